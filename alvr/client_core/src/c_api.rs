@@ -19,7 +19,8 @@ use alvr_graphics::{
 };
 use alvr_packets::{ButtonEntry, ButtonValue, FaceData, TrackingData};
 use alvr_session::{
-    CodecType, FoveatedEncodingConfig, MediacodecPropType, MediacodecProperty, UpscalingConfig,
+    CodecType, FoveatedEncodingConfig, FoveationShape, MediacodecPropType, MediacodecProperty,
+    UpscalingConfig, settings_schema::Switch,
 };
 use std::{
     cell::RefCell,
@@ -605,6 +606,10 @@ pub struct AlvrStreamConfig {
     foveation_center_shift_y: f32,
     foveation_edge_ratio_x: f32,
     foveation_edge_ratio_y: f32,
+    // Radial compression instead of the axis aligned one, with its own radius and edge ratio
+    foveation_radial: bool,
+    foveation_center_radius: f32,
+    foveation_radial_edge_ratio: f32,
     enable_upscaling: bool,
     upscaling_edge_direction: bool,
     upscaling_edge_threshold: f32,
@@ -690,6 +695,18 @@ pub extern "C" fn alvr_start_stream_opengl(config: AlvrStreamConfig) {
         center_shift_y: config.foveation_center_shift_y,
         edge_ratio_x: config.foveation_edge_ratio_x,
         edge_ratio_y: config.foveation_edge_ratio_y,
+        shape: if config.foveation_radial {
+            FoveationShape::Radial {
+                center_radius: config.foveation_center_radius,
+                edge_ratio: config.foveation_radial_edge_ratio,
+            }
+        } else {
+            FoveationShape::AxisAligned
+        },
+        follow_eye_gaze: false,
+        compress_periphery: true,
+        periphery_qp_offset: Switch::Disabled,
+        periphery_target_qp: Switch::Disabled,
     });
     let upscaling = config.enable_upscaling.then_some(UpscalingConfig {
         edge_direction: config.upscaling_edge_direction,
@@ -768,6 +785,10 @@ pub extern "C" fn alvr_render_stream_opengl(
         if let Some(renderer) = renderer {
             let left_params = unsafe { &*view_params };
             let right_params = unsafe { &*view_params.offset(1) };
+            let foveation_center_shift = CLIENT_CORE_CONTEXT
+                .lock()
+                .as_ref()
+                .and_then(|context| context.foveation_center_shift());
             renderer.render(
                 hardware_buffer,
                 [
@@ -786,6 +807,7 @@ pub extern "C" fn alvr_render_stream_opengl(
                             },
                             fov: alvr_common::from_capi_fov(&left_params.fov),
                         },
+                        foveation_center_shift: foveation_center_shift.map(|s| s[0]),
                     },
                     StreamViewParams {
                         swapchain_index: right_params.swapchain_index,
@@ -802,6 +824,7 @@ pub extern "C" fn alvr_render_stream_opengl(
                             },
                             fov: alvr_common::from_capi_fov(&right_params.fov),
                         },
+                        foveation_center_shift: foveation_center_shift.map(|s| s[1]),
                     },
                 ],
                 None,
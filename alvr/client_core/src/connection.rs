@@ -1,7 +1,7 @@
 #![allow(clippy::if_same_then_else)]
 
 use crate::{
-    ClientCapabilities, ClientCoreEvent,
+    ClientCapabilities, ClientCoreEvent, DepthPlane,
     logging_backend::{LOG_CHANNEL_SENDER, LogMirrorData},
     sockets::AnnouncerSocket,
     statistics::StatisticsManager,
@@ -9,14 +9,18 @@ use crate::{
 };
 use alvr_common::{
     ALVR_VERSION, AnyhowToCon, ConResult, ConnectionError, ConnectionState, LifecycleState,
-    ViewParams, dbg_connection, debug, error, info,
+    ViewParams, dbg_connection, debug, error,
+    glam::Vec2,
+    info,
     parking_lot::{Condvar, Mutex, RwLock},
     wait_rwlock, warn,
 };
 use alvr_packets::{
-    AUDIO, ClientConnectionResult, ClientControlPacket, ClientStatistics, ConnectionAcceptedInfo,
-    HAPTICS, Haptics, STATISTICS, ServerControlPacket, StreamConfigPacket, TRACKING, TrackingData,
-    VIDEO, VideoPacketHeader, VideoStreamingCapabilities, VideoStreamingCapabilitiesExt,
+    AUDIO, ClientConnectionResult, ClientControlPacket, ClientControlPacketExt, ClientStatistics,
+    ConnectionAcceptedInfo, DEPTH, DepthPlaneHeader, HAPTICS, Haptics,
+    NegotiatedStreamingConfigExt, STATISTICS, ServerControlPacket, StreamConfigPacket, TRACKING,
+    TrackingData, VIDEO, VideoPacketHeader, VideoStreamingCapabilities,
+    VideoStreamingCapabilitiesExt, read_foveation_center_shift,
 };
 use alvr_session::{SocketProtocol, settings_schema::Switch};
 use alvr_sockets::{
@@ -64,8 +68,12 @@ pub struct ConnectionContext {
     pub statistics_sender: Mutex<Option<StreamSender<ClientStatistics>>>,
     pub statistics_manager: Mutex<Option<StatisticsManager>>,
     pub decoder_callback: Mutex<Option<Box<DecoderCallback>>>,
-    pub global_view_params_queue: Mutex<VecDeque<(Duration, [ViewParams; 2])>>,
+    // Also holds the foveation center shift each frame was encoded with, None if the server
+    // doesn't send it
+    pub global_view_params_queue: Mutex<VecDeque<(Duration, [ViewParams; 2], Option<[Vec2; 2]>)>>,
     pub max_prediction: RwLock<Duration>,
+    // Of the last frames, sent a few frames after their video
+    pub depth_planes: Mutex<VecDeque<(Duration, Arc<DepthPlane>)>>,
 }
 
 fn set_hud_message(event_queue: &Mutex<VecDeque<ClientCoreEvent>>, message: &str) {
@@ -81,6 +89,28 @@ fn set_hud_message(event_queue: &Mutex<VecDeque<ClientCoreEvent>>, message: &str
         .push_back(ClientCoreEvent::UpdateHudMessage(message));
 }
 
+// The server predicts from the last received frame if it can, otherwise it repairs the stream.
+// Servers that negotiated neither get an IDR request instead.
+fn report_lost_frames(
+    ctx: &ConnectionContext,
+    negotiated: &NegotiatedStreamingConfigExt,
+    last_received_timestamp: Option<Duration>,
+) {
+    if let Some(sender) = &mut *ctx.control_sender.lock() {
+        let packet = match last_received_timestamp {
+            Some(last_received_timestamp) if negotiated.lost_frame_reports => {
+                ClientControlPacketExt::ReportLostFrames {
+                    last_received_timestamp,
+                }
+                .to_packet()
+            }
+            _ if negotiated.stream_recovery => ClientControlPacketExt::RequestRecovery.to_packet(),
+            _ => ClientControlPacket::RequestIdr,
+        };
+        sender.send(&packet).ok();
+    }
+}
+
 fn is_streaming(ctx: &ConnectionContext) -> bool {
     *ctx.state.read() == ConnectionState::Streaming
 }
@@ -182,7 +212,9 @@ fn connection_pipeline(
                         prefer_hdr: capabilities.prefer_hdr,
                         ext_str: String::new(),
                     }
-                    .with_ext(VideoStreamingCapabilitiesExt {}),
+                    .with_ext(VideoStreamingCapabilitiesExt {
+                        foveation_center_shift: true,
+                    }),
                 ),
             },
         )))
@@ -197,6 +229,8 @@ fn connection_pipeline(
 
     let settings = stream_config.settings;
     let negotiated_config = stream_config.negotiated_config;
+    // Old servers negotiated no extension
+    let negotiated_ext = Arc::new(negotiated_config.ext().unwrap_or_default());
 
     *ctx.max_prediction.write() = Duration::from_millis(settings.headset.max_prediction_ms);
 
@@ -269,33 +303,46 @@ fn connection_pipeline(
     let tracking_sender = stream_socket.request_stream(TRACKING);
     let mut haptics_receiver =
         stream_socket.subscribe_to_stream::<Haptics>(HAPTICS, MAX_UNREAD_PACKETS);
+    let mut depth_receiver =
+        stream_socket.subscribe_to_stream::<DepthPlaneHeader>(DEPTH, MAX_UNREAD_PACKETS);
     let statistics_sender = stream_socket.request_stream(STATISTICS);
 
     let video_receive_thread = thread::spawn({
         let ctx = Arc::clone(&ctx);
+        let negotiated_ext = Arc::clone(&negotiated_ext);
         move || {
             let mut stream_corrupted = true;
+            // Newest frame decoded since the last IDR or recovery frame without any loss before it
+            let mut last_received_timestamp = None;
             while is_streaming(&ctx) {
                 let data = match video_receiver.recv(STREAMING_RECV_TIMEOUT) {
                     Ok(data) => data,
                     Err(ConnectionError::TryAgain(_)) => continue,
                     Err(ConnectionError::Other(_)) => return,
                 };
-                let Ok((header, nal)) = data.get() else {
+                let Ok((header, mut nal)) = data.get() else {
                     return;
                 };
+                let mut foveation_center_shift = None;
+                if negotiated_ext.foveation_center_shift {
+                    let Some((center_shift, frame_nal)) = read_foveation_center_shift(nal) else {
+                        return;
+                    };
+                    foveation_center_shift = Some(center_shift);
+                    nal = frame_nal;
+                }
 
                 if let Some(stats) = &mut *ctx.statistics_manager.lock() {
                     stats.report_video_packet_received(header.timestamp);
                 }
 
+                // Also set on the recovery frame of a lost frames report
                 if header.is_idr {
                     stream_corrupted = false;
+                    last_received_timestamp = None;
                 } else if data.had_packet_loss() {
                     stream_corrupted = true;
-                    if let Some(sender) = &mut *ctx.control_sender.lock() {
-                        sender.send(&ClientControlPacket::RequestIdr).ok();
-                    }
+                    report_lost_frames(&ctx, &negotiated_ext, last_received_timestamp);
                     warn!("Network dropped video packet");
                 }
 
@@ -306,8 +353,11 @@ fn connection_pipeline(
                         let global_view_params_queue_lock =
                             &mut ctx.global_view_params_queue.lock();
 
-                        global_view_params_queue_lock
-                            .push_back((header.timestamp, header.global_view_params));
+                        global_view_params_queue_lock.push_back((
+                            header.timestamp,
+                            header.global_view_params,
+                            foveation_center_shift,
+                        ));
 
                         while global_view_params_queue_lock.len() > 128 {
                             global_view_params_queue_lock.pop_front();
@@ -322,10 +372,10 @@ fn connection_pipeline(
 
                     if !submitted {
                         stream_corrupted = true;
-                        if let Some(sender) = &mut *ctx.control_sender.lock() {
-                            sender.send(&ClientControlPacket::RequestIdr).ok();
-                        }
+                        report_lost_frames(&ctx, &negotiated_ext, last_received_timestamp);
                         warn!("Dropped video packet. Reason: Decoder saturation")
+                    } else if !stream_corrupted {
+                        last_received_timestamp = Some(header.timestamp);
                     }
                 } else {
                     if let Some(sender) = &mut *ctx.control_sender.lock() {
@@ -413,6 +463,41 @@ fn connection_pipeline(
         }
     });
 
+    let depth_receive_thread = thread::spawn({
+        let ctx = Arc::clone(&ctx);
+        move || {
+            while is_streaming(&ctx) {
+                let data = match depth_receiver.recv(STREAMING_RECV_TIMEOUT) {
+                    Ok(packet) => packet,
+                    Err(ConnectionError::TryAgain(_)) => continue,
+                    Err(ConnectionError::Other(_)) => return,
+                };
+                let Ok((header, payload)) = data.get() else {
+                    return;
+                };
+                if payload.len() != (header.width * header.height) as usize * 2 {
+                    continue;
+                }
+
+                let depth_plane = DepthPlane {
+                    width: header.width,
+                    height: header.height,
+                    projections: header.projections,
+                    depth: payload
+                        .chunks_exact(2)
+                        .map(|value| u16::from_le_bytes([value[0], value[1]]))
+                        .collect(),
+                };
+
+                let depth_planes_lock = &mut *ctx.depth_planes.lock();
+                depth_planes_lock.push_back((header.timestamp, Arc::new(depth_plane)));
+                while depth_planes_lock.len() > 8 {
+                    depth_planes_lock.pop_front();
+                }
+            }
+        }
+    });
+
     let (log_channel_sender, log_channel_receiver) = mpsc::channel();
 
     let control_send_thread = thread::spawn({
@@ -579,6 +664,7 @@ fn connection_pipeline(
     game_audio_thread.join().ok();
     microphone_thread.join().ok();
     haptics_receive_thread.join().ok();
+    depth_receive_thread.join().ok();
     control_send_thread.join().ok();
     control_receive_thread.join().ok();
     stream_receive_thread.join().ok();
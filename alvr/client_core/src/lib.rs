@@ -57,6 +57,16 @@ pub enum ClientCoreEvent {
     RealTimeConfig(RealTimeConfig),
 }
 
+// Low resolution depth of a frame, the views side by side. Each value is the nearest depth of its
+// block of the game depth buffer, in unorm16. The row-major projections the game rendered the views
+// with give the view space depth.
+pub struct DepthPlane {
+    pub width: u32,
+    pub height: u32,
+    pub projections: [[f32; 16]; 2],
+    pub depth: Vec<u16>,
+}
+
 // Note: this struct may change without breaking network protocol changes
 #[derive(Clone)]
 pub struct ClientCapabilities {
@@ -80,6 +90,7 @@ pub struct ClientCoreContext {
     connection_context: Arc<ConnectionContext>,
     connection_thread: Arc<Mutex<Option<JoinHandle<()>>>>,
     last_good_global_view_params: Mutex<[ViewParams; 2]>,
+    last_good_foveation_center_shift: Mutex<Option<[Vec2; 2]>>,
 }
 
 impl ClientCoreContext {
@@ -125,6 +136,7 @@ impl ClientCoreContext {
             connection_context,
             connection_thread: Arc::new(Mutex::new(Some(connection_thread))),
             last_good_global_view_params: Mutex::new([ViewParams::DUMMY; 2]),
+            last_good_foveation_center_shift: Mutex::new(None),
         }
     }
 
@@ -283,9 +295,11 @@ impl ClientCoreContext {
         }
 
         let global_view_params_lock = &mut *self.last_good_global_view_params.lock();
-        for (ts, params) in &*self.connection_context.global_view_params_queue.lock() {
+        for (ts, params, center_shift) in &*self.connection_context.global_view_params_queue.lock()
+        {
             if *ts == timestamp {
                 *global_view_params_lock = *params;
+                *self.last_good_foveation_center_shift.lock() = *center_shift;
                 break;
             }
         }
@@ -293,6 +307,27 @@ impl ClientCoreContext {
         *global_view_params_lock
     }
 
+    /// Foveation center shift of the frame last passed to report_compositor_start, mirrored
+    /// horizontally for the right view. None before the first frame, or if the server doesn't send
+    /// it and the frames use the static center shift.
+    pub fn foveation_center_shift(&self) -> Option<[Vec2; 2]> {
+        *self.last_good_foveation_center_shift.lock()
+    }
+
+    /// Depth plane of the frame with this timestamp, or of the latest frame before it since the
+    /// depth arrives after the video. None if the server doesn't send depth for this game.
+    pub fn get_depth_plane(&self, timestamp: Duration) -> Option<Arc<DepthPlane>> {
+        dbg_client_core!("get_depth_plane");
+
+        self.connection_context
+            .depth_planes
+            .lock()
+            .iter()
+            .rev()
+            .find(|(ts, _)| *ts <= timestamp)
+            .map(|(_, depth_plane)| Arc::clone(depth_plane))
+    }
+
     pub fn report_submit(&self, timestamp: Duration, vsync_queue: Duration) {
         dbg_client_core!("report_submit");
 
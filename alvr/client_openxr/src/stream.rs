@@ -13,6 +13,7 @@ use alvr_common::{
     error,
     glam::{UVec2, Vec2},
     parking_lot::RwLock,
+    warn,
 };
 use alvr_graphics::{GraphicsContext, StreamRenderer, StreamViewParams};
 use alvr_packets::{ClientStreamConfig, RealTimeConfig, TrackingData};
@@ -335,6 +336,21 @@ impl StreamContext {
     pub fn update_real_time_config(&mut self, config: &RealTimeConfig) {
         self.config.passthrough = config.passthrough.clone();
         self.config.clientside_post_processing = config.clientside_post_processing.clone();
+
+        // The input thread keeps polling at the rate of the stream start
+        if let Some(refresh_rate) = config.ext().ok().and_then(|ext| ext.refresh_rate)
+            && self
+                .xr_session
+                .instance()
+                .exts()
+                .fb_display_refresh_rate
+                .is_some()
+        {
+            if let Err(error) = self.xr_session.request_display_refresh_rate(refresh_rate) {
+                warn!("Failed to switch to {refresh_rate}Hz: {error}");
+            }
+            self.config.refresh_rate_hint = refresh_rate;
+        }
     }
 
     pub fn render(
@@ -420,6 +436,8 @@ impl StreamContext {
             openxr_display_time = vsync_time;
         }
 
+        let foveation_center_shift = self.core_context.foveation_center_shift();
+
         self.renderer.render(
             buffer_ptr,
             [
@@ -427,11 +445,13 @@ impl StreamContext {
                     swapchain_index: left_swapchain_idx,
                     input_view_params: input_view_params[0],
                     output_view_params: output_view_params[0],
+                    foveation_center_shift: foveation_center_shift.map(|s| s[0]),
                 },
                 StreamViewParams {
                     swapchain_index: right_swapchain_idx,
                     input_view_params: input_view_params[1],
                     output_view_params: output_view_params[1],
+                    foveation_center_shift: foveation_center_shift.map(|s| s[1]),
                 },
             ],
             self.config.passthrough.as_ref(),
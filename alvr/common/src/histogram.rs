@@ -0,0 +1,108 @@
+use std::time::Duration;
+
+// Values are counted in microseconds, exactly below 2^SUB_BUCKET_BITS and in 2^SUB_BUCKET_BITS
+// linear buckets per power of two above, which keeps the error of the percentiles under 1/32.
+const SUB_BUCKET_BITS: u32 = 5;
+const SUB_BUCKETS: usize = 1 << SUB_BUCKET_BITS;
+// Powers of two above the exact range, values past around 33 seconds are clamped
+const MAGNITUDES: usize = 20;
+const BUCKETS: usize = SUB_BUCKETS * (MAGNITUDES + 1);
+
+// Log-linear histogram of durations in the way of HdrHistogram, with a constant relative error.
+// Recording is constant time, so it can take every frame.
+#[derive(Clone)]
+pub struct LatencyHistogram {
+    counts: Vec<u32>,
+    total: u64,
+    max_us: u64,
+}
+
+impl Default for LatencyHistogram {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+impl LatencyHistogram {
+    pub fn new() -> Self {
+        Self {
+            counts: vec![0; BUCKETS],
+            total: 0,
+            max_us: 0,
+        }
+    }
+
+    fn bucket_of(value_us: u64) -> usize {
+        if value_us < SUB_BUCKETS as u64 {
+            return value_us as usize;
+        }
+        let magnitude = (63 - value_us.leading_zeros() - SUB_BUCKET_BITS) as usize;
+        if magnitude >= MAGNITUDES {
+            return BUCKETS - 1;
+        }
+        let sub_bucket = (value_us >> magnitude) as usize - SUB_BUCKETS;
+
+        SUB_BUCKETS * (magnitude + 1) + sub_bucket
+    }
+
+    // Largest value counted in the bucket
+    fn bucket_high_us(bucket: usize) -> u64 {
+        if bucket < SUB_BUCKETS {
+            return bucket as u64;
+        }
+        let magnitude = bucket / SUB_BUCKETS - 1;
+        let sub_bucket = (bucket % SUB_BUCKETS + SUB_BUCKETS) as u64;
+
+        ((sub_bucket + 1) << magnitude) - 1
+    }
+
+    pub fn record(&mut self, value: Duration) {
+        let value_us = value.as_micros() as u64;
+        self.counts[Self::bucket_of(value_us)] += 1;
+        self.total += 1;
+        self.max_us = u64::max(self.max_us, value_us);
+    }
+
+    pub fn add(&mut self, other: &LatencyHistogram) {
+        for (count, other_count) in self.counts.iter_mut().zip(&other.counts) {
+            *count += other_count;
+        }
+        self.total += other.total;
+        self.max_us = u64::max(self.max_us, other.max_us);
+    }
+
+    pub fn clear(&mut self) {
+        self.counts.fill(0);
+        self.total = 0;
+        self.max_us = 0;
+    }
+
+    pub fn count(&self) -> u64 {
+        self.total
+    }
+
+    pub fn max(&self) -> Duration {
+        Duration::from_micros(self.max_us)
+    }
+
+    // Value that quantile of the recorded values are at or below, from 0 to 1. Zero if empty.
+    pub fn value_at_quantile(&self, quantile: f64) -> Duration {
+        if self.total == 0 {
+            return Duration::ZERO;
+        }
+        let rank = u64::max(
+            (quantile.clamp(0.0, 1.0) * self.total as f64).ceil() as u64,
+            1,
+        );
+
+        let mut cumulative = 0;
+        for (bucket, count) in self.counts.iter().enumerate() {
+            cumulative += *count as u64;
+            if cumulative >= rank {
+                return Duration::from_micros(u64::min(Self::bucket_high_us(bucket), self.max_us));
+            }
+        }
+
+        self.max()
+    }
+}
@@ -9,7 +9,7 @@ pub fn debug_tab_ui(ui: &mut Ui) -> Option<ServerRequest> {
 For that, use other means of recording, for example through headset or desktop VR output.",
     );
 
-    ui.columns(4, |ui| {
+    ui.columns(5, |ui| {
         if ui[0].button("Capture frame").clicked() {
             request = Some(ServerRequest::CaptureFrame);
         }
@@ -25,6 +25,10 @@ For that, use other means of recording, for example through headset or desktop V
         if ui[3].button("Stop recording").clicked() {
             request = Some(ServerRequest::StopRecording);
         }
+
+        if ui[4].button("Log GPU memory").clicked() {
+            request = Some(ServerRequest::LogGpuMemory);
+        }
     });
 
     request
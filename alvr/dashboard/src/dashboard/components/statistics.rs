@@ -454,6 +454,75 @@ impl StatisticsTab {
             ui[0].label("Encoder latency:");
             ui[1].label(format!("{:.2} ms", statistics.encode_latency_ms));
 
+            for (name, ms) in &statistics.compose_stages_ms {
+                ui[0].label(format!("Compositor {name}:"));
+                ui[1].label(format!("{ms:.2} ms"));
+            }
+
+            for (name, latency) in &statistics.frame_latencies_ms {
+                ui[0].label(format!("{name} (p50/p99/p99.9/max):"));
+                ui[1].label(format!(
+                    "{:.2} / {:.2} / {:.2} / {:.2} ms",
+                    latency.p50, latency.p99, latency.p99_9, latency.max
+                ));
+            }
+
+            let encoded = &statistics.encoded_frames;
+            ui[0].label("Encoded frames (intra/inter):");
+            ui[1].label(format!(
+                "{} / {} ({:.1} / {:.1} kB)",
+                encoded.intra_frames,
+                encoded.inter_frames,
+                encoded.average_intra_kbytes,
+                encoded.average_inter_kbytes
+            ));
+
+            ui[0].label("IDR frames (requested/issued):");
+            ui[1].label(format!(
+                "{} / {}",
+                encoded.idr_requests, encoded.issued_idrs
+            ));
+
+            if let Some(qp) = encoded.average_qp {
+                ui[0].label("Encoder QP:");
+                ui[1].label(format!("{qp:.1}"));
+            }
+
+            if let Some(ms) = encoded.average_encode_ms {
+                ui[0].label("Encoder frame time:");
+                ui[1].label(format!("{ms:.2} ms"));
+            }
+
+            let pacing = &statistics.present_pacing;
+            ui[0].label("Presents (dropped/duplicate/late):");
+            ui[1].label(format!(
+                "{} ({} / {} / {})",
+                pacing.arrivals, pacing.dropped, pacing.duplicates, pacing.late
+            ));
+
+            ui[0].label("Present interval (p50/p99/max):");
+            ui[1].label(format!(
+                "{:.2} / {:.2} / {:.2} vsyncs",
+                pacing.interval_p50, pacing.interval_p99, pacing.interval_max
+            ));
+
+            if let Some(ms) = pacing.compositor_gpu_ms {
+                ui[0].label("SteamVR compositor GPU time (over a vsync):");
+                ui[1].label(format!("{ms:.2} ms ({})", pacing.compositor_gpu_bound));
+            }
+
+            for (name, lock) in &statistics.lock_waits {
+                ui[0].label(format!("{name} lock (contended, p50/p99/max):"));
+                ui[1].label(format!(
+                    "{} / {} ({:.3} / {:.3} / {:.3} ms)",
+                    lock.contended,
+                    lock.acquisitions,
+                    lock.wait_p50_ms,
+                    lock.wait_p99_ms,
+                    lock.wait_max_ms
+                ));
+            }
+
             ui[0].label("Transport latency:");
             ui[1].label(format!("{:.2} ms", statistics.network_latency_ms));
 
@@ -466,6 +535,14 @@ impl StatisticsTab {
             ui[0].label("Streamer FPS:");
             ui[1].label(format!("{} FPS", statistics.server_fps));
 
+            if let Some(power_w) = statistics.host_battery_power_w {
+                ui[0].label("Streamer battery draw:");
+                ui[1].label(match statistics.energy_per_frame_mj {
+                    Some(energy_mj) => format!("{power_w:.1} W ({energy_mj:.0} mJ/frame)"),
+                    None => format!("{power_w:.1} W"),
+                });
+            }
+
             ui[0].label("Headset battery");
             ui[1].label(format!(
                 "{}% ({})",
@@ -32,6 +32,7 @@ pub enum ServerRequest {
         action: ClientConnectionsAction,
     },
     CaptureFrame,
+    LogGpuMemory,
     InsertIdr,
     StartRecording,
     StopRecording,
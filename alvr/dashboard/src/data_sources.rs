@@ -303,6 +303,7 @@ impl DataSources {
                                     }
                                 }
                                 ServerRequest::CaptureFrame
+                                | ServerRequest::LogGpuMemory
                                 | ServerRequest::InsertIdr
                                 | ServerRequest::StartRecording
                                 | ServerRequest::StopRecording => {
@@ -364,6 +365,7 @@ impl DataSources {
                                     post_body(&rq, &base_uri, "drivers/unregister", Some(path))
                                 }
                                 ServerRequest::CaptureFrame => post("capture-frame"),
+                                ServerRequest::LogGpuMemory => post("log-gpu-memory"),
                                 ServerRequest::InsertIdr => post("insert-idr"),
                                 ServerRequest::StartRecording => post("recording/start"),
                                 ServerRequest::StopRecording => post("recording/stop"),
@@ -18,6 +18,87 @@ pub struct StatisticsSummary {
     pub server_fps: u32,
     pub battery_hmd: u32,
     pub hmd_plugged: bool,
+    // Average GPU time of each server compositor pass
+    #[serde(default)]
+    pub compose_stages_ms: Vec<(String, f32)>,
+    // Percentiles of the intervals of the server side timeline of the frames, over the last few
+    // seconds
+    #[serde(default)]
+    pub frame_latencies_ms: Vec<(String, LatencyPercentiles)>,
+    // As reported by the encoder, over the last report interval
+    #[serde(default)]
+    pub encoded_frames: EncodedFramesSummary,
+    // Presents of the game over the last report interval
+    #[serde(default)]
+    pub present_pacing: PresentPacingSummary,
+    // Locks of the frame path over the last report interval, empty unless the driver is built with
+    // the lock-stats feature
+    #[serde(default)]
+    pub lock_waits: Vec<(String, LockWaitSummary)>,
+    // Drawn from the batteries of the streamer at the end of the report interval, and the energy
+    // per encoded frame at that power. None unless the streamer runs on battery, on Linux.
+    #[serde(default)]
+    pub host_battery_power_w: Option<f32>,
+    #[serde(default)]
+    pub energy_per_frame_mj: Option<f32>,
+}
+
+#[derive(Serialize, Deserialize, Clone, Debug, Default)]
+pub struct LockWaitSummary {
+    pub acquisitions: u32,
+    // Not free at the first try
+    pub contended: u32,
+    // Of all the acquisitions, rounded up to a power of two of microseconds
+    pub wait_p50_ms: f32,
+    pub wait_p99_ms: f32,
+    pub wait_max_ms: f32,
+}
+
+#[derive(Serialize, Deserialize, Clone, Debug, Default)]
+pub struct PresentPacingSummary {
+    pub arrivals: u32,
+    // Overwritten before the encoder took them
+    pub dropped: u32,
+    // Encoded again without a new frame of the game
+    pub duplicates: u32,
+    // Missed the vsync they were meant for
+    pub late: u32,
+    // Of the interval between consecutive presents, in vsync periods
+    pub interval_p50: f32,
+    pub interval_p99: f32,
+    pub interval_max: f32,
+    // Average GPU time of the SteamVR compositor's presents, known on Linux only
+    #[serde(default)]
+    pub compositor_gpu_ms: Option<f32>,
+    // Presents of the SteamVR compositor that took the GPU longer than a vsync period
+    #[serde(default)]
+    pub compositor_gpu_bound: u32,
+}
+
+#[derive(Serialize, Deserialize, Clone, Debug, Default)]
+pub struct EncodedFramesSummary {
+    pub intra_frames: u32,
+    pub inter_frames: u32,
+    pub average_intra_kbytes: f32,
+    pub average_inter_kbytes: f32,
+    // Of the inter frames, on the scale of the codec. None if the encoder doesn't report it
+    pub average_qp: Option<f32>,
+    pub average_encode_ms: Option<f32>,
+    // IDR frames asked for by the client, the losses and the driver, and the ones encoded. Requests
+    // within the minimum IDR interval share one IDR frame.
+    #[serde(default)]
+    pub idr_requests: u32,
+    #[serde(default)]
+    pub issued_idrs: u32,
+}
+
+#[derive(Serialize, Deserialize, Clone, Debug, Default)]
+pub struct LatencyPercentiles {
+    pub p50: f32,
+    pub p90: f32,
+    pub p99: f32,
+    pub p99_9: f32,
+    pub max: f32,
 }
 
 // Bitrate statistics minus the empirical output value
@@ -18,26 +18,27 @@ override VIEW_HEIGHT_RATIO: f32 = 0.0;
 override EDGE_X_RATIO: f32 = 0.0;
 override EDGE_Y_RATIO: f32 = 0.0;
 
-override C1_X: f32 = 0.0;
-override C1_Y: f32 = 0.0;
 override C2_X: f32 = 0.0;
 override C2_Y: f32 = 0.0;
-override LO_BOUND_X: f32 = 0.0;
-override LO_BOUND_Y: f32 = 0.0;
-override HI_BOUND_X: f32 = 0.0;
-override HI_BOUND_Y: f32 = 0.0;
-
-override A_LEFT_X: f32 = 0.0;
-override A_LEFT_Y: f32 = 0.0;
-override B_LEFT_X: f32 = 0.0;
-override B_LEFT_Y: f32 = 0.0;
-
-override A_RIGHT_X: f32 = 0.0;
-override A_RIGHT_Y: f32 = 0.0;
-override B_RIGHT_X: f32 = 0.0;
-override B_RIGHT_Y: f32 = 0.0;
-override C_RIGHT_X: f32 = 0.0;
-override C_RIGHT_Y: f32 = 0.0;
+
+// Radial compression instead of the axis aligned one, see FoveationLayout
+override RADIAL_FFE: bool = false;
+override RADIAL_RADIUS: f32 = 0.0;
+override RADIAL_SCALE: f32 = 0.0;
+override RADIAL_CURVE: f32 = 0.0;
+
+// Terms depending on the foveation center, which can move every frame
+struct Foveation {
+    c1: vec2f,
+    lo_bound: vec2f,
+    hi_bound: vec2f,
+    a_left: vec2f,
+    b_left: vec2f,
+    a_right: vec2f,
+    b_right: vec2f,
+    c_right: vec2f,
+    radial_center: vec2f,
+}
 
 struct PushConstant {
     reprojection_transform: mat4x4f,
@@ -53,6 +54,7 @@ var<push_constant> pc: PushConstant;
 
 @group(0) @binding(0) var stream_texture: texture_2d<f32>;
 @group(0) @binding(1) var stream_sampler: sampler;
+@group(0) @binding(2) var<uniform> foveation: Foveation;
 
 struct VertexOutput {
     @builtin(position) position: vec4f,
@@ -74,21 +76,51 @@ fn fragment_main(@location(0) uv: vec2f) -> @location(0) vec4f {
     var corrected_uv = uv;
     // tell upscaler to target a lower resolution for the edges
     var upscale_source_resolution = 1.0;
-    if ENABLE_FFE {
+    if ENABLE_FFE && RADIAL_FFE {
+        if pc.view_idx == 1 {
+            corrected_uv.x = 1.0 - corrected_uv.x;
+        }
+
+        // Normalized to 1 at the edges on each side of the center, in the view and in the
+        // compressed view
+        let center = foveation.radial_center;
+        let extent = select(1.0 - center, center, corrected_uv < center);
+        let position = (corrected_uv - center) / extent;
+
+        // Inverse of r = scale * r' + curve * (r' - radius / scale)^2 beyond the center disk
+        let center_distance = length(position);
+        var compressed_distance = center_distance / RADIAL_SCALE;
+        if center_distance > RADIAL_RADIUS && RADIAL_CURVE > 0.0 {
+            let discriminant = RADIAL_SCALE * RADIAL_SCALE
+                + 4.0 * RADIAL_CURVE * (center_distance - RADIAL_RADIUS);
+            let beyond = (-RADIAL_SCALE + sqrt(discriminant)) / (2.0 * RADIAL_CURVE);
+            compressed_distance = RADIAL_RADIUS / RADIAL_SCALE + beyond;
+            // Pixels of the view per pixel of the stream along the radius
+            upscale_source_resolution = 1.0 + 2.0 * RADIAL_CURVE * beyond / RADIAL_SCALE;
+        }
+        let compressed_position = position * compressed_distance / max(center_distance, 1e-6);
+        corrected_uv = center + compressed_position * extent;
+
+        corrected_uv = corrected_uv * vec2f(VIEW_WIDTH_RATIO, VIEW_HEIGHT_RATIO);
+
+        if pc.view_idx == 1 {
+            corrected_uv.x = 1.0 - corrected_uv.x;
+        }
+    } else if ENABLE_FFE {
         let view_size_ratio = vec2f(VIEW_WIDTH_RATIO, VIEW_HEIGHT_RATIO);
         let edge_ratio = vec2f(EDGE_X_RATIO, EDGE_Y_RATIO);
 
-        let c1 = vec2f(C1_X, C1_Y);
+        let c1 = foveation.c1;
         let c2 = vec2f(C2_X, C2_Y);
-        let lo_bound = vec2f(LO_BOUND_X, LO_BOUND_Y);
-        let hi_bound = vec2f(HI_BOUND_X, HI_BOUND_Y);
+        let lo_bound = foveation.lo_bound;
+        let hi_bound = foveation.hi_bound;
 
-        let a_left = vec2f(A_LEFT_X, A_LEFT_Y);
-        let b_left = vec2f(B_LEFT_X, B_LEFT_Y);
+        let a_left = foveation.a_left;
+        let b_left = foveation.b_left;
 
-        let a_right = vec2f(A_RIGHT_X, A_RIGHT_Y);
-        let b_right = vec2f(B_RIGHT_X, B_RIGHT_Y);
-        let c_right = vec2f(C_RIGHT_X, C_RIGHT_Y);
+        let a_right = foveation.a_right;
+        let b_right = foveation.b_right;
+        let c_right = foveation.c_right;
 
         if pc.view_idx == 1 {
             corrected_uv.x = 1.0 - corrected_uv.x;
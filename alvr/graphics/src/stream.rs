@@ -1,18 +1,19 @@
 use super::{GraphicsContext, MAX_PUSH_CONSTANTS_SIZE, staging::StagingRenderer};
 use alvr_common::{
     ViewParams,
-    glam::{self, Mat4, UVec2, Vec3, Vec4},
+    glam::{self, Mat4, UVec2, Vec2, Vec3, Vec4},
 };
-use alvr_session::{FoveatedEncodingConfig, PassthroughMode, UpscalingConfig};
+use alvr_session::{FoveatedEncodingConfig, FoveationShape, PassthroughMode, UpscalingConfig};
 use std::{ffi::c_void, iter, mem, rc::Rc};
 use wgpu::{
     BindGroup, BindGroupDescriptor, BindGroupEntry, BindGroupLayoutDescriptor,
-    BindGroupLayoutEntry, BindingResource, BindingType, Color, ColorTargetState, ColorWrites,
-    FragmentState, LoadOp, PipelineCompilationOptions, PipelineLayoutDescriptor, PrimitiveState,
-    PrimitiveTopology, PushConstantRange, RenderPass, RenderPassColorAttachment,
-    RenderPassDescriptor, RenderPipeline, RenderPipelineDescriptor, SamplerBindingType,
-    SamplerDescriptor, ShaderStages, StoreOp, TextureSampleType, TextureView,
-    TextureViewDescriptor, TextureViewDimension, VertexState, include_wgsl,
+    BindGroupLayoutEntry, BindingResource, BindingType, Buffer, BufferBindingType,
+    BufferDescriptor, BufferUsages, Color, ColorTargetState, ColorWrites, FragmentState, LoadOp,
+    PipelineCompilationOptions, PipelineLayoutDescriptor, PrimitiveState, PrimitiveTopology,
+    PushConstantRange, RenderPass, RenderPassColorAttachment, RenderPassDescriptor, RenderPipeline,
+    RenderPipelineDescriptor, SamplerBindingType, SamplerDescriptor, ShaderStages, StoreOp,
+    TextureSampleType, TextureView, TextureViewDescriptor, TextureViewDimension, VertexState,
+    include_wgsl,
 };
 
 const FLOAT_SIZE: u32 = mem::size_of::<f32>() as u32;
@@ -34,15 +35,22 @@ const _: () = assert!(
     "Push constants size exceeds the maximum size"
 );
 
+// The push constants are full, the center dependent foveation terms go in a uniform buffer
+const FOVEATION_UNIFORMS_SIZE: u64 = 9 * mem::size_of::<Vec2>() as u64;
+
 pub struct StreamViewParams {
     pub swapchain_index: u32,
     pub input_view_params: ViewParams,
     pub output_view_params: ViewParams,
+    // Foveation center the frame was encoded with, mirrored horizontally for the right view. None
+    // uses the configured static shift.
+    pub foveation_center_shift: Option<Vec2>,
 }
 
 #[derive(Debug)]
 struct ViewObjects {
     bind_group: BindGroup,
+    foveation_buffer: Buffer,
     render_target: Vec<TextureView>,
 }
 
@@ -50,6 +58,7 @@ pub struct StreamRenderer {
     context: Rc<GraphicsContext>,
     staging_renderer: StagingRenderer,
     pipeline: RenderPipeline,
+    foveation_layout: Option<FoveationLayout>,
     views_objects: [ViewObjects; 2],
 }
 
@@ -91,6 +100,16 @@ impl StreamRenderer {
                     ty: BindingType::Sampler(SamplerBindingType::Filtering),
                     count: None,
                 },
+                BindGroupLayoutEntry {
+                    binding: 2,
+                    visibility: ShaderStages::FRAGMENT,
+                    ty: BindingType::Buffer {
+                        ty: BufferBindingType::Uniform,
+                        has_dynamic_offset: false,
+                        min_binding_size: None,
+                    },
+                    count: None,
+                },
             ],
         });
 
@@ -103,15 +122,16 @@ impl StreamRenderer {
             ("ENCODING_GAMMA", encoding_gamma.into()),
         ]);
 
-        let staging_resolution = if let Some(foveated_encoding) = foveated_encoding {
-            let (staging_resolution, ffe_constants) =
-                foveated_encoding_shader_constants(base_view_resolution, foveated_encoding);
-            constants.extend(ffe_constants);
+        let (staging_resolution, foveation_layout) =
+            if let Some(foveated_encoding) = foveated_encoding {
+                let (staging_resolution, ffe_constants, layout) =
+                    foveated_encoding_shader_constants(base_view_resolution, foveated_encoding);
+                constants.extend(ffe_constants);
 
-            staging_resolution
-        } else {
-            base_view_resolution
-        };
+                (staging_resolution, Some(layout))
+            } else {
+                (base_view_resolution, None)
+            };
 
         if let Some(upscaling) = upscaling {
             constants.extend([
@@ -182,6 +202,14 @@ impl StreamRenderer {
         for target_swapchain in &swapchain_textures {
             let staging_texture = super::create_texture(device, staging_resolution, target_format);
 
+            // Created even without foveated encoding, the shader declares it unconditionally
+            let foveation_buffer = device.create_buffer(&BufferDescriptor {
+                label: None,
+                size: FOVEATION_UNIFORMS_SIZE,
+                usage: BufferUsages::UNIFORM | BufferUsages::COPY_DST,
+                mapped_at_creation: false,
+            });
+
             let bind_group = device.create_bind_group(&BindGroupDescriptor {
                 label: None,
                 layout: &bind_group_layout,
@@ -196,6 +224,10 @@ impl StreamRenderer {
                         binding: 1,
                         resource: BindingResource::Sampler(&sampler),
                     },
+                    BindGroupEntry {
+                        binding: 2,
+                        resource: foveation_buffer.as_entire_binding(),
+                    },
                 ],
             });
 
@@ -208,6 +240,7 @@ impl StreamRenderer {
 
             view_objects.push(ViewObjects {
                 bind_group,
+                foveation_buffer,
                 render_target,
             });
 
@@ -237,6 +270,7 @@ impl StreamRenderer {
             context,
             staging_renderer,
             pipeline,
+            foveation_layout,
             views_objects: view_objects.try_into().unwrap(),
         }
     }
@@ -260,6 +294,23 @@ impl StreamRenderer {
             .create_command_encoder(&Default::default());
 
         for (view_idx, view_params) in view_params.iter().enumerate() {
+            if let Some(layout) = &self.foveation_layout {
+                let center_shift = view_params
+                    .foveation_center_shift
+                    .unwrap_or(layout.static_center_shift);
+                let uniforms = layout
+                    .uniforms(center_shift)
+                    .iter()
+                    .flat_map(|v| v.to_array())
+                    .flat_map(|v| v.to_le_bytes())
+                    .collect::<Vec<u8>>();
+                self.context.queue.write_buffer(
+                    &self.views_objects[view_idx].foveation_buffer,
+                    0,
+                    &uniforms,
+                );
+            }
+
             let mut render_pass = encoder.begin_render_pass(&RenderPassDescriptor {
                 label: None,
                 color_attachments: &[Some(RenderPassColorAttachment {
@@ -437,12 +488,155 @@ fn set_passthrough_push_constants(render_pass: &mut RenderPass, config: Option<&
     }
 }
 
+// Center independent part of the foveated encoding layout of a stream
+#[derive(Clone, Copy, Debug)]
+pub struct FoveationLayout {
+    edge_ratio: Vec2,
+    edge_size_aligned: Vec2,
+    c0: Vec2,
+    c2: Vec2,
+    static_center_shift: Vec2,
+    // Radius of the radial compression, None for the axis aligned one
+    radial_radius: Option<f32>,
+}
+
+impl FoveationLayout {
+    // Center dependent terms of stream.wgsl, in the order of its Foveation struct
+    fn uniforms(&self, center_shift: Vec2) -> [Vec2; 9] {
+        let Self {
+            edge_ratio,
+            edge_size_aligned,
+            c0,
+            c2,
+            radial_radius,
+            ..
+        } = *self;
+
+        // Like the start of the axis aligned center region, the radial compression matches no
+        // pixel grid and the shift isn't snapped
+        if let Some(radius) = radial_radius {
+            let mut uniforms = [Vec2::ZERO; 9];
+            uniforms[8] = 0.5 + center_shift * (1. - radius) * 0.5;
+            return uniforms;
+        }
+
+        // Snapped to whole edge pixels, like the server does
+        let center_shift_aligned = (center_shift * edge_size_aligned / (edge_ratio * 2.)).ceil()
+            * (edge_ratio * 2.)
+            / edge_size_aligned;
+
+        let c1 = (edge_ratio - 1.) * c0 * (center_shift_aligned + 1.) / edge_ratio;
+
+        let lo_bound = c0 * (center_shift_aligned + 1.);
+        let hi_bound = c0 * (center_shift_aligned - 1.) + 1.;
+        let lo_bound_c = c0 * (center_shift_aligned + 1.) / c2;
+        let hi_bound_c = c0 * (center_shift_aligned - 1.) / c2 + 1.;
+
+        let a_left = c2 * (1. - edge_ratio) / (edge_ratio * lo_bound_c);
+        let b_left = (c1 + c2 * lo_bound_c) / lo_bound_c;
+
+        let a_right = c2 * (edge_ratio - 1.) / (edge_ratio * (1. - hi_bound_c));
+        let b_right = (c2 - edge_ratio * c1 - 2. * edge_ratio * c2
+            + c2 * edge_ratio * (1. - hi_bound_c)
+            + edge_ratio)
+            / (edge_ratio * (1. - hi_bound_c));
+        let c_right = (c2 * edge_ratio - c2) * (c1 - hi_bound_c + c2 * hi_bound_c)
+            / (edge_ratio * (1. - hi_bound_c) * (1. - hi_bound_c));
+
+        [
+            c1,
+            lo_bound,
+            hi_bound,
+            a_left,
+            b_left,
+            a_right,
+            b_right,
+            c_right,
+            Vec2::ZERO,
+        ]
+    }
+}
+
+// The radial compression of the server keeps a disk of the radius at full resolution and compresses
+// beyond it to reach the edge ratio at the edges of the view, a distance r' of the compressed view
+// being at r = scale * r' + curve * (r' - radius / scale)^2 of the view. Returns scale and curve.
+fn radial_foveation(radius: f32, edge_ratio: f32) -> (f32, f32) {
+    let radius = radius.clamp(0., 1.);
+    let edge_ratio = edge_ratio.max(1.);
+
+    let scale = (2. + (edge_ratio - 1.) * radius) / (edge_ratio + 1.);
+    let compressed_radius = radius / scale;
+    let curve = if compressed_radius < 1. {
+        (1. - scale) / ((1. - compressed_radius) * (1. - compressed_radius))
+    } else {
+        0.
+    };
+
+    (scale, curve)
+}
+
+fn radial_foveated_encoding_shader_constants(
+    view_resolution: Vec2,
+    config: FoveatedEncodingConfig,
+    radius: f32,
+    edge_ratio: f32,
+) -> (UVec2, Vec<(&'static str, f64)>, FoveationLayout) {
+    let radius = radius.clamp(0., 1.);
+    let (scale, curve) = radial_foveation(radius, edge_ratio);
+
+    let optimized_view_resolution = scale * view_resolution;
+    let optimized_view_resolution_aligned =
+        optimized_view_resolution.map(|v| (v / 32.).ceil() * 32.);
+    let view_ratio_aligned = optimized_view_resolution / optimized_view_resolution_aligned;
+
+    let constants = [
+        ("ENABLE_FFE", 1.),
+        ("RADIAL_FFE", 1.),
+        ("VIEW_WIDTH_RATIO", view_ratio_aligned.x),
+        ("VIEW_HEIGHT_RATIO", view_ratio_aligned.y),
+        ("RADIAL_RADIUS", radius),
+        ("RADIAL_SCALE", scale),
+        ("RADIAL_CURVE", curve),
+    ]
+    .iter()
+    .map(|(k, v)| (*k, *v as f64))
+    .collect();
+
+    let layout = FoveationLayout {
+        edge_ratio: Vec2::ONE,
+        edge_size_aligned: Vec2::ZERO,
+        c0: Vec2::ZERO,
+        c2: Vec2::ONE,
+        static_center_shift: glam::vec2(config.center_shift_x, config.center_shift_y),
+        radial_radius: Some(radius),
+    };
+
+    (
+        optimized_view_resolution_aligned.as_uvec2(),
+        constants,
+        layout,
+    )
+}
+
 pub fn foveated_encoding_shader_constants(
     expanded_view_resolution: UVec2,
     config: FoveatedEncodingConfig,
-) -> (UVec2, Vec<(&'static str, f64)>) {
+) -> (UVec2, Vec<(&'static str, f64)>, FoveationLayout) {
     let view_resolution = expanded_view_resolution.as_vec2();
 
+    if let FoveationShape::Radial {
+        center_radius,
+        edge_ratio,
+    } = config.shape
+    {
+        return radial_foveated_encoding_shader_constants(
+            view_resolution,
+            config,
+            center_radius,
+            edge_ratio,
+        );
+    }
+
     let center_size = glam::vec2(config.center_size_x, config.center_size_y);
     let center_shift = glam::vec2(config.center_shift_x, config.center_shift_y);
     let edge_ratio = glam::vec2(config.edge_ratio_x, config.edge_ratio_y);
@@ -452,9 +646,6 @@ pub fn foveated_encoding_shader_constants(
         1. - (edge_size / (edge_ratio * 2.)).ceil() * (edge_ratio * 2.) / view_resolution;
 
     let edge_size_aligned = view_resolution - center_size_aligned * view_resolution;
-    let center_shift_aligned = (center_shift * edge_size_aligned / (edge_ratio * 2.)).ceil()
-        * (edge_ratio * 2.)
-        / edge_size_aligned;
 
     let foveation_scale = center_size_aligned + (1. - center_size_aligned) / edge_ratio;
 
@@ -466,55 +657,35 @@ pub fn foveated_encoding_shader_constants(
     let view_ratio_aligned = optimized_view_resolution / optimized_view_resolution_aligned;
 
     let c0 = (1. - center_size_aligned) * 0.5;
-    let c1 = (edge_ratio - 1.) * c0 * (center_shift_aligned + 1.) / edge_ratio;
     let c2 = (edge_ratio - 1.) * center_size_aligned + 1.;
 
-    let lo_bound = c0 * (center_shift_aligned + 1.);
-    let hi_bound = c0 * (center_shift_aligned - 1.) + 1.;
-    let lo_bound_c = c0 * (center_shift_aligned + 1.) / c2;
-    let hi_bound_c = c0 * (center_shift_aligned - 1.) / c2 + 1.;
-
-    let a_left = c2 * (1. - edge_ratio) / (edge_ratio * lo_bound_c);
-    let b_left = (c1 + c2 * lo_bound_c) / lo_bound_c;
-
-    let a_right = c2 * (edge_ratio - 1.) / (edge_ratio * (1. - hi_bound_c));
-    let b_right = (c2 - edge_ratio * c1 - 2. * edge_ratio * c2
-        + c2 * edge_ratio * (1. - hi_bound_c)
-        + edge_ratio)
-        / (edge_ratio * (1. - hi_bound_c));
-    let c_right = (c2 * edge_ratio - c2) * (c1 - hi_bound_c + c2 * hi_bound_c)
-        / (edge_ratio * (1. - hi_bound_c) * (1. - hi_bound_c));
-
     let constants = [
         ("ENABLE_FFE", 1.),
         ("VIEW_WIDTH_RATIO", view_ratio_aligned.x),
         ("VIEW_HEIGHT_RATIO", view_ratio_aligned.y),
         ("EDGE_X_RATIO", edge_ratio.x),
         ("EDGE_Y_RATIO", edge_ratio.y),
-        ("C1_X", c1.x),
-        ("C1_Y", c1.y),
         ("C2_X", c2.x),
         ("C2_Y", c2.y),
-        ("LO_BOUND_X", lo_bound.x),
-        ("LO_BOUND_Y", lo_bound.y),
-        ("HI_BOUND_X", hi_bound.x),
-        ("HI_BOUND_Y", hi_bound.y),
-        ("A_LEFT_X", a_left.x),
-        ("A_LEFT_Y", a_left.y),
-        ("B_LEFT_X", b_left.x),
-        ("B_LEFT_Y", b_left.y),
-        ("A_RIGHT_X", a_right.x),
-        ("A_RIGHT_Y", a_right.y),
-        ("B_RIGHT_X", b_right.x),
-        ("B_RIGHT_Y", b_right.y),
-        ("C_RIGHT_X", c_right.x),
-        ("C_RIGHT_Y", c_right.y),
     ]
     .iter()
     .map(|(k, v)| (*k, *v as f64))
     .collect();
 
-    (optimized_view_resolution_aligned.as_uvec2(), constants)
+    let layout = FoveationLayout {
+        edge_ratio,
+        edge_size_aligned,
+        c0,
+        c2,
+        static_center_shift: center_shift,
+        radial_radius: None,
+    };
+
+    (
+        optimized_view_resolution_aligned.as_uvec2(),
+        constants,
+        layout,
+    )
 }
 
 pub fn compute_target_view_resolution(
@@ -0,0 +1,26 @@
+#[cfg(target_os = "linux")]
+fn main() {
+    use std::{env, path::PathBuf};
+
+    let server_cpp_dir =
+        PathBuf::from(env::var("CARGO_MANIFEST_DIR").unwrap()).join("../server_openvr/cpp");
+
+    let vulkan = pkg_config::Config::new().probe("vulkan").unwrap();
+
+    cc::Build::new()
+        .cpp(true)
+        .file("producer.cpp")
+        .flag("-std=c++17")
+        .include(&server_cpp_dir)
+        .includes(vulkan.include_paths)
+        .compile("alvr_ipc_producer");
+
+    println!("cargo:rerun-if-changed=producer.cpp");
+    println!(
+        "cargo:rerun-if-changed={}",
+        server_cpp_dir.join("platform/linux/protocol.h").display()
+    );
+}
+
+#[cfg(not(target_os = "linux"))]
+fn main() {}
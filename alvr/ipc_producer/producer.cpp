@@ -0,0 +1,775 @@
+// Synthetic alvr-ipc producer, for load testing the Linux encoder without vrcompositor.
+//
+// It connects to the driver like the Vulkan layer does for the compositor swapchain: it creates
+// exportable images and timeline semaphores, sends the init_packet and the fds, then publishes a
+// present_packet in the present ring for each frame it renders. The frames are an animated test
+// pattern, a background cycling through hues with a square bouncing across it. Frames can be
+// presented late, skipped, and the connection dropped and opened again, to exercise the frame
+// drops, timing jitter and reconnects of CEncoder::Run.
+//
+// The presents carry an identity pose without tag, that the driver matches against the nearest
+// tracked pose. Without a client streaming poses the driver has none, and drops the frames before
+// encoding them.
+
+#include "platform/linux/protocol.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <iterator>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace {
+
+std::atomic_bool g_exiting = false;
+
+struct Options {
+    uint32_t width = 2880;
+    uint32_t height = 1600;
+    // 0 follows the vsync schedule the driver writes into the ring
+    double fps = 90;
+    uint32_t images = 3;
+    // 0 runs until interrupted
+    uint64_t frames = 0;
+    // Each present is late by up to this much
+    double jitterMs = 0;
+    // Share of the frames rendered but not presented
+    double dropPercent = 0;
+    // 0 keeps the connection
+    uint64_t reconnectEvery = 0;
+    uint32_t device = 0;
+};
+
+const char* const USAGE
+    = "usage: alvr_ipc_producer [options]\n"
+      "  --width <pixels>         image width, both eyes side by side (2880)\n"
+      "  --height <pixels>        image height (1600)\n"
+      "  --fps <rate>             present rate, 0 follows the driver vsync (90)\n"
+      "  --images <count>         swapchain images (3)\n"
+      "  --frames <count>         frames to present, 0 runs until interrupted (0)\n"
+      "  --jitter-ms <ms>         random delay added to each present (0)\n"
+      "  --drop-percent <percent> frames rendered but not presented (0)\n"
+      "  --reconnect-every <n>    frames between reconnections, 0 keeps the connection (0)\n"
+      "  --device <index>         Vulkan physical device (0)\n";
+
+#define VK_CHECK(f)                                                                                \
+    do {                                                                                           \
+        VkResult result = (f);                                                                     \
+        if (result != VK_SUCCESS) {                                                                \
+            throw std::runtime_error(                                                              \
+                std::string(#f) + " failed: VkResult " + std::to_string(result)                    \
+            );                                                                                     \
+        }                                                                                          \
+    } while (0)
+
+bool ParseOptions(int argc, const char* const* argv, Options& options) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--help" || i + 1 == argc) {
+            return false;
+        }
+        char* end = nullptr;
+        const char* value = argv[++i];
+        double number = strtod(value, &end);
+        if (*end != '\0' || number < 0) {
+            fprintf(stderr, "invalid value for %s: %s\n", arg.c_str(), value);
+            return false;
+        }
+        if (arg == "--width") {
+            options.width = (uint32_t)number;
+        } else if (arg == "--height") {
+            options.height = (uint32_t)number;
+        } else if (arg == "--fps") {
+            options.fps = number;
+        } else if (arg == "--images") {
+            options.images = (uint32_t)number;
+        } else if (arg == "--frames") {
+            options.frames = (uint64_t)number;
+        } else if (arg == "--jitter-ms") {
+            options.jitterMs = number;
+        } else if (arg == "--drop-percent") {
+            options.dropPercent = std::min(number, 100.0);
+        } else if (arg == "--reconnect-every") {
+            options.reconnectEvery = (uint64_t)number;
+        } else if (arg == "--device") {
+            options.device = (uint32_t)number;
+        } else {
+            fprintf(stderr, "unknown option %s\n", arg.c_str());
+            return false;
+        }
+    }
+    return options.width > 0 && options.height > 0 && options.images > 0;
+}
+
+uint64_t NowNs() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void SleepUntil(uint64_t timeNs) {
+    timespec ts;
+    ts.tv_sec = timeNs / 1000000000;
+    ts.tv_nsec = timeNs % 1000000000;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR
+           && !g_exiting) { }
+}
+
+// Hue in [0, 1) to an RGBA color
+VkClearColorValue HueColor(float hue) {
+    auto channel = [&](float offset) {
+        float h = std::fmod(hue + offset, 1.0f) * 6.0f;
+        return std::clamp(std::abs(h - 3.0f) - 1.0f, 0.0f, 1.0f);
+    };
+    VkClearColorValue color = {};
+    color.float32[0] = channel(0.0f);
+    color.float32[1] = channel(2.0f / 3.0f);
+    color.float32[2] = channel(1.0f / 3.0f);
+    color.float32[3] = 1.0f;
+    return color;
+}
+
+class Producer {
+public:
+    explicit Producer(const Options& options)
+        : m_options(options) {
+        CreateDevice();
+        CreateImages();
+        CreateSquare();
+    }
+
+    ~Producer() {
+        Disconnect();
+        vkDeviceWaitIdle(m_device);
+        for (auto& image : m_images) {
+            vkDestroyFence(m_device, image.fence, nullptr);
+            vkDestroySemaphore(m_device, image.semaphore, nullptr);
+            vkDestroyImage(m_device, image.image, nullptr);
+            vkFreeMemory(m_device, image.memory, nullptr);
+        }
+        vkDestroyBuffer(m_device, m_squareBuffer, nullptr);
+        vkFreeMemory(m_device, m_squareMemory, nullptr);
+        vkDestroyCommandPool(m_device, m_commandPool, nullptr);
+        vkDestroyDevice(m_device, nullptr);
+        vkDestroyInstance(m_instance, nullptr);
+    }
+
+    void Run() {
+        std::mt19937 random(std::random_device {}());
+        std::uniform_real_distribution<double> unit(0.0, 1.0);
+
+        uint64_t presented = 0;
+        uint64_t dropped = 0;
+        uint64_t reconnects = 0;
+        uint64_t statsTime = NowNs();
+        uint64_t nextTime = NowNs();
+
+        for (uint64_t frame = 0; !g_exiting && (m_options.frames == 0 || frame < m_options.frames);
+             frame++) {
+            bool reconnect = m_options.reconnectEvery > 0 && frame > 0
+                && frame % m_options.reconnectEvery == 0;
+            if (m_socket != -1 && (reconnect || ServerClosed())) {
+                Disconnect();
+                reconnects++;
+            }
+            if (m_socket == -1 && !Connect()) {
+                break;
+            }
+
+            uint32_t index = frame % m_images.size();
+            uint64_t value = Render(index, frame);
+
+            if (unit(random) * 100.0 < m_options.dropPercent) {
+                dropped++;
+            } else {
+                present_packet packet = {};
+                packet.image = index;
+                packet.frame = (uint32_t)frame;
+                packet.semaphore_value = value;
+                packet.pose[0][0] = 1.0f;
+                packet.pose[1][1] = 1.0f;
+                packet.pose[2][2] = 1.0f;
+                packet.pose_tag = 0;
+                m_ring->publish(packet);
+                uint64_t one = 1;
+                if (write(m_doorbell, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+                    perror("doorbell write");
+                }
+                presented++;
+            }
+
+            nextTime = NextPresentTime(nextTime);
+            uint64_t jitterNs = (uint64_t)(unit(random) * m_options.jitterMs * 1e6);
+            SleepUntil(nextTime + jitterNs);
+
+            uint64_t now = NowNs();
+            if (now - statsTime >= 1000000000) {
+                fprintf(
+                    stderr,
+                    "frame %llu: %.1f presents/s, %llu presented, %llu dropped, %llu reconnects\n",
+                    (unsigned long long)frame,
+                    presented * 1e9 / (now - statsTime),
+                    (unsigned long long)presented,
+                    (unsigned long long)dropped,
+                    (unsigned long long)reconnects
+                );
+                presented = 0;
+                dropped = 0;
+                reconnects = 0;
+                statsTime = now;
+            }
+        }
+    }
+
+private:
+    struct Image {
+        VkImage image = VK_NULL_HANDLE;
+        VkDeviceMemory memory = VK_NULL_HANDLE;
+        VkSemaphore semaphore = VK_NULL_HANDLE;
+        uint64_t semaphoreValue = 0;
+        VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
+        VkFence fence = VK_NULL_HANDLE;
+    };
+
+    void CreateDevice() {
+        VkApplicationInfo appInfo = {};
+        appInfo.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
+        appInfo.pApplicationName = "alvr_ipc_producer";
+        appInfo.apiVersion = VK_API_VERSION_1_2;
+
+        VkInstanceCreateInfo instanceInfo = {};
+        instanceInfo.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
+        instanceInfo.pApplicationInfo = &appInfo;
+        VK_CHECK(vkCreateInstance(&instanceInfo, nullptr, &m_instance));
+
+        uint32_t count = 0;
+        VK_CHECK(vkEnumeratePhysicalDevices(m_instance, &count, nullptr));
+        std::vector<VkPhysicalDevice> physicalDevices(count);
+        VK_CHECK(vkEnumeratePhysicalDevices(m_instance, &count, physicalDevices.data()));
+        if (m_options.device >= count) {
+            throw std::runtime_error("no Vulkan device " + std::to_string(m_options.device));
+        }
+        m_physicalDevice = physicalDevices[m_options.device];
+
+        VkPhysicalDeviceProperties props;
+        vkGetPhysicalDeviceProperties(m_physicalDevice, &props);
+        fprintf(stderr, "using %s\n", props.deviceName);
+
+        vkGetPhysicalDeviceQueueFamilyProperties(m_physicalDevice, &count, nullptr);
+        std::vector<VkQueueFamilyProperties> families(count);
+        vkGetPhysicalDeviceQueueFamilyProperties(m_physicalDevice, &count, families.data());
+        m_queueFamily = count;
+        for (uint32_t i = 0; i < count; i++) {
+            if (families[i].queueFlags & VK_QUEUE_GRAPHICS_BIT) {
+                m_queueFamily = i;
+                break;
+            }
+        }
+        if (m_queueFamily == count) {
+            throw std::runtime_error("no graphics queue");
+        }
+
+        float priority = 1.0f;
+        VkDeviceQueueCreateInfo queueInfo = {};
+        queueInfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+        queueInfo.queueFamilyIndex = m_queueFamily;
+        queueInfo.queueCount = 1;
+        queueInfo.pQueuePriorities = &priority;
+
+        const char* extensions[] = {
+            VK_KHR_EXTERNAL_MEMORY_FD_EXTENSION_NAME,
+            VK_KHR_EXTERNAL_SEMAPHORE_FD_EXTENSION_NAME,
+        };
+
+        VkPhysicalDeviceVulkan12Features features12 = {};
+        features12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+        features12.timelineSemaphore = VK_TRUE;
+
+        VkDeviceCreateInfo deviceInfo = {};
+        deviceInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+        deviceInfo.pNext = &features12;
+        deviceInfo.queueCreateInfoCount = 1;
+        deviceInfo.pQueueCreateInfos = &queueInfo;
+        deviceInfo.enabledExtensionCount = std::size(extensions);
+        deviceInfo.ppEnabledExtensionNames = extensions;
+        VK_CHECK(vkCreateDevice(m_physicalDevice, &deviceInfo, nullptr, &m_device));
+        vkGetDeviceQueue(m_device, m_queueFamily, 0, &m_queue);
+
+        m_getMemoryFd
+            = (PFN_vkGetMemoryFdKHR)vkGetDeviceProcAddr(m_device, "vkGetMemoryFdKHR");
+        m_getSemaphoreFd
+            = (PFN_vkGetSemaphoreFdKHR)vkGetDeviceProcAddr(m_device, "vkGetSemaphoreFdKHR");
+
+        VkCommandPoolCreateInfo poolInfo = {};
+        poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+        poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+        poolInfo.queueFamilyIndex = m_queueFamily;
+        VK_CHECK(vkCreateCommandPool(m_device, &poolInfo, nullptr, &m_commandPool));
+    }
+
+    uint32_t MemoryTypeIndex(uint32_t typeBits, VkMemoryPropertyFlags flags) {
+        VkPhysicalDeviceMemoryProperties props;
+        vkGetPhysicalDeviceMemoryProperties(m_physicalDevice, &props);
+        for (uint32_t i = 0; i < props.memoryTypeCount; i++) {
+            if ((typeBits & (1 << i)) && (props.memoryTypes[i].propertyFlags & flags) == flags) {
+                return i;
+            }
+        }
+        throw std::runtime_error("no suitable memory type");
+    }
+
+    // Same as the swapchain images of the layer: dedicated allocations exported as opaque fds,
+    // each with a timeline semaphore signaled once a frame is rendered into it
+    void CreateImages() {
+        m_imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+        m_imageInfo.imageType = VK_IMAGE_TYPE_2D;
+        m_imageInfo.format = VK_FORMAT_R8G8B8A8_UNORM;
+        m_imageInfo.extent = { m_options.width, m_options.height, 1 };
+        m_imageInfo.mipLevels = 1;
+        m_imageInfo.arrayLayers = 1;
+        m_imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+        m_imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+        m_imageInfo.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT
+            | VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT
+            | VK_IMAGE_USAGE_STORAGE_BIT;
+        m_imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+        m_imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+        m_images.resize(m_options.images);
+        for (auto& image : m_images) {
+            VkExternalMemoryImageCreateInfo externalInfo = {};
+            externalInfo.sType = VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_IMAGE_CREATE_INFO;
+            externalInfo.handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_OPAQUE_FD_BIT;
+            VkImageCreateInfo imageInfo = m_imageInfo;
+            imageInfo.pNext = &externalInfo;
+            VK_CHECK(vkCreateImage(m_device, &imageInfo, nullptr, &image.image));
+
+            VkMemoryRequirements requirements;
+            vkGetImageMemoryRequirements(m_device, image.image, &requirements);
+            m_memIndex = MemoryTypeIndex(
+                requirements.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT
+            );
+
+            VkExportMemoryAllocateInfo exportInfo = {};
+            exportInfo.sType = VK_STRUCTURE_TYPE_EXPORT_MEMORY_ALLOCATE_INFO;
+            exportInfo.handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_OPAQUE_FD_BIT;
+
+            VkMemoryDedicatedAllocateInfo dedicatedInfo = {};
+            dedicatedInfo.sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_ALLOCATE_INFO;
+            dedicatedInfo.pNext = &exportInfo;
+            dedicatedInfo.image = image.image;
+
+            VkMemoryAllocateInfo memoryInfo = {};
+            memoryInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+            memoryInfo.pNext = &dedicatedInfo;
+            memoryInfo.allocationSize = requirements.size;
+            memoryInfo.memoryTypeIndex = m_memIndex;
+            VK_CHECK(vkAllocateMemory(m_device, &memoryInfo, nullptr, &image.memory));
+            VK_CHECK(vkBindImageMemory(m_device, image.image, image.memory, 0));
+
+            VkExportSemaphoreCreateInfo exportSemaphoreInfo = {};
+            exportSemaphoreInfo.sType = VK_STRUCTURE_TYPE_EXPORT_SEMAPHORE_CREATE_INFO;
+            exportSemaphoreInfo.handleTypes = VK_EXTERNAL_SEMAPHORE_HANDLE_TYPE_OPAQUE_FD_BIT;
+
+            VkSemaphoreTypeCreateInfo timelineInfo = {};
+            timelineInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+            timelineInfo.pNext = &exportSemaphoreInfo;
+            timelineInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+
+            VkSemaphoreCreateInfo semaphoreInfo = {};
+            semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+            semaphoreInfo.pNext = &timelineInfo;
+            VK_CHECK(vkCreateSemaphore(m_device, &semaphoreInfo, nullptr, &image.semaphore));
+
+            VkCommandBufferAllocateInfo commandBufferInfo = {};
+            commandBufferInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+            commandBufferInfo.commandPool = m_commandPool;
+            commandBufferInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+            commandBufferInfo.commandBufferCount = 1;
+            VK_CHECK(vkAllocateCommandBuffers(m_device, &commandBufferInfo, &image.commandBuffer));
+
+            VkFenceCreateInfo fenceInfo = {};
+            fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+            fenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+            VK_CHECK(vkCreateFence(m_device, &fenceInfo, nullptr, &image.fence));
+        }
+    }
+
+    // White square copied over the background, a sixth of the image height
+    void CreateSquare() {
+        m_squareSize = std::max(m_options.height / 6, 1u);
+        VkDeviceSize size = (VkDeviceSize)m_squareSize * m_squareSize * 4;
+
+        VkBufferCreateInfo bufferInfo = {};
+        bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+        bufferInfo.size = size;
+        bufferInfo.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+        bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+        VK_CHECK(vkCreateBuffer(m_device, &bufferInfo, nullptr, &m_squareBuffer));
+
+        VkMemoryRequirements requirements;
+        vkGetBufferMemoryRequirements(m_device, m_squareBuffer, &requirements);
+        VkMemoryAllocateInfo memoryInfo = {};
+        memoryInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+        memoryInfo.allocationSize = requirements.size;
+        memoryInfo.memoryTypeIndex = MemoryTypeIndex(
+            requirements.memoryTypeBits,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT
+        );
+        VK_CHECK(vkAllocateMemory(m_device, &memoryInfo, nullptr, &m_squareMemory));
+        VK_CHECK(vkBindBufferMemory(m_device, m_squareBuffer, m_squareMemory, 0));
+
+        void* data = nullptr;
+        VK_CHECK(vkMapMemory(m_device, m_squareMemory, 0, size, 0, &data));
+        memset(data, 0xff, size);
+        vkUnmapMemory(m_device, m_squareMemory);
+    }
+
+    // Renders the pattern of frame into the image and returns the semaphore value signaled once
+    // it's done. The image is left in the layout the Renderer of the driver keeps its inputs in.
+    uint64_t Render(uint32_t index, uint64_t frame) {
+        Image& image = m_images[index];
+        VK_CHECK(vkWaitForFences(m_device, 1, &image.fence, VK_TRUE, UINT64_MAX));
+        VK_CHECK(vkResetFences(m_device, 1, &image.fence));
+
+        VkCommandBufferBeginInfo beginInfo = {};
+        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+        VK_CHECK(vkBeginCommandBuffer(image.commandBuffer, &beginInfo));
+
+        VkImageSubresourceRange range = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+
+        VkImageMemoryBarrier barrier = {};
+        barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        barrier.srcAccessMask = 0;
+        barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        // The whole image is drawn again
+        barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+        barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+        barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.image = image.image;
+        barrier.subresourceRange = range;
+        vkCmdPipelineBarrier(
+            image.commandBuffer,
+            VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+            VK_PIPELINE_STAGE_TRANSFER_BIT,
+            0,
+            0,
+            nullptr,
+            0,
+            nullptr,
+            1,
+            &barrier
+        );
+
+        // A full hue cycle every 4 seconds at 90 fps, and a square crossing the image every 2
+        VkClearColorValue color = HueColor((frame % 360) / 360.0f);
+        vkCmdClearColorImage(
+            image.commandBuffer,
+            image.image,
+            VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+            &color,
+            1,
+            &range
+        );
+
+        uint32_t squareSize = std::min(m_squareSize, std::min(m_options.width, m_options.height));
+        uint32_t travelX = m_options.width - squareSize;
+        uint32_t travelY = m_options.height - squareSize;
+        VkBufferImageCopy copy = {};
+        copy.bufferRowLength = m_squareSize;
+        copy.imageSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
+        copy.imageOffset.x = travelX == 0 ? 0 : (int32_t)Bounce(frame * travelX / 180, travelX);
+        copy.imageOffset.y = travelY == 0 ? 0 : (int32_t)Bounce(frame * travelY / 360, travelY);
+        copy.imageExtent = { squareSize, squareSize, 1 };
+        vkCmdCopyBufferToImage(
+            image.commandBuffer,
+            m_squareBuffer,
+            image.image,
+            VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+            1,
+            &copy
+        );
+
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+        barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+        barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+        vkCmdPipelineBarrier(
+            image.commandBuffer,
+            VK_PIPELINE_STAGE_TRANSFER_BIT,
+            VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+            0,
+            0,
+            nullptr,
+            0,
+            nullptr,
+            1,
+            &barrier
+        );
+        VK_CHECK(vkEndCommandBuffer(image.commandBuffer));
+
+        uint64_t value = ++image.semaphoreValue;
+        VkTimelineSemaphoreSubmitInfo timelineInfo = {};
+        timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+        timelineInfo.signalSemaphoreValueCount = 1;
+        timelineInfo.pSignalSemaphoreValues = &value;
+
+        VkSubmitInfo submitInfo = {};
+        submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        submitInfo.pNext = &timelineInfo;
+        submitInfo.commandBufferCount = 1;
+        submitInfo.pCommandBuffers = &image.commandBuffer;
+        submitInfo.signalSemaphoreCount = 1;
+        submitInfo.pSignalSemaphores = &image.semaphore;
+        VK_CHECK(vkQueueSubmit(m_queue, 1, &submitInfo, image.fence));
+
+        return value;
+    }
+
+    // Position along a back and forth path of length travel
+    static uint64_t Bounce(uint64_t position, uint64_t travel) {
+        position %= 2 * travel;
+        return position <= travel ? position : 2 * travel - position;
+    }
+
+    uint64_t NextPresentTime(uint64_t previous) {
+        uint64_t now = NowNs();
+        if (m_options.fps == 0) {
+            uint64_t vsyncTime;
+            uint64_t period;
+            if (m_ring->read_vsync(vsyncTime, period)) {
+                if (vsyncTime > now) {
+                    return vsyncTime;
+                }
+                return vsyncTime + ((now - vsyncTime) / period + 1) * period;
+            }
+            // Until the driver publishes its schedule
+            return now + 1000000000 / 90;
+        }
+        uint64_t interval = (uint64_t)(1e9 / m_options.fps);
+        // Late frames don't make the next ones early
+        return std::max(previous + interval, now);
+    }
+
+    // Blocks until the driver accepts the connection, false if interrupted
+    bool Connect() {
+        std::string socketPath = ipc_socket_path();
+
+        sockaddr_un name = {};
+        name.sun_family = AF_UNIX;
+        strncpy(name.sun_path, socketPath.c_str(), sizeof(name.sun_path) - 1);
+
+        bool waiting = false;
+        while (!g_exiting) {
+            m_socket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if (m_socket == -1) {
+                throw std::runtime_error(std::string("socket: ") + strerror(errno));
+            }
+            if (connect(m_socket, (const sockaddr*)&name, sizeof(name)) == 0) {
+                break;
+            }
+            close(m_socket);
+            m_socket = -1;
+            if (!waiting) {
+                fprintf(stderr, "waiting for the driver on %s\n", socketPath.c_str());
+                waiting = true;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+        if (m_socket == -1) {
+            return false;
+        }
+
+        CreateRing();
+
+        VkPhysicalDeviceVulkan11Properties props11 = {};
+        props11.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_1_PROPERTIES;
+        VkPhysicalDeviceProperties2 props = {};
+        props.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+        props.pNext = &props11;
+        vkGetPhysicalDeviceProperties2(m_physicalDevice, &props);
+
+        init_packet init = {};
+        init.num_images = m_images.size();
+        memcpy(init.device_uuid.data(), props11.deviceUUID, VK_UUID_SIZE);
+        init.image_create_info = m_imageInfo;
+        init.mem_index = m_memIndex;
+        init.source_pid = getpid();
+        init.protocol_version = ALVR_IPC_PROTOCOL_VERSION;
+        init.flags = 0;
+        if (send(m_socket, &init, sizeof(init), MSG_NOSIGNAL) != sizeof(init)) {
+            throw std::runtime_error(std::string("init packet write: ") + strerror(errno));
+        }
+
+        // The driver imports the fds, each connection sends new ones
+        std::vector<int> fds;
+        for (auto& image : m_images) {
+            VkMemoryGetFdInfoKHR memoryFdInfo = {};
+            memoryFdInfo.sType = VK_STRUCTURE_TYPE_MEMORY_GET_FD_INFO_KHR;
+            memoryFdInfo.memory = image.memory;
+            memoryFdInfo.handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_OPAQUE_FD_BIT;
+            int fd;
+            VK_CHECK(m_getMemoryFd(m_device, &memoryFdInfo, &fd));
+            fds.push_back(fd);
+
+            VkSemaphoreGetFdInfoKHR semaphoreFdInfo = {};
+            semaphoreFdInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_GET_FD_INFO_KHR;
+            semaphoreFdInfo.semaphore = image.semaphore;
+            semaphoreFdInfo.handleType = VK_EXTERNAL_SEMAPHORE_HANDLE_TYPE_OPAQUE_FD_BIT;
+            VK_CHECK(m_getSemaphoreFd(m_device, &semaphoreFdInfo, &fd));
+            fds.push_back(fd);
+        }
+        SendFds(fds);
+        for (int fd : fds) {
+            close(fd);
+        }
+        SendFds({ m_ringFd, m_doorbell });
+
+        fprintf(
+            stderr,
+            "connected, %u images of %ux%u\n",
+            init.num_images,
+            m_options.width,
+            m_options.height
+        );
+        return true;
+    }
+
+    // Like the ring of the layer, the driver maps it from the fd it receives
+    void CreateRing() {
+        m_ringFd = memfd_create("alvr-present-ring", MFD_CLOEXEC);
+        if (m_ringFd == -1 || ftruncate(m_ringFd, sizeof(present_ring)) == -1) {
+            throw std::runtime_error(std::string("present ring memfd: ") + strerror(errno));
+        }
+        void* mem = mmap(
+            nullptr, sizeof(present_ring), PROT_READ | PROT_WRITE, MAP_SHARED, m_ringFd, 0
+        );
+        if (mem == MAP_FAILED) {
+            throw std::runtime_error(std::string("present ring mmap: ") + strerror(errno));
+        }
+        m_ring = new (mem) present_ring;
+        m_doorbell = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (m_doorbell == -1) {
+            throw std::runtime_error(std::string("doorbell eventfd: ") + strerror(errno));
+        }
+    }
+
+    // All the fds in a single message with a one byte payload, the driver knows how many to expect
+    void SendFds(const std::vector<int>& fds) {
+        size_t fdsSize = fds.size() * sizeof(int);
+        std::vector<char> control(CMSG_SPACE(fdsSize), 0);
+        char data[1] = {};
+        iovec iov = { data, sizeof(data) };
+
+        msghdr msg = {};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.data();
+        msg.msg_controllen = control.size();
+
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(fdsSize);
+        memcpy(CMSG_DATA(cmsg), fds.data(), fdsSize);
+
+        if (sendmsg(m_socket, &msg, MSG_NOSIGNAL) == -1) {
+            throw std::runtime_error(std::string("sendmsg: ") + strerror(errno));
+        }
+    }
+
+    // The driver closes the connection when its session ends
+    bool ServerClosed() {
+        pollfd pfd = { m_socket, POLLIN, 0 };
+        if (poll(&pfd, 1, 0) <= 0) {
+            return false;
+        }
+        char byte;
+        return (pfd.revents & (POLLHUP | POLLERR))
+            || recv(m_socket, &byte, 1, MSG_DONTWAIT | MSG_PEEK) == 0;
+    }
+
+    void Disconnect() {
+        if (m_socket != -1) {
+            close(m_socket);
+            m_socket = -1;
+        }
+        if (m_ring != nullptr) {
+            munmap(m_ring, sizeof(present_ring));
+            m_ring = nullptr;
+        }
+        if (m_ringFd != -1) {
+            close(m_ringFd);
+            m_ringFd = -1;
+        }
+        if (m_doorbell != -1) {
+            close(m_doorbell);
+            m_doorbell = -1;
+        }
+    }
+
+    Options m_options;
+
+    VkInstance m_instance = VK_NULL_HANDLE;
+    VkPhysicalDevice m_physicalDevice = VK_NULL_HANDLE;
+    VkDevice m_device = VK_NULL_HANDLE;
+    uint32_t m_queueFamily = 0;
+    VkQueue m_queue = VK_NULL_HANDLE;
+    VkCommandPool m_commandPool = VK_NULL_HANDLE;
+    PFN_vkGetMemoryFdKHR m_getMemoryFd = nullptr;
+    PFN_vkGetSemaphoreFdKHR m_getSemaphoreFd = nullptr;
+
+    VkImageCreateInfo m_imageInfo = {};
+    uint32_t m_memIndex = 0;
+    std::vector<Image> m_images;
+
+    uint32_t m_squareSize = 0;
+    VkBuffer m_squareBuffer = VK_NULL_HANDLE;
+    VkDeviceMemory m_squareMemory = VK_NULL_HANDLE;
+
+    int m_socket = -1;
+    int m_ringFd = -1;
+    int m_doorbell = -1;
+    present_ring* m_ring = nullptr;
+};
+
+}
+
+extern "C" int alvr_ipc_producer_main(int argc, const char* const* argv) {
+    Options options;
+    if (!ParseOptions(argc, argv, options)) {
+        fputs(USAGE, stderr);
+        return 1;
+    }
+
+    signal(SIGINT, [](int) { g_exiting = true; });
+    signal(SIGTERM, [](int) { g_exiting = true; });
+
+    try {
+        Producer producer(options);
+        producer.Run();
+    } catch (std::exception& e) {
+        fprintf(stderr, "alvr_ipc_producer: %s\n", e.what());
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,25 @@
+#[cfg(target_os = "linux")]
+fn main() {
+    use std::{
+        env,
+        ffi::{CString, c_char, c_int},
+        process,
+    };
+
+    unsafe extern "C" {
+        fn alvr_ipc_producer_main(argc: c_int, argv: *const *const c_char) -> c_int;
+    }
+
+    let args = env::args()
+        .map(|arg| CString::new(arg).unwrap())
+        .collect::<Vec<_>>();
+    let argv = args.iter().map(|arg| arg.as_ptr()).collect::<Vec<_>>();
+
+    let code = unsafe { alvr_ipc_producer_main(argv.len() as c_int, argv.as_ptr()) };
+    process::exit(code);
+}
+
+#[cfg(not(target_os = "linux"))]
+fn main() {
+    eprintln!("alvr_ipc_producer only runs on Linux");
+}
@@ -203,7 +203,11 @@ impl AlvrVideoSink {
                     self.exact_frame_pose_logged = false;
                     self.feedback_controller_published = [false; 2];
                 }
-                Ok(ServerCoreEvent::RequestIDR) => self.force_keyframe = true,
+                Ok(
+                    ServerCoreEvent::RequestIDR
+                    | ServerCoreEvent::RequestRecovery
+                    | ServerCoreEvent::LostFrames { .. },
+                ) => self.force_keyframe = true,
                 Ok(ServerCoreEvent::LocalViewParams(params)) => {
                     self.local_view_params = Some(params);
                     if !self.feedback_view_logged {
@@ -430,7 +434,9 @@ impl AlvrVideoSink {
         let transported = self.context.send_video_nal(
             frame.metadata.video_timestamp,
             frame.metadata.global_view_params,
+            None,
             frame.is_keyframe,
+            0,
             frame.nal_data,
         );
         if transported {
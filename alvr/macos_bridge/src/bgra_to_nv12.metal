@@ -7,6 +7,9 @@ struct ConversionParams {
     uint output_eye_width;
     uint source_height;
     uint output_height;
+    // Bilinear taps per axis, more than one when downscaling by more than 2:1
+    uint taps_x;
+    uint taps_y;
 };
 
 constexpr sampler bilinear_sampler(
@@ -35,27 +38,64 @@ static float2 source_position(
     return float2(float(eye * params.source_eye_width) + source_eye_x, source_y);
 }
 
+// Each tap averages 2x2 source pixels, so spreading the taps over the footprint of the output
+// pixel filters the downscale instead of skipping source pixels. Taps stay inside the eye.
 static float3 sample_rgb(
     texture2d<float, access::sample> source,
     uint output_x,
     uint output_y,
     constant ConversionParams &params) {
-    return source.sample(
-        bilinear_sampler,
-        source_position(output_x, output_y, params)).rgb;
+    float2 center = source_position(output_x, output_y, params);
+    if (params.taps_x <= 1 && params.taps_y <= 1) {
+        return source.sample(bilinear_sampler, center).rgb;
+    }
+
+    uint eye = output_x / params.output_eye_width;
+    float eye_min = float(eye * params.source_eye_width) + 0.5f;
+    float eye_max = float((eye + 1) * params.source_eye_width) - 0.5f;
+    float2 footprint = float2(
+        float(params.source_eye_width) / float(params.output_eye_width),
+        float(params.source_height) / float(params.output_height));
+    float2 step = footprint / float2(params.taps_x, params.taps_y);
+    float2 first = center - 0.5f * footprint + 0.5f * step;
+    float3 sum = float3(0.0f);
+    for (uint tap_y = 0; tap_y < params.taps_y; tap_y++) {
+        for (uint tap_x = 0; tap_x < params.taps_x; tap_x++) {
+            float2 position = first + step * float2(tap_x, tap_y);
+            position.x = clamp(position.x, eye_min, eye_max);
+            position.y = clamp(position.y, 0.5f, float(params.source_height) - 0.5f);
+            sum += source.sample(bilinear_sampler, position).rgb;
+        }
+    }
+    return sum / float(params.taps_x * params.taps_y);
 }
 
+// Normalized plane value of a BT.709 video range code given in 8-bit units. NV12 stores 8-bit
+// codes, P010 stores 10-bit codes in the high bits of 16.
+struct Nv12Format {
+    static float code(float value) {
+        return value / 255.0f;
+    }
+};
+
+struct P010Format {
+    static float code(float value) {
+        return value * 4.0f * 64.0f / 65535.0f;
+    }
+};
+
+template <typename Format>
 static float luma(float3 rgb) {
-    return (16.0f + 219.0f * dot(rgb, float3(0.2126f, 0.7152f, 0.0722f)))
-        / 255.0f;
+    return Format::code(16.0f + 219.0f * dot(rgb, float3(0.2126f, 0.7152f, 0.0722f)));
 }
 
-kernel void bgra_to_nv12(
-    texture2d<float, access::sample> source [[texture(0)]],
-    texture2d<float, access::write> destination_y [[texture(1)]],
-    texture2d<float, access::write> destination_uv [[texture(2)]],
-    constant ConversionParams &params [[buffer(0)]],
-    uint2 chroma_position [[thread_position_in_grid]]) {
+template <typename Format>
+static void convert_block(
+    texture2d<float, access::sample> source,
+    texture2d<float, access::write> destination_y,
+    texture2d<float, access::write> destination_uv,
+    constant ConversionParams &params,
+    uint2 chroma_position) {
     uint output_width = params.output_eye_width * 2;
     uint2 output_origin = chroma_position * 2;
     if (output_origin.x >= output_width || output_origin.y >= params.output_height) {
@@ -67,17 +107,35 @@ kernel void bgra_to_nv12(
     float3 rgb_01 = sample_rgb(source, output_origin.x, output_origin.y + 1, params);
     float3 rgb_11 = sample_rgb(source, output_origin.x + 1, output_origin.y + 1, params);
 
-    destination_y.write(float4(luma(rgb_00), 0.0f, 0.0f, 1.0f), output_origin);
+    destination_y.write(float4(luma<Format>(rgb_00), 0.0f, 0.0f, 1.0f), output_origin);
     destination_y.write(
-        float4(luma(rgb_10), 0.0f, 0.0f, 1.0f), output_origin + uint2(1, 0));
+        float4(luma<Format>(rgb_10), 0.0f, 0.0f, 1.0f), output_origin + uint2(1, 0));
     destination_y.write(
-        float4(luma(rgb_01), 0.0f, 0.0f, 1.0f), output_origin + uint2(0, 1));
+        float4(luma<Format>(rgb_01), 0.0f, 0.0f, 1.0f), output_origin + uint2(0, 1));
     destination_y.write(
-        float4(luma(rgb_11), 0.0f, 0.0f, 1.0f), output_origin + uint2(1, 1));
+        float4(luma<Format>(rgb_11), 0.0f, 0.0f, 1.0f), output_origin + uint2(1, 1));
 
     float3 rgb = (rgb_00 + rgb_10 + rgb_01 + rgb_11) * 0.25f;
     float y = dot(rgb, float3(0.2126f, 0.7152f, 0.0722f));
-    float cb = (128.0f + 112.0f * (rgb.b - y) / (1.0f - 0.0722f)) / 255.0f;
-    float cr = (128.0f + 112.0f * (rgb.r - y) / (1.0f - 0.2126f)) / 255.0f;
+    float cb = Format::code(128.0f + 112.0f * (rgb.b - y) / (1.0f - 0.0722f));
+    float cr = Format::code(128.0f + 112.0f * (rgb.r - y) / (1.0f - 0.2126f));
     destination_uv.write(float4(cb, cr, 0.0f, 1.0f), chroma_position);
 }
+
+kernel void bgra_to_nv12(
+    texture2d<float, access::sample> source [[texture(0)]],
+    texture2d<float, access::write> destination_y [[texture(1)]],
+    texture2d<float, access::write> destination_uv [[texture(2)]],
+    constant ConversionParams &params [[buffer(0)]],
+    uint2 chroma_position [[thread_position_in_grid]]) {
+    convert_block<Nv12Format>(source, destination_y, destination_uv, params, chroma_position);
+}
+
+kernel void bgra_to_p010(
+    texture2d<float, access::sample> source [[texture(0)]],
+    texture2d<float, access::write> destination_y [[texture(1)]],
+    texture2d<float, access::write> destination_uv [[texture(2)]],
+    constant ConversionParams &params [[buffer(0)]],
+    uint2 chroma_position [[thread_position_in_grid]]) {
+    convert_block<P010Format>(source, destination_y, destination_uv, params, chroma_position);
+}
@@ -3,7 +3,18 @@
 
 #include <stdint.h>
 
-#define ALVR_IOSURFACE_PROTOCOL_VERSION UINT32_C(3)
+#define ALVR_IOSURFACE_PROTOCOL_VERSION UINT32_C(5)
+/* Oldest producer protocol still accepted. The version of the first import request is used by
+ * every later message of the session. */
+#define ALVR_IOSURFACE_MIN_PROTOCOL_VERSION UINT32_C(3)
+/* From version 4 the consumer never locks a surface on the frame path: self tests are only
+ * accepted before the startup barrier, and after it at most one consumer sample is read every
+ * this many frames. Samples requested more often are passed through with the flag cleared. */
+#define ALVR_IOSURFACE_CONSUMER_SAMPLE_INTERVAL UINT32_C(90)
+/* From version 5 every offer carries a second port descriptor, a memory entry holding
+ * struct alvr_iosurface_ring. The handshake stays on Mach, frame-ready and slot-release entries
+ * then only go through the ring. */
+#define ALVR_IOSURFACE_RING_CAPACITY UINT32_C(8)
 #define ALVR_IOSURFACE_PIXEL_FORMAT_BGRA UINT32_C(0x42475241)
 
 enum alvr_iosurface_message_id
@@ -112,12 +123,34 @@ struct alvr_iosurface_slot_release
     uint32_t reserved;
 };
 
+/* Single producer single consumer rings. Heads and tails are free running counters accessed with
+ * acquire/release atomics, entry n lives at n % ALVR_IOSURFACE_RING_CAPACITY. A side stores its
+ * waiting word before waiting on the other side's head with os_sync_wait_on_address, and the
+ * other side calls os_sync_wake_by_address_any on that head after moving it if the word is set.
+ * Both are shared-memory os_sync calls. */
+struct alvr_iosurface_ring
+{
+    /* Written by the producer */
+    uint32_t frame_head;
+    /* Written by the consumer */
+    uint32_t frame_tail;
+    /* Written by the consumer */
+    uint32_t release_head;
+    /* Written by the producer */
+    uint32_t release_tail;
+    uint32_t consumer_waiting;
+    uint32_t producer_waiting;
+    struct alvr_iosurface_frame_ready frames[ALVR_IOSURFACE_RING_CAPACITY];
+    struct alvr_iosurface_slot_release releases[ALVR_IOSURFACE_RING_CAPACITY];
+};
+
 #if defined(__cplusplus)
 static_assert(sizeof(struct alvr_iosurface_request) == 16);
 static_assert(sizeof(struct alvr_iosurface_offer) == 64);
 static_assert(sizeof(struct alvr_iosurface_ack) == 48);
 static_assert(sizeof(struct alvr_iosurface_frame_ready) == 136);
 static_assert(sizeof(struct alvr_iosurface_slot_release) == 48);
+static_assert(sizeof(struct alvr_iosurface_ring) == 1496);
 #else
 _Static_assert(sizeof(struct alvr_iosurface_request) == 16,
                "request wire layout changed");
@@ -129,6 +162,8 @@ _Static_assert(sizeof(struct alvr_iosurface_frame_ready) == 136,
                "frame-ready wire layout changed");
 _Static_assert(sizeof(struct alvr_iosurface_slot_release) == 48,
                "slot-release wire layout changed");
+_Static_assert(sizeof(struct alvr_iosurface_ring) == 1496,
+               "ring layout changed");
 #endif
 
 #endif
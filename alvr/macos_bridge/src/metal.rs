@@ -2,8 +2,10 @@ use crate::{SurfaceLease, native_source::NativeSourceFrame};
 use anyhow::{Result, anyhow};
 use std::{
     ffi::{CStr, c_char, c_int, c_void},
-    ptr::NonNull,
-    time::{Duration, Instant},
+    marker::PhantomData,
+    mem,
+    ptr::{self, NonNull},
+    time::Duration,
 };
 
 const ERROR_CAPACITY: usize = 512;
@@ -17,12 +19,20 @@ unsafe extern "C" {
         error_capacity: usize,
     ) -> *mut c_void;
     fn alvr_metal_converter_destroy(converter: *mut c_void);
-    fn alvr_metal_converter_convert(
+    fn alvr_metal_converter_submit(
         converter: *mut c_void,
+        source_slot: u32,
         source_surface: *mut c_void,
         destination_buffer: *mut c_void,
         source_width: u32,
         source_height: u32,
+        error_buffer: *mut c_char,
+        error_capacity: usize,
+    ) -> *mut c_void;
+    fn alvr_metal_conversion_is_complete(conversion: *mut c_void) -> c_int;
+    fn alvr_metal_conversion_finish(
+        conversion: *mut c_void,
+        wall_duration_ns: *mut u64,
         gpu_duration_ns: *mut u64,
         error_buffer: *mut c_char,
         error_capacity: usize,
@@ -58,14 +68,17 @@ impl MetalConverter {
             .ok_or_else(|| anyhow!(error_message(&error)))
     }
 
-    pub fn convert(
-        &self,
-        source_frame: &NativeSourceFrame<'_>,
-        destination: &SurfaceLease,
+    // Encodes and commits the conversion without waiting for the GPU. The source frame and the
+    // destination stay borrowed until the conversion is waited for or dropped.
+    pub fn submit<'a>(
+        &'a self,
+        source_frame: &'a NativeSourceFrame<'_>,
+        destination: &'a SurfaceLease,
         source_width: u32,
         source_height: u32,
-    ) -> Result<ConversionTiming> {
-        self.convert_raw(
+    ) -> Result<PendingConversion<'a>> {
+        self.submit_raw(
+            source_frame.slot_index(),
             source_frame.surface()?,
             destination.cv_pixel_buffer(),
             source_width,
@@ -73,32 +86,88 @@ impl MetalConverter {
         )
     }
 
-    fn convert_raw(
+    // Source textures are cached per slot and destination textures per pool buffer, so that
+    // steady state conversions create no Metal objects besides the command buffer
+    fn submit_raw(
         &self,
+        source_slot: u32,
         source_surface: NonNull<c_void>,
         destination_buffer: NonNull<c_void>,
         source_width: u32,
         source_height: u32,
-    ) -> Result<ConversionTiming> {
+    ) -> Result<PendingConversion<'_>> {
         let mut error = [0 as c_char; ERROR_CAPACITY];
-        let mut gpu_duration_ns = 0;
-        let start = Instant::now();
-        let status = unsafe {
-            alvr_metal_converter_convert(
+        let conversion = unsafe {
+            alvr_metal_converter_submit(
                 self.converter.as_ptr(),
+                source_slot,
                 source_surface.as_ptr(),
                 destination_buffer.as_ptr(),
                 source_width,
                 source_height,
+                error.as_mut_ptr(),
+                error.len(),
+            )
+        };
+        NonNull::new(conversion)
+            .map(|conversion| PendingConversion {
+                conversion,
+                _borrow: PhantomData,
+            })
+            .ok_or_else(|| anyhow!("Metal conversion failed: {}", error_message(&error)))
+    }
+
+    #[cfg(test)]
+    fn convert_raw(
+        &self,
+        source_surface: NonNull<c_void>,
+        destination_buffer: NonNull<c_void>,
+        source_width: u32,
+        source_height: u32,
+    ) -> Result<ConversionTiming> {
+        self.submit_raw(
+            0,
+            source_surface,
+            destination_buffer,
+            source_width,
+            source_height,
+        )?
+        .wait()
+    }
+}
+
+// Conversion committed to the GPU. Dropping it without waiting still blocks until the GPU is done,
+// so that the textures are never released while in use.
+pub struct PendingConversion<'a> {
+    conversion: NonNull<c_void>,
+    _borrow: PhantomData<&'a MetalConverter>,
+}
+
+impl PendingConversion<'_> {
+    pub fn is_complete(&self) -> bool {
+        unsafe { alvr_metal_conversion_is_complete(self.conversion.as_ptr()) != 0 }
+    }
+
+    // Wall time is measured from the commit to the completion handler, not to this call
+    pub fn wait(self) -> Result<ConversionTiming> {
+        let conversion = self.conversion;
+        mem::forget(self);
+
+        let mut error = [0 as c_char; ERROR_CAPACITY];
+        let mut wall_duration_ns = 0;
+        let mut gpu_duration_ns = 0;
+        let status = unsafe {
+            alvr_metal_conversion_finish(
+                conversion.as_ptr(),
+                &mut wall_duration_ns,
                 &mut gpu_duration_ns,
                 error.as_mut_ptr(),
                 error.len(),
             )
         };
-        let elapsed = start.elapsed();
         if status == 0 {
             Ok(ConversionTiming {
-                wall: elapsed,
+                wall: Duration::from_nanos(wall_duration_ns),
                 gpu: Duration::from_nanos(gpu_duration_ns),
             })
         } else {
@@ -110,6 +179,20 @@ impl MetalConverter {
     }
 }
 
+impl Drop for PendingConversion<'_> {
+    fn drop(&mut self) {
+        unsafe {
+            alvr_metal_conversion_finish(
+                self.conversion.as_ptr(),
+                ptr::null_mut(),
+                ptr::null_mut(),
+                ptr::null_mut(),
+                0,
+            );
+        }
+    }
+}
+
 impl Drop for MetalConverter {
     fn drop(&mut self) {
         unsafe { alvr_metal_converter_destroy(self.converter.as_ptr()) }
@@ -2,22 +2,60 @@
 #import <IOSurface/IOSurface.h>
 #import <Metal/Metal.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cstddef>
 #include <cstdint>
 #include <cstdio>
+#include <vector>
 
 struct ConversionParams {
     uint32_t source_eye_width;
     uint32_t output_eye_width;
     uint32_t source_height;
     uint32_t output_height;
+    uint32_t taps_x;
+    uint32_t taps_y;
 };
 
+// Bilinear taps per output pixel along one axis. A single tap already averages 2:1, beyond that
+// enough taps are spread over the footprint that no source pixel is skipped.
+constexpr uint32_t max_downscale_taps = 4;
+
+static uint32_t downscale_taps(uint32_t source_extent, uint32_t output_extent) {
+    uint32_t taps = (source_extent + 2 * output_extent - 1) / (2 * output_extent);
+    return std::clamp<uint32_t>(taps, 1, max_downscale_taps);
+}
+
+// Source texture of an IOSurface slot. The surface is retained so that its address keeps
+// identifying it, the texture is recreated only when the producer hands over a new surface.
+struct SourceSlot {
+    IOSurfaceRef surface;
+    uint32_t width;
+    uint32_t height;
+    id<MTLTexture> texture;
+};
+
+// Plane textures of a pool CVPixelBuffer, kept for as long as the buffer stays in the pool
+struct DestinationTextures {
+    CVPixelBufferRef buffer;
+    CVMetalTextureRef y_reference;
+    CVMetalTextureRef uv_reference;
+};
+
+// Bounds the caches if the pools keep changing under the converter
+constexpr size_t max_source_slots = 16;
+constexpr size_t max_destination_buffers = 32;
+
 struct MetalConverter {
     id<MTLDevice> device;
     id<MTLCommandQueue> queue;
     id<MTLComputePipelineState> pipeline;
+    id<MTLComputePipelineState> p010_pipeline;
     CVMetalTextureCacheRef texture_cache;
+    std::vector<SourceSlot> source_slots;
+    std::vector<DestinationTextures> destinations;
 };
 
 static void set_error(char *buffer, size_t capacity, const char *message) {
@@ -26,6 +64,117 @@ static void set_error(char *buffer, size_t capacity, const char *message) {
     }
 }
 
+static void release_source_slot(SourceSlot &slot) {
+    if (slot.surface != nullptr) {
+        CFRelease(slot.surface);
+    }
+    slot = SourceSlot{};
+}
+
+static void release_destinations(MetalConverter *converter) {
+    for (DestinationTextures &destination : converter->destinations) {
+        CFRelease(destination.y_reference);
+        CFRelease(destination.uv_reference);
+        CFRelease(destination.buffer);
+    }
+    converter->destinations.clear();
+    CVMetalTextureCacheFlush(converter->texture_cache, 0);
+}
+
+static id<MTLTexture> source_texture(
+    MetalConverter *converter,
+    uint32_t slot_index,
+    IOSurfaceRef surface,
+    uint32_t width,
+    uint32_t height) {
+    if (slot_index >= max_source_slots) {
+        return nil;
+    }
+    if (slot_index >= converter->source_slots.size()) {
+        converter->source_slots.resize(slot_index + 1);
+    }
+    SourceSlot &slot = converter->source_slots[slot_index];
+    if (slot.surface == surface && slot.width == width && slot.height == height) {
+        return slot.texture;
+    }
+    release_source_slot(slot);
+
+    MTLTextureDescriptor *descriptor =
+        [MTLTextureDescriptor texture2DDescriptorWithPixelFormat:MTLPixelFormatBGRA8Unorm
+                                                           width:width
+                                                          height:height
+                                                       mipmapped:NO];
+    descriptor.storageMode = MTLStorageModeShared;
+    descriptor.usage = MTLTextureUsageShaderRead;
+    id<MTLTexture> texture =
+        [converter->device newTextureWithDescriptor:descriptor iosurface:surface plane:0];
+    if (texture == nil) {
+        return nil;
+    }
+    slot = SourceSlot{
+        static_cast<IOSurfaceRef>(CFRetain(surface)),
+        width,
+        height,
+        texture,
+    };
+    return texture;
+}
+
+static const DestinationTextures *destination_textures(
+    MetalConverter *converter,
+    CVPixelBufferRef buffer,
+    uint32_t width,
+    uint32_t height) {
+    for (const DestinationTextures &destination : converter->destinations) {
+        if (destination.buffer == buffer) {
+            return &destination;
+        }
+    }
+    if (converter->destinations.size() == max_destination_buffers) {
+        release_destinations(converter);
+    }
+
+    bool ten_bit = CVPixelBufferGetPixelFormatType(buffer) ==
+        kCVPixelFormatType_420YpCbCr10BiPlanarVideoRange;
+    CVMetalTextureRef y_reference = nullptr;
+    CVReturn y_status = CVMetalTextureCacheCreateTextureFromImage(
+        kCFAllocatorDefault,
+        converter->texture_cache,
+        buffer,
+        nullptr,
+        ten_bit ? MTLPixelFormatR16Unorm : MTLPixelFormatR8Unorm,
+        width,
+        height,
+        0,
+        &y_reference);
+    CVMetalTextureRef uv_reference = nullptr;
+    CVReturn uv_status = CVMetalTextureCacheCreateTextureFromImage(
+        kCFAllocatorDefault,
+        converter->texture_cache,
+        buffer,
+        nullptr,
+        ten_bit ? MTLPixelFormatRG16Unorm : MTLPixelFormatRG8Unorm,
+        width / 2,
+        height / 2,
+        1,
+        &uv_reference);
+    if (y_status != kCVReturnSuccess || uv_status != kCVReturnSuccess ||
+        y_reference == nullptr || uv_reference == nullptr ||
+        CVMetalTextureGetTexture(y_reference) == nil ||
+        CVMetalTextureGetTexture(uv_reference) == nil) {
+        if (y_reference != nullptr) CFRelease(y_reference);
+        if (uv_reference != nullptr) CFRelease(uv_reference);
+        return nullptr;
+    }
+
+    converter->destinations.push_back(DestinationTextures{
+        static_cast<CVPixelBufferRef>(CFRetain(buffer)),
+        y_reference,
+        uv_reference,
+    });
+    return &converter->destinations.back();
+}
+
 extern "C" void *alvr_metal_converter_create(
     const uint8_t *library_bytes,
     size_t library_size,
@@ -56,13 +205,17 @@ extern "C" void *alvr_metal_converter_create(
             return nullptr;
         }
         id<MTLFunction> function = [library newFunctionWithName:@"bgra_to_nv12"];
-        if (function == nil) {
+        id<MTLFunction> p010_function = [library newFunctionWithName:@"bgra_to_p010"];
+        if (function == nil || p010_function == nil) {
             set_error(error_buffer, error_capacity, "bgra_to_nv12 function is missing");
             return nullptr;
         }
         id<MTLComputePipelineState> pipeline =
             [device newComputePipelineStateWithFunction:function error:&error];
-        if (pipeline == nil) {
+        id<MTLComputePipelineState> p010_pipeline = pipeline == nil
+            ? nil
+            : [device newComputePipelineStateWithFunction:p010_function error:&error];
+        if (pipeline == nil || p010_pipeline == nil) {
             set_error(
                 error_buffer,
                 error_capacity,
@@ -86,7 +239,10 @@ extern "C" void *alvr_metal_converter_create(
             device,
             queue,
             pipeline,
+            p010_pipeline,
             texture_cache,
+            {},
+            {},
         };
         return converter;
     }
@@ -97,99 +253,73 @@ extern "C" void alvr_metal_converter_destroy(void *opaque_converter) {
     if (converter == nullptr) {
         return;
     }
-    if (converter->texture_cache != nullptr) {
-        CFRelease(converter->texture_cache);
+    for (SourceSlot &slot : converter->source_slots) {
+        release_source_slot(slot);
     }
+    release_destinations(converter);
+    CFRelease(converter->texture_cache);
     delete converter;
 }
 
-extern "C" int alvr_metal_converter_convert(
+// One conversion in flight, freed by alvr_metal_conversion_finish after the completion handler ran
+struct MetalConversion {
+    id<MTLCommandBuffer> command_buffer;
+    dispatch_semaphore_t done;
+    std::atomic<bool> complete;
+    std::chrono::steady_clock::time_point submitted;
+    std::chrono::steady_clock::time_point completed;
+};
+
+extern "C" void *alvr_metal_converter_submit(
     void *opaque_converter,
+    uint32_t source_slot,
     IOSurfaceRef source_surface,
     CVPixelBufferRef destination_buffer,
     uint32_t source_width,
     uint32_t source_height,
-    uint64_t *gpu_duration_ns,
     char *error_buffer,
     size_t error_capacity) {
     @autoreleasepool {
-        if (gpu_duration_ns != nullptr) {
-            *gpu_duration_ns = 0;
-        }
         auto *converter = static_cast<MetalConverter *>(opaque_converter);
         if (converter == nullptr || source_surface == nullptr ||
             destination_buffer == nullptr || source_width == 0 || source_height == 0 ||
             source_width % 4 != 0 || source_height % 2 != 0) {
             set_error(error_buffer, error_capacity, "invalid Metal conversion arguments");
-            return 1;
+            return nullptr;
         }
 
         uint32_t output_width = static_cast<uint32_t>(
             CVPixelBufferGetWidth(destination_buffer));
         uint32_t output_height = static_cast<uint32_t>(
             CVPixelBufferGetHeight(destination_buffer));
+        OSType pixel_format = CVPixelBufferGetPixelFormatType(destination_buffer);
         if (output_width == 0 || output_width % 4 != 0 ||
             output_height == 0 || output_height % 2 != 0 ||
-            CVPixelBufferGetPlaneCount(destination_buffer) != 2) {
+            CVPixelBufferGetPlaneCount(destination_buffer) != 2 ||
+            (pixel_format != kCVPixelFormatType_420YpCbCr8BiPlanarVideoRange &&
+             pixel_format != kCVPixelFormatType_420YpCbCr10BiPlanarVideoRange)) {
             set_error(error_buffer, error_capacity, "destination CVPixelBuffer shape mismatch");
-            return 2;
-        }
-
-        MTLTextureDescriptor *source_descriptor =
-            [MTLTextureDescriptor texture2DDescriptorWithPixelFormat:MTLPixelFormatBGRA8Unorm
-                                                               width:source_width
-                                                              height:source_height
-                                                           mipmapped:NO];
-        source_descriptor.storageMode = MTLStorageModeShared;
-        source_descriptor.usage = MTLTextureUsageShaderRead;
-        id<MTLTexture> source_texture =
-            [converter->device newTextureWithDescriptor:source_descriptor
-                                               iosurface:source_surface
-                                                   plane:0];
-        if (source_texture == nil) {
-            set_error(error_buffer, error_capacity, "source IOSurface texture creation failed");
-            return 3;
+            return nullptr;
         }
 
-        CVMetalTextureRef y_reference = nullptr;
-        CVReturn y_status = CVMetalTextureCacheCreateTextureFromImage(
-            kCFAllocatorDefault,
-            converter->texture_cache,
-            destination_buffer,
-            nullptr,
-            MTLPixelFormatR8Unorm,
-            output_width,
-            output_height,
-            0,
-            &y_reference);
-        CVMetalTextureRef uv_reference = nullptr;
-        CVReturn uv_status = CVMetalTextureCacheCreateTextureFromImage(
-            kCFAllocatorDefault,
-            converter->texture_cache,
-            destination_buffer,
-            nullptr,
-            MTLPixelFormatRG8Unorm,
-            output_width / 2,
-            output_height / 2,
-            1,
-            &uv_reference);
-        if (y_status != kCVReturnSuccess || uv_status != kCVReturnSuccess ||
-            y_reference == nullptr || uv_reference == nullptr) {
-            if (y_reference != nullptr) CFRelease(y_reference);
-            if (uv_reference != nullptr) CFRelease(uv_reference);
+        id<MTLTexture> source = source_texture(
+            converter, source_slot, source_surface, source_width, source_height);
+        if (source == nil) {
+            set_error(error_buffer, error_capacity, "source IOSurface texture creation failed");
+            return nullptr;
+        }
+        const DestinationTextures *destination =
+            destination_textures(converter, destination_buffer, output_width, output_height);
+        if (destination == nullptr) {
             set_error(error_buffer, error_capacity, "destination Metal texture creation failed");
-            return 4;
+            return nullptr;
         }
 
-        id<MTLTexture> y_texture = CVMetalTextureGetTexture(y_reference);
-        id<MTLTexture> uv_texture = CVMetalTextureGetTexture(uv_reference);
         id<MTLCommandBuffer> command_buffer = [converter->queue commandBuffer];
         id<MTLComputeCommandEncoder> encoder = [command_buffer computeCommandEncoder];
-        if (y_texture == nil || uv_texture == nil || command_buffer == nil || encoder == nil) {
-            CFRelease(y_reference);
-            CFRelease(uv_reference);
+        if (command_buffer == nil || encoder == nil) {
             set_error(error_buffer, error_capacity, "Metal command allocation failed");
-            return 5;
+            return nullptr;
         }
 
         ConversionParams params{
@@ -197,24 +327,72 @@ extern "C" int alvr_metal_converter_convert(
             output_width / 2,
             source_height,
             output_height,
+            downscale_taps(source_width / 2, output_width / 2),
+            downscale_taps(source_height, output_height),
         };
-        [encoder setComputePipelineState:converter->pipeline];
-        [encoder setTexture:source_texture atIndex:0];
-        [encoder setTexture:y_texture atIndex:1];
-        [encoder setTexture:uv_texture atIndex:2];
+        id<MTLComputePipelineState> pipeline =
+            pixel_format == kCVPixelFormatType_420YpCbCr10BiPlanarVideoRange
+            ? converter->p010_pipeline
+            : converter->pipeline;
+        [encoder setComputePipelineState:pipeline];
+        [encoder setTexture:source atIndex:0];
+        [encoder setTexture:CVMetalTextureGetTexture(destination->y_reference) atIndex:1];
+        [encoder setTexture:CVMetalTextureGetTexture(destination->uv_reference) atIndex:2];
         [encoder setBytes:&params length:sizeof(params) atIndex:0];
         MTLSize grid = MTLSizeMake(output_width / 2, output_height / 2, 1);
-        NSUInteger thread_width = converter->pipeline.threadExecutionWidth;
-        NSUInteger thread_height =
-            converter->pipeline.maxTotalThreadsPerThreadgroup / thread_width;
+        NSUInteger thread_width = pipeline.threadExecutionWidth;
+        NSUInteger thread_height = pipeline.maxTotalThreadsPerThreadgroup / thread_width;
         MTLSize threads = MTLSizeMake(thread_width, thread_height, 1);
         [encoder dispatchThreads:grid threadsPerThreadgroup:threads];
         [encoder endEncoding];
+
+        auto *conversion = new MetalConversion{
+            command_buffer,
+            dispatch_semaphore_create(0),
+            {false},
+            std::chrono::steady_clock::now(),
+            {},
+        };
+        // The conversion outlives the handler, finish waits for it before deleting
+        [command_buffer addCompletedHandler:^(id<MTLCommandBuffer>) {
+            conversion->completed = std::chrono::steady_clock::now();
+            conversion->complete.store(true, std::memory_order_release);
+            dispatch_semaphore_signal(conversion->done);
+        }];
         [command_buffer commit];
-        [command_buffer waitUntilCompleted];
-        CFRelease(y_reference);
-        CFRelease(uv_reference);
-        CVMetalTextureCacheFlush(converter->texture_cache, 0);
+        return conversion;
+    }
+}
+
+extern "C" int alvr_metal_conversion_is_complete(void *opaque_conversion) {
+    auto *conversion = static_cast<MetalConversion *>(opaque_conversion);
+    return conversion->complete.load(std::memory_order_acquire) ? 1 : 0;
+}
+
+// Waits for the conversion if needed and frees it, whatever the result
+extern "C" int alvr_metal_conversion_finish(
+    void *opaque_conversion,
+    uint64_t *wall_duration_ns,
+    uint64_t *gpu_duration_ns,
+    char *error_buffer,
+    size_t error_capacity) {
+    @autoreleasepool {
+        if (wall_duration_ns != nullptr) {
+            *wall_duration_ns = 0;
+        }
+        if (gpu_duration_ns != nullptr) {
+            *gpu_duration_ns = 0;
+        }
+        auto *conversion = static_cast<MetalConversion *>(opaque_conversion);
+        if (conversion == nullptr) {
+            set_error(error_buffer, error_capacity, "invalid Metal conversion");
+            return 1;
+        }
+        dispatch_semaphore_wait(conversion->done, DISPATCH_TIME_FOREVER);
+
+        id<MTLCommandBuffer> command_buffer = conversion->command_buffer;
+        auto wall = conversion->completed - conversion->submitted;
+        delete conversion;
 
         if (command_buffer.status != MTLCommandBufferStatusCompleted) {
             set_error(
@@ -224,6 +402,10 @@ extern "C" int alvr_metal_converter_convert(
                     ?: "Metal conversion command failed");
             return 6;
         }
+        if (wall_duration_ns != nullptr) {
+            *wall_duration_ns = static_cast<uint64_t>(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(wall).count());
+        }
         if (gpu_duration_ns != nullptr && command_buffer.GPUEndTime >= command_buffer.GPUStartTime) {
             *gpu_duration_ns = static_cast<uint64_t>(
                 (command_buffer.GPUEndTime - command_buffer.GPUStartTime) * 1'000'000'000.0);
@@ -359,6 +359,19 @@ pub fn run_native_source_probe(
     let mut closing_timeouts = 0;
     let mut exact_pose_wait_started: Option<Instant> = None;
 
+    macro_rules! add_dispatch {
+        ($dispatch:expr) => {
+            let dispatch = $dispatch;
+            encoded += dispatch.encoded;
+            transported += dispatch.transported;
+            encoded_bytes = encoded_bytes.saturating_add(dispatch.encoded_bytes);
+            transported_bytes = transported_bytes.saturating_add(dispatch.transported_bytes);
+            keyframes += dispatch.keyframes;
+            keyframe_bytes = keyframe_bytes.saturating_add(dispatch.keyframe_bytes);
+            max_frame_bytes = max_frame_bytes.max(dispatch.max_frame_bytes);
+        };
+    }
+
     macro_rules! report_cadence {
         () => {
             report(NativeCadenceReport {
@@ -537,8 +550,19 @@ pub fn run_native_source_probe(
             continue;
         };
 
-        let conversion_timing =
-            converter.convert(&frame, &lease, source.width(), source.height())?;
+        // The conversion runs on the GPU while the keyframe decision is made and the bitstream of
+        // earlier frames is sent. The lease only goes to VideoToolbox once the conversion is done.
+        let conversion = converter.submit(&frame, &lease, source.width(), source.height())?;
+        let requested_keyframe = sink
+            .as_mut()
+            .is_some_and(AlvrVideoSink::take_force_keyframe);
+        let force_keyframe = decoder_bootstrap_frame
+            || submitted % u64::from(config.probe.fps) == 0
+            || requested_keyframe;
+        if !conversion.is_complete() && encoder.pending_count() > 0 {
+            add_dispatch!(dispatch_outputs(encoder.drain_ready()?, &mut sink)?);
+        }
+        let conversion_timing = conversion.wait()?;
         conversion_total += conversion_timing.wall;
         conversion_max = conversion_max.max(conversion_timing.wall);
         conversion_gpu_total += conversion_timing.gpu;
@@ -551,12 +575,6 @@ pub fn run_native_source_probe(
             STATUS_PASS
         })?;
 
-        let requested_keyframe = sink
-            .as_mut()
-            .is_some_and(AlvrVideoSink::take_force_keyframe);
-        let force_keyframe = decoder_bootstrap_frame
-            || submitted % u64::from(config.probe.fps) == 0
-            || requested_keyframe;
         first_submitted_video_timestamp.get_or_insert(metadata.video_timestamp);
         last_submitted_video_timestamp = Some(metadata.video_timestamp);
         let outputs = encoder.submit(lease, metadata, force_keyframe)?;
@@ -571,14 +589,7 @@ pub fn run_native_source_probe(
                 );
             }
         }
-        let dispatch = dispatch_outputs(outputs, &mut sink)?;
-        encoded += dispatch.encoded;
-        transported += dispatch.transported;
-        encoded_bytes = encoded_bytes.saturating_add(dispatch.encoded_bytes);
-        transported_bytes = transported_bytes.saturating_add(dispatch.transported_bytes);
-        keyframes += dispatch.keyframes;
-        keyframe_bytes = keyframe_bytes.saturating_add(dispatch.keyframe_bytes);
-        max_frame_bytes = max_frame_bytes.max(dispatch.max_frame_bytes);
+        add_dispatch!(dispatch_outputs(outputs, &mut sink)?);
 
         if received % config.probe.telemetry_interval == 0 || close_after_frame {
             report_cadence!();
@@ -588,14 +599,7 @@ pub fn run_native_source_probe(
         }
     }
 
-    let dispatch = dispatch_outputs(encoder.finish()?, &mut sink)?;
-    encoded += dispatch.encoded;
-    transported += dispatch.transported;
-    encoded_bytes = encoded_bytes.saturating_add(dispatch.encoded_bytes);
-    transported_bytes = transported_bytes.saturating_add(dispatch.transported_bytes);
-    keyframes += dispatch.keyframes;
-    keyframe_bytes = keyframe_bytes.saturating_add(dispatch.keyframe_bytes);
-    max_frame_bytes = max_frame_bytes.max(dispatch.max_frame_bytes);
+    add_dispatch!(dispatch_outputs(encoder.finish()?, &mut sink)?);
     let pool_stats = pool.stats();
     ensure!(
         submitted == config.probe.frame_count,
@@ -4,6 +4,7 @@
 #include <IOSurface/IOSurface.h>
 #include <libproc.h>
 #include <mach/mach.h>
+#include <mach/mach_vm.h>
 #include <math.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -15,13 +16,26 @@
 
 #include "iosurface_handoff_protocol.h"
 
+#if __has_include(<os/os_sync_wait_on_address.h>)
+#include <os/os_sync_wait_on_address.h>
+#define NATIVE_SOURCE_HAS_OS_SYNC 1
+#endif
+
 enum
 {
     source_slot_count = 3,
     import_send_timeout_ms = 5000,
-    release_send_timeout_ms = 200
+    release_send_timeout_ms = 200,
+    /* Ring wait granularity when os_sync_wait_on_address is unavailable */
+    ring_poll_interval_us = 250
 };
 
+_Static_assert(ALVR_IOSURFACE_RING_CAPACITY >= source_slot_count,
+               "ring must hold a release for every slot");
+
+/* Reply port of frames received through the ring, released through the ring as well */
+#define ring_reply_port MACH_PORT_DEAD
+
 struct request_message
 {
     mach_msg_header_t header;
@@ -36,6 +50,15 @@ struct offer_message
     struct alvr_iosurface_offer payload;
 };
 
+struct ring_offer_message
+{
+    mach_msg_header_t header;
+    mach_msg_body_t body;
+    mach_msg_port_descriptor_t surface_port;
+    mach_msg_port_descriptor_t ring_port;
+    struct alvr_iosurface_offer payload;
+};
+
 struct frame_ready_message
 {
     mach_msg_header_t header;
@@ -98,6 +121,14 @@ struct alvr_native_source
     uint32_t producer_pid;
     uint32_t producer_pidversion;
     uint64_t producer_start_token;
+    uint32_t protocol_version;
+    bool streaming;
+    uint32_t frames_since_sample;
+    struct alvr_iosurface_ring *ring;
+    mach_vm_size_t ring_size;
+    mach_port_t ring_port;
+    uint32_t frame_tail;
+    uint32_t release_head;
     mach_port_t receive_port;
     struct source_slot slots[source_slot_count];
 };
@@ -299,7 +330,10 @@ static const char *import_request_rejection_reason(
     if (sender_pid <= 0) return "audit-pid";
     if (!sender_pidversion) return "audit-pidversion";
     if (!sender_start_token) return "process-start-token";
-    if (request->payload.protocol_version != ALVR_IOSURFACE_PROTOCOL_VERSION)
+    if (request->payload.protocol_version < ALVR_IOSURFACE_MIN_PROTOCOL_VERSION ||
+        request->payload.protocol_version > ALVR_IOSURFACE_PROTOCOL_VERSION ||
+        (source->protocol_version &&
+         request->payload.protocol_version != source->protocol_version))
         return "protocol-version";
     if (request->payload.session_nonce != source->session_nonce) return "session-nonce";
     if (request->payload.client_pid != (uint32_t)sender_pid) return "client-pid";
@@ -333,26 +367,44 @@ static kern_return_t receive_message(mach_port_t port,
 static kern_return_t send_offer(
     mach_port_t reply_port,
     mach_port_t surface_port,
+    mach_port_t ring_port,
     const struct alvr_iosurface_offer *offer,
     mach_msg_timeout_t timeout_ms)
 {
-    struct offer_message message = {0};
+    union
+    {
+        struct offer_message single;
+        struct ring_offer_message ring;
+    } message = {0};
     kern_return_t result;
 
-    message.header.msgh_bits =
+    /* Both layouts share the header and the surface descriptor */
+    message.single.header.msgh_bits =
         MACH_MSGH_BITS(MACH_MSG_TYPE_MOVE_SEND_ONCE, 0) |
         MACH_MSGH_BITS_COMPLEX;
-    message.header.msgh_size = sizeof(message);
-    message.header.msgh_remote_port = reply_port;
-    message.header.msgh_id = ALVR_IOSURFACE_MESSAGE_OFFER;
-    message.body.msgh_descriptor_count = 1;
-    message.surface_port.name = surface_port;
-    message.surface_port.disposition = MACH_MSG_TYPE_COPY_SEND;
-    message.surface_port.type = MACH_MSG_PORT_DESCRIPTOR;
-    message.payload = *offer;
-    result = mach_msg(&message.header,
+    message.single.header.msgh_remote_port = reply_port;
+    message.single.header.msgh_id = ALVR_IOSURFACE_MESSAGE_OFFER;
+    message.single.surface_port.name = surface_port;
+    message.single.surface_port.disposition = MACH_MSG_TYPE_COPY_SEND;
+    message.single.surface_port.type = MACH_MSG_PORT_DESCRIPTOR;
+    if (ring_port != MACH_PORT_NULL)
+    {
+        message.ring.header.msgh_size = sizeof(message.ring);
+        message.ring.body.msgh_descriptor_count = 2;
+        message.ring.ring_port.name = ring_port;
+        message.ring.ring_port.disposition = MACH_MSG_TYPE_COPY_SEND;
+        message.ring.ring_port.type = MACH_MSG_PORT_DESCRIPTOR;
+        message.ring.payload = *offer;
+    }
+    else
+    {
+        message.single.header.msgh_size = sizeof(message.single);
+        message.single.body.msgh_descriptor_count = 1;
+        message.single.payload = *offer;
+    }
+    result = mach_msg(&message.single.header,
                       MACH_SEND_MSG | MACH_SEND_TIMEOUT,
-                      message.header.msgh_size,
+                      message.single.header.msgh_size,
                       0,
                       MACH_PORT_NULL,
                       timeout_ms,
@@ -384,6 +436,117 @@ static kern_return_t send_release(
     return result;
 }
 
+static kern_return_t create_ring(struct alvr_native_source *source)
+{
+    mach_vm_address_t address = 0;
+    memory_object_size_t size = mach_vm_round_page(sizeof(struct alvr_iosurface_ring));
+    kern_return_t result;
+
+    result = mach_vm_allocate(mach_task_self(), &address, size, VM_FLAGS_ANYWHERE);
+    if (result != KERN_SUCCESS) return result;
+    result = mach_make_memory_entry_64(mach_task_self(),
+                                       &size,
+                                       address,
+                                       VM_PROT_READ | VM_PROT_WRITE | MAP_MEM_VM_SHARE,
+                                       &source->ring_port,
+                                       MACH_PORT_NULL);
+    if (result != KERN_SUCCESS)
+    {
+        source->ring_port = MACH_PORT_NULL;
+        mach_vm_deallocate(mach_task_self(), address, size);
+        return result;
+    }
+    source->ring = (struct alvr_iosurface_ring *)(uintptr_t)address;
+    source->ring_size = size;
+    return KERN_SUCCESS;
+}
+
+static void wait_on_ring_word(uint32_t *word, uint32_t value, uint32_t timeout_ms)
+{
+#ifdef NATIVE_SOURCE_HAS_OS_SYNC
+    if (__builtin_available(macOS 14.4, *))
+    {
+        os_sync_wait_on_address_with_timeout(word,
+                                             value,
+                                             sizeof(*word),
+                                             OS_SYNC_WAIT_ON_ADDRESS_SHARED,
+                                             OS_CLOCK_MACH_ABSOLUTE_TIME,
+                                             (uint64_t)timeout_ms * UINT64_C(1000000));
+        return;
+    }
+#endif
+    (void)word;
+    (void)value;
+    const uint64_t interval_us =
+        timeout_ms * UINT64_C(1000) < ring_poll_interval_us
+            ? timeout_ms * UINT64_C(1000)
+            : ring_poll_interval_us;
+    struct timespec interval = {0, (long)(interval_us * 1000)};
+    nanosleep(&interval, NULL);
+}
+
+static void wake_ring_word(uint32_t *word)
+{
+#ifdef NATIVE_SOURCE_HAS_OS_SYNC
+    if (__builtin_available(macOS 14.4, *))
+        os_sync_wake_by_address_any(word, sizeof(*word), OS_SYNC_WAKE_BY_ADDRESS_SHARED);
+#else
+    (void)word;
+#endif
+}
+
+static int next_ring_frame(struct alvr_native_source *source,
+                           uint32_t timeout_ms,
+                           uint64_t deadline_ms,
+                           struct alvr_iosurface_frame_ready *frame,
+                           char *error_buffer,
+                           size_t error_capacity)
+{
+    struct alvr_iosurface_ring *ring = source->ring;
+
+    for (;;)
+    {
+        const uint32_t head = __atomic_load_n(&ring->frame_head, __ATOMIC_ACQUIRE);
+        const mach_msg_timeout_t wait_timeout = deadline_ms
+            ? remaining_timeout(deadline_ms, timeout_ms)
+            : timeout_ms;
+
+        if (head != source->frame_tail)
+        {
+            if (head - source->frame_tail > ALVR_IOSURFACE_RING_CAPACITY)
+            {
+                set_error(error_buffer, error_capacity, "frame ring overrun");
+                return -3;
+            }
+            *frame = ring->frames[source->frame_tail % ALVR_IOSURFACE_RING_CAPACITY];
+            source->frame_tail++;
+            __atomic_store_n(&ring->frame_tail, source->frame_tail, __ATOMIC_RELEASE);
+            return 0;
+        }
+        if (!wait_timeout) return 1;
+        /* Pairs with the producer storing frame_head before loading consumer_waiting */
+        __atomic_store_n(&ring->consumer_waiting, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&ring->frame_head, __ATOMIC_SEQ_CST) == head)
+            wait_on_ring_word(&ring->frame_head, head, wait_timeout);
+        __atomic_store_n(&ring->consumer_waiting, 0, __ATOMIC_RELAXED);
+    }
+}
+
+static int release_ring_slot(struct alvr_native_source *source,
+                             const struct alvr_iosurface_slot_release *release)
+{
+    struct alvr_iosurface_ring *ring = source->ring;
+    const uint32_t tail = __atomic_load_n(&ring->release_tail, __ATOMIC_ACQUIRE);
+
+    if (source->release_head - tail >= ALVR_IOSURFACE_RING_CAPACITY) return -1;
+    ring->releases[source->release_head % ALVR_IOSURFACE_RING_CAPACITY] = *release;
+    source->release_head++;
+    __atomic_store_n(&ring->release_head, source->release_head, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->producer_waiting, __ATOMIC_SEQ_CST))
+        wake_ring_word(&ring->release_head);
+    return 0;
+}
+
 static uint32_t read_sample(IOSurfaceRef surface,
                             uint32_t x,
                             uint32_t y,
@@ -586,6 +749,17 @@ int alvr_native_source_accept(void *opaque_source,
         source->producer_pid = (uint32_t)sender_pid;
         source->producer_pidversion = sender_pidversion;
         source->producer_start_token = sender_start_token;
+        source->protocol_version = received.request.payload.protocol_version;
+        if (source->protocol_version >= 5 && !source->ring)
+        {
+            result = create_ring(source);
+            if (result != KERN_SUCCESS)
+            {
+                deallocate_port(&received.request.header.msgh_remote_port);
+                set_mach_error(error_buffer, error_capacity, "ring creation", result);
+                return -4;
+            }
+        }
 
         surface_port = IOSurfaceCreateMachPort(
             source->slots[slot_index].surface);
@@ -609,7 +783,7 @@ int alvr_native_source_accept(void *opaque_source,
         }
         offer.session_nonce = source->session_nonce;
         offer.frame_id = slot_index + 1;
-        offer.protocol_version = ALVR_IOSURFACE_PROTOCOL_VERSION;
+        offer.protocol_version = source->protocol_version;
         offer.slot_index = slot_index;
         offer.surface_id = source->slots[slot_index].surface_id;
         offer.width = source->width;
@@ -622,6 +796,7 @@ int alvr_native_source_accept(void *opaque_source,
         result = send_offer(
             received.request.header.msgh_remote_port,
             surface_port,
+            source->ring_port,
             &offer,
             send_timeout);
         received.request.header.msgh_remote_port = MACH_PORT_NULL;
@@ -656,31 +831,17 @@ uint64_t alvr_native_source_producer_start_token(void *opaque_source)
     return source ? source->producer_start_token : 0;
 }
 
-int alvr_native_source_next_frame(void *opaque_source,
-                                  uint32_t timeout_ms,
-                                  struct alvr_native_source_frame *output,
-                                  char *error_buffer,
-                                  size_t error_capacity)
+static int receive_frame_message(struct alvr_native_source *source,
+                                 uint32_t timeout_ms,
+                                 uint64_t deadline_ms,
+                                 union receive_message *received,
+                                 pid_t *sender_pid,
+                                 char *error_buffer,
+                                 size_t error_capacity)
 {
-    struct alvr_native_source *source = opaque_source;
-    union receive_message received;
-    const struct alvr_iosurface_frame_ready *frame;
-    struct source_slot *slot;
     kern_return_t result;
-    bool consumer_sample;
-    bool fallback_pose;
-    bool self_test;
-    bool startup_barrier;
-    pid_t sender_pid;
     uint32_t sender_pidversion;
-    const uint64_t started_ms = monotonic_milliseconds();
-    const uint64_t deadline_ms = started_ms ? started_ms + timeout_ms : 0;
 
-    if (!source || !output)
-    {
-        set_error(error_buffer, error_capacity, "invalid native source frame arguments");
-        return -1;
-    }
     for (;;)
     {
         const mach_msg_timeout_t receive_timeout = deadline_ms
@@ -690,7 +851,7 @@ int alvr_native_source_next_frame(void *opaque_source,
 
         if (!receive_timeout) return 1;
         result = receive_message(
-            source->receive_port, &received, receive_timeout);
+            source->receive_port, received, receive_timeout);
         if (result == MACH_RCV_TIMED_OUT || result == MACH_RCV_INTERRUPTED) return 1;
         if (result == MACH_RCV_TOO_LARGE)
         {
@@ -704,20 +865,20 @@ int alvr_native_source_next_frame(void *opaque_source,
             set_mach_error(error_buffer, error_capacity, "frame receive", result);
             return -2;
         }
-        sender_pid = message_sender_pid(&received.frame.header);
-        sender_pidversion = message_sender_pidversion(&received.frame.header);
-        if (received.frame.header.msgh_size != sizeof(struct frame_ready_message))
+        *sender_pid = message_sender_pid(&received->frame.header);
+        sender_pidversion = message_sender_pidversion(&received->frame.header);
+        if (received->frame.header.msgh_size != sizeof(struct frame_ready_message))
             rejection_reason = "message-size";
-        else if (received.frame.header.msgh_bits & MACH_MSGH_BITS_COMPLEX)
+        else if (received->frame.header.msgh_bits & MACH_MSGH_BITS_COMPLEX)
             rejection_reason = "complex-message";
-        else if (received.frame.header.msgh_id !=
+        else if (received->frame.header.msgh_id !=
                  ALVR_IOSURFACE_MESSAGE_FRAME_READY)
             rejection_reason = "message-id";
-        else if (!has_send_once_reply(&received.frame.header))
+        else if (!has_send_once_reply(&received->frame.header))
             rejection_reason = "reply-right";
-        else if (sender_pid <= 0)
+        else if (*sender_pid <= 0)
             rejection_reason = "audit-pid";
-        else if ((uint32_t)sender_pid != source->producer_pid)
+        else if ((uint32_t)*sender_pid != source->producer_pid)
             rejection_reason = "producer-pid";
         else if (sender_pidversion != source->producer_pidversion)
             rejection_reason = "producer-pidversion";
@@ -727,15 +888,68 @@ int alvr_native_source_next_frame(void *opaque_source,
                 "native_source rejected frame-ready reason=%s sender_pid=%d "
                 "producer_pid=%u sender_pidversion=%u producer_pidversion=%u\n",
                 rejection_reason,
-                sender_pid,
+                *sender_pid,
                 source->producer_pid,
                 sender_pidversion,
                 source->producer_pidversion);
-        mach_msg_destroy(&received.frame.header);
+        mach_msg_destroy(&received->frame.header);
+    }
+    return 0;
+}
+
+int alvr_native_source_next_frame(void *opaque_source,
+                                  uint32_t timeout_ms,
+                                  struct alvr_native_source_frame *output,
+                                  char *error_buffer,
+                                  size_t error_capacity)
+{
+    struct alvr_native_source *source = opaque_source;
+    union receive_message received;
+    struct alvr_iosurface_frame_ready ring_frame;
+    const struct alvr_iosurface_frame_ready *frame;
+    struct source_slot *slot;
+    mach_port_t reply_port;
+    bool consumer_sample;
+    bool fallback_pose;
+    bool self_test;
+    bool startup_barrier;
+    pid_t sender_pid;
+    const uint64_t started_ms = monotonic_milliseconds();
+    const uint64_t deadline_ms = started_ms ? started_ms + timeout_ms : 0;
+
+    if (!source || !output)
+    {
+        set_error(error_buffer, error_capacity, "invalid native source frame arguments");
+        return -1;
+    }
+    if (source->ring)
+    {
+        const int status = next_ring_frame(
+            source, timeout_ms, deadline_ms, &ring_frame, error_buffer, error_capacity);
+
+        if (status) return status;
+        frame = &ring_frame;
+        /* Only the audited producer was given the ring */
+        sender_pid = (pid_t)source->producer_pid;
+        reply_port = ring_reply_port;
+    }
+    else
+    {
+        const int status = receive_frame_message(source,
+                                                 timeout_ms,
+                                                 deadline_ms,
+                                                 &received,
+                                                 &sender_pid,
+                                                 error_buffer,
+                                                 error_capacity);
+
+        if (status) return status;
+        frame = &received.frame.payload;
+        reply_port = received.frame.header.msgh_remote_port;
+        received.frame.header.msgh_remote_port = MACH_PORT_NULL;
     }
 
     memset(output, 0, sizeof(*output));
-    frame = &received.frame.payload;
     output->frame_id = frame->frame_id;
     output->video_timestamp_ns = frame->video_timestamp_ns;
     output->pose_timestamp_ns = frame->pose_timestamp_ns;
@@ -750,11 +964,10 @@ int alvr_native_source_next_frame(void *opaque_source,
     output->sample_x = frame->sample_x;
     output->sample_y = frame->sample_y;
     memcpy(output->expected_bgra, frame->expected_bgra, 4);
-    output->reply_port = received.frame.header.msgh_remote_port;
-    received.frame.header.msgh_remote_port = MACH_PORT_NULL;
+    output->reply_port = reply_port;
     output->validation_status = ALVR_IOSURFACE_PROBE_PASS;
 
-    if (frame->protocol_version != ALVR_IOSURFACE_PROTOCOL_VERSION ||
+    if (frame->protocol_version != source->protocol_version ||
         frame->session_nonce != source->session_nonce ||
         frame->slot_index >= source_slot_count ||
         sender_pid <= 0 ||
@@ -780,6 +993,24 @@ int alvr_native_source_next_frame(void *opaque_source,
         output->validation_status = ALVR_IOSURFACE_PROBE_PROTOCOL_MISMATCH;
     if (startup_barrier && (self_test || consumer_sample || fallback_pose))
         output->validation_status = ALVR_IOSURFACE_PROBE_PROTOCOL_MISMATCH;
+    if (source->protocol_version >= 4 && source->streaming)
+    {
+        /* Zero CPU touch mode, see ALVR_IOSURFACE_CONSUMER_SAMPLE_INTERVAL */
+        if (self_test)
+            output->validation_status = ALVR_IOSURFACE_PROBE_PROTOCOL_MISMATCH;
+        if (source->frames_since_sample < ALVR_IOSURFACE_CONSUMER_SAMPLE_INTERVAL)
+            source->frames_since_sample++;
+        if (consumer_sample)
+        {
+            if (source->frames_since_sample < ALVR_IOSURFACE_CONSUMER_SAMPLE_INTERVAL)
+            {
+                consumer_sample = false;
+                output->flags &= ~(uint32_t)ALVR_IOSURFACE_FRAME_CONSUMER_SAMPLE;
+            }
+            else
+                source->frames_since_sample = 0;
+        }
+    }
     if (frame->surface_id != slot->surface_id || frame->width != source->width ||
         frame->height != source->height ||
         frame->generation <= slot->last_generation ||
@@ -813,6 +1044,11 @@ int alvr_native_source_next_frame(void *opaque_source,
     {
         slot->last_generation = frame->generation;
         source->last_frame_id = frame->frame_id;
+        if (startup_barrier && !source->streaming)
+        {
+            source->streaming = true;
+            source->frames_since_sample = ALVR_IOSURFACE_CONSUMER_SAMPLE_INTERVAL;
+        }
         if (!self_test && !startup_barrier)
         {
             source->last_video_timestamp_ns = frame->video_timestamp_ns;
@@ -851,7 +1087,7 @@ int alvr_native_source_release(void *opaque_source,
     frame->reply_port = MACH_PORT_NULL;
     release.session_nonce = source->session_nonce;
     release.frame_id = frame->frame_id;
-    release.protocol_version = ALVR_IOSURFACE_PROTOCOL_VERSION;
+    release.protocol_version = source->protocol_version;
     release.slot_index = frame->slot_index;
     release.generation = frame->generation;
     release.status = frame->slot_index < source_slot_count
@@ -860,6 +1096,15 @@ int alvr_native_source_release(void *opaque_source,
     release.surface_id = frame->surface_id;
     release.consumer_pid = getpid();
     memcpy(release.actual_bgra, frame->actual_bgra, 4);
+    if (reply_port == ring_reply_port)
+    {
+        if (!source->ring || release_ring_slot(source, &release) != 0)
+        {
+            set_error(error_buffer, error_capacity, "slot release ring is full");
+            return -2;
+        }
+        return 0;
+    }
     result = send_release(reply_port, &release);
     if (result != KERN_SUCCESS)
     {
@@ -875,6 +1120,11 @@ void alvr_native_source_destroy(void *opaque_source)
 
     if (!source) return;
     destroy_receive_port(&source->receive_port);
+    deallocate_port(&source->ring_port);
+    if (source->ring)
+        mach_vm_deallocate(mach_task_self(),
+                           (mach_vm_address_t)(uintptr_t)source->ring,
+                           source->ring_size);
     for (uint32_t index = 0; index < source_slot_count; ++index)
     {
         if (source->slots[index].surface)
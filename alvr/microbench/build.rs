@@ -0,0 +1,52 @@
+use std::path::PathBuf;
+
+// The benchmarked sources of the server, which only call into the Rust side through the video, log
+// and settings functions that cpp/Stubs.cpp provides instead
+const SERVER_SOURCES: &[&str] = &[
+    "ALVR-common/exception.cpp",
+    "alvr_server/NalIndex.cpp",
+    "alvr_server/NalParsing.cpp",
+    "alvr_server/PoseHistory.cpp",
+    "alvr_server/StartupTimeline.cpp",
+];
+
+fn main() {
+    let platform_name = std::env::var("CARGO_CFG_TARGET_OS").unwrap();
+    let server_cpp_dir = PathBuf::from("../server_openvr/cpp");
+
+    let benchmark_paths = std::fs::read_dir("cpp")
+        .unwrap()
+        .filter_map(|maybe_entry| maybe_entry.ok())
+        .map(|entry| entry.path())
+        .collect::<Vec<_>>();
+    let server_paths = SERVER_SOURCES
+        .iter()
+        .map(|path| server_cpp_dir.join(path))
+        .collect::<Vec<_>>();
+
+    let mut build = cc::Build::new();
+    build
+        .cpp(true)
+        .std("c++17")
+        .files(
+            benchmark_paths
+                .iter()
+                .filter(|path| path.extension().is_some_and(|ext| ext == "cpp")),
+        )
+        .files(&server_paths)
+        .include(alvr_filesystem::workspace_dir().join("openvr/headers"))
+        .include(&server_cpp_dir);
+
+    if platform_name == "windows" {
+        build
+            .flag("/permissive-")
+            .define("NOMINMAX", None)
+            .define("_WINSOCKAPI_", None);
+    }
+
+    build.compile("alvr_microbench");
+
+    for path in benchmark_paths.iter().chain(&server_paths) {
+        println!("cargo:rerun-if-changed={}", path.to_string_lossy());
+    }
+}
@@ -0,0 +1,109 @@
+#include "Benchmark.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <memory>
+
+namespace bench {
+
+namespace {
+
+const uint64_t MAX_ITERATIONS = 1'000'000'000;
+
+std::vector<std::unique_ptr<Benchmark>>& Registry() {
+    static std::vector<std::unique_ptr<Benchmark>> registry;
+    return registry;
+}
+
+std::string FormatRate(double perSecond, const char* unit) {
+    const char* prefixes[] = { "", "k", "M", "G" };
+    size_t prefix = 0;
+    while (perSecond >= 1000 && prefix + 1 < std::size(prefixes)) {
+        perSecond /= 1000;
+        prefix++;
+    }
+    char text[64];
+    snprintf(text, sizeof(text), "%.2f %s%s/s", perSecond, prefixes[prefix], unit);
+    return text;
+}
+
+// Grows the iteration count until a run takes minTime, like Google Benchmark
+void Run(const Benchmark& benchmark, int64_t arg, bool hasArg, double minTime) {
+    std::string name = benchmark.Name();
+    if (hasArg) {
+        name += "/" + std::to_string(arg);
+    }
+
+    uint64_t iterations = 1;
+    for (;;) {
+        State state(iterations, arg);
+        benchmark.Fn()(state);
+        double elapsed = state.ElapsedSeconds();
+
+        if (elapsed >= minTime || iterations >= MAX_ITERATIONS) {
+            std::string rate;
+            if (state.Bytes() > 0) {
+                rate = FormatRate(state.Bytes() / elapsed, "B");
+            } else if (state.Items() > 0) {
+                rate = FormatRate(state.Items() / elapsed, "items");
+            }
+            printf(
+                "%-48s %12.1f ns %12llu %s\n",
+                name.c_str(),
+                elapsed * 1e9 / iterations,
+                (unsigned long long)iterations,
+                rate.c_str()
+            );
+            fflush(stdout);
+            return;
+        }
+
+        // Aim a bit past minTime so that the next run is the last one, growing at most 10 times
+        double scale = elapsed > 0 ? minTime * 1.4 / elapsed : 10;
+        uint64_t next = (uint64_t)(iterations * std::clamp(scale, 2.0, 10.0));
+        iterations = std::min(std::max(next, iterations + 1), MAX_ITERATIONS);
+    }
+}
+
+}
+
+Benchmark* RegisterBenchmark(const char* name, BenchmarkFn fn) {
+    Registry().push_back(std::make_unique<Benchmark>(name, fn));
+    return Registry().back().get();
+}
+
+}
+
+// Usage: alvr_microbench [--min-time=<seconds>] [filter], filter being a part of the names of the
+// benchmarks to run
+extern "C" int alvr_microbench_main(int argc, const char* const* argv) {
+    double minTime = 0.5;
+    const char* filter = "";
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--min-time=", 11) == 0) {
+            minTime = atof(argv[i] + 11);
+        } else if (argv[i][0] == '-') {
+            fprintf(stderr, "usage: alvr_microbench [--min-time=<seconds>] [filter]\n");
+            return 1;
+        } else {
+            filter = argv[i];
+        }
+    }
+
+    printf("%-48s %15s %12s\n", "Benchmark", "Time", "Iterations");
+    for (const auto& benchmark : bench::Registry()) {
+        if (benchmark->Name().find(filter) == std::string::npos) {
+            continue;
+        }
+        if (benchmark->Args().empty()) {
+            bench::Run(*benchmark, 0, false, minTime);
+        }
+        for (int64_t arg : benchmark->Args()) {
+            bench::Run(*benchmark, arg, true, minTime);
+        }
+    }
+    return 0;
+}
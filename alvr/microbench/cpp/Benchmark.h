@@ -0,0 +1,147 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// Minimal harness with the interface of Google Benchmark, for the CPU helpers of the server:
+//
+//     void BM_Name(bench::State& state) {
+//         // fixture, not timed
+//         for (auto _ : state) {
+//             // timed
+//         }
+//     }
+//     BENCHMARK(BM_Name)->Arg(360);
+//
+// Each benchmark runs with growing iteration counts until a run takes the minimum time, and that
+// run is reported as the time per iteration.
+namespace bench {
+
+class State {
+public:
+    class Iterator {
+    public:
+        Iterator(State* state, uint64_t remaining)
+            : m_state(state)
+            , m_remaining(remaining) { }
+
+        bool operator!=(const Iterator&) {
+            if (m_remaining != 0) {
+                return true;
+            }
+            m_state->StopTiming();
+            return false;
+        }
+        void operator++() { m_remaining--; }
+        // The user provided destructor keeps compilers from warning about the unused loop variable
+        struct Value {
+            ~Value() { }
+        };
+        Value operator*() const { return {}; }
+
+    private:
+        State* m_state;
+        uint64_t m_remaining;
+    };
+
+    State(uint64_t iterations, int64_t arg)
+        : m_iterations(iterations)
+        , m_arg(arg) { }
+
+    Iterator begin() {
+        ResumeTiming();
+        return Iterator(this, m_iterations);
+    }
+    Iterator end() { return Iterator(this, 0); }
+
+    // Excludes the work between the two calls from the time of the loop
+    void PauseTiming() { StopTiming(); }
+    void ResumeTiming() { m_start = std::chrono::steady_clock::now(); }
+
+    // Totals over all the iterations, reported per second
+    void SetBytesProcessed(uint64_t bytes) { m_bytes = bytes; }
+    void SetItemsProcessed(uint64_t items) { m_items = items; }
+
+    uint64_t iterations() const { return m_iterations; }
+    // Argument given to Arg(), 0 without one
+    int64_t range(int index = 0) const {
+        (void)index;
+        return m_arg;
+    }
+
+    double ElapsedSeconds() const { return m_elapsed.count(); }
+    uint64_t Bytes() const { return m_bytes; }
+    uint64_t Items() const { return m_items; }
+
+private:
+    void StopTiming() {
+        m_elapsed += std::chrono::steady_clock::now() - m_start;
+    }
+
+    uint64_t m_iterations;
+    int64_t m_arg;
+    std::chrono::steady_clock::time_point m_start;
+    std::chrono::duration<double> m_elapsed {};
+    uint64_t m_bytes = 0;
+    uint64_t m_items = 0;
+};
+
+typedef void (*BenchmarkFn)(State& state);
+
+class Benchmark {
+public:
+    Benchmark(const char* name, BenchmarkFn fn)
+        : m_name(name)
+        , m_fn(fn) { }
+
+    // Runs the benchmark once per argument
+    Benchmark* Arg(int64_t arg) {
+        m_args.push_back(arg);
+        return this;
+    }
+
+    const std::string& Name() const { return m_name; }
+    BenchmarkFn Fn() const { return m_fn; }
+    const std::vector<int64_t>& Args() const { return m_args; }
+
+private:
+    std::string m_name;
+    BenchmarkFn m_fn;
+    std::vector<int64_t> m_args;
+};
+
+Benchmark* RegisterBenchmark(const char* name, BenchmarkFn fn);
+
+// Keeps the compiler from optimizing away the computation of value
+template <typename T> inline void DoNotOptimize(const T& value) {
+#ifdef _MSC_VER
+    static const volatile void* sink;
+    sink = &value;
+    _ReadWriteBarrier();
+#else
+    asm volatile("" : : "r,m"(value) : "memory");
+#endif
+}
+
+// Keeps the compiler from optimizing away the writes to memory done so far
+inline void ClobberMemory() {
+#ifdef _MSC_VER
+    _ReadWriteBarrier();
+#else
+    asm volatile("" : : : "memory");
+#endif
+}
+
+}
+
+#define BENCHMARK_CONCAT_(a, b) a##b
+#define BENCHMARK_CONCAT(a, b) BENCHMARK_CONCAT_(a, b)
+#define BENCHMARK(fn)                                                                              \
+    [[maybe_unused]] static bench::Benchmark* BENCHMARK_CONCAT(benchmark_, __LINE__)               \
+        = bench::RegisterBenchmark(#fn, fn)
@@ -0,0 +1,75 @@
+#include "Benchmark.h"
+
+#include "alvr_server/Utils.h"
+#include "alvr_server/include/openvr_math.h"
+
+#include <cmath>
+#include <vector>
+
+namespace {
+
+const size_t INPUT_COUNT = 256;
+
+std::vector<vr::HmdQuaternion_t> Quaternions() {
+    std::vector<vr::HmdQuaternion_t> quaternions;
+    for (size_t i = 0; i < INPUT_COUNT; i++) {
+        double yawPitchRoll[3] = { i * 0.05, std::sin(i * 0.1) * 0.5, std::cos(i * 0.3) * 0.1 };
+        quaternions.push_back(EulerAngleToQuaternion(yawPitchRoll));
+    }
+    return quaternions;
+}
+
+std::vector<vr::HmdMatrix34_t> Matrices() {
+    std::vector<vr::HmdMatrix34_t> matrices;
+    for (const auto& q : Quaternions()) {
+        vr::HmdMatrix34_t matrix;
+        HmdMatrix_QuatToMat(q.w, q.x, q.y, q.z, &matrix);
+        matrices.push_back(matrix);
+    }
+    return matrices;
+}
+
+void BM_HmdMatrix_QuatToMat(bench::State& state) {
+    std::vector<vr::HmdQuaternion_t> quaternions = Quaternions();
+
+    size_t index = 0;
+    vr::HmdMatrix34_t matrix;
+    for (auto _ : state) {
+        const auto& q = quaternions[index];
+        HmdMatrix_QuatToMat(q.w, q.x, q.y, q.z, &matrix);
+        bench::DoNotOptimize(matrix);
+        index = (index + 1) % INPUT_COUNT;
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_HmdMatrix_QuatToMat);
+
+void BM_Vrmath_MatMul33(bench::State& state) {
+    std::vector<vr::HmdMatrix34_t> matrices = Matrices();
+
+    size_t index = 0;
+    for (auto _ : state) {
+        vr::HmdMatrix34_t result
+            = vrmath::matMul33(matrices[index], matrices[(index + 1) % INPUT_COUNT]);
+        bench::DoNotOptimize(result);
+        index = (index + 1) % INPUT_COUNT;
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_Vrmath_MatMul33);
+
+void BM_Vrmath_MatMul33Vector(bench::State& state) {
+    std::vector<vr::HmdMatrix34_t> matrices = Matrices();
+    vr::HmdVector3_t vector = { 0.1f, 1.7f, -0.3f };
+
+    size_t index = 0;
+    for (auto _ : state) {
+        vr::HmdVector3_t result = vrmath::matMul33(matrices[index], vector);
+        bench::DoNotOptimize(result);
+        index = (index + 1) % INPUT_COUNT;
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_Vrmath_MatMul33Vector);
+
+}
@@ -0,0 +1,157 @@
+#include "Benchmark.h"
+
+#include "ALVR-common/packet_types.h"
+#include "alvr_server/NalIndex.h"
+#include "alvr_server/bindings.h"
+
+#include <random>
+#include <vector>
+
+namespace {
+
+// Sizes of the access units of a 30 Mbps stream at 90 fps, with an IDR 6 times the P frames
+const size_t IDR_SIZE = 200 * 1024;
+const size_t P_FRAME_SIZE = 32 * 1024;
+
+uint64_t g_sentBytes = 0;
+
+void CountingSink(unsigned long long targetTimestampNs, int len, bool isIdr, bool lastSlice) {
+    (void)targetTimestampNs;
+    (void)isIdr;
+    (void)lastSlice;
+    g_sentBytes += len;
+}
+
+// Payload bytes are never 0, so that they can't contain a start code
+void AppendPayload(std::vector<unsigned char>& au, size_t size, std::mt19937& random) {
+    std::uniform_int_distribution<int> byte(1, 255);
+    for (size_t i = 0; i < size; i++) {
+        au.push_back((unsigned char)byte(random));
+    }
+}
+
+void AppendNal(
+    std::vector<unsigned char>& au,
+    std::initializer_list<unsigned char> header,
+    size_t payloadSize,
+    std::mt19937& random
+) {
+    au.insert(au.end(), { 0, 0, 0, 1 });
+    au.insert(au.end(), header);
+    AppendPayload(au, payloadSize, random);
+}
+
+// AUD, SPS, PPS, SEI and the slices of the frame, like NVENC and x264 output them
+std::vector<unsigned char> MakeAccessUnit(int codec, bool idr, size_t size) {
+    std::mt19937 random(codec * 2 + idr);
+    std::vector<unsigned char> au;
+    if (codec == ALVR_CODEC_H264) {
+        AppendNal(au, { 0x09, 0xf0 }, 0, random);
+        if (idr) {
+            AppendNal(au, { 0x67 }, 24, random);
+            AppendNal(au, { 0x68 }, 4, random);
+            AppendNal(au, { 0x06 }, 640, random);
+        }
+        AppendNal(au, { (unsigned char)(idr ? 0x65 : 0x41) }, size - au.size() - 5, random);
+    } else {
+        AppendNal(au, { 0x46, 0x01 }, 1, random);
+        if (idr) {
+            AppendNal(au, { 0x40, 0x01 }, 20, random);
+            AppendNal(au, { 0x42, 0x01 }, 40, random);
+            AppendNal(au, { 0x44, 0x01 }, 6, random);
+            AppendNal(au, { 0x4e, 0x01 }, 640, random);
+        }
+        AppendNal(au, { (unsigned char)(idr ? 0x26 : 0x02), 0x01 }, size - au.size() - 6, random);
+    }
+    return au;
+}
+
+void RunParseFrameNals(bench::State& state, int codec, bool idr, size_t size, bool newConfig) {
+    std::vector<unsigned char> au = MakeAccessUnit(codec, idr, size);
+    SetVideoSink(CountingSink);
+    ResetVideoConfigNals();
+
+    for (auto _ : state) {
+        if (newConfig) {
+            ResetVideoConfigNals();
+        }
+        ParseFrameNals(codec, au.data(), au.size(), 0, idr);
+    }
+    bench::DoNotOptimize(g_sentBytes);
+    state.SetBytesProcessed(state.iterations() * au.size());
+    SetVideoSink(nullptr);
+}
+
+// The encoder repeats the same configuration before each IDR, which isn't sent again
+void BM_ParseFrameNals_H264Idr(bench::State& state) {
+    RunParseFrameNals(state, ALVR_CODEC_H264, true, IDR_SIZE, false);
+}
+BENCHMARK(BM_ParseFrameNals_H264Idr);
+
+void BM_ParseFrameNals_H264IdrNewConfig(bench::State& state) {
+    RunParseFrameNals(state, ALVR_CODEC_H264, true, IDR_SIZE, true);
+}
+BENCHMARK(BM_ParseFrameNals_H264IdrNewConfig);
+
+void BM_ParseFrameNals_H264P(bench::State& state) {
+    RunParseFrameNals(state, ALVR_CODEC_H264, false, P_FRAME_SIZE, false);
+}
+BENCHMARK(BM_ParseFrameNals_H264P);
+
+void BM_ParseFrameNals_HevcIdr(bench::State& state) {
+    RunParseFrameNals(state, ALVR_CODEC_HEVC, true, IDR_SIZE, false);
+}
+BENCHMARK(BM_ParseFrameNals_HevcIdr);
+
+void BM_ParseFrameNals_HevcP(bench::State& state) {
+    RunParseFrameNals(state, ALVR_CODEC_HEVC, false, P_FRAME_SIZE, false);
+}
+BENCHMARK(BM_ParseFrameNals_HevcP);
+
+// Temporal delimiter, sequence header and frame OBU. The temporal delimiter is removed in place,
+// so the temporal unit is copied back before each iteration, outside of the timing.
+void BM_ParseFrameNals_Av1Key(bench::State& state) {
+    std::mt19937 random(0);
+    std::vector<unsigned char> tu = { 0x12, 0x00, 0x0a, 0x0b };
+    AppendPayload(tu, 11, random);
+    size_t frameSize = IDR_SIZE - tu.size() - 4;
+    tu.insert(
+        tu.end(),
+        { 0x32,
+          (unsigned char)(0x80 | (frameSize & 0x7f)),
+          (unsigned char)(0x80 | ((frameSize >> 7) & 0x7f)),
+          (unsigned char)(frameSize >> 14) }
+    );
+    AppendPayload(tu, frameSize, random);
+
+    std::vector<unsigned char> buf = tu;
+    SetVideoSink(CountingSink);
+    ResetVideoConfigNals();
+
+    for (auto _ : state) {
+        ParseFrameNals(ALVR_CODEC_AV1, buf.data(), buf.size(), 0, true);
+
+        state.PauseTiming();
+        buf = tu;
+        state.ResumeTiming();
+    }
+    bench::DoNotOptimize(g_sentBytes);
+    state.SetBytesProcessed(state.iterations() * tu.size());
+    SetVideoSink(nullptr);
+}
+BENCHMARK(BM_ParseFrameNals_Av1Key);
+
+// Scan of all the start codes of the access unit
+void BM_IndexNals_H264Idr(bench::State& state) {
+    std::vector<unsigned char> au = MakeAccessUnit(ALVR_CODEC_H264, true, IDR_SIZE);
+    std::vector<NalUnit> nals;
+
+    for (auto _ : state) {
+        IndexNals(ALVR_CODEC_H264, au.data(), au.size(), nals);
+        bench::DoNotOptimize(nals.data());
+    }
+    state.SetBytesProcessed(state.iterations() * au.size());
+}
+BENCHMARK(BM_IndexNals_H264Idr);
+
+}
@@ -0,0 +1,147 @@
+#include "Benchmark.h"
+
+#include "alvr_server/PoseHistory.h"
+#include "alvr_server/Utils.h"
+
+#include <cmath>
+#include <memory>
+#include <vector>
+
+namespace {
+
+// Poses of the head at 90 Hz, turning and nodding like during a game
+const uint64_t POSE_INTERVAL_NS = 11'111'111;
+const size_t MOTION_COUNT = 1024;
+
+FfiDeviceMotion HeadMotion(size_t index) {
+    double t = index * POSE_INTERVAL_NS * 1e-9;
+    double yawPitchRoll[3] = {
+        0.8 * std::sin(t * 0.7),
+        0.3 * std::sin(t * 1.3 + 1.0),
+        0.05 * std::sin(t * 2.1),
+    };
+    vr::HmdQuaternion_t q = EulerAngleToQuaternion(yawPitchRoll);
+
+    FfiDeviceMotion motion = {};
+    motion.pose.orientation = { (float)q.x, (float)q.y, (float)q.z, (float)q.w };
+    motion.pose.position[1] = 1.7f;
+    motion.angularVelocity[1] = (float)(0.56 * std::cos(t * 0.7));
+    return motion;
+}
+
+const std::vector<FfiDeviceMotion>& HeadMotions() {
+    static std::vector<FfiDeviceMotion> motions = [] {
+        std::vector<FfiDeviceMotion> motions;
+        for (size_t i = 0; i < MOTION_COUNT; i++) {
+            motions.push_back(HeadMotion(i));
+        }
+        return motions;
+    }();
+    return motions;
+}
+
+// History holding count poses, the timestamp of the pose i is i * POSE_INTERVAL_NS
+std::unique_ptr<PoseHistory> MakeHistory(size_t count, std::vector<uint32_t>* tags = nullptr) {
+    auto history = std::make_unique<PoseHistory>();
+    const auto& motions = HeadMotions();
+    for (size_t i = 0; i < count; i++) {
+        uint32_t tag
+            = history->OnPoseUpdated((i + 1) * POSE_INTERVAL_NS, motions[i % MOTION_COUNT]);
+        if (tags != nullptr) {
+            tags->push_back(tag);
+        }
+    }
+    return history;
+}
+
+// With a full history, each pose overwrites the oldest one
+void BM_PoseHistory_OnPoseUpdated(bench::State& state) {
+    size_t count = state.range(0);
+    auto history = MakeHistory(count);
+    const auto& motions = HeadMotions();
+
+    size_t index = count;
+    for (auto _ : state) {
+        index++;
+        bench::DoNotOptimize(
+            history->OnPoseUpdated(index * POSE_INTERVAL_NS, motions[index % MOTION_COUNT])
+        );
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_PoseHistory_OnPoseUpdated)->Arg(360);
+
+// The compositor renders with the exact poses of the history, in the order they were submitted
+void BM_PoseHistory_GetBestPoseMatch(bench::State& state) {
+    size_t count = state.range(0);
+    auto history = MakeHistory(count);
+
+    std::vector<vr::HmdMatrix34_t> queries;
+    for (size_t i = 0; i < count; i++) {
+        queries.push_back(history->GetPoseAt((i + 1) * POSE_INTERVAL_NS)->rotationMatrix);
+    }
+
+    size_t index = 0;
+    for (auto _ : state) {
+        bench::DoNotOptimize(history->GetBestPoseMatch(queries[index]));
+        index = (index + 1) % count;
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_PoseHistory_GetBestPoseMatch)->Arg(1)->Arg(90)->Arg(360);
+
+// Poses in between the ones of the history never match exactly, so the whole history is compared
+void BM_PoseHistory_GetBestPoseMatchNearest(bench::State& state) {
+    size_t count = state.range(0);
+    auto history = MakeHistory(count);
+
+    std::vector<vr::HmdMatrix34_t> queries;
+    for (size_t i = 0; i < count; i++) {
+        FfiQuat q = HeadMotion(i).pose.orientation;
+        FfiQuat next = HeadMotion(i + 1).pose.orientation;
+        vr::HmdMatrix34_t matrix;
+        HmdMatrix_QuatToMat(
+            (q.w + next.w) / 2, (q.x + next.x) / 2, (q.y + next.y) / 2, (q.z + next.z) / 2, &matrix
+        );
+        queries.push_back(matrix);
+    }
+
+    size_t index = 0;
+    for (auto _ : state) {
+        bench::DoNotOptimize(history->GetBestPoseMatch(queries[index]));
+        index = (index + 1) % count;
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_PoseHistory_GetBestPoseMatchNearest)->Arg(90)->Arg(360);
+
+void BM_PoseHistory_GetPoseByTag(bench::State& state) {
+    size_t count = state.range(0);
+    std::vector<uint32_t> tags;
+    auto history = MakeHistory(count, &tags);
+
+    size_t index = 0;
+    for (auto _ : state) {
+        bench::DoNotOptimize(history->GetPoseByTag(tags[index]));
+        index = (index + 1) % count;
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_PoseHistory_GetPoseByTag)->Arg(360);
+
+// Timestamps in between the poses, interpolated
+void BM_PoseHistory_Sample(bench::State& state) {
+    size_t count = state.range(0);
+    auto history = MakeHistory(count);
+
+    size_t index = 0;
+    for (auto _ : state) {
+        uint64_t timestampNs = (index + 1) * POSE_INTERVAL_NS + POSE_INTERVAL_NS / 3;
+        bench::DoNotOptimize(history->Sample(timestampNs));
+        index = (index + 1) % count;
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_PoseHistory_Sample)->Arg(360);
+
+}
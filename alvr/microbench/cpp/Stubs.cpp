@@ -0,0 +1,111 @@
+#include "alvr_server/Logger.h"
+#include "alvr_server/bindings.h"
+
+#include <cstdarg>
+#include <cstdio>
+
+// Stand-ins for what the Rust side of the server, alvr_server.cpp and Logger.cpp provide to the
+// benchmarked sources. Logs go to stderr and the video is dropped, the benchmarks read it from a
+// video sink.
+
+// Default settings, which leave out temporal layers
+static Settings g_settings = {};
+
+const Settings* Settings_Instance() { return &g_settings; }
+
+static void log(const char* level, const char* format, va_list args) {
+    fprintf(stderr, "%s: ", level);
+    vfprintf(stderr, format, args);
+    fprintf(stderr, "\n");
+}
+
+Exception MakeException(const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    Exception e = FormatExceptionV(format, args);
+    va_end(args);
+    return e;
+}
+
+void Error(const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    log("error", format, args);
+    va_end(args);
+}
+
+void Warn(const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    log("warning", format, args);
+    va_end(args);
+}
+
+void Info(const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    log("info", format, args);
+    va_end(args);
+}
+
+void LogPeriod(const char* tag, const char* format, ...) {
+    (void)tag;
+    va_list args;
+    va_start(args, format);
+    log("info", format, args);
+    va_end(args);
+}
+
+extern "C" void SetVideoConfigNals(const unsigned char* configBuffer, int len, int codec) {
+    (void)configBuffer;
+    (void)len;
+    (void)codec;
+}
+
+extern "C" void VideoSend(
+    unsigned long long targetTimestampNs,
+    unsigned char* buf,
+    int len,
+    bool isIdr,
+    unsigned int temporalLayer
+) {
+    (void)targetTimestampNs;
+    (void)buf;
+    (void)len;
+    (void)isIdr;
+    (void)temporalLayer;
+}
+
+extern "C" void VideoSendSlice(
+    unsigned long long targetTimestampNs,
+    unsigned char* buf,
+    int len,
+    bool isIdr,
+    unsigned int temporalLayer,
+    bool firstSlice,
+    bool lastSlice
+) {
+    (void)targetTimestampNs;
+    (void)buf;
+    (void)len;
+    (void)isIdr;
+    (void)temporalLayer;
+    (void)firstSlice;
+    (void)lastSlice;
+}
+
+extern "C" void VideoSendLent(
+    unsigned long long targetTimestampNs,
+    const unsigned char* buf,
+    int len,
+    bool isIdr,
+    unsigned int temporalLayer,
+    unsigned long long handle
+) {
+    (void)targetTimestampNs;
+    (void)buf;
+    (void)len;
+    (void)isIdr;
+    (void)temporalLayer;
+    ReleaseVideoBuffer(handle);
+}
@@ -0,0 +1,19 @@
+use std::{
+    env,
+    ffi::{CString, c_char, c_int},
+    process,
+};
+
+unsafe extern "C" {
+    fn alvr_microbench_main(argc: c_int, argv: *const *const c_char) -> c_int;
+}
+
+fn main() {
+    let args = env::args()
+        .map(|arg| CString::new(arg).unwrap())
+        .collect::<Vec<_>>();
+    let argv = args.iter().map(|arg| arg.as_ptr()).collect::<Vec<_>>();
+
+    let code = unsafe { alvr_microbench_main(argv.len() as c_int, argv.as_ptr()) };
+    process::exit(code);
+}
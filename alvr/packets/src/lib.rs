@@ -22,10 +22,14 @@ pub const HAPTICS: u16 = 1;
 pub const AUDIO: u16 = 2;
 pub const VIDEO: u16 = 3;
 pub const STATISTICS: u16 = 4;
+pub const DEPTH: u16 = 5;
 
-#[derive(Serialize, Deserialize, Clone)]
+#[derive(Serialize, Deserialize, Clone, Default)]
+#[serde(default)]
 pub struct VideoStreamingCapabilitiesExt {
-    // Nothing for now
+    // The client reads the foveation center shift of the video packets, see
+    // write_foveation_center_shift
+    pub foveation_center_shift: bool,
 }
 
 #[derive(Serialize, Deserialize, Clone)]
@@ -53,11 +57,7 @@ impl VideoStreamingCapabilities {
     }
 
     pub fn ext(&self) -> Result<VideoStreamingCapabilitiesExt> {
-        let _ext_json = json::from_str::<json::Value>(&self.ext_str)?;
-
-        // decode values here
-
-        Ok(VideoStreamingCapabilitiesExt {})
+        Ok(json::from_str(&self.ext_str)?)
     }
 }
 
@@ -75,9 +75,16 @@ pub enum ClientConnectionResult {
     ClientStandby,
 }
 
-#[derive(Serialize, Deserialize)]
+#[derive(Serialize, Deserialize, Default)]
+#[serde(default)]
 pub struct NegotiatedStreamingConfigExt {
-    // Nothing for now
+    // The server handles ClientControlPacketExt::RequestRecovery
+    pub stream_recovery: bool,
+    // The server handles ClientControlPacketExt::ReportLostFrames
+    pub lost_frame_reports: bool,
+    // The video packets start with the foveation center shift their frame was compressed with,
+    // which follows the eye gaze. See write_foveation_center_shift.
+    pub foveation_center_shift: bool,
 }
 
 #[derive(Serialize, Deserialize, Clone)]
@@ -101,11 +108,7 @@ impl ClientNegotiatedStreamingConfig {
     }
 
     pub fn ext(&self) -> Result<NegotiatedStreamingConfigExt> {
-        let _ext_json = json::from_str::<json::Value>(&self.ext_str)?;
-
-        // decode values here
-
-        Ok(NegotiatedStreamingConfigExt {})
+        Ok(json::from_str(&self.ext_str)?)
     }
 }
 
@@ -206,6 +209,28 @@ pub enum ClientControlPacket {
     ReservedBuffer(Vec<u8>),
 }
 
+// Packets added after the Reserved variants of ClientControlPacket, sent as JSON in
+// ClientControlPacket::Reserved so that the enum keeps its encoding. Only sent to servers that
+// negotiated them, see NegotiatedStreamingConfigExt.
+#[derive(Serialize, Deserialize)]
+pub enum ClientControlPacketExt {
+    // Frames were lost. Unlike RequestIdr, the server may repair the stream without an IDR frame.
+    RequestRecovery,
+    // Frames after last_received_timestamp were lost, the server may predict the next ones from it
+    ReportLostFrames { last_received_timestamp: Duration },
+}
+
+impl ClientControlPacketExt {
+    pub fn to_packet(&self) -> ClientControlPacket {
+        ClientControlPacket::Reserved(json::to_string(self).unwrap())
+    }
+
+    // None for reserved packets of other extensions
+    pub fn from_reserved(data: &str) -> Option<Self> {
+        json::from_str(data).ok()
+    }
+}
+
 #[derive(Serialize, Deserialize, Clone, Debug)]
 pub enum FaceExpressions {
     Fb(Vec<f32>), // 70 values
@@ -239,9 +264,53 @@ pub struct TrackingData {
 pub struct VideoPacketHeader {
     pub timestamp: Duration,
     pub global_view_params: [ViewParams; 2],
+    // Also set on the recovery frame that follows a ReportLostFrames, which references nothing the
+    // client lost: the stream is clean again from this frame
     pub is_idr: bool,
 }
 
+pub const FOVEATION_CENTER_SHIFT_SIZE: usize = 16;
+
+// Foveated encoding center shift the frame was compressed with, per view, written at the start of
+// the payload of the video packets when NegotiatedStreamingConfigExt::foveation_center_shift is
+// set. Like the center shift setting, the right view one is mirrored horizontally. buffer must be
+// at least FOVEATION_CENTER_SHIFT_SIZE bytes.
+pub fn write_foveation_center_shift(center_shift: [Vec2; 2], buffer: &mut [u8]) {
+    let values = [
+        center_shift[0].x,
+        center_shift[0].y,
+        center_shift[1].x,
+        center_shift[1].y,
+    ];
+    for (chunk, value) in buffer.chunks_exact_mut(4).zip(values) {
+        chunk.copy_from_slice(&value.to_le_bytes());
+    }
+}
+
+// The center shift and the NALs after it, None if the payload is too short
+pub fn read_foveation_center_shift(payload: &[u8]) -> Option<([Vec2; 2], &[u8])> {
+    let (prefix, nal) = payload.split_at_checked(FOVEATION_CENTER_SHIFT_SIZE)?;
+    let mut values = prefix
+        .chunks_exact(4)
+        .map(|chunk| f32::from_le_bytes(chunk.try_into().unwrap()));
+    let mut next_shift = || Some(Vec2::new(values.next()?, values.next()?));
+
+    Some(([next_shift()?, next_shift()?], nal))
+}
+
+// Low resolution depth of the frame with the same timestamp, the views side by side. Each texel is
+// the nearest depth of its block of the depth buffer the game submitted. The payload is width *
+// height little endian u16, the depth buffer values in unorm16.
+#[derive(Serialize, Deserialize, Clone)]
+pub struct DepthPlaneHeader {
+    pub timestamp: Duration,
+    pub width: u32,
+    pub height: u32,
+    // Row-major projections the game rendered the views with, they give the view space depth of the
+    // depth buffer values
+    pub projections: [[f32; 16]; 2],
+}
+
 #[derive(Serialize, Deserialize)]
 pub struct Haptics {
     pub device_id: u64,
@@ -325,6 +394,13 @@ pub enum FirewallRulesAction {
     Remove,
 }
 
+#[derive(Serialize, Deserialize, PartialEq, Clone, Default)]
+#[serde(default)]
+pub struct RealTimeConfigExt {
+    // Display refresh rate the server switched the stream to, None to keep the current one
+    pub refresh_rate: Option<f32>,
+}
+
 // Note: server sends a packet to the client at low frequency, binary encoding, without ensuring
 // compatibility between different versions, even if within the same major version.
 #[derive(Serialize, Deserialize, PartialEq, Clone)]
@@ -347,7 +423,18 @@ impl RealTimeConfig {
                 .into_option(),
             cpu_performance_level: settings.headset.performance_level.clone().cpu.into_option(),
             gpu_performance_level: settings.headset.performance_level.clone().gpu.into_option(),
-            ext_str: String::new(), // No extensions for now
+            ext_str: String::new(),
         }
     }
+
+    pub fn with_ext(self, ext: RealTimeConfigExt) -> Self {
+        Self {
+            ext_str: json::to_string(&ext).unwrap(),
+            ..self
+        }
+    }
+
+    pub fn ext(&self) -> Result<RealTimeConfigExt> {
+        Ok(json::from_str(&self.ext_str)?)
+    }
 }
@@ -10,10 +10,54 @@ use std::{
 };
 
 const UPDATE_INTERVAL: Duration = Duration::from_secs(1);
+// Relative change of the throughput estimate that updates the frame size cap with a constant
+// bitrate
+const THROUGHPUT_CHANGE_THRESHOLD: f32 = 0.2;
 
 pub struct DynamicEncoderParams {
     pub bitrate_bps: f32,
     pub framerate: f32,
+    // Refresh rate of the stream, which the encoders are configured with
+    pub refresh_rate: f32,
+    // Fraction of the nominal encoding resolution, in (0, 1]
+    pub resolution_scale: f32,
+    // Largest encoded frame, IDR frames included, 0 if not capped
+    pub max_frame_bytes: u64,
+}
+
+// Bitrate limits of the running application, in place of the ones of the settings
+#[derive(Clone, Copy, Default, PartialEq)]
+pub struct BitrateBounds {
+    pub min_mbps: Option<u64>,
+    pub max_mbps: Option<u64>,
+}
+
+impl BitrateBounds {
+    // A constant bitrate is clamped, the adaptive limits are replaced
+    pub fn apply(&self, config: &mut BitrateConfig) {
+        match &mut config.mode {
+            BitrateMode::ConstantMbps(bitrate_mbps) => {
+                if let Some(max) = self.max_mbps {
+                    *bitrate_mbps = u64::min(*bitrate_mbps, max);
+                }
+                if let Some(min) = self.min_mbps {
+                    *bitrate_mbps = u64::max(*bitrate_mbps, min);
+                }
+            }
+            BitrateMode::Adaptive {
+                max_throughput_mbps,
+                min_throughput_mbps,
+                ..
+            } => {
+                if let Some(max) = self.max_mbps {
+                    *max_throughput_mbps = Switch::Enabled(max);
+                }
+                if let Some(min) = self.min_mbps {
+                    *min_throughput_mbps = Switch::Enabled(min);
+                }
+            }
+        }
+    }
 }
 
 pub struct BitrateManager {
@@ -30,6 +74,9 @@ pub struct BitrateManager {
     last_update_instant: Instant,
     dynamic_decoder_max_bytes_per_frame: f32,
     previous_config: Option<BitrateConfig>,
+    resolution_scale: f32,
+    // Throughput estimate of the last update
+    throughput_bps: f32,
     update_needed: bool,
 }
 
@@ -56,6 +103,8 @@ impl BitrateManager {
             last_update_instant: Instant::now(),
             dynamic_decoder_max_bytes_per_frame: f32::MAX,
             previous_config: None,
+            resolution_scale: 1.0,
+            throughput_bps: 0.0,
             update_needed: true,
         }
     }
@@ -147,24 +196,63 @@ impl BitrateManager {
         }
     }
 
+    // The framerate the bitrate is spread over when it doesn't adapt to the measured one
+    pub fn set_nominal_framerate(&mut self, framerate: f32) {
+        let interval = Duration::from_secs_f32(1. / framerate);
+        if interval != self.nominal_frame_interval {
+            self.nominal_frame_interval = interval;
+            self.update_needed = true;
+        }
+    }
+
+    // The encoders switch to the new resolution in place, starting with an IDR
+    pub fn set_resolution_scale(&mut self, scale: f32) {
+        // clamp() keeps NaN, which the encoders would convert to a size
+        if !scale.is_finite() {
+            return;
+        }
+        let scale = scale.clamp(0.1, 1.0);
+        if scale != self.resolution_scale {
+            self.resolution_scale = scale;
+            self.update_needed = true;
+        }
+    }
+
     pub fn get_encoder_params(
         &mut self,
         config: &BitrateConfig,
     ) -> Option<(DynamicEncoderParams, BitrateDirectives)> {
         let now = Instant::now();
 
+        // Measured on the frames sent back to back, it doesn't depend on the bitrate mode. Zero
+        // while there is no usable latency sample to divide by
+        let network_latency_s = self.network_latency_average.get_average().as_secs_f32();
+        let throughput_bps =
+            Some(self.packet_bytes_average.get_average() * 8.0 / network_latency_s)
+                .filter(|bps| network_latency_s > 0.0 && bps.is_finite())
+                .unwrap_or(0.0);
+        // A constant bitrate is only pushed again for the frame size cap. The first valid
+        // measurement always counts as a change, there is nothing to compare it to
+        let throughput_changed = config.max_frame_size.enabled()
+            && if self.throughput_bps > 0.0 {
+                (throughput_bps / self.throughput_bps - 1.0).abs() > THROUGHPUT_CHANGE_THRESHOLD
+            } else {
+                throughput_bps > 0.0
+            };
+
         if self.previous_config.as_ref() != Some(config) {
             self.previous_config = Some(config.clone());
             // Continue method. Always update bitrate in this case
         } else if !self.update_needed
             && (now < self.last_update_instant + UPDATE_INTERVAL
-                || matches!(config.mode, BitrateMode::ConstantMbps(_)))
+                || matches!(config.mode, BitrateMode::ConstantMbps(_)) && !throughput_changed)
         {
             return None;
         }
 
         self.last_update_instant = now;
         self.update_needed = false;
+        self.throughput_bps = throughput_bps;
 
         let frame_interval = if config.adapt_to_framerate.enabled() {
             self.frame_interval_average.get_average()
@@ -243,10 +331,25 @@ impl BitrateManager {
 
         bitrate_directives.requested_bitrate_bps = bitrate_bps;
 
+        // Not capped until the throughput has been measured, the average frame size alone would
+        // cap every IDR frame
+        let max_frame_bytes = if let Switch::Enabled(intervals) = config.max_frame_size
+            && throughput_bps > 0.0
+        {
+            let interval_s = frame_interval.as_secs_f32();
+            // Rate control can't get frames below the average size
+            (f32::max(throughput_bps * intervals, bitrate_bps) * interval_s / 8.0) as u64
+        } else {
+            0
+        };
+
         Some((
             DynamicEncoderParams {
                 bitrate_bps,
                 framerate: 1.0 / f32::min(frame_interval.as_secs_f32(), 1.0),
+                refresh_rate: 1.0 / self.nominal_frame_interval.as_secs_f32(),
+                resolution_scale: self.resolution_scale,
+                max_frame_bytes,
             },
             bitrate_directives,
         ))
@@ -94,6 +94,10 @@ pub struct AlvrDeviceConfig {
 pub struct AlvrDynamicEncoderParams {
     bitrate_bps: f32,
     framerate: f32,
+    refresh_rate: f32,
+    resolution_scale: f32,
+    // Largest encoded frame, 0 if not capped
+    max_frame_bytes: u64,
 }
 
 #[repr(C)]
@@ -310,7 +314,9 @@ pub unsafe extern "C" fn alvr_poll_event(out_event: *mut AlvrEvent, timeout_ns:
                 BUTTONS_QUEUE.lock().push_back(entries);
                 unsafe { *out_event = AlvrEvent::ButtonsUpdated };
             }
-            ServerCoreEvent::RequestIDR => unsafe { *out_event = AlvrEvent::RequestIDR },
+            ServerCoreEvent::RequestIDR
+            | ServerCoreEvent::RequestRecovery
+            | ServerCoreEvent::LostFrames { .. } => unsafe { *out_event = AlvrEvent::RequestIDR },
             ServerCoreEvent::CaptureFrame => unsafe { *out_event = AlvrEvent::CaptureFrame },
             ServerCoreEvent::RestartPending => unsafe {
                 *out_event = AlvrEvent::RestartPending;
@@ -319,6 +325,7 @@ pub unsafe extern "C" fn alvr_poll_event(out_event: *mut AlvrEvent, timeout_ns:
                 *out_event = AlvrEvent::ShutdownPending;
             },
             ServerCoreEvent::RawButtons(_)
+            | ServerCoreEvent::LogGpuMemory
             | ServerCoreEvent::GameRenderLatencyFeedback(_)
             | ServerCoreEvent::SetOpenvrProperty { .. } => {} // implementation not needed
             ServerCoreEvent::ProximityState(headset_is_worn) => unsafe {
@@ -504,7 +511,9 @@ pub unsafe extern "C" fn alvr_send_video_nal(
         context.send_video_nal(
             Duration::from_nanos(timestamp_ns),
             global_view_params,
+            None,
             is_idr,
+            0,
             buffer.to_vec(),
         );
     }
@@ -521,6 +530,9 @@ pub unsafe extern "C" fn alvr_get_dynamic_encoder_params(
         unsafe {
             (*out_params).bitrate_bps = params.bitrate_bps;
             (*out_params).framerate = params.framerate;
+            (*out_params).refresh_rate = params.refresh_rate;
+            (*out_params).resolution_scale = params.resolution_scale;
+            (*out_params).max_frame_bytes = params.max_frame_bytes;
         }
 
         true
@@ -529,6 +541,14 @@ pub unsafe extern "C" fn alvr_get_dynamic_encoder_params(
     }
 }
 
+/// Fraction of the nominal encoding resolution, applied by the encoders starting with an IDR
+#[unsafe(no_mangle)]
+pub extern "C" fn alvr_set_encoding_resolution_scale(scale: f32) {
+    if let Some(context) = &*SERVER_CORE_CONTEXT.read() {
+        context.set_encoding_resolution_scale(scale);
+    }
+}
+
 #[unsafe(no_mangle)]
 pub extern "C" fn alvr_report_composed(timestamp_ns: u64, offset_ns: u64) {
     if let Some(context) = &*SERVER_CORE_CONTEXT.read() {
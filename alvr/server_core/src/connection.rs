@@ -1,5 +1,5 @@
 use crate::{
-    ConnectionContext, FILESYSTEM_LAYOUT, SESSION_MANAGER, ServerCoreEvent,
+    ConnectionContext, FILESYSTEM_LAYOUT, RefreshRates, SESSION_MANAGER, ServerCoreEvent,
     ServerNegotiatedStreamingConfig,
     bitrate::BitrateManager,
     input_mapping::ButtonMappingManager,
@@ -20,13 +20,14 @@ use alvr_common::{
 use alvr_events::{AdbEvent, ButtonEvent, EventType};
 use alvr_packets::{
     AUDIO, ButtonEntry, ClientConnectionResult, ClientConnectionsAction, ClientControlPacket,
-    ClientNegotiatedStreamingConfig, ClientStatistics, HAPTICS, NegotiatedStreamingConfigExt,
-    RealTimeConfig, STATISTICS, ServerControlPacket, StreamConfigPacket, TRACKING, TrackingData,
-    VIDEO, VideoPacketHeader,
+    ClientControlPacketExt, ClientNegotiatedStreamingConfig, ClientStatistics, DEPTH,
+    FOVEATION_CENTER_SHIFT_SIZE, HAPTICS, NegotiatedStreamingConfigExt, RealTimeConfig, STATISTICS,
+    ServerControlPacket, StreamConfigPacket, TRACKING, TrackingData, VIDEO, VideoPacketHeader,
+    write_foveation_center_shift,
 };
 use alvr_session::{
-    BodyTrackingSinkConfig, CodecType, ControllersEmulationMode, FrameSize, H264Profile, Settings,
-    SocketProtocol, SteamvrHmdInitConfig,
+    BodyTrackingSinkConfig, CodecType, ControllersEmulationMode, FoveationShape, FrameSize,
+    H264Profile, Settings, SocketProtocol, SteamvrHmdInitConfig,
 };
 use alvr_sockets::{
     CONTROL_PORT, KEEPALIVE_INTERVAL, KEEPALIVE_TIMEOUT, ProtoControlSocket, SocketConnection,
@@ -37,7 +38,7 @@ use std::{
     hash::{Hash, Hasher},
     net::{IpAddr, Ipv4Addr},
     process::Command,
-    sync::{Arc, mpsc::RecvTimeoutError},
+    sync::{Arc, atomic::Ordering, mpsc::RecvTimeoutError},
     thread,
     time::{Duration, Instant},
 };
@@ -49,9 +50,12 @@ const REAL_TIME_UPDATE_INTERVAL: Duration = Duration::from_secs(1);
 
 const MAX_UNREAD_PACKETS: usize = 10; // Applies per stream
 
+// Encoded frame. The payload can be memory lent by the encoder, given back when it is dropped.
 pub struct VideoPacket {
     pub header: VideoPacketHeader,
-    pub payload: Vec<u8>,
+    // Only sent if the client negotiated it, see write_foveation_center_shift
+    pub foveation_center_shift: [Vec2; 2],
+    pub payload: Box<dyn AsRef<[u8]> + Send>,
 }
 
 fn align32(value: f32) -> u32 {
@@ -123,6 +127,11 @@ pub fn compute_restart_settings_hash(
     let mut foveation_center_shift_y = 0.0_f32;
     let mut foveation_edge_ratio_x = 0.0_f32;
     let mut foveation_edge_ratio_y = 0.0_f32;
+    let mut foveation_radial = None;
+    let mut foveation_follow_eye_gaze = false;
+    let mut foveation_compress_periphery = false;
+    let mut foveation_periphery_qp_offset = None;
+    let mut foveation_periphery_target_qp = None;
     let enable_foveated_encoding =
         if let Switch::Enabled(config) = &settings.video.foveated_encoding {
             foveation_center_size_x = config.center_size_x;
@@ -131,6 +140,17 @@ pub fn compute_restart_settings_hash(
             foveation_center_shift_y = config.center_shift_y;
             foveation_edge_ratio_x = config.edge_ratio_x;
             foveation_edge_ratio_y = config.edge_ratio_y;
+            if let FoveationShape::Radial {
+                center_radius,
+                edge_ratio,
+            } = config.shape
+            {
+                foveation_radial = Some((center_radius.to_bits(), edge_ratio.to_bits()));
+            }
+            foveation_follow_eye_gaze = config.follow_eye_gaze;
+            foveation_compress_periphery = config.compress_periphery;
+            foveation_periphery_qp_offset = config.periphery_qp_offset.as_option().copied();
+            foveation_periphery_target_qp = config.periphery_target_qp.as_option().copied();
             true
         } else {
             false
@@ -173,20 +193,56 @@ pub fn compute_restart_settings_hash(
     steamvr_hmd_init_config.refresh_rate.hash(&mut h);
     // Pre-init settings fields (read directly from settings)
     settings.video.adapter_index.hash(&mut h);
+    settings.video.encode_adapter_index.as_option().hash(&mut h);
     settings.headset.tracking_ref_only.hash(&mut h);
     settings.headset.enable_vive_tracker_proxy.hash(&mut h);
     settings.extra.patches.linux_async_compute.hash(&mut h);
     settings.extra.patches.linux_async_reprojection.hash(&mut h);
+    settings.extra.patches.late_latching.hash(&mut h);
+    settings.extra.patches.linux_encoder_output_images.hash(&mut h);
+    settings.extra.patches.compact_gpu_memory.hash(&mut h);
+    settings.extra.patches.linux_mailbox_present.hash(&mut h);
+    settings
+        .extra
+        .patches
+        .linux_swapchain_images
+        .as_option()
+        .hash(&mut h);
+    settings.extra.patches.linux_present_sync_files.hash(&mut h);
+    settings.extra.patches.linux_vaapi_shader_conversion.hash(&mut h);
+    settings
+        .extra
+        .capture
+        .secondary_video_stream
+        .as_option()
+        .map(|config| (config.height, config.bitrate_mbps))
+        .hash(&mut h);
     // Encoder / codec
     (settings.video.preferred_codec as u8).hash(&mut h);
     (enc.h264_profile as u32).hash(&mut h);
     (enc.rate_control_mode as u32).hash(&mut h);
     enc.filler_data.hash(&mut h);
+    enc.slices_per_frame.hash(&mut h);
+    enc.tile_columns.hash(&mut h);
+    enc.tile_rows.hash(&mut h);
+    enc.temporal_layers.hash(&mut h);
+    enc.skip_static_frames.hash(&mut h);
+    enc.scene_change_detection.hash(&mut h);
+    enc.drop_late_frames.hash(&mut h);
+    settings.video.power_saving.hash(&mut h);
+    enc.adaptive_quality
+        .as_option()
+        .map(|config| (config.min_resolution_scale.to_bits(), config.lower_refresh_rate))
+        .hash(&mut h);
+    enc.overlay_qp_offset.as_option().hash(&mut h);
+    enc.static_block_qp_offset.as_option().hash(&mut h);
     (enc.entropy_coding as u32).hash(&mut h);
     (enc.quality_preset as u32).hash(&mut h);
     enc.enable_vbaq.hash(&mut h);
     enc.use_10bit.hash(&mut h);
     enc.encoding_gamma.map(f32::to_bits).hash(&mut h);
+    enc.vulkan_video.hash(&mut h);
+    (enc.force_backend as u32).hash(&mut h);
     enc.software.force_software_encoding.hash(&mut h);
     enc.software.thread_count.hash(&mut h);
     // HDR
@@ -199,11 +255,14 @@ pub fn compute_restart_settings_hash(
     amf.use_preproc.hash(&mut h);
     amf.preproc_sigma.hash(&mut h);
     amf.preproc_tor.hash(&mut h);
+    // VPL
+    enc.vpl.async_depth.hash(&mut h);
     // NVENC
     (nvenc.quality_preset as u32).hash(&mut h);
     (nvenc.tuning_preset as u32).hash(&mut h);
     (nvenc.multi_pass as u32).hash(&mut h);
     (nvenc.adaptive_quantization_mode as u32).hash(&mut h);
+    (nvenc.split_encode_mode as u32).hash(&mut h);
     nvenc.low_delay_key_frame_scale.hash(&mut h);
     nvenc.refresh_rate.hash(&mut h);
     nvenc.enable_intra_refresh.hash(&mut h);
@@ -218,6 +277,8 @@ pub fn compute_restart_settings_hash(
     nvenc.rc_max_bitrate.hash(&mut h);
     nvenc.rc_average_bitrate.hash(&mut h);
     nvenc.enable_weighted_prediction.hash(&mut h);
+    nvenc.head_motion_hints.hash(&mut h);
+    nvenc.yuv_input.hash(&mut h);
     // Foveated encoding
     enable_foveated_encoding.hash(&mut h);
     foveation_center_size_x.to_bits().hash(&mut h);
@@ -226,6 +287,11 @@ pub fn compute_restart_settings_hash(
     foveation_center_shift_y.to_bits().hash(&mut h);
     foveation_edge_ratio_x.to_bits().hash(&mut h);
     foveation_edge_ratio_y.to_bits().hash(&mut h);
+    foveation_radial.hash(&mut h);
+    foveation_follow_eye_gaze.hash(&mut h);
+    foveation_compress_periphery.hash(&mut h);
+    foveation_periphery_qp_offset.hash(&mut h);
+    foveation_periphery_target_qp.hash(&mut h);
     // Color correction
     enable_color_correction.hash(&mut h);
     brightness.to_bits().hash(&mut h);
@@ -233,6 +299,19 @@ pub fn compute_restart_settings_hash(
     saturation.to_bits().hash(&mut h);
     gamma.to_bits().hash(&mut h);
     sharpening.to_bits().hash(&mut h);
+    settings
+        .video
+        .hidden_area_mask
+        .as_option()
+        .map(|config| config.visible_size.to_bits())
+        .hash(&mut h);
+    settings.video.high_quality_downscaling.hash(&mut h);
+    settings
+        .video
+        .temporal_denoise
+        .as_option()
+        .map(|config| (config.strength.to_bits(), config.tolerance.to_bits()))
+        .hash(&mut h);
     // Controllers
     controllers_enabled.hash(&mut h);
     controller_is_tracker.hash(&mut h);
@@ -243,6 +322,16 @@ pub fn compute_restart_settings_hash(
     body_tracking_has_legs.hash(&mut h);
     // Misc
     settings.connection.minimum_idr_interval_ms.hash(&mut h);
+    settings
+        .connection
+        .intra_refresh_recovery_frames
+        .as_option()
+        .hash(&mut h);
+    settings.connection.avoid_video_glitching.hash(&mut h);
+    settings
+        .connection
+        .reference_frame_invalidation
+        .hash(&mut h);
     settings.extra.capture.capture_frame_dir.hash(&mut h);
     settings.video.bitrate.image_corruption_fix.hash(&mut h);
     // Debug groups
@@ -677,14 +766,27 @@ fn connection_pipeline(
         if let Switch::Enabled(config) = &initial_settings.video.foveated_encoding {
             let enable = streaming_caps.foveated_encoding || config.force_enable;
 
-            if !enable {
+            if !enable && config.compress_periphery {
                 warn!("Foveated encoding is not supported by the client.");
             }
 
-            enable
+            // The periphery QP offset alone doesn't need the client
+            enable && config.compress_periphery
         } else {
             false
         };
+    // The frames only carry their center shift if it follows the gaze and the client reads it
+    let foveation_center_shift = enable_foveated_encoding
+        && initial_settings
+            .video
+            .foveated_encoding
+            .as_option()
+            .is_some_and(|config| config.follow_eye_gaze)
+        && streaming_caps
+            .ext()
+            .is_ok_and(|ext| ext.foveation_center_shift);
+    ctx.foveation_center_shift
+        .store(foveation_center_shift, Ordering::Relaxed);
 
     let encoder_profile = if initial_settings.video.encoder_config.h264_profile == H264Profile::High
     {
@@ -790,7 +892,11 @@ fn connection_pipeline(
             wired,
             ext_str: String::new(),
         }
-        .with_ext(NegotiatedStreamingConfigExt {}),
+        .with_ext(NegotiatedStreamingConfigExt {
+            stream_recovery: true,
+            lost_frame_reports: true,
+            foveation_center_shift,
+        }),
     )
     .to_con()?;
 
@@ -851,6 +957,15 @@ fn connection_pipeline(
     ));
     *ctx.bitrate_manager.lock() =
         BitrateManager::new(initial_settings.video.bitrate.history_size, fps);
+    *ctx.refresh_rates.lock() = RefreshRates {
+        supported: streaming_caps
+            .refresh_rates
+            .iter()
+            .copied()
+            .filter(|rate| *rate <= fps)
+            .collect(),
+        current: fps,
+    };
     *ctx.tracking_manager.write() =
         TrackingManager::new(initial_settings.connection.statistics_history_size);
 
@@ -860,6 +975,7 @@ fn connection_pipeline(
     let mut video_sender = socket.request_unreliable_stream(VIDEO);
     let game_audio_sender: alvr_sockets::StreamSender<()> = socket.request_unreliable_stream(AUDIO);
     let haptics_sender = socket.request_unreliable_stream(HAPTICS);
+    let depth_sender = socket.request_unreliable_stream(DEPTH);
 
     let mut control_receiver = socket.subscribe_to_reliable_stream()?;
     let mut microphone_receiver: alvr_sockets::StreamReceiver<()> =
@@ -873,6 +989,7 @@ fn connection_pipeline(
         std::sync::mpsc::sync_channel(initial_settings.connection.max_queued_server_video_frames);
     *ctx.video_channel_sender.lock() = Some(video_channel_sender);
     *ctx.haptics_sender.lock() = Some(haptics_sender);
+    *ctx.depth_sender.lock() = Some(depth_sender);
 
     let video_send_thread = thread::spawn({
         let ctx = Arc::clone(&ctx);
@@ -881,6 +998,7 @@ fn connection_pipeline(
             while is_streaming(&client_hostname) {
                 let VideoPacket {
                     mut header,
+                    foveation_center_shift: center_shift,
                     payload,
                 } = match video_channel_receiver.recv_timeout(STREAMING_RECV_TIMEOUT) {
                     Ok(packet) => packet,
@@ -892,15 +1010,31 @@ fn connection_pipeline(
                     .read()
                     .unrecenter_view_params(&mut header.global_view_params);
 
-                // todo: use get_buffer and make encoder write to socket buffers directly to avoid copy
-                if let Err(error) = video_sender.send_header_with_payload(&header, &payload) {
+                let payload: &[u8] = (*payload).as_ref();
+
+                // todo: make encoder write to socket buffers directly to avoid copy
+                let prefix_size = if foveation_center_shift {
+                    FOVEATION_CENTER_SHIFT_SIZE
+                } else {
+                    0
+                };
+                let result = video_sender
+                    .get_buffer(&header, prefix_size + payload.len())
+                    .and_then(|mut buffer| {
+                        write_foveation_center_shift(center_shift, &mut buffer[..prefix_size]);
+                        buffer[prefix_size..].copy_from_slice(payload);
+                        video_sender.send(buffer)
+                    });
+                if let Err(error) = result {
                     warn!(
                         "Failed to send video packet: bytes={}, idr={}, timestamp_ns={}, error={error:?}",
                         payload.len(),
                         header.is_idr,
                         header.timestamp.as_nanos(),
                     );
-                    ctx.events_sender.send(ServerCoreEvent::RequestIDR).ok();
+                    ctx.events_sender
+                        .send(ServerCoreEvent::RequestRecovery)
+                        .ok();
                 }
             }
         }
@@ -1326,7 +1460,26 @@ fn connection_pipeline(
                             .send(ServerCoreEvent::ProximityState(headset_is_worn))
                             .ok();
                     }
-                    ClientControlPacket::Reserved(_) | ClientControlPacket::ReservedBuffer(_) => (),
+                    ClientControlPacket::Reserved(data) => {
+                        match ClientControlPacketExt::from_reserved(&data) {
+                            Some(ClientControlPacketExt::RequestRecovery) => {
+                                ctx.events_sender
+                                    .send(ServerCoreEvent::RequestRecovery)
+                                    .ok();
+                            }
+                            Some(ClientControlPacketExt::ReportLostFrames {
+                                last_received_timestamp,
+                            }) => {
+                                ctx.events_sender
+                                    .send(ServerCoreEvent::LostFrames {
+                                        last_received_timestamp,
+                                    })
+                                    .ok();
+                            }
+                            None => (),
+                        }
+                    }
+                    ClientControlPacket::ReservedBuffer(_) => (),
                 }
 
                 disconnection_deadline = Instant::now() + KEEPALIVE_TIMEOUT;
@@ -1391,6 +1544,14 @@ fn connection_pipeline(
         info!("Creating recording file");
         crate::create_recording_file(&ctx, session_manager_lock.settings());
     }
+    if initial_settings
+        .extra
+        .capture
+        .secondary_video_stream
+        .enabled()
+    {
+        crate::create_secondary_video_file(&ctx);
+    }
 
     session_manager_lock.update_client_connections(
         client_hostname.clone(),
@@ -1419,11 +1580,14 @@ fn connection_pipeline(
 
     // This requests shutdown from threads
     *ctx.control_sender.lock() = None;
+    *ctx.refresh_rates.lock() = RefreshRates::default();
     *ctx.decoder_config.lock() = None;
     *ctx.video_channel_sender.lock() = None;
     *ctx.haptics_sender.lock() = None;
+    *ctx.depth_sender.lock() = None;
 
-    *ctx.video_recording_file.lock() = None;
+    *ctx.video_recorder.lock() = None;
+    *ctx.secondary_video_recorder.lock() = None;
 
     session_manager_lock.update_client_connections(
         client_hostname,
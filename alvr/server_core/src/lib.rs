@@ -5,6 +5,8 @@ mod hand_gestures;
 mod haptics;
 mod input_mapping;
 mod logging_backend;
+mod power;
+mod recording;
 mod sockets;
 mod statistics;
 mod tracking;
@@ -12,6 +14,7 @@ mod web_server;
 
 pub use c_api::*;
 pub use logging_backend::init_logging;
+pub use statistics::{EncodedFrameStats, EncodedFrameType, LockStats, PresentPacingStats};
 pub use tracking::HandType;
 
 pub fn compute_restart_settings_hash(
@@ -33,20 +36,21 @@ use alvr_common::{
 use alvr_events::{EventType, HapticsEvent};
 use alvr_filesystem as afs;
 use alvr_packets::{
-    BatteryInfo, ButtonEntry, ClientConnectionsAction, DecoderInitializationConfig, Haptics,
-    ServerControlPacket, VideoPacketHeader,
+    BatteryInfo, ButtonEntry, ClientConnectionsAction, DecoderInitializationConfig,
+    DepthPlaneHeader, Haptics, RealTimeConfig, RealTimeConfigExt, ServerControlPacket,
+    VideoPacketHeader,
 };
 use alvr_server_io::ServerSessionManager;
 use alvr_session::{CodecType, H264Profile, OpenvrProperty, Settings, SteamvrHmdInitConfig};
 use alvr_sockets::{ControlSocketSender, StreamSender};
-use bitrate::{BitrateManager, DynamicEncoderParams};
+use bitrate::{BitrateBounds, BitrateManager, DynamicEncoderParams};
+use recording::VideoRecorder;
 use statistics::StatisticsManager;
 use std::{
     collections::HashSet,
     env,
     ffi::OsStr,
     fs::File,
-    io::Write,
     sync::{
         Arc, LazyLock, OnceLock,
         atomic::{AtomicBool, Ordering},
@@ -105,26 +109,60 @@ pub enum ServerCoreEvent {
     RawButtons(Vec<ButtonEntry>),
     Buttons(Vec<ButtonEntry>), // Note: this is after mapping
     RequestIDR,
+    // Frames were lost, repairing the stream with an intra refresh is enough
+    RequestRecovery,
+    // The client lost the frames after this one
+    LostFrames {
+        last_received_timestamp: Duration,
+    },
     CaptureFrame,
+    LogGpuMemory,
     GameRenderLatencyFeedback(Duration), // only used for SteamVR
     ShutdownPending,
     RestartPending,
     ProximityState(bool),
 }
 
+// Refresh rates the client supports up to the negotiated one, the stream switches between them
+// without reconnecting
+#[derive(Default)]
+struct RefreshRates {
+    supported: Vec<f32>,
+    // 0 until a client connects
+    current: f32,
+}
+
 pub struct ConnectionContext {
     events_sender: mpsc::Sender<ServerCoreEvent>,
     statistics_manager: RwLock<Option<StatisticsManager>>,
     bitrate_manager: Mutex<BitrateManager>,
+    // Kept across connections, the bitrate manager is created again for each
+    bitrate_bounds: Mutex<BitrateBounds>,
+    refresh_rates: Mutex<RefreshRates>,
     tracking_manager: RwLock<TrackingManager>,
     decoder_config: Mutex<Option<DecoderInitializationConfig>>,
     video_mirror_sender: Mutex<Option<broadcast::Sender<Vec<u8>>>>,
-    video_recording_file: Mutex<Option<File>>,
+    video_recorder: Mutex<Option<VideoRecorder>>,
+    secondary_video_recorder: Mutex<Option<VideoRecorder>>,
     connection_threads: Mutex<Vec<JoinHandle<()>>>,
     clients_to_be_removed: Mutex<HashSet<String>>,
     control_sender: Mutex<Option<Arc<Mutex<ControlSocketSender<ServerControlPacket>>>>>,
     video_channel_sender: Mutex<Option<SyncSender<VideoPacket>>>,
     haptics_sender: Mutex<Option<StreamSender<Haptics>>>,
+    depth_sender: Mutex<Option<StreamSender<DepthPlaneHeader>>>,
+    // The client negotiated the center shift of the video packets, which can then follow the gaze
+    foveation_center_shift: AtomicBool,
+    // Of the frame encoded after the reference frames lost by the client were invalidated
+    recovery_frame_timestamp: Mutex<Option<Duration>>,
+}
+
+// The AV1 configuration is an av1C record, raw streams only take the OBUs after its 4 byte header
+fn config_stream_bytes(config_buffer: &[u8], codec: CodecType) -> &[u8] {
+    if codec == CodecType::AV1 {
+        config_buffer.get(4..).unwrap_or_default()
+    } else {
+        config_buffer
+    }
 }
 
 pub fn create_recording_file(connection_context: &ConnectionContext, settings: &Settings) {
@@ -141,12 +179,13 @@ pub fn create_recording_file(connection_context: &ConnectionContext, settings: &
     ));
 
     match File::create(path) {
-        Ok(mut file) => {
+        Ok(file) => {
+            let mut recorder = VideoRecorder::new(file);
             if let Some(config) = &*connection_context.decoder_config.lock() {
-                file.write_all(&config.config_buffer).ok();
+                recorder.write_config(config_stream_bytes(&config.config_buffer, config.codec));
             }
 
-            *connection_context.video_recording_file.lock() = Some(file);
+            *connection_context.video_recorder.lock() = Some(recorder);
 
             connection_context
                 .events_sender
@@ -159,6 +198,23 @@ pub fn create_recording_file(connection_context: &ConnectionContext, settings: &
     }
 }
 
+// The secondary stream has a keyframe every few seconds, players start from the first one
+pub fn create_secondary_video_file(connection_context: &ConnectionContext) {
+    let path = FILESYSTEM_LAYOUT.get().unwrap().log_dir.join(format!(
+        "secondary.{}.h264",
+        chrono::Local::now().format("%F.%H-%M-%S")
+    ));
+
+    match File::create(path) {
+        Ok(file) => {
+            *connection_context.secondary_video_recorder.lock() = Some(VideoRecorder::new(file));
+        }
+        Err(e) => {
+            error!("Failed to write secondary video stream on disk: {e}");
+        }
+    }
+}
+
 pub fn notify_restart_driver() {
     if sysinfo::System::new_all()
         .processes_by_name(OsStr::new(&afs::dashboard_fname()))
@@ -233,17 +289,23 @@ impl ServerCoreContext {
             events_sender,
             statistics_manager: RwLock::new(Some(stats)),
             bitrate_manager: Mutex::new(BitrateManager::new(256, 60.0)),
+            bitrate_bounds: Mutex::new(BitrateBounds::default()),
+            refresh_rates: Mutex::new(RefreshRates::default()),
             tracking_manager: RwLock::new(TrackingManager::new(
                 initial_settings.connection.statistics_history_size,
             )),
             decoder_config: Mutex::new(None),
             video_mirror_sender: Mutex::new(None),
-            video_recording_file: Mutex::new(None),
+            video_recorder: Mutex::new(None),
+            secondary_video_recorder: Mutex::new(None),
             connection_threads: Mutex::new(Vec::new()),
             clients_to_be_removed: Mutex::new(HashSet::new()),
             control_sender: Mutex::new(None),
             video_channel_sender: Mutex::new(None),
             haptics_sender: Mutex::new(None),
+            depth_sender: Mutex::new(None),
+            foveation_center_shift: AtomicBool::new(false),
+            recovery_frame_timestamp: Mutex::new(None),
         });
 
         let webserver_runtime = Runtime::new().unwrap();
@@ -303,6 +365,35 @@ impl ServerCoreContext {
             .copied()
     }
 
+    // Center shift to compress the frame rendered with the tracking of this timestamp with, see
+    // tracking::foveation_center_shift
+    pub fn get_foveation_center_shift(
+        &self,
+        timestamp: Duration,
+        local_view_params: [ViewParams; 2],
+    ) -> [Vec2; 2] {
+        dbg_server_core!("get_foveation_center_shift: ts={timestamp:?}");
+
+        // Clients that don't read the center shift of the frames decompress with the static one
+        let eye_gaze = self
+            .connection_context
+            .tracking_manager
+            .read()
+            .get_eye_gaze(timestamp)
+            .filter(|_| {
+                self.connection_context
+                    .foveation_center_shift
+                    .load(Ordering::Relaxed)
+            });
+
+        if let Switch::Enabled(config) = &SESSION_MANAGER.read().settings().video.foveated_encoding
+        {
+            tracking::foveation_center_shift(config, eye_gaze, local_view_params)
+        } else {
+            [Vec2::ZERO; 2]
+        }
+    }
+
     pub fn get_motion_to_photon_latency(&self) -> Duration {
         dbg_server_core!("get_motion_to_photon_latency");
 
@@ -326,6 +417,36 @@ impl ServerCoreContext {
         }
     }
 
+    // Latest age of a pose, from its reception, at the start of the encode of its frame for the
+    // frame to be displayed at the predicted time. The network latency estimate includes the
+    // transport of the tracking, which happens before the reception. Zero if unknown.
+    pub fn get_max_pose_age_at_encode(&self) -> Duration {
+        dbg_server_core!("get_max_pose_age_at_encode");
+
+        let Some((encode_to_display, frame_interval)) = self
+            .connection_context
+            .statistics_manager
+            .read()
+            .as_ref()
+            .map(|stats| {
+                (
+                    stats.encode_to_display_latency_average(),
+                    stats.vsync_interval(),
+                )
+            })
+        else {
+            return Duration::ZERO;
+        };
+        if encode_to_display.is_zero() {
+            return Duration::ZERO;
+        }
+
+        // Half a frame of margin for the jitter of the estimates
+        (self.get_motion_to_photon_latency() + frame_interval / 2)
+            .saturating_sub(encode_to_display)
+            .max(Duration::from_nanos(1))
+    }
+
     pub fn get_tracker_pose_time_offset(&self) -> Duration {
         dbg_server_core!("get_tracker_pose_time_offset");
 
@@ -340,10 +461,30 @@ impl ServerCoreContext {
     pub fn send_haptics(&self, haptics: Haptics) {
         dbg_server_core!("send_haptics");
 
-        let haptics_config = {
+        self.send_haptics_batch([haptics]);
+    }
+
+    // The settings and the sender are locked once for the events of a burst
+    pub fn send_haptics_batch(&self, batch: impl IntoIterator<Item = Haptics>) {
+        dbg_server_core!("send_haptics_batch");
+
+        let (log_haptics, haptics_config) = {
             let session_manager_lock = SESSION_MANAGER.read();
+            let settings = session_manager_lock.settings();
+
+            (
+                settings.extra.logging.log_haptics,
+                settings
+                    .headset
+                    .controllers
+                    .as_option()
+                    .and_then(|c| c.haptics.as_option().cloned()),
+            )
+        };
+        let mut sender_lock = self.connection_context.haptics_sender.lock();
 
-            if session_manager_lock.settings().extra.logging.log_haptics {
+        for haptics in batch {
+            if log_haptics {
                 alvr_events::send_event(EventType::Haptics(HapticsEvent {
                     path: DEVICE_ID_TO_PATH.get(&haptics.device_id).map_or_else(
                         || format!("Unknown (ID: {:#16x})", haptics.device_id),
@@ -355,33 +496,34 @@ impl ServerCoreContext {
                 }))
             }
 
-            session_manager_lock
-                .settings()
-                .headset
-                .controllers
-                .as_option()
-                .and_then(|c| c.haptics.as_option().cloned())
-        };
+            if let (Some(config), Some(sender)) = (&haptics_config, &mut *sender_lock) {
+                sender
+                    .send_header(&haptics::map_haptics(config, haptics))
+                    .ok();
+            }
+        }
+    }
 
-        if let (Some(config), Some(sender)) = (
-            haptics_config,
-            &mut *self.connection_context.haptics_sender.lock(),
-        ) {
-            sender
-                .send_header(&haptics::map_haptics(&config, haptics))
-                .ok();
+    // Depth is only a hint for the client reprojection, a plane that does not fit in the socket
+    // buffer is dropped
+    pub fn send_depth_plane(&self, header: DepthPlaneHeader, depth: &[u8]) {
+        dbg_server_core!("send_depth_plane");
+
+        if let Some(sender) = &mut *self.connection_context.depth_sender.lock() {
+            sender.send_header_with_payload(&header, depth).ok();
         }
     }
 
     pub fn set_video_config_nals(&self, config_buffer: Vec<u8>, codec: CodecType) {
         dbg_server_core!("set_video_config_nals");
 
+        let stream_bytes = config_stream_bytes(&config_buffer, codec);
         if let Some(sender) = &*self.connection_context.video_mirror_sender.lock() {
-            sender.send(config_buffer.clone()).ok();
+            sender.send(stream_bytes.to_vec()).ok();
         }
 
-        if let Some(file) = &mut *self.connection_context.video_recording_file.lock() {
-            file.write_all(&config_buffer).ok();
+        if let Some(recorder) = &mut *self.connection_context.video_recorder.lock() {
+            recorder.write_config(stream_bytes);
         }
 
         let config = DecoderInitializationConfig {
@@ -401,12 +543,22 @@ impl ServerCoreContext {
         }
     }
 
+    pub fn send_secondary_video(&self, buffer: &[u8], is_idr: bool) {
+        if let Some(recorder) = &mut *self.connection_context.secondary_video_recorder.lock() {
+            recorder.write_frame(buffer, is_idr);
+        }
+    }
+
+    // foveation_center_shift: the frame was compressed with the center shift setting if None
+    // temporal_layer: temporal ID of the frame, no frame references the top temporal layer
     pub fn send_video_nal(
         &self,
         timestamp: Duration,
         global_view_params: [ViewParams; 2],
+        foveation_center_shift: Option<[Vec2; 2]>,
         is_idr: bool,
-        nal_buffer: Vec<u8>,
+        temporal_layer: u32,
+        nal_buffer: impl AsRef<[u8]> + Send + 'static,
     ) -> bool {
         dbg_server_core!("send_video_nal");
 
@@ -421,7 +573,7 @@ impl ServerCoreContext {
         };
         let mut enqueued = false;
         {
-            let buffer_size = nal_buffer.len();
+            let buffer_size = nal_buffer.as_ref().len();
 
             if is_idr {
                 STREAM_CORRUPTED.store(false, Ordering::SeqCst);
@@ -458,28 +610,66 @@ impl ServerCoreContext {
                     .avoid_video_glitching
             {
                 if let Some(sender) = &*self.connection_context.video_mirror_sender.lock() {
-                    sender.send(nal_buffer.clone()).ok();
+                    sender.send(nal_buffer.as_ref().to_vec()).ok();
                 }
 
-                if let Some(file) = &mut *self.connection_context.video_recording_file.lock() {
-                    file.write_all(&nal_buffer).ok();
+                if let Some(recorder) = &mut *self.connection_context.video_recorder.lock() {
+                    recorder.write_frame(nal_buffer.as_ref(), is_idr);
                 }
 
+                let foveation_center_shift = foveation_center_shift.unwrap_or_else(|| {
+                    let static_shift = SESSION_MANAGER
+                        .read()
+                        .settings()
+                        .video
+                        .foveated_encoding
+                        .as_option()
+                        .map(|config| Vec2::new(config.center_shift_x, config.center_shift_y))
+                        .unwrap_or_default();
+
+                    [static_shift; 2]
+                });
+
+                // The client waits for it to report the next losses from it
+                let is_recovery = {
+                    let mut recovery_timestamp =
+                        self.connection_context.recovery_frame_timestamp.lock();
+                    let is_recovery = *recovery_timestamp == Some(timestamp);
+                    if is_recovery {
+                        *recovery_timestamp = None;
+                    }
+                    is_recovery
+                };
+
                 let sender_result = sender.try_send(VideoPacket {
                     header: VideoPacketHeader {
                         timestamp,
                         global_view_params,
-                        is_idr,
+                        is_idr: is_idr || is_recovery,
                     },
-                    payload: nal_buffer,
+                    foveation_center_shift,
+                    payload: Box::new(nal_buffer),
                 });
+                // No frame is predicted from the top temporal layer, dropping one of its frames
+                // doesn't need a recovery frame
+                let temporal_layers = SESSION_MANAGER
+                    .read()
+                    .settings()
+                    .video
+                    .encoder_config
+                    .temporal_layers;
+                let droppable = temporal_layer > 0 && temporal_layer + 1 >= temporal_layers;
+
                 match sender_result {
                     Ok(()) => enqueued = true,
+                    Err(TrySendError::Full(_)) if droppable => {
+                        warn!("Dropping unreferenced video packet. Reason: Can't push to network");
+                    }
                     Err(TrySendError::Full(_)) => {
                         STREAM_CORRUPTED.store(true, Ordering::SeqCst);
                         self.connection_context
                             .events_sender
-                            .send(ServerCoreEvent::RequestIDR)
+                            .send(ServerCoreEvent::RequestRecovery)
                             .ok();
                         warn!("Dropping video packet. Reason: Can't push to network");
                     }
@@ -507,11 +697,15 @@ impl ServerCoreContext {
         dbg_server_core!("get_dynamic_encoder_params");
 
         let pair = {
-            let session_manager_lock = SESSION_MANAGER.read();
+            let mut config = SESSION_MANAGER.read().settings().video.bitrate.clone();
+            self.connection_context
+                .bitrate_bounds
+                .lock()
+                .apply(&mut config);
             self.connection_context
                 .bitrate_manager
                 .lock()
-                .get_encoder_params(&session_manager_lock.settings().video.bitrate)
+                .get_encoder_params(&config)
         };
 
         pair.map(|(params, stats)| {
@@ -522,6 +716,73 @@ impl ServerCoreContext {
         })
     }
 
+    // The encoders get the new bitrate with their next parameters
+    pub fn set_bitrate_bounds(&self, min_mbps: Option<u64>, max_mbps: Option<u64>) {
+        dbg_server_core!("set_bitrate_bounds");
+
+        *self.connection_context.bitrate_bounds.lock() = BitrateBounds { min_mbps, max_mbps };
+    }
+
+    pub fn set_encoding_resolution_scale(&self, scale: f32) {
+        dbg_server_core!("set_encoding_resolution_scale");
+
+        self.connection_context
+            .bitrate_manager
+            .lock()
+            .set_resolution_scale(scale);
+    }
+
+    // Moves the stream to the next lower or higher refresh rate. The vsync schedule, which the
+    // compositor follows, and the nominal framerate of the encoders switch right away and the
+    // client is asked to switch its display. Returns the new rate, None if there is no other.
+    pub fn step_refresh_rate(&self, lower: bool) -> Option<f32> {
+        dbg_server_core!("step_refresh_rate");
+
+        let rate = {
+            let mut rates = self.connection_context.refresh_rates.lock();
+            let current = rates.current;
+            let others = rates.supported.iter().copied();
+            let rate = if lower {
+                others.filter(|rate| *rate < current).reduce(f32::max)
+            } else {
+                others.filter(|rate| *rate > current).reduce(f32::min)
+            }?;
+            rates.current = rate;
+            rate
+        };
+
+        if let Some(stats) = &mut *self.connection_context.statistics_manager.write() {
+            stats.set_nominal_frame_interval(Duration::from_secs_f32(1.0 / rate));
+        }
+        self.connection_context
+            .bitrate_manager
+            .lock()
+            .set_nominal_framerate(rate);
+
+        let config = RealTimeConfig::from_settings(SESSION_MANAGER.read().settings()).with_ext(
+            RealTimeConfigExt {
+                refresh_rate: Some(rate),
+            },
+        );
+        let control_sender = self.connection_context.control_sender.lock().clone();
+        if let Some(sender) = control_sender
+            && let Err(error) = sender
+                .lock()
+                .send(&ServerControlPacket::RealTimeConfig(config))
+        {
+            warn!("Failed to send the refresh rate: {error}");
+        }
+
+        Some(rate)
+    }
+
+    // 0 while no client is connected
+    pub fn refresh_rate(&self) -> f32 {
+        dbg_server_core!("refresh_rate");
+
+        self.connection_context.refresh_rates.lock().current
+    }
+
     pub fn report_composed(&self, target_timestamp: Duration, offset: Duration) {
         dbg_server_core!("report_composed");
 
@@ -530,6 +791,67 @@ impl ServerCoreContext {
         }
     }
 
+    pub fn report_compose_stage_timing(&self, name: &str, duration: Duration) {
+        dbg_server_core!("report_compose_stage_timing");
+
+        if let Some(stats) = &mut *self.connection_context.statistics_manager.write() {
+            stats.report_compose_stage_timing(name, duration);
+        }
+    }
+
+    pub fn report_encoded_frame_stats(&self, stats: EncodedFrameStats) {
+        dbg_server_core!("report_encoded_frame_stats");
+
+        if let Some(stats_manager) = &mut *self.connection_context.statistics_manager.write() {
+            stats_manager.report_encoded_frame_stats(stats);
+        }
+    }
+
+    // The frame of target_timestamp is predicted only from frames the client received, after
+    // ServerCoreEvent::LostFrames
+    pub fn report_recovery_frame(&self, target_timestamp: Duration) {
+        dbg_server_core!("report_recovery_frame");
+
+        *self.connection_context.recovery_frame_timestamp.lock() = Some(target_timestamp);
+    }
+
+    pub fn report_idr_stats(&self, requested: u32, issued: u32) {
+        dbg_server_core!("report_idr_stats");
+
+        if let Some(stats_manager) = &mut *self.connection_context.statistics_manager.write() {
+            stats_manager.report_idr_stats(requested, issued);
+        }
+    }
+
+    pub fn report_present_pacing(&self, stats: &PresentPacingStats) {
+        dbg_server_core!("report_present_pacing");
+
+        if let Some(stats_manager) = &mut *self.connection_context.statistics_manager.write() {
+            stats_manager.report_present_pacing(stats);
+        }
+    }
+
+    pub fn report_lock_stats(&self, locks: &[(&str, LockStats)]) {
+        dbg_server_core!("report_lock_stats");
+
+        if let Some(stats_manager) = &mut *self.connection_context.statistics_manager.write() {
+            for (name, stats) in locks {
+                stats_manager.report_lock_stats(name, stats);
+            }
+        }
+    }
+
+    // Intervals of the server side timeline of one frame, by name
+    pub fn report_frame_latencies(&self, latencies: &[(&str, Duration)]) {
+        dbg_server_core!("report_frame_latencies");
+
+        if let Some(stats) = &mut *self.connection_context.statistics_manager.write() {
+            for (name, duration) in latencies {
+                stats.report_frame_latency(name, *duration);
+            }
+        }
+    }
+
     pub fn report_present(&self, target_timestamp: Duration, offset: Duration) {
         dbg_server_core!("report_present");
 
@@ -559,6 +881,16 @@ impl ServerCoreContext {
             .as_mut()
             .map(|stats| stats.duration_until_next_vsync())
     }
+
+    pub fn vsync_interval(&self) -> Option<Duration> {
+        dbg_server_core!("vsync_interval");
+
+        self.connection_context
+            .statistics_manager
+            .read()
+            .as_ref()
+            .map(|stats| stats.vsync_interval())
+    }
 }
 
 impl Drop for ServerCoreContext {
@@ -0,0 +1,41 @@
+// Power drawn from the batteries of the streamer, in watts. None when none of them is discharging
+// or the platform doesn't tell.
+#[cfg(target_os = "linux")]
+pub fn battery_discharge_w() -> Option<f32> {
+    use std::{fs, path::Path};
+
+    let read_value =
+        |path: &Path| -> Option<f64> { fs::read_to_string(path).ok()?.trim().parse().ok() };
+    let read_word = |path: &Path| fs::read_to_string(path).map(|value| value.trim().to_owned());
+
+    let mut total_w = None;
+    for entry in fs::read_dir("/sys/class/power_supply").ok()?.flatten() {
+        let path = entry.path();
+        if !read_word(&path.join("type")).is_ok_and(|value| value == "Battery")
+            || !read_word(&path.join("status")).is_ok_and(|value| value == "Discharging")
+        {
+            continue;
+        }
+
+        // In microwatts, or in microamps and microvolts. Some batteries report negative values
+        // while discharging.
+        let power_w = if let Some(power) = read_value(&path.join("power_now")) {
+            power / 1e6
+        } else if let (Some(current), Some(voltage)) = (
+            read_value(&path.join("current_now")),
+            read_value(&path.join("voltage_now")),
+        ) {
+            current * voltage / 1e12
+        } else {
+            continue;
+        };
+        *total_w.get_or_insert(0.0) += power_w.abs() as f32;
+    }
+
+    total_w
+}
+
+#[cfg(not(target_os = "linux"))]
+pub fn battery_discharge_w() -> Option<f32> {
+    None
+}
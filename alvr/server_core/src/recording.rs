@@ -0,0 +1,65 @@
+use alvr_common::{error, warn};
+use std::{
+    fs::File,
+    io::{BufWriter, Write},
+    sync::mpsc::{self, SyncSender, TrySendError},
+    thread,
+};
+
+// Buffers that can wait for the writer thread before new ones are dropped. Around 4 seconds of
+// video at 120fps.
+const MAX_QUEUED_BUFFERS: usize = 512;
+
+// Video file written by its own thread, so that a slow disk does not stall the video path. The
+// queued buffers are still written after the recorder is dropped, then the file is closed. Once a
+// frame is dropped, the frames that follow are dropped too until the next IDR, since they
+// reference it.
+pub struct VideoRecorder {
+    sender: SyncSender<Vec<u8>>,
+    dropping: bool,
+}
+
+impl VideoRecorder {
+    pub fn new(file: File) -> Self {
+        let (sender, receiver) = mpsc::sync_channel::<Vec<u8>>(MAX_QUEUED_BUFFERS);
+
+        thread::spawn(move || {
+            let mut writer = BufWriter::new(file);
+            for buffer in receiver {
+                if let Err(e) = writer.write_all(&buffer) {
+                    error!("Failed to write video recording: {e}");
+                    return;
+                }
+            }
+            writer.flush().ok();
+        });
+
+        Self {
+            sender,
+            dropping: false,
+        }
+    }
+
+    // Configuration buffers don't reference frames and are written whenever there is room
+    pub fn write_config(&mut self, buffer: &[u8]) {
+        self.sender.try_send(buffer.to_vec()).ok();
+    }
+
+    pub fn write_frame(&mut self, buffer: &[u8], is_idr: bool) {
+        if self.dropping && !is_idr {
+            return;
+        }
+
+        match self.sender.try_send(buffer.to_vec()) {
+            Ok(()) => self.dropping = false,
+            Err(TrySendError::Full(_)) => {
+                if !self.dropping {
+                    warn!("Video recording can't keep up with the stream, dropping frames");
+                    self.dropping = true;
+                }
+            }
+            // The writer thread stopped after an error
+            Err(TrySendError::Disconnected(_)) => (),
+        }
+    }
+}
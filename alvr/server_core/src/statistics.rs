@@ -1,5 +1,9 @@
-use alvr_common::{HEAD_ID, SlidingWindowAverage};
-use alvr_events::{BitrateDirectives, EventType, GraphStatistics, StatisticsSummary};
+use crate::power;
+use alvr_common::{HEAD_ID, LatencyHistogram, SlidingWindowAverage};
+use alvr_events::{
+    BitrateDirectives, EncodedFramesSummary, EventType, GraphStatistics, LatencyPercentiles,
+    LockWaitSummary, PresentPacingSummary, StatisticsSummary,
+};
 use alvr_packets::ClientStatistics;
 use std::{
     collections::{HashMap, VecDeque},
@@ -8,6 +12,9 @@ use std::{
 
 const FULL_REPORT_INTERVAL: Duration = Duration::from_millis(500);
 const EPS_INTERVAL: Duration = Duration::from_micros(1);
+// Frame latency percentiles cover the current window and the previous one, enough frames for the
+// 99.9th percentile at the usual refresh rates
+const LATENCY_WINDOW: Duration = Duration::from_secs(10);
 
 pub struct HistoryFrame {
     target_timestamp: Duration,
@@ -34,6 +41,187 @@ impl Default for HistoryFrame {
     }
 }
 
+#[derive(Clone, Copy, PartialEq, Eq, Debug)]
+pub enum EncodedFrameType {
+    Unknown,
+    Idr,
+    // Intra frame that doesn't reset the references
+    Intra,
+    Predicted,
+    Bidirectional,
+}
+
+pub struct EncodedFrameStats {
+    pub target_timestamp: Duration,
+    pub size_bytes: usize,
+    // On the scale of the codec
+    pub average_qp: Option<f32>,
+    pub frame_type: EncodedFrameType,
+    pub encode_time: Option<Duration>,
+}
+
+// Sums over the current report interval
+#[derive(Default)]
+struct EncodedFramesAccumulator {
+    intra_frames: u32,
+    inter_frames: u32,
+    intra_bytes: usize,
+    inter_bytes: usize,
+    inter_qp_sum: f32,
+    inter_qp_count: u32,
+    encode_time_sum: Duration,
+    encode_time_count: u32,
+    idr_requests: u32,
+    issued_idrs: u32,
+}
+
+impl EncodedFramesAccumulator {
+    fn summary(&self) -> EncodedFramesSummary {
+        EncodedFramesSummary {
+            intra_frames: self.intra_frames,
+            inter_frames: self.inter_frames,
+            average_intra_kbytes: self.intra_bytes as f32 / 1e3 / self.intra_frames.max(1) as f32,
+            average_inter_kbytes: self.inter_bytes as f32 / 1e3 / self.inter_frames.max(1) as f32,
+            average_qp: (self.inter_qp_count > 0)
+                .then(|| self.inter_qp_sum / self.inter_qp_count as f32),
+            average_encode_ms: (self.encode_time_count > 0).then(|| {
+                self.encode_time_sum.as_secs_f32() * 1000. / self.encode_time_count as f32
+            }),
+            idr_requests: self.idr_requests,
+            issued_idrs: self.issued_idrs,
+        }
+    }
+}
+
+// Counted by the driver
+#[derive(Default, Clone)]
+pub struct PresentPacingStats {
+    pub arrivals: u32,
+    pub dropped: u32,
+    pub duplicates: u32,
+    pub late: u32,
+    // Counts of the intervals between consecutive presents, the last bucket also counts the longer
+    // ones
+    pub interval_buckets: Vec<u32>,
+    // Width of the buckets, in vsync periods
+    pub interval_bucket_periods: f32,
+    // From the present of the SteamVR compositor to the end of its rendering, reported by the
+    // capture layer
+    pub compositor_gpu_time_sum: Duration,
+    pub compositor_gpu_times: u32,
+    // Over a vsync period
+    pub compositor_gpu_bound: u32,
+}
+
+impl PresentPacingStats {
+    fn add(&mut self, other: &PresentPacingStats) {
+        self.arrivals += other.arrivals;
+        self.dropped += other.dropped;
+        self.duplicates += other.duplicates;
+        self.late += other.late;
+        self.compositor_gpu_time_sum += other.compositor_gpu_time_sum;
+        self.compositor_gpu_times += other.compositor_gpu_times;
+        self.compositor_gpu_bound += other.compositor_gpu_bound;
+        self.interval_bucket_periods = other.interval_bucket_periods;
+        if self.interval_buckets.len() < other.interval_buckets.len() {
+            self.interval_buckets
+                .resize(other.interval_buckets.len(), 0);
+        }
+        for (sum, count) in self
+            .interval_buckets
+            .iter_mut()
+            .zip(&other.interval_buckets)
+        {
+            *sum += count;
+        }
+    }
+
+    // Upper bound of the bucket, in vsync periods
+    fn interval_at_quantile(&self, quantile: f32) -> f32 {
+        let total = self.interval_buckets.iter().sum::<u32>();
+        if total == 0 {
+            return 0.0;
+        }
+        let target = (quantile * total as f32).ceil().max(1.0) as u32;
+        let mut cumulative = 0;
+        for (index, count) in self.interval_buckets.iter().enumerate() {
+            cumulative += count;
+            if cumulative >= target {
+                return (index + 1) as f32 * self.interval_bucket_periods;
+            }
+        }
+        self.interval_buckets.len() as f32 * self.interval_bucket_periods
+    }
+
+    fn summary(&self) -> PresentPacingSummary {
+        PresentPacingSummary {
+            arrivals: self.arrivals,
+            dropped: self.dropped,
+            duplicates: self.duplicates,
+            late: self.late,
+            interval_p50: self.interval_at_quantile(0.5),
+            interval_p99: self.interval_at_quantile(0.99),
+            interval_max: self.interval_at_quantile(1.0),
+            compositor_gpu_ms: (self.compositor_gpu_times > 0).then(|| {
+                self.compositor_gpu_time_sum.as_secs_f32() * 1000.
+                    / self.compositor_gpu_times as f32
+            }),
+            compositor_gpu_bound: self.compositor_gpu_bound,
+        }
+    }
+}
+
+// Counted by the driver for one named lock
+#[derive(Default, Clone)]
+pub struct LockStats {
+    pub acquisitions: u32,
+    pub contended: u32,
+    // Counts of the wait times, under 1us in the first bucket and up to 2^i us in the bucket i.
+    // The last bucket also counts the longer ones.
+    pub wait_buckets: Vec<u32>,
+}
+
+impl LockStats {
+    fn add(&mut self, other: &LockStats) {
+        self.acquisitions += other.acquisitions;
+        self.contended += other.contended;
+        if self.wait_buckets.len() < other.wait_buckets.len() {
+            self.wait_buckets.resize(other.wait_buckets.len(), 0);
+        }
+        for (sum, count) in self.wait_buckets.iter_mut().zip(&other.wait_buckets) {
+            *sum += count;
+        }
+    }
+
+    // Upper bound of the bucket
+    fn wait_at_quantile(&self, quantile: f32) -> Duration {
+        let total = self.wait_buckets.iter().sum::<u32>();
+        if total == 0 {
+            return Duration::ZERO;
+        }
+        let target = (quantile * total as f32).ceil().max(1.0) as u32;
+        let mut cumulative = 0;
+        for (index, count) in self.wait_buckets.iter().enumerate() {
+            cumulative += count;
+            if cumulative >= target {
+                return Duration::from_micros(1 << index);
+            }
+        }
+        Duration::from_micros(1 << self.wait_buckets.len().saturating_sub(1))
+    }
+
+    fn summary(&self) -> LockWaitSummary {
+        let to_ms = |duration: Duration| duration.as_secs_f32() * 1000.;
+        LockWaitSummary {
+            acquisitions: self.acquisitions,
+            contended: self.contended,
+            wait_p50_ms: to_ms(self.wait_at_quantile(0.5)),
+            wait_p99_ms: to_ms(self.wait_at_quantile(0.99)),
+            wait_max_ms: to_ms(self.wait_at_quantile(1.0)),
+        }
+    }
+}
+
 #[derive(Default, Clone)]
 struct BatteryData {
     gauge_value: f32,
@@ -53,9 +241,21 @@ pub struct StatisticsManager {
     battery_gauges: HashMap<u64, BatteryData>,
     steamvr_pipeline_latency: Duration,
     motion_to_photon_latency_average: SlidingWindowAverage<Duration>,
+    // From the end of the composition of a frame to its display, without the wait for the vsync
+    encode_to_display_latency_average: SlidingWindowAverage<Duration>,
     last_vsync_time: Instant,
     frame_interval: Duration,
+    nominal_frame_interval: Duration,
     last_throughput_directives: BitrateDirectives,
+    // GPU time of each compositor pass, in chain order
+    compose_stage_averages: Vec<(String, SlidingWindowAverage<Duration>)>,
+    // Histograms of the current and the previous window of each interval of the server side frame
+    // timeline, in timeline order
+    frame_latency_histograms: Vec<(String, [LatencyHistogram; 2])>,
+    last_latency_window_instant: Instant,
+    encoded_frames: EncodedFramesAccumulator,
+    present_pacing: PresentPacingStats,
+    lock_stats: Vec<(String, LockStats)>,
 }
 
 impl StatisticsManager {
@@ -83,9 +283,20 @@ impl StatisticsManager {
                 Duration::ZERO,
                 max_history_size,
             ),
+            encode_to_display_latency_average: SlidingWindowAverage::new(
+                Duration::ZERO,
+                max_history_size,
+            ),
             last_vsync_time: Instant::now(),
             frame_interval: nominal_server_frame_interval,
+            nominal_frame_interval: nominal_server_frame_interval,
             last_throughput_directives: BitrateDirectives::default(),
+            compose_stage_averages: Vec::new(),
+            frame_latency_histograms: Vec::new(),
+            last_latency_window_instant: Instant::now(),
+            encoded_frames: EncodedFramesAccumulator::default(),
+            present_pacing: PresentPacingStats::default(),
+            lock_stats: Vec::new(),
         }
     }
 
@@ -161,6 +372,106 @@ impl StatisticsManager {
         }
     }
 
+    pub fn report_compose_stage_timing(&mut self, name: &str, duration: Duration) {
+        if let Some((_, average)) = self
+            .compose_stage_averages
+            .iter_mut()
+            .find(|(stage, _)| stage == name)
+        {
+            average.submit_sample(duration);
+        } else {
+            self.compose_stage_averages.push((
+                name.to_owned(),
+                SlidingWindowAverage::new(duration, self.max_history_size),
+            ));
+        }
+    }
+
+    pub fn report_frame_latency(&mut self, name: &str, duration: Duration) {
+        if let Some((_, histograms)) = self
+            .frame_latency_histograms
+            .iter_mut()
+            .find(|(interval, _)| interval == name)
+        {
+            histograms[0].record(duration);
+        } else {
+            let mut histogram = LatencyHistogram::new();
+            histogram.record(duration);
+            self.frame_latency_histograms
+                .push((name.to_owned(), [histogram, LatencyHistogram::new()]));
+        }
+    }
+
+    pub fn report_encoded_frame_stats(&mut self, stats: EncodedFrameStats) {
+        let acc = &mut self.encoded_frames;
+        if matches!(
+            stats.frame_type,
+            EncodedFrameType::Idr | EncodedFrameType::Intra
+        ) {
+            acc.intra_frames += 1;
+            acc.intra_bytes += stats.size_bytes;
+        } else {
+            acc.inter_frames += 1;
+            acc.inter_bytes += stats.size_bytes;
+            if let Some(qp) = stats.average_qp {
+                acc.inter_qp_sum += qp;
+                acc.inter_qp_count += 1;
+            }
+        }
+        if let Some(encode_time) = stats.encode_time {
+            acc.encode_time_sum += encode_time;
+            acc.encode_time_count += 1;
+        }
+    }
+
+    pub fn report_idr_stats(&mut self, requested: u32, issued: u32) {
+        self.encoded_frames.idr_requests += requested;
+        self.encoded_frames.issued_idrs += issued;
+    }
+
+    pub fn report_present_pacing(&mut self, stats: &PresentPacingStats) {
+        self.present_pacing.add(stats);
+    }
+
+    pub fn report_lock_stats(&mut self, name: &str, stats: &LockStats) {
+        if let Some((_, sum)) = self.lock_stats.iter_mut().find(|(lock, _)| lock == name) {
+            sum.add(stats);
+        } else {
+            self.lock_stats.push((name.to_owned(), stats.clone()));
+        }
+    }
+
+    fn frame_latency_percentiles(&mut self) -> Vec<(String, LatencyPercentiles)> {
+        if self.last_latency_window_instant + LATENCY_WINDOW < Instant::now() {
+            self.last_latency_window_instant = Instant::now();
+
+            for (_, [current, previous]) in &mut self.frame_latency_histograms {
+                std::mem::swap(current, previous);
+                current.clear();
+            }
+        }
+
+        let to_ms = |duration: Duration| duration.as_secs_f32() * 1000.;
+        self.frame_latency_histograms
+            .iter()
+            .map(|(name, [current, previous])| {
+                let mut histogram = current.clone();
+                histogram.add(previous);
+
+                (
+                    name.clone(),
+                    LatencyPercentiles {
+                        p50: to_ms(histogram.value_at_quantile(0.5)),
+                        p90: to_ms(histogram.value_at_quantile(0.9)),
+                        p99: to_ms(histogram.value_at_quantile(0.99)),
+                        p99_9: to_ms(histogram.value_at_quantile(0.999)),
+                        max: to_ms(histogram.max()),
+                    },
+                )
+            })
+            .collect()
+    }
+
     pub fn report_battery(&mut self, device_id: u64, gauge_value: f32, is_plugged: bool) {
         *self.battery_gauges.entry(device_id).or_default() = BatteryData {
             gauge_value,
@@ -178,6 +489,16 @@ impl StatisticsManager {
         self.motion_to_photon_latency_average
             .submit_sample(client_stats.total_pipeline_latency);
 
+        // Follow the rate the headset actually displays frames at, so that the vsync phase doesn't
+        // drift against it. Intervals of repeated frames are ignored.
+        let nominal_interval = self.nominal_frame_interval.as_secs_f64();
+        let client_interval = client_stats.frame_interval.as_secs_f64();
+        if (client_interval - nominal_interval).abs() < nominal_interval * 0.1 {
+            self.frame_interval = Duration::from_secs_f64(
+                self.frame_interval.as_secs_f64() * 0.95 + client_interval * 0.05,
+            );
+        }
+
         if let Some(frame) = self
             .history_buffer
             .iter_mut()
@@ -213,6 +534,14 @@ impl StatisticsManager {
                     + client_stats.vsync_queue,
             );
 
+            self.encode_to_display_latency_average.submit_sample(
+                encoder_latency
+                    + network_latency
+                    + client_stats.video_decode
+                    + client_stats.video_decoder_queue
+                    + client_stats.rendering,
+            );
+
             let client_fps =
                 1.0 / Duration::max(client_stats.frame_interval, EPS_INTERVAL).as_secs_f32();
             let server_fps =
@@ -222,6 +551,13 @@ impl StatisticsManager {
                 self.last_full_report_instant += FULL_REPORT_INTERVAL;
 
                 let interval_secs = FULL_REPORT_INTERVAL.as_secs_f32();
+                let frame_latencies_ms = self.frame_latency_percentiles();
+                let host_battery_power_w = power::battery_discharge_w();
+                let encoded_frames =
+                    self.encoded_frames.intra_frames + self.encoded_frames.inter_frames;
+                let energy_per_frame_mj = host_battery_power_w
+                    .filter(|_| encoded_frames > 0)
+                    .map(|power_w| power_w * interval_secs * 1000. / encoded_frames as f32);
 
                 alvr_events::send_event(EventType::StatisticsSummary(StatisticsSummary {
                     video_packets_total: self.video_packets_total,
@@ -250,10 +586,30 @@ impl StatisticsManager {
                         .cloned()
                         .unwrap_or_default()
                         .is_plugged,
+                    compose_stages_ms: self
+                        .compose_stage_averages
+                        .iter()
+                        .map(|(name, average)| {
+                            (name.clone(), average.get_average().as_secs_f32() * 1000.)
+                        })
+                        .collect(),
+                    frame_latencies_ms,
+                    encoded_frames: self.encoded_frames.summary(),
+                    present_pacing: self.present_pacing.summary(),
+                    lock_waits: self
+                        .lock_stats
+                        .iter()
+                        .map(|(name, stats)| (name.clone(), stats.summary()))
+                        .collect(),
+                    host_battery_power_w,
+                    energy_per_frame_mj,
                 }));
 
                 self.video_packets_partial_sum = 0;
                 self.video_bytes_partial_sum = 0;
+                self.encoded_frames = EncodedFramesAccumulator::default();
+                self.present_pacing = PresentPacingStats::default();
+                self.lock_stats.clear();
             }
 
             let packet_bits = frame.video_packet_bytes as f32 * 8.0;
@@ -291,6 +647,10 @@ impl StatisticsManager {
         self.motion_to_photon_latency_average.get_average()
     }
 
+    pub fn encode_to_display_latency_average(&self) -> Duration {
+        self.encode_to_display_latency_average.get_average()
+    }
+
     pub fn tracker_pose_time_offset(&self) -> Duration {
         // This is the opposite of the client's StatisticsManager::tracker_prediction_offset().
         self.steamvr_pipeline_latency
@@ -307,4 +667,14 @@ impl StatisticsManager {
 
         (self.last_vsync_time + self.frame_interval).saturating_duration_since(now)
     }
+
+    // The vsync phase is kept, the interval follows the headset again from the new nominal one
+    pub fn set_nominal_frame_interval(&mut self, interval: Duration) {
+        self.nominal_frame_interval = interval;
+        self.frame_interval = interval;
+    }
+
+    pub fn vsync_interval(&self) -> Duration {
+        self.frame_interval
+    }
 }
@@ -13,15 +13,15 @@ use crate::{
     input_mapping::ButtonMappingManager,
 };
 use alvr_common::{
-    ConnectionError, DEVICE_ID_TO_PATH, DeviceMotion, Pose, ViewParams,
-    glam::{Quat, Vec3},
+    ConnectionError, DEVICE_ID_TO_PATH, DeviceMotion, Fov, Pose, ViewParams,
+    glam::{Quat, Vec2, Vec3},
     inputs as inp,
 };
 use alvr_events::{EventType, TrackingEvent};
 use alvr_packets::TrackingData;
 use alvr_session::{
-    BodyTrackingConfig, HeadsetConfig, RecenteringMode, Settings, VMCConfig,
-    settings_schema::Switch,
+    BodyTrackingConfig, FoveatedEncodingConfig, FoveationShape, HeadsetConfig, RecenteringMode,
+    Settings, VMCConfig, settings_schema::Switch,
 };
 use alvr_sockets::StreamReceiver;
 use std::{
@@ -53,6 +53,7 @@ pub struct TrackingManager {
     inverse_recentering_origin: Pose, // client's reference space
     device_motions_history: HashMap<u64, VecDeque<(Duration, DeviceMotion)>>,
     hand_skeletons_history: [VecDeque<(Duration, [Pose; 26])>; 2],
+    eye_gaze_history: VecDeque<(Duration, Quat)>, // head space
     max_history_size: usize,
 }
 
@@ -63,6 +64,7 @@ impl TrackingManager {
             inverse_recentering_origin: Pose::IDENTITY,
             device_motions_history: HashMap::new(),
             hand_skeletons_history: [VecDeque::new(), VecDeque::new()],
+            eye_gaze_history: VecDeque::new(),
             max_history_size,
         }
     }
@@ -254,6 +256,23 @@ impl TrackingManager {
             .map(|(_, skeleton)| skeleton)
     }
 
+    // The gaze is relative to the head and is not recentered
+    pub fn report_eye_gaze(&mut self, timestamp: Duration, gaze: Quat) {
+        self.eye_gaze_history.push_back((timestamp, gaze));
+
+        if self.eye_gaze_history.len() > self.max_history_size {
+            self.eye_gaze_history.pop_front();
+        }
+    }
+
+    pub fn get_eye_gaze(&self, sample_timestamp: Duration) -> Option<Quat> {
+        self.eye_gaze_history
+            .iter()
+            .rev()
+            .find(|(timestamp, _)| *timestamp == sample_timestamp)
+            .map(|(_, gaze)| *gaze)
+    }
+
     pub fn unrecenter_view_params(&self, view_params: &mut [ViewParams; 2]) {
         for params in view_params {
             params.pose = self.inverse_recentering_origin.inverse() * params.pose;
@@ -261,6 +280,58 @@ impl TrackingManager {
     }
 }
 
+// Foveated encoding center shift of each view that puts the center region where the gaze hits it.
+// Like the center shift setting it goes from -1 to 1 across the view, the right view one being
+// mirrored horizontally. The setting is used when not following the gaze or without a gaze.
+pub fn foveation_center_shift(
+    config: &FoveatedEncodingConfig,
+    eye_gaze: Option<Quat>,
+    local_view_params: [ViewParams; 2],
+) -> [Vec2; 2] {
+    let static_shift = Vec2::new(config.center_shift_x, config.center_shift_y);
+    let Some(gaze) = eye_gaze.filter(|_| config.follow_eye_gaze) else {
+        return [static_shift; 2];
+    };
+
+    // The center region starts at (1 - center_size) / 2 * (shift + 1), the radial one being the
+    // square around its disk
+    let center_size = match config.shape {
+        FoveationShape::AxisAligned => Vec2::new(config.center_size_x, config.center_size_y),
+        FoveationShape::Radial { center_radius, .. } => Vec2::splat(center_radius),
+    };
+    let edge_size = (1.0 - center_size).max(Vec2::splat(f32::EPSILON));
+
+    let view_shift = |view: ViewParams| {
+        let direction = view.pose.orientation.inverse() * gaze * -Vec3::Z;
+        if direction.z >= 0.0 {
+            return static_shift;
+        }
+        let tangent = Vec2::new(direction.x, direction.y) / -direction.z;
+
+        let Fov {
+            left,
+            right,
+            up,
+            down,
+        } = view.fov;
+        let (left, right, up, down) = (left.tan(), right.tan(), up.tan(), down.tan());
+
+        // From the top left corner of the view
+        let uv = Vec2::new(
+            (tangent.x - left) / (right - left),
+            (up - tangent.y) / (up - down),
+        );
+
+        ((2.0 * uv - 1.0) / edge_size).clamp(Vec2::NEG_ONE, Vec2::ONE)
+    };
+
+    let left_shift = view_shift(local_view_params[0]);
+    let mut right_shift = view_shift(local_view_params[1]);
+    right_shift.x = -right_shift.x;
+
+    [left_shift, right_shift]
+}
+
 pub fn tracking_loop(
     ctx: &ConnectionContext,
     initial_settings: Settings,
@@ -374,6 +445,9 @@ pub fn tracking_loop(
             if let Some(skeleton) = tracking.hand_skeletons[1] {
                 tracking_manager_lock.report_hand_skeleton(HandType::Right, timestamp, skeleton);
             }
+            if let Some(gaze) = tracking.face.eyes_combined {
+                tracking_manager_lock.report_eye_gaze(timestamp, gaze);
+            }
 
             if let Some(sink) = &mut face_tracking_sink {
                 sink.send_tracking(&tracking.face);
@@ -80,6 +80,7 @@ pub async fn web_server(connection_context: Arc<ConnectionContext>) -> Result<()
                 .route("/buttons", routing::post(set_buttons))
                 .route("/insert-idr", routing::post(insert_idr))
                 .route("/capture-frame", routing::post(capture_frame))
+                .route("/log-gpu-memory", routing::post(log_gpu_memory))
                 .nest(
                     "/recording",
                     Router::new()
@@ -196,12 +197,16 @@ async fn capture_frame(State(ctx): State<Arc<ConnectionContext>>) {
     ctx.events_sender.send(ServerCoreEvent::CaptureFrame).ok();
 }
 
+async fn log_gpu_memory(State(ctx): State<Arc<ConnectionContext>>) {
+    ctx.events_sender.send(ServerCoreEvent::LogGpuMemory).ok();
+}
+
 async fn start_recording(State(ctx): State<Arc<ConnectionContext>>) {
     crate::create_recording_file(&ctx, crate::SESSION_MANAGER.read().settings())
 }
 
 async fn stop_recording(State(ctx): State<Arc<ConnectionContext>>) {
-    *ctx.video_recording_file.lock() = None;
+    *ctx.video_recorder.lock() = None;
 }
 
 async fn add_firewall_rules() {
@@ -1,4 +1,4 @@
-use std::{env, path::PathBuf};
+use std::{env, fs, path::PathBuf, process::Command};
 
 fn get_vulkan_headers_path(platform_name: &str) -> PathBuf {
     alvr_filesystem::deps_dir()
@@ -49,6 +49,7 @@ fn main() {
                 && entry.file_name() != "platform"
                 && (platform_name != "macos" || entry.file_name() != "amf")
                 && (platform_name != "linux" || entry.file_name() != "amf")
+                && (platform_name != "macos" || entry.file_name() != "nvenc")
         });
 
     let platform_iter = walkdir::WalkDir::new(platform_subpath).into_iter();
@@ -113,11 +114,29 @@ fn main() {
             assert!(x264_path.join("include").exists());
             build.include(x264_path.join("include"));
         }
+
+        // Installed when ffmpeg is built with nvenc, needed to share Vulkan memory with CUDA
+        let nv_codec_headers_path =
+            alvr_filesystem::deps_dir().join("linux/nv-codec-headers/build/include");
+        if nv_codec_headers_path.exists() {
+            build.include(nv_codec_headers_path);
+            build.define("ALVR_CUDA_INTEROP", None);
+        }
     }
 
     #[cfg(feature = "gpl")]
     build.define("ALVR_GPL", None);
 
+    // The C++ zones go to the Tracy client linked in by alvr_server_core
+    #[cfg(feature = "trace-performance")]
+    build.define("ALVR_TRACY", None);
+    #[cfg(feature = "check-allocations")]
+    build.define("ALVR_CHECK_ALLOCATIONS", None);
+    #[cfg(feature = "lock-stats")]
+    build.define("ALVR_LOCK_STATS", None);
+    #[cfg(feature = "tracking-replay")]
+    build.define("ALVR_TRACKING_REPLAY", None);
+
     if platform_name == "windows" {
         let vpl_path = alvr_filesystem::deps_dir().join("windows/libvpl/alvr_build");
         let vpl_include_path = vpl_path.join("include");
@@ -209,6 +228,182 @@ fn main() {
         }
     }
 
+    // These shaders are compiled here instead of being checked in. Without glslangValidator an
+    // empty module is embedded: FrameRender keeps one pass per stage instead of the fused compose
+    // shader, foveated encoding fails to start, the hidden area mask, temporal denoising, high
+    // quality downscaling, encoder side reprojection and the secondary video stream are disabled.
+    for (shader, fallback) in [
+        ("compose", "using separate passes"),
+        ("ffr", "foveated encoding is not available"),
+        ("mask", "the hidden area mask is disabled"),
+        ("denoise", "temporal denoising is disabled"),
+        ("downscale", "high quality downscaling is disabled"),
+        ("reproject", "encoder side reprojection is disabled"),
+        ("scale_yuv420", "the secondary video stream is disabled"),
+        ("rgbtonv12", "VAAPI converts with video processing"),
+    ] {
+        let spv_path = out_dir.join(format!("{shader}.comp.spv"));
+        let compiled = platform_name == "linux"
+            && Command::new("glslangValidator")
+                .arg("-V")
+                .arg(format!("cpp/platform/linux/shader/{shader}.comp"))
+                .arg("-o")
+                .arg(&spv_path)
+                .status()
+                .is_ok_and(|status| status.success());
+        if !compiled {
+            if platform_name == "linux" {
+                println!("cargo:warning=Failed to compile {shader}.comp, {fallback}");
+            }
+            fs::write(&spv_path, b"").unwrap();
+        }
+    }
+
+    // Variants of the shaders that write or read the Renderer outputs for 10 bit outputs. Any of
+    // them missing keeps the outputs 8 bit.
+    for shader in [
+        "quad",
+        "compose",
+        "downscale",
+        "rgbtoyuv420",
+        "scale_yuv420",
+    ] {
+        let spv_path = out_dir.join(format!("{shader}_10bit.comp.spv"));
+        let compiled = platform_name == "linux"
+            && Command::new("glslangValidator")
+                .arg("-V")
+                .arg("-DRGB10A2_OUTPUTS")
+                .arg(format!("cpp/platform/linux/shader/{shader}.comp"))
+                .arg("-o")
+                .arg(&spv_path)
+                .status()
+                .is_ok_and(|status| status.success());
+        if !compiled {
+            if platform_name == "linux" {
+                println!("cargo:warning=Failed to compile {shader}.comp for 10 bit outputs");
+            }
+            fs::write(&spv_path, b"").unwrap();
+        }
+    }
+
+    // rgbtoyuv420.comp writing host allocated planes for x264, empty without glslangValidator. The
+    // planes are then Vulkan images.
+    {
+        let spv_path = out_dir.join("rgbtoyuv420_host.comp.spv");
+        let compiled = platform_name == "linux"
+            && Command::new("glslangValidator")
+                .arg("-V")
+                .arg("-DHOST_BUFFER_OUTPUTS")
+                .arg("cpp/platform/linux/shader/rgbtoyuv420.comp")
+                .arg("-o")
+                .arg(&spv_path)
+                .status()
+                .is_ok_and(|status| status.success());
+        if !compiled {
+            if platform_name == "linux" {
+                println!("cargo:warning=Failed to compile rgbtoyuv420.comp for host planes");
+            }
+            fs::write(&spv_path, b"").unwrap();
+        }
+    }
+
+    // Variants doing the color math in half precision, for 8 bit outputs on devices with
+    // shaderFloat16. Any of them missing keeps the full precision one of that shader.
+    for shader in ["color", "compose"] {
+        let spv_path = out_dir.join(format!("{shader}_fp16.comp.spv"));
+        let compiled = platform_name == "linux"
+            && Command::new("glslangValidator")
+                .arg("-V")
+                .arg("-DFP16_ARITHMETIC")
+                .arg(format!("cpp/platform/linux/shader/{shader}.comp"))
+                .arg("-o")
+                .arg(&spv_path)
+                .status()
+                .is_ok_and(|status| status.success());
+        if !compiled {
+            if platform_name == "linux" {
+                println!("cargo:warning=Failed to compile {shader}.comp with fp16 arithmetic");
+            }
+            fs::write(&spv_path, b"").unwrap();
+        }
+    }
+
+    // Permutations of the Windows shaders for the settings that disable a part of them, so that the
+    // part is not branched over at every pixel. Without fxc they are empty and the checked in
+    // shaders are used. The color LUT ones read the color correction from a 3D texture, the
+    // foveated ones draw the layers straight into the foveated frame. DepthPlaneCS has no checked
+    // in build, the depth plane is not sent without fxc.
+    let permutations: [(&str, &str, &str, &str, &[&str]); 8] = [
+        (
+            "FrameRenderPS_linear",
+            "FrameRenderPS",
+            "ps_5_0",
+            "PS",
+            &["LINEAR_ENCODING"],
+        ),
+        (
+            "ColorCorrectionPixelShader_no_sharpening",
+            "ColorCorrectionPixelShader",
+            "ps_5_0",
+            "main",
+            &["NO_SHARPENING"],
+        ),
+        (
+            "ColorCorrectionPixelShader_lut",
+            "ColorCorrectionPixelShader",
+            "ps_5_0",
+            "main",
+            &["NO_SHARPENING", "COLOR_LUT"],
+        ),
+        (
+            "CompressAxisAlignedPixelShader_lut",
+            "CompressAxisAlignedPixelShader",
+            "ps_5_0",
+            "main",
+            &["COLOR_LUT"],
+        ),
+        (
+            "FrameRenderVS_foveated",
+            "FrameRenderVS",
+            "vs_5_0",
+            "VS",
+            &["FOVEATED"],
+        ),
+        (
+            "FrameRenderPS_foveated",
+            "FrameRenderPS",
+            "ps_5_0",
+            "PS",
+            &["FOVEATED"],
+        ),
+        (
+            "FrameRenderPS_foveated_linear",
+            "FrameRenderPS",
+            "ps_5_0",
+            "PS",
+            &["FOVEATED", "LINEAR_ENCODING"],
+        ),
+        ("DepthPlaneCS", "DepthPlaneCS", "cs_5_0", "main", &[]),
+    ];
+    for (name, shader, profile, entry, defines) in permutations {
+        let cso_path = out_dir.join(format!("{name}.cso"));
+        let compiled = platform_name == "windows"
+            && Command::new("fxc")
+                .args(["/nologo", "/O3", "/T", profile, "/E", entry])
+                .args(defines.iter().flat_map(|&define| ["/D", define]))
+                .arg("/Fo")
+                .arg(&cso_path)
+                .arg(format!("cpp/alvr_server/shader/{shader}.hlsl"))
+                .status()
+                .is_ok_and(|status| status.success());
+        if !compiled {
+            if platform_name == "windows" {
+                println!("cargo:warning=Failed to compile {name}.cso, using {shader}.cso");
+            }
+            fs::write(&cso_path, b"").unwrap();
+        }
+    }
+
     bindgen::builder()
         .clang_arg("-xc++")
         .header("cpp/alvr_server/bindings.h")
@@ -236,6 +431,18 @@ fn main() {
         println!("cargo:rustc-link-lib=openvr_api");
     }
 
+    if platform_name == "macos" {
+        for framework in [
+            "CoreFoundation",
+            "CoreMedia",
+            "CoreVideo",
+            "IOSurface",
+            "VideoToolbox",
+        ] {
+            println!("cargo:rustc-link-lib=framework={framework}");
+        }
+    }
+
     if platform_name == "linux" {
         #[cfg(target_os = "linux")]
         {
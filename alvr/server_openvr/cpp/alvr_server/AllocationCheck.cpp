@@ -0,0 +1,80 @@
+#include "AllocationCheck.h"
+
+#ifdef ALVR_CHECK_ALLOCATIONS
+
+#include "Logger.h"
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+namespace {
+
+// Runs of a site before its allocations are reported, for the buffers that grow to their steady
+// size and the caches filled on the first frames
+const uint64_t WARMUP_RUNS = 300;
+
+// Allocations of the thread since it started, only counted inside scopes
+thread_local uint64_t threadAllocations = 0;
+thread_local int threadScopeDepth = 0;
+
+void* allocate(size_t size) noexcept {
+    if (threadScopeDepth > 0) {
+        threadAllocations++;
+    }
+    return malloc(size == 0 ? 1 : size);
+}
+
+bool abortOnAllocation() {
+    static const bool abort = [] {
+        const char* mode = getenv("ALVR_CHECK_ALLOCATIONS");
+        return mode && strcmp(mode, "abort") == 0;
+    }();
+    return abort;
+}
+
+} // namespace
+
+void* operator new(size_t size) {
+    void* ptr = allocate(size);
+    if (!ptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void* operator new[](size_t size) {
+    void* ptr = allocate(size);
+    if (!ptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept { return allocate(size); }
+void* operator new[](size_t size, const std::nothrow_t&) noexcept { return allocate(size); }
+void operator delete(void* ptr) noexcept { free(ptr); }
+void operator delete[](void* ptr) noexcept { free(ptr); }
+void operator delete(void* ptr, size_t) noexcept { free(ptr); }
+void operator delete[](void* ptr, size_t) noexcept { free(ptr); }
+
+AllocationScope::AllocationScope(Site& site)
+    : m_site(site)
+    , m_startCount(threadAllocations) {
+    threadScopeDepth++;
+}
+
+AllocationScope::~AllocationScope() {
+    threadScopeDepth--;
+    unsigned long long count = threadAllocations - m_startCount;
+    if (m_site.runs.fetch_add(1, std::memory_order_relaxed) < WARMUP_RUNS || count == 0) {
+        return;
+    }
+
+    if (abortOnAllocation()) {
+        Error("%s: %llu heap allocations in the steady state\n", m_site.name, count);
+        std::abort();
+    }
+    LogPeriod(m_site.name, "%s: %llu heap allocations in the steady state", m_site.name, count);
+}
+
+#endif
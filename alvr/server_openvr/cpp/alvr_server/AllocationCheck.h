@@ -0,0 +1,48 @@
+#pragma once
+
+// Catches the heap allocations that creep back into the steady state of the frame path. Builds
+// with the check-allocations feature define ALVR_CHECK_ALLOCATIONS, which replaces the global
+// operator new of the driver to count the allocations of each thread. Without it the macro expands
+// to nothing.
+//
+// ALVR_NO_ALLOCATIONS(name) checks the rest of the enclosing scope. A scope that allocates is
+// reported, once its first runs, which fill the reused buffers, are over. With the environment
+// variable ALVR_CHECK_ALLOCATIONS=abort the driver aborts instead. Names must be string literals.
+// Allocations of the C libraries with malloc are not seen.
+
+#ifdef ALVR_CHECK_ALLOCATIONS
+
+#include <atomic>
+#include <stdint.h>
+
+class AllocationScope {
+public:
+    struct Site {
+        const char* name;
+        std::atomic<uint64_t> runs = 0;
+    };
+
+    explicit AllocationScope(Site& site);
+    ~AllocationScope();
+
+    AllocationScope(const AllocationScope&) = delete;
+    AllocationScope& operator=(const AllocationScope&) = delete;
+
+private:
+    Site& m_site;
+    uint64_t m_startCount;
+};
+
+#define ALVR_ALLOCATION_CONCAT_(a, b) a##b
+#define ALVR_ALLOCATION_CONCAT(a, b) ALVR_ALLOCATION_CONCAT_(a, b)
+#define ALVR_NO_ALLOCATIONS(name)                                                                  \
+    static AllocationScope::Site ALVR_ALLOCATION_CONCAT(allocationSite, __LINE__) = { name };      \
+    AllocationScope ALVR_ALLOCATION_CONCAT(allocationScope, __LINE__)(                             \
+        ALVR_ALLOCATION_CONCAT(allocationSite, __LINE__)                                           \
+    )
+
+#else
+
+#define ALVR_NO_ALLOCATIONS(name)
+
+#endif
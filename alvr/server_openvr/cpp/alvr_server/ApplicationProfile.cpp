@@ -0,0 +1,57 @@
+#include "ApplicationProfile.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+extern Settings g_settings;
+
+namespace {
+
+// Calls f with the member pointer of each field that profiles override
+template <typename F> void forEachProfileField(F f) {
+    f(&Settings::m_encoderQualityPreset);
+    f(&Settings::m_nvencQualityPreset);
+    f(&Settings::m_foveatedQpOffset);
+    f(&Settings::m_enableColorCorrection);
+    f(&Settings::m_brightness);
+    f(&Settings::m_contrast);
+    f(&Settings::m_saturation);
+    f(&Settings::m_gamma);
+    f(&Settings::m_sharpening);
+}
+
+#ifdef _WIN32
+std::string fileName(const std::string& path) {
+    size_t separator = path.find_last_of("/\\");
+    return separator == std::string::npos ? path : path.substr(separator + 1);
+}
+#endif
+
+} // namespace
+
+std::string GetProcessExecutable([[maybe_unused]] uint32_t pid) {
+#ifdef _WIN32
+    HANDLE process = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, pid);
+    if (!process) {
+        return "";
+    }
+    char path[MAX_PATH];
+    DWORD size = MAX_PATH;
+    bool found = QueryFullProcessImageNameA(process, 0, path, &size);
+    CloseHandle(process);
+    return found ? fileName(std::string(path, size)) : "";
+#else
+    return "";
+#endif
+}
+
+bool ApplicationSettingsChanged(const Settings& settings) {
+    bool changed = false;
+    forEachProfileField([&](auto field) { changed |= g_settings.*field != settings.*field; });
+    return changed;
+}
+
+void ApplyApplicationSettings(const Settings& settings) {
+    forEachProfileField([&](auto field) { g_settings.*field = settings.*field; });
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include "bindings.h"
+#include <stdint.h>
+#include <string>
+
+// Per game encoder settings, see VideoConfig::application_profiles. Windows only, the profile is
+// looked up when the game process creates its swap texture sets. On Linux the capture layer only
+// runs in vrcompositor and never sees the game process. Its bitrate bounds apply with the next
+// encoder parameters, its other fields when the encoder and the compose chain are created again.
+
+// File name of the executable of the process, empty if it can't be read
+std::string GetProcessExecutable(uint32_t pid);
+
+// For settings of ApplicationSettings, true if the settings instance doesn't have their profile
+// fields
+bool ApplicationSettingsChanged(const Settings& settings);
+// Copies the profile fields into the settings instance. Called on the thread that creates the
+// encoder, while it doesn't.
+void ApplyApplicationSettings(const Settings& settings);
@@ -0,0 +1,54 @@
+#include "CapturedFrames.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+
+std::vector<std::filesystem::path> ListCapturedFrames(const std::string& directory) {
+    std::vector<std::filesystem::path> paths;
+    for (const auto& entry : std::filesystem::directory_iterator(directory)) {
+        auto extension = entry.path().extension();
+        if (entry.is_regular_file() && (extension == ".ppm" || extension == ".rgba")) {
+            paths.push_back(entry.path());
+        }
+    }
+    std::sort(paths.begin(), paths.end());
+    return paths;
+}
+
+bool LoadCapturedFrame(const std::filesystem::path& path, CapturedFrame& frame) {
+    std::ifstream file(path, std::ios::in | std::ios::binary);
+    if (path.extension() == ".ppm") {
+        std::string magic;
+        uint32_t maxValue = 0;
+        file >> magic >> frame.width >> frame.height >> maxValue;
+        // Single whitespace before the samples
+        file.get();
+        if (!file || magic != "P6" || maxValue != 255) {
+            return false;
+        }
+        std::vector<uint8_t> rgb((size_t)frame.width * frame.height * 3);
+        file.read((char*)rgb.data(), rgb.size());
+        if (!file) {
+            return false;
+        }
+        frame.rgba.resize((size_t)frame.width * frame.height * 4);
+        for (size_t i = 0; i < (size_t)frame.width * frame.height; i++) {
+            frame.rgba[i * 4] = rgb[i * 3];
+            frame.rgba[i * 4 + 1] = rgb[i * 3 + 1];
+            frame.rgba[i * 4 + 2] = rgb[i * 3 + 2];
+            frame.rgba[i * 4 + 3] = 255;
+        }
+        return true;
+    }
+
+    std::string stem = path.stem().string();
+    size_t separator = stem.rfind('_');
+    if (separator == std::string::npos
+        || sscanf(stem.c_str() + separator + 1, "%ux%u", &frame.width, &frame.height) != 2) {
+        return false;
+    }
+    frame.rgba.resize((size_t)frame.width * frame.height * 4);
+    file.read((char*)frame.rgba.data(), frame.rgba.size());
+    return (bool)file;
+}
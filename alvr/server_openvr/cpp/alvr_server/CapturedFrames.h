@@ -0,0 +1,21 @@
+#pragma once
+
+#include <filesystem>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Frames the encode benchmarks replay: PPM files as written by the frame captures, or raw RGBA
+// dumps named <name>_<width>x<height>.rgba
+
+struct CapturedFrame {
+    uint32_t width = 0;
+    uint32_t height = 0;
+    std::vector<uint8_t> rgba;
+};
+
+// Captured frames of directory in name order
+std::vector<std::filesystem::path> ListCapturedFrames(const std::string& directory);
+
+// False if path is not a readable captured frame
+bool LoadCapturedFrame(const std::filesystem::path& path, CapturedFrame& frame);
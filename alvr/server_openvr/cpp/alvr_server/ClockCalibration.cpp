@@ -0,0 +1,48 @@
+#include "ClockCalibration.h"
+
+#include <cmath>
+
+bool ClockCalibration::NeedsSample(uint64_t cpuNs) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    return !m_calibrated || cpuNs - m_lastSampleCpuNs >= SAMPLE_INTERVAL_NS;
+}
+
+void ClockCalibration::AddSample(uint64_t gpuNs, uint64_t cpuNs, uint64_t deviationNs) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_lastSampleCpuNs = cpuNs;
+
+    if (!m_calibrated) {
+        m_calibrated = true;
+    } else if (deviationNs > MAX_DEVIATION_NS && deviationNs >= m_deviationNs) {
+        return;
+    } else if (gpuNs > m_gpuNs && cpuNs > m_cpuNs) {
+        double rate = double(cpuNs - m_cpuNs) / double(gpuNs - m_gpuNs);
+        if (std::abs(rate - 1.0) <= MAX_DRIFT) {
+            m_rate += (rate - m_rate) * RATE_SMOOTHING;
+        }
+    }
+
+    m_gpuNs = gpuNs;
+    m_cpuNs = cpuNs;
+    m_deviationNs = deviationNs;
+}
+
+void ClockCalibration::Reset() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_calibrated = false;
+    m_rate = 1.0;
+}
+
+bool ClockCalibration::IsCalibrated() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    return m_calibrated;
+}
+
+uint64_t ClockCalibration::ToSteadyTimeNs(uint64_t gpuNs) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (!m_calibrated) {
+        return 0;
+    }
+    double elapsedNs = double(int64_t(gpuNs - m_gpuNs)) * m_rate;
+    return m_cpuNs + int64_t(std::llround(elapsedNs));
+}
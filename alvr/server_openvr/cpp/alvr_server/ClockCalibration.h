@@ -0,0 +1,39 @@
+#pragma once
+
+#include <mutex>
+#include <stdint.h>
+
+// Maps the timestamps of a GPU clock to the steady clock of GetSteadyTimeNs, so that the GPU
+// times of the timing reports land on the same timeline as the CPU ones. The GPU clock is sampled
+// together with the steady clock about once per second, and the rate between the two follows the
+// drift of the GPU clock in between.
+class ClockCalibration {
+public:
+    // True if a new sample should be taken at cpuNs, steady clock time
+    bool NeedsSample(uint64_t cpuNs);
+    // gpuNs and cpuNs were read at the same time, within deviationNs. Samples less exact than
+    // MAX_DEVIATION_NS are only used until a better one is given.
+    void AddSample(uint64_t gpuNs, uint64_t cpuNs, uint64_t deviationNs);
+    // Forgets the samples, for a new device
+    void Reset();
+
+    bool IsCalibrated();
+    // Steady clock time of gpuNs, 0 if not calibrated
+    uint64_t ToSteadyTimeNs(uint64_t gpuNs);
+
+private:
+    static const uint64_t SAMPLE_INTERVAL_NS = 1'000'000'000;
+    static const uint64_t MAX_DEVIATION_NS = 50'000;
+    // Rates further than this from 1 come from a bad sample, not from drift
+    static constexpr double MAX_DRIFT = 1e-3;
+    // Weight of the rate of the latest interval
+    static constexpr double RATE_SMOOTHING = 0.2;
+
+    std::mutex m_mutex;
+    bool m_calibrated = false;
+    uint64_t m_gpuNs = 0;
+    uint64_t m_cpuNs = 0;
+    uint64_t m_deviationNs = 0;
+    uint64_t m_lastSampleCpuNs = 0;
+    double m_rate = 1.0;
+};
@@ -3,28 +3,85 @@
 #include "ALVR-common/packet_types.h"
 #include "TrackedDevice.h"
 #include "openvr_driver_wrap.h"
-#include <map>
+#include <vector>
 
 class Controller : public TrackedDevice {
 public:
     Controller(uint64_t deviceID, vr::EVRSkeletalTrackingLevel skeletonLevel);
     virtual ~Controller() {};
     void RegisterButton(uint64_t id);
+    // Does nothing for buttons not registered on this controller
     void SetButton(uint64_t id, FfiButtonValue value);
     bool OnPoseUpdate(uint64_t targetTimestampNs, float predictionS, FfiHandData handData);
 
 private:
     static const int SKELETON_BONE_COUNT = 31;
     static const int ANIMATION_FRAME_COUNT = 15;
+    // Joints rounded up to a multiple of the SIMD width, the padding lane is an identity rotation
+    static const int JOINT_LANES = 32;
 
-    std::map<uint64_t, vr::VRInputComponentHandle_t> m_buttonHandles;
+    // Hand skeleton joint rotations stored one component (w, x, y, z) per row, so that the
+    // prediction loops run over contiguous floats and vectorize
+    struct JointRotations {
+        alignas(16) float c[4][JOINT_LANES];
+    };
+
+    // Inputs that drive the inferred hand skeleton
+    enum class HandInput {
+        None,
+        ThumbTouch,
+        TriggerTouch,
+        TriggerValue,
+        GripValue,
+    };
+
+    // A registered button. Its SteamVR components are a range of m_componentHandles.
+    struct ButtonEntry {
+        uint64_t id;
+        size_t firstComponent;
+        size_t componentCount;
+        HandInput handInput;
+    };
+
+    // Dispatch table built by RegisterButton, sorted by button ID
+    std::vector<ButtonEntry> m_buttons;
+    std::vector<vr::VRInputComponentHandle_t> m_componentHandles;
+
+    // Steps per unit of the change detection of the finger curls and of the skeleton bones.
+    // Values that round to the last submitted ones are not sent to SteamVR again.
+    static constexpr float SCALAR_STEPS = 1024.0f;
+    static constexpr float ROTATION_STEPS = 4096.0f;
+    // Tenths of a millimeter
+    static constexpr float POSITION_STEPS = 10000.0f;
+
+    struct ScalarComponent {
+        vr::VRInputComponentHandle_t handle = vr::k_ulInvalidInputComponentHandle;
+        int32_t submitted = INT32_MIN;
+    };
+
+    // Quantized orientation and position of the bones last submitted for a motion range
+    struct SubmittedSkeleton {
+        bool valid = false;
+        int32_t bones[SKELETON_BONE_COUNT][7];
+    };
 
     vr::VRInputComponentHandle_t m_compHaptic;
+    ScalarComponent m_fingerIndex;
+    ScalarComponent m_fingerMiddle;
+    ScalarComponent m_fingerRing;
+    ScalarComponent m_fingerPinky;
     vr::VRInputComponentHandle_t m_compSkeleton = vr::k_ulInvalidInputComponentHandle;
     vr::EVRSkeletalTrackingLevel m_skeletonLevel;
+    // With and without controller
+    SubmittedSkeleton m_submittedSkeletons[2];
 
     uint64_t m_poseTargetTimestampNs;
 
+    // Alpha-beta filter state of the hand skeleton rotations and their rate of change per second
+    JointRotations m_jointRotations;
+    JointRotations m_jointRotationRates;
+    bool m_jointFilterValid = false;
+
     // These variables are used for controller hand animation
     // todo: move to rust
     float m_thumbTouchAnimationProgress = 0;
@@ -37,7 +94,13 @@ private:
     float m_gripValue = 0;
 
     vr::VRInputComponentHandle_t getHapticComponent();
+    void UpdateScalar(ScalarComponent& component, float value);
+    void
+    UpdateSkeleton(vr::EVRSkeletalMotionRange motionRange, const vr::VRBoneTransform_t bones[]);
     void GetBoneTransform(bool withController, vr::VRBoneTransform_t outBoneTransform[]);
+    void PredictJointRotations(
+        const FfiHandSkeleton& skeleton, double dt, float predictionS, JointRotations& predicted
+    );
 
     // TrackedDevice
     bool activate() final;
@@ -0,0 +1,62 @@
+#include "DynamicResolution.h"
+
+#include "PresentPacing.h"
+#include <algorithm>
+
+namespace {
+
+const uint64_t WINDOW_NS = 1'000'000'000;
+// Windows with fewer presents say little about the game, like while it loads
+const uint64_t MIN_WINDOW_ARRIVALS = 10;
+// Fractions of late presents in a window that lower and that allow raising the scale
+const double LOWER_LATE_FRACTION = 0.1;
+const double RAISE_LATE_FRACTION = 0.02;
+// Consecutive good windows before raising
+const int RAISE_WINDOWS = 5;
+const float LOWER_STEP = 0.1f;
+const float RAISE_STEP = 0.05f;
+
+} // namespace
+
+DynamicResolution::DynamicResolution(float minScale)
+    : m_minScale(std::clamp(minScale, 0.1f, 1.0f)) { }
+
+bool DynamicResolution::Update(uint64_t timeNs) {
+    if (m_windowStartNs == 0) {
+        m_windowStartNs = timeNs;
+        uint64_t arrivals, late;
+        TakePresentLateness(arrivals, late);
+        return false;
+    }
+    if (timeNs - m_windowStartNs < WINDOW_NS) {
+        return false;
+    }
+    m_windowStartNs = timeNs;
+
+    uint64_t arrivals, late;
+    TakePresentLateness(arrivals, late);
+    if (arrivals < MIN_WINDOW_ARRIVALS) {
+        m_goodWindows = 0;
+        return false;
+    }
+
+    float scale = m_scale;
+    double lateFraction = double(late) / arrivals;
+    if (lateFraction > LOWER_LATE_FRACTION) {
+        m_goodWindows = 0;
+        scale = std::max(m_minScale, scale - LOWER_STEP);
+    } else if (lateFraction < RAISE_LATE_FRACTION) {
+        if (++m_goodWindows >= RAISE_WINDOWS) {
+            m_goodWindows = 0;
+            scale = std::min(1.0f, scale + RAISE_STEP);
+        }
+    } else {
+        m_goodWindows = 0;
+    }
+
+    if (scale == m_scale) {
+        return false;
+    }
+    m_scale = scale;
+    return true;
+}
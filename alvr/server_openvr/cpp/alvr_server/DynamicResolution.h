@@ -0,0 +1,23 @@
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+
+// Scale of the render target size recommended to the game, lowered while the game misses vsyncs
+// so that it renders fewer pixels before frames get dropped, and raised back once it keeps up.
+// Lowering is quick and raising slow, so that a game at the edge doesn't flip between two sizes.
+class DynamicResolution {
+public:
+    explicit DynamicResolution(float minScale);
+
+    // Called regularly with the steady clock time. Returns true when the scale changed.
+    bool Update(uint64_t timeNs);
+    float Scale() const { return m_scale; }
+
+private:
+    const float m_minScale;
+    std::atomic<float> m_scale = 1.0f;
+
+    uint64_t m_windowStartNs = 0;
+    int m_goodWindows = 0;
+};
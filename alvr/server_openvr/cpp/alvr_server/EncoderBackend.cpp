@@ -0,0 +1,106 @@
+#include "EncoderBackend.h"
+
+#include "Logger.h"
+#include "Settings.h"
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <map>
+
+namespace {
+
+std::filesystem::path cachePath() {
+    return std::filesystem::path(g_sessionPath).parent_path() / "encoder_backends.txt";
+}
+
+std::string cacheKey(const std::string& gpuId) {
+    return gpuId + "_" + std::to_string(Settings_Instance()->m_codec) + "_"
+        + (Settings_Instance()->m_use10bitEncoder ? "10bit" : "8bit");
+}
+
+// One "<key> <backend>" line per GPU, codec and bit depth
+std::map<std::string, EncoderBackend> loadCache() {
+    std::map<std::string, EncoderBackend> cache;
+    std::ifstream file(cachePath());
+    std::string key;
+    unsigned int backend;
+    while (file >> key >> backend) {
+        if (backend > (unsigned int)EncoderBackend::Automatic
+            && backend <= (unsigned int)EncoderBackend::Software) {
+            cache[key] = EncoderBackend(backend);
+        }
+    }
+    return cache;
+}
+
+}
+
+const char* EncoderBackendName(EncoderBackend backend) {
+    switch (backend) {
+    case EncoderBackend::Automatic:
+        return "Automatic";
+    case EncoderBackend::Nvenc:
+        return "NVENC";
+    case EncoderBackend::Amf:
+        return "AMF";
+    case EncoderBackend::Vpl:
+        return "VPL";
+    case EncoderBackend::Vaapi:
+        return "VAAPI";
+    case EncoderBackend::VulkanVideo:
+        return "Vulkan Video";
+    case EncoderBackend::Software:
+        return "Software";
+    }
+    return "Unknown";
+}
+
+std::vector<EncoderBackend>
+EncoderBackendProbeOrder(const std::string& gpuId, std::vector<EncoderBackend> defaultOrder) {
+    auto forced = EncoderBackend(Settings_Instance()->m_forceEncoderBackend);
+    if (forced != EncoderBackend::Automatic) {
+        Info("Encoder backend forced to %s", EncoderBackendName(forced));
+        return { forced };
+    }
+
+    auto cache = loadCache();
+    auto cached = cache.find(cacheKey(gpuId));
+    if (cached != cache.end()) {
+        auto it = std::find(defaultOrder.begin(), defaultOrder.end(), cached->second);
+        if (it != defaultOrder.end()) {
+            Info("Trying %s encoder first, it worked last time", EncoderBackendName(*it));
+            std::rotate(defaultOrder.begin(), it, it + 1);
+        }
+    }
+    return defaultOrder;
+}
+
+void StoreEncoderBackend(const std::string& gpuId, EncoderBackend backend) {
+    auto cache = loadCache();
+    auto key = cacheKey(gpuId);
+    auto cached = cache.find(key);
+    if (cached != cache.end() && cached->second == backend) {
+        return;
+    }
+    cache[key] = backend;
+
+    // Written to a temporary file first so concurrent readers never see a partial file
+    auto path = cachePath();
+    auto tmpPath = path;
+    tmpPath += ".tmp";
+    {
+        std::ofstream file(tmpPath, std::ios::trunc);
+        for (const auto& [entryKey, entryBackend] : cache) {
+            file << entryKey << " " << (unsigned int)entryBackend << "\n";
+        }
+        if (!file) {
+            Warn("Failed to write %s", tmpPath.string().c_str());
+            return;
+        }
+    }
+    std::error_code ec;
+    std::filesystem::rename(tmpPath, path, ec);
+    if (ec) {
+        Warn("Failed to write %s: %s", path.string().c_str(), ec.message().c_str());
+    }
+}
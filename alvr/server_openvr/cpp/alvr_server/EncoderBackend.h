@@ -0,0 +1,26 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+// Values of Settings::m_forceEncoderBackend
+enum class EncoderBackend : unsigned int {
+    Automatic = 0,
+    Nvenc = 1,
+    Amf = 2,
+    Vpl = 3,
+    Vaapi = 4,
+    VulkanVideo = 5,
+    Software = 6,
+};
+
+const char* EncoderBackendName(EncoderBackend backend);
+
+// Backends to try for the GPU identified by gpuId, which should also change with the driver
+// version. Only the forced backend if the settings force one, otherwise defaultOrder with the
+// backend that last worked on this GPU, codec and bit depth moved first.
+std::vector<EncoderBackend>
+EncoderBackendProbeOrder(const std::string& gpuId, std::vector<EncoderBackend> defaultOrder);
+
+// Remembers the backend that worked, for EncoderBackendProbeOrder on the next stream start
+void StoreEncoderBackend(const std::string& gpuId, EncoderBackend backend);
@@ -0,0 +1,95 @@
+#include "EncoderControl.h"
+
+#include <cmath>
+
+namespace {
+
+// Encoders undershoot on content that is easy to compress whatever their target, the correction
+// raises the bitrate less than it lowers it
+const float MIN_BITRATE_CORRECTION = 0.5f;
+const float MAX_BITRATE_CORRECTION = 1.25f;
+// Smaller changes don't push new parameters to the encoder
+const float MIN_CORRECTION_CHANGE = 0.02f;
+
+} // namespace
+
+EncoderControl g_encoderControl;
+
+void EncoderControl::Update(FfiDynamicEncoderParams params) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_params = params;
+    m_params.updated = 1;
+    m_generation.fetch_add(1, std::memory_order_release);
+}
+
+void EncoderControl::Reset() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_params = {};
+    m_bitrateCorrection = 1.f;
+    m_windowBytes = 0;
+    m_windowFrames = 0;
+    m_generation.fetch_add(1, std::memory_order_release);
+}
+
+void EncoderControl::SetGovernorScale(float scale) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (scale == m_governorScale) {
+        return;
+    }
+    m_governorScale = scale;
+    // Before the first parameters of the server core, the encoders keep their settings
+    if (m_params.updated) {
+        m_generation.fetch_add(1, std::memory_order_release);
+    }
+}
+
+void EncoderControl::ReportFrameSize(uint64_t bytes) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    // Before the first parameters of the server core, the encoders keep the bitrate of their
+    // settings
+    if (!m_params.updated || m_params.framerate < 1.f || m_params.bitrate_bps == 0) {
+        return;
+    }
+    m_windowBytes += bytes;
+    if (++m_windowFrames < uint32_t(m_params.framerate)) {
+        return;
+    }
+
+    // Per frame, so that the frames the encoder skipped don't count as an undershoot
+    double requestedBits = double(m_params.bitrate_bps) / m_params.framerate * m_windowFrames;
+    double outputBits = double(m_windowBytes) * 8;
+    m_windowBytes = 0;
+    m_windowFrames = 0;
+    if (outputBits == 0) {
+        return;
+    }
+    // Halfway to the ratio of the window, one unusual second doesn't swing the bitrate
+    float correction = std::clamp(
+        float(m_bitrateCorrection * std::sqrt(requestedBits / outputBits)),
+        MIN_BITRATE_CORRECTION,
+        MAX_BITRATE_CORRECTION
+    );
+    if (std::abs(correction - m_bitrateCorrection) < MIN_CORRECTION_CHANGE * m_bitrateCorrection) {
+        return;
+    }
+    m_bitrateCorrection = correction;
+    m_generation.fetch_add(1, std::memory_order_release);
+}
+
+FfiDynamicEncoderParams EncoderControl::Poll(uint64_t& lastGeneration) {
+    if (m_generation.load(std::memory_order_acquire) == lastGeneration) {
+        return {};
+    }
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    lastGeneration = m_generation.load(std::memory_order_relaxed);
+    FfiDynamicEncoderParams params = m_params;
+    if (params.updated) {
+        params.bitrate_bps = uint64_t(params.bitrate_bps * m_bitrateCorrection);
+    }
+    if (params.updated && m_governorScale < 1.f) {
+        float scale = params.resolution_scale > 0.f ? params.resolution_scale : 1.f;
+        params.resolution_scale = scale * m_governorScale;
+    }
+    return params;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "bindings.h"
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <stdint.h>
+
+// Dynamic encoder parameters pushed by the server core. Encoders compare the generation once per
+// frame, which is a single atomic load, and only take the lock to copy a new block. Each encoder
+// applies the change at the start of the next frame it encodes.
+class EncoderControl {
+public:
+    // Called by the server core when the bitrate manager has new parameters
+    void Update(FfiDynamicEncoderParams params);
+    // Drops the parameters of the last session, so that a new encoder starts from its settings
+    void Reset();
+    // Fraction of the encoding resolution kept by the QualityGovernor, applied on top of
+    // resolution_scale
+    void SetGovernorScale(float scale);
+    // Called by the encoders for every frame they output, with its size. Every encoder misses the
+    // target bitrate by its own margin, the bitrate it is given is corrected by the ratio of the
+    // requested bits to the output ones over the last second of frames.
+    void ReportFrameSize(uint64_t bytes);
+
+    // Latest parameters if they changed since lastGeneration, which is updated. Otherwise or after
+    // a reset, updated is 0.
+    FfiDynamicEncoderParams Poll(uint64_t& lastGeneration);
+
+private:
+    std::mutex m_mutex;
+    FfiDynamicEncoderParams m_params = {};
+    float m_governorScale = 1.f;
+    float m_bitrateCorrection = 1.f;
+    uint64_t m_windowBytes = 0;
+    uint32_t m_windowFrames = 0;
+    std::atomic<uint64_t> m_generation = 0;
+};
+
+extern EncoderControl g_encoderControl;
+
+// Rate control buffer of bufferBits, no larger than FfiDynamicEncoderParams::max_frame_bytes. With
+// a buffer of at most the cap, no frame is larger than what the network can deliver in time.
+inline uint64_t CapToMaxFrameSize(uint64_t maxFrameBytes, uint64_t bufferBits) {
+    if (maxFrameBytes == 0) {
+        return bufferBits;
+    }
+    return std::min<uint64_t>(bufferBits, maxFrameBytes * 8);
+}
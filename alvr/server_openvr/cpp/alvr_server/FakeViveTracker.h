@@ -9,6 +9,9 @@ public:
     FakeViveTracker(uint64_t deviceID);
     void OnPoseUpdated(uint64_t targetTimestampNs, const FfiDeviceMotion* motion);
 
+    // Body path hash of the tracker, device_id is reset on deactivation
+    const uint64_t body_id;
+
 private:
     // TrackedDevice
     bool activate() final;
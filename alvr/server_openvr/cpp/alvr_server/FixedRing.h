@@ -0,0 +1,37 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+
+// Queue of at most N items stored in place, for the per frame queues that a deque would allocate
+// nodes for. Pushing to a full ring drops its oldest item.
+template <typename T, size_t N> class FixedRing {
+public:
+    void push_back(const T& item) {
+        if (m_size == N) {
+            pop_front();
+        }
+        m_items[(m_first + m_size) % N] = item;
+        m_size++;
+    }
+
+    void pop_front() {
+        m_first = (m_first + 1) % N;
+        m_size--;
+    }
+
+    T& front() { return m_items[m_first]; }
+    const T& front() const { return m_items[m_first]; }
+
+    // The index-th oldest item
+    const T& operator[](size_t index) const { return m_items[(m_first + index) % N]; }
+
+    size_t size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+    void clear() { m_size = 0; }
+
+private:
+    std::array<T, N> m_items = {};
+    size_t m_first = 0;
+    size_t m_size = 0;
+};
@@ -0,0 +1,273 @@
+#include "FoveatedQpMap.h"
+#include "HiddenAreaMask.h"
+#include "OverlayCoverage.h"
+#include "RadialFoveation.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace {
+
+// Frames averaged before each step of the largest offset, about a second
+const uint32_t QP_WINDOW_FRAMES = 60;
+// Distance from the target QP within which the offset is kept
+const float QP_TOLERANCE = 1.f;
+
+struct CenterBounds {
+    float lo;
+    float hi;
+};
+
+// Center region along one axis of an eye, in eye UVs of the encoded frame. The compression keeps
+// it at full resolution, see CompressAxisAlignedPixelShader.hlsl.
+CenterBounds GetCenterBounds(float shift, float centerSize, float edgeRatio) {
+    float c0 = (1.f - centerSize) / 2.f;
+    if (Settings_Instance()->m_enableFoveatedEncoding) {
+        float c2 = (edgeRatio - 1.f) * centerSize + 1.f;
+        return { c0 * (shift + 1.f) / c2, c0 * (shift - 1.f) / c2 + 1.f };
+    }
+    float lo = c0 * (shift + 1.f);
+    return { lo, lo + centerSize };
+}
+
+// Bounds of the full resolution disk of the radial compression, see RadialFoveation.h
+CenterBounds GetRadialCenterBounds(float shift) {
+    RadialFoveation radial = GetRadialFoveation();
+    float center = RadialFoveationCenter(shift, radial.radius);
+    float radius = Settings_Instance()->m_enableFoveatedEncoding ? radial.radius / radial.scale
+                                                                 : radial.radius;
+    return { center * (1.f - radius), center + (1.f - center) * radius };
+}
+
+void GetEyeBounds(
+    const FfiFoveationCenter& center, int eye, CenterBounds& boundsX, CenterBounds& boundsY
+) {
+    const Settings* settings = Settings_Instance();
+    if (settings->m_foveationRadial) {
+        boundsX = GetRadialCenterBounds(eye == 0 ? center.leftShiftX : center.rightShiftX);
+        boundsY = GetRadialCenterBounds(eye == 0 ? center.leftShiftY : center.rightShiftY);
+        return;
+    }
+    boundsX = GetCenterBounds(
+        eye == 0 ? center.leftShiftX : center.rightShiftX,
+        settings->m_foveationCenterSizeX,
+        settings->m_foveationEdgeRatioX
+    );
+    boundsY = GetCenterBounds(
+        eye == 0 ? center.leftShiftY : center.rightShiftY,
+        settings->m_foveationCenterSizeY,
+        settings->m_foveationEdgeRatioY
+    );
+}
+
+// Eye UV of the composition frame at an eye UV of the encoded frame along one axis, the inverse of
+// the compression. See CompressedToTextureUV in FoveatedRendering.hlsli.
+float CompressedToEyeUv(float uv, float shift, float centerSize, float edgeRatio) {
+    if (!Settings_Instance()->m_enableFoveatedEncoding) {
+        return uv;
+    }
+    float c0 = (1.f - centerSize) / 2.f;
+    float c1 = (edgeRatio - 1.f) * c0 * (shift + 1.f) / edgeRatio;
+    float c2 = (edgeRatio - 1.f) * centerSize + 1.f;
+    float lo = c0 * (shift + 1.f) / c2;
+    float hi = c0 * (shift - 1.f) / c2 + 1.f;
+
+    float center = uv * c2 / edgeRatio + c1;
+    if (uv < lo) {
+        float g = uv / lo;
+        return g * center + (1.f - g) * uv * c2;
+    } else if (uv > hi) {
+        float g = (1.f - uv) / (1.f - hi);
+        return g * center + (1.f - g) * ((uv - 1.f) * c2 + 1.f);
+    }
+    return center;
+}
+
+// 0 in the center region, 1 at the edges of the eye
+float PeripheryDistance(float uv, const CenterBounds& bounds) {
+    if (uv < bounds.lo) {
+        return (bounds.lo - uv) / bounds.lo;
+    } else if (uv > bounds.hi) {
+        return bounds.hi < 1.f ? std::min((uv - bounds.hi) / (1.f - bounds.hi), 1.f) : 1.f;
+    }
+    return 0.f;
+}
+
+} // namespace
+
+FoveatedRect GetFoveatedRect(
+    const FfiFoveationCenter& center, int eye, float spread, uint32_t width, uint32_t height
+) {
+    CenterBounds boundsX, boundsY;
+    GetEyeBounds(center, eye, boundsX, boundsY);
+
+    float loX = std::max(boundsX.lo * (1.f - spread), 0.f);
+    float hiX = std::min(boundsX.hi + (1.f - boundsX.hi) * spread, 1.f);
+    float loY = std::max(boundsY.lo * (1.f - spread), 0.f);
+    float hiY = std::min(boundsY.hi + (1.f - boundsY.hi) * spread, 1.f);
+
+    // The right eye UVs are mirrored horizontally
+    float eyeWidth = width / 2.f;
+    FoveatedRect rect;
+    if (eye == 0) {
+        rect.left = (uint32_t)std::floor(loX * eyeWidth);
+        rect.right = (uint32_t)std::ceil(hiX * eyeWidth);
+    } else {
+        rect.left = (uint32_t)std::floor(width - hiX * eyeWidth);
+        rect.right = (uint32_t)std::ceil(width - loX * eyeWidth);
+    }
+    rect.top = (uint32_t)std::floor(loY * height);
+    rect.bottom = (uint32_t)std::ceil(hiY * height);
+    return rect;
+}
+
+FoveatedQpMap::FoveatedQpMap(uint32_t blockSize)
+    : m_blockSize(blockSize)
+    , m_offsetLimit(Settings_Instance()->m_foveatedQpOffset)
+    , m_maxOffset(m_offsetLimit)
+    , m_targetQp(Settings_Instance()->m_foveatedTargetQp)
+    , m_overlayOffset(Settings_Instance()->m_overlayQpOffset)
+    , m_staticOffset(Settings_Instance()->m_staticBlockQpOffset) { }
+
+void FoveatedQpMap::TuneMaxOffset() {
+    float averageQp = m_reportedQp.exchange(-1.f);
+    if (m_targetQp == 0 || averageQp < 0.f) {
+        return;
+    }
+    // The offsets raise the average by themselves, a stronger periphery would never come down
+    m_qpSum += averageQp - m_meanOffset;
+    if (++m_qpFrames < QP_WINDOW_FRAMES) {
+        return;
+    }
+    float centerQp = m_qpSum / m_qpFrames;
+    m_qpSum = 0.f;
+    m_qpFrames = 0;
+
+    if (centerQp > m_targetQp + QP_TOLERANCE) {
+        m_maxOffset = std::min(m_maxOffset + 1, m_offsetLimit);
+    } else if (centerQp < m_targetQp - QP_TOLERANCE) {
+        m_maxOffset = std::max(m_maxOffset - 1, 0);
+    }
+}
+
+bool FoveatedQpMap::OverlayCovers(const FfiFoveationCenter& center, float u, float v) const {
+    const Settings* settings = Settings_Instance();
+    int eye = u > 0.5f ? 1 : 0;
+    float shiftX = eye == 0 ? center.leftShiftX : center.rightShiftX;
+    float shiftY = eye == 0 ? center.leftShiftY : center.rightShiftY;
+    float eyeU = eye == 1 ? (1.f - u) * 2.f : u * 2.f;
+    float eyeV = v;
+    if (settings->m_enableFoveatedEncoding && settings->m_foveationRadial) {
+        RadialCompressedToEyeUv(GetRadialFoveation(), shiftX, shiftY, eyeU, eyeV);
+    } else {
+        eyeU = CompressedToEyeUv(
+            eyeU, shiftX, settings->m_foveationCenterSizeX, settings->m_foveationEdgeRatioX
+        );
+        eyeV = CompressedToEyeUv(
+            eyeV, shiftY, settings->m_foveationCenterSizeY, settings->m_foveationEdgeRatioY
+        );
+    }
+    // The cells are of the composition frame, with the right eye mirrored back
+    float frameU = eye == 1 ? 1.f - eyeU / 2.f : eyeU / 2.f;
+    uint32_t x = std::min((uint32_t)std::max(frameU * m_overlayWidth, 0.f), m_overlayWidth - 1);
+    uint32_t y = std::min((uint32_t)std::max(eyeV * m_overlayHeight, 0.f), m_overlayHeight - 1);
+    return m_overlayCells[y * m_overlayWidth + x] != 0;
+}
+
+bool FoveatedQpMap::BlockStatic(
+    const StaticBlocks& blocks, float left, float top, float right, float bottom
+) {
+    uint32_t x0 = std::min((uint32_t)(left * blocks.width), blocks.width - 1);
+    uint32_t x1 = std::clamp((uint32_t)std::ceil(right * blocks.width), x0 + 1, blocks.width);
+    uint32_t y0 = std::min((uint32_t)(top * blocks.height), blocks.height - 1);
+    uint32_t y1 = std::clamp((uint32_t)std::ceil(bottom * blocks.height), y0 + 1, blocks.height);
+    for (uint32_t y = y0; y < y1; y++) {
+        for (uint32_t x = x0; x < x1; x++) {
+            if (blocks.cells[y * blocks.width + x] == 0) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+bool FoveatedQpMap::Update(
+    const FfiFoveationCenter& center,
+    uint32_t width,
+    uint32_t height,
+    const StaticBlocks* staticBlocks
+) {
+    TuneMaxOffset();
+    bool overlaysChanged = m_overlayOffset > 0
+        && GetOverlayCoverage(m_overlayVersion, m_overlayCells, m_overlayWidth, m_overlayHeight);
+    // The static blocks are of a single frame
+    bool useStatic = m_staticOffset > 0 && staticBlocks && staticBlocks->width > 0;
+    if (width == m_width && height == m_height && m_maxOffset == m_builtMaxOffset
+        && !overlaysChanged && !useStatic && !m_builtStatic
+        && memcmp(&center, &m_center, sizeof(center)) == 0) {
+        return false;
+    }
+    m_builtStatic = useStatic;
+    m_builtMaxOffset = m_maxOffset;
+    m_center = center;
+    m_width = width;
+    m_height = height;
+    m_blocksX = (width + m_blockSize - 1) / m_blockSize;
+    m_blocksY = (height + m_blockSize - 1) / m_blockSize;
+    m_offsets.resize(m_blocksX * m_blocksY);
+
+    CenterBounds boundsX[2], boundsY[2];
+    for (int eye = 0; eye < 2; eye++) {
+        GetEyeBounds(center, eye, boundsX[eye], boundsY[eye]);
+    }
+    // The hidden area is in the layout of the eye images, which the periphery compression changes
+    bool maskHidden = IsHiddenAreaMaskEnabled() && !Settings_Instance()->m_enableFoveatedEncoding;
+    float eyeWidth = width / 2.f;
+
+    // Sampled at the block centers
+    int offsetSum = 0;
+    for (uint32_t y = 0; y < m_blocksY; y++) {
+        float v = std::min((y + 0.5f) * m_blockSize / height, 1.f);
+        for (uint32_t x = 0; x < m_blocksX; x++) {
+            float u = std::min((x + 0.5f) * m_blockSize / width, 1.f);
+            int eye = u > 0.5f ? 1 : 0;
+            float eyeU = eye == 1 ? (1.f - u) * 2.f : u * 2.f;
+
+            float distance = std::max(
+                PeripheryDistance(eyeU, boundsX[eye]), PeripheryDistance(v, boundsY[eye])
+            );
+            // Blocks with no visible pixel, the hidden area is symmetric so the right eye needs no
+            // mirroring. The point of a block closest to the eye center tells.
+            if (maskHidden) {
+                float left = x * m_blockSize / eyeWidth - eye;
+                float right = (x + 1) * m_blockSize / eyeWidth - eye;
+                float top = (float)y * m_blockSize / height;
+                float bottom = (float)(y + 1) * m_blockSize / height;
+                if (IsHiddenArea(std::clamp(0.5f, left, right), std::clamp(0.5f, top, bottom))) {
+                    distance = 1.f;
+                }
+            }
+            int8_t offset = (int8_t)std::lround(distance * m_maxOffset);
+            float left = (float)x * m_blockSize / width;
+            float right = std::min((float)(x + 1) * m_blockSize / width, 1.f);
+            float top = (float)y * m_blockSize / height;
+            float bottom = std::min((float)(y + 1) * m_blockSize / height, 1.f);
+            // At the center and the corners of the block, text is often thinner than a block
+            if (m_overlayWidth > 0
+                && (OverlayCovers(center, u, v) || OverlayCovers(center, left, top)
+                    || OverlayCovers(center, right, top) || OverlayCovers(center, left, bottom)
+                    || OverlayCovers(center, right, bottom))) {
+                offset = (int8_t)-m_overlayOffset;
+            }
+            // An unchanged overlay keeps the quality it was encoded with
+            if (useStatic && BlockStatic(*staticBlocks, left, top, right, bottom)) {
+                offset = std::max(offset, (int8_t)m_staticOffset);
+            }
+            m_offsets[y * m_blocksX + x] = offset;
+            offsetSum += offset;
+        }
+    }
+    m_meanOffset = m_offsets.empty() ? 0.f : (float)offsetSum / m_offsets.size();
+    return true;
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include "StaticFrames.h"
+#include "bindings.h"
+#include <atomic>
+#include <stdint.h>
+#include <vector>
+
+// Frame rectangle in pixels, right and bottom excluded
+struct FoveatedRect {
+    uint32_t left;
+    uint32_t top;
+    uint32_t right;
+    uint32_t bottom;
+};
+
+// Rectangle of an eye (0 left, 1 right) of a width x height frame around its foveation center
+// region, grown by spread from 0, the center region, to 1, the whole eye. The frame layout is the
+// one given to the encoder, compressed when foveated encoding is enabled.
+FoveatedRect GetFoveatedRect(
+    const FfiFoveationCenter& center, int eye, float spread, uint32_t width, uint32_t height
+);
+
+// QP offsets of the blocks of the encoded frame, 0 in the foveation center regions and growing to
+// m_foveatedQpOffset at the edges of the eyes. A coarser periphery costs fewer bits, on top of or
+// instead of the periphery compression of foveated encoding. Blocks in the hidden area get the
+// largest offset. With m_overlayQpOffset, the blocks that overlays cover get that offset below 0
+// instead, see OverlayCoverage.h. With m_staticBlockQpOffset, the blocks that didn't change since
+// the last encoded frame get at least that offset, a coarser QP on a block with no residual makes
+// the encoder skip it instead of refining it.
+//
+// With m_foveatedTargetQp, the largest offset is adapted between 0 and m_foveatedQpOffset to hold
+// the average QP of the frames, without the offsets, at the target. Above it the bitrate doesn't
+// suffice and a coarser periphery leaves more bits to the center, below it the periphery gets the
+// spare bits back.
+class FoveatedQpMap {
+public:
+    // blockSize is the size of the blocks of the codec that an offset applies to
+    explicit FoveatedQpMap(uint32_t blockSize);
+
+    // Whether a setting gives the blocks offsets, the encoders make a map only then
+    static bool Enabled() {
+        const Settings* settings = Settings_Instance();
+        return settings->m_foveatedQpOffset > 0 || settings->m_overlayQpOffset > 0
+            || settings->m_staticBlockQpOffset > 0;
+    }
+
+    // False if the center, the frame size, the largest offset and the overlay coverage didn't
+    // change since the last update and there are no static blocks, the offsets are still valid
+    // then. staticBlocks may be null.
+    bool Update(
+        const FfiFoveationCenter& center,
+        uint32_t width,
+        uint32_t height,
+        const StaticBlocks* staticBlocks = nullptr
+    );
+
+    // Average QP of an encoded frame, taken by the next Update. May be called from the output
+    // thread of the encoder, negative values are ignored.
+    void ReportQp(float averageQp) { m_reportedQp = averageQp; }
+
+    // BlocksX() * BlocksY() offsets, in raster order
+    const std::vector<int8_t>& GetOffsets() const { return m_offsets; }
+    uint32_t BlocksX() const { return m_blocksX; }
+    uint32_t BlocksY() const { return m_blocksY; }
+    int MaxOffset() const { return m_maxOffset; }
+    // m_foveatedQpOffset when the stream started, the bound of MaxOffset
+    int OffsetLimit() const { return m_offsetLimit; }
+    // Of the overlay blocks, which go down to -OverlayOffset()
+    int OverlayOffset() const { return m_overlayOffset; }
+    // Of the static blocks, OffsetLimit() may be lower
+    int StaticOffset() const { return m_staticOffset; }
+
+private:
+    // Steps the largest offset once per window of reported frames
+    void TuneMaxOffset();
+    // Whether an overlay shows at a UV of the encoded frame
+    bool OverlayCovers(const FfiFoveationCenter& center, float u, float v) const;
+    // Whether all the cells under a UV rectangle of the encoded frame are unchanged
+    static bool BlockStatic(
+        const StaticBlocks& blocks, float left, float top, float right, float bottom
+    );
+
+    uint32_t m_blockSize;
+    int m_offsetLimit;
+    int m_maxOffset;
+    int m_targetQp;
+    std::atomic<float> m_reportedQp = -1.f;
+    float m_qpSum = 0.f;
+    uint32_t m_qpFrames = 0;
+    // Of the current offsets, taken out of the reported QPs
+    float m_meanOffset = 0.f;
+    int m_builtMaxOffset = -1;
+    int m_overlayOffset;
+    uint64_t m_overlayVersion = 0;
+    std::vector<uint8_t> m_overlayCells;
+    uint32_t m_overlayWidth = 0;
+    uint32_t m_overlayHeight = 0;
+    int m_staticOffset;
+    // Whether the last offsets were built with static blocks
+    bool m_builtStatic = false;
+    FfiFoveationCenter m_center = {};
+    uint32_t m_width = 0;
+    uint32_t m_height = 0;
+    uint32_t m_blocksX = 0;
+    uint32_t m_blocksY = 0;
+    std::vector<int8_t> m_offsets;
+};
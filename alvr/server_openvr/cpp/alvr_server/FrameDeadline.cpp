@@ -0,0 +1,45 @@
+#include "FrameDeadline.h"
+
+#include "Utils.h"
+
+FrameDeadline g_frameDeadline;
+
+void FrameDeadline::OnPoseReceived(uint64_t targetTimestampNs) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    int newest = (m_next + POSE_COUNT - 1) % POSE_COUNT;
+    if (m_poses[newest].targetTimestampNs == targetTimestampNs) {
+        return;
+    }
+    m_poses[m_next] = { targetTimestampNs, GetTimestampUs() };
+    m_next = (m_next + 1) % POSE_COUNT;
+}
+
+void FrameDeadline::SetMaxPoseAge(uint64_t maxPoseAgeNs) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_maxPoseAgeUs = maxPoseAgeNs / 1000;
+}
+
+void FrameDeadline::Reset() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for (Pose& pose : m_poses) {
+        pose = {};
+    }
+    m_maxPoseAgeUs = 0;
+    m_droppedLast = false;
+}
+
+bool FrameDeadline::IsLate(uint64_t targetTimestampNs) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    bool late = false;
+    // A stream that only drops frames would freeze on a wrong estimate
+    if (m_maxPoseAgeUs != 0 && targetTimestampNs != 0 && !m_droppedLast) {
+        for (const Pose& pose : m_poses) {
+            if (pose.targetTimestampNs == targetTimestampNs) {
+                late = GetTimestampUs() > pose.receivedTimeUs + m_maxPoseAgeUs;
+                break;
+            }
+        }
+    }
+    m_droppedLast = late;
+    return late;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <mutex>
+#include <stdint.h>
+
+// Frames that can't be displayed at their target time are not encoded, so that the encoder spends
+// its time on the next frame instead. The client displays a pose motion to photon latency after it
+// sampled it. The server core measures the time from the start of an encode to the display of the
+// frame, network included, which leaves the age a pose can have when its frame starts encoding.
+class FrameDeadline {
+public:
+    // Called when the tracking of a new pose is received
+    void OnPoseReceived(uint64_t targetTimestampNs);
+    // Latest age of a pose when its frame starts encoding, 0 if unknown
+    void SetMaxPoseAge(uint64_t maxPoseAgeNs);
+    // Forgets the poses and the age of the last session
+    void Reset();
+
+    // True if the frame rendered for targetTimestampNs can't be displayed in time and is not
+    // encoded. Called when the encode of the frame would start, never true for two frames in a row.
+    bool IsLate(uint64_t targetTimestampNs);
+
+private:
+    // Received poses kept, a few hundred milliseconds of tracking
+    static const int POSE_COUNT = 64;
+
+    struct Pose {
+        uint64_t targetTimestampNs;
+        uint64_t receivedTimeUs;
+    };
+
+    std::mutex m_mutex;
+    Pose m_poses[POSE_COUNT] = {};
+    int m_next = 0;
+    uint64_t m_maxPoseAgeUs = 0;
+    bool m_droppedLast = false;
+};
+
+extern FrameDeadline g_frameDeadline;
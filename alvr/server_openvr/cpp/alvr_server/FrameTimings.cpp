@@ -0,0 +1,68 @@
+#include "FrameTimings.h"
+
+#include <atomic>
+#include <cstddef>
+
+namespace {
+
+// Power of two, a couple of seconds of frames at 120Hz. The server core pops them every few ms.
+const size_t RING_CAPACITY = 256;
+
+// Bounded queue like the debug log one, see LogRing.cpp, with a single consumer
+struct RingSlot {
+    std::atomic<size_t> sequence;
+    FfiFrameTiming timing;
+};
+
+struct Ring {
+    Ring() {
+        for (size_t i = 0; i < RING_CAPACITY; i++) {
+            slots[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    RingSlot slots[RING_CAPACITY];
+    std::atomic<size_t> enqueuePosition = 0;
+    size_t dequeuePosition = 0;
+};
+
+Ring g_ring;
+
+} // namespace
+
+void PushFrameTiming(const FfiFrameTiming& timing) {
+    size_t position = g_ring.enqueuePosition.load(std::memory_order_relaxed);
+    while (true) {
+        RingSlot& slot = g_ring.slots[position % RING_CAPACITY];
+        size_t sequence = slot.sequence.load(std::memory_order_acquire);
+        if (sequence == position) {
+            if (g_ring.enqueuePosition.compare_exchange_weak(
+                    position, position + 1, std::memory_order_relaxed
+                )) {
+                slot.timing = timing;
+                slot.sequence.store(position + 1, std::memory_order_release);
+                return;
+            }
+        } else if ((ptrdiff_t)(sequence - position) < 0) {
+            // Full, the slot still holds the record of the previous lap
+            return;
+        } else {
+            position = g_ring.enqueuePosition.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+int PopFrameTimings(FfiFrameTiming* timings, int maxCount) {
+    int count = 0;
+    while (count < maxCount) {
+        size_t position = g_ring.dequeuePosition;
+        RingSlot& slot = g_ring.slots[position % RING_CAPACITY];
+        if (slot.sequence.load(std::memory_order_acquire) != position + 1) {
+            break;
+        }
+        timings[count++] = slot.timing;
+        slot.sequence.store(position + RING_CAPACITY, std::memory_order_release);
+        g_ring.dequeuePosition = position + 1;
+    }
+    return count;
+}
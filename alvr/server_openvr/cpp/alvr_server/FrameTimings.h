@@ -0,0 +1,8 @@
+#pragma once
+
+#include "bindings.h"
+
+// Timing records of the frames the encoder sent, queued for the server core which turns them into
+// latency percentiles for the dashboard. Pushing never blocks: records are dropped when the server
+// core doesn't pop them in time.
+void PushFrameTiming(const FfiFrameTiming& timing);
@@ -0,0 +1,90 @@
+#include "GpuMemory.h"
+
+#include "Logger.h"
+#include "Settings.h"
+#include "bindings.h"
+#include <map>
+#include <mutex>
+#include <string>
+#include <tuple>
+
+namespace {
+
+struct Allocation {
+    std::string subsystem;
+    GpuMemoryType type;
+    uint64_t bytes;
+};
+
+const char* GpuMemoryTypeName(GpuMemoryType type) {
+    switch (type) {
+    case GpuMemoryType::DeviceLocal:
+        return "device";
+    case GpuMemoryType::HostVisible:
+        return "host";
+    case GpuMemoryType::Imported:
+        return "imported";
+    }
+    return "unknown";
+}
+
+std::mutex g_mutex;
+std::map<const void*, Allocation> g_allocations;
+
+} // namespace
+
+void TrackGpuMemory(const void* handle, const char* subsystem, GpuMemoryType type, uint64_t bytes) {
+    if (!handle) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(g_mutex);
+    g_allocations[handle] = { subsystem, type, bytes };
+}
+
+void UntrackGpuMemory(const void* handle) {
+    if (!handle) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(g_mutex);
+    g_allocations.erase(handle);
+}
+
+bool IsGpuMemoryTracked(const void* handle) {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    return g_allocations.count(handle) != 0;
+}
+
+void LogGpuMemory(const char* reason) {
+    struct Total {
+        uint64_t bytes = 0;
+        uint64_t count = 0;
+    };
+    std::map<std::tuple<std::string, GpuMemoryType>, Total> totals;
+    uint64_t ownedBytes = 0;
+    {
+        std::lock_guard<std::mutex> lock(g_mutex);
+        for (auto& [handle, allocation] : g_allocations) {
+            Total& total = totals[{ allocation.subsystem, allocation.type }];
+            total.bytes += allocation.bytes;
+            total.count++;
+            if (allocation.type != GpuMemoryType::Imported) {
+                ownedBytes += allocation.bytes;
+            }
+        }
+    }
+
+    Info("GPU memory (%s): %.1f MiB allocated by the driver", reason, ownedBytes / 1048576.0);
+    for (auto& [key, total] : totals) {
+        Info(
+            "GPU memory: %s %s: %.1f MiB in %llu allocations",
+            std::get<0>(key).c_str(),
+            GpuMemoryTypeName(std::get<1>(key)),
+            total.bytes / 1048576.0,
+            (unsigned long long)total.count
+        );
+    }
+}
+
+void LogGpuMemoryUsage() { LogGpuMemory("requested"); }
+
+bool IsCompactGpuMemory() { return Settings_Instance()->m_compactGpuMemory; }
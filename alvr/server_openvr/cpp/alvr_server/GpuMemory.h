@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdint.h>
+
+// Accounting of the GPU memory the driver allocates itself, by subsystem and memory type, to know
+// our share of the VRAM. Allocations are keyed by their handle, like a VkDeviceMemory or an
+// ID3D11Texture2D pointer, so that the release sites only need the handle. Sizes of resources the
+// API doesn't report are estimated from their format.
+
+enum class GpuMemoryType {
+    DeviceLocal,
+    HostVisible,
+    // Allocated by the game or the compositor, the driver only maps it
+    Imported,
+};
+
+void TrackGpuMemory(const void* handle, const char* subsystem, GpuMemoryType type, uint64_t bytes);
+// Does nothing for handles that are not tracked, like null ones
+void UntrackGpuMemory(const void* handle);
+bool IsGpuMemoryTracked(const void* handle);
+
+// Logs the bytes and allocation count of each subsystem and memory type
+void LogGpuMemory(const char* reason);
+
+// Settings::m_compactGpuMemory: fewer staging and encoder buffers, at the cost of less overlap
+// between the compositor and the encoder
+bool IsCompactGpuMemory();
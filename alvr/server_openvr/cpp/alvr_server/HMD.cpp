@@ -1,12 +1,15 @@
 #include "HMD.h"
 
 #include "Controller.h"
+#include "DynamicResolution.h"
+#include "HiddenAreaMask.h"
 #include "Logger.h"
 #include "Paths.h"
 #include "PoseHistory.h"
 #include "Utils.h"
 #include "ViveTrackerProxy.h"
 #include "bindings.h"
+#include <cmath>
 
 #ifdef _WIN32
 #include "platform/win32/CEncoder.h"
@@ -14,8 +17,47 @@
 #include "platform/macos/CEncoder.h"
 #else
 #include "platform/linux/CEncoder.h"
+#include "platform/linux/protocol.h"
 #endif
 
+namespace {
+
+// Changes of the view params that SteamVR doesn't get, the compose chain absorbs them
+const float VIEW_FOV_THRESHOLD_RAD = 0.005f;
+const float VIEW_POSITION_THRESHOLD_M = 0.0005f;
+const float VIEW_ORIENTATION_THRESHOLD = 0.0025f;
+// Shortest time between two reconfigurations of the SteamVR display
+const uint64_t VIEW_PARAMS_INTERVAL_NS = 1'000'000'000;
+
+bool viewParamsDiffer(const FfiViewParams (&a)[2], const FfiViewParams (&b)[2]) {
+    for (int eye = 0; eye < 2; eye++) {
+        const FfiFov& fovA = a[eye].fov;
+        const FfiFov& fovB = b[eye].fov;
+        if (std::abs(fovA.left - fovB.left) > VIEW_FOV_THRESHOLD_RAD
+            || std::abs(fovA.right - fovB.right) > VIEW_FOV_THRESHOLD_RAD
+            || std::abs(fovA.up - fovB.up) > VIEW_FOV_THRESHOLD_RAD
+            || std::abs(fovA.down - fovB.down) > VIEW_FOV_THRESHOLD_RAD) {
+            return true;
+        }
+        const FfiPose& poseA = a[eye].pose;
+        const FfiPose& poseB = b[eye].pose;
+        for (int i = 0; i < 3; i++) {
+            if (std::abs(poseA.position[i] - poseB.position[i]) > VIEW_POSITION_THRESHOLD_M) {
+                return true;
+            }
+        }
+        if (std::abs(poseA.orientation.x - poseB.orientation.x) > VIEW_ORIENTATION_THRESHOLD
+            || std::abs(poseA.orientation.y - poseB.orientation.y) > VIEW_ORIENTATION_THRESHOLD
+            || std::abs(poseA.orientation.z - poseB.orientation.z) > VIEW_ORIENTATION_THRESHOLD
+            || std::abs(poseA.orientation.w - poseB.orientation.w) > VIEW_ORIENTATION_THRESHOLD) {
+            return true;
+        }
+    }
+    return false;
+}
+
+} // namespace
+
 Hmd::Hmd()
     : TrackedDevice(
           HEAD_ID,
@@ -32,9 +74,16 @@ Hmd::Hmd()
 
     this->m_viewParams[0] = dummy_m_viewParams;
     this->m_viewParams[1] = dummy_m_viewParams;
+    this->m_latestViewParams[0] = dummy_m_viewParams;
+    this->m_latestViewParams[1] = dummy_m_viewParams;
 
     m_poseHistory = std::make_shared<PoseHistory>();
 
+    if (Settings_Instance()->m_dynamicResolutionMinScale < 1.0f) {
+        m_dynamicResolution
+            = std::make_unique<DynamicResolution>(Settings_Instance()->m_dynamicResolutionMinScale);
+    }
+
     if (Settings_Instance()->m_enableViveTrackerProxy) {
         m_viveTrackerProxy = std::make_unique<ViveTrackerProxy>(*this);
         if (!vr::VRServerDriverHost()->TrackedDeviceAdded(
@@ -76,9 +125,22 @@ bool Hmd::activate() {
         vr::Prop_DisplayFrequency_Float,
         static_cast<float>(Settings_Instance()->m_refreshRate)
     );
+#if defined(_WIN32) || defined(__APPLE__)
+    m_displayFrequency = static_cast<float>(Settings_Instance()->m_refreshRate);
+#endif
 
     vr::VRDriverInput()->CreateBooleanComponent(this->prop_container, "/proximity", &m_proximity);
 
+    // Games skip rendering what the stream fills with black anyway
+    std::vector<vr::HmdVector2_t> hiddenArea = GetHiddenAreaMesh();
+    if (!hiddenArea.empty()) {
+        for (vr::EVREye eye : { vr::Eye_Left, vr::Eye_Right }) {
+            vr::VRHiddenArea()->SetHiddenArea(
+                eye, vr::k_eHiddenAreaMesh_Standard, hiddenArea.data(), hiddenArea.size()
+            );
+        }
+    }
+
 #ifdef _WIN32
     float originalIPD
         = vr::VRSettings()->GetFloat(vr::k_pch_SteamVR_Section, vr::k_pch_SteamVR_IPD_Float);
@@ -138,6 +200,8 @@ bool Hmd::activate() {
 
             m_directModeComponent
                 = std::make_shared<OvrDirectModeComponent>(m_D3DRender, m_poseHistory);
+#elif __APPLE__
+            m_directModeComponent = std::make_shared<OvrDirectModeComponent>(m_poseHistory);
 #endif
         }
 
@@ -165,7 +229,7 @@ void* Hmd::get_component(const char* component_name_and_version) {
         return (vr::IVRDisplayComponent*)this;
     }
 
-#ifdef _WIN32
+#if defined(_WIN32) || defined(__APPLE__)
     if (name_and_vers == vr::IVRDriverDirectModeComponent_Version) {
         return m_directModeComponent.get();
     }
@@ -199,25 +263,42 @@ void Hmd::OnPoseUpdated(uint64_t targetTimestampNs, FfiDeviceMotion motion) {
     pose.vecPosition[1] = motion.pose.position[1];
     pose.vecPosition[2] = motion.pose.position[2];
 
+    uint32_t poseTag = m_poseHistory->OnPoseUpdated(targetTimestampNs, motion);
+#if !defined(_WIN32) && !defined(__APPLE__)
+    // Lets the encoder find the exact pose a frame was rendered with, see protocol.h
+    pose.vecVelocity[0] = pose_tag_to_velocity(poseTag);
+#endif
+
     this->submit_pose(pose);
 
-    m_poseHistory->OnPoseUpdated(targetTimestampNs, motion);
+    SendPendingViewParams();
+
+    // SteamVR passes the new size on to the game with a resolution change event
+    if (m_dynamicResolution && m_dynamicResolution->Update(GetSteadyTimeNs())) {
+        uint32_t width, height;
+        GetRecommendedRenderTargetSize(&width, &height);
+        Info("Recommending a render target of %ux%u per eye\n", width, height);
+        vr::VRServerDriverHost()->SetRecommendedRenderTargetSize(this->object_id, width, height);
+    }
 
     if (m_viveTrackerProxy)
         m_viveTrackerProxy->update();
 
+    // The stream can switch its refresh rate, see StepRefreshRate
 #if !defined(_WIN32) && !defined(__APPLE__)
     // This has to be set after initialization is done, because something in vrcompositor is
     // setting it to 90Hz in the meantime
-    if (!m_refreshRateSet && m_encoder && m_encoder->IsConnected()) {
-        m_refreshRateSet = true;
+    bool canSetFrequency = m_encoder && m_encoder->IsConnected();
+#else
+    bool canSetFrequency = true;
+#endif
+    float refreshRate = GetRefreshRate();
+    if (canSetFrequency && refreshRate > 0.f && refreshRate != m_displayFrequency) {
+        m_displayFrequency = refreshRate;
         vr::VRProperties()->SetFloatProperty(
-            this->prop_container,
-            vr::Prop_DisplayFrequency_Float,
-            static_cast<float>(Settings_Instance()->m_refreshRate)
+            this->prop_container, vr::Prop_DisplayFrequency_Float, refreshRate
         );
     }
-#endif
 }
 
 void Hmd::StartStreaming() {
@@ -226,6 +307,12 @@ void Hmd::StartStreaming() {
     vr::VRDriverInput()->UpdateBooleanComponent(m_proximity, true, 0.0);
 
     if (m_streamComponentsInitialized) {
+        // The encoder and compose resources outlive client connections, since any setting they
+        // depend on restarts SteamVR when it changes. A reconnecting client only needs the
+        // parameter sets and an IDR frame, which the next frame carries.
+        if (m_encoder) {
+            m_encoder->OnStreamStart();
+        }
         return;
     }
 
@@ -235,6 +322,16 @@ void Hmd::StartStreaming() {
         m_encoder = std::make_shared<CEncoder>();
         try {
             m_encoder->Initialize(m_D3DRender);
+            // The view params may have come before the encoder
+            m_encoder->SetViewParams(
+                fov_to_tangents(m_latestViewParams[0].fov),
+                pose_to_mat(m_latestViewParams[0].pose),
+                fov_to_tangents(m_latestViewParams[1].fov),
+                pose_to_mat(m_latestViewParams[1].pose)
+            );
+            m_encoder->SetRenderProjections(
+                fov_to_tangents(m_viewParams[0].fov), fov_to_tangents(m_viewParams[1].fov)
+            );
         } catch (Exception e) {
             Error(
                 "Your GPU does not meet the requirements for video encoding. %s %s\n%s %s\n",
@@ -250,8 +347,14 @@ void Hmd::StartStreaming() {
 
 #elif __APPLE__
         m_encoder = std::make_shared<CEncoder>();
+        m_encoder->Start();
+
+        m_directModeComponent->SetEncoder(m_encoder);
 #else
         m_encoder = std::make_shared<CEncoder>(m_poseHistory);
+        m_encoder->SetViewParams(
+            fov_to_tangents(m_latestViewParams[0].fov), fov_to_tangents(m_latestViewParams[1].fov)
+        );
         m_encoder->Start();
 #endif
         m_encoder->OnStreamStart();
@@ -269,23 +372,56 @@ void Hmd::StopStreaming() {
 void Hmd::SetViewParams(const FfiViewParams params[2]) {
     Debug("Hmd::SetViewParams");
 
-    this->m_viewParams[0] = params[0];
-    this->m_viewParams[1] = params[1];
+    this->m_latestViewParams[0] = params[0];
+    this->m_latestViewParams[1] = params[1];
 
     // The OpenXR spec defines the HMD position as the midpoint
     // between the eyes, so conversion to this is handled by the
     // client.
-    auto left_transform = pose_to_mat(params[0].pose);
-    auto right_transform = pose_to_mat(params[1].pose);
-    vr::VRServerDriverHost()->SetDisplayEyeToHead(object_id, left_transform, right_transform);
-
     auto left_proj = fov_to_tangents(params[0].fov);
     auto right_proj = fov_to_tangents(params[1].fov);
+#ifdef _WIN32
+    if (m_encoder) {
+        m_encoder->SetViewParams(
+            left_proj, pose_to_mat(params[0].pose), right_proj, pose_to_mat(params[1].pose)
+        );
+    }
+#elif !defined(__APPLE__)
+    if (m_encoder) {
+        m_encoder->SetViewParams(left_proj, right_proj);
+    }
+#endif
+
+    m_viewParamsPending = !m_viewParamsSent || viewParamsDiffer(m_viewParams, m_latestViewParams);
+    SendPendingViewParams();
+}
+
+void Hmd::SendPendingViewParams() {
+    if (!m_viewParamsPending) {
+        return;
+    }
+    uint64_t now = GetSteadyTimeNs();
+    if (m_viewParamsSent && now - m_viewParamsSentNs < VIEW_PARAMS_INTERVAL_NS) {
+        return;
+    }
+    m_viewParamsPending = false;
+    m_viewParamsSent = true;
+    m_viewParamsSentNs = now;
+    this->m_viewParams[0] = m_latestViewParams[0];
+    this->m_viewParams[1] = m_latestViewParams[1];
+
+    auto left_transform = pose_to_mat(m_viewParams[0].pose);
+    auto right_transform = pose_to_mat(m_viewParams[1].pose);
+    vr::VRServerDriverHost()->SetDisplayEyeToHead(object_id, left_transform, right_transform);
+
+    auto left_proj = fov_to_tangents(m_viewParams[0].fov);
+    auto right_proj = fov_to_tangents(m_viewParams[1].fov);
     vr::VRServerDriverHost()->SetDisplayProjectionRaw(object_id, left_proj, right_proj);
 
 #ifdef _WIN32
+    // The game renders with the new projections from one of its next frames
     if (m_encoder) {
-        m_encoder->SetViewParams(left_proj, left_transform, right_proj, right_transform);
+        m_encoder->SetRenderProjections(left_proj, right_proj);
     }
 #endif
 
@@ -323,8 +459,10 @@ bool Hmd::IsDisplayRealDisplay() {
 }
 
 void Hmd::GetRecommendedRenderTargetSize(uint32_t* pnWidth, uint32_t* pnHeight) {
-    *pnWidth = Settings_Instance()->m_recommendedTargetWidth / 2;
-    *pnHeight = Settings_Instance()->m_recommendedTargetHeight;
+    float scale = m_dynamicResolution ? m_dynamicResolution->Scale() : 1.0f;
+    // Even sizes, like the ones of the settings
+    *pnWidth = uint32_t(Settings_Instance()->m_recommendedTargetWidth / 2 * scale) & ~1u;
+    *pnHeight = uint32_t(Settings_Instance()->m_recommendedTargetHeight * scale) & ~1u;
     Debug("Hmd::GetRecommendedRenderTargetSize %dx%d\n", *pnWidth, *pnHeight);
 }
 
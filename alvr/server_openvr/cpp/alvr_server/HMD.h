@@ -6,6 +6,8 @@
 #include <memory>
 #ifdef _WIN32
 #include "platform/win32/OvrDirectModeComponent.h"
+#elif __APPLE__
+#include "platform/macos/OvrDirectModeComponent.h"
 #endif
 
 class Controller;
@@ -13,6 +15,7 @@ class Controller;
 class ViveTrackerProxy;
 
 class CEncoder;
+class DynamicResolution;
 #ifdef _WIN32
 class CD3DRender;
 #endif
@@ -34,7 +37,18 @@ public:
 private:
     vr::VRInputComponentHandle_t m_proximity;
 
+    // SteamVR reconfigures the display on each change of the view params. The compose chain follows
+    // the latest ones of the client, SteamVR gets them when they are farther than a threshold from
+    // the ones it has, at a limited rate.
     FfiViewParams m_viewParams[2];
+    FfiViewParams m_latestViewParams[2];
+    bool m_viewParamsSent = false;
+    // The latest view params are past the threshold, held back by the rate limit
+    bool m_viewParamsPending = false;
+    uint64_t m_viewParamsSentNs = 0;
+
+    // Gives SteamVR the latest view params if they are pending and the rate limit allows it
+    void SendPendingViewParams();
 
     bool m_baseComponentsInitialized;
     bool m_streamComponentsInitialized;
@@ -50,15 +64,18 @@ private:
     std::shared_ptr<CD3DRender> m_D3DRender;
 #endif
 
-#ifdef _WIN32
+#if defined(_WIN32) || defined(__APPLE__)
     std::shared_ptr<OvrDirectModeComponent> m_directModeComponent;
 #endif
 
     std::shared_ptr<ViveTrackerProxy> m_viveTrackerProxy;
 
-#ifndef _WIN32
-    bool m_refreshRateSet = false;
-#endif
+    // Null unless the dynamic game resolution is enabled
+    std::unique_ptr<DynamicResolution> m_dynamicResolution;
+
+    // Prop_DisplayFrequency_Float SteamVR has, following the refresh rate of the stream. 0 on
+    // Linux until the encoder is connected.
+    float m_displayFrequency = 0.f;
 
     // TrackedDevice
     virtual bool activate() final;
@@ -0,0 +1,109 @@
+#include "HeadMotionHints.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace {
+
+void QuaternionToMatrix(const vr::HmdQuaternion_t& q, float m[3][3]) {
+    m[0][0] = float(1.0 - 2.0 * (q.y * q.y + q.z * q.z));
+    m[0][1] = float(2.0 * (q.x * q.y - q.w * q.z));
+    m[0][2] = float(2.0 * (q.x * q.z + q.w * q.y));
+    m[1][0] = float(2.0 * (q.x * q.y + q.w * q.z));
+    m[1][1] = float(1.0 - 2.0 * (q.x * q.x + q.z * q.z));
+    m[1][2] = float(2.0 * (q.y * q.z - q.w * q.x));
+    m[2][0] = float(2.0 * (q.x * q.z - q.w * q.y));
+    m[2][1] = float(2.0 * (q.y * q.z + q.w * q.x));
+    m[2][2] = float(1.0 - 2.0 * (q.x * q.x + q.y * q.y));
+}
+
+bool IsUnknown(const vr::HmdQuaternion_t& q) {
+    return q.w == 0.0 && q.x == 0.0 && q.y == 0.0 && q.z == 0.0;
+}
+
+int16_t ToVector(float pixels) {
+    return (int16_t)std::clamp(std::lround(pixels), -32768l, 32767l);
+}
+
+} // namespace
+
+HeadMotionHints::HeadMotionHints(uint32_t blockSize)
+    : m_blockSize(blockSize) { }
+
+bool HeadMotionHints::Update(
+    const vr::HmdQuaternion_t& orientation,
+    const vr::HmdRect2_t projections[2],
+    uint32_t width,
+    uint32_t height
+) {
+    bool hasPrevious = m_hasPrevious;
+    vr::HmdQuaternion_t previous = m_previous;
+    m_hasPrevious = !IsUnknown(orientation);
+    m_previous = orientation;
+    if (!hasPrevious || !m_hasPrevious) {
+        return false;
+    }
+
+    // Left, right, up and down tangents of each eye, as in fov_to_tangents
+    float tangents[2][4];
+    for (int eye = 0; eye < 2; eye++) {
+        tangents[eye][0] = projections[eye].vTopLeft.v[0];
+        tangents[eye][1] = projections[eye].vBottomRight.v[0];
+        tangents[eye][2] = projections[eye].vBottomRight.v[1];
+        tangents[eye][3] = projections[eye].vTopLeft.v[1];
+        if (tangents[eye][0] == tangents[eye][1] || tangents[eye][2] == tangents[eye][3]) {
+            return false;
+        }
+    }
+
+    // From the head space of this frame to the one of the previous frame, previous^T * current
+    float current[3][3], last[3][3], rotation[3][3];
+    QuaternionToMatrix(orientation, current);
+    QuaternionToMatrix(previous, last);
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            rotation[i][j] = last[0][i] * current[0][j] + last[1][i] * current[1][j]
+                + last[2][i] * current[2][j];
+        }
+    }
+
+    m_blocksX = (width + m_blockSize - 1) / m_blockSize;
+    m_blocksY = (height + m_blockSize - 1) / m_blockSize;
+    m_vectors.resize(m_blocksX * m_blocksY);
+
+    float eyeWidth = width / 2.f;
+    // Sampled at the block centers
+    for (uint32_t y = 0; y < m_blocksY; y++) {
+        float py = std::min((y + 0.5f) * m_blockSize, (float)height);
+        float v = py / height;
+        for (uint32_t x = 0; x < m_blocksX; x++) {
+            float px = std::min((x + 0.5f) * m_blockSize, (float)width);
+            int eye = px >= eyeWidth ? 1 : 0;
+            float u = px / eyeWidth - eye;
+            const float* t = tangents[eye];
+
+            float ray[3] = { t[0] + (t[1] - t[0]) * u, t[2] + (t[3] - t[2]) * v, -1.f };
+            float old[3];
+            for (int i = 0; i < 3; i++) {
+                old[i]
+                    = rotation[i][0] * ray[0] + rotation[i][1] * ray[1] + rotation[i][2] * ray[2];
+            }
+
+            MotionVector& vector = m_vectors[y * m_blocksX + x];
+            vector = {};
+            // Behind the eye in the previous frame, there is no good guess
+            if (old[2] >= 0.f) {
+                continue;
+            }
+            float oldU = (old[0] / -old[2] - t[0]) / (t[1] - t[0]);
+            float oldV = (old[1] / -old[2] - t[2]) / (t[3] - t[2]);
+            // Out of the eye in the previous frame, the encoder search starts from the block
+            if (oldU < 0.f || oldU > 1.f || oldV < 0.f || oldV > 1.f) {
+                continue;
+            }
+            vector.x = ToVector((oldU + eye) * eyeWidth - px);
+            vector.y = ToVector(oldV * height - py);
+        }
+    }
+    return true;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include "openvr_driver_wrap.h"
+#include <stdint.h>
+#include <vector>
+
+// Motion of a block in whole pixels, from the block to where its content was in the previous frame
+struct MotionVector {
+    int16_t x;
+    int16_t y;
+};
+
+// Motion of the blocks of the encoded frame caused by the head rotation between two frames, with
+// the eyes side by side and not compressed by foveated encoding. Head translation and the motion
+// of the scene are left to the motion search of the encoder.
+class HeadMotionHints {
+public:
+    // blockSize is the size of the blocks of the codec that a vector applies to
+    explicit HeadMotionHints(uint32_t blockSize);
+
+    // Vectors of a width x height frame rendered with orientation and projections, relative to the
+    // frame given to the previous update. False if there are no vectors for this frame, at the
+    // first frame or after one with an unknown orientation, which is all zeros.
+    bool Update(
+        const vr::HmdQuaternion_t& orientation,
+        const vr::HmdRect2_t projections[2],
+        uint32_t width,
+        uint32_t height
+    );
+
+    // BlocksX() * BlocksY() vectors, in raster order
+    const std::vector<MotionVector>& GetVectors() const { return m_vectors; }
+    uint32_t BlocksX() const { return m_blocksX; }
+    uint32_t BlocksY() const { return m_blocksY; }
+
+private:
+    uint32_t m_blockSize;
+    bool m_hasPrevious = false;
+    vr::HmdQuaternion_t m_previous = {};
+    uint32_t m_blocksX = 0;
+    uint32_t m_blocksY = 0;
+    std::vector<MotionVector> m_vectors;
+};
@@ -0,0 +1,92 @@
+#include "HiddenAreaMask.h"
+
+#include "bindings.h"
+#include <algorithm>
+#include <cmath>
+
+namespace {
+
+// Segments of the arc in each corner of the mesh
+const int ARC_SEGMENTS = 8;
+
+float VisibleSize() { return Settings_Instance()->m_hiddenAreaMaskSize; }
+
+} // namespace
+
+bool IsHiddenAreaMaskEnabled() { return VisibleSize() > 0.f; }
+
+bool IsHiddenArea(float u, float v) {
+    if (!IsHiddenAreaMaskEnabled()) {
+        return false;
+    }
+    // From -1 to 1 across the eye
+    float x = u * 2.f - 1.f;
+    float y = v * 2.f - 1.f;
+    return x * x + y * y > VisibleSize() * VisibleSize();
+}
+
+std::vector<vr::HmdVector2_t> GetHiddenAreaMesh() {
+    std::vector<vr::HmdVector2_t> vertices;
+    float size = VisibleSize();
+    // The ellipse reaches the corners, nothing is hidden
+    if (!IsHiddenAreaMaskEnabled() || size * size >= 2.f) {
+        return vertices;
+    }
+
+    // Arc of the top right corner between the right and the top edges, fanned from the corner,
+    // which sees all of it since the visible size is at least 1
+    float edge = std::sqrt(std::max(size * size - 1.f, 0.f));
+    float start = std::atan2(edge, 1.f);
+    float end = std::atan2(1.f, edge);
+    float arc[ARC_SEGMENTS + 1][2];
+    for (int i = 0; i <= ARC_SEGMENTS; i++) {
+        float angle = start + (end - start) * i / ARC_SEGMENTS;
+        arc[i][0] = std::min(size * std::cos(angle), 1.f);
+        arc[i][1] = std::min(size * std::sin(angle), 1.f);
+    }
+
+    for (float signX : { -1.f, 1.f }) {
+        for (float signY : { -1.f, 1.f }) {
+            auto toUV = [&](float x, float y) {
+                return vr::HmdVector2_t { { (signX * x + 1.f) / 2.f, (signY * y + 1.f) / 2.f } };
+            };
+            for (int i = 0; i < ARC_SEGMENTS; i++) {
+                vertices.push_back(toUV(1.f, 1.f));
+                vertices.push_back(toUV(arc[i][0], arc[i][1]));
+                vertices.push_back(toUV(arc[i + 1][0], arc[i + 1][1]));
+            }
+        }
+    }
+    return vertices;
+}
+
+std::vector<HiddenAreaRect>
+GetHiddenAreaRects(uint32_t width, uint32_t height, uint32_t rowHeight) {
+    std::vector<HiddenAreaRect> rects;
+    if (!IsHiddenAreaMaskEnabled() || width == 0 || height == 0) {
+        return rects;
+    }
+    float size = VisibleSize();
+
+    for (uint32_t top = 0; top < height; top += rowHeight) {
+        uint32_t bottom = std::min(top + rowHeight, height);
+        // The row of the band closest to the center has the widest visible span
+        float yTop = top * 2.f / height - 1.f;
+        float yBottom = bottom * 2.f / height - 1.f;
+        float y = yTop < 0.f && yBottom > 0.f ? 0.f : std::min(fabsf(yTop), fabsf(yBottom));
+
+        float visibleX = std::sqrt(std::max(size * size - y * y, 0.f));
+        if (visibleX >= 1.f) {
+            continue;
+        }
+        auto left = (uint32_t)std::floor((1.f - visibleX) / 2.f * width);
+        auto right = (uint32_t)std::ceil((1.f + visibleX) / 2.f * width);
+        if (left > 0) {
+            rects.push_back({ 0, top, left, bottom });
+        }
+        if (right < width) {
+            rects.push_back({ right, top, width, bottom });
+        }
+    }
+    return rects;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "openvr_driver_wrap.h"
+#include <stdint.h>
+#include <vector>
+
+// The visible area of an eye is the ellipse centered on the eye image with its axes
+// m_hiddenAreaMaskSize times the image size. What the lenses don't show, mostly the corners, is
+// hidden to the games with the hidden area mesh and filled with black before encoding.
+
+// Whether the mask is enabled
+bool IsHiddenAreaMaskEnabled();
+
+// Whether a point of an eye image is hidden, u and v from 0 to 1
+bool IsHiddenArea(float u, float v);
+
+// Hidden area of an eye as a triangle list in eye UVs, the vr::k_eHiddenAreaMesh_Standard layout
+std::vector<vr::HmdVector2_t> GetHiddenAreaMesh();
+
+// Pixel rectangle, right and bottom excluded
+struct HiddenAreaRect {
+    uint32_t left;
+    uint32_t top;
+    uint32_t right;
+    uint32_t bottom;
+};
+
+// Hidden area of a width x height eye image as rectangles of rowHeight pixels high, which never
+// cover a visible pixel
+std::vector<HiddenAreaRect> GetHiddenAreaRects(uint32_t width, uint32_t height, uint32_t rowHeight);
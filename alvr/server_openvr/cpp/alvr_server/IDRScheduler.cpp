@@ -1,33 +1,153 @@
 #include "IDRScheduler.h"
 
 #include "Utils.h"
+#include <algorithm>
 #include <mutex>
 
+namespace {
+
+std::mutex g_statsMutex;
+FfiIdrStats g_stats = {};
+
+void countRequest() {
+    std::lock_guard<std::mutex> lock(g_statsMutex);
+    g_stats.requested++;
+}
+
+}
+
 IDRScheduler::IDRScheduler() { }
 
 IDRScheduler::~IDRScheduler() { }
 
 void IDRScheduler::OnStreamStart() {
     m_minIDRFrameInterval = Settings_Instance()->m_minimumIdrIntervalMs * 1000;
+    m_intraRefreshFrames = Settings_Instance()->m_intraRefreshRecoveryFrames;
+    m_refInvalidationEnabled = Settings_Instance()->m_refFrameInvalidation;
     m_scheduled = false;
     InsertIDR();
 }
 
+void IDRScheduler::SetEncoderCapabilities(const EncoderCapabilities& capabilities) {
+    std::unique_lock lock(m_mutex);
+
+    m_intraRefreshMode = capabilities.intraRefreshMode;
+    m_refInvalidationSupported = capabilities.refInvalidation;
+}
+
 void IDRScheduler::InsertIDR() {
     std::unique_lock lock(m_mutex);
 
-    m_insertIDRTime = GetTimestampUs() - MIN_IDR_FRAME_INTERVAL * 2;
+    m_insertIDRTime = 0;
+    m_scheduled = true;
+    countRequest();
+}
+
+void IDRScheduler::RequestIDR() {
+    std::unique_lock lock(m_mutex);
+
+    // An IDR frame that is already scheduled sooner serves this request too
+    uint64_t insertTime = std::max(GetTimestampUs(), m_lastIDRTime + m_minIDRFrameInterval);
+    if (!m_scheduled || insertTime < m_insertIDRTime) {
+        m_insertIDRTime = insertTime;
+    }
     m_scheduled = true;
+    countRequest();
+}
+
+void IDRScheduler::InsertSceneCut() {
+    std::unique_lock lock(m_mutex);
+
+    uint64_t now = GetTimestampUs();
+    if (!m_scheduled && m_lastIDRTime + m_minIDRFrameInterval <= now) {
+        m_insertIDRTime = now;
+        m_scheduled = true;
+        countRequest();
+    }
+}
+
+void IDRScheduler::InsertRecovery() {
+    std::unique_lock lock(m_mutex);
+
+    if (m_intraRefreshFrames == 0 || m_intraRefreshMode == IntraRefreshMode::None) {
+        lock.unlock();
+        RequestIDR();
+    } else if (m_intraRefreshMode == IntraRefreshMode::OnDemand) {
+        m_intraRefreshScheduled = true;
+    }
+    // A continuous intra refresh already repairs the picture within one period
+}
+
+void IDRScheduler::InsertRefInvalidation(uint64_t lastReceivedTimestampNs) {
+    std::unique_lock lock(m_mutex);
+
+    if (!m_refInvalidationEnabled || !m_refInvalidationSupported) {
+        lock.unlock();
+        InsertRecovery();
+        return;
+    }
+    // Reports of the same loss can overlap, everything after the oldest one is invalid
+    if (!m_refInvalidationScheduled || lastReceivedTimestampNs < m_lastReceivedTimestampNs) {
+        m_lastReceivedTimestampNs = lastReceivedTimestampNs;
+    }
+    m_refInvalidationScheduled = true;
 }
 
 bool IDRScheduler::CheckIDRInsertion() {
     std::unique_lock lock(m_mutex);
 
     if (m_scheduled) {
-        if (m_insertIDRTime <= GetTimestampUs()) {
+        uint64_t now = GetTimestampUs();
+        if (m_insertIDRTime <= now) {
             m_scheduled = false;
+            m_lastIDRTime = now;
+            // The IDR frame repairs everything an intra refresh would have
+            m_intraRefreshScheduled = false;
+            m_intraRefreshFramesLeft = 0;
+            m_refInvalidationScheduled = false;
+            std::lock_guard<std::mutex> statsLock(g_statsMutex);
+            g_stats.issued++;
             return true;
         }
     }
     return false;
 }
+
+bool IDRScheduler::CheckIntraRefreshInsertion() {
+    std::unique_lock lock(m_mutex);
+
+    if (m_intraRefreshFramesLeft > 0) {
+        m_intraRefreshFramesLeft--;
+        return false;
+    }
+    if (m_intraRefreshScheduled) {
+        m_intraRefreshScheduled = false;
+        m_intraRefreshFramesLeft = m_intraRefreshFrames - 1;
+        return true;
+    }
+    return false;
+}
+
+bool IDRScheduler::CheckRefInvalidation(uint64_t& lastReceivedTimestampNs) {
+    std::unique_lock lock(m_mutex);
+
+    if (m_refInvalidationScheduled) {
+        m_refInvalidationScheduled = false;
+        lastReceivedTimestampNs = m_lastReceivedTimestampNs;
+        return true;
+    }
+    return false;
+}
+
+bool IDRScheduler::IsRecoveryPending() {
+    std::unique_lock lock(m_mutex);
+
+    return m_scheduled || m_intraRefreshScheduled || m_intraRefreshFramesLeft > 0
+        || m_refInvalidationScheduled;
+}
+
+void TakeIdrStats(FfiIdrStats* stats) {
+    std::lock_guard<std::mutex> lock(g_statsMutex);
+    *stats = g_stats;
+    g_stats = {};
+}
@@ -1,5 +1,7 @@
 #pragma once
 
+#include "IEncoder.h"
+#include "LockStats.h"
 #include "bindings.h"
 #include <mutex>
 #include <stdint.h>
@@ -10,14 +12,53 @@ public:
     ~IDRScheduler();
 
     void OnStreamStart();
+    // Set once the encoder is created, IDR frames are used until then
+    void SetEncoderCapabilities(const EncoderCapabilities& capabilities);
+    // With the next frame, for a decoder that has nothing to decode from, like at the start of the
+    // stream or once the encoder was recreated
     void InsertIDR();
+    // No sooner than the minimum IDR interval after the last IDR frame. The requests within the
+    // interval wait for the same IDR frame, so that bursts of losses don't send one each.
+    void RequestIDR();
+    // The next frame starts a new scene, it is encoded as an IDR frame unless one was within the
+    // minimum IDR interval
+    void InsertSceneCut();
+    // Recovers from lost frames with an intra refresh if it is enabled and the encoder supports
+    // it, otherwise with RequestIDR
+    void InsertRecovery();
+    // Frames encoded after lastReceivedTimestampNs were lost or predicted from lost frames. The
+    // encoder stops referencing them if it can, otherwise the stream is recovered.
+    void InsertRefInvalidation(uint64_t lastReceivedTimestampNs);
 
     bool CheckIDRInsertion();
+    // Called once per encoded frame that is not an IDR frame. True if the encoder must start an
+    // intra refresh with this frame.
+    bool CheckIntraRefreshInsertion();
+    // True if the encoder must stop referencing the frames encoded after lastReceivedTimestampNs.
+    // Called before CheckIDRInsertion, so that a failed invalidation can still be recovered from
+    // with the same frame.
+    bool CheckRefInvalidation(uint64_t& lastReceivedTimestampNs);
+    // True while an IDR frame, an intra refresh or a ref invalidation is pending or running, the
+    // next frames must be encoded then
+    bool IsRecoveryPending();
 
 private:
     static const int MIN_IDR_FRAME_INTERVAL = 100 * 1000; // 100-milliseconds
     uint64_t m_insertIDRTime = 0;
     bool m_scheduled = false;
-    std::mutex m_mutex;
+    InstrumentedMutex m_mutex { "IDRScheduler" };
     uint64_t m_minIDRFrameInterval = MIN_IDR_FRAME_INTERVAL;
+    uint64_t m_lastIDRTime = 0;
+
+    IntraRefreshMode m_intraRefreshMode = IntraRefreshMode::None;
+    // 0 if recovering with intra refresh is disabled
+    uint32_t m_intraRefreshFrames = 0;
+    bool m_intraRefreshScheduled = false;
+    // Frames left in the running intra refresh, a new one is started after it
+    uint32_t m_intraRefreshFramesLeft = 0;
+
+    bool m_refInvalidationEnabled = false;
+    bool m_refInvalidationSupported = false;
+    bool m_refInvalidationScheduled = false;
+    uint64_t m_lastReceivedTimestampNs = 0;
 };
@@ -0,0 +1,72 @@
+#pragma once
+
+#include "ALVR-common/packet_types.h"
+#include "StaticFrames.h"
+#include "bindings.h"
+#include "openvr_driver_wrap.h"
+#include <stdint.h>
+
+// How an encoder can recover from lost frames without an IDR frame
+enum class IntraRefreshMode {
+    // Only with IDR frames
+    None,
+    // Refreshes the picture over a number of frames when asked to
+    OnDemand,
+    // Always refreshes the picture over a number of frames, so lost frames heal by themselves
+    Continuous,
+};
+
+// What an encoder backend can do, for the scheduling code shared by the platforms
+struct EncoderCapabilities {
+    IntraRefreshMode intraRefreshMode = IntraRefreshMode::None;
+    // Can stop referencing lost frames, see IEncoder::InvalidateRefFrames
+    bool refInvalidation = false;
+    // Hands leading slices of a frame over before the whole frame is encoded
+    bool slices = false;
+    // Lowers the quality of the periphery with a QP map, see FoveatedQpMap
+    bool qpMaps = false;
+    // The input of a frame may still be read after the call that submitted it returned
+    bool async = false;
+    // Encodes with a 10 bit profile
+    bool tenBit = false;
+};
+
+// Part of the encoder interface that doesn't depend on the platform. Frames are submitted through
+// the platform interfaces, VideoEncoder::Transmit with a D3D11 texture on Windows and
+// alvr::EncodePipeline::PushFrame with a Renderer output on Linux.
+class IEncoder {
+public:
+    virtual ~IEncoder() = default;
+
+    // Valid once the encoder is initialized
+    virtual EncoderCapabilities GetCapabilities() = 0;
+    // With IntraRefreshMode::OnDemand, the next submitted frame starts an intra refresh
+    virtual void StartIntraRefresh() { }
+    // Stops referencing the frames encoded after lastReceivedTimestampNs from the next submitted
+    // frame. False if the stream can't be repaired this way.
+    virtual bool InvalidateRefFrames(uint64_t /*lastReceivedTimestampNs*/) { return false; }
+
+    // Foveation center of the next submitted frame
+    void SetFoveationCenter(const FfiFoveationCenter& center) { m_foveationCenter = center; }
+    // Head orientation and eye projections of the next submitted frame, the orientation is all
+    // zeros if unknown
+    void SetHeadView(const vr::HmdQuaternion_t& orientation, const vr::HmdRect2_t projections[2]) {
+        m_headOrientation = orientation;
+        m_projections[0] = projections[0];
+        m_projections[1] = projections[1];
+    }
+    // Unchanged parts of the next submitted frame, null or of width 0 if unknown. Kept by the
+    // caller until the frame is submitted.
+    void SetStaticBlocks(const StaticBlocks* blocks) { m_staticBlocks = blocks; }
+
+protected:
+    // Whether the settings ask for a 10 bit profile that the codec has
+    static bool Uses10BitProfile(int codec) {
+        return Settings_Instance()->m_use10bitEncoder && codec != ALVR_CODEC_H264;
+    }
+
+    FfiFoveationCenter m_foveationCenter = {};
+    vr::HmdQuaternion_t m_headOrientation = {};
+    vr::HmdRect2_t m_projections[2] = {};
+    const StaticBlocks* m_staticBlocks = nullptr;
+};
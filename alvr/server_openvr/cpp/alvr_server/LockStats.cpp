@@ -0,0 +1,105 @@
+#include "LockStats.h"
+#include "bindings.h"
+
+#ifdef ALVR_LOCK_STATS
+
+#include <algorithm>
+#include <atomic>
+#include <string.h>
+
+namespace {
+
+// The frame path has a handful of locks, the ones past this are not recorded
+const int MAX_LOCKS = 32;
+
+struct LockCounters {
+    const char* name;
+    std::atomic<uint32_t> acquisitions;
+    std::atomic<uint32_t> contended;
+    std::atomic<uint32_t> waitBuckets[LOCK_WAIT_BUCKETS];
+};
+
+LockCounters g_locks[MAX_LOCKS] = {};
+// Only taken when a LockStats is created
+std::mutex g_registerMutex;
+std::atomic<int> g_lockCount = 0;
+
+int waitBucket(uint64_t waitNs) {
+    uint64_t waitUs = waitNs / 1000;
+    int bucket = 0;
+    while (waitUs > 0 && bucket < LOCK_WAIT_BUCKETS - 1) {
+        waitUs >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+} // namespace
+
+LockStats::LockStats(const char* name) {
+    std::lock_guard<std::mutex> lock(g_registerMutex);
+    int count = g_lockCount.load();
+    for (int i = 0; i < count; i++) {
+        if (strcmp(g_locks[i].name, name) == 0) {
+            m_index = i;
+            return;
+        }
+    }
+    if (count == MAX_LOCKS) {
+        m_index = -1;
+        return;
+    }
+    g_locks[count].name = name;
+    m_index = count;
+    g_lockCount.store(count + 1);
+}
+
+void LockStats::Record(uint64_t waitNs, bool contended) {
+    if (m_index < 0) {
+        return;
+    }
+    LockCounters& counters = g_locks[m_index];
+    counters.acquisitions.fetch_add(1, std::memory_order_relaxed);
+    if (contended) {
+        counters.contended.fetch_add(1, std::memory_order_relaxed);
+    }
+    counters.waitBuckets[waitBucket(waitNs)].fetch_add(1, std::memory_order_relaxed);
+}
+
+void InstrumentedMutex::lock() {
+    if (m_mutex.try_lock()) {
+        m_stats.Record(0, false);
+        return;
+    }
+    auto begin = std::chrono::steady_clock::now();
+    m_mutex.lock();
+    m_stats.Record(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - begin
+        )
+            .count(),
+        true
+    );
+}
+
+// The counts are taken one by one, so a lock recorded meanwhile may be split between two calls
+int TakeLockStats(FfiLockStats* stats, int maxCount) {
+    int count = std::min(g_lockCount.load(), maxCount);
+    for (int i = 0; i < count; i++) {
+        LockCounters& counters = g_locks[i];
+        stats[i].name = counters.name;
+        stats[i].acquisitions = counters.acquisitions.exchange(0, std::memory_order_relaxed);
+        stats[i].contended = counters.contended.exchange(0, std::memory_order_relaxed);
+        for (int bucket = 0; bucket < LOCK_WAIT_BUCKETS; bucket++) {
+            stats[i].waitBuckets[bucket]
+                = counters.waitBuckets[bucket].exchange(0, std::memory_order_relaxed);
+        }
+    }
+    return count;
+}
+
+#else
+
+int TakeLockStats(FfiLockStats*, int) { return 0; }
+
+#endif
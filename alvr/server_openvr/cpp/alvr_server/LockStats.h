@@ -0,0 +1,76 @@
+#pragma once
+
+#include <chrono>
+#include <mutex>
+#include <stdint.h>
+
+// Wait times and contention of the locks and events of the frame path, to find the ones worth
+// making lock-free. Builds with the lock-stats feature define ALVR_LOCK_STATS, and the counts of
+// each name go to the statistics through TakeLockStats. Without it InstrumentedMutex is a
+// std::mutex and nothing is recorded.
+
+#ifdef ALVR_LOCK_STATS
+
+// Counts of one name, shared by the locks with the same name. Names must be string literals.
+class LockStats {
+public:
+    explicit LockStats(const char* name);
+
+    void Record(uint64_t waitNs, bool contended);
+
+private:
+    int m_index;
+};
+
+// std::mutex that records the time its lock calls wait
+class InstrumentedMutex {
+public:
+    explicit InstrumentedMutex(const char* name)
+        : m_stats(name) { }
+
+    void lock();
+    bool try_lock() { return m_mutex.try_lock(); }
+    void unlock() { m_mutex.unlock(); }
+
+private:
+    std::mutex m_mutex;
+    LockStats m_stats;
+};
+
+#else
+
+class LockStats {
+public:
+    explicit LockStats(const char*) { }
+
+    void Record(uint64_t, bool) { }
+};
+
+class InstrumentedMutex : public std::mutex {
+public:
+    explicit InstrumentedMutex(const char*) { }
+};
+
+#endif
+
+// Waits for an event like CThreadEvent, which counts as contended if it was not set yet
+template <typename Event> void WaitRecorded(Event& event, LockStats& stats) {
+#ifdef ALVR_LOCK_STATS
+    if (event.Wait(0)) {
+        stats.Record(0, false);
+        return;
+    }
+    auto begin = std::chrono::steady_clock::now();
+    event.Wait();
+    stats.Record(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - begin
+        )
+            .count(),
+        true
+    );
+#else
+    (void)stats;
+    event.Wait();
+#endif
+}
@@ -0,0 +1,203 @@
+#include "LogRing.h"
+#include "bindings.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <thread>
+
+std::atomic<bool> g_debugLogEnabled = false;
+
+namespace {
+
+// Power of two, around a second of debug messages of all devices at 120Hz
+const size_t RING_CAPACITY = 1024;
+const auto DRAIN_INTERVAL = std::chrono::milliseconds(5);
+
+// Bounded multi producer queue, each slot sequence tells whether the slot is free for the
+// producer claiming that position or holds a record for the consumer
+struct RingSlot {
+    std::atomic<size_t> sequence;
+    LogRecord record;
+};
+
+RingSlot g_ring[RING_CAPACITY];
+std::atomic<size_t> g_enqueuePosition = 0;
+std::atomic<size_t> g_droppedCount = 0;
+std::once_flag g_threadStarted;
+
+unsigned long long ArgBits(const LogRecord::Arg& arg) {
+    if (arg.kind == LogRecord::ARG_INTEGER) {
+        return arg.bits;
+    } else if (arg.kind == LogRecord::ARG_DOUBLE) {
+        return (unsigned long long)(long long)arg.number;
+    }
+    return 0;
+}
+
+// Formats one conversion at a time, with the length modifiers of the captured argument instead of
+// the ones in the format string. '*' widths are not supported.
+void FormatRecord(const LogRecord& record, char* out, size_t size) {
+    size_t length = 0;
+    int argIndex = 0;
+    const char* f = record.format;
+    while (*f != '\0' && length + 1 < size) {
+        if (*f != '%') {
+            out[length++] = *f++;
+            continue;
+        } else if (f[1] == '%') {
+            out[length++] = '%';
+            f += 2;
+            continue;
+        }
+
+        char spec[32] = "%";
+        size_t specLength = 1;
+        f++;
+        while (*f != '\0' && strchr("-+ #0123456789.", *f) != nullptr && specLength < 24) {
+            spec[specLength++] = *f++;
+        }
+        while (*f != '\0' && strchr("hljztL", *f) != nullptr) {
+            f++;
+        }
+        char conversion = *f;
+        if (conversion == '\0' || argIndex == record.argCount) {
+            break;
+        }
+        f++;
+        const LogRecord::Arg& arg = record.args[argIndex++];
+
+        int count = 0;
+        switch (conversion) {
+        case 'd':
+        case 'i':
+        case 'u':
+        case 'o':
+        case 'x':
+        case 'X':
+            spec[specLength++] = 'l';
+            spec[specLength++] = 'l';
+            spec[specLength] = conversion;
+            count = snprintf(out + length, size - length, spec, ArgBits(arg));
+            break;
+        case 'c':
+            spec[specLength] = 'c';
+            count = snprintf(out + length, size - length, spec, (int)ArgBits(arg));
+            break;
+        case 'f':
+        case 'F':
+        case 'e':
+        case 'E':
+        case 'g':
+        case 'G':
+        case 'a':
+        case 'A':
+            spec[specLength] = conversion;
+            count = snprintf(
+                out + length,
+                size - length,
+                spec,
+                arg.kind == LogRecord::ARG_DOUBLE ? arg.number : (double)(long long)ArgBits(arg)
+            );
+            break;
+        case 's':
+            spec[specLength] = 's';
+            count = snprintf(
+                out + length,
+                size - length,
+                spec,
+                arg.kind == LogRecord::ARG_STRING ? record.text + arg.textOffset : "(null)"
+            );
+            break;
+        case 'p':
+            spec[specLength] = 'p';
+            count = snprintf(out + length, size - length, spec, (void*)(uintptr_t)ArgBits(arg));
+            break;
+        default:
+            break;
+        }
+        if (count > 0) {
+            length = std::min(length + count, size - 1);
+        }
+    }
+
+    if (length > 0 && out[length - 1] == '\n') {
+        length--;
+    }
+    out[length] = '\0';
+}
+
+void DrainRing() {
+    size_t dequeuePosition = 0;
+    char buf[1024];
+    while (true) {
+        RingSlot& slot = g_ring[dequeuePosition % RING_CAPACITY];
+        if (slot.sequence.load(std::memory_order_acquire) != dequeuePosition + 1) {
+            size_t dropped = g_droppedCount.exchange(0, std::memory_order_relaxed);
+            if (dropped > 0) {
+                snprintf(buf, sizeof(buf), "Dropped %zu debug log messages", dropped);
+                LogDebug(buf);
+            }
+
+            std::this_thread::sleep_for(DRAIN_INTERVAL);
+            continue;
+        }
+
+        FormatRecord(slot.record, buf, sizeof(buf));
+        slot.sequence.store(dequeuePosition + RING_CAPACITY, std::memory_order_release);
+        dequeuePosition++;
+
+        LogDebug(buf);
+    }
+}
+
+} // namespace
+
+uint32_t LogRecord::AppendText(const char* string) {
+    uint32_t offset = textSize;
+    int count = snprintf(text + offset, TEXT_SIZE - offset, "%s", string ? string : "(null)");
+    textSize = std::min(offset + (uint32_t)std::max(count, 0) + 1, (uint32_t)TEXT_SIZE - 1);
+    return offset;
+}
+
+uint32_t LogRecord::AppendText(const wchar_t* string) {
+    uint32_t offset = textSize;
+    int count = snprintf(text + offset, TEXT_SIZE - offset, "%ls", string ? string : L"(null)");
+    textSize = std::min(offset + (uint32_t)std::max(count, 0) + 1, (uint32_t)TEXT_SIZE - 1);
+    return offset;
+}
+
+void StartDebugLogThread() {
+    std::call_once(g_threadStarted, [] {
+        for (size_t i = 0; i < RING_CAPACITY; i++) {
+            g_ring[i].sequence.store(i, std::memory_order_relaxed);
+        }
+        std::thread(DrainRing).detach();
+    });
+}
+
+void PushDebugLogRecord(const LogRecord& record) {
+    size_t position = g_enqueuePosition.load(std::memory_order_relaxed);
+    while (true) {
+        RingSlot& slot = g_ring[position % RING_CAPACITY];
+        size_t sequence = slot.sequence.load(std::memory_order_acquire);
+        if (sequence == position) {
+            if (g_enqueuePosition.compare_exchange_weak(
+                    position, position + 1, std::memory_order_relaxed
+                )) {
+                slot.record = record;
+                slot.sequence.store(position + 1, std::memory_order_release);
+                return;
+            }
+        } else if ((ptrdiff_t)(sequence - position) < 0) {
+            // The slot still holds the record of the previous lap
+            g_droppedCount.fetch_add(1, std::memory_order_relaxed);
+            return;
+        } else {
+            position = g_enqueuePosition.load(std::memory_order_relaxed);
+        }
+    }
+}
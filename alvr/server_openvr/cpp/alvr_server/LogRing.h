@@ -0,0 +1,87 @@
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+#include <type_traits>
+#include <wchar.h>
+
+// Log message captured without formatting. The format string is kept by pointer, so it must be a
+// string literal, while string arguments are copied into the record.
+struct LogRecord {
+    static const int MAX_ARGS = 12;
+    static const int TEXT_SIZE = 256;
+
+    enum ArgKind : uint8_t {
+        ARG_INTEGER,
+        ARG_DOUBLE,
+        ARG_STRING,
+    };
+
+    struct Arg {
+        ArgKind kind;
+        union {
+            // Integers and pointers, sign extended
+            unsigned long long bits;
+            double number;
+            // Offset of the copied string in text
+            uint32_t textOffset;
+        };
+    };
+
+    const char* format;
+    int argCount;
+    uint32_t textSize;
+    Arg args[MAX_ARGS];
+    char text[TEXT_SIZE];
+
+    uint32_t AppendText(const char* string);
+    uint32_t AppendText(const wchar_t* string);
+};
+
+// Set once the server_impl debug group is known, debug messages are dropped before being captured
+// while it is false
+extern std::atomic<bool> g_debugLogEnabled;
+
+// Starts the thread that formats and forwards the queued debug messages
+void StartDebugLogThread();
+
+// Queues a record for the debug log thread. Messages are dropped and counted when the ring is full.
+void PushDebugLogRecord(const LogRecord& record);
+
+template <typename T> LogRecord::Arg CaptureLogArg(LogRecord& record, T value) {
+    LogRecord::Arg arg;
+    if constexpr (std::is_same_v<T, const char*> || std::is_same_v<T, char*>
+                  || std::is_same_v<T, const wchar_t*> || std::is_same_v<T, wchar_t*>) {
+        arg.kind = LogRecord::ARG_STRING;
+        arg.textOffset = record.AppendText(value);
+    } else if constexpr (std::is_pointer_v<T>) {
+        arg.kind = LogRecord::ARG_INTEGER;
+        arg.bits = (uintptr_t)value;
+    } else if constexpr (std::is_floating_point_v<T>) {
+        arg.kind = LogRecord::ARG_DOUBLE;
+        arg.number = value;
+    } else {
+        static_assert(
+            std::is_integral_v<T> || std::is_enum_v<T>, "Unsupported debug log argument type"
+        );
+        arg.kind = LogRecord::ARG_INTEGER;
+        if constexpr (std::is_unsigned_v<T>) {
+            arg.bits = (unsigned long long)value;
+        } else {
+            arg.bits = (unsigned long long)(long long)value;
+        }
+    }
+    return arg;
+}
+
+template <typename... Args> void PushDebugLog(const char* format, Args... args) {
+    static_assert(sizeof...(Args) <= LogRecord::MAX_ARGS, "Too many debug log arguments");
+
+    LogRecord record;
+    record.format = format;
+    record.argCount = 0;
+    record.textSize = 0;
+    ((record.args[record.argCount++] = CaptureLogArg(record, args)), ...);
+
+    PushDebugLogRecord(record);
+}
@@ -50,14 +50,14 @@ void Info(const char* format, ...) {
     va_end(args);
 }
 
-void Debug(const char* format, ...) {
+void SetDebugLogEnabled(bool enabled) {
 #ifdef ALVR_DEBUG_LOG
-    va_list args;
-    va_start(args, format);
-    _log(format, args, LogDebug);
-    va_end(args);
+    if (enabled) {
+        StartDebugLogThread();
+    }
+    g_debugLogEnabled = enabled;
 #else
-    (void)format;
+    (void)enabled;
 #endif
 }
 
@@ -1,11 +1,28 @@
 #pragma once
 
 #include "ALVR-common/exception.h"
+#include "LogRing.h"
 
 Exception MakeException(const char* format, ...);
 
 void Error(const char* format, ...);
 void Warn(const char* format, ...);
 void Info(const char* format, ...);
-void Debug(const char* format, ...);
 void LogPeriod(const char* tag, const char* format, ...);
+
+// Enables the debug messages of the server_impl group, which are otherwise dropped before being
+// captured. Builds without ALVR_DEBUG_LOG compile them out.
+void SetDebugLogEnabled(bool enabled);
+
+// Called every frame and pose, so the arguments are only captured here and a background thread
+// formats them. The format must be a string literal.
+template <typename... Args> void Debug(const char* format, Args... args) {
+#ifdef ALVR_DEBUG_LOG
+    if (g_debugLogEnabled.load(std::memory_order_relaxed)) {
+        PushDebugLog(format, args...);
+    }
+#else
+    (void)format;
+    ((void)args, ...);
+#endif
+}
@@ -0,0 +1,120 @@
+#include "NalIndex.h"
+#include "ALVR-common/packet_types.h"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define NAL_INDEX_SSE2
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#define NAL_INDEX_NEON
+#include <arm_neon.h>
+#endif
+
+namespace {
+
+const unsigned char* findStartCodeScalar(const unsigned char* p, const unsigned char* end) {
+    for (; p + 3 <= end; ++p) {
+        if (p[2] > 1) {
+            // No start code can begin at p, p + 1 or p + 2
+            p += 2;
+        } else if (p[0] == 0 && p[1] == 0 && p[2] == 1) {
+            return p;
+        }
+    }
+    return end;
+}
+
+#ifdef NAL_INDEX_SSE2
+int countTrailingZeros(unsigned int mask) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return index;
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+#endif
+
+} // namespace
+
+const unsigned char* FindStartCode(const unsigned char* begin, const unsigned char* end) {
+    const unsigned char* p = begin;
+
+    // Each iteration tests the 16 positions p..p+15 with three overlapping loads
+#if defined(NAL_INDEX_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi8(1);
+    while (p + 18 <= end) {
+        __m128i b0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        __m128i b1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 1));
+        __m128i b2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 2));
+        __m128i match = _mm_and_si128(
+            _mm_and_si128(_mm_cmpeq_epi8(b0, zero), _mm_cmpeq_epi8(b1, zero)),
+            _mm_cmpeq_epi8(b2, one)
+        );
+        int mask = _mm_movemask_epi8(match);
+        if (mask != 0) {
+            return p + countTrailingZeros(mask);
+        }
+        p += 16;
+    }
+#elif defined(NAL_INDEX_NEON)
+    const uint8x16_t one = vdupq_n_u8(1);
+    while (p + 18 <= end) {
+        uint8x16_t match = vandq_u8(
+            vandq_u8(vceqzq_u8(vld1q_u8(p)), vceqzq_u8(vld1q_u8(p + 1))),
+            vceqq_u8(vld1q_u8(p + 2), one)
+        );
+        if (vmaxvq_u8(match) != 0) {
+            return findStartCodeScalar(p, p + 18);
+        }
+        p += 16;
+    }
+#endif
+
+    return findStartCodeScalar(p, end);
+}
+
+void IndexNals(
+    int codec, const unsigned char* buf, int len, std::vector<NalUnit>& nals, size_t maxNals
+) {
+    nals.clear();
+    if (codec != ALVR_CODEC_H264 && codec != ALVR_CODEC_HEVC) {
+        return;
+    }
+
+    const unsigned char* end = buf + len;
+    const unsigned char* code = FindStartCode(buf, end);
+    while (code != end) {
+        NalUnit nal = {};
+        nal.prefixSize = 3;
+        // A leading zero byte makes it a 4 byte start code
+        if (code > buf && code[-1] == 0) {
+            code--;
+            nal.prefixSize = 4;
+        }
+        nal.offset = code - buf;
+
+        if (!nals.empty()) {
+            nals.back().size = nal.offset - nals.back().offset;
+        }
+        if (nals.size() == maxNals) {
+            return;
+        }
+
+        const unsigned char* header = code + nal.prefixSize;
+        if (header != end) {
+            nal.type = codec == ALVR_CODEC_H264 ? header[0] & 0x1F : (header[0] >> 1) & 0x3F;
+        }
+        nals.push_back(nal);
+
+        code = FindStartCode(header, end);
+    }
+
+    if (!nals.empty()) {
+        nals.back().size = len - nals.back().offset;
+    }
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// NAL unit of an Annex B H.264 or H.265 access unit
+struct NalUnit {
+    // Offset of the start code in the access unit
+    uint32_t offset;
+    // Start code plus payload, up to the next start code
+    uint32_t size;
+    // 3 or 4 bytes
+    uint8_t prefixSize;
+    // nal_unit_type, 0 if the start code is the last bytes of the buffer
+    uint8_t type;
+};
+
+// Start of the first 00 00 01 start code in [begin, end), or end. Scans 16 bytes at a time with
+// SSE2 or NEON when available.
+const unsigned char* FindStartCode(const unsigned char* begin, const unsigned char* end);
+
+// Indexes the NALs of an access unit in one pass, stopping after maxNals. Bytes before the first
+// start code are ignored. AV1 streams have no start codes and give an empty index.
+void IndexNals(
+    int codec,
+    const unsigned char* buf,
+    int len,
+    std::vector<NalUnit>& nals,
+    size_t maxNals = SIZE_MAX
+);
@@ -1,117 +1,899 @@
 
 #include "Logger.h"
+#include "NalIndex.h"
+#include "Profiling.h"
+#include "StartupTimeline.h"
 #include "Utils.h"
 #include "bindings.h"
+#include <algorithm>
+#include <atomic>
 #include <mutex>
 #include <string.h>
 
-static const char NAL_PREFIX_3B[] = { 0x00, 0x00, 0x01 };
-static const char NAL_PREFIX_4B[] = { 0x00, 0x00, 0x00, 0x01 };
-
 static const unsigned char H264_NAL_TYPE_SPS = 7;
 static const unsigned char HEVC_NAL_TYPE_VPS = 32;
+static const unsigned char HEVC_NAL_TYPE_SPS = 33;
 
 static const unsigned char H264_NAL_TYPE_AUD = 9;
 static const unsigned char HEVC_NAL_TYPE_AUD = 35;
 
-int8_t getNalPrefixSize(unsigned char* buf) {
-    if (memcmp(buf, NAL_PREFIX_3B, sizeof(NAL_PREFIX_3B)) == 0) {
-        return sizeof(NAL_PREFIX_3B);
-    } else if (memcmp(buf, NAL_PREFIX_4B, sizeof(NAL_PREFIX_4B)) == 0) {
-        return sizeof(NAL_PREFIX_4B);
+static const unsigned char H264_NAL_TYPE_PREFIX = 14;
+
+static const unsigned char AV1_OBU_SEQUENCE_HEADER = 1;
+static const unsigned char AV1_OBU_TEMPORAL_DELIMITER = 2;
+static const unsigned char AV1_OBU_FRAME_HEADER = 3;
+static const unsigned char AV1_OBU_FRAME = 6;
+static const unsigned char AV1_OBU_PADDING = 15;
+
+// Shortest buffer that can hold a NAL, a 4 byte start code
+static const int MIN_NAL_SIZE = 4;
+
+// Set when a stream starts, so that the configuration is sent again even if it didn't change
+static std::atomic<bool> configStale = true;
+
+void ResetVideoConfigNals() { configStale = true; }
+
+static std::atomic<VideoSinkFn> videoSink = nullptr;
+
+void SetVideoSink(VideoSinkFn sink) { videoSink = sink; }
+
+namespace {
+
+// Reads an RBSP, past its end the bits are 0 and the reader overflows
+class BitReader {
+public:
+    explicit BitReader(const std::vector<unsigned char>& data)
+        : m_data(data) { }
+
+    bool Overflow() const { return m_pos > m_data.size() * 8; }
+    size_t Position() const { return m_pos; }
+    // For values the parser can't go on with
+    void Fail() { m_pos = m_data.size() * 8 + 1; }
+
+    uint32_t Bits(int count) {
+        uint32_t value = 0;
+        for (int i = 0; i < count; i++) {
+            value = (value << 1) | Bit();
+        }
+        return value;
+    }
+
+    uint32_t Ue() {
+        int zeros = 0;
+        while (!Bit()) {
+            if (++zeros > 31 || Overflow()) {
+                Fail();
+                return 0;
+            }
+        }
+        return uint32_t((uint64_t(1) << zeros) - 1 + Bits(zeros));
+    }
+
+    int32_t Se() {
+        uint32_t code = Ue();
+        return code & 1 ? int32_t((code + 1) / 2) : -int32_t(code / 2);
+    }
+
+    // Of the rbsp_stop_one_bit, the last bit set. 0 if there is none.
+    size_t StopBit() const {
+        for (size_t i = m_data.size(); i > 0; i--) {
+            if (unsigned char byte = m_data[i - 1]) {
+                int trailing = 0;
+                while (!(byte & (1 << trailing))) {
+                    trailing++;
+                }
+                return i * 8 - 1 - trailing;
+            }
+        }
+        return 0;
+    }
+
+private:
+    unsigned int Bit() {
+        size_t pos = m_pos++;
+        if (pos >= m_data.size() * 8) {
+            Fail();
+            return 0;
+        }
+        return (m_data[pos / 8] >> (7 - pos % 8)) & 1;
+    }
+
+    const std::vector<unsigned char>& m_data;
+    size_t m_pos = 0;
+};
+
+class BitWriter {
+public:
+    std::vector<unsigned char>& Data() { return m_data; }
+
+    void Bits(uint32_t value, int count) {
+        for (int i = count - 1; i >= 0; i--) {
+            if (m_bits % 8 == 0) {
+                m_data.push_back(0);
+            }
+            m_data.back() |= ((value >> i) & 1) << (7 - m_bits % 8);
+            m_bits++;
+        }
+    }
+
+    void Ue(uint32_t value) {
+        uint64_t code = uint64_t(value) + 1;
+        int length = 0;
+        while (code >> (length + 1)) {
+            length++;
+        }
+        Bits(0, length);
+        Bits(uint32_t(code >> 32), length >= 32 ? 1 : 0);
+        Bits(uint32_t(code), std::min(length + 1, 32));
+    }
+
+    void Se(int32_t value) { Ue(value > 0 ? uint32_t(value) * 2 - 1 : uint32_t(-value) * 2); }
+
+    void TrailingBits() {
+        Bits(1, 1);
+        while (m_bits % 8 != 0) {
+            Bits(0, 1);
+        }
+    }
+
+private:
+    std::vector<unsigned char> m_data;
+    size_t m_bits = 0;
+};
+
+// Writes back the syntax elements it reads
+struct BitCopier {
+    BitReader& r;
+    BitWriter& w;
+
+    uint32_t Bits(int count) {
+        uint32_t value = r.Bits(count);
+        w.Bits(value, count);
+        return value;
+    }
+    uint32_t Ue() {
+        uint32_t value = r.Ue();
+        w.Ue(value);
+        return value;
+    }
+    int32_t Se() {
+        int32_t value = r.Se();
+        w.Se(value);
+        return value;
+    }
+};
+
+void unescapeRbsp(const unsigned char* buf, int len, std::vector<unsigned char>& rbsp) {
+    rbsp.clear();
+    int zeros = 0;
+    for (int i = 0; i < len; i++) {
+        if (zeros >= 2 && buf[i] == 3) {
+            zeros = 0;
+            continue;
+        }
+        zeros = buf[i] == 0 ? zeros + 1 : 0;
+        rbsp.push_back(buf[i]);
+    }
+}
+
+void escapeRbsp(const std::vector<unsigned char>& rbsp, std::vector<unsigned char>& out) {
+    int zeros = 0;
+    for (unsigned char byte : rbsp) {
+        if (zeros >= 2 && byte <= 3) {
+            out.push_back(3);
+            zeros = 0;
+        }
+        zeros = byte == 0 ? zeros + 1 : 0;
+        out.push_back(byte);
+    }
+}
+
+void copyH264ScalingList(BitCopier& c, int size) {
+    int lastScale = 8;
+    int nextScale = 8;
+    for (int i = 0; i < size; i++) {
+        if (nextScale != 0) {
+            nextScale = (lastScale + c.Se() + 256) % 256;
+        }
+        lastScale = nextScale == 0 ? lastScale : nextScale;
+    }
+}
+
+void copyH264Hrd(BitCopier& c) {
+    uint32_t cpbCount = c.Ue() + 1;
+    if (cpbCount > 32) {
+        c.r.Fail();
+        return;
+    }
+    // bit_rate_scale, cpb_size_scale
+    c.Bits(8);
+    for (uint32_t i = 0; i < cpbCount; i++) {
+        c.Ue();
+        c.Ue();
+        c.Bits(1);
+    }
+    // Delay lengths and time_offset_length
+    c.Bits(20);
+}
+
+/*
+Rewrites the H.264 SPS with max_num_reorder_frames 0 and max_dec_frame_buffering as small as the
+reference frames allow in the bitstream restriction of its VUI, which is added if there is none.
+Without them, decoders may hold frames back for reordering the stream never does.
+*/
+bool rewriteH264Sps(BitReader& r, BitWriter& w) {
+    BitCopier c { r, w };
+    uint32_t profile = c.Bits(8);
+    // Constraint flags and level_idc
+    c.Bits(16);
+    c.Ue();
+    if (profile == 100 || profile == 110 || profile == 122 || profile == 244 || profile == 44
+        || profile == 83 || profile == 86 || profile == 118 || profile == 128 || profile == 138
+        || profile == 139 || profile == 134 || profile == 135) {
+        uint32_t chromaFormat = c.Ue();
+        if (chromaFormat == 3) {
+            c.Bits(1);
+        }
+        c.Ue();
+        c.Ue();
+        c.Bits(1);
+        if (c.Bits(1)) {
+            for (int i = 0; i < (chromaFormat != 3 ? 8 : 12); i++) {
+                if (c.Bits(1)) {
+                    copyH264ScalingList(c, i < 6 ? 16 : 64);
+                }
+            }
+        }
+    }
+    c.Ue();
+    uint32_t pocType = c.Ue();
+    if (pocType == 0) {
+        c.Ue();
+    } else if (pocType == 1) {
+        c.Bits(1);
+        c.Se();
+        c.Se();
+        uint32_t cycle = c.Ue();
+        if (cycle > 255) {
+            return false;
+        }
+        for (uint32_t i = 0; i < cycle; i++) {
+            c.Se();
+        }
+    }
+    uint32_t maxRefFrames = c.Ue();
+    c.Bits(1);
+    c.Ue();
+    c.Ue();
+    if (!c.Bits(1)) {
+        c.Bits(1);
+    }
+    c.Bits(1);
+    if (c.Bits(1)) {
+        for (int i = 0; i < 4; i++) {
+            c.Ue();
+        }
+    }
+
+    // Inferred values of an absent bitstream restriction
+    uint32_t mvOverPicBoundaries = 1;
+    uint32_t maxBytesPerPicDenom = 2;
+    uint32_t maxBitsPerMbDenom = 1;
+    uint32_t log2MaxMvLengthHorizontal = 16;
+    uint32_t log2MaxMvLengthVertical = 16;
+
+    w.Bits(1, 1);
+    if (r.Bits(1)) {
+        if (c.Bits(1) && c.Bits(8) == 255) {
+            // Extended_SAR
+            c.Bits(32);
+        }
+        if (c.Bits(1)) {
+            c.Bits(1);
+        }
+        if (c.Bits(1)) {
+            c.Bits(4);
+            if (c.Bits(1)) {
+                c.Bits(24);
+            }
+        }
+        if (c.Bits(1)) {
+            c.Ue();
+            c.Ue();
+        }
+        if (c.Bits(1)) {
+            c.Bits(32);
+            c.Bits(32);
+            c.Bits(1);
+        }
+        bool nalHrd = c.Bits(1);
+        if (nalHrd) {
+            copyH264Hrd(c);
+        }
+        bool vclHrd = c.Bits(1);
+        if (vclHrd) {
+            copyH264Hrd(c);
+        }
+        if (nalHrd || vclHrd) {
+            c.Bits(1);
+        }
+        c.Bits(1);
+        if (r.Bits(1)) {
+            mvOverPicBoundaries = r.Bits(1);
+            maxBytesPerPicDenom = r.Ue();
+            maxBitsPerMbDenom = r.Ue();
+            log2MaxMvLengthHorizontal = r.Ue();
+            log2MaxMvLengthVertical = r.Ue();
+        }
     } else {
-        return -1;
+        // Only the bitstream restriction
+        w.Bits(0, 8);
     }
+    w.Bits(1, 1);
+    w.Bits(mvOverPicBoundaries, 1);
+    w.Ue(maxBytesPerPicDenom);
+    w.Ue(maxBitsPerMbDenom);
+    w.Ue(log2MaxMvLengthHorizontal);
+    w.Ue(log2MaxMvLengthVertical);
+    w.Ue(0);
+    w.Ue(std::max(maxRefFrames, 1u));
+    w.TrailingBits();
+    return !r.Overflow();
 }
 
 /*
-Sends the (VPS + )SPS + PPS video configuration headers from H.264 or H.265 stream as a sequence of
-NALs. (VPS + )SPS + PPS have short size (8bytes + 28bytes in some environment), so we can assume
-SPS + PPS is contained in first fragment.
+Rewrites the HEVC SPS with sps_max_num_reorder_pics and sps_max_latency_increase_plus1 0 for all the
+sub-layers, HEVC has no reordering fields in the VUI. The rest of the SPS is copied as is.
 */
-void sendHeaders(int codec, unsigned char*& buf, int& len, int nalNum) {
-    unsigned char* cursor = buf;
-    int headersLen = 0;
-    int foundHeaders = -1; // Offset by 1 header to find the length until the next header
-
-    while (headersLen <= len) {
-        if (headersLen + sizeof(NAL_PREFIX_4B) > (unsigned)len) {
-            cursor++;
-            headersLen++;
-            continue;
+bool rewriteHevcSps(BitReader& r, BitWriter& w) {
+    BitCopier c { r, w };
+    c.Bits(4);
+    uint32_t maxSubLayersMinus1 = c.Bits(3);
+    c.Bits(1);
+
+    // profile_tier_level, the general profile and level take 96 bits and each sub-layer 88 bits
+    // of profile and 8 of level
+    c.Bits(32);
+    c.Bits(32);
+    c.Bits(32);
+    bool subLayerProfile[8];
+    bool subLayerLevel[8];
+    for (uint32_t i = 0; i < maxSubLayersMinus1; i++) {
+        subLayerProfile[i] = c.Bits(1);
+        subLayerLevel[i] = c.Bits(1);
+    }
+    if (maxSubLayersMinus1 > 0) {
+        c.Bits(2 * (8 - maxSubLayersMinus1));
+    }
+    for (uint32_t i = 0; i < maxSubLayersMinus1; i++) {
+        if (subLayerProfile[i]) {
+            c.Bits(32);
+            c.Bits(32);
+            c.Bits(24);
+        }
+        if (subLayerLevel[i]) {
+            c.Bits(8);
         }
-        int8_t prefixSize = getNalPrefixSize(cursor);
-        if (prefixSize == -1) {
-            cursor++;
-            headersLen++;
+    }
+
+    c.Ue();
+    if (c.Ue() == 3) {
+        c.Bits(1);
+    }
+    c.Ue();
+    c.Ue();
+    if (c.Bits(1)) {
+        for (int i = 0; i < 4; i++) {
+            c.Ue();
+        }
+    }
+    c.Ue();
+    c.Ue();
+    c.Ue();
+    bool allSubLayers = c.Bits(1);
+    for (uint32_t i = allSubLayers ? 0 : maxSubLayersMinus1; i <= maxSubLayersMinus1; i++) {
+        c.Ue();
+        r.Ue();
+        w.Ue(0);
+        r.Ue();
+        w.Ue(0);
+    }
+
+    size_t stopBit = r.StopBit();
+    if (r.Overflow() || r.Position() > stopBit) {
+        return false;
+    }
+    while (r.Position() < stopBit) {
+        c.Bits(std::min<size_t>(stopBit - r.Position(), 32));
+    }
+    w.TrailingBits();
+    return true;
+}
+
+/*
+Copies the config NALs to out with their SPS rewritten so that clients output each frame as soon
+as it is decoded. False if an SPS can't be parsed, the NALs are then sent unchanged.
+*/
+bool rewriteConfigForLowDelay(
+    const unsigned char* buf, int len, int codec, std::vector<unsigned char>& out
+) {
+    const bool h264 = codec == ALVR_CODEC_H264;
+    const int headerSize = h264 ? 1 : 2;
+
+    thread_local std::vector<NalUnit> nals;
+    thread_local std::vector<unsigned char> rbsp;
+    IndexNals(codec, buf, len, nals);
+    out.clear();
+    for (const NalUnit& nal : nals) {
+        const unsigned char* data = buf + nal.offset;
+        if (nal.type != (h264 ? H264_NAL_TYPE_SPS : HEVC_NAL_TYPE_SPS)) {
+            out.insert(out.end(), data, data + nal.size);
             continue;
         }
-        foundHeaders++;
-        if (foundHeaders == nalNum) {
-            break;
+        if (int(nal.size) <= nal.prefixSize + headerSize) {
+            return false;
+        }
+
+        int payloadOffset = nal.prefixSize + headerSize;
+        unescapeRbsp(data + payloadOffset, nal.size - payloadOffset, rbsp);
+        BitReader reader(rbsp);
+        BitWriter writer;
+        if (!(h264 ? rewriteH264Sps(reader, writer) : rewriteHevcSps(reader, writer))) {
+            return false;
         }
-        headersLen += prefixSize;
-        cursor += prefixSize;
+        out.insert(out.end(), data, data + payloadOffset);
+        escapeRbsp(writer.Data(), out);
     }
+    return !nals.empty();
+}
+
+} // namespace
+
+// Only crosses the FFI when the configuration changed, encoders repeat it before every IDR
+static void sendConfigNals(const unsigned char* buf, int len, int codec) {
+    static std::vector<unsigned char> lastConfig;
+    static int lastCodec = -1;
 
-    if (foundHeaders != nalNum) {
+    bool stale = configStale.exchange(false);
+    if (!stale && codec == lastCodec
+        && std::equal(buf, buf + len, lastConfig.begin(), lastConfig.end())) {
         return;
     }
+    lastConfig.assign(buf, buf + len);
+    lastCodec = codec;
 
-    SetVideoConfigNals((const unsigned char*)buf, headersLen, codec);
+    static std::vector<unsigned char> rewritten;
+    if (codec != ALVR_CODEC_AV1 && rewriteConfigForLowDelay(buf, len, codec, rewritten)) {
+        SetVideoConfigNals(rewritten.data(), rewritten.size(), codec);
+        return;
+    }
+    SetVideoConfigNals(buf, len, codec);
+}
 
-    // move the cursor forward excluding config NALs
-    buf = cursor;
-    len -= headersLen;
+// Reads an AV1 leb128 value, returns its size in bytes or 0 if it is truncated
+static int readLeb128(const unsigned char* buf, int len, uint64_t& value) {
+    value = 0;
+    for (int i = 0; i < 8 && i < len; i++) {
+        value |= uint64_t(buf[i] & 0x7F) << (i * 7);
+        if (!(buf[i] & 0x80)) {
+            return i + 1;
+        }
+    }
+    return 0;
 }
 
-void processH264Nals(unsigned char*& buf, int& len) {
-    unsigned char prefixSize = getNalPrefixSize(buf);
-    unsigned char nalType = buf[prefixSize] & 0x1F;
+/*
+Wraps an AV1 sequence header OBU into an AV1CodecConfigurationRecord (av1C), which Android takes as
+csd-0. Only the fields up to the color config are parsed. Returns false if the OBU is truncated.
+*/
+static bool buildAv1Config(
+    const unsigned char* obu,
+    int headerSize,
+    const unsigned char* payload,
+    int payloadSize,
+    std::vector<unsigned char>& out
+) {
+    thread_local std::vector<unsigned char> data;
+    data.assign(payload, payload + payloadSize);
+    BitReader r(data);
+
+    uint32_t profile = r.Bits(3);
+    r.Bits(1); // still_picture
+    bool reducedStillPictureHeader = r.Bits(1);
+    uint32_t level = 0;
+    uint32_t tier = 0;
+    if (reducedStillPictureHeader) {
+        level = r.Bits(5);
+    } else {
+        bool decoderModelInfoPresent = false;
+        int bufferDelayLength = 0;
+        if (r.Bits(1)) { // timing_info_present_flag
+            r.Bits(32); // num_units_in_display_tick
+            r.Bits(32); // time_scale
+            if (r.Bits(1)) { // equal_picture_interval
+                r.Ue(); // num_ticks_per_picture_minus_1
+            }
+            decoderModelInfoPresent = r.Bits(1);
+            if (decoderModelInfoPresent) {
+                bufferDelayLength = r.Bits(5) + 1;
+                r.Bits(32); // num_units_in_decoding_tick
+                r.Bits(10); // buffer_removal_time_length_minus_1 and the presentation one
+            }
+        }
+        bool initialDisplayDelayPresent = r.Bits(1);
+        uint32_t operatingPoints = r.Bits(5) + 1;
+        for (uint32_t i = 0; i < operatingPoints; i++) {
+            r.Bits(12); // operating_point_idc
+            uint32_t opLevel = r.Bits(5);
+            uint32_t opTier = opLevel > 7 ? r.Bits(1) : 0;
+            // The record holds the ones of the first operating point
+            if (i == 0) {
+                level = opLevel;
+                tier = opTier;
+            }
+            if (decoderModelInfoPresent && r.Bits(1)) {
+                r.Bits(bufferDelayLength); // decoder_buffer_delay
+                r.Bits(bufferDelayLength); // encoder_buffer_delay
+                r.Bits(1); // low_delay_mode_flag
+            }
+            if (initialDisplayDelayPresent && r.Bits(1)) {
+                r.Bits(4); // initial_display_delay_minus_1
+            }
+        }
+    }
+
+    int frameWidthBits = r.Bits(4) + 1;
+    int frameHeightBits = r.Bits(4) + 1;
+    r.Bits(frameWidthBits);
+    r.Bits(frameHeightBits);
+    if (!reducedStillPictureHeader && r.Bits(1)) { // frame_id_numbers_present_flag
+        r.Bits(7); // delta_frame_id_length_minus_2, additional_frame_id_length_minus_1
+    }
+    r.Bits(3); // use_128x128_superblock, enable_filter_intra, enable_intra_edge_filter
+    if (!reducedStillPictureHeader) {
+        r.Bits(4); // enable_interintra_compound to enable_dual_filter
+        bool enableOrderHint = r.Bits(1);
+        if (enableOrderHint) {
+            r.Bits(2); // enable_jnt_comp, enable_ref_frame_mvs
+        }
+        // seq_choose_screen_content_tools, or seq_force_screen_content_tools
+        bool screenContentTools = r.Bits(1) || r.Bits(1);
+        // seq_choose_integer_mv, or seq_force_integer_mv
+        if (screenContentTools && !r.Bits(1)) {
+            r.Bits(1);
+        }
+        if (enableOrderHint) {
+            r.Bits(3); // order_hint_bits_minus_1
+        }
+    }
+    r.Bits(3); // enable_superres, enable_cdef, enable_restoration
+
+    bool highBitdepth = r.Bits(1);
+    bool twelveBit = profile == 2 && highBitdepth && r.Bits(1);
+    bool monochrome = profile != 1 && r.Bits(1);
+    uint32_t primaries = 2;
+    uint32_t transfer = 2;
+    uint32_t matrix = 2;
+    if (r.Bits(1)) { // color_description_present_flag
+        primaries = r.Bits(8);
+        transfer = r.Bits(8);
+        matrix = r.Bits(8);
+    }
+    uint32_t subsamplingX = 1;
+    uint32_t subsamplingY = 1;
+    uint32_t chromaSamplePosition = 0;
+    // BT.709 primaries with the sRGB transfer and the identity matrix are 4:4:4
+    if (!monochrome && primaries == 1 && transfer == 13 && matrix == 0) {
+        subsamplingX = 0;
+        subsamplingY = 0;
+    } else if (!monochrome) {
+        r.Bits(1); // color_range
+        if (profile == 1) {
+            subsamplingX = 0;
+            subsamplingY = 0;
+        } else if (profile == 2) {
+            subsamplingX = twelveBit ? r.Bits(1) : 1;
+            subsamplingY = twelveBit && subsamplingX ? r.Bits(1) : 0;
+        }
+        if (subsamplingX && subsamplingY) {
+            chromaSamplePosition = r.Bits(2);
+        }
+    }
+    if (r.Overflow()) {
+        return false;
+    }
+
+    out.clear();
+    out.push_back(0x81); // marker and version 1
+    out.push_back(profile << 5 | level);
+    out.push_back(
+        tier << 7 | highBitdepth << 6 | twelveBit << 5 | monochrome << 4 | subsamplingX << 3
+        | subsamplingY << 2 | chromaSamplePosition
+    );
+    out.push_back(0); // no initial_presentation_delay
+
+    // The configOBUs, which must have a size field
+    out.push_back(obu[0] | 0x02);
+    if (headerSize == 2) {
+        out.push_back(obu[1]);
+    }
+    uint64_t size = payloadSize;
+    do {
+        out.push_back((size & 0x7F) | (size > 0x7F ? 0x80 : 0));
+        size >>= 7;
+    } while (size != 0);
+    out.insert(out.end(), payload, payload + payloadSize);
+    return true;
+}
+
+/*
+Sends the sequence header OBU of an AV1 temporal unit as the video configuration, in an av1C
+record, and removes the temporal delimiter and padding OBUs in place. The sequence header stays in
+the frame, for decoders that don't use the configuration. Bytes that can't be parsed as OBUs are
+left untouched.
+*/
+static void processAv1Obus(unsigned char* buf, int& len) {
+    unsigned char* out = buf;
+    int pos = 0;
+    while (pos < len) {
+        unsigned char* obu = buf + pos;
+        int remaining = len - pos;
+
+        unsigned char type = (obu[0] >> 3) & 0xF;
+        int headerSize = (obu[0] & 0x04) ? 2 : 1;
+        bool hasSizeField = obu[0] & 0x02;
+
+        // Without a size field the OBU extends to the end of the temporal unit
+        int obuSize = remaining;
+        int payloadOffset = headerSize;
+        if (hasSizeField && headerSize < remaining) {
+            uint64_t payloadSize;
+            int lebSize = readLeb128(obu + headerSize, remaining - headerSize, payloadSize);
+            if (lebSize != 0 && payloadSize <= uint64_t(remaining - headerSize - lebSize)) {
+                obuSize = headerSize + lebSize + int(payloadSize);
+                payloadOffset = headerSize + lebSize;
+            }
+        }
+
+        if (type == AV1_OBU_SEQUENCE_HEADER && payloadOffset < obuSize) {
+            thread_local std::vector<unsigned char> config;
+            if (buildAv1Config(
+                    obu, headerSize, obu + payloadOffset, obuSize - payloadOffset, config
+                )) {
+                sendConfigNals(config.data(), config.size(), ALVR_CODEC_AV1);
+            } else {
+                Warn("Failed to parse the AV1 sequence header\n");
+            }
+        }
+        if (type != AV1_OBU_TEMPORAL_DELIMITER && type != AV1_OBU_PADDING) {
+            if (out != obu) {
+                memmove(out, obu, obuSize);
+            }
+            out += obuSize;
+        }
+
+        pos += obuSize;
+    }
+    len = out - buf;
+}
+
+/*
+Sends the (VPS + )SPS + PPS video configuration headers from H.264 or H.265 stream as a sequence of
+NALs, after dropping a leading AUD. (VPS + )SPS + PPS have short size (8bytes + 28bytes in some
+environment), so we can assume SPS + PPS is contained in first fragment.
+*/
+void processConfigNals(int codec, unsigned char*& buf, int& len) {
+    // Every frame comes through here before it is sent
+    StartupTimelineFinish();
+    if (codec == ALVR_CODEC_AV1) {
+        processAv1Obus(buf, len);
+        return;
+    }
+
+    const bool h264 = codec == ALVR_CODEC_H264;
+    const unsigned char audType = h264 ? H264_NAL_TYPE_AUD : HEVC_NAL_TYPE_AUD;
+    const unsigned char configType = h264 ? H264_NAL_TYPE_SPS : HEVC_NAL_TYPE_VPS;
+    const size_t configCount = h264 ? 2 : 3;
 
-    if (nalType == H264_NAL_TYPE_AUD && len > prefixSize * 2 + 2) {
-        buf += prefixSize + 2;
-        len -= prefixSize + 2;
-        prefixSize = getNalPrefixSize(buf);
-        nalType = buf[prefixSize] & 0x1F;
+    // Only the leading NALs are needed: an AUD, the config NALs and the start of the next one
+    thread_local std::vector<NalUnit> nals;
+    IndexNals(codec, buf, len, nals, configCount + 2);
+
+    size_t first = 0;
+    int skipped = 0;
+    if (nals.size() > 1 && nals[0].offset == 0 && nals[0].type == audType) {
+        skipped = nals[0].size;
+        buf += skipped;
+        len -= skipped;
+        first = 1;
     }
-    if (nalType == H264_NAL_TYPE_SPS) {
-        sendHeaders(ALVR_CODEC_H264, buf, len, 2); // 2 headers SPS and PPS
+
+    if (nals.size() > first + configCount && nals[first].type == configType) {
+        int headersLen = nals[first + configCount].offset - skipped;
+        sendConfigNals(buf, headersLen, codec);
+
+        // move the cursor forward excluding config NALs
+        buf += headersLen;
+        len -= headersLen;
     }
 }
 
-void processHevcNals(unsigned char*& buf, int& len) {
-    unsigned char prefixSize = getNalPrefixSize(buf);
-    unsigned char nalType = (buf[prefixSize] >> 1) & 0x3F;
+/*
+Returns the temporal ID of a frame without its configuration NALs: the one of the SVC prefix NAL of
+its first H.264 slice, of the NAL header of its first HEVC slice or of the OBU extension of its AV1
+frame header. Without temporal layers the frame is not parsed and the ID is 0.
+*/
+static unsigned int frameTemporalLayer(int codec, const unsigned char* buf, int len) {
+    if (Settings_Instance()->m_temporalLayers <= 1) {
+        return 0;
+    }
 
-    if (nalType == HEVC_NAL_TYPE_AUD && len > prefixSize * 2 + 3) {
-        buf += prefixSize + 3;
-        len -= prefixSize + 3;
-        prefixSize = getNalPrefixSize(buf);
-        nalType = (buf[prefixSize] >> 1) & 0x3F;
+    if (codec == ALVR_CODEC_AV1) {
+        int pos = 0;
+        while (pos + 1 < len) {
+            const unsigned char* obu = buf + pos;
+            unsigned char type = (obu[0] >> 3) & 0xF;
+            bool hasExtension = obu[0] & 0x04;
+            if (type == AV1_OBU_FRAME_HEADER || type == AV1_OBU_FRAME) {
+                return hasExtension ? obu[1] >> 5 : 0;
+            }
+
+            // Without a size field the OBU extends to the end of the temporal unit
+            int headerSize = hasExtension ? 2 : 1;
+            uint64_t payloadSize;
+            int lebSize = (obu[0] & 0x02)
+                ? readLeb128(obu + headerSize, len - pos - headerSize, payloadSize)
+                : 0;
+            if (lebSize == 0 || payloadSize > uint64_t(len - pos - headerSize - lebSize)) {
+                return 0;
+            }
+            pos += headerSize + lebSize + int(payloadSize);
+        }
+        return 0;
     }
-    if (nalType == HEVC_NAL_TYPE_VPS) {
-        sendHeaders(ALVR_CODEC_HEVC, buf, len, 3); // 3 headers VPS, SPS and PPS
+
+    // Only SEI NALs can come before the first slice or its prefix NAL
+    thread_local std::vector<NalUnit> nals;
+    IndexNals(codec, buf, len, nals, 8);
+    for (const NalUnit& nal : nals) {
+        const unsigned char* header = buf + nal.offset + nal.prefixSize;
+        int headerLen = nal.size - nal.prefixSize;
+        if (codec == ALVR_CODEC_H264 && nal.type == H264_NAL_TYPE_PREFIX && headerLen >= 4) {
+            // temporal_id of nal_unit_header_svc_extension
+            return header[3] >> 5;
+        }
+        if (codec == ALVR_CODEC_HEVC && nal.type < HEVC_NAL_TYPE_VPS && headerLen >= 2) {
+            // nuh_temporal_id_plus1
+            return std::max(header[1] & 0x7, 1) - 1;
+        }
     }
+    return 0;
 }
 
 void ParseFrameNals(
     int codec, unsigned char* buf, int len, unsigned long long targetTimestampNs, bool isIdr
 ) {
-    static bool av1GotFrame = false;
+    ALVR_PROFILE_ZONE("ParseFrameNals");
+    if (len < MIN_NAL_SIZE) {
+        return;
+    }
 
-    if ((unsigned)len < sizeof(NAL_PREFIX_4B)) {
+    processConfigNals(codec, buf, len);
+    if (len <= 0) {
         return;
     }
 
-    if (codec == ALVR_CODEC_H264) {
-        processH264Nals(buf, len);
-    } else if (codec == ALVR_CODEC_HEVC) {
-        processHevcNals(buf, len);
-    } else if (codec == ALVR_CODEC_AV1 && !av1GotFrame) {
-        av1GotFrame = true;
-        SetVideoConfigNals(0, 0, codec);
+    if (VideoSinkFn sink = videoSink) {
+        sink(targetTimestampNs, len, isIdr, true);
+        return;
     }
+    VideoSend(targetTimestampNs, buf, len, isIdr, frameTemporalLayer(codec, buf, len));
+}
+
+namespace {
+// Encoder memory lent to the Rust side, referenced by its handle
+struct LentVideoBuffer {
+    ReleaseVideoBufferFn release;
+    void* userData;
+    std::atomic<bool> inUse = false;
+};
 
-    VideoSend(targetTimestampNs, buf, len, isIdr);
+// Enough for the frames in flight of any encoder, past that the buffers are allocated
+const size_t LENT_BUFFER_POOL_SIZE = 64;
+LentVideoBuffer lentBufferPool[LENT_BUFFER_POOL_SIZE];
+std::atomic<size_t> lentBufferNext = 0;
+
+LentVideoBuffer* takeLentBuffer(ReleaseVideoBufferFn release, void* userData) {
+    size_t start = lentBufferNext.fetch_add(1, std::memory_order_relaxed);
+    for (size_t i = 0; i < LENT_BUFFER_POOL_SIZE; i++) {
+        LentVideoBuffer& buffer = lentBufferPool[(start + i) % LENT_BUFFER_POOL_SIZE];
+        if (!buffer.inUse.exchange(true, std::memory_order_acquire)) {
+            buffer.release = release;
+            buffer.userData = userData;
+            return &buffer;
+        }
+    }
+    LentVideoBuffer* buffer = new LentVideoBuffer;
+    buffer->release = release;
+    buffer->userData = userData;
+    return buffer;
+}
+
+bool isPooled(const LentVideoBuffer* buffer) {
+    return buffer >= lentBufferPool && buffer < lentBufferPool + LENT_BUFFER_POOL_SIZE;
+}
+}
+
+extern "C" void ReleaseVideoBuffer(unsigned long long handle) {
+    LentVideoBuffer* buffer = reinterpret_cast<LentVideoBuffer*>(handle);
+    buffer->release(buffer->userData);
+    if (isPooled(buffer)) {
+        buffer->inUse.store(false, std::memory_order_release);
+    } else {
+        delete buffer;
+    }
+}
+
+void ParseFrameLentNals(
+    int codec,
+    unsigned char* buf,
+    int len,
+    unsigned long long targetTimestampNs,
+    bool isIdr,
+    ReleaseVideoBufferFn release,
+    void* userData
+) {
+    ALVR_PROFILE_ZONE("ParseFrameLentNals");
+    if (len < MIN_NAL_SIZE) {
+        release(userData);
+        return;
+    }
+
+    processConfigNals(codec, buf, len);
+    if (len <= 0) {
+        release(userData);
+        return;
+    }
+
+    if (VideoSinkFn sink = videoSink) {
+        sink(targetTimestampNs, len, isIdr, true);
+        release(userData);
+        return;
+    }
+
+    unsigned int temporalLayer = frameTemporalLayer(codec, buf, len);
+    auto handle = reinterpret_cast<unsigned long long>(takeLentBuffer(release, userData));
+    VideoSendLent(targetTimestampNs, buf, len, isIdr, temporalLayer, handle);
+}
+
+void ParseFrameSliceNals(
+    int codec,
+    unsigned char* buf,
+    int len,
+    unsigned long long targetTimestampNs,
+    bool isIdr,
+    bool firstSlice,
+    bool lastSlice
+) {
+    ALVR_PROFILE_ZONE("ParseFrameSliceNals");
+    if (len < MIN_NAL_SIZE) {
+        // An empty last slice still completes the slices sent before it
+        if (firstSlice || !lastSlice) {
+            return;
+        }
+    } else if (firstSlice) {
+        processConfigNals(codec, buf, len);
+    }
+
+    if (VideoSinkFn sink = videoSink) {
+        sink(targetTimestampNs, std::max(len, 0), isIdr, lastSlice);
+        return;
+    }
+    // All the slices of a frame have the same temporal ID, an empty last slice keeps the one of the
+    // slices before it. Every H.264 slice has its prefix NAL.
+    thread_local unsigned int temporalLayer = 0;
+    if (len >= MIN_NAL_SIZE) {
+        temporalLayer = frameTemporalLayer(codec, buf, len);
+    }
+    VideoSendSlice(targetTimestampNs, buf, len, isIdr, temporalLayer, firstSlice, lastSlice);
 }
@@ -0,0 +1,236 @@
+#include "NumaPlacement.h"
+
+#include "Logger.h"
+#include "Settings.h"
+#include <algorithm>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#elif defined(__linux__)
+#include <fstream>
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+#ifdef __linux__
+
+// A sysfs list like "0-15,32-47"
+std::vector<int> readCpuList(const std::string& path) {
+    std::vector<int> cpus;
+    std::ifstream file(path);
+    std::string list;
+    if (!std::getline(file, list)) {
+        return cpus;
+    }
+    size_t pos = 0;
+    while (pos < list.size()) {
+        size_t end = std::min(list.find(',', pos), list.size());
+        std::string range = list.substr(pos, end - pos);
+        size_t dash = range.find('-');
+        try {
+            int first = std::stoi(range.substr(0, dash));
+            int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+            for (int cpu = first; cpu <= last; cpu++) {
+                cpus.push_back(cpu);
+            }
+        } catch (const std::exception&) {
+            // Empty list
+        }
+        pos = end + 1;
+    }
+    return cpus;
+}
+
+std::vector<int> nodeCpus(int node) {
+    return readCpuList("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+}
+
+int detectNode() {
+    std::vector<int> nodes = readCpuList("/sys/devices/system/node/online");
+    std::vector<int> cpus = readCpuList("/sys/devices/system/cpu/online");
+    if (nodes.size() < 2 || cpus.empty()) {
+        return -1;
+    }
+    for (int node : nodes) {
+        for (int cpu : nodeCpus(node)) {
+            if (cpu == cpus.back()) {
+                return node;
+            }
+        }
+    }
+    return -1;
+}
+
+#elif defined(_WIN32)
+
+int detectNode() {
+    ULONG highest = 0;
+    if (!GetNumaHighestNodeNumber(&highest) || highest == 0) {
+        return -1;
+    }
+    // The reserved cores are counted in the first processor group
+    DWORD count = GetActiveProcessorCount(0);
+    if (count == 0) {
+        return -1;
+    }
+    PROCESSOR_NUMBER processor = {};
+    processor.Number = (BYTE)(count - 1);
+    USHORT node = 0;
+    if (!GetNumaProcessorNodeEx(&processor, &node)) {
+        return -1;
+    }
+    return node;
+}
+
+// Keeps the lowest logical processor of each physical core in the mask of affinity
+void keepPhysicalCores(GROUP_AFFINITY& affinity) {
+    DWORD length = 0;
+    GetLogicalProcessorInformationEx(RelationProcessorCore, nullptr, &length);
+    std::vector<uint8_t> buffer(length);
+    if (length == 0
+        || !GetLogicalProcessorInformationEx(
+            RelationProcessorCore, (SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX*)buffer.data(), &length
+        )) {
+        return;
+    }
+    KAFFINITY mask = 0;
+    DWORD offset = 0;
+    while (offset < length) {
+        auto* entry = (SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX*)(buffer.data() + offset);
+        const GROUP_AFFINITY& core = entry->Processor.GroupMask[0];
+        KAFFINITY threads = core.Mask & affinity.Mask;
+        if (core.Group == affinity.Group && threads != 0) {
+            mask |= threads & (~threads + 1);
+        }
+        offset += entry->Size;
+    }
+    if (mask != 0) {
+        affinity.Mask = mask;
+    }
+}
+
+#endif
+
+}
+
+int SoftwareEncoderNumaNode() {
+    static const int node = [] {
+        if (!Settings_Instance()->m_swNumaPlacement) {
+            return -1;
+        }
+#if defined(__linux__) || defined(_WIN32)
+        int node = detectNode();
+#else
+        int node = -1;
+#endif
+        if (node >= 0) {
+            Info("The software encoder runs on NUMA node %d\n", node);
+        }
+        return node;
+    }();
+    return node;
+}
+
+bool PinThreadToNumaNode(int node) {
+    if (node < 0) {
+        return false;
+    }
+#ifdef __linux__
+    // The first logical core of each physical core
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    bool empty = true;
+    for (int cpu : nodeCpus(node)) {
+        std::vector<int> siblings = readCpuList(
+            "/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/thread_siblings_list"
+        );
+        if ((siblings.empty() || siblings[0] == cpu) && cpu < CPU_SETSIZE) {
+            CPU_SET(cpu, &set);
+            empty = false;
+        }
+    }
+    return !empty && pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#elif defined(_WIN32)
+    GROUP_AFFINITY affinity = {};
+    if (!GetNumaNodeProcessorMaskEx((USHORT)node, &affinity) || affinity.Mask == 0) {
+        return false;
+    }
+    keepPhysicalCores(affinity);
+    return SetThreadGroupAffinity(GetCurrentThread(), &affinity, nullptr) != 0;
+#else
+    return false;
+#endif
+}
+
+void RunOnNumaNode(int node, const std::function<void()>& body) {
+    if (node < 0) {
+        body();
+        return;
+    }
+
+#ifdef __linux__
+    cpu_set_t previous;
+    bool saved = pthread_getaffinity_np(pthread_self(), sizeof(previous), &previous) == 0;
+    auto restore = [&] { pthread_setaffinity_np(pthread_self(), sizeof(previous), &previous); };
+#elif defined(_WIN32)
+    GROUP_AFFINITY previous = {};
+    bool saved = GetThreadGroupAffinity(GetCurrentThread(), &previous) != 0;
+    auto restore = [&] { SetThreadGroupAffinity(GetCurrentThread(), &previous, nullptr); };
+#else
+    bool saved = false;
+    auto restore = [] { };
+#endif
+    if (!saved || !PinThreadToNumaNode(node)) {
+        Warn("Failed to pin the software encoder to NUMA node %d\n", node);
+        body();
+        return;
+    }
+
+    try {
+        body();
+    } catch (...) {
+        restore();
+        throw;
+    }
+    restore();
+}
+
+bool BindMemoryToNumaNode(void* data, size_t size, int node) {
+#ifdef __linux__
+    // One bit for each of the 1024 nodes the kernel supports at most
+    unsigned long mask[16] = {};
+    const int bits = sizeof(unsigned long) * 8;
+    if (node < 0 || node >= (int)sizeof(mask) * 8 || size == 0) {
+        return false;
+    }
+    mask[node / bits] |= 1UL << (node % bits);
+
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t begin = (uintptr_t)data & ~(page - 1);
+    uintptr_t end = ((uintptr_t)data + size + page - 1) & ~(page - 1);
+    // Preferred rather than bound, so that the allocations still succeed if the node is full
+    return syscall(
+               SYS_mbind,
+               begin,
+               end - begin,
+               MPOL_PREFERRED,
+               mask,
+               sizeof(mask) * 8 + 1,
+               MPOL_MF_MOVE
+           )
+        == 0;
+#else
+    (void)data;
+    (void)size;
+    (void)node;
+    return false;
+#endif
+}
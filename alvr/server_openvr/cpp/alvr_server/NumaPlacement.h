@@ -0,0 +1,25 @@
+#pragma once
+
+#include <functional>
+#include <stddef.h>
+
+// Placement of the software encoders on a single NUMA node, so that on machines with several the
+// encoder threads don't read the frames across the interconnect. The node is the one of the last
+// logical core, which is where ApplyStreamingThreadScheduling reserves cores for the threads that
+// compose the frames.
+
+// The node the software encoders run on. -1 if the machine has a single node, if the topology
+// can't be read or if the placement is disabled in the settings. Logged once.
+int SoftwareEncoderNumaNode();
+
+// Pins the calling thread to one logical core of each physical core of node, so that the encoder
+// threads don't share the cores with their hyperthreads. False if it can't be pinned.
+bool PinThreadToNumaNode(int node);
+
+// Runs body with the calling thread pinned to node, then restores the affinity it had. On Linux
+// the threads created by body keep the pinning, like the thread pools of the encoders.
+void RunOnNumaNode(int node, const std::function<void()>& body);
+
+// Moves the pages of the range to node, and places the ones not touched yet there when they are.
+// False if they can't be bound, like the mapped memory of a device. Linux only.
+bool BindMemoryToNumaNode(void* data, size_t size, int node);
@@ -0,0 +1,317 @@
+#include "NvEncConfig.h"
+
+#include "ALVR-common/packet_types.h"
+#include "EncoderControl.h"
+#include "Logger.h"
+#include "bindings.h"
+
+GUID NvEncCodecGuid(int codec) {
+    switch (codec) {
+    case ALVR_CODEC_H264:
+        return NV_ENC_CODEC_H264_GUID;
+    case ALVR_CODEC_HEVC:
+        return NV_ENC_CODEC_HEVC_GUID;
+    case ALVR_CODEC_AV1:
+        return NV_ENC_CODEC_AV1_GUID;
+    }
+    return NV_ENC_CODEC_H264_GUID;
+}
+
+GUID NvEncPresetGuid() {
+    // See recommended NVENC settings for low-latency encoding.
+    // https://docs.nvidia.com/video-technologies/video-codec-sdk/nvenc-video-encoder-api-prog-guide/#recommended-nvenc-settings
+    switch (Settings_Instance()->m_nvencQualityPreset) {
+    case 7:
+        return NV_ENC_PRESET_P7_GUID;
+    case 6:
+        return NV_ENC_PRESET_P6_GUID;
+    case 5:
+        return NV_ENC_PRESET_P5_GUID;
+    case 4:
+        return NV_ENC_PRESET_P4_GUID;
+    case 3:
+        return NV_ENC_PRESET_P3_GUID;
+    case 2:
+        return NV_ENC_PRESET_P2_GUID;
+    case 1:
+    default:
+        return NV_ENC_PRESET_P1_GUID;
+    }
+}
+
+NV_ENC_TUNING_INFO NvEncTuningInfo() {
+    return static_cast<NV_ENC_TUNING_INFO>(Settings_Instance()->m_nvencTuningPreset);
+}
+
+FfiFrameType NvEncFrameType(NV_ENC_PIC_TYPE pictureType) {
+    switch (pictureType) {
+    case NV_ENC_PIC_TYPE_IDR:
+        return FRAME_TYPE_IDR;
+    case NV_ENC_PIC_TYPE_I:
+    case NV_ENC_PIC_TYPE_INTRA_REFRESH:
+        return FRAME_TYPE_INTRA;
+    case NV_ENC_PIC_TYPE_P:
+    case NV_ENC_PIC_TYPE_NONREF_P:
+    case NV_ENC_PIC_TYPE_SKIPPED:
+        return FRAME_TYPE_PREDICTED;
+    case NV_ENC_PIC_TYPE_B:
+    case NV_ENC_PIC_TYPE_BI:
+        return FRAME_TYPE_BIDIRECTIONAL;
+    default:
+        return FRAME_TYPE_UNKNOWN;
+    }
+}
+
+void FillNvEncConfig(NV_ENC_INITIALIZE_PARAMS& initializeParams, const NvEncConfigParams& params) {
+    auto& encodeConfig = *initializeParams.encodeConfig;
+
+    // The slices are polled, in async mode the completion event wakes the poll at the end of the
+    // frame
+    if (params.subFrameReadback) {
+        initializeParams.enableSubFrameWrite = 1;
+    }
+
+    initializeParams.encodeWidth = initializeParams.darWidth = params.width;
+    initializeParams.encodeHeight = initializeParams.darHeight = params.height;
+    initializeParams.frameRateNum = params.framerate;
+    initializeParams.frameRateDen = 1;
+
+    if (Settings_Instance()->m_nvencRefreshRate != -1) {
+        initializeParams.frameRateNum = Settings_Instance()->m_nvencRefreshRate;
+    }
+
+    initializeParams.enableWeightedPrediction
+        = Settings_Instance()->m_nvencEnableWeightedPrediction;
+
+    if (params.motionHints) {
+        initializeParams.enableExternalMEHints = 1;
+        initializeParams.maxMEHintCountsPerBlock[0].numCandsPerBlk16x16 = 1;
+    }
+
+    // Frames split over the NVENC engines, H.264 is never split. The field is new in API 12.1.
+#if NVENCAPI_MAJOR_VERSION > 12 || (NVENCAPI_MAJOR_VERSION == 12 && NVENCAPI_MINOR_VERSION >= 1)
+    if (params.codec != ALVR_CODEC_H264) {
+        initializeParams.splitEncodeMode = Settings_Instance()->m_nvencSplitEncodeMode;
+    }
+#endif
+
+    // 16 is recommended when using reference frame invalidation. But it has caused bad visual
+    // quality. Now, use 0 (use default).
+    uint32_t maxNumRefFrames = 0;
+    uint32_t gopLength = NVENC_INFINITE_GOPLENGTH;
+
+    if (Settings_Instance()->m_nvencMaxNumRefFrames != -1) {
+        maxNumRefFrames = Settings_Instance()->m_nvencMaxNumRefFrames;
+    }
+    if (Settings_Instance()->m_nvencGopLength != -1) {
+        gopLength = Settings_Instance()->m_nvencGopLength;
+    }
+
+    switch (params.codec) {
+    case ALVR_CODEC_H264: {
+        auto& config = encodeConfig.encodeCodecConfig.h264Config;
+        config.repeatSPSPPS = 1;
+        config.enableIntraRefresh = Settings_Instance()->m_nvencEnableIntraRefresh;
+
+        if (Settings_Instance()->m_nvencIntraRefreshPeriod != -1) {
+            config.intraRefreshPeriod = Settings_Instance()->m_nvencIntraRefreshPeriod;
+        }
+        if (Settings_Instance()->m_nvencIntraRefreshCount != -1) {
+            config.intraRefreshCnt = Settings_Instance()->m_nvencIntraRefreshCount;
+        }
+
+        switch (Settings_Instance()->m_entropyCoding) {
+        case ALVR_CABAC:
+            config.entropyCodingMode = NV_ENC_H264_ENTROPY_CODING_MODE_CABAC;
+            break;
+        case ALVR_CAVLC:
+            config.entropyCodingMode = NV_ENC_H264_ENTROPY_CODING_MODE_CAVLC;
+            break;
+        }
+
+        config.maxNumRefFrames = maxNumRefFrames;
+        config.idrPeriod = gopLength;
+
+        // Hierarchical P frames, the prefix NAL of each slice has the temporal ID of the frame
+        if (params.temporalLayers > 1) {
+            config.enableTemporalSVC = 1;
+            config.numTemporalLayers = params.temporalLayers;
+            config.maxTemporalLayers = params.temporalLayers;
+        }
+
+        if (Settings_Instance()->m_slicesPerFrame > 1) {
+            config.sliceMode = 3;
+            config.sliceModeData = Settings_Instance()->m_slicesPerFrame;
+        }
+
+        if (Settings_Instance()->m_fillerData) {
+            config.enableFillerDataInsertion = Settings_Instance()->m_rateControlMode == ALVR_CBR;
+        }
+
+        config.h264VUIParameters.videoSignalTypePresentFlag = 1;
+        config.h264VUIParameters.videoFormat = NV_ENC_VUI_VIDEO_FORMAT_UNSPECIFIED;
+        config.h264VUIParameters.videoFullRangeFlag = 1;
+        config.h264VUIParameters.colourDescriptionPresentFlag = 1;
+        if (Settings_Instance()->m_enableHdr) {
+            config.h264VUIParameters.colourPrimaries = NV_ENC_VUI_COLOR_PRIMARIES_BT2020;
+            config.h264VUIParameters.transferCharacteristics
+                = NV_ENC_VUI_TRANSFER_CHARACTERISTIC_SRGB;
+            config.h264VUIParameters.colourMatrix = NV_ENC_VUI_MATRIX_COEFFS_BT2020_NCL;
+        } else {
+            config.h264VUIParameters.colourPrimaries = NV_ENC_VUI_COLOR_PRIMARIES_BT709;
+            config.h264VUIParameters.transferCharacteristics
+                = NV_ENC_VUI_TRANSFER_CHARACTERISTIC_SRGB;
+            config.h264VUIParameters.colourMatrix = NV_ENC_VUI_MATRIX_COEFFS_BT709;
+        }
+    } break;
+    case ALVR_CODEC_HEVC: {
+        auto& config = encodeConfig.encodeCodecConfig.hevcConfig;
+        config.repeatSPSPPS = 1;
+        config.enableIntraRefresh = Settings_Instance()->m_nvencEnableIntraRefresh;
+
+        if (Settings_Instance()->m_nvencIntraRefreshPeriod != -1) {
+            config.intraRefreshPeriod = Settings_Instance()->m_nvencIntraRefreshPeriod;
+        }
+        if (Settings_Instance()->m_nvencIntraRefreshCount != -1) {
+            config.intraRefreshCnt = Settings_Instance()->m_nvencIntraRefreshCount;
+        }
+
+        config.maxNumRefFramesInDPB = maxNumRefFrames;
+        config.idrPeriod = gopLength;
+
+        if (Settings_Instance()->m_slicesPerFrame > 1) {
+            config.sliceMode = 3;
+            config.sliceModeData = Settings_Instance()->m_slicesPerFrame;
+        }
+        // The size of the QP delta map blocks
+        if (params.qpMap) {
+            config.maxCUSize = NV_ENC_HEVC_CUSIZE_32x32;
+        }
+
+        if (Settings_Instance()->m_use10bitEncoder) {
+            encodeConfig.encodeCodecConfig.hevcConfig.pixelBitDepthMinus8 = 2;
+        }
+
+        if (Settings_Instance()->m_fillerData) {
+            config.enableFillerDataInsertion = Settings_Instance()->m_rateControlMode == ALVR_CBR;
+        }
+
+        config.hevcVUIParameters.videoSignalTypePresentFlag = 1;
+        config.hevcVUIParameters.videoFormat = NV_ENC_VUI_VIDEO_FORMAT_UNSPECIFIED;
+        config.hevcVUIParameters.videoFullRangeFlag = 1;
+        config.hevcVUIParameters.colourDescriptionPresentFlag = 1;
+        if (Settings_Instance()->m_enableHdr) {
+            config.hevcVUIParameters.colourPrimaries = NV_ENC_VUI_COLOR_PRIMARIES_BT2020;
+            config.hevcVUIParameters.transferCharacteristics
+                = NV_ENC_VUI_TRANSFER_CHARACTERISTIC_SRGB;
+            config.hevcVUIParameters.colourMatrix = NV_ENC_VUI_MATRIX_COEFFS_BT2020_NCL;
+        } else {
+            config.hevcVUIParameters.colourPrimaries = NV_ENC_VUI_COLOR_PRIMARIES_BT709;
+            config.hevcVUIParameters.transferCharacteristics
+                = NV_ENC_VUI_TRANSFER_CHARACTERISTIC_SRGB;
+            config.hevcVUIParameters.colourMatrix = NV_ENC_VUI_MATRIX_COEFFS_BT709;
+        }
+    } break;
+    case ALVR_CODEC_AV1: {
+        auto& config = encodeConfig.encodeCodecConfig.av1Config;
+        config.repeatSeqHdr = 1;
+        config.enableIntraRefresh = Settings_Instance()->m_nvencEnableIntraRefresh;
+
+        if (Settings_Instance()->m_nvencIntraRefreshPeriod != -1) {
+            config.intraRefreshPeriod = Settings_Instance()->m_nvencIntraRefreshPeriod;
+        }
+        if (Settings_Instance()->m_nvencIntraRefreshCount != -1) {
+            config.intraRefreshCnt = Settings_Instance()->m_nvencIntraRefreshCount;
+        }
+
+        config.maxNumRefFramesInDPB = maxNumRefFrames;
+        config.idrPeriod = gopLength;
+
+        // Uniform tiles, NVENC rounds the counts down to powers of 2. NVENC has no HEVC tiles.
+        config.numTileColumns = Settings_Instance()->m_tileColumns;
+        config.numTileRows = Settings_Instance()->m_tileRows;
+
+        if (Settings_Instance()->m_use10bitEncoder) {
+            config.pixelBitDepthMinus8 = 2;
+        }
+
+        if (Settings_Instance()->m_fillerData) {
+            config.enableBitstreamPadding = Settings_Instance()->m_rateControlMode == ALVR_CBR;
+        }
+
+        config.chromaFormatIDC = 1; // 4:2:0, 4:4:4 currently not supported
+        config.colorRange = 1;
+        if (Settings_Instance()->m_enableHdr) {
+            config.colorPrimaries = NV_ENC_VUI_COLOR_PRIMARIES_BT2020;
+            config.transferCharacteristics = NV_ENC_VUI_TRANSFER_CHARACTERISTIC_SRGB;
+            config.matrixCoefficients = NV_ENC_VUI_MATRIX_COEFFS_BT2020_NCL;
+        } else {
+            config.colorPrimaries = NV_ENC_VUI_COLOR_PRIMARIES_BT709;
+            config.transferCharacteristics = NV_ENC_VUI_TRANSFER_CHARACTERISTIC_SRGB;
+            config.matrixCoefficients = NV_ENC_VUI_MATRIX_COEFFS_BT709;
+        }
+    } break;
+    }
+
+    // Disable automatic IDR insertion by NVENC. We need to manually insert IDR when packet is
+    // dropped if don't use reference frame invalidation.
+    encodeConfig.gopLength = gopLength;
+    encodeConfig.frameIntervalP = 1;
+
+    if (Settings_Instance()->m_nvencPFrameStrategy != -1) {
+        encodeConfig.frameIntervalP = Settings_Instance()->m_nvencPFrameStrategy;
+    }
+
+    switch (Settings_Instance()->m_rateControlMode) {
+    case ALVR_CBR:
+        encodeConfig.rcParams.rateControlMode = NV_ENC_PARAMS_RC_CBR;
+        break;
+    case ALVR_VBR:
+        encodeConfig.rcParams.rateControlMode = NV_ENC_PARAMS_RC_VBR;
+        break;
+    }
+    encodeConfig.rcParams.multiPass
+        = static_cast<NV_ENC_MULTI_PASS>(Settings_Instance()->m_nvencMultiPass);
+    encodeConfig.rcParams.lowDelayKeyFrameScale = 1;
+
+    if (Settings_Instance()->m_nvencLowDelayKeyFrameScale != -1) {
+        encodeConfig.rcParams.lowDelayKeyFrameScale
+            = Settings_Instance()->m_nvencLowDelayKeyFrameScale;
+    }
+
+    uint32_t maxFrameSize = static_cast<uint32_t>(params.bitrateBps / params.framerate);
+    Debug("NVENC: maxFrameSize=%d bits", maxFrameSize);
+    // This API version has no explicit frame size limit, a smaller VBV buffer keeps the IDR frames
+    // within the cap
+    uint32_t vbvSize = (uint32_t)CapToMaxFrameSize(params.maxFrameBytes, maxFrameSize * 1.1);
+    encodeConfig.rcParams.vbvBufferSize = vbvSize;
+    encodeConfig.rcParams.vbvInitialDelay = vbvSize;
+    encodeConfig.rcParams.maxBitRate = static_cast<uint32_t>(params.bitrateBps);
+    encodeConfig.rcParams.averageBitRate = static_cast<uint32_t>(params.bitrateBps);
+    if (Settings_Instance()->m_nvencAdaptiveQuantizationMode == SpatialAQ) {
+        encodeConfig.rcParams.enableAQ = 1;
+    } else if (Settings_Instance()->m_nvencAdaptiveQuantizationMode == TemporalAQ) {
+        encodeConfig.rcParams.enableTemporalAQ = 1;
+    }
+    // Added to the QP chosen by rate control
+    if (params.qpMap) {
+        encodeConfig.rcParams.qpMapMode = NV_ENC_QP_MAP_DELTA;
+    }
+
+    if (Settings_Instance()->m_nvencRateControlMode != -1) {
+        encodeConfig.rcParams.rateControlMode
+            = (NV_ENC_PARAMS_RC_MODE)Settings_Instance()->m_nvencRateControlMode;
+    }
+    if (Settings_Instance()->m_nvencRcBufferSize != -1) {
+        encodeConfig.rcParams.vbvBufferSize = Settings_Instance()->m_nvencRcBufferSize;
+    }
+    if (Settings_Instance()->m_nvencRcInitialDelay != -1) {
+        encodeConfig.rcParams.vbvInitialDelay = Settings_Instance()->m_nvencRcInitialDelay;
+    }
+    if (Settings_Instance()->m_nvencRcMaxBitrate != -1) {
+        encodeConfig.rcParams.maxBitRate = Settings_Instance()->m_nvencRcMaxBitrate;
+    }
+    if (Settings_Instance()->m_nvencRcAverageBitrate != -1) {
+        encodeConfig.rcParams.averageBitRate = Settings_Instance()->m_nvencRcAverageBitrate;
+    }
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "bindings.h"
+#include "nvEncodeAPI.h"
+#include <stdint.h>
+
+// Values of Settings::m_nvencAdaptiveQuantizationMode
+enum AdaptiveQuantizationMode { SpatialAQ = 1, TemporalAQ = 2 };
+
+// State of an NVENC encoder that its configuration depends on, besides the settings
+struct NvEncConfigParams {
+    int codec;
+    int framerate;
+    int width;
+    int height;
+    uint64_t bitrateBps;
+    uint64_t maxFrameBytes;
+    // Slices are read back while the frame is encoded, which needs synchronous encoding
+    bool subFrameReadback;
+    bool motionHints;
+    bool qpMap;
+    // Temporal SVC layers of H.264, limited to what the GPU supports. 0 or 1 disables them.
+    int temporalLayers;
+};
+
+GUID NvEncCodecGuid(int codec);
+// Preset of Settings::m_nvencQualityPreset
+GUID NvEncPresetGuid();
+NV_ENC_TUNING_INFO NvEncTuningInfo();
+// Type of the pictureType of a locked bitstream
+FfiFrameType NvEncFrameType(NV_ENC_PIC_TYPE pictureType);
+
+// Applies the settings to parameters filled by NvEncoder::CreateDefaultEncoderParams with
+// NvEncCodecGuid, NvEncPresetGuid and NvEncTuningInfo. Used by the NVENC encoders of all platforms.
+void FillNvEncConfig(NV_ENC_INITIALIZE_PARAMS& initializeParams, const NvEncConfigParams& params);
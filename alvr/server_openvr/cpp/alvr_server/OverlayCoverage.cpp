@@ -0,0 +1,39 @@
+#include "OverlayCoverage.h"
+
+#include <mutex>
+
+namespace {
+
+std::mutex g_mutex;
+std::vector<uint8_t> g_cells;
+uint32_t g_width = 0;
+uint32_t g_height = 0;
+// 0 before the first coverage, which readers start from
+uint64_t g_version = 0;
+
+} // namespace
+
+void SetOverlayCoverage(const uint8_t* cells, uint32_t width, uint32_t height) {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    if (width == 0 && g_width == 0) {
+        return;
+    }
+    g_width = width;
+    g_height = width > 0 ? height : 0;
+    g_cells.assign(cells, cells + g_width * g_height);
+    g_version++;
+}
+
+bool GetOverlayCoverage(
+    uint64_t& version, std::vector<uint8_t>& cells, uint32_t& width, uint32_t& height
+) {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    if (version == g_version) {
+        return false;
+    }
+    version = g_version;
+    cells = g_cells;
+    width = g_width;
+    height = g_height;
+    return true;
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+// The parts of the frame that overlay layers cover, like the SteamVR dashboard or a desktop window,
+// so that the encoders can spend more bits on their text. A grid of cells over the composition
+// frame at the render resolution, both eyes side by side, set by the compositor when the overlays
+// change and read by the QP maps of the encoders.
+
+// width x height cells in raster order, nonzero where an overlay shows. A width of 0 clears the
+// coverage.
+void SetOverlayCoverage(const uint8_t* cells, uint32_t width, uint32_t height);
+
+// Copies the coverage if it changed since version, which then takes the current one. False if it
+// didn't change.
+bool GetOverlayCoverage(
+    uint64_t& version, std::vector<uint8_t>& cells, uint32_t& width, uint32_t& height
+);
@@ -37,7 +37,6 @@ uint64_t RIGHT_SQUEEZE_VALUE_ID;
 std::set<uint64_t> BODY_IDS;
 std::map<uint64_t, ButtonInfo> LEFT_CONTROLLER_BUTTON_MAPPING;
 std::map<uint64_t, ButtonInfo> RIGHT_CONTROLLER_BUTTON_MAPPING;
-std::map<uint64_t, std::vector<uint64_t>> ALVR_TO_STEAMVR_PATH_IDS;
 
 void init_paths() {
     HEAD_ID = PathStringToHash("/user/head");
@@ -301,14 +300,4 @@ void init_paths() {
         { PathStringToHash("/user/hand/right/input/thumbrest/touch"),
           { { "/input/thumbrest/touch" }, ButtonType::Binary } }
     );
-
-    for (auto hand : { LEFT_CONTROLLER_BUTTON_MAPPING, RIGHT_CONTROLLER_BUTTON_MAPPING }) {
-        for (auto info : hand) {
-            std::vector<uint64_t> ids;
-            for (auto path : info.second.steamvr_paths) {
-                ids.push_back(PathStringToHash(path));
-            }
-            ALVR_TO_STEAMVR_PATH_IDS.insert({ info.first, ids });
-        }
-    }
 }
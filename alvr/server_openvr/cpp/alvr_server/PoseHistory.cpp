@@ -1,87 +1,348 @@
 #include "PoseHistory.h"
 #include "Logger.h"
+#include "PoseMath.h"
+#include "Profiling.h"
 #include "Utils.h"
-#include "include/openvr_math.h"
+#include <algorithm>
+#include <cmath>
 #include <mutex>
 #include <optional>
+#include <thread>
 
-void PoseHistory::OnPoseUpdated(uint64_t targetTimestampNs, FfiDeviceMotion motion) {
+#if defined(__SSE2__) || defined(_M_X64)
+#define POSE_HISTORY_SSE2
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#define POSE_HISTORY_NEON
+#include <arm_neon.h>
+#endif
+
+namespace {
+
+// Poses this close are the same pose, up to the rounding of the runtime
+const float EXACT_MATCH_DISTANCE = 1e-7f;
+
+// Velocities are not trusted to predict further than this
+const uint64_t MAX_EXTRAPOLATION_NS = 100'000'000;
+
+FfiQuat normalize(double x, double y, double z, double w) {
+    double norm = std::sqrt(x * x + y * y + z * z + w * w);
+    return { float(x / norm), float(y / norm), float(z / norm), float(w / norm) };
+}
+
+// Shortest path spherical interpolation
+FfiQuat slerp(const FfiQuat& a, const FfiQuat& b, double t) {
+    double dot = a.x * b.x + a.y * b.y + a.z * b.z + a.w * b.w;
+    double sign = dot < 0 ? -1 : 1;
+    dot *= sign;
+
+    double weightA = 1 - t;
+    double weightB = t;
+    // Close quaternions are linearly interpolated, where slerp is unstable
+    if (dot < 0.9995) {
+        double theta = std::acos(dot);
+        weightA = std::sin((1 - t) * theta) / std::sin(theta);
+        weightB = std::sin(t * theta) / std::sin(theta);
+    }
+    weightB *= sign;
+
+    return normalize(
+        weightA * a.x + weightB * b.x,
+        weightA * a.y + weightB * b.y,
+        weightA * a.z + weightB * b.z,
+        weightA * a.w + weightB * b.w
+    );
+}
+
+// Rotates q by the angular velocity, expressed in the tracking space, during dt seconds
+FfiQuat integrateAngularVelocity(const FfiQuat& q, const float velocity[3], double dt) {
+    double speed = std::sqrt(
+        velocity[0] * velocity[0] + velocity[1] * velocity[1] + velocity[2] * velocity[2]
+    );
+    if (speed * dt < 1e-9) {
+        return q;
+    }
+    double halfAngle = speed * dt / 2;
+    double s = std::sin(halfAngle) / speed;
+    double dx = velocity[0] * s, dy = velocity[1] * s, dz = velocity[2] * s;
+    double dw = std::cos(halfAngle);
+
+    // delta * q
+    return normalize(
+        dw * q.x + dx * q.w + dy * q.z - dz * q.y,
+        dw * q.y - dx * q.z + dy * q.w + dz * q.x,
+        dw * q.z + dx * q.y - dy * q.x + dz * q.w,
+        dw * q.w - dx * q.x - dy * q.y - dz * q.z
+    );
+}
+
+// Squared distance between the target rotation and the rotation in a slot of rotations, which holds
+// each of the 9 components in turn, stride floats apart
+float rotationDistance(const float* rotations, size_t stride, size_t slot, const float target[9]) {
+    float sum = 0;
+    for (int k = 0; k < 9; k++) {
+        float diff = rotations[k * stride + slot] - target[k];
+        sum += diff * diff;
+    }
+    return sum;
+}
+
+// Same as rotationDistance, for the 4 slots starting at slot
+void rotationDistances4(
+    const float* rotations, size_t stride, size_t slot, const float target[9], float distances[4]
+) {
+#if defined(POSE_HISTORY_SSE2)
+    __m128 sum = _mm_setzero_ps();
+    for (int k = 0; k < 9; k++) {
+        __m128 diff
+            = _mm_sub_ps(_mm_loadu_ps(&rotations[k * stride + slot]), _mm_set1_ps(target[k]));
+        sum = _mm_add_ps(sum, _mm_mul_ps(diff, diff));
+    }
+    _mm_storeu_ps(distances, sum);
+#elif defined(POSE_HISTORY_NEON)
+    float32x4_t sum = vdupq_n_f32(0);
+    for (int k = 0; k < 9; k++) {
+        float32x4_t diff
+            = vsubq_f32(vld1q_f32(&rotations[k * stride + slot]), vdupq_n_f32(target[k]));
+        sum = vfmaq_f32(sum, diff, diff);
+    }
+    vst1q_f32(distances, sum);
+#else
+    for (int lane = 0; lane < 4; lane++) {
+        distances[lane] = rotationDistance(rotations, stride, slot + lane, target);
+    }
+#endif
+}
+
+} // namespace
+
+template <typename Read> auto PoseHistory::readConsistent(Read read) const {
+    while (true) {
+        uint64_t sequence = m_sequence.load(std::memory_order_acquire);
+        if (sequence % 2 == 1) {
+            std::this_thread::yield();
+            continue;
+        }
+
+        // May see a partially written pose, in which case the result is discarded
+        auto result = read();
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (m_sequence.load(std::memory_order_relaxed) == sequence) {
+            return result;
+        }
+    }
+}
+
+uint32_t PoseHistory::OnPoseUpdated(uint64_t targetTimestampNs, FfiDeviceMotion motion) {
+    ALVR_PROFILE_ZONE("PoseHistory::OnPoseUpdated");
     // Put pose history buffer
     TrackingHistoryFrame history;
     history.targetTimestampNs = targetTimestampNs;
     history.motion = motion;
+    history.receivedNs = GetSteadyTimeNs();
 
-    HmdMatrix_QuatToMat(
-        motion.pose.orientation.w,
-        motion.pose.orientation.x,
-        motion.pose.orientation.y,
-        motion.pose.orientation.z,
-        &history.rotationMatrix
-    );
+    posemath::QuatsToMats(&motion.pose.orientation, 1, &history.rotationMatrix);
 
-    std::unique_lock<std::mutex> lock(m_mutex);
+    std::unique_lock<InstrumentedMutex> lock(m_writeMutex);
+    history.foveationCenter = m_foveationCenter;
     if (!m_transformIdentity) {
-        vr::HmdMatrix34_t rotation = vrmath::matMul33(m_transform, history.rotationMatrix);
-        history.rotationMatrix = rotation;
+        history.rotationMatrix = posemath::Mul33(m_transform, history.rotationMatrix);
     }
 
-    if (m_poseBuffer.size() == 0) {
-        m_poseBuffer.push_back(history);
-    } else {
-        if (m_poseBuffer.back().targetTimestampNs != targetTimestampNs) {
-            // New track info
-            m_poseBuffer.push_back(history);
-        }
+    if (m_count > 0 && m_poses[m_newest].targetTimestampNs == targetTimestampNs) {
+        return m_tags[m_newest];
+    }
+    uint32_t tag = m_count > 0 ? m_tags[m_newest] % POSE_TAG_COUNT + 1 : 1;
+
+    uint64_t sequence = m_sequence.load(std::memory_order_relaxed);
+    m_sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    // New track info, overwriting the oldest one once full
+    m_newest = (m_newest + 1) % CAPACITY;
+    if (m_count < CAPACITY) {
+        m_count++;
     }
-    // The value should match with the client's MAXIMUM_TRACKING_FRAMES in ovr_context.cpp
-    if (m_poseBuffer.size() > 120 * 3) {
-        m_poseBuffer.pop_front();
+    m_poses[m_newest] = history;
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            m_rotations[i * 3 + j][m_newest] = history.rotationMatrix.m[i][j];
+        }
     }
+    m_tags[m_newest] = tag;
+
+    m_sequence.store(sequence + 2, std::memory_order_release);
+
+    return tag;
 }
 
 std::optional<PoseHistory::TrackingHistoryFrame>
 PoseHistory::GetBestPoseMatch(const vr::HmdMatrix34_t& pose) const {
-    std::unique_lock<std::mutex> lock(m_mutex);
-    float minDiff = 100000;
-    auto minIt = m_poseBuffer.begin();
-    for (auto it = m_poseBuffer.begin(); it != m_poseBuffer.end(); ++it) {
-        float distance = 0;
-        // Rotation matrix composes a part of ViewMatrix of TrackingInfo.
-        // Be carefull of transpose.
-        // And bottom side and right side of matrix should not be compared, because pPose does not
-        // contain that part of matrix.
-        for (int i = 0; i < 3; i++) {
-            for (int j = 0; j < 3; j++) {
-                distance += pow(it->rotationMatrix.m[j][i] - pose.m[j][i], 2);
-            }
-        }
-        if (minDiff > distance) {
-            minIt = it;
-            minDiff = distance;
+    ALVR_PROFILE_ZONE("PoseHistory::GetBestPoseMatch");
+    // Rotation matrix composes a part of ViewMatrix of TrackingInfo.
+    // And bottom side and right side of matrix should not be compared, because pPose does not
+    // contain that part of matrix.
+    float target[9];
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            target[i * 3 + j] = pose.m[i][j];
         }
     }
-    if (minIt != m_poseBuffer.end()) {
-        return *minIt;
-    }
 
-    Debug("PoseHistory::GetBestPoseMatch: No pose matched.");
-    return {};
+    auto match = readConsistent([&]() -> std::optional<TrackingHistoryFrame> {
+        if (m_count == 0) {
+            return {};
+        }
+
+        // Walk the poses from the newest one, 4 at a time. A group is read backwards from the slot
+        // of its newest pose, groups that wrap around the ring are compared one by one.
+        float minDiff = 100000;
+        size_t minSlot = m_newest;
+        for (size_t age = 0; age < m_count && minDiff > EXACT_MATCH_DISTANCE; age += 4) {
+            size_t slot = slotOf(age);
+            float distances[4];
+            if (slot >= 3) {
+                rotationDistances4(&m_rotations[0][0], CAPACITY, slot - 3, target, distances);
+            } else {
+                for (size_t i = 0; i < 4; i++) {
+                    distances[3 - i]
+                        = rotationDistance(&m_rotations[0][0], CAPACITY, slotOf(age + i), target);
+                }
+            }
+
+            for (size_t i = 0; i < 4 && age + i < m_count; i++) {
+                if (distances[3 - i] < minDiff) {
+                    minSlot = slotOf(age + i);
+                    minDiff = distances[3 - i];
+                    if (minDiff <= EXACT_MATCH_DISTANCE) {
+                        break;
+                    }
+                }
+            }
+        }
+
+        return m_poses[minSlot];
+    });
+
+    if (!match) {
+        Debug("PoseHistory::GetBestPoseMatch: No pose matched.");
+    }
+    return match;
 }
 
 std::optional<PoseHistory::TrackingHistoryFrame> PoseHistory::GetPoseAt(uint64_t timestampNs
 ) const {
-    std::unique_lock<std::mutex> lock(m_mutex);
-    for (auto it = m_poseBuffer.rbegin(), end = m_poseBuffer.rend(); it != end; ++it) {
-        if (it->targetTimestampNs == timestampNs)
-            return *it;
+    auto match = readConsistent([&]() -> std::optional<TrackingHistoryFrame> {
+        for (size_t age = 0; age < m_count; age++) {
+            const TrackingHistoryFrame& frame = m_poses[slotOf(age)];
+            if (frame.targetTimestampNs == timestampNs)
+                return frame;
+        }
+        return {};
+    });
+
+    if (!match) {
+        Debug("PoseHistory::GetPoseAt: No pose matched.");
+    }
+    return match;
+}
+
+std::optional<PoseHistory::TrackingHistoryFrame> PoseHistory::GetLatestPose() const {
+    return readConsistent([&]() -> std::optional<TrackingHistoryFrame> {
+        if (m_count == 0) {
+            return {};
+        }
+        return m_poses[m_newest];
+    });
+}
+
+std::optional<PoseHistory::TrackingHistoryFrame> PoseHistory::GetPoseByTag(uint32_t tag) const {
+    if (tag == 0 || tag > POSE_TAG_COUNT) {
+        return {};
     }
+    return readConsistent([&]() -> std::optional<TrackingHistoryFrame> {
+        // Tags are consecutive, so the tag gives the age of the pose
+        size_t age = (m_tags[m_newest] + POSE_TAG_COUNT - tag) % POSE_TAG_COUNT;
+        if (age >= m_count || m_tags[slotOf(age)] != tag) {
+            return {};
+        }
+        return m_poses[slotOf(age)];
+    });
+}
 
-    Debug("PoseHistory::GetPoseAt: No pose matched.");
-    return {};
+std::optional<PoseHistory::TrackingHistoryFrame> PoseHistory::Sample(uint64_t timestampNs) const {
+    ALVR_PROFILE_ZONE("PoseHistory::Sample");
+    struct Bracket {
+        // Newest pose not after timestampNs, or the oldest pose
+        TrackingHistoryFrame before;
+        // The pose following it, if any
+        std::optional<TrackingHistoryFrame> after;
+    };
+    auto bracket = readConsistent([&]() -> std::optional<Bracket> {
+        if (m_count == 0) {
+            return {};
+        }
+        for (size_t age = 0; age < m_count; age++) {
+            const TrackingHistoryFrame& frame = m_poses[slotOf(age)];
+            if (frame.targetTimestampNs <= timestampNs) {
+                if (age == 0) {
+                    return Bracket { frame, {} };
+                }
+                return Bracket { frame, m_poses[slotOf(age - 1)] };
+            }
+        }
+        return Bracket { m_poses[slotOf(m_count - 1)], {} };
+    });
+    if (!bracket) {
+        return {};
+    }
+
+    const TrackingHistoryFrame& before = bracket->before;
+    TrackingHistoryFrame sample = before;
+    sample.targetTimestampNs = timestampNs;
+    FfiDeviceMotion& motion = sample.motion;
+
+    if (bracket->after && bracket->after->targetTimestampNs > before.targetTimestampNs) {
+        const FfiDeviceMotion& next = bracket->after->motion;
+        double t = double(timestampNs - before.targetTimestampNs)
+            / double(bracket->after->targetTimestampNs - before.targetTimestampNs);
+
+        motion.pose.orientation = slerp(before.motion.pose.orientation, next.pose.orientation, t);
+        for (int i = 0; i < 3; i++) {
+            motion.pose.position[i] += float(t * (next.pose.position[i] - motion.pose.position[i]));
+            motion.linearVelocity[i]
+                += float(t * (next.linearVelocity[i] - motion.linearVelocity[i]));
+            motion.angularVelocity[i]
+                += float(t * (next.angularVelocity[i] - motion.angularVelocity[i]));
+        }
+    } else if (timestampNs > before.targetTimestampNs) {
+        double dt = std::min(timestampNs - before.targetTimestampNs, MAX_EXTRAPOLATION_NS) / 1e9;
+
+        motion.pose.orientation
+            = integrateAngularVelocity(motion.pose.orientation, motion.angularVelocity, dt);
+        for (int i = 0; i < 3; i++) {
+            motion.pose.position[i] += float(motion.linearVelocity[i] * dt);
+        }
+    } else {
+        return sample;
+    }
+
+    // The stored matrix has the tracking transform applied, which is carried over to the sample
+    // as a rotation relative to the base pose
+    // Both rotations are converted in one pass: 0 is the base pose, 1 the sample
+    const FfiQuat quats[2] = { before.motion.pose.orientation, motion.pose.orientation };
+    vr::HmdMatrix34_t rotations[2];
+    posemath::QuatsToMats(quats, 2, rotations);
+    sample.rotationMatrix = posemath::Mul33(
+        before.rotationMatrix, posemath::Mul33(posemath::Transpose33(rotations[0]), rotations[1])
+    );
+
+    return sample;
 }
 
 void PoseHistory::SetTransform(const vr::HmdMatrix34_t& transform) {
-    std::unique_lock<std::mutex> lock(m_mutex);
+    std::unique_lock<InstrumentedMutex> lock(m_writeMutex);
     m_transform = transform;
 
     for (int i = 0; i < 3; ++i) {
@@ -94,3 +355,8 @@ void PoseHistory::SetTransform(const vr::HmdMatrix34_t& transform) {
     }
     m_transformIdentity = true;
 }
+
+void PoseHistory::SetFoveationCenter(const FfiFoveationCenter& center) {
+    std::unique_lock<InstrumentedMutex> lock(m_writeMutex);
+    m_foveationCenter = center;
+}
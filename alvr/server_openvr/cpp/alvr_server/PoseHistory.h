@@ -1,32 +1,74 @@
 #pragma once
 
 #include "ALVR-common/packet_types.h"
+#include "LockStats.h"
 #include "openvr_driver_wrap.h"
 
-#include <list>
+#include <array>
+#include <atomic>
 #include <mutex>
 #include <optional>
 
+// Poses are written by the tracking thread and read by the encoder threads. Readers never take a
+// lock: they retry when a pose was written while they were reading.
 class PoseHistory {
 public:
     struct TrackingHistoryFrame {
         uint64_t targetTimestampNs;
         FfiDeviceMotion motion;
         vr::HmdMatrix34_t rotationMatrix;
+        // Center the frame rendered with this pose is compressed with
+        FfiFoveationCenter foveationCenter;
+        // GetSteadyTimeNs when the tracking was received
+        uint64_t receivedNs;
     };
 
-    void OnPoseUpdated(uint64_t targetTimestampNs, FfiDeviceMotion motion);
+    // Number of distinct pose tags, tags go from 1 to POSE_TAG_COUNT
+    static constexpr uint32_t POSE_TAG_COUNT = 4096;
 
+    // Returns the tag of the pose, which identifies it among the last POSE_TAG_COUNT poses
+    uint32_t OnPoseUpdated(uint64_t targetTimestampNs, FfiDeviceMotion motion);
+
+    // Return the pose whose rotation is nearest to the given one, the most recent one on ties
     std::optional<TrackingHistoryFrame> GetBestPoseMatch(const vr::HmdMatrix34_t& pose) const;
     // Return the most recent pose known at the given timestamp
     std::optional<TrackingHistoryFrame> GetPoseAt(uint64_t timestampNs) const;
+    // Return the most recent pose received from the client
+    std::optional<TrackingHistoryFrame> GetLatestPose() const;
+    // Return the pose with the given tag, if it is still in the history
+    std::optional<TrackingHistoryFrame> GetPoseByTag(uint32_t tag) const;
+    // Return the pose at any timestamp: interpolated between the poses around it, extrapolated
+    // with the velocities of the newest pose after it, or the oldest pose before the history
+    std::optional<TrackingHistoryFrame> Sample(uint64_t timestampNs) const;
 
     void SetTransform(const vr::HmdMatrix34_t& transform);
+    // Foveation center of the poses updated after this call
+    void SetFoveationCenter(const FfiFoveationCenter& center);
 
 private:
-    mutable std::mutex m_mutex;
-    std::list<TrackingHistoryFrame> m_poseBuffer;
+    // The value should match with the client's MAXIMUM_TRACKING_FRAMES in ovr_context.cpp
+    static constexpr size_t CAPACITY = 120 * 3;
+
+    // Slot of the pose received age updates before the newest one
+    size_t slotOf(size_t age) const { return (m_newest + CAPACITY - age) % CAPACITY; }
+
+    // Returns what read() copied out of the history, once it ran without a concurrent write
+    template <typename Read> auto readConsistent(Read read) const;
+
+    // Only taken by OnPoseUpdated and SetTransform
+    InstrumentedMutex m_writeMutex { "PoseHistory write" };
+    // Odd while a pose is being written
+    std::atomic<uint64_t> m_sequence = 0;
+    // Ring of the last m_count poses, the newest one in m_newest
+    std::array<TrackingHistoryFrame, CAPACITY> m_poses;
+    // Rotation matrix components of m_poses, one array per component, so that GetBestPoseMatch can
+    // compare several poses at once
+    float m_rotations[9][CAPACITY] = {};
+    uint32_t m_tags[CAPACITY] = {};
+    size_t m_newest = CAPACITY - 1;
+    size_t m_count = 0;
     vr::HmdMatrix34_t m_transform
         = { { { 1.0, 0.0, 0.0, 0.0 }, { 0.0, 1.0, 0.0, 0.0 }, { 0.0, 0.0, 1.0, 0.0 } } };
     bool m_transformIdentity = true;
+    FfiFoveationCenter m_foveationCenter = {};
 };
@@ -0,0 +1,182 @@
+#pragma once
+
+#include <stddef.h>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define POSE_MATH_SSE2
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#define POSE_MATH_NEON
+#include <arm_neon.h>
+#endif
+
+// Rotation math of the pose paths. Matrices are 3x4 with rows of four floats, vr::HmdMatrix34_t
+// or a type of the same layout like the one of the Vulkan layer, so that a row fits a SIMD
+// register. Only the 3x3 rotation part is computed. Quaternions are any type with x, y, z and w
+// members, like FfiQuat.
+namespace posemath {
+
+namespace detail {
+// Two doubles, the lanes of QuatsToMats
+#if defined(POSE_MATH_SSE2)
+typedef __m128d Lanes;
+inline Lanes set(double a, double b) { return _mm_set_pd(b, a); }
+inline Lanes add(Lanes a, Lanes b) { return _mm_add_pd(a, b); }
+inline Lanes sub(Lanes a, Lanes b) { return _mm_sub_pd(a, b); }
+inline Lanes mul(Lanes a, Lanes b) { return _mm_mul_pd(a, b); }
+inline void store(double values[2], Lanes v) { _mm_storeu_pd(values, v); }
+#elif defined(POSE_MATH_NEON)
+typedef float64x2_t Lanes;
+inline Lanes set(double a, double b) { return vsetq_lane_f64(b, vdupq_n_f64(a), 1); }
+inline Lanes add(Lanes a, Lanes b) { return vaddq_f64(a, b); }
+inline Lanes sub(Lanes a, Lanes b) { return vsubq_f64(a, b); }
+inline Lanes mul(Lanes a, Lanes b) { return vmulq_f64(a, b); }
+inline void store(double values[2], Lanes v) { vst1q_f64(values, v); }
+#endif
+} // namespace detail
+
+// a * b. The fourth column of the result is zero.
+template <typename Matrix> Matrix Mul33(const Matrix& a, const Matrix& b) {
+    Matrix result;
+#if defined(POSE_MATH_SSE2)
+    __m128 b0 = _mm_loadu_ps(b.m[0]);
+    __m128 b1 = _mm_loadu_ps(b.m[1]);
+    __m128 b2 = _mm_loadu_ps(b.m[2]);
+    for (int i = 0; i < 3; i++) {
+        __m128 row = _mm_mul_ps(_mm_set1_ps(a.m[i][0]), b0);
+        row = _mm_add_ps(row, _mm_mul_ps(_mm_set1_ps(a.m[i][1]), b1));
+        row = _mm_add_ps(row, _mm_mul_ps(_mm_set1_ps(a.m[i][2]), b2));
+        _mm_storeu_ps(result.m[i], row);
+        result.m[i][3] = 0.0f;
+    }
+#elif defined(POSE_MATH_NEON)
+    float32x4_t b0 = vld1q_f32(b.m[0]);
+    float32x4_t b1 = vld1q_f32(b.m[1]);
+    float32x4_t b2 = vld1q_f32(b.m[2]);
+    for (int i = 0; i < 3; i++) {
+        float32x4_t row = vmulq_n_f32(b0, a.m[i][0]);
+        row = vfmaq_n_f32(row, b1, a.m[i][1]);
+        row = vfmaq_n_f32(row, b2, a.m[i][2]);
+        vst1q_f32(result.m[i], row);
+        result.m[i][3] = 0.0f;
+    }
+#else
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            result.m[i][j] = a.m[i][0] * b.m[0][j] + a.m[i][1] * b.m[1][j] + a.m[i][2] * b.m[2][j];
+        }
+        result.m[i][3] = 0.0f;
+    }
+#endif
+    return result;
+}
+
+// Transpose of the rotation of a, the fourth column is kept
+template <typename Matrix> Matrix Transpose33(const Matrix& a) {
+    Matrix result;
+#if defined(POSE_MATH_SSE2)
+    __m128 r0 = _mm_loadu_ps(a.m[0]);
+    __m128 r1 = _mm_loadu_ps(a.m[1]);
+    __m128 r2 = _mm_loadu_ps(a.m[2]);
+    __m128 r3 = _mm_setzero_ps();
+    _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+    _mm_storeu_ps(result.m[0], r0);
+    _mm_storeu_ps(result.m[1], r1);
+    _mm_storeu_ps(result.m[2], r2);
+#elif defined(POSE_MATH_NEON)
+    float32x4_t r0 = vld1q_f32(a.m[0]);
+    float32x4_t r1 = vld1q_f32(a.m[1]);
+    float32x4_t r2 = vld1q_f32(a.m[2]);
+    float32x4_t r3 = vdupq_n_f32(0.0f);
+    float32x4_t t0 = vtrn1q_f32(r0, r1);
+    float32x4_t t1 = vtrn2q_f32(r0, r1);
+    float32x4_t t2 = vtrn1q_f32(r2, r3);
+    float32x4_t t3 = vtrn2q_f32(r2, r3);
+    vst1q_f32(
+        result.m[0],
+        vreinterpretq_f32_f64(vtrn1q_f64(vreinterpretq_f64_f32(t0), vreinterpretq_f64_f32(t2)))
+    );
+    vst1q_f32(
+        result.m[1],
+        vreinterpretq_f32_f64(vtrn1q_f64(vreinterpretq_f64_f32(t1), vreinterpretq_f64_f32(t3)))
+    );
+    vst1q_f32(
+        result.m[2],
+        vreinterpretq_f32_f64(vtrn2q_f64(vreinterpretq_f64_f32(t0), vreinterpretq_f64_f32(t2)))
+    );
+#else
+    for (int i = 0; i < 3; i++) {
+        for (int k = 0; k < 3; k++) {
+            result.m[i][k] = a.m[k][i];
+        }
+    }
+#endif
+    result.m[0][3] = a.m[0][3];
+    result.m[1][3] = a.m[1][3];
+    result.m[2][3] = a.m[2][3];
+    return result;
+}
+
+// Rotation matrices of count quaternions, two at a time in double lanes. The operations are the
+// ones of HmdMatrix_QuatToMat in the same order, so that the matrices compare with the ones of
+// the runtime poses as before.
+template <typename Quat, typename Matrix>
+void QuatsToMats(const Quat* quats, size_t count, Matrix* matrices) {
+    size_t i = 0;
+#if defined(POSE_MATH_SSE2) || defined(POSE_MATH_NEON)
+    using namespace detail;
+    for (; i + 2 <= count; i += 2) {
+        const Quat& q0 = quats[i];
+        const Quat& q1 = quats[i + 1];
+        Lanes w = set(q0.w, q1.w);
+        Lanes x = set(q0.x, q1.x);
+        Lanes y = set(q0.y, q1.y);
+        Lanes z = set(q0.z, q1.z);
+        Lanes one = set(1.0, 1.0);
+        Lanes two = set(2.0, 2.0);
+        Lanes x2 = mul(two, x);
+        Lanes y2 = mul(two, y);
+        Lanes z2 = mul(two, z);
+
+        Lanes m[3][3] = {
+            { sub(sub(one, mul(y2, y)), mul(z2, z)),
+              sub(mul(x2, y), mul(z2, w)),
+              add(mul(x2, z), mul(y2, w)) },
+            { add(mul(x2, y), mul(z2, w)),
+              sub(sub(one, mul(x2, x)), mul(z2, z)),
+              sub(mul(y2, z), mul(x2, w)) },
+            { sub(mul(x2, z), mul(y2, w)),
+              add(mul(y2, z), mul(x2, w)),
+              sub(sub(one, mul(x2, x)), mul(y2, y)) },
+        };
+        for (int row = 0; row < 3; row++) {
+            for (int col = 0; col < 3; col++) {
+                double values[2];
+                store(values, m[row][col]);
+                matrices[i].m[row][col] = (float)values[0];
+                matrices[i + 1].m[row][col] = (float)values[1];
+            }
+            matrices[i].m[row][3] = 0.0f;
+            matrices[i + 1].m[row][3] = 0.0f;
+        }
+    }
+#endif
+    for (; i < count; i++) {
+        double w = quats[i].w, x = quats[i].x, y = quats[i].y, z = quats[i].z;
+        Matrix& m = matrices[i];
+        m.m[0][0] = (float)(1.0 - 2.0 * y * y - 2.0 * z * z);
+        m.m[0][1] = (float)(2.0 * x * y - 2.0 * z * w);
+        m.m[0][2] = (float)(2.0 * x * z + 2.0 * y * w);
+        m.m[0][3] = 0.0f;
+        m.m[1][0] = (float)(2.0 * x * y + 2.0 * z * w);
+        m.m[1][1] = (float)(1.0 - 2.0 * x * x - 2.0 * z * z);
+        m.m[1][2] = (float)(2.0 * y * z - 2.0 * x * w);
+        m.m[1][3] = 0.0f;
+        m.m[2][0] = (float)(2.0 * x * z - 2.0 * y * w);
+        m.m[2][1] = (float)(2.0 * y * z + 2.0 * x * w);
+        m.m[2][2] = (float)(1.0 - 2.0 * x * x - 2.0 * y * y);
+        m.m[2][3] = 0.0f;
+    }
+}
+
+} // namespace posemath
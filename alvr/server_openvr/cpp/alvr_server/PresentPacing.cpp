@@ -0,0 +1,77 @@
+#include "PresentPacing.h"
+
+#include <mutex>
+
+namespace {
+
+// Intervals of more than this many vsync periods missed the vsync they were meant for
+const double LATE_INTERVAL_PERIODS = 1.5;
+
+std::mutex g_mutex;
+FfiPresentPacingStats g_stats = {};
+uint64_t g_lastArrivalNs = 0;
+uint64_t g_lastTargetTimestampNs = 0;
+uint64_t g_latenessArrivals = 0;
+uint64_t g_latenessLate = 0;
+
+} // namespace
+
+void RecordPresentArrival(uint64_t timeNs, uint64_t targetTimestampNs) {
+    uint64_t periodNs = GetVSyncIntervalNs();
+
+    std::lock_guard<std::mutex> lock(g_mutex);
+    g_stats.arrivals++;
+    g_latenessArrivals++;
+    if (targetTimestampNs != 0 && targetTimestampNs == g_lastTargetTimestampNs) {
+        g_stats.duplicates++;
+    }
+    if (g_lastArrivalNs != 0 && periodNs != 0 && timeNs > g_lastArrivalNs) {
+        double periods = double(timeNs - g_lastArrivalNs) / periodNs;
+        if (periods > LATE_INTERVAL_PERIODS) {
+            g_stats.late++;
+            g_latenessLate++;
+        }
+        int bucket = int(periods * PRESENT_INTERVAL_BUCKETS_PER_PERIOD);
+        if (bucket >= PRESENT_INTERVAL_BUCKETS) {
+            bucket = PRESENT_INTERVAL_BUCKETS - 1;
+        }
+        g_stats.intervalBuckets[bucket]++;
+    }
+    g_lastArrivalNs = timeNs;
+    g_lastTargetTimestampNs = targetTimestampNs;
+}
+
+void RecordPresentsDropped(uint64_t count) {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    g_stats.dropped += count;
+}
+
+void RecordPresentRepeated() {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    g_stats.duplicates++;
+}
+
+void RecordCompositorGpuTime(uint64_t gpuNs) {
+    uint64_t periodNs = GetVSyncIntervalNs();
+
+    std::lock_guard<std::mutex> lock(g_mutex);
+    g_stats.compositorGpuTimeSumNs += gpuNs;
+    g_stats.compositorGpuTimes++;
+    if (periodNs != 0 && gpuNs > periodNs) {
+        g_stats.compositorGpuBound++;
+    }
+}
+
+void TakePresentLateness(uint64_t& arrivals, uint64_t& late) {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    arrivals = g_latenessArrivals;
+    late = g_latenessLate;
+    g_latenessArrivals = 0;
+    g_latenessLate = 0;
+}
+
+void TakePresentPacingStats(FfiPresentPacingStats* stats) {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    *stats = g_stats;
+    g_stats = {};
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include "bindings.h"
+#include <stdint.h>
+
+// Pacing of the frames the game presents against the vsync schedule, to tell uneven game frame
+// times from encoder stalls. Counts are kept since the last TakePresentPacingStats.
+
+// timeNs is the steady clock time the present reached the driver. A present with the target
+// timestamp of the previous one carries no new frame, it counts as a duplicate.
+void RecordPresentArrival(uint64_t timeNs, uint64_t targetTimestampNs);
+// Presents that were overwritten before the encoder took them
+void RecordPresentsDropped(uint64_t count);
+// Frames encoded again without a new present, like reprojections
+void RecordPresentRepeated();
+// Time from a present of the SteamVR compositor until the GPU was done rendering its image. Above
+// the vsync period the compositor is GPU bound, and the late presents aren't the encoder's.
+void RecordCompositorGpuTime(uint64_t gpuNs);
+
+// Arrivals and late arrivals since the last call, counted apart from the statistics for the
+// driver's own use
+void TakePresentLateness(uint64_t& arrivals, uint64_t& late);
@@ -0,0 +1,158 @@
+#pragma once
+
+#include <stdint.h>
+
+// Zones and frame marks of the frame path for the Tracy profiler. Builds with the
+// trace-performance feature define ALVR_TRACY, and the zones go to the Tracy client that the
+// profiling crate links into the driver for the Rust side, so that one trace covers both. Without
+// it the macros expand to nothing.
+//
+// ALVR_PROFILE_ZONE(name) times the rest of the enclosing scope, ALVR_PROFILE_FRAME(name) marks
+// the end of a frame of the named timeline. Names must be string literals.
+
+#ifdef ALVR_TRACY
+
+#include <atomic>
+#include <string.h>
+
+// The subset of the C API of the Tracy client (TracyC.h) used here, as of Tracy 0.11
+extern "C" {
+struct ___tracy_source_location_data {
+    const char* name;
+    const char* function;
+    const char* file;
+    uint32_t line;
+    uint32_t color;
+};
+
+struct ___tracy_c_zone_context {
+    uint32_t id;
+    int32_t active;
+};
+
+struct ___tracy_gpu_time_data {
+    int64_t gpuTime;
+    uint16_t queryId;
+    uint8_t context;
+};
+
+struct ___tracy_gpu_zone_begin_data {
+    uint64_t srcloc;
+    uint16_t queryId;
+    uint8_t context;
+};
+
+struct ___tracy_gpu_zone_end_data {
+    uint16_t queryId;
+    uint8_t context;
+};
+
+struct ___tracy_gpu_new_context_data {
+    int64_t gpuTime;
+    float period;
+    uint8_t context;
+    uint8_t flags;
+    uint8_t type;
+};
+
+struct ___tracy_gpu_context_name_data {
+    uint8_t context;
+    const char* name;
+    uint16_t len;
+};
+
+___tracy_c_zone_context
+___tracy_emit_zone_begin(const ___tracy_source_location_data* srcloc, int32_t active);
+void ___tracy_emit_zone_end(___tracy_c_zone_context ctx);
+void ___tracy_emit_frame_mark(const char* name);
+uint64_t ___tracy_alloc_srcloc_name(
+    uint32_t line,
+    const char* source,
+    size_t sourceSz,
+    const char* function,
+    size_t functionSz,
+    const char* name,
+    size_t nameSz,
+    uint32_t color
+);
+void ___tracy_emit_gpu_new_context_serial(const ___tracy_gpu_new_context_data data);
+void ___tracy_emit_gpu_context_name_serial(const ___tracy_gpu_context_name_data data);
+void ___tracy_emit_gpu_zone_begin_alloc_serial(const ___tracy_gpu_zone_begin_data data);
+void ___tracy_emit_gpu_zone_end_serial(const ___tracy_gpu_zone_end_data data);
+void ___tracy_emit_gpu_time_serial(const ___tracy_gpu_time_data data);
+}
+
+class ProfileZone {
+public:
+    explicit ProfileZone(const ___tracy_source_location_data* location)
+        : m_context(___tracy_emit_zone_begin(location, 1)) { }
+    ~ProfileZone() { ___tracy_emit_zone_end(m_context); }
+
+    ProfileZone(const ProfileZone&) = delete;
+    ProfileZone& operator=(const ProfileZone&) = delete;
+
+private:
+    ___tracy_c_zone_context m_context;
+};
+
+// GPU timeline of the trace. The zones are given after the fact, from the timestamps read back
+// from a query pool.
+class ProfileGpuContext {
+public:
+    // gpuTimeNs is the current GPU time, in the domain of the timestamps given to Zone. Only the
+    // first call counts.
+    void Init(const char* name, int64_t gpuTimeNs) {
+        if (m_initialized) {
+            return;
+        }
+        static std::atomic<uint8_t> nextContext = 0;
+        m_context = nextContext++;
+        ___tracy_emit_gpu_new_context_serial({ gpuTimeNs, 1.0f, m_context, 0, GPU_CONTEXT_VULKAN });
+        ___tracy_emit_gpu_context_name_serial({ m_context, name, (uint16_t)strlen(name) });
+        m_initialized = true;
+    }
+
+    void Zone(const char* name, int64_t beginNs, int64_t endNs) {
+        if (!m_initialized) {
+            return;
+        }
+        uint64_t location = ___tracy_alloc_srcloc_name(0, "", 0, "", 0, name, strlen(name), 0);
+        uint16_t beginQuery = m_nextQuery++;
+        uint16_t endQuery = m_nextQuery++;
+        ___tracy_emit_gpu_zone_begin_alloc_serial({ location, beginQuery, m_context });
+        ___tracy_emit_gpu_zone_end_serial({ endQuery, m_context });
+        ___tracy_emit_gpu_time_serial({ beginNs, beginQuery, m_context });
+        ___tracy_emit_gpu_time_serial({ endNs, endQuery, m_context });
+    }
+
+private:
+    // GpuContextType::Vulkan of Tracy
+    static constexpr uint8_t GPU_CONTEXT_VULKAN = 2;
+
+    bool m_initialized = false;
+    uint8_t m_context = 0;
+    uint16_t m_nextQuery = 0;
+};
+
+#define ALVR_PROFILE_CONCAT_(a, b) a##b
+#define ALVR_PROFILE_CONCAT(a, b) ALVR_PROFILE_CONCAT_(a, b)
+#define ALVR_PROFILE_ZONE(name)                                                                    \
+    static const ___tracy_source_location_data ALVR_PROFILE_CONCAT(profileLocation, __LINE__)      \
+        = { name, __func__, __FILE__, (uint32_t)__LINE__, 0 };                                     \
+    ProfileZone ALVR_PROFILE_CONCAT(profileZone, __LINE__)(                                        \
+        &ALVR_PROFILE_CONCAT(profileLocation, __LINE__)                                            \
+    )
+#define ALVR_PROFILE_FRAME(name) ___tracy_emit_frame_mark(name)
+
+#else
+
+class ProfileGpuContext {
+public:
+    void Init(const char*, int64_t) { }
+    void Zone(const char*, int64_t, int64_t) { }
+};
+
+#define ALVR_PROFILE_ZONE(name)
+#define ALVR_PROFILE_FRAME(name)
+
+#endif
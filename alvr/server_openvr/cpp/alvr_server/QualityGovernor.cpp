@@ -0,0 +1,108 @@
+#include "QualityGovernor.h"
+
+#include "EncoderControl.h"
+#include "Logger.h"
+#include "bindings.h"
+#include <algorithm>
+
+QualityGovernor::QualityGovernor() {
+    const Settings* settings = Settings_Instance();
+    m_enabled = settings->m_adaptiveQualityMinScale > 0.f;
+    m_minScale = std::clamp(settings->m_adaptiveQualityMinScale, 0.1f, 1.f);
+    m_adaptiveRefreshRate = m_enabled && settings->m_adaptiveRefreshRate;
+    m_negotiatedRefreshRate = float(std::max(settings->m_refreshRate, 1));
+    // A previous encoder may have lowered the rate of the stream
+    float refreshRate = GetRefreshRate();
+    setRefreshRate(refreshRate > 0.f ? refreshRate : m_negotiatedRefreshRate);
+    keepNegotiatedBudget(refreshRate);
+    g_encoderControl.SetGovernorScale(1.f);
+}
+
+void QualityGovernor::updateRefreshRate(bool overloaded) {
+    if (overloaded && m_scale == m_minScale && m_refreshSteps < MAX_REFRESH_STEPS) {
+        uint64_t budgetNs = m_budgetNs;
+        float refreshRate = StepRefreshRate(true);
+        if (refreshRate > 0.f) {
+            Info("Refresh rate lowered to %.0f Hz", refreshRate);
+            m_higherBudgetsNs[m_refreshSteps++] = budgetNs;
+            setRefreshRate(refreshRate);
+        }
+    }
+
+    if (m_refreshSteps == 0 || overloaded || m_scale < 1.f || m_slowHigherFrames > 0) {
+        m_higherHeadroomWindows = 0;
+        return;
+    }
+    if (++m_higherHeadroomWindows < RAISE_REFRESH_WINDOWS) {
+        return;
+    }
+    m_higherHeadroomWindows = 0;
+    float refreshRate = StepRefreshRate(false);
+    if (refreshRate > 0.f) {
+        Info("Refresh rate raised to %.0f Hz", refreshRate);
+        m_refreshSteps--;
+        setRefreshRate(refreshRate);
+        keepNegotiatedBudget(refreshRate);
+    } else {
+        // The stream was restarted at its negotiated rate
+        m_refreshSteps = 0;
+    }
+}
+
+void QualityGovernor::keepNegotiatedBudget(float refreshRate) {
+    // The budgets of the rates in between are unknown, the one of the negotiated rate is stricter
+    if (m_refreshSteps == 0 && refreshRate > 0.f && refreshRate < m_negotiatedRefreshRate) {
+        m_higherBudgetsNs[m_refreshSteps++] = uint64_t(1e9 / m_negotiatedRefreshRate);
+    }
+}
+
+void QualityGovernor::setRefreshRate(float refreshRate) {
+    refreshRate = std::max(refreshRate, 1.f);
+    m_budgetNs = uint64_t(1e9 / refreshRate);
+    m_windowFrames = std::max(uint32_t(refreshRate + 0.5f), 1u);
+}
+
+void QualityGovernor::Report(uint64_t composeNs, uint64_t encodeNs) {
+    if (!m_enabled) {
+        return;
+    }
+
+    uint64_t frameNs = composeNs + encodeNs;
+    if (frameNs > m_budgetNs) {
+        m_overruns++;
+    }
+    if (frameNs > m_budgetNs * HEADROOM) {
+        m_slowFrames++;
+    }
+    if (m_refreshSteps > 0 && frameNs > m_higherBudgetsNs[m_refreshSteps - 1] * HEADROOM) {
+        m_slowHigherFrames++;
+    }
+    if (++m_frames < m_windowFrames) {
+        return;
+    }
+
+    float scale = m_scale;
+    bool overloaded = m_overruns > m_windowFrames * OVERRUN_FRACTION;
+    if (m_adaptiveRefreshRate) {
+        updateRefreshRate(overloaded);
+    }
+    if (overloaded) {
+        scale = std::max(m_scale - SCALE_STEP, m_minScale);
+        m_headroomWindows = 0;
+    } else if (m_slowFrames == 0 && ++m_headroomWindows >= 2) {
+        scale = std::min(m_scale + SCALE_STEP, 1.f);
+        m_headroomWindows = 0;
+    } else if (m_slowFrames > 0) {
+        m_headroomWindows = 0;
+    }
+    m_frames = 0;
+    m_overruns = 0;
+    m_slowFrames = 0;
+    m_slowHigherFrames = 0;
+
+    if (scale != m_scale) {
+        Info("Encoding resolution scale %.1f, frame budget %.1f ms", scale, m_budgetNs / 1e6);
+        m_scale = scale;
+        g_encoderControl.SetGovernorScale(scale);
+    }
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stdint.h>
+
+// Lowers the encoding resolution while the frames take longer to compose and encode than the
+// frame interval, and raises it back when there is headroom. The resolution is the one quality
+// knob all the resizing encoders can change between two frames, see
+// FfiDynamicEncoderParams::resolution_scale. Presets and the foveation are fixed when the encoder
+// and the compose chain are created.
+//
+// With the adaptive refresh rate, frames that still don't fit at the minimum scale switch the
+// stream to the next lower refresh rate. It goes back up once the frames would fit the budget of
+// the higher rate again, at full scale.
+class QualityGovernor {
+public:
+    // Reads the settings, the frame budget is one refresh interval
+    QualityGovernor();
+
+    // Called once per encoded frame, with the GPU time of its composition if known and the time
+    // of its encode
+    void Report(uint64_t composeNs, uint64_t encodeNs);
+
+private:
+    // Fraction of the frames of a window over the budget from which the resolution is lowered
+    static constexpr float OVERRUN_FRACTION = 0.05f;
+    // Share of the budget under which all the frames of a window must stay to raise the resolution
+    static constexpr float HEADROOM = 0.6f;
+    static constexpr float SCALE_STEP = 0.1f;
+    // Windows with headroom at the higher rate in a row before switching back to it
+    static constexpr uint32_t RAISE_REFRESH_WINDOWS = 5;
+    static constexpr int MAX_REFRESH_STEPS = 8;
+
+    // Once per window, before the scale changes
+    void updateRefreshRate(bool overloaded);
+    // Without the budget of the next higher rate below the negotiated one, the stream goes back up
+    // once the frames fit the negotiated rate
+    void keepNegotiatedBudget(float refreshRate);
+    void setRefreshRate(float refreshRate);
+
+    bool m_enabled;
+    uint64_t m_budgetNs;
+    float m_minScale;
+    // One second of frames
+    uint32_t m_windowFrames;
+
+    float m_scale = 1.f;
+    uint32_t m_frames = 0;
+    uint32_t m_overruns = 0;
+    uint32_t m_slowFrames = 0;
+    // Windows with headroom in a row, the resolution is raised after two
+    uint32_t m_headroomWindows = 0;
+
+    bool m_adaptiveRefreshRate;
+    float m_negotiatedRefreshRate;
+    // Budgets of the higher refresh rates the stream was lowered from, the last one is the next
+    uint64_t m_higherBudgetsNs[MAX_REFRESH_STEPS];
+    int m_refreshSteps = 0;
+    // Frames of the window over the headroom of the next higher rate
+    uint32_t m_slowHigherFrames = 0;
+    uint32_t m_higherHeadroomWindows = 0;
+};
@@ -0,0 +1,47 @@
+#include "RadialFoveation.h"
+
+#include "Settings.h"
+#include <algorithm>
+#include <cmath>
+
+RadialFoveation GetRadialFoveation() {
+    const Settings* settings = Settings_Instance();
+    float radius = std::clamp(settings->m_foveationCenterRadius, 0.f, 1.f);
+    float edgeRatio = std::max(settings->m_foveationRadialEdgeRatio, 1.f);
+
+    // The slope at the edges of the compressed eye is scale * edgeRatio, and the edges of both
+    // eyes meet
+    float scale = (2.f + (edgeRatio - 1.f) * radius) / (edgeRatio + 1.f);
+    float compressedRadius = radius / scale;
+    float curve = compressedRadius < 1.f
+        ? (1.f - scale) / ((1.f - compressedRadius) * (1.f - compressedRadius))
+        : 0.f;
+    return { radius, scale, curve };
+}
+
+float RadialFoveationCenter(float shift, float radius) {
+    // Like the start of the axis aligned center region, which moves by its margin to the edges
+    return .5f + shift * (1.f - radius) / 2.f;
+}
+
+void RadialCompressedToEyeUv(
+    const RadialFoveation& foveation, float shiftX, float shiftY, float& u, float& v
+) {
+    float centerX = RadialFoveationCenter(shiftX, foveation.radius);
+    float centerY = RadialFoveationCenter(shiftY, foveation.radius);
+    float extentX = u < centerX ? centerX : 1.f - centerX;
+    float extentY = v < centerY ? centerY : 1.f - centerY;
+    float x = extentX > 0.f ? (u - centerX) / extentX : 0.f;
+    float y = extentY > 0.f ? (v - centerY) / extentY : 0.f;
+
+    float distance = std::sqrt(x * x + y * y);
+    float beyond = std::max(distance - foveation.radius / foveation.scale, 0.f);
+    // Of the vector from the center, the direction doesn't change
+    float scale = foveation.scale;
+    if (distance > 0.f) {
+        scale += foveation.curve * beyond * beyond / distance;
+    }
+
+    u = centerX + std::clamp(x * scale, -1.f, 1.f) * extentX;
+    v = centerY + std::clamp(y * scale, -1.f, 1.f) * extentY;
+}
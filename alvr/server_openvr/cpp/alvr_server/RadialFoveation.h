@@ -0,0 +1,31 @@
+#pragma once
+
+// Radial compression of foveated encoding, an alternative to the axis aligned one that follows the
+// falloff of the resolution of the lenses. Each eye is normalized around its foveation center, so
+// that the edges are at distance 1 on both sides of both axes. Within m_foveationCenterRadius the
+// frame keeps its resolution, beyond it the compression grows with the distance to the center and
+// reaches m_foveationRadialEdgeRatio at the edges, more in the corners. The compressed eye is scale
+// times the size of the eye and is normalized around the same center, which is at the same UV of
+// both. Its corners reach past the corners of the eye and repeat its edges.
+//
+// A distance r' of the compressed eye is at r = scale * r' + curve * max(r' - radius / scale, 0)^2
+// of the eye, scale keeping the center at full resolution and curve bringing the edges of the
+// compressed eye to the edges of the eye. See CompressedToTextureUV in FoveatedRendering.hlsli,
+// ffr.comp and stream.wgsl of the client, which inverts it.
+struct RadialFoveation {
+    float radius;
+    float scale;
+    float curve;
+};
+
+// Of the settings
+RadialFoveation GetRadialFoveation();
+
+// Eye UV of the foveation center along an axis, for a center shift from -1 to 1
+float RadialFoveationCenter(float shift, float radius);
+
+// Eye UV at an eye UV of the compressed eye, the inverse of the compression. The shifts are the
+// ones of the eye, mirrored horizontally for the right eye like its UVs.
+void RadialCompressedToEyeUv(
+    const RadialFoveation& foveation, float shiftX, float shiftY, float& u, float& v
+);
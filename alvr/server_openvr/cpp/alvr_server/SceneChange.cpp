@@ -0,0 +1,56 @@
+#include "SceneChange.h"
+
+#include <stdlib.h>
+
+namespace {
+
+const uint32_t HISTOGRAM_BINS = 32;
+// Both must be exceeded, a fade or a fast head turn only exceeds one of them
+const float CUT_MEAN_DIFFERENCE = 24.f;
+const float CUT_HISTOGRAM_DIFFERENCE = 0.5f;
+
+} // namespace
+
+bool SceneChangeDetector::Update(
+    const uint8_t* pixels, size_t pitch, uint32_t width, uint32_t rows, uint32_t bytesPerPixel
+) {
+    bool hasPrevious = width == m_width && rows == m_height;
+    m_luma.resize(width * rows);
+    std::vector<uint32_t> histogram(HISTOGRAM_BINS);
+
+    uint64_t difference = 0;
+    for (uint32_t y = 0; y < rows; y++) {
+        const uint8_t* row = pixels + y * pitch;
+        uint8_t* previous = &m_luma[y * width];
+        for (uint32_t x = 0; x < width; x++) {
+            int luma;
+            if (bytesPerPixel == 1) {
+                luma = row[x];
+            } else {
+                // BT.709 weights of B, G and R, in 1/256
+                const uint8_t* bgra = row + x * bytesPerPixel;
+                luma = (bgra[0] * 18 + bgra[1] * 183 + bgra[2] * 55) >> 8;
+            }
+            difference += abs(luma - previous[x]);
+            previous[x] = (uint8_t)luma;
+            histogram[luma * HISTOGRAM_BINS / 256]++;
+        }
+    }
+
+    uint32_t pixelCount = width * rows;
+    m_stats = {};
+    if (hasPrevious && pixelCount > 0) {
+        uint64_t moved = 0;
+        for (uint32_t i = 0; i < HISTOGRAM_BINS; i++) {
+            moved += abs((int64_t)histogram[i] - (int64_t)m_histogram[i]);
+        }
+        m_stats.meanDifference = (float)difference / pixelCount;
+        m_stats.histogramDifference = moved / 2.f / pixelCount;
+    }
+    m_histogram = std::move(histogram);
+    m_width = width;
+    m_height = rows;
+
+    return m_stats.meanDifference > CUT_MEAN_DIFFERENCE
+        && m_stats.histogramDifference > CUT_HISTOGRAM_DIFFERENCE;
+}
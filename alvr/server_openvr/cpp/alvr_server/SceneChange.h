@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// Scene cuts, like a menu opening or a teleport, are found on the downscaled copies of the frames
+// made for alvr_server/StaticFrames.h. The first frame of the new scene is encoded as an IDR frame
+// instead of an oversized P-frame predicted from unrelated content.
+
+// Statistics of a frame copy against the copy of the previous frame
+struct SceneStats {
+    // Mean absolute luma difference, from 0 to 255
+    float meanDifference;
+    // Fraction of the pixels that would have to change luma bin to turn the luma histogram of the
+    // previous frame into this one, from 0 to 1. Head motion moves the content but keeps it.
+    float histogramDifference;
+};
+
+class SceneChangeDetector {
+public:
+    // True if the rows x width copy starts a new scene, bytesPerPixel is 1 for luma and 4 for
+    // BGRA. It is compared to the copy given to the previous call, the first frame and the first
+    // one after a resize are not cuts.
+    bool Update(
+        const uint8_t* pixels, size_t pitch, uint32_t width, uint32_t rows, uint32_t bytesPerPixel
+    );
+
+    // Of the last update
+    const SceneStats& GetStats() const { return m_stats; }
+
+private:
+    std::vector<uint8_t> m_luma;
+    std::vector<uint32_t> m_histogram;
+    uint32_t m_width = 0;
+    uint32_t m_height = 0;
+    SceneStats m_stats = {};
+};
@@ -0,0 +1,81 @@
+#include "StartupTimeline.h"
+
+#include "Logger.h"
+#include "Utils.h"
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+namespace {
+
+struct Milestone {
+    std::string name;
+    uint64_t durationNs;
+};
+
+std::mutex g_mutex;
+// Read without the lock by StartupTimelineFinish, which is called for every frame
+std::atomic<bool> g_running = false;
+uint64_t g_beginNs = 0;
+uint64_t g_lastNs = 0;
+std::vector<Milestone> g_milestones;
+
+void record(const std::string& name, uint64_t nowNs) {
+    g_milestones.push_back({ name, nowNs - g_lastNs });
+    g_lastNs = nowNs;
+}
+
+} // namespace
+
+void StartupTimelineBegin() {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    g_running = true;
+    g_beginNs = GetSteadyTimeNs();
+    g_lastNs = g_beginNs;
+    g_milestones.clear();
+}
+
+void StartupMilestone(const std::string& name) {
+    if (!g_running) {
+        return;
+    }
+    uint64_t now = GetSteadyTimeNs();
+    std::lock_guard<std::mutex> lock(g_mutex);
+    if (!g_running) {
+        return;
+    }
+    // Keeps the line splittable on spaces, backend names have them
+    std::string key = name;
+    std::replace(key.begin(), key.end(), ' ', '_');
+    for (const Milestone& milestone : g_milestones) {
+        if (milestone.name == key) {
+            return;
+        }
+    }
+    record(key, now);
+}
+
+void StartupTimelineFinish() {
+    if (!g_running) {
+        return;
+    }
+    uint64_t now = GetSteadyTimeNs();
+    std::string breakdown;
+    {
+        std::lock_guard<std::mutex> lock(g_mutex);
+        if (!g_running) {
+            return;
+        }
+        g_running = false;
+        record("first_frame", now);
+
+        for (const Milestone& milestone : g_milestones) {
+            breakdown += " " + milestone.name + "="
+                + std::to_string(milestone.durationNs / 1'000'000);
+        }
+    }
+    Info(
+        "Startup %llu ms:%s", (unsigned long long)((now - g_beginNs) / 1'000'000), breakdown.c_str()
+    );
+}
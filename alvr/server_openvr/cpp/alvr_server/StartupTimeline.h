@@ -0,0 +1,19 @@
+#pragma once
+
+#include <string>
+
+// Times the steps from InitializeStreaming to the first encoded frame, to tell which one makes a
+// stream slow to show its first image. Each milestone records the time since the previous one, the
+// breakdown of the session is logged as one line when the first frame reaches the network side:
+// "Startup 3412 ms: devices=40 accept=1210 init_packet=2 ...". Milestones of steps that are done
+// again during a session, like encoder rebuilds, are not recorded once the timeline is finished.
+
+// Starts the timeline of a session, dropping the milestones of the previous one
+void StartupTimelineBegin();
+
+// Nothing before StartupTimelineBegin, once the first frame was recorded or if the session already
+// has the milestone, so that the steps of every frame can mark themselves
+void StartupMilestone(const std::string& name);
+
+// Records the first frame and logs the breakdown, once per session
+void StartupTimelineFinish();
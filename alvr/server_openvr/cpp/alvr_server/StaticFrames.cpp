@@ -0,0 +1,51 @@
+#include "StaticFrames.h"
+
+#include <stdlib.h>
+
+namespace {
+const int STATIC_FRAME_TOLERANCE = 2;
+}
+
+bool StaticFramesMatch(
+    const uint8_t* a, size_t pitchA, const uint8_t* b, size_t pitchB, size_t rowBytes, uint32_t rows
+) {
+    for (uint32_t y = 0; y < rows; y++) {
+        const uint8_t* rowA = a + y * pitchA;
+        const uint8_t* rowB = b + y * pitchB;
+        for (size_t x = 0; x < rowBytes; x++) {
+            if (abs(rowA[x] - rowB[x]) > STATIC_FRAME_TOLERANCE) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+void FindStaticBlocks(
+    const uint8_t* a,
+    size_t pitchA,
+    const uint8_t* b,
+    size_t pitchB,
+    uint32_t width,
+    uint32_t height,
+    uint32_t bytesPerPixel,
+    StaticBlocks& blocks
+) {
+    blocks.cells.resize(width * height);
+    blocks.width = width;
+    blocks.height = height;
+    for (uint32_t y = 0; y < height; y++) {
+        const uint8_t* rowA = a + y * pitchA;
+        const uint8_t* rowB = b + y * pitchB;
+        for (uint32_t x = 0; x < width; x++) {
+            uint8_t unchanged = 1;
+            for (uint32_t i = x * bytesPerPixel; i < (x + 1) * bytesPerPixel; i++) {
+                if (abs(rowA[i] - rowB[i]) > STATIC_FRAME_TOLERANCE) {
+                    unchanged = 0;
+                    break;
+                }
+            }
+            blocks.cells[y * width + x] = unchanged;
+        }
+    }
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// Frames repeating the last encoded frame are not encoded, the client keeps showing that frame.
+// Nothing is sent while a game is stalled or shows a still loading screen. A frame repeats the last
+// encoded one if it was rendered for the same pose and a downscaled copy of it matches the one of
+// that frame. Comparing the pixels keeps overlays drawn over a stalled game, like the dashboard,
+// updating.
+
+// Downscale factor of the compared copies
+const uint32_t STATIC_FRAME_SCALE = 8;
+
+// True if the rows x rowBytes of the downscaled copies a and b differ by at most a few levels per
+// byte. The tolerance covers dithering, not changes.
+bool StaticFramesMatch(
+    const uint8_t* a, size_t pitchA, const uint8_t* b, size_t pitchB, size_t rowBytes, uint32_t rows
+);
+
+// The pixels of a downscaled copy that match the copy of the last encoded frame, for frames that
+// repeat its pose but not all of its pixels, like a menu or the desktop over a stalled game. The
+// encoders code the blocks of the frame under them as skipped, see FoveatedQpMap.
+struct StaticBlocks {
+    // width x height in raster order, nonzero where the frame didn't change. A width of 0 if
+    // unknown.
+    std::vector<uint8_t> cells;
+    uint32_t width = 0;
+    uint32_t height = 0;
+};
+
+// Compares the width x height pixels of bytesPerPixel of the downscaled copies a and b with the
+// tolerance of StaticFramesMatch
+void FindStaticBlocks(
+    const uint8_t* a,
+    size_t pitchA,
+    const uint8_t* b,
+    size_t pitchB,
+    uint32_t width,
+    uint32_t height,
+    uint32_t bytesPerPixel,
+    StaticBlocks& blocks
+);
@@ -0,0 +1,14 @@
+#include "ThreadScheduling.h"
+
+#include "Logger.h"
+#include "Settings.h"
+
+void ApplyStreamingThreadScheduling(const char* name) {
+    const Settings* settings = Settings_Instance();
+    if (!settings->m_threadScheduling) {
+        return;
+    }
+    if (!ApplyThreadScheduling((MmcssTask)settings->m_mmcssTask, settings->m_reservedCores)) {
+        Warn("Failed to apply the thread scheduling settings to the %s thread\n", name);
+    }
+}
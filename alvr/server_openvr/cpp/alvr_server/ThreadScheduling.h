@@ -0,0 +1,102 @@
+#pragma once
+
+#include <algorithm>
+#include <stdint.h>
+#include <thread>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <avrt.h>
+#pragma comment(lib, "avrt.lib")
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Scheduling of the threads a frame goes through from the vsync to the encoded frame, which a game
+// loading all the cores would otherwise preempt. Header only, the Vulkan layer applies it to its
+// vsync and page flip threads too.
+
+// MmcssTask values
+enum class MmcssTask : uint32_t {
+    ProAudio = 0,
+    Playback = 1,
+};
+
+// Applies the scheduling to the calling thread. On Windows it is registered with the MMCSS task,
+// on Linux it gets SCHED_RR, or the lowest nice value allowed without the rights for it. With
+// reservedCores above 0 it is pinned to that many logical cores counted from the last one. False
+// if a part of it couldn't be applied, the rest is still applied.
+inline bool ApplyThreadScheduling(MmcssTask mmcssTask, uint32_t reservedCores) {
+    bool applied = true;
+    uint32_t cores = std::thread::hardware_concurrency();
+
+#ifdef _WIN32
+    // The registration is kept for the lifetime of the thread
+    DWORD taskIndex = 0;
+    HANDLE task = AvSetMmThreadCharacteristicsW(
+        mmcssTask == MmcssTask::Playback ? L"Playback" : L"Pro Audio", &taskIndex
+    );
+    if (task == NULL || !AvSetMmThreadPriority(task, AVRT_PRIORITY_HIGH)) {
+        applied = false;
+    }
+
+    // An affinity mask only covers the processor group of the thread
+    cores = std::min<uint32_t>(cores, 64);
+    if (reservedCores > 0 && cores > 0) {
+        uint32_t count = std::min(reservedCores, cores);
+        DWORD_PTR mask = 0;
+        for (uint32_t core = cores - count; core < cores; core++) {
+            mask |= (DWORD_PTR)1 << core;
+        }
+        if (SetThreadAffinityMask(GetCurrentThread(), mask) == 0) {
+            applied = false;
+        }
+    }
+#elif defined(__linux__)
+    (void)mmcssTask;
+
+    // Below the interrupt threads of the kernel, which run at 50
+    sched_param param = {};
+    param.sched_priority = 10;
+    if (pthread_setschedparam(pthread_self(), SCHED_RR, &param) != 0) {
+        // The nice value of a thread is set through its thread id. Without CAP_SYS_NICE the lowest
+        // one allowed is 20 - RLIMIT_NICE.
+        pid_t tid = (pid_t)syscall(SYS_gettid);
+        rlimit limit = {};
+        int nice = 0;
+        if (getrlimit(RLIMIT_NICE, &limit) == 0) {
+            nice = 20 - (int)std::min<rlim_t>(limit.rlim_cur, 40);
+        }
+        if (nice >= 0 || setpriority(PRIO_PROCESS, tid, nice) != 0) {
+            applied = false;
+        }
+    }
+
+    if (reservedCores > 0 && cores > 0) {
+        uint32_t count = std::min(reservedCores, cores);
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (uint32_t core = cores - count; core < cores; core++) {
+            CPU_SET(core, &set);
+        }
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+            applied = false;
+        }
+    }
+#else
+    (void)mmcssTask;
+    (void)reservedCores;
+    (void)cores;
+    applied = false;
+#endif
+
+    return applied;
+}
+
+// Applies the thread scheduling settings to the calling thread of the server if they are enabled,
+// name is logged if they can't be applied
+void ApplyStreamingThreadScheduling(const char* name);
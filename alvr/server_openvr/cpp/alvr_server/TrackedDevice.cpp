@@ -26,54 +26,88 @@ std::string TrackedDevice::get_serial_number() {
     return std::string(&buffer[0]);
 }
 
-void TrackedDevice::set_prop(FfiOpenvrProperty prop) {
-    if (this->object_id == vr::k_unTrackedDeviceIndexInvalid) {
+void PropertyBatch::Set(
+    vr::ETrackedDeviceProperty prop, const void* value, uint32_t size, vr::PropertyTypeTag_t tag
+) {
+    auto write = vr::PropertyWrite_t {};
+    write.prop = prop;
+    write.writeType = vr::PropertyWrite_Set;
+    write.unBufferSize = size;
+    write.unTag = tag;
+    m_writes.push_back(write);
+
+    const uint8_t* bytes = (const uint8_t*)value;
+    m_values.emplace_back(bytes, bytes + size);
+}
+
+void PropertyBatch::Write(vr::PropertyContainerHandle_t container) {
+    if (m_writes.empty()) {
         return;
     }
+    // The value buffers don't move once added, but the writes are only pointed at them here
+    for (size_t i = 0; i < m_writes.size(); i++) {
+        m_writes[i].pvBuffer = m_values[i].data();
+    }
+
+    vr::VRPropertiesRaw()->WritePropertyBatch(
+        container, m_writes.data(), (uint32_t)m_writes.size()
+    );
 
-    auto key = (vr::ETrackedDeviceProperty)prop.key;
-
-    auto props = vr::VRProperties();
-
-    vr::ETrackedPropertyError result;
-
-    if (prop.type == FfiOpenvrPropertyType::Bool) {
-        result = props->SetBoolProperty(this->prop_container, key, prop.value.bool_);
-    } else if (prop.type == FfiOpenvrPropertyType::Float) {
-        result = props->SetFloatProperty(this->prop_container, key, prop.value.float_);
-    } else if (prop.type == FfiOpenvrPropertyType::Int32) {
-        result = props->SetInt32Property(this->prop_container, key, prop.value.int32);
-    } else if (prop.type == FfiOpenvrPropertyType::Uint64) {
-        result = props->SetUint64Property(this->prop_container, key, prop.value.uint64);
-    } else if (prop.type == FfiOpenvrPropertyType::Vector3) {
-        auto vec3 = vr::HmdVector3_t {};
-        vec3.v[0] = prop.value.vector3[0];
-        vec3.v[1] = prop.value.vector3[1];
-        vec3.v[2] = prop.value.vector3[2];
-        result = props->SetVec3Property(this->prop_container, key, vec3);
-    } else if (prop.type == FfiOpenvrPropertyType::Double) {
-        result = props->SetDoubleProperty(this->prop_container, key, prop.value.double_);
-    } else if (prop.type == FfiOpenvrPropertyType::String) {
-        result = props->SetStringProperty(this->prop_container, key, prop.value.string);
-    } else {
-        Error("Unreachable");
-        result = vr::TrackedProp_Success;
+    for (const auto& write : m_writes) {
+        if (write.eError != vr::TrackedProp_Success) {
+            Error(
+                "Error setting property %d: %s",
+                write.prop,
+                vr::VRPropertiesRaw()->GetPropErrorNameFromEnum(write.eError)
+            );
+        }
     }
+}
 
-    if (result != vr::TrackedProp_Success) {
-        Error(
-            "Error setting property %d: %s",
-            key,
-            vr::VRPropertiesRaw()->GetPropErrorNameFromEnum(result)
-        );
+void TrackedDevice::set_prop(FfiOpenvrProperty prop) { this->set_props(&prop, 1); }
+
+void TrackedDevice::set_props(const FfiOpenvrProperty* props, int count) {
+    if (this->object_id == vr::k_unTrackedDeviceIndexInvalid) {
+        return;
     }
 
-    auto event_data = vr::VREvent_Data_t {};
-    event_data.property.container = this->prop_container;
-    event_data.property.prop = key;
-    vr::VRServerDriverHost()->VendorSpecificEvent(
-        this->object_id, vr::VREvent_PropertyChanged, event_data, 0.
-    );
+    auto batch = PropertyBatch {};
+    for (int i = 0; i < count; i++) {
+        const FfiOpenvrProperty& prop = props[i];
+        auto key = (vr::ETrackedDeviceProperty)prop.key;
+
+        if (prop.type == FfiOpenvrPropertyType::Bool) {
+            batch.SetBool(key, prop.value.bool_);
+        } else if (prop.type == FfiOpenvrPropertyType::Float) {
+            batch.SetFloat(key, prop.value.float_);
+        } else if (prop.type == FfiOpenvrPropertyType::Int32) {
+            batch.SetInt32(key, prop.value.int32);
+        } else if (prop.type == FfiOpenvrPropertyType::Uint64) {
+            batch.SetUint64(key, prop.value.uint64);
+        } else if (prop.type == FfiOpenvrPropertyType::Vector3) {
+            auto vec3 = vr::HmdVector3_t {};
+            vec3.v[0] = prop.value.vector3[0];
+            vec3.v[1] = prop.value.vector3[1];
+            vec3.v[2] = prop.value.vector3[2];
+            batch.SetVec3(key, vec3);
+        } else if (prop.type == FfiOpenvrPropertyType::Double) {
+            batch.SetDouble(key, prop.value.double_);
+        } else if (prop.type == FfiOpenvrPropertyType::String) {
+            batch.SetString(key, prop.value.string);
+        } else {
+            Error("Unreachable");
+        }
+    }
+    batch.Write(this->prop_container);
+
+    for (int i = 0; i < count; i++) {
+        auto event_data = vr::VREvent_Data_t {};
+        event_data.property.container = this->prop_container;
+        event_data.property.prop = (vr::ETrackedDeviceProperty)props[i].key;
+        vr::VRServerDriverHost()->VendorSpecificEvent(
+            this->object_id, vr::VREvent_PropertyChanged, event_data, 0.
+        );
+    }
 }
 
 void TrackedDevice::submit_pose(vr::DriverPose_t pose) {
@@ -83,7 +117,7 @@ void TrackedDevice::submit_pose(vr::DriverPose_t pose) {
     );
 }
 
-bool TrackedDevice::register_device(bool await_activation) {
+bool TrackedDevice::register_device() {
     if (!vr::VRServerDriverHost()->TrackedDeviceAdded(
             this->get_serial_number().c_str(),
             this->device_class,
@@ -94,16 +128,16 @@ bool TrackedDevice::register_device(bool await_activation) {
         return false;
     }
 
-    if (await_activation) {
-        auto lock = std::unique_lock<std::mutex>(this->activation_mutex);
-        this->activation_condvar.wait_for(lock, std::chrono::seconds(1), [this] {
-            return this->activation_state != ActivationState::Pending;
-        });
+    return true;
+}
 
-        return this->activation_state == ActivationState::Success;
-    } else {
-        return true;
-    }
+bool TrackedDevice::await_activation(std::chrono::steady_clock::time_point deadline) {
+    auto lock = std::unique_lock<std::mutex>(this->activation_mutex);
+    this->activation_condvar.wait_until(lock, deadline, [this] {
+        return this->activation_state != ActivationState::Pending;
+    });
+
+    return this->activation_state == ActivationState::Success;
 }
 
 vr::EVRInitError TrackedDevice::Activate(vr::TrackedDeviceIndex_t object_id) {
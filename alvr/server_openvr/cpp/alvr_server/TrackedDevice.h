@@ -2,10 +2,14 @@
 
 #include "bindings.h"
 #include "openvr_driver_wrap.h"
+#include <chrono>
 #include <condition_variable>
 #include <map>
 #include <mutex>
 #include <optional>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
 
 enum class ActivationState {
     Pending,
@@ -13,14 +17,57 @@ enum class ActivationState {
     Failure,
 };
 
+// Property writes to one container, applied with a single WritePropertyBatch call instead of one
+// call per property. Values are copied when they are added.
+class PropertyBatch {
+public:
+    void Set(
+        vr::ETrackedDeviceProperty prop, const void* value, uint32_t size, vr::PropertyTypeTag_t tag
+    );
+    void SetBool(vr::ETrackedDeviceProperty prop, bool value) {
+        Set(prop, &value, sizeof(value), vr::k_unBoolPropertyTag);
+    }
+    void SetFloat(vr::ETrackedDeviceProperty prop, float value) {
+        Set(prop, &value, sizeof(value), vr::k_unFloatPropertyTag);
+    }
+    void SetInt32(vr::ETrackedDeviceProperty prop, int32_t value) {
+        Set(prop, &value, sizeof(value), vr::k_unInt32PropertyTag);
+    }
+    void SetUint64(vr::ETrackedDeviceProperty prop, uint64_t value) {
+        Set(prop, &value, sizeof(value), vr::k_unUint64PropertyTag);
+    }
+    void SetDouble(vr::ETrackedDeviceProperty prop, double value) {
+        Set(prop, &value, sizeof(value), vr::k_unDoublePropertyTag);
+    }
+    void SetVec3(vr::ETrackedDeviceProperty prop, const vr::HmdVector3_t& value) {
+        Set(prop, &value, sizeof(value), vr::k_unHmdVector3PropertyTag);
+    }
+    void SetString(vr::ETrackedDeviceProperty prop, const char* value) {
+        Set(prop, value, (uint32_t)strlen(value) + 1, vr::k_unStringPropertyTag);
+    }
+
+    // Writes the properties added so far and logs the ones that failed
+    void Write(vr::PropertyContainerHandle_t container);
+
+private:
+    std::vector<vr::PropertyWrite_t> m_writes;
+    std::vector<std::vector<uint8_t>> m_values;
+};
+
 class TrackedDevice : vr::ITrackedDeviceServerDriver {
 public:
     vr::TrackedDeviceIndex_t object_id = vr::k_unTrackedDeviceIndexInvalid;
     vr::PropertyContainerHandle_t prop_container = vr::k_ulInvalidPropertyContainer;
     vr::DriverPose_t last_pose;
 
-    bool register_device(bool await_activation);
+    // Adds the device to SteamVR, which activates it later. Devices registered together can then
+    // await their activations with the same deadline, so that they are activated in one go
+    bool register_device();
+    // True once the device is activated successfully, false if it failed or the deadline passed
+    bool await_activation(std::chrono::steady_clock::time_point deadline);
     void set_prop(FfiOpenvrProperty prop);
+    // Same as set_prop for each property, with a single property write
+    void set_props(const FfiOpenvrProperty* props, int count);
 
 protected:
     uint64_t device_id;
@@ -0,0 +1,202 @@
+#include "TrackingRecording.h"
+
+#include "Logger.h"
+#include "Utils.h"
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+
+namespace {
+
+const char MAGIC[8] = { 'A', 'L', 'V', 'R', 'T', 'R', 'K', '1' };
+// The file is flushed every so many records, so that a crash loses little of the session
+const int FLUSH_INTERVAL_RECORDS = 512;
+
+enum HandFlags : uint8_t {
+    HAND_MOTION = 1,
+    HAND_SKELETON = 2,
+    HAND_TRACKER = 4,
+    HAND_PREDICT_SKELETON = 8,
+};
+
+class Recorder {
+public:
+    Recorder() {
+        const char* path = getenv("ALVR_TRACKING_RECORD");
+        if (!path) {
+            return;
+        }
+        m_file = fopen(path, "wb");
+        if (!m_file) {
+            Error("Failed to open the tracking recording %s\n", path);
+            return;
+        }
+        setvbuf(m_file, nullptr, _IOFBF, 1 << 20);
+        fwrite(MAGIC, sizeof(MAGIC), 1, m_file);
+        Info("Recording the tracking input to %s\n", path);
+    }
+
+    bool Active() const { return m_file && m_enabled; }
+
+    // Begins a record, with the lock held until End
+    void Begin(TrackingRecordType type) {
+        m_mutex.lock();
+        uint64_t timeNs = GetSteadyTimeNs();
+        Write(&type, sizeof(type));
+        Write(&timeNs, sizeof(timeNs));
+    }
+
+    void Write(const void* data, size_t size) { fwrite(data, size, 1, m_file); }
+
+    void End() {
+        if (++m_records % FLUSH_INTERVAL_RECORDS == 0) {
+            fflush(m_file);
+        }
+        m_mutex.unlock();
+    }
+
+    void SetEnabled(bool enabled) { m_enabled = enabled; }
+
+private:
+    FILE* m_file = nullptr;
+    std::atomic<bool> m_enabled = true;
+    std::mutex m_mutex;
+    uint64_t m_records = 0;
+};
+
+Recorder& recorder() {
+    static Recorder recorder;
+    return recorder;
+}
+
+void writeHand(Recorder& recorder, const FfiHandData& hand) {
+    uint8_t flags = (hand.controllerMotion ? HAND_MOTION : 0)
+        | (hand.handSkeleton ? HAND_SKELETON : 0) | (hand.isHandTracker ? HAND_TRACKER : 0)
+        | (hand.predictHandSkeleton ? HAND_PREDICT_SKELETON : 0);
+    recorder.Write(&flags, sizeof(flags));
+    if (hand.controllerMotion) {
+        recorder.Write(hand.controllerMotion, sizeof(FfiDeviceMotion));
+    }
+    if (hand.handSkeleton) {
+        recorder.Write(hand.handSkeleton, sizeof(FfiHandSkeleton));
+    }
+}
+
+template <typename T> bool read(std::ifstream& file, T& value) {
+    file.read((char*)&value, sizeof(T));
+    return (bool)file;
+}
+
+bool readHand(std::ifstream& file, RecordedHand& hand) {
+    uint8_t flags;
+    if (!read(file, flags)) {
+        return false;
+    }
+    hand.hasMotion = flags & HAND_MOTION;
+    hand.hasSkeleton = flags & HAND_SKELETON;
+    hand.isHandTracker = flags & HAND_TRACKER;
+    hand.predictHandSkeleton = flags & HAND_PREDICT_SKELETON;
+    return (!hand.hasMotion || read(file, hand.motion))
+        && (!hand.hasSkeleton || read(file, hand.skeleton));
+}
+
+bool readRecord(std::ifstream& file, TrackingRecord& record) {
+    if (!read(file, record.type) || !read(file, record.timeNs)) {
+        return false;
+    }
+    switch (record.type) {
+    case TrackingRecordType::Tracking: {
+        uint32_t count;
+        if (!read(file, record.targetTimestampNs) || !read(file, record.controllerPoseTimeOffsetS)
+            || !read(file, record.headMotion) || !readHand(file, record.hands[0])
+            || !readHand(file, record.hands[1]) || !read(file, count)) {
+            return false;
+        }
+        record.bodyTrackerMotions.resize(count);
+        file.read((char*)record.bodyTrackerMotions.data(), count * sizeof(FfiDeviceMotion));
+        return (bool)file;
+    }
+    case TrackingRecordType::Buttons: {
+        uint32_t count;
+        if (!read(file, count)) {
+            return false;
+        }
+        record.buttons.resize(count);
+        file.read((char*)record.buttons.data(), count * sizeof(FfiButtonEntry));
+        return (bool)file;
+    }
+    case TrackingRecordType::ViewParams:
+        return read(file, record.viewParams);
+    }
+    return false;
+}
+
+} // namespace
+
+void RecordTracking(
+    uint64_t targetTimestampNs,
+    float controllerPoseTimeOffsetS,
+    const FfiDeviceMotion& headMotion,
+    const FfiHandData& leftHandData,
+    const FfiHandData& rightHandData,
+    const FfiDeviceMotion* bodyTrackerMotions,
+    int bodyTrackerMotionCount
+) {
+    Recorder& r = recorder();
+    if (!r.Active()) {
+        return;
+    }
+    uint32_t count = bodyTrackerMotionCount;
+    r.Begin(TrackingRecordType::Tracking);
+    r.Write(&targetTimestampNs, sizeof(targetTimestampNs));
+    r.Write(&controllerPoseTimeOffsetS, sizeof(controllerPoseTimeOffsetS));
+    r.Write(&headMotion, sizeof(headMotion));
+    writeHand(r, leftHandData);
+    writeHand(r, rightHandData);
+    r.Write(&count, sizeof(count));
+    r.Write(bodyTrackerMotions, count * sizeof(FfiDeviceMotion));
+    r.End();
+}
+
+void RecordButtons(const FfiButtonEntry* entries, int count) {
+    Recorder& r = recorder();
+    if (!r.Active()) {
+        return;
+    }
+    uint32_t entryCount = count;
+    r.Begin(TrackingRecordType::Buttons);
+    r.Write(&entryCount, sizeof(entryCount));
+    r.Write(entries, entryCount * sizeof(FfiButtonEntry));
+    r.End();
+}
+
+void RecordViewParams(const FfiViewParams params[2]) {
+    Recorder& r = recorder();
+    if (!r.Active()) {
+        return;
+    }
+    r.Begin(TrackingRecordType::ViewParams);
+    r.Write(params, 2 * sizeof(FfiViewParams));
+    r.End();
+}
+
+void SetTrackingRecordingEnabled(bool enabled) { recorder().SetEnabled(enabled); }
+
+bool ReadTrackingRecording(const std::string& path, std::vector<TrackingRecord>& records) {
+    std::ifstream file(path, std::ios::in | std::ios::binary);
+    char magic[sizeof(MAGIC)];
+    if (!file.read(magic, sizeof(magic)) || memcmp(magic, MAGIC, sizeof(MAGIC)) != 0) {
+        return false;
+    }
+
+    records.clear();
+    TrackingRecord record;
+    while (readRecord(file, record)) {
+        records.push_back(record);
+        record = {};
+    }
+    return true;
+}
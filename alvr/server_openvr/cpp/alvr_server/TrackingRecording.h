@@ -0,0 +1,71 @@
+#pragma once
+
+#include "bindings.h"
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Tracking input of the driver recorded to a file, to measure the tracking path offline, see
+// TrackingReplay.h. With ALVR_TRACKING_RECORD set to a file path, the SetTracking, SetButtons and
+// SetLocalViewParams calls of the session are appended to that file with their steady clock time.
+// The structs are written as they are in memory, so a recording is read on the platform that
+// wrote it.
+
+enum class TrackingRecordType : uint8_t {
+    Tracking = 1,
+    Buttons = 2,
+    ViewParams = 3,
+};
+
+// Do nothing unless recording
+void RecordTracking(
+    uint64_t targetTimestampNs,
+    float controllerPoseTimeOffsetS,
+    const FfiDeviceMotion& headMotion,
+    const FfiHandData& leftHandData,
+    const FfiHandData& rightHandData,
+    const FfiDeviceMotion* bodyTrackerMotions,
+    int bodyTrackerMotionCount
+);
+void RecordButtons(const FfiButtonEntry* entries, int count);
+void RecordViewParams(const FfiViewParams params[2]);
+// To keep a replay out of the recording, on by default
+void SetTrackingRecordingEnabled(bool enabled);
+
+// FfiHandData with the data its pointers refer to
+struct RecordedHand {
+    bool hasMotion = false;
+    FfiDeviceMotion motion = {};
+    bool hasSkeleton = false;
+    FfiHandSkeleton skeleton = {};
+    bool isHandTracker = false;
+    bool predictHandSkeleton = false;
+
+    // Points into this
+    FfiHandData Data() const {
+        return { hasMotion ? &motion : nullptr,
+                 hasSkeleton ? &skeleton : nullptr,
+                 isHandTracker,
+                 predictHandSkeleton };
+    }
+};
+
+// One recorded call, only the fields of its type are set
+struct TrackingRecord {
+    TrackingRecordType type;
+    uint64_t timeNs;
+
+    uint64_t targetTimestampNs = 0;
+    float controllerPoseTimeOffsetS = 0;
+    FfiDeviceMotion headMotion = {};
+    RecordedHand hands[2];
+    std::vector<FfiDeviceMotion> bodyTrackerMotions;
+
+    std::vector<FfiButtonEntry> buttons;
+
+    FfiViewParams viewParams[2] = {};
+};
+
+// False if path is not a recording. A truncated last record, from a driver that did not shut down
+// cleanly, is dropped.
+bool ReadTrackingRecording(const std::string& path, std::vector<TrackingRecord>& records);
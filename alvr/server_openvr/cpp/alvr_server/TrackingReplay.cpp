@@ -0,0 +1,338 @@
+#include "TrackingReplay.h"
+
+#ifdef ALVR_TRACKING_REPLAY
+
+#include "Logger.h"
+#include "TrackingRecording.h"
+#include "bindings.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <thread>
+
+namespace {
+
+// Counts the calls of the mocks, which are otherwise no-ops
+std::atomic<uint64_t> g_hostCalls = 0;
+
+class ReplayServerDriverHost : public vr::IVRServerDriverHost {
+public:
+    // Devices are activated right away, like SteamVR does after Init returns
+    bool TrackedDeviceAdded(
+        const char*, vr::ETrackedDeviceClass, vr::ITrackedDeviceServerDriver* pDriver
+    ) override {
+        g_hostCalls++;
+        pDriver->Activate(m_nextDeviceIndex++);
+        return true;
+    }
+    void TrackedDevicePoseUpdated(uint32_t, const vr::DriverPose_t&, uint32_t) override {
+        g_hostCalls++;
+    }
+    void VsyncEvent(double) override { g_hostCalls++; }
+    void VendorSpecificEvent(uint32_t, vr::EVREventType, const vr::VREvent_Data_t&, double)
+        override {
+        g_hostCalls++;
+    }
+    bool IsExiting() override { return false; }
+    bool PollNextEvent(vr::VREvent_t*, uint32_t) override { return false; }
+    void GetRawTrackedDevicePoses(float, vr::TrackedDevicePose_t*, uint32_t) override {
+        g_hostCalls++;
+    }
+    void RequestRestart(const char*, const char*, const char*, const char*) override { }
+    bool GetFrameTimings(vr::Compositor_FrameTiming*, uint32_t) override { return false; }
+    void SetDisplayEyeToHead(uint32_t, const vr::HmdMatrix34_t&, const vr::HmdMatrix34_t&)
+        override {
+        g_hostCalls++;
+    }
+    void SetDisplayProjectionRaw(uint32_t, const vr::HmdRect2_t&, const vr::HmdRect2_t&)
+        override {
+        g_hostCalls++;
+    }
+    void SetRecommendedRenderTargetSize(uint32_t, uint32_t, uint32_t) override { g_hostCalls++; }
+
+private:
+    // The HMD takes index 0 without being activated
+    vr::TrackedDeviceIndex_t m_nextDeviceIndex = 1;
+};
+
+class ReplayDriverInput : public vr::IVRDriverInput {
+public:
+    vr::EVRInputError CreateBooleanComponent(
+        vr::PropertyContainerHandle_t, const char*, vr::VRInputComponentHandle_t* pHandle
+    ) override {
+        return create(pHandle);
+    }
+    vr::EVRInputError UpdateBooleanComponent(vr::VRInputComponentHandle_t, bool, double) override {
+        return update();
+    }
+    vr::EVRInputError CreateScalarComponent(
+        vr::PropertyContainerHandle_t,
+        const char*,
+        vr::VRInputComponentHandle_t* pHandle,
+        vr::EVRScalarType,
+        vr::EVRScalarUnits
+    ) override {
+        return create(pHandle);
+    }
+    vr::EVRInputError UpdateScalarComponent(vr::VRInputComponentHandle_t, float, double) override {
+        return update();
+    }
+    vr::EVRInputError CreateHapticComponent(
+        vr::PropertyContainerHandle_t, const char*, vr::VRInputComponentHandle_t* pHandle
+    ) override {
+        return create(pHandle);
+    }
+    vr::EVRInputError CreateSkeletonComponent(
+        vr::PropertyContainerHandle_t,
+        const char*,
+        const char*,
+        const char*,
+        vr::EVRSkeletalTrackingLevel,
+        const vr::VRBoneTransform_t*,
+        uint32_t,
+        vr::VRInputComponentHandle_t* pHandle
+    ) override {
+        return create(pHandle);
+    }
+    vr::EVRInputError UpdateSkeletonComponent(
+        vr::VRInputComponentHandle_t,
+        vr::EVRSkeletalMotionRange,
+        const vr::VRBoneTransform_t*,
+        uint32_t
+    ) override {
+        return update();
+    }
+    vr::EVRInputError CreatePoseComponent(
+        vr::PropertyContainerHandle_t, const char*, vr::VRInputComponentHandle_t* pHandle
+    ) override {
+        return create(pHandle);
+    }
+    vr::EVRInputError
+    UpdatePoseComponent(vr::VRInputComponentHandle_t, const vr::HmdMatrix34_t*, double) override {
+        return update();
+    }
+    vr::EVRInputError CreateEyeTrackingComponent(
+        vr::PropertyContainerHandle_t, const char*, vr::VRInputComponentHandle_t* pHandle
+    ) override {
+        return create(pHandle);
+    }
+    vr::EVRInputError UpdateEyeTrackingComponent(
+        vr::VRInputComponentHandle_t, const vr::VREyeTrackingData_t*, double
+    ) override {
+        return update();
+    }
+
+private:
+    vr::VRInputComponentHandle_t m_nextHandle = 1;
+
+    vr::EVRInputError create(vr::VRInputComponentHandle_t* pHandle) {
+        *pHandle = m_nextHandle++;
+        return vr::VRInputError_None;
+    }
+
+    vr::EVRInputError update() {
+        g_hostCalls++;
+        return vr::VRInputError_None;
+    }
+};
+
+// The device properties would otherwise be written to containers SteamVR does not know
+class ReplayProperties : public vr::IVRProperties {
+public:
+    vr::ETrackedPropertyError
+    ReadPropertyBatch(vr::PropertyContainerHandle_t, vr::PropertyRead_t* pBatch, uint32_t count)
+        override {
+        for (uint32_t i = 0; i < count; i++) {
+            pBatch[i].eError = vr::TrackedProp_UnknownProperty;
+        }
+        return vr::TrackedProp_Success;
+    }
+    vr::ETrackedPropertyError
+    WritePropertyBatch(vr::PropertyContainerHandle_t, vr::PropertyWrite_t* pBatch, uint32_t count)
+        override {
+        g_hostCalls++;
+        for (uint32_t i = 0; i < count; i++) {
+            pBatch[i].eError = vr::TrackedProp_Success;
+        }
+        return vr::TrackedProp_Success;
+    }
+    const char* GetPropErrorNameFromEnum(vr::ETrackedPropertyError) override { return "replay"; }
+    vr::PropertyContainerHandle_t TrackedDeviceToPropertyContainer(vr::TrackedDeviceIndex_t index
+    ) override {
+        return index + 1;
+    }
+};
+
+class ReplayDriverContext : public vr::IVRDriverContext {
+public:
+    explicit ReplayDriverContext(vr::IVRDriverContext* driverContext)
+        : m_driverContext(driverContext) { }
+
+    void* GetGenericInterface(const char* pchInterfaceVersion, vr::EVRInitError* peError) override {
+        if (peError) {
+            *peError = vr::VRInitError_None;
+        }
+        if (strcmp(pchInterfaceVersion, vr::IVRServerDriverHost_Version) == 0) {
+            return &m_host;
+        } else if (strcmp(pchInterfaceVersion, vr::IVRDriverInput_Version) == 0) {
+            return &m_input;
+        } else if (strcmp(pchInterfaceVersion, vr::IVRProperties_Version) == 0) {
+            return &m_properties;
+        }
+        return m_driverContext->GetGenericInterface(pchInterfaceVersion, peError);
+    }
+    vr::DriverHandle_t GetDriverHandle() override { return m_driverContext->GetDriverHandle(); }
+
+private:
+    vr::IVRDriverContext* m_driverContext;
+    ReplayServerDriverHost m_host;
+    ReplayDriverInput m_input;
+    ReplayProperties m_properties;
+};
+
+// Times of the calls of one entry point, in nanoseconds
+struct CallTimes {
+    const char* name;
+    std::vector<uint64_t> times;
+};
+
+std::vector<uint64_t> bodyTrackerIDs(const std::vector<TrackingRecord>& records) {
+    // The record with the most body trackers has all the slots of the session, in order
+    const TrackingRecord* widest = nullptr;
+    for (auto& record : records) {
+        if (record.type == TrackingRecordType::Tracking
+            && (!widest || record.bodyTrackerMotions.size() > widest->bodyTrackerMotions.size())) {
+            widest = &record;
+        }
+    }
+    std::vector<uint64_t> ids;
+    if (widest) {
+        for (auto& motion : widest->bodyTrackerMotions) {
+            ids.push_back(motion.deviceID);
+        }
+    }
+    return ids;
+}
+
+void replay(const TrackingRecord& record) {
+    switch (record.type) {
+    case TrackingRecordType::Tracking:
+        SetTracking(
+            record.targetTimestampNs,
+            record.controllerPoseTimeOffsetS,
+            record.headMotion,
+            record.hands[0].Data(),
+            record.hands[1].Data(),
+            record.bodyTrackerMotions.data(),
+            (int)record.bodyTrackerMotions.size()
+        );
+        break;
+    case TrackingRecordType::Buttons:
+        SetButtons(record.buttons.data(), (int)record.buttons.size());
+        break;
+    case TrackingRecordType::ViewParams:
+        SetLocalViewParams(record.viewParams);
+        break;
+    }
+}
+
+double percentileUs(const std::vector<uint64_t>& sorted, double quantile) {
+    return sorted[std::min(sorted.size() - 1, (size_t)(quantile * sorted.size()))] / 1000.0;
+}
+
+void writeCsv(const std::string& path, std::vector<CallTimes>& calls) {
+    std::ofstream file(path);
+    file << "call,count,mean_us,p50_us,p99_us,max_us\n";
+    for (auto& call : calls) {
+        if (call.times.empty()) {
+            continue;
+        }
+        std::sort(call.times.begin(), call.times.end());
+        uint64_t total = 0;
+        for (uint64_t time : call.times) {
+            total += time;
+        }
+        file << call.name << "," << call.times.size() << ","
+             << total / 1000.0 / call.times.size() << "," << percentileUs(call.times, 0.5) << ","
+             << percentileUs(call.times, 0.99) << "," << call.times.back() / 1000.0 << "\n";
+    }
+}
+
+} // namespace
+
+bool RunTrackingReplay(
+    const char* path,
+    vr::IVRDriverContext* context,
+    const CreateReplayDevices& createDevices,
+    const std::function<void()>& destroyDevices
+) {
+    std::vector<TrackingRecord> records;
+    if (!ReadTrackingRecording(path, records)) {
+        Error("Failed to read the tracking recording %s\n", path);
+        return false;
+    }
+    if (records.empty()) {
+        return true;
+    }
+
+    const char* rateString = getenv("ALVR_TRACKING_REPLAY_RATE");
+    double rate = rateString ? atof(rateString) : 1.0;
+    Info("Replaying %zu tracking records of %s at rate %g\n", records.size(), path, rate);
+
+    // The devices only see the mocks, and the IVRDriverLog of SteamVR through them
+    ReplayDriverContext replayContext(context);
+    vr::InitServerDriverContext(&replayContext);
+    SetTrackingRecordingEnabled(false);
+    g_hostCalls = 0;
+
+    createDevices(bodyTrackerIDs(records));
+
+    std::vector<CallTimes> calls = {
+        { "SetTracking", {} },
+        { "SetButtons", {} },
+        { "SetLocalViewParams", {} },
+    };
+    for (auto& call : calls) {
+        call.times.reserve(records.size());
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    uint64_t firstTimeNs = records[0].timeNs;
+    for (auto& record : records) {
+        if (rate > 0) {
+            std::this_thread::sleep_until(
+                start
+                + std::chrono::nanoseconds((uint64_t)((record.timeNs - firstTimeNs) / rate))
+            );
+        }
+
+        auto begin = std::chrono::steady_clock::now();
+        replay(record);
+        auto end = std::chrono::steady_clock::now();
+
+        calls[(int)record.type - 1].times.push_back(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count()
+        );
+    }
+
+    destroyDevices();
+
+    SetTrackingRecordingEnabled(true);
+    vr::InitServerDriverContext(context);
+
+    std::string csvPath = std::string(path) + ".csv";
+    writeCsv(csvPath, calls);
+    Info(
+        "Tracking replay done, %llu calls to the mocked interfaces, times written to %s\n",
+        (unsigned long long)g_hostCalls.load(),
+        csvPath.c_str()
+    );
+
+    return true;
+}
+
+#endif
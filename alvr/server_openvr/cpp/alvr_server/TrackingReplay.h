@@ -0,0 +1,33 @@
+#pragma once
+
+#ifdef ALVR_TRACKING_REPLAY
+
+#include "openvr_driver_wrap.h"
+#include <functional>
+#include <stdint.h>
+#include <vector>
+
+// Offline measurement of the tracking path. Builds with the tracking-replay feature define
+// ALVR_TRACKING_REPLAY, and with ALVR_TRACKING_REPLAY set to a recording of TrackingRecording.h
+// the driver replays it when SteamVR loads it, before any device is registered. The recorded calls
+// go through SetTracking, SetButtons and SetLocalViewParams, with SteamVR's IVRServerDriverHost,
+// IVRDriverInput and IVRProperties replaced by mocks that only count the calls, so that the time
+// measured is the one of the driver. The other interfaces are the ones of SteamVR.
+//
+// ALVR_TRACKING_REPLAY_RATE sets the speed of the replay relative to the recording, 1 by default,
+// and 0 replays the calls back to back. The per call times go to <recording>.csv.
+
+// Creates the devices the calls are replayed to, with the IDs of the body trackers of the
+// recording in the order SetTracking sends them
+using CreateReplayDevices = std::function<void(const std::vector<uint64_t>& bodyTrackerIDs)>;
+
+// Returns false if path could not be read. context is the one SteamVR passed to the driver, it is
+// the driver context again when this returns.
+bool RunTrackingReplay(
+    const char* path,
+    vr::IVRDriverContext* context,
+    const CreateReplayDevices& createDevices,
+    const std::function<void()>& destroyDevices
+);
+
+#endif
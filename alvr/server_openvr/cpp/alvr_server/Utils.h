@@ -24,6 +24,7 @@
 #include <math.h>
 
 #include "ALVR-common/packet_types.h"
+#include "PoseMath.h"
 #include "openvr_driver_wrap.h"
 
 const float DEG_TO_RAD = (float)(M_PI / 180.);
@@ -35,6 +36,22 @@ inline uint64_t GetTimestampUs() {
     return std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
 }
 
+// Monotonic time in ns, the domain of the FfiFrameTiming records
+inline uint64_t GetSteadyTimeNs() {
+    auto duration = std::chrono::steady_clock::now().time_since_epoch();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
+}
+
+// Encoding size for FfiDynamicEncoderParams::resolution_scale, kept even for 4:2:0 and never
+// larger than the nominal size the encoder buffers are allocated for
+inline uint32_t ScaleEncodingSize(uint32_t size, float scale) {
+    if (scale <= 0 || scale >= 1) {
+        return size;
+    }
+    uint32_t scaled = uint32_t(size * scale) & ~1u;
+    return scaled < 64 ? 64 : scaled;
+}
+
 #ifdef _WIN32
 inline std::wstring GetErrorStr(HRESULT hr) {
     wchar_t* s = NULL;
@@ -117,20 +134,13 @@ inline void HmdMatrix_SetIdentity(vr::HmdMatrix34_t* pMatrix) {
     pMatrix->m[2][3] = 0.f;
 }
 
+// Single quaternion form of posemath::QuatsToMats
 inline void
 HmdMatrix_QuatToMat(double w, double x, double y, double z, vr::HmdMatrix34_t* pMatrix) {
-    pMatrix->m[0][0] = (float)(1.0f - 2.0f * y * y - 2.0f * z * z);
-    pMatrix->m[0][1] = (float)(2.0f * x * y - 2.0f * z * w);
-    pMatrix->m[0][2] = (float)(2.0f * x * z + 2.0f * y * w);
-    pMatrix->m[0][3] = (float)(0.0f);
-    pMatrix->m[1][0] = (float)(2.0f * x * y + 2.0f * z * w);
-    pMatrix->m[1][1] = (float)(1.0f - 2.0f * x * x - 2.0f * z * z);
-    pMatrix->m[1][2] = (float)(2.0f * y * z - 2.0f * x * w);
-    pMatrix->m[1][3] = (float)(0.0f);
-    pMatrix->m[2][0] = (float)(2.0f * x * z - 2.0f * y * w);
-    pMatrix->m[2][1] = (float)(2.0f * y * z + 2.0f * x * w);
-    pMatrix->m[2][2] = (float)(1.0f - 2.0f * x * x - 2.0f * y * y);
-    pMatrix->m[2][3] = (float)(0.0f);
+    struct {
+        double x, y, z, w;
+    } q = { x, y, z, w };
+    posemath::QuatsToMats(&q, 1, pMatrix);
 }
 
 inline vr::HmdQuaternion_t EulerAngleToQuaternion(const double* yaw_pitch_roll) {
@@ -150,52 +160,6 @@ inline vr::HmdQuaternion_t EulerAngleToQuaternion(const double* yaw_pitch_roll)
     return q;
 }
 
-inline vr::HmdVector4_t Lerp(vr::HmdVector4_t& v1, vr::HmdVector4_t& v2, double lambda) {
-    vr::HmdVector4_t res;
-    res.v[0] = (float)((1 - lambda) * v1.v[0] + lambda * v2.v[0]);
-    res.v[1] = (float)((1 - lambda) * v1.v[1] + lambda * v2.v[1]);
-    res.v[2] = (float)((1 - lambda) * v1.v[2] + lambda * v2.v[2]);
-    res.v[3] = 1;
-
-    return res;
-}
-
-inline vr::HmdQuaternionf_t
-Slerp(vr::HmdQuaternionf_t& q1, vr::HmdQuaternionf_t& q2, double lambda) {
-    if (q1.w != q2.w || q1.x != q2.x || q1.y != q2.y || q1.z != q2.z) {
-        float dotproduct = q1.x * q2.x + q1.y * q2.y + q1.z * q2.z + q1.w * q2.w;
-        float theta, st, sut, sout, coeff1, coeff2;
-
-        // algorithm adapted from Shoemake's paper
-
-        theta = (float)acos(dotproduct);
-        if (theta < 0.0)
-            theta = -theta;
-
-        st = (float)sin(theta);
-        sut = (float)sin(lambda * theta);
-        sout = (float)sin((1 - lambda) * theta);
-        coeff1 = sout / st;
-        coeff2 = sut / st;
-
-        vr::HmdQuaternionf_t res;
-        res.w = coeff1 * q1.w + coeff2 * q2.w;
-        res.x = coeff1 * q1.x + coeff2 * q2.x;
-        res.y = coeff1 * q1.y + coeff2 * q2.y;
-        res.z = coeff1 * q1.z + coeff2 * q2.z;
-
-        float norm = res.w * res.w + res.x * res.x + res.y * res.y + res.z * res.z;
-        res.w /= norm;
-        res.x /= norm;
-        res.y /= norm;
-        res.z /= norm;
-
-        return res;
-    } else {
-        return q1;
-    }
-}
-
 // Sourced from https://mariogc.com/post/angular-velocity-quaternions/
 inline vr::HmdVector3d_t AngularVelocityBetweenQuats(
     const vr::HmdQuaternion_t& q1, const vr::HmdQuaternion_t& q2, double dt
@@ -7,20 +7,28 @@
 #include "platform/linux/CEncoder.h"
 #endif
 #include "Controller.h"
+#include "EncoderControl.h"
 #include "FakeViveTracker.h"
+#include "FrameDeadline.h"
 #include "HMD.h"
 #include "Logger.h"
 #include "Paths.h"
 #include "PoseHistory.h"
+#include "StartupTimeline.h"
 #include "TrackedDevice.h"
+#include "TrackingRecording.h"
+#include "TrackingReplay.h"
 #include "bindings.h"
 #include "driverlog.h"
 #include "openvr_driver_wrap.h"
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cmath>
 #include <cstring>
 #include <map>
 #include <optional>
+#include <thread>
 
 #ifdef __linux__
 #include "include/openvr_math.h"
@@ -41,6 +49,13 @@ void _SetChaperoneArea(float areaWidth, float areaHeight);
 vr::EVREventType VendorEvent_ALVRDriverResync
     = (vr::EVREventType)(vr::VREvent_VendorSpecific_Reserved_Start + ((vr::EVREventType)0xC0));
 
+// The driver host has no wait for events, they are polled
+const auto EVENT_POLL_INTERVAL = std::chrono::milliseconds(1);
+// Haptic events of a drain sent together, a longer burst is split
+const int MAX_HAPTICS_BATCH = 16;
+// Shared by the devices registered together at the stream start
+const auto DEVICE_ACTIVATION_TIMEOUT = std::chrono::seconds(1);
+
 static void load_debug_privilege(void) {
 #ifdef _WIN32
     const DWORD flags = TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY;
@@ -83,12 +98,18 @@ public:
     std::unique_ptr<Hmd> hmd;
     std::unique_ptr<Controller> left_controller, right_controller;
     std::unique_ptr<Controller> left_hand_tracker, right_hand_tracker;
+    // Body trackers, in the order of BODY_TRACKER_IDS on the Rust side
     std::vector<std::unique_ptr<FakeViveTracker>> generic_trackers;
     bool devices_initialized = false;
     bool shutdown_called = false;
 
     std::map<uint64_t, TrackedDevice*> tracked_devices;
 
+    // Drains the events instead of RunFrame, which SteamVR calls at the frame rate, so that the
+    // haptics don't wait for the next frame
+    std::thread event_thread;
+    std::atomic<bool> stop_events = false;
+
     virtual vr::EVRInitError Init(vr::IVRDriverContext* pContext) override {
         InitializeRuntime(); // sets up rust logging/runtime, keep first
         Debug("DriverProvider::Init");
@@ -96,25 +117,41 @@ public:
         VR_INIT_SERVER_DRIVER_CONTEXT(pContext);
         InitDriverLog(vr::VRDriverLog());
 
+#ifdef ALVR_TRACKING_REPLAY
+        if (const char* replayPath = getenv("ALVR_TRACKING_REPLAY")) {
+            RunTrackingReplay(
+                replayPath,
+                pContext,
+                [this](const std::vector<uint64_t>& bodyTrackerIDs) {
+                    CreateReplayDevices(bodyTrackerIDs);
+                },
+                [this] { DestroyDevices(); }
+            );
+        }
+#endif
+
         if (this->early_hmd_initialization) {
             auto hmd = new Hmd();
             // Note: we disable awaiting for Acivate() call. That will only be called after
             // IServerTrackedDeviceProvider::Init() (this function) returns.
-            hmd->register_device(false);
+            hmd->register_device();
             this->hmd = std::unique_ptr<Hmd>(hmd);
             this->tracked_devices.insert({ HEAD_ID, this->hmd.get() });
         }
 
+        this->event_thread = std::thread(&DriverProvider::DrainEvents, this);
+
         return vr::VRInitError_None;
     }
     virtual void Cleanup() override {
         Debug("DriverProvider::Cleanup");
 
-        this->left_hand_tracker.reset();
-        this->right_hand_tracker.reset();
-        this->left_controller.reset();
-        this->right_controller.reset();
-        this->hmd.reset();
+        this->stop_events = true;
+        if (this->event_thread.joinable()) {
+            this->event_thread.join();
+        }
+
+        DestroyDevices();
 
         CleanupDriverLog();
 
@@ -125,52 +162,139 @@ public:
         return vr::ITrackedDeviceServerDriver_Version;
     }
     virtual void RunFrame() override {
-        vr::VREvent_t event;
-        while (vr::VRServerDriverHost()->PollNextEvent(&event, sizeof(vr::VREvent_t))) {
-            if (event.eventType == vr::VREvent_Input_HapticVibration) {
-                Debug("DriverProvider: Received HapticVibration event");
-
-                vr::VREvent_HapticVibration_t haptics = event.data.hapticVibration;
-
-                uint64_t id = 0;
-                if (this->left_controller
-                    && haptics.containerHandle == this->left_controller->prop_container) {
-                    id = HAND_LEFT_ID;
-                } else if (this->right_controller
-                           && haptics.containerHandle == this->right_controller->prop_container) {
-                    id = HAND_RIGHT_ID;
-                }
+        if (vr::VRServerDriverHost()->IsExiting() && !shutdown_called) {
+            Debug("DriverProvider: Received shutdown event");
 
-                HapticsSend(id, haptics.fDurationSeconds, haptics.fFrequency, haptics.fAmplitude);
+            shutdown_called = true;
+            ShutdownRuntime();
+        }
+    }
+    virtual bool ShouldBlockStandbyMode() override { return false; }
+    virtual void EnterStandby() override { Debug("DriverProvider::EnterStandby"); }
+    virtual void LeaveStandby() override { Debug("DriverProvider::LeaveStandby"); }
+
+private:
+    void DrainEvents() {
+#ifdef _WIN32
+        bool fineTimer = false;
+#endif
+        FfiHaptics haptics[MAX_HAPTICS_BATCH];
+        while (!this->stop_events) {
+#ifdef _WIN32
+            // Sleeps of a millisecond instead of a scheduler tick. The finer timer keeps the CPU
+            // out of its deeper idle states, with m_powerSaving the haptics wait a tick instead.
+            bool wantFineTimer = !Settings_Instance()->m_powerSaving;
+            if (wantFineTimer != fineTimer) {
+                if (wantFineTimer) {
+                    timeBeginPeriod(1);
+                } else {
+                    timeEndPeriod(1);
+                }
+                fineTimer = wantFineTimer;
             }
+#endif
+            int hapticsCount = 0;
+            vr::VREvent_t event;
+            while (vr::VRServerDriverHost()->PollNextEvent(&event, sizeof(vr::VREvent_t))) {
+                if (event.eventType == vr::VREvent_Input_HapticVibration) {
+                    Debug("DriverProvider: Received HapticVibration event");
+
+                    vr::VREvent_HapticVibration_t vibration = event.data.hapticVibration;
+
+                    uint64_t id = 0;
+                    if (this->left_controller
+                        && vibration.containerHandle == this->left_controller->prop_container) {
+                        id = HAND_LEFT_ID;
+                    } else if (this->right_controller
+                               && vibration.containerHandle
+                                   == this->right_controller->prop_container) {
+                        id = HAND_RIGHT_ID;
+                    }
+
+                    haptics[hapticsCount++] = {
+                        id, vibration.fDurationSeconds, vibration.fFrequency, vibration.fAmplitude
+                    };
+                    if (hapticsCount == MAX_HAPTICS_BATCH) {
+                        HapticsSendBatch(haptics, hapticsCount);
+                        hapticsCount = 0;
+                    }
+                }
 #ifdef __linux__
-            else if (event.eventType == vr::VREvent_ChaperoneUniverseHasChanged
-                     || event.eventType == vr::VREvent_ChaperoneRoomSetupCommitted
-                     || event.eventType == vr::VREvent_ChaperoneFlushCache
-                     || event.eventType == vr::VREvent_ChaperoneSettingsHaveChanged
-                     || event.eventType == vr::VREvent_SeatedZeroPoseReset
-                     || event.eventType == vr::VREvent_StandingZeroPoseReset
-                     || event.eventType == vr::VREvent_SceneApplicationChanged
-                     || event.eventType == VendorEvent_ALVRDriverResync) {
-                if (hmd && hmd->m_poseHistory) {
-                    auto rawZeroPose = GetRawZeroPose();
-                    if (rawZeroPose != nullptr) {
-                        hmd->m_poseHistory->SetTransform(*rawZeroPose);
+                else if (event.eventType == vr::VREvent_ChaperoneUniverseHasChanged
+                         || event.eventType == vr::VREvent_ChaperoneRoomSetupCommitted
+                         || event.eventType == vr::VREvent_ChaperoneFlushCache
+                         || event.eventType == vr::VREvent_ChaperoneSettingsHaveChanged
+                         || event.eventType == vr::VREvent_SeatedZeroPoseReset
+                         || event.eventType == vr::VREvent_StandingZeroPoseReset
+                         || event.eventType == vr::VREvent_SceneApplicationChanged
+                         || event.eventType == VendorEvent_ALVRDriverResync) {
+                    if (hmd && hmd->m_poseHistory) {
+                        auto rawZeroPose = GetRawZeroPose();
+                        if (rawZeroPose != nullptr) {
+                            hmd->m_poseHistory->SetTransform(*rawZeroPose);
+                        }
                     }
                 }
+#endif
             }
+            if (hapticsCount > 0) {
+                HapticsSendBatch(haptics, hapticsCount);
+            }
+            std::this_thread::sleep_for(EVENT_POLL_INTERVAL);
+        }
+#ifdef _WIN32
+        if (fineTimer) {
+            timeEndPeriod(1);
+        }
 #endif
+    }
+
+    void DestroyDevices() {
+        this->left_hand_tracker.reset();
+        this->right_hand_tracker.reset();
+        this->left_controller.reset();
+        this->right_controller.reset();
+        this->hmd.reset();
+        this->generic_trackers.clear();
+    }
+
+#ifdef ALVR_TRACKING_REPLAY
+    // The devices of InitializeStreaming, registered to the mocks of the replay. The HMD is not
+    // activated, that would start the encoder.
+    void CreateReplayDevices(const std::vector<uint64_t>& bodyTrackerIDs) {
+        this->hmd = std::make_unique<Hmd>();
+        this->hmd->object_id = 0;
+
+        auto skeletonLevel = Settings_Instance()->m_useSeparateHandTrackers
+            ? vr::VRSkeletalTracking_Estimated
+            : vr::VRSkeletalTracking_Partial;
+        std::vector<TrackedDevice*> devices;
+        this->left_controller = std::make_unique<Controller>(HAND_LEFT_ID, skeletonLevel);
+        devices.push_back(this->left_controller.get());
+        this->right_controller = std::make_unique<Controller>(HAND_RIGHT_ID, skeletonLevel);
+        devices.push_back(this->right_controller.get());
+        if (Settings_Instance()->m_useSeparateHandTrackers) {
+            this->left_hand_tracker
+                = std::make_unique<Controller>(HAND_TRACKER_LEFT_ID, vr::VRSkeletalTracking_Full);
+            devices.push_back(this->left_hand_tracker.get());
+            this->right_hand_tracker
+                = std::make_unique<Controller>(HAND_TRACKER_RIGHT_ID, vr::VRSkeletalTracking_Full);
+            devices.push_back(this->right_hand_tracker.get());
+        }
+        for (uint64_t id : bodyTrackerIDs) {
+            this->generic_trackers.push_back(std::make_unique<FakeViveTracker>(id));
+            devices.push_back(this->generic_trackers.back().get());
         }
-        if (vr::VRServerDriverHost()->IsExiting() && !shutdown_called) {
-            Debug("DriverProvider: Received shutdown event");
 
-            shutdown_called = true;
-            ShutdownRuntime();
+        for (TrackedDevice* device : devices) {
+            device->register_device();
+        }
+        auto deadline = std::chrono::steady_clock::now() + DEVICE_ACTIVATION_TIMEOUT;
+        for (TrackedDevice* device : devices) {
+            device->await_activation(deadline);
         }
     }
-    virtual bool ShouldBlockStandbyMode() override { return false; }
-    virtual void EnterStandby() override { Debug("DriverProvider::EnterStandby"); }
-    virtual void LeaveStandby() override { Debug("DriverProvider::LeaveStandby"); }
+#endif
 } g_driver_provider;
 
 // bindings for Rust
@@ -187,6 +311,22 @@ const unsigned char* COLOR_CORRECTION_CSO_PTR;
 unsigned int COLOR_CORRECTION_CSO_LEN;
 const unsigned char* RGBTOYUV420_CSO_PTR;
 unsigned int RGBTOYUV420_CSO_LEN;
+const unsigned char* FRAME_RENDER_PS_LINEAR_CSO_PTR;
+unsigned int FRAME_RENDER_PS_LINEAR_CSO_LEN;
+const unsigned char* COLOR_CORRECTION_NO_SHARPENING_CSO_PTR;
+unsigned int COLOR_CORRECTION_NO_SHARPENING_CSO_LEN;
+const unsigned char* COLOR_CORRECTION_LUT_CSO_PTR;
+unsigned int COLOR_CORRECTION_LUT_CSO_LEN;
+const unsigned char* COMPRESS_AXIS_ALIGNED_LUT_CSO_PTR;
+unsigned int COMPRESS_AXIS_ALIGNED_LUT_CSO_LEN;
+const unsigned char* FRAME_RENDER_VS_FOVEATED_CSO_PTR;
+unsigned int FRAME_RENDER_VS_FOVEATED_CSO_LEN;
+const unsigned char* FRAME_RENDER_PS_FOVEATED_CSO_PTR;
+unsigned int FRAME_RENDER_PS_FOVEATED_CSO_LEN;
+const unsigned char* FRAME_RENDER_PS_FOVEATED_LINEAR_CSO_PTR;
+unsigned int FRAME_RENDER_PS_FOVEATED_LINEAR_CSO_LEN;
+const unsigned char* DEPTH_PLANE_CSO_PTR;
+unsigned int DEPTH_PLANE_CSO_LEN;
 
 const unsigned char* QUAD_SHADER_COMP_SPV_PTR;
 unsigned int QUAD_SHADER_COMP_SPV_LEN;
@@ -196,6 +336,36 @@ const unsigned char* FFR_SHADER_COMP_SPV_PTR;
 unsigned int FFR_SHADER_COMP_SPV_LEN;
 const unsigned char* RGBTOYUV420_SHADER_COMP_SPV_PTR;
 unsigned int RGBTOYUV420_SHADER_COMP_SPV_LEN;
+const unsigned char* COMPOSE_SHADER_COMP_SPV_PTR;
+unsigned int COMPOSE_SHADER_COMP_SPV_LEN;
+const unsigned char* DOWNSCALE_SHADER_COMP_SPV_PTR;
+unsigned int DOWNSCALE_SHADER_COMP_SPV_LEN;
+const unsigned char* MASK_SHADER_COMP_SPV_PTR;
+unsigned int MASK_SHADER_COMP_SPV_LEN;
+const unsigned char* DENOISE_SHADER_COMP_SPV_PTR;
+unsigned int DENOISE_SHADER_COMP_SPV_LEN;
+const unsigned char* REPROJECT_SHADER_COMP_SPV_PTR;
+unsigned int REPROJECT_SHADER_COMP_SPV_LEN;
+const unsigned char* SCALE_YUV420_SHADER_COMP_SPV_PTR;
+unsigned int SCALE_YUV420_SHADER_COMP_SPV_LEN;
+const unsigned char* RGBTONV12_SHADER_COMP_SPV_PTR;
+unsigned int RGBTONV12_SHADER_COMP_SPV_LEN;
+const unsigned char* QUAD_10BIT_SHADER_COMP_SPV_PTR;
+unsigned int QUAD_10BIT_SHADER_COMP_SPV_LEN;
+const unsigned char* COMPOSE_10BIT_SHADER_COMP_SPV_PTR;
+unsigned int COMPOSE_10BIT_SHADER_COMP_SPV_LEN;
+const unsigned char* DOWNSCALE_10BIT_SHADER_COMP_SPV_PTR;
+unsigned int DOWNSCALE_10BIT_SHADER_COMP_SPV_LEN;
+const unsigned char* RGBTOYUV420_10BIT_SHADER_COMP_SPV_PTR;
+unsigned int RGBTOYUV420_10BIT_SHADER_COMP_SPV_LEN;
+const unsigned char* SCALE_YUV420_10BIT_SHADER_COMP_SPV_PTR;
+unsigned int SCALE_YUV420_10BIT_SHADER_COMP_SPV_LEN;
+const unsigned char* RGBTOYUV420_HOST_SHADER_COMP_SPV_PTR;
+unsigned int RGBTOYUV420_HOST_SHADER_COMP_SPV_LEN;
+const unsigned char* COLOR_FP16_SHADER_COMP_SPV_PTR;
+unsigned int COLOR_FP16_SHADER_COMP_SPV_LEN;
+const unsigned char* COMPOSE_FP16_SHADER_COMP_SPV_PTR;
+unsigned int COMPOSE_FP16_SHADER_COMP_SPV_LEN;
 
 const char* g_sessionPath;
 const char* g_driverRootDir;
@@ -212,6 +382,7 @@ void CppInit(bool earlyHmdInitialization, Settings settings) {
     init_paths();
 
     g_settings = settings;
+    SetDebugLogEnabled(settings.m_debugServerImpl);
 
     load_debug_privilege();
 }
@@ -227,12 +398,16 @@ void* CppOpenvrEntryPoint(const char* interface_name, int* return_code) {
 }
 
 bool InitializeStreaming(Settings settings) {
+    StartupTimelineBegin();
     g_settings = settings;
+    SetDebugLogEnabled(settings.m_debugServerImpl);
+    // The client of the new connection doesn't have the decoder configuration yet
+    ResetVideoConfigNals();
 
     if (!g_driver_provider.devices_initialized) {
         if (!g_driver_provider.early_hmd_initialization) {
             auto hmd = new Hmd();
-            if (!hmd->register_device(false)) {
+            if (!hmd->register_device()) {
                 Error("Failed to register HMD");
                 return false;
             }
@@ -241,113 +416,95 @@ bool InitializeStreaming(Settings settings) {
         }
 
         // Note: for controllers, hands and trackers don't bail out if registration fails
+        std::unique_ptr<Controller> left_controller, right_controller;
+        std::unique_ptr<Controller> left_hand_tracker, right_hand_tracker;
         if (Settings_Instance()->m_enableControllers) {
             auto controllerSkeletonLevel = Settings_Instance()->m_useSeparateHandTrackers
                 ? vr::VRSkeletalTracking_Estimated
                 : vr::VRSkeletalTracking_Partial;
 
-            auto left_controller = new Controller(HAND_LEFT_ID, controllerSkeletonLevel);
-            if (left_controller->register_device(true)) {
-                g_driver_provider.left_controller = std::unique_ptr<Controller>(left_controller);
-                g_driver_provider.tracked_devices.insert(
-                    { HAND_LEFT_ID, g_driver_provider.left_controller.get() }
+            left_controller = std::make_unique<Controller>(HAND_LEFT_ID, controllerSkeletonLevel);
+            right_controller = std::make_unique<Controller>(HAND_RIGHT_ID, controllerSkeletonLevel);
+            if (Settings_Instance()->m_useSeparateHandTrackers) {
+                left_hand_tracker = std::make_unique<Controller>(
+                    HAND_TRACKER_LEFT_ID, vr::VRSkeletalTracking_Full
+                );
+                right_hand_tracker = std::make_unique<Controller>(
+                    HAND_TRACKER_RIGHT_ID, vr::VRSkeletalTracking_Full
                 );
             }
+        }
 
-            auto right_controller = new Controller(HAND_RIGHT_ID, controllerSkeletonLevel);
-            if (right_controller->register_device(true)) {
-                g_driver_provider.right_controller = std::unique_ptr<Controller>(right_controller);
-                g_driver_provider.tracked_devices.insert(
-                    { HAND_RIGHT_ID, g_driver_provider.right_controller.get() }
+        std::vector<std::pair<uint64_t, std::unique_ptr<FakeViveTracker>>> body_trackers;
+        if (Settings_Instance()->m_enableBodyTrackingFakeVive) {
+            std::vector<uint64_t> ids
+                = { BODY_CHEST_ID, BODY_HIPS_ID, BODY_LEFT_ELBOW_ID, BODY_RIGHT_ELBOW_ID };
+            if (Settings_Instance()->m_bodyTrackingHasLegs) {
+                ids.insert(
+                    ids.end(),
+                    { BODY_LEFT_KNEE_ID, BODY_LEFT_FOOT_ID, BODY_RIGHT_KNEE_ID, BODY_RIGHT_FOOT_ID }
                 );
             }
-
-            if (Settings_Instance()->m_useSeparateHandTrackers) {
-                auto left_hand_tracker
-                    = new Controller(HAND_TRACKER_LEFT_ID, vr::VRSkeletalTracking_Full);
-                if (left_hand_tracker->register_device(true)) {
-                    g_driver_provider.left_hand_tracker
-                        = std::unique_ptr<Controller>(left_hand_tracker);
-                    g_driver_provider.tracked_devices.insert(
-                        { HAND_TRACKER_LEFT_ID, g_driver_provider.left_hand_tracker.get() }
-                    );
-                }
-
-                auto right_hand_tracker
-                    = new Controller(HAND_TRACKER_RIGHT_ID, vr::VRSkeletalTracking_Full);
-                if (right_hand_tracker->register_device(true)) {
-                    g_driver_provider.right_hand_tracker
-                        = std::unique_ptr<Controller>(right_hand_tracker);
-                    g_driver_provider.tracked_devices.insert(
-                        { HAND_TRACKER_RIGHT_ID, g_driver_provider.right_hand_tracker.get() }
-                    );
-                }
+            for (uint64_t id : ids) {
+                body_trackers.push_back({ id, std::make_unique<FakeViveTracker>(id) });
             }
         }
 
-        if (Settings_Instance()->m_enableBodyTrackingFakeVive) {
-            auto chestTracker = std::make_unique<FakeViveTracker>(BODY_CHEST_ID);
-            if (chestTracker->register_device(true)) {
-                g_driver_provider.tracked_devices.insert({ BODY_CHEST_ID, chestTracker.get() });
-                g_driver_provider.generic_trackers.push_back(std::move(chestTracker));
+        // All the devices are added before any activation is awaited, so that SteamVR activates
+        // them in one go and the startup takes one activation round trip instead of one per device
+        auto add = [](auto& device) {
+            if (device && !device->register_device()) {
+                device.reset();
             }
+        };
+        add(left_controller);
+        add(right_controller);
+        add(left_hand_tracker);
+        add(right_hand_tracker);
+        for (auto& tracker : body_trackers) {
+            add(tracker.second);
+        }
 
-            auto waistTracker = std::make_unique<FakeViveTracker>(BODY_HIPS_ID);
-            if (waistTracker->register_device(true)) {
-                g_driver_provider.tracked_devices.insert({ BODY_HIPS_ID, waistTracker.get() });
-                g_driver_provider.generic_trackers.push_back(std::move(waistTracker));
+        auto deadline = std::chrono::steady_clock::now() + DEVICE_ACTIVATION_TIMEOUT;
+        auto activated = [&](auto& device) {
+            if (!device) {
+                return false;
             }
-
-            auto leftElbowTracker = std::make_unique<FakeViveTracker>(BODY_LEFT_ELBOW_ID);
-            if (leftElbowTracker->register_device(true)) {
-                g_driver_provider.tracked_devices.insert({ BODY_LEFT_ELBOW_ID,
-                                                           leftElbowTracker.get() });
-                g_driver_provider.generic_trackers.push_back(std::move(leftElbowTracker));
+            if (!device->await_activation(deadline)) {
+                // SteamVR keeps the device, which may still be activated later
+                (void)device.release();
+                return false;
             }
-
-            auto rightElbowTracker = std::make_unique<FakeViveTracker>(BODY_RIGHT_ELBOW_ID);
-            if (rightElbowTracker->register_device(true)) {
-                g_driver_provider.tracked_devices.insert({ BODY_RIGHT_ELBOW_ID,
-                                                           rightElbowTracker.get() });
-                g_driver_provider.generic_trackers.push_back(std::move(rightElbowTracker));
+            return true;
+        };
+        auto adopt_controller = [&](uint64_t id, auto& device, std::unique_ptr<Controller>& owner) {
+            if (activated(device)) {
+                owner = std::move(device);
+                g_driver_provider.tracked_devices.insert({ id, owner.get() });
             }
-
-            if (Settings_Instance()->m_bodyTrackingHasLegs) {
-                auto leftKneeTracker = std::make_unique<FakeViveTracker>(BODY_LEFT_KNEE_ID);
-                if (leftKneeTracker->register_device(true)) {
-                    g_driver_provider.tracked_devices.insert({ BODY_LEFT_KNEE_ID,
-                                                               leftKneeTracker.get() });
-                    g_driver_provider.generic_trackers.push_back(std::move(leftKneeTracker));
-                }
-
-                auto leftFootTracker = std::make_unique<FakeViveTracker>(BODY_LEFT_FOOT_ID);
-                if (leftFootTracker->register_device(true)) {
-                    g_driver_provider.tracked_devices.insert({ BODY_LEFT_FOOT_ID,
-                                                               leftFootTracker.get() });
-                    g_driver_provider.generic_trackers.push_back(std::move(leftFootTracker));
-                }
-
-                auto rightKneeTracker = std::make_unique<FakeViveTracker>(BODY_RIGHT_KNEE_ID);
-                if (rightKneeTracker->register_device(true)) {
-                    g_driver_provider.tracked_devices.insert({ BODY_RIGHT_KNEE_ID,
-                                                               rightKneeTracker.get() });
-                    g_driver_provider.generic_trackers.push_back(std::move(rightKneeTracker));
-                }
-
-                auto rightFootTracker = std::make_unique<FakeViveTracker>(BODY_RIGHT_FOOT_ID);
-                if (rightFootTracker->register_device(true)) {
-                    g_driver_provider.tracked_devices.insert({ BODY_RIGHT_FOOT_ID,
-                                                               rightFootTracker.get() });
-                    g_driver_provider.generic_trackers.push_back(std::move(rightFootTracker));
-                }
+        };
+        adopt_controller(HAND_LEFT_ID, left_controller, g_driver_provider.left_controller);
+        adopt_controller(HAND_RIGHT_ID, right_controller, g_driver_provider.right_controller);
+        adopt_controller(
+            HAND_TRACKER_LEFT_ID, left_hand_tracker, g_driver_provider.left_hand_tracker
+        );
+        adopt_controller(
+            HAND_TRACKER_RIGHT_ID, right_hand_tracker, g_driver_provider.right_hand_tracker
+        );
+        for (auto& tracker : body_trackers) {
+            if (activated(tracker.second)) {
+                g_driver_provider.tracked_devices.insert({ tracker.first, tracker.second.get() });
+                g_driver_provider.generic_trackers.push_back(std::move(tracker.second));
             }
         }
 
         g_driver_provider.devices_initialized = true;
+        StartupMilestone("devices");
     }
 
     if (g_driver_provider.hmd) {
         g_driver_provider.hmd->StartStreaming();
+        StartupMilestone("start_streaming");
     }
 
     return true;
@@ -357,16 +514,40 @@ void DeinitializeStreaming() {
     if (g_driver_provider.hmd) {
         g_driver_provider.hmd->StopStreaming();
     }
+    g_encoderControl.Reset();
+    g_frameDeadline.Reset();
 }
 
 void SendVSync() { vr::VRServerDriverHost()->VsyncEvent(0.0); }
 
+void SetDynamicEncoderParams(FfiDynamicEncoderParams params) { g_encoderControl.Update(params); }
+
+void SetMaxPoseAge(unsigned long long maxPoseAgeNs) { g_frameDeadline.SetMaxPoseAge(maxPoseAgeNs); }
+
 void RequestIDR() {
     if (g_driver_provider.hmd && g_driver_provider.hmd->m_encoder) {
         g_driver_provider.hmd->m_encoder->InsertIDR();
     }
 }
 
+void RequestRecovery() {
+    if (g_driver_provider.hmd && g_driver_provider.hmd->m_encoder) {
+        g_driver_provider.hmd->m_encoder->InsertRecovery();
+    }
+}
+
+void ReportLostFrame(unsigned long long lastReceivedTimestampNs) {
+    if (g_driver_provider.hmd && g_driver_provider.hmd->m_encoder) {
+        g_driver_provider.hmd->m_encoder->ReportLostFrame(lastReceivedTimestampNs);
+    }
+}
+
+void SetFoveationCenter(FfiFoveationCenter center) {
+    if (g_driver_provider.hmd && g_driver_provider.hmd->m_poseHistory) {
+        g_driver_provider.hmd->m_poseHistory->SetFoveationCenter(center);
+    }
+}
+
 void SetTracking(
     unsigned long long targetTimestampNs,
     float controllerPoseTimeOffsetS,
@@ -376,6 +557,17 @@ void SetTracking(
     const FfiDeviceMotion* bodyTrackerMotions,
     int bodyTrackerMotionCount
 ) {
+    RecordTracking(
+        targetTimestampNs,
+        controllerPoseTimeOffsetS,
+        headMotion,
+        leftHandData,
+        rightHandData,
+        bodyTrackerMotions,
+        bodyTrackerMotionCount
+    );
+
+    g_frameDeadline.OnPoseReceived(targetTimestampNs);
     if (g_driver_provider.hmd) {
         g_driver_provider.hmd->OnPoseUpdated(targetTimestampNs, headMotion);
     }
@@ -404,23 +596,20 @@ void SetTracking(
         );
     }
 
-    if (Settings_Instance()->m_enableBodyTrackingFakeVive) {
-        std::map<uint64_t, FfiDeviceMotion> motionsMap;
-        for (int i = 0; i < bodyTrackerMotionCount; i++) {
-            auto m = bodyTrackerMotions[i];
-            motionsMap.insert({ m.deviceID, m });
-        }
-
-        for (auto id : BODY_IDS) {
-            auto it = g_driver_provider.tracked_devices.find(id);
-            if (it != g_driver_provider.tracked_devices.end()) {
-                auto* maybeTracker = (FakeViveTracker*)it->second;
-                auto res = motionsMap.find(id);
-                auto* maybeMotion = res != motionsMap.end() ? &res->second : nullptr;
-
-                maybeTracker->OnPoseUpdated(targetTimestampNs, maybeMotion);
+    // The trackers are registered and the motions sent in the same body slot order, both
+    // skipping missing slots, so they pair up in one pass without lookups
+    int motionIdx = 0;
+    for (auto& tracker : g_driver_provider.generic_trackers) {
+        const FfiDeviceMotion* motion = nullptr;
+        for (int i = motionIdx; i < bodyTrackerMotionCount; i++) {
+            if (bodyTrackerMotions[i].deviceID == tracker->body_id) {
+                motion = &bodyTrackerMotions[i];
+                motionIdx = i + 1;
+                break;
             }
         }
+
+        tracker->OnPoseUpdated(targetTimestampNs, motion);
     }
 }
 
@@ -444,6 +633,10 @@ void SetOpenvrProperty(void* instancePtr, FfiOpenvrProperty prop) {
     ((TrackedDevice*)instancePtr)->set_prop(prop);
 }
 
+void SetOpenvrProperties(void* instancePtr, const FfiOpenvrProperty* props, int count) {
+    ((TrackedDevice*)instancePtr)->set_props(props, count);
+}
+
 void SetOpenvrPropByDeviceID(unsigned long long deviceID, FfiOpenvrProperty prop) {
     auto device_it = g_driver_provider.tracked_devices.find(deviceID);
 
@@ -458,6 +651,8 @@ void RegisterButton(void* instancePtr, unsigned long long buttonID) {
 }
 
 void SetLocalViewParams(const FfiViewParams params[2]) {
+    RecordViewParams(params);
+
     if (g_driver_provider.hmd) {
         g_driver_provider.hmd->SetViewParams(params);
     }
@@ -476,21 +671,22 @@ void SetBattery(unsigned long long deviceID, float gauge_value, bool is_plugged)
     }
 }
 
-void SetButton(unsigned long long buttonID, FfiButtonValue value) {
-    if (LEFT_CONTROLLER_BUTTON_MAPPING.find(buttonID) != LEFT_CONTROLLER_BUTTON_MAPPING.end()) {
-        if (g_driver_provider.left_controller) {
-            g_driver_provider.left_controller->SetButton(buttonID, value);
-        }
-        if (g_driver_provider.left_hand_tracker) {
-            g_driver_provider.left_hand_tracker->SetButton(buttonID, value);
-        }
-    } else if (RIGHT_CONTROLLER_BUTTON_MAPPING.find(buttonID)
-               != RIGHT_CONTROLLER_BUTTON_MAPPING.end()) {
-        if (g_driver_provider.right_controller) {
-            g_driver_provider.right_controller->SetButton(buttonID, value);
+void SetButtons(const FfiButtonEntry* entries, int count) {
+    RecordButtons(entries, count);
+
+    // Each controller only acts on the buttons registered on it, the ones of its hand
+    Controller* controllers[] = {
+        g_driver_provider.left_controller.get(),
+        g_driver_provider.left_hand_tracker.get(),
+        g_driver_provider.right_controller.get(),
+        g_driver_provider.right_hand_tracker.get(),
+    };
+    for (auto controller : controllers) {
+        if (controller == nullptr) {
+            continue;
         }
-        if (g_driver_provider.right_hand_tracker) {
-            g_driver_provider.right_hand_tracker->SetButton(buttonID, value);
+        for (int i = 0; i < count; i++) {
+            controller->SetButton(entries[i].id, entries[i].value);
         }
     }
 }
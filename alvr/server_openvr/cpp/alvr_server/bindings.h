@@ -43,6 +43,15 @@ struct FfiHandData {
     bool predictHandSkeleton;
 };
 
+// Foveated encoding center shift of each eye, from -1 to 1 like the settings. The right eye one is
+// mirrored horizontally.
+struct FfiFoveationCenter {
+    float leftShiftX;
+    float leftShiftY;
+    float rightShiftX;
+    float rightShiftY;
+};
+
 enum FfiOpenvrPropertyType {
     Bool,
     Float,
@@ -82,10 +91,105 @@ struct FfiButtonValue {
     };
 };
 
+struct FfiButtonEntry {
+    unsigned long long id;
+    FfiButtonValue value;
+};
+
 struct FfiDynamicEncoderParams {
     unsigned int updated;
     unsigned long long bitrate_bps;
     float framerate;
+    // Refresh rate the encoder runs at, which the stream can switch while streaming
+    float refresh_rate;
+    // Fraction of the nominal encoding resolution, 0 if not updated
+    float resolution_scale;
+    // Largest encoded frame, IDR frames included, 0 if not capped
+    unsigned long long max_frame_bytes;
+};
+
+struct FfiHaptics {
+    unsigned long long deviceID;
+    float duration_s;
+    float frequency;
+    float amplitude;
+};
+
+struct FfiStageTiming {
+    const char* name;
+    unsigned long long durationNs;
+};
+
+// Server side timeline of a frame, in monotonic ns, 0 for the points the encoder doesn't know
+struct FfiFrameTiming {
+    unsigned long long targetTimestampNs;
+    // Tracking of the pose the frame was rendered with
+    unsigned long long poseReceivedNs;
+    unsigned long long presentNs;
+    unsigned long long composeBeginNs;
+    unsigned long long composeEndNs;
+    unsigned long long encodeSubmitNs;
+    unsigned long long encodeCompleteNs;
+    unsigned long long firstNalSentNs;
+    unsigned long long lastNalSentNs;
+};
+
+enum FfiFrameType {
+    FRAME_TYPE_UNKNOWN,
+    FRAME_TYPE_IDR,
+    // Intra frame that doesn't reset the references, or an AV1 intra only frame
+    FRAME_TYPE_INTRA,
+    FRAME_TYPE_PREDICTED,
+    FRAME_TYPE_BIDIRECTIONAL,
+};
+
+// IDR frames the IDRScheduler was asked for and the ones it had encoded. The requests within the
+// minimum IDR interval share one IDR frame.
+struct FfiIdrStats {
+    unsigned int requested;
+    unsigned int issued;
+};
+
+// What the encoder reports about one frame, once all of it was output
+#define PRESENT_INTERVAL_BUCKETS 24
+#define PRESENT_INTERVAL_BUCKETS_PER_PERIOD 8
+
+struct FfiPresentPacingStats {
+    unsigned int arrivals;
+    unsigned int dropped;
+    unsigned int duplicates;
+    unsigned int late;
+    // Intervals between consecutive presents, in 1/PRESENT_INTERVAL_BUCKETS_PER_PERIOD of the vsync
+    // period. The last bucket also counts the longer ones.
+    unsigned int intervalBuckets[PRESENT_INTERVAL_BUCKETS];
+    // GPU times of the SteamVR compositor's presents, until the end of their rendering. Reported by
+    // the capture layer, on Linux. The bound ones took longer than a vsync period.
+    unsigned long long compositorGpuTimeSumNs;
+    unsigned int compositorGpuTimes;
+    unsigned int compositorGpuBound;
+};
+
+#define LOCK_WAIT_BUCKETS 20
+
+// Acquisitions of a named lock or event of the frame path, see LockStats.h
+struct FfiLockStats {
+    const char* name;
+    unsigned int acquisitions;
+    // Not free at the first try
+    unsigned int contended;
+    // Wait times in microseconds of all the acquisitions, under 1 in the first bucket and in
+    // [2^(i-1), 2^i) in the bucket i. The last bucket also counts the longer ones.
+    unsigned int waitBuckets[LOCK_WAIT_BUCKETS];
+};
+
+struct FfiEncodedFrameStats {
+    unsigned long long targetTimestampNs;
+    unsigned int sizeBytes;
+    // Average QP of the frame in the scale of the codec, negative if the encoder doesn't report it
+    float averageQp;
+    FfiFrameType frameType;
+    // From the submission of the frame to the encoder to the end of its bitstream, 0 if unknown
+    unsigned long long encodeTimeNs;
 };
 
 struct Settings {
@@ -94,7 +198,11 @@ struct Settings {
     unsigned int m_renderHeight;
     int m_recommendedTargetWidth;
     int m_recommendedTargetHeight;
+    // Lowest scale of the recommended render target size, 1 keeps it fixed
+    float m_dynamicResolutionMinScale;
     int m_nAdapterIndex;
+    // -1 to encode on the compositor adapter
+    int m_nEncodeAdapterIndex;
     char m_captureFrameDir[1024];
 
     bool m_enableFoveatedEncoding;
@@ -104,6 +212,19 @@ struct Settings {
     float m_foveationCenterShiftY;
     float m_foveationEdgeRatioX;
     float m_foveationEdgeRatioY;
+    // Radial instead of axis aligned compression of the periphery, see RadialFoveation.h
+    bool m_foveationRadial;
+    float m_foveationCenterRadius;
+    float m_foveationRadialEdgeRatio;
+    bool m_foveationFollowGaze;
+    // 0 if the encoder doesn't lower the quality of the periphery
+    unsigned int m_foveatedQpOffset;
+    // Average QP that the offset of the periphery is adapted to, 0 to keep m_foveatedQpOffset
+    unsigned int m_foveatedTargetQp;
+    // QP offset taken off the blocks that overlays cover, 0 to encode them like the rest
+    unsigned int m_overlayQpOffset;
+    // QP offset given at least to the blocks that repeat the last encoded frame, 0 to disable
+    unsigned int m_staticBlockQpOffset;
 
     bool m_enableColorCorrection;
     float m_brightness;
@@ -111,12 +232,21 @@ struct Settings {
     float m_saturation;
     float m_gamma;
     float m_sharpening;
+    // Size of the visible ellipse of the eyes relative to the eye images, 0 if not masked
+    float m_hiddenAreaMaskSize;
+    // Lanczos instead of bilinear when the frames are smaller than the game renders them
+    bool m_highQualityDownscaling;
+    // Largest weight of the previous frame in the temporal denoise pass, 0 if disabled
+    float m_temporalDenoiseStrength;
+    float m_temporalDenoiseTolerance;
 
     int m_codec;
     int m_h264Profile;
     bool m_use10bitEncoder;
     double m_encodingGamma;
     bool m_enableHdr;
+    // The compositor hands NV12 or P010 frames to the encoders, always with HDR
+    bool m_convertToYuv;
     bool m_forceHdrSrgbCorrection;
     bool m_clampHdrExtendedRange;
     bool m_enableAmfPreAnalysis;
@@ -125,18 +255,57 @@ struct Settings {
     bool m_useAmfPreproc;
     unsigned int m_amfPreProcSigma;
     unsigned int m_amfPreProcTor;
+    unsigned int m_vplAsyncDepth;
     unsigned int m_encoderQualityPreset;
     bool m_amdBitrateCorruptionFix;
     unsigned int m_nvencQualityPreset;
     unsigned int m_rateControlMode;
     bool m_fillerData;
+    // At least 1
+    unsigned int m_slicesPerFrame;
+    // HEVC and AV1 tiles, at least 1
+    unsigned int m_tileColumns;
+    unsigned int m_tileRows;
+    // From 1 to 3, frames of the top layer are not referenced
+    unsigned int m_temporalLayers;
+    bool m_skipStaticFrames;
+    bool m_sceneChangeDetection;
+    bool m_dropLateFrames;
+    // PostPresent waits for the next vsync of the headset
+    bool m_enforceServerFramePacing;
+    // Raised GPU scheduling priority of the compose and encode work
+    bool m_gpuPriority;
+    // Width of each view in the depth plane, 0 if disabled
+    unsigned int m_depthPlaneWidth;
+    // ApplyStreamingThreadScheduling parameters, see ThreadScheduling.h
+    bool m_threadScheduling;
+    unsigned int m_mmcssTask;
+    // The other fields are already set for it, the driver events are polled less finely then
+    bool m_powerSaving;
+    // 0 if the threads are not pinned
+    unsigned int m_reservedCores;
+    // Lowest resolution scale of the QualityGovernor, 0 if disabled
+    float m_adaptiveQualityMinScale;
+    // Whether the QualityGovernor also steps the refresh rate down below the minimum scale
+    bool m_adaptiveRefreshRate;
     unsigned int m_entropyCoding;
     bool m_forceSwEncoding;
     unsigned int m_swThreadCount;
+    // x265 and SVT-AV1, 0 threads for automatic
+    unsigned int m_swHevcThreadCount;
+    unsigned int m_swHevcSlices;
+    unsigned int m_swAv1ThreadCount;
+    // See NumaPlacement.h
+    bool m_swNumaPlacement;
+    bool m_useVulkanVideoEncoder;
+    // EncoderBackend value
+    unsigned int m_forceEncoderBackend;
 
     unsigned int m_nvencTuningPreset;
     unsigned int m_nvencMultiPass;
     unsigned int m_nvencAdaptiveQuantizationMode;
+    // NV_ENC_SPLIT_ENCODE_MODE value, 0 for automatic
+    unsigned int m_nvencSplitEncodeMode;
     long long m_nvencLowDelayKeyFrameScale;
     long long m_nvencRefreshRate;
     bool m_nvencEnableIntraRefresh;
@@ -151,19 +320,36 @@ struct Settings {
     long long m_nvencRcMaxBitrate;
     long long m_nvencRcAverageBitrate;
     bool m_nvencEnableWeightedPrediction;
+    bool m_nvencHeadMotionHints;
 
     unsigned long long m_minimumIdrIntervalMs;
+    // 0 if lost frames are repaired with IDR frames only
+    unsigned int m_intraRefreshRecoveryFrames;
+    bool m_refFrameInvalidation;
 
     bool m_enableViveTrackerProxy = false;
     bool m_trackingRefOnly = false;
     bool m_enableLinuxVulkanAsyncCompute;
     bool m_enableLinuxAsyncReprojection;
+    // Rotates frames to the newest head pose right before composing them
+    bool m_enableLateLatching;
+    unsigned int m_linuxEncoderOutputImages;
+    // Fewer staging and encoder buffers, for GPUs low on memory
+    bool m_compactGpuMemory;
+    // VAAPI encodes NV12 surfaces written by RgbToNv12 instead of video processing blits
+    bool m_vaapiShaderConversion;
+    // 0 when the secondary video stream is disabled
+    unsigned int m_secondaryStreamHeight;
+    unsigned int m_secondaryStreamBitrateMbps;
 
     bool m_enableControllers;
     bool m_controllerIsTracker = false;
     bool m_enableBodyTrackingFakeVive = false;
     bool m_bodyTrackingHasLegs = false;
     bool m_useSeparateHandTrackers = false;
+
+    // The server_impl debug group, always false in release builds that compile the logs out
+    bool m_debugServerImpl;
 };
 
 extern "C" const unsigned char* FRAME_RENDER_VS_CSO_PTR;
@@ -178,15 +364,69 @@ extern "C" const unsigned char* COLOR_CORRECTION_CSO_PTR;
 extern "C" unsigned int COLOR_CORRECTION_CSO_LEN;
 extern "C" const unsigned char* RGBTOYUV420_CSO_PTR;
 extern "C" unsigned int RGBTOYUV420_CSO_LEN;
+// Permutations without the encoding gamma, without sharpening, reading the color correction from
+// a LUT and drawing the layers into the foveated frame, empty if they couldn't be compiled at
+// build time
+extern "C" const unsigned char* FRAME_RENDER_PS_LINEAR_CSO_PTR;
+extern "C" unsigned int FRAME_RENDER_PS_LINEAR_CSO_LEN;
+extern "C" const unsigned char* COLOR_CORRECTION_NO_SHARPENING_CSO_PTR;
+extern "C" unsigned int COLOR_CORRECTION_NO_SHARPENING_CSO_LEN;
+extern "C" const unsigned char* COLOR_CORRECTION_LUT_CSO_PTR;
+extern "C" unsigned int COLOR_CORRECTION_LUT_CSO_LEN;
+extern "C" const unsigned char* COMPRESS_AXIS_ALIGNED_LUT_CSO_PTR;
+extern "C" unsigned int COMPRESS_AXIS_ALIGNED_LUT_CSO_LEN;
+extern "C" const unsigned char* FRAME_RENDER_VS_FOVEATED_CSO_PTR;
+extern "C" unsigned int FRAME_RENDER_VS_FOVEATED_CSO_LEN;
+extern "C" const unsigned char* FRAME_RENDER_PS_FOVEATED_CSO_PTR;
+extern "C" unsigned int FRAME_RENDER_PS_FOVEATED_CSO_LEN;
+extern "C" const unsigned char* FRAME_RENDER_PS_FOVEATED_LINEAR_CSO_PTR;
+extern "C" unsigned int FRAME_RENDER_PS_FOVEATED_LINEAR_CSO_LEN;
+// Empty if fxc was not available at build time
+extern "C" const unsigned char* DEPTH_PLANE_CSO_PTR;
+extern "C" unsigned int DEPTH_PLANE_CSO_LEN;
 
 extern "C" const unsigned char* QUAD_SHADER_COMP_SPV_PTR;
 extern "C" unsigned int QUAD_SHADER_COMP_SPV_LEN;
 extern "C" const unsigned char* COLOR_SHADER_COMP_SPV_PTR;
 extern "C" unsigned int COLOR_SHADER_COMP_SPV_LEN;
-extern "C" const unsigned char* FFR_SHADER_COMP_SPV_PTR;
-extern "C" unsigned int FFR_SHADER_COMP_SPV_LEN;
 extern "C" const unsigned char* RGBTOYUV420_SHADER_COMP_SPV_PTR;
 extern "C" unsigned int RGBTOYUV420_SHADER_COMP_SPV_LEN;
+// Empty if the shaders couldn't be compiled at build time
+extern "C" const unsigned char* COMPOSE_SHADER_COMP_SPV_PTR;
+extern "C" unsigned int COMPOSE_SHADER_COMP_SPV_LEN;
+extern "C" const unsigned char* FFR_SHADER_COMP_SPV_PTR;
+extern "C" unsigned int FFR_SHADER_COMP_SPV_LEN;
+extern "C" const unsigned char* DOWNSCALE_SHADER_COMP_SPV_PTR;
+extern "C" unsigned int DOWNSCALE_SHADER_COMP_SPV_LEN;
+extern "C" const unsigned char* MASK_SHADER_COMP_SPV_PTR;
+extern "C" unsigned int MASK_SHADER_COMP_SPV_LEN;
+extern "C" const unsigned char* DENOISE_SHADER_COMP_SPV_PTR;
+extern "C" unsigned int DENOISE_SHADER_COMP_SPV_LEN;
+extern "C" const unsigned char* REPROJECT_SHADER_COMP_SPV_PTR;
+extern "C" unsigned int REPROJECT_SHADER_COMP_SPV_LEN;
+extern "C" const unsigned char* SCALE_YUV420_SHADER_COMP_SPV_PTR;
+extern "C" unsigned int SCALE_YUV420_SHADER_COMP_SPV_LEN;
+extern "C" const unsigned char* RGBTONV12_SHADER_COMP_SPV_PTR;
+extern "C" unsigned int RGBTONV12_SHADER_COMP_SPV_LEN;
+// Variants for 10 bit Renderer outputs, empty if they couldn't be compiled
+extern "C" const unsigned char* QUAD_10BIT_SHADER_COMP_SPV_PTR;
+extern "C" unsigned int QUAD_10BIT_SHADER_COMP_SPV_LEN;
+extern "C" const unsigned char* COMPOSE_10BIT_SHADER_COMP_SPV_PTR;
+extern "C" unsigned int COMPOSE_10BIT_SHADER_COMP_SPV_LEN;
+extern "C" const unsigned char* DOWNSCALE_10BIT_SHADER_COMP_SPV_PTR;
+extern "C" unsigned int DOWNSCALE_10BIT_SHADER_COMP_SPV_LEN;
+extern "C" const unsigned char* RGBTOYUV420_10BIT_SHADER_COMP_SPV_PTR;
+extern "C" unsigned int RGBTOYUV420_10BIT_SHADER_COMP_SPV_LEN;
+extern "C" const unsigned char* SCALE_YUV420_10BIT_SHADER_COMP_SPV_PTR;
+extern "C" unsigned int SCALE_YUV420_10BIT_SHADER_COMP_SPV_LEN;
+// Writing host allocated planes, empty if it couldn't be compiled
+extern "C" const unsigned char* RGBTOYUV420_HOST_SHADER_COMP_SPV_PTR;
+extern "C" unsigned int RGBTOYUV420_HOST_SHADER_COMP_SPV_LEN;
+// Variants with the color math in half precision, empty if they couldn't be compiled
+extern "C" const unsigned char* COLOR_FP16_SHADER_COMP_SPV_PTR;
+extern "C" unsigned int COLOR_FP16_SHADER_COMP_SPV_LEN;
+extern "C" const unsigned char* COMPOSE_FP16_SHADER_COMP_SPV_PTR;
+extern "C" unsigned int COMPOSE_FP16_SHADER_COMP_SPV_LEN;
 
 extern "C" const char* g_sessionPath;
 extern "C" const char* g_driverRootDir;
@@ -199,19 +439,75 @@ extern "C" void LogEncoder(const char* stringPtr);
 extern "C" void LogPeriodically(const char* tag, const char* stringPtr);
 extern "C" void DriverReadyIdle(bool setDefaultChaprone);
 extern "C" void SetVideoConfigNals(const unsigned char* configBuffer, int len, int codec);
-extern "C" void
-VideoSend(unsigned long long targetTimestampNs, unsigned char* buf, int len, bool isIdr);
-extern "C" void
-HapticsSend(unsigned long long path, float duration_s, float frequency, float amplitude);
+// temporalLayer is the temporal ID of the frame, 0 without temporal layers. Frames of the top layer
+// of Settings::m_temporalLayers can be dropped without breaking the stream.
+extern "C" void VideoSend(
+    unsigned long long targetTimestampNs,
+    unsigned char* buf,
+    int len,
+    bool isIdr,
+    unsigned int temporalLayer
+);
+extern "C" void VideoSendSlice(
+    unsigned long long targetTimestampNs,
+    unsigned char* buf,
+    int len,
+    bool isIdr,
+    unsigned int temporalLayer,
+    bool firstSlice,
+    bool lastSlice
+);
+// Sends a frame whose memory stays owned by the encoder. ReleaseVideoBuffer(handle) is called once
+// the frame has been sent or dropped, until then the buffer must not be modified.
+extern "C" void VideoSendLent(
+    unsigned long long targetTimestampNs,
+    const unsigned char* buf,
+    int len,
+    bool isIdr,
+    unsigned int temporalLayer,
+    unsigned long long handle
+);
+// H.264 access unit of the secondary video stream, copied before returning
+extern "C" void SecondaryVideoSend(const unsigned char* buf, int len, bool isIdr);
+// Depth plane of the frame with targetTimestampNs, width x height unorm16 values with the views
+// side by side. projections are the two row-major 4x4 projections of the views. Copied before
+// returning.
+extern "C" void DepthPlaneSend(
+    unsigned long long targetTimestampNs,
+    const unsigned short* depth,
+    int width,
+    int height,
+    const float* projections
+);
+// The events of a burst, sent with one lock of the haptics stream
+extern "C" void HapticsSendBatch(const FfiHaptics* haptics, int count);
 extern "C" void ShutdownRuntime();
 extern "C" unsigned long long PathStringToHash(const char* path);
 extern "C" void ReportPresent(unsigned long long timestamp_ns, unsigned long long offset_ns);
 extern "C" void ReportComposed(unsigned long long timestamp_ns, unsigned long long offset_ns);
-extern "C" FfiDynamicEncoderParams GetDynamicEncoderParams();
+extern "C" void ReportComposeStageTimings(const FfiStageTiming* timings, int count);
+// Called by the encoders along with the send of the last part of each frame
+extern "C" void ReportEncodedFrameStats(FfiEncodedFrameStats stats);
+// The frame of targetTimestampNs is the first one encoded after the reference frames lost by the
+// client were invalidated, the client can report losses from it again
+extern "C" void ReportRecoveryFrame(unsigned long long targetTimestampNs);
 extern "C" unsigned long long GetSerialNumber(unsigned long long deviceID, char* outString);
 extern "C" void SetOpenvrProps(void* instancePtr, unsigned long long deviceID);
 extern "C" void RegisterButtons(void* instancePtr, unsigned long long deviceID);
 extern "C" void WaitForVSync();
+// Settings with the profile of the game executable applied, or with none if no profile matches.
+// Also sets the bitrate bounds of the profile. Only the fields that profiles override are meant to
+// be read from the result, see ApplicationProfile.h.
+extern "C" Settings ApplicationSettings(const char* executable);
+// Non-blocking, 0 until the headset is connected
+extern "C" unsigned long long GetTimeUntilNextVSyncNs();
+// Vsync period, following the headset refresh rate. 0 before a client connects.
+extern "C" unsigned long long GetVSyncIntervalNs();
+// Refresh rate of the stream, 0 before a client connects
+extern "C" float GetRefreshRate();
+// Switches the stream to the next lower or higher refresh rate the client supports, up to the
+// negotiated one. Returns the new rate, 0 if there is no other.
+extern "C" float StepRefreshRate(bool lower);
 
 extern "C" void CppInit(bool earlyHmdInitialization, Settings settings);
 extern "C" void* CppOpenvrEntryPoint(const char* pInterfaceName, int* pReturnCode);
@@ -219,7 +515,15 @@ extern "C" void InitializeRuntime();
 extern "C" bool InitializeStreaming(Settings settings);
 extern "C" void DeinitializeStreaming();
 extern "C" void SendVSync();
+// Applied by the encoder at the start of its next frame
+extern "C" void SetDynamicEncoderParams(FfiDynamicEncoderParams params);
+// Latest age of a pose when its frame starts encoding for the frame to be displayed in time, 0 if
+// unknown
+extern "C" void SetMaxPoseAge(unsigned long long maxPoseAgeNs);
 extern "C" void RequestIDR();
+extern "C" void RequestRecovery();
+// The client lost the frames after the one with this target timestamp
+extern "C" void ReportLostFrame(unsigned long long lastReceivedTimestampNs);
 extern "C" void SetTracking(
     unsigned long long targetTimestampNs,
     float controllerPoseTimeOffsetS,
@@ -229,15 +533,20 @@ extern "C" void SetTracking(
     const FfiDeviceMotion* bodyTrackerMotions,
     int bodyTrackerMotionCount
 );
+// Center to compress the frames rendered with the head poses of the next SetTracking calls with
+extern "C" void SetFoveationCenter(FfiFoveationCenter center);
 extern "C" void RequestDriverResync();
 extern "C" void ShutdownSteamvr();
 
 extern "C" void SetOpenvrProperty(void* instancePtr, FfiOpenvrProperty prop);
+extern "C" void
+SetOpenvrProperties(void* instancePtr, const FfiOpenvrProperty* props, int count);
 extern "C" void SetOpenvrPropByDeviceID(unsigned long long deviceID, FfiOpenvrProperty prop);
 extern "C" void RegisterButton(void* instancePtr, unsigned long long buttonID);
 extern "C" void SetLocalViewParams(const FfiViewParams params[2]);
 extern "C" void SetBattery(unsigned long long deviceID, float gauge_value, bool is_plugged);
-extern "C" void SetButton(unsigned long long buttonID, FfiButtonValue value);
+// The button changes of one input frame
+extern "C" void SetButtons(const FfiButtonEntry* entries, int count);
 extern "C" void SetProximityState(bool headset_is_worn);
 
 extern "C" void InitOpenvrClient();
@@ -245,11 +554,56 @@ extern "C" void ShutdownOpenvrClient();
 extern "C" void SetChaperoneArea(float areaWidth, float areaHeight);
 
 extern "C" void CaptureFrame();
+// Logs the GPU memory the driver allocated, by subsystem
+extern "C" void LogGpuMemoryUsage();
+// Moves up to maxCount of the oldest frame timing records into timings, returns how many
+extern "C" int PopFrameTimings(FfiFrameTiming* timings, int maxCount);
+// Present pacing counts since the previous call
+extern "C" void TakePresentPacingStats(FfiPresentPacingStats* stats);
+// IDR counts since the previous call
+extern "C" void TakeIdrStats(FfiIdrStats* stats);
+// Lock counts since the previous call, returns how many locks were written. Always 0 without the
+// lock-stats feature.
+extern "C" int TakeLockStats(FfiLockStats* stats, int maxCount);
+extern "C" void ReleaseVideoBuffer(unsigned long long handle);
 
 // NalParsing.cpp
+// Makes the next configuration NALs be sent even if they are the same as the last ones
+void ResetVideoConfigNals();
 void ParseFrameNals(
     int codec, unsigned char* buf, int len, unsigned long long targetTimestampNs, bool isIdr
 );
+// Same as ParseFrameNals, for a frame that is sent one slice at a time. Configuration NALs are only
+// looked for in the first slice.
+void ParseFrameSliceNals(
+    int codec,
+    unsigned char* buf,
+    int len,
+    unsigned long long targetTimestampNs,
+    bool isIdr,
+    bool firstSlice,
+    bool lastSlice
+);
+// Gives back the encoder memory lent to ParseFrameLentNals
+typedef void (*ReleaseVideoBufferFn)(void* userData);
+// Same as ParseFrameNals, without copying the frame out of the encoder memory. release(userData) is
+// called from any thread once the frame is sent, which can be after the next frames are encoded.
+void ParseFrameLentNals(
+    int codec,
+    unsigned char* buf,
+    int len,
+    unsigned long long targetTimestampNs,
+    bool isIdr,
+    ReleaseVideoBufferFn release,
+    void* userData
+);
+// Receives the frames in place of the server core while set, for the encode benchmarks. len is the
+// size of the frame or of the slice without the configuration NALs, lastSlice is true for whole
+// frames. Called from the encoder threads.
+typedef void (*VideoSinkFn)(
+    unsigned long long targetTimestampNs, int len, bool isIdr, bool lastSlice
+);
+void SetVideoSink(VideoSinkFn sink);
 
 // CrashHandler.cpp
 void HookCrashHandler();
@@ -3,6 +3,8 @@
 #include <cmath>
 #include <memory>
 
+#include "../PoseMath.h"
+
 inline vr::HmdQuaternion_t operator+(const vr::HmdQuaternion_t& lhs, const vr::HmdQuaternion_t& rhs) {
 	return {
 		lhs.w + rhs.w,
@@ -229,16 +231,7 @@ namespace vrmath {
 	}
 
 	inline vr::HmdMatrix34_t matMul33(const vr::HmdMatrix34_t& a, const vr::HmdMatrix34_t& b) {
-		vr::HmdMatrix34_t result;
-		for (unsigned i = 0; i < 3; i++) {
-			for (unsigned j = 0; j < 3; j++) {
-				result.m[i][j] = 0.0f;
-				for (unsigned k = 0; k < 3; k++) {
-					result.m[i][j] += a.m[i][k] * b.m[k][j];
-				}
-			}
-		}
-		return result;
+		return posemath::Mul33(a, b);
 	}
 
 	inline vr::HmdVector3_t matMul33(const vr::HmdMatrix34_t& a, const vr::HmdVector3_t& b) {
@@ -286,16 +279,7 @@ namespace vrmath {
 	}
 
 	inline vr::HmdMatrix34_t transposeMul33(const vr::HmdMatrix34_t& a) {
-		vr::HmdMatrix34_t result;
-		for (unsigned i = 0; i < 3; i++) {
-			for (unsigned k = 0; k < 3; k++) {
-				result.m[i][k] = a.m[k][i];
-			}
-		}
-		result.m[0][3] = a.m[0][3];
-		result.m[1][3] = a.m[1][3];
-		result.m[2][3] = a.m[2][3];
-		return result;
+		return posemath::Transpose33(a);
 	}
 
   inline vr::HmdMatrix34_t matInv33(vr::HmdMatrix34_t matrix) {
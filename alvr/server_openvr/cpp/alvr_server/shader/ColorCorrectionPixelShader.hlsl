@@ -15,6 +15,11 @@ const static float DY = 1. / renderHeight;
 const static float sharpenNeighbourWeight = -sharpening / 8.;
 
 Texture2D<float4> sourceTexture;
+#ifdef COLOR_LUT
+// The correction below baked for the settings, see FrameRender.cpp
+Texture3D<float4> colorLut : register(t1);
+#include "ColorLut.hlsli"
+#endif
 
 SamplerState bilinearSampler {
 	Filter = MIN_MAG_LINEAR_MIP_POINT;
@@ -32,6 +37,9 @@ float3 blendLighten(float3 base, float3 blend) {
 
 // https://forum.unity.com/threads/hue-saturation-brightness-contrast-shader.260649/
 float4 main(float2 uv : TEXCOORD0) : SV_Target{
+#ifdef NO_SHARPENING
+	float3 pixel = sourceTexture.Sample(bilinearSampler, uv).rgb;
+#else
 	// sharpening
 	float3 pixel = sourceTexture.Sample(bilinearSampler, uv).rgb * (sharpening + 1.);
 	pixel += GetSharpenNeighborComponent(uv, -DX, -DY);
@@ -42,13 +50,18 @@ float4 main(float2 uv : TEXCOORD0) : SV_Target{
 	pixel += GetSharpenNeighborComponent(uv, 0, +DY);
 	pixel += GetSharpenNeighborComponent(uv, -DX, +DY);
 	pixel += GetSharpenNeighborComponent(uv, -DX, 0);
+#endif
 
+#ifdef COLOR_LUT
+	pixel = ColorLutSample(colorLut, pixel);
+#else
 	pixel += brightness;                                                                            // brightness
 	pixel = (pixel - 0.5) * contrast + 0.5f;                                                        // contast
     pixel = blendLighten(lerp(dot(pixel, float3(0.299, 0.587, 0.114)), pixel, saturation), pixel);  // saturation + lighten only
 
 	pixel = clamp(pixel, 0, 1);
 	pixel = pow(pixel, 1. / gamma);                                                                 // gamma
+#endif
 
 	return float4(pixel, 1);
 }
\ No newline at end of file
@@ -0,0 +1,16 @@
+// Edge length of the color correction LUT, COLOR_LUT_SIZE in FrameRender.cpp
+#define COLOR_LUT_SIZE 33
+
+SamplerState lutSampler {
+	Filter = MIN_MAG_MIP_LINEAR;
+	AddressU = CLAMP;
+	AddressV = CLAMP;
+	AddressW = CLAMP;
+};
+
+// The texel centers of the LUT are at the input values 0, 1 / (COLOR_LUT_SIZE - 1), ..., 1
+float3 ColorLutSample(Texture3D<float4> lut, float3 color) {
+	const float scale = (COLOR_LUT_SIZE - 1.) / COLOR_LUT_SIZE;
+	const float offset = 0.5 / COLOR_LUT_SIZE;
+	return lut.Sample(lutSampler, saturate(color) * scale + offset).rgb;
+}
@@ -0,0 +1,59 @@
+// Downscales the depth buffers of the two views into the depth plane, the views side by side. Each
+// texel keeps the nearest depth of its block, so that the client doesn't reproject the edges of
+// near objects with the depth of the background.
+
+cbuffer DepthPlaneParams : register(b0) {
+	// Bounds of the views in the depth buffers, uMin, vMin, uMax, vMax
+	float4 bounds[2];
+	// Size of each view in the plane
+	uint2 viewSize;
+	// Near is 1 instead of 0
+	uint reversedDepth;
+	uint _padding0;
+};
+
+Texture2D<float> depthLeft : register(t0);
+Texture2D<float> depthRight : register(t1);
+RWTexture2D<unorm float> depthPlane : register(u0);
+
+// The blocks are large for high resolution depth buffers, they are sampled on a grid of at most
+// this many texels per side
+#define MAX_BLOCK_SAMPLES 16
+
+float NearestDepth(Texture2D<float> depth, float4 viewBounds, uint2 texel)
+{
+	uint width;
+	uint height;
+	depth.GetDimensions(width, height);
+
+	float2 blockStart = lerp(viewBounds.xy, viewBounds.zw, float2(texel) / float2(viewSize));
+	float2 blockEnd = lerp(viewBounds.xy, viewBounds.zw, float2(texel + 1) / float2(viewSize));
+	int2 start = int2(min(blockStart, blockEnd) * float2(width, height));
+	int2 end = max(int2(max(blockStart, blockEnd) * float2(width, height)), start + 1);
+	int2 step = max((end - start) / MAX_BLOCK_SAMPLES, 1);
+
+	float nearest = reversedDepth ? 0.0 : 1.0;
+	for (int y = start.y; y < end.y; y += step.y) {
+		for (int x = start.x; x < end.x; x += step.x) {
+			float value = depth.Load(int3(x, y, 0));
+			nearest = reversedDepth ? max(nearest, value) : min(nearest, value);
+		}
+	}
+
+	return nearest;
+}
+
+[numthreads(8, 8, 1)]
+void main(uint3 id : SV_DispatchThreadID)
+{
+	if (id.x >= viewSize.x * 2 || id.y >= viewSize.y) {
+		return;
+	}
+
+	uint2 texel = uint2(id.x % viewSize.x, id.y);
+	if (id.x < viewSize.x) {
+		depthPlane[id.xy] = NearestDepth(depthLeft, bounds[0], texel);
+	} else {
+		depthPlane[id.xy] = NearestDepth(depthRight, bounds[1], texel);
+	}
+}
@@ -3,8 +3,14 @@ cbuffer FoveationVars {
 	uint2 optimizedResolution;
 	float2 eyeSizeRatio;
 	float2 centerSize;
-	float2 centerShift;
+	float2 leftCenterShift;
+	// Mirrored horizontally, like the right eye UVs
+	float2 rightCenterShift;
 	float2 edgeRatio;
+	// 0 for the axis aligned compression, see RadialFoveation.h otherwise. The center sizes are
+	// both the radius then.
+	float radialScale;
+	float radialCurve;
 };
 
 float2 TextureToEyeUV(float2 textureUV, bool isRightEye) {
@@ -19,4 +25,54 @@ float2 EyeToTextureUV(float2 eyeUV, bool isRightEye) {
 	// left: x / 2; right 1 - (x / 2)
 	//return float2(clampedUV.x / 2. + float(isRightEye) * (1. - clampedUV.x), clampedUV.y);
 	return float2(eyeUV.x * .5 + float(isRightEye) * (1. - eyeUV.x), eyeUV.y);
-}
\ No newline at end of file
+}
+
+// Radial compression of an eye, compressed eye UV to eye UV
+float2 RadialCompressedToEyeUV(float2 eyeUV, float2 centerShift) {
+	float radius = centerSize.x;
+	float2 center = .5 + centerShift * (1. - radius) / 2.;
+	float2 extent = float2(eyeUV.x < center.x ? center.x : 1. - center.x,
+						   eyeUV.y < center.y ? center.y : 1. - center.y);
+	float2 position = (eyeUV - center) / extent;
+
+	float centerDistance = length(position);
+	float beyond = max(centerDistance - radius / radialScale, 0.);
+	float scale = radialScale + radialCurve * beyond * beyond / max(centerDistance, 1e-6);
+
+	// The corners of the compressed eye past the eye repeat its edges
+	return center + clamp(position * scale, -1., 1.) * extent;
+}
+
+// UV of the composition texture sampled at a UV of the compressed frame
+float2 CompressedToTextureUV(float2 uv) {
+	bool isRightEye = uv.x > 0.5;
+	float2 eyeUV = TextureToEyeUV(uv, isRightEye) / eyeSizeRatio;
+	float2 centerShift = isRightEye ? rightCenterShift : leftCenterShift;
+	if (radialScale > 0.) {
+		return EyeToTextureUV(RadialCompressedToEyeUV(eyeUV, centerShift), isRightEye);
+	}
+
+	float2 c0 = (1. - centerSize) / 2.;
+	float2 c1 = (edgeRatio - 1.) * c0 * (centerShift + 1.) / edgeRatio;
+	float2 c2 = (edgeRatio - 1.) * centerSize + 1.;
+
+	float2 loBound = c0 * (centerShift + 1.) / c2;
+	float2 hiBound = c0 * (centerShift - 1.) / c2 + 1.;
+	float2 underBound = float2(eyeUV.x < loBound.x, eyeUV.y < loBound.y);
+	float2 inBound = float2(loBound.x < eyeUV.x && eyeUV.x < hiBound.x,
+							loBound.y < eyeUV.y && eyeUV.y < hiBound.y);
+	float2 overBound = float2(eyeUV.x > hiBound.x, eyeUV.y > hiBound.y);
+
+	float2 center = eyeUV * c2 / edgeRatio + c1;
+	float2 d2 = eyeUV * c2;
+	float2 d3 = (eyeUV - 1.) * c2 + 1.;
+	float2 g1 = eyeUV / loBound;
+	float2 g2 = (1. - eyeUV) / (1. - hiBound);
+
+	float2 leftEdge = g1 * center + (1. - g1) * d2;
+	float2 rightEdge = g2 * center + (1. - g2) * d3;
+
+	float2 compressedUV = underBound * leftEdge + inBound * center + overBound * rightEdge;
+
+	return EyeToTextureUV(compressedUV, isRightEye);
+}
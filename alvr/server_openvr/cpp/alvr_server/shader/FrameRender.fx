@@ -1,10 +1,36 @@
-cbuffer FrameRenderParams {
+cbuffer FrameRenderParams : register(b0) {
 	float encodingGamma;
 	float _padding0;
 	float _padding1;
 	float _padding2;
 };
 
+#ifdef FOVEATED
+// The layers are drawn straight into the foveated frame. Each pixel finds the point of the eye image
+// it is sampled from, and then the texel of the layer at that point.
+#include "FoveatedRendering.hlsli"
+
+// Two per batched layer, MAX_LAYERS + 1 in FrameRender.h
+#define LAYER_TRANSFORM_COUNT 24
+
+struct LayerTransform {
+	// Rows of the inverse of the layer quad in clip space, from the eye NDC to the position on
+	// the quad divided by w
+	float4 s;
+	float4 t;
+	float4 q;
+	// Texture coordinates at the first corner, and their change along the quad
+	float4 texCoords;
+};
+
+cbuffer LayerTransforms : register(b2) {
+	// Visible size of the hidden area mask, 0 when it is disabled
+	float hiddenAreaSize;
+	float3 _padding3;
+	LayerTransform layerTransforms[LAYER_TRANSFORM_COUNT];
+};
+#endif
+
 Texture2D txLeft : register(t0);
 Texture2D txRight : register(t1);
 SamplerState samLinear : register(s0);
@@ -21,6 +47,9 @@ struct PS_INPUT
 	float4 Pos : SV_POSITION;
 	float2 Tex : TEXCOORD;
 	uint    View : VIEW;
+#ifdef FOVEATED
+	uint    Transform : TRANSFORM;
+#endif
 };
 
 #define SRGB_GAMMA_TO_NONLINEAR (1.0 / 2.4)
@@ -62,6 +91,22 @@ float4 NonlinearToLinearRGB(float4 color, float gamma)
     return linearColor;
 }
 
+#ifdef FOVEATED
+// Covers the eye viewport, ignoring the position of the layer quad. The vertices of a layer are
+// 4 for the left eye and 4 for the right one, so the vertex ID picks the transform.
+PS_INPUT VS(VS_INPUT input, uint id : SV_VertexID)
+{
+	PS_INPUT output = (PS_INPUT)0;
+	// The corners of the layer vertices: bottom left, top right, bottom right and top left
+	uint corner = id % 4;
+	output.Pos = float4(corner == 1 || corner == 2 ? 1. : -1., corner == 1 || corner == 3 ? 1. : -1., 0.5, 1.);
+	output.Tex = input.Tex;
+	output.View = input.View;
+	output.Transform = id / 4;
+
+	return output;
+}
+#else
 PS_INPUT VS(VS_INPUT input)
 {
 	PS_INPUT output = (PS_INPUT)0;
@@ -71,24 +116,49 @@ PS_INPUT VS(VS_INPUT input)
 
 	return output;
 }
+#endif
 float4 PS(PS_INPUT input) : SV_Target
 {
 	float4 color = float4(1.0, 0.0, 0.0, 1.0);
 	uint correctionType = (input.View >> 1) & 0xF;
 	uint shouldClamp = (input.View >> 5);
 
+	float2 tex = input.Tex;
+#ifdef FOVEATED
+	float2 textureUV = CompressedToTextureUV(input.Pos.xy / float2(optimizedResolution.x * 2, optimizedResolution.y));
+	float2 eyeUV = float2(textureUV.x * 2. - float(input.View & 1), textureUV.y);
+	float3 ndc = float3(eyeUV.x * 2. - 1., 1. - eyeUV.y * 2., 1.);
+	// The hidden area mask, which the composition texture gets after the layers
+	float2 maskPos = eyeUV * 2. - 1.;
+	bool hidden = hiddenAreaSize > 0. && dot(maskPos, maskPos) > hiddenAreaSize * hiddenAreaSize;
+
+	LayerTransform transform = layerTransforms[input.Transform];
+	float q = dot(transform.q.xyz, ndc);
+	float2 quadPos = float2(dot(transform.s.xyz, ndc), dot(transform.t.xyz, ndc)) / q;
+	tex = transform.texCoords.xy + quadPos * transform.texCoords.zw;
+#endif
+
 	if ((input.View & 1) == 1) {
-		color = txRight.Sample(samLinear, input.Tex);
+		color = txRight.Sample(samLinear, tex);
 	}
 	else {
-		color = txLeft.Sample(samLinear, input.Tex);
+		color = txLeft.Sample(samLinear, tex);
 	}
+
+#ifdef FOVEATED
+	// Where the quad of the layer would not have been rasterized, outside of it or behind the eye
+	if (!hidden && (q <= 0. || any(quadPos < 0.) || any(quadPos > 1.))) {
+		discard;
+	}
+#endif
 	
 	if (shouldClamp == (uint)1) {
 		color = clamp(color, 0.0, 1.0);
 	}
 
+#ifndef LINEAR_ENCODING
 	color = EncodingLinearToNonlinearRGB(color, encodingGamma);
+#endif
 
 	if (correctionType == (uint)1) { // Left View sRGB
 		color = LinearToNonlinearRGB(color, SRGB_GAMMA_TO_NONLINEAR);
@@ -100,5 +170,11 @@ float4 PS(PS_INPUT input) : SV_Target
 		color = clamp(color, 0.0, 1.0);
 	}
 
+#ifdef FOVEATED
+	if (hidden) {
+		color = float4(0., 0., 0., 1.);
+	}
+#endif
+
 	return color;
 };
\ No newline at end of file
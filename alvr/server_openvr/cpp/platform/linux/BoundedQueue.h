@@ -0,0 +1,78 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+namespace alvr {
+
+// Bounded blocking queue connecting two pipeline stages, guarded by a mutex. It is used with one
+// producer and one consumer thread but doesn't rely on it. Push blocks while the queue is full and
+// Pop blocks while it is empty, which gives natural back-pressure between stages. Close() wakes
+// up both sides so stages can shut down.
+// The items are moved in and out of slots allocated upfront, so a frame going through the queues
+// makes no allocation.
+template <typename T> class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity)
+        : m_items(capacity) { }
+
+    // Returns false if the queue has been closed
+    bool Push(T&& item) {
+        std::unique_lock lock(m_mutex);
+        m_notFull.wait(lock, [&] { return m_closed || m_size < m_items.size(); });
+        if (m_closed) {
+            return false;
+        }
+        m_items[(m_first + m_size) % m_items.size()] = std::move(item);
+        m_size++;
+        m_notEmpty.notify_one();
+        return true;
+    }
+
+    // Returns false if the queue has been closed
+    bool Pop(T& item) {
+        std::unique_lock lock(m_mutex);
+        m_notEmpty.wait(lock, [&] { return m_closed || m_size > 0; });
+        if (m_closed) {
+            return false;
+        }
+        item = std::move(m_items[m_first]);
+        m_first = (m_first + 1) % m_items.size();
+        m_size--;
+        m_notFull.notify_one();
+        return true;
+    }
+
+    // Returns false if the queue is empty or has been closed, without waiting
+    bool TryPop(T& item) {
+        std::unique_lock lock(m_mutex);
+        if (m_closed || m_size == 0) {
+            return false;
+        }
+        item = std::move(m_items[m_first]);
+        m_first = (m_first + 1) % m_items.size();
+        m_size--;
+        m_notFull.notify_one();
+        return true;
+    }
+
+    void Close() {
+        std::unique_lock lock(m_mutex);
+        m_closed = true;
+        m_notEmpty.notify_all();
+        m_notFull.notify_all();
+    }
+
+private:
+    std::vector<T> m_items;
+    size_t m_first = 0;
+    size_t m_size = 0;
+    bool m_closed = false;
+    std::mutex m_mutex;
+    std::condition_variable m_notEmpty;
+    std::condition_variable m_notFull;
+};
+
+}
@@ -1,26 +1,52 @@
 #include "CEncoder.h"
 
+#include <algorithm>
 #include <chrono>
+#include <deque>
 #include <exception>
 #include <fstream>
+#include <future>
+#include <initializer_list>
 #include <iostream>
+#include <iterator>
 #include <memory>
-#include <poll.h>
+#include <optional>
 #include <sstream>
 #include <stdexcept>
 #include <stdlib.h>
 #include <string>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/mman.h>
-#include <sys/poll.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <thread>
 #include <unistd.h>
+#include <vector>
 
 #include "ALVR-common/packet_types.h"
+#include "BoundedQueue.h"
+#include "ComposeBenchmark.h"
+#include "EncodeBenchmark.h"
 #include "EncodePipeline.h"
+#include "FormatConverter.h"
 #include "FrameRender.h"
+#include "SecondaryStream.h"
+#include "alvr_server/AllocationCheck.h"
+#include "alvr_server/EncoderControl.h"
+#include "alvr_server/FrameDeadline.h"
+#include "alvr_server/FrameTimings.h"
+#include "alvr_server/GpuMemory.h"
 #include "alvr_server/Logger.h"
 #include "alvr_server/PoseHistory.h"
+#include "alvr_server/PresentPacing.h"
+#include "alvr_server/Profiling.h"
+#include "alvr_server/QualityGovernor.h"
+#include "alvr_server/SceneChange.h"
+#include "alvr_server/StartupTimeline.h"
+#include "alvr_server/StaticFrames.h"
+#include "alvr_server/ThreadScheduling.h"
+#include "alvr_server/Utils.h"
 #include "alvr_server/bindings.h"
 #include "ffmpeg_helper.h"
 #include "protocol.h"
@@ -30,54 +56,250 @@ extern "C" {
 }
 
 CEncoder::CEncoder(std::shared_ptr<PoseHistory> poseHistory)
-    : m_poseHistory(poseHistory) { }
+    : m_poseHistory(poseHistory) {
+    m_exitEvent = eventfd(0, EFD_CLOEXEC);
+    if (m_exitEvent == -1) {
+        throw MakeException("eventfd failed: %s", strerror(errno));
+    }
+}
 
-CEncoder::~CEncoder() { Stop(); }
+CEncoder::~CEncoder() {
+    Stop();
+    close(m_exitEvent);
+}
 
 namespace {
-void read_exactly(pollfd pollfds, char* out, size_t size, std::atomic_bool& exiting) {
-    while (not exiting and size != 0) {
-        int timeout = 1; // poll api doesn't fit perfectly(100 mircoseconds) poll uses milliseconds
-                         // we do the best we can(1000 mircoseconds)
-        pollfds.events = POLLIN;
-        int count = poll(&pollfds, 1, timeout);
-        if (count < 0) {
-            throw MakeException("poll failed: %s", strerror(errno));
-        } else if (count == 1) {
-            int s = read(pollfds.fd, out, size);
-            if (s == -1) {
-                throw MakeException("read failed: %s", strerror(errno));
+// epoll instance watching fds for input, usually along with the exit event that Stop() signals
+int make_epoll(std::initializer_list<int> fds) {
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1) {
+        throw MakeException("epoll_create1 failed: %s", strerror(errno));
+    }
+    for (int watched : fds) {
+        epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.fd = watched;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, watched, &event) == -1) {
+            close(epoll_fd);
+            throw MakeException("epoll_ctl failed: %s", strerror(errno));
+        }
+    }
+    return epoll_fd;
+}
+
+// Returns true when fd can be read, false on timeout or once the exit event is signaled. The exit
+// event is never reset, so every later wait returns false immediately.
+bool wait_readable(int epoll_fd, int fd, int timeout) {
+    epoll_event events[2];
+    int count;
+    do {
+        count = epoll_wait(epoll_fd, events, 2, timeout);
+    } while (count < 0 and errno == EINTR);
+    if (count < 0) {
+        throw MakeException("epoll_wait failed: %s", strerror(errno));
+    }
+
+    bool readable = false;
+    for (int i = 0; i < count; ++i) {
+        if (events[i].data.fd != fd) {
+            return false;
+        }
+        readable = true;
+    }
+    return readable;
+}
+
+// The layer closed its connection, which it does when the compositor exits or destroys its
+// swapchain
+class ClientDisconnected : public std::runtime_error {
+public:
+    ClientDisconnected()
+        : std::runtime_error("alvr-ipc client disconnected") { }
+};
+
+// Returns false if interrupted by the exit event
+bool read_exactly(int epoll_fd, int fd, char* out, size_t size) {
+    while (size != 0) {
+        if (!wait_readable(epoll_fd, fd, -1)) {
+            return false;
+        }
+        ssize_t s = read(fd, out, size);
+        if (s == -1) {
+            if (errno == EINTR or errno == EAGAIN) {
+                continue;
             }
-            out += s;
-            size -= s;
+            throw MakeException("read failed: %s", strerror(errno));
+        }
+        if (s == 0) {
+            throw ClientDisconnected();
+        }
+        out += s;
+        size -= s;
+    }
+    return true;
+}
+
+// Blocks for one packet, then drains the socket so that only the most recent packet is kept.
+// skipped counts the older packets that were drained.
+bool read_latest(int epoll_fd, int fd, char* out, size_t size, uint64_t& skipped) {
+    if (!read_exactly(epoll_fd, fd, out, size)) {
+        return false;
+    }
+    while (wait_readable(epoll_fd, fd, 0)) {
+        if (!read_exactly(epoll_fd, fd, out, size)) {
+            return false;
         }
+        skipped++;
     }
+    return true;
 }
 
-void read_latest(pollfd pollfds, char* out, size_t size, std::atomic_bool& exiting) {
-    read_exactly(pollfds, out, size, exiting);
-    while (not exiting) {
-        int timeout = 0; // poll api fixes the original perfectly(0 microseconds)
-        pollfds.events = POLLIN;
-        int count = poll(&pollfds, 1, timeout);
-        if (count == 0)
-            return;
-        read_exactly(pollfds, out, size, exiting);
+int accept_wait(int socket, int exit_event) {
+    int epoll_fd = make_epoll({ socket, exit_event });
+    int client = -1;
+    while (client == -1 and wait_readable(epoll_fd, socket, -1)) {
+        client = accept4(socket, NULL, NULL, SOCK_CLOEXEC);
     }
+    close(epoll_fd);
+    return client;
 }
 
-int accept_timeout(pollfd socket, std::atomic_bool& exiting) {
-    while (not exiting) {
-        int timeout = 15; // poll api also fits the original perfectly(15000 microseconds)
-        socket.events = POLLIN;
-        int count = poll(&socket, 1, timeout);
+// Reads one present sync_file message, see ALVR_IPC_FLAG_SYNC_FILE_PRESENTS. Returns -1 for a
+// message without fd.
+int receive_sync_file(int client) {
+    union {
+        cmsghdr cm;
+        uint8_t buffer[CMSG_SPACE(sizeof(int))];
+    } control = {};
+    char data[1];
+    iovec iov = { data, sizeof(data) };
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = &control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t ret;
+    do {
+        ret = recvmsg(client, &msg, MSG_CMSG_CLOEXEC);
+    } while (ret == -1 and errno == EINTR);
+    if (ret == -1) {
+        throw MakeException("recvmsg failed: %s", strerror(errno));
+    }
+    if (ret == 0) {
+        throw ClientDisconnected();
+    }
+
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL or cmsg->cmsg_level != SOL_SOCKET or cmsg->cmsg_type != SCM_RIGHTS
+        or cmsg->cmsg_len != CMSG_LEN(sizeof(int))) {
+        return -1;
+    }
+    int fd;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+    return fd;
+}
+
+// Sync files the layer sends ahead of the ring packets. Message n goes with ring sequence n, the
+// ones of packets the ring skipped are closed.
+class SyncFileReceiver {
+public:
+    explicit SyncFileReceiver(int client)
+        : m_client(client) { }
+    ~SyncFileReceiver() {
+        for (int fd : m_pending) {
+            if (fd != -1) {
+                close(fd);
+            }
+        }
+    }
+
+    // Called when the socket is readable, the message comes right before its packet
+    void Receive() {
+        m_pending.push_back(receive_sync_file(m_client));
+        m_received++;
+    }
+
+    // Sync file of the packet of the given ring sequence, -1 if it has none. The caller owns it.
+    int Take(uint64_t sequence) {
+        while (m_received < sequence) {
+            Receive();
+        }
+        int fd = -1;
+        uint64_t first = m_received - m_pending.size() + 1;
+        while (!m_pending.empty() and first <= sequence) {
+            if (fd != -1) {
+                close(fd);
+            }
+            fd = m_pending.front();
+            m_pending.pop_front();
+            first++;
+        }
+        return fd;
+    }
+
+private:
+    int m_client;
+    uint64_t m_received = 0;
+    std::deque<int> m_pending;
+};
+
+// Waits for a packet published in the ring after last_read. The epoll instance watches the
+// doorbell, the client socket (which only becomes readable once the layer disconnected, or with a
+// sync file message when sync_files is not null) and the exit event. Returns false if interrupted
+// by the exit event, or after timeout ms without a packet if timeout is not -1.
+bool read_ring(
+    int epoll_fd,
+    int doorbell,
+    int client,
+    const present_ring& ring,
+    uint64_t& last_read,
+    present_packet& out,
+    int timeout,
+    SyncFileReceiver* sync_files
+) {
+    while (!ring.read_latest(last_read, out)) {
+        epoll_event events[3];
+        int count;
+        do {
+            count = epoll_wait(epoll_fd, events, 3, timeout);
+        } while (count < 0 and errno == EINTR);
         if (count < 0) {
-            throw MakeException("poll failed: %s", strerror(errno));
-        } else if (count == 1) {
-            return accept4(socket.fd, NULL, NULL, SOCK_CLOEXEC);
+            throw MakeException("epoll_wait failed: %s", strerror(errno));
+        }
+        if (count == 0) {
+            return false;
+        }
+
+        for (int i = 0; i < count; ++i) {
+            if (events[i].data.fd == doorbell) {
+                // Reset the counter, the ring is checked again right after
+                uint64_t value;
+                if (read(doorbell, &value, sizeof(value)) == -1 and errno != EAGAIN) {
+                    throw MakeException("read failed: %s", strerror(errno));
+                }
+            } else if (events[i].data.fd == client) {
+                if (!sync_files) {
+                    throw ClientDisconnected();
+                }
+                sync_files->Receive();
+            } else {
+                return false;
+            }
         }
     }
-    return -1;
+    return true;
+}
+
+// Hands the layer the vsync schedule the server paces frames with, which follows the headset
+void publish_vsync(present_ring& ring) {
+    uint64_t period = GetVSyncIntervalNs();
+    if (period == 0) {
+        return;
+    }
+    // steady_clock is CLOCK_MONOTONIC
+    auto now = std::chrono::steady_clock::now().time_since_epoch();
+    ring.publish_vsync(now / std::chrono::nanoseconds(1) + GetTimeUntilNextVSyncNs(), period);
 }
 
 void av_logfn(void*, int level, const char* data, va_list va) {
@@ -98,9 +320,133 @@ void av_logfn(void*, int level, const char* data, va_list va) {
         Info("Encoder: %s", buf);
 }
 
+// Device of the encode adapter index when it is another GPU than the compositor one, which VAAPI
+// can encode on. Null to encode on the compositor GPU.
+std::unique_ptr<alvr::VkContext> make_encode_context(const alvr::VkContext& vk_ctx) {
+    const int index = Settings_Instance()->m_nEncodeAdapterIndex;
+    if (index < 0 or Settings_Instance()->m_forceSwEncoding) {
+        return nullptr;
+    }
+    std::unique_ptr<alvr::VkContext> encode_ctx;
+    try {
+        encode_ctx = std::make_unique<alvr::VkContext>(nullptr, std::vector<const char*> {}, index);
+    } catch (std::exception& e) {
+        Warn("Can't encode on adapter %d, encoding on the compositor one: %s", index, e.what());
+        return nullptr;
+    }
+    if (encode_ctx->physicalDeviceUUID == vk_ctx.physicalDeviceUUID) {
+        return nullptr;
+    }
+    if (encode_ctx->nvidia) {
+        Warn("Can't encode on adapter %d without VAAPI, encoding on the compositor one", index);
+        return nullptr;
+    }
+    Info("Encoding on adapter %d, %s", index, encode_ctx->devicePath.c_str());
+    return encode_ctx;
+}
+
+// Warp from the head pose an image was rendered at to a newer one, see reproject.comp
+Renderer::Reprojection make_reprojection(
+    const vr::HmdMatrix34_t& rendered, const vr::HmdMatrix34_t& latest, const vr::HmdRect2_t proj[2]
+) {
+    Renderer::Reprojection reprojection = {};
+    // rendered^T * latest, rotating rays from the latest head space to the rendered one
+    for (int i = 0; i < 3; ++i) {
+        for (int j = 0; j < 3; ++j) {
+            for (int k = 0; k < 3; ++k) {
+                reprojection.rotation[i][j] += rendered.m[k][i] * latest.m[k][j];
+            }
+        }
+    }
+    float* tangents[2] = { reprojection.leftTangents, reprojection.rightTangents };
+    for (int eye = 0; eye < 2; ++eye) {
+        // fov_to_tangents stores tan(down) in the top left corner and tan(up) in the bottom right
+        tangents[eye][0] = proj[eye].vTopLeft.v[0];
+        tangents[eye][1] = proj[eye].vBottomRight.v[0];
+        tangents[eye][2] = proj[eye].vBottomRight.v[1];
+        tangents[eye][3] = proj[eye].vTopLeft.v[1];
+    }
+    return reprojection;
+}
+
+struct RenderedFrame {
+    PoseHistory::TrackingHistoryFrame pose;
+    uint32_t output;
+    // GetSteadyTimeNs when the present was received, or when its reprojection was decided
+    uint64_t presentNs;
+};
+
+// Frame pushed to the encoder, until its packet is out
+struct PendingFrame {
+    uint32_t output;
+    uint64_t targetTimestampNs;
+    std::chrono::steady_clock::time_point encodeBegin;
+    Renderer::Timestamps renderTimestamps = {};
+    bool validTimestamps = false;
+    FfiFrameTiming timing = {};
+};
+
+struct EncodedFrame {
+    std::vector<uint8_t> data;
+    uint64_t pts = 0;
+    bool isIDR = false;
+    uint64_t targetTimestampNs = 0;
+    bool reportTimestamps = false;
+    uint64_t presentOffset = 0;
+    uint64_t composedOffset = 0;
+    // Filled up to the encode, only for the last slice
+    FfiFrameTiming timing = {};
+    // Frames may be split in slices, which are all sent before the encoder has finished the frame
+    // except for the last one
+    bool firstSlice = true;
+    bool lastSlice = true;
+    // Of the whole frame, only for the last slice
+    float averageQp = -1.0f;
+    FfiFrameType frameType = FRAME_TYPE_UNKNOWN;
+};
+
+// Encoded frames that may wait for the output stage before the encode stage blocks
+constexpr size_t ENCODED_QUEUE_DEPTH = 2;
+
+// Encoder failures in a row, each followed by a rebuild, before the stream is given up
+constexpr int MAX_ENCODER_REBUILDS = 3;
+
 } // namespace
 
-void CEncoder::GetFds(int client, int (*received_fds)[6]) {
+// Connection of the layer, which makes one for each swapchain of the compositor
+struct CEncoder::IpcClient {
+    int socket = -1;
+    int epoll = -1;
+    init_packet init;
+    // Memory and semaphore fd of each swapchain image, owned by the Renderer once imported
+    std::vector<int> fds;
+    // Protocol version 2 state, see present_ring
+    present_ring* ring = nullptr;
+    int doorbell = -1;
+    int ring_epoll = -1;
+    std::optional<SyncFileReceiver> sync_files;
+
+    ~IpcClient() {
+        sync_files.reset();
+        if (ring) {
+            munmap(ring, sizeof(present_ring));
+        }
+        if (ring_epoll != -1) {
+            close(ring_epoll);
+        }
+        if (doorbell != -1) {
+            close(doorbell);
+        }
+        if (epoll != -1) {
+            close(epoll);
+        }
+        if (socket != -1) {
+            close(socket);
+        }
+    }
+};
+
+void CEncoder::GetFds(int client, int* received_fds, size_t count) {
     struct msghdr msg;
     struct cmsghdr* cmsg;
     union {
@@ -128,7 +474,10 @@ void CEncoder::GetFds(int client, int (*received_fds)[6]) {
 
     for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
         if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
-            memcpy(received_fds, CMSG_DATA(cmsg), sizeof(*received_fds));
+            if (cmsg->cmsg_len != CMSG_LEN(count * sizeof(int))) {
+                throw MakeException("expected %zu fds from alvr-ipc client", count);
+            }
+            memcpy(received_fds, CMSG_DATA(cmsg), count * sizeof(int));
             break;
         }
     }
@@ -140,17 +489,29 @@ void CEncoder::GetFds(int client, int (*received_fds)[6]) {
 
 void CEncoder::Run() {
     Info("CEncoder::Run\n");
-    m_socketPath = getenv("XDG_RUNTIME_DIR");
-    m_socketPath += "/alvr-ipc";
+    // The render stage runs on this thread
+    ApplyStreamingThreadScheduling("render");
+
+    // Offline run of the frame path on captured frames instead of the ones of the layer
+    if (const char* benchmark = getenv("ALVR_ENCODE_BENCHMARK")) {
+        alvr::RunEncodeBenchmark(benchmark, m_exiting);
+        return;
+    }
+    // GPU times of the compose passes alone, on a synthetic frame
+    if (const char* benchmark = getenv("ALVR_COMPOSE_BENCHMARK")) {
+        alvr::RunComposeBenchmark(benchmark, m_exiting);
+        return;
+    }
+    m_socketPath = ipc_socket_path();
 
     int ret;
     // we don't really care about what happends with unlink, it's just incase we crashed before this
     // run
     ret = unlink(m_socketPath.c_str());
 
-    m_socket.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    m_socket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
     struct sockaddr_un name;
-    if (m_socket.fd == -1) {
+    if (m_socket == -1) {
         perror("socket");
         exit(1);
     }
@@ -159,28 +520,58 @@ void CEncoder::Run() {
     name.sun_family = AF_UNIX;
     strncpy(name.sun_path, m_socketPath.c_str(), sizeof(name.sun_path) - 1);
 
-    ret = bind(m_socket.fd, (const struct sockaddr*)&name, sizeof(name));
+    ret = bind(m_socket, (const struct sockaddr*)&name, sizeof(name));
     if (ret == -1) {
         perror("bind");
         exit(1);
     }
 
-    ret = listen(m_socket.fd, 1024);
+    ret = listen(m_socket, 1024);
     if (ret == -1) {
         perror("listen");
         exit(1);
     }
 
     Info("CEncoder Listening\n");
-    struct pollfd client;
-    client.fd = accept_timeout(m_socket, m_exiting);
-    if (m_exiting)
-        return;
-    init_packet init;
-    client.events = POLLIN;
-    read_exactly(client, (char*)&init, sizeof(init), m_exiting);
-    if (m_exiting)
-        return;
+
+    av_log_set_callback(av_logfn);
+
+    // Device and ffmpeg hwcontext creation overlap with the compositor startup. The device the
+    // layer renders on is only known from the init packet, which usually names the same one.
+    std::unique_ptr<alvr::VkContext> warm_ctx;
+    try {
+        warm_ctx = std::make_unique<alvr::VkContext>(nullptr, std::vector<const char*> {});
+    } catch (std::exception& e) {
+        Warn("CEncoder warm-up failed: %s", e.what());
+    }
+
+    // The compositor connects again each time it creates its swapchain. A session keeps the
+    // device, the outputs and the encoder across connections while the swapchain images keep
+    // their size and format, only the input images are imported again.
+    std::unique_ptr<IpcClient> ipc;
+    try {
+        ipc = AcceptClient();
+    } catch (std::exception& e) {
+        Error("error in encoder thread: %s", e.what());
+    }
+    while (ipc) {
+        ipc = RunSession(std::move(ipc), warm_ctx);
+    }
+}
+
+std::unique_ptr<CEncoder::IpcClient> CEncoder::AcceptClient() {
+    auto ipc = std::make_unique<IpcClient>();
+    ipc->socket = accept_wait(m_socket, m_exitEvent);
+    if (ipc->socket == -1) {
+        return nullptr;
+    }
+    StartupMilestone("accept");
+    ipc->epoll = make_epoll({ ipc->socket, m_exitEvent });
+    init_packet& init = ipc->init;
+    if (!read_exactly(ipc->epoll, ipc->socket, (char*)&init, sizeof(init))) {
+        return nullptr;
+    }
+    StartupMilestone("init_packet");
 
     // check that pointer types are null, other values would not make sense over a socket
     assert(init.image_create_info.queueFamilyIndexCount == 0);
@@ -193,125 +584,908 @@ void CEncoder::Run() {
     ifscmdl >> ifbuf2;
     Info("CEncoder client connected, pid %d, cmdline %s\n", (int)init.source_pid, ifbuf2);
 
-    try {
-        GetFds(client.fd, &m_fds);
+    ipc->fds.resize(2 * init.num_images);
+    GetFds(ipc->socket, ipc->fds.data(), ipc->fds.size());
 
-        m_connected = true;
+    if (init.protocol_version >= 2) {
+        int ring_fds[2];
+        GetFds(ipc->socket, ring_fds, std::size(ring_fds));
+        ipc->doorbell = ring_fds[1];
+        // The vsync schedule is written back into the ring since version 4
+        int prot = init.protocol_version >= 4 ? PROT_READ | PROT_WRITE : PROT_READ;
+        void* mem = mmap(NULL, sizeof(present_ring), prot, MAP_SHARED, ring_fds[0], 0);
+        close(ring_fds[0]);
+        if (mem == MAP_FAILED) {
+            throw MakeException("mmap of present ring failed: %s", strerror(errno));
+        }
+        ipc->ring = (present_ring*)mem;
+        ipc->ring_epoll = make_epoll({ ipc->doorbell, ipc->socket, m_exitEvent });
+        Info("CEncoder using shared memory present ring\n");
 
-        fprintf(stderr, "\n\nWe are initalizing Vulkan in CEncoder thread\n\n\n");
+        if (init.protocol_version >= 5 and (init.flags & ALVR_IPC_FLAG_SYNC_FILE_PRESENTS)) {
+            ipc->sync_files.emplace(ipc->socket);
+            Info("CEncoder waiting on present sync files\n");
+        }
+    }
+    StartupMilestone("fds");
+    return ipc;
+}
 
-        av_log_set_callback(av_logfn);
+std::unique_ptr<CEncoder::IpcClient> CEncoder::RunSession(
+    std::unique_ptr<IpcClient> ipc, std::unique_ptr<alvr::VkContext>& warm_ctx
+) {
+    // Connection the next session starts with, when this one can't take it over
+    std::unique_ptr<IpcClient> next;
+    try {
+        m_connected = true;
 
-        alvr::VkContext vk_ctx(init.device_uuid.data(), {});
+        std::unique_ptr<alvr::VkContext> vk_ctx_ptr;
+        if (warm_ctx && warm_ctx->physicalDeviceUUID == ipc->init.device_uuid) {
+            vk_ctx_ptr = std::move(warm_ctx);
+        } else {
+            warm_ctx.reset();
+            Info("CEncoder creating the Vulkan device of the compositor\n");
+            vk_ctx_ptr = std::make_unique<alvr::VkContext>(
+                ipc->init.device_uuid.data(), std::vector<const char*> {}
+            );
+        }
+        alvr::VkContext& vk_ctx = *vk_ctx_ptr;
+        StartupMilestone("vulkan_device");
+        // The outputs are exported to it as linear dma-bufs, composing stays on the game GPU. Its
+        // device is created while the input images are imported.
+        std::future<std::unique_ptr<alvr::VkContext>> encode_ctx_future
+            = std::async(std::launch::async, [&] { return make_encode_context(vk_ctx); });
 
-        FrameRender render(vk_ctx, init, m_fds);
-        auto output = render.CreateOutput();
+        // Number of Renderer output images cycling between the render and encode stages
+        const uint32_t output_count = IsCompactGpuMemory()
+            ? 1
+            : std::clamp<uint32_t>(Settings_Instance()->m_linuxEncoderOutputImages, 1, 3);
 
-        alvr::VkFrame frame(
-            vk_ctx, output.image, output.imageInfo, output.size, output.memory, output.drm
-        );
-        auto encode_pipeline = alvr::EncodePipeline::Create(
-            &render,
-            vk_ctx,
-            frame,
-            output.imageInfo,
-            render.GetEncodingWidth(),
-            render.GetEncodingHeight()
+        // The future waits for the device if this throws
+        FrameRender render(vk_ctx, ipc->init, ipc->fds.data());
+        std::unique_ptr<alvr::VkContext> encode_ctx = encode_ctx_future.get();
+        render.CreateOutput(
+            output_count,
+            alvr::EncodePipeline::OutputModifierFilter(vk_ctx, encode_ctx.get()),
+            encode_ctx != nullptr
         );
+        StartupMilestone("renderer");
 
-        bool valid_timestamps = true;
+        // The VAAPI pipeline imports its surfaces as the outputs, which replaces their images
+        std::vector<std::unique_ptr<alvr::VkFrame>> frames;
+        auto wrapOutputs = [&] {
+            frames.clear();
+            for (uint32_t i = 0; i < output_count; ++i) {
+                auto& output = render.GetOutput(i);
+                frames.push_back(std::make_unique<alvr::VkFrame>(
+                    vk_ctx, output.image, output.imageInfo, output.size, output.memory, output.drm
+                ));
+            }
+        };
+        wrapOutputs();
+        auto createPipeline = [&] {
+            auto pipeline = alvr::EncodePipeline::Create(
+                &render,
+                vk_ctx,
+                frames,
+                render.GetOutput(0).imageInfo,
+                render.GetEncodingWidth(),
+                render.GetEncodingHeight(),
+                encode_ctx.get()
+            );
+            m_scheduler.SetEncoderCapabilities(pipeline->GetCapabilities());
+            return pipeline;
+        };
+        auto encode_pipeline = createPipeline();
+        StartupMilestone("encoder");
+        // Held by the render stage while it renders a frame, and by the encode stage while it
+        // replaces a failed pipeline, which may import the outputs again
+        std::mutex pipeline_mutex;
+        const int codec = encode_pipeline->GetCodec();
 
-        fprintf(stderr, "CEncoder starting to read present packets");
-        present_packet frame_info;
-        while (not m_exiting) {
-            read_latest(client, (char*)&frame_info, sizeof(frame_info), m_exiting);
+        // Its converters read the output images, it is created again when the outputs are
+        // imported again
+        std::unique_ptr<alvr::SecondaryStream> secondary_stream;
+        auto createSecondaryStream = [&] {
+            secondary_stream.reset();
+            if (Settings_Instance()->m_secondaryStreamHeight == 0
+                || SCALE_YUV420_SHADER_COMP_SPV_LEN == 0) {
+                return;
+            }
+            try {
+                secondary_stream = std::make_unique<alvr::SecondaryStream>(
+                    &render,
+                    Settings_Instance()->m_secondaryStreamHeight,
+                    Settings_Instance()->m_secondaryStreamBitrateMbps
+                );
+            } catch (std::exception& e) {
+                Warn("Failed to create the secondary video stream: %s", e.what());
+            }
+        };
+        if (Settings_Instance()->m_secondaryStreamHeight > 0
+            && SCALE_YUV420_SHADER_COMP_SPV_LEN == 0) {
+            Warn("Secondary video stream unavailable, its shader wasn't compiled");
+        }
+        createSecondaryStream();
 
-            encode_pipeline->SetParams(GetDynamicEncoderParams());
+        // Downscaled copies of the outputs, only their luma is compared, see
+        // alvr_server/StaticFrames.h and alvr_server/SceneChange.h
+        std::vector<std::unique_ptr<FormatConverter>> static_frames;
+        VkExtent2D static_extent = {};
+        const bool skip_static_frames = Settings_Instance()->m_skipStaticFrames;
+        const bool scene_change_detection = Settings_Instance()->m_sceneChangeDetection;
+        const bool find_static_blocks = Settings_Instance()->m_staticBlockQpOffset > 0;
+        if (skip_static_frames || scene_change_detection || find_static_blocks) {
+            const VkExtent3D& extent = render.GetOutput(0).imageInfo.extent;
+            static_extent.width = std::max((extent.width / STATIC_FRAME_SCALE) & ~1u, 2u);
+            static_extent.height = std::max((extent.height / STATIC_FRAME_SCALE) & ~1u, 2u);
+            if (SCALE_YUV420_SHADER_COMP_SPV_LEN == 0) {
+                Warn("Frame copies unavailable, their shader wasn't compiled");
+            }
+        }
+        // Called again when the outputs are imported again
+        auto createStaticFrames = [&] {
+            static_frames.clear();
+            if (static_extent.width == 0 || SCALE_YUV420_SHADER_COMP_SPV_LEN == 0) {
+                return;
+            }
+            try {
+                for (uint32_t i = 0; i < output_count; ++i) {
+                    const auto& output = render.GetOutput(i);
+                    static_frames.push_back(std::make_unique<ScaleYuv420>(
+                        &render, output.image, output.imageInfo, output.semaphore, static_extent
+                    ));
+                }
+            } catch (std::exception& e) {
+                Warn("Frame copies unavailable: %s", e.what());
+                static_frames.clear();
+            }
+        };
+        createStaticFrames();
 
-            auto pose = m_poseHistory->GetBestPoseMatch((const vr::HmdMatrix34_t&)frame_info.pose);
-            if (!pose) {
-                continue;
+        // All compute pipelines exist at this point
+        render.SavePipelineCache();
+        LogGpuMemory("encoder started");
+        StartupMilestone("pipelines");
+
+        // The loop is split in three stages so that composing frame N+1 overlaps with encoding
+        // frame N and with sending frame N-1:
+        //  * render (this thread): wait for a present packet, compose it into an output image
+        //  * encode: submit the output image to the encoder and collect the bitstream
+        //  * output: report timings and hand the NALs over to the network side
+        // Output images are handed around as tokens: the render stage can only compose into an
+        // image that the encoder has finished consuming.
+        alvr::BoundedQueue<uint32_t> freeOutputs(output_count);
+        alvr::BoundedQueue<RenderedFrame> renderedFrames(output_count);
+        alvr::BoundedQueue<EncodedFrame> encodedFrames(ENCODED_QUEUE_DEPTH);
+        alvr::BoundedQueue<std::vector<uint8_t>> freeBuffers(ENCODED_QUEUE_DEPTH + 1);
+        for (uint32_t i = 0; i < output_count; ++i) {
+            freeOutputs.Push(uint32_t(i));
+        }
+        for (size_t i = 0; i < ENCODED_QUEUE_DEPTH + 1; ++i) {
+            freeBuffers.Push(std::vector<uint8_t>());
+        }
+
+        auto closeQueues = [&] {
+            freeOutputs.Close();
+            renderedFrames.Close();
+            encodedFrames.Close();
+            freeBuffers.Close();
+        };
+
+        auto runStage = [&](const char* name, auto&& body) {
+            return std::thread([&, name, body] {
+                ApplyStreamingThreadScheduling(name);
+                try {
+                    body();
+                } catch (std::exception& e) {
+                    Error("error in encoder %s stage: %s", name, e.what());
+                }
+                closeQueues();
+            });
+        };
+
+        // Leading slices go to the output stage while the encoder is still working on the frame
+        auto sliceSink = [&](const alvr::FramePacket& slice) {
+            EncodedFrame encoded;
+            if (!freeBuffers.Pop(encoded.data)) {
+                return;
             }
+            encoded.data.assign(slice.data, slice.data + slice.size);
+            encoded.pts = slice.pts;
+            encoded.isIDR = slice.isIDR;
+            encoded.targetTimestampNs = slice.pts;
+            encoded.firstSlice = slice.firstSlice;
+            encoded.lastSlice = false;
+            encodedFrames.Push(std::move(encoded));
+        };
+        encode_pipeline->SetSliceSink(sliceSink);
 
-            if (m_captureFrame) {
-                m_captureFrame = false;
-                render.CaptureInputFrame(
-                    std::string(Settings_Instance()->m_captureFrameDir) + "/alvr_frame_input.ppm"
-                );
-                render.CaptureOutputFrame(
-                    std::string(Settings_Instance()->m_captureFrameDir) + "/alvr_frame_output.ppm"
+        std::thread encodeThread = runStage("encode", [&] {
+            bool valid_timestamps = true;
+            std::vector<Renderer::StageTiming> stage_timings;
+            std::vector<FfiStageTiming> ffi_stage_timings;
+            RenderedFrame rendered;
+            uint64_t paramsGeneration = 0;
+            int failures = 0;
+            // Luma of the copy of the last encoded frame
+            std::vector<uint8_t> static_reference;
+            uint64_t last_encoded_timestamp = 0;
+            // Of the frame being encoded
+            StaticBlocks static_blocks;
+            SceneChangeDetector scene_changes;
+            QualityGovernor governor;
+            ProfileGpuContext gpu_profile;
+            // True if the frame is skipped, schedules an IDR frame if it starts a new scene. The
+            // copy of a late frame is only waited for, the reference stays the last encoded frame.
+            auto checkFrameCopy = [&](uint32_t output, uint64_t targetTimestampNs, bool late) {
+                static_blocks.width = 0;
+                FormatConverter& converter = *static_frames[output];
+                if (!converter.Pending()) {
+                    return late;
+                }
+                uint8_t* planes[3];
+                int linesizes[3];
+                converter.Sync(planes, linesizes);
+                if (late) {
+                    return true;
+                }
+
+                const uint32_t width = static_extent.width;
+                const uint32_t height = static_extent.height;
+                // The client must get the frames that repair the stream
+                const bool same_pose
+                    = targetTimestampNs != 0 && targetTimestampNs == last_encoded_timestamp;
+                if (skip_static_frames && same_pose && !m_scheduler.IsRecoveryPending()
+                    && StaticFramesMatch(
+                        static_reference.data(), width, planes[0], linesizes[0], width, height
+                    )) {
+                    Debug("Skipping static frame %llu", targetTimestampNs);
+                    return true;
+                }
+                // With another pose every pixel moves
+                if (find_static_blocks && same_pose) {
+                    FindStaticBlocks(
+                        static_reference.data(),
+                        width,
+                        planes[0],
+                        linesizes[0],
+                        width,
+                        height,
+                        1,
+                        static_blocks
+                    );
+                }
+                if (scene_change_detection
+                    && scene_changes.Update(planes[0], linesizes[0], width, height, 1)) {
+                    Debug(
+                        "Scene cut at frame %llu, histogram difference %.2f",
+                        targetTimestampNs,
+                        scene_changes.GetStats().histogramDifference
+                    );
+                    m_scheduler.InsertSceneCut();
+                }
+                static_reference.resize(width * height);
+                for (uint32_t y = 0; y < height; ++y) {
+                    memcpy(&static_reference[y * width], planes[0] + y * linesizes[0], width);
+                }
+                last_encoded_timestamp = targetTimestampNs;
+                return false;
+            };
+            // Frames pushed to the encoder whose packet isn't out yet, oldest first
+            std::deque<PendingFrame> pending_frames;
+            // Hands a packet over to the output stage, and the output of its frame back to the
+            // render stage along with the ones of the older frames, which the encoder dropped.
+            // False once the queues are closed.
+            auto sendPacket = [&](const alvr::FramePacket& packet) {
+                PendingFrame frame = {};
+                frame.targetTimestampNs = packet.pts;
+                auto match = std::find_if(
+                    pending_frames.begin(),
+                    pending_frames.end(),
+                    [&](const PendingFrame& pending) {
+                        return pending.targetTimestampNs == packet.pts;
+                    }
                 );
-            }
+                bool known = match != pending_frames.end();
+                while (known) {
+                    bool last = pending_frames.begin() == match;
+                    frame = pending_frames.front();
+                    pending_frames.pop_front();
+                    if (!freeOutputs.Push(uint32_t(frame.output))) {
+                        return false;
+                    }
+                    if (last) {
+                        break;
+                    }
+                }
 
-            render.Render(frame_info.image, frame_info.semaphore_value);
+                if (known) {
+                    auto encode_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                         std::chrono::steady_clock::now() - frame.encodeBegin
+                    )
+                                         .count();
+                    governor.Report(
+                        frame.validTimestamps
+                            ? frame.renderTimestamps.renderComplete
+                                - frame.renderTimestamps.renderBegin
+                            : 0,
+                        encode_ns
+                    );
+                }
 
-            if (!valid_timestamps) {
-                ReportPresent(pose->targetTimestampNs, 0);
-                ReportComposed(pose->targetTimestampNs, 0);
-            }
+                EncodedFrame encoded;
+                if (!freeBuffers.Pop(encoded.data)) {
+                    return false;
+                }
+                encoded.data.assign(packet.data, packet.data + packet.size);
+                encoded.pts = packet.pts;
+                encoded.isIDR = packet.isIDR;
+                encoded.firstSlice = packet.firstSlice;
+                encoded.averageQp = packet.averageQp;
+                encoded.frameType = packet.frameType;
+                if (encoded.frameType == FRAME_TYPE_UNKNOWN && packet.isIDR) {
+                    encoded.frameType = FRAME_TYPE_IDR;
+                }
+                encoded.targetTimestampNs = frame.targetTimestampNs;
+                encoded.reportTimestamps = frame.validTimestamps;
+                if (known) {
+                    encoded.timing = frame.timing;
+                    encoded.timing.encodeCompleteNs = GetSteadyTimeNs();
+                }
 
-            encode_pipeline->PushFrame(pose->targetTimestampNs, m_scheduler.CheckIDRInsertion());
+                if (frame.validTimestamps) {
+                    const Renderer::Timestamps& render_timestamps = frame.renderTimestamps;
+                    auto encode_timestamp = encode_pipeline->GetTimestamp();
+                    // Offsets are measured when the bitstream is available, as before pipelining.
+                    // GPU times are calibrated to the steady clock of the CPU times.
+                    uint64_t now = GetSteadyTimeNs();
 
-            static_assert(sizeof(frame_info.pose) == sizeof(vr::HmdMatrix34_t&));
+                    uint64_t present_offset
+                        = now - render.ToSteadyTimeNs(render_timestamps.renderBegin);
+                    uint64_t composed_offset = 0;
 
-            alvr::FramePacket packet;
-            if (!encode_pipeline->GetEncoded(packet)) {
-                Error("Failed to get encoded data!");
-                continue;
+                    if (encode_timestamp.gpu) {
+                        composed_offset = now - render.ToSteadyTimeNs(encode_timestamp.gpu);
+                    } else if (encode_timestamp.cpu) {
+                        composed_offset = now - encode_timestamp.cpu;
+                    } else {
+                        composed_offset
+                            = now - render.ToSteadyTimeNs(render_timestamps.renderComplete);
+                    }
+
+                    if (present_offset < composed_offset) {
+                        present_offset = composed_offset;
+                    }
+
+                    encoded.presentOffset = present_offset;
+                    encoded.composedOffset = composed_offset;
+                }
+
+                return encodedFrames.Push(std::move(encoded));
+            };
+            while (renderedFrames.Pop(rendered)) {
+                uint64_t targetTimestampNs = rendered.pose.targetTimestampNs;
+
+                // The client must get the frames that repair the stream
+                bool late = Settings_Instance()->m_dropLateFrames
+                    && !m_scheduler.IsRecoveryPending()
+                    && g_frameDeadline.IsLate(targetTimestampNs);
+                if (late) {
+                    Debug("Dropping late frame %llu", targetTimestampNs);
+                }
+                bool skipped = static_frames.empty()
+                    ? late
+                    : checkFrameCopy(rendered.output, targetTimestampNs, late);
+                if (skipped) {
+                    encode_pipeline->DropFrame(rendered.output);
+                    if (!freeOutputs.Push(uint32_t(rendered.output))) {
+                        break;
+                    }
+                    continue;
+                }
+                ALVR_PROFILE_ZONE("CEncoder encode");
+                // Waiting for the first present of the game and composing it, the encode of the
+                // IDR frame follows
+                StartupMilestone("first_compose");
+
+                if (!valid_timestamps) {
+                    ReportPresent(targetTimestampNs, 0);
+                    ReportComposed(targetTimestampNs, 0);
+                }
+
+                // The packet of the frame comes from this or a later GetEncoded, its output stays
+                // with the encoder until then
+                pending_frames.push_back({ rendered.output, targetTimestampNs });
+                PendingFrame& frame = pending_frames.back();
+                frame.encodeBegin = std::chrono::steady_clock::now();
+                frame.timing.targetTimestampNs = targetTimestampNs;
+                frame.timing.poseReceivedNs = rendered.pose.receivedNs;
+                frame.timing.presentNs = rendered.presentNs;
+                bool failed = false;
+                try {
+                    encode_pipeline->SetParams(g_encoderControl.Poll(paramsGeneration));
+
+                    uint64_t lastReceivedTimestampNs;
+                    if (m_scheduler.CheckRefInvalidation(lastReceivedTimestampNs)) {
+                        if (encode_pipeline->InvalidateRefFrames(lastReceivedTimestampNs)) {
+                            ReportRecoveryFrame(targetTimestampNs);
+                        } else {
+                            m_scheduler.InsertRecovery();
+                        }
+                    }
+                    bool idr = m_scheduler.CheckIDRInsertion();
+                    if (!idr && m_scheduler.CheckIntraRefreshInsertion()) {
+                        encode_pipeline->StartIntraRefresh();
+                    }
+                    encode_pipeline->SetFoveationCenter(rendered.pose.foveationCenter);
+                    encode_pipeline->SetStaticBlocks(&static_blocks);
+                    const FfiQuat& orientation = rendered.pose.motion.pose.orientation;
+                    vr::HmdRect2_t projections[2];
+                    {
+                        std::lock_guard lock(m_viewParamsMutex);
+                        std::copy(std::begin(m_projections), std::end(m_projections), projections);
+                    }
+                    encode_pipeline->SetHeadView(
+                        { orientation.w, orientation.x, orientation.y, orientation.z }, projections
+                    );
+                    frame.timing.encodeSubmitNs = GetSteadyTimeNs();
+                    encode_pipeline->PushFrame(rendered.output, targetTimestampNs, idr);
+
+                    // Renderer timestamps are reset by the next Render into this output, so they
+                    // are read before the output image goes back to the render stage
+                    if (valid_timestamps) {
+                        frame.renderTimestamps = render.GetTimestamps(rendered.output);
+                        valid_timestamps = frame.renderTimestamps.now != 0;
+                    }
+                    frame.validTimestamps = valid_timestamps;
+                    if (valid_timestamps) {
+                        const Renderer::Timestamps& render_timestamps = frame.renderTimestamps;
+                        frame.timing.composeBeginNs
+                            = render.ToSteadyTimeNs(render_timestamps.renderBegin);
+                        frame.timing.composeEndNs
+                            = render.ToSteadyTimeNs(render_timestamps.renderComplete);
+
+                        stage_timings = render.GetStageTimings(rendered.output);
+
+                        // The passes of the chain are timed back to back, up to the end of the
+                        // render
+                        gpu_profile.Init("Renderer", frame.renderTimestamps.now);
+                        int64_t stage_begin = frame.renderTimestamps.renderComplete;
+                        for (const auto& timing : stage_timings) {
+                            stage_begin -= timing.durationNs;
+                        }
+                        for (const auto& timing : stage_timings) {
+                            gpu_profile.Zone(
+                                timing.name, stage_begin, stage_begin + timing.durationNs
+                            );
+                            stage_begin += timing.durationNs;
+                        }
+
+                        encode_pipeline->GetStageTimings(stage_timings);
+
+                        ffi_stage_timings.clear();
+                        for (const auto& timing : stage_timings) {
+                            ffi_stage_timings.push_back({ timing.name, timing.durationNs });
+                        }
+                        ReportComposeStageTimings(
+                            ffi_stage_timings.data(), ffi_stage_timings.size()
+                        );
+                    }
+
+                    alvr::FramePacket packet;
+                    while (encode_pipeline->GetEncoded(packet)) {
+                        if (!sendPacket(packet)) {
+                            return;
+                        }
+                    }
+                    failures = 0;
+                } catch (std::exception& e) {
+                    if (++failures > MAX_ENCODER_REBUILDS) {
+                        throw;
+                    }
+                    // The same backend is tried again first, then the next ones of the probe
+                    // order. The render stage waits meanwhile.
+                    Error("Encoder failed, recreating it: %s", e.what());
+                    std::unique_lock lock(pipeline_mutex);
+                    // Nothing may use the outputs while the new pipeline imports them. The frames
+                    // rendered for the failed encoder are dropped, their images would be lost.
+                    RenderedFrame queued;
+                    while (renderedFrames.TryPop(queued)) {
+                        if (!freeOutputs.Push(uint32_t(queued.output))) {
+                            return;
+                        }
+                    }
+                    for (uint32_t i = 0; i < output_count; ++i) {
+                        render.Sync(i);
+                    }
+                    for (auto& converter : static_frames) {
+                        if (converter->Pending()) {
+                            uint8_t* planes[3];
+                            int linesizes[3];
+                            converter->Sync(planes, linesizes);
+                        }
+                    }
+                    static_reference.clear();
+                    last_encoded_timestamp = 0;
+                    // Waits for its conversion
+                    secondary_stream.reset();
+                    encode_pipeline.reset();
+                    wrapOutputs();
+                    encode_pipeline = createPipeline();
+                    encode_pipeline->SetSliceSink(sliceSink);
+                    createStaticFrames();
+                    createSecondaryStream();
+                    lock.unlock();
+
+                    // The client decodes again from the next frame
+                    m_scheduler.InsertIDR();
+                    paramsGeneration = 0;
+                    failed = true;
+                }
+
+                // Frames beyond the ones the encoder may still hold won't get a packet, and their
+                // outputs are not read anymore. The frames of a failed encoder are all lost.
+                size_t frames_in_flight = failed
+                    ? 0
+                    : std::min<uint32_t>(encode_pipeline->GetMaxFramesInFlight(), output_count - 1);
+                while (pending_frames.size() > frames_in_flight) {
+                    if (!failed) {
+                        Error("Failed to get encoded data!");
+                    }
+                    if (!freeOutputs.Push(uint32_t(pending_frames.front().output))) {
+                        return;
+                    }
+                    pending_frames.pop_front();
+                }
             }
+        });
 
-            if (valid_timestamps) {
-                auto render_timestamps = render.GetTimestamps();
-                auto encode_timestamp = encode_pipeline->GetTimestamp();
+        std::thread outputThread = runStage("output", [&] {
+            EncodedFrame encoded;
+            uint64_t first_nal_sent = 0;
+            uint32_t frame_bytes = 0;
+            while (encodedFrames.Pop(encoded)) {
+                ALVR_PROFILE_ZONE("CEncoder output");
+                if (encoded.reportTimestamps) {
+                    ReportPresent(encoded.targetTimestampNs, encoded.presentOffset);
+                    ReportComposed(encoded.targetTimestampNs, encoded.composedOffset);
+                }
 
-                uint64_t present_offset = render_timestamps.now - render_timestamps.renderBegin;
-                uint64_t composed_offset = 0;
+                ParseFrameSliceNals(
+                    codec,
+                    encoded.data.data(),
+                    encoded.data.size(),
+                    encoded.pts,
+                    encoded.isIDR,
+                    encoded.firstSlice,
+                    encoded.lastSlice
+                );
+                if (encoded.firstSlice) {
+                    first_nal_sent = GetSteadyTimeNs();
+                    frame_bytes = 0;
+                }
+                frame_bytes += encoded.data.size();
+                if (encoded.lastSlice) {
+                    ALVR_PROFILE_FRAME("encoded");
 
-                valid_timestamps = render_timestamps.now != 0;
+                    FfiEncodedFrameStats stats = {};
+                    stats.targetTimestampNs = encoded.targetTimestampNs;
+                    stats.sizeBytes = frame_bytes;
+                    stats.averageQp = encoded.averageQp;
+                    stats.frameType = encoded.frameType;
+                    if (encoded.timing.encodeSubmitNs != 0
+                        && encoded.timing.encodeCompleteNs > encoded.timing.encodeSubmitNs) {
+                        stats.encodeTimeNs
+                            = encoded.timing.encodeCompleteNs - encoded.timing.encodeSubmitNs;
+                    }
+                    ReportEncodedFrameStats(stats);
+                    g_encoderControl.ReportFrameSize(stats.sizeBytes);
 
-                if (encode_timestamp.gpu) {
-                    composed_offset = render_timestamps.now - encode_timestamp.gpu;
-                } else if (encode_timestamp.cpu) {
-                    auto now = std::chrono::duration_cast<std::chrono::nanoseconds>(
-                                   std::chrono::steady_clock::now().time_since_epoch()
-                    )
-                                   .count();
-                    composed_offset = now - encode_timestamp.cpu;
-                } else {
-                    composed_offset = render_timestamps.now - render_timestamps.renderComplete;
+                    if (encoded.timing.targetTimestampNs != 0) {
+                        encoded.timing.firstNalSentNs = first_nal_sent;
+                        encoded.timing.lastNalSentNs = GetSteadyTimeNs();
+                        PushFrameTiming(encoded.timing);
+                    }
                 }
 
-                if (present_offset < composed_offset) {
-                    present_offset = composed_offset;
+                if (!freeBuffers.Push(std::move(encoded.data))) {
+                    break;
                 }
+            }
+        });
 
-                ReportPresent(pose->targetTimestampNs, present_offset);
-                ReportComposed(pose->targetTimestampNs, composed_offset);
+        auto stopStages = [&] {
+            closeQueues();
+            encodeThread.join();
+            outputThread.join();
+            if (encode_pipeline) {
+                encode_pipeline->SetSliceSink(nullptr);
             }
+        };
 
-            ParseFrameNals(
-                encode_pipeline->GetCodec(), packet.data, packet.size, packet.pts, packet.isIDR
-            );
+        try {
+            fprintf(stderr, "CEncoder starting to read present packets");
+            present_packet frame_info;
+            uint64_t last_present = 0;
+            uint32_t output_index;
+
+            // When the game misses the vsync deadline of the next frame, its last frame is warped
+            // to the newest head pose and encoded in its place
+            const bool reprojection = render.SupportsReprojection()
+                and Settings_Instance()->m_enableLinuxAsyncReprojection;
+            // Frames rendered with an older pose than the newest tracking are rotated to it just
+            // before composing, and sent with it
+            const bool late_latching
+                = render.SupportsReprojection() and Settings_Instance()->m_enableLateLatching;
+            auto make_warp = [this](const vr::HmdMatrix34_t& from, const vr::HmdMatrix34_t& to) {
+                vr::HmdRect2_t projections[2];
+                {
+                    std::lock_guard lock(m_viewParamsMutex);
+                    std::copy(std::begin(m_projections), std::end(m_projections), projections);
+                }
+                return make_reprojection(from, to, projections);
+            };
+            // Follows the headset and the refresh rate switches of the stream
+            auto frame_interval = [] {
+                uint64_t period = GetVSyncIntervalNs();
+                if (period == 0) {
+                    period = 1'000'000'000 / std::max(Settings_Instance()->m_refreshRate, 1);
+                }
+                return std::chrono::nanoseconds(period);
+            };
+            // Pose frame_info was rendered at, once a frame was received
+            std::optional<PoseHistory::TrackingHistoryFrame> rendered_pose;
+            uint64_t last_target_timestamp = 0;
+            auto deadline = std::chrono::steady_clock::now();
+            // Of frame_info, until Render takes it. Reprojection renders wait on the timeline
+            // semaphore, which the layer signals along with it.
+            int sync_file = -1;
+            // Reused across the frames, the pipelines append to it
+            std::vector<Renderer::SignalOperation> render_signals;
+
+            while (not m_exiting and freeOutputs.Pop(output_index)) {
+                if (ipc->ring and ipc->init.protocol_version >= 4) {
+                    publish_vsync(*ipc->ring);
+                }
+
+                std::optional<PoseHistory::TrackingHistoryFrame> pose;
+                bool reproject = false;
+                while (not pose) {
+                    int timeout = -1;
+                    if (reprojection and rendered_pose) {
+                        auto remaining = std::chrono::ceil<std::chrono::milliseconds>(
+                            deadline - std::chrono::steady_clock::now()
+                        );
+                        timeout = std::max<int64_t>(remaining.count(), 0);
+                    }
+                    bool received;
+                    uint64_t previous_present = last_present;
+                    uint64_t skipped = 0;
+                    try {
+                        received = ipc->ring
+                            ? read_ring(
+                                  ipc->ring_epoll,
+                                  ipc->doorbell,
+                                  ipc->socket,
+                                  *ipc->ring,
+                                  last_present,
+                                  frame_info,
+                                  timeout,
+                                  ipc->sync_files ? &*ipc->sync_files : nullptr
+                              )
+                            : wait_readable(ipc->epoll, ipc->socket, timeout)
+                                and read_latest(
+                                    ipc->epoll,
+                                    ipc->socket,
+                                    (char*)&frame_info,
+                                    sizeof(frame_info),
+                                    skipped
+                                );
+                    } catch (ClientDisconnected&) {
+                        Info("CEncoder client disconnected, waiting for the next swapchain\n");
+                        if (sync_file != -1) {
+                            close(sync_file);
+                            sync_file = -1;
+                        }
+                        ipc.reset();
+                        ipc = AcceptClient();
+                        if (!ipc) {
+                            break;
+                        }
+                        if (vk_ctx.physicalDeviceUUID != ipc->init.device_uuid
+                            || !render.CanReplaceImages(ipc->init)) {
+                            Info("CEncoder swapchain changed, restarting the encoder\n");
+                            // The client decodes again from the first frame of the new encoder
+                            m_scheduler.InsertIDR();
+                            next = std::move(ipc);
+                            break;
+                        }
+                        // The frames of the old swapchain are gone, there is nothing to reproject
+                        render.ReplaceImages(ipc->init, ipc->fds.data());
+                        last_present = 0;
+                        rendered_pose.reset();
+                        continue;
+                    }
+                    if (received) {
+                        if (ipc->sync_files) {
+                            if (sync_file != -1) {
+                                close(sync_file);
+                            }
+                            sync_file = ipc->sync_files->Take(last_present);
+                        }
+                        pose = m_poseHistory->GetPoseByTag(frame_info.pose_tag);
+                        if (!pose) {
+                            pose = m_poseHistory->GetBestPoseMatch(
+                                (const vr::HmdMatrix34_t&)frame_info.pose
+                            );
+                        }
+                        // The ring only keeps the latest packet, the ones in between were skipped
+                        if (ipc->ring and previous_present != 0) {
+                            skipped = last_present - previous_present - 1;
+                        }
+                        RecordPresentsDropped(skipped);
+                        // The time the compositor presented at, without the delay of the layer
+                        bool present_times = ipc->ring and ipc->init.protocol_version >= 6;
+                        RecordPresentArrival(
+                            present_times and frame_info.present_ns != 0 ? frame_info.present_ns
+                                                                         : GetSteadyTimeNs(),
+                            pose ? pose->targetTimestampNs : 0
+                        );
+                        if (present_times and frame_info.previous_gpu_ns != 0) {
+                            RecordCompositorGpuTime(frame_info.previous_gpu_ns);
+                        }
+                        continue;
+                    }
+                    if (m_exiting or timeout == -1) {
+                        break;
+                    }
+
+                    // Missed deadline, the next one is a vsync later. Without newer tracking
+                    // there is nothing to reproject to.
+                    deadline += frame_interval();
+                    pose = m_poseHistory->GetLatestPose();
+                    if (pose and pose->targetTimestampNs == last_target_timestamp) {
+                        pose.reset();
+                    }
+                    reproject = pose.has_value();
+                    if (reproject) {
+                        RecordPresentRepeated();
+                    }
+                }
+                if (!pose) {
+                    break;
+                }
+                ALVR_PROFILE_FRAME("present");
+                ALVR_PROFILE_ZONE("CEncoder render");
+                ALVR_NO_ALLOCATIONS("CEncoder render");
+                uint64_t present_ns = GetSteadyTimeNs();
+
+                if (m_captureFrame) {
+                    m_captureFrame = false;
+                    render.CaptureInputFrame(
+                        std::string(Settings_Instance()->m_captureFrameDir)
+                        + "/alvr_frame_input.ppm"
+                    );
+                    render.CaptureOutputFrame(
+                        std::string(Settings_Instance()->m_captureFrameDir)
+                        + "/alvr_frame_output.ppm"
+                    );
+                }
+
+                // Until the frame is queued, the encode stage can't replace the outputs under it
+                std::unique_lock pipeline_lock(pipeline_mutex);
+                render_signals.clear();
+                if (encode_pipeline) {
+                    encode_pipeline->GetRenderSignals(output_index, render_signals);
+                }
+
+                std::optional<PoseHistory::TrackingHistoryFrame> latched;
+                if (late_latching and not reproject) {
+                    latched = m_poseHistory->GetLatestPose();
+                    if (latched and latched->targetTimestampNs <= pose->targetTimestampNs) {
+                        latched.reset();
+                    }
+                }
+
+                // Reprojected and latched frames are sent with the newer pose, and its foveation
+                // center
+                render.SetFoveationCenter((latched ? *latched : *pose).foveationCenter);
+                if (reproject) {
+                    Renderer::Reprojection warp
+                        = make_warp(rendered_pose->rotationMatrix, pose->rotationMatrix);
+                    // The game renders into its other swapchain images until the next present, so
+                    // the last presented one can be read again
+                    render.Render(
+                        frame_info.image,
+                        frame_info.semaphore_value,
+                        output_index,
+                        render_signals,
+                        &warp
+                    );
+                } else {
+                    Renderer::Reprojection warp;
+                    if (latched) {
+                        warp = make_warp(pose->rotationMatrix, latched->rotationMatrix);
+                    }
+                    render.Render(
+                        frame_info.image,
+                        frame_info.semaphore_value,
+                        output_index,
+                        render_signals,
+                        latched ? &warp : nullptr,
+                        sync_file
+                    );
+                    sync_file = -1;
+                    // Async reprojection warps from the pose the game rendered at
+                    rendered_pose = pose;
+                    // The next frame is due by the vsync after the next one
+                    deadline = std::chrono::steady_clock::now()
+                        + std::chrono::nanoseconds(GetTimeUntilNextVSyncNs()) + frame_interval();
+                    if (latched) {
+                        pose = latched;
+                    }
+                }
+                last_target_timestamp = pose->targetTimestampNs;
+                if (encode_pipeline) {
+                    encode_pipeline->PrepareFrame(output_index);
+                }
+                if (secondary_stream) {
+                    secondary_stream->Submit(output_index, pose->targetTimestampNs);
+                }
+                if (!static_frames.empty()) {
+                    static_frames[output_index]->Convert(
+                        render.GetOutput(output_index).semaphoreValue
+                    );
+                }
+                pipeline_lock.unlock();
+
+                static_assert(sizeof(frame_info.pose) == sizeof(vr::HmdMatrix34_t&));
+
+                if (!renderedFrames.Push({ *pose, output_index, present_ns })) {
+                    break;
+                }
+            }
+            if (sync_file != -1) {
+                close(sync_file);
+            }
+        } catch (...) {
+            stopStages();
+            throw;
         }
+        stopStages();
     } catch (std::exception& e) {
         std::stringstream err;
         err << "error in encoder thread: " << e.what();
         Error(err.str().c_str());
     }
-
-    client.events = POLLHUP;
-    close(client.fd);
+    return next;
 }
 
 void CEncoder::Stop() {
     m_exiting = true;
-    m_socket.events = POLLHUP;
-    close(m_socket.fd);
+    uint64_t one = 1;
+    if (write(m_exitEvent, &one, sizeof(one)) != sizeof(one)) {
+        Error("Failed to signal CEncoder exit: %s", strerror(errno));
+    }
+    close(m_socket);
     unlink(m_socketPath.c_str());
 }
 
 void CEncoder::OnStreamStart() { m_scheduler.OnStreamStart(); }
 
-void CEncoder::InsertIDR() { m_scheduler.InsertIDR(); }
+void CEncoder::InsertIDR() { m_scheduler.RequestIDR(); }
+
+void CEncoder::InsertRecovery() { m_scheduler.InsertRecovery(); }
+
+void CEncoder::ReportLostFrame(uint64_t lastReceivedTimestampNs) {
+    m_scheduler.InsertRefInvalidation(lastReceivedTimestampNs);
+}
 
 void CEncoder::CaptureFrame() { m_captureFrame = true; }
+
+void CEncoder::SetViewParams(vr::HmdRect2_t projLeft, vr::HmdRect2_t projRight) {
+    std::lock_guard lock(m_viewParamsMutex);
+    m_projections[0] = projLeft;
+    m_projections[1] = projRight;
+}
@@ -1,14 +1,19 @@
 #pragma once
 
 #include "alvr_server/IDRScheduler.h"
+#include "alvr_server/openvr_driver_wrap.h"
 #include "shared/threadtools.h"
 #include <atomic>
 #include <memory>
-#include <poll.h>
+#include <mutex>
 #include <string>
 #include <sys/types.h>
+#include <vector>
 
 class PoseHistory;
+namespace alvr {
+class VkContext;
+}
 
 class CEncoder : public CThread {
 public:
@@ -20,17 +25,32 @@ public:
     void Stop();
     void OnStreamStart();
     void InsertIDR();
+    void InsertRecovery();
+    void ReportLostFrame(uint64_t lastReceivedTimestampNs);
     bool IsConnected() { return m_connected; }
     void CaptureFrame();
+    // Projection tangents of the eyes, used to reproject frames the game did not deliver in time
+    void SetViewParams(vr::HmdRect2_t projLeft, vr::HmdRect2_t projRight);
 
 private:
-    void GetFds(int client, int (*fds)[6]);
+    struct IpcClient;
+
+    // Null once Stop() was called
+    std::unique_ptr<IpcClient> AcceptClient();
+    // Encodes the frames of ipc and of the following connections with a compatible swapchain.
+    // Returns the connection that needs a new session, if any.
+    std::unique_ptr<IpcClient>
+    RunSession(std::unique_ptr<IpcClient> ipc, std::unique_ptr<alvr::VkContext>& warm_ctx);
+    void GetFds(int client, int* fds, size_t count);
     std::shared_ptr<PoseHistory> m_poseHistory;
     std::atomic_bool m_exiting { false };
     IDRScheduler m_scheduler;
-    pollfd m_socket;
+    int m_socket = -1;
+    // eventfd signaled by Stop() to wake up the blocking IPC waits
+    int m_exitEvent = -1;
     std::string m_socketPath;
-    int m_fds[6];
     bool m_connected = false;
     std::atomic_bool m_captureFrame = false;
+    std::mutex m_viewParamsMutex;
+    vr::HmdRect2_t m_projections[2] = {};
 };
@@ -0,0 +1,224 @@
+#include "ComposeBenchmark.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <vector>
+
+#include "FormatConverter.h"
+#include "FrameRender.h"
+#include "FrameUploader.h"
+#include "alvr_server/Logger.h"
+#include "alvr_server/bindings.h"
+#include "protocol.h"
+
+namespace {
+
+// Timed frames of each variant, after the warm up ones that let the GPU clocks settle
+const uint32_t FRAMES = 2000;
+const uint32_t WARMUP_FRAMES = 100;
+
+struct Variant {
+    std::string name;
+    FrameRender::Variant variant;
+};
+
+// GPU times of one pass of a variant, in chain order
+struct Stage {
+    std::string name;
+    std::vector<uint64_t> durationsNs;
+};
+
+// Gradients under a checkerboard, so that the color correction and the sharpening have edges to
+// work on like the frames of a game
+CapturedFrame SyntheticFrame(uint32_t width, uint32_t height) {
+    CapturedFrame frame;
+    frame.width = width;
+    frame.height = height;
+    frame.rgba.resize((size_t)width * height * 4);
+    for (uint32_t y = 0; y < height; y++) {
+        for (uint32_t x = 0; x < width; x++) {
+            uint8_t* p = &frame.rgba[((size_t)y * width + x) * 4];
+            bool light = ((x / 16) + (y / 16)) % 2 == 0;
+            p[0] = uint8_t(x * 255 / width);
+            p[1] = uint8_t(y * 255 / height);
+            p[2] = light ? 224 : 32;
+            p[3] = 255;
+        }
+    }
+    return frame;
+}
+
+// The fused and fp16 variants only where they could be picked
+std::vector<Variant> ListVariants(const alvr::VkContext& ctx) {
+    std::vector<Variant> variants;
+    FrameRender::Variant quad;
+    quad.fused = false;
+    quad.fp16 = false;
+    variants.push_back({ "quad", quad });
+
+    for (bool fused : { false, true }) {
+        if (fused && COMPOSE_SHADER_COMP_SPV_LEN == 0) {
+            continue;
+        }
+        for (bool fp16 : { false, true }) {
+            if (fp16 && !ctx.shaderFloat16) {
+                continue;
+            }
+            for (bool tuned : { false, true }) {
+                FrameRender::Variant variant;
+                variant.colorCorrection = true;
+                variant.foveatedEncoding = true;
+                variant.fused = fused;
+                variant.fp16 = fp16;
+                variant.tunedWorkgroups = tuned;
+                std::string name = fused ? "fused" : "separate";
+                name += fp16 ? "_fp16" : "";
+                name += tuned ? "_tuned" : "";
+                variants.push_back({ name, variant });
+            }
+        }
+    }
+    return variants;
+}
+
+uint64_t Percentile(const std::vector<uint64_t>& sorted, size_t percent) {
+    return sorted[std::min(sorted.size() - 1, sorted.size() * percent / 100)];
+}
+
+std::vector<Stage> RunVariant(
+    alvr::VkContext& ctx,
+    init_packet& init,
+    const CapturedFrame& frame,
+    const FrameRender::Variant& variant,
+    const std::atomic_bool& exiting
+) {
+    FrameRender render(ctx, init, nullptr, &variant);
+    if (!render.d.haveCalibratedTimestamps) {
+        throw MakeException("the device has no calibrated timestamps");
+    }
+
+    FrameUploader uploader(render, init.image_create_info, init.mem_index);
+    for (uint32_t i = 0; i < FrameUploader::INPUT_IMAGES; i++) {
+        int imageFd, semaphoreFd;
+        uploader.GetFds(i, imageFd, semaphoreFd);
+        render.AddImage(init.image_create_info, init.mem_index, imageFd, semaphoreFd);
+    }
+    // Each Render is waited for before the next, so that the passes are timed without overlap
+    render.CreateOutput(1);
+    const Renderer::Output& output = render.GetOutput(0);
+    RgbToYuv420 converter(&render, output.image, output.imageInfo, output.semaphore);
+
+    // The frame doesn't change, the inputs are only uploaded once
+    uint64_t values[FrameUploader::INPUT_IMAGES];
+    for (uint32_t i = 0; i < FrameUploader::INPUT_IMAGES; i++) {
+        values[i] = uploader.Upload(i, frame);
+    }
+
+    std::vector<Stage> stages;
+    uint8_t* planes[3];
+    int linesizes[3];
+    for (uint32_t i = 0; i < WARMUP_FRAMES + FRAMES && !exiting; i++) {
+        uint32_t input = i % FrameUploader::INPUT_IMAGES;
+        render.Render(input, values[input], 0);
+        converter.Convert(output.semaphoreValue);
+        converter.Sync(planes, linesizes);
+        render.Sync(0);
+        if (i < WARMUP_FRAMES) {
+            continue;
+        }
+
+        const std::vector<Renderer::StageTiming>& timings = render.GetStageTimings(0);
+        if (stages.empty()) {
+            for (const Renderer::StageTiming& timing : timings) {
+                stages.push_back({ timing.name, {} });
+            }
+            stages.push_back({ "rgbtoyuv420", {} });
+            stages.push_back({ "total", {} });
+        }
+        for (size_t j = 0; j < timings.size(); j++) {
+            stages[j].durationsNs.push_back(timings[j].durationNs);
+        }
+        stages[timings.size()].durationsNs.push_back(converter.GetDuration());
+        auto timestamps = render.GetTimestamps(0);
+        stages.back().durationsNs.push_back(timestamps.renderComplete - timestamps.renderBegin);
+    }
+    return stages;
+}
+
+void Run(const std::string& directory, const std::atomic_bool& exiting) {
+    const uint32_t width = Settings_Instance()->m_renderWidth;
+    const uint32_t height = Settings_Instance()->m_renderHeight;
+    CapturedFrame frame = SyntheticFrame(width, height);
+
+    alvr::VkContext vk_ctx(nullptr, std::vector<const char*> {});
+
+    // Images are taken from the uploader instead of the layer
+    init_packet init = {};
+    init.num_images = 0;
+    init.image_create_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    init.image_create_info.imageType = VK_IMAGE_TYPE_2D;
+    init.image_create_info.format = VK_FORMAT_R8G8B8A8_UNORM;
+    init.image_create_info.extent = { width, height, 1 };
+    init.image_create_info.mipLevels = 1;
+    init.image_create_info.arrayLayers = 1;
+    init.image_create_info.samples = VK_SAMPLE_COUNT_1_BIT;
+    init.image_create_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+    init.image_create_info.usage = VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+    init.image_create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    init.image_create_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+    std::vector<Variant> variants = ListVariants(vk_ctx);
+    Info(
+        "Compose benchmark: %zu variants of %u frames of %ux%u",
+        variants.size(),
+        FRAMES,
+        width,
+        height
+    );
+
+    std::filesystem::path path = std::filesystem::path(directory) / "compose_benchmark.csv";
+    std::ofstream file(path);
+    file << "variant,stage,p50_us,p95_us,p99_us,mean_us\n";
+    for (const Variant& variant : variants) {
+        if (exiting) {
+            break;
+        }
+        std::vector<Stage> stages = RunVariant(vk_ctx, init, frame, variant.variant, exiting);
+        for (Stage& stage : stages) {
+            if (stage.durationsNs.empty()) {
+                continue;
+            }
+            std::sort(stage.durationsNs.begin(), stage.durationsNs.end());
+            uint64_t sum = 0;
+            for (uint64_t duration : stage.durationsNs) {
+                sum += duration;
+            }
+            double p50 = Percentile(stage.durationsNs, 50) / 1e3;
+            double p95 = Percentile(stage.durationsNs, 95) / 1e3;
+            double p99 = Percentile(stage.durationsNs, 99) / 1e3;
+            double mean = sum / 1e3 / stage.durationsNs.size();
+            Info(
+                "Compose benchmark: %s %s p50 %.1f us, p95 %.1f us, p99 %.1f us",
+                variant.name.c_str(),
+                stage.name.c_str(),
+                p50,
+                p95,
+                p99
+            );
+            file << variant.name << "," << stage.name << "," << p50 << "," << p95 << "," << p99
+                 << "," << mean << "\n";
+        }
+    }
+    Info("Compose benchmark results written to %s", path.c_str());
+}
+
+} // namespace
+
+void alvr::RunComposeBenchmark(const std::string& directory, const std::atomic_bool& exiting) {
+    try {
+        Run(directory, exiting);
+    } catch (std::exception& e) {
+        Error("Compose benchmark failed: %s", e.what());
+    }
+}
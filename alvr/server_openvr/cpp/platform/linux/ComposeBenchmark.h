@@ -0,0 +1,17 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+
+namespace alvr {
+
+// Times the variants of the compose chain of FrameRender on a synthetic frame of the render size,
+// without the compositor, a client or an encoder: the quad pass alone, and the separate color
+// correction and foveation passes against the fused compose shader, each with and without the
+// fp16 color correction and the tuned workgroup sizes. The other passes follow the settings.
+// Each variant renders a few thousand frames back to back, and the p50, p95 and p99 GPU time of
+// each of its passes and of the rgbtoyuv420 conversion of the software encoder are logged and
+// written to compose_benchmark.csv in directory. Returns early once exiting is set.
+void RunComposeBenchmark(const std::string& directory, const std::atomic_bool& exiting);
+
+}
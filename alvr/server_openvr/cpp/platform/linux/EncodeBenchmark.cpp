@@ -0,0 +1,446 @@
+#include "EncodeBenchmark.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "ALVR-common/packet_types.h"
+#include "EncodePipeline.h"
+#include "FrameRender.h"
+#include "FrameUploader.h"
+#include "alvr_server/CapturedFrames.h"
+#include "alvr_server/Logger.h"
+#include "alvr_server/bindings.h"
+#include "ffmpeg_helper.h"
+#include "protocol.h"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavutil/pixdesc.h>
+}
+
+namespace {
+
+// Side of the windows the SSIM is averaged over
+const uint32_t SSIM_WINDOW = 8;
+
+// Result of one frame, the quality is negative when it wasn't measured
+struct FrameResult {
+    uint64_t composeNs = 0;
+    uint64_t encodeNs = 0;
+    uint32_t bytes = 0;
+    bool idr = false;
+    bool rendered = false;
+    bool encoded = false;
+    double psnr = -1.;
+    double ssim = -1.;
+    // Packet kept for the quality pass
+    std::vector<uint8_t> packet;
+};
+
+// Luma of a captured frame in the 8 bit range of the decoded frames, BT.709
+std::vector<float> SourceLuma(const CapturedFrame& frame, bool fullRange) {
+    std::vector<float> luma((size_t)frame.width * frame.height);
+    for (size_t i = 0; i < luma.size(); i++) {
+        const uint8_t* p = &frame.rgba[i * 4];
+        float y = 0.2126f * p[0] + 0.7152f * p[1] + 0.0722f * p[2];
+        luma[i] = fullRange ? y : 16.f + y * 219.f / 255.f;
+    }
+    return luma;
+}
+
+// Luma of a decoded frame scaled to 8 bits, empty for formats without a luma plane
+std::vector<float> DecodedLuma(const AVFrame* frame) {
+    std::vector<float> luma;
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get((AVPixelFormat)frame->format);
+    if (desc == nullptr || (desc->flags & AV_PIX_FMT_FLAG_RGB) || desc->comp[0].plane != 0) {
+        return luma;
+    }
+    const AVComponentDescriptor& comp = desc->comp[0];
+    float scale = 1.f / float(1 << (comp.depth - 8));
+    luma.resize((size_t)frame->width * frame->height);
+    for (int y = 0; y < frame->height; y++) {
+        const uint8_t* row = frame->data[0] + (size_t)y * frame->linesize[0] + comp.offset;
+        for (int x = 0; x < frame->width; x++) {
+            const uint8_t* sample = row + (size_t)x * comp.step;
+            uint32_t value = comp.step > 1 ? *(const uint16_t*)sample : *sample;
+            luma[(size_t)y * frame->width + x]
+                = float((value >> comp.shift) & ((1u << comp.depth) - 1)) * scale;
+        }
+    }
+    return luma;
+}
+
+double Psnr(const std::vector<float>& a, const std::vector<float>& b) {
+    double error = 0.;
+    for (size_t i = 0; i < a.size(); i++) {
+        double d = a[i] - b[i];
+        error += d * d;
+    }
+    error /= a.size();
+    // Identical frames are reported at the PSNR of an error of one step
+    return 10. * std::log10(255. * 255. / std::max(error, 1.));
+}
+
+// Mean of the SSIM of the SSIM_WINDOW x SSIM_WINDOW windows tiling the frame
+double Ssim(const std::vector<float>& a, const std::vector<float>& b, uint32_t w, uint32_t h) {
+    const double c1 = (0.01 * 255.) * (0.01 * 255.);
+    const double c2 = (0.03 * 255.) * (0.03 * 255.);
+    const double n = SSIM_WINDOW * SSIM_WINDOW;
+    double sum = 0.;
+    uint32_t windows = 0;
+    for (uint32_t top = 0; top + SSIM_WINDOW <= h; top += SSIM_WINDOW) {
+        for (uint32_t left = 0; left + SSIM_WINDOW <= w; left += SSIM_WINDOW) {
+            double sa = 0., sb = 0., saa = 0., sbb = 0., sab = 0.;
+            for (uint32_t y = top; y < top + SSIM_WINDOW; y++) {
+                for (uint32_t x = left; x < left + SSIM_WINDOW; x++) {
+                    double va = a[(size_t)y * w + x];
+                    double vb = b[(size_t)y * w + x];
+                    sa += va;
+                    sb += vb;
+                    saa += va * va;
+                    sbb += vb * vb;
+                    sab += va * vb;
+                }
+            }
+            double ma = sa / n, mb = sb / n;
+            double va = saa / n - ma * ma, vb = sbb / n - mb * mb, cov = sab / n - ma * mb;
+            sum += (2. * ma * mb + c1) * (2. * cov + c2)
+                / ((ma * ma + mb * mb + c1) * (va + vb + c2));
+            windows++;
+        }
+    }
+    return windows > 0 ? sum / windows : -1.;
+}
+
+// Decodes the packets of the frames in encode order and compares their luma with the captured
+// frames, which is only meaningful when the compose chain keeps the frame size
+void MeasureQuality(
+    const std::vector<std::filesystem::path>& paths, std::vector<FrameResult>& results, int codec
+) {
+    AVCodecID id = AV_CODEC_ID_AV1;
+    if (codec == ALVR_CODEC_H264) {
+        id = AV_CODEC_ID_H264;
+    } else if (codec == ALVR_CODEC_HEVC) {
+        id = AV_CODEC_ID_HEVC;
+    }
+    const AVCodec* decoder = avcodec_find_decoder(id);
+    if (decoder == nullptr) {
+        Warn("Encode benchmark: no decoder for the codec, the quality isn't measured");
+        return;
+    }
+    AVCodecContext* ctx = avcodec_alloc_context3(decoder);
+    AVPacket* packet = av_packet_alloc();
+    AVFrame* frame = av_frame_alloc();
+    if (avcodec_open2(ctx, decoder, nullptr) < 0) {
+        Warn("Encode benchmark: failed to open the decoder, the quality isn't measured");
+    }
+
+    // Frames in the order their packets were decoded, there are no B-frames
+    std::deque<size_t> decoding;
+    bool sizeWarned = false;
+    auto receive = [&] {
+        while (!decoding.empty() && avcodec_receive_frame(ctx, frame) == 0) {
+            size_t index = decoding.front();
+            decoding.pop_front();
+            CapturedFrame source;
+            if (!LoadCapturedFrame(paths[index], source)) {
+                continue;
+            }
+            if ((uint32_t)frame->width != source.width
+                || (uint32_t)frame->height != source.height) {
+                if (!sizeWarned) {
+                    Warn(
+                        "Encode benchmark: the encoded frames are %dx%d, the quality is only "
+                        "measured on frames of the captured size",
+                        frame->width,
+                        frame->height
+                    );
+                    sizeWarned = true;
+                }
+                continue;
+            }
+            std::vector<float> decoded = DecodedLuma(frame);
+            if (decoded.empty()) {
+                continue;
+            }
+            std::vector<float> reference
+                = SourceLuma(source, frame->color_range == AVCOL_RANGE_JPEG);
+            results[index].psnr = Psnr(reference, decoded);
+            results[index].ssim = Ssim(reference, decoded, source.width, source.height);
+        }
+    };
+
+    if (avcodec_is_open(ctx)) {
+        for (size_t i = 0; i < results.size(); i++) {
+            if (!results[i].encoded) {
+                continue;
+            }
+            packet->data = results[i].packet.data();
+            packet->size = (int)results[i].packet.size();
+            if (avcodec_send_packet(ctx, packet) == 0) {
+                decoding.push_back(i);
+            }
+            receive();
+        }
+        avcodec_send_packet(ctx, nullptr);
+        receive();
+    }
+
+    av_frame_free(&frame);
+    av_packet_free(&packet);
+    avcodec_free_context(&ctx);
+}
+
+void WriteResults(const std::string& directory, const std::vector<FrameResult>& results) {
+    std::filesystem::path path = std::filesystem::path(directory) / "encode_benchmark.csv";
+    std::ofstream file(path);
+    file << "frame,compose_us,encode_us,bytes,idr,psnr,ssim\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        const FrameResult& result = results[i];
+        file << i << ",";
+        if (result.rendered) {
+            file << result.composeNs / 1000;
+        }
+        file << ",";
+        if (result.encoded) {
+            file << result.encodeNs / 1000 << "," << result.bytes;
+        } else {
+            file << ",";
+        }
+        file << "," << (result.idr ? 1 : 0) << ",";
+        if (result.psnr >= 0.) {
+            file << result.psnr << "," << result.ssim;
+        } else {
+            file << ",";
+        }
+        file << "\n";
+    }
+    Info("Encode benchmark results written to %s", path.c_str());
+}
+
+void LogSummary(const std::vector<FrameResult>& results, double frameRate) {
+    std::vector<uint64_t> latencies;
+    uint64_t composeNs = 0, bytes = 0;
+    double psnr = 0., ssim = 0.;
+    size_t rendered = 0, measured = 0;
+    for (const FrameResult& result : results) {
+        if (result.rendered) {
+            composeNs += result.composeNs;
+            rendered++;
+        }
+        if (result.encoded) {
+            latencies.push_back(result.encodeNs);
+            bytes += result.bytes;
+        }
+        if (result.psnr >= 0.) {
+            psnr += result.psnr;
+            ssim += result.ssim;
+            measured++;
+        }
+    }
+    if (latencies.empty()) {
+        Error("Encode benchmark: no frame was encoded");
+        return;
+    }
+    std::sort(latencies.begin(), latencies.end());
+    uint64_t meanLatency = 0;
+    for (uint64_t latency : latencies) {
+        meanLatency += latency;
+    }
+    meanLatency /= latencies.size();
+    uint64_t p99Latency = latencies[std::min(latencies.size() - 1, latencies.size() * 99 / 100)];
+
+    Info(
+        "Encode benchmark: %zu/%zu frames encoded, compose %.2f ms, encode %.2f ms (p99 %.2f ms), "
+        "%.1f KB per frame, %.1f Mbps",
+        latencies.size(),
+        results.size(),
+        composeNs / 1e6 / rendered,
+        meanLatency / 1e6,
+        p99Latency / 1e6,
+        bytes / 1e3 / latencies.size(),
+        bytes * 8. * frameRate / 1e6 / latencies.size()
+    );
+    if (measured > 0) {
+        Info("Encode benchmark: luma PSNR %.2f dB, SSIM %.4f", psnr / measured, ssim / measured);
+    }
+}
+
+void Run(const std::string& directory, const std::atomic_bool& exiting) {
+    std::vector<std::filesystem::path> paths = ListCapturedFrames(directory);
+    CapturedFrame frame;
+    if (paths.empty() || !LoadCapturedFrame(paths[0], frame)) {
+        throw MakeException("no captured frame in %s", directory.c_str());
+    }
+    Info(
+        "Encode benchmark: %zu frames of %ux%u in %s",
+        paths.size(),
+        frame.width,
+        frame.height,
+        directory.c_str()
+    );
+
+    alvr::VkContext vk_ctx(nullptr, std::vector<const char*> {});
+
+    // Images are taken from the uploader instead of the layer
+    init_packet init = {};
+    init.num_images = 0;
+    init.image_create_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    init.image_create_info.imageType = VK_IMAGE_TYPE_2D;
+    init.image_create_info.format = VK_FORMAT_R8G8B8A8_UNORM;
+    init.image_create_info.extent = { frame.width, frame.height, 1 };
+    init.image_create_info.mipLevels = 1;
+    init.image_create_info.arrayLayers = 1;
+    init.image_create_info.samples = VK_SAMPLE_COUNT_1_BIT;
+    init.image_create_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+    init.image_create_info.usage = VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+    init.image_create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    init.image_create_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    FrameRender render(vk_ctx, init, nullptr);
+
+    FrameUploader uploader(render, init.image_create_info, init.mem_index);
+    for (uint32_t i = 0; i < FrameUploader::INPUT_IMAGES; i++) {
+        int imageFd, semaphoreFd;
+        uploader.GetFds(i, imageFd, semaphoreFd);
+        render.AddImage(init.image_create_info, init.mem_index, imageFd, semaphoreFd);
+    }
+
+    const uint32_t output_count
+        = std::clamp<uint32_t>(Settings_Instance()->m_linuxEncoderOutputImages, 1, 3);
+    render.CreateOutput(output_count, alvr::EncodePipeline::OutputModifierFilter(vk_ctx));
+    std::vector<std::unique_ptr<alvr::VkFrame>> frames;
+    for (uint32_t i = 0; i < output_count; ++i) {
+        auto& output = render.GetOutput(i);
+        frames.push_back(std::make_unique<alvr::VkFrame>(
+            vk_ctx, output.image, output.imageInfo, output.size, output.memory, output.drm
+        ));
+    }
+    auto encode_pipeline = alvr::EncodePipeline::Create(
+        &render,
+        vk_ctx,
+        frames,
+        render.GetOutput(0).imageInfo,
+        render.GetEncodingWidth(),
+        render.GetEncodingHeight()
+    );
+    const int codec = encode_pipeline->GetCodec();
+    Info(
+        "Encode benchmark: encoding at %ux%u",
+        render.GetEncodingWidth(),
+        render.GetEncodingHeight()
+    );
+
+    // The first Render of each input image moves it out of the undefined layout and builds the
+    // compose pipelines, none of which is part of the measures
+    for (uint32_t i = 0; i < FrameUploader::INPUT_IMAGES; i++) {
+        uint64_t value = uploader.Upload(i, frame);
+        render.Render(i, value, 0);
+        uploader.SetRead(i, 0);
+    }
+
+    const double frame_rate = std::max(Settings_Instance()->m_refreshRate, 1);
+    const auto frame_interval = std::chrono::nanoseconds(uint64_t(1e9 / frame_rate));
+    std::vector<FrameResult> results(paths.size());
+
+    struct PendingFrame {
+        size_t index;
+        std::chrono::steady_clock::time_point pushTime;
+    };
+    std::deque<PendingFrame> pending_frames;
+    auto receivePackets = [&] {
+        alvr::FramePacket packet;
+        while (encode_pipeline->GetEncoded(packet)) {
+            // Leading slices are only split off with a slice sink
+            if (pending_frames.empty()) {
+                continue;
+            }
+            FrameResult& result = results[pending_frames.front().index];
+            auto latency = std::chrono::steady_clock::now() - pending_frames.front().pushTime;
+            result.encodeNs = std::chrono::duration_cast<std::chrono::nanoseconds>(latency).count();
+            result.bytes = packet.size;
+            result.idr = packet.isIDR;
+            result.encoded = true;
+            result.packet.assign(packet.data, packet.data + packet.size);
+            pending_frames.pop_front();
+        }
+    };
+
+    auto next_frame = std::chrono::steady_clock::now();
+    bool behind = false;
+    // The stream starts with an IDR frame
+    bool idr = true;
+    for (size_t i = 0; i < paths.size() && !exiting; i++) {
+        if (i > 0 && !LoadCapturedFrame(paths[i], frame)) {
+            Warn("Encode benchmark: skipping %s", paths[i].c_str());
+            continue;
+        }
+        if (frame.width != init.image_create_info.extent.width
+            || frame.height != init.image_create_info.extent.height) {
+            Warn("Encode benchmark: skipping %s, its size differs", paths[i].c_str());
+            continue;
+        }
+        uint32_t input = i % FrameUploader::INPUT_IMAGES;
+        uint32_t output_index = i % output_count;
+        uint64_t value = uploader.Upload(input, frame);
+
+        if (std::chrono::steady_clock::now() > next_frame + frame_interval && !behind) {
+            Warn("Encode benchmark: frames are loaded slower than the refresh rate");
+            behind = true;
+        }
+        std::this_thread::sleep_until(next_frame);
+        next_frame += frame_interval;
+
+        std::vector<Renderer::SignalOperation> signals;
+        encode_pipeline->GetRenderSignals(output_index, signals);
+        render.Render(input, value, output_index, signals);
+        uploader.SetRead(input, output_index);
+        encode_pipeline->PrepareFrame(output_index);
+
+        pending_frames.push_back({ i, std::chrono::steady_clock::now() });
+        encode_pipeline->PushFrame(output_index, (i + 1) * frame_interval.count(), idr);
+        idr = false;
+        auto timestamps = render.GetTimestamps(output_index);
+        results[i].composeNs = timestamps.renderComplete - timestamps.renderBegin;
+        results[i].rendered = true;
+        receivePackets();
+
+        // Same as the encode stage of CEncoder, frames beyond the ones the encoder may still
+        // hold won't get a packet
+        size_t frames_in_flight
+            = std::min<uint32_t>(encode_pipeline->GetMaxFramesInFlight(), output_count - 1);
+        while (pending_frames.size() > frames_in_flight) {
+            Error(
+                "Encode benchmark: failed to get the packet of frame %zu",
+                pending_frames.front().index
+            );
+            pending_frames.pop_front();
+        }
+    }
+    auto flush_deadline = std::chrono::steady_clock::now() + 10 * frame_interval;
+    while (!pending_frames.empty() && std::chrono::steady_clock::now() < flush_deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        receivePackets();
+    }
+    encode_pipeline.reset();
+
+    MeasureQuality(paths, results, codec);
+    WriteResults(directory, results);
+    LogSummary(results, frame_rate);
+}
+
+} // namespace
+
+void alvr::RunEncodeBenchmark(const std::string& directory, const std::atomic_bool& exiting) {
+    try {
+        Run(directory, exiting);
+    } catch (std::exception& e) {
+        Error("Encode benchmark failed: %s", e.what());
+    }
+}
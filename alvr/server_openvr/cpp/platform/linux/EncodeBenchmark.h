@@ -0,0 +1,18 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+
+namespace alvr {
+
+// Replays captured frames through FrameRender and the EncodePipeline the settings pick, without
+// the compositor or a client. directory holds the frames in name order, either PPM files as
+// written by Renderer::CaptureInputFrame or raw RGBA dumps named <name>_<width>x<height>.rgba.
+// They are uploaded at the refresh rate into exported images, like the swapchain images of the
+// layer, and the compose time, encode latency and frame size of each frame are written to
+// encode_benchmark.csv in directory, along with the luma PSNR and SSIM of the decoded frames
+// against the captured ones when the compose chain keeps their size. Returns early once exiting
+// is set.
+void RunEncodeBenchmark(const std::string& directory, const std::atomic_bool& exiting);
+
+}
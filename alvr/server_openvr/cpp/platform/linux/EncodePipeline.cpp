@@ -1,68 +1,183 @@
 #include "EncodePipeline.h"
 
 #include "EncodePipelineNvEnc.h"
+#include "EncodePipelineNvEncSdk.h"
 #include "EncodePipelineSW.h"
+#include "EncodePipelineSWAvcodec.h"
 #include "EncodePipelineVAAPI.h"
+#include "EncodePipelineVulkan.h"
+#include "alvr_server/EncoderBackend.h"
+#include "alvr_server/EncoderControl.h"
 #include "alvr_server/Logger.h"
+#include "alvr_server/StartupTimeline.h"
 #include "alvr_server/bindings.h"
 #include "ffmpeg_helper.h"
 
 extern "C" {
 #include <libavcodec/avcodec.h>
+#include <libavutil/intreadwrite.h>
 }
 
 void alvr::EncodePipeline::SetParams(FfiDynamicEncoderParams params) {
     if (params.updated) {
         encoder_ctx->bit_rate = params.bitrate_bps / params.framerate * 60.0;
         encoder_ctx->framerate = AVRational { 60, 1 };
-        encoder_ctx->rc_buffer_size = encoder_ctx->bit_rate / 60.0 * 1.1;
+        encoder_ctx->rc_buffer_size
+            = CapToMaxFrameSize(params.max_frame_bytes, encoder_ctx->bit_rate / 60.0 * 1.1);
         encoder_ctx->rc_max_rate = encoder_ctx->bit_rate;
         encoder_ctx->rc_initial_buffer_occupancy = encoder_ctx->rc_buffer_size / 4 * 3;
     }
 }
 
+namespace {
+// DRM_FORMAT_MOD_LINEAR, the only layout that GPUs of different drivers share
+const uint64_t LINEAR_MODIFIER = 0;
+
+// Device UUID and driver version
+std::string gpu_id(alvr::VkContext& vk_ctx) {
+    VkPhysicalDeviceVulkan11Properties props11 = {};
+    props11.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_1_PROPERTIES;
+    VkPhysicalDeviceProperties2 props = {};
+    props.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+    props.pNext = &props11;
+    vkGetPhysicalDeviceProperties2(vk_ctx.get_vk_phys_device(), &props);
+
+    char id[2 * VK_UUID_SIZE + 1] = {};
+    for (int i = 0; i < VK_UUID_SIZE; ++i) {
+        snprintf(id + 2 * i, 3, "%02x", props11.deviceUUID[i]);
+    }
+    return std::string(id) + "_" + std::to_string(props.properties.driverVersion);
+}
+}
+
+Renderer::ModifierFilter
+alvr::EncodePipeline::OutputModifierFilter(VkContext& vk_ctx, VkContext* encode_ctx) {
+    if (encode_ctx) {
+        auto importable = EncodePipelineVAAPI::ImportableModifierFilter(*encode_ctx);
+        return [importable](uint32_t format, uint64_t modifier) {
+            return modifier == LINEAR_MODIFIER && (!importable || importable(format, modifier));
+        };
+    }
+    // The other encoders of AMD and Intel read the same images as VAAPI, or copy them
+    if (Settings_Instance()->m_forceSwEncoding || vk_ctx.nvidia) {
+        return {};
+    }
+    return EncodePipelineVAAPI::ImportableModifierFilter(vk_ctx);
+}
+
 std::unique_ptr<alvr::EncodePipeline> alvr::EncodePipeline::Create(
     Renderer* render,
     VkContext& vk_ctx,
-    VkFrame& input_frame,
+    const std::vector<std::unique_ptr<VkFrame>>& input_frames,
     VkImageCreateInfo& image_create_info,
     uint32_t width,
-    uint32_t height
+    uint32_t height,
+    VkContext* encode_ctx
 ) {
-    if (!Settings_Instance()->m_forceSwEncoding) {
-        if (vk_ctx.nvidia) {
-            try {
-                auto nvenc = std::make_unique<alvr::EncodePipelineNvEnc>(
-                    render, vk_ctx, input_frame, image_create_info, width, height
+    const std::string id = gpu_id(encode_ctx ? *encode_ctx : vk_ctx);
+    std::vector<EncoderBackend> order;
+    if (Settings_Instance()->m_forceSwEncoding) {
+        order = { EncoderBackend::Software };
+    } else if (encode_ctx) {
+        order = EncoderBackendProbeOrder(id, { EncoderBackend::Vaapi, EncoderBackend::Software });
+    } else {
+        if (Settings_Instance()->m_useVulkanVideoEncoder) {
+            order.push_back(EncoderBackend::VulkanVideo);
+        }
+        order.push_back(vk_ctx.nvidia ? EncoderBackend::Nvenc : EncoderBackend::Vaapi);
+        // Reads the same VA surfaces, for drivers whose VAAPI encoder doesn't work
+        if (vk_ctx.intel) {
+            order.push_back(EncoderBackend::Vpl);
+        }
+        order.push_back(EncoderBackend::Software);
+        order = EncoderBackendProbeOrder(id, order);
+    }
+
+    for (EncoderBackend backend : order) {
+        try {
+            std::unique_ptr<EncodePipeline> pipeline;
+            switch (backend) {
+            case EncoderBackend::VulkanVideo:
+                pipeline = std::make_unique<alvr::EncodePipelineVulkan>(
+                    render, vk_ctx, input_frames, image_create_info, width, height
+                );
+                break;
+            case EncoderBackend::Nvenc:
+#ifdef ALVR_CUDA_INTEROP
+                // The SDK encoder reads the outputs in place, libavcodec copies the others
+                if (image_create_info.tiling == VK_IMAGE_TILING_LINEAR) {
+                    try {
+                        pipeline = std::make_unique<alvr::EncodePipelineNvEncSdk>(
+                            render, vk_ctx, width, height
+                        );
+                        break;
+                    } catch (std::exception& e) {
+                        Warn("NvEnc SDK encoder not available, using FFmpeg: %s", e.what());
+                    }
+                }
+#endif
+                pipeline = std::make_unique<alvr::EncodePipelineNvEnc>(
+                    render, vk_ctx, input_frames, image_create_info, width, height
+                );
+                break;
+            case EncoderBackend::Vaapi:
+                pipeline = std::make_unique<alvr::EncodePipelineVAAPI>(
+                    render,
+                    encode_ctx ? *encode_ctx : vk_ctx,
+                    input_frames,
+                    width,
+                    height,
+                    encode_ctx != nullptr
+                );
+                break;
+            case EncoderBackend::Vpl:
+                if (encode_ctx) {
+                    throw std::runtime_error("not available for a separate encoding GPU");
+                }
+                pipeline = std::make_unique<alvr::EncodePipelineVAAPI>(
+                    render, vk_ctx, input_frames, width, height, false, true
                 );
-                Info("Using NvEnc encoder");
-                return nvenc;
-            } catch (std::exception& e) {
+                break;
+            case EncoderBackend::Software:
+                if (Settings_Instance()->m_codec == ALVR_CODEC_H264) {
+                    pipeline = std::make_unique<alvr::EncodePipelineSW>(render, width, height);
+                } else {
+                    pipeline
+                        = std::make_unique<alvr::EncodePipelineSWAvcodec>(render, width, height);
+                }
+                break;
+            default:
+                throw std::runtime_error("not available on Linux");
+            }
+            Info("Using %s encoder", EncoderBackendName(backend));
+            // A software fallback after a transient hardware failure would otherwise be tried
+            // first from then on
+            if (backend != EncoderBackend::Software) {
+                StoreEncoderBackend(id, backend);
+            }
+            return pipeline;
+        } catch (std::exception& e) {
+            if (backend == EncoderBackend::Nvenc) {
                 Error(
-                    "Failed to create NvEnc encoder: %s\nPlease make sure you have installed CUDA "
+                    "Failed to create NVENC encoder: %s\nPlease make sure you have installed CUDA "
                     "runtime.",
                     e.what()
                 );
-            }
-        } else {
-            try {
-                auto vaapi = std::make_unique<alvr::EncodePipelineVAAPI>(
-                    render, vk_ctx, input_frame, width, height
-                );
-                Info("Using VAAPI encoder");
-                return vaapi;
-            } catch (std::exception& e) {
+            } else if (backend == EncoderBackend::Vaapi) {
                 Error(
                     "Failed to create VAAPI encoder: %s\nPlease make sure you have installed VAAPI "
                     "runtime.",
                     e.what()
                 );
+            } else {
+                Error("Failed to create %s encoder: %s", EncoderBackendName(backend), e.what());
             }
+            StartupMilestone(std::string("failed_") + EncoderBackendName(backend));
         }
     }
-    auto sw = std::make_unique<alvr::EncodePipelineSW>(render, width, height);
-    Info("Using SW encoder");
-    return sw;
+    throw std::runtime_error(
+        std::string("Failed to create the ") + EncoderBackendName(order.back()) + " encoder"
+    );
 }
 
 alvr::EncodePipeline::~EncodePipeline() { avcodec_free_context(&encoder_ctx); }
@@ -82,7 +197,37 @@ bool alvr::EncodePipeline::GetEncoded(FramePacket& packet) {
     packet.size = encoder_packet->size;
     packet.pts = encoder_packet->pts;
     packet.isIDR = (encoder_packet->flags & AV_PKT_FLAG_KEY) != 0;
+    packet.firstSlice = true;
+    packet.averageQp = -1.0f;
+    packet.frameType = FRAME_TYPE_UNKNOWN;
+
+    // Set by the ffmpeg encoders that report the QP of their frames, like NVENC and libx264
+    size_t stats_size = 0;
+    const uint8_t* stats
+        = av_packet_get_side_data(encoder_packet, AV_PKT_DATA_QUALITY_STATS, &stats_size);
+    if (stats && stats_size >= 5) {
+        packet.averageQp = (float)AV_RL32(stats) / FF_QP2LAMBDA;
+        switch (stats[4]) {
+        case AV_PICTURE_TYPE_I:
+            packet.frameType = packet.isIDR ? FRAME_TYPE_IDR : FRAME_TYPE_INTRA;
+            break;
+        case AV_PICTURE_TYPE_P:
+            packet.frameType = FRAME_TYPE_PREDICTED;
+            break;
+        case AV_PICTURE_TYPE_B:
+            packet.frameType = FRAME_TYPE_BIDIRECTIONAL;
+            break;
+        }
+    }
     return true;
 }
 
 int alvr::EncodePipeline::GetCodec() { return Settings_Instance()->m_codec; }
+
+EncoderCapabilities alvr::EncodePipeline::GetCapabilities() {
+    EncoderCapabilities capabilities;
+    capabilities.intraRefreshMode = intra_refresh_mode;
+    capabilities.async = GetMaxFramesInFlight() > 0;
+    capabilities.tenBit = Uses10BitProfile(GetCodec());
+    return capabilities;
+}
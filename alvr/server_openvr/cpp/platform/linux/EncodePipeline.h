@@ -1,6 +1,10 @@
 #pragma once
+#include "Renderer.h"
+#include "alvr_server/IEncoder.h"
 #include "alvr_server/bindings.h"
+#include "alvr_server/openvr_driver_wrap.h"
 #include <cstdint>
+#include <functional>
 #include <memory>
 #include <vector>
 #include <vulkan/vulkan_core.h>
@@ -8,8 +12,6 @@
 extern "C" struct AVCodecContext;
 extern "C" struct AVPacket;
 
-class Renderer;
-
 namespace alvr {
 
 class VkFrame;
@@ -21,36 +23,77 @@ struct FramePacket {
     int size;
     uint64_t pts;
     bool isIDR;
+    // False if leading slices of this frame were already handed to the slice sink
+    bool firstSlice = true;
+    // Of the whole frame, negative if the encoder doesn't report it
+    float averageQp = -1.0f;
+    FfiFrameType frameType = FRAME_TYPE_UNKNOWN;
 };
 
-class EncodePipeline {
+class EncodePipeline : public IEncoder {
 public:
     struct Timestamp {
         uint64_t gpu = 0;
         uint64_t cpu = 0;
     };
 
+    // Receives slices of the frame being encoded as soon as they are complete, except the last one
+    // which is still returned by GetEncoded. May be called from encoder threads during PushFrame.
+    using SliceSink = std::function<void(const FramePacket& slice)>;
+
     virtual ~EncodePipeline();
 
-    virtual void PushFrame(uint64_t targetTimestampNs, bool idr) = 0;
+    // Submits Renderer output outputIndex for encoding. Its packet, with targetTimestampNs as pts,
+    // comes from this or a later GetEncoded, and the output image may be read until then. The
+    // frame is dropped once more than GetMaxFramesInFlight frames are waiting for their packet.
+    virtual void PushFrame(uint32_t outputIndex, uint64_t targetTimestampNs, bool idr) = 0;
+    // Called by the render stage before rendering into Renderer output outputIndex, for the
+    // semaphores the Render submit signals for the pipeline along with the output one
+    virtual void GetRenderSignals(
+        uint32_t outputIndex, std::vector<Renderer::SignalOperation>& signals
+    ) { }
+    // Called by the render stage as soon as Renderer output outputIndex has been submitted, so
+    // that GPU work can be queued while the encode stage is still busy with the previous frame
+    virtual void PrepareFrame(uint32_t outputIndex) { }
+    // Called instead of PushFrame for a prepared frame that is not encoded
+    virtual void DropFrame(uint32_t outputIndex) { }
+    // Pipelines that can't output partial frames ignore the sink
+    virtual void SetSliceSink(SliceSink sink) { }
+    // Next packet of the pushed frames in push order, false if none is ready. Called until it
+    // returns false after each PushFrame, data is valid until the next call.
     virtual bool GetEncoded(FramePacket& data);
+    // Frames the encoder may still be reading once GetEncoded returned false after a PushFrame,
+    // 0 for encoders that return the packet of each frame right away
+    virtual uint32_t GetMaxFramesInFlight() { return 0; }
     virtual Timestamp GetTimestamp() { return timestamp; }
+    // Async if GetMaxFramesInFlight is not 0
+    EncoderCapabilities GetCapabilities() override;
+    // Appends the GPU timings of work done by the pipeline for the last frame, if any
+    virtual void GetStageTimings(std::vector<Renderer::StageTiming>& timings) { }
     virtual int GetCodec();
 
     virtual void SetParams(FfiDynamicEncoderParams params);
+    // Modifiers of the Renderer outputs that the encoder picked by Create reads, empty when it
+    // doesn't import DRM images or can't tell
+    static Renderer::ModifierFilter
+    OutputModifierFilter(VkContext& vk_ctx, VkContext* encode_ctx = nullptr);
+    // With encode_ctx, the outputs of the vk_ctx Renderer are encoded on another GPU. Only VAAPI
+    // imports them there, the software encoder reads them back on vk_ctx.
     static std::unique_ptr<EncodePipeline> Create(
         Renderer* render,
         VkContext& vk_ctx,
-        VkFrame& input_frame,
+        const std::vector<std::unique_ptr<VkFrame>>& input_frames,
         VkImageCreateInfo& image_create_info,
         uint32_t width,
-        uint32_t height
+        uint32_t height,
+        VkContext* encode_ctx = nullptr
     );
 
 protected:
     AVCodecContext* encoder_ctx = nullptr; // shall be initialized by child class
     AVPacket* encoder_packet = NULL;
     Timestamp timestamp = {};
+    IntraRefreshMode intra_refresh_mode = IntraRefreshMode::None;
 };
 
 }
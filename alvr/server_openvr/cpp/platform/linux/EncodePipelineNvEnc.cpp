@@ -1,13 +1,22 @@
 #include "EncodePipelineNvEnc.h"
 #include "ALVR-common/packet_types.h"
 #include "alvr_server/Logger.h"
+#include "alvr_server/Profiling.h"
 #include "alvr_server/bindings.h"
 #include "ffmpeg_helper.h"
 #include <chrono>
 #include <memory>
+#include <unistd.h>
+
+#ifdef ALVR_CUDA_INTEROP
+#include <ffnvcodec/dynlink_loader.h>
+#endif
 
 extern "C" {
 #include <libavcodec/avcodec.h>
+#ifdef ALVR_CUDA_INTEROP
+#include <libavutil/hwcontext_cuda.h>
+#endif
 #include <libavutil/opt.h>
 }
 
@@ -25,7 +34,7 @@ const char* encoder(ALVR_CODEC codec) {
     throw std::runtime_error("invalid codec " + std::to_string(codec));
 }
 
-void set_hwframe_ctx(AVCodecContext* ctx, AVBufferRef* hw_device_ctx) {
+void set_hwframe_ctx(AVCodecContext* ctx, AVBufferRef* hw_device_ctx, bool ten_bit) {
     AVBufferRef* hw_frames_ref;
     AVHWFramesContext* frames_ctx = NULL;
     int err = 0;
@@ -44,8 +53,9 @@ void set_hwframe_ctx(AVCodecContext* ctx, AVBufferRef* hw_device_ctx) {
      * AV_PIX_FMT_BGR0 - 123 ///< packed BGR 8:8:8,    32bpp, BGRXBGRX...   X=unused/undefined
      *
      * We just to ignore the alpha channel and it's done
+     * The 10 bit outputs are X2BGR10 the same way, which NVEnc encodes to 10 bit
      */
-    frames_ctx->sw_format = AV_PIX_FMT_BGR0;
+    frames_ctx->sw_format = ten_bit ? AV_PIX_FMT_X2BGR10 : AV_PIX_FMT_BGR0;
     frames_ctx->width = ctx->width;
     frames_ctx->height = ctx->height;
     if ((err = av_hwframe_ctx_init(hw_frames_ref)) < 0) {
@@ -59,23 +69,194 @@ void set_hwframe_ctx(AVCodecContext* ctx, AVBufferRef* hw_device_ctx) {
     av_buffer_unref(&hw_frames_ref);
 }
 
+#ifdef ALVR_CUDA_INTEROP
+void check_cu(CUresult res, const char* what) {
+    if (res != CUDA_SUCCESS) {
+        throw std::runtime_error(std::string(what) + " failed: " + std::to_string(res));
+    }
+}
+
+void free_nothing(void*, uint8_t*) { }
+#endif
+
 } // namespace
+
+#ifdef ALVR_CUDA_INTEROP
+// Renderer outputs imported into CUDA, so that NVENC reads them in place instead of from a copy
+struct alvr::EncodePipelineNvEnc::CudaInterop {
+    struct Output {
+        CUexternalMemory memory = nullptr;
+        CUdeviceptr ptr = 0;
+        CUexternalSemaphore semaphore = nullptr;
+        AVFrame* frame = nullptr;
+    };
+
+    CudaFunctions* cu = nullptr;
+    AVCUDADeviceContext* device = nullptr;
+    std::vector<Output> outputs;
+
+    CudaInterop(Renderer* r, AVBufferRef* hw_ctx, AVBufferRef* hw_frames_ctx, int w, int h) {
+        if (cuda_load_functions(&cu, nullptr) < 0) {
+            throw std::runtime_error("Failed to load CUDA functions");
+        }
+        device = (AVCUDADeviceContext*)((AVHWDeviceContext*)hw_ctx->data)->hwctx;
+
+        check_cu(cu->cuCtxPushCurrent(device->cuda_ctx), "cuCtxPushCurrent");
+        try {
+            for (uint32_t i = 0; i < r->GetOutputCount(); ++i) {
+                outputs.push_back({});
+                import(r, r->GetOutput(i), outputs.back(), hw_frames_ctx, w, h);
+            }
+        } catch (...) {
+            CUcontext dummy;
+            cu->cuCtxPopCurrent(&dummy);
+            release();
+            throw;
+        }
+        CUcontext dummy;
+        cu->cuCtxPopCurrent(&dummy);
+    }
+
+    ~CudaInterop() { release(); }
+
+    void import(
+        Renderer* r,
+        const Renderer::Output& output,
+        Output& imported,
+        AVBufferRef* hw_frames_ctx,
+        int w,
+        int h
+    ) {
+        VkMemoryGetFdInfoKHR memoryFdInfo = {};
+        memoryFdInfo.sType = VK_STRUCTURE_TYPE_MEMORY_GET_FD_INFO_KHR;
+        memoryFdInfo.memory = output.memory;
+        memoryFdInfo.handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_OPAQUE_FD_BIT;
+        int memoryFd;
+        VK_CHECK(r->d.vkGetMemoryFdKHR(r->m_dev, &memoryFdInfo, &memoryFd));
+
+        // CUDA owns the fd once the import succeeded
+        CUDA_EXTERNAL_MEMORY_HANDLE_DESC memoryDesc = {};
+        memoryDesc.type = CU_EXTERNAL_MEMORY_HANDLE_TYPE_OPAQUE_FD;
+        memoryDesc.handle.fd = memoryFd;
+        memoryDesc.size = output.size;
+        memoryDesc.flags = CUDA_EXTERNAL_MEMORY_DEDICATED;
+        CUresult res = cu->cuImportExternalMemory(&imported.memory, &memoryDesc);
+        if (res != CUDA_SUCCESS) {
+            close(memoryFd);
+        }
+        check_cu(res, "cuImportExternalMemory");
+
+        CUDA_EXTERNAL_MEMORY_BUFFER_DESC bufferDesc = {};
+        bufferDesc.size = output.size;
+        check_cu(
+            cu->cuExternalMemoryGetMappedBuffer(&imported.ptr, imported.memory, &bufferDesc),
+            "cuExternalMemoryGetMappedBuffer"
+        );
+
+        VkSemaphoreGetFdInfoKHR semaphoreFdInfo = {};
+        semaphoreFdInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_GET_FD_INFO_KHR;
+        semaphoreFdInfo.semaphore = output.semaphore;
+        semaphoreFdInfo.handleType = VK_EXTERNAL_SEMAPHORE_HANDLE_TYPE_OPAQUE_FD_BIT;
+        int semaphoreFd;
+        VK_CHECK(r->d.vkGetSemaphoreFdKHR(r->m_dev, &semaphoreFdInfo, &semaphoreFd));
+
+        CUDA_EXTERNAL_SEMAPHORE_HANDLE_DESC semaphoreDesc = {};
+        semaphoreDesc.type = CU_EXTERNAL_SEMAPHORE_HANDLE_TYPE_TIMELINE_SEMAPHORE_FD;
+        semaphoreDesc.handle.fd = semaphoreFd;
+        res = cu->cuImportExternalSemaphore(&imported.semaphore, &semaphoreDesc);
+        if (res != CUDA_SUCCESS) {
+            close(semaphoreFd);
+        }
+        check_cu(res, "cuImportExternalSemaphore");
+
+        VkImageSubresource subresource = {};
+        subresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        VkSubresourceLayout layout;
+        vkGetImageSubresourceLayout(r->m_dev, output.image, &subresource, &layout);
+
+        // A CUDA frame pointing into the imported memory. The buffer is owned by the import, so
+        // the frame must not free it; ffmpeg registers it with NVENC the first time it's encoded.
+        imported.frame = av_frame_alloc();
+        imported.frame->format = AV_PIX_FMT_CUDA;
+        imported.frame->width = w;
+        imported.frame->height = h;
+        imported.frame->data[0] = (uint8_t*)(imported.ptr + layout.offset);
+        imported.frame->linesize[0] = layout.rowPitch;
+        imported.frame->buf[0]
+            = av_buffer_create(imported.frame->data[0], layout.size, free_nothing, nullptr, 0);
+        imported.frame->hw_frames_ctx = av_buffer_ref(hw_frames_ctx);
+        if (!imported.frame->buf[0] || !imported.frame->hw_frames_ctx) {
+            throw std::runtime_error("Failed to allocate CUDA frame");
+        }
+    }
+
+    void release() {
+        for (Output& output : outputs) {
+            av_frame_free(&output.frame);
+            if (output.semaphore) {
+                cu->cuDestroyExternalSemaphore(output.semaphore);
+            }
+            if (output.ptr) {
+                cu->cuMemFree(output.ptr);
+            }
+            if (output.memory) {
+                cu->cuDestroyExternalMemory(output.memory);
+            }
+        }
+        outputs.clear();
+        cuda_free_functions(&cu);
+    }
+
+    // Makes the encode of the frame wait on the GPU for the Renderer to finish writing it
+    AVFrame* get_frame(uint32_t outputIndex, uint64_t semaphoreValue) {
+        Output& output = outputs[outputIndex];
+
+        CUDA_EXTERNAL_SEMAPHORE_WAIT_PARAMS waitParams = {};
+        waitParams.params.fence.value = semaphoreValue;
+
+        check_cu(cu->cuCtxPushCurrent(device->cuda_ctx), "cuCtxPushCurrent");
+        CUresult res
+            = cu->cuWaitExternalSemaphoresAsync(&output.semaphore, &waitParams, 1, device->stream);
+        CUcontext dummy;
+        cu->cuCtxPopCurrent(&dummy);
+        check_cu(res, "cuWaitExternalSemaphoresAsync");
+
+        return output.frame;
+    }
+};
+#endif
+
 alvr::EncodePipelineNvEnc::EncodePipelineNvEnc(
     Renderer* render,
     VkContext& vk_ctx,
-    VkFrame& input_frame,
+    const std::vector<std::unique_ptr<VkFrame>>& input_frames,
     VkImageCreateInfo& image_create_info,
     uint32_t width,
     uint32_t height
 ) {
     r = render;
-    vk_frame_ctx = std::make_unique<alvr::VkFrameCtx>(vk_ctx, image_create_info);
 
-    auto input_frame_ctx = (AVHWFramesContext*)vk_frame_ctx->ctx->data;
-    assert(input_frame_ctx->sw_format == AV_PIX_FMT_BGRA);
+    // Linear outputs are imported into CUDA, optimal ones are copied into CUDA frames by ffmpeg
+    bool zero_copy = false;
+#ifdef ALVR_CUDA_INTEROP
+    zero_copy = image_create_info.tiling == VK_IMAGE_TILING_LINEAR;
+#endif
+    if (!zero_copy) {
+        vk_frame_ctx = std::make_unique<alvr::VkFrameCtx>(vk_ctx, image_create_info);
+
+        auto input_frame_ctx = (AVHWFramesContext*)vk_frame_ctx->ctx->data;
+        assert(
+            input_frame_ctx->sw_format == AV_PIX_FMT_BGRA
+            || input_frame_ctx->sw_format == AV_PIX_FMT_X2BGR10
+        );
+
+        for (const auto& input_frame : input_frames) {
+            vk_frames.push_back(input_frame->make_av_frame(*vk_frame_ctx));
+        }
+        render_signal_values.resize(vk_frames.size());
+    }
 
     int err;
-    vk_frame = input_frame.make_av_frame(*vk_frame_ctx);
 
     err = av_hwdevice_ctx_create_derived(&hw_ctx, AV_HWDEVICE_TYPE_CUDA, vk_ctx.ctx, 0);
     if (err < 0) {
@@ -152,6 +333,20 @@ alvr::EncodePipelineNvEnc::EncodePipelineNvEnc(
         av_opt_set_int(encoder_ctx->priv_data, "weighted_pred", 1, 0);
     }
 
+    // NVENC has no HEVC tiles
+    if (codec_id == ALVR_CODEC_AV1) {
+        av_opt_set_int(encoder_ctx->priv_data, "tile-columns", settings->m_tileColumns, 0);
+        av_opt_set_int(encoder_ctx->priv_data, "tile-rows", settings->m_tileRows, 0);
+    }
+
+    // Frames split over the NVENC engines, H.264 is never split
+    if (settings->m_nvencSplitEncodeMode != 0 && codec_id != ALVR_CODEC_H264
+        && av_opt_set_int(
+               encoder_ctx->priv_data, "split_encode_mode", settings->m_nvencSplitEncodeMode, 0
+           ) < 0) {
+        Warn("Split frame encoding is not supported by this FFmpeg version");
+    }
+
     av_opt_set_int(encoder_ctx->priv_data, "tune", settings->m_nvencTuningPreset, 0);
     av_opt_set_int(encoder_ctx->priv_data, "zerolatency", 1, 0);
     // Delay isn't actually a delay instead its how many surfaces to encode at a time
@@ -167,7 +362,15 @@ alvr::EncodePipelineNvEnc::EncodePipelineNvEnc(
     encoder_ctx->framerate = AVRational { settings->m_refreshRate, 1 };
     encoder_ctx->sample_aspect_ratio = AVRational { 1, 1 };
     encoder_ctx->max_b_frames = 0;
+    // Encoded in parallel where supported, libavcodec still returns them as one packet
+    encoder_ctx->slices = settings->m_slicesPerFrame;
     encoder_ctx->gop_size = INT16_MAX;
+    // ffmpeg refreshes the picture over gop_size frames and stops inserting IDR frames by itself
+    if (settings->m_intraRefreshRecoveryFrames > 0) {
+        av_opt_set_int(encoder_ctx->priv_data, "intra-refresh", 1, 0);
+        encoder_ctx->gop_size = settings->m_intraRefreshRecoveryFrames;
+        intra_refresh_mode = IntraRefreshMode::Continuous;
+    }
     encoder_ctx->color_range = AVCOL_RANGE_JPEG;
     auto params = FfiDynamicEncoderParams {};
     params.updated = true;
@@ -175,51 +378,124 @@ alvr::EncodePipelineNvEnc::EncodePipelineNvEnc(
     params.framerate = 60.0;
     SetParams(params);
 
-    set_hwframe_ctx(encoder_ctx, hw_ctx);
+    set_hwframe_ctx(
+        encoder_ctx, hw_ctx, image_create_info.format == VK_FORMAT_A2B10G10R10_UNORM_PACK32
+    );
 
     err = avcodec_open2(encoder_ctx, codec, NULL);
     if (err < 0) {
         throw alvr::AvException("Cannot open video encoder codec:", err);
     }
 
+#ifdef ALVR_CUDA_INTEROP
+    if (zero_copy) {
+        cuda = std::make_unique<CudaInterop>(
+            r, hw_ctx, encoder_ctx->hw_frames_ctx, encoder_ctx->width, encoder_ctx->height
+        );
+        Info("NvEnc encoding Renderer outputs in place through CUDA");
+    }
+#endif
+
     hw_frame = av_frame_alloc();
 }
 
 alvr::EncodePipelineNvEnc::~EncodePipelineNvEnc() {
+#ifdef ALVR_CUDA_INTEROP
+    // NVENC holds registrations of the imported buffers until the encoder is closed
+    avcodec_free_context(&encoder_ctx);
+    cuda.reset();
+#endif
     av_buffer_unref(&hw_ctx);
     av_frame_free(&hw_frame);
 }
 
-void alvr::EncodePipelineNvEnc::PushFrame(uint64_t targetTimestampNs, bool idr) {
-    AVVkFrame* vkf = reinterpret_cast<AVVkFrame*>(vk_frame->data[0]);
+void alvr::EncodePipelineNvEnc::GetRenderSignals(
+    uint32_t outputIndex, std::vector<Renderer::SignalOperation>& signals
+) {
+    // The imported outputs are waited for by CUDA
+    if (vk_frames.empty()) {
+        return;
+    }
+    AVVkFrame* vkf = reinterpret_cast<AVVkFrame*>(vk_frames[outputIndex]->data[0]);
     vkf->sem_value[0]++;
+    render_signal_values[outputIndex] = vkf->sem_value[0];
+    signals.push_back({ vkf->sem[0], vkf->sem_value[0] });
+}
 
-    VkTimelineSemaphoreSubmitInfo timelineInfo = {};
-    timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
-    timelineInfo.signalSemaphoreValueCount = 1;
-    timelineInfo.pSignalSemaphoreValues = &vkf->sem_value[0];
+// Submit waiting for the Render into the output and signaling the frame semaphore
+void alvr::EncodePipelineNvEnc::signalFrame(uint32_t outputIndex) {
+    AVVkFrame* vkf = reinterpret_cast<AVVkFrame*>(vk_frames[outputIndex]->data[0]);
+    vkf->sem_value[0]++;
 
-    VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
+    const Renderer::Output& output = r->GetOutput(outputIndex);
+
+    // The batch has no commands, the signal only has to follow the wait
+    VkSemaphoreSubmitInfo waitInfo = {};
+    waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO;
+    waitInfo.semaphore = output.semaphore;
+    waitInfo.value = output.semaphoreValue;
+    waitInfo.stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT;
+    VkSemaphoreSubmitInfo signalInfo = {};
+    signalInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO;
+    signalInfo.semaphore = vkf->sem[0];
+    signalInfo.value = vkf->sem_value[0];
+    signalInfo.stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT;
+
+    VkSubmitInfo2 submitInfo = {};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO_2;
+    submitInfo.waitSemaphoreInfoCount = 1;
+    submitInfo.pWaitSemaphoreInfos = &waitInfo;
+    submitInfo.signalSemaphoreInfoCount = 1;
+    submitInfo.pSignalSemaphoreInfos = &signalInfo;
+    r->QueueSubmit(submitInfo, VK_NULL_HANDLE);
+}
 
-    VkSubmitInfo submitInfo = {};
-    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-    submitInfo.pNext = &timelineInfo;
-    submitInfo.waitSemaphoreCount = 1;
-    submitInfo.pWaitSemaphores = &r->GetOutput().semaphore;
-    submitInfo.pWaitDstStageMask = &waitStage;
-    submitInfo.signalSemaphoreCount = 1;
-    submitInfo.pSignalSemaphores = &vkf->sem[0];
-    VK_CHECK(vkQueueSubmit(r->m_queue, 1, &submitInfo, nullptr));
+void alvr::EncodePipelineNvEnc::PushFrame(
+    uint32_t outputIndex, uint64_t targetTimestampNs, bool idr
+) {
+    ALVR_PROFILE_ZONE("EncodePipelineNvEnc::PushFrame");
+#ifdef ALVR_CUDA_INTEROP
+    if (cuda) {
+        // The output image stays in use until the bitstream is retrieved, the encode stage only
+        // hands it back to the Renderer after GetEncoded
+        AVFrame* frame = cuda->get_frame(outputIndex, r->GetOutput(outputIndex).semaphoreValue);
+        frame->pict_type = idr ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+        frame->pts = targetTimestampNs;
+
+        int err = avcodec_send_frame(encoder_ctx, frame);
+        if (err < 0) {
+            throw alvr::AvException("avcodec_send_frame failed:", err);
+        }
+        return;
+    }
+#endif
+
+    AVFrame* vk_frame = vk_frames[outputIndex].get();
+    AVVkFrame* vkf = reinterpret_cast<AVVkFrame*>(vk_frame->data[0]);
+    // Unless the pipeline was created after the Render, its submit signaled the frame semaphore
+    if (render_signal_values[outputIndex] == 0
+        || render_signal_values[outputIndex] != vkf->sem_value[0]) {
+        signalFrame(outputIndex);
+    }
 
     int err = av_hwframe_get_buffer(encoder_ctx->hw_frames_ctx, hw_frame, 0);
     if (err < 0) {
         throw alvr::AvException("Failed to allocate CUDA frame", err);
     }
-    err = av_hwframe_transfer_data(hw_frame, vk_frame.get(), 0);
+    err = av_hwframe_transfer_data(hw_frame, vk_frame, 0);
     if (err < 0) {
         throw alvr::AvException("Failed to transfer Vulkan image to CUDA frame", err);
     }
 
+    // The copy runs asynchronously on the CUDA stream, which signals the frame semaphore when
+    // done. Wait for it so the Renderer can reuse the output image as soon as we return.
+    VkSemaphoreWaitInfo waitInfo = {};
+    waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+    waitInfo.semaphoreCount = 1;
+    waitInfo.pSemaphores = &vkf->sem[0];
+    waitInfo.pValues = &vkf->sem_value[0];
+    VK_CHECK(vkWaitSemaphores(r->m_dev, &waitInfo, UINT64_MAX));
+
     hw_frame->pict_type = idr ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
     hw_frame->pts = targetTimestampNs;
 
@@ -18,19 +18,31 @@ public:
     EncodePipelineNvEnc(
         Renderer* render,
         VkContext& vk_ctx,
-        VkFrame& input_frame,
+        const std::vector<std::unique_ptr<VkFrame>>& input_frames,
         VkImageCreateInfo& image_create_info,
         uint32_t width,
         uint32_t height
     );
 
-    void PushFrame(uint64_t targetTimestampNs, bool idr) override;
+    void GetRenderSignals(
+        uint32_t outputIndex, std::vector<Renderer::SignalOperation>& signals
+    ) override;
+    void PushFrame(uint32_t outputIndex, uint64_t targetTimestampNs, bool idr) override;
 
 private:
+    void signalFrame(uint32_t outputIndex);
+
+#ifdef ALVR_CUDA_INTEROP
+    struct CudaInterop;
+    std::unique_ptr<CudaInterop> cuda;
+#endif
     Renderer* r = nullptr;
     std::unique_ptr<alvr::VkFrameCtx> vk_frame_ctx;
     AVBufferRef* hw_ctx = nullptr;
-    std::unique_ptr<AVFrame, std::function<void(AVFrame*)>> vk_frame;
+    // One per Renderer output
+    std::vector<std::unique_ptr<AVFrame, std::function<void(AVFrame*)>>> vk_frames;
+    // Frame semaphore value signaled by the last Render into each output, 0 if none
+    std::vector<uint64_t> render_signal_values;
     AVFrame* hw_frame = nullptr;
 };
 }
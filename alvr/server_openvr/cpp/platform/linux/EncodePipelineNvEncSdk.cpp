@@ -0,0 +1,410 @@
+#include "EncodePipelineNvEncSdk.h"
+
+#ifdef ALVR_CUDA_INTEROP
+#include "ALVR-common/packet_types.h"
+#include "alvr_server/Logger.h"
+#include "alvr_server/Profiling.h"
+#include "alvr_server/NvEncConfig.h"
+#include "alvr_server/bindings.h"
+#include "ffmpeg_helper.h"
+#include <algorithm>
+#include <unistd.h>
+
+extern "C" {
+#include <libavutil/hwcontext_cuda.h>
+}
+
+namespace {
+
+void check_cu(CUresult res, const char* what) {
+    if (res != CUDA_SUCCESS) {
+        throw std::runtime_error(std::string(what) + " failed: " + std::to_string(res));
+    }
+}
+
+std::runtime_error nvenc_error(const char* what, const NVENCException& e) {
+    return std::runtime_error(
+        std::string(what) + " failed: " + e.what() + " (" + std::to_string(e.getErrorCode()) + ")"
+    );
+}
+
+} // namespace
+
+alvr::EncodePipelineNvEncSdk::EncodePipelineNvEncSdk(
+    Renderer* render, VkContext& vk_ctx, uint32_t width, uint32_t height
+)
+    : r(render)
+    , codec(Settings_Instance()->m_codec)
+    , width(width)
+    , height(height)
+    , framerate(Settings_Instance()->m_refreshRate) {
+    const auto* settings = Settings_Instance();
+    // 10 bit outputs are A2B10G10R10, which NVENC takes as ABGR10. It doesn't encode the 8 bit
+    // BGRA ones to 10 bit.
+    const bool ten_bit = r->GetOutputFormat() == VK_FORMAT_A2B10G10R10_UNORM_PACK32;
+    if (settings->m_use10bitEncoder && !ten_bit) {
+        throw std::runtime_error("10 bit encoding of 8 bit outputs is not supported");
+    }
+
+    // Derived from the Vulkan device, so that CUDA runs on the same GPU
+    int err = av_hwdevice_ctx_create_derived(&hw_ctx, AV_HWDEVICE_TYPE_CUDA, vk_ctx.ctx, 0);
+    if (err < 0) {
+        throw alvr::AvException("Failed to create a CUDA device:", err);
+    }
+    cuda_ctx = ((AVCUDADeviceContext*)((AVHWDeviceContext*)hw_ctx->data)->hwctx)->cuda_ctx;
+
+    try {
+        if (cuda_load_functions(&cu, nullptr) < 0) {
+            throw std::runtime_error("Failed to load CUDA functions");
+        }
+
+        try {
+            encoder = std::make_unique<NvEncoderCuda>(
+                cu,
+                cuda_ctx,
+                width,
+                height,
+                ten_bit ? NV_ENC_BUFFER_FORMAT_ABGR10 : NV_ENC_BUFFER_FORMAT_ARGB,
+                1
+            );
+        } catch (NVENCException& e) {
+            throw nvenc_error("NvEncoderCuda", e);
+        }
+
+        // AV1 frames are split in tiles, which are not read back separately
+        sub_frame_readback = settings->m_slicesPerFrame > 1 && codec != ALVR_CODEC_AV1
+            && encoder->GetCapabilityValue(
+                NvEncCodecGuid(codec), NV_ENC_CAPS_SUPPORT_SUBFRAME_READBACK
+            );
+
+        // The overlays are composed by SteamVR, they get no offsets
+        if ((settings->m_foveatedQpOffset > 0 || settings->m_staticBlockQpOffset > 0)
+            && codec != ALVR_CODEC_AV1) {
+            qp_map = std::make_unique<FoveatedQpMap>(codec == ALVR_CODEC_H264 ? 16 : 32);
+        }
+        // As on Windows, in raster order of the H.264 macroblocks and without foveated encoding
+        if (settings->m_nvencHeadMotionHints && codec == ALVR_CODEC_H264
+            && !settings->m_enableFoveatedEncoding) {
+            motion_hints = std::make_unique<HeadMotionHints>(16);
+        }
+
+        NV_ENC_INITIALIZE_PARAMS initializeParams = { NV_ENC_INITIALIZE_PARAMS_VER };
+        NV_ENC_CONFIG encodeConfig = { NV_ENC_CONFIG_VER };
+        initializeParams.encodeConfig = &encodeConfig;
+        fillEncodeConfig(initializeParams);
+        try {
+            encoder->CreateEncoder(&initializeParams);
+        } catch (NVENCException& e) {
+            throw nvenc_error("NVENC CreateEncoder", e);
+        }
+
+        if (settings->m_nvencEnableIntraRefresh) {
+            intra_refresh_mode = IntraRefreshMode::Continuous;
+        } else if (encoder->GetCapabilityValue(
+                       initializeParams.encodeGUID, NV_ENC_CAPS_SUPPORT_INTRA_REFRESH
+                   )) {
+            intra_refresh_mode = IntraRefreshMode::OnDemand;
+        }
+
+        check_cu(cu->cuCtxPushCurrent(cuda_ctx), "cuCtxPushCurrent");
+        try {
+            for (uint32_t i = 0; i < r->GetOutputCount(); ++i) {
+                outputs.push_back({});
+                importOutput(r->GetOutput(i), outputs.back());
+            }
+        } catch (...) {
+            CUcontext popped;
+            cu->cuCtxPopCurrent(&popped);
+            throw;
+        }
+        CUcontext popped;
+        cu->cuCtxPopCurrent(&popped);
+    } catch (...) {
+        release();
+        throw;
+    }
+
+    Info(
+        "NvEnc SDK encoder created. SubFrameReadback=%d Engines=%d",
+        sub_frame_readback,
+        encoder->GetCapabilityValue(NvEncCodecGuid(codec), NV_ENC_CAPS_NUM_ENCODER_ENGINES)
+    );
+}
+
+alvr::EncodePipelineNvEncSdk::~EncodePipelineNvEncSdk() { release(); }
+
+void alvr::EncodePipelineNvEncSdk::importOutput(const Renderer::Output& output, Output& imported) {
+    VkMemoryGetFdInfoKHR memoryFdInfo = {};
+    memoryFdInfo.sType = VK_STRUCTURE_TYPE_MEMORY_GET_FD_INFO_KHR;
+    memoryFdInfo.memory = output.memory;
+    memoryFdInfo.handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_OPAQUE_FD_BIT;
+    int memoryFd;
+    VK_CHECK(r->d.vkGetMemoryFdKHR(r->m_dev, &memoryFdInfo, &memoryFd));
+
+    // CUDA owns the fd once the import succeeded
+    CUDA_EXTERNAL_MEMORY_HANDLE_DESC memoryDesc = {};
+    memoryDesc.type = CU_EXTERNAL_MEMORY_HANDLE_TYPE_OPAQUE_FD;
+    memoryDesc.handle.fd = memoryFd;
+    memoryDesc.size = output.size;
+    memoryDesc.flags = CUDA_EXTERNAL_MEMORY_DEDICATED;
+    CUresult res = cu->cuImportExternalMemory(&imported.memory, &memoryDesc);
+    if (res != CUDA_SUCCESS) {
+        close(memoryFd);
+    }
+    check_cu(res, "cuImportExternalMemory");
+
+    CUDA_EXTERNAL_MEMORY_BUFFER_DESC bufferDesc = {};
+    bufferDesc.size = output.size;
+    check_cu(
+        cu->cuExternalMemoryGetMappedBuffer(&imported.ptr, imported.memory, &bufferDesc),
+        "cuExternalMemoryGetMappedBuffer"
+    );
+
+    VkImageSubresource subresource = {};
+    subresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    VkSubresourceLayout layout;
+    vkGetImageSubresourceLayout(r->m_dev, output.image, &subresource, &layout);
+
+    // Registered with the buffer format of the encoder, ARGB or ABGR10 in NVENC's naming
+    try {
+        imported.resource = encoder->RegisterExternalInput(
+            (void*)(imported.ptr + layout.offset),
+            NV_ENC_INPUT_RESOURCE_TYPE_CUDADEVICEPTR,
+            (int)layout.rowPitch
+        );
+    } catch (NVENCException& e) {
+        throw nvenc_error("Registering the Renderer output", e);
+    }
+}
+
+void alvr::EncodePipelineNvEncSdk::release() {
+    if (encoder) {
+        // Registrations must go before the encoder, the imports after it
+        for (Output& output : outputs) {
+            if (output.resource) {
+                try {
+                    encoder->UnregisterExternalInput(output.resource);
+                } catch (NVENCException& e) {
+                    Warn("NvEnc: failed to unregister an output: %s", e.what());
+                }
+            }
+        }
+        encoder->DestroyEncoder();
+        encoder.reset();
+    }
+    if (cu) {
+        // The imports belong to the context of the encoder, which isn't current on this thread
+        if (!outputs.empty() && cu->cuCtxPushCurrent(cuda_ctx) != CUDA_SUCCESS) {
+            Warn("NvEnc: failed to make the CUDA context current, the outputs are leaked");
+        } else if (!outputs.empty()) {
+            for (Output& output : outputs) {
+                if (output.ptr && cu->cuMemFree(output.ptr) != CUDA_SUCCESS) {
+                    Warn("NvEnc: failed to free the mapping of an output");
+                }
+                if (output.memory && cu->cuDestroyExternalMemory(output.memory) != CUDA_SUCCESS) {
+                    Warn("NvEnc: failed to destroy the import of an output");
+                }
+            }
+            cu->cuCtxPopCurrent(nullptr);
+        }
+        cuda_free_functions(&cu);
+    }
+    outputs.clear();
+    av_buffer_unref(&hw_ctx);
+}
+
+void alvr::EncodePipelineNvEncSdk::fillEncodeConfig(NV_ENC_INITIALIZE_PARAMS& initializeParams) {
+    encoder->CreateDefaultEncoderParams(
+        &initializeParams, NvEncCodecGuid(codec), NvEncPresetGuid(), NvEncTuningInfo()
+    );
+
+    NvEncConfigParams params = {};
+    params.codec = codec;
+    params.framerate = framerate;
+    params.width = width;
+    params.height = height;
+    params.bitrateBps = bitrate_bps;
+    params.maxFrameBytes = max_frame_bytes;
+    params.subFrameReadback = sub_frame_readback;
+    params.motionHints = motion_hints != nullptr;
+    params.qpMap = qp_map != nullptr;
+    // Only H.264 has temporal layers that NVENC lays out by itself
+    if (codec == ALVR_CODEC_H264
+        && encoder->GetCapabilityValue(NV_ENC_CODEC_H264_GUID, NV_ENC_CAPS_SUPPORT_TEMPORAL_SVC)) {
+        params.temporalLayers = std::min(
+            (int)Settings_Instance()->m_temporalLayers,
+            encoder->GetCapabilityValue(NV_ENC_CODEC_H264_GUID, NV_ENC_CAPS_NUM_MAX_TEMPORAL_LAYERS)
+        );
+    }
+    FillNvEncConfig(initializeParams, params);
+    // There are no completion events on Linux
+    initializeParams.enableEncodeAsync = 0;
+}
+
+void alvr::EncodePipelineNvEncSdk::SetParams(FfiDynamicEncoderParams params) {
+    if (!params.updated) {
+        return;
+    }
+    // The encoding size stays the one of the outputs, which NVENC reads in place
+    bitrate_bps = params.bitrate_bps;
+    framerate = std::max((int)params.framerate, 1);
+    max_frame_bytes = params.max_frame_bytes;
+
+    NV_ENC_INITIALIZE_PARAMS initializeParams = { NV_ENC_INITIALIZE_PARAMS_VER };
+    NV_ENC_CONFIG encodeConfig = { NV_ENC_CONFIG_VER };
+    initializeParams.encodeConfig = &encodeConfig;
+    fillEncodeConfig(initializeParams);
+
+    NV_ENC_RECONFIGURE_PARAMS reconfigureParams = { NV_ENC_RECONFIGURE_PARAMS_VER };
+    reconfigureParams.reInitEncodeParams = initializeParams;
+    try {
+        encoder->Reconfigure(&reconfigureParams);
+    } catch (NVENCException& e) {
+        throw nvenc_error("NVENC Reconfigure", e);
+    }
+}
+
+void alvr::EncodePipelineNvEncSdk::PushFrame(
+    uint32_t outputIndex, uint64_t targetTimestampNs, bool idr
+) {
+    ALVR_PROFILE_ZONE("EncodePipelineNvEncSdk::PushFrame");
+    const Renderer::Output& output = r->GetOutput(outputIndex);
+
+    // NVENC reads the output once the Renderer is done with it
+    VkSemaphoreWaitInfo waitInfo = {};
+    waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+    waitInfo.semaphoreCount = 1;
+    waitInfo.pSemaphores = &output.semaphore;
+    waitInfo.pValues = &output.semaphoreValue;
+    VK_CHECK(vkWaitSemaphores(r->m_dev, &waitInfo, UINT64_MAX));
+
+    NV_ENC_PIC_PARAMS picParams = {};
+    // Identifies the frame for InvalidateRefFrames
+    picParams.inputTimeStamp = targetTimestampNs;
+    if (idr) {
+        picParams.encodePicFlags = NV_ENC_PIC_FLAG_FORCEIDR;
+        encoded_timestamps.clear();
+    } else if (start_intra_refresh) {
+        uint32_t frames = Settings_Instance()->m_intraRefreshRecoveryFrames;
+        switch (codec) {
+        case ALVR_CODEC_H264:
+            picParams.codecPicParams.h264PicParams.forceIntraRefreshWithFrameCnt = frames;
+            break;
+        case ALVR_CODEC_HEVC:
+            picParams.codecPicParams.hevcPicParams.forceIntraRefreshWithFrameCnt = frames;
+            break;
+        case ALVR_CODEC_AV1:
+            picParams.codecPicParams.av1PicParams.forceIntraRefreshWithFrameCnt = frames;
+            break;
+        }
+    }
+    start_intra_refresh = false;
+    if (qp_map) {
+        // Read by NVENC when the frame is submitted
+        qp_map->Update(m_foveationCenter, width, height, m_staticBlocks);
+        picParams.qpDeltaMap = const_cast<int8_t*>(qp_map->GetOffsets().data());
+        picParams.qpDeltaMapSize = (uint32_t)qp_map->GetOffsets().size();
+    }
+    // Updated on every frame to track the orientation of the reference, unused by IDR frames
+    if (motion_hints && motion_hints->Update(m_headOrientation, m_projections, width, height)
+        && !idr) {
+        const std::vector<MotionVector>& vectors = motion_hints->GetVectors();
+        me_hints.resize(vectors.size());
+        for (size_t i = 0; i < vectors.size(); i++) {
+            NVENC_EXTERNAL_ME_HINT& hint = me_hints[i];
+            hint = {};
+            hint.mvx = std::clamp<int>(vectors[i].x, -2048, 2047);
+            hint.mvy = std::clamp<int>(vectors[i].y, -512, 511);
+            hint.lastofPart = 1;
+            hint.lastOfMB = 1;
+        }
+        picParams.meHintCountsPerBlock[0].numCandsPerBlk16x16 = 1;
+        picParams.meExternalHints = me_hints.data();
+    }
+
+    bitstream.clear();
+    pts = targetTimestampNs;
+    is_idr = idr;
+    sent_first_slice = false;
+    try {
+        if (sub_frame_readback) {
+            encoder->SubmitFrameRaw(outputs[outputIndex].resource, &picParams);
+            encoder->RetrieveFrameSlicesRaw([&](uint8_t* buf, uint32_t size, bool, bool) {
+                // The latest part is held back for GetEncoded, in case the frame completes with
+                // no new data
+                if (size > 0 && !bitstream.empty() && slice_sink) {
+                    FramePacket slice = {};
+                    slice.data = bitstream.data();
+                    slice.size = bitstream.size();
+                    slice.pts = pts;
+                    slice.isIDR = is_idr;
+                    slice.firstSlice = !sent_first_slice;
+                    slice_sink(slice);
+
+                    bitstream.clear();
+                    sent_first_slice = true;
+                }
+                bitstream.insert(bitstream.end(), buf, buf + size);
+            });
+        } else {
+            encoder->EncodeRegisteredFrameRaw(
+                outputs[outputIndex].resource,
+                [&](uint8_t* buf, uint32_t size) { bitstream.assign(buf, buf + size); },
+                &picParams
+            );
+        }
+    } catch (NVENCException& e) {
+        throw nvenc_error("NVENC encode", e);
+    }
+    has_frame = true;
+
+    // Drops the oldest one once full
+    encoded_timestamps.push_back(targetTimestampNs);
+}
+
+bool alvr::EncodePipelineNvEncSdk::GetEncoded(FramePacket& packet) {
+    if (!has_frame || bitstream.empty()) {
+        return false;
+    }
+    has_frame = false;
+    packet.data = bitstream.data();
+    packet.size = bitstream.size();
+    packet.pts = pts;
+    packet.isIDR = is_idr;
+    packet.firstSlice = !sent_first_slice;
+    const NvEncoder::FrameStats& stats = encoder->GetLastFrameStats();
+    packet.averageQp = stats.averageQp;
+    packet.frameType = NvEncFrameType(stats.pictureType);
+    if (qp_map) {
+        qp_map->ReportQp(packet.averageQp);
+    }
+    return true;
+}
+
+EncoderCapabilities alvr::EncodePipelineNvEncSdk::GetCapabilities() {
+    EncoderCapabilities capabilities = EncodePipeline::GetCapabilities();
+    capabilities.refInvalidation = true;
+    capabilities.slices = sub_frame_readback;
+    capabilities.qpMaps = qp_map != nullptr;
+    return capabilities;
+}
+
+bool alvr::EncodePipelineNvEncSdk::InvalidateRefFrames(uint64_t lastReceivedTimestampNs) {
+    // No frame older than the history can still be referenced, invalidating all of them would
+    // only make NVENC encode an intra frame
+    if (encoded_timestamps.empty() || encoded_timestamps.front() > lastReceivedTimestampNs) {
+        return false;
+    }
+    try {
+        for (size_t i = 0; i < encoded_timestamps.size(); i++) {
+            if (encoded_timestamps[i] > lastReceivedTimestampNs) {
+                encoder->InvalidateRefFrame(encoded_timestamps[i]);
+            }
+        }
+    } catch (NVENCException& e) {
+        Warn("NvEnc: failed to invalidate reference frames: %s", e.what());
+        return false;
+    }
+    return true;
+}
+#endif
@@ -0,0 +1,78 @@
+#pragma once
+
+#ifdef ALVR_CUDA_INTEROP
+#include "EncodePipeline.h"
+#include "NvEncoderCuda.h"
+#include "alvr_server/FixedRing.h"
+#include "alvr_server/FoveatedQpMap.h"
+#include "alvr_server/HeadMotionHints.h"
+#include <memory>
+#include <vector>
+
+extern "C" struct AVBufferRef;
+
+namespace alvr {
+
+// NVENC driven through the SDK, with the NvEncoder class and the configuration of the Windows
+// encoder, instead of through libavcodec. Renderer outputs are imported into CUDA and encoded in
+// place, which needs outputs with linear tiling.
+class EncodePipelineNvEncSdk : public EncodePipeline {
+public:
+    ~EncodePipelineNvEncSdk();
+    EncodePipelineNvEncSdk(Renderer* render, VkContext& vk_ctx, uint32_t width, uint32_t height);
+
+    void PushFrame(uint32_t outputIndex, uint64_t targetTimestampNs, bool idr) override;
+    void SetSliceSink(SliceSink sink) override { slice_sink = std::move(sink); }
+    bool GetEncoded(FramePacket& packet) override;
+    void StartIntraRefresh() override { start_intra_refresh = true; }
+    EncoderCapabilities GetCapabilities() override;
+    bool InvalidateRefFrames(uint64_t lastReceivedTimestampNs) override;
+    void SetParams(FfiDynamicEncoderParams params) override;
+
+private:
+    // Size of the largest DPB of NVENC
+    static const size_t MAX_REFERENCE_FRAMES = 16;
+
+    // Renderer output mapped as a CUDA device pointer and registered with NVENC
+    struct Output {
+        CUexternalMemory memory = nullptr;
+        CUdeviceptr ptr = 0;
+        NV_ENC_REGISTERED_PTR resource = nullptr;
+    };
+
+    void importOutput(const Renderer::Output& output, Output& imported);
+    void release();
+    void fillEncodeConfig(NV_ENC_INITIALIZE_PARAMS& initializeParams);
+
+    Renderer* r = nullptr;
+    AVBufferRef* hw_ctx = nullptr;
+    CudaFunctions* cu = nullptr;
+    CUcontext cuda_ctx = nullptr;
+    std::unique_ptr<NvEncoderCuda> encoder;
+    // One per Renderer output
+    std::vector<Output> outputs;
+
+    int codec;
+    uint32_t width;
+    uint32_t height;
+    int framerate;
+    uint64_t bitrate_bps = 30'000'000;
+    uint64_t max_frame_bytes = 0;
+    bool sub_frame_readback = false;
+    bool start_intra_refresh = false;
+    std::unique_ptr<FoveatedQpMap> qp_map;
+    std::unique_ptr<HeadMotionHints> motion_hints;
+    std::vector<NVENC_EXTERNAL_ME_HINT> me_hints;
+    // Of the frames that may still be referenced, oldest first
+    FixedRing<uint64_t, MAX_REFERENCE_FRAMES> encoded_timestamps;
+
+    SliceSink slice_sink;
+    // Bitstream of the frame which hasn't been handed out yet
+    std::vector<uint8_t> bitstream;
+    bool has_frame = false;
+    uint64_t pts = 0;
+    bool is_idr = false;
+    bool sent_first_slice = false;
+};
+}
+#endif
@@ -4,7 +4,10 @@
 
 #include "ALVR-common/packet_types.h"
 #include "FormatConverter.h"
+#include "alvr_server/EncoderControl.h"
 #include "alvr_server/Logger.h"
+#include "alvr_server/NumaPlacement.h"
+#include "alvr_server/Profiling.h"
 #include "alvr_server/bindings.h"
 
 namespace {
@@ -32,7 +35,8 @@ void x264_log(void*, int level, const char* fmt, va_list args) {
 
 }
 
-alvr::EncodePipelineSW::EncodePipelineSW(Renderer* render, uint32_t width, uint32_t height) {
+alvr::EncodePipelineSW::EncodePipelineSW(Renderer* render, uint32_t width, uint32_t height)
+    : r(render) {
     const auto* settings = Settings_Instance();
 
     x264_param_default_preset(&param, "ultrafast", "zerolatency");
@@ -46,7 +50,21 @@ alvr::EncodePipelineSW::EncodePipelineSW(Renderer* render, uint32_t width, uint3
     param.i_threads = settings->m_swThreadCount;
     param.i_width = width;
     param.i_height = height;
+    // Slices are collected as soon as each slice thread is done, instead of once per frame
+    param.nalu_process = nalu_process;
     param.rc.i_rc_method = X264_RC_ABR;
+    // Periodic refresh waves over keyint frames replace the periodic IDR frames
+    if (settings->m_intraRefreshRecoveryFrames > 0) {
+        param.b_intra_refresh = 1;
+        param.i_keyint_max = settings->m_intraRefreshRecoveryFrames;
+        intra_refresh_mode = IntraRefreshMode::Continuous;
+    } else if (settings->m_refFrameInvalidation) {
+        // Older frames to fall back on after invalidating lost ones, without searching them for
+        // motion. Keyframes are only needed when invalidating fails.
+        param.i_dpb_size = REF_INVALIDATION_DPB_SIZE;
+        param.i_keyint_max = X264_KEYINT_MAX_INFINITE;
+        ref_invalidation = true;
+    }
 
     switch (settings->m_h264Profile) {
     case ALVR_H264_PROFILE_BASELINE:
@@ -65,9 +83,12 @@ alvr::EncodePipelineSW::EncodePipelineSW(Renderer* render, uint32_t width, uint3
     params.updated = true;
     params.bitrate_bps = 30'000'000;
     params.framerate = Settings_Instance()->m_refreshRate;
+    params.refresh_rate = Settings_Instance()->m_refreshRate;
     SetParams(params);
 
-    enc = x264_encoder_open(&param);
+    // The slice threads are created by the open, and keep the pinning of this thread
+    int numa_node = SoftwareEncoderNumaNode();
+    RunOnNumaNode(numa_node, [&] { enc = x264_encoder_open(&param); });
     if (!enc) {
         throw std::runtime_error("Failed to open encoder");
     }
@@ -75,29 +96,54 @@ alvr::EncodePipelineSW::EncodePipelineSW(Renderer* render, uint32_t width, uint3
     x264_picture_init(&picture);
     picture.img.i_csp = X264_CSP_I420;
     picture.img.i_plane = 3;
+    picture.opaque = this;
+
+    mb_count = ((width + 15) / 16) * ((height + 15) / 16);
 
     x264_picture_init(&picture_out);
 
-    rgbtoyuv = new RgbToYuv420(
-        render,
-        render->GetOutput().image,
-        render->GetOutput().imageInfo,
-        render->GetOutput().semaphore
-    );
+    for (uint32_t i = 0; i < render->GetOutputCount(); ++i) {
+        const Renderer::Output& output = render->GetOutput(i);
+        rgbtoyuv.push_back(
+            new RgbToYuv420(render, output.image, output.imageInfo, output.semaphore, numa_node)
+        );
+    }
 }
 
 alvr::EncodePipelineSW::~EncodePipelineSW() {
-    if (rgbtoyuv) {
-        delete rgbtoyuv;
+    for (FormatConverter* converter : rgbtoyuv) {
+        delete converter;
     }
     if (enc) {
         x264_encoder_close(enc);
     }
 }
 
-void alvr::EncodePipelineSW::PushFrame(uint64_t targetTimestampNs, bool idr) {
-    rgbtoyuv->Convert(picture.img.plane, picture.img.i_stride);
-    rgbtoyuv->Sync();
+void alvr::EncodePipelineSW::PrepareFrame(uint32_t outputIndex) {
+    rgbtoyuv[outputIndex]->Convert(r->GetOutput(outputIndex).semaphoreValue);
+}
+
+void alvr::EncodePipelineSW::DropFrame(uint32_t outputIndex) {
+    // Waits for the conversion, so that the next PrepareFrame of the output can convert again
+    uint8_t* planes[3];
+    int linesizes[3];
+    rgbtoyuv[outputIndex]->Sync(planes, linesizes);
+}
+
+void alvr::EncodePipelineSW::PushFrame(
+    uint32_t outputIndex, uint64_t targetTimestampNs, bool idr
+) {
+    ALVR_PROFILE_ZONE("EncodePipelineSW::PushFrame");
+    FormatConverter* converter = rgbtoyuv[outputIndex];
+    if (!converter->Pending()) {
+        converter->Convert(r->GetOutput(outputIndex).semaphoreValue);
+    }
+    // The whole frame, not stripes of it: x264_encoder_encode copies the picture into its own frame
+    // and computes the adaptive quantization over all of it before the slice threads start, so no
+    // slice could begin on the top rows early. The conversion overlaps the previous frame instead,
+    // through PrepareFrame.
+    converter->Sync(picture.img.plane, picture.img.i_stride);
+    last_converter = converter;
     timestamp.cpu = std::chrono::duration_cast<std::chrono::nanoseconds>(
                         std::chrono::steady_clock::now().time_since_epoch()
     )
@@ -107,6 +153,16 @@ void alvr::EncodePipelineSW::PushFrame(uint64_t targetTimestampNs, bool idr) {
     pts = picture.i_pts = targetTimestampNs;
     is_idr = idr;
 
+    {
+        std::lock_guard lock(slice_mutex);
+        pending.clear();
+        early_slices.clear();
+        next_mb = 0;
+        sent_first_slice = false;
+    }
+
+    // With sliced threads, all NALs of the frame went through nalu_process once this returns
+    x264_nal_t* nal = nullptr;
     int nnal = 0;
     nal_size = x264_encoder_encode(enc, &nal, &nnal, &picture, &picture_out);
     if (nal_size < 0) {
@@ -115,26 +171,119 @@ void alvr::EncodePipelineSW::PushFrame(uint64_t targetTimestampNs, bool idr) {
 }
 
 bool alvr::EncodePipelineSW::GetEncoded(FramePacket& packet) {
-    if (!nal) {
+    std::lock_guard lock(slice_mutex);
+    // Should not happen, but a missing slice must not lose the rest of the frame
+    for (auto& [first_mb, slice] : early_slices) {
+        pending.insert(pending.end(), slice.data.begin(), slice.data.end());
+    }
+    early_slices.clear();
+
+    if (nal_size <= 0 || pending.empty()) {
         return false;
     }
-    packet.size = nal_size;
-    packet.data = nal[0].p_payload;
+    packet.size = pending.size();
+    packet.data = pending.data();
     packet.pts = pts;
     packet.isIDR = is_idr;
-    return packet.size > 0;
+    packet.firstSlice = !sent_first_slice;
+    packet.averageQp = picture_out.i_qpplus1 - 1;
+    switch (picture_out.i_type) {
+    case X264_TYPE_IDR:
+        packet.frameType = FRAME_TYPE_IDR;
+        break;
+    case X264_TYPE_I:
+        packet.frameType = FRAME_TYPE_INTRA;
+        break;
+    case X264_TYPE_P:
+        packet.frameType = FRAME_TYPE_PREDICTED;
+        break;
+    case X264_TYPE_B:
+    case X264_TYPE_BREF:
+        packet.frameType = FRAME_TYPE_BIDIRECTIONAL;
+        break;
+    default:
+        packet.frameType = FRAME_TYPE_UNKNOWN;
+    }
+    // Handed out once, pending stays valid until the next PushFrame
+    nal_size = 0;
+    return true;
+}
+
+void alvr::EncodePipelineSW::GetStageTimings(std::vector<Renderer::StageTiming>& timings) {
+    if (last_converter) {
+        timings.push_back({ "rgbtoyuv420", last_converter->GetDuration() });
+    }
+}
+
+EncoderCapabilities alvr::EncodePipelineSW::GetCapabilities() {
+    EncoderCapabilities capabilities = EncodePipeline::GetCapabilities();
+    capabilities.refInvalidation = ref_invalidation;
+    // Sliced threads
+    capabilities.slices = true;
+    return capabilities;
+}
+
+void alvr::EncodePipelineSW::SetSliceSink(SliceSink sink) {
+    std::lock_guard lock(slice_mutex);
+    slice_sink = std::move(sink);
+}
+
+void alvr::EncodePipelineSW::nalu_process(x264_t* h, x264_nal_t* nal, void* opaque) {
+    static_cast<EncodePipelineSW*>(opaque)->ProcessNal(h, nal);
+}
+
+void alvr::EncodePipelineSW::ProcessNal(x264_t* h, x264_nal_t* nal) {
+    // Size required by x264_nal_encode, which then points p_payload into the buffer
+    std::vector<uint8_t> data(nal->i_payload * 3 / 2 + 5 + 64);
+    x264_nal_encode(h, data.data(), nal);
+    data.resize(nal->i_payload);
+
+    std::lock_guard lock(slice_mutex);
+
+    // Parameter sets and SEI are written before the slice threads start
+    if (nal->i_type != NAL_SLICE && nal->i_type != NAL_SLICE_IDR) {
+        pending.insert(pending.end(), data.begin(), data.end());
+        return;
+    }
+
+    early_slices.emplace(nal->i_first_mb, Slice { nal->i_last_mb, std::move(data) });
+
+    auto it = early_slices.find(next_mb);
+    while (it != early_slices.end()) {
+        pending.insert(pending.end(), it->second.data.begin(), it->second.data.end());
+        next_mb = it->second.last_mb + 1;
+        early_slices.erase(it);
+
+        // The last slice is left for GetEncoded, which returns it with the frame timings
+        if (next_mb < mb_count && slice_sink) {
+            FramePacket slice = {};
+            slice.data = pending.data();
+            slice.size = pending.size();
+            slice.pts = pts;
+            slice.isIDR = is_idr;
+            slice.firstSlice = !sent_first_slice;
+            slice_sink(slice);
+
+            pending.clear();
+            sent_first_slice = true;
+        }
+
+        it = early_slices.find(next_mb);
+    }
 }
 
 void alvr::EncodePipelineSW::SetParams(FfiDynamicEncoderParams params) {
     if (!params.updated) {
         return;
     }
-    // x264 doesn't work well with adaptive bitrate/fps
-    param.i_fps_num = Settings_Instance()->m_refreshRate;
+    // x264 doesn't work well with adaptive bitrate/fps, it only follows the refresh rate
+    param.i_fps_num = std::max(int(params.refresh_rate + 0.5f), 1);
     param.i_fps_den = 1;
     param.rc.i_bitrate
         = params.bitrate_bps / 1'000 * 1.4; // needs higher value to hit target bitrate
-    param.rc.i_vbv_buffer_size = param.rc.i_bitrate / param.i_fps_num * 1.1;
+    // In kbit, like the bitrate
+    uint64_t vbvBits = param.rc.i_bitrate * 1'000 / param.i_fps_num * 1.1;
+    param.rc.i_vbv_buffer_size = CapToMaxFrameSize(params.max_frame_bytes, vbvBits) / 1'000;
     param.rc.i_vbv_max_bitrate = param.rc.i_bitrate;
     param.rc.f_vbv_buffer_init = 0.75;
     if (enc) {
@@ -142,4 +291,11 @@ void alvr::EncodePipelineSW::SetParams(FfiDynamicEncoderParams params) {
     }
 }
 
+bool alvr::EncodePipelineSW::InvalidateRefFrames(uint64_t lastReceivedTimestampNs) {
+    // Frames are encoded with their target timestamp as pts, every frame from the next one on is
+    // forgotten
+    return ref_invalidation
+        && x264_encoder_invalidate_reference(enc, lastReceivedTimestampNs + 1) == 0;
+}
+
 int alvr::EncodePipelineSW::GetCodec() { return ALVR_CODEC_H264; }
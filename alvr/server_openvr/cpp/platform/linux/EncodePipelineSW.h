@@ -2,6 +2,8 @@
 
 #include "EncodePipeline.h"
 
+#include <map>
+#include <mutex>
 #include <x264.h>
 
 class FormatConverter;
@@ -13,20 +15,50 @@ public:
     ~EncodePipelineSW();
     EncodePipelineSW(Renderer* render, uint32_t width, uint32_t height);
 
-    void PushFrame(uint64_t targetTimestampNs, bool idr) override;
+    void PushFrame(uint32_t outputIndex, uint64_t targetTimestampNs, bool idr) override;
+    void PrepareFrame(uint32_t outputIndex) override;
+    void DropFrame(uint32_t outputIndex) override;
+    void SetSliceSink(SliceSink sink) override;
+    void GetStageTimings(std::vector<Renderer::StageTiming>& timings) override;
     bool GetEncoded(FramePacket& packet) override;
     void SetParams(FfiDynamicEncoderParams params) override;
     int GetCodec() override;
+    // Ref invalidation is not compatible with intra refresh
+    EncoderCapabilities GetCapabilities() override;
+    bool InvalidateRefFrames(uint64_t lastReceivedTimestampNs) override;
 
 private:
+    static const int REF_INVALIDATION_DPB_SIZE = 8;
+
+    static void nalu_process(x264_t* h, x264_nal_t* nal, void* opaque);
+    void ProcessNal(x264_t* h, x264_nal_t* nal);
+
+    Renderer* r = nullptr;
     x264_t* enc = nullptr;
     x264_param_t param;
     x264_picture_t picture;
     x264_picture_t picture_out;
-    x264_nal_t* nal = nullptr;
     int nal_size = 0;
     int64_t pts = 0;
     bool is_idr = false;
-    FormatConverter* rgbtoyuv = nullptr;
+    int mb_count = 0;
+    bool ref_invalidation = false;
+
+    // x264 hands NALs over from its slice threads, possibly out of order
+    std::mutex slice_mutex;
+    SliceSink slice_sink;
+    // In order bitstream which hasn't been handed out yet
+    std::vector<uint8_t> pending;
+    struct Slice {
+        int last_mb;
+        std::vector<uint8_t> data;
+    };
+    // Slices that completed before the ones preceding them, keyed by first macroblock
+    std::map<int, Slice> early_slices;
+    int next_mb = 0;
+    bool sent_first_slice = false;
+    // One per Renderer output, so that converting the next frame overlaps x264 reading this one
+    std::vector<FormatConverter*> rgbtoyuv;
+    FormatConverter* last_converter = nullptr;
 };
 }
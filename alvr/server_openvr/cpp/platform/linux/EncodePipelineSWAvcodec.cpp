@@ -0,0 +1,199 @@
+#include "EncodePipelineSWAvcodec.h"
+
+#include <chrono>
+#include <string>
+
+#include "FormatConverter.h"
+#include "alvr_server/NumaPlacement.h"
+#include "alvr_server/Profiling.h"
+#include "alvr_server/bindings.h"
+#include "ffmpeg_helper.h"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavutil/opt.h>
+}
+
+namespace {
+
+// Fastest preset of SVT-AV1 that still has the low delay prediction structure
+const int SVT_AV1_PRESET = 12;
+// Pictures SVT-AV1 may hold in its pipeline before the packet of the first one comes out
+const uint32_t SVT_AV1_FRAMES_IN_FLIGHT = 2;
+
+const char* encoder(ALVR_CODEC codec) {
+    switch (codec) {
+    case ALVR_CODEC_HEVC:
+        return "libx265";
+    case ALVR_CODEC_AV1:
+        return "libsvtav1";
+    default:
+        break;
+    }
+    throw std::runtime_error("invalid codec " + std::to_string(codec));
+}
+
+// SVT-AV1 takes the tile counts as log2
+int floor_log2(uint32_t value) {
+    int log2 = 0;
+    while (value > 1) {
+        value >>= 1;
+        log2++;
+    }
+    return log2;
+}
+
+}
+
+alvr::EncodePipelineSWAvcodec::EncodePipelineSWAvcodec(
+    Renderer* render, uint32_t width, uint32_t height
+)
+    : r(render)
+    , codec(ALVR_CODEC(Settings_Instance()->m_codec)) {
+    const auto* settings = Settings_Instance();
+
+    const char* encoder_name = encoder(codec);
+    const AVCodec* av_codec = avcodec_find_encoder_by_name(encoder_name);
+    if (av_codec == nullptr) {
+        throw std::runtime_error(std::string("Failed to find encoder ") + encoder_name);
+    }
+
+    encoder_ctx = avcodec_alloc_context3(av_codec);
+    if (not encoder_ctx) {
+        throw std::runtime_error(std::string("failed to allocate ") + encoder_name + " encoder");
+    }
+
+    std::string params;
+    switch (codec) {
+    case ALVR_CODEC_HEVC:
+        // No lookahead, B frames or frame threads. The rows of each frame are encoded in parallel
+        // instead, on top of the slices.
+        av_opt_set(encoder_ctx->priv_data, "preset", "ultrafast", 0);
+        av_opt_set(encoder_ctx->priv_data, "tune", "zerolatency", 0);
+        av_opt_set_int(encoder_ctx->priv_data, "forced-idr", 1, 0);
+        params = "slices=" + std::to_string(settings->m_swHevcSlices);
+        if (settings->m_swHevcThreadCount > 0) {
+            params += ":pools=" + std::to_string(settings->m_swHevcThreadCount);
+        }
+        // Periodic refresh waves over keyint frames replace the periodic IDR frames
+        if (settings->m_intraRefreshRecoveryFrames > 0) {
+            params += ":intra-refresh=1";
+            encoder_ctx->gop_size = settings->m_intraRefreshRecoveryFrames;
+            intra_refresh_mode = IntraRefreshMode::Continuous;
+        } else {
+            encoder_ctx->gop_size = INT16_MAX;
+        }
+        av_opt_set(encoder_ctx->priv_data, "x265-params", params.c_str(), 0);
+        break;
+    case ALVR_CODEC_AV1:
+        // Low delay prediction, which CBR requires, and keyframes only when requested
+        av_opt_set_int(encoder_ctx->priv_data, "preset", SVT_AV1_PRESET, 0);
+        params = "pred-struct=1:keyint=-1";
+        params += ":lp=" + std::to_string(settings->m_swAv1ThreadCount);
+        params += ":tile-columns=" + std::to_string(floor_log2(settings->m_tileColumns));
+        params += ":tile-rows=" + std::to_string(floor_log2(settings->m_tileRows));
+        av_opt_set(encoder_ctx->priv_data, "svtav1-params", params.c_str(), 0);
+        break;
+    default:
+        break;
+    }
+
+    encoder_ctx->width = width;
+    encoder_ctx->height = height;
+    encoder_ctx->time_base = { 1, (int)1e9 };
+    encoder_ctx->sample_aspect_ratio = AVRational { 1, 1 };
+    encoder_ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+    encoder_ctx->max_b_frames = 0;
+    encoder_ctx->color_range = AVCOL_RANGE_JPEG;
+    encoder_ctx->color_primaries = AVCOL_PRI_BT709;
+    encoder_ctx->color_trc = AVCOL_TRC_GAMMA22;
+    encoder_ctx->colorspace = AVCOL_SPC_BT709;
+
+    // The maximum rate is the bitrate, which SVT-AV1 encodes as CBR and x265 as a capped VBV
+    auto dynamic_params = FfiDynamicEncoderParams {};
+    dynamic_params.updated = true;
+    dynamic_params.bitrate_bps = 30'000'000;
+    dynamic_params.framerate = settings->m_refreshRate;
+    SetParams(dynamic_params);
+
+    // The threads of x265 and SVT-AV1 are created by the open, and keep the pinning of this thread
+    int numa_node = SoftwareEncoderNumaNode();
+    int err = 0;
+    RunOnNumaNode(numa_node, [&] { err = avcodec_open2(encoder_ctx, av_codec, NULL); });
+    if (err < 0) {
+        throw alvr::AvException(std::string("Cannot open ") + encoder_name + " encoder:", err);
+    }
+
+    frame = av_frame_alloc();
+    frame->width = width;
+    frame->height = height;
+    frame->format = AV_PIX_FMT_YUV420P;
+    frame->color_range = AVCOL_RANGE_JPEG;
+
+    for (uint32_t i = 0; i < render->GetOutputCount(); ++i) {
+        const Renderer::Output& output = render->GetOutput(i);
+        rgbtoyuv.push_back(
+            new RgbToYuv420(render, output.image, output.imageInfo, output.semaphore, numa_node)
+        );
+    }
+}
+
+alvr::EncodePipelineSWAvcodec::~EncodePipelineSWAvcodec() {
+    for (FormatConverter* converter : rgbtoyuv) {
+        delete converter;
+    }
+    av_frame_free(&frame);
+}
+
+void alvr::EncodePipelineSWAvcodec::PrepareFrame(uint32_t outputIndex) {
+    rgbtoyuv[outputIndex]->Convert(r->GetOutput(outputIndex).semaphoreValue);
+}
+
+void alvr::EncodePipelineSWAvcodec::DropFrame(uint32_t outputIndex) {
+    // Waits for the conversion, so that the next PrepareFrame of the output can convert again
+    uint8_t* planes[3];
+    int linesizes[3];
+    rgbtoyuv[outputIndex]->Sync(planes, linesizes);
+}
+
+void alvr::EncodePipelineSWAvcodec::PushFrame(
+    uint32_t outputIndex, uint64_t targetTimestampNs, bool idr
+) {
+    ALVR_PROFILE_ZONE("EncodePipelineSWAvcodec::PushFrame");
+    FormatConverter* converter = rgbtoyuv[outputIndex];
+    if (!converter->Pending()) {
+        converter->Convert(r->GetOutput(outputIndex).semaphoreValue);
+    }
+    converter->Sync(frame->data, frame->linesize);
+    last_converter = converter;
+    timestamp.cpu = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now().time_since_epoch()
+    )
+                        .count();
+
+    // The frame isn't reference counted, so libavcodec copies the planes before this returns and
+    // the converter can be reused while the encoder still holds the picture
+    frame->pict_type = idr ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+    frame->pts = targetTimestampNs;
+
+    int err = avcodec_send_frame(encoder_ctx, frame);
+    if (err < 0) {
+        throw alvr::AvException("avcodec_send_frame failed:", err);
+    }
+}
+
+void alvr::EncodePipelineSWAvcodec::GetStageTimings(std::vector<Renderer::StageTiming>& timings) {
+    if (last_converter) {
+        timings.push_back({ "rgbtoyuv420", last_converter->GetDuration() });
+    }
+}
+
+uint32_t alvr::EncodePipelineSWAvcodec::GetMaxFramesInFlight() {
+    return codec == ALVR_CODEC_AV1 ? SVT_AV1_FRAMES_IN_FLIGHT : 0;
+}
+
+EncoderCapabilities alvr::EncodePipelineSWAvcodec::GetCapabilities() {
+    EncoderCapabilities capabilities = EncodePipeline::GetCapabilities();
+    capabilities.tenBit = false;
+    return capabilities;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "EncodePipeline.h"
+
+extern "C" struct AVFrame;
+
+class FormatConverter;
+
+namespace alvr {
+
+// Software encoding of HEVC with x265 and of AV1 with SVT-AV1, through their libavcodec wrappers.
+// H.264 goes through EncodePipelineSW, which drives x264 directly for its slice output.
+class EncodePipelineSWAvcodec : public EncodePipeline {
+public:
+    ~EncodePipelineSWAvcodec();
+    EncodePipelineSWAvcodec(Renderer* render, uint32_t width, uint32_t height);
+
+    void PushFrame(uint32_t outputIndex, uint64_t targetTimestampNs, bool idr) override;
+    void PrepareFrame(uint32_t outputIndex) override;
+    void DropFrame(uint32_t outputIndex) override;
+    void GetStageTimings(std::vector<Renderer::StageTiming>& timings) override;
+    // SVT-AV1 returns the packets of its pipeline later, x265 those of each frame right away
+    uint32_t GetMaxFramesInFlight() override;
+    // The planes are 8 bit
+    EncoderCapabilities GetCapabilities() override;
+
+private:
+    Renderer* r = nullptr;
+    ALVR_CODEC codec;
+    AVFrame* frame = nullptr;
+    // One per Renderer output, so that converting the next frame overlaps encoding this one
+    std::vector<FormatConverter*> rgbtoyuv;
+    FormatConverter* last_converter = nullptr;
+};
+}
@@ -1,9 +1,21 @@
 #include "EncodePipelineVAAPI.h"
 #include "ALVR-common/packet_types.h"
+#include "FormatConverter.h"
+#include "alvr_server/EncoderControl.h"
+#include "alvr_server/FoveatedQpMap.h"
+#include "alvr_server/GpuMemory.h"
 #include "alvr_server/Logger.h"
+#include "alvr_server/Profiling.h"
+#include "alvr_server/Utils.h"
 #include "alvr_server/bindings.h"
 #include "ffmpeg_helper.h"
+#include <algorithm>
 #include <chrono>
+#include <map>
+#include <memory>
+#include <string>
+#include <unistd.h>
+#include <va/va_drmcommon.h>
 
 extern "C" {
 #include <libavcodec/avcodec.h>
@@ -11,23 +23,128 @@ extern "C" {
 #include <libavfilter/buffersink.h>
 #include <libavfilter/buffersrc.h>
 #include <libavutil/hwcontext.h>
+#include <libavutil/hwcontext_vaapi.h>
 #include <libavutil/opt.h>
 }
 
 namespace {
 
-const char* encoder(ALVR_CODEC codec) {
+const char* encoder(ALVR_CODEC codec, bool qsv) {
     switch (codec) {
     case ALVR_CODEC_H264:
-        return "h264_vaapi";
+        return qsv ? "h264_qsv" : "h264_vaapi";
     case ALVR_CODEC_HEVC:
-        return "hevc_vaapi";
+        return qsv ? "hevc_qsv" : "hevc_vaapi";
     case ALVR_CODEC_AV1:
-        return "av1_vaapi";
+        return qsv ? "av1_qsv" : "av1_vaapi";
     }
     throw std::runtime_error("invalid codec " + std::to_string(codec));
 }
 
+VADisplay va_display(AVBufferRef* hw_ctx) {
+    return ((AVVAAPIDeviceContext*)((AVHWDeviceContext*)hw_ctx->data)->hwctx)->display;
+}
+
+VAProfile va_profile(ALVR_CODEC codec, int profile) {
+    switch (codec) {
+    case ALVR_CODEC_H264:
+        if (profile == AV_PROFILE_H264_HIGH) {
+            return VAProfileH264High;
+        }
+        return profile == AV_PROFILE_H264_MAIN ? VAProfileH264Main
+                                               : VAProfileH264ConstrainedBaseline;
+    case ALVR_CODEC_HEVC:
+        return profile == AV_PROFILE_HEVC_MAIN_10 ? VAProfileHEVCMain10 : VAProfileHEVCMain;
+    case ALVR_CODEC_AV1:
+        return VAProfileAV1Profile0;
+    }
+    return VAProfileNone;
+}
+
+// The fixed function encoder of Intel GPUs, libavcodec only picks it by itself when the shader
+// based one is missing
+bool has_low_power_entrypoint(VADisplay display, VAProfile profile) {
+    std::vector<VAEntrypoint> entrypoints(vaMaxNumEntrypoints(display));
+    int count = 0;
+    if (vaQueryConfigEntrypoints(display, profile, entrypoints.data(), &count)
+        != VA_STATUS_SUCCESS) {
+        return false;
+    }
+    auto end = entrypoints.begin() + count;
+    return std::find(entrypoints.begin(), end, VAEntrypointEncSliceLP) != end;
+}
+
+// The VA surfaces are created by the driver and imported into the Renderer instead of the other
+// way around
+bool imports_surfaces(alvr::VkContext& vk_ctx) {
+    return vk_ctx.intel || getenv("ALVR_VAAPI_IMPORT_SURFACE");
+}
+
+#if VA_CHECK_VERSION(1, 21, 0)
+// Same byte order, DRM names the channels from the most significant bit and VA from the first byte
+uint32_t va_fourcc(uint32_t drm_format) {
+    switch (drm_format) {
+    case VA_FOURCC('A', 'R', '2', '4'): // DRM_FORMAT_ARGB8888
+        return VA_FOURCC_BGRA;
+    case VA_FOURCC('A', 'B', '2', '4'): // DRM_FORMAT_ABGR8888
+        return VA_FOURCC_RGBA;
+    case VA_FOURCC('X', 'B', '3', '0'): // DRM_FORMAT_XBGR2101010
+        return VA_FOURCC_X2B10G10R10;
+    }
+    return 0;
+}
+
+// Whether the driver allocates a video processing input with exactly this modifier, drivers that
+// don't know VASurfaceAttribDRMFormatModifiers pick their own
+bool allocates_modifier(VADisplay display, uint32_t drm_format, uint64_t modifier) {
+    uint32_t fourcc = va_fourcc(drm_format);
+    if (fourcc == 0) {
+        return false;
+    }
+    VADRMFormatModifierList modifiers = {};
+    modifiers.num_modifiers = 1;
+    modifiers.modifiers = &modifier;
+
+    VASurfaceAttrib attribs[3] = {};
+    attribs[0].type = VASurfaceAttribPixelFormat;
+    attribs[0].flags = VA_SURFACE_ATTRIB_SETTABLE;
+    attribs[0].value.type = VAGenericValueTypeInteger;
+    attribs[0].value.value.i = fourcc;
+    attribs[1].type = VASurfaceAttribUsageHint;
+    attribs[1].flags = VA_SURFACE_ATTRIB_SETTABLE;
+    attribs[1].value.type = VAGenericValueTypeInteger;
+    attribs[1].value.value.i = VA_SURFACE_ATTRIB_USAGE_HINT_VPP_READ;
+    attribs[2].type = VASurfaceAttribDRMFormatModifiers;
+    attribs[2].flags = VA_SURFACE_ATTRIB_SETTABLE;
+    attribs[2].value.type = VAGenericValueTypePointer;
+    attribs[2].value.value.p = &modifiers;
+
+    VASurfaceID surface;
+    unsigned int rt_format
+        = fourcc == VA_FOURCC_X2B10G10R10 ? VA_RT_FORMAT_RGB32_10 : VA_RT_FORMAT_RGB32;
+    if (vaCreateSurfaces(display, rt_format, 64, 64, &surface, 1, attribs, 3)
+        != VA_STATUS_SUCCESS) {
+        return false;
+    }
+    VADRMPRIMESurfaceDescriptor desc = {};
+    VAStatus status = vaExportSurfaceHandle(
+        display,
+        surface,
+        VA_SURFACE_ATTRIB_MEM_TYPE_DRM_PRIME_2,
+        VA_EXPORT_SURFACE_READ_ONLY | VA_EXPORT_SURFACE_COMPOSED_LAYERS,
+        &desc
+    );
+    vaDestroySurfaces(display, &surface, 1);
+    if (status != VA_STATUS_SUCCESS) {
+        return false;
+    }
+    for (uint32_t i = 0; i < desc.num_objects; ++i) {
+        close(desc.objects[i].fd);
+    }
+    return desc.num_objects > 0 && desc.objects[0].drm_format_modifier == modifier;
+}
+#endif
+
 void set_hwframe_ctx(AVCodecContext* ctx, AVBufferRef* hw_device_ctx) {
     AVBufferRef* hw_frames_ref;
     AVHWFramesContext* frames_ctx = NULL;
@@ -53,10 +170,56 @@ void set_hwframe_ctx(AVCodecContext* ctx, AVBufferRef* hw_device_ctx) {
     ctx->hw_frames_ctx = av_buffer_ref(hw_frames_ref);
     if (!ctx->hw_frames_ctx)
         err = AVERROR(ENOMEM);
+    // The encoder context is never freed, see ~EncodePipelineVAAPI, and neither is the pool
+    uint64_t frame_bytes = uint64_t(ctx->width) * ctx->height * 3 / 2
+        * (frames_ctx->sw_format == AV_PIX_FMT_P010 ? 2 : 1);
+    TrackGpuMemory(
+        ctx,
+        "VAAPI encoder frames",
+        GpuMemoryType::DeviceLocal,
+        frame_bytes * frames_ctx->initial_pool_size
+    );
 
     av_buffer_unref(&hw_frames_ref);
 }
 
+// Center regions at full quality, then rings halfway to the edges of the eyes and the rest of the
+// frame with growing QP offsets. VAAPI takes regions instead of a map, from the most important.
+void add_foveation_regions(AVFrame* frame, const FfiFoveationCenter& center) {
+    // The offsets are fractions of the QP range of H.264 and HEVC
+    const int QP_RANGE = 51;
+    const int REGION_COUNT = 5;
+    int maxOffset = Settings_Instance()->m_foveatedQpOffset;
+
+    AVFrameSideData* sideData = av_frame_new_side_data(
+        frame, AV_FRAME_DATA_REGIONS_OF_INTEREST, REGION_COUNT * sizeof(AVRegionOfInterest)
+    );
+    if (!sideData) {
+        return;
+    }
+    auto* regions = reinterpret_cast<AVRegionOfInterest*>(sideData->data);
+    for (int i = 0; i < REGION_COUNT; i++) {
+        AVRegionOfInterest& region = regions[i];
+        region.self_size = sizeof(AVRegionOfInterest);
+        if (i < 4) {
+            int ring = i / 2;
+            FoveatedRect rect
+                = GetFoveatedRect(center, i % 2, ring * 0.5f, frame->width, frame->height);
+            region.top = rect.top;
+            region.bottom = rect.bottom;
+            region.left = rect.left;
+            region.right = rect.right;
+            region.qoffset = AVRational { maxOffset * ring / 2, QP_RANGE };
+        } else {
+            region.top = 0;
+            region.bottom = frame->height;
+            region.left = 0;
+            region.right = frame->width;
+            region.qoffset = AVRational { maxOffset, QP_RANGE };
+        }
+    }
+}
+
 // Map the vulkan frames to corresponding vaapi frames
 AVFrame*
 map_frame(AVBufferRef* hw_frames_ref, AVBufferRef* drm_device_ctx, alvr::VkFrame& input_frame) {
@@ -118,8 +281,8 @@ AVFrame* import_frame(AVBufferRef* hw_frames_ref, DrmImage& drm) {
     drm.modifier = desc->objects[0].format_modifier;
     drm.planes = desc->layers[0].nb_planes;
     for (uint32_t i = 0; i < drm.planes; ++i) {
-        drm.strides[0] = desc->layers[0].planes[i].pitch;
-        drm.offsets[0] = desc->layers[0].planes[i].offset;
+        drm.strides[i] = desc->layers[0].planes[i].pitch;
+        drm.offsets[i] = desc->layers[0].planes[i].offset;
     }
 
     return va_frame;
@@ -128,18 +291,38 @@ AVFrame* import_frame(AVBufferRef* hw_frames_ref, DrmImage& drm) {
 }
 
 alvr::EncodePipelineVAAPI::EncodePipelineVAAPI(
-    Renderer* render, VkContext& vk_ctx, VkFrame& input_frame, uint32_t width, uint32_t height
+    Renderer* render,
+    VkContext& vk_ctx,
+    const std::vector<std::unique_ptr<VkFrame>>& input_frames,
+    uint32_t width,
+    uint32_t height,
+    bool cross_device,
+    bool qsv
 )
-    : r(render) {
+    : r(render)
+    , nominal_width(width)
+    , nominal_height(height)
+    , amd(vk_ctx.amd)
+    , intel(vk_ctx.intel)
+    , qsv(qsv) {
     /* VAAPI Encoding pipeline
      * The encoding pipeline has 3 frame types:
      * - input vulkan frames, only used to initialize the mapped frames
      * - mapped frames, one per input frame, same format, and point to the same memory on the device
-     * - encoder frame, with a format compatible with the encoder, created by the filter
+     *   (there is one input frame per Renderer output)
+     * - encoder frame, with a format compatible with the encoder, from the encoder frame pool
      * Each frame type has a corresponding hardware frame context, the vulkan one is provided
      *
-     * The pipeline is simply made of a scale_vaapi object, that does the conversion between formats
-     * and the encoder that takes the converted frame and produces packets.
+     * The conversion between formats is a video processing blit from the mapped frame into the
+     * encoder frame, then the encoder takes the converted frame and produces packets.
+     * With a dynamic resolution scale, a scale_vaapi filter graph downscales instead and the
+     * encoder is reopened at the new size, the mapped frames don't change.
+     * With qsv, the encoder frames are also mapped to QSV frames of a derived context, which the
+     * oneVPL encoder takes. The video processing blit scales them then, the frames of a filter
+     * graph or of the shader conversion don't come from a pool the QSV context is derived from.
+     * With linux_vaapi_shader_conversion, a compute shader converts each Renderer output into an
+     * NV12 surface of its own at the nominal size, which the encoder takes as is. It replaces the
+     * video processing blit, whose fixed function conversion is slow on some GPUs.
      */
     int err = av_hwdevice_ctx_create(
         &hw_ctx, AV_HWDEVICE_TYPE_VAAPI, vk_ctx.devicePath.c_str(), NULL, 0
@@ -157,10 +340,196 @@ alvr::EncodePipelineVAAPI::EncodePipelineVAAPI(
         throw alvr::AvException("Failed to create DRM device:", err);
     }
 
+    if (qsv) {
+        err = av_hwdevice_ctx_create_derived(&qsv_ctx, AV_HWDEVICE_TYPE_QSV, hw_ctx, 0);
+        if (err < 0) {
+            throw alvr::AvException("Failed to create a QSV device:", err);
+        }
+        qsv_frame = av_frame_alloc();
+    }
+
+    open_encoder(width, height);
+
+    AVBufferRef* hw_frames_ref;
+    if (!(hw_frames_ref = av_hwframe_ctx_alloc(hw_ctx))) {
+        throw std::runtime_error("Failed to create VAAPI frame context.");
+    }
+    auto frames_ctx = (AVHWFramesContext*)(hw_frames_ref->data);
+    frames_ctx->format = AV_PIX_FMT_VAAPI;
+    frames_ctx->sw_format = input_frames[0]->avFormat();
+    frames_ctx->width = input_frames[0]->imageInfo().extent.width;
+    frames_ctx->height = input_frames[0]->imageInfo().extent.height;
+    frames_ctx->initial_pool_size = input_frames.size();
+    if ((err = av_hwframe_ctx_init(hw_frames_ref)) < 0) {
+        av_buffer_unref(&hw_frames_ref);
+        throw alvr::AvException("Failed to initialize VAAPI frame context:", err);
+    }
+
+    encoder_frame = av_frame_alloc();
+    // The Renderer can't import the tiled surfaces of another GPU
+    bool import_surface = !cross_device && imports_surfaces(vk_ctx);
+    if (import_surface) {
+        Info("Importing VA surface");
+    }
+    for (uint32_t i = 0; i < input_frames.size(); ++i) {
+        if (import_surface) {
+            DrmImage drm;
+            mapped_frames.push_back(import_frame(hw_frames_ref, drm));
+            r->ImportOutput(i, drm);
+        } else {
+            // map_frame takes ownership of the reference
+            mapped_frames.push_back(
+                map_frame(av_buffer_ref(hw_frames_ref), drm_ctx, *input_frames[i])
+            );
+        }
+    }
+    if (!import_surface) {
+        av_buffer_unref(&hw_frames_ref);
+    }
+    // The converter runs on the Renderer GPU, which must import the surfaces of the encoder
+    bool eight_bit = ((AVHWFramesContext*)va_frames_ctx()->data)->sw_format == AV_PIX_FMT_NV12;
+    if (Settings_Instance()->m_vaapiShaderConversion) {
+        if (cross_device || qsv || !eight_bit || !r->d.haveDrmModifiers
+            || RGBTONV12_SHADER_COMP_SPV_LEN == 0) {
+            Warn("VAAPI: shader conversion not available, using video processing");
+        } else if (init_shader_conversion()) {
+            Info("VAAPI: converting with a shader");
+        }
+    }
+    init_conversion(width, height);
+}
+
+bool alvr::EncodePipelineVAAPI::init_shader_conversion() {
+    AVBufferRef* frames_ref = av_hwframe_ctx_alloc(hw_ctx);
+    if (!frames_ref) {
+        throw std::runtime_error("Failed to create VAAPI frame context.");
+    }
+    auto frames_ctx = (AVHWFramesContext*)(frames_ref->data);
+    frames_ctx->format = AV_PIX_FMT_VAAPI;
+    frames_ctx->sw_format = AV_PIX_FMT_NV12;
+    frames_ctx->width = nominal_width;
+    frames_ctx->height = nominal_height;
+    frames_ctx->initial_pool_size = r->GetOutputCount();
+    int err = av_hwframe_ctx_init(frames_ref);
+    if (err < 0) {
+        av_buffer_unref(&frames_ref);
+        throw alvr::AvException("Failed to initialize VAAPI frame context:", err);
+    }
+
+    try {
+        for (uint32_t i = 0; i < r->GetOutputCount(); ++i) {
+            AVFrame* va_frame = av_frame_alloc();
+            nv12_frames.push_back(va_frame);
+            if ((err = av_hwframe_get_buffer(frames_ref, va_frame, 0)) < 0) {
+                throw alvr::AvException("Failed to get an NV12 frame:", err);
+            }
+
+            // Exported as separate R8 and GR88 layers, the converter writes each as r8
+            AVFrame* drm_frame = av_frame_alloc();
+            drm_frame->format = AV_PIX_FMT_DRM_PRIME;
+            err = av_hwframe_map(drm_frame, va_frame, AV_HWFRAME_MAP_WRITE);
+            if (err < 0) {
+                av_frame_free(&drm_frame);
+                throw alvr::AvException("Failed to export an NV12 frame:", err);
+            }
+            auto desc = reinterpret_cast<AVDRMFrameDescriptor*>(drm_frame->data[0]);
+            if (desc->nb_layers != 2) {
+                av_frame_free(&drm_frame);
+                throw std::runtime_error("NV12 frame not exported as two layers");
+            }
+            DrmImage layers[2];
+            for (int l = 0; l < 2; ++l) {
+                const AVDRMPlaneDescriptor& plane = desc->layers[l].planes[0];
+                const AVDRMObjectDescriptor& object = desc->objects[plane.object_index];
+                layers[l].fd = object.fd;
+                layers[l].format = desc->layers[l].format;
+                layers[l].modifier = object.format_modifier;
+                layers[l].planes = 1;
+                layers[l].strides[0] = plane.pitch;
+                layers[l].offsets[0] = plane.offset;
+            }
+
+            const Renderer::Output& output = r->GetOutput(i);
+            try {
+                rgbtonv12.push_back(new RgbToNv12(
+                    r, output.image, output.imageInfo, output.semaphore, layers[0], layers[1]
+                ));
+            } catch (...) {
+                av_frame_free(&drm_frame);
+                throw;
+            }
+            // The converter holds its own fds to the surface
+            av_frame_free(&drm_frame);
+        }
+    } catch (const std::exception& e) {
+        Warn("VAAPI: shader conversion failed, using video processing: %s", e.what());
+        for (FormatConverter* converter : rgbtonv12) {
+            delete converter;
+        }
+        rgbtonv12.clear();
+        for (AVFrame* frame : nv12_frames) {
+            av_frame_free(&frame);
+        }
+        nv12_frames.clear();
+        av_buffer_unref(&frames_ref);
+        return false;
+    }
+
+    // Like the encoder frames, the surfaces live as long as the process
+    TrackGpuMemory(
+        frames_ctx,
+        "VAAPI shader conversion frames",
+        GpuMemoryType::DeviceLocal,
+        uint64_t(nominal_width) * nominal_height * 3 / 2 * frames_ctx->initial_pool_size
+    );
+    av_buffer_unref(&frames_ref);
+    return true;
+}
+
+bool alvr::EncodePipelineVAAPI::shader_conversion() const {
+    return !rgbtonv12.empty() && encoder_ctx->width == int(nominal_width)
+        && encoder_ctx->height == int(nominal_height);
+}
+
+Renderer::ModifierFilter alvr::EncodePipelineVAAPI::ImportableModifierFilter(VkContext& vk_ctx) {
+#if VA_CHECK_VERSION(1, 21, 0)
+    if (imports_surfaces(vk_ctx)) {
+        return {};
+    }
+    AVBufferRef* device = nullptr;
+    int err = av_hwdevice_ctx_create(
+        &device, AV_HWDEVICE_TYPE_VAAPI, vk_ctx.devicePath.c_str(), NULL, 0
+    );
+    if (err < 0) {
+        return {};
+    }
+    // Released with the filter, once the outputs are created
+    std::shared_ptr<AVBufferRef> hw_device(device, [](AVBufferRef* ref) { av_buffer_unref(&ref); });
+    if (!allocates_modifier(va_display(device), VA_FOURCC('A', 'R', '2', '4'), 0)) {
+        Info("VAAPI: driver ignores modifier lists, using the default output modifiers");
+        return {};
+    }
+
+    auto results = std::make_shared<std::map<std::pair<uint32_t, uint64_t>, bool>>();
+    return [hw_device, results](uint32_t format, uint64_t modifier) {
+        auto key = std::make_pair(format, modifier);
+        auto it = results->find(key);
+        if (it == results->end()) {
+            bool allocated = allocates_modifier(va_display(hw_device.get()), format, modifier);
+            it = results->emplace(key, allocated).first;
+        }
+        return it->second;
+    };
+#else
+    return {};
+#endif
+}
+
+void alvr::EncodePipelineVAAPI::open_encoder(uint32_t width, uint32_t height, bool low_power) {
     const auto* settings = Settings_Instance();
 
     auto codec_id = ALVR_CODEC(settings->m_codec);
-    const char* encoder_name = encoder(codec_id);
+    const char* encoder_name = encoder(codec_id, qsv);
     const AVCodec* codec = avcodec_find_encoder_by_name(encoder_name);
     if (codec == nullptr) {
         throw std::runtime_error(std::string("Failed to find encoder ") + encoder_name);
@@ -220,12 +589,21 @@ alvr::EncodePipelineVAAPI::EncodePipelineVAAPI(
 
     av_opt_set_int(encoder_ctx->priv_data, "filler_data", settings->m_fillerData, 0);
 
+    if (codec_id != ALVR_CODEC_H264) {
+        // Columns x rows
+        std::string tiles
+            = std::to_string(settings->m_tileColumns) + "x" + std::to_string(settings->m_tileRows);
+        av_opt_set(encoder_ctx->priv_data, "tiles", tiles.c_str(), 0);
+    }
+
     encoder_ctx->width = width;
     encoder_ctx->height = height;
     encoder_ctx->time_base = { 1, (int)1e9 };
     encoder_ctx->sample_aspect_ratio = AVRational { 1, 1 };
     encoder_ctx->pix_fmt = AV_PIX_FMT_VAAPI;
     encoder_ctx->max_b_frames = 0;
+    // Encoded in parallel where supported, libavcodec still returns them as one packet
+    encoder_ctx->slices = settings->m_slicesPerFrame;
     encoder_ctx->color_range = AVCOL_RANGE_JPEG;
 
     auto params = FfiDynamicEncoderParams {};
@@ -241,68 +619,176 @@ alvr::EncodePipelineVAAPI::EncodePipelineVAAPI(
                               // quality by allocating more bits to smooth areas
     switch (settings->m_encoderQualityPreset) {
     case ALVR_QUALITY:
-        if (vk_ctx.amd) {
+        if (amd) {
             quality.preset_mode = PRESET_MODE_QUALITY;
             encoder_ctx->compression_level
                 = quality.quality; // (QUALITY preset, no pre-encoding, vbaq)
-        } else if (vk_ctx.intel) {
+        } else if (intel) {
             encoder_ctx->compression_level = 1;
         }
         break;
     case ALVR_BALANCED:
-        if (vk_ctx.amd) {
+        if (amd) {
             quality.preset_mode = PRESET_MODE_BALANCE;
             encoder_ctx->compression_level
                 = quality.quality; // (BALANCE preset, no pre-encoding, vbaq)
-        } else if (vk_ctx.intel) {
+        } else if (intel) {
             encoder_ctx->compression_level = 4;
         }
         break;
     case ALVR_SPEED:
     default:
-        if (vk_ctx.amd) {
+        if (amd) {
             quality.preset_mode = PRESET_MODE_SPEED;
             encoder_ctx->compression_level
                 = quality.quality; // (speed preset, no pre-encoding, vbaq)
-        } else if (vk_ctx.intel) {
+        } else if (intel) {
             encoder_ctx->compression_level = 7;
         }
         break;
     }
 
     av_opt_set_int(encoder_ctx->priv_data, "async_depth", 1, 0);
+    // The VAAPI options above that the QSV encoders don't have are ignored
+    if (qsv) {
+        set_qsv_options();
+    }
+
+    low_power = low_power
+        && has_low_power_entrypoint(va_display(hw_ctx), va_profile(codec_id, encoder_ctx->profile));
+    if (low_power) {
+        av_opt_set_int(encoder_ctx->priv_data, "low_power", 1, 0);
+    }
 
     set_hwframe_ctx(encoder_ctx, hw_ctx);
+    int err;
+    if (qsv) {
+        av_buffer_unref(&va_frames);
+        va_frames = encoder_ctx->hw_frames_ctx;
+        encoder_ctx->hw_frames_ctx = nullptr;
+        err = av_hwframe_ctx_create_derived(
+            &encoder_ctx->hw_frames_ctx, AV_PIX_FMT_QSV, qsv_ctx, va_frames, 0
+        );
+        if (err < 0) {
+            throw alvr::AvException("Failed to derive the QSV frame context:", err);
+        }
+        encoder_ctx->pix_fmt = AV_PIX_FMT_QSV;
+    }
 
     err = avcodec_open2(encoder_ctx, codec, NULL);
+    if (err < 0 && low_power) {
+        // Low power encoders of older GPUs miss some rate control modes
+        Warn("VAAPI: low power encoder not usable, using the regular one");
+        avcodec_free_context(&encoder_ctx);
+        open_encoder(width, height, false);
+        return;
+    }
     if (err < 0) {
         throw alvr::AvException("Cannot open video encoder codec:", err);
     }
+    if (low_power) {
+        Info("VAAPI: using the low power encoder");
+    }
+}
 
-    AVBufferRef* hw_frames_ref;
-    if (!(hw_frames_ref = av_hwframe_ctx_alloc(hw_ctx))) {
-        throw std::runtime_error("Failed to create VAAPI frame context.");
+void alvr::EncodePipelineVAAPI::set_qsv_options() {
+    const auto* settings = Settings_Instance();
+    void* options = encoder_ctx->priv_data;
+    switch (ALVR_CODEC(settings->m_codec)) {
+    case ALVR_CODEC_H264:
+        switch (settings->m_h264Profile) {
+        case ALVR_H264_PROFILE_BASELINE:
+            av_opt_set(options, "profile", "baseline", 0);
+            break;
+        case ALVR_H264_PROFILE_MAIN:
+            av_opt_set(options, "profile", "main", 0);
+            break;
+        default:
+        case ALVR_H264_PROFILE_HIGH:
+            av_opt_set(options, "profile", "high", 0);
+            break;
+        }
+        av_opt_set_int(options, "cavlc", settings->m_entropyCoding == ALVR_CAVLC, 0);
+        break;
+    case ALVR_CODEC_HEVC:
+        av_opt_set(options, "profile", settings->m_use10bitEncoder ? "main10" : "main", 0);
+        av_opt_set_int(options, "tile_cols", settings->m_tileColumns, 0);
+        av_opt_set_int(options, "tile_rows", settings->m_tileRows, 0);
+        break;
+    case ALVR_CODEC_AV1:
+        av_opt_set_int(options, "tile_cols", settings->m_tileColumns, 0);
+        av_opt_set_int(options, "tile_rows", settings->m_tileRows, 0);
+        break;
     }
-    auto frames_ctx = (AVHWFramesContext*)(hw_frames_ref->data);
-    frames_ctx->format = AV_PIX_FMT_VAAPI;
-    frames_ctx->sw_format = input_frame.avFormat();
-    frames_ctx->width = input_frame.imageInfo().extent.width;
-    frames_ctx->height = input_frame.imageInfo().extent.height;
-    frames_ctx->initial_pool_size = 1;
-    if ((err = av_hwframe_ctx_init(hw_frames_ref)) < 0) {
-        av_buffer_unref(&hw_frames_ref);
-        throw alvr::AvException("Failed to initialize VAAPI frame context:", err);
+    // The bitrate control of the runtime adapts within the frame instead of over a lookahead,
+    // which would delay every frame. The compression level above is its target usage.
+    av_opt_set_int(options, "low_delay_brc", 1, 0);
+    av_opt_set_int(options, "forced_idr", 1, 0);
+}
+
+AVBufferRef* alvr::EncodePipelineVAAPI::va_frames_ctx() {
+    return qsv ? va_frames : encoder_ctx->hw_frames_ctx;
+}
+
+void alvr::EncodePipelineVAAPI::init_conversion(uint32_t width, uint32_t height) {
+    bool nominal = width == nominal_width && height == nominal_height;
+    if (nominal && !rgbtonv12.empty()) {
+        return;
+    }
+    if ((nominal || qsv) && init_vpp()) {
+        return;
+    }
+    if (qsv) {
+        throw std::runtime_error("VPL: video processing not available");
     }
+    init_filter_graph(width, height);
+}
 
-    encoder_frame = av_frame_alloc();
-    if (vk_ctx.intel || getenv("ALVR_VAAPI_IMPORT_SURFACE")) {
-        Info("Importing VA surface");
-        DrmImage drm;
-        mapped_frame = import_frame(hw_frames_ref, drm);
-        r->ImportOutput(drm);
-    } else {
-        mapped_frame = map_frame(hw_frames_ref, drm_ctx, input_frame);
+void alvr::EncodePipelineVAAPI::free_conversion() {
+    VADisplay display = va_display(hw_ctx);
+    if (vpp_context != VA_INVALID_ID) {
+        vaDestroyContext(display, vpp_context);
+        vpp_context = VA_INVALID_ID;
     }
+    if (vpp_config != VA_INVALID_ID) {
+        vaDestroyConfig(display, vpp_config);
+        vpp_config = VA_INVALID_ID;
+    }
+    avfilter_graph_free(&filter_graph);
+}
+
+bool alvr::EncodePipelineVAAPI::init_vpp() {
+    VADisplay display = va_display(hw_ctx);
+    auto frames_ctx = (AVHWFramesContext*)va_frames_ctx()->data;
+    auto va_surfaces = (AVVAAPIFramesContext*)frames_ctx->hwctx;
+
+    VAStatus status = vaCreateConfig(
+        display, VAProfileNone, VAEntrypointVideoProc, nullptr, 0, &vpp_config
+    );
+    if (status == VA_STATUS_SUCCESS) {
+        // Rendering into the encoder frames, which come from a fixed pool
+        status = vaCreateContext(
+            display,
+            vpp_config,
+            frames_ctx->width,
+            frames_ctx->height,
+            VA_PROGRESSIVE,
+            va_surfaces->surface_ids,
+            va_surfaces->nb_surfaces,
+            &vpp_context
+        );
+    }
+    if (status != VA_STATUS_SUCCESS) {
+        Warn("VAAPI: video processing not available, using scale_vaapi: %s", vaErrorStr(status));
+        free_conversion();
+        return false;
+    }
+    return true;
+}
+
+void alvr::EncodePipelineVAAPI::init_filter_graph(uint32_t width, uint32_t height) {
+    int err;
+    AVFrame* mapped_frame = mapped_frames[0];
 
     filter_graph = avfilter_graph_alloc();
 
@@ -342,7 +828,8 @@ alvr::EncodePipelineVAAPI::EncodePipelineVAAPI(
     inputs->pad_idx = 0;
     inputs->next = NULL;
 
-    std::string filters = "scale_vaapi=out_range=full:format=";
+    std::string filters = "scale_vaapi=w=" + std::to_string(width) + ":h=" + std::to_string(height)
+        + ":out_range=full:format=";
     if ((Settings_Instance()->m_codec == ALVR_CODEC_HEVC
          || Settings_Instance()->m_codec == ALVR_CODEC_AV1)
         && Settings_Instance()->m_use10bitEncoder) {
@@ -370,46 +857,195 @@ alvr::EncodePipelineVAAPI::EncodePipelineVAAPI(
 alvr::EncodePipelineVAAPI::~EncodePipelineVAAPI() {
     // Commented because freeing it here causes a gpu reset, it should be cleaned up away
     // avcodec_free_context(&encoder_ctx);
-    // avfilter_graph_free(&filter_graph);
-    // av_frame_free(&mapped_frame);
+    // for (AVFrame* mapped_frame : mapped_frames) {
+    //     av_frame_free(&mapped_frame);
+    // }
+    // free_conversion();
     // av_frame_free(&encoder_frame);
     // av_buffer_unref(&hw_ctx);
     // av_buffer_unref(&drm_ctx);
 }
 
-void alvr::EncodePipelineVAAPI::PushFrame(uint64_t targetTimestampNs, bool idr) {
-    r->Sync();
+void alvr::EncodePipelineVAAPI::PushFrame(
+    uint32_t outputIndex, uint64_t targetTimestampNs, bool idr
+) {
+    ALVR_PROFILE_ZONE("EncodePipelineVAAPI::PushFrame");
+    if (shader_conversion()) {
+        // The converter waits for the Render on the GPU
+        FormatConverter* converter = rgbtonv12[outputIndex];
+        if (!converter->Pending()) {
+            converter->Convert(r->GetOutput(outputIndex).semaphoreValue);
+        }
+        uint8_t* planes[2];
+        int linesizes[2];
+        converter->Sync(planes, linesizes);
+        last_converter = converter;
+        timestamp.cpu = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::steady_clock::now().time_since_epoch()
+        )
+                            .count();
+
+        // The encoder holds the surface until the frame is encoded, which is before the converter
+        // of the output runs again
+        int err = av_frame_ref(encoder_frame, nv12_frames[outputIndex]);
+        if (err < 0) {
+            throw alvr::AvException("Failed to reference an NV12 frame:", err);
+        }
+        encoder_frame->color_range = AVCOL_RANGE_JPEG;
+        send_encoder_frame(targetTimestampNs, idr);
+        return;
+    }
+    // A conversion prepared before the encoder was scaled
+    DropFrame(outputIndex);
+
+    // When the Render fence is attached to the dma-buf, VAAPI waits for it on the GPU
+    if (!r->GetOutput(outputIndex).implicitSync) {
+        r->Sync(outputIndex);
+    }
     timestamp.cpu = std::chrono::duration_cast<std::chrono::nanoseconds>(
                         std::chrono::steady_clock::now().time_since_epoch()
     )
                         .count();
-    int err = av_buffersrc_add_frame_flags(
-        filter_in, mapped_frame, AV_BUFFERSRC_FLAG_PUSH | AV_BUFFERSRC_FLAG_KEEP_REF
-    );
-    if (err != 0) {
-        throw alvr::AvException("av_buffersrc_add_frame failed", err);
+    VADisplay display = va_display(hw_ctx);
+    int err;
+    if (vpp_context != VA_INVALID_ID) {
+        err = av_hwframe_get_buffer(va_frames_ctx(), encoder_frame, 0);
+        if (err < 0) {
+            throw alvr::AvException("Failed to get an encoder frame:", err);
+        }
+        encoder_frame->color_range = AVCOL_RANGE_JPEG;
+        VASurfaceID output = (VASurfaceID)(uintptr_t)encoder_frame->data[3];
+
+        // What scale_vaapi does with out_range=full, without the filter graph around it
+        VAProcPipelineParameterBuffer params = {};
+        params.surface = (VASurfaceID)(uintptr_t)mapped_frames[outputIndex]->data[3];
+        params.surface_color_standard = VAProcColorStandardNone;
+        params.output_color_standard = VAProcColorStandardBT709;
+        params.output_background_color = 0xff000000;
+        params.filter_flags = VA_FRAME_PICTURE;
+        params.input_color_properties.color_range = VA_SOURCE_RANGE_FULL;
+        params.output_color_properties.color_range = VA_SOURCE_RANGE_FULL;
+
+        VABufferID buffer;
+        VAStatus status = vaCreateBuffer(
+            display,
+            vpp_context,
+            VAProcPipelineParameterBufferType,
+            sizeof(params),
+            1,
+            &params,
+            &buffer
+        );
+        if (status != VA_STATUS_SUCCESS) {
+            throw MakeException("vaCreateBuffer failed: %s", vaErrorStr(status));
+        }
+        status = vaBeginPicture(display, vpp_context, output);
+        if (status == VA_STATUS_SUCCESS) {
+            status = vaRenderPicture(display, vpp_context, &buffer, 1);
+            VAStatus end_status = vaEndPicture(display, vpp_context);
+            if (status == VA_STATUS_SUCCESS) {
+                status = end_status;
+            }
+        }
+        vaDestroyBuffer(display, buffer);
+        if (status != VA_STATUS_SUCCESS) {
+            throw MakeException("Video processing failed: %s", vaErrorStr(status));
+        }
+    } else {
+        err = av_buffersrc_add_frame_flags(
+            filter_in,
+            mapped_frames[outputIndex],
+            AV_BUFFERSRC_FLAG_PUSH | AV_BUFFERSRC_FLAG_KEEP_REF
+        );
+        if (err != 0) {
+            throw alvr::AvException("av_buffersrc_add_frame failed", err);
+        }
+        err = av_buffersink_get_frame(filter_out, encoder_frame);
+        if (err != 0) {
+            throw alvr::AvException("av_buffersink_get_frame failed", err);
+        }
     }
-    err = av_buffersink_get_frame(filter_out, encoder_frame);
-    if (err != 0) {
-        throw alvr::AvException("av_buffersink_get_frame failed", err);
+
+    // Make sure the conversion is done reading mapped_frame, so the Renderer can reuse the output
+    // image as soon as we return
+    VAStatus status = vaSyncSurface(display, (VASurfaceID)(uintptr_t)encoder_frame->data[3]);
+    if (status != VA_STATUS_SUCCESS) {
+        throw MakeException("vaSyncSurface failed: %s", vaErrorStr(status));
     }
+    send_encoder_frame(targetTimestampNs, idr);
+}
 
+void alvr::EncodePipelineVAAPI::send_encoder_frame(uint64_t targetTimestampNs, bool idr) {
     encoder_frame->pict_type = idr ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
     encoder_frame->pts = targetTimestampNs;
+    if (Settings_Instance()->m_foveatedQpOffset > 0
+        && Settings_Instance()->m_codec != ALVR_CODEC_AV1) {
+        add_foveation_regions(encoder_frame, m_foveationCenter);
+    }
 
-    if ((err = avcodec_send_frame(encoder_ctx, encoder_frame)) < 0) {
+    AVFrame* frame = encoder_frame;
+    int err;
+    if (qsv) {
+        // Also copies the properties of the frame
+        qsv_frame->format = AV_PIX_FMT_QSV;
+        qsv_frame->hw_frames_ctx = av_buffer_ref(encoder_ctx->hw_frames_ctx);
+        if ((err = av_hwframe_map(qsv_frame, encoder_frame, 0)) < 0) {
+            throw alvr::AvException("Failed to map the frame to QSV:", err);
+        }
+        frame = qsv_frame;
+    }
+
+    err = avcodec_send_frame(encoder_ctx, frame);
+    if (err < 0) {
         throw alvr::AvException("avcodec_send_frame failed: ", err);
     }
+    if (qsv) {
+        av_frame_unref(qsv_frame);
+    }
     av_frame_unref(encoder_frame);
 }
 
+void alvr::EncodePipelineVAAPI::PrepareFrame(uint32_t outputIndex) {
+    if (shader_conversion()) {
+        rgbtonv12[outputIndex]->Convert(r->GetOutput(outputIndex).semaphoreValue);
+    }
+}
+
+void alvr::EncodePipelineVAAPI::DropFrame(uint32_t outputIndex) {
+    // Waits for the conversion, so that the next PrepareFrame of the output can convert again
+    if (!rgbtonv12.empty()) {
+        uint8_t* planes[2];
+        int linesizes[2];
+        rgbtonv12[outputIndex]->Sync(planes, linesizes);
+    }
+}
+
+void alvr::EncodePipelineVAAPI::GetStageTimings(std::vector<Renderer::StageTiming>& timings) {
+    if (last_converter && shader_conversion()) {
+        timings.push_back({ "rgbtonv12", last_converter->GetDuration() });
+    }
+}
+
 void alvr::EncodePipelineVAAPI::SetParams(FfiDynamicEncoderParams params) {
     if (!params.updated) {
         return;
     }
+
+    uint32_t width = ScaleEncodingSize(nominal_width, params.resolution_scale);
+    uint32_t height = ScaleEncodingSize(nominal_height, params.resolution_scale);
+    if (params.resolution_scale > 0
+        && (int(width) != encoder_ctx->width || int(height) != encoder_ctx->height)) {
+        Info("VAAPI: encoding resolution changed to %ux%u", width, height);
+        // The new encoder starts with an IDR carrying the new parameter sets
+        free_conversion();
+        avcodec_free_context(&encoder_ctx);
+        open_encoder(width, height);
+        init_conversion(width, height);
+    }
     encoder_ctx->bit_rate = params.bitrate_bps;
     encoder_ctx->framerate = AVRational { int(params.framerate * 1000), 1000 };
-    encoder_ctx->rc_buffer_size = encoder_ctx->bit_rate / params.framerate;
+    encoder_ctx->rc_buffer_size
+        = CapToMaxFrameSize(params.max_frame_bytes, encoder_ctx->bit_rate / params.framerate);
     encoder_ctx->rc_max_rate = encoder_ctx->bit_rate;
     encoder_ctx->rc_initial_buffer_occupancy = encoder_ctx->rc_buffer_size;
 
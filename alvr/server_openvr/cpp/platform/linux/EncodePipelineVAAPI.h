@@ -1,6 +1,7 @@
 #pragma once
 
 #include "EncodePipeline.h"
+#include <va/va.h>
 
 extern "C" struct AVBufferRef;
 extern "C" struct AVCodecContext;
@@ -8,6 +9,7 @@ extern "C" struct AVFilterContext;
 extern "C" struct AVFilterGraph;
 extern "C" struct AVFrame;
 
+class FormatConverter;
 class Renderer;
 
 namespace alvr {
@@ -21,22 +23,76 @@ enum EncoderQualityPreset { QUALITY = 0, BALANCED = 1, SPEED = 2 };
 class EncodePipelineVAAPI : public EncodePipeline {
 public:
     ~EncodePipelineVAAPI();
+    // With cross_device, vk_ctx is another GPU than the one of render, the outputs are mapped
+    // from their dma-bufs rather than imported from surfaces of vk_ctx. With qsv, the VA
+    // surfaces are encoded by the oneVPL encoders of libavcodec instead, for Intel GPUs.
     EncodePipelineVAAPI(
-        Renderer* render, VkContext& vk_ctx, VkFrame& input_frame, uint32_t width, uint32_t height
+        Renderer* render,
+        VkContext& vk_ctx,
+        const std::vector<std::unique_ptr<VkFrame>>& input_frames,
+        uint32_t width,
+        uint32_t height,
+        bool cross_device = false,
+        bool qsv = false
     );
 
-    void PushFrame(uint64_t targetTimestampNs, bool idr) override;
+    void PushFrame(uint32_t outputIndex, uint64_t targetTimestampNs, bool idr) override;
+    // Start and wait for the shader conversion, when it is used
+    void PrepareFrame(uint32_t outputIndex) override;
+    void DropFrame(uint32_t outputIndex) override;
+    void GetStageTimings(std::vector<Renderer::StageTiming>& timings) override;
     void SetParams(FfiDynamicEncoderParams params) override;
 
+    // Whether the driver reads images of a DRM format and modifier, probed by allocating small
+    // surfaces with them. Empty if the driver ignores modifier lists or if the pipeline imports
+    // images it allocates into the Renderer instead.
+    static Renderer::ModifierFilter ImportableModifierFilter(VkContext& vk_ctx);
+
 private:
+    // Prefers the low power entrypoint if the driver has one for the profile
+    void open_encoder(uint32_t width, uint32_t height, bool low_power = true);
+    void set_qsv_options();
+    // The VA pool of the encoder frames, which the QSV frames are derived from
+    AVBufferRef* va_frames_ctx();
+    // Sets up the conversion of the mapped frames to encoder frames of the encoder size
+    void init_conversion(uint32_t width, uint32_t height);
+    void free_conversion();
+    bool init_vpp();
+    void init_filter_graph(uint32_t width, uint32_t height);
+    // Allocates the NV12 surfaces the Renderer outputs are converted into by the shader
+    bool init_shader_conversion();
+    // Whether the frames of the current encoder size go through the shader conversion
+    bool shader_conversion() const;
+    void send_encoder_frame(uint64_t targetTimestampNs, bool idr);
+
     Renderer* r = nullptr;
+    // Encoding size at creation, dynamic resolution changes only scale it down
+    uint32_t nominal_width;
+    uint32_t nominal_height;
+    bool amd;
+    bool intel;
+    bool qsv;
     AVBufferRef* hw_ctx = nullptr;
     AVBufferRef* drm_ctx = nullptr;
-    AVFrame* mapped_frame = nullptr;
+    // With qsv, derived from hw_ctx and from va_frames
+    AVBufferRef* qsv_ctx = nullptr;
+    AVBufferRef* va_frames = nullptr;
+    AVFrame* qsv_frame = nullptr;
+    // One per Renderer output
+    std::vector<AVFrame*> mapped_frames;
     AVFrame* encoder_frame = nullptr;
     AVFilterGraph* filter_graph = nullptr;
     AVFilterContext* filter_in = nullptr;
     AVFilterContext* filter_out = nullptr;
+    // Converts the mapped frames straight into encoder surfaces when there is nothing to scale,
+    // instead of going through the filter graph. VA_INVALID_ID when the filter graph is used.
+    VAConfigID vpp_config = VA_INVALID_ID;
+    VAContextID vpp_context = VA_INVALID_ID;
+    // With linux_vaapi_shader_conversion, one NV12 surface and converter per Renderer output,
+    // used instead of the video processing blit at the nominal size
+    std::vector<AVFrame*> nv12_frames;
+    std::vector<FormatConverter*> rgbtonv12;
+    FormatConverter* last_converter = nullptr;
 
     union vlVaQualityBits {
         unsigned int quality;
@@ -0,0 +1,261 @@
+#include "EncodePipelineVulkan.h"
+#include "ALVR-common/packet_types.h"
+#include "alvr_server/Logger.h"
+#include "alvr_server/Profiling.h"
+#include "alvr_server/bindings.h"
+#include "ffmpeg_helper.h"
+#include <sstream>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavfilter/avfilter.h>
+#include <libavfilter/buffersink.h>
+#include <libavfilter/buffersrc.h>
+#include <libavutil/hwcontext.h>
+#include <libavutil/hwcontext_vulkan.h>
+#include <libavutil/opt.h>
+}
+
+namespace {
+
+const char* encoder(ALVR_CODEC codec) {
+    switch (codec) {
+    case ALVR_CODEC_H264:
+        return "h264_vulkan";
+    case ALVR_CODEC_HEVC:
+        return "hevc_vulkan";
+    case ALVR_CODEC_AV1:
+        return "av1_vulkan";
+    }
+    throw std::runtime_error("invalid codec " + std::to_string(codec));
+}
+
+} // namespace
+
+alvr::EncodePipelineVulkan::EncodePipelineVulkan(
+    Renderer* render,
+    VkContext& vk_ctx,
+    const std::vector<std::unique_ptr<VkFrame>>& input_frames,
+    VkImageCreateInfo& image_create_info,
+    uint32_t width,
+    uint32_t height
+)
+    : r(render) {
+    /* Vulkan Video encoding pipeline
+     * Everything runs on the Renderer's VkDevice, so there is no interop or memory mapping:
+     * - input vulkan frames wrap the Renderer outputs
+     * - scale_vulkan converts them to a YUV format on the compute queue
+     * - the encoder consumes the converted frames on the video encode queue
+     * The frames are chained with timeline semaphores, nothing waits on the CPU before
+     * GetEncoded.
+     */
+    if (vk_ctx.encodeQueueFamilyIndex == VK_QUEUE_FAMILY_IGNORED) {
+        throw std::runtime_error("Vulkan device has no video encode queue");
+    }
+
+    vk_frame_ctx = std::make_unique<alvr::VkFrameCtx>(vk_ctx, image_create_info);
+    for (const auto& input_frame : input_frames) {
+        vk_frames.push_back(input_frame->make_av_frame(*vk_frame_ctx));
+    }
+
+    const auto* settings = Settings_Instance();
+
+    auto codec_id = ALVR_CODEC(settings->m_codec);
+    const char* encoder_name = encoder(codec_id);
+    const AVCodec* codec = avcodec_find_encoder_by_name(encoder_name);
+    if (codec == nullptr) {
+        throw std::runtime_error(std::string("Failed to find encoder ") + encoder_name);
+    }
+
+    bool use_10bit = (codec_id == ALVR_CODEC_HEVC || codec_id == ALVR_CODEC_AV1)
+        && settings->m_use10bitEncoder;
+
+    int err;
+    filter_graph = avfilter_graph_alloc();
+
+    AVFilterInOut* outputs = avfilter_inout_alloc();
+    AVFilterInOut* inputs = avfilter_inout_alloc();
+
+    std::stringstream buffer_filter_args;
+    buffer_filter_args << "video_size=" << image_create_info.extent.width << "x"
+                       << image_create_info.extent.height;
+    buffer_filter_args << ":time_base=1/" << (int)1e9;
+    filter_in = avfilter_graph_alloc_filter(filter_graph, avfilter_get_by_name("buffer"), "in");
+    if (!filter_in) {
+        throw std::runtime_error("filter_in allocation failed");
+    }
+    AVBufferSrcParameters* par = av_buffersrc_parameters_alloc();
+    par->format = AV_PIX_FMT_VULKAN;
+    par->hw_frames_ctx = av_buffer_ref(vk_frame_ctx->ctx);
+    av_buffersrc_parameters_set(filter_in, par);
+    av_free(par);
+    if ((err = avfilter_init_str(filter_in, buffer_filter_args.str().c_str()))) {
+        throw alvr::AvException("filter_in creation failed:", err);
+    }
+
+    if ((err = avfilter_graph_create_filter(
+             &filter_out, avfilter_get_by_name("buffersink"), "out", NULL, NULL, filter_graph
+         ))) {
+        throw alvr::AvException("filter_out creation failed:", err);
+    }
+
+    outputs->name = av_strdup("in");
+    outputs->filter_ctx = filter_in;
+    outputs->pad_idx = 0;
+    outputs->next = NULL;
+
+    inputs->name = av_strdup("out");
+    inputs->filter_ctx = filter_out;
+    inputs->pad_idx = 0;
+    inputs->next = NULL;
+
+    std::string filters = "scale_vulkan=out_range=full:format=";
+    filters += use_10bit ? "p010" : "nv12";
+    if ((err = avfilter_graph_parse_ptr(filter_graph, filters.c_str(), &inputs, &outputs, NULL))
+        < 0) {
+        throw alvr::AvException("avfilter_graph_parse_ptr failed:", err);
+    }
+
+    avfilter_inout_free(&outputs);
+    avfilter_inout_free(&inputs);
+
+    for (unsigned i = 0; i < filter_graph->nb_filters; ++i) {
+        filter_graph->filters[i]->hw_device_ctx = av_buffer_ref(vk_ctx.ctx);
+    }
+
+    if ((err = avfilter_graph_config(filter_graph, NULL))) {
+        throw alvr::AvException("avfilter_graph_config failed:", err);
+    }
+
+    encoder_ctx = avcodec_alloc_context3(codec);
+    if (not encoder_ctx) {
+        throw std::runtime_error("failed to allocate Vulkan encoder");
+    }
+
+    switch (codec_id) {
+    case ALVR_CODEC_H264:
+        switch (settings->m_h264Profile) {
+        case ALVR_H264_PROFILE_BASELINE:
+            encoder_ctx->profile = AV_PROFILE_H264_CONSTRAINED_BASELINE;
+            break;
+        case ALVR_H264_PROFILE_MAIN:
+            encoder_ctx->profile = AV_PROFILE_H264_MAIN;
+            break;
+        default:
+        case ALVR_H264_PROFILE_HIGH:
+            encoder_ctx->profile = AV_PROFILE_H264_HIGH;
+            break;
+        }
+
+        switch (settings->m_entropyCoding) {
+        case ALVR_CABAC:
+            av_opt_set(encoder_ctx->priv_data, "coder", "cabac", 0);
+            break;
+        case ALVR_CAVLC:
+            av_opt_set(encoder_ctx->priv_data, "coder", "vlc", 0);
+            break;
+        }
+        break;
+    case ALVR_CODEC_HEVC:
+        encoder_ctx->profile = use_10bit ? AV_PROFILE_HEVC_MAIN_10 : AV_PROFILE_HEVC_MAIN;
+        break;
+    case ALVR_CODEC_AV1:
+        encoder_ctx->profile = AV_PROFILE_AV1_MAIN;
+        break;
+    }
+
+    switch (settings->m_rateControlMode) {
+    case ALVR_VBR:
+        av_opt_set(encoder_ctx->priv_data, "rc_mode", "vbr", 0);
+        break;
+    case ALVR_CBR:
+    default:
+        av_opt_set(encoder_ctx->priv_data, "rc_mode", "cbr", 0);
+        break;
+    }
+
+    av_opt_set(encoder_ctx->priv_data, "tune", "ull", 0);
+    av_opt_set(encoder_ctx->priv_data, "usage", "stream", 0);
+    av_opt_set(encoder_ctx->priv_data, "content", "rendered", 0);
+    av_opt_set_int(encoder_ctx->priv_data, "async_depth", 1, 0);
+
+    encoder_ctx->width = width;
+    encoder_ctx->height = height;
+    encoder_ctx->time_base = { 1, (int)1e9 };
+    encoder_ctx->framerate = AVRational { settings->m_refreshRate, 1 };
+    encoder_ctx->sample_aspect_ratio = AVRational { 1, 1 };
+    encoder_ctx->pix_fmt = AV_PIX_FMT_VULKAN;
+    encoder_ctx->max_b_frames = 0;
+    encoder_ctx->gop_size = INT16_MAX;
+    encoder_ctx->color_range = AVCOL_RANGE_JPEG;
+    encoder_ctx->hw_frames_ctx = av_buffer_ref(av_buffersink_get_hw_frames_ctx(filter_out));
+
+    auto params = FfiDynamicEncoderParams {};
+    params.updated = true;
+    params.bitrate_bps = 30'000'000;
+    params.framerate = settings->m_refreshRate;
+    SetParams(params);
+
+    err = avcodec_open2(encoder_ctx, codec, NULL);
+    if (err < 0) {
+        throw alvr::AvException("Cannot open video encoder codec:", err);
+    }
+
+    encoder_frame = av_frame_alloc();
+}
+
+alvr::EncodePipelineVulkan::~EncodePipelineVulkan() {
+    avfilter_graph_free(&filter_graph);
+    av_frame_free(&encoder_frame);
+}
+
+void alvr::EncodePipelineVulkan::PushFrame(
+    uint32_t outputIndex, uint64_t targetTimestampNs, bool idr
+) {
+    ALVR_PROFILE_ZONE("EncodePipelineVulkan::PushFrame");
+    AVFrame* vk_frame = vk_frames[outputIndex].get();
+    AVVkFrame* vkf = reinterpret_cast<AVVkFrame*>(vk_frame->data[0]);
+    vkf->sem_value[0]++;
+
+    const Renderer::Output& output = r->GetOutput(outputIndex);
+
+    // Chain the Renderer semaphore into the frame semaphore that scale_vulkan waits on
+    // The batch has no commands, the signal only has to follow the wait
+    VkSemaphoreSubmitInfo waitInfo = {};
+    waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO;
+    waitInfo.semaphore = output.semaphore;
+    waitInfo.value = output.semaphoreValue;
+    waitInfo.stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT;
+    VkSemaphoreSubmitInfo signalInfo = {};
+    signalInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO;
+    signalInfo.semaphore = vkf->sem[0];
+    signalInfo.value = vkf->sem_value[0];
+    signalInfo.stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT;
+
+    VkSubmitInfo2 submitInfo = {};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO_2;
+    submitInfo.waitSemaphoreInfoCount = 1;
+    submitInfo.pWaitSemaphoreInfos = &waitInfo;
+    submitInfo.signalSemaphoreInfoCount = 1;
+    submitInfo.pSignalSemaphoreInfos = &signalInfo;
+    r->QueueSubmit(submitInfo, VK_NULL_HANDLE);
+
+    int err = av_buffersrc_add_frame_flags(
+        filter_in, vk_frame, AV_BUFFERSRC_FLAG_PUSH | AV_BUFFERSRC_FLAG_KEEP_REF
+    );
+    if (err != 0) {
+        throw alvr::AvException("av_buffersrc_add_frame failed", err);
+    }
+    err = av_buffersink_get_frame(filter_out, encoder_frame);
+    if (err != 0) {
+        throw alvr::AvException("av_buffersink_get_frame failed", err);
+    }
+
+    encoder_frame->pict_type = idr ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+    encoder_frame->pts = targetTimestampNs;
+
+    if ((err = avcodec_send_frame(encoder_ctx, encoder_frame)) < 0) {
+        throw alvr::AvException("avcodec_send_frame failed: ", err);
+    }
+    av_frame_unref(encoder_frame);
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "EncodePipeline.h"
+#include <functional>
+#include <memory>
+
+extern "C" struct AVCodecContext;
+extern "C" struct AVFilterContext;
+extern "C" struct AVFilterGraph;
+extern "C" struct AVFrame;
+
+class Renderer;
+
+namespace alvr {
+
+class EncodePipelineVulkan : public EncodePipeline {
+public:
+    ~EncodePipelineVulkan();
+    EncodePipelineVulkan(
+        Renderer* render,
+        VkContext& vk_ctx,
+        const std::vector<std::unique_ptr<VkFrame>>& input_frames,
+        VkImageCreateInfo& image_create_info,
+        uint32_t width,
+        uint32_t height
+    );
+
+    void PushFrame(uint32_t outputIndex, uint64_t targetTimestampNs, bool idr) override;
+
+private:
+    Renderer* r = nullptr;
+    std::unique_ptr<alvr::VkFrameCtx> vk_frame_ctx;
+    // One per Renderer output
+    std::vector<std::unique_ptr<AVFrame, std::function<void(AVFrame*)>>> vk_frames;
+    AVFrame* encoder_frame = nullptr;
+    AVFilterGraph* filter_graph = nullptr;
+    AVFilterContext* filter_in = nullptr;
+    AVFilterContext* filter_out = nullptr;
+};
+}
@@ -1,18 +1,54 @@
 #include "FormatConverter.h"
+#include "alvr_server/GpuMemory.h"
+#include "alvr_server/NumaPlacement.h"
 #include "alvr_server/bindings.h"
 
+#include <algorithm>
+#include <cstdlib>
+#include <stdexcept>
+#include <unistd.h>
+
+namespace {
+
+// x264 reads the planes with 64 byte aligned loads at its fastest
+const VkDeviceSize X264_ALIGNMENT = 64;
+
+VkDeviceSize alignUp(VkDeviceSize value, VkDeviceSize alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+// The 10 bit Renderer outputs, read by variants of the shaders
+bool isTenBit(const VkImageCreateInfo& imageInfo) {
+    return imageInfo.format == VK_FORMAT_A2B10G10R10_UNORM_PACK32;
+}
+
+} // namespace
+
 FormatConverter::FormatConverter(Renderer* render)
     : r(render) { }
 
 FormatConverter::~FormatConverter() {
+    if (m_pending) {
+        vkWaitForFences(r->m_dev, 1, &m_fence, VK_TRUE, UINT64_MAX);
+    }
+
     for (const OutputImage& image : m_images) {
-        vkUnmapMemory(r->m_dev, image.memory);
+        if (image.buffer != VK_NULL_HANDLE) {
+            vkDestroyBuffer(r->m_dev, image.buffer, nullptr);
+            vkFreeMemory(r->m_dev, image.memory, nullptr);
+            // Only once the imported memory is freed
+            std::free(image.mapped);
+            continue;
+        }
+        if (image.mapped) {
+            vkUnmapMemory(r->m_dev, image.memory);
+        }
         vkDestroyImageView(r->m_dev, image.view, nullptr);
         vkDestroyImage(r->m_dev, image.image, nullptr);
+        UntrackGpuMemory(image.memory);
         vkFreeMemory(r->m_dev, image.memory, nullptr);
     }
-
-    vkDestroySemaphore(r->m_dev, m_output.semaphore, nullptr);
+    vkDestroyFence(r->m_dev, m_fence, nullptr);
 
     vkDestroyQueryPool(r->m_dev, m_queryPool, nullptr);
     vkDestroyDescriptorSetLayout(r->m_dev, m_descriptorLayout, nullptr);
@@ -28,16 +64,26 @@ void FormatConverter::init(
     VkSemaphore semaphore,
     int count,
     const unsigned char* shaderData,
-    unsigned shaderLen
+    unsigned shaderLen,
+    VkExtent2D outputExtent,
+    bool hostBuffers,
+    const DrmImage* importedPlanes,
+    const VkExtent2D* importedExtents
 ) {
+    if (outputExtent.width == 0 || outputExtent.height == 0) {
+        outputExtent.width = imageCreateInfo.extent.width;
+        outputExtent.height = imageCreateInfo.extent.height;
+    }
+
     m_images.resize(count);
     m_semaphore = semaphore;
+    m_hostBuffers = hostBuffers;
 
-    // Timestamp query
+    // Timestamp queries, end then begin
     VkQueryPoolCreateInfo queryPoolInfo = {};
     queryPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
     queryPoolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
-    queryPoolInfo.queryCount = 1;
+    queryPoolInfo.queryCount = 2;
     VK_CHECK(vkCreateQueryPool(r->m_dev, &queryPoolInfo, nullptr, &m_queryPool));
 
     // Command buffer
@@ -48,6 +94,11 @@ void FormatConverter::init(
     commandBufferInfo.commandBufferCount = 1;
     VK_CHECK(vkAllocateCommandBuffers(r->m_dev, &commandBufferInfo, &m_commandBuffer));
 
+    // Fence
+    VkFenceCreateInfo fenceInfo = {};
+    fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    VK_CHECK(vkCreateFence(r->m_dev, &fenceInfo, nullptr, &m_fence));
+
     // Descriptors
     VkDescriptorSetLayoutBinding descriptorBindings[2];
     descriptorBindings[0] = {};
@@ -58,7 +109,8 @@ void FormatConverter::init(
     descriptorBindings[1] = {};
     descriptorBindings[1].binding = 1;
     descriptorBindings[1].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
-    descriptorBindings[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+    descriptorBindings[1].descriptorType
+        = hostBuffers ? VK_DESCRIPTOR_TYPE_STORAGE_BUFFER : VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
     descriptorBindings[1].descriptorCount = count;
 
     VkDescriptorSetLayoutCreateInfo descriptorSetLayoutInfo = {};
@@ -90,12 +142,24 @@ void FormatConverter::init(
 
     // Output images
     for (int i = 0; i < count; ++i) {
+        if (hostBuffers) {
+            // The luma plane, then the chroma planes of half the size
+            VkDeviceSize width = i == 0 ? outputExtent.width : (outputExtent.width + 1) / 2;
+            uint32_t rows = i == 0 ? outputExtent.height : (outputExtent.height + 1) / 2;
+            importHostPlane(m_images[i], alignUp(width, X264_ALIGNMENT), rows);
+            continue;
+        }
+        if (importedPlanes) {
+            importDmaBufPlane(m_images[i], importedPlanes[i], importedExtents[i]);
+            continue;
+        }
+
         VkImageCreateInfo imageInfo = {};
         imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
         imageInfo.imageType = VK_IMAGE_TYPE_2D;
         imageInfo.format = VK_FORMAT_R8_UNORM;
-        imageInfo.extent.width = imageCreateInfo.extent.width;
-        imageInfo.extent.height = imageCreateInfo.extent.height;
+        imageInfo.extent.width = outputExtent.width;
+        imageInfo.extent.height = outputExtent.height;
         imageInfo.extent.depth = 1;
         imageInfo.arrayLayers = 1;
         imageInfo.mipLevels = 1;
@@ -115,6 +179,12 @@ void FormatConverter::init(
             | VK_MEMORY_PROPERTY_HOST_CACHED_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
         memAllocInfo.memoryTypeIndex = r->memoryTypeIndex(memType, memReqs.memoryTypeBits);
         VK_CHECK(vkAllocateMemory(r->m_dev, &memAllocInfo, nullptr, &m_images[i].memory));
+        TrackGpuMemory(
+            m_images[i].memory,
+            "Format converter",
+            GpuMemoryType::HostVisible,
+            memAllocInfo.allocationSize
+        );
         VK_CHECK(vkBindImageMemory(r->m_dev, m_images[i].image, m_images[i].memory, 0));
 
         VkImageViewCreateInfo viewInfo = {};
@@ -134,30 +204,21 @@ void FormatConverter::init(
         viewInfo.components.a = VK_COMPONENT_SWIZZLE_IDENTITY;
         VK_CHECK(vkCreateImageView(r->m_dev, &viewInfo, nullptr, &m_images[i].view));
 
-        VkImageMemoryBarrier imageBarrier = {};
-        imageBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        VkImageMemoryBarrier2 imageBarrier = {};
+        imageBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2;
         imageBarrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
         imageBarrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
         imageBarrier.image = m_images[i].image;
         imageBarrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
         imageBarrier.subresourceRange.layerCount = 1;
         imageBarrier.subresourceRange.levelCount = 1;
-        imageBarrier.srcAccessMask = 0;
-        imageBarrier.dstAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+        imageBarrier.srcStageMask = VK_PIPELINE_STAGE_2_NONE;
+        imageBarrier.srcAccessMask = VK_ACCESS_2_NONE;
+        imageBarrier.dstStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+        imageBarrier.dstAccessMask = VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT;
 
         r->commandBufferBegin();
-        vkCmdPipelineBarrier(
-            r->m_commandBuffer,
-            VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
-            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
-            0,
-            0,
-            nullptr,
-            0,
-            nullptr,
-            1,
-            &imageBarrier
-        );
+        r->PipelineBarrier(r->m_commandBuffer, nullptr, &imageBarrier, 1);
         r->commandBufferSubmit();
 
         VkImageSubresource subresource = {};
@@ -174,12 +235,12 @@ void FormatConverter::init(
             0,
             reinterpret_cast<void**>(&m_images[i].mapped)
         ));
+        // Moves the memory of a GPU-less device, the mapped memory of a GPU stays where it is
+        if (m_numaNode >= 0) {
+            BindMemoryToNumaNode(m_images[i].mapped, memAllocInfo.allocationSize, m_numaNode);
+        }
     }
 
-    VkSemaphoreCreateInfo semInfo = {};
-    semInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
-    VK_CHECK(vkCreateSemaphore(r->m_dev, &semInfo, nullptr, &m_output.semaphore));
-
     // Shader
     VkShaderModuleCreateInfo moduleInfo = {};
     moduleInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
@@ -192,6 +253,14 @@ void FormatConverter::init(
     pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
     pipelineLayoutInfo.setLayoutCount = 1;
     pipelineLayoutInfo.pSetLayouts = &m_descriptorLayout;
+    // The luma and chroma strides of the host planes
+    VkPushConstantRange pushConstantRange = {};
+    pushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    pushConstantRange.size = 2 * sizeof(uint32_t);
+    if (hostBuffers) {
+        pipelineLayoutInfo.pushConstantRangeCount = 1;
+        pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
+    }
     VK_CHECK(vkCreatePipelineLayout(r->m_dev, &pipelineLayoutInfo, nullptr, &m_pipelineLayout));
 
     VkPipelineShaderStageCreateInfo stageInfo = {};
@@ -204,22 +273,202 @@ void FormatConverter::init(
     pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
     pipelineInfo.layout = m_pipelineLayout;
     pipelineInfo.stage = stageInfo;
-    VK_CHECK(vkCreateComputePipelines(r->m_dev, nullptr, 1, &pipelineInfo, nullptr, &m_pipeline));
+    VK_CHECK(vkCreateComputePipelines(
+        r->m_dev, r->m_pipelineCache, 1, &pipelineInfo, nullptr, &m_pipeline
+    ));
+
+    m_groupCountX = (outputExtent.width + 7) / 8;
+    m_groupCountY = (outputExtent.height + 7) / 8;
+}
 
-    m_groupCountX = (imageCreateInfo.extent.width + 7) / 8;
-    m_groupCountY = (imageCreateInfo.extent.height + 7) / 8;
+void FormatConverter::importHostPlane(OutputImage& plane, VkDeviceSize linesize, uint32_t rows) {
+    VkPhysicalDeviceExternalMemoryHostPropertiesEXT hostProps = {};
+    hostProps.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTERNAL_MEMORY_HOST_PROPERTIES_EXT;
+    VkPhysicalDeviceProperties2 props = {};
+    props.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+    props.pNext = &hostProps;
+    vkGetPhysicalDeviceProperties2(r->m_physDev, &props);
+
+    // Both the pointer and the size of an import must be aligned
+    VkDeviceSize alignment = std::max(hostProps.minImportedHostPointerAlignment, X264_ALIGNMENT);
+    VkDeviceSize size = alignUp(linesize * rows, alignment);
+    plane.mapped = static_cast<uint8_t*>(std::aligned_alloc(alignment, size));
+    if (!plane.mapped) {
+        throw std::runtime_error("FormatConverter: failed to allocate a host plane");
+    }
+    // Before the import, which may pin the pages where they are
+    if (m_numaNode >= 0) {
+        BindMemoryToNumaNode(plane.mapped, size, m_numaNode);
+    }
+    plane.linesize = linesize;
+
+    VkMemoryHostPointerPropertiesEXT pointerProps = {};
+    pointerProps.sType = VK_STRUCTURE_TYPE_MEMORY_HOST_POINTER_PROPERTIES_EXT;
+    VK_CHECK(r->d.vkGetMemoryHostPointerPropertiesEXT(
+        r->m_dev,
+        VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT,
+        plane.mapped,
+        &pointerProps
+    ));
+
+    VkExternalMemoryBufferCreateInfo externalInfo = {};
+    externalInfo.sType = VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_BUFFER_CREATE_INFO;
+    externalInfo.handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT;
+    VkBufferCreateInfo bufferInfo = {};
+    bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    bufferInfo.pNext = &externalInfo;
+    bufferInfo.size = size;
+    bufferInfo.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+    bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    VK_CHECK(vkCreateBuffer(r->m_dev, &bufferInfo, nullptr, &plane.buffer));
+
+    VkMemoryRequirements memReqs;
+    vkGetBufferMemoryRequirements(r->m_dev, plane.buffer, &memReqs);
+
+    VkImportMemoryHostPointerInfoEXT importInfo = {};
+    importInfo.sType = VK_STRUCTURE_TYPE_IMPORT_MEMORY_HOST_POINTER_INFO_EXT;
+    importInfo.handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT;
+    importInfo.pHostPointer = plane.mapped;
+    VkMemoryAllocateInfo memAllocInfo = {};
+    memAllocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    memAllocInfo.pNext = &importInfo;
+    memAllocInfo.allocationSize = size;
+    // Coherent, so that Sync needs no invalidation before x264 reads the plane
+    memAllocInfo.memoryTypeIndex = r->memoryTypeIndex(
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+        memReqs.memoryTypeBits & pointerProps.memoryTypeBits
+    );
+    if (memAllocInfo.memoryTypeIndex == 0xFFFFFFFF) {
+        vkDestroyBuffer(r->m_dev, plane.buffer, nullptr);
+        plane.buffer = VK_NULL_HANDLE;
+        std::free(plane.mapped);
+        plane.mapped = nullptr;
+        throw std::runtime_error("FormatConverter: no coherent memory type for host planes");
+    }
+    VK_CHECK(vkAllocateMemory(r->m_dev, &memAllocInfo, nullptr, &plane.memory));
+    VK_CHECK(vkBindBufferMemory(r->m_dev, plane.buffer, plane.memory, 0));
+}
+
+void FormatConverter::importDmaBufPlane(
+    OutputImage& plane, const DrmImage& drm, VkExtent2D extent
+) {
+    VkSubresourceLayout layout = {};
+    layout.offset = drm.offsets[0];
+    layout.rowPitch = drm.strides[0];
+    VkImageDrmFormatModifierExplicitCreateInfoEXT modifierInfo = {};
+    modifierInfo.sType = VK_STRUCTURE_TYPE_IMAGE_DRM_FORMAT_MODIFIER_EXPLICIT_CREATE_INFO_EXT;
+    modifierInfo.drmFormatModifier = drm.modifier;
+    modifierInfo.drmFormatModifierPlaneCount = 1;
+    modifierInfo.pPlaneLayouts = &layout;
+
+    VkExternalMemoryImageCreateInfo extMemImageInfo = {};
+    extMemImageInfo.sType = VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_IMAGE_CREATE_INFO;
+    extMemImageInfo.pNext = &modifierInfo;
+    extMemImageInfo.handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT;
+
+    VkImageCreateInfo imageInfo = {};
+    imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    imageInfo.pNext = &extMemImageInfo;
+    imageInfo.imageType = VK_IMAGE_TYPE_2D;
+    imageInfo.format = VK_FORMAT_R8_UNORM;
+    imageInfo.extent.width = extent.width;
+    imageInfo.extent.height = extent.height;
+    imageInfo.extent.depth = 1;
+    imageInfo.arrayLayers = 1;
+    imageInfo.mipLevels = 1;
+    imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+    imageInfo.tiling = VK_IMAGE_TILING_DRM_FORMAT_MODIFIER_EXT;
+    imageInfo.usage = VK_IMAGE_USAGE_STORAGE_BIT;
+    VK_CHECK(vkCreateImage(r->m_dev, &imageInfo, nullptr, &plane.image));
+
+    VkMemoryFdPropertiesKHR fdProps = {};
+    fdProps.sType = VK_STRUCTURE_TYPE_MEMORY_FD_PROPERTIES_KHR;
+    VK_CHECK(r->d.vkGetMemoryFdPropertiesKHR(
+        r->m_dev, VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT, drm.fd, &fdProps
+    ));
+
+    VkMemoryRequirements memReqs;
+    vkGetImageMemoryRequirements(r->m_dev, plane.image, &memReqs);
+
+    VkMemoryDedicatedAllocateInfo dedicatedMemInfo = {};
+    dedicatedMemInfo.sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_ALLOCATE_INFO;
+    dedicatedMemInfo.image = plane.image;
+    VkImportMemoryFdInfoKHR importMemInfo = {};
+    importMemInfo.sType = VK_STRUCTURE_TYPE_IMPORT_MEMORY_FD_INFO_KHR;
+    importMemInfo.pNext = &dedicatedMemInfo;
+    importMemInfo.handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT;
+    VkMemoryAllocateInfo memAllocInfo = {};
+    memAllocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    memAllocInfo.pNext = &importMemInfo;
+    memAllocInfo.allocationSize = memReqs.size;
+    memAllocInfo.memoryTypeIndex = r->memoryTypeIndex(
+        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, memReqs.memoryTypeBits & fdProps.memoryTypeBits
+    );
+
+    // The layers of a surface share one object, each import holds its own fd to it
+    int fd = dup(drm.fd);
+    if (fd < 0) {
+        throw std::runtime_error("FormatConverter: failed to duplicate a dma-buf fd");
+    }
+    importMemInfo.fd = fd;
+    // The allocation owns the fd only once it succeeds
+    VkResult result = vkAllocateMemory(r->m_dev, &memAllocInfo, nullptr, &plane.memory);
+    if (result != VK_SUCCESS) {
+        close(fd);
+        VK_CHECK(result);
+    }
+    // The encoder allocated the surface, its pool is accounted for by the encoder
+    TrackGpuMemory(
+        plane.memory, "Format converter", GpuMemoryType::Imported, memAllocInfo.allocationSize
+    );
+    VK_CHECK(vkBindImageMemory(r->m_dev, plane.image, plane.memory, 0));
+
+    VkImageViewCreateInfo viewInfo = {};
+    viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+    viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+    viewInfo.format = imageInfo.format;
+    viewInfo.image = plane.image;
+    viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    viewInfo.subresourceRange.levelCount = 1;
+    viewInfo.subresourceRange.layerCount = 1;
+    VK_CHECK(vkCreateImageView(r->m_dev, &viewInfo, nullptr, &plane.view));
+
+    VkImageMemoryBarrier2 imageBarrier = {};
+    imageBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2;
+    imageBarrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    imageBarrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+    imageBarrier.image = plane.image;
+    imageBarrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    imageBarrier.subresourceRange.layerCount = 1;
+    imageBarrier.subresourceRange.levelCount = 1;
+    imageBarrier.srcStageMask = VK_PIPELINE_STAGE_2_NONE;
+    imageBarrier.srcAccessMask = VK_ACCESS_2_NONE;
+    imageBarrier.dstStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+    imageBarrier.dstAccessMask = VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT;
+
+    r->commandBufferBegin();
+    r->PipelineBarrier(r->m_commandBuffer, nullptr, &imageBarrier, 1);
+    r->commandBufferSubmit();
 }
 
-void FormatConverter::Convert(uint8_t** data, int* linesize) {
+void FormatConverter::Convert(uint64_t waitValue) {
+    if (m_pending) {
+        throw std::runtime_error("FormatConverter: Convert called with a conversion in flight");
+    }
+
     VkCommandBufferBeginInfo commandBufferBegin = {};
     commandBufferBegin.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
     VK_CHECK(vkBeginCommandBuffer(m_commandBuffer, &commandBufferBegin));
 
-    vkCmdResetQueryPool(m_commandBuffer, m_queryPool, 0, 1);
+    vkCmdResetQueryPool(m_commandBuffer, m_queryPool, 0, 2);
+    vkCmdWriteTimestamp(m_commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, m_queryPool, 1);
 
     vkCmdBindPipeline(m_commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, m_pipeline);
 
-    std::vector<VkWriteDescriptorSet> descriptorWriteSets;
+    // The input and up to three planes
+    VkWriteDescriptorSet descriptorWriteSets[4];
+    uint32_t descriptorWriteCount = 0;
 
     VkDescriptorImageInfo descriptorImageInfoIn = {};
     descriptorImageInfoIn.imageView = m_view;
@@ -231,18 +480,28 @@ void FormatConverter::Convert(uint8_t** data, int* linesize) {
     descriptorWriteSet.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
     descriptorWriteSet.pImageInfo = &descriptorImageInfoIn;
     descriptorWriteSet.dstBinding = 0;
-    descriptorWriteSets.push_back(descriptorWriteSet);
+    descriptorWriteSets[descriptorWriteCount++] = descriptorWriteSet;
 
     VkDescriptorImageInfo descriptorImageInfoOuts[3] = {};
+    VkDescriptorBufferInfo descriptorBufferInfoOuts[3] = {};
     for (size_t i = 0; i < m_images.size(); ++i) {
-        descriptorImageInfoOuts[i].imageView = m_images[i].view;
-        descriptorImageInfoOuts[i].imageLayout = VK_IMAGE_LAYOUT_GENERAL;
-
-        descriptorWriteSet.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
-        descriptorWriteSet.pImageInfo = &descriptorImageInfoOuts[i];
         descriptorWriteSet.dstBinding = 1;
         descriptorWriteSet.dstArrayElement = i;
-        descriptorWriteSets.push_back(descriptorWriteSet);
+        if (m_hostBuffers) {
+            descriptorBufferInfoOuts[i].buffer = m_images[i].buffer;
+            descriptorBufferInfoOuts[i].range = VK_WHOLE_SIZE;
+
+            descriptorWriteSet.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+            descriptorWriteSet.pImageInfo = nullptr;
+            descriptorWriteSet.pBufferInfo = &descriptorBufferInfoOuts[i];
+        } else {
+            descriptorImageInfoOuts[i].imageView = m_images[i].view;
+            descriptorImageInfoOuts[i].imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+
+            descriptorWriteSet.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+            descriptorWriteSet.pImageInfo = &descriptorImageInfoOuts[i];
+        }
+        descriptorWriteSets[descriptorWriteCount++] = descriptorWriteSet;
     }
 
     r->d.vkCmdPushDescriptorSetKHR(
@@ -250,28 +509,64 @@ void FormatConverter::Convert(uint8_t** data, int* linesize) {
         VK_PIPELINE_BIND_POINT_COMPUTE,
         m_pipelineLayout,
         0,
-        descriptorWriteSets.size(),
-        descriptorWriteSets.data()
+        descriptorWriteCount,
+        descriptorWriteSets
     );
 
+    if (m_hostBuffers) {
+        const uint32_t strides[2]
+            = { (uint32_t)m_images[0].linesize, (uint32_t)m_images[1].linesize };
+        vkCmdPushConstants(
+            m_commandBuffer,
+            m_pipelineLayout,
+            VK_SHADER_STAGE_COMPUTE_BIT,
+            0,
+            sizeof(strides),
+            strides
+        );
+    }
+
     vkCmdDispatch(m_commandBuffer, m_groupCountX, m_groupCountY, 1);
 
+    // Sync reads the mapped images once the fence is signaled
+    VkMemoryBarrier2 hostBarrier = {};
+    hostBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER_2;
+    hostBarrier.srcStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+    hostBarrier.srcAccessMask = VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT;
+    hostBarrier.dstStageMask = VK_PIPELINE_STAGE_2_HOST_BIT;
+    hostBarrier.dstAccessMask = VK_ACCESS_2_HOST_READ_BIT;
+    r->PipelineBarrier(m_commandBuffer, &hostBarrier, nullptr, 0);
+
     vkCmdWriteTimestamp(m_commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, m_queryPool, 0);
 
     vkEndCommandBuffer(m_commandBuffer);
 
-    VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+    VkSemaphoreSubmitInfo waitInfo = {};
+    waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO;
+    waitInfo.semaphore = m_semaphore;
+    waitInfo.value = waitValue;
+    waitInfo.stageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+
+    VkCommandBufferSubmitInfo commandBufferInfo = {};
+    commandBufferInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO;
+    commandBufferInfo.commandBuffer = m_commandBuffer;
+
+    VkSubmitInfo2 submitInfo = {};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO_2;
+    submitInfo.waitSemaphoreInfoCount = 1;
+    submitInfo.pWaitSemaphoreInfos = &waitInfo;
+    submitInfo.commandBufferInfoCount = 1;
+    submitInfo.pCommandBufferInfos = &commandBufferInfo;
+    r->QueueSubmit(submitInfo, m_fence);
+    m_pending = true;
+}
 
-    VkSubmitInfo submitInfo = {};
-    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-    submitInfo.waitSemaphoreCount = 1;
-    submitInfo.pWaitSemaphores = &m_semaphore;
-    submitInfo.pWaitDstStageMask = &waitStage;
-    submitInfo.signalSemaphoreCount = 1;
-    submitInfo.pSignalSemaphores = &m_output.semaphore;
-    submitInfo.commandBufferCount = 1;
-    submitInfo.pCommandBuffers = &m_commandBuffer;
-    VK_CHECK(vkQueueSubmit(r->m_queue, 1, &submitInfo, nullptr));
+void FormatConverter::Sync(uint8_t** data, int* linesize) {
+    if (m_pending) {
+        VK_CHECK(vkWaitForFences(r->m_dev, 1, &m_fence, VK_TRUE, UINT64_MAX));
+        VK_CHECK(vkResetFences(r->m_dev, 1, &m_fence));
+        m_pending = false;
+    }
 
     for (size_t i = 0; i < m_images.size(); ++i) {
         data[i] = m_images[i].mapped;
@@ -279,20 +574,6 @@ void FormatConverter::Convert(uint8_t** data, int* linesize) {
     }
 }
 
-void FormatConverter::Sync() {
-    VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
-
-    VkSubmitInfo submitInfo = {};
-    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-    submitInfo.waitSemaphoreCount = 1;
-    submitInfo.pWaitSemaphores = &m_output.semaphore;
-    submitInfo.pWaitDstStageMask = &waitStage;
-    VK_CHECK(vkQueueSubmit(r->m_queue, 1, &submitInfo, r->m_fence));
-
-    VK_CHECK(vkWaitForFences(r->m_dev, 1, &r->m_fence, VK_TRUE, UINT64_MAX));
-    VK_CHECK(vkResetFences(r->m_dev, 1, &r->m_fence));
-}
-
 uint64_t FormatConverter::GetTimestamp() {
     uint64_t query;
     VK_CHECK(vkGetQueryPoolResults(
@@ -308,16 +589,100 @@ uint64_t FormatConverter::GetTimestamp() {
     return query * r->m_timestampPeriod;
 }
 
+uint64_t FormatConverter::GetDuration() {
+    uint64_t queries[2];
+    VK_CHECK(vkGetQueryPoolResults(
+        r->m_dev,
+        m_queryPool,
+        0,
+        2,
+        sizeof(queries),
+        queries,
+        sizeof(uint64_t),
+        VK_QUERY_RESULT_64_BIT
+    ));
+    return (queries[0] - queries[1]) * r->m_timestampPeriod;
+}
+
 RgbToYuv420::RgbToYuv420(
-    Renderer* render, VkImage image, VkImageCreateInfo imageInfo, VkSemaphore semaphore
+    Renderer* render,
+    VkImage image,
+    VkImageCreateInfo imageInfo,
+    VkSemaphore semaphore,
+    int numaNode
+)
+    : FormatConverter(render) {
+    m_numaNode = numaNode;
+    bool tenBit = isTenBit(imageInfo);
+    // The host planes are only built for 8 bit inputs, which are the ones x264 encodes
+    if (!tenBit && r->d.haveExternalMemoryHost && RGBTOYUV420_HOST_SHADER_COMP_SPV_LEN > 0) {
+        init(
+            image,
+            imageInfo,
+            semaphore,
+            3,
+            RGBTOYUV420_HOST_SHADER_COMP_SPV_PTR,
+            RGBTOYUV420_HOST_SHADER_COMP_SPV_LEN,
+            {},
+            true
+        );
+        return;
+    }
+    init(
+        image,
+        imageInfo,
+        semaphore,
+        3,
+        tenBit ? RGBTOYUV420_10BIT_SHADER_COMP_SPV_PTR : RGBTOYUV420_SHADER_COMP_SPV_PTR,
+        tenBit ? RGBTOYUV420_10BIT_SHADER_COMP_SPV_LEN : RGBTOYUV420_SHADER_COMP_SPV_LEN
+    );
+}
+
+RgbToNv12::RgbToNv12(
+    Renderer* render,
+    VkImage image,
+    VkImageCreateInfo imageInfo,
+    VkSemaphore semaphore,
+    const DrmImage& luma,
+    const DrmImage& chroma
+)
+    : FormatConverter(render) {
+    uint32_t width = imageInfo.extent.width;
+    uint32_t height = imageInfo.extent.height;
+    const DrmImage planes[2] = { luma, chroma };
+    // The chroma plane holds two bytes per pair of columns
+    const VkExtent2D extents[2]
+        = { { width, height }, { (width + 1) / 2 * 2, (height + 1) / 2 } };
+    init(
+        image,
+        imageInfo,
+        semaphore,
+        2,
+        RGBTONV12_SHADER_COMP_SPV_PTR,
+        RGBTONV12_SHADER_COMP_SPV_LEN,
+        {},
+        false,
+        planes,
+        extents
+    );
+}
+
+ScaleYuv420::ScaleYuv420(
+    Renderer* render,
+    VkImage image,
+    VkImageCreateInfo imageInfo,
+    VkSemaphore semaphore,
+    VkExtent2D extent
 )
     : FormatConverter(render) {
+    bool tenBit = isTenBit(imageInfo);
     init(
         image,
         imageInfo,
         semaphore,
         3,
-        RGBTOYUV420_SHADER_COMP_SPV_PTR,
-        RGBTOYUV420_SHADER_COMP_SPV_LEN
+        tenBit ? SCALE_YUV420_10BIT_SHADER_COMP_SPV_PTR : SCALE_YUV420_SHADER_COMP_SPV_PTR,
+        tenBit ? SCALE_YUV420_10BIT_SHADER_COMP_SPV_LEN : SCALE_YUV420_SHADER_COMP_SPV_LEN,
+        extent
     );
 }
@@ -2,21 +2,24 @@
 
 #include "Renderer.h"
 
+// Converts one image into host mapped planes. Each converter owns its planes and fence, so with
+// one converter per Renderer output, converting a frame can overlap reading the previous one.
 class FormatConverter {
 public:
-    struct Output {
-        VkSemaphore semaphore = VK_NULL_HANDLE;
-    };
-
     virtual ~FormatConverter();
 
-    Output GetOutput();
+    // Submits the conversion, which waits for the input timeline semaphore to reach waitValue
+    void Convert(uint64_t waitValue);
 
-    void Convert(uint8_t** data, int* linesize);
+    // Waits for the last Convert to complete, then returns the planes. Does nothing if there is
+    // no conversion in flight.
+    void Sync(uint8_t** data, int* linesize);
 
-    void Sync();
+    bool Pending() const { return m_pending; }
 
     uint64_t GetTimestamp();
+    // GPU time of the last conversion in ns
+    uint64_t GetDuration();
 
 protected:
     struct OutputImage {
@@ -26,21 +29,35 @@ protected:
         VkSemaphore semaphore = VK_NULL_HANDLE;
         VkDeviceSize linesize = 0;
         uint8_t* mapped = nullptr;
+        // Instead of the image, with the memory imported from the host allocation mapped points to
+        VkBuffer buffer = VK_NULL_HANDLE;
     };
 
     explicit FormatConverter(Renderer* render);
+    // The planes are outputExtent large, or as large as the image if it is empty. With
+    // hostBuffers they are host allocations the shader writes as storage buffers, see
+    // rgbtoyuv420.comp. With importedPlanes, count r8 dma-bufs of the given extents are written
+    // instead, and Sync returns null planes.
     void init(
         VkImage image,
         VkImageCreateInfo imageCreateInfo,
         VkSemaphore semaphore,
         int count,
         const unsigned char* shaderData,
-        unsigned shaderLen
+        unsigned shaderLen,
+        VkExtent2D outputExtent = {},
+        bool hostBuffers = false,
+        const DrmImage* importedPlanes = nullptr,
+        const VkExtent2D* importedExtents = nullptr
     );
+    void importHostPlane(OutputImage& plane, VkDeviceSize linesize, uint32_t rows);
+    // Takes a duplicate of the fd of drm
+    void importDmaBufPlane(OutputImage& plane, const DrmImage& drm, VkExtent2D extent);
 
     Renderer* r;
     VkQueryPool m_queryPool = VK_NULL_HANDLE;
     VkCommandBuffer m_commandBuffer = VK_NULL_HANDLE;
+    VkFence m_fence = VK_NULL_HANDLE;
     VkDescriptorSetLayout m_descriptorLayout = VK_NULL_HANDLE;
     VkImageView m_view = VK_NULL_HANDLE;
     VkSemaphore m_semaphore = VK_NULL_HANDLE;
@@ -50,12 +67,48 @@ protected:
     uint32_t m_groupCountX = 0;
     uint32_t m_groupCountY = 0;
     std::vector<OutputImage> m_images;
-    Output m_output;
+    bool m_hostBuffers = false;
+    // The host planes are placed on it, -1 for anywhere. See NumaPlacement.h
+    int m_numaNode = -1;
+    bool m_pending = false;
 };
 
 class RgbToYuv420 : public FormatConverter {
 public:
+    // The host planes are placed on numaNode, which the threads reading them run on
     explicit RgbToYuv420(
-        Renderer* render, VkImage image, VkImageCreateInfo imageInfo, VkSemaphore semaphore
+        Renderer* render,
+        VkImage image,
+        VkImageCreateInfo imageInfo,
+        VkSemaphore semaphore,
+        int numaNode = -1
+    );
+};
+
+// Into the planes of an NV12 surface of the same size, imported from the dma-bufs of its two
+// layers, for VAAPI to encode without a conversion of its own. 8 bit inputs only, see
+// rgbtonv12.comp.
+class RgbToNv12 : public FormatConverter {
+public:
+    // luma and chroma are single plane layers, DRM_FORMAT_R8 and DRM_FORMAT_GR88
+    explicit RgbToNv12(
+        Renderer* render,
+        VkImage image,
+        VkImageCreateInfo imageInfo,
+        VkSemaphore semaphore,
+        const DrmImage& luma,
+        const DrmImage& chroma
+    );
+};
+
+// RgbToYuv420 into planes of another size, see scale_yuv420.comp
+class ScaleYuv420 : public FormatConverter {
+public:
+    explicit ScaleYuv420(
+        Renderer* render,
+        VkImage image,
+        VkImageCreateInfo imageInfo,
+        VkSemaphore semaphore,
+        VkExtent2D extent
     );
 };
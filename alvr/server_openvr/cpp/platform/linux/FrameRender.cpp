@@ -1,17 +1,72 @@
 #include "FrameRender.h"
+#include "ALVR-common/packet_types.h"
+#include "alvr_server/HiddenAreaMask.h"
 #include "alvr_server/Logger.h"
+#include "alvr_server/RadialFoveation.h"
 #include "alvr_server/bindings.h"
 
+#include <cmath>
 #include <filesystem>
 #include <fstream>
 
-FrameRender::FrameRender(alvr::VkContext& ctx, init_packet& init, int fds[])
+namespace {
+
+// Snaps a center shift to whole compressed edge pixels, like the client does. The radial
+// compression matches no pixel grid and keeps it.
+float alignCenterShift(float shift, float edgeSizeAligned, float edgeRatio) {
+    if (Settings_Instance()->m_foveationRadial) {
+        return shift;
+    }
+    if (edgeSizeAligned <= 0.) {
+        return 0.;
+    }
+    return ceil(shift * edgeSizeAligned / (edgeRatio * 2.)) * (edgeRatio * 2.) / edgeSizeAligned;
+}
+
+FfiFoveationCenter staticFoveationCenter() {
+    float centerShiftX = (float)Settings_Instance()->m_foveationCenterShiftX;
+    float centerShiftY = (float)Settings_Instance()->m_foveationCenterShiftY;
+    return { centerShiftX, centerShiftY, centerShiftX, centerShiftY };
+}
+
+// 10 bit outputs when the encoder encodes 10 bit, so that the last pass doesn't round to 8 bit
+bool use10BitOutputs(alvr::VkContext& ctx) {
+    const auto* settings = Settings_Instance();
+    if (!settings->m_use10bitEncoder || settings->m_forceSwEncoding
+        || (settings->m_codec != ALVR_CODEC_HEVC && settings->m_codec != ALVR_CODEC_AV1)) {
+        return false;
+    }
+    if (QUAD_10BIT_SHADER_COMP_SPV_LEN == 0 || RGBTOYUV420_10BIT_SHADER_COMP_SPV_LEN == 0
+        || SCALE_YUV420_10BIT_SHADER_COMP_SPV_LEN == 0) {
+        Warn("FrameRender: 10 bit output shaders weren't compiled, using 8 bit outputs");
+        return false;
+    }
+    VkFormatProperties props = {};
+    vkGetPhysicalDeviceFormatProperties(
+        ctx.get_vk_phys_device(), VK_FORMAT_A2B10G10R10_UNORM_PACK32, &props
+    );
+    if (!ctx.storageImageExtendedFormats
+        || !(props.optimalTilingFeatures & VK_FORMAT_FEATURE_STORAGE_IMAGE_BIT)) {
+        Warn("FrameRender: 10 bit storage images not supported, using 8 bit outputs");
+        return false;
+    }
+    return true;
+}
+
+} // namespace
+
+FrameRender::FrameRender(
+    alvr::VkContext& ctx, init_packet& init, int fds[], const Variant* variant
+)
     : Renderer(
           ctx.get_vk_instance(),
           ctx.get_vk_device(),
           ctx.get_vk_phys_device(),
-          ctx.get_vk_queue_family_index(),
-          ctx.get_vk_device_extensions()
+          ctx.get_vk_compose_queue_family_index(),
+          ctx.get_vk_compose_queue_index(),
+          ctx.get_vk_device_extensions(),
+          ctx.get_compose_queue_mutex(),
+          ctx.get_vk_output_queue_families()
       ) {
     m_quadShaderSize = QUAD_SHADER_COMP_SPV_LEN;
     m_quadShaderCode = reinterpret_cast<const uint32_t*>(QUAD_SHADER_COMP_SPV_PTR);
@@ -22,7 +77,12 @@ FrameRender::FrameRender(alvr::VkContext& ctx, init_packet& init, int fds[])
         init.image_create_info.format
     );
 
-    for (size_t i = 0; i < 3; ++i) {
+    LoadPipelineCache(std::filesystem::path(g_sessionPath).parent_path().string());
+    if (variant && !variant->tunedWorkgroups) {
+        DisableWorkgroupTuning();
+    }
+
+    for (size_t i = 0; i < init.num_images; ++i) {
         AddImage(init.image_create_info, init.mem_index, fds[2 * i], fds[2 * i + 1]);
     }
 
@@ -31,52 +91,143 @@ FrameRender::FrameRender(alvr::VkContext& ctx, init_packet& init, int fds[])
 
     Info("FrameRender: Input size %ux%u", m_width, m_height);
 
+    if (use10BitOutputs(ctx)) {
+        SetOutputFormat(VK_FORMAT_A2B10G10R10_UNORM_PACK32);
+        Info("FrameRender: Using 10 bit outputs");
+    }
+    // The half precision color math is only within the rounding of 8 bit outputs
+    m_fp16Arithmetic = ctx.shaderFloat16 && GetOutputFormat() == m_format;
+    if (variant && !variant->fp16) {
+        m_fp16Arithmetic = false;
+    }
+
     if (Settings_Instance()->m_forceSwEncoding) {
         m_handle = ExternalHandle::None;
     } else if (ctx.amd || ctx.intel) {
         m_handle = ExternalHandle::DmaBuf;
     } else if (ctx.nvidia) {
+#ifdef ALVR_CUDA_INTEROP
+        m_handle = SupportsLinearOutput() ? ExternalHandle::OpaqueFdLinear
+                                          : ExternalHandle::OpaqueFd;
+#else
         m_handle = ExternalHandle::OpaqueFd;
+#endif
     }
 
     setupCustomShaders("pre");
 
-    if (Settings_Instance()->m_enableColorCorrection) {
-        setupColorCorrection();
+    if (Settings_Instance()->m_temporalDenoiseStrength > 0.f) {
+        setupDenoise();
     }
 
-    if (Settings_Instance()->m_enableFoveatedEncoding) {
-        setupFoveatedRendering();
+    if (IsHiddenAreaMaskEnabled()) {
+        setupHiddenAreaMask();
+    }
+
+    const bool colorCorrection
+        = variant ? variant->colorCorrection : Settings_Instance()->m_enableColorCorrection;
+    const bool foveatedEncoding
+        = variant ? variant->foveatedEncoding : Settings_Instance()->m_enableFoveatedEncoding;
+    const bool fused = !variant || variant->fused;
+    // The fused shader is only built when glslangValidator was found at build time
+    if (fused && COMPOSE_SHADER_COMP_SPV_LEN > 0 && (colorCorrection || foveatedEncoding)) {
+        setupCompose(colorCorrection, foveatedEncoding);
+    } else {
+        if (colorCorrection) {
+            setupColorCorrection();
+        }
+        if (foveatedEncoding) {
+            setupFoveatedRendering();
+        }
     }
 
     setupCustomShaders("post");
 
-    if (m_pipelines.empty()) {
+    // The foveation pass resamples on its own
+    if (Settings_Instance()->m_highQualityDownscaling && !foveatedEncoding
+        && (m_imageSize.width > m_width || m_imageSize.height > m_height)) {
+        setupDownscale();
+    }
+
+    // The history of the denoise pass is of the input size, it needs a pass after it. 10 bit
+    // outputs are written by the last pass, which needs a variant of its shader for them.
+    if (m_pipelines.empty() || m_pipelines.back() == m_denoisePipeline
+        || (GetOutputFormat() != m_format && !m_pipelines.back()->HasOutputShader())) {
         RenderPipeline* pipeline = new RenderPipeline(this);
         pipeline->SetShader(QUAD_SHADER_COMP_SPV_PTR, QUAD_SHADER_COMP_SPV_LEN);
+        pipeline->SetOutputShader(QUAD_10BIT_SHADER_COMP_SPV_PTR, QUAD_10BIT_SHADER_COMP_SPV_LEN);
+        pipeline->SetName("quad");
         m_pipelines.push_back(pipeline);
         AddPipeline(pipeline);
     }
 
+    if (Settings_Instance()->m_enableLinuxAsyncReprojection
+        || Settings_Instance()->m_enableLateLatching) {
+        if (REPROJECT_SHADER_COMP_SPV_LEN > 0) {
+            RenderPipeline* pipeline = new RenderPipeline(this);
+            pipeline->SetShader(REPROJECT_SHADER_COMP_SPV_PTR, REPROJECT_SHADER_COMP_SPV_LEN);
+            pipeline->SetName("reproject");
+            m_pipelines.push_back(pipeline);
+            SetReprojectionPipeline(pipeline);
+        } else {
+            Warn("FrameRender: Reprojection shader is not available, async reprojection and late "
+                 "latching disabled");
+        }
+    }
+
     Info("FrameRender: Output size %ux%u", m_width, m_height);
 }
 
+bool FrameRender::CanReplaceImages(const init_packet& init) const {
+    const VkImageCreateInfo& info = init.image_create_info;
+    return info.format == m_format && info.extent.width == m_imageSize.width
+        && info.extent.height == m_imageSize.height;
+}
+
+void FrameRender::ReplaceImages(init_packet& init, int fds[]) {
+    RemoveImages();
+    for (size_t i = 0; i < init.num_images; ++i) {
+        AddImage(init.image_create_info, init.mem_index, fds[2 * i], fds[2 * i + 1]);
+    }
+}
+
 FrameRender::~FrameRender() {
     for (RenderPipeline* pipeline : m_pipelines) {
         delete pipeline;
     }
 }
 
-FrameRender::Output FrameRender::CreateOutput() {
-    Renderer::CreateOutput(m_width, m_height, m_handle);
-    return GetOutput();
+void FrameRender::CreateOutput(
+    uint32_t count, const ModifierFilter& modifierFilter, bool crossDevice
+) {
+    ExternalHandle handle = crossDevice ? ExternalHandle::DmaBuf : m_handle;
+    Renderer::CreateOutput(m_width, m_height, handle, count, modifierFilter);
 }
 
 uint32_t FrameRender::GetEncodingWidth() const { return m_width; }
 
 uint32_t FrameRender::GetEncodingHeight() const { return m_height; }
 
-void FrameRender::setupColorCorrection() {
+void FrameRender::SetFoveationCenter(const FfiFoveationCenter& center) {
+    if (!m_foveationPipeline) {
+        return;
+    }
+
+    const FoveationVars& vars = m_foveatedRenderingConstants;
+    FoveationCenter constants = {
+        {
+            alignCenterShift(center.leftShiftX, m_foveationEdgeSize[0], vars.edgeRatioX),
+            alignCenterShift(center.leftShiftY, m_foveationEdgeSize[1], vars.edgeRatioY),
+        },
+        {
+            alignCenterShift(center.rightShiftX, m_foveationEdgeSize[0], vars.edgeRatioX),
+            alignCenterShift(center.rightShiftY, m_foveationEdgeSize[1], vars.edgeRatioY),
+        },
+    };
+    m_foveationPipeline->SetPushConstants(&constants);
+}
+
+std::vector<VkSpecializationMapEntry> FrameRender::initColorCorrection() {
     std::vector<VkSpecializationMapEntry> entries;
 
 #define ENTRY(x, v)                                                                                \
@@ -94,21 +245,31 @@ void FrameRender::setupColorCorrection() {
     ENTRY(sharpening, Settings_Instance()->m_sharpening);
 #undef ENTRY
 
+    return entries;
+}
+
+void FrameRender::setupColorCorrection() {
+    std::vector<VkSpecializationMapEntry> entries = initColorCorrection();
+
     RenderPipeline* pipeline = new RenderPipeline(this);
-    pipeline->SetShader(COLOR_SHADER_COMP_SPV_PTR, COLOR_SHADER_COMP_SPV_LEN);
+    if (m_fp16Arithmetic && COLOR_FP16_SHADER_COMP_SPV_LEN > 0) {
+        Info("FrameRender: Using fp16 color correction");
+        pipeline->SetShader(COLOR_FP16_SHADER_COMP_SPV_PTR, COLOR_FP16_SHADER_COMP_SPV_LEN);
+    } else {
+        pipeline->SetShader(COLOR_SHADER_COMP_SPV_PTR, COLOR_SHADER_COMP_SPV_LEN);
+    }
+    pipeline->SetName("color");
     pipeline->SetConstants(&m_colorCorrectionConstants, std::move(entries));
     m_pipelines.push_back(pipeline);
     AddPipeline(pipeline);
 }
 
-void FrameRender::setupFoveatedRendering() {
+std::vector<VkSpecializationMapEntry> FrameRender::initFoveatedRendering() {
     float targetEyeWidth = (float)m_width / 2;
     float targetEyeHeight = (float)m_height;
 
     float centerSizeX = (float)Settings_Instance()->m_foveationCenterSizeX;
     float centerSizeY = (float)Settings_Instance()->m_foveationCenterSizeY;
-    float centerShiftX = (float)Settings_Instance()->m_foveationCenterShiftX;
-    float centerShiftY = (float)Settings_Instance()->m_foveationCenterShiftY;
     float edgeRatioX = (float)Settings_Instance()->m_foveationEdgeRatioX;
     float edgeRatioY = (float)Settings_Instance()->m_foveationEdgeRatioY;
 
@@ -122,15 +283,26 @@ void FrameRender::setupFoveatedRendering() {
 
     float edgeSizeXAligned = targetEyeWidth - centerSizeXAligned * targetEyeWidth;
     float edgeSizeYAligned = targetEyeHeight - centerSizeYAligned * targetEyeHeight;
-
-    float centerShiftXAligned = ceil(centerShiftX * edgeSizeXAligned / (edgeRatioX * 2.))
-        * (edgeRatioX * 2.) / edgeSizeXAligned;
-    float centerShiftYAligned = ceil(centerShiftY * edgeSizeYAligned / (edgeRatioY * 2.))
-        * (edgeRatioY * 2.) / edgeSizeYAligned;
+    m_foveationEdgeSize[0] = edgeSizeXAligned;
+    m_foveationEdgeSize[1] = edgeSizeYAligned;
 
     float foveationScaleX = (centerSizeXAligned + (1. - centerSizeXAligned) / edgeRatioX);
     float foveationScaleY = (centerSizeYAligned + (1. - centerSizeYAligned) / edgeRatioY);
 
+    // The radial compression has a single scale and matches no pixel grid, see RadialFoveation.h
+    RadialFoveation radial = {};
+    if (Settings_Instance()->m_foveationRadial) {
+        radial = GetRadialFoveation();
+        centerSizeXAligned = radial.radius;
+        centerSizeYAligned = radial.radius;
+        edgeRatioX = 0.;
+        edgeRatioY = 0.;
+        m_foveationEdgeSize[0] = 0.;
+        m_foveationEdgeSize[1] = 0.;
+        foveationScaleX = radial.scale;
+        foveationScaleY = radial.scale;
+    }
+
     float optimizedEyeWidth = foveationScaleX * targetEyeWidth;
     float optimizedEyeHeight = foveationScaleY * targetEyeHeight;
 
@@ -156,15 +328,159 @@ void FrameRender::setupFoveatedRendering() {
     ENTRY(eyeHeightRatio, eyeHeightRatioAligned);
     ENTRY(centerSizeX, centerSizeXAligned);
     ENTRY(centerSizeY, centerSizeYAligned);
-    ENTRY(centerShiftX, centerShiftXAligned);
-    ENTRY(centerShiftY, centerShiftYAligned);
     ENTRY(edgeRatioX, edgeRatioX);
     ENTRY(edgeRatioY, edgeRatioY);
+    ENTRY(radialScale, radial.scale);
+    ENTRY(radialCurve, radial.curve);
 #undef ENTRY
 
+    return entries;
+}
+
+void FrameRender::setupFoveatedRendering() {
+    // The client expects a compressed frame, the stream can't go on without the shader
+    if (FFR_SHADER_COMP_SPV_LEN == 0) {
+        throw MakeException("FrameRender: Foveated encoding shader is not available");
+    }
+
+    std::vector<VkSpecializationMapEntry> entries = initFoveatedRendering();
+
     RenderPipeline* pipeline = new RenderPipeline(this);
     pipeline->SetShader(FFR_SHADER_COMP_SPV_PTR, FFR_SHADER_COMP_SPV_LEN);
+    // Older builds of ffr.comp take the center shift as specialization constants with the ids
+    // that are now the edge ratios, and predate the workgroup size constants. Constants the module
+    // doesn't declare are ignored by Vulkan, the radial shape would fall back to the axis aligned
+    // compression the client doesn't expect.
+    const uint32_t* code = reinterpret_cast<const uint32_t*>(FFR_SHADER_COMP_SPV_PTR);
+    bool upToDate = pipeline->HasWorkgroupSizeConstants();
+    for (const VkSpecializationMapEntry& entry : entries) {
+        upToDate = upToDate && hasSpecId(code, FFR_SHADER_COMP_SPV_LEN / 4, entry.constantID);
+    }
+    if (!upToDate) {
+        delete pipeline;
+        throw MakeException("FrameRender: Foveated encoding shader is out of date");
+    }
+    pipeline->SetName("ffr");
     pipeline->SetConstants(&m_foveatedRenderingConstants, std::move(entries));
+    pipeline->SetPushConstantSize(sizeof(FoveationCenter));
+    m_foveationPipeline = pipeline;
+    SetFoveationCenter(staticFoveationCenter());
+    m_pipelines.push_back(pipeline);
+    AddPipeline(pipeline);
+}
+
+void FrameRender::setupCompose(bool colorCorrection, bool foveatedEncoding) {
+    std::vector<VkSpecializationMapEntry> entries;
+
+    // Stage constants keep their layout and are moved to their place in ComposeConstants, with
+    // foveation ids following the color correction ones and the stage switches after them
+    auto append = [&](std::vector<VkSpecializationMapEntry>&& stage, uint32_t idBase, size_t base) {
+        for (VkSpecializationMapEntry entry : stage) {
+            entry.constantID += idBase;
+            entry.offset += base;
+            entries.push_back(entry);
+        }
+    };
+
+    m_composeConstants = {};
+    if (colorCorrection) {
+        append(initColorCorrection(), 0, offsetof(ComposeConstants, colorCorrection));
+        m_composeConstants.colorCorrection = m_colorCorrectionConstants;
+    }
+    if (foveatedEncoding) {
+        append(initFoveatedRendering(), 7, offsetof(ComposeConstants, foveation));
+        m_composeConstants.foveation = m_foveatedRenderingConstants;
+    }
+
+    m_composeConstants.enableColorCorrection = colorCorrection;
+    entries.push_back(
+        { 15, offsetof(ComposeConstants, enableColorCorrection), sizeof(VkBool32) }
+    );
+    m_composeConstants.enableFoveation = foveatedEncoding;
+    entries.push_back({ 16, offsetof(ComposeConstants, enableFoveation), sizeof(VkBool32) });
+
+    Info(
+        "FrameRender: Using fused compose shader (color correction: %d, foveated encoding: %d)",
+        colorCorrection,
+        foveatedEncoding
+    );
+
+    RenderPipeline* pipeline = new RenderPipeline(this);
+    if (m_fp16Arithmetic && colorCorrection && COMPOSE_FP16_SHADER_COMP_SPV_LEN > 0) {
+        Info("FrameRender: Using fp16 color correction");
+        pipeline->SetShader(COMPOSE_FP16_SHADER_COMP_SPV_PTR, COMPOSE_FP16_SHADER_COMP_SPV_LEN);
+    } else {
+        pipeline->SetShader(COMPOSE_SHADER_COMP_SPV_PTR, COMPOSE_SHADER_COMP_SPV_LEN);
+    }
+    pipeline->SetOutputShader(
+        COMPOSE_10BIT_SHADER_COMP_SPV_PTR, COMPOSE_10BIT_SHADER_COMP_SPV_LEN
+    );
+    pipeline->SetName("compose");
+    pipeline->SetConstants(&m_composeConstants, std::move(entries));
+    // The shader declares the center even without foveation, it stays zero then
+    pipeline->SetPushConstantSize(sizeof(FoveationCenter));
+    if (foveatedEncoding) {
+        m_foveationPipeline = pipeline;
+        SetFoveationCenter(staticFoveationCenter());
+    }
+    m_pipelines.push_back(pipeline);
+    AddPipeline(pipeline);
+}
+
+void FrameRender::setupDenoise() {
+    if (DENOISE_SHADER_COMP_SPV_LEN == 0) {
+        Warn("FrameRender: Denoise shader is not available, temporal denoising disabled");
+        return;
+    }
+
+    m_denoiseConstants.strength = Settings_Instance()->m_temporalDenoiseStrength;
+    m_denoiseConstants.tolerance = Settings_Instance()->m_temporalDenoiseTolerance;
+    std::vector<VkSpecializationMapEntry> entries = {
+        { 0, offsetof(DenoiseConstants, strength), sizeof(float) },
+        { 1, offsetof(DenoiseConstants, tolerance), sizeof(float) },
+    };
+
+    RenderPipeline* pipeline = new RenderPipeline(this);
+    pipeline->SetShader(DENOISE_SHADER_COMP_SPV_PTR, DENOISE_SHADER_COMP_SPV_LEN);
+    pipeline->SetName("denoise");
+    pipeline->SetConstants(&m_denoiseConstants, std::move(entries));
+    m_denoisePipeline = pipeline;
+    m_pipelines.push_back(pipeline);
+    AddHistoryPipeline(pipeline);
+}
+
+void FrameRender::setupHiddenAreaMask() {
+    if (MASK_SHADER_COMP_SPV_LEN == 0) {
+        Warn("FrameRender: Mask shader is not available, hidden area mask disabled");
+        return;
+    }
+
+    m_hiddenAreaMaskSize = Settings_Instance()->m_hiddenAreaMaskSize;
+    RenderPipeline* pipeline = new RenderPipeline(this);
+    pipeline->SetShader(MASK_SHADER_COMP_SPV_PTR, MASK_SHADER_COMP_SPV_LEN);
+    pipeline->SetName("mask");
+    pipeline->SetConstants(&m_hiddenAreaMaskSize, { { 0, 0, sizeof(float) } });
+    m_pipelines.push_back(pipeline);
+    AddPipeline(pipeline);
+}
+
+void FrameRender::setupDownscale() {
+    if (DOWNSCALE_SHADER_COMP_SPV_LEN == 0) {
+        Warn("FrameRender: Downscale shader is not available, using bilinear downscaling");
+        return;
+    }
+
+    Info(
+        "FrameRender: Downscaling from %ux%u with a Lanczos filter",
+        m_imageSize.width,
+        m_imageSize.height
+    );
+    RenderPipeline* pipeline = new RenderPipeline(this);
+    pipeline->SetShader(DOWNSCALE_SHADER_COMP_SPV_PTR, DOWNSCALE_SHADER_COMP_SPV_LEN);
+    pipeline->SetOutputShader(
+        DOWNSCALE_10BIT_SHADER_COMP_SPV_PTR, DOWNSCALE_10BIT_SHADER_COMP_SPV_LEN
+    );
+    pipeline->SetName("downscale");
     m_pipelines.push_back(pipeline);
     AddPipeline(pipeline);
 }
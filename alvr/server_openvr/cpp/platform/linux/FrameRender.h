@@ -1,17 +1,43 @@
 #pragma once
 
 #include "Renderer.h"
+#include "alvr_server/bindings.h"
 #include "ffmpeg_helper.h"
 #include "protocol.h"
 
 class FrameRender : public Renderer {
 public:
-    explicit FrameRender(alvr::VkContext& ctx, init_packet& init, int fds[]);
+    // Overrides of the compose choices FrameRender makes from the settings and the device, for
+    // the compose benchmark to time each variant of the chain
+    struct Variant {
+        bool colorCorrection = false;
+        bool foveatedEncoding = false;
+        // The fused compose shader, when it was compiled
+        bool fused = true;
+        // The fp16 color correction, when the device supports it
+        bool fp16 = true;
+        // Tuned workgroup sizes, which are loaded or tuned with the pipeline cache
+        bool tunedWorkgroups = true;
+    };
+
+    explicit FrameRender(
+        alvr::VkContext& ctx, init_packet& init, int fds[], const Variant* variant = nullptr
+    );
     ~FrameRender();
 
-    Output CreateOutput();
+    // With crossDevice the outputs are dma-bufs whatever the compose GPU, for an encoder on
+    // another GPU to import
+    void CreateOutput(
+        uint32_t count, const ModifierFilter& modifierFilter = {}, bool crossDevice = false
+    );
+    // Whether the swapchain of init can replace the current one with ReplaceImages
+    bool CanReplaceImages(const init_packet& init) const;
+    // Imports the images of a new swapchain of the compositor in place of the current ones
+    void ReplaceImages(init_packet& init, int fds[]);
     uint32_t GetEncodingWidth() const;
     uint32_t GetEncodingHeight() const;
+    // Center the next Render compresses with when foveated encoding is enabled
+    void SetFoveationCenter(const FfiFoveationCenter& center);
 
 private:
     struct ColorCorrection {
@@ -29,20 +55,61 @@ private:
         float eyeHeightRatio;
         float centerSizeX;
         float centerSizeY;
-        float centerShiftX;
-        float centerShiftY;
         float edgeRatioX;
         float edgeRatioY;
+        // 0 for the axis aligned compression, the center sizes are the radius otherwise
+        float radialScale;
+        float radialCurve;
+    };
+
+    // Push constants of ffr.comp and compose.comp
+    struct FoveationCenter {
+        float leftShift[2];
+        float rightShift[2];
+    };
+
+    // Specialization constants of compose.comp
+    struct ComposeConstants {
+        ColorCorrection colorCorrection;
+        FoveationVars foveation;
+        VkBool32 enableColorCorrection;
+        VkBool32 enableFoveation;
+    };
+
+    // Specialization constants of denoise.comp
+    struct DenoiseConstants {
+        float strength;
+        float tolerance;
     };
 
+    std::vector<VkSpecializationMapEntry> initColorCorrection();
+    std::vector<VkSpecializationMapEntry> initFoveatedRendering();
     void setupColorCorrection();
     void setupFoveatedRendering();
+    // Color correction and foveated encoding in one pass, without a staging image between them
+    void setupCompose(bool colorCorrection, bool foveatedEncoding);
+    // First pass after the "pre" custom shaders, on the frames as the game renders them
+    void setupDenoise();
+    // Before the passes that change the eye layout
+    void setupHiddenAreaMask();
+    // Last pass, resamples to the output size
+    void setupDownscale();
     void setupCustomShaders(const std::string& stage);
 
     uint32_t m_width;
     uint32_t m_height;
     ExternalHandle m_handle = ExternalHandle::None;
+    // Whether the color correction uses the fp16 variants of its shaders
+    bool m_fp16Arithmetic = false;
     ColorCorrection m_colorCorrectionConstants;
     FoveationVars m_foveatedRenderingConstants;
+    // Aligned size of the edges of an eye, in pixels, 0 with the radial compression
+    float m_foveationEdgeSize[2] = {};
+    RenderPipeline* m_foveationPipeline = nullptr;
+    ComposeConstants m_composeConstants;
+    DenoiseConstants m_denoiseConstants;
+    RenderPipeline* m_denoisePipeline = nullptr;
+    // Specialization constant of mask.comp
+    float m_hiddenAreaMaskSize = 0.f;
     std::vector<RenderPipeline*> m_pipelines;
 };
@@ -0,0 +1,195 @@
+#include "FrameUploader.h"
+
+#include <cstring>
+
+FrameUploader::FrameUploader(
+    Renderer& render, const VkImageCreateInfo& imageInfo, size_t& memoryIndex
+)
+    : r(render)
+    , m_imageInfo(imageInfo) {
+    for (InputImage& input : m_inputs) {
+        VkExternalMemoryImageCreateInfo extMemImageInfo = {};
+        extMemImageInfo.sType = VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_IMAGE_CREATE_INFO;
+        extMemImageInfo.handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_OPAQUE_FD_BIT;
+        VkImageCreateInfo info = imageInfo;
+        info.pNext = &extMemImageInfo;
+        VK_CHECK(vkCreateImage(r.m_dev, &info, nullptr, &input.image));
+
+        VkMemoryRequirements req;
+        vkGetImageMemoryRequirements(r.m_dev, input.image, &req);
+        memoryIndex
+            = r.memoryTypeIndex(VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, req.memoryTypeBits);
+
+        VkMemoryDedicatedAllocateInfo dedicatedMemInfo = {};
+        dedicatedMemInfo.sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_ALLOCATE_INFO;
+        dedicatedMemInfo.image = input.image;
+        VkExportMemoryAllocateInfo exportMemInfo = {};
+        exportMemInfo.sType = VK_STRUCTURE_TYPE_EXPORT_MEMORY_ALLOCATE_INFO;
+        exportMemInfo.pNext = &dedicatedMemInfo;
+        exportMemInfo.handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_OPAQUE_FD_BIT;
+        VkMemoryAllocateInfo memAllocInfo = {};
+        memAllocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+        memAllocInfo.pNext = &exportMemInfo;
+        memAllocInfo.allocationSize = req.size;
+        memAllocInfo.memoryTypeIndex = memoryIndex;
+        VK_CHECK(vkAllocateMemory(r.m_dev, &memAllocInfo, nullptr, &input.memory));
+        VK_CHECK(vkBindImageMemory(r.m_dev, input.image, input.memory, 0));
+
+        VkExportSemaphoreCreateInfo exportSemInfo = {};
+        exportSemInfo.sType = VK_STRUCTURE_TYPE_EXPORT_SEMAPHORE_CREATE_INFO;
+        exportSemInfo.handleTypes = VK_EXTERNAL_SEMAPHORE_HANDLE_TYPE_OPAQUE_FD_BIT;
+        VkSemaphoreTypeCreateInfo timelineInfo = {};
+        timelineInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+        timelineInfo.pNext = &exportSemInfo;
+        timelineInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+        VkSemaphoreCreateInfo semInfo = {};
+        semInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+        semInfo.pNext = &timelineInfo;
+        VK_CHECK(vkCreateSemaphore(r.m_dev, &semInfo, nullptr, &input.semaphore));
+    }
+
+    VkBufferCreateInfo bufferInfo = {};
+    bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    bufferInfo.size = (VkDeviceSize)imageInfo.extent.width * imageInfo.extent.height * 4;
+    bufferInfo.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+    VK_CHECK(vkCreateBuffer(r.m_dev, &bufferInfo, nullptr, &m_staging));
+    VkMemoryRequirements req;
+    vkGetBufferMemoryRequirements(r.m_dev, m_staging, &req);
+    VkMemoryAllocateInfo memAllocInfo = {};
+    memAllocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    memAllocInfo.allocationSize = req.size;
+    memAllocInfo.memoryTypeIndex = r.memoryTypeIndex(
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+        req.memoryTypeBits
+    );
+    VK_CHECK(vkAllocateMemory(r.m_dev, &memAllocInfo, nullptr, &m_stagingMemory));
+    VK_CHECK(vkBindBufferMemory(r.m_dev, m_staging, m_stagingMemory, 0));
+    VK_CHECK(vkMapMemory(r.m_dev, m_stagingMemory, 0, VK_WHOLE_SIZE, 0, &m_stagingMap));
+
+    VkCommandBufferAllocateInfo commandBufferInfo = {};
+    commandBufferInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    commandBufferInfo.commandPool = r.m_commandPool;
+    commandBufferInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    commandBufferInfo.commandBufferCount = 1;
+    VK_CHECK(vkAllocateCommandBuffers(r.m_dev, &commandBufferInfo, &m_commandBuffer));
+
+    VkFenceCreateInfo fenceInfo = {};
+    fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    VK_CHECK(vkCreateFence(r.m_dev, &fenceInfo, nullptr, &m_fence));
+}
+
+FrameUploader::~FrameUploader() {
+    // Renders may still read the images
+    vkDeviceWaitIdle(r.m_dev);
+    vkDestroyFence(r.m_dev, m_fence, nullptr);
+    vkFreeCommandBuffers(r.m_dev, r.m_commandPool, 1, &m_commandBuffer);
+    vkDestroyBuffer(r.m_dev, m_staging, nullptr);
+    vkFreeMemory(r.m_dev, m_stagingMemory, nullptr);
+    for (InputImage& input : m_inputs) {
+        vkDestroySemaphore(r.m_dev, input.semaphore, nullptr);
+        vkDestroyImage(r.m_dev, input.image, nullptr);
+        vkFreeMemory(r.m_dev, input.memory, nullptr);
+    }
+}
+
+void FrameUploader::GetFds(uint32_t index, int& imageFd, int& semaphoreFd) {
+    VkMemoryGetFdInfoKHR memoryFdInfo = {};
+    memoryFdInfo.sType = VK_STRUCTURE_TYPE_MEMORY_GET_FD_INFO_KHR;
+    memoryFdInfo.memory = m_inputs[index].memory;
+    memoryFdInfo.handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_OPAQUE_FD_BIT;
+    VK_CHECK(r.d.vkGetMemoryFdKHR(r.m_dev, &memoryFdInfo, &imageFd));
+
+    VkSemaphoreGetFdInfoKHR semaphoreFdInfo = {};
+    semaphoreFdInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_GET_FD_INFO_KHR;
+    semaphoreFdInfo.semaphore = m_inputs[index].semaphore;
+    semaphoreFdInfo.handleType = VK_EXTERNAL_SEMAPHORE_HANDLE_TYPE_OPAQUE_FD_BIT;
+    VK_CHECK(r.d.vkGetSemaphoreFdKHR(r.m_dev, &semaphoreFdInfo, &semaphoreFd));
+}
+
+uint64_t FrameUploader::Upload(uint32_t index, const CapturedFrame& frame) {
+    InputImage& input = m_inputs[index];
+    if (input.uploaded) {
+        Renderer::Output& output = r.GetOutput(input.readOutput);
+        VkSemaphoreWaitInfo waitInfo = {};
+        waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+        waitInfo.semaphoreCount = 1;
+        waitInfo.pSemaphores = &output.semaphore;
+        waitInfo.pValues = &input.readValue;
+        VK_CHECK(vkWaitSemaphores(r.m_dev, &waitInfo, UINT64_MAX));
+    }
+    memcpy(m_stagingMap, frame.rgba.data(), frame.rgba.size());
+
+    VkCommandBufferBeginInfo beginInfo = {};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    VK_CHECK(vkBeginCommandBuffer(m_commandBuffer, &beginInfo));
+
+    // Renderer leaves its input images in the shader read layout
+    VkImageMemoryBarrier2 barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2;
+    barrier.oldLayout = input.uploaded ? VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL
+                                       : VK_IMAGE_LAYOUT_UNDEFINED;
+    barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.image = input.image;
+    barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    barrier.subresourceRange.levelCount = 1;
+    barrier.subresourceRange.layerCount = 1;
+    barrier.srcStageMask = VK_PIPELINE_STAGE_2_NONE;
+    barrier.srcAccessMask = VK_ACCESS_2_NONE;
+    barrier.dstStageMask = VK_PIPELINE_STAGE_2_COPY_BIT;
+    barrier.dstAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT;
+    r.PipelineBarrier(m_commandBuffer, nullptr, &barrier, 1);
+
+    VkBufferImageCopy region = {};
+    region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    region.imageSubresource.layerCount = 1;
+    region.imageExtent = m_imageInfo.extent;
+    vkCmdCopyBufferToImage(
+        m_commandBuffer,
+        m_staging,
+        input.image,
+        VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+        1,
+        &region
+    );
+
+    barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    // The semaphore signal makes the copy visible to the Renderer
+    barrier.srcStageMask = VK_PIPELINE_STAGE_2_COPY_BIT;
+    barrier.srcAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT;
+    barrier.dstStageMask = VK_PIPELINE_STAGE_2_NONE;
+    barrier.dstAccessMask = VK_ACCESS_2_NONE;
+    r.PipelineBarrier(m_commandBuffer, nullptr, &barrier, 1);
+    VK_CHECK(vkEndCommandBuffer(m_commandBuffer));
+
+    input.value++;
+    VkSemaphoreSubmitInfo signalInfo = {};
+    signalInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO;
+    signalInfo.semaphore = input.semaphore;
+    signalInfo.value = input.value;
+    signalInfo.stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT;
+    VkCommandBufferSubmitInfo commandBufferInfo = {};
+    commandBufferInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO;
+    commandBufferInfo.commandBuffer = m_commandBuffer;
+    VkSubmitInfo2 submitInfo = {};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO_2;
+    submitInfo.commandBufferInfoCount = 1;
+    submitInfo.pCommandBufferInfos = &commandBufferInfo;
+    submitInfo.signalSemaphoreInfoCount = 1;
+    submitInfo.pSignalSemaphoreInfos = &signalInfo;
+    r.QueueSubmit(submitInfo, m_fence);
+
+    // The staging buffer is written again by the next upload
+    VK_CHECK(vkWaitForFences(r.m_dev, 1, &m_fence, VK_TRUE, UINT64_MAX));
+    VK_CHECK(vkResetFences(r.m_dev, 1, &m_fence));
+    input.uploaded = true;
+    return input.value;
+}
+
+void FrameUploader::SetRead(uint32_t index, uint32_t outputIndex) {
+    m_inputs[index].readOutput = outputIndex;
+    m_inputs[index].readValue = r.GetOutput(outputIndex).semaphoreValue;
+}
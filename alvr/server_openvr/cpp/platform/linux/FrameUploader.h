@@ -0,0 +1,49 @@
+#pragma once
+
+#include "Renderer.h"
+#include "alvr_server/CapturedFrames.h"
+
+// Exported images and timeline semaphores frames are uploaded into in turn, imported by a
+// Renderer the way the swapchain images of the layer are. For the benchmarks that run the frame
+// path without the compositor.
+class FrameUploader {
+public:
+    // Images the frames are uploaded into in turn, like the swapchain images of the layer
+    static const uint32_t INPUT_IMAGES = 2;
+
+    // memoryIndex is set to the memory type of the images, for Renderer::AddImage
+    FrameUploader(Renderer& render, const VkImageCreateInfo& imageInfo, size_t& memoryIndex);
+    ~FrameUploader();
+
+    // Fds of each image for Renderer::AddImage, which takes their ownership
+    void GetFds(uint32_t index, int& imageFd, int& semaphoreFd);
+
+    // Copies frame into input image index once the Render that last read it is complete. The
+    // image is ready for a Render waiting for the returned semaphore value. The frame must be of
+    // the size of the images.
+    uint64_t Upload(uint32_t index, const CapturedFrame& frame);
+
+    // Records the Render into output outputIndex that reads input image index
+    void SetRead(uint32_t index, uint32_t outputIndex);
+
+private:
+    struct InputImage {
+        VkImage image = VK_NULL_HANDLE;
+        VkDeviceMemory memory = VK_NULL_HANDLE;
+        VkSemaphore semaphore = VK_NULL_HANDLE;
+        uint64_t value = 0;
+        bool uploaded = false;
+        // Output semaphore value at which the last Render reading the image is complete
+        uint32_t readOutput = 0;
+        uint64_t readValue = 0;
+    };
+
+    Renderer& r;
+    VkImageCreateInfo m_imageInfo;
+    InputImage m_inputs[INPUT_IMAGES];
+    VkBuffer m_staging = VK_NULL_HANDLE;
+    VkDeviceMemory m_stagingMemory = VK_NULL_HANDLE;
+    void* m_stagingMap = nullptr;
+    VkCommandBuffer m_commandBuffer = VK_NULL_HANDLE;
+    VkFence m_fence = VK_NULL_HANDLE;
+};
@@ -0,0 +1,81 @@
+#include "NvEncoderCuda.h"
+#include "alvr_server/GpuMemory.h"
+
+#ifdef ALVR_CUDA_INTEROP
+NvEncoderCuda::NvEncoderCuda(
+    CudaFunctions* cu,
+    CUcontext context,
+    uint32_t width,
+    uint32_t height,
+    NV_ENC_BUFFER_FORMAT format,
+    uint32_t extraOutputDelay
+)
+    : NvEncoder(NV_ENC_DEVICE_TYPE_CUDA, context, width, height, format, extraOutputDelay, false)
+    , m_cu(cu)
+    , m_context(context) {
+    if (!m_hEncoder) {
+        NVENC_THROW_ERROR("Encoder Initialization failed", NV_ENC_ERR_INVALID_DEVICE);
+    }
+}
+
+NvEncoderCuda::~NvEncoderCuda() { ReleaseCudaResources(); }
+
+void NvEncoderCuda::AllocateInputBuffers(int32_t numInputBuffers) {
+    if (!IsHWEncoderInitialized()) {
+        NVENC_THROW_ERROR("Encoder intialization failed", NV_ENC_ERR_ENCODER_NOT_INITIALIZED);
+    }
+
+    // The chroma planes of YUV formats follow the luma plane with the same pitch
+    NV_ENC_BUFFER_FORMAT format = GetPixelFormat();
+    uint32_t height = GetMaxEncodeHeight()
+        + GetNumChromaPlanes(format) * GetChromaHeight(format, GetMaxEncodeHeight());
+    size_t pitch = 0;
+    std::vector<void*> inputFrames;
+    m_cu->cuCtxPushCurrent(m_context);
+    for (int i = 0; i < numInputBuffers; i++) {
+        CUdeviceptr buffer = 0;
+        CUresult res = m_cu->cuMemAllocPitch(
+            &buffer, &pitch, GetWidthInBytes(format, GetMaxEncodeWidth()), height, 16
+        );
+        if (res != CUDA_SUCCESS) {
+            CUcontext popped;
+            m_cu->cuCtxPopCurrent(&popped);
+            NVENC_THROW_ERROR("Failed to allocate CUDA input buffers", NV_ENC_ERR_OUT_OF_MEMORY);
+        }
+        inputFrames.push_back((void*)buffer);
+        TrackGpuMemory((void*)buffer, "NVENC input", GpuMemoryType::DeviceLocal, pitch * height);
+    }
+    CUcontext popped;
+    m_cu->cuCtxPopCurrent(&popped);
+
+    RegisterInputResources(
+        inputFrames,
+        NV_ENC_INPUT_RESOURCE_TYPE_CUDADEVICEPTR,
+        GetMaxEncodeWidth(),
+        GetMaxEncodeHeight(),
+        (int)pitch,
+        format
+    );
+}
+
+void NvEncoderCuda::ReleaseInputBuffers() { ReleaseCudaResources(); }
+
+void NvEncoderCuda::ReleaseCudaResources() {
+    if (!m_hEncoder) {
+        return;
+    }
+
+    UnregisterInputResources();
+
+    m_cu->cuCtxPushCurrent(m_context);
+    for (const NvEncInputFrame& frame : m_vInputFrames) {
+        if (frame.inputPtr) {
+            UntrackGpuMemory(frame.inputPtr);
+            m_cu->cuMemFree((CUdeviceptr)frame.inputPtr);
+        }
+    }
+    CUcontext popped;
+    m_cu->cuCtxPopCurrent(&popped);
+    m_vInputFrames.clear();
+}
+#endif
@@ -0,0 +1,32 @@
+#pragma once
+
+#ifdef ALVR_CUDA_INTEROP
+#include "shared/nvenc/NvEncoder.h"
+#include <ffnvcodec/dynlink_loader.h>
+
+// NvEncoder on a CUDA context, the counterpart of NvEncoderD3D11. The buffers of
+// GetNextInputFrame() are pitched device allocations. Other device pointers can be registered with
+// RegisterExternalInput() as NV_ENC_INPUT_RESOURCE_TYPE_CUDADEVICEPTR with their pitch.
+class NvEncoderCuda : public NvEncoder {
+public:
+    NvEncoderCuda(
+        CudaFunctions* cu,
+        CUcontext context,
+        uint32_t width,
+        uint32_t height,
+        NV_ENC_BUFFER_FORMAT format,
+        uint32_t extraOutputDelay
+    );
+    ~NvEncoderCuda();
+
+protected:
+    void ReleaseInputBuffers() override;
+
+private:
+    void AllocateInputBuffers(int32_t numInputBuffers) override;
+    void ReleaseCudaResources();
+
+    CudaFunctions* m_cu;
+    CUcontext m_context;
+};
+#endif
@@ -1,11 +1,33 @@
 #include "Renderer.h"
+#include "alvr_server/GpuMemory.h"
+#include "alvr_server/Profiling.h"
+#include "alvr_server/Utils.h"
 
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <cassert>
+#include <cerrno>
+#include <cstdio>
 #include <cstring>
+#include <filesystem>
 #include <fstream>
+#include <future>
 #include <iostream>
+#include <linux/dma-buf.h>
+#include <map>
+#include <sys/ioctl.h>
+#include <thread>
+#include <unistd.h>
+
+// Only in kernel headers >= 6.0
+#ifndef DMA_BUF_IOCTL_IMPORT_SYNC_FILE
+struct dma_buf_import_sync_file {
+    __u32 flags;
+    __s32 fd;
+};
+#define DMA_BUF_IOCTL_IMPORT_SYNC_FILE _IOW(DMA_BUF_BASE, 3, struct dma_buf_import_sync_file)
+#endif
 
 #ifndef DRM_FORMAT_INVALID
 #define DRM_FORMAT_INVALID 0
@@ -13,6 +35,7 @@
     ((uint32_t)(a) | ((uint32_t)(b) << 8) | ((uint32_t)(c) << 16) | ((uint32_t)(d) << 24))
 #define DRM_FORMAT_ARGB8888 fourcc_code('A', 'R', '2', '4')
 #define DRM_FORMAT_ABGR8888 fourcc_code('A', 'B', '2', '4')
+#define DRM_FORMAT_XBGR2101010 fourcc_code('X', 'B', '3', '0')
 #define fourcc_mod_code(vendor, val) ((((uint64_t)vendor) << 56) | ((val) & 0x00ffffffffffffffULL))
 #define DRM_FORMAT_MOD_INVALID fourcc_mod_code(0, ((1ULL << 56) - 1))
 #define DRM_FORMAT_MOD_LINEAR fourcc_mod_code(0, 0)
@@ -28,12 +51,46 @@ struct Vertex {
     float position[2];
 };
 
+// Specialization constant IDs of local_size_x_id and local_size_y_id in the shaders
+static const uint32_t WORKGROUP_SIZE_X_ID = 100;
+static const uint32_t WORKGROUP_SIZE_Y_ID = 101;
+// Candidates of tuneWorkgroupSizes. AMD runs 64 invocation waves, NVIDIA 32 invocation warps and
+// Intel anything from 8 to 32, and the best shape also depends on how the shader samples.
+static const VkExtent2D WORKGROUP_SIZES[] = {
+    { 8, 8 }, { 8, 4 }, { 16, 4 }, { 16, 8 }, { 32, 4 }, { 32, 8 }, { 16, 16 },
+};
+// Timed dispatches per candidate, after an untimed one
+static const uint32_t TUNING_DISPATCHES = 8;
+// Threads compiling the pipelines of the chain at startup
+static const uint32_t BUILD_THREADS = 4;
+
+bool hasSpecId(const uint32_t* code, size_t wordCount, uint32_t id) {
+    const uint32_t OP_DECORATE = 71;
+    const uint32_t DECORATION_SPEC_ID = 1;
+    // The instructions follow the 5 word header
+    for (size_t i = 5; i < wordCount;) {
+        uint32_t instructionWords = code[i] >> 16;
+        if (instructionWords == 0 || i + instructionWords > wordCount) {
+            break;
+        }
+        if ((code[i] & 0xffff) == OP_DECORATE && instructionWords == 4
+            && code[i + 2] == DECORATION_SPEC_ID && code[i + 3] == id) {
+            return true;
+        }
+        i += instructionWords;
+    }
+    return false;
+}
+
 static uint32_t to_drm_format(VkFormat format) {
     switch (format) {
     case VK_FORMAT_B8G8R8A8_UNORM:
         return DRM_FORMAT_ARGB8888;
     case VK_FORMAT_R8G8B8A8_UNORM:
         return DRM_FORMAT_ABGR8888;
+    // Without alpha, the only 10 bit RGB format VAAPI imports
+    case VK_FORMAT_A2B10G10R10_UNORM_PACK32:
+        return DRM_FORMAT_XBGR2101010;
     default:
         std::cerr << "Unsupported format " << format << std::endl;
         return DRM_FORMAT_INVALID;
@@ -55,12 +112,24 @@ Renderer::Renderer(
     const VkDevice& dev,
     const VkPhysicalDevice& physDev,
     uint32_t queueIdx,
-    const std::vector<const char*>& devExtensions
+    uint32_t queueIndex,
+    const std::vector<const char*>& devExtensions,
+    std::mutex& queueMutex,
+    const std::vector<uint32_t>& outputQueueFamilies
 )
     : m_inst(inst)
     , m_dev(dev)
     , m_physDev(physDev)
-    , m_queueFamilyIndex(queueIdx) {
+    , m_queueFamilyIndex(queueIdx)
+    , m_queueIndex(queueIndex)
+    , m_queueMutex(queueMutex) {
+    if (!outputQueueFamilies.empty()) {
+        m_outputQueueFamilies.push_back(m_queueFamilyIndex);
+        m_outputQueueFamilies.insert(
+            m_outputQueueFamilies.end(), outputQueueFamilies.begin(), outputQueueFamilies.end()
+        );
+    }
+
     auto checkExtension = [devExtensions](const char* name) {
         return std::find_if(
                    devExtensions.begin(),
@@ -72,24 +141,57 @@ Renderer::Renderer(
     d.haveDmaBuf = checkExtension(VK_EXT_EXTERNAL_MEMORY_DMA_BUF_EXTENSION_NAME);
     d.haveDrmModifiers = checkExtension(VK_EXT_IMAGE_DRM_FORMAT_MODIFIER_EXTENSION_NAME);
     d.haveCalibratedTimestamps = checkExtension(VK_EXT_CALIBRATED_TIMESTAMPS_EXTENSION_NAME);
+    if (checkExtension(VK_EXT_EXTERNAL_MEMORY_HOST_EXTENSION_NAME)) {
+        // The Vulkan context enables storageBuffer8BitAccess whenever it is supported
+        VkPhysicalDeviceVulkan12Features features12 = {};
+        features12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+        VkPhysicalDeviceFeatures2 features = {};
+        features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+        features.pNext = &features12;
+        vkGetPhysicalDeviceFeatures2(m_physDev, &features);
+        d.haveExternalMemoryHost = features12.storageBuffer8BitAccess;
+    }
 
     if (!checkExtension(VK_KHR_PUSH_DESCRIPTOR_EXTENSION_NAME)) {
         throw std::runtime_error("Vulkan: Required extension " VK_KHR_PUSH_DESCRIPTOR_EXTENSION_NAME
                                  " not available");
     }
+    if (!checkExtension(VK_KHR_SYNCHRONIZATION_2_EXTENSION_NAME)) {
+        throw std::runtime_error(
+            "Vulkan: Required extension " VK_KHR_SYNCHRONIZATION_2_EXTENSION_NAME " not available"
+        );
+    }
 
 #define VK_LOAD_PFN(name) d.name = (PFN_##name)vkGetInstanceProcAddr(m_inst, #name)
     VK_LOAD_PFN(vkImportSemaphoreFdKHR);
     VK_LOAD_PFN(vkGetMemoryFdKHR);
+    VK_LOAD_PFN(vkGetSemaphoreFdKHR);
     VK_LOAD_PFN(vkGetMemoryFdPropertiesKHR);
     VK_LOAD_PFN(vkGetImageDrmFormatModifierPropertiesEXT);
     VK_LOAD_PFN(vkGetCalibratedTimestampsEXT);
+    VK_LOAD_PFN(vkGetPhysicalDeviceCalibrateableTimeDomainsEXT);
     VK_LOAD_PFN(vkCmdPushDescriptorSetKHR);
+    VK_LOAD_PFN(vkCmdPipelineBarrier2KHR);
+    VK_LOAD_PFN(vkQueueSubmit2KHR);
+    VK_LOAD_PFN(vkGetMemoryHostPointerPropertiesEXT);
 #undef VK_LOAD_PFN
 
     VkPhysicalDeviceProperties props = {};
     vkGetPhysicalDeviceProperties(m_physDev, &props);
     m_timestampPeriod = props.limits.timestampPeriod;
+
+    if (d.haveCalibratedTimestamps) {
+        uint32_t domainCount = 0;
+        VK_CHECK(d.vkGetPhysicalDeviceCalibrateableTimeDomainsEXT(m_physDev, &domainCount, nullptr)
+        );
+        std::vector<VkTimeDomainEXT> domains(domainCount);
+        VK_CHECK(d.vkGetPhysicalDeviceCalibrateableTimeDomainsEXT(
+            m_physDev, &domainCount, domains.data()
+        ));
+        d.haveMonotonicTimeDomain
+            = std::find(domains.begin(), domains.end(), VK_TIME_DOMAIN_CLOCK_MONOTONIC_EXT)
+            != domains.end();
+    }
 }
 
 Renderer::~Renderer() {
@@ -98,41 +200,50 @@ Renderer::~Renderer() {
     for (const InputImage& image : m_images) {
         vkDestroyImageView(m_dev, image.view, nullptr);
         vkDestroyImage(m_dev, image.image, nullptr);
+        UntrackGpuMemory(image.memory);
         vkFreeMemory(m_dev, image.memory, nullptr);
         vkDestroySemaphore(m_dev, image.semaphore, nullptr);
+        vkDestroySemaphore(m_dev, image.syncSemaphore, nullptr);
     }
 
     for (const StagingImage& image : m_stagingImages) {
         vkDestroyImageView(m_dev, image.view, nullptr);
         vkDestroyImage(m_dev, image.image, nullptr);
+        UntrackGpuMemory(image.memory);
         vkFreeMemory(m_dev, image.memory, nullptr);
     }
-
-    vkDestroyImageView(m_dev, m_output.view, nullptr);
-    vkDestroyImage(m_dev, m_output.image, nullptr);
-    vkFreeMemory(m_dev, m_output.memory, nullptr);
-    vkDestroySemaphore(m_dev, m_output.semaphore, nullptr);
+    vkDestroyImageView(m_dev, m_reprojectionImage.view, nullptr);
+    vkDestroyImage(m_dev, m_reprojectionImage.image, nullptr);
+    UntrackGpuMemory(m_reprojectionImage.memory);
+    vkFreeMemory(m_dev, m_reprojectionImage.memory, nullptr);
+    vkDestroyImageView(m_dev, m_historyImage.view, nullptr);
+    vkDestroyImage(m_dev, m_historyImage.image, nullptr);
+    UntrackGpuMemory(m_historyImage.memory);
+    vkFreeMemory(m_dev, m_historyImage.memory, nullptr);
+
+    for (const Output& output : m_outputs) {
+        vkDestroyImageView(m_dev, output.view, nullptr);
+        vkDestroyImage(m_dev, output.image, nullptr);
+        UntrackGpuMemory(output.memory);
+        vkFreeMemory(m_dev, output.memory, nullptr);
+        vkDestroySemaphore(m_dev, output.semaphore, nullptr);
+        vkDestroySemaphore(m_dev, output.syncFileSemaphore, nullptr);
+    }
 
     vkDestroyQueryPool(m_dev, m_queryPool, nullptr);
+    vkDestroyPipelineCache(m_dev, m_pipelineCache, nullptr);
     vkDestroyCommandPool(m_dev, m_commandPool, nullptr);
     vkDestroySampler(m_dev, m_sampler, nullptr);
     vkDestroyDescriptorSetLayout(m_dev, m_descriptorLayout, nullptr);
-    vkDestroyFence(m_dev, m_fence, nullptr);
 }
 
 void Renderer::Startup(uint32_t width, uint32_t height, VkFormat format) {
     m_format = format;
+    m_outputFormat = format;
     m_imageSize.width = width;
     m_imageSize.height = height;
 
-    vkGetDeviceQueue(m_dev, m_queueFamilyIndex, 0, &m_queue);
-
-    // Timestamp query
-    VkQueryPoolCreateInfo queryPoolInfo = {};
-    queryPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
-    queryPoolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
-    queryPoolInfo.queryCount = 2;
-    VK_CHECK(vkCreateQueryPool(m_dev, &queryPoolInfo, nullptr, &m_queryPool));
+    vkGetDeviceQueue(m_dev, m_queueFamilyIndex, m_queueIndex, &m_queue);
 
     // Command buffer
     VkCommandPoolCreateInfo cmdPoolInfo = {};
@@ -163,7 +274,8 @@ void Renderer::Startup(uint32_t width, uint32_t height, VkFormat format) {
     VK_CHECK(vkCreateSampler(m_dev, &samplerInfo, nullptr, &m_sampler));
 
     // Descriptors
-    VkDescriptorSetLayoutBinding descriptorBindings[2] = {};
+    // The history image is only bound for the history pipeline, the other shaders don't declare it
+    VkDescriptorSetLayoutBinding descriptorBindings[3] = {};
     descriptorBindings[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
     descriptorBindings[0].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
     descriptorBindings[0].descriptorCount = 1;
@@ -173,20 +285,19 @@ void Renderer::Startup(uint32_t width, uint32_t height, VkFormat format) {
     descriptorBindings[1].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
     descriptorBindings[1].descriptorCount = 1;
     descriptorBindings[1].binding = 1;
+    descriptorBindings[2].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+    descriptorBindings[2].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    descriptorBindings[2].descriptorCount = 1;
+    descriptorBindings[2].binding = 2;
 
     VkDescriptorSetLayoutCreateInfo descriptorSetLayoutInfo = {};
     descriptorSetLayoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
     descriptorSetLayoutInfo.flags = VK_DESCRIPTOR_SET_LAYOUT_CREATE_PUSH_DESCRIPTOR_BIT_KHR;
-    descriptorSetLayoutInfo.bindingCount = 2;
+    descriptorSetLayoutInfo.bindingCount = 3;
     descriptorSetLayoutInfo.pBindings = descriptorBindings;
     VK_CHECK(
         vkCreateDescriptorSetLayout(m_dev, &descriptorSetLayoutInfo, nullptr, &m_descriptorLayout)
     );
-
-    // Fence
-    VkFenceCreateInfo fenceInfo = {};
-    fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-    VK_CHECK(vkCreateFence(m_dev, &fenceInfo, nullptr, &m_fence));
 }
 
 void Renderer::AddImage(
@@ -221,6 +332,7 @@ void Renderer::AddImage(
 
     VkDeviceMemory mem;
     VK_CHECK(vkAllocateMemory(m_dev, &memAllocInfo, nullptr, &mem));
+    TrackGpuMemory(mem, "Renderer input", GpuMemoryType::Imported, req.size);
     VK_CHECK(vkBindImageMemory(m_dev, image, mem, 0));
 
     VkSemaphoreTypeCreateInfo timelineInfo = {};
@@ -259,31 +371,163 @@ void Renderer::AddImage(
     VK_CHECK(vkCreateImageView(m_dev, &viewInfo, nullptr, &view));
 
     m_images.push_back({ image, VK_IMAGE_LAYOUT_UNDEFINED, mem, semaphore, view });
+    for (Output& output : m_outputs) {
+        output.recordedCommandBuffers.push_back(VK_NULL_HANDLE);
+        output.recordedPushConstantsVersions.push_back(0);
+    }
+}
+
+void Renderer::RemoveImages() {
+    for (Output& output : m_outputs) {
+        VkSemaphoreWaitInfo waitInfo = {};
+        waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+        waitInfo.semaphoreCount = 1;
+        waitInfo.pSemaphores = &output.semaphore;
+        waitInfo.pValues = &output.semaphoreValue;
+        VK_CHECK(vkWaitSemaphores(m_dev, &waitInfo, UINT64_MAX));
+
+        for (VkCommandBuffer commandBuffer : output.recordedCommandBuffers) {
+            if (commandBuffer != VK_NULL_HANDLE) {
+                vkFreeCommandBuffers(m_dev, m_commandPool, 1, &commandBuffer);
+            }
+        }
+        output.recordedCommandBuffers.clear();
+        output.recordedPushConstantsVersions.clear();
+    }
+
+    for (const InputImage& image : m_images) {
+        vkDestroyImageView(m_dev, image.view, nullptr);
+        vkDestroyImage(m_dev, image.image, nullptr);
+        UntrackGpuMemory(image.memory);
+        vkFreeMemory(m_dev, image.memory, nullptr);
+        vkDestroySemaphore(m_dev, image.semaphore, nullptr);
+        vkDestroySemaphore(m_dev, image.syncSemaphore, nullptr);
+    }
+    m_images.clear();
 }
 
 void Renderer::AddPipeline(RenderPipeline* pipeline) {
-    pipeline->Build();
     m_pipelines.push_back(pipeline);
 
     if (m_pipelines.size() > 1 && m_stagingImages.size() < 2) {
-        addStagingImage(m_imageSize.width, m_imageSize.height);
+        m_stagingImages.push_back(createStagingImage(m_imageSize.width, m_imageSize.height));
+    }
+}
+
+void Renderer::AddHistoryPipeline(RenderPipeline* pipeline) {
+    AddPipeline(pipeline);
+    m_historyPipeline = pipeline;
+    m_historyImage = createStagingImage(
+        m_imageSize.width, m_imageSize.height, VK_IMAGE_USAGE_TRANSFER_DST_BIT
+    );
+
+    commandBufferBegin();
+    VkImageMemoryBarrier2 imageBarrier = {};
+    imageBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2;
+    imageBarrier.image = m_historyImage.image;
+    imageBarrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    imageBarrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+    imageBarrier.srcStageMask = VK_PIPELINE_STAGE_2_NONE;
+    imageBarrier.dstStageMask = VK_PIPELINE_STAGE_2_CLEAR_BIT;
+    imageBarrier.dstAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT;
+    imageBarrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    imageBarrier.subresourceRange.layerCount = 1;
+    imageBarrier.subresourceRange.levelCount = 1;
+    PipelineBarrier(m_commandBuffer, nullptr, &imageBarrier, 1);
+    VkClearColorValue clearColor = {};
+    vkCmdClearColorImage(
+        m_commandBuffer,
+        m_historyImage.image,
+        VK_IMAGE_LAYOUT_GENERAL,
+        &clearColor,
+        1,
+        &imageBarrier.subresourceRange
+    );
+    // The render waits for the fence of this submit, no barrier is needed after the clear
+    commandBufferSubmit();
+    m_historyImage.layout = VK_IMAGE_LAYOUT_GENERAL;
+}
+
+void Renderer::SetReprojectionPipeline(RenderPipeline* pipeline) {
+    pipeline->SetPushConstantSize(sizeof(Reprojection));
+    m_reprojectionPipeline = pipeline;
+    m_reprojectionImage = createStagingImage(m_imageSize.width, m_imageSize.height);
+}
+
+bool Renderer::SupportsReprojection() const { return m_reprojectionPipeline != nullptr; }
+
+void Renderer::CreateOutput(
+    uint32_t width,
+    uint32_t height,
+    ExternalHandle handle,
+    uint32_t count,
+    const ModifierFilter& modifierFilter
+) {
+    if (m_outputFormat != m_format) {
+        if (!m_pipelines.back()->HasOutputShader()) {
+            throw std::runtime_error("Renderer: the last pipeline can't write the output format");
+        }
+        m_pipelines.back()->useOutputShader();
+    }
+    // The driver compiles while the outputs are allocated
+    std::future<void> built = std::async(std::launch::async, [this] { buildPipelines(); });
+
+    m_outputs.resize(count);
+    for (Output& output : m_outputs) {
+        createOutput(output, width, height, handle, modifierFilter);
     }
+    built.get();
+
+    // Begin, compute begin and one timestamp after each pipeline per output
+    m_queriesPerOutput = m_pipelines.size() + 2;
+    m_queryResults.resize(m_queriesPerOutput);
+    m_stageTimings.reserve(m_pipelines.size());
+
+    VkQueryPoolCreateInfo queryPoolInfo = {};
+    queryPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    queryPoolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+    queryPoolInfo.queryCount = m_queriesPerOutput * count;
+    VK_CHECK(vkCreateQueryPool(m_dev, &queryPoolInfo, nullptr, &m_queryPool));
+
+    tuneWorkgroupSizes();
 }
 
-void Renderer::CreateOutput(uint32_t width, uint32_t height, ExternalHandle handle) {
-    m_output.imageInfo = {};
-    m_output.imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
-    m_output.imageInfo.imageType = VK_IMAGE_TYPE_2D;
-    m_output.imageInfo.format = m_format;
-    m_output.imageInfo.extent.width = width;
-    m_output.imageInfo.extent.height = height;
-    m_output.imageInfo.extent.depth = 1;
-    m_output.imageInfo.mipLevels = 1;
-    m_output.imageInfo.arrayLayers = 1;
-    m_output.imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
-    m_output.imageInfo.usage = VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
-    m_output.imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-    m_output.imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+bool Renderer::SupportsLinearOutput() const {
+    const VkFormatFeatureFlags features
+        = VK_FORMAT_FEATURE_STORAGE_IMAGE_BIT | VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT;
+    VkFormatProperties props = {};
+    vkGetPhysicalDeviceFormatProperties(m_physDev, m_outputFormat, &props);
+    return (props.linearTilingFeatures & features) == features;
+}
+
+void Renderer::createOutput(
+    Output& output,
+    uint32_t width,
+    uint32_t height,
+    ExternalHandle handle,
+    const ModifierFilter& modifierFilter
+) {
+    output.imageInfo = {};
+    output.imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    output.imageInfo.imageType = VK_IMAGE_TYPE_2D;
+    output.imageInfo.format = m_outputFormat;
+    output.imageInfo.extent.width = width;
+    output.imageInfo.extent.height = height;
+    output.imageInfo.extent.depth = 1;
+    output.imageInfo.mipLevels = 1;
+    output.imageInfo.arrayLayers = 1;
+    output.imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+    output.imageInfo.usage = VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+    // The encoder reads the outputs on its own queue family when Renderer has a dedicated compute
+    // family. Concurrent sharing avoids ownership transfers ffmpeg and the encoders don't do.
+    if (m_outputQueueFamilies.empty()) {
+        output.imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    } else {
+        output.imageInfo.sharingMode = VK_SHARING_MODE_CONCURRENT;
+        output.imageInfo.queueFamilyIndexCount = m_outputQueueFamilies.size();
+        output.imageInfo.pQueueFamilyIndices = m_outputQueueFamilies.data();
+    }
+    output.imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
 
     std::vector<VkDrmFormatModifierPropertiesEXT> modifierProps;
 
@@ -294,8 +538,8 @@ void Renderer::CreateOutput(uint32_t width, uint32_t height, ExternalHandle hand
         VkImageDrmFormatModifierListCreateInfoEXT modifierListInfo = {};
         modifierListInfo.sType = VK_STRUCTURE_TYPE_IMAGE_DRM_FORMAT_MODIFIER_LIST_CREATE_INFO_EXT;
 
-        m_output.imageInfo.pNext = &modifierListInfo;
-        m_output.imageInfo.tiling = VK_IMAGE_TILING_DRM_FORMAT_MODIFIER_EXT;
+        output.imageInfo.pNext = &modifierListInfo;
+        output.imageInfo.tiling = VK_IMAGE_TILING_DRM_FORMAT_MODIFIER_EXT;
 
         VkDrmFormatModifierPropertiesListEXT modifierPropsList = {};
         modifierPropsList.sType = VK_STRUCTURE_TYPE_DRM_FORMAT_MODIFIER_PROPERTIES_LIST_EXT;
@@ -303,37 +547,36 @@ void Renderer::CreateOutput(uint32_t width, uint32_t height, ExternalHandle hand
         VkFormatProperties2 formatProps = {};
         formatProps.sType = VK_STRUCTURE_TYPE_FORMAT_PROPERTIES_2;
         formatProps.pNext = &modifierPropsList;
-        vkGetPhysicalDeviceFormatProperties2(m_physDev, m_output.imageInfo.format, &formatProps);
+        vkGetPhysicalDeviceFormatProperties2(m_physDev, output.imageInfo.format, &formatProps);
 
         modifierProps.resize(modifierPropsList.drmFormatModifierCount);
         modifierPropsList.pDrmFormatModifierProperties = modifierProps.data();
-        vkGetPhysicalDeviceFormatProperties2(m_physDev, m_output.imageInfo.format, &formatProps);
+        vkGetPhysicalDeviceFormatProperties2(m_physDev, output.imageInfo.format, &formatProps);
 
+        // The driver picks the best of the list for the usage, which is a compressed one when
+        // the encoder can read it
         std::vector<uint64_t> imageModifiers;
+        std::vector<uint64_t> fallbackModifiers;
         std::cout << "Available modifiers:" << std::endl;
         for (const VkDrmFormatModifierPropertiesEXT& prop : modifierProps) {
             std::cout << "modifier: " << prop.drmFormatModifier
                       << " planes: " << prop.drmFormatModifierPlaneCount << std::endl;
-            if (!filter_modifier(prop.drmFormatModifier)) {
-                std::cout << " filtered" << std::endl;
-                continue;
-            }
 
             VkPhysicalDeviceImageDrmFormatModifierInfoEXT modInfo = {};
             modInfo.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_IMAGE_DRM_FORMAT_MODIFIER_INFO_EXT;
             modInfo.drmFormatModifier = prop.drmFormatModifier;
-            modInfo.sharingMode = m_output.imageInfo.sharingMode;
-            modInfo.queueFamilyIndexCount = m_output.imageInfo.queueFamilyIndexCount;
-            modInfo.pQueueFamilyIndices = m_output.imageInfo.pQueueFamilyIndices;
+            modInfo.sharingMode = output.imageInfo.sharingMode;
+            modInfo.queueFamilyIndexCount = output.imageInfo.queueFamilyIndexCount;
+            modInfo.pQueueFamilyIndices = output.imageInfo.pQueueFamilyIndices;
 
             VkPhysicalDeviceImageFormatInfo2 formatInfo = {};
             formatInfo.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_IMAGE_FORMAT_INFO_2;
             formatInfo.pNext = &modInfo;
-            formatInfo.format = m_output.imageInfo.format;
-            formatInfo.type = m_output.imageInfo.imageType;
-            formatInfo.tiling = m_output.imageInfo.tiling;
-            formatInfo.usage = m_output.imageInfo.usage;
-            formatInfo.flags = m_output.imageInfo.flags;
+            formatInfo.format = output.imageInfo.format;
+            formatInfo.type = output.imageInfo.imageType;
+            formatInfo.tiling = output.imageInfo.tiling;
+            formatInfo.usage = output.imageInfo.usage;
+            formatInfo.flags = output.imageInfo.flags;
 
             VkImageFormatProperties2 imageFormatProps = {};
             imageFormatProps.sType = VK_STRUCTURE_TYPE_IMAGE_FORMAT_PROPERTIES_2;
@@ -342,32 +585,49 @@ void Renderer::CreateOutput(uint32_t width, uint32_t height, ExternalHandle hand
             VkResult r = vkGetPhysicalDeviceImageFormatProperties2(
                 m_physDev, &formatInfo, &imageFormatProps
             );
-            if (r == VK_SUCCESS) {
+            if (r != VK_SUCCESS) {
+                continue;
+            }
+            bool importable = modifierFilter
+                ? modifierFilter(to_drm_format(output.imageInfo.format), prop.drmFormatModifier)
+                : filter_modifier(prop.drmFormatModifier);
+            if (importable) {
                 imageModifiers.push_back(prop.drmFormatModifier);
+            } else {
+                std::cout << " filtered" << std::endl;
+            }
+            if (filter_modifier(prop.drmFormatModifier)) {
+                fallbackModifiers.push_back(prop.drmFormatModifier);
             }
         }
+        if (imageModifiers.empty()) {
+            std::cout << "No modifier accepted by the encoder, using the default ones" << std::endl;
+            imageModifiers = fallbackModifiers;
+        }
         modifierListInfo.drmFormatModifierCount = imageModifiers.size();
         modifierListInfo.pDrmFormatModifiers = imageModifiers.data();
 
         extMemImageInfo.handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT;
         modifierListInfo.pNext = &extMemImageInfo;
 
-        VK_CHECK(vkCreateImage(m_dev, &m_output.imageInfo, nullptr, &m_output.image));
+        VK_CHECK(vkCreateImage(m_dev, &output.imageInfo, nullptr, &output.image));
     } else if (d.haveDmaBuf && handle == ExternalHandle::DmaBuf) {
         extMemImageInfo.handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT;
-        m_output.imageInfo.pNext = &extMemImageInfo;
+        output.imageInfo.pNext = &extMemImageInfo;
 
-        m_output.imageInfo.tiling = VK_IMAGE_TILING_LINEAR;
-        VK_CHECK(vkCreateImage(m_dev, &m_output.imageInfo, nullptr, &m_output.image));
-    } else if (handle == ExternalHandle::OpaqueFd) {
+        output.imageInfo.tiling = VK_IMAGE_TILING_LINEAR;
+        VK_CHECK(vkCreateImage(m_dev, &output.imageInfo, nullptr, &output.image));
+    } else if (handle == ExternalHandle::OpaqueFd || handle == ExternalHandle::OpaqueFdLinear) {
         extMemImageInfo.handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_OPAQUE_FD_BIT;
-        m_output.imageInfo.pNext = &extMemImageInfo;
+        output.imageInfo.pNext = &extMemImageInfo;
 
-        m_output.imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
-        VK_CHECK(vkCreateImage(m_dev, &m_output.imageInfo, nullptr, &m_output.image));
+        output.imageInfo.tiling = handle == ExternalHandle::OpaqueFdLinear
+            ? VK_IMAGE_TILING_LINEAR
+            : VK_IMAGE_TILING_OPTIMAL;
+        VK_CHECK(vkCreateImage(m_dev, &output.imageInfo, nullptr, &output.image));
     } else {
-        m_output.imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
-        VK_CHECK(vkCreateImage(m_dev, &m_output.imageInfo, nullptr, &m_output.image));
+        output.imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+        VK_CHECK(vkCreateImage(m_dev, &output.imageInfo, nullptr, &output.image));
     }
 
     VkMemoryDedicatedRequirements mdr = {};
@@ -379,9 +639,9 @@ void Renderer::CreateOutput(uint32_t width, uint32_t height, ExternalHandle hand
 
     VkImageMemoryRequirementsInfo2 memoryReqsInfo = {};
     memoryReqsInfo.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_REQUIREMENTS_INFO_2;
-    memoryReqsInfo.image = m_output.image;
+    memoryReqsInfo.image = output.image;
     vkGetImageMemoryRequirements2(m_dev, &memoryReqsInfo, &memoryReqs);
-    m_output.size = memoryReqs.memoryRequirements.size;
+    output.size = memoryReqs.memoryRequirements.size;
 
     VkExportMemoryAllocateInfo memory_export_info = {};
     memory_export_info.sType = VK_STRUCTURE_TYPE_EXPORT_MEMORY_ALLOCATE_INFO;
@@ -389,7 +649,7 @@ void Renderer::CreateOutput(uint32_t width, uint32_t height, ExternalHandle hand
 
     VkMemoryDedicatedAllocateInfo memory_dedicated_info = {};
     memory_dedicated_info.sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_ALLOCATE_INFO;
-    memory_dedicated_info.image = m_output.image;
+    memory_dedicated_info.image = output.image;
     if (handle != ExternalHandle::None) {
         memory_dedicated_info.pNext = &memory_export_info;
     }
@@ -401,12 +661,15 @@ void Renderer::CreateOutput(uint32_t width, uint32_t height, ExternalHandle hand
     memi.memoryTypeIndex = memoryTypeIndex(
         VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, memoryReqs.memoryRequirements.memoryTypeBits
     );
-    VK_CHECK(vkAllocateMemory(m_dev, &memi, nullptr, &m_output.memory));
+    VK_CHECK(vkAllocateMemory(m_dev, &memi, nullptr, &output.memory));
+    TrackGpuMemory(
+        output.memory, "Renderer output", GpuMemoryType::DeviceLocal, memi.allocationSize
+    );
 
     VkBindImageMemoryInfo bimi = {};
     bimi.sType = VK_STRUCTURE_TYPE_BIND_IMAGE_MEMORY_INFO;
-    bimi.image = m_output.image;
-    bimi.memory = m_output.memory;
+    bimi.image = output.image;
+    bimi.memory = output.memory;
     bimi.memoryOffset = 0;
     VK_CHECK(vkBindImageMemory2(m_dev, 1, &bimi));
 
@@ -414,33 +677,34 @@ void Renderer::CreateOutput(uint32_t width, uint32_t height, ExternalHandle hand
     if (d.haveDmaBuf) {
         VkMemoryGetFdInfoKHR memoryGetFdInfo = {};
         memoryGetFdInfo.sType = VK_STRUCTURE_TYPE_MEMORY_GET_FD_INFO_KHR;
-        memoryGetFdInfo.memory = m_output.memory;
+        memoryGetFdInfo.memory = output.memory;
         memoryGetFdInfo.handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT;
-        VkResult res = d.vkGetMemoryFdKHR(m_dev, &memoryGetFdInfo, &m_output.drm.fd);
+        VkResult res = d.vkGetMemoryFdKHR(m_dev, &memoryGetFdInfo, &output.drm.fd);
         if (res != VK_SUCCESS) {
             std::cout << "vkGetMemoryFdKHR " << result_to_str(res) << std::endl;
         } else {
             if (d.haveDrmModifiers) {
                 VkImageDrmFormatModifierPropertiesEXT imageDrmProps = {};
                 imageDrmProps.sType = VK_STRUCTURE_TYPE_IMAGE_DRM_FORMAT_MODIFIER_PROPERTIES_EXT;
-                d.vkGetImageDrmFormatModifierPropertiesEXT(m_dev, m_output.image, &imageDrmProps);
+                d.vkGetImageDrmFormatModifierPropertiesEXT(m_dev, output.image, &imageDrmProps);
                 if (res != VK_SUCCESS) {
                     std::cout << "vkGetImageDrmFormatModifierPropertiesEXT " << result_to_str(res)
                               << std::endl;
                 } else {
-                    m_output.drm.modifier = imageDrmProps.drmFormatModifier;
+                    output.drm.modifier = imageDrmProps.drmFormatModifier;
+                    std::cout << "Output modifier: " << output.drm.modifier << std::endl;
                     for (VkDrmFormatModifierPropertiesEXT prop : modifierProps) {
-                        if (prop.drmFormatModifier == m_output.drm.modifier) {
-                            m_output.drm.planes = prop.drmFormatModifierPlaneCount;
+                        if (prop.drmFormatModifier == output.drm.modifier) {
+                            output.drm.planes = prop.drmFormatModifierPlaneCount;
                         }
                     }
                 }
             } else {
-                m_output.drm.modifier = DRM_FORMAT_MOD_INVALID;
-                m_output.drm.planes = 1;
+                output.drm.modifier = DRM_FORMAT_MOD_INVALID;
+                output.drm.planes = 1;
             }
 
-            for (uint32_t i = 0; i < m_output.drm.planes; i++) {
+            for (uint32_t i = 0; i < output.drm.planes; i++) {
                 VkImageSubresource subresource = {};
                 if (d.haveDrmModifiers) {
                     subresource.aspectMask = VK_IMAGE_ASPECT_MEMORY_PLANE_0_BIT_EXT << i;
@@ -448,19 +712,19 @@ void Renderer::CreateOutput(uint32_t width, uint32_t height, ExternalHandle hand
                     subresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
                 }
                 VkSubresourceLayout layout;
-                vkGetImageSubresourceLayout(m_dev, m_output.image, &subresource, &layout);
-                m_output.drm.strides[i] = layout.rowPitch;
-                m_output.drm.offsets[i] = layout.offset;
+                vkGetImageSubresourceLayout(m_dev, output.image, &subresource, &layout);
+                output.drm.strides[i] = layout.rowPitch;
+                output.drm.offsets[i] = layout.offset;
             }
         }
-        m_output.drm.format = to_drm_format(m_output.imageInfo.format);
+        output.drm.format = to_drm_format(output.imageInfo.format);
     }
 
     VkImageViewCreateInfo viewInfo = {};
     viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
     viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
-    viewInfo.format = m_output.imageInfo.format;
-    viewInfo.image = m_output.image;
+    viewInfo.format = output.imageInfo.format;
+    viewInfo.image = output.image;
     viewInfo.subresourceRange = {};
     viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
     viewInfo.subresourceRange.baseMipLevel = 0;
@@ -471,25 +735,115 @@ void Renderer::CreateOutput(uint32_t width, uint32_t height, ExternalHandle hand
     viewInfo.components.g = VK_COMPONENT_SWIZZLE_IDENTITY;
     viewInfo.components.b = VK_COMPONENT_SWIZZLE_IDENTITY;
     viewInfo.components.a = VK_COMPONENT_SWIZZLE_IDENTITY;
-    VK_CHECK(vkCreateImageView(m_dev, &viewInfo, nullptr, &m_output.view));
+    VK_CHECK(vkCreateImageView(m_dev, &viewInfo, nullptr, &output.view));
+
+    // Linear outputs are read by CUDA, which waits on the imported semaphore
+    VkExportSemaphoreCreateInfo exportSemInfo = {};
+    exportSemInfo.sType = VK_STRUCTURE_TYPE_EXPORT_SEMAPHORE_CREATE_INFO;
+    exportSemInfo.handleTypes = VK_EXTERNAL_SEMAPHORE_HANDLE_TYPE_OPAQUE_FD_BIT;
+
+    VkSemaphoreTypeCreateInfo timelineInfo = {};
+    timelineInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+    timelineInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+    if (handle == ExternalHandle::OpaqueFdLinear) {
+        timelineInfo.pNext = &exportSemInfo;
+    }
+
+    VkSemaphoreCreateInfo semInfo = {};
+    semInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    semInfo.pNext = &timelineInfo;
+    VK_CHECK(vkCreateSemaphore(m_dev, &semInfo, nullptr, &output.semaphore));
+
+    VkCommandBufferAllocateInfo commandBufferInfo = {};
+    commandBufferInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    commandBufferInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    commandBufferInfo.commandPool = m_commandPool;
+    commandBufferInfo.commandBufferCount = 1;
+    VK_CHECK(vkAllocateCommandBuffers(m_dev, &commandBufferInfo, &output.commandBuffer));
+    output.recordedCommandBuffers.assign(m_images.size(), VK_NULL_HANDLE);
+    output.recordedPushConstantsVersions.assign(m_images.size(), 0);
+
+    if (handle == ExternalHandle::DmaBuf && d.haveDmaBuf) {
+        createSyncFileSemaphore(output);
+    }
+}
+
+void Renderer::createSyncFileSemaphore(Output& output) {
+    VkPhysicalDeviceExternalSemaphoreInfo externalInfo = {};
+    externalInfo.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTERNAL_SEMAPHORE_INFO;
+    externalInfo.handleType = VK_EXTERNAL_SEMAPHORE_HANDLE_TYPE_SYNC_FD_BIT;
+
+    VkExternalSemaphoreProperties externalProps = {};
+    externalProps.sType = VK_STRUCTURE_TYPE_EXTERNAL_SEMAPHORE_PROPERTIES;
+    vkGetPhysicalDeviceExternalSemaphoreProperties(m_physDev, &externalInfo, &externalProps);
+    if (!(externalProps.externalSemaphoreFeatures & VK_EXTERNAL_SEMAPHORE_FEATURE_EXPORTABLE_BIT)) {
+        return;
+    }
+
+    VkExportSemaphoreCreateInfo exportInfo = {};
+    exportInfo.sType = VK_STRUCTURE_TYPE_EXPORT_SEMAPHORE_CREATE_INFO;
+    exportInfo.handleTypes = VK_EXTERNAL_SEMAPHORE_HANDLE_TYPE_SYNC_FD_BIT;
 
     VkSemaphoreCreateInfo semInfo = {};
     semInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
-    VK_CHECK(vkCreateSemaphore(m_dev, &semInfo, nullptr, &m_output.semaphore));
+    semInfo.pNext = &exportInfo;
+    VK_CHECK(vkCreateSemaphore(m_dev, &semInfo, nullptr, &output.syncFileSemaphore));
 }
 
-void Renderer::ImportOutput(const DrmImage& drm) {
-    vkDestroyImageView(m_dev, m_output.view, nullptr);
-    vkDestroyImage(m_dev, m_output.image, nullptr);
-    vkFreeMemory(m_dev, m_output.memory, nullptr);
+// Returns false if the kernel can't import fences into dma-bufs, in which case the semaphore is
+// dropped and readers fall back to Sync
+bool Renderer::attachSyncFile(Output& output) {
+    VkSemaphoreGetFdInfoKHR fdInfo = {};
+    fdInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_GET_FD_INFO_KHR;
+    fdInfo.semaphore = output.syncFileSemaphore;
+    fdInfo.handleType = VK_EXTERNAL_SEMAPHORE_HANDLE_TYPE_SYNC_FD_BIT;
+    int syncFile = -1;
+    VK_CHECK(d.vkGetSemaphoreFdKHR(m_dev, &fdInfo, &syncFile));
+
+    // -1 means the fence already signaled
+    if (syncFile == -1) {
+        return true;
+    }
 
-    m_output.drm = drm;
-    m_output.imageInfo.tiling = VK_IMAGE_TILING_DRM_FORMAT_MODIFIER_EXT;
+    dma_buf_import_sync_file import = {};
+    import.flags = DMA_BUF_SYNC_WRITE;
+    import.fd = syncFile;
+    int ret = ioctl(output.drm.fd, DMA_BUF_IOCTL_IMPORT_SYNC_FILE, &import);
+    close(syncFile);
+    if (ret != 0) {
+        std::cout << "DMA_BUF_IOCTL_IMPORT_SYNC_FILE failed, falling back to CPU sync: "
+                  << strerror(errno) << std::endl;
+        vkDestroySemaphore(m_dev, output.syncFileSemaphore, nullptr);
+        output.syncFileSemaphore = VK_NULL_HANDLE;
+        return false;
+    }
+    return true;
+}
+
+void Renderer::ImportOutput(uint32_t outputIndex, const DrmImage& drm) {
+    Output& output = m_outputs[outputIndex];
+
+    vkDestroyImageView(m_dev, output.view, nullptr);
+    vkDestroyImage(m_dev, output.image, nullptr);
+    UntrackGpuMemory(output.memory);
+    vkFreeMemory(m_dev, output.memory, nullptr);
+
+    // Recorded commands reference the old image
+    for (VkCommandBuffer& commandBuffer : output.recordedCommandBuffers) {
+        if (commandBuffer != VK_NULL_HANDLE) {
+            vkFreeCommandBuffers(m_dev, m_commandPool, 1, &commandBuffer);
+            commandBuffer = VK_NULL_HANDLE;
+        }
+    }
+    output.layout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+    output.drm = drm;
+    output.imageInfo.tiling = VK_IMAGE_TILING_DRM_FORMAT_MODIFIER_EXT;
 
     VkExternalMemoryImageCreateInfo extMemImageInfo = {};
     extMemImageInfo.sType = VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_IMAGE_CREATE_INFO;
     extMemImageInfo.handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT;
-    m_output.imageInfo.pNext = &extMemImageInfo;
+    output.imageInfo.pNext = &extMemImageInfo;
 
     VkSubresourceLayout layouts[4] = {};
     for (uint32_t i = 0; i < drm.planes; ++i) {
@@ -503,7 +857,7 @@ void Renderer::ImportOutput(const DrmImage& drm) {
     modifierInfo.pPlaneLayouts = layouts;
     extMemImageInfo.pNext = &modifierInfo;
 
-    VK_CHECK(vkCreateImage(m_dev, &m_output.imageInfo, NULL, &m_output.image));
+    VK_CHECK(vkCreateImage(m_dev, &output.imageInfo, NULL, &output.image));
 
     VkMemoryFdPropertiesKHR fdProps = {};
     fdProps.sType = VK_STRUCTURE_TYPE_MEMORY_FD_PROPERTIES_KHR;
@@ -512,7 +866,7 @@ void Renderer::ImportOutput(const DrmImage& drm) {
     ));
 
     VkImageMemoryRequirementsInfo2 memoryReqsInfo = {};
-    memoryReqsInfo.image = m_output.image;
+    memoryReqsInfo.image = output.image;
     memoryReqsInfo.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_REQUIREMENTS_INFO_2;
 
     VkMemoryRequirements2 memoryReqs = {};
@@ -534,23 +888,27 @@ void Renderer::ImportOutput(const DrmImage& drm) {
 
     VkMemoryDedicatedAllocateInfo dedicatedMemInfo = {};
     dedicatedMemInfo.sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_ALLOCATE_INFO;
-    dedicatedMemInfo.image = m_output.image;
+    dedicatedMemInfo.image = output.image;
     importMemInfo.pNext = &dedicatedMemInfo;
 
-    VK_CHECK(vkAllocateMemory(m_dev, &memoryAllocInfo, NULL, &m_output.memory));
+    VK_CHECK(vkAllocateMemory(m_dev, &memoryAllocInfo, NULL, &output.memory));
+    // The encoder allocated the surface, its pool is accounted for by the encoder
+    TrackGpuMemory(
+        output.memory, "Renderer output", GpuMemoryType::Imported, memoryAllocInfo.allocationSize
+    );
 
     VkBindImageMemoryInfo bindInfo = {};
     bindInfo.sType = VK_STRUCTURE_TYPE_BIND_IMAGE_MEMORY_INFO;
-    bindInfo.image = m_output.image;
-    bindInfo.memory = m_output.memory;
+    bindInfo.image = output.image;
+    bindInfo.memory = output.memory;
     bindInfo.memoryOffset = 0;
     VK_CHECK(vkBindImageMemory2(m_dev, 1, &bindInfo));
 
     VkImageViewCreateInfo viewInfo = {};
     viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
     viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
-    viewInfo.format = m_output.imageInfo.format;
-    viewInfo.image = m_output.image;
+    viewInfo.format = output.imageInfo.format;
+    viewInfo.image = output.image;
     viewInfo.subresourceRange = {};
     viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
     viewInfo.subresourceRange.baseMipLevel = 0;
@@ -561,10 +919,48 @@ void Renderer::ImportOutput(const DrmImage& drm) {
     viewInfo.components.g = VK_COMPONENT_SWIZZLE_IDENTITY;
     viewInfo.components.b = VK_COMPONENT_SWIZZLE_IDENTITY;
     viewInfo.components.a = VK_COMPONENT_SWIZZLE_IDENTITY;
-    VK_CHECK(vkCreateImageView(m_dev, &viewInfo, nullptr, &m_output.view));
+    VK_CHECK(vkCreateImageView(m_dev, &viewInfo, nullptr, &output.view));
+}
+
+void Renderer::Render(
+    uint32_t index,
+    uint64_t waitValue,
+    uint32_t outputIndex,
+    const Reprojection* reprojection,
+    int syncFile
+) {
+    Render(index, waitValue, outputIndex, {}, reprojection, syncFile);
 }
 
-void Renderer::Render(uint32_t index, uint64_t waitValue) {
+void Renderer::Render(
+    uint32_t index,
+    uint64_t waitValue,
+    uint32_t outputIndex,
+    const std::vector<SignalOperation>& signals,
+    const Reprojection* reprojection,
+    int syncFile
+) {
+    ALVR_PROFILE_ZONE("Renderer::Render");
+    Output& output = m_outputs[outputIndex];
+
+    VkSemaphore inputSemaphore = m_images[index].semaphore;
+    if (syncFile != -1) {
+        if (importSyncFile(m_images[index], syncFile)) {
+            inputSemaphore = m_images[index].syncSemaphore;
+        } else {
+            close(syncFile);
+        }
+    }
+
+    // The encoder has released this output, this only waits if the GPU is still running the
+    // previous Render into it
+    VkSemaphoreWaitInfo outputWaitInfo = {};
+    outputWaitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+    outputWaitInfo.semaphoreCount = 1;
+    outputWaitInfo.pSemaphores = &output.semaphore;
+    outputWaitInfo.pValues = &output.semaphoreValue;
+    VK_CHECK(vkWaitSemaphores(m_dev, &outputWaitInfo, UINT64_MAX));
+
     if (!m_inputImageCapture.empty()) {
         VkSemaphoreWaitInfo waitInfo = {};
         waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
@@ -584,12 +980,186 @@ void Renderer::Render(uint32_t index, uint64_t waitValue) {
         m_inputImageCapture.clear();
     }
 
+    // Once the input, output and staging images are in the layouts every Render leaves them in,
+    // the commands for an input/output pair only change with the push constants and are recorded
+    // again when those do. Reprojected frames push a new rotation each time.
+    VkCommandBuffer commandBuffer = output.commandBuffer;
+    if (reprojection) {
+        recordRender(commandBuffer, index, outputIndex, reprojection);
+    } else if (m_renderCount > 0
+               && m_images[index].layout == VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL
+               && output.layout == VK_IMAGE_LAYOUT_GENERAL) {
+        VkCommandBuffer& recorded = output.recordedCommandBuffers[index];
+        if (recorded == VK_NULL_HANDLE) {
+            VkCommandBufferAllocateInfo commandBufferInfo = {};
+            commandBufferInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+            commandBufferInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+            commandBufferInfo.commandPool = m_commandPool;
+            commandBufferInfo.commandBufferCount = 1;
+            VK_CHECK(vkAllocateCommandBuffers(m_dev, &commandBufferInfo, &recorded));
+            recordRender(recorded, index, outputIndex, nullptr);
+            output.recordedPushConstantsVersions[index] = m_pushConstantsVersion;
+        } else if (output.recordedPushConstantsVersions[index] != m_pushConstantsVersion) {
+            // Not pending anymore, like output.commandBuffer
+            recordRender(recorded, index, outputIndex, nullptr);
+            output.recordedPushConstantsVersions[index] = m_pushConstantsVersion;
+        }
+        commandBuffer = recorded;
+    } else {
+        recordRender(commandBuffer, index, outputIndex, nullptr);
+    }
+    m_renderCount++;
+
+    output.semaphoreValue++;
+
+    // The input is only read by the compute shaders. The signals also cover the timestamp writes,
+    // which are read without waiting once the output semaphore is signaled.
+    VkSemaphoreSubmitInfo waitInfo = {};
+    waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO;
+    // The binary semaphore ignores waitValue
+    waitInfo.semaphore = inputSemaphore;
+    waitInfo.value = waitValue;
+    waitInfo.stageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+
+    std::vector<VkSemaphoreSubmitInfo>& signalInfos = m_signalInfos;
+    signalInfos.clear();
+    VkSemaphoreSubmitInfo signalInfo = {};
+    signalInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO;
+    signalInfo.stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT;
+    signalInfo.semaphore = output.semaphore;
+    signalInfo.value = output.semaphoreValue;
+    signalInfos.push_back(signalInfo);
+    bool signalSyncFile = output.syncFileSemaphore != VK_NULL_HANDLE && output.drm.fd != -1;
+    if (signalSyncFile) {
+        signalInfo.semaphore = output.syncFileSemaphore;
+        signalInfo.value = 0;
+        signalInfos.push_back(signalInfo);
+    }
+    for (const SignalOperation& signal : signals) {
+        signalInfo.semaphore = signal.semaphore;
+        signalInfo.value = signal.value;
+        signalInfos.push_back(signalInfo);
+    }
+
+    VkCommandBufferSubmitInfo commandBufferInfo = {};
+    commandBufferInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO;
+    commandBufferInfo.commandBuffer = commandBuffer;
+
+    VkSubmitInfo2 submitInfo = {};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO_2;
+    submitInfo.waitSemaphoreInfoCount = 1;
+    submitInfo.pWaitSemaphoreInfos = &waitInfo;
+    submitInfo.signalSemaphoreInfoCount = signalInfos.size();
+    submitInfo.pSignalSemaphoreInfos = signalInfos.data();
+    submitInfo.commandBufferInfoCount = 1;
+    submitInfo.pCommandBufferInfos = &commandBufferInfo;
+    QueueSubmit(submitInfo, VK_NULL_HANDLE);
+
+    output.implicitSync = signalSyncFile && attachSyncFile(output);
+
+    if (!m_outputImageCapture.empty()) {
+        Sync(outputIndex);
+        dumpImage(
+            output.image,
+            output.view,
+            output.layout,
+            output.imageInfo.extent.width,
+            output.imageInfo.extent.height,
+            m_outputImageCapture
+        );
+        m_outputImageCapture.clear();
+    }
+}
+
+// The import is temporary, the semaphore goes back to being unsignaled once the Render waited on it
+bool Renderer::importSyncFile(InputImage& image, int syncFile) {
+    if (image.syncSemaphore == VK_NULL_HANDLE) {
+        VkSemaphoreCreateInfo semInfo = {};
+        semInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+        VK_CHECK(vkCreateSemaphore(m_dev, &semInfo, nullptr, &image.syncSemaphore));
+    }
+
+    VkImportSemaphoreFdInfoKHR importInfo = {};
+    importInfo.sType = VK_STRUCTURE_TYPE_IMPORT_SEMAPHORE_FD_INFO_KHR;
+    importInfo.semaphore = image.syncSemaphore;
+    importInfo.flags = VK_SEMAPHORE_IMPORT_TEMPORARY_BIT;
+    importInfo.handleType = VK_EXTERNAL_SEMAPHORE_HANDLE_TYPE_SYNC_FD_BIT;
+    importInfo.fd = syncFile;
+    VkResult result = d.vkImportSemaphoreFdKHR(m_dev, &importInfo);
+    if (result != VK_SUCCESS) {
+        std::cerr << "Failed to import present sync_file: " << result << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void Renderer::recordRender(
+    VkCommandBuffer commandBuffer,
+    uint32_t index,
+    uint32_t outputIndex,
+    const Reprojection* reprojection
+) {
+    Output& output = m_outputs[outputIndex];
+
     VkCommandBufferBeginInfo commandBufferBegin = {};
     commandBufferBegin.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-    VK_CHECK(vkBeginCommandBuffer(m_commandBuffer, &commandBufferBegin));
+    VK_CHECK(vkBeginCommandBuffer(commandBuffer, &commandBufferBegin));
+
+    const uint32_t queryBase = m_queriesPerOutput * outputIndex;
+    vkCmdResetQueryPool(commandBuffer, m_queryPool, queryBase, m_queriesPerOutput);
+    vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, m_queryPool, queryBase);
+    // Written once the wait for the input image is over
+    vkCmdWriteTimestamp(
+        commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, m_queryPool, queryBase + 1
+    );
+
+    if (reprojection) {
+        auto& img = m_images[index];
+
+        // The reprojection image was written and read by the previous frame. The reads only need
+        // the execution dependency.
+        VkMemoryBarrier2 memoryBarrier = {};
+        memoryBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER_2;
+        memoryBarrier.srcStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+        memoryBarrier.srcAccessMask = VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT;
+        memoryBarrier.dstStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+        memoryBarrier.dstAccessMask = VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT;
+
+        // The layout transitions follow the input semaphore wait, which is at the compute stage
+        VkImageMemoryBarrier2 imageBarrier = {};
+        imageBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2;
+        imageBarrier.srcStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+        imageBarrier.srcAccessMask = VK_ACCESS_2_NONE;
+        imageBarrier.dstStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+        imageBarrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        imageBarrier.subresourceRange.layerCount = 1;
+        imageBarrier.subresourceRange.levelCount = 1;
+        std::array<VkImageMemoryBarrier2, 2> imageBarriers;
+        uint32_t imageBarrierCount = 0;
+        if (img.layout != VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL) {
+            imageBarrier.image = img.image;
+            imageBarrier.oldLayout = img.layout;
+            img.layout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+            imageBarrier.newLayout = img.layout;
+            imageBarrier.dstAccessMask = VK_ACCESS_2_SHADER_SAMPLED_READ_BIT;
+            imageBarriers[imageBarrierCount++] = imageBarrier;
+        }
+        if (m_reprojectionImage.layout != VK_IMAGE_LAYOUT_GENERAL) {
+            imageBarrier.image = m_reprojectionImage.image;
+            imageBarrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+            m_reprojectionImage.layout = VK_IMAGE_LAYOUT_GENERAL;
+            imageBarrier.newLayout = m_reprojectionImage.layout;
+            imageBarrier.dstAccessMask = VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT;
+            imageBarriers[imageBarrierCount++] = imageBarrier;
+        }
+        PipelineBarrier(commandBuffer, &memoryBarrier, imageBarriers.data(), imageBarrierCount);
 
-    vkCmdResetQueryPool(m_commandBuffer, m_queryPool, 0, 2);
-    vkCmdWriteTimestamp(m_commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, m_queryPool, 0);
+        VkRect2D rect = {};
+        rect.extent = m_imageSize;
+        m_reprojectionPipeline->Render(
+            commandBuffer, img.view, m_reprojectionImage.view, rect, reprojection
+        );
+    }
 
     for (size_t i = 0; i < m_pipelines.size(); ++i) {
         VkRect2D rect = {};
@@ -599,7 +1169,11 @@ void Renderer::Render(uint32_t index, uint64_t waitValue) {
         VkImage out = VK_NULL_HANDLE;
         VkImageView outView = VK_NULL_HANDLE;
         VkImageLayout* outLayout = nullptr;
-        if (i == 0) {
+        if (i == 0 && reprojection) {
+            in = m_reprojectionImage.image;
+            inView = m_reprojectionImage.view;
+            inLayout = &m_reprojectionImage.layout;
+        } else if (i == 0) {
             auto& img = m_images[index];
             in = img.image;
             inView = img.view;
@@ -611,11 +1185,11 @@ void Renderer::Render(uint32_t index, uint64_t waitValue) {
             inLayout = &img.layout;
         }
         if (i == m_pipelines.size() - 1) {
-            out = m_output.image;
-            outView = m_output.view;
-            outLayout = &m_output.layout;
-            rect.extent.width = m_output.imageInfo.extent.width;
-            rect.extent.height = m_output.imageInfo.extent.height;
+            out = output.image;
+            outView = output.view;
+            outLayout = &output.layout;
+            rect.extent.width = output.imageInfo.extent.width;
+            rect.extent.height = output.imageInfo.extent.height;
         } else {
             auto& img = m_stagingImages[i % m_stagingImages.size()];
             out = img.image;
@@ -623,88 +1197,98 @@ void Renderer::Render(uint32_t index, uint64_t waitValue) {
             outLayout = &img.layout;
             rect.extent = m_imageSize;
         }
-        VkImageMemoryBarrier imageBarrier = {};
-        imageBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        // Staging images are shared by all outputs and with the previous pass, and a previous
+        // frame may still be running on the queue
+        VkMemoryBarrier2 memoryBarrier = {};
+        memoryBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER_2;
+        memoryBarrier.srcStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+        memoryBarrier.srcAccessMask = VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT;
+        memoryBarrier.dstStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+        // The history image is read as a storage image
+        memoryBarrier.dstAccessMask = VK_ACCESS_2_SHADER_SAMPLED_READ_BIT
+            | VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT;
+
+        VkImageMemoryBarrier2 imageBarrier = {};
+        imageBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2;
+        imageBarrier.srcStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+        imageBarrier.srcAccessMask = VK_ACCESS_2_NONE;
+        imageBarrier.dstStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
         imageBarrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
         imageBarrier.subresourceRange.layerCount = 1;
         imageBarrier.subresourceRange.levelCount = 1;
-        std::vector<VkImageMemoryBarrier> imageBarriers;
+        std::array<VkImageMemoryBarrier2, 2> imageBarriers;
+        uint32_t imageBarrierCount = 0;
         if (*inLayout != VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL) {
             imageBarrier.image = in;
             imageBarrier.oldLayout = *inLayout;
             *inLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
             imageBarrier.newLayout = *inLayout;
-            imageBarrier.srcAccessMask = 0;
-            imageBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
-            imageBarriers.push_back(imageBarrier);
+            imageBarrier.dstAccessMask = VK_ACCESS_2_SHADER_SAMPLED_READ_BIT;
+            imageBarriers[imageBarrierCount++] = imageBarrier;
         }
         if (*outLayout != VK_IMAGE_LAYOUT_GENERAL) {
             imageBarrier.image = out;
             imageBarrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
             *outLayout = VK_IMAGE_LAYOUT_GENERAL;
             imageBarrier.newLayout = *outLayout;
-            imageBarrier.srcAccessMask = 0;
-            imageBarrier.dstAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
-            imageBarriers.push_back(imageBarrier);
-        }
-        if (imageBarriers.size()) {
-            vkCmdPipelineBarrier(
-                m_commandBuffer,
-                VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
-                VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
-                0,
-                0,
-                nullptr,
-                0,
-                nullptr,
-                imageBarriers.size(),
-                imageBarriers.data()
-            );
+            imageBarrier.dstAccessMask = VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT;
+            imageBarriers[imageBarrierCount++] = imageBarrier;
         }
-        m_pipelines[i]->Render(inView, outView, rect);
+        PipelineBarrier(commandBuffer, &memoryBarrier, imageBarriers.data(), imageBarrierCount);
+        const void* pushConstants
+            = m_pipelines[i]->m_pushConstantSize ? m_pipelines[i]->m_pushConstants.data() : nullptr;
+        VkImageView history = m_pipelines[i] == m_historyPipeline ? m_historyImage.view
+                                                                   : VK_NULL_HANDLE;
+        m_pipelines[i]->Render(commandBuffer, inView, outView, rect, pushConstants, history);
+
+        vkCmdWriteTimestamp(
+            commandBuffer,
+            i == m_pipelines.size() - 1 ? VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT
+                                        : VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+            m_queryPool,
+            queryBase + 2 + i
+        );
     }
 
-    vkCmdWriteTimestamp(m_commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, m_queryPool, 1);
+    VK_CHECK(vkEndCommandBuffer(commandBuffer));
+}
 
-    VK_CHECK(vkEndCommandBuffer(m_commandBuffer));
+void Renderer::Sync(uint32_t outputIndex) {
+    const Output& output = m_outputs[outputIndex];
 
-    VkTimelineSemaphoreSubmitInfo timelineInfo = {};
-    timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
-    timelineInfo.waitSemaphoreValueCount = 1;
-    timelineInfo.pWaitSemaphoreValues = &waitValue;
-
-    VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
-
-    VkSubmitInfo submitInfo = {};
-    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-    submitInfo.pNext = &timelineInfo;
-    submitInfo.waitSemaphoreCount = 1;
-    submitInfo.pWaitSemaphores = &m_images[index].semaphore;
-    submitInfo.pWaitDstStageMask = &waitStage;
-    submitInfo.signalSemaphoreCount = 1;
-    submitInfo.pSignalSemaphores = &m_output.semaphore;
-    submitInfo.commandBufferCount = 1;
-    submitInfo.pCommandBuffers = &m_commandBuffer;
-    VK_CHECK(vkQueueSubmit(m_queue, 1, &submitInfo, nullptr));
+    VkSemaphoreWaitInfo waitInfo = {};
+    waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+    waitInfo.semaphoreCount = 1;
+    waitInfo.pSemaphores = &output.semaphore;
+    waitInfo.pValues = &output.semaphoreValue;
+    VK_CHECK(vkWaitSemaphores(m_dev, &waitInfo, UINT64_MAX));
 }
 
-void Renderer::Sync() {
-    VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
-
-    VkSubmitInfo submitInfo = {};
-    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-    submitInfo.waitSemaphoreCount = 1;
-    submitInfo.pWaitSemaphores = &m_output.semaphore;
-    submitInfo.pWaitDstStageMask = &waitStage;
-    VK_CHECK(vkQueueSubmit(m_queue, 1, &submitInfo, m_fence));
+void Renderer::QueueSubmit(const VkSubmitInfo2& submitInfo, VkFence fence) {
+    std::lock_guard lock(m_queueMutex);
+    VK_CHECK(d.vkQueueSubmit2KHR(m_queue, 1, &submitInfo, fence));
+}
 
-    VK_CHECK(vkWaitForFences(m_dev, 1, &m_fence, VK_TRUE, UINT64_MAX));
-    VK_CHECK(vkResetFences(m_dev, 1, &m_fence));
+void Renderer::PipelineBarrier(
+    VkCommandBuffer commandBuffer,
+    const VkMemoryBarrier2* memoryBarrier,
+    const VkImageMemoryBarrier2* imageBarriers,
+    uint32_t imageBarrierCount
+) {
+    VkDependencyInfo dependencyInfo = {};
+    dependencyInfo.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO;
+    dependencyInfo.memoryBarrierCount = memoryBarrier ? 1 : 0;
+    dependencyInfo.pMemoryBarriers = memoryBarrier;
+    dependencyInfo.imageMemoryBarrierCount = imageBarrierCount;
+    dependencyInfo.pImageMemoryBarriers = imageBarriers;
+    d.vkCmdPipelineBarrier2KHR(commandBuffer, &dependencyInfo);
 }
 
-Renderer::Output& Renderer::GetOutput() { return m_output; }
+Renderer::Output& Renderer::GetOutput(uint32_t outputIndex) { return m_outputs[outputIndex]; }
 
-Renderer::Timestamps Renderer::GetTimestamps() {
+uint32_t Renderer::GetOutputCount() const { return m_outputs.size(); }
+
+Renderer::Timestamps Renderer::GetTimestamps(uint32_t outputIndex) {
     if (!d.haveCalibratedTimestamps) {
         return { 0, 0, 0 };
     }
@@ -713,37 +1297,181 @@ Renderer::Timestamps Renderer::GetTimestamps() {
     VK_CHECK(vkGetQueryPoolResults(
         m_dev,
         m_queryPool,
-        0,
-        2,
-        2 * sizeof(uint64_t),
-        queries,
+        m_queriesPerOutput * outputIndex,
+        1,
+        sizeof(uint64_t),
+        &queries[0],
+        sizeof(uint64_t),
+        VK_QUERY_RESULT_64_BIT
+    ));
+    VK_CHECK(vkGetQueryPoolResults(
+        m_dev,
+        m_queryPool,
+        m_queriesPerOutput * (outputIndex + 1) - 1,
+        1,
+        sizeof(uint64_t),
+        &queries[1],
         sizeof(uint64_t),
         VK_QUERY_RESULT_64_BIT
     ));
     queries[0] *= m_timestampPeriod;
     queries[1] *= m_timestampPeriod;
 
+    uint64_t timestamp = GetDeviceTimestamp();
+
+    return { timestamp, queries[0], queries[1] };
+}
+
+const std::vector<Renderer::StageTiming>& Renderer::GetStageTimings(uint32_t outputIndex) {
+    m_stageTimings.clear();
+    if (!d.haveCalibratedTimestamps) {
+        return m_stageTimings;
+    }
+
+    VK_CHECK(vkGetQueryPoolResults(
+        m_dev,
+        m_queryPool,
+        m_queriesPerOutput * outputIndex,
+        m_queriesPerOutput,
+        m_queryResults.size() * sizeof(uint64_t),
+        m_queryResults.data(),
+        sizeof(uint64_t),
+        VK_QUERY_RESULT_64_BIT
+    ));
+
+    for (size_t i = 0; i < m_pipelines.size(); ++i) {
+        uint64_t ticks = m_queryResults[i + 2] - m_queryResults[i + 1];
+        m_stageTimings.push_back(
+            { m_pipelines[i]->GetName().c_str(), uint64_t(ticks * m_timestampPeriod) }
+        );
+    }
+
+    return m_stageTimings;
+}
+
+uint64_t Renderer::GetDeviceTimestamp() {
+    if (!d.haveCalibratedTimestamps) {
+        return 0;
+    }
+
     VkCalibratedTimestampInfoEXT timestampInfo = {};
     timestampInfo.sType = VK_STRUCTURE_TYPE_CALIBRATED_TIMESTAMP_INFO_EXT;
     timestampInfo.timeDomain = VK_TIME_DOMAIN_DEVICE_EXT;
     uint64_t deviation;
     uint64_t timestamp;
     VK_CHECK(d.vkGetCalibratedTimestampsEXT(m_dev, 1, &timestampInfo, &timestamp, &deviation));
-    timestamp *= m_timestampPeriod;
+    return timestamp * m_timestampPeriod;
+}
 
-    if (!m_outputImageCapture.empty()) {
-        dumpImage(
-            m_output.image,
-            m_output.view,
-            m_output.layout,
-            m_output.imageInfo.extent.width,
-            m_output.imageInfo.extent.height,
-            m_outputImageCapture
-        );
-        m_outputImageCapture.clear();
+uint64_t Renderer::ToSteadyTimeNs(uint64_t deviceNs) {
+    if (!d.haveCalibratedTimestamps) {
+        return 0;
     }
 
-    return { timestamp, queries[0], queries[1] };
+    uint64_t cpuNs = GetSteadyTimeNs();
+    if (m_clockCalibration.NeedsSample(cpuNs)) {
+        if (d.haveMonotonicTimeDomain) {
+            VkCalibratedTimestampInfoEXT timestampInfos[2] = {};
+            timestampInfos[0].sType = VK_STRUCTURE_TYPE_CALIBRATED_TIMESTAMP_INFO_EXT;
+            timestampInfos[0].timeDomain = VK_TIME_DOMAIN_DEVICE_EXT;
+            timestampInfos[1].sType = VK_STRUCTURE_TYPE_CALIBRATED_TIMESTAMP_INFO_EXT;
+            timestampInfos[1].timeDomain = VK_TIME_DOMAIN_CLOCK_MONOTONIC_EXT;
+            uint64_t timestamps[2];
+            uint64_t deviation;
+            VK_CHECK(
+                d.vkGetCalibratedTimestampsEXT(m_dev, 2, timestampInfos, timestamps, &deviation)
+            );
+            m_clockCalibration.AddSample(
+                timestamps[0] * m_timestampPeriod, timestamps[1], deviation
+            );
+        } else {
+            // The GPU time is taken to the middle of two reads of the steady clock
+            uint64_t gpuNs = GetDeviceTimestamp();
+            uint64_t afterNs = GetSteadyTimeNs();
+            m_clockCalibration.AddSample(gpuNs, cpuNs + (afterNs - cpuNs) / 2, afterNs - cpuNs);
+        }
+    }
+
+    return m_clockCalibration.ToSteadyTimeNs(deviceNs);
+}
+
+void Renderer::LoadPipelineCache(const std::string& directory) {
+    VkPhysicalDeviceIDProperties idProps = {};
+    idProps.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ID_PROPERTIES;
+    VkPhysicalDeviceProperties2 props = {};
+    props.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+    props.pNext = &idProps;
+    vkGetPhysicalDeviceProperties2(m_physDev, &props);
+
+    // Pipeline cache contents are only valid for the same device and driver
+    std::string name = "vulkan_pipeline_cache_";
+    char hex[3];
+    for (uint8_t byte : idProps.deviceUUID) {
+        snprintf(hex, sizeof(hex), "%02x", byte);
+        name += hex;
+    }
+    name += "_" + std::to_string(props.properties.driverVersion);
+    m_pipelineCachePath = (std::filesystem::path(directory) / (name + ".bin")).string();
+    // The tuned workgroup sizes are as specific to the device and driver
+    m_workgroupSizesPath = (std::filesystem::path(directory) / (name + "_workgroups.txt")).string();
+
+    std::vector<char> data;
+    std::ifstream is(m_pipelineCachePath, std::ios::binary | std::ios::in | std::ios::ate);
+    if (is.is_open()) {
+        data.resize(is.tellg());
+        is.seekg(0, std::ios::beg);
+        is.read(data.data(), data.size());
+        if (!is) {
+            data.clear();
+        }
+    }
+
+    // Drivers must reject incompatible data, but an unexpected header is not worth the risk
+    VkPipelineCacheHeaderVersionOne header = {};
+    if (data.size() >= sizeof(header)) {
+        memcpy(&header, data.data(), sizeof(header));
+    }
+    if (header.headerVersion != VK_PIPELINE_CACHE_HEADER_VERSION_ONE
+        || header.vendorID != props.properties.vendorID
+        || header.deviceID != props.properties.deviceID
+        || memcmp(header.pipelineCacheUUID, props.properties.pipelineCacheUUID, VK_UUID_SIZE)
+            != 0) {
+        data.clear();
+    }
+
+    VkPipelineCacheCreateInfo cacheInfo = {};
+    cacheInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+    cacheInfo.initialDataSize = data.size();
+    cacheInfo.pInitialData = data.data();
+    VK_CHECK(vkCreatePipelineCache(m_dev, &cacheInfo, nullptr, &m_pipelineCache));
+}
+
+void Renderer::SavePipelineCache() {
+    if (m_pipelineCache == VK_NULL_HANDLE) {
+        return;
+    }
+
+    size_t size = 0;
+    VK_CHECK(vkGetPipelineCacheData(m_dev, m_pipelineCache, &size, nullptr));
+    std::vector<char> data(size);
+    VK_CHECK(vkGetPipelineCacheData(m_dev, m_pipelineCache, &size, data.data()));
+
+    // Written next to the cache and renamed, so concurrent readers never see a partial file
+    std::string tmpPath = m_pipelineCachePath + ".tmp";
+    {
+        std::ofstream os(tmpPath, std::ios::binary | std::ios::out | std::ios::trunc);
+        os.write(data.data(), size);
+        if (!os) {
+            std::cerr << "Failed to write pipeline cache " << tmpPath << std::endl;
+            return;
+        }
+    }
+    std::error_code ec;
+    std::filesystem::rename(tmpPath, m_pipelineCachePath, ec);
+    if (ec) {
+        std::cerr << "Failed to write pipeline cache " << m_pipelineCachePath << ": "
+                  << ec.message() << std::endl;
+    }
 }
 
 void Renderer::CaptureInputFrame(const std::string& filename) { m_inputImageCapture = filename; }
@@ -791,6 +1519,243 @@ std::string Renderer::result_to_str(VkResult result) {
     }
 }
 
+void Renderer::buildPipelines() {
+    std::vector<RenderPipeline*> pipelines = m_pipelines;
+    if (m_reprojectionPipeline) {
+        pipelines.push_back(m_reprojectionPipeline);
+    }
+    // The pipeline cache is synchronized by the driver, each pipeline is built by one thread
+    std::atomic<size_t> next = 0;
+    auto build = [&] {
+        for (size_t i = next++; i < pipelines.size(); i = next++) {
+            pipelines[i]->Build();
+        }
+    };
+    std::vector<std::future<void>> threads;
+    for (size_t i = 1; i < std::min<size_t>(BUILD_THREADS, pipelines.size()); i++) {
+        threads.push_back(std::async(std::launch::async, build));
+    }
+    build();
+    for (std::future<void>& thread : threads) {
+        thread.get();
+    }
+}
+
+void Renderer::tuneWorkgroupSizes() {
+    std::vector<RenderPipeline*> pipelines;
+    for (RenderPipeline* pipeline : m_pipelines) {
+        if (pipeline->m_workgroupSizeConstants) {
+            pipelines.push_back(pipeline);
+        }
+    }
+    if (m_reprojectionPipeline && m_reprojectionPipeline->m_workgroupSizeConstants) {
+        pipelines.push_back(m_reprojectionPipeline);
+    }
+    if (pipelines.empty() || m_workgroupSizesPath.empty()) {
+        return;
+    }
+    // Writes the outputs, the other pipelines write staging images of the input size
+    RenderPipeline* lastPipeline = m_pipelines.empty() ? nullptr : m_pipelines.back();
+
+    // Lines of name, output size and workgroup size. Deleting the file tunes again.
+    std::map<std::string, VkExtent2D> sizes;
+    {
+        std::ifstream is(m_workgroupSizesPath);
+        std::string name, extent;
+        VkExtent2D size;
+        while (is >> name >> extent >> size.width >> size.height) {
+            sizes[name + " " + extent] = size;
+        }
+    }
+
+    VkPhysicalDeviceProperties props = {};
+    vkGetPhysicalDeviceProperties(m_physDev, &props);
+    uint32_t familyCount = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(m_physDev, &familyCount, nullptr);
+    std::vector<VkQueueFamilyProperties> families(familyCount);
+    vkGetPhysicalDeviceQueueFamilyProperties(m_physDev, &familyCount, families.data());
+    const bool haveTimestamps = families[m_queueFamilyIndex].timestampValidBits > 0;
+
+    // Created on the first pipeline to time. The contents do not matter, only the sizes.
+    StagingImage input = {};
+    StagingImage output = {};
+    VkQueryPool queryPool = VK_NULL_HANDLE;
+    auto createResources = [&]() {
+        input = createStagingImage(m_imageSize.width, m_imageSize.height);
+        output = createStagingImage(m_imageSize.width, m_imageSize.height);
+
+        VkQueryPoolCreateInfo queryPoolInfo = {};
+        queryPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+        queryPoolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+        queryPoolInfo.queryCount = 2;
+        VK_CHECK(vkCreateQueryPool(m_dev, &queryPoolInfo, nullptr, &queryPool));
+
+        VkImageMemoryBarrier2 imageBarrier = {};
+        imageBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2;
+        imageBarrier.srcStageMask = VK_PIPELINE_STAGE_2_NONE;
+        imageBarrier.dstStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+        imageBarrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+        imageBarrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        imageBarrier.subresourceRange.layerCount = 1;
+        imageBarrier.subresourceRange.levelCount = 1;
+        std::array<VkImageMemoryBarrier2, 3> imageBarriers;
+        uint32_t imageBarrierCount = 0;
+        imageBarrier.image = input.image;
+        imageBarrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+        imageBarrier.dstAccessMask = VK_ACCESS_2_SHADER_SAMPLED_READ_BIT;
+        imageBarriers[imageBarrierCount++] = imageBarrier;
+        imageBarrier.image = output.image;
+        imageBarrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+        imageBarrier.dstAccessMask = VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT;
+        imageBarriers[imageBarrierCount++] = imageBarrier;
+        // The last pipeline is timed writing the first output, which no Render used yet
+        if (m_outputs[0].layout != VK_IMAGE_LAYOUT_GENERAL) {
+            imageBarrier.image = m_outputs[0].image;
+            imageBarriers[imageBarrierCount++] = imageBarrier;
+            m_outputs[0].layout = VK_IMAGE_LAYOUT_GENERAL;
+        }
+        commandBufferBegin();
+        PipelineBarrier(m_commandBuffer, nullptr, imageBarriers.data(), imageBarrierCount);
+        commandBufferSubmit();
+    };
+
+    // GPU time of one dispatch in ticks, at the current workgroup size of pipeline
+    auto timeDispatch = [&](RenderPipeline* pipeline) {
+        const bool last = pipeline == lastPipeline;
+        VkRect2D rect = {};
+        rect.extent = last ? VkExtent2D { m_outputs[0].imageInfo.extent.width,
+                                          m_outputs[0].imageInfo.extent.height }
+                           : m_imageSize;
+        VkImageView out = last ? m_outputs[0].view : output.view;
+        const void* pushConstants
+            = pipeline->m_pushConstantSize ? pipeline->m_pushConstants.data() : nullptr;
+        VkImageView history = pipeline == m_historyPipeline ? m_historyImage.view : VK_NULL_HANDLE;
+
+        // Like between the passes of Render, so that the dispatches do not overlap
+        VkMemoryBarrier2 memoryBarrier = {};
+        memoryBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER_2;
+        memoryBarrier.srcStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+        memoryBarrier.srcAccessMask = VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT;
+        memoryBarrier.dstStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+        memoryBarrier.dstAccessMask = VK_ACCESS_2_SHADER_STORAGE_READ_BIT
+            | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT;
+
+        commandBufferBegin();
+        vkCmdResetQueryPool(m_commandBuffer, queryPool, 0, 2);
+        pipeline->Render(m_commandBuffer, input.view, out, rect, pushConstants, history);
+        PipelineBarrier(m_commandBuffer, &memoryBarrier, nullptr, 0);
+        vkCmdWriteTimestamp(m_commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, queryPool, 0);
+        for (uint32_t i = 0; i < TUNING_DISPATCHES; ++i) {
+            pipeline->Render(m_commandBuffer, input.view, out, rect, pushConstants, history);
+            PipelineBarrier(m_commandBuffer, &memoryBarrier, nullptr, 0);
+        }
+        vkCmdWriteTimestamp(m_commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, queryPool, 1);
+        commandBufferSubmit();
+
+        uint64_t queries[2];
+        VK_CHECK(vkGetQueryPoolResults(
+            m_dev,
+            queryPool,
+            0,
+            2,
+            sizeof(queries),
+            queries,
+            sizeof(uint64_t),
+            VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT
+        ));
+        return (queries[1] - queries[0]) / TUNING_DISPATCHES;
+    };
+
+    bool tuned = false;
+    for (RenderPipeline* pipeline : pipelines) {
+        const bool last = pipeline == lastPipeline;
+        const VkExtent3D& outputExtent = m_outputs[0].imageInfo.extent;
+        std::string extent = last
+            ? std::to_string(outputExtent.width) + "x" + std::to_string(outputExtent.height)
+            : std::to_string(m_imageSize.width) + "x" + std::to_string(m_imageSize.height);
+        std::string key = pipeline->GetName() + " " + extent;
+
+        auto it = sizes.find(key);
+        if (it != sizes.end()) {
+            pipeline->setWorkgroupSize(it->second);
+            continue;
+        }
+        if (!haveTimestamps) {
+            continue;
+        }
+        if (queryPool == VK_NULL_HANDLE) {
+            createResources();
+        }
+
+        VkExtent2D best = pipeline->m_workgroupSize;
+        uint64_t bestTicks = UINT64_MAX;
+        for (const VkExtent2D& size : WORKGROUP_SIZES) {
+            if (size.width * size.height > props.limits.maxComputeWorkGroupInvocations
+                || size.width > props.limits.maxComputeWorkGroupSize[0]
+                || size.height > props.limits.maxComputeWorkGroupSize[1]) {
+                continue;
+            }
+            pipeline->setWorkgroupSize(size);
+            uint64_t ticks = timeDispatch(pipeline);
+            if (ticks < bestTicks) {
+                best = size;
+                bestTicks = ticks;
+            }
+        }
+        pipeline->setWorkgroupSize(best);
+        sizes[key] = best;
+        tuned = true;
+
+        // The history written by the timed dispatches would blend into the first frames
+        if (pipeline == m_historyPipeline) {
+            VkImageMemoryBarrier2 imageBarrier = {};
+            imageBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2;
+            imageBarrier.image = m_historyImage.image;
+            imageBarrier.oldLayout = VK_IMAGE_LAYOUT_GENERAL;
+            imageBarrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+            imageBarrier.srcStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+            imageBarrier.srcAccessMask = VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT;
+            imageBarrier.dstStageMask = VK_PIPELINE_STAGE_2_CLEAR_BIT;
+            imageBarrier.dstAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT;
+            imageBarrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+            imageBarrier.subresourceRange.layerCount = 1;
+            imageBarrier.subresourceRange.levelCount = 1;
+            commandBufferBegin();
+            PipelineBarrier(m_commandBuffer, nullptr, &imageBarrier, 1);
+            VkClearColorValue clearColor = {};
+            vkCmdClearColorImage(
+                m_commandBuffer,
+                m_historyImage.image,
+                VK_IMAGE_LAYOUT_GENERAL,
+                &clearColor,
+                1,
+                &imageBarrier.subresourceRange
+            );
+            commandBufferSubmit();
+        }
+    }
+
+    if (queryPool != VK_NULL_HANDLE) {
+        vkDestroyQueryPool(m_dev, queryPool, nullptr);
+        for (const StagingImage& image : { input, output }) {
+            vkDestroyImageView(m_dev, image.view, nullptr);
+            vkDestroyImage(m_dev, image.image, nullptr);
+            UntrackGpuMemory(image.memory);
+            vkFreeMemory(m_dev, image.memory, nullptr);
+        }
+    }
+
+    if (tuned) {
+        std::ofstream os(m_workgroupSizesPath, std::ios::out | std::ios::trunc);
+        for (const auto& [key, size] : sizes) {
+            os << key << " " << size.width << " " << size.height << "\n";
+        }
+        if (!os) {
+            std::cerr << "Failed to write workgroup sizes " << m_workgroupSizesPath << std::endl;
+        }
+    }
+}
+
 void Renderer::commandBufferBegin() {
     VkCommandBufferBeginInfo commandBufferBegin = {};
     commandBufferBegin.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
@@ -800,20 +1765,25 @@ void Renderer::commandBufferBegin() {
 void Renderer::commandBufferSubmit() {
     VK_CHECK(vkEndCommandBuffer(m_commandBuffer));
 
-    VkSubmitInfo submitInfo = {};
-    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-    submitInfo.commandBufferCount = 1;
-    submitInfo.pCommandBuffers = &m_commandBuffer;
+    VkCommandBufferSubmitInfo commandBufferInfo = {};
+    commandBufferInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO;
+    commandBufferInfo.commandBuffer = m_commandBuffer;
+
+    VkSubmitInfo2 submitInfo = {};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO_2;
+    submitInfo.commandBufferInfoCount = 1;
+    submitInfo.pCommandBufferInfos = &commandBufferInfo;
     VkFenceCreateInfo fenceInfo = {};
     fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
     VkFence fence;
     VK_CHECK(vkCreateFence(m_dev, &fenceInfo, nullptr, &fence));
-    VK_CHECK(vkQueueSubmit(m_queue, 1, &submitInfo, fence));
+    QueueSubmit(submitInfo, fence);
     VK_CHECK(vkWaitForFences(m_dev, 1, &fence, VK_TRUE, UINT64_MAX));
     vkDestroyFence(m_dev, fence, nullptr);
 }
 
-void Renderer::addStagingImage(uint32_t width, uint32_t height) {
+Renderer::StagingImage
+Renderer::createStagingImage(uint32_t width, uint32_t height, VkImageUsageFlags extraUsage) {
     VkImageCreateInfo imageInfo = {};
     imageInfo = {};
     imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
@@ -826,7 +1796,7 @@ void Renderer::addStagingImage(uint32_t width, uint32_t height) {
     imageInfo.arrayLayers = 1;
     imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
     imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
-    imageInfo.usage = VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+    imageInfo.usage = VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT | extraUsage;
     imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
     imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
     VkImage image;
@@ -841,6 +1811,9 @@ void Renderer::addStagingImage(uint32_t width, uint32_t height) {
         = memoryTypeIndex(VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, memoryReqs.memoryTypeBits);
     VkDeviceMemory memory;
     VK_CHECK(vkAllocateMemory(m_dev, &memoryAllocInfo, nullptr, &memory));
+    TrackGpuMemory(
+        memory, "Renderer staging", GpuMemoryType::DeviceLocal, memoryAllocInfo.allocationSize
+    );
     VK_CHECK(vkBindImageMemory(m_dev, image, memory, 0));
 
     VkImageViewCreateInfo viewInfo = {};
@@ -861,7 +1834,7 @@ void Renderer::addStagingImage(uint32_t width, uint32_t height) {
     VkImageView view;
     VK_CHECK(vkCreateImageView(m_dev, &viewInfo, nullptr, &view));
 
-    m_stagingImages.push_back({ image, VK_IMAGE_LAYOUT_UNDEFINED, memory, view });
+    return { image, VK_IMAGE_LAYOUT_UNDEFINED, memory, view };
 }
 
 void Renderer::dumpImage(
@@ -920,27 +1893,25 @@ void Renderer::dumpImage(
     VkImageView dstView;
     VK_CHECK(vkCreateImageView(m_dev, &viewInfo, nullptr, &dstView));
 
-    std::array<VkImageMemoryBarrier, 2> imageBarrierIn;
+    // The image was waited for on the host, only the layout transitions need ordering
+    std::array<VkImageMemoryBarrier2, 2> imageBarrierIn;
     imageBarrierIn[0] = {};
-    imageBarrierIn[0].sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    imageBarrierIn[0].sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2;
     imageBarrierIn[0].oldLayout = imageLayout;
     imageBarrierIn[0].newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
     imageBarrierIn[0].image = image;
     imageBarrierIn[0].subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
     imageBarrierIn[0].subresourceRange.layerCount = 1;
     imageBarrierIn[0].subresourceRange.levelCount = 1;
-    imageBarrierIn[0].srcAccessMask = 0;
-    imageBarrierIn[0].dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
-    imageBarrierIn[1] = {};
-    imageBarrierIn[1].sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    imageBarrierIn[0].srcStageMask = VK_PIPELINE_STAGE_2_NONE;
+    imageBarrierIn[0].srcAccessMask = VK_ACCESS_2_NONE;
+    imageBarrierIn[0].dstStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+    imageBarrierIn[0].dstAccessMask = VK_ACCESS_2_SHADER_SAMPLED_READ_BIT;
+    imageBarrierIn[1] = imageBarrierIn[0];
     imageBarrierIn[1].oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
     imageBarrierIn[1].newLayout = VK_IMAGE_LAYOUT_GENERAL;
     imageBarrierIn[1].image = dstImage;
-    imageBarrierIn[1].subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    imageBarrierIn[1].subresourceRange.layerCount = 1;
-    imageBarrierIn[1].subresourceRange.levelCount = 1;
-    imageBarrierIn[1].srcAccessMask = 0;
-    imageBarrierIn[1].dstAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    imageBarrierIn[1].dstAccessMask = VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT;
 
     // Shader
     VkShaderModuleCreateInfo moduleInfo = {};
@@ -969,29 +1940,31 @@ void Renderer::dumpImage(
     pipelineInfo.layout = pipelineLayout;
     pipelineInfo.stage = stageInfo;
     VkPipeline pipeline;
-    VK_CHECK(vkCreateComputePipelines(m_dev, nullptr, 1, &pipelineInfo, nullptr, &pipeline));
+    VK_CHECK(
+        vkCreateComputePipelines(m_dev, m_pipelineCache, 1, &pipelineInfo, nullptr, &pipeline)
+    );
 
-    std::array<VkImageMemoryBarrier, 2> imageBarrierOut;
+    // Back to the layout of the image, and the copy made visible to the host that maps it
+    std::array<VkImageMemoryBarrier2, 2> imageBarrierOut;
     imageBarrierOut[0] = {};
-    imageBarrierOut[0].sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    imageBarrierOut[0].sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2;
     imageBarrierOut[0].oldLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
     imageBarrierOut[0].newLayout = imageLayout;
     imageBarrierOut[0].image = image;
     imageBarrierOut[0].subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
     imageBarrierOut[0].subresourceRange.layerCount = 1;
     imageBarrierOut[0].subresourceRange.levelCount = 1;
-    imageBarrierOut[0].srcAccessMask = 0;
-    imageBarrierOut[0].dstAccessMask = 0;
-    imageBarrierOut[1] = {};
-    imageBarrierOut[1].sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    imageBarrierOut[0].srcStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+    imageBarrierOut[0].srcAccessMask = VK_ACCESS_2_NONE;
+    imageBarrierOut[0].dstStageMask = VK_PIPELINE_STAGE_2_NONE;
+    imageBarrierOut[0].dstAccessMask = VK_ACCESS_2_NONE;
+    imageBarrierOut[1] = imageBarrierOut[0];
     imageBarrierOut[1].oldLayout = VK_IMAGE_LAYOUT_GENERAL;
     imageBarrierOut[1].newLayout = VK_IMAGE_LAYOUT_GENERAL;
     imageBarrierOut[1].image = dstImage;
-    imageBarrierOut[1].subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    imageBarrierOut[1].subresourceRange.layerCount = 1;
-    imageBarrierOut[1].subresourceRange.levelCount = 1;
-    imageBarrierOut[1].srcAccessMask = 0;
-    imageBarrierOut[1].dstAccessMask = VK_ACCESS_MEMORY_READ_BIT;
+    imageBarrierOut[1].srcAccessMask = VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT;
+    imageBarrierOut[1].dstStageMask = VK_PIPELINE_STAGE_2_HOST_BIT;
+    imageBarrierOut[1].dstAccessMask = VK_ACCESS_2_HOST_READ_BIT;
 
     std::vector<VkWriteDescriptorSet> descriptorWriteSets;
 
@@ -1017,18 +1990,7 @@ void Renderer::dumpImage(
     descriptorWriteSets.push_back(descriptorWriteSet);
 
     commandBufferBegin();
-    vkCmdPipelineBarrier(
-        m_commandBuffer,
-        VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
-        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
-        0,
-        0,
-        nullptr,
-        0,
-        nullptr,
-        imageBarrierIn.size(),
-        imageBarrierIn.data()
-    );
+    PipelineBarrier(m_commandBuffer, nullptr, imageBarrierIn.data(), imageBarrierIn.size());
     vkCmdBindPipeline(m_commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
     d.vkCmdPushDescriptorSetKHR(
         m_commandBuffer,
@@ -1041,18 +2003,7 @@ void Renderer::dumpImage(
     vkCmdDispatch(
         m_commandBuffer, (imageInfo.extent.width + 7) / 8, (imageInfo.extent.height + 7) / 8, 1
     );
-    vkCmdPipelineBarrier(
-        m_commandBuffer,
-        VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
-        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
-        0,
-        0,
-        nullptr,
-        0,
-        nullptr,
-        imageBarrierOut.size(),
-        imageBarrierOut.data()
-    );
+    PipelineBarrier(m_commandBuffer, nullptr, imageBarrierOut.data(), imageBarrierOut.size());
     commandBufferSubmit();
 
     VkImageSubresource subresource = {};
@@ -1064,22 +2015,30 @@ void Renderer::dumpImage(
     VK_CHECK(vkMapMemory(m_dev, dstMemory, 0, VK_WHOLE_SIZE, 0, (void**)&imageData));
     imageData += layout.offset;
 
-    std::ofstream file(filename, std::ios::out | std::ios::binary);
-
-    // PPM header
-    file << "P6\n" << width << "\n" << height << "\n" << 255 << "\n";
-
     // PPM binary pixel data
+    std::vector<char> pixels(size_t(width) * height * 3);
+    char* pixel = pixels.data();
     for (uint32_t y = 0; y < height; y++) {
-        uint32_t* row = (uint32_t*)imageData;
+        const char* row = imageData;
         for (uint32_t x = 0; x < width; x++) {
-            file.write((char*)row++, 3);
+            memcpy(pixel, row, 3);
+            pixel += 3;
+            row += 4;
         }
         imageData += layout.rowPitch;
     }
-    file.close();
 
-    std::cout << "Image saved to \"" << filename << "\"" << std::endl;
+    // Writing a full frame takes long enough to stall streaming, it's done off the encoder thread
+    std::thread([filename, width, height, pixels = std::move(pixels)] {
+        std::ofstream file(filename, std::ios::out | std::ios::binary);
+
+        // PPM header
+        file << "P6\n" << width << "\n" << height << "\n" << 255 << "\n";
+        file.write(pixels.data(), pixels.size());
+        file.close();
+
+        std::cout << "Image saved to \"" << filename << "\"" << std::endl;
+    }).detach();
 
     vkUnmapMemory(m_dev, dstMemory);
     vkFreeMemory(m_dev, dstMemory, nullptr);
@@ -1112,6 +2071,8 @@ RenderPipeline::~RenderPipeline() {
 }
 
 void RenderPipeline::SetShader(const char* filename) {
+    m_name = std::filesystem::path(filename).filename().string();
+
     std::ifstream is(filename, std::ios::binary | std::ios::in | std::ios::ate);
     if (!is.is_open()) {
         std::cerr << "Failed to open shader file: " << filename << std::endl;
@@ -1125,6 +2086,11 @@ void RenderPipeline::SetShader(const char* filename) {
 }
 
 void RenderPipeline::SetShader(const unsigned char* data, unsigned len) {
+    // The checked in builds of some shaders predate the workgroup size constants
+    const uint32_t* code = reinterpret_cast<const uint32_t*>(data);
+    m_workgroupSizeConstants = hasSpecId(code, len / 4, WORKGROUP_SIZE_X_ID)
+        && hasSpecId(code, len / 4, WORKGROUP_SIZE_Y_ID);
+
     VkShaderModuleCreateInfo moduleInfo = {};
     moduleInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
     moduleInfo.codeSize = len;
@@ -1132,25 +2098,70 @@ void RenderPipeline::SetShader(const unsigned char* data, unsigned len) {
     VK_CHECK(vkCreateShaderModule(r->m_dev, &moduleInfo, nullptr, &m_shader));
 }
 
+void RenderPipeline::useOutputShader() {
+    vkDestroyShaderModule(r->m_dev, m_shader, nullptr);
+    SetShader(m_outputShader, m_outputShaderLen);
+}
+
+void RenderPipeline::setWorkgroupSize(VkExtent2D size) {
+    if (size.width == m_workgroupSize.width && size.height == m_workgroupSize.height) {
+        return;
+    }
+    m_workgroupSize = size;
+    vkDestroyPipeline(r->m_dev, m_pipeline, nullptr);
+    vkDestroyPipelineLayout(r->m_dev, m_pipelineLayout, nullptr);
+    Build();
+}
+
+void RenderPipeline::SetPushConstants(const void* data) {
+    if (memcmp(m_pushConstants.data(), data, m_pushConstantSize) == 0) {
+        return;
+    }
+    memcpy(m_pushConstants.data(), data, m_pushConstantSize);
+    r->m_pushConstantsVersion++;
+}
+
 void RenderPipeline::Build() {
     VkPipelineLayoutCreateInfo pipelineLayoutInfo = {};
     pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
     pipelineLayoutInfo.setLayoutCount = 1;
     pipelineLayoutInfo.pSetLayouts = &r->m_descriptorLayout;
+    VkPushConstantRange pushConstantRange = {};
+    pushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    pushConstantRange.size = m_pushConstantSize;
+    if (m_pushConstantSize) {
+        pipelineLayoutInfo.pushConstantRangeCount = 1;
+        pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
+    }
     VK_CHECK(vkCreatePipelineLayout(r->m_dev, &pipelineLayoutInfo, nullptr, &m_pipelineLayout));
 
+    // The workgroup size goes after the constants of the shader
+    std::vector<VkSpecializationMapEntry> entries = m_constantEntries;
+    std::vector<uint8_t> constants(m_constantSize);
+    if (m_constant) {
+        memcpy(constants.data(), m_constant, m_constantSize);
+    }
+    if (m_workgroupSizeConstants) {
+        const uint32_t offset = (m_constantSize + 3) & ~3u;
+        const uint32_t size[2] = { m_workgroupSize.width, m_workgroupSize.height };
+        constants.resize(offset + sizeof(size));
+        memcpy(constants.data() + offset, size, sizeof(size));
+        entries.push_back({ WORKGROUP_SIZE_X_ID, offset, sizeof(uint32_t) });
+        entries.push_back({ WORKGROUP_SIZE_Y_ID, offset + 4, sizeof(uint32_t) });
+    }
+
     VkSpecializationInfo specInfo = {};
-    specInfo.mapEntryCount = m_constantEntries.size();
-    specInfo.pMapEntries = m_constantEntries.data();
-    specInfo.dataSize = m_constantSize;
-    specInfo.pData = m_constant;
+    specInfo.mapEntryCount = entries.size();
+    specInfo.pMapEntries = entries.data();
+    specInfo.dataSize = constants.size();
+    specInfo.pData = constants.data();
 
     VkPipelineShaderStageCreateInfo stageInfo = {};
     stageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
     stageInfo.stage = VK_SHADER_STAGE_COMPUTE_BIT;
     stageInfo.pName = "main";
     stageInfo.module = m_shader;
-    if (m_constant) {
+    if (!entries.empty()) {
         stageInfo.pSpecializationInfo = &specInfo;
     }
 
@@ -1158,11 +2169,20 @@ void RenderPipeline::Build() {
     pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
     pipelineInfo.layout = m_pipelineLayout;
     pipelineInfo.stage = stageInfo;
-    VK_CHECK(vkCreateComputePipelines(r->m_dev, nullptr, 1, &pipelineInfo, nullptr, &m_pipeline));
+    VK_CHECK(vkCreateComputePipelines(
+        r->m_dev, r->m_pipelineCache, 1, &pipelineInfo, nullptr, &m_pipeline
+    ));
 }
 
-void RenderPipeline::Render(VkImageView in, VkImageView out, VkRect2D outSize) {
-    vkCmdBindPipeline(r->m_commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, m_pipeline);
+void RenderPipeline::Render(
+    VkCommandBuffer commandBuffer,
+    VkImageView in,
+    VkImageView out,
+    VkRect2D outSize,
+    const void* pushConstants,
+    VkImageView history
+) {
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, m_pipeline);
 
     VkDescriptorImageInfo descriptorImageInfoIn = {};
     descriptorImageInfoIn.imageView = in;
@@ -1172,7 +2192,11 @@ void RenderPipeline::Render(VkImageView in, VkImageView out, VkRect2D outSize) {
     descriptorImageInfoOut.imageView = out;
     descriptorImageInfoOut.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
 
-    VkWriteDescriptorSet descriptorWriteSets[2] = {};
+    VkDescriptorImageInfo descriptorImageInfoHistory = {};
+    descriptorImageInfoHistory.imageView = history;
+    descriptorImageInfoHistory.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+
+    VkWriteDescriptorSet descriptorWriteSets[3] = {};
     descriptorWriteSets[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
     descriptorWriteSets[0].descriptorCount = 1;
     descriptorWriteSets[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
@@ -1183,16 +2207,35 @@ void RenderPipeline::Render(VkImageView in, VkImageView out, VkRect2D outSize) {
     descriptorWriteSets[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
     descriptorWriteSets[1].pImageInfo = &descriptorImageInfoOut;
     descriptorWriteSets[1].dstBinding = 1;
+    descriptorWriteSets[2].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    descriptorWriteSets[2].descriptorCount = 1;
+    descriptorWriteSets[2].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+    descriptorWriteSets[2].pImageInfo = &descriptorImageInfoHistory;
+    descriptorWriteSets[2].dstBinding = 2;
     r->d.vkCmdPushDescriptorSetKHR(
-        r->m_commandBuffer,
+        commandBuffer,
         VK_PIPELINE_BIND_POINT_COMPUTE,
         m_pipelineLayout,
         0,
-        2,
+        history ? 3 : 2,
         descriptorWriteSets
     );
 
+    if (pushConstants) {
+        vkCmdPushConstants(
+            commandBuffer,
+            m_pipelineLayout,
+            VK_SHADER_STAGE_COMPUTE_BIT,
+            0,
+            m_pushConstantSize,
+            pushConstants
+        );
+    }
+
     vkCmdDispatch(
-        r->m_commandBuffer, (outSize.extent.width + 7) / 8, (outSize.extent.height + 7) / 8, 1
+        commandBuffer,
+        (outSize.extent.width + m_workgroupSize.width - 1) / m_workgroupSize.width,
+        (outSize.extent.height + m_workgroupSize.height - 1) / m_workgroupSize.height,
+        1
     );
 }
@@ -1,11 +1,15 @@
 #pragma once
 
 #include <array>
+#include <functional>
 #include <iostream>
+#include <mutex>
 #include <string>
 #include <vector>
 #include <vulkan/vulkan.h>
 
+#include "alvr_server/ClockCalibration.h"
+
 #define VK_CHECK(f)                                                                                \
     {                                                                                              \
         VkResult res = (f);                                                                        \
@@ -28,11 +32,18 @@ struct DrmImage {
     std::array<uint32_t, 4> offsets;
 };
 
+// Whether the SPIR-V code has a specialization constant with SpecId id
+bool hasSpecId(const uint32_t* code, size_t wordCount, uint32_t id);
+
 class RenderPipeline;
 
 class Renderer {
 public:
-    enum class ExternalHandle { None, DmaBuf, OpaqueFd };
+    // OpaqueFdLinear is an opaque fd export with linear tiling, which CUDA can map as a pitched
+    // buffer and hand to NVENC without a copy
+    enum class ExternalHandle { None, DmaBuf, OpaqueFd, OpaqueFdLinear };
+    // Whether the encoder can read images of a DRM fourcc and modifier
+    using ModifierFilter = std::function<bool(uint32_t format, uint64_t modifier)>;
 
     struct Output {
         VkImage image = VK_NULL_HANDLE;
@@ -40,9 +51,21 @@ public:
         VkImageCreateInfo imageInfo;
         VkDeviceSize size = 0;
         VkDeviceMemory memory = VK_NULL_HANDLE;
+        // Timeline semaphore, signaled to semaphoreValue when the last Render into it completes
         VkSemaphore semaphore = VK_NULL_HANDLE;
+        uint64_t semaphoreValue = 0;
+        // Binary semaphore exported as a sync_file after each Render and attached to the dma-buf,
+        // so that implicitly synchronized readers (VAAPI) wait for the Render on the GPU
+        VkSemaphore syncFileSemaphore = VK_NULL_HANDLE;
+        // Whether the last Render fence is attached to the dma-buf, making Sync unnecessary
+        bool implicitSync = false;
         // ---
         VkImageView view = VK_NULL_HANDLE;
+        VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
+        // Commands rendering each input image into this output, recorded once layouts are stable
+        std::vector<VkCommandBuffer> recordedCommandBuffers;
+        // Push constants version each of them was recorded with
+        std::vector<uint64_t> recordedPushConstantsVersions;
         // ---
         DrmImage drm;
     };
@@ -53,30 +76,126 @@ public:
         uint64_t renderComplete;
     };
 
+    // GPU time spent in one pass of the compose chain, or in an encoder side conversion
+    struct StageTiming {
+        const char* name;
+        uint64_t durationNs;
+    };
+
+    // Semaphore signaled by the submit of a Render along with the output semaphore, to value if it
+    // is a timeline semaphore
+    struct SignalOperation {
+        VkSemaphore semaphore;
+        uint64_t value;
+    };
+
+    // Push constants of the reprojection pipeline, see reproject.comp
+    struct Reprojection {
+        // Rows of the rotation from the new head space to the head space of the input image
+        float rotation[3][4];
+        // Projection tangents of each eye: left, right, up, down
+        float leftTangents[4];
+        float rightTangents[4];
+    };
+
     explicit Renderer(
         const VkInstance& inst,
         const VkDevice& dev,
         const VkPhysicalDevice& physDev,
         uint32_t queueIdx,
-        const std::vector<const char*>& devExtensions
+        uint32_t queueIndex,
+        const std::vector<const char*>& devExtensions,
+        std::mutex& queueMutex,
+        const std::vector<uint32_t>& outputQueueFamilies = {}
     );
     virtual ~Renderer();
 
     void Startup(uint32_t width, uint32_t height, VkFormat format);
+    // Format of the output images, the input format by default. The last pipeline of the chain
+    // then needs a shader writing it, see RenderPipeline::SetOutputShader.
+    void SetOutputFormat(VkFormat format) { m_outputFormat = format; }
+    VkFormat GetOutputFormat() const { return m_outputFormat; }
 
     void AddImage(VkImageCreateInfo imageInfo, size_t memoryIndex, int imageFd, int semaphoreFd);
+    // Destroys the input images once the Renders reading them are complete, so that the ones of
+    // a new swapchain of the same size and format can be added. Outputs and pipelines are kept.
+    void RemoveImages();
 
+    // The pipelines are built by CreateOutput
     void AddPipeline(RenderPipeline* pipeline);
+    // Adds a pipeline that also reads and writes an image of the input size at binding 2, kept
+    // from frame to frame and cleared to zero at first. It can't be the last of the chain.
+    void AddHistoryPipeline(RenderPipeline* pipeline);
+    // Warp pass run before the chain when Render is given a Reprojection. Its GPU time is
+    // reported as part of the first pipeline.
+    void SetReprojectionPipeline(RenderPipeline* pipeline);
+    bool SupportsReprojection() const;
+
+    // Creates a ring of count output images. A slot must not be rendered into again until the
+    // encoder is done reading it. DmaBuf outputs get one of the modifiers modifierFilter accepts,
+    // or without one any modifier but the compressed ones of AMD.
+    void CreateOutput(
+        uint32_t width,
+        uint32_t height,
+        ExternalHandle handle,
+        uint32_t count,
+        const ModifierFilter& modifierFilter = {}
+    );
+    // Whether output images can be created with ExternalHandle::OpaqueFdLinear
+    bool SupportsLinearOutput() const;
+    void ImportOutput(uint32_t outputIndex, const DrmImage& drm);
+
+    // The Render waits for the input image on the GPU, through syncFile if it is not -1 and
+    // otherwise until its timeline semaphore reaches waitValue. Takes ownership of syncFile.
+    void Render(
+        uint32_t index,
+        uint64_t waitValue,
+        uint32_t outputIndex,
+        const Reprojection* reprojection = nullptr,
+        int syncFile = -1
+    );
+    // Render that also signals the given semaphores, so that an encoder waiting for the output on
+    // the GPU needs no submit of its own
+    void Render(
+        uint32_t index,
+        uint64_t waitValue,
+        uint32_t outputIndex,
+        const std::vector<SignalOperation>& signals,
+        const Reprojection* reprojection = nullptr,
+        int syncFile = -1
+    );
 
-    void CreateOutput(uint32_t width, uint32_t height, ExternalHandle handle);
-    void ImportOutput(const DrmImage& drm);
+    void Sync(uint32_t outputIndex);
 
-    void Render(uint32_t index, uint64_t waitValue);
+    // vkQueueSubmit2 on m_queue, which may be shared with ffmpeg and the encoder thread
+    void QueueSubmit(const VkSubmitInfo2& submitInfo, VkFence fence);
+    // vkCmdPipelineBarrier2 with an optional global memory barrier
+    void PipelineBarrier(
+        VkCommandBuffer commandBuffer,
+        const VkMemoryBarrier2* memoryBarrier,
+        const VkImageMemoryBarrier2* imageBarriers,
+        uint32_t imageBarrierCount
+    );
 
-    void Sync();
+    Output& GetOutput(uint32_t outputIndex);
+    uint32_t GetOutputCount() const;
+    Timestamps GetTimestamps(uint32_t outputIndex);
+    // Per pipeline timings of the last Render into outputIndex, in chain order. Empty if
+    // timestamps are not supported. Valid until the next call.
+    const std::vector<StageTiming>& GetStageTimings(uint32_t outputIndex);
+    // Current GPU time in ns, in the same domain as Timestamps. 0 if not supported
+    uint64_t GetDeviceTimestamp();
+    // Steady clock time of deviceNs, a GPU time in the domain of Timestamps. The GPU clock is
+    // calibrated against CLOCK_MONOTONIC when due. 0 if timestamps are not supported
+    uint64_t ToSteadyTimeNs(uint64_t deviceNs);
 
-    Output& GetOutput();
-    Timestamps GetTimestamps();
+    // Creates the pipeline cache shared by all compute pipelines on this device from the file for
+    // this device and driver in directory. Must be called before pipelines are built.
+    void LoadPipelineCache(const std::string& directory);
+    // Writes the pipeline cache back to the file it was loaded from
+    void SavePipelineCache();
+    // Keeps the default workgroup sizes, instead of the ones tuned for this device and driver
+    void DisableWorkgroupTuning() { m_workgroupSizesPath.clear(); }
 
     void CaptureInputFrame(const std::string& filename);
     void CaptureOutputFrame(const std::string& filename);
@@ -90,6 +209,9 @@ public:
         VkDeviceMemory memory = VK_NULL_HANDLE;
         VkSemaphore semaphore = VK_NULL_HANDLE;
         VkImageView view = VK_NULL_HANDLE;
+        // Binary semaphore the sync_file of a present is temporarily imported into, created on
+        // first use
+        VkSemaphore syncSemaphore = VK_NULL_HANDLE;
     };
 
     struct StagingImage {
@@ -99,9 +221,32 @@ public:
         VkImageView view = VK_NULL_HANDLE;
     };
 
+    void createOutput(
+        Output& output,
+        uint32_t width,
+        uint32_t height,
+        ExternalHandle handle,
+        const ModifierFilter& modifierFilter
+    );
+    void createSyncFileSemaphore(Output& output);
+    bool importSyncFile(InputImage& image, int syncFile);
+    bool attachSyncFile(Output& output);
+    void recordRender(
+        VkCommandBuffer commandBuffer,
+        uint32_t index,
+        uint32_t outputIndex,
+        const Reprojection* reprojection
+    );
+    // Compiles the chain and the reprojection pipeline on a few threads, they are only built once
+    // the output format is known
+    void buildPipelines();
+    // Picks the workgroup size of each pipeline that can be specialized with one, from the file
+    // next to the pipeline cache or by timing each candidate when the file has none
+    void tuneWorkgroupSizes();
     void commandBufferBegin();
     void commandBufferSubmit();
-    void addStagingImage(uint32_t width, uint32_t height);
+    StagingImage
+    createStagingImage(uint32_t width, uint32_t height, VkImageUsageFlags extraUsage = 0);
     void dumpImage(
         VkImage image,
         VkImageView imageView,
@@ -115,35 +260,69 @@ public:
     struct {
         PFN_vkImportSemaphoreFdKHR vkImportSemaphoreFdKHR = nullptr;
         PFN_vkGetMemoryFdKHR vkGetMemoryFdKHR = nullptr;
+        PFN_vkGetSemaphoreFdKHR vkGetSemaphoreFdKHR = nullptr;
         PFN_vkGetMemoryFdPropertiesKHR vkGetMemoryFdPropertiesKHR = nullptr;
         PFN_vkGetImageDrmFormatModifierPropertiesEXT vkGetImageDrmFormatModifierPropertiesEXT
             = nullptr;
         PFN_vkGetCalibratedTimestampsEXT vkGetCalibratedTimestampsEXT = nullptr;
+        PFN_vkGetPhysicalDeviceCalibrateableTimeDomainsEXT
+            vkGetPhysicalDeviceCalibrateableTimeDomainsEXT
+            = nullptr;
         PFN_vkCmdPushDescriptorSetKHR vkCmdPushDescriptorSetKHR = nullptr;
+        PFN_vkCmdPipelineBarrier2KHR vkCmdPipelineBarrier2KHR = nullptr;
+        PFN_vkQueueSubmit2KHR vkQueueSubmit2KHR = nullptr;
+        PFN_vkGetMemoryHostPointerPropertiesEXT vkGetMemoryHostPointerPropertiesEXT = nullptr;
         bool haveDmaBuf = false;
         bool haveDrmModifiers = false;
         bool haveCalibratedTimestamps = false;
+        // Host allocations can be imported and written by shaders a byte at a time, see
+        // FormatConverter
+        bool haveExternalMemoryHost = false;
+        // CLOCK_MONOTONIC, the clock of std::chrono::steady_clock, is a calibrateable domain
+        bool haveMonotonicTimeDomain = false;
     } d;
 
-    Output m_output;
+    std::vector<Output> m_outputs;
     std::vector<InputImage> m_images;
     std::vector<StagingImage> m_stagingImages;
     std::vector<RenderPipeline*> m_pipelines;
+    RenderPipeline* m_reprojectionPipeline = nullptr;
+    // Reprojected input image, read by the first pipeline of the chain
+    StagingImage m_reprojectionImage;
+    RenderPipeline* m_historyPipeline = nullptr;
+    StagingImage m_historyImage;
 
     VkInstance m_inst = VK_NULL_HANDLE;
     VkDevice m_dev = VK_NULL_HANDLE;
     VkPhysicalDevice m_physDev = VK_NULL_HANDLE;
     VkQueue m_queue = VK_NULL_HANDLE;
     uint32_t m_queueFamilyIndex = 0;
+    uint32_t m_queueIndex = 0;
+    // Outputs are shared concurrently with these families and m_queueFamilyIndex if not empty
+    std::vector<uint32_t> m_outputQueueFamilies;
     VkFormat m_format = VK_FORMAT_UNDEFINED;
+    VkFormat m_outputFormat = VK_FORMAT_UNDEFINED;
     VkExtent2D m_imageSize = { 0, 0 };
     VkQueryPool m_queryPool = VK_NULL_HANDLE;
     VkCommandPool m_commandPool = VK_NULL_HANDLE;
     VkSampler m_sampler = VK_NULL_HANDLE;
     VkDescriptorSetLayout m_descriptorLayout = VK_NULL_HANDLE;
     VkCommandBuffer m_commandBuffer = VK_NULL_HANDLE;
-    VkFence m_fence = VK_NULL_HANDLE;
+    VkPipelineCache m_pipelineCache = VK_NULL_HANDLE;
+    std::string m_pipelineCachePath;
+    std::string m_workgroupSizesPath;
+    std::mutex& m_queueMutex;
     double m_timestampPeriod = 0;
+    ClockCalibration m_clockCalibration;
+    uint64_t m_renderCount = 0;
+    // Bumped when the push constants of a compose pipeline change
+    uint64_t m_pushConstantsVersion = 0;
+    // Per output: render begin, compute begin, then one after each pipeline
+    uint32_t m_queriesPerOutput = 0;
+    std::vector<uint64_t> m_queryResults;
+    std::vector<StageTiming> m_stageTimings;
+    // Of the submit in Render, kept so that its capacity is reused
+    std::vector<VkSemaphoreSubmitInfo> m_signalInfos;
 
     size_t m_quadShaderSize = 0;
     const uint32_t* m_quadShaderCode = nullptr;
@@ -159,6 +338,20 @@ public:
 
     void SetShader(const char* filename);
     void SetShader(const unsigned char* data, unsigned len);
+    // Variant of the shader used instead when the pipeline ends the chain of a Renderer with
+    // outputs of another format than the input
+    void SetOutputShader(const unsigned char* data, unsigned len) {
+        m_outputShader = data;
+        m_outputShaderLen = len;
+    }
+    bool HasOutputShader() const { return m_outputShaderLen > 0; }
+    // Whether the shader takes its workgroup size from specialization constants, which only
+    // builds from the current sources do
+    bool HasWorkgroupSizeConstants() const { return m_workgroupSizeConstants; }
+
+    // Used to report GPU timings. Defaults to the shader file name.
+    void SetName(const std::string& name) { m_name = name; }
+    const std::string& GetName() const { return m_name; }
 
     template <typename T>
     void SetConstants(const T* data, std::vector<VkSpecializationMapEntry>&& entries) {
@@ -167,15 +360,42 @@ public:
         m_constantEntries = std::move(entries);
     }
 
+    // Size of the push constant block of the shader, pushed with each Render
+    void SetPushConstantSize(uint32_t size) {
+        m_pushConstantSize = size;
+        m_pushConstants.assign(size, 0);
+    }
+    // Values pushed by the next Render, the recorded command buffers are recorded again on change
+    void SetPushConstants(const void* data);
+
 private:
     void Build();
-    void Render(VkImageView in, VkImageView out, VkRect2D outSize);
+    // Before the pipeline is built
+    void useOutputShader();
+    // Rebuilds the pipeline if the size changes
+    void setWorkgroupSize(VkExtent2D size);
+    void Render(
+        VkCommandBuffer commandBuffer,
+        VkImageView in,
+        VkImageView out,
+        VkRect2D outSize,
+        const void* pushConstants = nullptr,
+        VkImageView history = VK_NULL_HANDLE
+    );
 
     Renderer* r;
+    std::string m_name = "shader";
     VkShaderModule m_shader = VK_NULL_HANDLE;
+    const unsigned char* m_outputShader = nullptr;
+    unsigned m_outputShaderLen = 0;
+    // Whether the shader takes its workgroup size from specialization constants
+    bool m_workgroupSizeConstants = false;
+    VkExtent2D m_workgroupSize = { 8, 8 };
     const void* m_constant = nullptr;
     uint32_t m_constantSize = 0;
     std::vector<VkSpecializationMapEntry> m_constantEntries;
+    uint32_t m_pushConstantSize = 0;
+    std::vector<uint8_t> m_pushConstants;
     VkPipeline m_pipeline = VK_NULL_HANDLE;
     VkPipelineLayout m_pipelineLayout = VK_NULL_HANDLE;
 
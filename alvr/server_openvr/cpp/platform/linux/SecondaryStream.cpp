@@ -0,0 +1,137 @@
+#include "SecondaryStream.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "FormatConverter.h"
+#include "alvr_server/Logger.h"
+#include "alvr_server/bindings.h"
+
+namespace {
+
+// Players of the written stream can only start at a keyframe
+const int KEYFRAME_INTERVAL_S = 2;
+// Few enough to leave the CPU to the game and to a software primary encoder
+const int ENCODER_THREADS = 2;
+
+}
+
+alvr::SecondaryStream::SecondaryStream(Renderer* render, uint32_t height, uint32_t bitrateMbps)
+    : r(render) {
+    const auto* settings = Settings_Instance();
+    const VkExtent3D& outputExtent = render->GetOutput(0).imageInfo.extent;
+
+    // Even sizes for 4:2:0, with the aspect ratio of the outputs and never upscaled
+    VkExtent2D extent;
+    extent.height = std::min(height, outputExtent.height) & ~1u;
+    extent.width
+        = uint32_t(uint64_t(outputExtent.width) * extent.height / outputExtent.height) & ~1u;
+    if (extent.width == 0 || extent.height == 0) {
+        throw std::runtime_error("Invalid secondary stream size");
+    }
+
+    x264_param_default_preset(&param, "superfast", "zerolatency");
+    param.i_log_level = X264_LOG_ERROR;
+    param.i_threads = ENCODER_THREADS;
+    param.i_width = extent.width;
+    param.i_height = extent.height;
+    param.i_fps_num = std::max(settings->m_refreshRate, 1);
+    param.i_fps_den = 1;
+    // Skipped frames are not worth a timestamp, rate control goes by the nominal frame rate
+    param.b_vfr_input = 0;
+    param.i_keyint_max = param.i_fps_num * KEYFRAME_INTERVAL_S;
+    param.b_repeat_headers = 1;
+    param.b_annexb = 1;
+    param.rc.i_rc_method = X264_RC_ABR;
+    param.rc.i_bitrate = bitrateMbps * 1'000;
+    param.rc.i_vbv_max_bitrate = param.rc.i_bitrate;
+    param.rc.i_vbv_buffer_size = param.rc.i_bitrate;
+    x264_param_apply_profile(&param, "high");
+
+    enc = x264_encoder_open(&param);
+    if (!enc) {
+        throw std::runtime_error("Failed to open secondary stream encoder");
+    }
+
+    for (uint32_t i = 0; i < render->GetOutputCount(); ++i) {
+        const Renderer::Output& output = render->GetOutput(i);
+        converters.push_back(std::make_unique<ScaleYuv420>(
+            render, output.image, output.imageInfo, output.semaphore, extent
+        ));
+    }
+
+    Info("Secondary video stream %ux%u at %u Mbps", extent.width, extent.height, bitrateMbps);
+
+    thread = std::thread(&SecondaryStream::Run, this);
+}
+
+alvr::SecondaryStream::~SecondaryStream() {
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        exiting = true;
+    }
+    cv.notify_one();
+    thread.join();
+
+    // Waits for a conversion the encoder thread didn't pick up
+    converters.clear();
+    x264_encoder_close(enc);
+}
+
+void alvr::SecondaryStream::Submit(uint32_t outputIndex, uint64_t targetTimestampNs) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (busy || pending) {
+        return;
+    }
+
+    FormatConverter* converter = converters[outputIndex].get();
+    converter->Convert(r->GetOutput(outputIndex).semaphoreValue);
+    pending = converter;
+    pendingTimestampNs = targetTimestampNs;
+    lock.unlock();
+
+    cv.notify_one();
+}
+
+void alvr::SecondaryStream::Run() {
+    x264_picture_t picture;
+    x264_picture_t pictureOut;
+    x264_picture_init(&picture);
+    picture.img.i_csp = X264_CSP_I420;
+    picture.img.i_plane = 3;
+
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        cv.wait(lock, [&] { return exiting || pending; });
+        if (exiting) {
+            return;
+        }
+        FormatConverter* converter = pending;
+        pending = nullptr;
+        picture.i_pts = pendingTimestampNs;
+        busy = true;
+        lock.unlock();
+
+        try {
+            converter->Sync(picture.img.plane, picture.img.i_stride);
+
+            x264_nal_t* nals = nullptr;
+            int nalCount = 0;
+            int size = x264_encoder_encode(enc, &nals, &nalCount, &picture, &pictureOut);
+            if (size < 0) {
+                throw std::runtime_error("x264 encoder_encode failed");
+            }
+            // The payloads of all NALs follow each other in memory
+            if (size > 0) {
+                SecondaryVideoSend(nals[0].p_payload, size, pictureOut.b_keyframe);
+            }
+        } catch (std::exception& e) {
+            // Staying busy, the next frames are skipped like while encoding
+            Error("Secondary video stream stopped: %s", e.what());
+            return;
+        }
+
+        lock.lock();
+        busy = false;
+    }
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "Renderer.h"
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <x264.h>
+
+class FormatConverter;
+
+namespace alvr {
+
+// Smaller H.264 copy of the stream, scaled on the GPU from the Renderer outputs and encoded with
+// x264 on its own thread. Frames are skipped while the previous one is still being encoded, so the
+// render stage never waits for it.
+class SecondaryStream {
+public:
+    SecondaryStream(Renderer* render, uint32_t height, uint32_t bitrateMbps);
+    ~SecondaryStream();
+
+    // Called by the render stage once outputIndex is rendered. The scaling is submitted on the
+    // Renderer queue, before the next Render that could write the output again.
+    void Submit(uint32_t outputIndex, uint64_t targetTimestampNs);
+
+private:
+    void Run();
+
+    x264_t* enc = nullptr;
+    x264_param_t param;
+    Renderer* r;
+    // One per Renderer output, only one of them converts or is read at a time
+    std::vector<std::unique_ptr<FormatConverter>> converters;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    FormatConverter* pending = nullptr;
+    uint64_t pendingTimestampNs = 0;
+    bool busy = false;
+    bool exiting = false;
+    std::thread thread;
+};
+
+}
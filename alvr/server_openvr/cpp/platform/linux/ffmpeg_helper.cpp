@@ -34,7 +34,9 @@ std::string alvr::AvException::makemsg(const std::string& msg, int averror) {
 }
 
 alvr::VkContext::VkContext(
-    const uint8_t* deviceUUID, const std::vector<const char*>& requiredDeviceExtensions
+    const uint8_t* deviceUUID,
+    const std::vector<const char*>& requiredDeviceExtensions,
+    int adapterIndex
 ) {
     std::vector<const char*> instance_extensions = {
         VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME,
@@ -52,6 +54,21 @@ alvr::VkContext::VkContext(
         VK_KHR_SAMPLER_YCBCR_CONVERSION_EXTENSION_NAME,
         VK_EXT_PHYSICAL_DEVICE_DRM_EXTENSION_NAME,
         VK_EXT_CALIBRATED_TIMESTAMPS_EXTENSION_NAME,
+        // High priority compose queue with linux async compute
+        VK_EXT_GLOBAL_PRIORITY_EXTENSION_NAME,
+        // Barriers and submits of the Renderer, also needed by the Vulkan Video encode
+        VK_KHR_SYNCHRONIZATION_2_EXTENSION_NAME,
+        // Vulkan Video encode, for EncodePipelineVulkan
+        VK_KHR_VIDEO_QUEUE_EXTENSION_NAME,
+        VK_KHR_VIDEO_ENCODE_QUEUE_EXTENSION_NAME,
+        VK_KHR_VIDEO_ENCODE_H264_EXTENSION_NAME,
+        VK_KHR_VIDEO_ENCODE_H265_EXTENSION_NAME,
+#ifdef VK_KHR_video_encode_av1
+        VK_KHR_VIDEO_ENCODE_AV1_EXTENSION_NAME,
+#endif
+#ifdef VK_KHR_video_maintenance1
+        VK_KHR_VIDEO_MAINTENANCE_1_EXTENSION_NAME,
+#endif
     };
     device_extensions.insert(
         device_extensions.end(), requiredDeviceExtensions.begin(), requiredDeviceExtensions.end()
@@ -75,7 +92,7 @@ alvr::VkContext::VkContext(
     VkApplicationInfo appInfo = {};
     appInfo.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
     appInfo.pApplicationName = "ALVR";
-    appInfo.apiVersion = VK_API_VERSION_1_2;
+    appInfo.apiVersion = VK_API_VERSION_1_3;
 
     VkInstanceCreateInfo instanceInfo = {};
     instanceInfo.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
@@ -95,19 +112,24 @@ alvr::VkContext::VkContext(
     VK_CHECK(vkEnumeratePhysicalDevices(instance, &deviceCount, nullptr));
     std::vector<VkPhysicalDevice> physicalDevices(deviceCount);
     VK_CHECK(vkEnumeratePhysicalDevices(instance, &deviceCount, physicalDevices.data()));
-    for (VkPhysicalDevice dev : physicalDevices) {
+    const int index = adapterIndex >= 0 ? adapterIndex : Settings_Instance()->m_nAdapterIndex;
+    for (size_t i = 0; i < physicalDevices.size(); ++i) {
         VkPhysicalDeviceVulkan11Properties props11 = {};
         props11.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_1_PROPERTIES;
 
         VkPhysicalDeviceProperties2 props = {};
         props.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
         props.pNext = &props11;
-        vkGetPhysicalDeviceProperties2(dev, &props);
-        if (memcmp(props11.deviceUUID, deviceUUID, VK_UUID_SIZE) == 0) {
-            physicalDevice = dev;
+        vkGetPhysicalDeviceProperties2(physicalDevices[i], &props);
+        if (deviceUUID ? memcmp(props11.deviceUUID, deviceUUID, VK_UUID_SIZE) == 0
+                       : (int)i == index) {
+            physicalDevice = physicalDevices[i];
             break;
         }
     }
+    if (!physicalDevice && !deviceUUID && adapterIndex >= 0) {
+        throw std::runtime_error("No Vulkan device at index " + std::to_string(adapterIndex));
+    }
     if (!physicalDevice && !physicalDevices.empty()) {
         Warn("Falling back to first device");
         physicalDevice = physicalDevices[0];
@@ -116,13 +138,18 @@ alvr::VkContext::VkContext(
         throw std::runtime_error("Failed to find vulkan device.");
     }
 
+    VkPhysicalDeviceVulkan11Properties deviceProps11 = {};
+    deviceProps11.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_1_PROPERTIES;
+
     VkPhysicalDeviceDrmPropertiesEXT drmProps = {};
     drmProps.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DRM_PROPERTIES_EXT;
+    drmProps.pNext = &deviceProps11;
 
     VkPhysicalDeviceProperties2 deviceProps = {};
     deviceProps.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
     deviceProps.pNext = &drmProps;
     vkGetPhysicalDeviceProperties2(physicalDevice, &deviceProps);
+    memcpy(physicalDeviceUUID.data(), deviceProps11.deviceUUID, VK_UUID_SIZE);
 
     amd = deviceProps.properties.vendorID == 0x1002;
     intel = deviceProps.properties.vendorID == 0x8086;
@@ -147,7 +174,8 @@ alvr::VkContext::VkContext(
         }
     }
 
-    float queuePriority = 1.0;
+    // The second queue of a family is only created for the compose queue
+    float queuePriorities[2] = { 1.0, 1.0 };
     std::vector<VkDeviceQueueCreateInfo> queueInfos;
 
     uint32_t queueFamilyCount;
@@ -162,22 +190,119 @@ alvr::VkContext::VkContext(
         if (compute && (queueFamilyIndex == VK_QUEUE_FAMILY_IGNORED || !graphics)) {
             queueFamilyIndex = i;
         }
+        if (queueFamilyProperties[i].queueFlags & VK_QUEUE_VIDEO_ENCODE_BIT_KHR
+            && encodeQueueFamilyIndex == VK_QUEUE_FAMILY_IGNORED) {
+            encodeQueueFamilyIndex = i;
+        }
         VkDeviceQueueCreateInfo queueInfo = {};
         queueInfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
         queueInfo.queueFamilyIndex = i;
         queueInfo.queueCount = 1;
-        queueInfo.pQueuePriorities = &queuePriority;
+        queueInfo.pQueuePriorities = queuePriorities;
         queueInfos.push_back(queueInfo);
     }
 
+    // With async compute the Renderer submits to its own queue instead of waiting behind the
+    // encoder submissions: preferably a second queue of the ffmpeg family, which needs no
+    // ownership transfers, otherwise another compute only family
+    if (Settings_Instance()->m_enableLinuxVulkanAsyncCompute) {
+        if (queueFamilyProperties[queueFamilyIndex].queueCount > 1) {
+            composeQueueFamilyIndex = queueFamilyIndex;
+            composeQueueIndex = 1;
+            queueInfos[queueFamilyIndex].queueCount = 2;
+        } else {
+            for (uint32_t i = 0; i < queueFamilyProperties.size(); ++i) {
+                const VkQueueFlags flags = queueFamilyProperties[i].queueFlags;
+                if (i != queueFamilyIndex && flags & VK_QUEUE_COMPUTE_BIT
+                    && !(flags & VK_QUEUE_GRAPHICS_BIT)) {
+                    composeQueueFamilyIndex = i;
+                    break;
+                }
+            }
+        }
+        if (composeQueueFamilyIndex == VK_QUEUE_FAMILY_IGNORED) {
+            Warn("No dedicated compute queue available, compose shares the encoder queue");
+        }
+    }
+
+    // Global priority applies to all the queues of the family
+    VkDeviceQueueGlobalPriorityCreateInfoEXT globalPriorityInfo = {};
+    globalPriorityInfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_GLOBAL_PRIORITY_CREATE_INFO_EXT;
+    globalPriorityInfo.globalPriority = VK_QUEUE_GLOBAL_PRIORITY_HIGH_EXT;
+    const bool haveGlobalPriority
+        = std::find_if(
+              deviceExtensions.begin(),
+              deviceExtensions.end(),
+              [](const char* name) {
+                  return strcmp(name, VK_EXT_GLOBAL_PRIORITY_EXTENSION_NAME) == 0;
+              }
+          )
+        != deviceExtensions.end();
+    if (composeQueueFamilyIndex != VK_QUEUE_FAMILY_IGNORED && haveGlobalPriority
+        && Settings_Instance()->m_gpuPriority) {
+        queueInfos[composeQueueFamilyIndex].pNext = &globalPriorityInfo;
+    }
+
     VkPhysicalDeviceVulkan12Features features12 = {};
     features12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
     features12.timelineSemaphore = true;
+    {
+        VkPhysicalDeviceVulkan12Features supported12 = {};
+        supported12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+        VkPhysicalDeviceFeatures2 supported = {};
+        supported.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+        supported.pNext = &supported12;
+        vkGetPhysicalDeviceFeatures2(physicalDevice, &supported);
+        features12.shaderFloat16 = supported12.shaderFloat16;
+        shaderFloat16 = supported12.shaderFloat16;
+        // For the host plane variant of rgbtoyuv420.comp
+        features12.storageBuffer8BitAccess = supported12.storageBuffer8BitAccess;
+    }
+
+    // The Renderer requires synchronization2, through Vulkan 1.3 or the extension. ffmpeg's
+    // Vulkan encoders need it in Vulkan 1.3.
+    const bool haveSynchronization2
+        = std::find_if(
+              deviceExtensions.begin(),
+              deviceExtensions.end(),
+              [](const char* name) {
+                  return strcmp(name, VK_KHR_SYNCHRONIZATION_2_EXTENSION_NAME) == 0;
+              }
+          )
+        != deviceExtensions.end();
+    VkPhysicalDeviceVulkan13Features features13 = {};
+    features13.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_3_FEATURES;
+    VkPhysicalDeviceSynchronization2FeaturesKHR synchronization2Features = {};
+    synchronization2Features.sType
+        = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SYNCHRONIZATION_2_FEATURES_KHR;
+    if (deviceProps.properties.apiVersion >= VK_API_VERSION_1_3) {
+        VkPhysicalDeviceVulkan13Features supported13 = {};
+        supported13.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_3_FEATURES;
+        VkPhysicalDeviceFeatures2 supported = {};
+        supported.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+        supported.pNext = &supported13;
+        vkGetPhysicalDeviceFeatures2(physicalDevice, &supported);
+
+        features13.synchronization2 = supported13.synchronization2;
+        features12.pNext = &features13;
+    } else if (haveSynchronization2) {
+        synchronization2Features.synchronization2 = true;
+        features12.pNext = &synchronization2Features;
+    }
+    if (!features13.synchronization2) {
+        encodeQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    }
 
     VkPhysicalDeviceFeatures2 features = {};
     features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
     features.pNext = &features12;
     features.features.samplerAnisotropy = VK_TRUE;
+    // For the rgb10_a2 storage images of the 10 bit outputs
+    VkPhysicalDeviceFeatures supportedFeatures = {};
+    vkGetPhysicalDeviceFeatures(physicalDevice, &supportedFeatures);
+    features.features.shaderStorageImageExtendedFormats
+        = supportedFeatures.shaderStorageImageExtendedFormats;
+    storageImageExtendedFormats = supportedFeatures.shaderStorageImageExtendedFormats;
 
     VkDeviceCreateInfo deviceInfo = {};
     deviceInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
@@ -186,7 +311,15 @@ alvr::VkContext::VkContext(
     deviceInfo.pQueueCreateInfos = queueInfos.data();
     deviceInfo.enabledExtensionCount = deviceExtensions.size();
     deviceInfo.ppEnabledExtensionNames = deviceExtensions.data();
-    VK_CHECK(vkCreateDevice(physicalDevice, &deviceInfo, nullptr, &device));
+    VkResult result = vkCreateDevice(physicalDevice, &deviceInfo, nullptr, &device);
+    if (result == VK_ERROR_NOT_PERMITTED_EXT && composeQueueFamilyIndex != VK_QUEUE_FAMILY_IGNORED
+        && queueInfos[composeQueueFamilyIndex].pNext) {
+        // High priority queues may require CAP_SYS_NICE
+        Warn("High priority compute queue not permitted, using normal priority");
+        queueInfos[composeQueueFamilyIndex].pNext = nullptr;
+        result = vkCreateDevice(physicalDevice, &deviceInfo, nullptr, &device);
+    }
+    VK_CHECK(result);
 
     for (int i = 128; i < 136; ++i) {
         auto path = "/dev/dri/renderD" + std::to_string(i);
@@ -228,10 +361,22 @@ alvr::VkContext::VkContext(
     vkctx->queue_family_comp_index = queueFamilyIndex;
     vkctx->nb_comp_queues = 1;
     vkctx->get_proc_addr = vkGetInstanceProcAddr;
-    vkctx->queue_family_encode_index = -1;
-    vkctx->nb_encode_queues = 0;
+    if (encodeQueueFamilyIndex != VK_QUEUE_FAMILY_IGNORED) {
+        vkctx->queue_family_encode_index = encodeQueueFamilyIndex;
+        vkctx->nb_encode_queues = 1;
+    } else {
+        vkctx->queue_family_encode_index = -1;
+        vkctx->nb_encode_queues = 0;
+    }
     vkctx->queue_family_decode_index = -1;
     vkctx->nb_decode_queues = 0;
+    hwctx->user_opaque = this;
+    vkctx->lock_queue = [](AVHWDeviceContext* ctx, uint32_t, uint32_t) {
+        static_cast<VkContext*>(ctx->user_opaque)->queueMutex.lock();
+    };
+    vkctx->unlock_queue = [](AVHWDeviceContext* ctx, uint32_t, uint32_t) {
+        static_cast<VkContext*>(ctx->user_opaque)->queueMutex.unlock();
+    };
 
     char** inst_extensions = (char**)malloc(sizeof(char*) * instanceExtensions.size());
     for (uint32_t i = 0; i < instanceExtensions.size(); ++i) {
@@ -258,6 +403,29 @@ alvr::VkContext::~VkContext() {
     vkDestroyInstance(instance, nullptr);
 }
 
+uint32_t alvr::VkContext::get_vk_compose_queue_family_index() const {
+    return composeQueueFamilyIndex != VK_QUEUE_FAMILY_IGNORED ? composeQueueFamilyIndex
+                                                              : queueFamilyIndex;
+}
+
+std::mutex& alvr::VkContext::get_compose_queue_mutex() {
+    return composeQueueFamilyIndex != VK_QUEUE_FAMILY_IGNORED ? composeQueueMutex : queueMutex;
+}
+
+std::vector<uint32_t> alvr::VkContext::get_vk_output_queue_families() const {
+    if (composeQueueFamilyIndex == VK_QUEUE_FAMILY_IGNORED
+        || composeQueueFamilyIndex == queueFamilyIndex) {
+        return {};
+    }
+    std::vector<uint32_t> families = { queueFamilyIndex };
+    if (encodeQueueFamilyIndex != VK_QUEUE_FAMILY_IGNORED
+        && encodeQueueFamilyIndex != composeQueueFamilyIndex
+        && encodeQueueFamilyIndex != queueFamilyIndex) {
+        families.push_back(encodeQueueFamilyIndex);
+    }
+    return families;
+}
+
 alvr::VkFrameCtx::VkFrameCtx(VkContext& vkContext, vk::ImageCreateInfo image_create_info) {
     AVHWFramesContext* frames_ctx = NULL;
     int err = 0;
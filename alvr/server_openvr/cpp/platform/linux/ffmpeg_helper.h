@@ -1,7 +1,9 @@
 #pragma once
 
+#include <array>
 #include <functional>
 #include <memory>
+#include <mutex>
 #include <vulkan/vulkan.hpp>
 
 extern "C" {
@@ -38,12 +40,23 @@ private:
 
 class VkContext {
 public:
-    VkContext(const uint8_t* deviceUUID, const std::vector<const char*>& requiredDeviceExtensions);
+    // Without deviceUUID, the device at adapterIndex is used, or at the configured adapter index
+    // when it is negative. Only the configured one falls back to the first device.
+    VkContext(
+        const uint8_t* deviceUUID,
+        const std::vector<const char*>& requiredDeviceExtensions,
+        int adapterIndex = -1
+    );
     ~VkContext();
     VkDevice get_vk_device() const { return device; }
     VkInstance get_vk_instance() const { return instance; }
     VkPhysicalDevice get_vk_phys_device() const { return physicalDevice; }
     uint32_t get_vk_queue_family_index() const { return queueFamilyIndex; }
+    uint32_t get_vk_compose_queue_family_index() const;
+    uint32_t get_vk_compose_queue_index() const { return composeQueueIndex; }
+    std::mutex& get_compose_queue_mutex();
+    // Queue families other than the compose one that access the Renderer outputs
+    std::vector<uint32_t> get_vk_output_queue_families() const;
     std::vector<const char*> get_vk_instance_extensions() const { return instanceExtensions; }
     std::vector<const char*> get_vk_device_extensions() const { return deviceExtensions; }
 
@@ -52,12 +65,26 @@ public:
     VkPhysicalDevice physicalDevice = VK_NULL_HANDLE;
     VkDevice device = VK_NULL_HANDLE;
     uint32_t queueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    // VK_QUEUE_FAMILY_IGNORED if the device can't encode with Vulkan Video
+    uint32_t encodeQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    // Renderer's queue when linux async compute is enabled, VK_QUEUE_FAMILY_IGNORED if it shares
+    // the ffmpeg queue
+    uint32_t composeQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    uint32_t composeQueueIndex = 0;
     std::vector<const char*> instanceExtensions;
     std::vector<const char*> deviceExtensions;
+    std::array<uint8_t, VK_UUID_SIZE> physicalDeviceUUID = {};
     bool amd = false;
     bool intel = false;
     bool nvidia = false;
+    // Whether shaders can use storage images of formats like rgb10_a2
+    bool storageImageExtendedFormats = false;
+    // Whether shaders can do float16 arithmetic, for the fp16 variants of the compose shaders
+    bool shaderFloat16 = false;
     std::string devicePath;
+    // The ffmpeg queue, shared by the encoders and by Renderer unless it has its own queue
+    std::mutex queueMutex;
+    std::mutex composeQueueMutex;
 };
 
 class VkFrameCtx {
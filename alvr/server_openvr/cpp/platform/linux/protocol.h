@@ -2,17 +2,78 @@
 
 #include <array>
 #include <atomic>
+#include <cmath>
 #include <condition_variable>
 #include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include <mutex>
+#include <string>
 #include <vulkan/vulkan.h>
 
+// Version 1 sends every present_packet over the socket.
+// Version 2 publishes them in a present_ring shared through a memfd, with an eventfd doorbell.
+// Version 3 adds the pose tag to present_packet.
+// Version 4 adds the vsync schedule the driver writes into present_ring.
+// Version 5 adds init_packet flags, and optional sync_files for presents.
+// Version 6 adds the present time and the GPU time of the compositor to present_packet.
+constexpr uint32_t ALVR_IPC_PROTOCOL_VERSION = 6;
+
+// init_packet flag: before publishing each present_packet in the ring, the layer sends a one byte
+// message on the socket carrying a sync_file (SCM_RIGHTS) that signals once the image is rendered.
+// Messages and packets are in the same order, message n goes with the ring packet of sequence n.
+// A message without fd means the export failed, and the timeline semaphore must be waited on.
+constexpr uint32_t ALVR_IPC_FLAG_SYNC_FILE_PRESENTS = 1;
+
+// Socket of the driver, in $XDG_RUNTIME_DIR. Every SteamVR instance streams one headset, and
+// instances that share a runtime directory, like several headsets served by one user, are told
+// apart by ALVR_INSTANCE_NAME. The driver and the compositor of an instance inherit it from the
+// environment SteamVR is started in.
+inline std::string ipc_socket_path() {
+    const char* runtime_dir = getenv("XDG_RUNTIME_DIR");
+    std::string path = runtime_dir ? runtime_dir : "/tmp";
+    path += "/alvr-ipc";
+    const char* instance = getenv("ALVR_INSTANCE_NAME");
+    if (instance && *instance) {
+        path += "-";
+        path += instance;
+    }
+    return path;
+}
+
+// The driver tags each head pose it submits with a small number, carried by the magnitude of the
+// pose velocity. Rotating the pose into the tracking universe keeps the magnitude, so the layer can
+// read the tag back from the pose the frame was rendered with. The velocity stays below 1mm/s.
+constexpr float POSE_TAG_VELOCITY_UNIT = 1e-7f;
+
+inline float pose_tag_to_velocity(uint32_t tag) { return tag * POSE_TAG_VELOCITY_UNIT; }
+
+// 0 if the velocity doesn't hold a tag
+inline uint32_t pose_tag_from_velocity(const float velocity[3]) {
+    float speed = std::sqrt(
+        velocity[0] * velocity[0] + velocity[1] * velocity[1] + velocity[2] * velocity[2]
+    );
+    // Tracked velocities are not tags
+    if (!(speed < 1e-3f)) {
+        return 0;
+    }
+    return std::lround(speed / POSE_TAG_VELOCITY_UNIT);
+}
+
 struct present_packet {
     uint32_t image;
     uint32_t frame;
     uint64_t semaphore_value;
     float pose[3][4];
+    // Tag of the head pose, 0 if unknown
+    uint32_t pose_tag;
+    // Since version 6. CLOCK_MONOTONIC time at which the compositor presented the image. The layer
+    // only runs in vrcompositor, the presents of the game never reach it.
+    uint64_t present_ns;
+    // Since version 6. Time from the present of the previous packet's image, or from when the
+    // layer started waiting on it if later, until the GPU was seen done rendering it. 0 if unknown.
+    // It exceeds the frame interval when the compositor is GPU bound.
+    uint64_t previous_gpu_ns;
 };
 
 struct init_packet {
@@ -21,4 +82,89 @@ struct init_packet {
     VkImageCreateInfo image_create_info;
     size_t mem_index;
     pid_t source_pid;
+    // Highest protocol version the layer speaks. For version 2, the memfd of the ring and the
+    // doorbell eventfd are sent in a second SCM_RIGHTS message after the image fds.
+    uint32_t protocol_version;
+    // ALVR_IPC_FLAG_*, since version 5
+    uint32_t flags;
+};
+
+// Single producer (the layer), single consumer (CEncoder) ring of present packets living in shared
+// memory. Each slot is a seqlock: the producer never waits on the consumer, and the consumer only
+// ever reads the latest published packet. Presents are coalesced: a slow consumer skips the ones
+// published since its last read instead of queueing them. No present is lost to a failed write,
+// and the skipped ones show as gaps in the packet numbers, which CEncoder reports as dropped.
+struct present_ring {
+    static constexpr uint32_t SLOT_COUNT = 8;
+    // The packet is copied as words the consumer may read while the producer writes them
+    static constexpr size_t PACKET_WORDS = sizeof(present_packet) / sizeof(uint64_t);
+    static_assert(sizeof(present_packet) % sizeof(uint64_t) == 0);
+
+    struct slot {
+        // Number of the packet stored in the slot, 0 while it's being written
+        std::atomic<uint64_t> sequence;
+        std::atomic<uint64_t> packet[PACKET_WORDS];
+    };
+
+    // Number of packets published so far
+    std::atomic<uint64_t> write_count;
+    slot slots[SLOT_COUNT];
+
+    // Written by the driver since version 4, the other way around: CLOCK_MONOTONIC time of a
+    // vsync and the vsync period, following the headset. 0 while unknown. The layer paces the
+    // game to them so that presents land right before the driver composes and encodes.
+    std::atomic<uint64_t> vsync_time_ns;
+    std::atomic<uint64_t> vsync_period_ns;
+
+    void publish_vsync(uint64_t time_ns, uint64_t period_ns) {
+        vsync_period_ns.store(period_ns, std::memory_order_relaxed);
+        vsync_time_ns.store(time_ns, std::memory_order_release);
+    }
+
+    // False while the driver didn't publish a schedule
+    bool read_vsync(uint64_t& time_ns, uint64_t& period_ns) const {
+        time_ns = vsync_time_ns.load(std::memory_order_acquire);
+        period_ns = vsync_period_ns.load(std::memory_order_relaxed);
+        return time_ns != 0 && period_ns != 0;
+    }
+
+    void publish(const present_packet& packet) {
+        uint64_t sequence = write_count.load(std::memory_order_relaxed) + 1;
+        slot& s = slots[sequence % SLOT_COUNT];
+        s.sequence.store(0, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        uint64_t words[PACKET_WORDS];
+        memcpy(words, &packet, sizeof(words));
+        for (size_t i = 0; i < PACKET_WORDS; i++) {
+            s.packet[i].store(words[i], std::memory_order_relaxed);
+        }
+        s.sequence.store(sequence, std::memory_order_release);
+        write_count.store(sequence, std::memory_order_release);
+    }
+
+    // Copies the latest packet if one was published after last_read, and updates last_read. The
+    // packets published in between are skipped, last_read jumps over their numbers.
+    bool read_latest(uint64_t& last_read, present_packet& out) const {
+        for (;;) {
+            uint64_t sequence = write_count.load(std::memory_order_acquire);
+            if (sequence == last_read) {
+                return false;
+            }
+            const slot& s = slots[sequence % SLOT_COUNT];
+            if (s.sequence.load(std::memory_order_acquire) != sequence) {
+                continue; // overwritten by the producer, retry with the newer packet
+            }
+            uint64_t words[PACKET_WORDS];
+            for (size_t i = 0; i < PACKET_WORDS; i++) {
+                words[i] = s.packet[i].load(std::memory_order_relaxed);
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (s.sequence.load(std::memory_order_relaxed) == sequence) {
+                memcpy(&out, words, sizeof(words));
+                last_read = sequence;
+                return true;
+            }
+        }
+    }
 };
+static_assert(std::atomic<uint64_t>::is_always_lock_free);
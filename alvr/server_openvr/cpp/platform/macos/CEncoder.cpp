@@ -0,0 +1,397 @@
+#include "CEncoder.h"
+
+#include "ALVR-common/packet_types.h"
+#include "alvr_server/EncoderControl.h"
+#include "alvr_server/Logger.h"
+#include "alvr_server/Settings.h"
+#include "alvr_server/Utils.h"
+#include <string.h>
+
+namespace {
+
+const uint8_t START_CODE[4] = { 0, 0, 0, 1 };
+
+void SetProperty(VTCompressionSessionRef session, CFStringRef key, CFTypeRef value) {
+    OSStatus status = VTSessionSetProperty(session, key, value);
+    if (status != noErr) {
+        Warn("VideoToolbox: failed to set a session property: %d", (int)status);
+    }
+}
+
+void SetNumber(VTCompressionSessionRef session, CFStringRef key, int64_t value) {
+    CFNumberRef number = CFNumberCreate(nullptr, kCFNumberSInt64Type, &value);
+    SetProperty(session, key, number);
+    CFRelease(number);
+}
+
+void SetNumber(VTCompressionSessionRef session, CFStringRef key, double value) {
+    CFNumberRef number = CFNumberCreate(nullptr, kCFNumberDoubleType, &value);
+    SetProperty(session, key, number);
+    CFRelease(number);
+}
+
+CFStringRef ProfileLevel(int codec, const Settings* settings) {
+    if (codec == ALVR_CODEC_HEVC) {
+        return settings->m_use10bitEncoder ? kVTProfileLevel_HEVC_Main10_AutoLevel
+                                           : kVTProfileLevel_HEVC_Main_AutoLevel;
+    }
+    switch (settings->m_h264Profile) {
+    case ALVR_H264_PROFILE_BASELINE:
+        return kVTProfileLevel_H264_Baseline_AutoLevel;
+    case ALVR_H264_PROFILE_MAIN:
+        return kVTProfileLevel_H264_Main_AutoLevel;
+    case ALVR_H264_PROFILE_HIGH:
+    default:
+        return kVTProfileLevel_H264_High_AutoLevel;
+    }
+}
+
+} // namespace
+
+CEncoder::CEncoder() {
+    m_codec = Settings_Instance()->m_codec;
+    if (m_codec == ALVR_CODEC_AV1) {
+        Warn("AV1 is not supported by VideoToolbox. Using HEVC instead.");
+        m_codec = ALVR_CODEC_HEVC;
+    }
+
+    const void* keys[] = { kVTEncodeFrameOptionKey_ForceKeyFrame };
+    const void* values[] = { kCFBooleanTrue };
+    m_forceKeyFrame = CFDictionaryCreate(
+        nullptr,
+        keys,
+        values,
+        1,
+        &kCFTypeDictionaryKeyCallBacks,
+        &kCFTypeDictionaryValueCallBacks
+    );
+
+    m_params.bitrate_bps = 30'000'000;
+    m_params.framerate = Settings_Instance()->m_refreshRate;
+}
+
+CEncoder::~CEncoder() {
+    Stop();
+    Join();
+
+    DestroySession();
+    for (auto& [surface, pixelBuffer] : m_pixelBuffers) {
+        CVPixelBufferRelease(pixelBuffer);
+    }
+    if (m_queuedSurface) {
+        CFRelease(m_queuedSurface);
+    }
+    CFRelease(m_forceKeyFrame);
+}
+
+void CEncoder::Run() {
+    Debug("CEncoder: Start thread");
+
+    while (true) {
+        IOSurfaceRef surface;
+        uint64_t targetTimestampNs;
+        {
+            std::unique_lock lock(m_frameMutex);
+            m_frameReady.wait(lock, [&] { return m_exiting || m_queuedSurface; });
+            if (m_exiting) {
+                break;
+            }
+            surface = m_queuedSurface;
+            targetTimestampNs = m_queuedTimestampNs;
+            m_queuedSurface = nullptr;
+        }
+
+        Encode(surface, targetTimestampNs);
+        CFRelease(surface);
+    }
+
+    if (m_session) {
+        VTCompressionSessionCompleteFrames(m_session, kCMTimeInvalid);
+    }
+    Debug("CEncoder: Thread exited");
+}
+
+void CEncoder::Stop() {
+    std::lock_guard lock(m_frameMutex);
+    m_exiting = true;
+    m_frameReady.notify_one();
+}
+
+void CEncoder::NewFrameReady(IOSurfaceRef surface, uint64_t targetTimestampNs) {
+    CFRetain(surface);
+
+    std::lock_guard lock(m_frameMutex);
+    if (m_queuedSurface) {
+        CFRelease(m_queuedSurface);
+    }
+    m_queuedSurface = surface;
+    m_queuedTimestampNs = targetTimestampNs;
+    m_frameReady.notify_one();
+}
+
+void CEncoder::ReleaseSurface(IOSurfaceRef surface) {
+    std::lock_guard lock(m_frameMutex);
+    auto it = m_pixelBuffers.find(surface);
+    if (it != m_pixelBuffers.end()) {
+        CVPixelBufferRelease(it->second);
+        m_pixelBuffers.erase(it);
+    }
+}
+
+void CEncoder::OnStreamStart() { m_scheduler.OnStreamStart(); }
+
+void CEncoder::InsertIDR() { m_scheduler.RequestIDR(); }
+
+void CEncoder::InsertRecovery() { m_scheduler.InsertRecovery(); }
+
+void CEncoder::ReportLostFrame(uint64_t lastReceivedTimestampNs) {
+    m_scheduler.InsertRefInvalidation(lastReceivedTimestampNs);
+}
+
+bool CEncoder::CreateSession(int32_t width, int32_t height) {
+    DestroySession();
+
+    // Frames are sent as soon as they are encoded, with the rate control of video conferencing
+    const void* specKeys[] = { kVTVideoEncoderSpecification_EnableLowLatencyRateControl };
+    const void* specValues[] = { kCFBooleanTrue };
+    CFDictionaryRef specification = CFDictionaryCreate(
+        nullptr,
+        specKeys,
+        specValues,
+        1,
+        &kCFTypeDictionaryKeyCallBacks,
+        &kCFTypeDictionaryValueCallBacks
+    );
+
+    OSStatus status = VTCompressionSessionCreate(
+        nullptr,
+        width,
+        height,
+        m_codec == ALVR_CODEC_HEVC ? kCMVideoCodecType_HEVC : kCMVideoCodecType_H264,
+        specification,
+        nullptr,
+        nullptr,
+        OnEncoded,
+        this,
+        &m_session
+    );
+    CFRelease(specification);
+    if (status != noErr) {
+        Error("VideoToolbox: failed to create the compression session: %d", (int)status);
+        m_session = nullptr;
+        return false;
+    }
+
+    const Settings* settings = Settings_Instance();
+    SetProperty(m_session, kVTCompressionPropertyKey_RealTime, kCFBooleanTrue);
+    SetProperty(m_session, kVTCompressionPropertyKey_AllowFrameReordering, kCFBooleanFalse);
+    SetProperty(m_session, kVTCompressionPropertyKey_ProfileLevel, ProfileLevel(m_codec, settings));
+    if (m_codec == ALVR_CODEC_H264) {
+        SetProperty(
+            m_session,
+            kVTCompressionPropertyKey_H264EntropyMode,
+            settings->m_entropyCoding == ALVR_CAVLC ? kVTH264EntropyMode_CAVLC
+                                                    : kVTH264EntropyMode_CABAC
+        );
+    }
+    // IDR frames only when the IDRScheduler asks for them
+    SetNumber(m_session, kVTCompressionPropertyKey_MaxKeyFrameInterval, (int64_t)INT32_MAX);
+    SetNumber(m_session, kVTCompressionPropertyKey_MaxFrameDelayCount, (int64_t)0);
+
+    status = VTCompressionSessionPrepareToEncodeFrames(m_session);
+    if (status != noErr) {
+        Error("VideoToolbox: failed to prepare the compression session: %d", (int)status);
+        DestroySession();
+        return false;
+    }
+
+    m_width = width;
+    m_height = height;
+    m_params.updated = true;
+    ApplyDynamicParams();
+    m_scheduler.SetEncoderCapabilities(EncoderCapabilities {});
+
+    Info("VideoToolbox: encoding %dx%d", width, height);
+    return true;
+}
+
+void CEncoder::DestroySession() {
+    if (!m_session) {
+        return;
+    }
+    VTCompressionSessionCompleteFrames(m_session, kCMTimeInvalid);
+    VTCompressionSessionInvalidate(m_session);
+    CFRelease(m_session);
+    m_session = nullptr;
+}
+
+void CEncoder::ApplyDynamicParams() {
+    FfiDynamicEncoderParams params = g_encoderControl.Poll(m_paramsGeneration);
+    if (params.updated) {
+        m_params = params;
+    } else if (!m_params.updated) {
+        return;
+    }
+    m_params.updated = false;
+
+    // The pixel buffers are the compositor surfaces, resolution_scale is not applied
+    SetNumber(m_session, kVTCompressionPropertyKey_AverageBitRate, (int64_t)m_params.bitrate_bps);
+    SetNumber(m_session, kVTCompressionPropertyKey_ExpectedFrameRate, (double)m_params.framerate);
+
+    if (m_params.max_frame_bytes != 0 && m_params.framerate > 0) {
+        // Bytes per frame interval
+        int64_t bytes = m_params.max_frame_bytes;
+        double seconds = 1.0 / m_params.framerate;
+        CFNumberRef limit[2] = {
+            CFNumberCreate(nullptr, kCFNumberSInt64Type, &bytes),
+            CFNumberCreate(nullptr, kCFNumberDoubleType, &seconds),
+        };
+        CFArrayRef limits = CFArrayCreate(nullptr, (const void**)limit, 2, &kCFTypeArrayCallBacks);
+        SetProperty(m_session, kVTCompressionPropertyKey_DataRateLimits, limits);
+        CFRelease(limits);
+        CFRelease(limit[0]);
+        CFRelease(limit[1]);
+    }
+}
+
+CVPixelBufferRef CEncoder::GetPixelBuffer(IOSurfaceRef surface) {
+    std::lock_guard lock(m_frameMutex);
+    auto it = m_pixelBuffers.find(surface);
+    if (it != m_pixelBuffers.end()) {
+        return it->second;
+    }
+
+    CVPixelBufferRef pixelBuffer = nullptr;
+    CVReturn ret = CVPixelBufferCreateWithIOSurface(nullptr, surface, nullptr, &pixelBuffer);
+    if (ret != kCVReturnSuccess) {
+        Error("VideoToolbox: failed to wrap the frame surface: %d", (int)ret);
+        return nullptr;
+    }
+    m_pixelBuffers[surface] = pixelBuffer;
+    return pixelBuffer;
+}
+
+void CEncoder::Encode(IOSurfaceRef surface, uint64_t targetTimestampNs) {
+    auto width = (int32_t)IOSurfaceGetWidth(surface);
+    auto height = (int32_t)IOSurfaceGetHeight(surface);
+    if (!m_session || width != m_width || height != m_height) {
+        if (!CreateSession(width, height)) {
+            return;
+        }
+        m_scheduler.InsertIDR();
+    }
+
+    CVPixelBufferRef pixelBuffer = GetPixelBuffer(surface);
+    if (!pixelBuffer) {
+        return;
+    }
+
+    ApplyDynamicParams();
+
+    // No reference invalidation, lost frames are recovered with an IDR frame
+    uint64_t lastReceivedTimestampNs;
+    m_scheduler.CheckRefInvalidation(lastReceivedTimestampNs);
+    bool insertIDR = m_scheduler.CheckIDRInsertion();
+
+    uint64_t submitNs = GetSteadyTimeNs();
+    OSStatus status = VTCompressionSessionEncodeFrame(
+        m_session,
+        pixelBuffer,
+        CMTimeMake(targetTimestampNs, 1'000'000'000),
+        kCMTimeInvalid,
+        insertIDR ? m_forceKeyFrame : nullptr,
+        (void*)(uintptr_t)submitNs,
+        nullptr
+    );
+    if (status != noErr) {
+        Error("VideoToolbox: failed to encode a frame: %d", (int)status);
+        // The session is recreated with the next frame, which is an IDR frame
+        DestroySession();
+    }
+}
+
+void CEncoder::OnEncoded(
+    void* outputCallbackRefCon,
+    void* sourceFrameRefCon,
+    OSStatus status,
+    VTEncodeInfoFlags infoFlags,
+    CMSampleBufferRef sampleBuffer
+) {
+    auto self = static_cast<CEncoder*>(outputCallbackRefCon);
+    if (status != noErr) {
+        Error("VideoToolbox: encoding failed: %d", (int)status);
+        self->m_scheduler.InsertIDR();
+        return;
+    }
+    if ((infoFlags & kVTEncodeInfo_FrameDropped) || !sampleBuffer) {
+        return;
+    }
+    self->SendFrame(sampleBuffer, (uint64_t)(uintptr_t)sourceFrameRefCon);
+}
+
+void CEncoder::SendFrame(CMSampleBufferRef sampleBuffer, uint64_t submitNs) {
+    bool isIdr = true;
+    CFArrayRef attachments = CMSampleBufferGetSampleAttachmentsArray(sampleBuffer, false);
+    if (attachments && CFArrayGetCount(attachments) > 0) {
+        auto attachment = (CFDictionaryRef)CFArrayGetValueAtIndex(attachments, 0);
+        isIdr = !CFDictionaryContainsKey(attachment, kCMSampleAttachmentKey_NotSync);
+    }
+
+    m_bitstream.clear();
+
+    // VideoToolbox keeps the parameter sets in the format description, the client expects them in
+    // front of the IDR frames
+    if (isIdr) {
+        CMFormatDescriptionRef format = CMSampleBufferGetFormatDescription(sampleBuffer);
+        size_t count = 0;
+        for (size_t i = 0;; i++) {
+            const uint8_t* parameterSet;
+            size_t size;
+            OSStatus status = m_codec == ALVR_CODEC_HEVC
+                ? CMVideoFormatDescriptionGetHEVCParameterSetAtIndex(
+                      format, i, &parameterSet, &size, &count, nullptr
+                  )
+                : CMVideoFormatDescriptionGetH264ParameterSetAtIndex(
+                      format, i, &parameterSet, &size, &count, nullptr
+                  );
+            if (status != noErr || i >= count) {
+                break;
+            }
+            m_bitstream.insert(m_bitstream.end(), START_CODE, START_CODE + sizeof(START_CODE));
+            m_bitstream.insert(m_bitstream.end(), parameterSet, parameterSet + size);
+        }
+    }
+
+    CMBlockBufferRef block = CMSampleBufferGetDataBuffer(sampleBuffer);
+    size_t length = CMBlockBufferGetDataLength(block);
+    size_t offset = m_bitstream.size();
+    m_bitstream.resize(offset + length);
+    if (CMBlockBufferCopyDataBytes(block, 0, length, m_bitstream.data() + offset) != noErr) {
+        Error("VideoToolbox: failed to read an encoded frame");
+        return;
+    }
+
+    // The NALs have 4 byte big endian length prefixes, which are replaced with start codes of the
+    // same size in place
+    for (size_t i = offset; i + 4 <= m_bitstream.size();) {
+        uint8_t* prefix = m_bitstream.data() + i;
+        size_t nalSize = ((size_t)prefix[0] << 24) | ((size_t)prefix[1] << 16)
+            | ((size_t)prefix[2] << 8) | prefix[3];
+        memcpy(prefix, START_CODE, sizeof(START_CODE));
+        i += 4 + nalSize;
+    }
+
+    // The presentation timestamps are the target timestamps, in ns
+    auto targetTimestampNs = (uint64_t)CMSampleBufferGetPresentationTimeStamp(sampleBuffer).value;
+
+    FfiEncodedFrameStats stats = {};
+    stats.targetTimestampNs = targetTimestampNs;
+    stats.sizeBytes = (unsigned int)m_bitstream.size();
+    stats.averageQp = -1.0f;
+    stats.frameType = isIdr ? FRAME_TYPE_IDR : FRAME_TYPE_UNKNOWN;
+    stats.encodeTimeNs = GetSteadyTimeNs() - submitNs;
+
+    ParseFrameNals(m_codec, m_bitstream.data(), (int)m_bitstream.size(), targetTimestampNs, isIdr);
+    ReportEncodedFrameStats(stats);
+    g_encoderControl.ReportFrameSize(stats.sizeBytes);
+}
@@ -1,15 +1,74 @@
 #pragma once
 
+#include "alvr_server/IDRScheduler.h"
+#include "alvr_server/bindings.h"
 #include "shared/threadtools.h"
+#include <CoreVideo/CoreVideo.h>
+#include <IOSurface/IOSurface.h>
+#include <VideoToolbox/VideoToolbox.h>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <stdint.h>
+#include <vector>
 
+// Encodes the frames of the direct mode component with VideoToolbox. The frames are IOSurfaces
+// wrapped as pixel buffers, the hardware encoder reads them where the compositor rendered them.
 class CEncoder : public CThread {
 public:
-    CEncoder() { }
-    ~CEncoder() { }
+    CEncoder();
+    ~CEncoder();
     bool Init() override { return true; }
-    void Run() override { }
+    void Run() override;
 
-    void Stop() { }
-    void OnStreamStart() { }
-    void InsertIDR() { }
+    void Stop();
+    // Queues a composed frame for the encoder thread, replacing the one it did not pick up yet.
+    // The surface must not be written again before the next two frames are queued.
+    void NewFrameReady(IOSurfaceRef surface, uint64_t targetTimestampNs);
+    // Drops the pixel buffer of a surface that is being destroyed
+    void ReleaseSurface(IOSurfaceRef surface);
+
+    void OnStreamStart();
+    void InsertIDR();
+    void InsertRecovery();
+    void ReportLostFrame(uint64_t lastReceivedTimestampNs);
+
+private:
+    bool CreateSession(int32_t width, int32_t height);
+    void DestroySession();
+    void ApplyDynamicParams();
+    void Encode(IOSurfaceRef surface, uint64_t targetTimestampNs);
+    // Pixel buffer of the surface, created once per surface
+    CVPixelBufferRef GetPixelBuffer(IOSurfaceRef surface);
+
+    static void OnEncoded(
+        void* outputCallbackRefCon,
+        void* sourceFrameRefCon,
+        OSStatus status,
+        VTEncodeInfoFlags infoFlags,
+        CMSampleBufferRef sampleBuffer
+    );
+    void SendFrame(CMSampleBufferRef sampleBuffer, uint64_t submitNs);
+
+    std::mutex m_frameMutex;
+    std::condition_variable m_frameReady;
+    // Retained until the encoder thread takes it
+    IOSurfaceRef m_queuedSurface = nullptr;
+    uint64_t m_queuedTimestampNs = 0;
+    bool m_exiting = false;
+
+    VTCompressionSessionRef m_session = nullptr;
+    int32_t m_width = 0;
+    int32_t m_height = 0;
+    int m_codec;
+    std::map<IOSurfaceRef, CVPixelBufferRef> m_pixelBuffers;
+    CFDictionaryRef m_forceKeyFrame;
+    // Last applied, so that a new session starts from them
+    FfiDynamicEncoderParams m_params = {};
+    uint64_t m_paramsGeneration = 0;
+
+    // Annex B bitstream of the frame being sent, only used by the VideoToolbox output thread
+    std::vector<unsigned char> m_bitstream;
+
+    IDRScheduler m_scheduler;
 };
@@ -0,0 +1,313 @@
+#include "OvrDirectModeComponent.h"
+#include "alvr_server/Logger.h"
+#include "alvr_server/PresentPacing.h"
+#include "alvr_server/Profiling.h"
+#include "alvr_server/Utils.h"
+#include <CoreFoundation/CoreFoundation.h>
+#include <algorithm>
+#include <set>
+#include <string.h>
+
+namespace {
+
+IOSurfaceRef CreateSurface(uint32_t width, uint32_t height) {
+    int32_t values[] = { (int32_t)width, (int32_t)height, 4, (int32_t)'BGRA' };
+    CFStringRef keys[]
+        = { kIOSurfaceWidth, kIOSurfaceHeight, kIOSurfaceBytesPerElement, kIOSurfacePixelFormat };
+    CFTypeRef numbers[4];
+    for (int i = 0; i < 4; i++) {
+        numbers[i] = CFNumberCreate(nullptr, kCFNumberSInt32Type, &values[i]);
+    }
+    CFMutableDictionaryRef properties = CFDictionaryCreateMutable(
+        nullptr, 5, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks
+    );
+    for (int i = 0; i < 4; i++) {
+        CFDictionarySetValue(properties, keys[i], numbers[i]);
+        CFRelease(numbers[i]);
+    }
+    // The compositor opens the swap textures by their ID
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wdeprecated-declarations"
+    CFDictionarySetValue(properties, kIOSurfaceIsGlobal, kCFBooleanTrue);
+#pragma clang diagnostic pop
+
+    IOSurfaceRef surface = IOSurfaceCreate(properties);
+    CFRelease(properties);
+    return surface;
+}
+
+} // namespace
+
+OvrDirectModeComponent::OvrDirectModeComponent(std::shared_ptr<PoseHistory> poseHistory)
+    : m_poseHistory(poseHistory)
+    , m_submitLayer(0)
+    , m_targetTimestampNs(0) { }
+
+OvrDirectModeComponent::~OvrDirectModeComponent() {
+    for (auto& [handle, entry] : m_handleMap) {
+        if (entry.second == 0) {
+            DestroyProcessResource(entry.first);
+        }
+    }
+    for (IOSurfaceRef surface : m_framePool) {
+        if (surface) {
+            CFRelease(surface);
+        }
+    }
+}
+
+void OvrDirectModeComponent::SetEncoder(std::shared_ptr<CEncoder> pEncoder) {
+    m_pEncoder = pEncoder;
+}
+
+/** Specific to Oculus compositor support, textures supplied must be created using this method. */
+void OvrDirectModeComponent::CreateSwapTextureSet(
+    uint32_t unPid,
+    const SwapTextureSetDesc_t* pSwapTextureSetDesc,
+    SwapTextureSet_t* pOutSwapTextureSet
+) {
+    Debug(
+        "OvrDirectModeComponent::CreateSwapTextureSet pid=%d Format=%d %dx%d SampleCount=%d",
+        unPid,
+        pSwapTextureSetDesc->nFormat,
+        pSwapTextureSetDesc->nWidth,
+        pSwapTextureSetDesc->nHeight,
+        pSwapTextureSetDesc->nSampleCount
+    );
+
+    // 8 bit BGRA whatever the requested format, so that the encoder can read the frames as they are
+    auto processResource = new ProcessResource();
+    processResource->pid = unPid;
+    processResource->index = 0;
+
+    for (int i = 0; i < 3; i++) {
+        IOSurfaceRef surface
+            = CreateSurface(pSwapTextureSetDesc->nWidth, pSwapTextureSetDesc->nHeight);
+        if (!surface) {
+            Error("Failed to create an IOSurface for the swap texture set");
+            for (int j = 0; j < i; j++) {
+                CFRelease(processResource->surfaces[j]);
+            }
+            delete processResource;
+            return;
+        }
+        processResource->surfaces[i] = surface;
+    }
+
+    for (int i = 0; i < 3; i++) {
+        auto handle = (vr::SharedTextureHandle_t)IOSurfaceGetID(processResource->surfaces[i]);
+        pOutSwapTextureSet->rSharedTextureHandles[i] = handle;
+        m_handleMap.insert(std::make_pair(handle, std::make_pair(processResource, i)));
+    }
+    pOutSwapTextureSet->unTextureFlags = 0;
+}
+
+/** Used to textures created using CreateSwapTextureSet.  Only one of the set's handles needs to be
+ * used to destroy the entire set. */
+void OvrDirectModeComponent::DestroySwapTextureSet(vr::SharedTextureHandle_t sharedTextureHandle) {
+    Debug("OvrDirectModeComponent::DestroySwapTextureSet %llu", sharedTextureHandle);
+
+    auto it = m_handleMap.find(sharedTextureHandle);
+    if (it == m_handleMap.end()) {
+        Debug("Requested to destroy not managing texture. handle:%llu", sharedTextureHandle);
+        return;
+    }
+    ProcessResource* resource = it->second.first;
+    for (IOSurfaceRef surface : resource->surfaces) {
+        m_handleMap.erase((vr::SharedTextureHandle_t)IOSurfaceGetID(surface));
+    }
+    DestroyProcessResource(resource);
+}
+
+/** Used to purge all texture sets for a given process. */
+void OvrDirectModeComponent::DestroyAllSwapTextureSets(uint32_t unPid) {
+    Debug("OvrDirectModeComponent::DestroyAllSwapTextureSets pid=%d", unPid);
+
+    std::set<ProcessResource*> resources;
+    for (auto it = m_handleMap.begin(); it != m_handleMap.end();) {
+        if (it->second.first->pid == unPid) {
+            resources.insert(it->second.first);
+            m_handleMap.erase(it++);
+        } else {
+            ++it;
+        }
+    }
+    for (ProcessResource* resource : resources) {
+        DestroyProcessResource(resource);
+    }
+}
+
+/** After Present returns, calls this to get the next index to use for rendering. */
+void OvrDirectModeComponent::GetNextSwapTextureSetIndex(
+    vr::SharedTextureHandle_t sharedTextureHandles[2], uint32_t (*pIndices)[2]
+) {
+    Debug("OvrDirectModeComponent::GetNextSwapTextureSetIndex");
+
+    for (int eye = 0; eye < 2; eye++) {
+        auto it = m_handleMap.find(sharedTextureHandles[eye]);
+        if (it == m_handleMap.end()) {
+            continue;
+        }
+        auto resource = it->second.first;
+        // Both eyes can be in the same set
+        if (eye == 0 || sharedTextureHandles[1] != sharedTextureHandles[0]) {
+            resource->index = (resource->index + 1) % 3;
+        }
+        if (pIndices) {
+            (*pIndices)[eye] = resource->index;
+        }
+    }
+}
+
+/** Call once per layer to draw for this frame.  One shared texture handle per eye.  Textures must
+ * be created using CreateSwapTextureSet and should be alternated per frame.  Call Present once all
+ * layers have been submitted. */
+void OvrDirectModeComponent::SubmitLayer(const SubmitLayerPerEye_t (&perEye)[2]) {
+    Debug("OvrDirectModeComponent::SubmitLayer");
+
+    std::lock_guard lock(m_presentMutex);
+
+    if (m_submitLayer == 0) {
+        // The frame is sent with the tracking it was rendered with
+        auto pose = m_poseHistory->GetBestPoseMatch(perEye[0].mHmdPose);
+        m_targetTimestampNs = pose ? pose->targetTimestampNs : 0;
+    }
+    if (m_submitLayer < MAX_LAYERS) {
+        m_submitLayers[m_submitLayer][0] = perEye[0];
+        m_submitLayers[m_submitLayer][1] = perEye[1];
+        m_submitLayer++;
+    } else {
+        Warn("Too many layers submitted!");
+    }
+}
+
+/** Submits queued layers for display. */
+void OvrDirectModeComponent::Present(vr::SharedTextureHandle_t syncTexture) {
+    ALVR_PROFILE_FRAME("present");
+    ALVR_PROFILE_ZONE("OvrDirectModeComponent::Present");
+    Debug("OvrDirectModeComponent::Present");
+
+    std::lock_guard lock(m_presentMutex);
+
+    ReportPresent(m_targetTimestampNs, 0);
+    RecordPresentArrival(GetSteadyTimeNs(), m_targetTimestampNs);
+
+    // IOSurfaces have no keyed mutex like the D3D shared textures, the sync texture is not waited
+    // on
+    IOSurfaceRef frame = ComposeFrame();
+    m_submitLayer = 0;
+    if (!frame) {
+        return;
+    }
+
+    ReportComposed(m_targetTimestampNs, 0);
+
+    if (m_pEncoder) {
+        m_pEncoder->NewFrameReady(frame, m_targetTimestampNs);
+    }
+}
+
+void OvrDirectModeComponent::PostPresent(const vr::IVRDriverDirectModeComponent::Throttling_t*) {
+    Debug("OvrDirectModeComponent::PostPresent");
+
+    WaitForVSync();
+}
+
+void OvrDirectModeComponent::DestroyProcessResource(ProcessResource* resource) {
+    for (IOSurfaceRef surface : resource->surfaces) {
+        if (m_pEncoder) {
+            m_pEncoder->ReleaseSurface(surface);
+        }
+        CFRelease(surface);
+    }
+    delete resource;
+}
+
+IOSurfaceRef OvrDirectModeComponent::FindSurface(vr::SharedTextureHandle_t handle) {
+    auto it = m_handleMap.find(handle);
+    if (it == m_handleMap.end()) {
+        Debug("Submitted texture is not found on HandleMap. Texture Handle=%llu", handle);
+        return nullptr;
+    }
+    return it->second.first->surfaces[it->second.second];
+}
+
+IOSurfaceRef OvrDirectModeComponent::ComposeFrame() {
+    ALVR_PROFILE_ZONE("OvrDirectModeComponent::ComposeFrame");
+
+    if (m_submitLayer == 0) {
+        return nullptr;
+    }
+    if (m_submitLayer > 1) {
+        // There is no compositor on macOS, the overlays are left out
+        Debug("Only the first of %d layers is streamed", m_submitLayer);
+    }
+
+    const auto& layer = m_submitLayers[0];
+    IOSurfaceRef left = FindSurface(layer[0].hTexture);
+    IOSurfaceRef right = FindSurface(layer[1].hTexture);
+    if (!left || !right) {
+        return nullptr;
+    }
+
+    const vr::VRTextureBounds_t& leftBounds = layer[0].bounds;
+    const vr::VRTextureBounds_t& rightBounds = layer[1].bounds;
+    if (left == right && leftBounds.uMin == 0.0f && leftBounds.uMax == 0.5f
+        && rightBounds.uMin == 0.5f && rightBounds.uMax == 1.0f && leftBounds.vMin == 0.0f
+        && leftBounds.vMax == 1.0f && rightBounds.vMin == 0.0f && rightBounds.vMax == 1.0f) {
+        // Side by side already, the encoder reads the swap texture itself
+        return left;
+    }
+
+    auto eyeWidth = (uint32_t)(IOSurfaceGetWidth(left) * (leftBounds.uMax - leftBounds.uMin));
+    auto height = (uint32_t)(IOSurfaceGetHeight(left) * (leftBounds.vMax - leftBounds.vMin));
+    IOSurfaceRef& target = m_framePool[m_nextFrame];
+    if (target
+        && (IOSurfaceGetWidth(target) != eyeWidth * 2 || IOSurfaceGetHeight(target) != height)) {
+        CFRelease(target);
+        target = nullptr;
+    }
+    if (!target) {
+        target = CreateSurface(eyeWidth * 2, height);
+        if (!target) {
+            Error("Failed to create an IOSurface for the frame");
+            return nullptr;
+        }
+    }
+    m_nextFrame = (m_nextFrame + 1) % FRAME_POOL_SIZE;
+
+    IOSurfaceLock(target, 0, nullptr);
+    CopyEye(left, leftBounds, target, 0);
+    CopyEye(right, rightBounds, target, 1);
+    IOSurfaceUnlock(target, 0, nullptr);
+
+    return target;
+}
+
+void OvrDirectModeComponent::CopyEye(
+    IOSurfaceRef source, const vr::VRTextureBounds_t& bounds, IOSurfaceRef target, int side
+) {
+    size_t eyeWidth = IOSurfaceGetWidth(target) / 2;
+    size_t sourceWidth = IOSurfaceGetWidth(source);
+    size_t sourceHeight = IOSurfaceGetHeight(source);
+
+    // Flipped bounds are not supported, the rectangle is clipped to both surfaces
+    size_t x = (size_t)(std::min(bounds.uMin, bounds.uMax) * sourceWidth);
+    size_t y = (size_t)(std::min(bounds.vMin, bounds.vMax) * sourceHeight);
+    size_t width = std::min(eyeWidth, sourceWidth - std::min(x, sourceWidth));
+    size_t height = std::min(IOSurfaceGetHeight(target), sourceHeight - std::min(y, sourceHeight));
+
+    IOSurfaceLock(source, kIOSurfaceLockReadOnly, nullptr);
+    auto sourceBase = (const uint8_t*)IOSurfaceGetBaseAddress(source);
+    auto targetBase = (uint8_t*)IOSurfaceGetBaseAddress(target);
+    size_t sourceStride = IOSurfaceGetBytesPerRow(source);
+    size_t targetStride = IOSurfaceGetBytesPerRow(target);
+    for (size_t row = 0; row < height; row++) {
+        memcpy(
+            targetBase + row * targetStride + side * eyeWidth * 4,
+            sourceBase + (y + row) * sourceStride + x * 4,
+            width * 4
+        );
+    }
+    IOSurfaceUnlock(source, kIOSurfaceLockReadOnly, nullptr);
+}
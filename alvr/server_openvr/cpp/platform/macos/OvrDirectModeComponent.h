@@ -0,0 +1,87 @@
+#pragma once
+#include "CEncoder.h"
+#include "alvr_server/PoseHistory.h"
+#include "alvr_server/openvr_driver_wrap.h"
+
+#include "alvr_server/bindings.h"
+
+#include <IOSurface/IOSurface.h>
+#include <map>
+#include <memory>
+#include <mutex>
+
+// Direct mode on macOS. The swap textures are IOSurfaces, and a frame that the compositor renders
+// side by side into one of them goes to the encoder as is. Separate eye textures are copied into a
+// double width surface first.
+class OvrDirectModeComponent : public vr::IVRDriverDirectModeComponent {
+public:
+    OvrDirectModeComponent(std::shared_ptr<PoseHistory> poseHistory);
+    ~OvrDirectModeComponent();
+
+    void SetEncoder(std::shared_ptr<CEncoder> pEncoder);
+
+    /** Specific to Oculus compositor support, textures supplied must be created using this method.
+     */
+    virtual void CreateSwapTextureSet(
+        uint32_t unPid,
+        const SwapTextureSetDesc_t* pSwapTextureSetDesc,
+        SwapTextureSet_t* pOutSwapTextureSet
+    );
+
+    /** Used to textures created using CreateSwapTextureSet.  Only one of the set's handles needs to
+     * be used to destroy the entire set. */
+    virtual void DestroySwapTextureSet(vr::SharedTextureHandle_t sharedTextureHandle);
+
+    /** Used to purge all texture sets for a given process. */
+    virtual void DestroyAllSwapTextureSets(uint32_t unPid);
+
+    /** After Present returns, calls this to get the next index to use for rendering. */
+    virtual void GetNextSwapTextureSetIndex(
+        vr::SharedTextureHandle_t sharedTextureHandles[2], uint32_t (*pIndices)[2]
+    );
+
+    /** Call once per layer to draw for this frame.  One shared texture handle per eye.  Textures
+     * must be created using CreateSwapTextureSet and should be alternated per frame.  Call Present
+     * once all layers have been submitted. */
+    virtual void SubmitLayer(const SubmitLayerPerEye_t (&perEye)[2]);
+
+    /** Submits queued layers for display. */
+    virtual void Present(vr::SharedTextureHandle_t syncTexture);
+
+    virtual void PostPresent(const vr::IVRDriverDirectModeComponent::Throttling_t* pThrottling);
+
+private:
+    // Resource for each process
+    struct ProcessResource {
+        IOSurfaceRef surfaces[3];
+        uint32_t pid;
+        uint32_t index;
+    };
+
+    void DestroyProcessResource(ProcessResource* resource);
+    IOSurfaceRef FindSurface(vr::SharedTextureHandle_t handle);
+    // The surface of the frame, the layer texture itself if both eyes are halves of it
+    IOSurfaceRef ComposeFrame();
+    // Copies the bounds of an eye texture into its half of the frame. Side is 0 or 1.
+    void CopyEye(
+        IOSurfaceRef source, const vr::VRTextureBounds_t& bounds, IOSurfaceRef target, int side
+    );
+
+    std::shared_ptr<CEncoder> m_pEncoder;
+    std::shared_ptr<PoseHistory> m_poseHistory;
+
+    // Handles are the IOSurface IDs
+    std::map<vr::SharedTextureHandle_t, std::pair<ProcessResource*, int>> m_handleMap;
+
+    // Double width frames of the copy path, in the order the encoder reads them
+    static const int FRAME_POOL_SIZE = 3;
+    IOSurfaceRef m_framePool[FRAME_POOL_SIZE] = {};
+    int m_nextFrame = 0;
+
+    static const int MAX_LAYERS = 10;
+    int m_submitLayer;
+    SubmitLayerPerEye_t m_submitLayers[MAX_LAYERS][2];
+    uint64_t m_targetTimestampNs;
+
+    std::mutex m_presentMutex;
+};
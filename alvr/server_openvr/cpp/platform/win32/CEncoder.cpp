@@ -1,92 +1,467 @@
 #include "CEncoder.h"
 
+#include "EncodeBenchmark.h"
+#include "GpuMemoryD3D11.h"
+
+#include "alvr_server/AllocationCheck.h"
+#include "alvr_server/ApplicationProfile.h"
+#include "alvr_server/EncoderBackend.h"
+#include "alvr_server/FrameDeadline.h"
+#include "alvr_server/GpuMemory.h"
+#include "alvr_server/PresentPacing.h"
+#include "alvr_server/Profiling.h"
+#include "alvr_server/QualityGovernor.h"
+#include "alvr_server/StartupTimeline.h"
+#include "alvr_server/ThreadScheduling.h"
+#include <chrono>
+
 CEncoder::CEncoder()
     : m_bExiting(false)
-    , m_targetTimestampNs(0) {
-    m_encodeFinished.Set();
-}
+    , m_crossAdapter(false)
+    , m_composeFenceValue(0)
+    , m_encodeFenceValue(0)
+    , m_queuedSlot(-1)
+    , m_encodingSlot(-1)
+    , m_previousSlot(-1) { }
 
 CEncoder::~CEncoder() {
     if (m_videoEncoder) {
         m_videoEncoder->Shutdown();
         m_videoEncoder.reset();
     }
+    for (FrameSlot& slot : m_frameRing) {
+        slot.texture.Reset();
+        slot.encodeTexture.Reset();
+        slot.sharedTexture.Reset();
+    }
+    ReleaseEncodeDevice();
+}
+
+namespace {
+// Encoder failures in a row, each followed by a rebuild, before the stream is given up
+const int MAX_ENCODER_REBUILDS = 3;
+
+// PCI ids and user mode driver version. The adapter LUID is not used, it changes on every boot.
+std::string GetGpuId(ID3D11Device* device) {
+    Microsoft::WRL::ComPtr<IDXGIDevice> dxgiDevice;
+    Microsoft::WRL::ComPtr<IDXGIAdapter> adapter;
+    DXGI_ADAPTER_DESC desc = {};
+    LARGE_INTEGER driverVersion = {};
+    if (FAILED(device->QueryInterface(IID_PPV_ARGS(&dxgiDevice)))
+        || FAILED(dxgiDevice->GetAdapter(&adapter)) || FAILED(adapter->GetDesc(&desc))) {
+        return "unknown";
+    }
+    adapter->CheckInterfaceSupport(__uuidof(IDXGIDevice), &driverVersion);
+
+    char id[64];
+    snprintf(
+        id,
+        sizeof(id),
+        "%04x-%04x-%08x_%llx",
+        desc.VendorId,
+        desc.DeviceId,
+        desc.SubSysId,
+        (unsigned long long)driverVersion.QuadPart
+    );
+    return id;
+}
+
+// Fence created on signalDevice and opened on waitDevice
+bool CreateSharedFence(
+    ID3D11Device5* signalDevice,
+    ID3D11Device5* waitDevice,
+    bool crossAdapter,
+    ComPtr<ID3D11Fence>& signalFence,
+    ComPtr<ID3D11Fence>& waitFence
+) {
+    D3D11_FENCE_FLAG flags = D3D11_FENCE_FLAG_SHARED;
+    if (crossAdapter) {
+        flags = (D3D11_FENCE_FLAG)(flags | D3D11_FENCE_FLAG_SHARED_CROSS_ADAPTER);
+    }
+    HANDLE handle;
+    if (FAILED(signalDevice->CreateFence(0, flags, IID_PPV_ARGS(&signalFence)))
+        || FAILED(signalFence->CreateSharedHandle(NULL, GENERIC_ALL, NULL, &handle))) {
+        return false;
+    }
+    HRESULT hr = waitDevice->OpenSharedFence(handle, IID_PPV_ARGS(&waitFence));
+    CloseHandle(handle);
+    return SUCCEEDED(hr);
+}
+
+// Texture created on composeDevice and opened on encodeDevice, which is on another adapter. Only
+// row major textures shared with an NT handle can cross adapters, they can't be bound and are
+// only copied to and from.
+bool CreateCrossAdapterTexture(
+    ID3D11Device3* composeDevice,
+    ID3D11Device1* encodeDevice,
+    const D3D11_TEXTURE2D_DESC& desc,
+    ComPtr<ID3D11Texture2D>& texture,
+    ComPtr<ID3D11Texture2D>& sharedTexture
+) {
+    D3D11_TEXTURE2D_DESC1 sharedDesc = {};
+    sharedDesc.Width = desc.Width;
+    sharedDesc.Height = desc.Height;
+    sharedDesc.MipLevels = 1;
+    sharedDesc.ArraySize = 1;
+    sharedDesc.Format = desc.Format;
+    sharedDesc.SampleDesc.Count = 1;
+    sharedDesc.Usage = D3D11_USAGE_DEFAULT;
+    sharedDesc.MiscFlags = D3D11_RESOURCE_MISC_SHARED | D3D11_RESOURCE_MISC_SHARED_NTHANDLE;
+    sharedDesc.TextureLayout = D3D11_TEXTURE_LAYOUT_ROW_MAJOR;
+
+    ComPtr<ID3D11Texture2D1> texture1;
+    ComPtr<IDXGIResource1> resource;
+    HANDLE handle;
+    if (FAILED(composeDevice->CreateTexture2D1(&sharedDesc, NULL, &texture1))
+        || FAILED(texture1.As(&resource))
+        || FAILED(resource->CreateSharedHandle(
+            NULL, DXGI_SHARED_RESOURCE_READ | DXGI_SHARED_RESOURCE_WRITE, NULL, &handle
+        ))) {
+        return false;
+    }
+    TrackTextureMemory(texture1.Get(), "Frame ring");
+    HRESULT hr = encodeDevice->OpenSharedResource1(handle, IID_PPV_ARGS(&sharedTexture));
+    CloseHandle(handle);
+    return SUCCEEDED(hr) && SUCCEEDED(texture1.As(&texture));
+}
+}
+
+// The encode device stays on D3D11 rather than D3D12. SteamVR hands over D3D11 shared textures,
+// and NVENC, AMF and VPL are all set up on D3D11 devices. The separate device already has its own
+// context, and the shared ID3D11Fence objects are the kernel fences ID3D12Fence uses, so compose
+// and encode run in parallel without a D3D12 queue of their own.
+bool CEncoder::InitializeEncodeDevice(int adapterIndex, bool crossAdapter) {
+    ComPtr<ID3D11Device5> composeDevice;
+    if (FAILED(m_d3dRender->GetDevice()->QueryInterface(IID_PPV_ARGS(&composeDevice)))
+        || FAILED(m_d3dRender->GetContext()->QueryInterface(IID_PPV_ARGS(&m_composeContext)))) {
+        Info("D3D11 fences are not supported\n");
+        return false;
+    }
+
+    m_crossAdapter = crossAdapter;
+    m_encodeRender = std::make_shared<CD3DRender>();
+    if (!m_encodeRender->Initialize(adapterIndex)) {
+        Warn("Failed to create the encode device on adapter %d\n", adapterIndex);
+        return false;
+    }
+
+    ComPtr<ID3D11Device5> encodeDevice;
+    if (FAILED(m_encodeRender->GetDevice()->QueryInterface(IID_PPV_ARGS(&encodeDevice)))
+        || FAILED(m_encodeRender->GetContext()->QueryInterface(IID_PPV_ARGS(&m_encodeContext)))
+        || !CreateSharedFence(
+            composeDevice.Get(),
+            encodeDevice.Get(),
+            crossAdapter,
+            m_composeFence,
+            m_composeFenceOnEncoder
+        )
+        || !CreateSharedFence(
+            encodeDevice.Get(),
+            composeDevice.Get(),
+            crossAdapter,
+            m_encodeFence,
+            m_encodeFenceOnComposer
+        )) {
+        Warn("Failed to share fences with the encode device\n");
+        return false;
+    }
+
+    if (!CreateFrameRing(true)) {
+        Warn("Failed to share frames with the encode device\n");
+        return false;
+    }
+
+    return true;
+}
+
+void CEncoder::ReleaseEncodeDevice() {
+    m_composeContext.Reset();
+    m_encodeContext.Reset();
+    m_composeFence.Reset();
+    m_composeFenceOnEncoder.Reset();
+    m_encodeFence.Reset();
+    m_encodeFenceOnComposer.Reset();
+    for (FrameSlot& slot : m_frameRing) {
+        slot.encodeTexture.Reset();
+        slot.sharedTexture.Reset();
+    }
+    if (m_encodeRender && m_encodeRender != m_d3dRender) {
+        m_encodeRender->Shutdown();
+    }
+    m_encodeRender.reset();
+    m_crossAdapter = false;
+}
+
+bool CEncoder::CreateFrameRing(bool shared) {
+    D3D11_TEXTURE2D_DESC desc;
+    m_FrameRender->GetTexture()->GetDesc(&desc);
+    desc.MiscFlags = shared ? D3D11_RESOURCE_MISC_SHARED : 0;
+
+    ComPtr<ID3D11Device3> composeDevice;
+    ComPtr<ID3D11Device1> encodeDevice;
+    if (m_crossAdapter
+        && (FAILED(m_d3dRender->GetDevice()->QueryInterface(IID_PPV_ARGS(&composeDevice)))
+            || FAILED(m_encodeRender->GetDevice()->QueryInterface(IID_PPV_ARGS(&encodeDevice))))) {
+        return false;
+    }
+
+    for (FrameSlot& slot : m_frameRing) {
+        slot.texture.Reset();
+        slot.encodeTexture.Reset();
+        slot.sharedTexture.Reset();
+        slot.composedFenceValue = 0;
+        slot.encodedFenceValue = 0;
+
+        if (m_crossAdapter) {
+            D3D11_TEXTURE2D_DESC encodeDesc = desc;
+            encodeDesc.MiscFlags = 0;
+            if (!CreateCrossAdapterTexture(
+                    composeDevice.Get(), encodeDevice.Get(), desc, slot.texture, slot.sharedTexture
+                )
+                || FAILED(m_encodeRender->GetDevice()->CreateTexture2D(
+                    &encodeDesc, NULL, &slot.encodeTexture
+                ))) {
+                return false;
+            }
+            TrackTextureMemory(slot.encodeTexture.Get(), "Frame ring");
+            continue;
+        }
+
+        if (FAILED(m_d3dRender->GetDevice()->CreateTexture2D(&desc, NULL, &slot.texture))) {
+            return false;
+        }
+        TrackTextureMemory(slot.texture.Get(), "Frame ring");
+        if (!shared) {
+            slot.encodeTexture = slot.texture;
+            continue;
+        }
+
+        ComPtr<IDXGIResource> resource;
+        HANDLE handle;
+        if (FAILED(slot.texture.As(&resource)) || FAILED(resource->GetSharedHandle(&handle))
+            || FAILED(m_encodeRender->GetDevice()->OpenSharedResource(
+                handle, IID_PPV_ARGS(&slot.encodeTexture)
+            ))) {
+            return false;
+        }
+    }
+
+    return true;
 }
 
 void CEncoder::Initialize(std::shared_ptr<CD3DRender> d3dRender) {
+    m_d3dRender = d3dRender;
     m_FrameRender = std::make_shared<FrameRender>(d3dRender);
-    m_FrameRender->Startup();
+    if (!m_FrameRender->Startup()) {
+        throw MakeException("Failed to initialize the frame renderer");
+    }
+    StartupMilestone("frame_renderer");
+    m_gpuTimer = std::make_unique<GpuFrameTimer>(d3dRender->GetDevice());
+
+    int adapterIndex = Settings_Instance()->m_nAdapterIndex;
+    int encodeAdapterIndex = Settings_Instance()->m_nEncodeAdapterIndex;
+    bool initialized = false;
+    if (encodeAdapterIndex >= 0 && encodeAdapterIndex != adapterIndex) {
+        initialized = InitializeEncodeDevice(encodeAdapterIndex, true);
+        if (initialized) {
+            Info("Encoding on adapter %d\n", encodeAdapterIndex);
+        } else {
+            Warn(
+                "Can't encode on adapter %d, encoding on the compositor one\n", encodeAdapterIndex
+            );
+            ReleaseEncodeDevice();
+        }
+    }
+    if (!initialized && !InitializeEncodeDevice(adapterIndex, false)) {
+        Info("Encoding on the compositor device\n");
+        ReleaseEncodeDevice();
+        m_encodeRender = d3dRender;
+        if (!CreateFrameRing(false)) {
+            throw MakeException("Failed to create the frame ring textures");
+        }
+    }
+    StartupMilestone("encode_device");
+
+    CreateVideoEncoder();
+}
+
+void CEncoder::CreateVideoEncoder() {
     uint32_t encoderWidth, encoderHeight;
     m_FrameRender->GetEncodingResolution(&encoderWidth, &encoderHeight);
 
-    Exception vplException;
-    Exception vceException;
-    Exception nvencException;
+    // The backend that worked before depends on the GPU that encodes
+    const std::string gpuId = GetGpuId(m_encodeRender->GetDevice());
+    std::vector<EncoderBackend> order
+        = { EncoderBackend::Amf, EncoderBackend::Nvenc, EncoderBackend::Vpl };
 #ifdef ALVR_GPL
-    Exception swException;
-
     if (Settings_Instance()->m_forceSwEncoding) {
+        // The hardware encoders are still tried if the software one fails
+        order.insert(order.begin(), EncoderBackend::Software);
+    } else {
+        order.push_back(EncoderBackend::Software);
+        order = EncoderBackendProbeOrder(gpuId, order);
+    }
+#else
+    order = EncoderBackendProbeOrder(gpuId, order);
+#endif
+
+    std::string errors;
+    for (EncoderBackend backend : order) {
         try {
-            Debug("Try to use VideoEncoderSW.\n");
-            m_videoEncoder
-                = std::make_shared<VideoEncoderSW>(d3dRender, encoderWidth, encoderHeight);
+            Debug("Try to use %s encoder.\n", EncoderBackendName(backend));
+            switch (backend) {
+            case EncoderBackend::Amf:
+                m_videoEncoder = std::make_shared<VideoEncoderAMF>(
+                    m_encodeRender, encoderWidth, encoderHeight
+                );
+                break;
+            case EncoderBackend::Nvenc:
+                m_videoEncoder = std::make_shared<VideoEncoderNVENC>(
+                    m_encodeRender, encoderWidth, encoderHeight
+                );
+                break;
+            case EncoderBackend::Vpl:
+                m_videoEncoder = std::make_shared<VideoEncoderVPL>(
+                    m_encodeRender, encoderWidth, encoderHeight
+                );
+                break;
+#ifdef ALVR_GPL
+            case EncoderBackend::Software:
+                // The conversion pass would change the state of the compositor's context from
+                // this thread when the encoder shares its device
+                m_videoEncoder = std::make_shared<VideoEncoderSW>(
+                    m_encodeRender, encoderWidth, encoderHeight, m_encodeRender != m_d3dRender
+                );
+                break;
+#endif
+            default:
+                throw MakeException("not available on Windows");
+            }
             m_videoEncoder->Initialize();
+            m_scheduler.SetEncoderCapabilities(m_videoEncoder->GetCapabilities());
+            // A software fallback after a transient hardware failure would otherwise be tried
+            // first from then on
+            if (backend != EncoderBackend::Software) {
+                StoreEncoderBackend(gpuId, backend);
+            }
+            LogGpuMemory("encoder started");
+            StartupMilestone("encoder");
             return;
         } catch (Exception e) {
-            swException = e;
+            m_videoEncoder.reset();
+            StartupMilestone(std::string("failed_") + EncoderBackendName(backend));
+            errors += std::string(errors.empty() ? "" : ", ") + EncoderBackendName(backend) + ": "
+                + e.what();
         }
     }
-#endif
+    throw MakeException("All VideoEncoder are not available. %s", errors.c_str());
+}
 
+void CEncoder::ReleaseVideoEncoder() {
     try {
-        Debug("Try to use VideoEncoderAMF.\n");
-        m_videoEncoder = std::make_shared<VideoEncoderAMF>(d3dRender, encoderWidth, encoderHeight);
-        m_videoEncoder->Initialize();
-        return;
+        m_videoEncoder->Shutdown();
     } catch (Exception e) {
-        vceException = e;
+        // A lost session may also fail to close
     }
-    try {
-        Debug("Try to use VideoEncoderNVENC.\n");
-        m_videoEncoder
-            = std::make_shared<VideoEncoderNVENC>(d3dRender, encoderWidth, encoderHeight);
-        m_videoEncoder->Initialize();
+    m_videoEncoder.reset();
+    {
+        // The new encoder does not read the inputs of the old one
+        std::lock_guard<std::mutex> lock(m_frameRingMutex);
+        m_previousSlot = -1;
+    }
+}
+
+void CEncoder::RecoverVideoEncoder(const char* error) {
+    Error("Encoder failed: %s\n", error);
+    ReleaseVideoEncoder();
+
+    if (++m_encoderFailures > MAX_ENCODER_REBUILDS) {
+        Error("Giving up on the encoder after %d failures\n", m_encoderFailures);
         return;
-    } catch (Exception e) {
-        nvencException = e;
     }
+    // The same backend is tried again first, then the next ones of the probe order
     try {
-        Debug("Try to use VideoEncoderVPL.\n");
-        m_videoEncoder = std::make_shared<VideoEncoderVPL>(d3dRender, encoderWidth, encoderHeight);
-        m_videoEncoder->Initialize();
+        CreateVideoEncoder();
+        m_scheduler.InsertIDR();
+    } catch (Exception e) {
+        Error("Failed to recreate the encoder: %s\n", e.what());
+    }
+}
+
+void CEncoder::SetApplicationSettings(const Settings& settings) {
+    std::lock_guard<std::mutex> lock(m_applicationSettingsMutex);
+    m_applicationSettings = settings;
+}
+
+void CEncoder::UpdateApplicationSettings() {
+    std::optional<Settings> settings;
+    {
+        std::lock_guard<std::mutex> lock(m_applicationSettingsMutex);
+        settings.swap(m_applicationSettings);
+    }
+    if (!settings || !ApplicationSettingsChanged(*settings)) {
         return;
+    }
+    ApplyApplicationSettings(*settings);
+    if (!m_videoEncoder) {
+        return;
+    }
+
+    Info("Encoder profile changed, restarting the encoder\n");
+    ReleaseVideoEncoder();
+    try {
+        CreateVideoEncoder();
+        m_scheduler.InsertIDR();
     } catch (Exception e) {
-        vplException = e;
+        Error("Failed to recreate the encoder: %s\n", e.what());
+    }
+}
+
+bool CEncoder::SkipStaticFrame(const FrameSlot& frame) {
+    bool skipStaticFrames = Settings_Instance()->m_skipStaticFrames;
+    bool sceneChangeDetection = Settings_Instance()->m_sceneChangeDetection;
+    bool staticBlocks = Settings_Instance()->m_staticBlockQpOffset > 0;
+    m_staticBlocks.width = 0;
+    if (!(skipStaticFrames || sceneChangeDetection || staticBlocks) || m_staticFramesFailed) {
+        return false;
     }
-#ifdef ALVR_GPL
     try {
-        Debug("Try to use VideoEncoderSW.\n");
-        m_videoEncoder = std::make_shared<VideoEncoderSW>(d3dRender, encoderWidth, encoderHeight);
-        m_videoEncoder->Initialize();
-        return;
+        if (!m_staticFrames) {
+            m_staticFrames = std::make_unique<StaticFrameDetector>(
+                m_encodeRender->GetDevice(), m_encodeRender->GetContext()
+            );
+        }
+        m_staticFrames->Submit(frame.encodeTexture.Get());
     } catch (Exception e) {
-        swException = e;
-    }
-    throw MakeException(
-        "All VideoEncoder are not available. VCE: %s, NVENC: %s, VPL: %s, SW: %s",
-        vceException.what(),
-        nvencException.what(),
-        vplException.what(),
-        swException.what()
-    );
-#else
-    throw MakeException(
-        "All VideoEncoder are not available. VCE: %s, NVENC: %s, VPL: %s",
-        vceException.what(),
-        nvencException.what(),
-        vplException.what()
-    );
-#endif
+        Warn("Frame copies unavailable: %s\n", e.what());
+        m_staticFrames.reset();
+        m_staticFramesFailed = true;
+        return false;
+    }
+
+    // The client must get the frames that repair the stream
+    bool samePose = frame.targetTimestampNs != 0
+        && frame.targetTimestampNs == m_lastEncodedTimestampNs;
+    if (skipStaticFrames && samePose && !m_scheduler.IsRecoveryPending()
+        && m_staticFrames->Matches()) {
+        Debug("Skipping static frame %llu\n", frame.targetTimestampNs);
+        return true;
+    }
+    // With another pose every pixel moves
+    if (staticBlocks && samePose) {
+        m_staticFrames->FindStaticBlocks(m_staticBlocks);
+    }
+    if (sceneChangeDetection && m_staticFrames->DetectSceneCut(m_sceneChanges)) {
+        Debug(
+            "Scene cut at frame %llu, histogram difference %.2f\n",
+            frame.targetTimestampNs,
+            m_sceneChanges.GetStats().histogramDifference
+        );
+        m_scheduler.InsertSceneCut();
+    }
+    m_staticFrames->Accept();
+    m_lastEncodedTimestampNs = frame.targetTimestampNs;
+    return false;
 }
 
 void CEncoder::SetViewParams(
@@ -96,48 +471,192 @@ void CEncoder::SetViewParams(
     vr::HmdMatrix34_t eyeToHeadRight
 ) {
     m_FrameRender->SetViewParams(projLeft, eyeToHeadLeft, projRight, eyeToHeadRight);
+
+    std::lock_guard<std::mutex> lock(m_frameRingMutex);
+    m_projections[0] = projLeft;
+    m_projections[1] = projRight;
+}
+
+void CEncoder::SetRenderProjections(vr::HmdRect2_t projLeft, vr::HmdRect2_t projRight) {
+    m_FrameRender->SetRenderProjections(projLeft, projRight);
 }
 
 bool CEncoder::CopyToStaging(
     ID3D11Texture2D* pTexture[][2],
+    ID3D11ShaderResourceView* pViews[][2],
     vr::VRTextureBounds_t bounds[][2],
     vr::HmdMatrix34_t poses[],
     int layerCount,
     bool recentering,
     uint64_t presentationTime,
     uint64_t targetTimestampNs,
-    const std::string& message,
-    const std::string& debugText
+    const FfiFoveationCenter& foveationCenter,
+    const vr::HmdQuaternion_t& headOrientation,
+    const char* message,
+    const vr::HmdMatrix34_t* headPose
 ) {
-    m_presentationTime = presentationTime;
-    m_targetTimestampNs = targetTimestampNs;
-    m_FrameRender->Startup();
+    int slot = 0;
+    {
+        std::lock_guard<std::mutex> lock(m_frameRingMutex);
+        while (slot == m_queuedSlot || slot == m_encodingSlot || slot == m_previousSlot) {
+            slot++;
+        }
+    }
 
+    FrameSlot& frame = m_frameRing[slot];
+
+    ID3D11DeviceContext* context = m_d3dRender->GetContext();
+    if (TimesFramesOnGpu()) {
+        m_gpuTimer->ReportCompleted(context);
+        m_gpuTimer->Begin(context, targetTimestampNs);
+    }
+    m_FrameRender->SetFoveationCenter(foveationCenter);
     m_FrameRender->RenderFrame(
-        pTexture, bounds, poses, layerCount, recentering, message, debugText
+        pTexture, pViews, bounds, poses, layerCount, recentering, message, headPose
     );
+    // On a single device the encoder thread only makes copies and video processor calls on the
+    // shared context, which is multithread protected, so this never waits for an ongoing encode
+    if (m_composeContext && frame.encodedFenceValue != 0) {
+        m_composeContext->Wait(m_encodeFenceOnComposer.Get(), frame.encodedFenceValue);
+    }
+    context->CopyResource(frame.texture.Get(), m_FrameRender->GetTexture().Get());
+    if (TimesFramesOnGpu()) {
+        m_gpuTimer->End(context);
+    }
+    if (m_composeContext) {
+        m_composeFenceValue++;
+        m_composeContext->Signal(m_composeFence.Get(), m_composeFenceValue);
+        frame.composedFenceValue = m_composeFenceValue;
+    }
+    frame.presentationTime = presentationTime;
+    frame.targetTimestampNs = targetTimestampNs;
+    frame.foveationCenter = foveationCenter;
+    frame.headOrientation = headOrientation;
+
+    std::lock_guard<std::mutex> lock(m_frameRingMutex);
+    if (m_queuedSlot >= 0) {
+        Debug(
+            "Encoder is lagging, dropping frame %llu\n", m_frameRing[m_queuedSlot].targetTimestampNs
+        );
+        RecordPresentsDropped(1);
+    }
+    m_queuedSlot = slot;
+
     return true;
 }
 
 void CEncoder::Run() {
     Debug("CEncoder: Start thread. Id=%d\n", GetCurrentThreadId());
     SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_MOST_URGENT);
+    ApplyStreamingThreadScheduling("encoder");
+
+    // Offline run of the frame path on captured frames instead of the ones of the compositor
+    if (const char* benchmark = getenv("ALVR_ENCODE_BENCHMARK")) {
+        if (m_videoEncoder) {
+            m_videoEncoder->Shutdown();
+            m_videoEncoder.reset();
+        }
+        RunEncodeBenchmark(m_encodeRender, benchmark, m_bExiting);
+        return;
+    }
+
+    QualityGovernor governor;
 
     while (!m_bExiting) {
-        m_newFrameReady.Wait();
+        WaitRecorded(m_newFrameReady, m_newFrameReadyStats);
         if (m_bExiting)
             break;
+        UpdateApplicationSettings();
 
-        if (m_FrameRender->GetTexture()) {
-            m_videoEncoder->Transmit(
-                m_FrameRender->GetTexture().Get(),
-                m_presentationTime,
-                m_targetTimestampNs,
-                m_scheduler.CheckIDRInsertion()
-            );
+        vr::HmdRect2_t projections[2];
+        {
+            std::lock_guard<std::mutex> lock(m_frameRingMutex);
+            m_encodingSlot = m_queuedSlot;
+            m_queuedSlot = -1;
+            projections[0] = m_projections[0];
+            projections[1] = m_projections[1];
         }
 
-        m_encodeFinished.Set();
+        if (m_encodingSlot >= 0) {
+            // Waiting for the first present of the game and composing it, the encode of the IDR
+            // frame follows
+            StartupMilestone("first_compose");
+            ALVR_PROFILE_ZONE("CEncoder encode");
+            ALVR_NO_ALLOCATIONS("CEncoder encode");
+            FrameSlot& frame = m_frameRing[m_encodingSlot];
+            if (m_encodeContext) {
+                m_encodeContext->Wait(m_composeFenceOnEncoder.Get(), frame.composedFenceValue);
+            }
+            if (m_crossAdapter) {
+                // Pulls the frame over the bus into a texture the encoders can bind
+                m_encodeContext->CopyResource(
+                    frame.encodeTexture.Get(), frame.sharedTexture.Get()
+                );
+            }
+
+            // The client must get the frames that repair the stream
+            bool late = Settings_Instance()->m_dropLateFrames && !m_scheduler.IsRecoveryPending()
+                && g_frameDeadline.IsLate(frame.targetTimestampNs);
+            if (late) {
+                Debug("Dropping late frame %llu\n", frame.targetTimestampNs);
+            }
+            bool skipped = m_videoEncoder && (late || SkipStaticFrame(frame));
+            try {
+                if (m_videoEncoder && !skipped) {
+                    uint64_t lastReceivedTimestampNs;
+                    if (m_scheduler.CheckRefInvalidation(lastReceivedTimestampNs)) {
+                        if (m_videoEncoder->InvalidateRefFrames(lastReceivedTimestampNs)) {
+                            ReportRecoveryFrame(frame.targetTimestampNs);
+                        } else {
+                            m_scheduler.InsertRecovery();
+                        }
+                    }
+                    bool insertIDR = m_scheduler.CheckIDRInsertion();
+                    if (!insertIDR && m_scheduler.CheckIntraRefreshInsertion()) {
+                        m_videoEncoder->StartIntraRefresh();
+                    }
+                    m_videoEncoder->SetFoveationCenter(frame.foveationCenter);
+                    m_videoEncoder->SetHeadView(frame.headOrientation, projections);
+                    m_videoEncoder->SetStaticBlocks(&m_staticBlocks);
+                    auto encodeBegin = std::chrono::steady_clock::now();
+                    m_videoEncoder->Transmit(
+                        frame.encodeTexture.Get(),
+                        frame.presentationTime,
+                        frame.targetTimestampNs,
+                        insertIDR
+                    );
+                    ALVR_PROFILE_FRAME("encoded");
+                    m_encoderFailures = 0;
+                    // The compose GPU time is not measured, Transmit waits for the end of the
+                    // composition on the encode context
+                    governor.Report(
+                        0,
+                        std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::steady_clock::now() - encodeBegin
+                        )
+                            .count()
+                    );
+                }
+            } catch (Exception e) {
+                RecoverVideoEncoder(e.what());
+            }
+            if (m_encodeContext) {
+                m_encodeFenceValue++;
+                m_encodeContext->Signal(m_encodeFence.Get(), m_encodeFenceValue);
+                m_encodeContext->Flush();
+            }
+
+            std::lock_guard<std::mutex> lock(m_frameRingMutex);
+            int releasedSlot = m_encodingSlot;
+            if (m_videoEncoder && m_videoEncoder->GetCapabilities().async && !skipped) {
+                releasedSlot = m_previousSlot;
+                m_previousSlot = m_encodingSlot;
+            }
+            if (m_encodeContext && releasedSlot >= 0) {
+                m_frameRing[releasedSlot].encodedFenceValue = m_encodeFenceValue;
+            }
+            m_encodingSlot = -1;
+        }
     }
 }
 
@@ -145,18 +664,24 @@ void CEncoder::Stop() {
     m_bExiting = true;
     m_newFrameReady.Set();
     Join();
+    for (FrameSlot& slot : m_frameRing) {
+        slot.texture.Reset();
+        slot.encodeTexture.Reset();
+        slot.sharedTexture.Reset();
+    }
     m_FrameRender.reset();
 }
 
-void CEncoder::NewFrameReady() {
-    m_encodeFinished.Reset();
-    m_newFrameReady.Set();
-}
-
-void CEncoder::WaitForEncode() { m_encodeFinished.Wait(); }
+void CEncoder::NewFrameReady() { m_newFrameReady.Set(); }
 
 void CEncoder::OnStreamStart() { m_scheduler.OnStreamStart(); }
 
-void CEncoder::InsertIDR() { m_scheduler.InsertIDR(); }
+void CEncoder::InsertIDR() { m_scheduler.RequestIDR(); }
+
+void CEncoder::InsertRecovery() { m_scheduler.InsertRecovery(); }
+
+void CEncoder::ReportLostFrame(uint64_t lastReceivedTimestampNs) {
+    m_scheduler.InsertRefInvalidation(lastReceivedTimestampNs);
+}
 
 void CEncoder::CaptureFrame() { }
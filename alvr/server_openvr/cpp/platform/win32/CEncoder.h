@@ -4,14 +4,20 @@
 #include "shared/threadtools.h"
 
 #include "FrameRender.h"
+#include "GpuFrameTimer.h"
+#include "StaticFrameDetector.h"
 #include "VideoEncoder.h"
 #include "VideoEncoderAMF.h"
 #include "VideoEncoderNVENC.h"
 #include "VideoEncoderVPL.h"
+#include "alvr_server/LockStats.h"
 #include "alvr_server/Utils.h"
 #include <d3d11.h>
 #include <d3d11_1.h>
+#include <d3d11_4.h>
 #include <map>
+#include <mutex>
+#include <optional>
 #include <wincodec.h>
 #include <wincodecsdk.h>
 #include <wrl.h>
@@ -40,17 +46,23 @@ public:
         vr::HmdRect2_t projRight,
         vr::HmdMatrix34_t eyeToHeadRight
     );
+    // See FrameRender::SetRenderProjections
+    void SetRenderProjections(vr::HmdRect2_t projLeft, vr::HmdRect2_t projRight);
 
+    // pViews are the shader resource views of the textures, null ones are created when needed
     bool CopyToStaging(
         ID3D11Texture2D* pTexture[][2],
+        ID3D11ShaderResourceView* pViews[][2],
         vr::VRTextureBounds_t bounds[][2],
         vr::HmdMatrix34_t poses[],
         int layerCount,
         bool recentering,
         uint64_t presentationTime,
         uint64_t targetTimestampNs,
-        const std::string& message,
-        const std::string& debugText
+        const FfiFoveationCenter& foveationCenter,
+        const vr::HmdQuaternion_t& headOrientation,
+        const char* message,
+        const vr::HmdMatrix34_t* headPose = nullptr
     );
 
     virtual void Run();
@@ -59,22 +71,107 @@ public:
 
     void NewFrameReady();
 
-    void WaitForEncode();
-
     void OnStreamStart();
 
     void InsertIDR();
+    void InsertRecovery();
+    void ReportLostFrame(uint64_t lastReceivedTimestampNs);
 
     void CaptureFrame();
 
+    // True if CopyToStaging reports the present and composed times of the frames from the GPU
+    bool TimesFramesOnGpu() const { return m_gpuTimer && m_gpuTimer->Valid(); }
+
+    // Settings with the profile of the game that connected, see alvr_server/ApplicationProfile.h.
+    // The encoder thread creates the encoder again when they change its settings. The compose
+    // chain keeps its color correction until the next stream.
+    void SetApplicationSettings(const Settings& settings);
+
 private:
-    CThreadEvent m_newFrameReady, m_encodeFinished;
+    struct FrameSlot {
+        ComPtr<ID3D11Texture2D> texture;
+        // The same texture opened on the encode device. When encoding on another adapter this is
+        // a texture of the encode device that sharedTexture is copied into.
+        ComPtr<ID3D11Texture2D> encodeTexture;
+        // Only when encoding on another adapter, the row major texture opened on the encode device
+        ComPtr<ID3D11Texture2D> sharedTexture;
+        uint64_t presentationTime;
+        uint64_t targetTimestampNs;
+        FfiFoveationCenter foveationCenter;
+        vr::HmdQuaternion_t headOrientation;
+        uint64_t composedFenceValue;
+        uint64_t encodedFenceValue;
+    };
+
+    bool InitializeEncodeDevice(int adapterIndex, bool crossAdapter);
+    void ReleaseEncodeDevice();
+    bool CreateFrameRing(bool shared);
+    // Creates the first backend of the probe order that works for the encode device
+    void CreateVideoEncoder();
+    // Shuts the VideoEncoder down, it may have failed
+    void ReleaseVideoEncoder();
+    // Replaces a VideoEncoder that threw while encoding, the next frame is an IDR frame
+    void RecoverVideoEncoder(const char* error);
+    // Applies the settings of SetApplicationSettings if they changed, between two frames
+    void UpdateApplicationSettings();
+    // True if the frame repeats the last encoded one and is not encoded, see
+    // alvr_server/StaticFrames.h. Schedules an IDR frame if it starts a new scene, see
+    // alvr_server/SceneChange.h. Finds the static blocks of a frame that is encoded.
+    bool SkipStaticFrame(const FrameSlot& frame);
+
+    // Composed frames waiting for the encoder thread. One slot can be encoding, one still read by
+    // an async encoder and one queued, so CopyToStaging always finds a free one and never waits
+    // for the encoder. A queued frame that the encoder did not pick up yet is replaced by the newer
+    // one.
+    static const int FRAME_RING_SIZE = 4;
+
+    CThreadEvent m_newFrameReady;
+    LockStats m_newFrameReadyStats { "CEncoder new frame" };
+    std::shared_ptr<CD3DRender> m_d3dRender;
     std::shared_ptr<VideoEncoder> m_videoEncoder;
+
+    // Device of the encoders, on the same adapter as the compositor one so that composition and
+    // encode submission don't share a context, or on the encode adapter so that the game GPU
+    // doesn't encode at all. The ring textures are shared between the devices. The compose fence
+    // is signaled when a slot is written and the encode fence when it has been read. Without D3D
+    // 11.4 fences this is m_d3dRender and the fences are null.
+    std::shared_ptr<CD3DRender> m_encodeRender;
+    bool m_crossAdapter;
+    ComPtr<ID3D11DeviceContext4> m_composeContext;
+    ComPtr<ID3D11DeviceContext4> m_encodeContext;
+    ComPtr<ID3D11Fence> m_composeFence;
+    ComPtr<ID3D11Fence> m_composeFenceOnEncoder;
+    ComPtr<ID3D11Fence> m_encodeFence;
+    ComPtr<ID3D11Fence> m_encodeFenceOnComposer;
+    uint64_t m_composeFenceValue;
+    uint64_t m_encodeFenceValue;
     bool m_bExiting;
-    uint64_t m_presentationTime;
-    uint64_t m_targetTimestampNs;
 
     std::shared_ptr<FrameRender> m_FrameRender;
+    std::unique_ptr<GpuFrameTimer> m_gpuTimer;
+    // Eye projections of the last view params, for the encoders
+    vr::HmdRect2_t m_projections[2] = {};
+
+    FrameSlot m_frameRing[FRAME_RING_SIZE];
+    std::mutex m_frameRingMutex;
+    int m_queuedSlot;
+    int m_encodingSlot;
+    // Slot of the previous frame, with EncoderCapabilities::async
+    int m_previousSlot;
 
     IDRScheduler m_scheduler;
+    // Encoder failures since the last frame that was encoded
+    int m_encoderFailures = 0;
+
+    std::mutex m_applicationSettingsMutex;
+    std::optional<Settings> m_applicationSettings;
+
+    // Only with m_skipStaticFrames, m_sceneChangeDetection or m_staticBlockQpOffset, created on
+    // the encoder thread
+    std::unique_ptr<StaticFrameDetector> m_staticFrames;
+    // Of the frame being encoded
+    StaticBlocks m_staticBlocks;
+    SceneChangeDetector m_sceneChanges;
+    bool m_staticFramesFailed = false;
+    uint64_t m_lastEncodedTimestampNs = 0;
 };
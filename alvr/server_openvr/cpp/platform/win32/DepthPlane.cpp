@@ -0,0 +1,186 @@
+#include "DepthPlane.h"
+
+#include "alvr_server/Logger.h"
+#include "alvr_server/bindings.h"
+#include "d3d-render-utils/RenderUtils.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+using Microsoft::WRL::ComPtr;
+
+namespace {
+// Layout of DepthPlaneParams in DepthPlaneCS.hlsl
+struct DepthPlaneParams {
+    float bounds[2][4];
+    uint32_t viewSize[2];
+    uint32_t reversedDepth;
+    uint32_t padding;
+};
+}
+
+DepthPlane::DepthPlane(ID3D11Device* device, ID3D11DeviceContext* context, uint32_t viewWidth)
+    : m_device(device)
+    , m_context(context)
+    , m_viewWidth(viewWidth) {
+    if (DEPTH_PLANE_CSO_LEN == 0) {
+        throw MakeException("The depth plane shader was not built");
+    }
+    OK_OR_THROW(
+        m_device->CreateComputeShader(DEPTH_PLANE_CSO_PTR, DEPTH_PLANE_CSO_LEN, NULL, &m_shader),
+        L"Failed to create the depth plane shader."
+    );
+    m_params.Attach(d3d_render_utils::CreateBuffer(
+        m_device, DepthPlaneParams {}, D3D11_USAGE_DEFAULT
+    ));
+}
+
+void DepthPlane::Submit(
+    ID3D11ShaderResourceView* views[2],
+    const vr::VRTextureBounds_t bounds[2],
+    const vr::HmdMatrix44_t projections[2],
+    uint64_t targetTimestampNs
+) {
+    SendFinished();
+
+    uint32_t viewHeight = ViewHeight(views[0], bounds[0]);
+    if (viewHeight != m_viewHeight) {
+        Resize(viewHeight);
+    }
+
+    // A D3D projection maps the near plane to 0, a reversed one to 1 with a small or zero z scale
+    DepthPlaneParams params = {};
+    for (int eye = 0; eye < 2; eye++) {
+        params.bounds[eye][0] = bounds[eye].uMin;
+        params.bounds[eye][1] = bounds[eye].vMin;
+        params.bounds[eye][2] = bounds[eye].uMax;
+        params.bounds[eye][3] = bounds[eye].vMax;
+    }
+    params.viewSize[0] = m_viewWidth;
+    params.viewSize[1] = m_viewHeight;
+    params.reversedDepth = projections[0].m[2][2] > -0.5f;
+    d3d_render_utils::UpdateBuffer(m_context, m_params.Get(), &params);
+
+    ID3D11Buffer* constantBuffers[] = { m_params.Get() };
+    ID3D11UnorderedAccessView* uavs[] = { m_planeView.Get() };
+    m_context->CSSetShader(m_shader.Get(), NULL, 0);
+    m_context->CSSetConstantBuffers(0, 1, constantBuffers);
+    m_context->CSSetShaderResources(0, 2, views);
+    m_context->CSSetUnorderedAccessViews(0, 1, uavs, NULL);
+    m_context->Dispatch((m_viewWidth * 2 + 7) / 8, (m_viewHeight + 7) / 8, 1);
+
+    // The game renders into the depth buffers again on its own device
+    ID3D11ShaderResourceView* nullViews[2] = {};
+    ID3D11UnorderedAccessView* nullUavs[1] = {};
+    m_context->CSSetShaderResources(0, 2, nullViews);
+    m_context->CSSetUnorderedAccessViews(0, 1, nullUavs, NULL);
+    m_context->CSSetShader(NULL, NULL, 0);
+
+    // The oldest copy is dropped if the GPU is that far behind
+    Readback& readback = m_readbacks[m_nextReadback];
+    m_context->CopyResource(readback.staging.Get(), m_plane.Get());
+    readback.targetTimestampNs = targetTimestampNs;
+    for (int eye = 0; eye < 2; eye++) {
+        memcpy(readback.projections[eye], projections[eye].m, sizeof(readback.projections[eye]));
+    }
+    readback.pending = true;
+    m_nextReadback = (m_nextReadback + 1) % READBACK_COUNT;
+}
+
+uint32_t DepthPlane::ViewHeight(
+    ID3D11ShaderResourceView* view, const vr::VRTextureBounds_t& bounds
+) const {
+    ComPtr<ID3D11Resource> resource;
+    view->GetResource(&resource);
+    ComPtr<ID3D11Texture2D> texture;
+    resource.As(&texture);
+    D3D11_TEXTURE2D_DESC desc;
+    texture->GetDesc(&desc);
+
+    float width = std::abs(bounds.uMax - bounds.uMin) * desc.Width;
+    float height = std::abs(bounds.vMax - bounds.vMin) * desc.Height;
+    if (width < 1.0f) {
+        return m_viewWidth;
+    }
+    uint32_t viewHeight = (uint32_t)std::lround(m_viewWidth * height / width);
+    return std::clamp(viewHeight, 1u, m_viewWidth * 4);
+}
+
+void DepthPlane::Resize(uint32_t viewHeight) {
+    m_plane.Reset();
+    m_planeView.Reset();
+    for (auto& readback : m_readbacks) {
+        readback.staging.Reset();
+        readback.pending = false;
+    }
+    m_viewHeight = 0;
+
+    D3D11_TEXTURE2D_DESC desc = {};
+    desc.Width = m_viewWidth * 2;
+    desc.Height = viewHeight;
+    desc.MipLevels = 1;
+    desc.ArraySize = 1;
+    desc.Format = DXGI_FORMAT_R16_UNORM;
+    desc.SampleDesc.Count = 1;
+    desc.Usage = D3D11_USAGE_DEFAULT;
+    desc.BindFlags = D3D11_BIND_UNORDERED_ACCESS;
+    OK_OR_THROW(
+        m_device->CreateTexture2D(&desc, NULL, &m_plane), L"Failed to create the depth plane."
+    );
+    OK_OR_THROW(
+        m_device->CreateUnorderedAccessView(m_plane.Get(), NULL, &m_planeView),
+        L"Failed to create the depth plane view."
+    );
+
+    desc.Usage = D3D11_USAGE_STAGING;
+    desc.BindFlags = 0;
+    desc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
+    for (auto& readback : m_readbacks) {
+        OK_OR_THROW(
+            m_device->CreateTexture2D(&desc, NULL, &readback.staging),
+            L"Failed to create the depth plane staging texture."
+        );
+    }
+
+    m_viewHeight = viewHeight;
+    m_depth.resize((size_t)desc.Width * desc.Height);
+}
+
+void DepthPlane::SendFinished() {
+    uint32_t width = m_viewWidth * 2;
+    for (int i = 0; i < READBACK_COUNT; i++) {
+        Readback& readback = m_readbacks[(m_nextReadback + i) % READBACK_COUNT];
+        if (!readback.pending) {
+            continue;
+        }
+
+        D3D11_MAPPED_SUBRESOURCE mapped;
+        HRESULT hr = m_context->Map(
+            readback.staging.Get(), 0, D3D11_MAP_READ, D3D11_MAP_FLAG_DO_NOT_WAIT, &mapped
+        );
+        if (hr == DXGI_ERROR_WAS_STILL_DRAWING) {
+            // The later copies are not finished either
+            return;
+        }
+        readback.pending = false;
+        if (FAILED(hr)) {
+            continue;
+        }
+        for (uint32_t y = 0; y < m_viewHeight; y++) {
+            memcpy(
+                &m_depth[(size_t)y * width],
+                (const uint8_t*)mapped.pData + (size_t)y * mapped.RowPitch,
+                width * sizeof(uint16_t)
+            );
+        }
+        m_context->Unmap(readback.staging.Get(), 0);
+
+        DepthPlaneSend(
+            readback.targetTimestampNs,
+            m_depth.data(),
+            (int)width,
+            (int)m_viewHeight,
+            &readback.projections[0][0]
+        );
+    }
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include "alvr_server/openvr_driver_wrap.h"
+#include <d3d11.h>
+#include <stdint.h>
+#include <vector>
+#include <wrl.h>
+
+// Low resolution depth of the frames, sent to the client beside the video for its positional
+// reprojection. The depth buffers that the game submits with the layers are downscaled on the GPU
+// and read back a few frames later, so that the compositor never waits for the copy.
+class DepthPlane {
+public:
+    // viewWidth is the width of each view in the plane, throws if the shader is not available
+    DepthPlane(ID3D11Device* device, ID3D11DeviceContext* context, uint32_t viewWidth);
+
+    // Records the depth plane of a frame, and sends the planes whose copy has finished. The views
+    // are shader resource views of the depth buffers.
+    void Submit(
+        ID3D11ShaderResourceView* views[2],
+        const vr::VRTextureBounds_t bounds[2],
+        const vr::HmdMatrix44_t projections[2],
+        uint64_t targetTimestampNs
+    );
+
+private:
+    struct Readback {
+        Microsoft::WRL::ComPtr<ID3D11Texture2D> staging;
+        uint64_t targetTimestampNs;
+        float projections[2][16];
+        bool pending;
+    };
+
+    // Plane height for the aspect of the views in the depth buffers
+    uint32_t ViewHeight(ID3D11ShaderResourceView* view, const vr::VRTextureBounds_t& bounds) const;
+    // Creates the plane and the readback textures for a new height, throws on failure
+    void Resize(uint32_t viewHeight);
+    // Sends the finished copies, oldest first, without waiting for the GPU
+    void SendFinished();
+
+    ID3D11Device* m_device;
+    ID3D11DeviceContext* m_context;
+    Microsoft::WRL::ComPtr<ID3D11ComputeShader> m_shader;
+    Microsoft::WRL::ComPtr<ID3D11Buffer> m_params;
+    Microsoft::WRL::ComPtr<ID3D11Texture2D> m_plane;
+    Microsoft::WRL::ComPtr<ID3D11UnorderedAccessView> m_planeView;
+
+    static const int READBACK_COUNT = 3;
+    Readback m_readbacks[READBACK_COUNT] = {};
+    // Index of the next copy, also the oldest pending one
+    int m_nextReadback = 0;
+
+    uint32_t m_viewWidth;
+    uint32_t m_viewHeight = 0;
+    std::vector<uint16_t> m_depth;
+};
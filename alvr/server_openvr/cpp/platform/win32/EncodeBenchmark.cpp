@@ -0,0 +1,396 @@
+#include "EncodeBenchmark.h"
+
+#include "FrameRender.h"
+#include "VideoEncoder.h"
+#include "VideoEncoderAMF.h"
+#include "VideoEncoderNVENC.h"
+#include "VideoEncoderVPL.h"
+#include "alvr_server/CapturedFrames.h"
+#include "alvr_server/EncoderBackend.h"
+#include "alvr_server/EncoderControl.h"
+#include "alvr_server/Logger.h"
+#include "alvr_server/Utils.h"
+#include "alvr_server/bindings.h"
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <mutex>
+#include <thread>
+#include <vector>
+#ifdef ALVR_GPL
+#include "VideoEncoderSW.h"
+#endif
+
+// alvr_server.cpp, the presets are read by the encoders when they initialize
+extern Settings g_settings;
+
+namespace {
+
+// The bitrate the encoders start with before the first dynamic parameters
+const uint64_t TARGET_BITRATE_BPS = 30'000'000;
+// Textures the composed frames are copied into in turn, an async encoder may still read the
+// previous one
+const int ENCODE_TEXTURES = 2;
+
+struct FrameTiming {
+    std::chrono::steady_clock::time_point transmitTime;
+    uint64_t latencyNs = 0;
+    uint32_t bytes = 0;
+    bool encoded = false;
+};
+
+struct RunResult {
+    EncoderBackend backend;
+    // -1 for backends without presets
+    int preset;
+    size_t frames;
+    size_t encoded;
+    double composeMs;
+    double p50Ms;
+    double p95Ms;
+    double p99Ms;
+    double mbps;
+};
+
+// Frames of the current run, filled by the video sink from the encoder threads. Their target
+// timestamps are their index plus one times the frame interval.
+std::mutex runMutex;
+std::vector<FrameTiming> runFrames;
+uint64_t runIntervalNs = 1;
+
+void SinkFrame(unsigned long long targetTimestampNs, int len, bool isIdr, bool lastSlice) {
+    auto now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(runMutex);
+    size_t index = size_t(targetTimestampNs / runIntervalNs) - 1;
+    if (index >= runFrames.size()) {
+        return;
+    }
+    FrameTiming& frame = runFrames[index];
+    frame.bytes += len;
+    if (lastSlice) {
+        auto latency = now - frame.transmitTime;
+        frame.latencyNs = std::chrono::duration_cast<std::chrono::nanoseconds>(latency).count();
+        frame.encoded = true;
+    }
+}
+
+std::shared_ptr<VideoEncoder> CreateVideoEncoder(
+    EncoderBackend backend, std::shared_ptr<CD3DRender> d3dRender, uint32_t width, uint32_t height
+) {
+    switch (backend) {
+    case EncoderBackend::Amf:
+        return std::make_shared<VideoEncoderAMF>(d3dRender, width, height);
+    case EncoderBackend::Nvenc:
+        return std::make_shared<VideoEncoderNVENC>(d3dRender, width, height);
+    case EncoderBackend::Vpl:
+        return std::make_shared<VideoEncoderVPL>(d3dRender, width, height);
+#ifdef ALVR_GPL
+    case EncoderBackend::Software:
+        // The benchmark composes on d3dRender from this thread too
+        return std::make_shared<VideoEncoderSW>(d3dRender, width, height, true);
+#endif
+    default:
+        return nullptr;
+    }
+}
+
+// Values the backend reads from m_nvencQualityPreset or m_encoderQualityPreset
+std::vector<int> QualityPresets(EncoderBackend backend) {
+    switch (backend) {
+    case EncoderBackend::Nvenc:
+        return { 1, 2, 3, 4, 5, 6, 7 };
+    case EncoderBackend::Amf:
+    case EncoderBackend::Vpl:
+        return { 0, 1, 2 };
+    default:
+        return { -1 };
+    }
+}
+
+class Benchmark {
+public:
+    Benchmark(std::shared_ptr<CD3DRender> d3dRender, const std::string& directory)
+        : m_d3dRender(d3dRender)
+        , m_frameRender(d3dRender)
+        , m_paths(ListCapturedFrames(directory)) { }
+
+    bool Startup() {
+        CapturedFrame frame;
+        if (m_paths.empty() || !LoadCapturedFrame(m_paths[0], frame)) {
+            Error("Encode benchmark: no captured frame\n");
+            return false;
+        }
+        m_width = frame.width;
+        m_height = frame.height;
+        Info("Encode benchmark: %zu frames of %ux%u\n", m_paths.size(), m_width, m_height);
+
+        if (!m_frameRender.Startup()) {
+            Error("Encode benchmark: failed to start the frame renderer\n");
+            return false;
+        }
+
+        D3D11_TEXTURE2D_DESC desc = {};
+        desc.Width = m_width;
+        desc.Height = m_height;
+        desc.MipLevels = 1;
+        desc.ArraySize = 1;
+        desc.Format = DXGI_FORMAT_R8G8B8A8_UNORM;
+        desc.SampleDesc.Count = 1;
+        desc.Usage = D3D11_USAGE_DEFAULT;
+        desc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+        HRESULT hr = m_d3dRender->GetDevice()->CreateTexture2D(&desc, nullptr, &m_inputTexture);
+        if (FAILED(hr)) {
+            Error("Encode benchmark: CreateTexture2D %p %ls\n", hr, GetErrorStr(hr).c_str());
+            return false;
+        }
+
+        m_frameRender.GetTexture()->GetDesc(&desc);
+        desc.MiscFlags = 0;
+        for (auto& texture : m_encodeTextures) {
+            hr = m_d3dRender->GetDevice()->CreateTexture2D(&desc, nullptr, &texture);
+            if (FAILED(hr)) {
+                Error("Encode benchmark: CreateTexture2D %p %ls\n", hr, GetErrorStr(hr).c_str());
+                return false;
+            }
+        }
+
+        D3D11_QUERY_DESC queryDesc = {};
+        queryDesc.Query = D3D11_QUERY_TIMESTAMP_DISJOINT;
+        hr = m_d3dRender->GetDevice()->CreateQuery(&queryDesc, &m_disjointQuery);
+        queryDesc.Query = D3D11_QUERY_TIMESTAMP;
+        if (SUCCEEDED(hr)) {
+            hr = m_d3dRender->GetDevice()->CreateQuery(&queryDesc, &m_beginQuery);
+        }
+        if (SUCCEEDED(hr)) {
+            hr = m_d3dRender->GetDevice()->CreateQuery(&queryDesc, &m_endQuery);
+        }
+        if (FAILED(hr)) {
+            Error("Encode benchmark: CreateQuery %p %ls\n", hr, GetErrorStr(hr).c_str());
+            return false;
+        }
+        return true;
+    }
+
+    // False if the backend is not available with this preset
+    bool Run(EncoderBackend backend, int preset, const bool& exiting, RunResult& result) {
+        uint32_t encoderWidth, encoderHeight;
+        m_frameRender.GetEncodingResolution(&encoderWidth, &encoderHeight);
+
+        const double frameRate = std::max(Settings_Instance()->m_refreshRate, 1);
+        const auto frameInterval = std::chrono::nanoseconds(uint64_t(1e9 / frameRate));
+        {
+            std::lock_guard<std::mutex> lock(runMutex);
+            runFrames.assign(m_paths.size(), {});
+            runIntervalNs = frameInterval.count();
+        }
+
+        FfiDynamicEncoderParams params = {};
+        params.updated = 1;
+        params.bitrate_bps = TARGET_BITRATE_BPS;
+        params.framerate = (float)frameRate;
+        params.refresh_rate = (float)frameRate;
+        // Each backend starts without the bitrate correction of the previous run
+        g_encoderControl.Reset();
+        g_encoderControl.Update(params);
+
+        std::shared_ptr<VideoEncoder> encoder;
+        try {
+            encoder = CreateVideoEncoder(backend, m_d3dRender, encoderWidth, encoderHeight);
+            if (!encoder) {
+                return false;
+            }
+            encoder->Initialize();
+        } catch (Exception e) {
+            Info(
+                "Encode benchmark: %s unavailable: %s\n", EncoderBackendName(backend), e.what()
+            );
+            return false;
+        }
+
+        ID3D11DeviceContext* context = m_d3dRender->GetContext();
+        ID3D11Texture2D* textures[1][2] = { { m_inputTexture.Get(), m_inputTexture.Get() } };
+        // Both eyes side by side, as captured
+        vr::VRTextureBounds_t bounds[1][2]
+            = { { { 0.f, 0.f, 0.5f, 1.f }, { 0.5f, 0.f, 1.f, 1.f } } };
+        vr::HmdMatrix34_t poses[1] = {};
+        poses[0].m[0][0] = poses[0].m[1][1] = poses[0].m[2][2] = 1.f;
+
+        double composeMs = 0.;
+        size_t composed = 0;
+        auto nextFrame = std::chrono::steady_clock::now();
+        CapturedFrame frame;
+        try {
+            for (size_t i = 0; i < m_paths.size() && !exiting; i++) {
+                if (!LoadCapturedFrame(m_paths[i], frame) || frame.width != m_width
+                    || frame.height != m_height) {
+                    continue;
+                }
+                context->UpdateSubresource(
+                    m_inputTexture.Get(), 0, nullptr, frame.rgba.data(), m_width * 4, 0
+                );
+
+                std::this_thread::sleep_until(nextFrame);
+                nextFrame += frameInterval;
+
+                ID3D11Texture2D* encodeTexture = m_encodeTextures[i % ENCODE_TEXTURES].Get();
+                context->Begin(m_disjointQuery.Get());
+                context->End(m_beginQuery.Get());
+                m_frameRender.RenderFrame(textures, nullptr, bounds, poses, 1, false, "");
+                context->CopyResource(encodeTexture, m_frameRender.GetTexture().Get());
+                context->End(m_endQuery.Get());
+                context->End(m_disjointQuery.Get());
+
+                {
+                    std::lock_guard<std::mutex> lock(runMutex);
+                    runFrames[i].transmitTime = std::chrono::steady_clock::now();
+                }
+                uint64_t targetTimestampNs = (i + 1) * frameInterval.count();
+                encoder->Transmit(encodeTexture, targetTimestampNs, targetTimestampNs, i == 0);
+
+                // The composition is complete once the encoder read the texture
+                double ms;
+                if (ReadComposeTime(ms)) {
+                    composeMs += ms;
+                    composed++;
+                }
+            }
+            // Frames of async encoders are delivered by the next Transmit or their own thread
+            std::this_thread::sleep_for(10 * frameInterval);
+        } catch (Exception e) {
+            Error("Encode benchmark: %s failed: %s\n", EncoderBackendName(backend), e.what());
+        }
+        encoder->Shutdown();
+        encoder.reset();
+
+        std::vector<uint64_t> latencies;
+        uint64_t bytes = 0;
+        {
+            std::lock_guard<std::mutex> lock(runMutex);
+            for (const FrameTiming& timing : runFrames) {
+                if (timing.encoded) {
+                    latencies.push_back(timing.latencyNs);
+                    bytes += timing.bytes;
+                }
+            }
+            runFrames.clear();
+        }
+        std::sort(latencies.begin(), latencies.end());
+        auto percentile = [&](size_t p) {
+            if (latencies.empty()) {
+                return 0.;
+            }
+            return latencies[std::min(latencies.size() - 1, latencies.size() * p / 100)] / 1e6;
+        };
+
+        result.backend = backend;
+        result.preset = preset;
+        result.frames = m_paths.size();
+        result.encoded = latencies.size();
+        result.composeMs = composed > 0 ? composeMs / composed : 0.;
+        result.p50Ms = percentile(50);
+        result.p95Ms = percentile(95);
+        result.p99Ms = percentile(99);
+        result.mbps = latencies.empty() ? 0. : bytes * 8. * frameRate / latencies.size() / 1e6;
+        return true;
+    }
+
+private:
+    bool ReadComposeTime(double& ms) {
+        ID3D11DeviceContext* context = m_d3dRender->GetContext();
+        D3D11_QUERY_DATA_TIMESTAMP_DISJOINT disjoint;
+        UINT64 begin, end;
+        HRESULT hr;
+        while ((hr = context->GetData(m_disjointQuery.Get(), &disjoint, sizeof(disjoint), 0))
+               == S_FALSE) {
+            std::this_thread::yield();
+        }
+        if (hr != S_OK || disjoint.Disjoint
+            || context->GetData(m_beginQuery.Get(), &begin, sizeof(begin), 0) != S_OK
+            || context->GetData(m_endQuery.Get(), &end, sizeof(end), 0) != S_OK) {
+            return false;
+        }
+        ms = double(end - begin) * 1e3 / disjoint.Frequency;
+        return true;
+    }
+
+    std::shared_ptr<CD3DRender> m_d3dRender;
+    FrameRender m_frameRender;
+    std::vector<std::filesystem::path> m_paths;
+    uint32_t m_width = 0;
+    uint32_t m_height = 0;
+    ComPtr<ID3D11Texture2D> m_inputTexture;
+    ComPtr<ID3D11Texture2D> m_encodeTextures[ENCODE_TEXTURES];
+    ComPtr<ID3D11Query> m_disjointQuery;
+    ComPtr<ID3D11Query> m_beginQuery;
+    ComPtr<ID3D11Query> m_endQuery;
+};
+
+} // namespace
+
+void RunEncodeBenchmark(
+    std::shared_ptr<CD3DRender> d3dRender, const std::string& directory, const bool& exiting
+) {
+    Benchmark benchmark(d3dRender, directory);
+    if (!benchmark.Startup()) {
+        return;
+    }
+
+    const Settings settings = *Settings_Instance();
+    std::vector<EncoderBackend> backends
+        = { EncoderBackend::Nvenc, EncoderBackend::Amf, EncoderBackend::Vpl };
+#ifdef ALVR_GPL
+    backends.push_back(EncoderBackend::Software);
+#endif
+
+    SetVideoSink(SinkFrame);
+    std::vector<RunResult> results;
+    for (EncoderBackend backend : backends) {
+        for (int preset : QualityPresets(backend)) {
+            if (exiting) {
+                break;
+            }
+            Settings presetSettings = settings;
+            if (backend == EncoderBackend::Nvenc) {
+                presetSettings.m_nvencQualityPreset = preset;
+            } else if (preset >= 0) {
+                presetSettings.m_encoderQualityPreset = preset;
+            }
+            g_settings = presetSettings;
+
+            RunResult result;
+            if (!benchmark.Run(backend, preset, exiting, result)) {
+                // The other presets of the backend would fail the same way
+                break;
+            }
+            Info(
+                "Encode benchmark: %s preset %d, %zu/%zu frames, compose %.2f ms, encode p50 %.2f "
+                "ms p95 %.2f ms p99 %.2f ms, %.1f Mbps for %.1f\n",
+                EncoderBackendName(backend),
+                preset,
+                result.encoded,
+                result.frames,
+                result.composeMs,
+                result.p50Ms,
+                result.p95Ms,
+                result.p99Ms,
+                result.mbps,
+                TARGET_BITRATE_BPS / 1e6
+            );
+            results.push_back(result);
+        }
+    }
+    SetVideoSink(nullptr);
+    g_settings = settings;
+    g_encoderControl.Reset();
+
+    std::filesystem::path path = std::filesystem::path(directory) / "encode_benchmark.csv";
+    std::ofstream file(path);
+    file << "backend,preset,frames,encoded,compose_ms,p50_ms,p95_ms,p99_ms,mbps,bitrate_ratio\n";
+    for (const RunResult& result : results) {
+        file << EncoderBackendName(result.backend) << "," << result.preset << "," << result.frames
+             << "," << result.encoded << "," << result.composeMs << "," << result.p50Ms << ","
+             << result.p95Ms << "," << result.p99Ms << "," << result.mbps << ","
+             << result.mbps * 1e6 / TARGET_BITRATE_BPS << "\n";
+    }
+    Info("Encode benchmark results written to %ls\n", path.c_str());
+}
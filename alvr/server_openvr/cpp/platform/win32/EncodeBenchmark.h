@@ -0,0 +1,15 @@
+#pragma once
+
+#include "shared/d3drender.h"
+#include <memory>
+#include <string>
+
+// Replays the captured frames of directory, see alvr_server/CapturedFrames.h, through FrameRender
+// and each video encoder backend that initializes on d3dRender, once per quality preset of the
+// backend. Frames are uploaded at the refresh rate as one texture holding both eyes, and the
+// encoded frames go to a sink instead of the client. The compose GPU time, the encode latency
+// percentiles and the bitrate against the target of each run are written to encode_benchmark.csv
+// in directory. Returns early once exiting is set.
+void RunEncodeBenchmark(
+    std::shared_ptr<CD3DRender> d3dRender, const std::string& directory, const bool& exiting
+);
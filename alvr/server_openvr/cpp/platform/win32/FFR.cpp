@@ -1,8 +1,11 @@
 #include "FFR.h"
 
+#include "alvr_server/RadialFoveation.h"
 #include "alvr_server/Utils.h"
 #include "alvr_server/bindings.h"
 
+#include <cstring>
+
 using Microsoft::WRL::ComPtr;
 using namespace d3d_render_utils;
 
@@ -19,20 +22,69 @@ struct FoveationVars {
 
     float centerSizeX;
     float centerSizeY;
-    float centerShiftX;
-    float centerShiftY;
+    float leftCenterShiftX;
+    float leftCenterShiftY;
+    float rightCenterShiftX;
+    float rightCenterShiftY;
     float edgeRatioX;
     float edgeRatioY;
+    // 0 for the axis aligned compression, the center sizes are the radius otherwise
+    float radialScale;
+    float radialCurve;
 };
 
-FoveationVars CalculateFoveationVars() {
+// Snaps a center shift to whole compressed edge pixels, like the client does
+float AlignCenterShift(float shift, float edgeSizeAligned, float edgeRatio) {
+    if (edgeSizeAligned <= 0.) {
+        return 0.;
+    }
+    return ceil(shift * edgeSizeAligned / (edgeRatio * 2.)) * (edgeRatio * 2.) / edgeSizeAligned;
+}
+
+FfiFoveationCenter GetStaticFoveationCenter() {
+    float centerShiftX = (float)Settings_Instance()->m_foveationCenterShiftX;
+    float centerShiftY = (float)Settings_Instance()->m_foveationCenterShiftY;
+    return { centerShiftX, centerShiftY, centerShiftX, centerShiftY };
+}
+
+// Eye sizes of RadialFoveation.h, which matches no pixel grid and doesn't snap the shifts
+FoveationVars CalculateRadialFoveationVars(
+    const FfiFoveationCenter& center, float targetEyeWidth, float targetEyeHeight
+) {
+    RadialFoveation radial = GetRadialFoveation();
+
+    float optimizedEyeWidth = radial.scale * targetEyeWidth;
+    float optimizedEyeHeight = radial.scale * targetEyeHeight;
+    auto optimizedEyeWidthAligned = (uint32_t)ceil(optimizedEyeWidth / 32.f) * 32;
+    auto optimizedEyeHeightAligned = (uint32_t)ceil(optimizedEyeHeight / 32.f) * 32;
+
+    return { (uint32_t)targetEyeWidth,
+             (uint32_t)targetEyeHeight,
+             optimizedEyeWidthAligned,
+             optimizedEyeHeightAligned,
+             optimizedEyeWidth / optimizedEyeWidthAligned,
+             optimizedEyeHeight / optimizedEyeHeightAligned,
+             radial.radius,
+             radial.radius,
+             center.leftShiftX,
+             center.leftShiftY,
+             center.rightShiftX,
+             center.rightShiftY,
+             0.,
+             0.,
+             radial.scale,
+             radial.curve };
+}
+
+FoveationVars CalculateFoveationVars(const FfiFoveationCenter& center) {
     float targetEyeWidth = (float)Settings_Instance()->m_renderWidth / 2;
     float targetEyeHeight = (float)Settings_Instance()->m_renderHeight;
+    if (Settings_Instance()->m_foveationRadial) {
+        return CalculateRadialFoveationVars(center, targetEyeWidth, targetEyeHeight);
+    }
 
     float centerSizeX = (float)Settings_Instance()->m_foveationCenterSizeX;
     float centerSizeY = (float)Settings_Instance()->m_foveationCenterSizeY;
-    float centerShiftX = (float)Settings_Instance()->m_foveationCenterShiftX;
-    float centerShiftY = (float)Settings_Instance()->m_foveationCenterShiftY;
     float edgeRatioX = (float)Settings_Instance()->m_foveationEdgeRatioX;
     float edgeRatioY = (float)Settings_Instance()->m_foveationEdgeRatioY;
 
@@ -47,11 +99,6 @@ FoveationVars CalculateFoveationVars() {
     float edgeSizeXAligned = targetEyeWidth - centerSizeXAligned * targetEyeWidth;
     float edgeSizeYAligned = targetEyeHeight - centerSizeYAligned * targetEyeHeight;
 
-    float centerShiftXAligned = ceil(centerShiftX * edgeSizeXAligned / (edgeRatioX * 2.))
-        * (edgeRatioX * 2.) / edgeSizeXAligned;
-    float centerShiftYAligned = ceil(centerShiftY * edgeSizeYAligned / (edgeRatioY * 2.))
-        * (edgeRatioY * 2.) / edgeSizeYAligned;
-
     float foveationScaleX = (centerSizeXAligned + (1. - centerSizeXAligned) / edgeRatioX);
     float foveationScaleY = (centerSizeYAligned + (1. - centerSizeYAligned) / edgeRatioY);
 
@@ -73,15 +120,19 @@ FoveationVars CalculateFoveationVars() {
              eyeHeightRatioAligned,
              centerSizeXAligned,
              centerSizeYAligned,
-             centerShiftXAligned,
-             centerShiftYAligned,
+             AlignCenterShift(center.leftShiftX, edgeSizeXAligned, edgeRatioX),
+             AlignCenterShift(center.leftShiftY, edgeSizeYAligned, edgeRatioY),
+             AlignCenterShift(center.rightShiftX, edgeSizeXAligned, edgeRatioX),
+             AlignCenterShift(center.rightShiftY, edgeSizeYAligned, edgeRatioY),
              edgeRatioX,
-             edgeRatioY };
+             edgeRatioY,
+             0.,
+             0. };
 }
 }
 
 void FFR::GetOptimizedResolution(uint32_t* width, uint32_t* height) {
-    auto fovVars = CalculateFoveationVars();
+    auto fovVars = CalculateFoveationVars(GetStaticFoveationCenter());
     *width = fovVars.optimizedEyeWidth * 2;
     *height = fovVars.optimizedEyeHeight;
 }
@@ -89,36 +140,52 @@ void FFR::GetOptimizedResolution(uint32_t* width, uint32_t* height) {
 FFR::FFR(ID3D11Device* device)
     : mDevice(device) { }
 
-void FFR::Initialize(ID3D11Texture2D* compositionTexture) {
-    auto fovVars = CalculateFoveationVars();
-    ComPtr<ID3D11Buffer> foveatedRenderingBuffer = CreateBuffer(mDevice.Get(), fovVars);
+void FFR::Initialize(ID3D11Texture2D* compositionTexture, ID3D11ShaderResourceView* colorLut) {
+    mCenter = GetStaticFoveationCenter();
+    auto fovVars = CalculateFoveationVars(mCenter);
+    // Updated when the center moves, which can be every frame when following the gaze
+    mFoveationBuffer.Attach(CreateBuffer(mDevice.Get(), fovVars, D3D11_USAGE_DEFAULT));
 
     std::vector<uint8_t> quadShaderCSO(
         QUAD_SHADER_CSO_PTR, QUAD_SHADER_CSO_PTR + QUAD_SHADER_CSO_LEN
     );
     mQuadVertexShader = CreateVertexShader(mDevice.Get(), quadShaderCSO);
 
+    // Same format as the composition texture, which only encodes sRGB when it's not converted to
+    // YUV afterwards
+    D3D11_TEXTURE2D_DESC compositionDesc;
+    compositionTexture->GetDesc(&compositionDesc);
     mOptimizedTexture = CreateTexture(
         mDevice.Get(),
         fovVars.optimizedEyeWidth * 2,
         fovVars.optimizedEyeHeight,
-        Settings_Instance()->m_enableHdr ? DXGI_FORMAT_R16G16B16A16_FLOAT
-                                         : DXGI_FORMAT_R8G8B8A8_UNORM_SRGB
+        compositionDesc.Format
     );
 
     if (Settings_Instance()->m_enableFoveatedEncoding) {
-        std::vector<uint8_t> compressAxisAlignedShaderCSO(
-            COMPRESS_AXIS_ALIGNED_CSO_PTR,
-            COMPRESS_AXIS_ALIGNED_CSO_PTR + COMPRESS_AXIS_ALIGNED_CSO_LEN
-        );
+        std::vector<uint8_t> compressAxisAlignedShaderCSO;
+        if (colorLut) {
+            compressAxisAlignedShaderCSO.assign(
+                COMPRESS_AXIS_ALIGNED_LUT_CSO_PTR,
+                COMPRESS_AXIS_ALIGNED_LUT_CSO_PTR + COMPRESS_AXIS_ALIGNED_LUT_CSO_LEN
+            );
+        } else {
+            compressAxisAlignedShaderCSO.assign(
+                COMPRESS_AXIS_ALIGNED_CSO_PTR,
+                COMPRESS_AXIS_ALIGNED_CSO_PTR + COMPRESS_AXIS_ALIGNED_CSO_LEN
+            );
+        }
         auto compressAxisAlignedPipeline = RenderPipeline(mDevice.Get());
         compressAxisAlignedPipeline.Initialize(
             { compositionTexture },
             mQuadVertexShader.Get(),
             compressAxisAlignedShaderCSO,
             mOptimizedTexture.Get(),
-            foveatedRenderingBuffer.Get()
+            mFoveationBuffer.Get()
         );
+        if (colorLut) {
+            compressAxisAlignedPipeline.AddInputView(colorLut);
+        }
 
         mPipelines.push_back(compressAxisAlignedPipeline);
     } else {
@@ -126,6 +193,28 @@ void FFR::Initialize(ID3D11Texture2D* compositionTexture) {
     }
 }
 
+void FFR::InitializeComposeTarget(DXGI_FORMAT format) {
+    mCenter = GetStaticFoveationCenter();
+    auto fovVars = CalculateFoveationVars(mCenter);
+    mFoveationBuffer.Attach(CreateBuffer(mDevice.Get(), fovVars, D3D11_USAGE_DEFAULT));
+
+    mOptimizedTexture.Attach(CreateTexture(
+        mDevice.Get(), fovVars.optimizedEyeWidth * 2, fovVars.optimizedEyeHeight, format
+    ));
+}
+
+void FFR::SetCenter(const FfiFoveationCenter& center) {
+    if (!mFoveationBuffer || memcmp(&center, &mCenter, sizeof(center)) == 0) {
+        return;
+    }
+    mCenter = center;
+
+    auto fovVars = CalculateFoveationVars(mCenter);
+    ComPtr<ID3D11DeviceContext> context;
+    mDevice->GetImmediateContext(&context);
+    UpdateBuffer(context.Get(), mFoveationBuffer.Get(), &fovVars);
+}
+
 void FFR::Render() {
     for (auto& p : mPipelines) {
         p.Render();
@@ -133,3 +222,5 @@ void FFR::Render() {
 }
 
 ID3D11Texture2D* FFR::GetOutputTexture() { return mOptimizedTexture.Get(); }
+
+ID3D11Buffer* FFR::GetFoveationBuffer() { return mFoveationBuffer.Get(); }
@@ -1,19 +1,32 @@
 #pragma once
 
+#include "alvr_server/bindings.h"
 #include "d3d-render-utils/RenderPipeline.h"
 
 class FFR {
 public:
     FFR(ID3D11Device* device);
-    void Initialize(ID3D11Texture2D* compositionTexture);
+    // With a color LUT, the output is color corrected with it
+    void Initialize(
+        ID3D11Texture2D* compositionTexture, ID3D11ShaderResourceView* colorLut = nullptr
+    );
+    // Only the output texture and the foveation buffer, for the layers to be drawn straight into
+    // the output
+    void InitializeComposeTarget(DXGI_FORMAT format);
+    // Center of the next Render, the center shift settings until called
+    void SetCenter(const FfiFoveationCenter& center);
     void Render();
     void GetOptimizedResolution(uint32_t* width, uint32_t* height);
     ID3D11Texture2D* GetOutputTexture();
+    // FoveationVars of FoveatedRendering.hlsli
+    ID3D11Buffer* GetFoveationBuffer();
 
 private:
     Microsoft::WRL::ComPtr<ID3D11Device> mDevice;
     Microsoft::WRL::ComPtr<ID3D11Texture2D> mOptimizedTexture;
     Microsoft::WRL::ComPtr<ID3D11VertexShader> mQuadVertexShader;
+    Microsoft::WRL::ComPtr<ID3D11Buffer> mFoveationBuffer;
+    FfiFoveationCenter mCenter = {};
 
     std::vector<d3d_render_utils::RenderPipeline> mPipelines;
 };
@@ -1,82 +1,192 @@
 #include "FrameRender.h"
+#include "GpuMemoryD3D11.h"
+#include "alvr_server/HiddenAreaMask.h"
 #include "alvr_server/Logger.h"
+#include "alvr_server/OverlayCoverage.h"
+#include "alvr_server/Profiling.h"
 #include "alvr_server/Utils.h"
 #include "alvr_server/bindings.h"
+#include <DirectXPackedVector.h>
+#include <algorithm>
+#include <cmath>
 
 extern uint64_t g_DriverTestMode;
 
+// Height of the hidden area rectangles, a band row of the smallest blocks the encoders code
+static const uint32_t HIDDEN_AREA_ROW_HEIGHT = 8;
+
+// Edge length of the color correction LUT, COLOR_LUT_SIZE in ColorLut.hlsli
+static const uint32_t COLOR_LUT_SIZE = 33;
+
+// Mip of the overlay cache read back for the overlay coverage, cells of 16x16 pixels like the
+// H.264 macroblocks
+static const UINT OVERLAY_COVERAGE_MIP = 4;
+// Average alpha of a cell above which an overlay shows in it
+static const float OVERLAY_COVERAGE_ALPHA = 0.05f;
+
 using namespace d3d_render_utils;
 
 static const DirectX::XMFLOAT4X4 _identityMat = DirectX::XMFLOAT4X4(
     1.0f, 0.0f, 0.0f, 0.0f, 0.0f, -1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f
 );
 
-static DirectX::XMMATRIX HmdMatrix_AsDxMat(const vr::HmdMatrix34_t& m) {
-    // I think the negative Y basis is a handedness thing?
-    DirectX::XMFLOAT4X4 f = DirectX::XMFLOAT4X4(
-        m.m[0][0],
-        m.m[1][0],
-        m.m[2][0],
-        0.0f,
-        -m.m[0][1],
-        -m.m[1][1],
-        -m.m[2][1],
-        0.0f,
-        m.m[0][2],
-        m.m[1][2],
-        m.m[2][2],
-        0.0f,
-        m.m[0][3],
-        m.m[1][3],
-        m.m[2][3],
-        1.0f
+// The rows of m loaded as they are, with the last row of the identity, so that the conversions
+// below are a transpose in registers
+static DirectX::XMMATRIX HmdMatrix_LoadRows(const vr::HmdMatrix34_t& m) {
+    return DirectX::XMMATRIX(
+        DirectX::XMLoadFloat4(reinterpret_cast<const DirectX::XMFLOAT4*>(m.m[0])),
+        DirectX::XMLoadFloat4(reinterpret_cast<const DirectX::XMFLOAT4*>(m.m[1])),
+        DirectX::XMLoadFloat4(reinterpret_cast<const DirectX::XMFLOAT4*>(m.m[2])),
+        DirectX::g_XMIdentityR3
     );
-    return DirectX::XMLoadFloat4x4(&f);
 }
 
-static DirectX::XMMATRIX HmdMatrix_AsDxMatOrientOnly(vr::HmdMatrix34_t& m) {
+static DirectX::XMMATRIX HmdMatrix_AsDxMat(const vr::HmdMatrix34_t& m) {
+    DirectX::XMMATRIX f = DirectX::XMMatrixTranspose(HmdMatrix_LoadRows(m));
     // I think the negative Y basis is a handedness thing?
-    DirectX::XMFLOAT4X4 f = DirectX::XMFLOAT4X4(
-        m.m[0][0],
-        m.m[1][0],
-        m.m[2][0],
-        0.0f,
-        -m.m[0][1],
-        -m.m[1][1],
-        -m.m[2][1],
-        0.0f,
-        m.m[0][2],
-        m.m[1][2],
-        m.m[2][2],
-        0.0f,
-        0.0f,
-        0.0f,
-        0.0f,
-        1.0f
-    );
-    return DirectX::XMLoadFloat4x4(&f);
+    f.r[1] = DirectX::XMVectorNegate(f.r[1]);
+    return f;
+}
+
+static DirectX::XMMATRIX HmdMatrix_AsDxMatOrientOnly(const vr::HmdMatrix34_t& m) {
+    DirectX::XMMATRIX f = HmdMatrix_AsDxMat(m);
+    f.r[3] = DirectX::g_XMIdentityR3;
+    return f;
 }
 
 static DirectX::XMMATRIX HmdMatrix_AsDxMatPosOnly(const vr::HmdMatrix34_t& m) {
-    DirectX::XMFLOAT4X4 f = DirectX::XMFLOAT4X4(
-        1.0f,
-        0.0f,
-        0.0f,
-        0.0f,
-        0.0f,
-        1.0f,
-        0.0f,
-        0.0f,
-        0.0f,
-        0.0f,
-        1.0f,
-        0.0f,
-        m.m[0][3],
-        m.m[1][3],
-        m.m[2][3],
-        1.0f
-    );
-    return DirectX::XMLoadFloat4x4(&f);
+    return DirectX::XMMatrixTranslation(m.m[0][3], m.m[1][3], m.m[2][3]);
+}
+
+static bool IsSrgbFormat(DXGI_FORMAT format) {
+    return format == DXGI_FORMAT_R8G8B8A8_UNORM_SRGB || format == DXGI_FORMAT_B8G8R8A8_UNORM_SRGB
+        || format == DXGI_FORMAT_B8G8R8X8_UNORM_SRGB;
+}
+
+// The YUV conversion samples its input as is, so before it the textures hold sRGB encoded values
+// in a format that doesn't encode them
+static DXGI_FORMAT GetCompositionFormat() {
+    if (Settings_Instance()->m_enableHdr) {
+        return DXGI_FORMAT_R16G16B16A16_FLOAT;
+    }
+    return Settings_Instance()->m_convertToYuv ? DXGI_FORMAT_R8G8B8A8_UNORM
+                                               : DXGI_FORMAT_R8G8B8A8_UNORM_SRGB;
+}
+
+// Color conversion of the frame pixel shader for a layer texture format
+static uint32_t GetInputColorAdjust(DXGI_FORMAT format) {
+    uint32_t inputColorAdjust = 0;
+    // The composition texture doesn't encode sRGB, the shader does
+    if (Settings_Instance()->m_convertToYuv) {
+        if (IsSrgbFormat(format)) {
+            inputColorAdjust = 1; // do sRGB manually
+        }
+        if (Settings_Instance()->m_forceHdrSrgbCorrection) {
+            inputColorAdjust = 1;
+        }
+        if (Settings_Instance()->m_clampHdrExtendedRange) {
+            inputColorAdjust |= 0x10; // Clamp values to 0.0 to 1.0
+        }
+    } else {
+        if (!IsSrgbFormat(format)) {
+            inputColorAdjust = 2; // undo sRGB?
+
+            if (Settings_Instance()->m_forceHdrSrgbCorrection) {
+                inputColorAdjust = 0;
+            }
+        }
+
+        if (Settings_Instance()->m_clampHdrExtendedRange) {
+            inputColorAdjust |= 0x10; // Clamp values to 0.0 to 1.0
+        }
+    }
+    return inputColorAdjust;
+}
+
+static bool IsUnormFormat(DXGI_FORMAT format) {
+    return format == DXGI_FORMAT_R8G8B8A8_UNORM || format == DXGI_FORMAT_R8G8B8A8_UNORM_SRGB;
+}
+
+// Whether copying a layer texture to the composition texture gives the same texels as drawing it
+// with the frame pixel shader
+static bool IsColorPreserved(DXGI_FORMAT srcFormat, DXGI_FORMAT dstFormat) {
+    if (srcFormat != dstFormat && !(IsUnormFormat(srcFormat) && IsUnormFormat(dstFormat))) {
+        return false;
+    }
+    if (Settings_Instance()->m_encodingGamma != 1.0) {
+        return false;
+    }
+
+    uint32_t inputColorAdjust = GetInputColorAdjust(srcFormat);
+    // Clamping changes nothing on normalized texels
+    if ((inputColorAdjust & 0x10) && !IsUnormFormat(srcFormat)) {
+        return false;
+    }
+    inputColorAdjust &= 0xF;
+
+    // Sampling decodes sRGB and the render target encodes it again
+    if (IsSrgbFormat(srcFormat) == IsSrgbFormat(dstFormat)) {
+        return inputColorAdjust == 0;
+    }
+    // Linear texels are decoded by the shader, so that the sRGB render target stores them as is
+    return !IsSrgbFormat(srcFormat) && inputColorAdjust == 2;
+}
+
+// The correction of ColorCorrectionPixelShader.hlsl without sharpening, for the colors at the texel
+// centers of a LUT. Null if the texture can't be created.
+static ComPtr<ID3D11ShaderResourceView> CreateColorLut(ID3D11Device* device) {
+    float brightness = Settings_Instance()->m_brightness;
+    float contrast = Settings_Instance()->m_contrast + 1.f;
+    float saturation = Settings_Instance()->m_saturation + 1.f;
+    float gamma = Settings_Instance()->m_gamma;
+
+    // Red along the width, green along the height and blue along the depth
+    std::vector<float> texels(COLOR_LUT_SIZE * COLOR_LUT_SIZE * COLOR_LUT_SIZE * 4);
+    float* texel = texels.data();
+    for (uint32_t b = 0; b < COLOR_LUT_SIZE; b++) {
+        for (uint32_t g = 0; g < COLOR_LUT_SIZE; g++) {
+            for (uint32_t r = 0; r < COLOR_LUT_SIZE; r++) {
+                float pixel[3] = { (float)r, (float)g, (float)b };
+                for (float& c : pixel) {
+                    c = (c / (COLOR_LUT_SIZE - 1) + brightness - 0.5f) * contrast + 0.5f;
+                }
+                float luma = 0.299f * pixel[0] + 0.587f * pixel[1] + 0.114f * pixel[2];
+                for (int i = 0; i < 3; i++) {
+                    // Saturation, lighten only
+                    float c = std::max(luma + (pixel[i] - luma) * saturation, pixel[i]);
+                    texel[i] = std::pow(std::clamp(c, 0.f, 1.f), 1.f / gamma);
+                }
+                texel[3] = 1.f;
+                texel += 4;
+            }
+        }
+    }
+
+    D3D11_TEXTURE3D_DESC desc = {};
+    desc.Width = COLOR_LUT_SIZE;
+    desc.Height = COLOR_LUT_SIZE;
+    desc.Depth = COLOR_LUT_SIZE;
+    desc.MipLevels = 1;
+    desc.Format = DXGI_FORMAT_R32G32B32A32_FLOAT;
+    desc.Usage = D3D11_USAGE_IMMUTABLE;
+    desc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+
+    D3D11_SUBRESOURCE_DATA data = {};
+    data.pSysMem = texels.data();
+    data.SysMemPitch = COLOR_LUT_SIZE * 4 * sizeof(float);
+    data.SysMemSlicePitch = COLOR_LUT_SIZE * data.SysMemPitch;
+
+    ComPtr<ID3D11Texture3D> texture;
+    ComPtr<ID3D11ShaderResourceView> view;
+    HRESULT hr = device->CreateTexture3D(&desc, &data, &texture);
+    if (SUCCEEDED(hr)) {
+        hr = device->CreateShaderResourceView(texture.Get(), nullptr, &view);
+    }
+    if (FAILED(hr)) {
+        Warn("Failed to create the color correction LUT %p %ls\n", hr, GetErrorStr(hr).c_str());
+        return nullptr;
+    }
+    return view;
 }
 
 FrameRender::FrameRender(std::shared_ptr<CD3DRender> pD3DRender)
@@ -86,8 +196,13 @@ FrameRender::FrameRender(std::shared_ptr<CD3DRender> pD3DRender)
     HmdMatrix_SetIdentity(&m_eyeToHead[1]);
     m_viewProj[0] = { -1.0f, 1.0f, 1.0f, -1.0f };
     m_viewProj[1] = { -1.0f, 1.0f, 1.0f, -1.0f };
+    m_renderProj[0] = m_viewProj[0];
+    m_renderProj[1] = m_viewProj[1];
+    UpdateViewTransforms();
 
-    FrameRender::SetGpuPriority(m_pD3DRender->GetDevice());
+    if (Settings_Instance()->m_gpuPriority) {
+        FrameRender::SetGpuPriority(m_pD3DRender->GetDevice());
+    }
 }
 
 FrameRender::~FrameRender() { }
@@ -97,6 +212,14 @@ bool FrameRender::Startup() {
         return true;
     }
 
+    enableColorCorrection = Settings_Instance()->m_enableColorCorrection;
+    enableFFE = Settings_Instance()->m_enableFoveatedEncoding;
+    bool sharpening = Settings_Instance()->m_sharpening != 0.f;
+
+    // Sharpening samples the neighbors of the pixels at the render resolution
+    m_foveatedCompose = enableFFE && !(enableColorCorrection && sharpening)
+        && FRAME_RENDER_VS_FOVEATED_CSO_LEN > 0 && FRAME_RENDER_PS_FOVEATED_CSO_LEN > 0;
+
     //
     // Create staging texture
     // This is input texture of Video Encoder and is render target of both eyes.
@@ -106,9 +229,7 @@ bool FrameRender::Startup() {
     ZeroMemory(&compositionTextureDesc, sizeof(compositionTextureDesc));
     compositionTextureDesc.Width = Settings_Instance()->m_renderWidth;
     compositionTextureDesc.Height = Settings_Instance()->m_renderHeight;
-    compositionTextureDesc.Format = Settings_Instance()->m_enableHdr
-        ? DXGI_FORMAT_R16G16B16A16_FLOAT
-        : DXGI_FORMAT_R8G8B8A8_UNORM_SRGB;
+    compositionTextureDesc.Format = GetCompositionFormat();
     compositionTextureDesc.MipLevels = 1;
     compositionTextureDesc.ArraySize = 1;
     compositionTextureDesc.SampleDesc.Count = 1;
@@ -117,12 +238,19 @@ bool FrameRender::Startup() {
 
     ComPtr<ID3D11Texture2D> compositionTexture;
 
-    if (FAILED(m_pD3DRender->GetDevice()->CreateTexture2D(
-            &compositionTextureDesc, NULL, &compositionTexture
-        ))) {
-        Error("Failed to create staging texture!\n");
-        return false;
+    if (m_foveatedCompose) {
+        m_ffr = std::make_unique<FFR>(m_pD3DRender->GetDevice());
+        m_ffr->InitializeComposeTarget(compositionTextureDesc.Format);
+        compositionTexture = m_ffr->GetOutputTexture();
+    } else {
+        if (FAILED(m_pD3DRender->GetDevice()->CreateTexture2D(
+                &compositionTextureDesc, NULL, &compositionTexture
+            ))) {
+            Error("Failed to create staging texture!\n");
+            return false;
+        }
     }
+    TrackTextureMemory(compositionTexture.Get(), "Compositor");
 
     HRESULT hr = m_pD3DRender->GetDevice()->CreateRenderTargetView(
         compositionTexture.Get(), NULL, &m_pRenderTargetView
@@ -197,6 +325,19 @@ bool FrameRender::Startup() {
     m_scissor.right = (float)Settings_Instance()->m_renderWidth;
     m_scissor.top = (float)Settings_Instance()->m_renderHeight;
 
+    if (m_foveatedCompose) {
+        uint32_t frameWidth, frameHeight;
+        m_ffr->GetOptimizedResolution(&frameWidth, &frameHeight);
+        for (int eye = 0; eye < 2; eye++) {
+            m_foveatedViewports[eye].Width = (float)frameWidth / 2.0;
+            m_foveatedViewports[eye].Height = (float)frameHeight;
+            m_foveatedViewports[eye].MinDepth = 0.0f;
+            m_foveatedViewports[eye].MaxDepth = 1.0f;
+            m_foveatedViewports[eye].TopLeftX = eye * (float)frameWidth / 2.0;
+            m_foveatedViewports[eye].TopLeftY = 0;
+        }
+    }
+
     //
     // Compile shaders
     //
@@ -212,9 +353,16 @@ bool FrameRender::Startup() {
         return false;
     }
 
-    std::vector<uint8_t> pshader(
-        FRAME_RENDER_PS_CSO_PTR, FRAME_RENDER_PS_CSO_PTR + FRAME_RENDER_PS_CSO_LEN
-    );
+    // Without the encoding gamma when it does nothing
+    std::vector<uint8_t> pshader;
+    if (Settings_Instance()->m_encodingGamma == 1.0 && FRAME_RENDER_PS_LINEAR_CSO_LEN > 0) {
+        pshader.assign(
+            FRAME_RENDER_PS_LINEAR_CSO_PTR,
+            FRAME_RENDER_PS_LINEAR_CSO_PTR + FRAME_RENDER_PS_LINEAR_CSO_LEN
+        );
+    } else {
+        pshader.assign(FRAME_RENDER_PS_CSO_PTR, FRAME_RENDER_PS_CSO_PTR + FRAME_RENDER_PS_CSO_LEN);
+    }
     hr = m_pD3DRender->GetDevice()->CreatePixelShader(
         (const DWORD*)&pshader[0], pshader.size(), NULL, &m_pPixelShader
     );
@@ -223,6 +371,49 @@ bool FrameRender::Startup() {
         return false;
     }
 
+    if (m_foveatedCompose) {
+        hr = m_pD3DRender->GetDevice()->CreateVertexShader(
+            FRAME_RENDER_VS_FOVEATED_CSO_PTR,
+            FRAME_RENDER_VS_FOVEATED_CSO_LEN,
+            NULL,
+            &m_pFoveatedVertexShader
+        );
+        if (FAILED(hr)) {
+            Error("CreateVertexShader %p %ls\n", hr, GetErrorStr(hr).c_str());
+            return false;
+        }
+
+        if (Settings_Instance()->m_encodingGamma == 1.0
+            && FRAME_RENDER_PS_FOVEATED_LINEAR_CSO_LEN > 0) {
+            hr = m_pD3DRender->GetDevice()->CreatePixelShader(
+                FRAME_RENDER_PS_FOVEATED_LINEAR_CSO_PTR,
+                FRAME_RENDER_PS_FOVEATED_LINEAR_CSO_LEN,
+                NULL,
+                &m_pFoveatedPixelShader
+            );
+        } else {
+            hr = m_pD3DRender->GetDevice()->CreatePixelShader(
+                FRAME_RENDER_PS_FOVEATED_CSO_PTR,
+                FRAME_RENDER_PS_FOVEATED_CSO_LEN,
+                NULL,
+                &m_pFoveatedPixelShader
+            );
+        }
+        if (FAILED(hr)) {
+            Error("CreatePixelShader %p %ls\n", hr, GetErrorStr(hr).c_str());
+            return false;
+        }
+
+        // The hidden area is masked by the pixel shader, the rectangles are at the render
+        // resolution
+        if (IsHiddenAreaMaskEnabled()) {
+            m_layerTransforms.hiddenAreaSize = Settings_Instance()->m_hiddenAreaMaskSize;
+        }
+        m_pLayerTransformsCBuffer.Attach(
+            CreateBuffer(m_pD3DRender->GetDevice(), m_layerTransforms, D3D11_USAGE_DEFAULT)
+        );
+    }
+
     //
     // Create input layout
     //
@@ -271,7 +462,8 @@ bool FrameRender::Startup() {
     D3D11_BUFFER_DESC bd;
     ZeroMemory(&bd, sizeof(bd));
     bd.Usage = D3D11_USAGE_DYNAMIC;
-    bd.ByteWidth = sizeof(SimpleVertex) * 8;
+    // With the quad of the overlay cache after the layers
+    bd.ByteWidth = sizeof(SimpleVertex) * 8 * (MAX_LAYERS + 1);
     bd.BindFlags = D3D11_BIND_VERTEX_BUFFER;
     bd.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
 
@@ -384,26 +576,173 @@ bool FrameRender::Startup() {
         return false;
     }
 
+    //
+    // Create the overlay cache
+    // The layers over the first one are blended into it with premultiplied alpha, which is then
+    // blended over the first layer while they don't change.
+    //
+
+    D3D11_TEXTURE2D_DESC overlayCacheDesc = compositionTextureDesc;
+    // Keeps the alpha and the values of any composition format
+    overlayCacheDesc.Format = DXGI_FORMAT_R16G16B16A16_FLOAT;
+    // The average alpha of the cells of the overlay coverage is a mip of the cache
+    const bool overlayCoverage = Settings_Instance()->m_overlayQpOffset > 0;
+    if (overlayCoverage) {
+        overlayCacheDesc.MipLevels = OVERLAY_COVERAGE_MIP + 1;
+        overlayCacheDesc.MiscFlags |= D3D11_RESOURCE_MISC_GENERATE_MIPS;
+    }
+    hr = m_pD3DRender->GetDevice()->CreateTexture2D(
+        &overlayCacheDesc, NULL, &m_overlayCacheTexture
+    );
+    if (FAILED(hr)) {
+        Error("CreateTexture2D %p %ls\n", hr, GetErrorStr(hr).c_str());
+        return false;
+    }
+    TrackTextureMemory(m_overlayCacheTexture.Get(), "Compositor");
+    hr = m_pD3DRender->GetDevice()->CreateRenderTargetView(
+        m_overlayCacheTexture.Get(), NULL, &m_overlayCacheRenderTargetView
+    );
+    if (FAILED(hr)) {
+        Error("CreateRenderTargetView %p %ls\n", hr, GetErrorStr(hr).c_str());
+        return false;
+    }
+    // The layers sample the full resolution only
+    D3D11_SHADER_RESOURCE_VIEW_DESC overlayCacheViewDesc = {};
+    overlayCacheViewDesc.Format = overlayCacheDesc.Format;
+    overlayCacheViewDesc.ViewDimension = D3D11_SRV_DIMENSION_TEXTURE2D;
+    overlayCacheViewDesc.Texture2D.MipLevels = 1;
+    hr = m_pD3DRender->GetDevice()->CreateShaderResourceView(
+        m_overlayCacheTexture.Get(), &overlayCacheViewDesc, &m_overlayCacheResourceView
+    );
+    if (FAILED(hr)) {
+        Error("CreateShaderResourceView %p %ls\n", hr, GetErrorStr(hr).c_str());
+        return false;
+    }
+
+    if (overlayCoverage) {
+        D3D11_TEXTURE2D_DESC coverageDesc = {};
+        coverageDesc.Width = std::max<UINT>(overlayCacheDesc.Width >> OVERLAY_COVERAGE_MIP, 1);
+        coverageDesc.Height = std::max<UINT>(overlayCacheDesc.Height >> OVERLAY_COVERAGE_MIP, 1);
+        coverageDesc.MipLevels = 1;
+        coverageDesc.ArraySize = 1;
+        coverageDesc.Format = overlayCacheDesc.Format;
+        coverageDesc.SampleDesc.Count = 1;
+        coverageDesc.Usage = D3D11_USAGE_STAGING;
+        coverageDesc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
+        if (FAILED(m_pD3DRender->GetDevice()->CreateShaderResourceView(
+                m_overlayCacheTexture.Get(), NULL, &m_overlayCacheMipsView
+            ))
+            || FAILED(m_pD3DRender->GetDevice()->CreateTexture2D(
+                &coverageDesc, NULL, &m_overlayCoverageTexture
+            ))) {
+            Warn("Failed to create the overlay coverage textures, overlays get no QP offset");
+            m_overlayCacheMipsView.Reset();
+            m_overlayCoverageTexture.Reset();
+        } else {
+            m_overlayCells.resize(coverageDesc.Width * coverageDesc.Height);
+        }
+    }
+
+    // The encoding gamma is in the cache already
+    FrameRenderBuffer overlayCacheStruct = { 1.0f, 0.0f, 0.0f, 0.0f };
+    m_pOverlayCacheCBuffer = CreateBuffer(m_pD3DRender->GetDevice(), overlayCacheStruct);
+
+    for (int i = 0; i < 8; i++) {
+        BlendDesc.RenderTarget[i].SrcBlendAlpha = D3D11_BLEND_ONE;
+        BlendDesc.RenderTarget[i].DestBlendAlpha = D3D11_BLEND_INV_SRC_ALPHA;
+    }
+
+    hr = m_pD3DRender->GetDevice()->CreateBlendState(&BlendDesc, &m_pBlendStateOverlayCache);
+    if (FAILED(hr)) {
+        Error("CreateBlendState %p %ls\n", hr, GetErrorStr(hr).c_str());
+        return false;
+    }
+
+    for (int i = 0; i < 8; i++) {
+        BlendDesc.RenderTarget[i].SrcBlend = D3D11_BLEND_ONE;
+        BlendDesc.RenderTarget[i].DestBlendAlpha = D3D11_BLEND_ZERO;
+    }
+
+    hr = m_pD3DRender->GetDevice()->CreateBlendState(&BlendDesc, &m_pBlendStateApplyOverlayCache);
+    if (FAILED(hr)) {
+        Error("CreateBlendState %p %ls\n", hr, GetErrorStr(hr).c_str());
+        return false;
+    }
+
+    m_compositionTexture = compositionTexture;
     m_pStagingTexture = compositionTexture;
 
+    if (IsHiddenAreaMaskEnabled() && !m_foveatedCompose) {
+        uint32_t eyeWidth = Settings_Instance()->m_renderWidth / 2;
+        std::vector<HiddenAreaRect> rects = GetHiddenAreaRects(
+            eyeWidth, Settings_Instance()->m_renderHeight, HIDDEN_AREA_ROW_HEIGHT
+        );
+        for (uint32_t eye = 0; eye < 2; eye++) {
+            for (const HiddenAreaRect& rect : rects) {
+                m_hiddenAreaRects.push_back({ (LONG)(rect.left + eye * eyeWidth),
+                                              (LONG)rect.top,
+                                              (LONG)(rect.right + eye * eyeWidth),
+                                              (LONG)rect.bottom });
+            }
+        }
+        hr = m_pD3DRender->GetContext()->QueryInterface(IID_PPV_ARGS(&m_pContext1));
+        if (FAILED(hr)) {
+            Warn("Hidden area mask is not supported by this device\n");
+            m_hiddenAreaRects.clear();
+        }
+    }
+
     std::vector<uint8_t> quadShaderCSO(
         QUAD_SHADER_CSO_PTR, QUAD_SHADER_CSO_PTR + QUAD_SHADER_CSO_LEN
     );
     ComPtr<ID3D11VertexShader> quadVertexShader
         = CreateVertexShader(m_pD3DRender->GetDevice(), quadShaderCSO);
 
-    enableColorCorrection = Settings_Instance()->m_enableColorCorrection;
+    // Without sharpening the correction of a pixel only depends on its color, which is in [0, 1]
+    // outside of HDR, so it's a single fetch from a LUT
+    ComPtr<ID3D11ShaderResourceView> colorLut;
+    if (enableColorCorrection && !sharpening && !Settings_Instance()->m_enableHdr) {
+        colorLut = CreateColorLut(m_pD3DRender->GetDevice());
+    }
+    // Then the foveated encoding pass applies it, instead of a pass of its own. When the layers
+    // are drawn into the foveated frame, the correction pass comes after at its resolution.
+    bool ffrColorLut
+        = colorLut && enableFFE && !m_foveatedCompose && COMPRESS_AXIS_ALIGNED_LUT_CSO_LEN > 0;
+    if (ffrColorLut) {
+        enableColorCorrection = false;
+    }
+    // The checked in CompressAxisAlignedPixelShader.cso predates the radial compression, only the
+    // shaders compiled with fxc have it
+    if (enableFFE && !m_foveatedCompose && !ffrColorLut
+        && Settings_Instance()->m_foveationRadial) {
+        Error("Radial foveated encoding needs the shaders compiled with fxc\n");
+        return false;
+    }
+
     if (enableColorCorrection) {
-        std::vector<uint8_t> colorCorrectionShaderCSO(
-            COLOR_CORRECTION_CSO_PTR, COLOR_CORRECTION_CSO_PTR + COLOR_CORRECTION_CSO_LEN
-        );
+        std::vector<uint8_t> colorCorrectionShaderCSO;
+        // The LUT, or without the sharpening samples when it is disabled
+        bool lut = colorLut && COLOR_CORRECTION_LUT_CSO_LEN > 0;
+        if (lut) {
+            colorCorrectionShaderCSO.assign(
+                COLOR_CORRECTION_LUT_CSO_PTR,
+                COLOR_CORRECTION_LUT_CSO_PTR + COLOR_CORRECTION_LUT_CSO_LEN
+            );
+        } else if (!sharpening && COLOR_CORRECTION_NO_SHARPENING_CSO_LEN > 0) {
+            colorCorrectionShaderCSO.assign(
+                COLOR_CORRECTION_NO_SHARPENING_CSO_PTR,
+                COLOR_CORRECTION_NO_SHARPENING_CSO_PTR + COLOR_CORRECTION_NO_SHARPENING_CSO_LEN
+            );
+        } else {
+            colorCorrectionShaderCSO.assign(
+                COLOR_CORRECTION_CSO_PTR, COLOR_CORRECTION_CSO_PTR + COLOR_CORRECTION_CSO_LEN
+            );
+        }
 
+        D3D11_TEXTURE2D_DESC inputDesc;
+        m_pStagingTexture->GetDesc(&inputDesc);
         ComPtr<ID3D11Texture2D> colorCorrectedTexture = CreateTexture(
-            m_pD3DRender->GetDevice(),
-            Settings_Instance()->m_renderWidth,
-            Settings_Instance()->m_renderHeight,
-            Settings_Instance()->m_enableHdr ? DXGI_FORMAT_R16G16B16A16_FLOAT
-                                             : DXGI_FORMAT_R8G8B8A8_UNORM_SRGB
+            m_pD3DRender->GetDevice(), inputDesc.Width, inputDesc.Height, GetCompositionFormat()
         );
 
         struct ColorCorrection {
@@ -417,9 +756,9 @@ bool FrameRender::Startup() {
             float _align;
         };
         ColorCorrection colorCorrectionStruct = {
-            (float)Settings_Instance()->m_renderWidth, (float)Settings_Instance()->m_renderHeight,
-            Settings_Instance()->m_brightness,         Settings_Instance()->m_contrast + 1.f,
-            Settings_Instance()->m_saturation + 1.f,   Settings_Instance()->m_gamma,
+            (float)inputDesc.Width,                  (float)inputDesc.Height,
+            Settings_Instance()->m_brightness,       Settings_Instance()->m_contrast + 1.f,
+            Settings_Instance()->m_saturation + 1.f, Settings_Instance()->m_gamma,
             Settings_Instance()->m_sharpening
         };
         ComPtr<ID3D11Buffer> colorCorrectionBuffer
@@ -433,19 +772,21 @@ bool FrameRender::Startup() {
             colorCorrectedTexture.Get(),
             colorCorrectionBuffer.Get()
         );
+        if (lut) {
+            m_colorCorrectionPipeline->AddInputView(colorLut.Get());
+        }
 
         m_pStagingTexture = colorCorrectedTexture;
     }
 
-    enableFFE = Settings_Instance()->m_enableFoveatedEncoding;
-    if (enableFFE) {
+    if (enableFFE && !m_foveatedCompose) {
         m_ffr = std::make_unique<FFR>(m_pD3DRender->GetDevice());
-        m_ffr->Initialize(m_pStagingTexture.Get());
+        m_ffr->Initialize(m_pStagingTexture.Get(), ffrColorLut ? colorLut.Get() : nullptr);
 
         m_pStagingTexture = m_ffr->GetOutputTexture();
     }
 
-    if (Settings_Instance()->m_enableHdr) {
+    if (Settings_Instance()->m_convertToYuv) {
         std::vector<uint8_t> yuv420ShaderCSO(
             RGBTOYUV420_CSO_PTR, RGBTOYUV420_CSO_PTR + RGBTOYUV420_CSO_LEN
         );
@@ -514,11 +855,34 @@ bool FrameRender::Startup() {
                 0.0,
                 0.0 };
 
+        // SDR frames are signaled as BT.709 full range by the encoders
+        YUVParams paramStruct_bt709_8bit_full
+            = { { 0.0000000f, 0.5019608f, 0.5019608f, 0.0f }, // offset
+                { 0.2126000f, 0.7152000f, 0.0722000f, 0.0f }, // yCoeff
+                { -0.1141226f, -0.3839166f, 0.4980392f, 0.0f }, // uCoeff
+                { 0.4980392f, -0.4523722f, -0.0456670f, 0.0f }, // vCoeff
+                (float)texWidth,
+                (float)texHeight,
+                0.0,
+                0.0 };
+
+        YUVParams paramStruct_bt709_10bit_full
+            = { { 0.0000000f, 0.5004888f, 0.5004888f, 0.0f }, // offset
+                { 0.2126000f, 0.7152000f, 0.0722000f, 0.0f }, // yCoeff
+                { -0.1144600f, -0.3850512f, 0.4995112f, 0.0f }, // uCoeff
+                { 0.4995112f, -0.4537094f, -0.0458018f, 0.0f }, // vCoeff
+                (float)texWidth,
+                (float)texHeight,
+                0.0,
+                0.0 };
+
         YUVParams& paramStruct = paramStruct_bt2020_8bit_full;
-        if (Settings_Instance()->m_use10bitEncoder) {
-            paramStruct = paramStruct_bt2020_10bit_full;
+        if (Settings_Instance()->m_enableHdr) {
+            paramStruct = Settings_Instance()->m_use10bitEncoder ? paramStruct_bt2020_10bit_full
+                                                                 : paramStruct_bt2020_8bit_full;
         } else {
-            paramStruct = paramStruct_bt2020_8bit_full;
+            paramStruct = Settings_Instance()->m_use10bitEncoder ? paramStruct_bt709_10bit_full
+                                                                 : paramStruct_bt709_8bit_full;
         }
 
         ComPtr<ID3D11Buffer> paramBuffer = CreateBuffer(m_pD3DRender->GetDevice(), paramStruct);
@@ -550,17 +914,202 @@ void FrameRender::SetViewParams(
     m_eyeToHead[0] = eyeToHeadLeft;
     m_viewProj[1] = projRight;
     m_eyeToHead[1] = eyeToHeadRight;
+    UpdateViewTransforms();
+}
+
+void FrameRender::SetRenderProjections(vr::HmdRect2_t projLeft, vr::HmdRect2_t projRight) {
+    m_renderProj[0] = projLeft;
+    m_renderProj[1] = projRight;
+    UpdateViewTransforms();
+}
+
+void FrameRender::UpdateViewTransforms() {
+    const auto nearZ = 0.001f;
+    const auto farZ = 1.0f;
+    const auto depth = 700.0f;
+    const auto m = 1.0f;
+
+    for (int eye = 0; eye < 2; eye++) {
+        const vr::HmdRect2_t& proj = m_viewProj[eye];
+
+        DirectX::XMMATRIX projectionMat = DirectX::XMMatrixPerspectiveOffCenterRH(
+            proj.vTopLeft.v[0] * nearZ,
+            proj.vBottomRight.v[0] * nearZ,
+            -proj.vTopLeft.v[1] * nearZ,
+            -proj.vBottomRight.v[1] * nearZ,
+            nearZ,
+            farZ
+        );
+        DirectX::XMMATRIX hmdToEyeMat
+            = DirectX::XMMatrixInverse(nullptr, HmdMatrix_AsDxMatPosOnly(m_eyeToHead[eye]));
+        DirectX::XMStoreFloat4x4(&m_hmdToEyeProj[eye], hmdToEyeMat * projectionMat);
+
+        // Corners of the eye quad, far enough to make the eye offset negligible. The quad covers
+        // what the game rendered, a difference with the client projection is absorbed here.
+        const vr::HmdRect2_t& renderProj = m_renderProj[eye];
+        m_eyeQuads[eye][0] = { -1.0f * -renderProj.vTopLeft.v[0] * depth * m,
+                               1.0f * -renderProj.vTopLeft.v[1] * depth * m,
+                               -depth,
+                               1.0f };
+        m_eyeQuads[eye][1] = { 1.0f * renderProj.vBottomRight.v[0] * depth * m,
+                               -1.0f * renderProj.vBottomRight.v[1] * depth * m,
+                               -depth,
+                               1.0f };
+        m_eyeQuads[eye][2] = { 1.0f * renderProj.vBottomRight.v[0] * depth * m,
+                               1.0f * -renderProj.vTopLeft.v[1] * depth * m,
+                               -depth,
+                               1.0f };
+        m_eyeQuads[eye][3] = { -1.0f * -renderProj.vTopLeft.v[0] * depth * m,
+                               -1.0f * renderProj.vBottomRight.v[1] * depth * m,
+                               -depth,
+                               1.0f };
+    }
+}
+
+FrameRender::LayerTransform FrameRender::GetLayerTransform(const SimpleVertex quad[4]) {
+    // The quad is affine in clip space: the x, y and w of its points are a + s * b + t * c, s
+    // going from the top left corner to the top right one and t to the bottom left one
+    DirectX::XMVECTOR topLeft
+        = DirectX::XMVectorSet(quad[3].Pos.x, quad[3].Pos.y, quad[3].Pos.w, 0);
+    DirectX::XMVECTOR topRight
+        = DirectX::XMVectorSet(quad[1].Pos.x, quad[1].Pos.y, quad[1].Pos.w, 0);
+    DirectX::XMVECTOR bottomLeft
+        = DirectX::XMVectorSet(quad[0].Pos.x, quad[0].Pos.y, quad[0].Pos.w, 0);
+    DirectX::XMVECTOR a = topLeft;
+    DirectX::XMVECTOR b = DirectX::XMVectorSubtract(topRight, topLeft);
+    DirectX::XMVECTOR c = DirectX::XMVectorSubtract(bottomLeft, topLeft);
+
+    // Rows of the inverse of the matrix of columns b, c and a, which takes the NDC (x / w, y / w,
+    // 1) to (s / w, t / w, 1 / w). A quad seen edge on has none and is never drawn.
+    LayerTransform transform = {};
+    float det = DirectX::XMVectorGetX(DirectX::XMVector3Dot(b, DirectX::XMVector3Cross(c, a)));
+    if (fabsf(det) > 1e-12f) {
+        DirectX::XMVECTOR invDet = DirectX::XMVectorReplicate(1.0f / det);
+        DirectX::XMStoreFloat4(
+            (DirectX::XMFLOAT4*)transform.s,
+            DirectX::XMVectorMultiply(DirectX::XMVector3Cross(c, a), invDet)
+        );
+        DirectX::XMStoreFloat4(
+            (DirectX::XMFLOAT4*)transform.t,
+            DirectX::XMVectorMultiply(DirectX::XMVector3Cross(a, b), invDet)
+        );
+        DirectX::XMStoreFloat4(
+            (DirectX::XMFLOAT4*)transform.q,
+            DirectX::XMVectorMultiply(DirectX::XMVector3Cross(b, c), invDet)
+        );
+    }
+
+    // The texture coordinates of the quads only change with s along u and with t along v
+    transform.texCoords[0] = quad[3].Tex.x;
+    transform.texCoords[1] = quad[3].Tex.y;
+    transform.texCoords[2] = quad[1].Tex.x - quad[3].Tex.x;
+    transform.texCoords[3] = quad[0].Tex.y - quad[3].Tex.y;
+    return transform;
+}
+
+bool FrameRender::CopyLayer(ID3D11Texture2D* textures[2], vr::VRTextureBounds_t bounds[2]) {
+    if (textures[0] == NULL || textures[1] == NULL) {
+        return false;
+    }
+
+    D3D11_TEXTURE2D_DESC dstDesc;
+    m_compositionTexture->GetDesc(&dstDesc);
+    UINT eyeWidth = dstDesc.Width / 2;
+
+    D3D11_BOX boxes[2];
+    for (int eye = 0; eye < 2; eye++) {
+        D3D11_TEXTURE2D_DESC srcDesc;
+        textures[eye]->GetDesc(&srcDesc);
+        if (srcDesc.SampleDesc.Count != 1 || !IsColorPreserved(srcDesc.Format, dstDesc.Format)) {
+            return false;
+        }
+
+        // The bounds must select an unflipped region of the eye size on whole texels
+        float left = bounds[eye].uMin * srcDesc.Width;
+        float top = bounds[eye].vMin * srcDesc.Height;
+        float width = (bounds[eye].uMax - bounds[eye].uMin) * srcDesc.Width;
+        float height = (bounds[eye].vMax - bounds[eye].vMin) * srcDesc.Height;
+        if (fabsf(left - roundf(left)) > 0.01f || fabsf(top - roundf(top)) > 0.01f
+            || fabsf(width - eyeWidth) > 0.01f || fabsf(height - dstDesc.Height) > 0.01f) {
+            return false;
+        }
+
+        boxes[eye].left = (UINT)roundf(left);
+        boxes[eye].top = (UINT)roundf(top);
+        boxes[eye].front = 0;
+        boxes[eye].right = boxes[eye].left + eyeWidth;
+        boxes[eye].bottom = boxes[eye].top + dstDesc.Height;
+        boxes[eye].back = 1;
+    }
+
+    for (int eye = 0; eye < 2; eye++) {
+        m_pD3DRender->GetContext()->CopySubresourceRegion(
+            m_compositionTexture.Get(), 0, eye * eyeWidth, 0, 0, textures[eye], 0, &boxes[eye]
+        );
+    }
+
+    return true;
+}
+
+void FrameRender::MaskHiddenArea() {
+    if (m_hiddenAreaRects.empty()) {
+        return;
+    }
+    const float black[4] = { 0.f, 0.f, 0.f, 1.f };
+    m_pContext1->ClearView(
+        m_pRenderTargetView.Get(), black, m_hiddenAreaRects.data(), m_hiddenAreaRects.size()
+    );
+}
+
+void FrameRender::FinishFrame() {
+    // After the layers, before the passes that read the composition texture
+    MaskHiddenArea();
+
+    // Restore full viewport/scissor rect for the rest
+    m_pD3DRender->GetContext()->RSSetViewports(1, &m_viewport);
+    m_pD3DRender->GetContext()->RSSetScissorRects(1, &m_scissor);
+
+    if (enableColorCorrection) {
+        m_colorCorrectionPipeline->Render();
+    }
+
+    if (enableFFE) {
+        m_ffr->Render();
+    }
+
+    if (Settings_Instance()->m_convertToYuv) {
+        m_yuvPipeline->Render();
+    }
+
+    m_pD3DRender->GetContext()->Flush();
+}
+
+void FrameRender::SetFoveationCenter(const FfiFoveationCenter& center) {
+    if (enableFFE) {
+        m_ffr->SetCenter(center);
+    }
 }
 
 bool FrameRender::RenderFrame(
     ID3D11Texture2D* pTexture[][2],
+    ID3D11ShaderResourceView* pViews[][2],
     vr::VRTextureBounds_t bounds[][2],
     vr::HmdMatrix34_t poses[],
     int layerCount,
     bool recentering,
-    const std::string& message,
-    const std::string& debugText
+    const char* message,
+    const vr::HmdMatrix34_t* headPose
 ) {
+    ALVR_PROFILE_ZONE("FrameRender::RenderFrame");
+    // A single layer is the plain eye images when the game renders at the stream resolution, the
+    // layer pose being the target pose. Copying them skips the draws.
+    if (layerCount == 1 && !recentering && !headPose && !m_foveatedCompose
+        && CopyLayer(pTexture[0], bounds[0])) {
+        UpdateOverlayCoverage(false);
+        FinishFrame();
+        return true;
+    }
+
     // Set render target
     m_pD3DRender->GetContext()->OMSetRenderTargets(1, m_pRenderTargetView.GetAddressOf(), NULL);
 
@@ -578,37 +1127,35 @@ bool FrameRender::RenderFrame(
         layerCount++;
     }
 
-    // Set up our projection, HMD, and HMD-to-eye transforms once
-    const auto nearZ = 0.001f;
-    const auto farZ = 1.0f;
-    DirectX::XMMATRIX projectionMatL = DirectX::XMMatrixPerspectiveOffCenterRH(
-        m_viewProj[0].vTopLeft.v[0] * nearZ,
-        m_viewProj[0].vBottomRight.v[0] * nearZ,
-        -m_viewProj[0].vTopLeft.v[1] * nearZ,
-        -m_viewProj[0].vBottomRight.v[1] * nearZ,
-        nearZ,
-        farZ
-    );
-    DirectX::XMMATRIX projectionMatR = DirectX::XMMatrixPerspectiveOffCenterRH(
-        m_viewProj[1].vTopLeft.v[0] * nearZ,
-        m_viewProj[1].vBottomRight.v[0] * nearZ,
-        -m_viewProj[1].vTopLeft.v[1] * nearZ,
-        -m_viewProj[1].vBottomRight.v[1] * nearZ,
-        nearZ,
-        farZ
-    );
-    DirectX::XMMATRIX hmdToEyeMatL
-        = DirectX::XMMatrixInverse(nullptr, HmdMatrix_AsDxMatPosOnly(m_eyeToHead[0]));
-    DirectX::XMMATRIX hmdToEyeMatR
-        = DirectX::XMMatrixInverse(nullptr, HmdMatrix_AsDxMatPosOnly(m_eyeToHead[1]));
-    DirectX::XMMATRIX hmdPoseForTargetTs
-        = HmdMatrix_AsDxMatOrientOnly(poses[0]); // Set to HmdMatrix_AsDxMat to debug the rendering
+    // The HMD-to-eye projections only change with the view params
+    DirectX::XMMATRIX hmdToEyeProjMatL = DirectX::XMLoadFloat4x4(&m_hmdToEyeProj[0]);
+    DirectX::XMMATRIX hmdToEyeProjMatR = DirectX::XMLoadFloat4x4(&m_hmdToEyeProj[1]);
+    DirectX::XMMATRIX hmdPoseForTargetTs = HmdMatrix_AsDxMatOrientOnly(
+        headPose ? *headPose : poses[0]
+    ); // Set to HmdMatrix_AsDxMat to debug the rendering
 
     // I think the negative Y basis is a handedness thing?
     DirectX::XMMATRIX identityMat = DirectX::XMLoadFloat4x4(&_identityMat);
 
+    if (layerCount > MAX_LAYERS) {
+        Warn("Ignore %d layers over %d\n", layerCount - MAX_LAYERS, MAX_LAYERS);
+        layerCount = MAX_LAYERS;
+    }
+
+    // The layers are batched in one vertex buffer update, drawn one eye at a time with a draw
+    // per layer
+    struct BatchedLayer {
+        ID3D11Texture2D* textures[2];
+        ComPtr<ID3D11ShaderResourceView> views[2];
+        bool first;
+    };
+    BatchedLayer batch[MAX_LAYERS + 1];
+    SimpleVertex vertices[MAX_LAYERS + 1][8];
+    int batchSize = 0;
+
     for (int i = 0; i < layerCount; i++) {
         ID3D11Texture2D* textures[2];
+        ID3D11ShaderResourceView* views[2] = {};
         vr::VRTextureBounds_t bound[2];
 
         if (i == recenterLayer) {
@@ -619,6 +1166,10 @@ bool FrameRender::RenderFrame(
         } else {
             textures[0] = pTexture[i][0];
             textures[1] = pTexture[i][1];
+            if (pViews) {
+                views[0] = pViews[i][0];
+                views[1] = pViews[i][1];
+            }
             bound[0] = bounds[i][0];
             bound[1] = bounds[i][1];
         }
@@ -628,7 +1179,7 @@ bool FrameRender::RenderFrame(
                 i,
                 layerCount,
                 recentering ? L" (recentering)" : L"",
-                !message.empty() ? L" (message)" : L""
+                message[0] != '\0' ? L" (message)" : L""
             );
             continue;
         }
@@ -642,58 +1193,28 @@ bool FrameRender::RenderFrame(
         SRVDesc.Texture2D.MostDetailedMip = 0;
         SRVDesc.Texture2D.MipLevels = 1;
 
-        ComPtr<ID3D11ShaderResourceView> pShaderResourceView[2];
+        BatchedLayer& layer = batch[batchSize];
+        layer.textures[0] = textures[0];
+        layer.textures[1] = textures[1];
+        layer.first = i == 0;
 
-        HRESULT hr = m_pD3DRender->GetDevice()->CreateShaderResourceView(
-            textures[0], &SRVDesc, pShaderResourceView[0].ReleaseAndGetAddressOf()
-        );
-        if (FAILED(hr)) {
-            Error("CreateShaderResourceView %p %ls\n", hr, GetErrorStr(hr).c_str());
-            return false;
-        }
-        hr = m_pD3DRender->GetDevice()->CreateShaderResourceView(
-            textures[1], &SRVDesc, pShaderResourceView[1].ReleaseAndGetAddressOf()
-        );
-        if (FAILED(hr)) {
-            Error("CreateShaderResourceView %p %ls\n", hr, GetErrorStr(hr).c_str());
-            return false;
-        }
-
-        if (i == 0) {
-            m_pD3DRender->GetContext()->OMSetBlendState(m_pBlendStateFirst.Get(), NULL, 0xffffffff);
-        } else {
-            m_pD3DRender->GetContext()->OMSetBlendState(m_pBlendState.Get(), NULL, 0xffffffff);
-        }
-
-        uint32_t inputColorAdjust = 0;
-        if (Settings_Instance()->m_enableHdr) {
-            if (SRVDesc.Format == DXGI_FORMAT_R8G8B8A8_UNORM_SRGB
-                || SRVDesc.Format == DXGI_FORMAT_B8G8R8A8_UNORM_SRGB
-                || SRVDesc.Format == DXGI_FORMAT_B8G8R8X8_UNORM_SRGB) {
-                inputColorAdjust = 1; // do sRGB manually
-            }
-            if (Settings_Instance()->m_forceHdrSrgbCorrection) {
-                inputColorAdjust = 1;
-            }
-            if (Settings_Instance()->m_clampHdrExtendedRange) {
-                inputColorAdjust |= 0x10; // Clamp values to 0.0 to 1.0
+        // The swap textures come with their views
+        for (int eye = 0; eye < 2; eye++) {
+            if (views[eye]) {
+                layer.views[eye] = views[eye];
+                continue;
             }
-        } else {
-            if (SRVDesc.Format != DXGI_FORMAT_R8G8B8A8_UNORM_SRGB
-                && SRVDesc.Format != DXGI_FORMAT_B8G8R8A8_UNORM_SRGB
-                && SRVDesc.Format != DXGI_FORMAT_B8G8R8X8_UNORM_SRGB) {
-                inputColorAdjust = 2; // undo sRGB?
-
-                if (Settings_Instance()->m_forceHdrSrgbCorrection) {
-                    inputColorAdjust = 0;
-                }
-            }
-
-            if (Settings_Instance()->m_clampHdrExtendedRange) {
-                inputColorAdjust |= 0x10; // Clamp values to 0.0 to 1.0
+            HRESULT hr = m_pD3DRender->GetDevice()->CreateShaderResourceView(
+                textures[eye], &SRVDesc, layer.views[eye].ReleaseAndGetAddressOf()
+            );
+            if (FAILED(hr)) {
+                Error("CreateShaderResourceView %p %ls\n", hr, GetErrorStr(hr).c_str());
+                return false;
             }
         }
 
+        uint32_t inputColorAdjust = GetInputColorAdjust(SRVDesc.Format);
+
         //
         // Update uv-coordinates in vertex buffer according to bounds.
         //
@@ -707,70 +1228,34 @@ bool FrameRender::RenderFrame(
         DirectX::XMMATRIX viewMatDiff
             = DirectX::XMMatrixInverse(nullptr, hmdPoseForTargetTs * framePoseInv);
 
-        DirectX::XMMATRIX transformMatL = viewMatDiff * hmdToEyeMatL * projectionMatL;
-        DirectX::XMMATRIX transformMatR = viewMatDiff * hmdToEyeMatR * projectionMatR;
+        DirectX::XMMATRIX transformMatL = viewMatDiff * hmdToEyeProjMatL;
+        DirectX::XMMATRIX transformMatR = viewMatDiff * hmdToEyeProjMatR;
 
         if (i == recenterLayer) {
             transformMatL = identityMat;
             transformMatR = identityMat;
         }
 
-        const auto depth = 700.0f;
-        const auto m = 1.0f;
         DirectX::XMFLOAT4 vertsL[4];
         DirectX::XMFLOAT4 vertsR[4];
-
-        DirectX::XMVECTORF32 vertsL_VF32[4]
-            = { { { { -1.0f * -m_viewProj[0].vTopLeft.v[0] * depth * m,
-                      1.0f * -m_viewProj[0].vTopLeft.v[1] * depth * m,
-                      -depth,
-                      1.0f } } },
-                { { { 1.0f * m_viewProj[0].vBottomRight.v[0] * depth * m,
-                      -1.0f * m_viewProj[0].vBottomRight.v[1] * depth * m,
-                      -depth,
-                      1.0f } } },
-                { { { 1.0f * m_viewProj[0].vBottomRight.v[0] * depth * m,
-                      1.0f * -m_viewProj[0].vTopLeft.v[1] * depth * m,
-                      -depth,
-                      1.0f } } },
-                { { { -1.0f * -m_viewProj[0].vTopLeft.v[0] * depth * m,
-                      -1.0f * m_viewProj[0].vBottomRight.v[1] * depth * m,
-                      -depth,
-                      1.0f } } } };
-
         for (int i = 0; i < 4; i++) {
             DirectX::XMStoreFloat4(
-                &vertsL[i], DirectX::XMVector3Transform(vertsL_VF32[i], transformMatL)
+                &vertsL[i],
+                DirectX::XMVector3Transform(
+                    DirectX::XMLoadFloat4(&m_eyeQuads[0][i]), transformMatL
+                )
             );
-        }
-
-        DirectX::XMVECTORF32 vertsR_VF32[4]
-            = { { { { -1.0f * -m_viewProj[1].vTopLeft.v[0] * depth * m,
-                      1.0f * -m_viewProj[1].vTopLeft.v[1] * depth * m,
-                      -depth,
-                      1.0f } } },
-                { { { 1.0f * m_viewProj[1].vBottomRight.v[0] * depth * m,
-                      -1.0f * m_viewProj[1].vBottomRight.v[1] * depth * m,
-                      -depth,
-                      1.0f } } },
-                { { { 1.0f * m_viewProj[1].vBottomRight.v[0] * depth * m,
-                      1.0f * -m_viewProj[1].vTopLeft.v[1] * depth * m,
-                      -depth,
-                      1.0f } } },
-                { { { -1.0f * -m_viewProj[1].vTopLeft.v[0] * depth * m,
-                      -1.0f * m_viewProj[1].vBottomRight.v[1] * depth * m,
-                      -depth,
-                      1.0f } } } };
-
-        for (int i = 0; i < 4; i++) {
             DirectX::XMStoreFloat4(
-                &vertsR[i], DirectX::XMVector3Transform(vertsR_VF32[i], transformMatR)
+                &vertsR[i],
+                DirectX::XMVector3Transform(
+                    DirectX::XMLoadFloat4(&m_eyeQuads[1][i]), transformMatR
+                )
             );
         }
 
         // We discard the z value because we never want any clipping,
         // but we do want the w value for perspective correction.
-        SimpleVertex vertices[] = {
+        SimpleVertex layerVertices[8] = {
             // Left View
             { DirectX::XMFLOAT4(vertsL[0].x, vertsL[0].y, 0.5, vertsL[0].w),
               DirectX::XMFLOAT2(bound[0].uMin, bound[0].vMax),
@@ -799,18 +1284,120 @@ bool FrameRender::RenderFrame(
               1 + (inputColorAdjust * 2) },
         };
 
+        memcpy(vertices[batchSize], layerVertices, sizeof(layerVertices));
+        batchSize++;
+    }
+
+    // The layers over the first one are drawn from the overlay cache when they are the same as in
+    // the previous frame. The textures of a layer change on each update since the compositor
+    // cycles the textures of its swap sets.
+    int overlayBegin = batchSize > 0 && batch[0].first ? 1 : 0;
+    bool overlaysStatic = batchSize > overlayBegin
+        && m_overlayKeys.size() == (size_t)(batchSize - overlayBegin);
+    for (int j = overlayBegin; j < batchSize && overlaysStatic; j++) {
+        const OverlayLayerKey& key = m_overlayKeys[j - overlayBegin];
+        overlaysStatic = key.textures[0] == batch[j].textures[0]
+            && key.textures[1] == batch[j].textures[1]
+            && memcmp(key.vertices, vertices[j], sizeof(key.vertices)) == 0;
+    }
+    if (!overlaysStatic) {
+        m_overlayKeys.clear();
+        for (int j = overlayBegin; j < batchSize; j++) {
+            OverlayLayerKey key;
+            key.textures[0] = batch[j].textures[0];
+            key.textures[1] = batch[j].textures[1];
+            memcpy(key.vertices, vertices[j], sizeof(key.vertices));
+            m_overlayKeys.push_back(key);
+        }
+        m_overlayCacheValid = false;
+    }
+    UpdateOverlayCoverage(batchSize > overlayBegin);
+
+    if (overlaysStatic) {
+        // Both eyes of the cache, drawn as a layer after the others
+        BatchedLayer& layer = batch[batchSize];
+        layer.textures[0] = layer.textures[1] = m_overlayCacheTexture.Get();
+        layer.views[0] = layer.views[1] = m_overlayCacheResourceView;
+        layer.first = false;
+        for (int eye = 0; eye < 2; eye++) {
+            float uMin = eye * 0.5f;
+            float uMax = uMin + 0.5f;
+            uint32_t view = eye;
+            SimpleVertex* quad = &vertices[batchSize][eye * 4];
+            quad[0] = { DirectX::XMFLOAT4(-1, -1, 0.5, 1), DirectX::XMFLOAT2(uMin, 1), view };
+            quad[1] = { DirectX::XMFLOAT4(1, 1, 0.5, 1), DirectX::XMFLOAT2(uMax, 0), view };
+            quad[2] = { DirectX::XMFLOAT4(1, -1, 0.5, 1), DirectX::XMFLOAT2(uMax, 1), view };
+            quad[3] = { DirectX::XMFLOAT4(-1, 1, 0.5, 1), DirectX::XMFLOAT2(uMin, 0), view };
+        }
+    }
+
+    // The pixel shader only samples the texture of the eye of the draw, t0 for the left eye and t1
+    // for the right one, so each draw binds that one. Foveated draws go to the foveated frame, the
+    // others to a texture at the render resolution.
+    auto drawLayers = [&](int begin, int end, ID3D11BlendState* overlayBlendState, bool foveated) {
+        m_pD3DRender->GetContext()->VSSetShader(
+            foveated ? m_pFoveatedVertexShader.Get() : m_pVertexShader.Get(), nullptr, 0
+        );
+        m_pD3DRender->GetContext()->PSSetShader(
+            foveated ? m_pFoveatedPixelShader.Get() : m_pPixelShader.Get(), nullptr, 0
+        );
+
+        for (int eye = 0; eye < 2; eye++) {
+            const D3D11_VIEWPORT* viewport = eye == 0 ? &m_viewportL : &m_viewportR;
+            if (foveated) {
+                viewport = &m_foveatedViewports[eye];
+            }
+            m_pD3DRender->GetContext()->RSSetViewports(1, viewport);
+            m_pD3DRender->GetContext()->RSSetScissorRects(1, eye == 0 ? &m_scissorL : &m_scissorR);
+
+            ID3D11BlendState* blendState = NULL;
+            for (int j = begin; j < end; j++) {
+                ID3D11BlendState* layerBlendState
+                    = batch[j].first ? m_pBlendStateFirst.Get() : overlayBlendState;
+                if (layerBlendState != blendState) {
+                    m_pD3DRender->GetContext()->OMSetBlendState(layerBlendState, NULL, 0xffffffff);
+                    blendState = layerBlendState;
+                }
+
+                ID3D11ShaderResourceView* view = batch[j].views[eye].Get();
+                m_pD3DRender->GetContext()->PSSetShaderResources(eye, 1, &view);
+
+                m_pD3DRender->GetContext()->DrawIndexed(
+                    VERTEX_INDEX_COUNT / 2, eye * (VERTEX_INDEX_COUNT / 2), j * 8
+                );
+            }
+        }
+    };
+
+    if (batchSize > 0) {
         D3D11_MAPPED_SUBRESOURCE mapped = { 0 };
-        hr = m_pD3DRender->GetContext()->Map(
+        HRESULT hr = m_pD3DRender->GetContext()->Map(
             m_pVertexBuffer.Get(), 0, D3D11_MAP_WRITE_DISCARD, 0, &mapped
         );
         if (FAILED(hr)) {
             Error("Map %p %ls\n", hr, GetErrorStr(hr).c_str());
             return false;
         }
-        memcpy(mapped.pData, vertices, sizeof(vertices));
+        int vertexLayers = batchSize + (overlaysStatic ? 1 : 0);
+        memcpy(mapped.pData, vertices, sizeof(vertices[0]) * vertexLayers);
 
         m_pD3DRender->GetContext()->Unmap(m_pVertexBuffer.Get(), 0);
 
+        if (m_foveatedCompose) {
+            for (int j = 0; j < vertexLayers; j++) {
+                for (int eye = 0; eye < 2; eye++) {
+                    m_layerTransforms.transforms[j * 2 + eye]
+                        = GetLayerTransform(&vertices[j][eye * 4]);
+                }
+            }
+            UpdateBuffer(
+                m_pD3DRender->GetContext(), m_pLayerTransformsCBuffer.Get(), &m_layerTransforms
+            );
+            ID3D11Buffer* buffers[2]
+                = { m_ffr->GetFoveationBuffer(), m_pLayerTransformsCBuffer.Get() };
+            m_pD3DRender->GetContext()->PSSetConstantBuffers(1, 2, buffers);
+        }
+
         // Set the input layout
         m_pD3DRender->GetContext()->IASetInputLayout(m_pVertexLayout.Get());
 
@@ -830,55 +1417,105 @@ bool FrameRender::RenderFrame(
             0, 1, m_pFrameRenderCBuffer.GetAddressOf()
         );
 
-        //
-        // Set shaders
-        //
-
-        m_pD3DRender->GetContext()->VSSetShader(m_pVertexShader.Get(), nullptr, 0);
-        m_pD3DRender->GetContext()->PSSetShader(m_pPixelShader.Get(), nullptr, 0);
-
-        ID3D11ShaderResourceView* shaderResourceView[2]
-            = { pShaderResourceView[0].Get(), pShaderResourceView[1].Get() };
-        m_pD3DRender->GetContext()->PSSetShaderResources(0, 2, shaderResourceView);
-
         m_pD3DRender->GetContext()->PSSetSamplers(0, 1, m_pSamplerLinear.GetAddressOf());
 
         //
         // Draw
         //
 
-        // Left eye
-        m_pD3DRender->GetContext()->RSSetViewports(1, &m_viewportL);
-        m_pD3DRender->GetContext()->RSSetScissorRects(1, &m_scissorL);
-        m_pD3DRender->GetContext()->DrawIndexed(VERTEX_INDEX_COUNT / 2, 0, 0);
+        if (!overlaysStatic) {
+            drawLayers(0, batchSize, m_pBlendState.Get(), m_foveatedCompose);
+        } else {
+            if (!m_overlayCacheValid) {
+                // Unbound first, the cache may still be bound from the last frame it was drawn
+                ID3D11ShaderResourceView* noViews[2] = { NULL, NULL };
+                m_pD3DRender->GetContext()->PSSetShaderResources(0, 2, noViews);
+
+                const float transparent[4] = { 0.f, 0.f, 0.f, 0.f };
+                m_pD3DRender->GetContext()->OMSetRenderTargets(
+                    1, m_overlayCacheRenderTargetView.GetAddressOf(), NULL
+                );
+                m_pD3DRender->GetContext()->ClearRenderTargetView(
+                    m_overlayCacheRenderTargetView.Get(), transparent
+                );
+                drawLayers(overlayBegin, batchSize, m_pBlendStateOverlayCache.Get(), false);
+                m_pD3DRender->GetContext()->OMSetRenderTargets(
+                    1, m_pRenderTargetView.GetAddressOf(), NULL
+                );
+                m_overlayCacheValid = true;
+
+                if (m_overlayCoverageTexture) {
+                    // Read back by a later frame, once the copy is done
+                    m_pD3DRender->GetContext()->GenerateMips(m_overlayCacheMipsView.Get());
+                    m_pD3DRender->GetContext()->CopySubresourceRegion(
+                        m_overlayCoverageTexture.Get(),
+                        0,
+                        0,
+                        0,
+                        0,
+                        m_overlayCacheTexture.Get(),
+                        OVERLAY_COVERAGE_MIP,
+                        NULL
+                    );
+                    m_overlayCoveragePending = true;
+                }
+            }
 
-        // Right eye
-        m_pD3DRender->GetContext()->RSSetViewports(1, &m_viewportR);
-        m_pD3DRender->GetContext()->RSSetScissorRects(1, &m_scissorR);
-        m_pD3DRender->GetContext()->DrawIndexed(
-            VERTEX_INDEX_COUNT / 2, (VERTEX_INDEX_COUNT / 2), 0
-        );
+            drawLayers(0, overlayBegin, m_pBlendState.Get(), m_foveatedCompose);
+            m_pD3DRender->GetContext()->PSSetConstantBuffers(
+                0, 1, m_pOverlayCacheCBuffer.GetAddressOf()
+            );
+            drawLayers(
+                batchSize, batchSize + 1, m_pBlendStateApplyOverlayCache.Get(), m_foveatedCompose
+            );
+        }
     }
 
-    // Restore full viewport/scissor rect for the rest
-    m_pD3DRender->GetContext()->RSSetViewports(1, &m_viewport);
-    m_pD3DRender->GetContext()->RSSetScissorRects(1, &m_scissor);
+    FinishFrame();
 
-    if (enableColorCorrection) {
-        m_colorCorrectionPipeline->Render();
-    }
+    return true;
+}
 
-    if (enableFFE) {
-        m_ffr->Render();
+void FrameRender::UpdateOverlayCoverage(bool overlays) {
+    if (!m_overlayCoverageTexture) {
+        return;
     }
-
-    if (Settings_Instance()->m_enableHdr) {
-        m_yuvPipeline->Render();
+    if (!overlays) {
+        m_overlayCoveragePending = false;
+        if (m_overlayCoverageSet) {
+            SetOverlayCoverage(nullptr, 0, 0);
+            m_overlayCoverageSet = false;
+        }
+        return;
+    }
+    // While the overlays change on every frame the cache isn't drawn, the last coverage is kept
+    if (!m_overlayCoveragePending) {
+        return;
     }
 
-    m_pD3DRender->GetContext()->Flush();
+    D3D11_MAPPED_SUBRESOURCE mapped = {};
+    if (m_pD3DRender->GetContext()->Map(
+            m_overlayCoverageTexture.Get(), 0, D3D11_MAP_READ, D3D11_MAP_FLAG_DO_NOT_WAIT, &mapped
+        )
+        != S_OK) {
+        return;
+    }
+    D3D11_TEXTURE2D_DESC desc;
+    m_overlayCoverageTexture->GetDesc(&desc);
+    for (UINT y = 0; y < desc.Height; y++) {
+        auto* row = reinterpret_cast<const DirectX::PackedVector::HALF*>(
+            static_cast<const uint8_t*>(mapped.pData) + y * mapped.RowPitch
+        );
+        for (UINT x = 0; x < desc.Width; x++) {
+            float alpha = DirectX::PackedVector::XMConvertHalfToFloat(row[x * 4 + 3]);
+            m_overlayCells[y * desc.Width + x] = alpha > OVERLAY_COVERAGE_ALPHA ? 1 : 0;
+        }
+    }
+    m_pD3DRender->GetContext()->Unmap(m_overlayCoverageTexture.Get(), 0);
 
-    return true;
+    SetOverlayCoverage(m_overlayCells.data(), desc.Width, desc.Height);
+    m_overlayCoverageSet = true;
+    m_overlayCoveragePending = false;
 }
 
 ComPtr<ID3D11Texture2D> FrameRender::GetTexture() { return m_pStagingTexture; }
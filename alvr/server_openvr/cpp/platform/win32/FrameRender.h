@@ -3,8 +3,10 @@
 #include <memory>
 #include <stdint.h>
 #include <string>
+#include <vector>
 
 #include <d3d11.h>
+#include <d3d11_1.h>
 #include <d3dcompiler.h>
 #include <directxcolors.h>
 #include <directxmath.h>
@@ -45,32 +47,64 @@ public:
     virtual ~FrameRender();
 
     bool Startup();
+    // The views of the client, which the frames are composed for. The client displays each frame
+    // with exactly these FOVs, so the encoded frame already ends at the edges of what it shows.
     void SetViewParams(
         vr::HmdRect2_t projLeft,
         vr::HmdMatrix34_t eyeToHeadLeft,
         vr::HmdRect2_t projRight,
         vr::HmdMatrix34_t eyeToHeadRight
     );
+    // The projections of the eye textures, the ones SteamVR has. They lag behind the view params
+    // of the client, which forwards small changes to SteamVR late or not at all.
+    void SetRenderProjections(vr::HmdRect2_t projLeft, vr::HmdRect2_t projRight);
+    // Center the next frame is compressed with when foveated encoding is enabled
+    void SetFoveationCenter(const FfiFoveationCenter& center);
+    // The layers are composed for the orientation of headPose, or of the first layer pose if it is
+    // null. A late pose rotates all layers, the first one included, from the poses they were
+    // rendered at.
+    // pViews can be null, as well as any of its views, which are then created for the frame
     bool RenderFrame(
         ID3D11Texture2D* pTexture[][2],
+        ID3D11ShaderResourceView* pViews[][2],
         vr::VRTextureBounds_t bounds[][2],
         vr::HmdMatrix34_t poses[],
         int layerCount,
         bool recentering,
-        const std::string& message,
-        const std::string& debugText
+        const char* message,
+        const vr::HmdMatrix34_t* headPose = nullptr
     );
     void GetEncodingResolution(uint32_t* width, uint32_t* height);
 
     ComPtr<ID3D11Texture2D> GetTexture();
 
 private:
+    void UpdateViewTransforms();
+    bool CopyLayer(ID3D11Texture2D* textures[2], vr::VRTextureBounds_t bounds[2]);
+    void FinishFrame();
+    // Fills the hidden area of the composition texture with black
+    void MaskHiddenArea();
+    // Publishes the overlay coverage once the copy of the last drawn overlay cache is readable,
+    // or clears it without overlay layers
+    void UpdateOverlayCoverage(bool overlays);
+
     std::shared_ptr<CD3DRender> m_pD3DRender;
     ComPtr<ID3D11Texture2D> m_pStagingTexture;
+    // Render target of the layers, input of the color correction, FFR and YUV passes. The FFR
+    // output when the layers are drawn into the foveated frame.
+    ComPtr<ID3D11Texture2D> m_compositionTexture;
 
     ComPtr<ID3D11VertexShader> m_pVertexShader;
     ComPtr<ID3D11PixelShader> m_pPixelShader;
 
+    // With foveated encoding the layers are drawn straight into the output of FFR, which then has
+    // no pass of its own. The overlay cache stays at the render resolution.
+    bool m_foveatedCompose = false;
+    ComPtr<ID3D11VertexShader> m_pFoveatedVertexShader;
+    ComPtr<ID3D11PixelShader> m_pFoveatedPixelShader;
+    ComPtr<ID3D11Buffer> m_pLayerTransformsCBuffer;
+    D3D11_VIEWPORT m_foveatedViewports[2];
+
     ComPtr<ID3D11InputLayout> m_pVertexLayout;
     ComPtr<ID3D11Buffer> m_pVertexBuffer;
     ComPtr<ID3D11Buffer> m_pIndexBuffer;
@@ -84,6 +118,10 @@ private:
     D3D11_VIEWPORT m_viewportL, m_viewportR, m_viewport;
     D3D11_RECT m_scissorL, m_scissorR, m_scissor;
 
+    // ClearView of rectangles needs the D3D11.1 context
+    ComPtr<ID3D11DeviceContext1> m_pContext1;
+    std::vector<D3D11_RECT> m_hiddenAreaRects;
+
     ComPtr<ID3D11BlendState> m_pBlendStateFirst;
     ComPtr<ID3D11BlendState> m_pBlendState;
 
@@ -94,6 +132,10 @@ private:
 
     vr::HmdRect2_t m_viewProj[2];
     vr::HmdMatrix34_t m_eyeToHead[2];
+    vr::HmdRect2_t m_renderProj[2];
+    // Derived from the view params by UpdateViewTransforms, they only change with them
+    DirectX::XMFLOAT4X4 m_hmdToEyeProj[2];
+    DirectX::XMFLOAT4 m_eyeQuads[2][4];
 
     struct SimpleVertex {
         DirectX::XMFLOAT4 Pos;
@@ -102,6 +144,44 @@ private:
     };
     // Parameter for Draw method. 2-triangles for both eyes.
     static const int VERTEX_INDEX_COUNT = 12;
+    // The OvrDirectModeComponent layers and the recentering layer
+    static const int MAX_LAYERS = 11;
+
+    // LayerTransforms of FrameRender.fx, for the layers and the overlay cache
+    struct LayerTransform {
+        float s[4];
+        float t[4];
+        float q[4];
+        float texCoords[4];
+    };
+    struct LayerTransformsBuffer {
+        float hiddenAreaSize;
+        float _align[3];
+        LayerTransform transforms[(MAX_LAYERS + 1) * 2];
+    };
+    LayerTransformsBuffer m_layerTransforms = {};
+    // From the eye NDC to the texture coordinates of the quad of the vertices of an eye
+    static LayerTransform GetLayerTransform(const SimpleVertex quad[4]);
+
+    // What an overlay layer draws, the overlay cache is redrawn when one changes
+    struct OverlayLayerKey {
+        ID3D11Texture2D* textures[2];
+        SimpleVertex vertices[8];
+    };
+    std::vector<OverlayLayerKey> m_overlayKeys;
+    bool m_overlayCacheValid = false;
+    ComPtr<ID3D11Texture2D> m_overlayCacheTexture;
+    ComPtr<ID3D11RenderTargetView> m_overlayCacheRenderTargetView;
+    ComPtr<ID3D11ShaderResourceView> m_overlayCacheResourceView;
+    ComPtr<ID3D11Buffer> m_pOverlayCacheCBuffer;
+    ComPtr<ID3D11BlendState> m_pBlendStateOverlayCache;
+    ComPtr<ID3D11BlendState> m_pBlendStateApplyOverlayCache;
+    // With m_overlayQpOffset, the mips of the cache and a copy of the one of the coverage cells
+    ComPtr<ID3D11ShaderResourceView> m_overlayCacheMipsView;
+    ComPtr<ID3D11Texture2D> m_overlayCoverageTexture;
+    std::vector<uint8_t> m_overlayCells;
+    bool m_overlayCoveragePending = false;
+    bool m_overlayCoverageSet = false;
 
     std::unique_ptr<d3d_render_utils::RenderPipeline> m_colorCorrectionPipeline;
     bool enableColorCorrection;
@@ -111,6 +191,8 @@ private:
 
     std::unique_ptr<d3d_render_utils::RenderPipelineYUV> m_yuvPipeline;
 
+    // Raises the scheduling class of the process, which needs administrator rights, and the
+    // priority of the device within it. The device priority is set even if the class is not.
     static bool SetGpuPriority(ID3D11Device* device) {
         typedef enum _D3DKMT_SCHEDULINGPRIORITYCLASS {
             D3DKMT_SCHEDULINGPRIORITYCLASS_IDLE,
@@ -141,6 +223,7 @@ private:
             return false;
         }
 
+        bool success = true;
         NTSTATUS status
             = d3dkmt_spspc(GetCurrentProcess(), D3DKMT_SCHEDULINGPRIORITYCLASS_REALTIME);
         if (status
@@ -150,14 +233,14 @@ private:
                 "Administrator.\n",
                 GetCurrentProcess()
             );
-            return false;
+            success = false;
         } else if (status != 0) {
             Info(
                 "[GPU PRIO FIX] Failed to set process (%d) priority class: %u\n",
                 GetCurrentProcess(),
                 status
             );
-            return false;
+            success = false;
         }
 
         HRESULT hr = dxgiDevice->SetGPUThreadPriority(GPU_PRIORITY_VAL);
@@ -166,7 +249,9 @@ private:
             return false;
         }
 
-        Debug("[GPU PRIO FIX] D3D11 GPU priority setup success\n");
-        return true;
+        if (success) {
+            Debug("[GPU PRIO FIX] D3D11 GPU priority setup success\n");
+        }
+        return success;
     }
 };
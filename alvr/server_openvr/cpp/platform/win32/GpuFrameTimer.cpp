@@ -0,0 +1,106 @@
+#include "GpuFrameTimer.h"
+
+#include "alvr_server/Logger.h"
+#include "alvr_server/Utils.h"
+#include "alvr_server/bindings.h"
+#include <algorithm>
+
+namespace {
+
+// The clock offset follows the drift of the GPU clock within two windows
+const uint64_t OFFSET_WINDOW_NS = 2'000'000'000;
+
+uint64_t ticksToNs(uint64_t ticks, uint64_t frequency) {
+    return ticks / frequency * 1'000'000'000
+        + uint64_t(double(ticks % frequency) * 1e9 / frequency);
+}
+
+} // namespace
+
+GpuFrameTimer::GpuFrameTimer(ID3D11Device* device) {
+    D3D11_QUERY_DESC disjointDesc = {};
+    disjointDesc.Query = D3D11_QUERY_TIMESTAMP_DISJOINT;
+    D3D11_QUERY_DESC timestampDesc = {};
+    timestampDesc.Query = D3D11_QUERY_TIMESTAMP;
+    for (Frame& frame : m_frames) {
+        if (FAILED(device->CreateQuery(&disjointDesc, &frame.disjoint))
+            || FAILED(device->CreateQuery(&timestampDesc, &frame.begin))
+            || FAILED(device->CreateQuery(&timestampDesc, &frame.end))) {
+            Warn("GpuFrameTimer: Failed to create the queries, frames are timed on the CPU\n");
+            return;
+        }
+    }
+    m_valid = true;
+}
+
+void GpuFrameTimer::Begin(ID3D11DeviceContext* context, uint64_t targetTimestampNs) {
+    Frame& frame = m_frames[m_current];
+    if (frame.pending) {
+        // The GPU is FRAME_COUNT frames behind, the oldest frame goes without times
+        m_oldest = (m_oldest + 1) % FRAME_COUNT;
+    }
+    frame.targetTimestampNs = targetTimestampNs;
+    context->Begin(frame.disjoint.Get());
+    context->End(frame.begin.Get());
+    // The query can't execute before it is submitted
+    frame.flushNs = GetSteadyTimeNs();
+    context->Flush();
+}
+
+void GpuFrameTimer::End(ID3D11DeviceContext* context) {
+    Frame& frame = m_frames[m_current];
+    context->End(frame.end.Get());
+    context->End(frame.disjoint.Get());
+    frame.pending = true;
+    m_current = (m_current + 1) % FRAME_COUNT;
+}
+
+void GpuFrameTimer::ReportCompleted(ID3D11DeviceContext* context) {
+    while (m_frames[m_oldest].pending) {
+        Frame& frame = m_frames[m_oldest];
+        D3D11_QUERY_DATA_TIMESTAMP_DISJOINT disjoint;
+        if (context->GetData(
+                frame.disjoint.Get(), &disjoint, sizeof(disjoint), D3D11_ASYNC_GETDATA_DONOTFLUSH
+            )
+            != S_OK) {
+            return;
+        }
+        frame.pending = false;
+        m_oldest = (m_oldest + 1) % FRAME_COUNT;
+
+        UINT64 begin, end;
+        if (context->GetData(frame.begin.Get(), &begin, sizeof(begin), 0) != S_OK
+            || context->GetData(frame.end.Get(), &end, sizeof(end), 0) != S_OK) {
+            continue;
+        }
+        if (disjoint.Disjoint || end < begin) {
+            // The GPU clock may have changed, the offset is measured again
+            m_windowOffsetNs = INT64_MAX;
+            m_lastWindowOffsetNs = INT64_MAX;
+            continue;
+        }
+
+        uint64_t now = GetSteadyTimeNs();
+        uint64_t beginGpuNs = ticksToNs(begin, disjoint.Frequency);
+        uint64_t endGpuNs = ticksToNs(end, disjoint.Frequency);
+        int64_t offsetNs = updateClockOffset(int64_t(beginGpuNs - frame.flushNs), now);
+
+        int64_t composedNs = int64_t(endGpuNs) - offsetNs;
+        int64_t presentNs = int64_t(beginGpuNs) - offsetNs;
+        uint64_t composedOffset = std::max<int64_t>(int64_t(now) - composedNs, 0);
+        uint64_t presentOffset
+            = std::max<int64_t>(int64_t(now) - presentNs, int64_t(composedOffset));
+        ReportPresent(frame.targetTimestampNs, presentOffset);
+        ReportComposed(frame.targetTimestampNs, composedOffset);
+    }
+}
+
+int64_t GpuFrameTimer::updateClockOffset(int64_t offsetNs, uint64_t nowNs) {
+    if (nowNs - m_windowStartNs > OFFSET_WINDOW_NS) {
+        m_lastWindowOffsetNs = m_windowOffsetNs;
+        m_windowOffsetNs = INT64_MAX;
+        m_windowStartNs = nowNs;
+    }
+    m_windowOffsetNs = std::min(m_windowOffsetNs, offsetNs);
+    return std::min(m_windowOffsetNs, m_lastWindowOffsetNs);
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <d3d11.h>
+#include <stdint.h>
+#include <wrl.h>
+
+using Microsoft::WRL::ComPtr;
+
+// Times the composition of each frame on the GPU with timestamp queries, which are read a few
+// frames later so that the present thread never waits for them. The present and composed times of
+// the statistics are the GPU begin and end of the frame on the steady clock.
+//
+// D3D11 has no clock calibration, so the GPU clock is mapped to the steady clock by the smallest
+// difference between a timestamp and the CPU time at which it was flushed, over the last seconds.
+// The GPU can't execute the query before it is flushed, and right after when it is idle.
+class GpuFrameTimer {
+public:
+    // Valid() is false if the queries can't be created
+    explicit GpuFrameTimer(ID3D11Device* device);
+
+    bool Valid() const { return m_valid; }
+
+    // Around the GPU work of the frame on the immediate context. Begin flushes the context
+    void Begin(ID3D11DeviceContext* context, uint64_t targetTimestampNs);
+    void End(ID3D11DeviceContext* context);
+
+    // Calls ReportPresent and ReportComposed for the frames whose queries are done
+    void ReportCompleted(ID3D11DeviceContext* context);
+
+private:
+    // Frames the GPU may be behind before their times are lost
+    static const int FRAME_COUNT = 4;
+
+    struct Frame {
+        ComPtr<ID3D11Query> disjoint;
+        ComPtr<ID3D11Query> begin;
+        ComPtr<ID3D11Query> end;
+        uint64_t targetTimestampNs = 0;
+        uint64_t flushNs = 0;
+        bool pending = false;
+    };
+
+    // Takes the difference of a frame, returns the current estimate
+    int64_t updateClockOffset(int64_t offsetNs, uint64_t nowNs);
+
+    bool m_valid = false;
+    Frame m_frames[FRAME_COUNT];
+    int m_current = 0;
+    int m_oldest = 0;
+
+    // GPU minus steady clock, the estimate is the minimum of the current and of the last window
+    int64_t m_windowOffsetNs = INT64_MAX;
+    int64_t m_lastWindowOffsetNs = INT64_MAX;
+    uint64_t m_windowStartNs = 0;
+};
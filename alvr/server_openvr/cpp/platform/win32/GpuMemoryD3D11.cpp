@@ -0,0 +1,60 @@
+#include "GpuMemoryD3D11.h"
+
+#include "alvr_server/GpuMemory.h"
+#include <d3dcommon.h>
+#include <wrl.h>
+
+using Microsoft::WRL::ComPtr;
+
+namespace {
+
+uint32_t BitsPerPixel(DXGI_FORMAT format) {
+    switch (format) {
+    case DXGI_FORMAT_R8_UNORM:
+    case DXGI_FORMAT_R8_UINT:
+        return 8;
+    case DXGI_FORMAT_NV12:
+        return 12;
+    case DXGI_FORMAT_R8G8_UNORM:
+    case DXGI_FORMAT_R16_UNORM:
+    case DXGI_FORMAT_R16_FLOAT:
+        return 16;
+    case DXGI_FORMAT_P010:
+        return 24;
+    case DXGI_FORMAT_R16G16B16A16_FLOAT:
+    case DXGI_FORMAT_R16G16B16A16_UNORM:
+        return 64;
+    default:
+        return 32;
+    }
+}
+
+void WINAPI OnTextureDestroyed(void* texture) { UntrackGpuMemory(texture); }
+
+} // namespace
+
+void TrackTextureMemory(ID3D11Texture2D* texture, const char* subsystem) {
+    if (!texture || IsGpuMemoryTracked(texture)) {
+        return;
+    }
+
+    D3D11_TEXTURE2D_DESC desc;
+    texture->GetDesc(&desc);
+    uint64_t bytes = uint64_t(desc.Width) * desc.Height * BitsPerPixel(desc.Format) / 8
+        * desc.ArraySize * desc.SampleDesc.Count;
+
+    // Without the notification the texture would stay counted after its release
+    ComPtr<ID3DDestructionNotifier> notifier;
+    UINT callbackId;
+    if (FAILED(texture->QueryInterface(IID_PPV_ARGS(&notifier)))
+        || FAILED(notifier->RegisterDestructionCallback(OnTextureDestroyed, texture, &callbackId)
+        )) {
+        return;
+    }
+    TrackGpuMemory(
+        texture,
+        subsystem,
+        desc.Usage == D3D11_USAGE_STAGING ? GpuMemoryType::HostVisible : GpuMemoryType::DeviceLocal,
+        bytes
+    );
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+#include <d3d11.h>
+
+// Counts texture in the GPU memory of subsystem, see alvr_server/GpuMemory.h, until the texture
+// is destroyed. The size is estimated from its description. Textures that are already counted,
+// like the ones of a pool, are left as they are.
+void TrackTextureMemory(ID3D11Texture2D* texture, const char* subsystem);
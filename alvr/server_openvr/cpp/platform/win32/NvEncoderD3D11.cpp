@@ -14,6 +14,7 @@
 #include <dlfcn.h>
 #endif
 #include "NvEncoderD3D11.h"
+#include "GpuMemoryD3D11.h"
 
 #ifndef MAKEFOURCC
 #define MAKEFOURCC(a,b,c,d) (((unsigned int)a) | (((unsigned int)b)<< 8) | (((unsigned int)c)<<16) | (((unsigned int)d)<<24) )
@@ -98,6 +99,7 @@ void NvEncoderD3D11::AllocateInputBuffers(int32_t numInputBuffers)
             {
                 NVENC_THROW_ERROR("Failed to create d3d11textures", NV_ENC_ERR_OUT_OF_MEMORY);
             }
+            TrackTextureMemory(pInputTextures, "NVENC input");
             inputFrames.push_back(pInputTextures);
         }
         RegisterInputResources(inputFrames, NV_ENC_INPUT_RESOURCE_TYPE_DIRECTX, 
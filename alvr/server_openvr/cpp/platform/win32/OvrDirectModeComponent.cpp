@@ -1,11 +1,32 @@
 #include "OvrDirectModeComponent.h"
+#include "alvr_server/AllocationCheck.h"
+#include "alvr_server/ApplicationProfile.h"
+#include "alvr_server/PresentPacing.h"
+#include "alvr_server/Profiling.h"
+#include <algorithm>
 
 OvrDirectModeComponent::OvrDirectModeComponent(
     std::shared_ptr<CD3DRender> pD3DRender, std::shared_ptr<PoseHistory> poseHistory
 )
     : m_pD3DRender(pD3DRender)
     , m_poseHistory(poseHistory)
-    , m_submitLayer(0) { }
+    , m_submitLayer(0) {
+    if (Settings_Instance()->m_enforceServerFramePacing) {
+        m_vsyncPacer = std::make_unique<VSyncPacer>();
+        m_vsyncPacer->Start();
+    }
+    if (Settings_Instance()->m_depthPlaneWidth > 0) {
+        try {
+            m_depthPlane = std::make_unique<DepthPlane>(
+                m_pD3DRender->GetDevice(),
+                m_pD3DRender->GetContext(),
+                Settings_Instance()->m_depthPlaneWidth
+            );
+        } catch (Exception e) {
+            Warn("Depth plane unavailable: %s\n", e.what());
+        }
+    }
+}
 
 void OvrDirectModeComponent::SetEncoder(std::shared_ptr<CEncoder> pEncoder) {
     m_pEncoder = pEncoder;
@@ -31,9 +52,17 @@ void OvrDirectModeComponent::CreateSwapTextureSet(
 
     D3D11_TEXTURE2D_DESC SharedTextureDesc = {};
     DXGI_FORMAT format = (DXGI_FORMAT)pSwapTextureSetDesc->nFormat;
+    DXGI_FORMAT viewFormat = format;
     SharedTextureDesc.BindFlags = D3D11_BIND_SHADER_RESOURCE | D3D11_BIND_RENDER_TARGET;
     if (format == DXGI_FORMAT_R32G8X24_TYPELESS || format == DXGI_FORMAT_R32_TYPELESS) {
         SharedTextureDesc.BindFlags = D3D11_BIND_DEPTH_STENCIL;
+        // The depth plane reads the depth channel, only from single sampled textures
+        if (m_depthPlane && pSwapTextureSetDesc->nSampleCount <= 1) {
+            SharedTextureDesc.BindFlags |= D3D11_BIND_SHADER_RESOURCE;
+            viewFormat = format == DXGI_FORMAT_R32_TYPELESS
+                ? DXGI_FORMAT_R32_FLOAT
+                : DXGI_FORMAT_R32_FLOAT_X8X24_TYPELESS;
+        }
     }
     SharedTextureDesc.ArraySize = 1;
     SharedTextureDesc.MipLevels = 1;
@@ -53,9 +82,16 @@ void OvrDirectModeComponent::CreateSwapTextureSet(
     // D3D11_RESOURCE_MISC_SHARED_NTHANDLE;
     SharedTextureDesc.MiscFlags = D3D11_RESOURCE_MISC_SHARED;
 
+    if (unPid != m_applicationPid && m_pEncoder) {
+        m_applicationPid = unPid;
+        std::string executable = GetProcessExecutable(unPid);
+        Info("Swap texture sets of pid %d, %s\n", unPid, executable.c_str());
+        m_pEncoder->SetApplicationSettings(ApplicationSettings(executable.c_str()));
+    }
+
     ProcessResource* processResource = new ProcessResource();
     processResource->pid = unPid;
-    m_swapchainIndices[processResource] = 0;
+    processResource->index = 0;
 
     for (int i = 0; i < 3; i++) {
         HRESULT hr = m_pD3DRender->GetDevice()->CreateTexture2D(
@@ -64,9 +100,28 @@ void OvrDirectModeComponent::CreateSwapTextureSet(
         // LogDriver("texture%d %p res:%d %s", i, texture[i], hr, GetDxErrorStr(hr).c_str());
         if (FAILED(hr)) {
             Error("CreateSwapTextureSet CreateTexture2D %p %ls", hr, GetErrorStr(hr).c_str());
-            m_swapchainIndices.erase(processResource);
             delete processResource;
-            break;
+            return;
+        }
+
+        // The views of the composition are created once with the set, not on every frame
+        if (SharedTextureDesc.BindFlags & D3D11_BIND_SHADER_RESOURCE) {
+            D3D11_SHADER_RESOURCE_VIEW_DESC SRVDesc = {};
+            SRVDesc.Format = viewFormat;
+            SRVDesc.ViewDimension = D3D11_SRV_DIMENSION_TEXTURE2D;
+            SRVDesc.Texture2D.MostDetailedMip = 0;
+            SRVDesc.Texture2D.MipLevels = 1;
+            hr = m_pD3DRender->GetDevice()->CreateShaderResourceView(
+                processResource->textures[i].Get(), &SRVDesc, &processResource->views[i]
+            );
+            if (FAILED(hr)) {
+                // The frame render creates it then, like for any other texture
+                Warn(
+                    "CreateSwapTextureSet CreateShaderResourceView %p %ls",
+                    hr,
+                    GetErrorStr(hr).c_str()
+                );
+            }
         }
 
         IDXGIResource* pResource;
@@ -75,34 +130,44 @@ void OvrDirectModeComponent::CreateSwapTextureSet(
         );
         if (FAILED(hr)) {
             Error("CreateSwapTextureSet QueryInterface %p %ls", hr, GetErrorStr(hr).c_str());
-            m_swapchainIndices.erase(processResource);
             delete processResource;
-            break;
+            return;
         }
         // LogDriver("QueryInterface %p res:%d %s", pResource, hr, GetDxErrorStr(hr).c_str());
 
         hr = pResource->GetSharedHandle(&processResource->sharedHandles[i]);
+        pResource->Release();
         if (FAILED(hr)) {
             Error("CreateSwapTextureSet GetSharedHandle %p %ls", hr, GetErrorStr(hr).c_str());
-            m_swapchainIndices.erase(processResource);
             delete processResource;
-            pResource->Release();
-            break;
+            return;
         }
         // LogDriver("GetSharedHandle %p res:%d %s", processResource->sharedHandles[i], hr,
         // GetDxErrorStr(hr).c_str());
 
-        m_handleMap.insert(
-            std::make_pair(processResource->sharedHandles[i], std::make_pair(processResource, i))
-        );
-
         pOutSwapTextureSet->rSharedTextureHandles[i]
             = (vr::SharedTextureHandle_t)processResource->sharedHandles[i];
 
-        pResource->Release();
-
         Debug("Created Texture %d %p", i, processResource->sharedHandles[i]);
     }
+
+    // Present reads the index
+    std::lock_guard lock(m_presentMutex);
+    for (int i = 0; i < 3; i++) {
+        SwapTexture swapTexture = {
+            processResource->sharedHandles[i],
+            processResource,
+            processResource->textures[i].Get(),
+            processResource->views[i].Get(),
+        };
+        auto it = std::lower_bound(
+            m_swapTextures.begin(),
+            m_swapTextures.end(),
+            swapTexture.handle,
+            [](const SwapTexture& entry, HANDLE handle) { return entry.handle < handle; }
+        );
+        m_swapTextures.insert(it, swapTexture);
+    }
     // m_processMap.insert(std::pair<uint32_t, ProcessResource *>(unPid, processResource));
 }
 
@@ -111,14 +176,13 @@ void OvrDirectModeComponent::CreateSwapTextureSet(
 void OvrDirectModeComponent::DestroySwapTextureSet(vr::SharedTextureHandle_t sharedTextureHandle) {
     Debug("OvrDirectModeComponent::DestroySwapTextureSet %p", sharedTextureHandle);
 
-    auto it = m_handleMap.find((HANDLE)sharedTextureHandle);
-    if (it != m_handleMap.end()) {
+    std::lock_guard lock(m_presentMutex);
+
+    const SwapTexture* swapTexture = FindSwapTexture((HANDLE)sharedTextureHandle);
+    if (swapTexture) {
         // Release all reference (a bit forcible)
-        ProcessResource* p = it->second.first;
-        m_handleMap.erase(p->sharedHandles[0]);
-        m_handleMap.erase(p->sharedHandles[1]);
-        m_handleMap.erase(p->sharedHandles[2]);
-        m_swapchainIndices.erase(p);
+        ProcessResource* p = swapTexture->resource;
+        RemoveSwapTextures(p);
         delete p;
     } else {
         Debug("Requested to destroy not managing texture. handle:%p", sharedTextureHandle);
@@ -129,17 +193,19 @@ void OvrDirectModeComponent::DestroySwapTextureSet(vr::SharedTextureHandle_t sha
 void OvrDirectModeComponent::DestroyAllSwapTextureSets(uint32_t unPid) {
     Debug("OvrDirectModeComponent::DestroyAllSwapTextureSets pid=%d", unPid);
 
-    for (auto it = m_handleMap.begin(); it != m_handleMap.end();) {
-        if (it->second.first->pid == unPid) {
-            if (it->second.second == 0) {
-                m_swapchainIndices.erase(it->second.first);
-                delete it->second.first;
-            }
-            m_handleMap.erase(it++);
-        } else {
-            ++it;
+    std::lock_guard lock(m_presentMutex);
+
+    std::vector<ProcessResource*> resources;
+    for (const SwapTexture& swapTexture : m_swapTextures) {
+        if (swapTexture.resource->pid == unPid
+            && swapTexture.handle == swapTexture.resource->sharedHandles[0]) {
+            resources.push_back(swapTexture.resource);
         }
     }
+    for (ProcessResource* resource : resources) {
+        RemoveSwapTextures(resource);
+        delete resource;
+    }
 }
 
 /** After Present returns, calls this to get the next index to use for rendering. */
@@ -149,11 +215,11 @@ void OvrDirectModeComponent::GetNextSwapTextureSetIndex(
     Debug("OvrDirectModeComponent::GetNextSwapTextureSetIndex");
 
     for (int eye = 0; eye < 2; eye++) {
-        auto it = m_handleMap.find((HANDLE)sharedTextureHandles[eye]);
-        if (it == m_handleMap.end()) {
+        const SwapTexture* swapTexture = FindSwapTexture((HANDLE)sharedTextureHandles[eye]);
+        if (!swapTexture) {
             continue;
         }
-        auto& idx = m_swapchainIndices[it->second.first];
+        auto& idx = swapTexture->resource->index;
         idx = (idx + 1) % 3;
         if (pIndices) {
             (*pIndices)[eye] = idx;
@@ -182,8 +248,8 @@ void OvrDirectModeComponent::SubmitLayer(const SubmitLayerPerEye_t (&perEye)[2])
         auto pose = m_poseHistory->GetBestPoseMatch(*pPose);
         if (pose) {
             // found the frameIndex
-            m_prevTargetTimestampNs = m_targetTimestampNs;
             m_targetTimestampNs = pose->targetTimestampNs;
+            m_foveationCenter = pose->foveationCenter;
 
             m_prevFramePoseRotation = m_framePoseRotation;
             m_framePoseRotation.x = pose->motion.pose.orientation.x;
@@ -210,11 +276,19 @@ void OvrDirectModeComponent::SubmitLayer(const SubmitLayerPerEye_t (&perEye)[2])
 
 /** Submits queued layers for display. */
 void OvrDirectModeComponent::Present(vr::SharedTextureHandle_t syncTexture) {
+    ALVR_PROFILE_FRAME("present");
+    ALVR_PROFILE_ZONE("OvrDirectModeComponent::Present");
+    ALVR_NO_ALLOCATIONS("OvrDirectModeComponent::Present");
     Debug("OvrDirectModeComponent::Present");
 
     m_presentMutex.lock();
 
-    ReportPresent(m_targetTimestampNs, 0);
+    // With GPU times, the encoder reports them once the GPU is done with the frame
+    bool cpuTimes = !m_pEncoder || !m_pEncoder->TimesFramesOnGpu();
+    if (cpuTimes) {
+        ReportPresent(m_targetTimestampNs, 0);
+    }
+    RecordPresentArrival(GetSteadyTimeNs(), m_targetTimestampNs);
 
     bool useMutex = true;
 
@@ -223,11 +297,6 @@ void OvrDirectModeComponent::Present(vr::SharedTextureHandle_t syncTexture) {
     uint32_t layerCount = m_submitLayer;
     m_submitLayer = 0;
 
-    if (m_prevTargetTimestampNs == m_targetTimestampNs) {
-        Debug("Discard duplicated frame. FrameIndex=%llu (Ignoring)", m_targetTimestampNs);
-        // return;
-    }
-
     ID3D11Texture2D* pSyncTexture = m_pD3DRender->GetSharedTexture((HANDLE)syncTexture);
     if (!pSyncTexture) {
         Warn("[VDispDvr] SyncTexture is NULL!");
@@ -256,14 +325,18 @@ void OvrDirectModeComponent::Present(vr::SharedTextureHandle_t syncTexture) {
 
     CopyTexture(layerCount);
 
-    if (useMutex) {
-        if (pKeyedMutex) {
-            pKeyedMutex->ReleaseSync(0);
-            pKeyedMutex->Release();
-        }
+    if (pKeyedMutex) {
+        // OpenVR shares no fence with the driver, but the keyed mutex waits on the GPU queues: the
+        // acquire queued a wait for the compositor work before the copy, and the release queues a
+        // signal after it. The compositor has released the mutex before calling Present, so the
+        // acquire doesn't block, and the mutex is only held while the copy is recorded.
+        pKeyedMutex->ReleaseSync(0);
+        pKeyedMutex->Release();
     }
 
-    ReportComposed(m_targetTimestampNs, 0);
+    if (cpuTimes) {
+        ReportComposed(m_targetTimestampNs, 0);
+    }
 
     if (m_pEncoder) {
         m_pEncoder->NewFrameReady();
@@ -275,86 +348,154 @@ void OvrDirectModeComponent::Present(vr::SharedTextureHandle_t syncTexture) {
 void OvrDirectModeComponent::PostPresent(const vr::IVRDriverDirectModeComponent::Throttling_t*) {
     Debug("OvrDirectModeComponent::PostPresent");
 
-    WaitForVSync();
+    if (m_vsyncPacer) {
+        m_vsyncPacer->WaitForVSync();
+    } else {
+        WaitForVSync();
+    }
 }
 
 void OvrDirectModeComponent::CopyTexture(uint32_t layerCount) {
+    ALVR_PROFILE_ZONE("OvrDirectModeComponent::CopyTexture");
 
     uint64_t presentationTime = GetTimestampUs();
 
     ID3D11Texture2D* pTexture[MAX_LAYERS][2];
-    ComPtr<ID3D11Texture2D> Texture[MAX_LAYERS][2];
+    ID3D11ShaderResourceView* pViews[MAX_LAYERS][2];
     vr::VRTextureBounds_t bounds[MAX_LAYERS][2];
     vr::HmdMatrix34_t poses[MAX_LAYERS];
 
     for (uint32_t i = 0; i < layerCount; i++) {
+        pTexture[i][0] = pTexture[i][1] = nullptr;
+        pViews[i][0] = pViews[i][1] = nullptr;
+
         // Find left eye texture.
         HANDLE leftEyeTexture = (HANDLE)m_submitLayers[i][0].hTexture;
-        auto it = m_handleMap.find(leftEyeTexture);
-        if (it == m_handleMap.end()) {
+        const SwapTexture* left = FindSwapTexture(leftEyeTexture);
+        // Find right eye texture.
+        HANDLE rightEyeTexture = (HANDLE)m_submitLayers[i][1].hTexture;
+        const SwapTexture* right
+            = rightEyeTexture == leftEyeTexture ? left : FindSwapTexture(rightEyeTexture);
+        if (!left || !right) {
             // Ignore this layer.
             Debug(
-                "Submitted texture is not found on HandleMap. eye=right layer=%d/%d Texture "
+                "Submitted texture is not found on HandleMap. eye=%s layer=%d/%d Texture "
                 "Handle=%p",
+                left ? "right" : "left",
                 i,
                 layerCount,
-                leftEyeTexture
+                left ? rightEyeTexture : leftEyeTexture
             );
         } else {
-            Texture[i][0] = it->second.first->textures[it->second.second];
-            D3D11_TEXTURE2D_DESC desc;
-            Texture[i][0]->GetDesc(&desc);
-
-            // Find right eye texture.
-            HANDLE rightEyeTexture = (HANDLE)m_submitLayers[i][1].hTexture;
-            it = m_handleMap.find(rightEyeTexture);
-            if (it == m_handleMap.end()) {
-                // Ignore this layer
-                Debug(
-                    "Submitted texture is not found on HandleMap. eye=left layer=%d/%d Texture "
-                    "Handle=%p",
-                    i,
-                    layerCount,
-                    rightEyeTexture
-                );
-                Texture[i][0].Reset();
-            } else {
-                Texture[i][1] = it->second.first->textures[it->second.second];
-            }
+            pTexture[i][0] = left->texture;
+            pTexture[i][1] = right->texture;
+            pViews[i][0] = left->view;
+            pViews[i][1] = right->view;
         }
 
-        pTexture[i][0] = Texture[i][0].Get();
-        pTexture[i][1] = Texture[i][1].Get();
         bounds[i][0] = m_submitLayers[i][0].bounds;
         bounds[i][1] = m_submitLayers[i][1].bounds;
         poses[i] = m_submitLayers[i][0].mHmdPose;
     }
 
+    if (m_depthPlane && layerCount > 0 && m_targetTimestampNs != 0) {
+        SubmitDepth(m_submitLayers[0]);
+    }
+
     // This can go away, but is useful to see it as a separate packet on the gpu in traces.
     m_pD3DRender->GetContext()->Flush();
 
     if (m_pEncoder) {
-        // Wait for the encoder to be ready.  This is important because the encoder thread
-        // blocks on transmit which uses our shared d3d context (which is not thread safe).
-        m_pEncoder->WaitForEncode();
-
-        std::string debugText;
+        // Composes into a free slot of the encoder frame ring, a slow encode never stalls here
+
+        // Late latch: the layers are rotated to the newest tracking just before composing, and the
+        // frame is sent with it. The client reprojects the rest.
+        std::optional<PoseHistory::TrackingHistoryFrame> latched;
+        if (Settings_Instance()->m_enableLateLatching && m_targetTimestampNs != 0) {
+            latched = m_poseHistory->GetLatestPose();
+            if (latched && latched->targetTimestampNs > m_targetTimestampNs) {
+                // The statistics of a frame follow its target timestamp
+                if (!m_pEncoder->TimesFramesOnGpu()) {
+                    ReportPresent(latched->targetTimestampNs, 0);
+                }
+                m_targetTimestampNs = latched->targetTimestampNs;
+                m_foveationCenter = latched->foveationCenter;
+                m_framePoseRotation.x = latched->motion.pose.orientation.x;
+                m_framePoseRotation.y = latched->motion.pose.orientation.y;
+                m_framePoseRotation.z = latched->motion.pose.orientation.z;
+                m_framePoseRotation.w = latched->motion.pose.orientation.w;
+            } else {
+                latched.reset();
+            }
+        }
 
         uint64_t submitFrameIndex = m_targetTimestampNs;
 
         // Copy entire texture to staging so we can read the pixels to send to remote device.
         m_pEncoder->CopyToStaging(
             pTexture,
+            pViews,
             bounds,
             poses,
             layerCount,
             false,
             presentationTime,
             submitFrameIndex,
+            m_foveationCenter,
+            m_framePoseRotation,
             "",
-            debugText
+            latched ? &latched->rotationMatrix : nullptr
         );
 
         m_pD3DRender->GetContext()->Flush();
     }
 }
+
+const OvrDirectModeComponent::SwapTexture*
+OvrDirectModeComponent::FindSwapTexture(HANDLE handle) const {
+    auto it = std::lower_bound(
+        m_swapTextures.begin(),
+        m_swapTextures.end(),
+        handle,
+        [](const SwapTexture& entry, HANDLE handle) { return entry.handle < handle; }
+    );
+    if (it == m_swapTextures.end() || it->handle != handle) {
+        return nullptr;
+    }
+    return &*it;
+}
+
+void OvrDirectModeComponent::SubmitDepth(const SubmitLayerPerEye_t (&layer)[2]) {
+    ID3D11ShaderResourceView* views[2];
+    vr::VRTextureBounds_t bounds[2];
+    vr::HmdMatrix44_t projections[2];
+    for (int eye = 0; eye < 2; eye++) {
+        const SwapTexture* depth = layer[eye].hDepthTexture
+            ? FindSwapTexture((HANDLE)layer[eye].hDepthTexture)
+            : nullptr;
+        if (!depth || !depth->view) {
+            return;
+        }
+        views[eye] = depth->view;
+        bounds[eye] = layer[eye].bounds;
+        projections[eye] = layer[eye].mProjection;
+    }
+
+    try {
+        m_depthPlane->Submit(views, bounds, projections, m_targetTimestampNs);
+    } catch (Exception e) {
+        Warn("Depth plane unavailable: %s\n", e.what());
+        m_depthPlane.reset();
+    }
+}
+
+void OvrDirectModeComponent::RemoveSwapTextures(ProcessResource* resource) {
+    m_swapTextures.erase(
+        std::remove_if(
+            m_swapTextures.begin(),
+            m_swapTextures.end(),
+            [&](const SwapTexture& entry) { return entry.resource == resource; }
+        ),
+        m_swapTextures.end()
+    );
+}
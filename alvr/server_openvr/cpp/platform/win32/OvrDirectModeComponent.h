@@ -1,5 +1,8 @@
 #pragma once
 #include "CEncoder.h"
+#include "DepthPlane.h"
+#include "VSyncPacer.h"
+#include "alvr_server/LockStats.h"
 #include "alvr_server/PoseHistory.h"
 #include "alvr_server/Utils.h"
 #include "alvr_server/openvr_driver_wrap.h"
@@ -7,6 +10,7 @@
 #include "alvr_server/bindings.h"
 
 #include <mutex>
+#include <vector>
 
 class OvrDirectModeComponent : public vr::IVRDriverDirectModeComponent {
 public:
@@ -54,15 +58,34 @@ private:
     std::shared_ptr<CD3DRender> m_pD3DRender;
     std::shared_ptr<CEncoder> m_pEncoder;
     std::shared_ptr<PoseHistory> m_poseHistory;
+    // Process of the last swap texture set, a game creates a few at once
+    uint32_t m_applicationPid = 0;
 
     // Resource for each process
     struct ProcessResource {
         ComPtr<ID3D11Texture2D> textures[3];
+        // Null for depth textures, which are not composed, unless the depth plane reads them
+        ComPtr<ID3D11ShaderResourceView> views[3];
         HANDLE sharedHandles[3];
         uint32_t pid;
+        uint32_t index;
     };
-    std::map<HANDLE, std::pair<ProcessResource*, int>> m_handleMap;
-    std::map<ProcessResource*, uint32_t> m_swapchainIndices;
+    // A texture of a swap texture set
+    struct SwapTexture {
+        HANDLE handle;
+        ProcessResource* resource;
+        ID3D11Texture2D* texture;
+        ID3D11ShaderResourceView* view;
+    };
+
+    // Null if the handle is not one of a swap texture set
+    const SwapTexture* FindSwapTexture(HANDLE handle) const;
+    void RemoveSwapTextures(ProcessResource* resource);
+    // Records the depth plane of the projection layer if the game submitted its depth
+    void SubmitDepth(const SubmitLayerPerEye_t (&layer)[2]);
+
+    // Textures of all swap texture sets, sorted by handle
+    std::vector<SwapTexture> m_swapTextures;
 
     static const int MAX_LAYERS = 10;
     int m_submitLayer;
@@ -70,7 +93,12 @@ private:
     vr::HmdQuaternion_t m_prevFramePoseRotation;
     vr::HmdQuaternion_t m_framePoseRotation;
     uint64_t m_targetTimestampNs;
-    uint64_t m_prevTargetTimestampNs;
+    FfiFoveationCenter m_foveationCenter = {};
+
+    InstrumentedMutex m_presentMutex { "OvrDirectModeComponent present" };
 
-    std::mutex m_presentMutex;
+    // Null if the server doesn't pace the frames
+    std::unique_ptr<VSyncPacer> m_vsyncPacer;
+    // Null if the depth plane is disabled or not supported
+    std::unique_ptr<DepthPlane> m_depthPlane;
 };
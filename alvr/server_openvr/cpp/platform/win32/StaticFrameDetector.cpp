@@ -0,0 +1,127 @@
+#include "StaticFrameDetector.h"
+
+#include "alvr_server/Logger.h"
+#include "alvr_server/StaticFrames.h"
+
+using Microsoft::WRL::ComPtr;
+
+StaticFrameDetector::StaticFrameDetector(ID3D11Device* device, ID3D11DeviceContext* context)
+    : m_device(device)
+    , m_context(context)
+    , m_scaler(device, context) { }
+
+void StaticFrameDetector::Submit(ID3D11Texture2D* frame) {
+    D3D11_TEXTURE2D_DESC frameDesc;
+    frame->GetDesc(&frameDesc);
+    uint32_t width = (frameDesc.Width + STATIC_FRAME_SCALE - 1) / STATIC_FRAME_SCALE;
+    uint32_t height = (frameDesc.Height + STATIC_FRAME_SCALE - 1) / STATIC_FRAME_SCALE;
+
+    if (width != m_width || height != m_height) {
+        D3D11_TEXTURE2D_DESC desc = {};
+        desc.Width = width;
+        desc.Height = height;
+        desc.MipLevels = 1;
+        desc.ArraySize = 1;
+        desc.Format = DXGI_FORMAT_B8G8R8A8_UNORM;
+        desc.SampleDesc.Count = 1;
+        desc.Usage = D3D11_USAGE_DEFAULT;
+        desc.BindFlags = D3D11_BIND_RENDER_TARGET;
+        m_scaled.Reset();
+        if (FAILED(m_device->CreateTexture2D(&desc, NULL, &m_scaled))) {
+            throw MakeException("Failed to create the static frame texture");
+        }
+
+        desc.Usage = D3D11_USAGE_STAGING;
+        desc.BindFlags = 0;
+        desc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
+        for (auto& staging : m_staging) {
+            staging.Reset();
+            if (FAILED(m_device->CreateTexture2D(&desc, NULL, &staging))) {
+                throw MakeException("Failed to create the static frame staging texture");
+            }
+        }
+        m_width = width;
+        m_height = height;
+        m_reference = -1;
+    }
+
+    m_scaler.Scale(frame, m_scaled.Get(), width, height);
+    m_context->CopyResource(m_staging[m_reference == 0 ? 1 : 0].Get(), m_scaled.Get());
+}
+
+bool StaticFrameDetector::Matches() {
+    if (m_reference < 0) {
+        return false;
+    }
+
+    ID3D11Texture2D* reference = m_staging[m_reference].Get();
+    ID3D11Texture2D* current = m_staging[m_reference == 0 ? 1 : 0].Get();
+    D3D11_MAPPED_SUBRESOURCE mappedReference;
+    D3D11_MAPPED_SUBRESOURCE mappedCurrent;
+    if (FAILED(m_context->Map(reference, 0, D3D11_MAP_READ, 0, &mappedReference))) {
+        return false;
+    }
+    if (FAILED(m_context->Map(current, 0, D3D11_MAP_READ, 0, &mappedCurrent))) {
+        m_context->Unmap(reference, 0);
+        return false;
+    }
+
+    bool matches = StaticFramesMatch(
+        (const uint8_t*)mappedReference.pData,
+        mappedReference.RowPitch,
+        (const uint8_t*)mappedCurrent.pData,
+        mappedCurrent.RowPitch,
+        m_width * 4,
+        m_height
+    );
+
+    m_context->Unmap(current, 0);
+    m_context->Unmap(reference, 0);
+    return matches;
+}
+
+void StaticFrameDetector::FindStaticBlocks(StaticBlocks& blocks) {
+    blocks.width = 0;
+    if (m_reference < 0) {
+        return;
+    }
+
+    ID3D11Texture2D* reference = m_staging[m_reference].Get();
+    ID3D11Texture2D* current = m_staging[m_reference == 0 ? 1 : 0].Get();
+    D3D11_MAPPED_SUBRESOURCE mappedReference;
+    D3D11_MAPPED_SUBRESOURCE mappedCurrent;
+    if (FAILED(m_context->Map(reference, 0, D3D11_MAP_READ, 0, &mappedReference))) {
+        return;
+    }
+    if (FAILED(m_context->Map(current, 0, D3D11_MAP_READ, 0, &mappedCurrent))) {
+        m_context->Unmap(reference, 0);
+        return;
+    }
+
+    ::FindStaticBlocks(
+        (const uint8_t*)mappedReference.pData,
+        mappedReference.RowPitch,
+        (const uint8_t*)mappedCurrent.pData,
+        mappedCurrent.RowPitch,
+        m_width,
+        m_height,
+        4,
+        blocks
+    );
+
+    m_context->Unmap(current, 0);
+    m_context->Unmap(reference, 0);
+}
+
+bool StaticFrameDetector::DetectSceneCut(SceneChangeDetector& detector) {
+    ID3D11Texture2D* current = m_staging[m_reference == 0 ? 1 : 0].Get();
+    D3D11_MAPPED_SUBRESOURCE mapped;
+    if (FAILED(m_context->Map(current, 0, D3D11_MAP_READ, 0, &mapped))) {
+        return false;
+    }
+    bool cut = detector.Update((const uint8_t*)mapped.pData, mapped.RowPitch, m_width, m_height, 4);
+    m_context->Unmap(current, 0);
+    return cut;
+}
+
+void StaticFrameDetector::Accept() { m_reference = m_reference == 0 ? 1 : 0; }
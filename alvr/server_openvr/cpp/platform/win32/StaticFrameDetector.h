@@ -0,0 +1,41 @@
+#pragma once
+
+#include "TextureScaler.h"
+#include "alvr_server/SceneChange.h"
+#include "alvr_server/StaticFrames.h"
+#include <d3d11.h>
+#include <wrl.h>
+
+// Downscaled copies of the encoded frames, read back to find the frames that repeat the last
+// encoded one, see alvr_server/StaticFrames.h. The copies are made by the video processor of the
+// encode device and only read when a frame repeats the pose of the last encoded one, or for every
+// frame to find the scene cuts.
+class StaticFrameDetector {
+public:
+    StaticFrameDetector(ID3D11Device* device, ID3D11DeviceContext* context);
+
+    // Records the downscaled copy of frame, throws if the video processor can't read it
+    void Submit(ID3D11Texture2D* frame);
+    // True if the copy of the last submitted frame matches the reference, waits for the copy
+    bool Matches();
+    // Compares the copy of the last submitted frame to the reference pixel by pixel, waits for the
+    // copy. The blocks are left of width 0 without a reference.
+    void FindStaticBlocks(StaticBlocks& blocks);
+    // Makes the last submitted frame the reference of the next ones
+    void Accept();
+    // Gives the copy of the last submitted frame to detector, waits for the copy. True if the frame
+    // starts a new scene.
+    bool DetectSceneCut(SceneChangeDetector& detector);
+
+private:
+    ID3D11Device* m_device;
+    ID3D11DeviceContext* m_context;
+    TextureScaler m_scaler;
+    Microsoft::WRL::ComPtr<ID3D11Texture2D> m_scaled;
+    // The reference and the last submitted copy
+    Microsoft::WRL::ComPtr<ID3D11Texture2D> m_staging[2];
+    uint32_t m_width = 0;
+    uint32_t m_height = 0;
+    // Index in m_staging, -1 until a frame is accepted
+    int m_reference = -1;
+};
@@ -0,0 +1,88 @@
+#include "TextureScaler.h"
+
+#include "alvr_server/Logger.h"
+
+using Microsoft::WRL::ComPtr;
+
+TextureScaler::TextureScaler(ID3D11Device* device, ID3D11DeviceContext* context) {
+    if (FAILED(device->QueryInterface(IID_PPV_ARGS(&m_videoDevice)))
+        || FAILED(context->QueryInterface(IID_PPV_ARGS(&m_videoContext)))) {
+        throw MakeException("D3D11 video processing is not supported");
+    }
+}
+
+void TextureScaler::createProcessor(
+    const D3D11_TEXTURE2D_DESC& srcDesc, uint32_t width, uint32_t height
+) {
+    D3D11_VIDEO_PROCESSOR_CONTENT_DESC contentDesc = {};
+    contentDesc.InputFrameFormat = D3D11_VIDEO_FRAME_FORMAT_PROGRESSIVE;
+    contentDesc.InputWidth = srcDesc.Width;
+    contentDesc.InputHeight = srcDesc.Height;
+    contentDesc.OutputWidth = width;
+    contentDesc.OutputHeight = height;
+    contentDesc.Usage = D3D11_VIDEO_USAGE_OPTIMAL_SPEED;
+
+    m_processor.Reset();
+    m_enumerator.Reset();
+    m_inputViews.clear();
+    m_outputViews.clear();
+    if (FAILED(m_videoDevice->CreateVideoProcessorEnumerator(&contentDesc, &m_enumerator))
+        || FAILED(m_videoDevice->CreateVideoProcessor(m_enumerator.Get(), 0, &m_processor))) {
+        throw MakeException("Failed to create the D3D11 video processor");
+    }
+
+    m_srcWidth = srcDesc.Width;
+    m_srcHeight = srcDesc.Height;
+    m_width = width;
+    m_height = height;
+}
+
+void TextureScaler::Scale(
+    ID3D11Texture2D* src, ID3D11Texture2D* dst, uint32_t width, uint32_t height
+) {
+    D3D11_TEXTURE2D_DESC srcDesc;
+    src->GetDesc(&srcDesc);
+    if (!m_processor || srcDesc.Width != m_srcWidth || srcDesc.Height != m_srcHeight
+        || width != m_width || height != m_height) {
+        createProcessor(srcDesc, width, height);
+    }
+
+    auto& inputView = m_inputViews[src];
+    if (!inputView) {
+        D3D11_VIDEO_PROCESSOR_INPUT_VIEW_DESC inputDesc = {};
+        inputDesc.ViewDimension = D3D11_VPIV_DIMENSION_TEXTURE2D;
+        if (FAILED(m_videoDevice->CreateVideoProcessorInputView(
+                src, m_enumerator.Get(), &inputDesc, &inputView
+            ))) {
+            m_inputViews.erase(src);
+            throw MakeException("Unsupported video processor input format %d", srcDesc.Format);
+        }
+    }
+
+    auto& outputView = m_outputViews[dst];
+    if (!outputView) {
+        D3D11_VIDEO_PROCESSOR_OUTPUT_VIEW_DESC outputDesc = {};
+        outputDesc.ViewDimension = D3D11_VPOV_DIMENSION_TEXTURE2D;
+        if (FAILED(m_videoDevice->CreateVideoProcessorOutputView(
+                dst, m_enumerator.Get(), &outputDesc, &outputView
+            ))) {
+            m_outputViews.erase(dst);
+            throw MakeException("Unsupported video processor output format");
+        }
+    }
+
+    RECT srcRect = { 0, 0, (LONG)srcDesc.Width, (LONG)srcDesc.Height };
+    RECT dstRect = { 0, 0, (LONG)width, (LONG)height };
+    m_videoContext->VideoProcessorSetStreamSourceRect(m_processor.Get(), 0, TRUE, &srcRect);
+    m_videoContext->VideoProcessorSetStreamDestRect(m_processor.Get(), 0, TRUE, &dstRect);
+    m_videoContext->VideoProcessorSetOutputTargetRect(m_processor.Get(), TRUE, &dstRect);
+
+    D3D11_VIDEO_PROCESSOR_STREAM stream = {};
+    stream.Enable = TRUE;
+    stream.pInputSurface = inputView.Get();
+    if (FAILED(m_videoContext->VideoProcessorBlt(
+            m_processor.Get(), outputView.Get(), 0, 1, &stream
+        ))) {
+        throw MakeException("VideoProcessorBlt failed");
+    }
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <d3d11.h>
+#include <map>
+#include <wrl.h>
+
+// Scales a texture into the top left corner of another one with the D3D11 video processor. Used to
+// encode at a dynamic resolution without resizing the compositor output.
+class TextureScaler {
+public:
+    TextureScaler(ID3D11Device* device, ID3D11DeviceContext* context);
+
+    // dst must be a render target, throws if the video processor can't convert between the formats
+    void Scale(ID3D11Texture2D* src, ID3D11Texture2D* dst, uint32_t width, uint32_t height);
+
+private:
+    void createProcessor(const D3D11_TEXTURE2D_DESC& srcDesc, uint32_t width, uint32_t height);
+
+    Microsoft::WRL::ComPtr<ID3D11VideoDevice> m_videoDevice;
+    Microsoft::WRL::ComPtr<ID3D11VideoContext> m_videoContext;
+    Microsoft::WRL::ComPtr<ID3D11VideoProcessorEnumerator> m_enumerator;
+    Microsoft::WRL::ComPtr<ID3D11VideoProcessor> m_processor;
+    uint32_t m_srcWidth = 0;
+    uint32_t m_srcHeight = 0;
+    uint32_t m_width = 0;
+    uint32_t m_height = 0;
+
+    // Views are kept for the few textures the encoders rotate through
+    std::map<ID3D11Texture2D*, Microsoft::WRL::ComPtr<ID3D11VideoProcessorInputView>> m_inputViews;
+    std::map<ID3D11Texture2D*, Microsoft::WRL::ComPtr<ID3D11VideoProcessorOutputView>>
+        m_outputViews;
+};
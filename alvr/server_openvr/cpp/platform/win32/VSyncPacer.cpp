@@ -0,0 +1,94 @@
+#include "VSyncPacer.h"
+
+#include "alvr_server/Logger.h"
+#include "alvr_server/ThreadScheduling.h"
+#include "alvr_server/bindings.h"
+#include <chrono>
+#include <thread>
+
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002
+#endif
+
+namespace {
+
+// Tick interval before a client connects, SteamVR must not take it for the display refresh rate
+const uint64_t PRE_HEADSET_INTERVAL_NS = 8'000'000;
+
+// Longest wait for a tick, a stalled pacer never holds the present thread for long
+const auto WAIT_TIMEOUT = std::chrono::milliseconds(100);
+
+uint64_t GetSteadyTimeNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch()
+    )
+        .count();
+}
+
+} // namespace
+
+VSyncPacer::VSyncPacer()
+    : m_bExiting(false)
+    , m_tickCount(0) {
+    m_timer = CreateWaitableTimerExW(
+        NULL, NULL, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS
+    );
+    if (m_timer == NULL) {
+        // Before Windows 10 1803
+        Warn("VSyncPacer: No high resolution timer, the vsyncs may be late\n");
+        m_timer = CreateWaitableTimerExW(NULL, NULL, 0, TIMER_ALL_ACCESS);
+    }
+}
+
+VSyncPacer::~VSyncPacer() {
+    Stop();
+    if (m_timer != NULL) {
+        CloseHandle(m_timer);
+    }
+}
+
+void VSyncPacer::Run() {
+    ApplyStreamingThreadScheduling("vsync");
+    uint64_t lastTickNs = 0;
+    while (!m_bExiting) {
+        uint64_t nowNs = GetSteadyTimeNs();
+        uint64_t waitNs = PRE_HEADSET_INTERVAL_NS;
+        uint64_t periodNs = GetVSyncIntervalNs();
+        if (periodNs > 0) {
+            waitNs = GetTimeUntilNextVSyncNs();
+            // Woken up right before the vsync that was just ticked, the next one is a period later
+            if (nowNs + waitNs < lastTickNs + periodNs / 2) {
+                waitNs += periodNs;
+            }
+        }
+
+        // In 100 ns units, negative for a time relative to now
+        LARGE_INTEGER dueTime;
+        dueTime.QuadPart = -(LONGLONG)(waitNs / 100);
+        if (dueTime.QuadPart < 0 && m_timer != NULL
+            && SetWaitableTimer(m_timer, &dueTime, 0, NULL, NULL, FALSE)) {
+            WaitForSingleObject(m_timer, INFINITE);
+        } else if (waitNs > 0) {
+            std::this_thread::sleep_for(std::chrono::nanoseconds(waitNs));
+        }
+        lastTickNs = GetSteadyTimeNs();
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_tickCount++;
+        }
+        m_tick.notify_all();
+    }
+}
+
+void VSyncPacer::Stop() {
+    m_bExiting = true;
+    m_tick.notify_all();
+    Join();
+}
+
+void VSyncPacer::WaitForVSync() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    uint64_t tickCount = m_tickCount;
+    m_tick.wait_for(lock, WAIT_TIMEOUT, [&] { return m_tickCount != tickCount || m_bExiting; });
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "shared/threadtools.h"
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <stdint.h>
+#include <windows.h>
+
+// Ticks at the vsyncs of the headset with a high resolution waitable timer, which wakes up within
+// tens of microseconds where a sleep of the default timer resolution can be a millisecond late.
+// Before a client connects it ticks every 8 ms, like WaitForVSync.
+class VSyncPacer : public CThread {
+public:
+    VSyncPacer();
+    ~VSyncPacer();
+
+    virtual void Run();
+
+    void Stop();
+
+    // Blocks until the next tick
+    void WaitForVSync();
+
+private:
+    HANDLE m_timer;
+    std::atomic<bool> m_bExiting;
+
+    std::mutex m_mutex;
+    std::condition_variable m_tick;
+    uint64_t m_tickCount;
+};
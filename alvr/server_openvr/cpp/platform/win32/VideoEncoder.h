@@ -1,11 +1,116 @@
 #pragma once
 
 #include "NvEncoderD3D11.h"
+#include "alvr_server/EncoderControl.h"
+#include "alvr_server/FixedRing.h"
+#include "alvr_server/IDRScheduler.h"
+#include "alvr_server/IEncoder.h"
+#include "alvr_server/Logger.h"
 #include "shared/d3drender.h"
+#include <chrono>
+#include <condition_variable>
 #include <functional>
 #include <memory>
+#include <mutex>
+#include <thread>
 
-class VideoEncoder {
+// Encoder buffers lent to ParseFrameLentNals and not given back yet. Shutdown waits for them, the
+// memory they hold belongs to the encoder.
+class LentBufferCount {
+public:
+    void Lend() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_count++;
+    }
+
+    void Return() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_count--;
+        }
+        m_returned.notify_all();
+    }
+
+    // The sender gives back the frames of a closed connection when it drops its queue, which
+    // doesn't take long
+    void WaitForReturns() {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (!m_returned.wait_for(lock, std::chrono::seconds(1), [&] { return m_count == 0; })) {
+            Warn("%d encoder buffers are still lent to the sender\n", m_count);
+        }
+    }
+
+private:
+    std::mutex m_mutex;
+    std::condition_variable m_returned;
+    int m_count = 0;
+};
+
+// Thread which sends the frames submitted by Transmit in order, so that waiting for the output of
+// a frame overlaps the submission of the next one. The pending frames are still sent when stopping.
+template <typename T, size_t N> class EncoderOutputThread {
+public:
+    ~EncoderOutputThread() { Stop(); }
+
+    void Start(std::function<void(const T&)> output) {
+        m_stop = false;
+        m_thread = std::thread([this, output] { Run(output); });
+    }
+
+    void Push(const T& item) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_pending.push_back(item);
+        }
+        m_condition.notify_all();
+    }
+
+    // Blocks until at most maxPending frames are still to be sent
+    void WaitForPending(size_t maxPending) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_condition.wait(lock, [&] { return m_pending.size() <= maxPending; });
+    }
+
+    void Stop() {
+        if (!m_thread.joinable()) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_condition.notify_all();
+        m_thread.join();
+    }
+
+private:
+    void Run(const std::function<void(const T&)>& output) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (true) {
+            m_condition.wait(lock, [&] { return m_stop || !m_pending.empty(); });
+            if (m_pending.empty()) {
+                return;
+            }
+            T item = m_pending.front();
+            lock.unlock();
+
+            output(item);
+
+            lock.lock();
+            m_pending.pop_front();
+            m_condition.notify_all();
+        }
+    }
+
+    std::thread m_thread;
+    std::mutex m_mutex;
+    std::condition_variable m_condition;
+    // The callers wait for the thread before more than N frames are pending
+    FixedRing<T, N> m_pending;
+    bool m_stop = false;
+};
+
+class VideoEncoder : public IEncoder {
 public:
     virtual void Initialize() = 0;
     virtual void Shutdown() = 0;
@@ -16,4 +121,21 @@ public:
         uint64_t targetTimestampNs,
         bool insertIDR
     ) = 0;
+
+    // With async, the texture of a frame may still be read until the next Transmit returns,
+    // instead of only until its own Transmit returns
+    EncoderCapabilities GetCapabilities() {
+        EncoderCapabilities capabilities;
+        capabilities.tenBit = Uses10BitProfile(Settings_Instance()->m_codec);
+        return capabilities;
+    }
+
+protected:
+    // Dynamic parameters newer than the last ones applied, checked at the start of Transmit
+    FfiDynamicEncoderParams PollDynamicParams() {
+        return g_encoderControl.Poll(m_dynamicParamsGeneration);
+    }
+
+private:
+    uint64_t m_dynamicParamsGeneration = 0;
 };
@@ -1,8 +1,15 @@
 #include "VideoEncoderAMF.h"
+#include "GpuMemoryD3D11.h"
 #include "ALVR-common/packet_types.h"
 
+#include "alvr_server/EncoderControl.h"
 #include "alvr_server/Logger.h"
+#include "alvr_server/Profiling.h"
+#include "alvr_server/Utils.h"
 #include "alvr_server/bindings.h"
+#include <algorithm>
+#include <chrono>
+#include <iterator>
 
 #define AMF_THROW_IF(expr)                                                                         \
     {                                                                                              \
@@ -20,35 +27,72 @@ AMFPipe::AMFPipe(amf::AMFComponentPtr src, AMFDataReceiver receiver)
     , m_receiver(receiver) { }
 
 AMFPipe::~AMFPipe() {
+    Stop();
     Debug("AMFPipe::~AMFPipe()  m_amfComponentSrc->Drain\n");
     m_amfComponentSrc->Drain();
 }
 
-void AMFPipe::doPassthrough(bool hasQueryTimeout, uint32_t timerResolution) {
-    amf::AMFDataPtr data = nullptr;
-    if (hasQueryTimeout) {
-        AMF_RESULT res = m_amfComponentSrc->QueryOutput(&data);
-        if (res == AMF_OK && data) {
-            m_receiver(data);
-        } else {
-            Debug("Failed to get AMF component data. Last status: %d.\n", res);
-        }
-    } else {
-        uint16_t timeout = 1000; // 1s timeout
-        AMF_RESULT res = m_amfComponentSrc->QueryOutput(&data);
+void AMFPipe::Start(bool blockingQuery, uint32_t timerResolution) {
+    m_blockingQuery = blockingQuery;
+    m_timerResolution = timerResolution;
+    m_thread = std::thread(&AMFPipe::Run, this);
+}
+
+void AMFPipe::Stop() {
+    if (!m_thread.joinable()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_condition.notify_all();
+    m_thread.join();
+}
+
+void AMFPipe::NotifyInput() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_pendingInputs++;
+    }
+    m_condition.notify_all();
+}
 
-        timeBeginPeriod(timerResolution);
-        while (!data && --timeout != 0) {
-            amf_sleep(1);
-            res = m_amfComponentSrc->QueryOutput(&data);
+void AMFPipe::Run() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true) {
+        m_condition.wait(lock, [&] { return m_stopping || m_pendingInputs > 0; });
+        if (m_stopping) {
+            return;
         }
-        timeEndPeriod(timerResolution);
+        m_pendingInputs--;
+        lock.unlock();
+
+        bool complete = false;
+        while (!complete) {
+            amf::AMFDataPtr data = nullptr;
+            AMF_RESULT res = m_amfComponentSrc->QueryOutput(&data);
+            if (!data && !m_blockingQuery) {
+                uint16_t timeout = 1000; // 1s timeout
+                timeBeginPeriod(m_timerResolution);
+                while (!data && --timeout != 0 && !m_stopping) {
+                    amf_sleep(1);
+                    res = m_amfComponentSrc->QueryOutput(&data);
+                }
+                timeEndPeriod(m_timerResolution);
+            }
 
-        if (data) {
-            m_receiver(data);
-        } else {
-            Debug("Failed to get AMF component data. Last status: %d.\n", res);
+            if (!data) {
+                Debug("Failed to get AMF component data. Last status: %d.\n", res);
+                break;
+            }
+            complete = m_receiver(data);
         }
+        if (complete && m_next) {
+            m_next->NotifyInput();
+        }
+
+        lock.lock();
     }
 }
 
@@ -56,7 +100,7 @@ AMFSolidPipe::AMFSolidPipe(amf::AMFComponentPtr src, amf::AMFComponentPtr dst)
     : AMFPipe(src, std::bind(&AMFSolidPipe::Passthrough, this, std::placeholders::_1))
     , m_amfComponentDst(dst) { }
 
-void AMFSolidPipe::Passthrough(AMFDataPtr data) {
+bool AMFSolidPipe::Passthrough(AMFDataPtr data) {
     auto res = m_amfComponentDst->SubmitInput(data);
     switch (res) {
     case AMF_OK:
@@ -71,6 +115,7 @@ void AMFSolidPipe::Passthrough(AMFDataPtr data) {
         Debug("m_amfComponentDst->SubmitInput returns code %d.\n", res);
         break;
     }
+    return true;
 }
 
 AMFPipeline::AMFPipeline()
@@ -80,19 +125,52 @@ AMFPipeline::AMFPipeline()
 }
 
 AMFPipeline::~AMFPipeline() {
+    // All the threads are stopped before a pipe drains, none may still submit to its source
+    for (auto& pipe : m_pipes) {
+        pipe->Stop();
+    }
     for (auto& pipe : m_pipes) {
         delete pipe;
     }
 }
 
-void AMFPipeline::Connect(AMFPipePtr pipe) { m_pipes.emplace_back(pipe); }
+void AMFPipeline::Connect(AMFPipePtr pipe) {
+    if (!m_pipes.empty()) {
+        m_pipes.back()->SetNext(pipe);
+    }
+    m_pipes.emplace_back(pipe);
+}
 
-void AMFPipeline::Run(bool hasQueryTimeout) {
-    for (auto& pipe : m_pipes) {
-        pipe->doPassthrough(hasQueryTimeout, m_timerResolution);
+void AMFPipeline::Start(bool hasQueryTimeout) {
+    for (size_t i = 0; i < m_pipes.size(); i++) {
+        m_pipes[i]->Start(hasQueryTimeout && i == m_pipes.size() - 1, m_timerResolution);
     }
 }
 
+void AMFPipeline::NotifyInput() {
+    if (!m_pipes.empty()) {
+        m_pipes.front()->NotifyInput();
+    }
+}
+
+void AMFInputObserver::OnSurfaceDataRelease(amf::AMFSurface*) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_inUse--;
+    m_condition.notify_all();
+}
+
+void AMFInputObserver::Acquire() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_inUse++;
+}
+
+bool AMFInputObserver::WaitForRelease(int maxInUse, uint32_t timeoutMs) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    return m_condition.wait_for(lock, std::chrono::milliseconds(timeoutMs), [&] {
+        return m_inUse <= maxInUse;
+    });
+}
+
 //
 // VideoEncoderAMF
 //
@@ -103,14 +181,19 @@ VideoEncoderAMF::VideoEncoderAMF(std::shared_ptr<CD3DRender> d3dRender, int widt
     , m_refreshRate(Settings_Instance()->m_refreshRate)
     , m_renderWidth(width)
     , m_renderHeight(height)
+    , m_encodeWidth(width)
+    , m_encodeHeight(height)
     , m_bitrateInMBits(30)
     , m_surfaceFormat(amf::AMF_SURFACE_RGBA)
     , m_use10bit(Settings_Instance()->m_use10bitEncoder)
     , m_hasQueryTimeout(false) {
-    if (Settings_Instance()->m_enableHdr) {
-        // Bypass preprocessor and converters for HDR, since it will already be YUV
+    if (Settings_Instance()->m_convertToYuv) {
+        // Bypass preprocessor and converters, the frames are already YUV
         m_surfaceFormat = m_use10bit ? amf::AMF_SURFACE_P010 : amf::AMF_SURFACE_NV12;
     }
+    // The long term references would take the slots of the temporal layer references
+    m_useLtr = Settings_Instance()->m_refFrameInvalidation && m_codec != ALVR_CODEC_AV1
+        && Settings_Instance()->m_temporalLayers <= 1;
 }
 
 VideoEncoderAMF::~VideoEncoderAMF() { }
@@ -127,6 +210,7 @@ amf::AMFComponentPtr VideoEncoderAMF::MakeEncoder(
 
     amf_int32 frameRateIn = refreshRate;
     amf_int64 bitRateIn = bitrateInMbits * 1'000'000L; // in bits
+    int intraRefreshFrames = Settings_Instance()->m_intraRefreshRecoveryFrames;
 
     switch (codec) {
     case ALVR_CODEC_H264:
@@ -149,6 +233,10 @@ amf::AMFComponentPtr VideoEncoderAMF::MakeEncoder(
     // Create encoder component.
     AMF_THROW_IF(g_AMFFactory.GetFactory()->CreateComponent(m_amfContext, pCodec, &amfEncoder));
 
+    // Each temporal layer is predicted from the layers below it, so the frames need one reference
+    // per layer below the top one
+    amf_int64 temporalLayers = Settings_Instance()->m_temporalLayers;
+
     switch (codec) {
     case ALVR_CODEC_H264: {
         amfEncoder->SetProperty(AMF_VIDEO_ENCODER_USAGE, AMF_VIDEO_ENCODER_USAGE_ULTRA_LOW_LATENCY);
@@ -292,13 +380,35 @@ amf::AMFComponentPtr VideoEncoderAMF::MakeEncoder(
         // Turns Off IDR/I Frames
         amfEncoder->SetProperty(AMF_VIDEO_ENCODER_IDR_PERIOD, 0);
 
+        // Refreshing a slot of macroblocks per frame repairs lost frames within the period
+        if (intraRefreshFrames > 0) {
+            int mbCount = ((width + 15) / 16) * ((height + 15) / 16);
+            amfEncoder->SetProperty(
+                AMF_VIDEO_ENCODER_INTRA_REFRESH_NUM_MBS_PER_SLOT,
+                (mbCount + intraRefreshFrames - 1) / intraRefreshFrames
+            );
+            m_intraRefreshMode = IntraRefreshMode::Continuous;
+        }
+        if (m_useLtr) {
+            amfEncoder->SetProperty(AMF_VIDEO_ENCODER_MAX_LTR_FRAMES, LTR_SLOTS);
+        }
+
         // Disable AUD to produce the same stream format as VideoEncoderNVENC.
         // FIXME: This option doesn't work in 22.10.3, but works in versions prior 22.5.1
         amfEncoder->SetProperty(AMF_VIDEO_ENCODER_INSERT_AUD, false);
 
-        amfEncoder->SetProperty(AMF_VIDEO_ENCODER_VBV_BUFFER_SIZE, bitRateIn / frameRateIn * 1.1);
+        amfEncoder->SetProperty(
+            AMF_VIDEO_ENCODER_VBV_BUFFER_SIZE,
+            (amf_int64)CapToMaxFrameSize(m_maxFrameBytes, bitRateIn / frameRateIn * 1.1)
+        );
 
-        amfEncoder->SetProperty(AMF_VIDEO_ENCODER_MAX_NUM_REFRAMES, 0);
+        amfEncoder->SetProperty(AMF_VIDEO_ENCODER_MAX_NUM_REFRAMES, temporalLayers - 1);
+        if (temporalLayers > 1) {
+            amfEncoder->SetProperty(AMF_VIDEO_ENCODER_MAX_NUM_TEMPORAL_LAYERS, temporalLayers);
+            amfEncoder->SetProperty(
+                AMF_VIDEO_ENCODER_NUM_TEMPORAL_ENHANCMENT_LAYERS, temporalLayers
+            );
+        }
 
         if (m_hasQueryTimeout) {
             amfEncoder->SetProperty(AMF_VIDEO_ENCODER_QUERY_TIMEOUT, 1000); // 1s timeout
@@ -454,15 +564,33 @@ amf::AMFComponentPtr VideoEncoderAMF::MakeEncoder(
         // Set infinite GOP length
         amfEncoder->SetProperty(AMF_VIDEO_ENCODER_HEVC_GOP_SIZE, 0);
 
+        // Refreshing a slot of CTBs per frame repairs lost frames within the period
+        if (intraRefreshFrames > 0) {
+            int ctbCount = ((width + 63) / 64) * ((height + 63) / 64);
+            amfEncoder->SetProperty(
+                AMF_VIDEO_ENCODER_HEVC_INTRA_REFRESH_NUM_CTBS_PER_SLOT,
+                (ctbCount + intraRefreshFrames - 1) / intraRefreshFrames
+            );
+            m_intraRefreshMode = IntraRefreshMode::Continuous;
+        }
+        if (m_useLtr) {
+            amfEncoder->SetProperty(AMF_VIDEO_ENCODER_HEVC_MAX_LTR_FRAMES, LTR_SLOTS);
+        }
+
         // Disable AUD to produce the same stream format as VideoEncoderNVENC.
         // FIXME: This option doesn't work in 22.10.3, but works in versions prior 22.5.1
         amfEncoder->SetProperty(AMF_VIDEO_ENCODER_HEVC_INSERT_AUD, false);
 
         amfEncoder->SetProperty(
-            AMF_VIDEO_ENCODER_HEVC_VBV_BUFFER_SIZE, bitRateIn / frameRateIn * 1.1
+            AMF_VIDEO_ENCODER_HEVC_VBV_BUFFER_SIZE,
+            (amf_int64)CapToMaxFrameSize(m_maxFrameBytes, bitRateIn / frameRateIn * 1.1)
         );
 
-        amfEncoder->SetProperty(AMF_VIDEO_ENCODER_HEVC_MAX_NUM_REFRAMES, 0);
+        amfEncoder->SetProperty(AMF_VIDEO_ENCODER_HEVC_MAX_NUM_REFRAMES, temporalLayers - 1);
+        if (temporalLayers > 1) {
+            amfEncoder->SetProperty(AMF_VIDEO_ENCODER_HEVC_MAX_NUM_TEMPORAL_LAYERS, temporalLayers);
+            amfEncoder->SetProperty(AMF_VIDEO_ENCODER_HEVC_NUM_TEMPORAL_LAYERS, temporalLayers);
+        }
 
         if (m_hasQueryTimeout) {
             amfEncoder->SetProperty(AMF_VIDEO_ENCODER_HEVC_QUERY_TIMEOUT, 1000); // 1s timeout
@@ -577,10 +705,21 @@ amf::AMFComponentPtr VideoEncoderAMF::MakeEncoder(
         amfEncoder->SetProperty(AMF_VIDEO_ENCODER_AV1_GOP_SIZE, 0);
 
         amfEncoder->SetProperty(
-            AMF_VIDEO_ENCODER_AV1_VBV_BUFFER_SIZE, bitRateIn / frameRateIn * 1.2
+            AMF_VIDEO_ENCODER_AV1_VBV_BUFFER_SIZE,
+            (amf_int64)CapToMaxFrameSize(m_maxFrameBytes, bitRateIn / frameRateIn * 1.2)
         );
 
-        amfEncoder->SetProperty(AMF_VIDEO_ENCODER_AV1_MAX_NUM_REFRAMES, 0);
+        amfEncoder->SetProperty(AMF_VIDEO_ENCODER_AV1_MAX_NUM_REFRAMES, temporalLayers - 1);
+        if (temporalLayers > 1) {
+            amfEncoder->SetProperty(AMF_VIDEO_ENCODER_AV1_MAX_NUM_TEMPORAL_LAYERS, temporalLayers);
+            amfEncoder->SetProperty(AMF_VIDEO_ENCODER_AV1_NUM_TEMPORAL_LAYERS, temporalLayers);
+        }
+
+        // Only a hint of the total, AMF picks the layout. AMF has no HEVC tiles.
+        amfEncoder->SetProperty(
+            AMF_VIDEO_ENCODER_AV1_TILES_PER_FRAME,
+            (amf_int64)(Settings_Instance()->m_tileColumns * Settings_Instance()->m_tileRows)
+        );
 
         // AV1 assumed always has support for query timeout.
         m_hasQueryTimeout = true;
@@ -591,6 +730,27 @@ amf::AMFComponentPtr VideoEncoderAMF::MakeEncoder(
     }
     }
 
+    ApplyMaxFrameSize(amfEncoder, codec);
+
+    // Each slice is queried on its own once encoded, AV1 stays with whole frames
+    m_sliceOutput = false;
+    unsigned int slices = Settings_Instance()->m_slicesPerFrame;
+    if (slices > 1 && codec == ALVR_CODEC_H264) {
+        amfEncoder->SetProperty(AMF_VIDEO_ENCODER_SLICES_PER_FRAME, (amf_int64)slices);
+        AMF_RESULT res = amfEncoder->SetProperty(
+            AMF_VIDEO_ENCODER_OUTPUT_MODE, AMF_VIDEO_ENCODER_OUTPUT_MODE_SLICE
+        );
+        m_sliceOutput = res == AMF_OK;
+    } else if (slices > 1 && codec == ALVR_CODEC_HEVC) {
+        amfEncoder->SetProperty(AMF_VIDEO_ENCODER_HEVC_SLICES_PER_FRAME, (amf_int64)slices);
+        AMF_RESULT res = amfEncoder->SetProperty(
+            AMF_VIDEO_ENCODER_HEVC_OUTPUT_MODE, AMF_VIDEO_ENCODER_HEVC_OUTPUT_MODE_SLICE
+        );
+        m_sliceOutput = res == AMF_OK;
+    }
+    m_nextSliceFirst = true;
+    Debug("AMF slice output: %d\n", m_sliceOutput);
+
     Debug("Configured %s.\n", pCodec);
     AMF_THROW_IF(amfEncoder->Init(inputFormat, width, height));
 
@@ -600,7 +760,12 @@ amf::AMFComponentPtr VideoEncoderAMF::MakeEncoder(
 }
 
 amf::AMFComponentPtr VideoEncoderAMF::MakeConverter(
-    amf::AMF_SURFACE_FORMAT inputFormat, int width, int height, amf::AMF_SURFACE_FORMAT outputFormat
+    amf::AMF_SURFACE_FORMAT inputFormat,
+    int width,
+    int height,
+    amf::AMF_SURFACE_FORMAT outputFormat,
+    int outputWidth,
+    int outputHeight
 ) {
     amf::AMFComponentPtr amfConverter;
     AMF_THROW_IF(
@@ -610,7 +775,7 @@ amf::AMFComponentPtr VideoEncoderAMF::MakeConverter(
     AMF_THROW_IF(amfConverter->SetProperty(AMF_VIDEO_CONVERTER_MEMORY_TYPE, amf::AMF_MEMORY_DX11));
     AMF_THROW_IF(amfConverter->SetProperty(AMF_VIDEO_CONVERTER_OUTPUT_FORMAT, outputFormat));
     AMF_THROW_IF(amfConverter->SetProperty(
-        AMF_VIDEO_CONVERTER_OUTPUT_SIZE, ::AMFConstructSize(width, height)
+        AMF_VIDEO_CONVERTER_OUTPUT_SIZE, ::AMFConstructSize(outputWidth, outputHeight)
     ));
 
     AMF_THROW_IF(amfConverter->Init(inputFormat, width, height));
@@ -647,26 +812,54 @@ void VideoEncoderAMF::Initialize() {
     AMF_THROW_IF(g_AMFFactory.GetFactory()->CreateContext(&m_amfContext));
     AMF_THROW_IF(m_amfContext->InitDX11(m_d3dRender->GetDevice()));
 
+    // Macroblocks for H.264, 64x64 CTBs and superblocks for HEVC and AV1
+    if (FoveatedQpMap::Enabled()) {
+        m_qpMap = std::make_unique<FoveatedQpMap>(m_codec == ALVR_CODEC_H264 ? 16 : 64);
+    }
+
+    InitializePipeline();
+
+    Debug("Successfully initialized VideoEncoderAMF.\n");
+}
+
+void VideoEncoderAMF::InitializePipeline() {
     amf::AMF_SURFACE_FORMAT inFormat = m_surfaceFormat;
-    if (Settings_Instance()->m_enableHdr) {
-        // Bypass preprocessor and converters for HDR, since it will already be YUV
+    if (Settings_Instance()->m_convertToYuv) {
+        // Bypass preprocessor and converters, the frames are already YUV
         ;
     } else if (m_use10bit) {
         inFormat = amf::AMF_SURFACE_R10G10B10A2;
-        m_amfComponents.emplace_back(
-            MakeConverter(m_surfaceFormat, m_renderWidth, m_renderHeight, inFormat)
-        );
+        m_amfComponents.emplace_back(MakeConverter(
+            m_surfaceFormat, m_renderWidth, m_renderHeight, inFormat, m_encodeWidth, m_encodeHeight
+        ));
     } else {
         if (Settings_Instance()->m_useAmfPreproc) {
             inFormat = amf::AMF_SURFACE_NV12;
-            m_amfComponents.emplace_back(
-                MakeConverter(m_surfaceFormat, m_renderWidth, m_renderHeight, inFormat)
-            );
-            m_amfComponents.emplace_back(MakePreprocessor(inFormat, m_renderWidth, m_renderHeight));
+            m_amfComponents.emplace_back(MakeConverter(
+                m_surfaceFormat,
+                m_renderWidth,
+                m_renderHeight,
+                inFormat,
+                m_encodeWidth,
+                m_encodeHeight
+            ));
+            m_amfComponents.emplace_back(MakePreprocessor(inFormat, m_encodeWidth, m_encodeHeight));
         }
     }
+    // The first converter also scales, otherwise a scaling-only one is needed
+    bool scaled = m_encodeWidth != m_renderWidth || m_encodeHeight != m_renderHeight;
+    if (scaled && m_amfComponents.empty()) {
+        m_amfComponents.emplace_back(MakeConverter(
+            m_surfaceFormat,
+            m_renderWidth,
+            m_renderHeight,
+            m_surfaceFormat,
+            m_encodeWidth,
+            m_encodeHeight
+        ));
+    }
     m_amfComponents.emplace_back(MakeEncoder(
-        inFormat, m_renderWidth, m_renderHeight, m_codec, m_refreshRate, m_bitrateInMBits
+        inFormat, m_encodeWidth, m_encodeHeight, m_codec, m_refreshRate, m_bitrateInMBits
     ));
 
     m_pipeline = new AMFPipeline();
@@ -677,40 +870,58 @@ void VideoEncoderAMF::Initialize() {
     m_pipeline->Connect(new AMFPipe(
         m_amfComponents.back(), std::bind(&VideoEncoderAMF::Receive, this, std::placeholders::_1)
     ));
-
-    Debug("Successfully initialized VideoEncoderAMF.\n");
+    m_pipeline->Start(m_hasQueryTimeout);
 }
 
-void VideoEncoderAMF::Shutdown() {
-    Debug("Shutting down VideoEncoderAMF.\n");
-
+void VideoEncoderAMF::ShutdownPipeline() {
     delete m_pipeline;
+    m_pipeline = nullptr;
 
     for (auto& component : m_amfComponents) {
         component->Terminate();
     }
     m_amfComponents.clear();
+}
+
+void VideoEncoderAMF::Shutdown() {
+    Debug("Shutting down VideoEncoderAMF.\n");
+
+    ShutdownPipeline();
+    // The lent buffers are released into the context
+    m_lentBuffers.WaitForReturns();
 
     m_amfContext->Terminate();
     m_amfContext = NULL;
 
     g_AMFFactory.Terminate();
 
-    if (fpOut) {
-        fpOut.close();
-    }
     Debug("Successfully shutdown VideoEncoderAMF.\n");
 }
 
 void VideoEncoderAMF::Transmit(
     ID3D11Texture2D* pTexture, uint64_t presentationTime, uint64_t targetTimestampNs, bool insertIDR
 ) {
+    ALVR_PROFILE_ZONE("VideoEncoderAMF::Transmit");
     amf::AMFSurfacePtr surface;
-    // Surface is cached by AMF.
+    // Wraps pTexture, or comes from the surface pool of AMF
 
-    auto params = GetDynamicEncoderParams();
+    auto params = PollDynamicParams();
     if (params.updated) {
+        int width = ScaleEncodingSize(m_renderWidth, params.resolution_scale);
+        int height = ScaleEncodingSize(m_renderHeight, params.resolution_scale);
+        if (width != m_encodeWidth || height != m_encodeHeight) {
+            Info("Changing AMF encoding resolution to %dx%d\n", width, height);
+            // The encoder frame size is fixed at Init(), so the whole chain is rebuilt. The new
+            // encoder starts with an IDR frame carrying the new parameter sets
+            ShutdownPipeline();
+            m_encodeWidth = width;
+            m_encodeHeight = height;
+            InitializePipeline();
+            insertIDR = true;
+        }
+
         amf_int64 bitRateIn = params.bitrate_bps / params.framerate * m_refreshRate; // in bps
+        m_maxFrameBytes = params.max_frame_bytes;
 
         const amf_int64 maxRate = 1'000'000'000;
         if (bitRateIn > maxRate) {
@@ -722,43 +933,88 @@ void VideoEncoderAMF::Transmit(
             bitRateIn = maxRate;
         }
 
+        amf::AMFComponentPtr encoder = m_amfComponents.back();
         if (m_codec == ALVR_CODEC_H264) {
-            m_amfComponents.back()->SetProperty(AMF_VIDEO_ENCODER_TARGET_BITRATE, bitRateIn);
-            m_amfComponents.back()->SetProperty(AMF_VIDEO_ENCODER_PEAK_BITRATE, bitRateIn);
-            m_amfComponents.back()->SetProperty(
-                AMF_VIDEO_ENCODER_VBV_BUFFER_SIZE, bitRateIn / m_refreshRate * 1.1
+            encoder->SetProperty(AMF_VIDEO_ENCODER_TARGET_BITRATE, bitRateIn);
+            encoder->SetProperty(AMF_VIDEO_ENCODER_PEAK_BITRATE, bitRateIn);
+            encoder->SetProperty(
+                AMF_VIDEO_ENCODER_VBV_BUFFER_SIZE,
+                (amf_int64)CapToMaxFrameSize(m_maxFrameBytes, bitRateIn / m_refreshRate * 1.1)
+            );
+        } else if (m_codec == ALVR_CODEC_HEVC) {
+            encoder->SetProperty(AMF_VIDEO_ENCODER_HEVC_TARGET_BITRATE, bitRateIn);
+            encoder->SetProperty(AMF_VIDEO_ENCODER_HEVC_PEAK_BITRATE, bitRateIn);
+            encoder->SetProperty(
+                AMF_VIDEO_ENCODER_HEVC_VBV_BUFFER_SIZE,
+                (amf_int64)CapToMaxFrameSize(m_maxFrameBytes, bitRateIn / m_refreshRate * 1.1)
             );
         } else {
-            m_amfComponents.back()->SetProperty(AMF_VIDEO_ENCODER_HEVC_TARGET_BITRATE, bitRateIn);
-            m_amfComponents.back()->SetProperty(AMF_VIDEO_ENCODER_HEVC_PEAK_BITRATE, bitRateIn);
-            m_amfComponents.back()->SetProperty(
-                AMF_VIDEO_ENCODER_HEVC_VBV_BUFFER_SIZE, bitRateIn / m_refreshRate * 1.1
+            encoder->SetProperty(AMF_VIDEO_ENCODER_AV1_TARGET_BITRATE, bitRateIn);
+            encoder->SetProperty(AMF_VIDEO_ENCODER_AV1_PEAK_BITRATE, bitRateIn);
+            encoder->SetProperty(
+                AMF_VIDEO_ENCODER_AV1_VBV_BUFFER_SIZE,
+                (amf_int64)CapToMaxFrameSize(m_maxFrameBytes, bitRateIn / m_refreshRate * 1.2)
             );
         }
+        ApplyMaxFrameSize(encoder, m_codec);
 
         if (Settings_Instance()->m_amdBitrateCorruptionFix) {
             RequestIDR();
         }
     }
 
-    AMF_THROW_IF(m_amfContext->AllocSurface(
-        amf::AMF_MEMORY_DX11, m_surfaceFormat, m_renderWidth, m_renderHeight, &surface
-    ));
-    ID3D11Texture2D* textureDX11 = (ID3D11Texture2D*)surface->GetPlaneAt(0)->GetNative(
-    ); // no reference counting - do not Release()
-    m_d3dRender->GetContext()->CopyResource(textureDX11, pTexture);
+    if (m_wrapInputs) {
+        AMF_RESULT res
+            = m_amfContext->CreateSurfaceFromDX11Native(pTexture, &surface, &m_inputObserver);
+        if (res == AMF_OK) {
+            m_inputObserver.Acquire();
+            if (surface->GetFormat() != m_surfaceFormat) {
+                res = AMF_INVALID_FORMAT;
+                surface = nullptr;
+            }
+        }
+        if (res != AMF_OK) {
+            Warn("AMF can't encode the frames in place, copying them. Error %d", res);
+            m_wrapInputs = false;
+        }
+    }
+    if (!surface) {
+        AMF_THROW_IF(m_amfContext->AllocSurface(
+            amf::AMF_MEMORY_DX11, m_surfaceFormat, m_renderWidth, m_renderHeight, &surface
+        ));
+        ID3D11Texture2D* textureDX11 = (ID3D11Texture2D*)surface->GetPlaneAt(0)->GetNative(
+        ); // no reference counting - do not Release()
+        // Counted once per texture of the pool of the context
+        TrackTextureMemory(textureDX11, "AMF input");
+        m_d3dRender->GetContext()->CopyResource(textureDX11, pTexture);
+    }
 
     amf_pts start_time = amf_high_precision_clock();
     surface->SetProperty(START_TIME_PROPERTY, start_time);
     surface->SetProperty(FRAME_INDEX_PROPERTY, targetTimestampNs);
 
-    ApplyFrameProperties(surface, insertIDR);
+    ApplyFrameProperties(surface, targetTimestampNs, insertIDR);
 
+    // The outputs are received by the pipe threads, Transmit doesn't wait for the bitstream
     m_amfComponents.front()->SubmitInput(surface);
-    m_pipeline->Run(m_hasQueryTimeout);
+    m_pipeline->NotifyInput();
+
+    // CEncoder reuses the texture of the previous frame once this returns
+    surface = nullptr;
+    if (!m_inputObserver.WaitForRelease(1, INPUT_RELEASE_TIMEOUT_MS)) {
+        Warn("AMF holds the input frames for too long, copying them instead");
+        m_wrapInputs = false;
+    }
+}
+
+namespace {
+struct LentAmfBuffer {
+    amf::AMFBufferPtr buffer;
+    LentBufferCount* count;
+};
 }
 
-void VideoEncoderAMF::Receive(AMFDataPtr data) {
+bool VideoEncoderAMF::Receive(AMFDataPtr data) {
     amf_pts current_time = amf_high_precision_clock();
     amf_pts start_time = 0;
     uint64_t targetTimestampNs;
@@ -770,26 +1026,250 @@ void VideoEncoderAMF::Receive(AMFDataPtr data) {
     char* p = reinterpret_cast<char*>(buffer->GetNative());
     int length = static_cast<int>(buffer->GetSize());
 
-    if (fpOut) {
-        fpOut.write(p, length);
-    }
-
     uint64_t type;
     bool isIdr;
+    uint64_t bufferType = AMF_VIDEO_ENCODER_OUTPUT_BUFFER_TYPE_FRAME;
     if (m_codec == ALVR_CODEC_H264) {
         data->GetProperty(AMF_VIDEO_ENCODER_OUTPUT_DATA_TYPE, &type);
         isIdr = type == AMF_VIDEO_ENCODER_OUTPUT_DATA_TYPE_IDR;
-    } else {
+        if (m_sliceOutput) {
+            data->GetProperty(AMF_VIDEO_ENCODER_OUTPUT_BUFFER_TYPE, &bufferType);
+        }
+    } else if (m_codec == ALVR_CODEC_HEVC) {
         data->GetProperty(AMF_VIDEO_ENCODER_HEVC_OUTPUT_DATA_TYPE, &type);
         isIdr = type == AMF_VIDEO_ENCODER_HEVC_OUTPUT_DATA_TYPE_IDR;
+        if (m_sliceOutput) {
+            data->GetProperty(AMF_VIDEO_ENCODER_HEVC_OUTPUT_BUFFER_TYPE, &bufferType);
+        }
+    } else {
+        // AV1 frames are never split in slices
+        data->GetProperty(AMF_VIDEO_ENCODER_AV1_OUTPUT_FRAME_TYPE, &type);
+        isIdr = type == AMF_VIDEO_ENCODER_AV1_OUTPUT_FRAME_TYPE_KEY;
+    }
+
+    // Encode times are in AMF clock units of 100 ns
+    FfiEncodedFrameStats stats = {
+        targetTimestampNs, 0, -1.0f, FRAME_TYPE_UNKNOWN, uint64_t(current_time - start_time) * 100
+    };
+
+    // The H.264 and HEVC buffer type values are the same
+    if (bufferType != AMF_VIDEO_ENCODER_OUTPUT_BUFFER_TYPE_FRAME) {
+        bool firstSlice = m_nextSliceFirst;
+        bool lastSlice = bufferType == AMF_VIDEO_ENCODER_OUTPUT_BUFFER_TYPE_SLICE_LAST;
+        if (firstSlice) {
+            m_sliceFrameIsIdr = isIdr;
+            m_sliceFrameBytes = 0;
+        }
+        m_nextSliceFirst = lastSlice;
+        m_sliceFrameBytes += length;
+
+        // Copied by the slice gathering, the buffer is released on return
+        ParseFrameSliceNals(
+            m_codec,
+            reinterpret_cast<uint8_t*>(p),
+            length,
+            targetTimestampNs,
+            m_sliceFrameIsIdr,
+            firstSlice,
+            lastSlice
+        );
+        if (lastSlice) {
+            stats.sizeBytes = m_sliceFrameBytes;
+            ReadFrameStats(data, stats);
+            ReportEncodedFrameStats(stats);
+            g_encoderControl.ReportFrameSize(stats.sizeBytes);
+        }
+        return lastSlice;
+    }
+
+    stats.sizeBytes = length;
+    ReadFrameStats(data, stats);
+
+    // The buffer reference is held until the frame is sent, so the bitstream isn't copied
+    m_lentBuffers.Lend();
+    ParseFrameLentNals(
+        m_codec,
+        reinterpret_cast<uint8_t*>(p),
+        length,
+        targetTimestampNs,
+        isIdr,
+        [](void* userData) {
+            auto lent = static_cast<LentAmfBuffer*>(userData);
+            LentBufferCount* count = lent->count;
+            delete lent;
+            count->Return();
+        },
+        new LentAmfBuffer { buffer, &m_lentBuffers }
+    );
+    ReportEncodedFrameStats(stats);
+    g_encoderControl.ReportFrameSize(stats.sizeBytes);
+    return true;
+}
+
+void VideoEncoderAMF::ReadFrameStats(AMFDataPtr data, FfiEncodedFrameStats& stats) {
+    int64_t type;
+    int64_t qp;
+    switch (m_codec) {
+    case ALVR_CODEC_H264:
+        if (data->GetProperty(AMF_VIDEO_ENCODER_OUTPUT_DATA_TYPE, &type) == AMF_OK) {
+            switch (type) {
+            case AMF_VIDEO_ENCODER_OUTPUT_DATA_TYPE_IDR:
+                stats.frameType = FRAME_TYPE_IDR;
+                break;
+            case AMF_VIDEO_ENCODER_OUTPUT_DATA_TYPE_I:
+                stats.frameType = FRAME_TYPE_INTRA;
+                break;
+            case AMF_VIDEO_ENCODER_OUTPUT_DATA_TYPE_P:
+                stats.frameType = FRAME_TYPE_PREDICTED;
+                break;
+            case AMF_VIDEO_ENCODER_OUTPUT_DATA_TYPE_B:
+                stats.frameType = FRAME_TYPE_BIDIRECTIONAL;
+                break;
+            }
+        }
+        if (data->GetProperty(AMF_VIDEO_ENCODER_STATISTIC_AVERAGE_QP, &qp) == AMF_OK) {
+            stats.averageQp = (float)qp;
+        }
+        break;
+    case ALVR_CODEC_HEVC:
+        if (data->GetProperty(AMF_VIDEO_ENCODER_HEVC_OUTPUT_DATA_TYPE, &type) == AMF_OK) {
+            switch (type) {
+            case AMF_VIDEO_ENCODER_HEVC_OUTPUT_DATA_TYPE_IDR:
+                stats.frameType = FRAME_TYPE_IDR;
+                break;
+            case AMF_VIDEO_ENCODER_HEVC_OUTPUT_DATA_TYPE_I:
+                stats.frameType = FRAME_TYPE_INTRA;
+                break;
+            case AMF_VIDEO_ENCODER_HEVC_OUTPUT_DATA_TYPE_P:
+                stats.frameType = FRAME_TYPE_PREDICTED;
+                break;
+            }
+        }
+        if (data->GetProperty(AMF_VIDEO_ENCODER_HEVC_STATISTIC_AVERAGE_QP, &qp) == AMF_OK) {
+            stats.averageQp = (float)qp;
+        }
+        break;
+    case ALVR_CODEC_AV1:
+        if (data->GetProperty(AMF_VIDEO_ENCODER_AV1_OUTPUT_FRAME_TYPE, &type) == AMF_OK) {
+            switch (type) {
+            case AMF_VIDEO_ENCODER_AV1_OUTPUT_FRAME_TYPE_KEY:
+                stats.frameType = FRAME_TYPE_IDR;
+                break;
+            case AMF_VIDEO_ENCODER_AV1_OUTPUT_FRAME_TYPE_INTRA_ONLY:
+                stats.frameType = FRAME_TYPE_INTRA;
+                break;
+            case AMF_VIDEO_ENCODER_AV1_OUTPUT_FRAME_TYPE_INTER:
+            case AMF_VIDEO_ENCODER_AV1_OUTPUT_FRAME_TYPE_SWITCH:
+                stats.frameType = FRAME_TYPE_PREDICTED;
+                break;
+            }
+        }
+        // In q index units, from 0 to 255
+        if (data->GetProperty(AMF_VIDEO_ENCODER_AV1_STATISTIC_AVERAGE_Q_INDEX, &qp) == AMF_OK) {
+            stats.averageQp = (float)qp;
+        }
+        break;
     }
+    // The target QP is in the range of H.264 and HEVC
+    if (m_qpMap && m_codec != ALVR_CODEC_AV1) {
+        m_qpMap->ReportQp(stats.averageQp);
+    }
+}
 
-    ParseFrameNals(m_codec, reinterpret_cast<uint8_t*>(p), length, targetTimestampNs, isIdr);
+EncoderCapabilities VideoEncoderAMF::GetCapabilities() {
+    EncoderCapabilities capabilities = VideoEncoder::GetCapabilities();
+    capabilities.intraRefreshMode = m_intraRefreshMode;
+    capabilities.refInvalidation = m_useLtr;
+    capabilities.slices = m_sliceOutput;
+    capabilities.qpMaps = m_qpMap != nullptr;
+    capabilities.async = true;
+    return capabilities;
 }
 
-void VideoEncoderAMF::ApplyFrameProperties(const amf::AMFSurfacePtr& surface, bool insertIDR) {
+bool VideoEncoderAMF::InvalidateRefFrames(uint64_t lastReceivedTimestampNs) {
+    int slot = -1;
+    for (int i = 0; i < LTR_SLOTS; i++) {
+        uint64_t timestampNs = m_ltrTimestamps[i];
+        if (timestampNs != 0 && timestampNs <= lastReceivedTimestampNs
+            && (slot == -1 || timestampNs > m_ltrTimestamps[slot])) {
+            slot = i;
+        }
+    }
+    if (slot == -1) {
+        return false;
+    }
+    Debug("AMF: predicting from the long term reference at %llu\n", m_ltrTimestamps[slot]);
+    m_forcedLtrSlot = slot;
+    return true;
+}
+
+void VideoEncoderAMF::ApplyMaxFrameSize(const amf::AMFComponentPtr& encoder, int codec) {
+    // In bits, 0 lifts the limit
+    amf_int64 maxBits = m_maxFrameBytes * 8;
+    switch (codec) {
+    case ALVR_CODEC_H264:
+        encoder->SetProperty(AMF_VIDEO_ENCODER_MAX_AU_SIZE, maxBits);
+        break;
+    case ALVR_CODEC_HEVC:
+        encoder->SetProperty(AMF_VIDEO_ENCODER_HEVC_MAX_AU_SIZE, maxBits);
+        break;
+    case ALVR_CODEC_AV1:
+        encoder->SetProperty(AMF_VIDEO_ENCODER_AV1_MAX_COMPRESSED_FRAME_SIZE, maxBits);
+        break;
+    }
+}
+
+void VideoEncoderAMF::ApplyLtrProperties(
+    const amf::AMFSurfacePtr& surface, uint64_t targetTimestampNs, bool insertIDR
+) {
+    const wchar_t* markProperty = m_codec == ALVR_CODEC_H264
+        ? AMF_VIDEO_ENCODER_MARK_CURRENT_WITH_LTR_INDEX
+        : AMF_VIDEO_ENCODER_HEVC_MARK_CURRENT_WITH_LTR_INDEX;
+    const wchar_t* forceProperty = m_codec == ALVR_CODEC_H264
+        ? AMF_VIDEO_ENCODER_FORCE_LTR_REFERENCE_BITFIELD
+        : AMF_VIDEO_ENCODER_HEVC_FORCE_LTR_REFERENCE_BITFIELD;
+
+    if (insertIDR) {
+        // The IDR frame drops all references, it becomes the first long term reference
+        std::fill(std::begin(m_ltrTimestamps), std::end(m_ltrTimestamps), 0);
+        m_forcedLtrSlot = -1;
+        m_ltrFrameCount = 0;
+    }
+
+    bool forced = m_forcedLtrSlot != -1;
+    if (forced) {
+        surface->SetProperty(forceProperty, 1 << m_forcedLtrSlot);
+        // Newer references were predicted from lost frames
+        for (int i = 0; i < LTR_SLOTS; i++) {
+            if (m_ltrTimestamps[i] > m_ltrTimestamps[m_forcedLtrSlot]) {
+                m_ltrTimestamps[i] = 0;
+            }
+        }
+        m_forcedLtrSlot = -1;
+    } else if (m_ltrFrameCount % LTR_INTERVAL == 0) {
+        // The oldest slot is replaced
+        int slot = 0;
+        for (int i = 1; i < LTR_SLOTS; i++) {
+            if (m_ltrTimestamps[i] < m_ltrTimestamps[slot]) {
+                slot = i;
+            }
+        }
+        surface->SetProperty(markProperty, slot);
+        m_ltrTimestamps[slot] = targetTimestampNs;
+    }
+    m_ltrFrameCount++;
+}
+
+void VideoEncoderAMF::ApplyFrameProperties(
+    const amf::AMFSurfacePtr& surface, uint64_t targetTimestampNs, bool insertIDR
+) {
+    if (m_useLtr) {
+        ApplyLtrProperties(surface, targetTimestampNs, insertIDR);
+    }
+
     switch (m_codec) {
     case ALVR_CODEC_H264:
+        surface->SetProperty(AMF_VIDEO_ENCODER_STATISTICS_FEEDBACK, true);
         // FIXME: This option doesn't work in drivers 22.3.1 - 22.5.1, but works in 22.10.3
         surface->SetProperty(AMF_VIDEO_ENCODER_INSERT_AUD, false);
         if (insertIDR) {
@@ -802,6 +1282,7 @@ void VideoEncoderAMF::ApplyFrameProperties(const amf::AMFSurfacePtr& surface, bo
         }
         break;
     case ALVR_CODEC_HEVC:
+        surface->SetProperty(AMF_VIDEO_ENCODER_HEVC_STATISTICS_FEEDBACK, true);
         // FIXME: This option works with 22.10.3, but may not work with older drivers
         surface->SetProperty(AMF_VIDEO_ENCODER_HEVC_INSERT_AUD, false);
         if (insertIDR) {
@@ -816,6 +1297,7 @@ void VideoEncoderAMF::ApplyFrameProperties(const amf::AMFSurfacePtr& surface, bo
         }
         break;
     case ALVR_CODEC_AV1:
+        surface->SetProperty(AMF_VIDEO_ENCODER_AV1_STATISTICS_FEEDBACK, true);
         if (insertIDR) {
             Debug("Inserting IDR frame for AV1.\n");
             surface->SetProperty(AMF_VIDEO_ENCODER_AV1_FORCE_INSERT_SEQUENCE_HEADER, true);
@@ -827,4 +1309,51 @@ void VideoEncoderAMF::ApplyFrameProperties(const amf::AMFSurfacePtr& surface, bo
     default:
         throw MakeException("Invalid video codec");
     }
+
+    if (m_qpMap
+        && m_qpMap->Update(m_foveationCenter, m_encodeWidth, m_encodeHeight, m_staticBlocks)) {
+        UpdateRoiSurface();
+    }
+    if (m_roiSurface) {
+        const wchar_t* roiProperty = AMF_VIDEO_ENCODER_AV1_ROI_DATA;
+        if (m_codec == ALVR_CODEC_H264) {
+            roiProperty = AMF_VIDEO_ENCODER_ROI_DATA;
+        } else if (m_codec == ALVR_CODEC_HEVC) {
+            roiProperty = AMF_VIDEO_ENCODER_HEVC_ROI_DATA;
+        }
+        surface->SetProperty(roiProperty, m_roiSurface);
+    }
+}
+
+void VideoEncoderAMF::UpdateRoiSurface() {
+    amf::AMFSurfacePtr roiSurface;
+    if (m_amfContext->AllocSurface(
+            amf::AMF_MEMORY_HOST,
+            amf::AMF_SURFACE_GRAY32,
+            m_qpMap->BlocksX(),
+            m_qpMap->BlocksY(),
+            &roiSurface
+        )
+        != AMF_OK) {
+        Warn("AMF: failed to allocate the ROI map, the periphery quality is not lowered");
+        m_qpMap.reset();
+        m_roiSurface = nullptr;
+        return;
+    }
+
+    amf::AMFPlanePtr plane = roiSurface->GetPlaneAt(0);
+    auto* levels = static_cast<amf_uint32*>(plane->GetNative());
+    int pitch = plane->GetHPitch() / sizeof(amf_uint32);
+    const std::vector<int8_t>& offsets = m_qpMap->GetOffsets();
+    // Relative to the limit, so that the importance follows the tuned offsets. The overlays get the
+    // most importance and the rest of the frame less, the static blocks may get the least.
+    int maxOffset = std::max(m_qpMap->OffsetLimit(), m_qpMap->StaticOffset());
+    int offsetRange = std::max(maxOffset + m_qpMap->OverlayOffset(), 1);
+    for (uint32_t y = 0; y < m_qpMap->BlocksY(); y++) {
+        for (uint32_t x = 0; x < m_qpMap->BlocksX(); x++) {
+            int offset = offsets[y * m_qpMap->BlocksX() + x];
+            levels[y * pitch + x] = (maxOffset - offset) * ROI_MAX_IMPORTANCE / offsetRange;
+        }
+    }
+    m_roiSurface = roiSurface;
 }
@@ -1,5 +1,6 @@
 #pragma once
 #include "VideoEncoder.h"
+#include "alvr_server/FoveatedQpMap.h"
 
 #include "../../shared/amf/public/common/AMFFactory.h"
 #include "../../shared/amf/public/common/AMFSTL.h"
@@ -9,32 +10,57 @@
 #include "../../shared/amf/public/include/components/VideoEncoderAV1.h"
 #include "../../shared/amf/public/include/components/VideoEncoderHEVC.h"
 #include "../../shared/amf/public/include/components/VideoEncoderVCE.h"
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 
 typedef amf::AMFData* AMFDataPtr;
-typedef std::function<void(AMFDataPtr)> AMFDataReceiver;
+// Returns false if the data is only a part of the output of the input, like an encoded slice
+typedef std::function<bool(AMFDataPtr)> AMFDataReceiver;
 
 class AMFPipeline;
 
+typedef class AMFPipe* AMFPipePtr;
+
+// Hands the outputs of a component to a receiver from its own thread, as soon as they are ready
 class AMFPipe {
 public:
     AMFPipe(amf::AMFComponentPtr src, AMFDataReceiver receiver);
     virtual ~AMFPipe();
 
-    void doPassthrough(bool hasQueryTimeout, uint32_t timerResolution);
+    // blockingQuery if QueryOutput of the source waits for the output with a query timeout,
+    // otherwise it is polled
+    void Start(bool blockingQuery, uint32_t timerResolution);
+    void Stop();
+    // Called after each input submitted to the source, which gets queried until the receiver has
+    // its whole output
+    void NotifyInput();
+    // Pipe notified after the whole output of each input passed to the receiver
+    void SetNext(AMFPipePtr next) { m_next = next; }
 
 protected:
+    void Run();
+
     amf::AMFComponentPtr m_amfComponentSrc;
     AMFDataReceiver m_receiver;
+    AMFPipePtr m_next = nullptr;
+
+    bool m_blockingQuery = false;
+    uint32_t m_timerResolution = 1;
+    std::thread m_thread;
+    std::mutex m_mutex;
+    std::condition_variable m_condition;
+    int m_pendingInputs = 0;
+    std::atomic_bool m_stopping { false };
 };
 
-typedef AMFPipe* AMFPipePtr;
-
 class AMFSolidPipe : public AMFPipe {
 public:
     AMFSolidPipe(amf::AMFComponentPtr src, amf::AMFComponentPtr dst);
 
 protected:
-    void Passthrough(AMFDataPtr);
+    bool Passthrough(AMFDataPtr);
 
     amf::AMFComponentPtr m_amfComponentDst;
 };
@@ -45,7 +71,11 @@ public:
     ~AMFPipeline();
 
     void Connect(AMFPipePtr pipe);
-    void Run(bool hasQueryTimeout);
+    // Starts the pipes once connected. Only the last component, the encoder, supports a query
+    // timeout.
+    void Start(bool hasQueryTimeout);
+    // Called after each input submitted to the first component
+    void NotifyInput();
 
 protected:
     uint32_t m_timerResolution;
@@ -55,6 +85,21 @@ protected:
 
 typedef AMFPipeline* AMFPipelinePtr;
 
+// Counts the surfaces wrapping our textures that AMF still holds
+class AMFInputObserver : public amf::AMFSurfaceObserver {
+public:
+    void AMF_STD_CALL OnSurfaceDataRelease(amf::AMFSurface* pSurface);
+
+    void Acquire();
+    // False if more than maxInUse surfaces are still held after the timeout
+    bool WaitForRelease(int maxInUse, uint32_t timeoutMs);
+
+private:
+    std::mutex m_mutex;
+    std::condition_variable m_condition;
+    int m_inUse = 0;
+};
+
 // Video encoder for AMD VCE and VCN.
 class VideoEncoderAMF : public VideoEncoder {
 public:
@@ -70,17 +115,31 @@ public:
         uint64_t targetTimestampNs,
         bool insertIDR
     );
-    void Receive(AMFDataPtr data);
+    bool Receive(AMFDataPtr data);
+
+    // A wrapped input is released at the latest by the next Transmit, it is async
+    EncoderCapabilities GetCapabilities();
+    // Predicts the next frame from the newest long term reference that the client received
+    bool InvalidateRefFrames(uint64_t lastReceivedTimestampNs);
 
 private:
     static const wchar_t* START_TIME_PROPERTY;
     static const wchar_t* FRAME_INDEX_PROPERTY;
+    static const uint32_t INPUT_RELEASE_TIMEOUT_MS = 1000;
+    // Long term references kept to fall back on after lost frames
+    static const int LTR_SLOTS = 2;
+    // Frames between long term references
+    static const int LTR_INTERVAL = 8;
+    // Levels of the ROI map, the center regions get the highest one
+    static const amf_uint32 ROI_MAX_IMPORTANCE = 10;
 
     amf::AMFComponentPtr MakeConverter(
         amf::AMF_SURFACE_FORMAT inputFormat,
         int width,
         int height,
-        amf::AMF_SURFACE_FORMAT outputFormat
+        amf::AMF_SURFACE_FORMAT outputFormat,
+        int outputWidth,
+        int outputHeight
     );
     amf::AMFComponentPtr
     MakePreprocessor(amf::AMF_SURFACE_FORMAT inputFormat, int width, int height);
@@ -92,25 +151,66 @@ private:
         int refreshRate,
         int bitrateInMbits
     );
+    // Builds the converter/preprocessor/encoder chain for the current encode size
+    void InitializePipeline();
+    // Frame type and statistics feedback of the output data of a frame, or its last slice
+    void ReadFrameStats(AMFDataPtr data, FfiEncodedFrameStats& stats);
+    void ShutdownPipeline();
+
     amf::AMFContextPtr m_amfContext;
     AMFPipelinePtr m_pipeline;
     std::vector<amf::AMFComponentPtr> m_amfComponents;
 
-    std::ofstream fpOut;
-
     std::shared_ptr<CD3DRender> m_d3dRender;
 
     bool m_use10bit;
     amf::AMF_SURFACE_FORMAT m_surfaceFormat;
 
+    // The CEncoder frame ring textures are wrapped into AMF surfaces and encoded in place. Cleared
+    // if AMF can't use them, then they are copied into surfaces of its own pool.
+    bool m_wrapInputs = true;
+    AMFInputObserver m_inputObserver;
+    LentBufferCount m_lentBuffers;
+
     int m_codec;
     int m_refreshRate;
     int m_renderWidth;
     int m_renderHeight;
+    int m_encodeWidth;
+    int m_encodeHeight;
     int m_bitrateInMBits;
+    // FfiDynamicEncoderParams::max_frame_bytes
+    uint64_t m_maxFrameBytes = 0;
 
     bool m_hasQueryTimeout;
+    // The encoder outputs each slice once encoded, set if it accepted the slice output mode
+    bool m_sliceOutput = false;
+    bool m_nextSliceFirst = true;
+    bool m_sliceFrameIsIdr = false;
+    uint32_t m_sliceFrameBytes = 0;
     bool m_hasPreAnalysis;
-
-    void ApplyFrameProperties(const amf::AMFSurfacePtr& surface, bool insertIDR);
+    // AV1 has no intra refresh with AMF
+    IntraRefreshMode m_intraRefreshMode = IntraRefreshMode::None;
+    // Long term references are used for H.264 and HEVC only
+    bool m_useLtr = false;
+    // Target timestamp of the frame in each long term reference slot, 0 if empty
+    uint64_t m_ltrTimestamps[LTR_SLOTS] = {};
+    uint64_t m_ltrFrameCount = 0;
+    // Slot the next frame must be predicted from, or -1
+    int m_forcedLtrSlot = -1;
+    // Periphery of the ROI map, per macroblock for H.264 and per 64x64 CTU for HEVC
+    std::unique_ptr<FoveatedQpMap> m_qpMap;
+    // Allocated again when the map changes, the encoder may still read the previous one
+    amf::AMFSurfacePtr m_roiSurface;
+
+    // Caps IDR and P frames to m_maxFrameBytes
+    void ApplyMaxFrameSize(const amf::AMFComponentPtr& encoder, int codec);
+    void ApplyLtrProperties(
+        const amf::AMFSurfacePtr& surface, uint64_t targetTimestampNs, bool insertIDR
+    );
+    void ApplyFrameProperties(
+        const amf::AMFSurfacePtr& surface, uint64_t targetTimestampNs, bool insertIDR
+    );
+    // Scales the QP offsets of m_qpMap to importance levels of a new ROI surface
+    void UpdateRoiSurface();
 };
@@ -1,7 +1,11 @@
 #include "VideoEncoderNVENC.h"
-#include "NvCodecUtils.h"
+#include "shared/nvenc/NvCodecUtils.h"
+#include <algorithm>
 
+#include "alvr_server/EncoderControl.h"
+#include "alvr_server/GpuMemory.h"
 #include "alvr_server/Logger.h"
+#include "alvr_server/Profiling.h"
 #include "alvr_server/Utils.h"
 #include "alvr_server/bindings.h"
 
@@ -9,23 +13,26 @@ VideoEncoderNVENC::VideoEncoderNVENC(std::shared_ptr<CD3DRender> pD3DRender, int
     : m_pD3DRender(pD3DRender)
     , m_codec(Settings_Instance()->m_codec)
     , m_refreshRate(Settings_Instance()->m_refreshRate)
+    , m_framerate(Settings_Instance()->m_refreshRate)
     , m_renderWidth(width)
     , m_renderHeight(height)
+    , m_encodeWidth(width)
+    , m_encodeHeight(height)
     , m_bitrateInMBits(30) { }
 
-VideoEncoderNVENC::~VideoEncoderNVENC() { }
+VideoEncoderNVENC::~VideoEncoderNVENC() { m_outputThread.Stop(); }
 
 void VideoEncoderNVENC::Initialize() {
     //
     // Initialize Encoder
     //
 
-    NV_ENC_BUFFER_FORMAT format
-        = Settings_Instance()->m_enableHdr ? NV_ENC_BUFFER_FORMAT_NV12 : NV_ENC_BUFFER_FORMAT_ABGR;
+    // With YUV frames NVENC skips its own color conversion
+    bool yuvInput = Settings_Instance()->m_convertToYuv;
+    NV_ENC_BUFFER_FORMAT format = yuvInput ? NV_ENC_BUFFER_FORMAT_NV12 : NV_ENC_BUFFER_FORMAT_ABGR;
 
     if (Settings_Instance()->m_use10bitEncoder) {
-        format = Settings_Instance()->m_enableHdr ? NV_ENC_BUFFER_FORMAT_YUV420_10BIT
-                                                  : NV_ENC_BUFFER_FORMAT_ABGR10;
+        format = yuvInput ? NV_ENC_BUFFER_FORMAT_YUV420_10BIT : NV_ENC_BUFFER_FORMAT_ABGR10;
     }
 
     Debug(
@@ -36,8 +43,13 @@ void VideoEncoderNVENC::Initialize() {
     );
 
     try {
+        // The extra buffer lets a frame be submitted while the previous one is retrieved
         m_NvNecoder = std::make_shared<NvEncoderD3D11>(
-            m_pD3DRender->GetDevice(), m_renderWidth, m_renderHeight, format, 0
+            m_pD3DRender->GetDevice(),
+            m_renderWidth,
+            m_renderHeight,
+            format,
+            IsCompactGpuMemory() ? 0 : 1
         );
     } catch (NVENCException e) {
         throw MakeException(
@@ -45,6 +57,23 @@ void VideoEncoderNVENC::Initialize() {
         );
     }
 
+    // AV1 frames are split in tiles, which are not read back separately
+    m_subFrameReadback = Settings_Instance()->m_slicesPerFrame > 1 && m_codec != ALVR_CODEC_AV1
+        && m_NvNecoder->GetCapabilityValue(
+            m_codec == ALVR_CODEC_H264 ? NV_ENC_CODEC_H264_GUID : NV_ENC_CODEC_HEVC_GUID,
+            NV_ENC_CAPS_SUPPORT_SUBFRAME_READBACK
+        );
+
+    if (FoveatedQpMap::Enabled() && m_codec != ALVR_CODEC_AV1) {
+        m_qpMap = std::make_unique<FoveatedQpMap>(m_codec == ALVR_CODEC_H264 ? 16 : 32);
+    }
+    // The hints are in raster order of the macroblocks, HEVC orders them by CTU. They would also
+    // be wrong in the compressed periphery of foveated encoding.
+    if (Settings_Instance()->m_nvencHeadMotionHints && m_codec == ALVR_CODEC_H264
+        && !Settings_Instance()->m_enableFoveatedEncoding) {
+        m_motionHints = std::make_unique<HeadMotionHints>(16);
+    }
+
     NV_ENC_INITIALIZE_PARAMS initializeParams = { NV_ENC_INITIALIZE_PARAMS_VER };
     NV_ENC_CONFIG encodeConfig = { NV_ENC_CONFIG_VER };
     initializeParams.encodeConfig = &encodeConfig;
@@ -67,352 +96,354 @@ void VideoEncoderNVENC::Initialize() {
         throw MakeException("NvEnc CreateEncoder failed. Code=%d %hs", e.getErrorCode(), e.what());
     }
 
-    Debug("CNvEncoder is successfully initialized.\n");
+    if (Settings_Instance()->m_nvencEnableIntraRefresh) {
+        m_intraRefreshMode = IntraRefreshMode::Continuous;
+    } else if (m_NvNecoder->GetCapabilityValue(
+                   initializeParams.encodeGUID, NV_ENC_CAPS_SUPPORT_INTRA_REFRESH
+               )) {
+        m_intraRefreshMode = IntraRefreshMode::OnDemand;
+    }
+
+    // Set by CreateDefaultEncoderParams when the GPU supports it. Frames read back slice by slice
+    // are retrieved by Transmit itself.
+    m_asyncEncode = initializeParams.enableEncodeAsync != 0 && !m_subFrameReadback;
+    if (m_asyncEncode) {
+        m_outputThread.Start([this](const PendingFrame& frame) { RetrieveFrame(frame); });
+    }
+
+#if NVENCAPI_MAJOR_VERSION == 12 && NVENCAPI_MINOR_VERSION == 0
+    if (Settings_Instance()->m_nvencSplitEncodeMode != 0) {
+        Warn("NVENC: split frame encoding needs a build with the API 12.1 headers, it is left to "
+             "the driver");
+    }
+#endif
+
+    Debug(
+        "CNvEncoder is successfully initialized. Async=%d SubFrameReadback=%d Engines=%d\n",
+        m_asyncEncode,
+        m_subFrameReadback,
+        m_NvNecoder->GetCapabilityValue(
+            initializeParams.encodeGUID, NV_ENC_CAPS_NUM_ENCODER_ENGINES
+        )
+    );
 }
 
 void VideoEncoderNVENC::Shutdown() {
     std::vector<std::vector<uint8_t>> vPacket;
+    m_outputThread.Stop();
+
     if (m_NvNecoder)
         m_NvNecoder->EndEncode(vPacket);
 
-    for (std::vector<uint8_t>& packet : vPacket) {
-        if (fpOut) {
-            fpOut.write(reinterpret_cast<char*>(packet.data()), packet.size());
-        }
-    }
+    UnregisterInputs();
+
     if (m_NvNecoder) {
         m_NvNecoder->DestroyEncoder();
         m_NvNecoder.reset();
     }
 
     Debug("CNvEncoder::Shutdown\n");
-
-    if (fpOut) {
-        fpOut.close();
-    }
 }
 
 void VideoEncoderNVENC::Transmit(
     ID3D11Texture2D* pTexture, uint64_t presentationTime, uint64_t targetTimestampNs, bool insertIDR
 ) {
-    auto params = GetDynamicEncoderParams();
+    ALVR_PROFILE_ZONE("VideoEncoderNVENC::Transmit");
+    auto params = PollDynamicParams();
     if (params.updated) {
         m_bitrateInMBits = params.bitrate_bps / 1'000'000;
-        NV_ENC_INITIALIZE_PARAMS initializeParams = { NV_ENC_INITIALIZE_PARAMS_VER };
-        NV_ENC_CONFIG encodeConfig = { NV_ENC_CONFIG_VER };
-        initializeParams.encodeConfig = &encodeConfig;
-        FillEncodeConfig(
-            initializeParams,
-            params.framerate,
-            m_renderWidth,
-            m_renderHeight,
-            m_bitrateInMBits * 1'000'000L
-        );
-        NV_ENC_RECONFIGURE_PARAMS reconfigureParams = { NV_ENC_RECONFIGURE_PARAMS_VER };
-        reconfigureParams.reInitEncodeParams = initializeParams;
-        m_NvNecoder->Reconfigure(&reconfigureParams);
+        m_framerate = params.framerate;
+        m_maxFrameBytes = params.max_frame_bytes;
+
+        int width = ScaleEncodingSize(m_renderWidth, params.resolution_scale);
+        int height = ScaleEncodingSize(m_renderHeight, params.resolution_scale);
+        bool resized = width != m_encodeWidth || height != m_encodeHeight;
+        if (resized) {
+            Info("NVENC: encoding resolution changed to %dx%d", width, height);
+            m_encodeWidth = width;
+            m_encodeHeight = height;
+            insertIDR = true;
+        }
+        Reconfigure(resized);
     }
 
-    std::vector<std::vector<uint8_t>> vPacket;
-
     const NvEncInputFrame* encoderInputFrame = m_NvNecoder->GetNextInputFrame();
 
     ID3D11Texture2D* pInputTexture
         = reinterpret_cast<ID3D11Texture2D*>(encoderInputFrame->inputPtr);
-    m_pD3DRender->GetContext()->CopyResource(pInputTexture, pTexture);
+    NV_ENC_REGISTERED_PTR registeredInput = nullptr;
+    if (m_encodeWidth == m_renderWidth && m_encodeHeight == m_renderHeight) {
+        registeredInput = GetRegisteredInput(pTexture);
+        if (!registeredInput) {
+            m_pD3DRender->GetContext()->CopyResource(pInputTexture, pTexture);
+        }
+    } else {
+        // The input textures keep the nominal size, NVENC reads the top left corner
+        try {
+            if (!m_scaler) {
+                m_scaler = std::make_unique<TextureScaler>(
+                    m_pD3DRender->GetDevice(), m_pD3DRender->GetContext()
+                );
+            }
+            m_scaler->Scale(pTexture, pInputTexture, m_encodeWidth, m_encodeHeight);
+        } catch (Exception e) {
+            Warn("NVENC: dynamic resolution not available, %s", e.what());
+            m_encodeWidth = m_renderWidth;
+            m_encodeHeight = m_renderHeight;
+            insertIDR = true;
+            Reconfigure(true);
+            m_pD3DRender->GetContext()->CopyResource(pInputTexture, pTexture);
+        }
+    }
 
     NV_ENC_PIC_PARAMS picParams = {};
+    // Identifies the frame for InvalidateRefFrames
+    picParams.inputTimeStamp = targetTimestampNs;
     if (insertIDR) {
         Debug("Inserting IDR frame.\n");
         picParams.encodePicFlags = NV_ENC_PIC_FLAG_FORCEIDR;
-    }
-    m_NvNecoder->EncodeFrame(vPacket, &picParams);
-
-    for (std::vector<uint8_t>& packet : vPacket) {
-        uint8_t* buf = packet.data();
-        int len = (int)packet.size();
-
-        // NVENC's AV1 encoding includes a bunch of IVF wrapping,
-        // so we need to strip it down to just the OBUs
-        if (m_codec == ALVR_CODEC_AV1) {
-            const uint8_t ivf_magic[4] = { 0x44, 0x4B, 0x49, 0x46 };
-            if (len >= 4 && !memcmp(buf, ivf_magic, 4)) {
-                buf += 32;
-                len -= 32;
-            }
-            if (len <= 12) {
-                continue;
-            }
-            buf += 12; // skip past the IVF packet size header thing
-            len -= 12;
-        }
-
-        if (len <= 0) {
-            continue;
-        }
-
-        if (fpOut) {
-            fpOut.write(reinterpret_cast<char*>(buf), len);
+        m_encodedTimestamps.clear();
+    } else if (m_startIntraRefresh) {
+        Debug("Starting intra refresh.\n");
+        uint32_t frames = Settings_Instance()->m_intraRefreshRecoveryFrames;
+        switch (m_codec) {
+        case ALVR_CODEC_H264:
+            picParams.codecPicParams.h264PicParams.forceIntraRefreshWithFrameCnt = frames;
+            break;
+        case ALVR_CODEC_HEVC:
+            picParams.codecPicParams.hevcPicParams.forceIntraRefreshWithFrameCnt = frames;
+            break;
+        case ALVR_CODEC_AV1:
+            picParams.codecPicParams.av1PicParams.forceIntraRefreshWithFrameCnt = frames;
+            break;
         }
-
-        ParseFrameNals(m_codec, buf, len, targetTimestampNs, insertIDR);
     }
-}
-
-void VideoEncoderNVENC::FillEncodeConfig(
-    NV_ENC_INITIALIZE_PARAMS& initializeParams,
-    int refreshRate,
-    int renderWidth,
-    int renderHeight,
-    uint64_t bitrate_bps
-) {
-    auto& encodeConfig = *initializeParams.encodeConfig;
-
-    GUID encoderGUID;
-    switch (m_codec) {
-    case ALVR_CODEC_H264:
-        encoderGUID = NV_ENC_CODEC_H264_GUID;
-        break;
-    case ALVR_CODEC_HEVC:
-        encoderGUID = NV_ENC_CODEC_HEVC_GUID;
-        break;
-    case ALVR_CODEC_AV1:
-        encoderGUID = NV_ENC_CODEC_AV1_GUID;
-        break;
+    m_startIntraRefresh = false;
+    if (m_qpMap) {
+        // Read by NVENC when the frame is submitted
+        m_qpMap->Update(m_foveationCenter, m_encodeWidth, m_encodeHeight, m_staticBlocks);
+        picParams.qpDeltaMap = const_cast<int8_t*>(m_qpMap->GetOffsets().data());
+        picParams.qpDeltaMapSize = (uint32_t)m_qpMap->GetOffsets().size();
     }
-
-    GUID qualityPreset;
-    // See recommended NVENC settings for low-latency encoding.
-    // https://docs.nvidia.com/video-technologies/video-codec-sdk/nvenc-video-encoder-api-prog-guide/#recommended-nvenc-settings
-    switch (Settings_Instance()->m_nvencQualityPreset) {
-    case 7:
-        qualityPreset = NV_ENC_PRESET_P7_GUID;
-        break;
-    case 6:
-        qualityPreset = NV_ENC_PRESET_P6_GUID;
-        break;
-    case 5:
-        qualityPreset = NV_ENC_PRESET_P5_GUID;
-        break;
-    case 4:
-        qualityPreset = NV_ENC_PRESET_P4_GUID;
-        break;
-    case 3:
-        qualityPreset = NV_ENC_PRESET_P3_GUID;
-        break;
-    case 2:
-        qualityPreset = NV_ENC_PRESET_P2_GUID;
-        break;
-    case 1:
-    default:
-        qualityPreset = NV_ENC_PRESET_P1_GUID;
-        break;
-    }
-
-    NV_ENC_TUNING_INFO tuningPreset
-        = static_cast<NV_ENC_TUNING_INFO>(Settings_Instance()->m_nvencTuningPreset);
-
-    m_NvNecoder->CreateDefaultEncoderParams(
-        &initializeParams, encoderGUID, qualityPreset, tuningPreset
-    );
-
-    initializeParams.encodeWidth = initializeParams.darWidth = renderWidth;
-    initializeParams.encodeHeight = initializeParams.darHeight = renderHeight;
-    initializeParams.frameRateNum = refreshRate;
-    initializeParams.frameRateDen = 1;
-
-    if (Settings_Instance()->m_nvencRefreshRate != -1) {
-        initializeParams.frameRateNum = Settings_Instance()->m_nvencRefreshRate;
-    }
-
-    initializeParams.enableWeightedPrediction
-        = Settings_Instance()->m_nvencEnableWeightedPrediction;
-
-    // 16 is recommended when using reference frame invalidation. But it has caused bad visual
-    // quality. Now, use 0 (use default).
-    uint32_t maxNumRefFrames = 0;
-    uint32_t gopLength = NVENC_INFINITE_GOPLENGTH;
-
-    if (Settings_Instance()->m_nvencMaxNumRefFrames != -1) {
-        maxNumRefFrames = Settings_Instance()->m_nvencMaxNumRefFrames;
+    // Updated on every frame to track the orientation of the reference, unused by IDR frames
+    if (m_motionHints
+        && m_motionHints->Update(m_headOrientation, m_projections, m_encodeWidth, m_encodeHeight)
+        && !insertIDR) {
+        const std::vector<MotionVector>& vectors = m_motionHints->GetVectors();
+        m_meHints.resize(vectors.size());
+        for (size_t i = 0; i < vectors.size(); i++) {
+            NVENC_EXTERNAL_ME_HINT& hint = m_meHints[i];
+            hint = {};
+            hint.mvx = std::clamp<int>(vectors[i].x, -2048, 2047);
+            hint.mvy = std::clamp<int>(vectors[i].y, -512, 511);
+            hint.lastofPart = 1;
+            hint.lastOfMB = 1;
+        }
+        // Read by NVENC when the frame is submitted, like the QP map
+        picParams.meHintCountsPerBlock[0].numCandsPerBlk16x16 = 1;
+        picParams.meExternalHints = m_meHints.data();
     }
-    if (Settings_Instance()->m_nvencGopLength != -1) {
-        gopLength = Settings_Instance()->m_nvencGopLength;
+    uint64_t submitNs = GetSteadyTimeNs();
+    // The bitstream is parsed and sent while it is locked, without the IVF wrapping of AV1
+    auto onBitstream = [&](uint8_t* buf, uint32_t size) {
+        ParseFrameNals(m_codec, buf, (int)size, targetTimestampNs, insertIDR);
+        ReportFrameStats(targetTimestampNs, size, submitNs);
+    };
+    if (m_subFrameReadback) {
+        m_NvNecoder->SubmitFrameRaw(registeredInput, &picParams);
+        uint32_t frameBytes = 0;
+        m_NvNecoder->RetrieveFrameSlicesRaw(
+            [&](uint8_t* buf, uint32_t size, bool firstSlice, bool lastSlice) {
+                ParseFrameSliceNals(
+                    m_codec, buf, (int)size, targetTimestampNs, insertIDR, firstSlice, lastSlice
+                );
+                frameBytes += size;
+                if (lastSlice) {
+                    ReportFrameStats(targetTimestampNs, frameBytes, submitNs);
+                }
+            }
+        );
+    } else if (m_asyncEncode) {
+        m_NvNecoder->SubmitFrameRaw(registeredInput, &picParams);
+        m_outputThread.Push({ targetTimestampNs, insertIDR, submitNs });
+        // The previous frame is retrieved while this one is encoded. Its input is no longer read
+        // after that, which the async capability promises to CEncoder. Without the extra buffer
+        // the frame is retrieved before the next one is submitted.
+        m_outputThread.WaitForPending(IsCompactGpuMemory() ? 0 : 1);
+    } else if (registeredInput) {
+        m_NvNecoder->EncodeRegisteredFrameRaw(registeredInput, onBitstream, &picParams);
+    } else {
+        m_NvNecoder->EncodeFrameRaw(onBitstream, &picParams);
     }
 
-    switch (m_codec) {
-    case ALVR_CODEC_H264: {
-        auto& config = encodeConfig.encodeCodecConfig.h264Config;
-        config.repeatSPSPPS = 1;
-        config.enableIntraRefresh = Settings_Instance()->m_nvencEnableIntraRefresh;
-
-        if (Settings_Instance()->m_nvencIntraRefreshPeriod != -1) {
-            config.intraRefreshPeriod = Settings_Instance()->m_nvencIntraRefreshPeriod;
-        }
-        if (Settings_Instance()->m_nvencIntraRefreshCount != -1) {
-            config.intraRefreshCnt = Settings_Instance()->m_nvencIntraRefreshCount;
-        }
-
-        switch (Settings_Instance()->m_entropyCoding) {
-        case ALVR_CABAC:
-            config.entropyCodingMode = NV_ENC_H264_ENTROPY_CODING_MODE_CABAC;
-            break;
-        case ALVR_CAVLC:
-            config.entropyCodingMode = NV_ENC_H264_ENTROPY_CODING_MODE_CAVLC;
-            break;
-        }
-
-        config.maxNumRefFrames = maxNumRefFrames;
-        config.idrPeriod = gopLength;
-
-        if (Settings_Instance()->m_fillerData) {
-            config.enableFillerDataInsertion = Settings_Instance()->m_rateControlMode == ALVR_CBR;
-        }
-
-        config.h264VUIParameters.videoSignalTypePresentFlag = 1;
-        config.h264VUIParameters.videoFormat = NV_ENC_VUI_VIDEO_FORMAT_UNSPECIFIED;
-        config.h264VUIParameters.videoFullRangeFlag = 1;
-        config.h264VUIParameters.colourDescriptionPresentFlag = 1;
-        if (Settings_Instance()->m_enableHdr) {
-            config.h264VUIParameters.colourPrimaries = NV_ENC_VUI_COLOR_PRIMARIES_BT2020;
-            config.h264VUIParameters.transferCharacteristics
-                = NV_ENC_VUI_TRANSFER_CHARACTERISTIC_SRGB;
-            config.h264VUIParameters.colourMatrix = NV_ENC_VUI_MATRIX_COEFFS_BT2020_NCL;
-        } else {
-            config.h264VUIParameters.colourPrimaries = NV_ENC_VUI_COLOR_PRIMARIES_BT709;
-            config.h264VUIParameters.transferCharacteristics
-                = NV_ENC_VUI_TRANSFER_CHARACTERISTIC_SRGB;
-            config.h264VUIParameters.colourMatrix = NV_ENC_VUI_MATRIX_COEFFS_BT709;
-        }
-    } break;
-    case ALVR_CODEC_HEVC: {
-        auto& config = encodeConfig.encodeCodecConfig.hevcConfig;
-        config.repeatSPSPPS = 1;
-        config.enableIntraRefresh = Settings_Instance()->m_nvencEnableIntraRefresh;
-
-        if (Settings_Instance()->m_nvencIntraRefreshPeriod != -1) {
-            config.intraRefreshPeriod = Settings_Instance()->m_nvencIntraRefreshPeriod;
-        }
-        if (Settings_Instance()->m_nvencIntraRefreshCount != -1) {
-            config.intraRefreshCnt = Settings_Instance()->m_nvencIntraRefreshCount;
-        }
-
-        config.maxNumRefFramesInDPB = maxNumRefFrames;
-        config.idrPeriod = gopLength;
+    // Drops the oldest one once full
+    m_encodedTimestamps.push_back(targetTimestampNs);
+}
 
-        if (Settings_Instance()->m_use10bitEncoder) {
-            encodeConfig.encodeCodecConfig.hevcConfig.pixelBitDepthMinus8 = 2;
+NV_ENC_REGISTERED_PTR VideoEncoderNVENC::GetRegisteredInput(ID3D11Texture2D* pTexture) {
+    for (auto& input : m_registeredInputs) {
+        if (input.texture.Get() == pTexture) {
+            return input.resource;
         }
-
-        if (Settings_Instance()->m_fillerData) {
-            config.enableFillerDataInsertion = Settings_Instance()->m_rateControlMode == ALVR_CBR;
+    }
+    for (auto input : m_unregistrableInputs) {
+        if (input == pTexture) {
+            return nullptr;
         }
+    }
 
-        config.hevcVUIParameters.videoSignalTypePresentFlag = 1;
-        config.hevcVUIParameters.videoFormat = NV_ENC_VUI_VIDEO_FORMAT_UNSPECIFIED;
-        config.hevcVUIParameters.videoFullRangeFlag = 1;
-        config.hevcVUIParameters.colourDescriptionPresentFlag = 1;
-        if (Settings_Instance()->m_enableHdr) {
-            config.hevcVUIParameters.colourPrimaries = NV_ENC_VUI_COLOR_PRIMARIES_BT2020;
-            config.hevcVUIParameters.transferCharacteristics
-                = NV_ENC_VUI_TRANSFER_CHARACTERISTIC_SRGB;
-            config.hevcVUIParameters.colourMatrix = NV_ENC_VUI_MATRIX_COEFFS_BT2020_NCL;
-        } else {
-            config.hevcVUIParameters.colourPrimaries = NV_ENC_VUI_COLOR_PRIMARIES_BT709;
-            config.hevcVUIParameters.transferCharacteristics
-                = NV_ENC_VUI_TRANSFER_CHARACTERISTIC_SRGB;
-            config.hevcVUIParameters.colourMatrix = NV_ENC_VUI_MATRIX_COEFFS_BT709;
-        }
-    } break;
-    case ALVR_CODEC_AV1: {
-        auto& config = encodeConfig.encodeCodecConfig.av1Config;
-        config.repeatSeqHdr = 1;
-        config.enableIntraRefresh = Settings_Instance()->m_nvencEnableIntraRefresh;
-
-        if (Settings_Instance()->m_nvencIntraRefreshPeriod != -1) {
-            config.intraRefreshPeriod = Settings_Instance()->m_nvencIntraRefreshPeriod;
-        }
-        if (Settings_Instance()->m_nvencIntraRefreshCount != -1) {
-            config.intraRefreshCnt = Settings_Instance()->m_nvencIntraRefreshCount;
-        }
+    D3D11_TEXTURE2D_DESC desc;
+    pTexture->GetDesc(&desc);
+    D3D11_TEXTURE2D_DESC inputDesc;
+    reinterpret_cast<ID3D11Texture2D*>(m_NvNecoder->GetNextInputFrame()->inputPtr)
+        ->GetDesc(&inputDesc);
+    if (desc.Width != inputDesc.Width || desc.Height != inputDesc.Height
+        || desc.Format != inputDesc.Format) {
+        m_unregistrableInputs.push_back(pTexture);
+        return nullptr;
+    }
 
-        config.maxNumRefFramesInDPB = maxNumRefFrames;
-        config.idrPeriod = gopLength;
+    RegisteredInput input = { pTexture, nullptr };
+    try {
+        input.resource
+            = m_NvNecoder->RegisterExternalInput(pTexture, NV_ENC_INPUT_RESOURCE_TYPE_DIRECTX);
+    } catch (NVENCException e) {
+        Warn("NVENC: failed to register input texture. Code=%d %hs", e.getErrorCode(), e.what());
+        m_unregistrableInputs.push_back(pTexture);
+        return nullptr;
+    }
+    Debug("NVENC: registered input texture %p\n", pTexture);
+    m_registeredInputs.push_back(input);
+    return input.resource;
+}
 
-        if (Settings_Instance()->m_use10bitEncoder) {
-            config.pixelBitDepthMinus8 = 2;
+void VideoEncoderNVENC::UnregisterInputs() {
+    for (auto& input : m_registeredInputs) {
+        try {
+            m_NvNecoder->UnregisterExternalInput(input.resource);
+        } catch (NVENCException e) {
+            Warn(
+                "NVENC: failed to unregister input texture. Code=%d %hs", e.getErrorCode(), e.what()
+            );
         }
+    }
+    m_registeredInputs.clear();
+    m_unregistrableInputs.clear();
+}
 
-        if (Settings_Instance()->m_fillerData) {
-            config.enableBitstreamPadding = Settings_Instance()->m_rateControlMode == ALVR_CBR;
-        }
+void VideoEncoderNVENC::ReportFrameStats(
+    uint64_t targetTimestampNs, uint32_t sizeBytes, uint64_t submitNs
+) {
+    const NvEncoder::FrameStats& nvStats = m_NvNecoder->GetLastFrameStats();
+    FfiEncodedFrameStats stats = {};
+    stats.targetTimestampNs = targetTimestampNs;
+    stats.sizeBytes = sizeBytes;
+    stats.averageQp = (float)nvStats.averageQp;
+    stats.frameType = NvEncFrameType(nvStats.pictureType);
+    stats.encodeTimeNs = GetSteadyTimeNs() - submitNs;
+    ReportEncodedFrameStats(stats);
+    g_encoderControl.ReportFrameSize(stats.sizeBytes);
+    if (m_qpMap) {
+        m_qpMap->ReportQp(stats.averageQp);
+    }
+}
 
-        config.chromaFormatIDC = 1; // 4:2:0, 4:4:4 currently not supported
-        config.colorRange = 1;
-        if (Settings_Instance()->m_enableHdr) {
-            config.colorPrimaries = NV_ENC_VUI_COLOR_PRIMARIES_BT2020;
-            config.transferCharacteristics = NV_ENC_VUI_TRANSFER_CHARACTERISTIC_SRGB;
-            config.matrixCoefficients = NV_ENC_VUI_MATRIX_COEFFS_BT2020_NCL;
-        } else {
-            config.colorPrimaries = NV_ENC_VUI_COLOR_PRIMARIES_BT709;
-            config.transferCharacteristics = NV_ENC_VUI_TRANSFER_CHARACTERISTIC_SRGB;
-            config.matrixCoefficients = NV_ENC_VUI_MATRIX_COEFFS_BT709;
-        }
-    } break;
+void VideoEncoderNVENC::RetrieveFrame(const PendingFrame& frame) {
+    try {
+        m_NvNecoder->RetrieveFrameRaw([&](uint8_t* buf, uint32_t size) {
+            ParseFrameNals(m_codec, buf, (int)size, frame.targetTimestampNs, frame.insertIDR);
+            ReportFrameStats(frame.targetTimestampNs, size, frame.submitNs);
+        });
+    } catch (NVENCException e) {
+        Error("NVENC: failed to retrieve a frame. Code=%d %hs", e.getErrorCode(), e.what());
     }
+}
 
-    // Disable automatic IDR insertion by NVENC. We need to manually insert IDR when packet is
-    // dropped if don't use reference frame invalidation.
-    encodeConfig.gopLength = gopLength;
-    encodeConfig.frameIntervalP = 1;
+EncoderCapabilities VideoEncoderNVENC::GetCapabilities() {
+    EncoderCapabilities capabilities = VideoEncoder::GetCapabilities();
+    capabilities.intraRefreshMode = m_intraRefreshMode;
+    capabilities.refInvalidation = true;
+    capabilities.slices = m_subFrameReadback;
+    capabilities.qpMaps = m_qpMap != nullptr;
+    capabilities.async = m_asyncEncode;
+    return capabilities;
+}
 
-    if (Settings_Instance()->m_nvencPFrameStrategy != -1) {
-        encodeConfig.frameIntervalP = Settings_Instance()->m_nvencPFrameStrategy;
+bool VideoEncoderNVENC::InvalidateRefFrames(uint64_t lastReceivedTimestampNs) {
+    // No frame older than the history can still be referenced, invalidating all of them would
+    // only make NVENC encode an intra frame
+    if (m_encodedTimestamps.empty() || m_encodedTimestamps.front() > lastReceivedTimestampNs) {
+        return false;
     }
-
-    switch (Settings_Instance()->m_rateControlMode) {
-    case ALVR_CBR:
-        encodeConfig.rcParams.rateControlMode = NV_ENC_PARAMS_RC_CBR;
-        break;
-    case ALVR_VBR:
-        encodeConfig.rcParams.rateControlMode = NV_ENC_PARAMS_RC_VBR;
-        break;
+    try {
+        for (size_t i = 0; i < m_encodedTimestamps.size(); i++) {
+            if (m_encodedTimestamps[i] > lastReceivedTimestampNs) {
+                m_NvNecoder->InvalidateRefFrame(m_encodedTimestamps[i]);
+            }
+        }
+    } catch (NVENCException e) {
+        Warn(
+            "NVENC: failed to invalidate reference frames. Code=%d %hs", e.getErrorCode(), e.what()
+        );
+        return false;
     }
-    encodeConfig.rcParams.multiPass
-        = static_cast<NV_ENC_MULTI_PASS>(Settings_Instance()->m_nvencMultiPass);
-    encodeConfig.rcParams.lowDelayKeyFrameScale = 1;
+    Debug("NVENC: invalidated the frames after %llu\n", lastReceivedTimestampNs);
+    return true;
+}
 
-    if (Settings_Instance()->m_nvencLowDelayKeyFrameScale != -1) {
-        encodeConfig.rcParams.lowDelayKeyFrameScale
-            = Settings_Instance()->m_nvencLowDelayKeyFrameScale;
+void VideoEncoderNVENC::Reconfigure(bool resized) {
+    NV_ENC_INITIALIZE_PARAMS initializeParams = { NV_ENC_INITIALIZE_PARAMS_VER };
+    NV_ENC_CONFIG encodeConfig = { NV_ENC_CONFIG_VER };
+    initializeParams.encodeConfig = &encodeConfig;
+    FillEncodeConfig(
+        initializeParams, m_framerate, m_encodeWidth, m_encodeHeight, m_bitrateInMBits * 1'000'000L
+    );
+    // The input buffers were allocated for the nominal size
+    initializeParams.maxEncodeWidth = m_renderWidth;
+    initializeParams.maxEncodeHeight = m_renderHeight;
+
+    NV_ENC_RECONFIGURE_PARAMS reconfigureParams = { NV_ENC_RECONFIGURE_PARAMS_VER };
+    reconfigureParams.reInitEncodeParams = initializeParams;
+    reconfigureParams.resetEncoder = resized;
+    reconfigureParams.forceIDR = resized;
+    if (m_asyncEncode) {
+        m_outputThread.WaitForPending(0);
     }
+    m_NvNecoder->Reconfigure(&reconfigureParams);
+}
 
-    uint32_t maxFrameSize = static_cast<uint32_t>(bitrate_bps / refreshRate);
-    Debug("VideoEncoderNVENC: maxFrameSize=%d bits\n", maxFrameSize);
-    encodeConfig.rcParams.vbvBufferSize = maxFrameSize * 1.1;
-    encodeConfig.rcParams.vbvInitialDelay = maxFrameSize * 1.1;
-    encodeConfig.rcParams.maxBitRate = static_cast<uint32_t>(bitrate_bps);
-    encodeConfig.rcParams.averageBitRate = static_cast<uint32_t>(bitrate_bps);
-    if (Settings_Instance()->m_nvencAdaptiveQuantizationMode == SpatialAQ) {
-        encodeConfig.rcParams.enableAQ = 1;
-    } else if (Settings_Instance()->m_nvencAdaptiveQuantizationMode == TemporalAQ) {
-        encodeConfig.rcParams.enableTemporalAQ = 1;
-    }
+void VideoEncoderNVENC::FillEncodeConfig(
+    NV_ENC_INITIALIZE_PARAMS& initializeParams,
+    int refreshRate,
+    int renderWidth,
+    int renderHeight,
+    uint64_t bitrate_bps
+) {
+    m_NvNecoder->CreateDefaultEncoderParams(
+        &initializeParams, NvEncCodecGuid(m_codec), NvEncPresetGuid(), NvEncTuningInfo()
+    );
 
-    if (Settings_Instance()->m_nvencRateControlMode != -1) {
-        encodeConfig.rcParams.rateControlMode
-            = (NV_ENC_PARAMS_RC_MODE)Settings_Instance()->m_nvencRateControlMode;
-    }
-    if (Settings_Instance()->m_nvencRcBufferSize != -1) {
-        encodeConfig.rcParams.vbvBufferSize = Settings_Instance()->m_nvencRcBufferSize;
-    }
-    if (Settings_Instance()->m_nvencRcInitialDelay != -1) {
-        encodeConfig.rcParams.vbvInitialDelay = Settings_Instance()->m_nvencRcInitialDelay;
-    }
-    if (Settings_Instance()->m_nvencRcMaxBitrate != -1) {
-        encodeConfig.rcParams.maxBitRate = Settings_Instance()->m_nvencRcMaxBitrate;
-    }
-    if (Settings_Instance()->m_nvencRcAverageBitrate != -1) {
-        encodeConfig.rcParams.averageBitRate = Settings_Instance()->m_nvencRcAverageBitrate;
+    NvEncConfigParams params = {};
+    params.codec = m_codec;
+    params.framerate = refreshRate;
+    params.width = renderWidth;
+    params.height = renderHeight;
+    params.bitrateBps = bitrate_bps;
+    params.maxFrameBytes = m_maxFrameBytes;
+    params.subFrameReadback = m_subFrameReadback;
+    params.motionHints = m_motionHints != nullptr;
+    params.qpMap = m_qpMap != nullptr;
+    // Only H.264 has temporal layers that NVENC lays out by itself
+    if (m_codec == ALVR_CODEC_H264
+        && m_NvNecoder->GetCapabilityValue(
+            NV_ENC_CODEC_H264_GUID, NV_ENC_CAPS_SUPPORT_TEMPORAL_SVC
+        )) {
+        params.temporalLayers = std::min(
+            (int)Settings_Instance()->m_temporalLayers,
+            m_NvNecoder->GetCapabilityValue(
+                NV_ENC_CODEC_H264_GUID, NV_ENC_CAPS_NUM_MAX_TEMPORAL_LAYERS
+            )
+        );
     }
+    FillNvEncConfig(initializeParams, params);
 }
@@ -1,11 +1,14 @@
 #pragma once
 
 #include "NvEncoderD3D11.h"
+#include "TextureScaler.h"
 #include "VideoEncoder.h"
+#include "alvr_server/FoveatedQpMap.h"
+#include "alvr_server/HeadMotionHints.h"
+#include "alvr_server/NvEncConfig.h"
 #include "shared/d3drender.h"
 #include <memory>
-
-enum AdaptiveQuantizationMode { SpatialAQ = 1, TemporalAQ = 2 };
+#include <vector>
 
 // Video encoder for NVIDIA NvEnc.
 class VideoEncoderNVENC : public VideoEncoder {
@@ -23,7 +26,16 @@ public:
         bool insertIDR
     );
 
+    EncoderCapabilities GetCapabilities();
+    void StartIntraRefresh() { m_startIntraRefresh = true; }
+    bool InvalidateRefFrames(uint64_t lastReceivedTimestampNs);
+
 private:
+    // Size of the largest DPB of NVENC
+    static const size_t MAX_REFERENCE_FRAMES = 16;
+
+    // Applies the current bitrate, framerate and encoding size
+    void Reconfigure(bool resized);
     void FillEncodeConfig(
         NV_ENC_INITIALIZE_PARAMS& initializeParams,
         int refreshRate,
@@ -32,14 +44,66 @@ private:
         uint64_t bitrate_bps
     );
 
-    std::ofstream fpOut;
+    // Returns the NVENC registration of a texture which has the input format and size, or null
+    NV_ENC_REGISTERED_PTR GetRegisteredInput(ID3D11Texture2D* pTexture);
+    void UnregisterInputs();
+
+    // Sends the statistics of the frame whose bitstream was just locked
+    void ReportFrameStats(uint64_t targetTimestampNs, uint32_t sizeBytes, uint64_t submitNs);
+
+    struct PendingFrame;
+    // Output of m_outputThread
+    void RetrieveFrame(const PendingFrame& frame);
+
     std::shared_ptr<NvEncoder> m_NvNecoder;
 
     std::shared_ptr<CD3DRender> m_pD3DRender;
 
+    // The CEncoder frame ring textures, encoded without copying them to the NVENC input buffers.
+    // The references keep the textures alive until they are unregistered.
+    struct RegisteredInput {
+        Microsoft::WRL::ComPtr<ID3D11Texture2D> texture;
+        NV_ENC_REGISTERED_PTR resource;
+    };
+    std::vector<RegisteredInput> m_registeredInputs;
+    // Input textures which can't be registered, so that it is not retried every frame
+    std::vector<ID3D11Texture2D*> m_unregistrableInputs;
+    // Only created for dynamic resolution changes
+    std::unique_ptr<TextureScaler> m_scaler;
+    // QP deltas of the periphery, per macroblock for H.264 and per 32x32 CTU for HEVC
+    std::unique_ptr<FoveatedQpMap> m_qpMap;
+    // Motion search hints of the head rotation, one per macroblock
+    std::unique_ptr<HeadMotionHints> m_motionHints;
+    std::vector<NVENC_EXTERNAL_ME_HINT> m_meHints;
+
     int m_codec;
     int m_refreshRate;
+    float m_framerate;
     int m_renderWidth;
     int m_renderHeight;
+    // Scaled down from the render size by FfiDynamicEncoderParams::resolution_scale
+    int m_encodeWidth;
+    int m_encodeHeight;
     int m_bitrateInMBits;
+    // FfiDynamicEncoderParams::max_frame_bytes
+    uint64_t m_maxFrameBytes = 0;
+
+    IntraRefreshMode m_intraRefreshMode = IntraRefreshMode::None;
+    bool m_startIntraRefresh = false;
+    // Target timestamps of the frames since the last IDR frame which may still be referenced
+    FixedRing<uint64_t, MAX_REFERENCE_FRAMES> m_encodedTimestamps;
+
+    // In async mode the bitstreams are locked and sent by m_outputThread, so that the retrieval of
+    // a frame overlaps the submission of the next one
+    struct PendingFrame {
+        uint64_t targetTimestampNs;
+        bool insertIDR;
+        // GetSteadyTimeNs when the frame was submitted
+        uint64_t submitNs;
+    };
+    bool m_asyncEncode = false;
+    // Multi slice frames are read back one slice at a time instead, in sync mode
+    bool m_subFrameReadback = false;
+    // At most two pending frames, see Transmit
+    EncoderOutputThread<PendingFrame, 4> m_outputThread;
 };
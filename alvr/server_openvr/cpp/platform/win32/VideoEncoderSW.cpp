@@ -1,18 +1,110 @@
 #ifdef ALVR_GPL
 
 #include "VideoEncoderSW.h"
+#include "GpuMemoryD3D11.h"
 
+#include "alvr_server/EncoderControl.h"
 #include "alvr_server/Logger.h"
+#include "alvr_server/NumaPlacement.h"
+#include "alvr_server/Profiling.h"
 #include "alvr_server/Utils.h"
 #include "alvr_server/bindings.h"
 
 #include <algorithm>
 #include <array>
 #include <iostream>
+#include <mutex>
 #include <string>
+#include <vector>
+
+using namespace d3d_render_utils;
+
+namespace {
+// Constant buffer of rgbtoyuv420.hlsl
+struct YUVParams {
+    float offset[4];
+    float yCoeff[4];
+    float uCoeff[4];
+    float vCoeff[4];
+
+    float renderWidth;
+    float renderHeight;
+    float _padding0;
+    float _padding1;
+};
+
+// BT.709 full range, to match the color properties of the codec context
+const YUVParams YUV_PARAMS_BT709_8BIT_FULL
+    = { { 0.0000000f, 0.5019608f, 0.5019608f, 0.0f }, // offset
+        { 0.2126000f, 0.7152000f, 0.0722000f, 0.0f }, // yCoeff
+        { -0.1141226f, -0.3839166f, 0.4980392f, 0.0f }, // uCoeff
+        { 0.4980392f, -0.4523722f, -0.0456670f, 0.0f }, // vCoeff
+        0.0,
+        0.0,
+        0.0,
+        0.0 };
+
+const YUVParams YUV_PARAMS_BT709_10BIT_FULL
+    = { { 0.0000000f, 0.5004888f, 0.5004888f, 0.0f }, // offset
+        { 0.2126000f, 0.7152000f, 0.0722000f, 0.0f }, // yCoeff
+        { -0.1144600f, -0.3850512f, 0.4995112f, 0.0f }, // uCoeff
+        { 0.4995112f, -0.4537094f, -0.0458018f, 0.0f }, // vCoeff
+        0.0,
+        0.0,
+        0.0,
+        0.0 };
+
+// Packets lent to the network path and given back once sent. Static since the release callback
+// has no encoder, and frames can still be in flight when the encoder is shut down.
+std::mutex packetPoolMutex;
+std::vector<AVPacket*> packetPool;
+LentBufferCount lentPackets;
+
+AVPacket* TakePacket() {
+    std::lock_guard<std::mutex> lock(packetPoolMutex);
+    if (packetPool.empty()) {
+        return av_packet_alloc();
+    }
+    AVPacket* packet = packetPool.back();
+    packetPool.pop_back();
+    return packet;
+}
+
+void ReturnPacket(void* userData) {
+    AVPacket* packet = static_cast<AVPacket*>(userData);
+    av_packet_unref(packet);
+    std::lock_guard<std::mutex> lock(packetPoolMutex);
+    packetPool.push_back(packet);
+    lentPackets.Return();
+}
+
+// QP and picture type that libx264 attaches to its packets
+void ReadQualityStats(const AVPacket* packet, FfiEncodedFrameStats& stats) {
+    size_t size = 0;
+    const uint8_t* data = av_packet_get_side_data(packet, AV_PKT_DATA_QUALITY_STATS, &size);
+    if (!data || size < 5) {
+        return;
+    }
+    stats.averageQp = (float)AV_RL32(data) / FF_QP2LAMBDA;
+    switch (data[4]) {
+    case AV_PICTURE_TYPE_I:
+        stats.frameType = (packet->flags & AV_PKT_FLAG_KEY) ? FRAME_TYPE_IDR : FRAME_TYPE_INTRA;
+        break;
+    case AV_PICTURE_TYPE_P:
+        stats.frameType = FRAME_TYPE_PREDICTED;
+        break;
+    case AV_PICTURE_TYPE_B:
+        stats.frameType = FRAME_TYPE_BIDIRECTIONAL;
+        break;
+    }
+}
+}
 
-VideoEncoderSW::VideoEncoderSW(std::shared_ptr<CD3DRender> d3dRender, int width, int height)
+VideoEncoderSW::VideoEncoderSW(
+    std::shared_ptr<CD3DRender> d3dRender, int width, int height, bool convertOnGpu
+)
     : m_d3dRender(d3dRender)
+    , m_convertOnGpu(convertOnGpu)
     , m_codec(ALVR_CODEC_H264)
     , m_refreshRate(Settings_Instance()->m_refreshRate)
     , m_renderWidth(width)
@@ -114,7 +206,11 @@ void VideoEncoderSW::Initialize() {
     m_codecContext->rc_max_rate = m_codecContext->bit_rate;
     m_codecContext->thread_count = settings->m_swThreadCount;
 
-    if ((err = avcodec_open2(m_codecContext, codec, &opt)))
+    // The threads of FFmpeg don't inherit the affinity on Windows, but the buffers x264 allocates
+    // and clears while it opens are still placed on the node
+    m_numaNode = SoftwareEncoderNumaNode();
+    RunOnNumaNode(m_numaNode, [&] { err = avcodec_open2(m_codecContext, codec, &opt); });
+    if (err)
         throw MakeException("Cannot open video encoder codec: %d", err);
 
     // Config transfer/encode frames
@@ -126,6 +222,7 @@ void VideoEncoderSW::Initialize() {
     m_encoderFrame->format = m_codecContext->pix_fmt;
     if ((err = av_frame_get_buffer(m_encoderFrame, 0)))
         throw MakeException("Error when allocating encoder frame: %d", err);
+    m_packet = TakePacket();
 
     Debug("Successfully initialized VideoEncoderSW");
 }
@@ -135,7 +232,10 @@ void VideoEncoderSW::Shutdown() {
 
     av_frame_free(&m_transferredFrame);
     av_frame_free(&m_encoderFrame);
+    av_packet_free(&m_packet);
 
+    // The packet data can be held by the encoder
+    lentPackets.WaitForReturns();
     avcodec_free_context(&m_codecContext);
     sws_freeContext(m_scalerContext);
     m_scalerContext = nullptr;
@@ -146,41 +246,153 @@ void VideoEncoderSW::Shutdown() {
 void VideoEncoderSW::Transmit(
     ID3D11Texture2D* pTexture, uint64_t presentationTime, uint64_t targetTimestampNs, bool insertIDR
 ) {
+    ALVR_PROFILE_ZONE("VideoEncoderSW::Transmit");
     // Handle bitrate changes
-    auto params = GetDynamicEncoderParams();
+    auto params = PollDynamicParams();
     if (params.updated) {
         m_codecContext->bit_rate = params.bitrate_bps;
         m_codecContext->framerate = AVRational { (int)params.framerate, 1 };
-        m_codecContext->rc_buffer_size = m_codecContext->bit_rate / params.framerate * 1.1;
+        m_codecContext->rc_buffer_size = CapToMaxFrameSize(
+            params.max_frame_bytes, m_codecContext->bit_rate / params.framerate * 1.1
+        );
         m_codecContext->rc_max_rate = m_codecContext->bit_rate;
     }
 
-    // Setup staging texture if not defined yet; we can only define it here as we now have the
+    // Setup staging textures if not defined yet; we can only define them here as we now have the
     // texture's size
-    if (!m_stagingTex) {
-        HRESULT hr = SetupStagingTexture(pTexture);
-        if (FAILED(hr)) {
-            Error("Failed to create staging texture: %p %ls", hr, GetErrorStr(hr).c_str());
+    if (!m_stagedFrames[0].texture) {
+        try {
+            SetupTextures(pTexture);
+        } catch (Exception e) {
+            Error("Failed to create staging textures: %s", e.what());
             return;
         }
-        Debug("Success in creating staging texture");
+        Debug("Success in creating staging textures");
+    }
+
+    // The texture to stage into still holds the oldest frame if the GPU fell behind
+    if (m_pendingStagedFrames == STAGING_TEXTURE_COUNT) {
+        EncodeStagedFrame(true);
     }
+    StageFrame(pTexture, targetTimestampNs, insertIDR);
+
+    // Encode the older frames that are already copied and leave the newest one for the next call,
+    // so that Map doesn't wait for the GPU
+    while (m_pendingStagedFrames > 1 && EncodeStagedFrame(false)) { }
+}
+
+void VideoEncoderSW::SetupTextures(ID3D11Texture2D* pTexture) {
+    auto device = m_d3dRender->GetDevice();
+
+    D3D11_TEXTURE2D_DESC desc;
+    pTexture->GetDesc(&desc);
+
+    bool use10bit = Settings_Instance()->m_use10bitEncoder;
+    DXGI_FORMAT yuvFormat = use10bit ? DXGI_FORMAT_P010 : DXGI_FORMAT_NV12;
+    m_stagingFormat = use10bit ? AV_PIX_FMT_P010LE : AV_PIX_FMT_NV12;
+
+    if (desc.Format == DXGI_FORMAT_NV12 || desc.Format == DXGI_FORMAT_P010) {
+        m_stagingFormat = desc.Format == DXGI_FORMAT_P010 ? AV_PIX_FMT_P010LE : AV_PIX_FMT_NV12;
+    } else if (!m_convertOnGpu) {
+        m_stagingFormat = AV_PIX_FMT_RGBA;
+    } else {
+        m_inputTex.Attach(CreateTexture(device, desc.Width, desc.Height, desc.Format));
+        m_yuvTex.Attach(CreateTexture(device, desc.Width, desc.Height, yuvFormat));
+
+        YUVParams params = use10bit ? YUV_PARAMS_BT709_10BIT_FULL : YUV_PARAMS_BT709_8BIT_FULL;
+        params.renderWidth = (float)desc.Width;
+        params.renderHeight = (float)desc.Height;
+        ComPtr<ID3D11Buffer> paramBuffer;
+        paramBuffer.Attach(CreateBuffer(device, params));
+
+        std::vector<uint8_t> quadShaderCSO(
+            QUAD_SHADER_CSO_PTR, QUAD_SHADER_CSO_PTR + QUAD_SHADER_CSO_LEN
+        );
+        ComPtr<ID3D11VertexShader> quadVertexShader;
+        quadVertexShader.Attach(CreateVertexShader(device, quadShaderCSO));
+        std::vector<uint8_t> yuv420ShaderCSO(
+            RGBTOYUV420_CSO_PTR, RGBTOYUV420_CSO_PTR + RGBTOYUV420_CSO_LEN
+        );
+
+        m_yuvPipeline = std::make_unique<RenderPipelineYUV>(device);
+        m_yuvPipeline->Initialize(
+            { m_inputTex.Get() },
+            quadVertexShader.Get(),
+            yuv420ShaderCSO,
+            m_yuvTex.Get(),
+            paramBuffer.Get()
+        );
+    }
+
+    m_stagingTexDesc.Width = desc.Width;
+    m_stagingTexDesc.Height = desc.Height;
+    m_stagingTexDesc.MipLevels = 1;
+    m_stagingTexDesc.ArraySize = 1;
+    m_stagingTexDesc.Format = m_yuvTex ? yuvFormat : desc.Format;
+    m_stagingTexDesc.SampleDesc = { 1, 0 };
+    m_stagingTexDesc.Usage = D3D11_USAGE_STAGING;
+    m_stagingTexDesc.BindFlags = 0;
+    m_stagingTexDesc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
+    m_stagingTexDesc.MiscFlags = 0;
+
+    for (auto& frame : m_stagedFrames) {
+        HRESULT hr = device->CreateTexture2D(&m_stagingTexDesc, nullptr, &frame.texture);
+        if (FAILED(hr)) {
+            throw MakeException("CreateTexture2D %p %ls", hr, GetErrorStr(hr).c_str());
+        }
+        TrackTextureMemory(frame.texture.Get(), "Software encoder staging");
+    }
+}
+
+void VideoEncoderSW::StageFrame(
+    ID3D11Texture2D* pTexture, uint64_t targetTimestampNs, bool insertIDR
+) {
+    auto context = m_d3dRender->GetContext();
+    StagedFrame& frame = m_stagedFrames[m_nextStagedFrame];
 
-    // Copy texture and map it to memory
     /// SteamVR crashes if the swapchain textures are set to staging, which is needed to be read by
-    /// the CPU. Unless there's another solution we have to copy the texture every time, which is
-    /// gonna be another performance hit.
-    HRESULT hr = CopyTexture(pTexture);
-    if (FAILED(hr)) {
-        Error("Failed to copy texture to staging: %p %ls", hr, GetErrorStr(hr).c_str());
-        return;
+    /// the CPU. Unless there's another solution we have to copy the texture every time.
+    if (m_yuvPipeline) {
+        context->CopyResource(m_inputTex.Get(), pTexture);
+        m_yuvPipeline->Render(context);
+        context->CopyResource(frame.texture.Get(), m_yuvTex.Get());
+    } else {
+        context->CopyResource(frame.texture.Get(), pTexture);
     }
-    // Debug("Success in mapping staging texture");
+    // Submit the copy now, the texture is mapped without waiting on a later call
+    context->Flush();
+
+    frame.targetTimestampNs = targetTimestampNs;
+    frame.insertIDR = insertIDR;
+    m_nextStagedFrame = (m_nextStagedFrame + 1) % STAGING_TEXTURE_COUNT;
+    m_pendingStagedFrames++;
+}
 
-    AVPixelFormat inputFormat = AV_PIX_FMT_RGBA;
-    if (Settings_Instance()->m_enableHdr) {
-        inputFormat
-            = Settings_Instance()->m_use10bitEncoder ? AV_PIX_FMT_YUV420P10 : AV_PIX_FMT_YUV420P;
+bool VideoEncoderSW::EncodeStagedFrame(bool wait) {
+    auto context = m_d3dRender->GetContext();
+    int index = (m_nextStagedFrame - m_pendingStagedFrames + STAGING_TEXTURE_COUNT)
+        % STAGING_TEXTURE_COUNT;
+    StagedFrame& frame = m_stagedFrames[index];
+
+    // The scaler writes the encoder frame from here, so its pages are placed on the node too
+    if (m_numaNode >= 0 && !m_numaPinned) {
+        m_numaPinned = true;
+        if (!PinThreadToNumaNode(m_numaNode)) {
+            Warn("Failed to pin the encode thread to NUMA node %d\n", m_numaNode);
+        }
+    }
+
+    D3D11_MAPPED_SUBRESOURCE map;
+    HRESULT hr = context->Map(
+        frame.texture.Get(), 0, D3D11_MAP_READ, wait ? 0 : D3D11_MAP_FLAG_DO_NOT_WAIT, &map
+    );
+    if (hr == DXGI_ERROR_WAS_STILL_DRAWING) {
+        return false;
+    }
+    m_pendingStagedFrames--;
+    if (FAILED(hr)) {
+        Error("Failed to map staging texture: %p %ls", hr, GetErrorStr(hr).c_str());
+        return true;
     }
 
     // Setup software scaler if not defined yet; we can only define it here as we now have the
@@ -189,7 +401,7 @@ void VideoEncoderSW::Transmit(
         m_scalerContext = sws_getContext(
             m_stagingTexDesc.Width,
             m_stagingTexDesc.Height,
-            inputFormat,
+            m_stagingFormat,
             m_codecContext->width,
             m_codecContext->height,
             m_codecContext->pix_fmt,
@@ -200,93 +412,91 @@ void VideoEncoderSW::Transmit(
         );
         if (!m_scalerContext) {
             Error("Couldn't initialize SWScaler.");
-            m_d3dRender->GetContext()->Unmap(m_stagingTex.Get(), 0);
-            return;
+            context->Unmap(frame.texture.Get(), 0);
+            return true;
         }
         Debug("Successfully initialized SWScaler.");
     }
 
-    // We got the texture, populate tansferredFrame with data
+    // We got the texture, populate tansferredFrame with data. The chroma plane follows the luma
+    // plane in mapped NV12 and P010 textures.
     m_transferredFrame->width = m_stagingTexDesc.Width;
     m_transferredFrame->height = m_stagingTexDesc.Height;
-    m_transferredFrame->data[0] = (uint8_t*)m_stagingTexMap.pData;
-    m_transferredFrame->linesize[0] = m_stagingTexMap.RowPitch;
-    m_transferredFrame->format = inputFormat;
-    m_transferredFrame->pts = targetTimestampNs;
-
-    // Use SWScaler for scaling
-    if (sws_scale(
-            m_scalerContext,
-            m_transferredFrame->data,
-            m_transferredFrame->linesize,
-            0,
-            m_transferredFrame->height,
-            m_encoderFrame->data,
-            m_encoderFrame->linesize
-        )
-        == 0) {
+    m_transferredFrame->data[0] = (uint8_t*)map.pData;
+    m_transferredFrame->linesize[0] = map.RowPitch;
+    if (m_stagingFormat != AV_PIX_FMT_RGBA) {
+        m_transferredFrame->data[1]
+            = (uint8_t*)map.pData + map.RowPitch * m_stagingTexDesc.Height;
+        m_transferredFrame->linesize[1] = map.RowPitch;
+    }
+    m_transferredFrame->format = m_stagingFormat;
+    m_transferredFrame->pts = frame.targetTimestampNs;
+
+    // Use SWScaler to convert RGBA or unpack the chroma plane, and for scaling
+    int scaledHeight = sws_scale(
+        m_scalerContext,
+        m_transferredFrame->data,
+        m_transferredFrame->linesize,
+        0,
+        m_transferredFrame->height,
+        m_encoderFrame->data,
+        m_encoderFrame->linesize
+    );
+    context->Unmap(frame.texture.Get(), 0);
+    if (scaledHeight == 0) {
         Error("SWScale failed.");
-        m_d3dRender->GetContext()->Unmap(m_stagingTex.Get(), 0);
-        return;
+        return true;
     }
-    // Debug("SWScale succeeded.");
 
     // Send frame for encoding
-    m_encoderFrame->pict_type = insertIDR ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
-    m_encoderFrame->pts = targetTimestampNs;
+    m_encoderFrame->pict_type = frame.insertIDR ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+    m_encoderFrame->pts = frame.targetTimestampNs;
 
+    m_submitNs = GetSteadyTimeNs();
     int err;
     if ((err = avcodec_send_frame(m_codecContext, m_encoderFrame)) < 0) {
         Error("Encoding frame failed: err code %d", err);
-        m_d3dRender->GetContext()->Unmap(m_stagingTex.Get(), 0);
-        return;
+        return true;
     }
-    // Debug("Send frame succeeded.");
 
+    ReceivePackets();
+
+    return true;
+}
+
+void VideoEncoderSW::ReceivePackets() {
     // Retrieve frames from encoding and send them until buffer is emptied
-    while (true) {
-        AVPacket* packet = av_packet_alloc();
-        err = avcodec_receive_packet(m_codecContext, packet);
-        if (err != 0) {
-            av_packet_free(&packet);
-            break;
-        }
-        // Send encoded frame to client
+    int err;
+    while ((err = avcodec_receive_packet(m_codecContext, m_packet)) == 0) {
+        // Send encoded frame to client, the packet is freed once it has been sent
+        AVPacket* packet = m_packet;
+        m_packet = TakePacket();
+
         bool isIdr = (packet->flags & AV_PKT_FLAG_KEY) != 0;
-        ParseFrameNals(m_codec, packet->data, packet->size, packet->pts, isIdr);
-        // Debug("Sent encoded packet to client");
-        av_packet_free(&packet);
+        FfiEncodedFrameStats stats = {};
+        stats.targetTimestampNs = packet->pts;
+        stats.sizeBytes = packet->size;
+        stats.averageQp = -1.0f;
+        stats.frameType = isIdr ? FRAME_TYPE_IDR : FRAME_TYPE_UNKNOWN;
+        stats.encodeTimeNs = GetSteadyTimeNs() - m_submitNs;
+        ReadQualityStats(packet, stats);
+
+        lentPackets.Lend();
+        ParseFrameLentNals(
+            m_codec,
+            packet->data,
+            packet->size,
+            packet->pts,
+            isIdr,
+            ReturnPacket,
+            packet
+        );
+        ReportEncodedFrameStats(stats);
+        g_encoderControl.ReportFrameSize(stats.sizeBytes);
     }
     if (err == AVERROR(EINVAL)) {
         Error("Received encoded frame failed: err code %d", err);
     }
-
-    // Unmap the copied texture and delete it
-    m_d3dRender->GetContext()->Unmap(m_stagingTex.Get(), 0);
-}
-
-HRESULT VideoEncoderSW::SetupStagingTexture(ID3D11Texture2D* pTexture) {
-    D3D11_TEXTURE2D_DESC desc;
-    pTexture->GetDesc(&desc);
-    m_stagingTexDesc.Width = desc.Width;
-    m_stagingTexDesc.Height = desc.Height;
-    m_stagingTexDesc.MipLevels = desc.MipLevels;
-    m_stagingTexDesc.ArraySize = desc.ArraySize;
-    m_stagingTexDesc.Format = desc.Format;
-    m_stagingTexDesc.SampleDesc = desc.SampleDesc;
-    m_stagingTexDesc.Usage = D3D11_USAGE_STAGING;
-    m_stagingTexDesc.BindFlags = 0;
-    m_stagingTexDesc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
-    m_stagingTexDesc.MiscFlags = 0;
-
-    return m_d3dRender->GetDevice()->CreateTexture2D(&m_stagingTexDesc, nullptr, &m_stagingTex);
-}
-
-HRESULT VideoEncoderSW::CopyTexture(ID3D11Texture2D* pTexture) {
-    m_d3dRender->GetContext()->CopyResource(m_stagingTex.Get(), pTexture);
-    return m_d3dRender->GetContext()->Map(
-        m_stagingTex.Get(), 0, D3D11_MAP_READ, 0, &m_stagingTexMap
-    );
 }
 
 AVCodecID VideoEncoderSW::ToFFMPEGCodec(ALVR_CODEC codec) {
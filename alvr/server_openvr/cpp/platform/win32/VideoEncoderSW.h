@@ -6,12 +6,14 @@
 
 #include "ALVR-common/packet_types.h"
 #include "VideoEncoder.h"
+#include "d3d-render-utils/RenderPipelineYUV.h"
 #include "shared/d3drender.h"
 
 extern "C" {
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 #include <libavutil/avutil.h>
+#include <libavutil/intreadwrite.h>
 #include <libswscale/swscale.h>
 }
 
@@ -20,7 +22,11 @@ using Microsoft::WRL::ComPtr;
 // Software video encoder using FFMPEG
 class VideoEncoderSW : public VideoEncoder {
 public:
-    VideoEncoderSW(std::shared_ptr<CD3DRender> pD3DRender, int width, int height);
+    // convertOnGpu converts RGBA frames to YUV with a render pass on pD3DRender, which must not be
+    // the device the compositor renders with from another thread
+    VideoEncoderSW(
+        std::shared_ptr<CD3DRender> pD3DRender, int width, int height, bool convertOnGpu
+    );
     ~VideoEncoderSW();
 
     void Initialize();
@@ -36,19 +42,48 @@ public:
         uint64_t targetTimestampNs,
         bool insertIDR
     );
-    HRESULT SetupStagingTexture(ID3D11Texture2D* pTexture);
-    HRESULT CopyTexture(ID3D11Texture2D* pTexture);
-
 private:
+    // Frames are read back from the oldest staging texture while the GPU copies newer ones
+    static const int STAGING_TEXTURE_COUNT = 3;
+
+    struct StagedFrame {
+        ComPtr<ID3D11Texture2D> texture;
+        uint64_t targetTimestampNs;
+        bool insertIDR;
+    };
+
+    void SetupTextures(ID3D11Texture2D* pTexture);
+    void StageFrame(ID3D11Texture2D* pTexture, uint64_t targetTimestampNs, bool insertIDR);
+    // Returns false if wait is false and the GPU has not finished the copy yet
+    bool EncodeStagedFrame(bool wait);
+    void ReceivePackets();
+
     std::shared_ptr<CD3DRender> m_d3dRender;
 
     AVCodecContext* m_codecContext;
     AVFrame *m_transferredFrame, *m_encoderFrame;
     SwsContext* m_scalerContext = nullptr;
+    // Reused for every receive, replaced only when a packet is lent to the sender
+    AVPacket* m_packet = nullptr;
+    // GetSteadyTimeNs when the last frame was sent to the encoder
+    uint64_t m_submitNs = 0;
+    // See NumaPlacement.h. The encode thread is pinned by its first frame.
+    int m_numaNode = -1;
+    bool m_numaPinned = false;
+
+    // With convertOnGpu, RGBA frames are converted to NV12 or P010 on the GPU, so the CPU only
+    // unpacks the planes. Otherwise sws_scale converts them. HDR frames already come in these
+    // formats.
+    bool m_convertOnGpu;
+    std::unique_ptr<d3d_render_utils::RenderPipelineYUV> m_yuvPipeline;
+    ComPtr<ID3D11Texture2D> m_inputTex;
+    ComPtr<ID3D11Texture2D> m_yuvTex;
+    D3D11_TEXTURE2D_DESC m_stagingTexDesc = {};
+    AVPixelFormat m_stagingFormat;
 
-    ComPtr<ID3D11Texture2D> m_stagingTex;
-    D3D11_TEXTURE2D_DESC m_stagingTexDesc;
-    D3D11_MAPPED_SUBRESOURCE m_stagingTexMap;
+    StagedFrame m_stagedFrames[STAGING_TEXTURE_COUNT];
+    int m_nextStagedFrame = 0;
+    int m_pendingStagedFrames = 0;
 
     ALVR_CODEC m_codec;
     int m_refreshRate;
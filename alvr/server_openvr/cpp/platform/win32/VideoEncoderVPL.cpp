@@ -1,7 +1,12 @@
 #include "VideoEncoderVPL.h"
+#include "GpuMemoryD3D11.h"
+#include "alvr_server/GpuMemory.h"
 #include "alvr_server/Logger.h"
+#include "alvr_server/Profiling.h"
 #include "alvr_server/Utils.h"
 #include "alvr_server/bindings.h"
+#include <algorithm>
+#include <chrono>
 
 #define VPLVERSION(major, minor) (major << 16 | minor)
 #define MAJOR_API_VERSION_REQUIRED 2
@@ -29,6 +34,23 @@
             ERROR_THROW("\"%s\" failed with %d", #expr, res);                                      \
     }
 
+namespace {
+
+FfiFrameType VplFrameType(mfxU16 frameType) {
+    if (frameType & MFX_FRAMETYPE_IDR) {
+        return FRAME_TYPE_IDR;
+    } else if (frameType & MFX_FRAMETYPE_I) {
+        return FRAME_TYPE_INTRA;
+    } else if (frameType & MFX_FRAMETYPE_P) {
+        return FRAME_TYPE_PREDICTED;
+    } else if (frameType & MFX_FRAMETYPE_B) {
+        return FRAME_TYPE_BIDIRECTIONAL;
+    }
+    return FRAME_TYPE_UNKNOWN;
+}
+
+} // namespace
+
 VideoEncoderVPL::VideoEncoderVPL(std::shared_ptr<CD3DRender> pD3DRender, int width, int height)
     : m_pD3DRender(pD3DRender)
     , m_renderWidth(width)
@@ -37,126 +59,197 @@ VideoEncoderVPL::VideoEncoderVPL(std::shared_ptr<CD3DRender> pD3DRender, int wid
     VPL_DEBUG("constructed");
 }
 
-VideoEncoderVPL::~VideoEncoderVPL() { VPL_DEBUG("destructed"); }
+VideoEncoderVPL::~VideoEncoderVPL() {
+    m_outputThread.Stop();
+    VPL_DEBUG("destructed");
+}
 
 void VideoEncoderVPL::Initialize() {
     VPL_DEBUG("initialize");
 
     ChooseParams();
-    InitTransferTex();
     InitVpl();
     InitVplEncode();
+    InitSlots();
 
-    // Prepare output bitstream
-    m_vplBitstream.MaxLength = m_renderWidth * m_renderHeight * 8;
-    m_vplBitstream.Data = (mfxU8*)calloc(m_vplBitstream.MaxLength, sizeof(mfxU8));
+    m_outputThread.Start([this](const size_t& slotIndex) { SyncFrame(slotIndex); });
 }
 
 void VideoEncoderVPL::Shutdown() {
     VPL_DEBUG("shutdown");
 
+    // The pending frames must be synced before their session is closed
+    m_outputThread.Stop();
+
+    ReleaseImportedInputs();
     MFXVideoENCODE_Close(m_vplSession);
     MFXClose(m_vplSession);
 
-    if (m_vplBitstream.Data)
-        free(m_vplBitstream.Data);
+    for (auto& slot : m_slots) {
+        if (slot.bitstream.Data)
+            free(slot.bitstream.Data);
+    }
+    m_slots.clear();
 
     if (m_vplLoader)
         MFXUnload(m_vplLoader);
 }
 
+EncoderCapabilities VideoEncoderVPL::GetCapabilities() {
+    EncoderCapabilities capabilities = VideoEncoder::GetCapabilities();
+    capabilities.intraRefreshMode = m_intraRefreshMode;
+    // An imported input is read until its frame is synced, see Transmit
+    capabilities.async = true;
+    return capabilities;
+}
+
 void VideoEncoderVPL::Transmit(
     ID3D11Texture2D* pTexture, uint64_t presentationTime, uint64_t targetTimestampNs, bool insertIDR
 ) {
+    ALVR_PROFILE_ZONE("VideoEncoderVPL::Transmit");
     // VPL_DEBUG("transmit");
 
-    auto dynParams = GetDynamicEncoderParams();
+    auto dynParams = PollDynamicParams();
     if (dynParams.updated) {
+        // Reset drops the frames still in the encoder
+        m_outputThread.WaitForPending(0);
         m_vplEncodeParams.mfx.TargetKbps = dynParams.bitrate_bps / 1000;
+        // The target is spread over the frames of one second at the refresh rate
+        if (dynParams.refresh_rate > 0) {
+            m_refreshRate = int(dynParams.refresh_rate + 0.5f);
+            m_vplEncodeParams.mfx.FrameInfo.FrameRateExtN = m_refreshRate;
+        }
+        m_maxFrameBytes = dynParams.max_frame_bytes;
+        m_vplCodingOption2.MaxFrameSize = (mfxU32)m_maxFrameBytes;
         MFXVideoENCODE_Reset(m_vplSession, &m_vplEncodeParams);
     }
 
-    auto encSurface = VplImportTexture(pTexture);
+    m_outputThread.WaitForPending(m_slots.size() - 1);
+    EncodeSlot& slot = m_slots[m_nextSlot];
+
+    mfxFrameSurface1* encSurface = GetImportedInput(pTexture);
+    bool imported = encSurface != nullptr;
+    if (imported) {
+        // Released with the other imported surfaces
+        VPL_VERIFY(encSurface->FrameInterface->AddRef(encSurface));
+    } else {
+        if (!slot.transferTex) {
+            D3D11_TEXTURE2D_DESC transferTexDesc = { UINT(m_renderWidth),
+                                                     UINT(m_renderHeight),
+                                                     1,
+                                                     1,
+                                                     m_dxColorFormat,
+                                                     { 1, 0 },
+                                                     D3D11_USAGE_DEFAULT,
+                                                     D3D11_BIND_SHADER_RESOURCE,
+                                                     0,
+                                                     D3D11_RESOURCE_MISC_SHARED };
+            HRESULT hr = m_pD3DRender->GetDevice()->CreateTexture2D(
+                &transferTexDesc, nullptr, &slot.transferTex
+            );
+            if (FAILED(hr))
+                ERROR_THROW(
+                    "failed to create transfer texture HR=%p %ls", hr, GetErrorStr(hr).c_str()
+                );
+            TrackTextureMemory(slot.transferTex, "VPL input");
+        }
+        encSurface = VplImportTexture(pTexture, slot.transferTex.p);
+    }
 
     mfxEncodeCtrl encodeCtrl = {};
     encodeCtrl.FrameType = insertIDR ? MFX_FRAMETYPE_IDR : 0;
 
-    mfxStatus sts = MFX_ERR_NONE;
-    mfxSyncPoint syncp = {};
-    bool isEncGoing = true;
-    bool isDraining = false;
-
-    while (isEncGoing) {
-        isDraining = encSurface == nullptr;
+    mfxStatus sts;
+    slot.syncp = nullptr;
+    slot.submitNs = GetSteadyTimeNs();
+    do {
         sts = MFXVideoENCODE_EncodeFrameAsync(
-            m_vplSession, &encodeCtrl, encSurface, &m_vplBitstream, &syncp
+            m_vplSession, &encodeCtrl, encSurface, &slot.bitstream, &slot.syncp
         );
+        if (sts == MFX_WRN_DEVICE_BUSY) {
+            VPL_DEBUG("device busy");
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    } while (sts == MFX_WRN_DEVICE_BUSY);
 
-        if (encSurface) {
-            VPL_VERIFY(encSurface->FrameInterface->Release(encSurface));
-            encSurface = nullptr;
+    // The encoder holds its own reference while it needs the surface
+    VPL_VERIFY(encSurface->FrameInterface->Release(encSurface));
+
+    switch (sts) {
+    case MFX_ERR_NONE:
+        // MFX_ERR_NONE and syncp indicate output will be available
+        if (slot.syncp) {
+            slot.targetTimestampNs = targetTimestampNs;
+            slot.insertIDR = insertIDR;
+            m_outputThread.Push(m_nextSlot);
+            m_nextSlot = (m_nextSlot + 1) % m_slots.size();
         }
+        // The ring texture is free for the compositor once the next Transmit returns, so the
+        // frame before this one must be done with it
+        if (imported) {
+            m_outputThread.WaitForPending(IsCompactGpuMemory() ? 0 : 1);
+        }
+        break;
 
-        switch (sts) {
-        case MFX_ERR_NONE:
-            // MFX_ERR_NONE and syncp indicate output is available
-            if (syncp) {
-                // Encode output is not available on CPU until sync operation completes
-                do {
-                    sts = MFXVideoCORE_SyncOperation(m_vplSession, syncp, WAIT_100_MILLISECONDS);
-                    if (MFX_ERR_NONE == sts) {
-                        ParseFrameNals(
-                            m_codec,
-                            reinterpret_cast<uint8_t*>(
-                                m_vplBitstream.Data + m_vplBitstream.DataOffset
-                            ),
-                            m_vplBitstream.DataLength,
-                            targetTimestampNs,
-                            insertIDR
-                        );
-                        m_vplBitstream.DataLength = 0;
-                    }
-                } while (sts == MFX_WRN_IN_EXECUTION);
-            }
-            break;
+    case MFX_ERR_NOT_ENOUGH_BUFFER:
+        ERROR_THROW("not enough buffer");
 
-        case MFX_ERR_NOT_ENOUGH_BUFFER:
-            ERROR_THROW("not enough buffer");
+    case MFX_ERR_MORE_DATA:
+        // Without B-frames this only happens if the encoder buffers frames internally
+        VPL_DEBUG("frame buffered by the encoder");
+        break;
 
-        case MFX_ERR_MORE_DATA:
-            if (isDraining == true)
-                isEncGoing = false;
-            break;
+    case MFX_ERR_DEVICE_LOST:
+        ERROR_THROW("device lost");
 
-        case MFX_ERR_DEVICE_LOST:
-            ERROR_THROW("device lost");
+    default:
+        ERROR_THROW("unknown encoding status %d", sts);
+    }
+}
 
-        case MFX_WRN_DEVICE_BUSY:
-            VPL_DEBUG("device busy");
-            break;
+void VideoEncoderVPL::SyncFrame(size_t slotIndex) {
+    EncodeSlot& slot = m_slots[slotIndex];
 
-        default:
-            ERROR_THROW("unknown encoding status %d", sts);
-        }
+    // Encode output is not available on CPU until sync operation completes
+    mfxStatus sts;
+    do {
+        sts = MFXVideoCORE_SyncOperation(m_vplSession, slot.syncp, WAIT_100_MILLISECONDS);
+    } while (sts == MFX_WRN_IN_EXECUTION);
+
+    if (sts == MFX_ERR_NONE) {
+        ParseFrameNals(
+            m_codec,
+            reinterpret_cast<uint8_t*>(slot.bitstream.Data + slot.bitstream.DataOffset),
+            slot.bitstream.DataLength,
+            slot.targetTimestampNs,
+            slot.insertIDR
+        );
+
+        // VPL has no QP feedback without the deprecated encoded frame info buffers
+        FfiEncodedFrameStats stats = {};
+        stats.targetTimestampNs = slot.targetTimestampNs;
+        stats.sizeBytes = slot.bitstream.DataLength;
+        stats.averageQp = -1.0f;
+        stats.frameType = VplFrameType(slot.bitstream.FrameType);
+        stats.encodeTimeNs = GetSteadyTimeNs() - slot.submitNs;
+        ReportEncodedFrameStats(stats);
+        g_encoderControl.ReportFrameSize(stats.sizeBytes);
+    } else {
+        Error("VPL: failed to sync a frame with %d\n", sts);
     }
+    slot.bitstream.DataOffset = 0;
+    slot.bitstream.DataLength = 0;
 }
 
-void VideoEncoderVPL::InitTransferTex() {
-    D3D11_TEXTURE2D_DESC transferTexDesc = { UINT(m_renderWidth),
-                                             UINT(m_renderHeight),
-                                             1,
-                                             1,
-                                             m_dxColorFormat,
-                                             { 1, 0 },
-                                             D3D11_USAGE_DEFAULT,
-                                             D3D11_BIND_SHADER_RESOURCE,
-                                             0,
-                                             D3D11_RESOURCE_MISC_SHARED };
-
-    HRESULT hr
-        = m_pD3DRender->GetDevice()->CreateTexture2D(&transferTexDesc, nullptr, &m_transferTex);
-    if (FAILED(hr))
-        ERROR_THROW("failed to create transfer texture HR=%p %ls", hr, GetErrorStr(hr).c_str());
+void VideoEncoderVPL::InitSlots() {
+    // Query may have lowered the async depth
+    m_slots.resize(std::max<mfxU16>(m_vplEncodeParams.AsyncDepth, 1));
+    for (auto& slot : m_slots) {
+        slot = {};
+        slot.bitstream.MaxLength = m_renderWidth * m_renderHeight * 8;
+        slot.bitstream.Data = (mfxU8*)calloc(slot.bitstream.MaxLength, sizeof(mfxU8));
+    }
+    VPL_DEBUG("encoding up to %zu frames at once", m_slots.size());
 }
 
 void VideoEncoderVPL::InitVpl() {
@@ -180,7 +273,9 @@ void VideoEncoderVPL::InitVpl() {
 void VideoEncoderVPL::InitVplEncode() {
     m_vplEncodeParams.IOPattern = MFX_IOPATTERN_IN_VIDEO_MEMORY;
     m_vplEncodeParams.mfx.LowPower = MFX_CODINGOPTION_ON;
-    m_vplEncodeParams.AsyncDepth = 1;
+    // Each frame in flight has its own transfer texture and encoder surfaces
+    m_vplEncodeParams.AsyncDepth
+        = IsCompactGpuMemory() ? 1 : std::clamp(Settings_Instance()->m_vplAsyncDepth, 1u, 16u);
     m_vplEncodeParams.mfx.CodecId = m_vplCodec;
     m_vplEncodeParams.mfx.CodecProfile = m_vplCodecProfile;
     m_vplEncodeParams.mfx.TargetUsage = m_vplQualityPreset;
@@ -194,6 +289,59 @@ void VideoEncoderVPL::InitVplEncode() {
     m_vplEncodeParams.mfx.FrameInfo.CropH = m_renderHeight;
     m_vplEncodeParams.mfx.FrameInfo.Width = ALIGN16(m_renderWidth);
     m_vplEncodeParams.mfx.FrameInfo.Height = ALIGN16(m_renderHeight);
+    // B-frames would hold back frames until their references are encoded
+    m_vplEncodeParams.mfx.GopRefDist = 1;
+
+    mfxU16 numExtParams = 0;
+
+    m_vplCodingOption2.Header.BufferId = MFX_EXTBUFF_CODING_OPTION2;
+    m_vplCodingOption2.Header.BufferSz = sizeof(mfxExtCodingOption2);
+    // In bytes, 0 lets the encoder choose, which is up to the whole HRD buffer
+    m_vplCodingOption2.MaxFrameSize = (mfxU32)m_maxFrameBytes;
+    // Refreshing a column of the picture per frame repairs lost frames within the cycle
+    uint32_t intraRefreshFrames = Settings_Instance()->m_intraRefreshRecoveryFrames;
+    if (intraRefreshFrames > 0) {
+        m_vplCodingOption2.IntRefType = MFX_REFRESH_VERTICAL;
+        m_vplCodingOption2.IntRefCycleSize = intraRefreshFrames;
+    }
+    m_vplExtParams[numExtParams++] = &m_vplCodingOption2.Header;
+
+    // Keeps each frame close to its share of the bitrate instead of averaging over the HRD buffer
+    m_vplCodingOption3.Header.BufferId = MFX_EXTBUFF_CODING_OPTION3;
+    m_vplCodingOption3.Header.BufferSz = sizeof(mfxExtCodingOption3);
+    m_vplCodingOption3.LowDelayBRC = MFX_CODINGOPTION_ON;
+    m_vplExtParams[numExtParams++] = &m_vplCodingOption3.Header;
+
+    // Tiles are decoded in parallel by the client
+    if (m_codec == ALVR_CODEC_HEVC) {
+        m_vplHevcTiles.Header.BufferId = MFX_EXTBUFF_HEVC_TILES;
+        m_vplHevcTiles.Header.BufferSz = sizeof(mfxExtHEVCTiles);
+        m_vplHevcTiles.NumTileColumns = (mfxU16)Settings_Instance()->m_tileColumns;
+        m_vplHevcTiles.NumTileRows = (mfxU16)Settings_Instance()->m_tileRows;
+        m_vplExtParams[numExtParams++] = &m_vplHevcTiles.Header;
+    } else if (m_codec == ALVR_CODEC_AV1) {
+        m_vplAv1Tiles.Header.BufferId = MFX_EXTBUFF_AV1_TILE_PARAM;
+        m_vplAv1Tiles.Header.BufferSz = sizeof(mfxExtAV1TileParam);
+        m_vplAv1Tiles.NumTileColumns = (mfxU16)Settings_Instance()->m_tileColumns;
+        m_vplAv1Tiles.NumTileRows = (mfxU16)Settings_Instance()->m_tileRows;
+        m_vplExtParams[numExtParams++] = &m_vplAv1Tiles.Header;
+    }
+
+    // Each layer doubles the frame rate of the layers below it, the top layer is never referenced
+    uint32_t temporalLayers = Settings_Instance()->m_temporalLayers;
+    if (temporalLayers > 1) {
+        for (uint32_t i = 0; i < temporalLayers; i++) {
+            m_vplTemporalLayerParams[i].FrameRateScale = (mfxU16)(1 << i);
+        }
+        m_vplTemporalLayers.Header.BufferId = MFX_EXTBUFF_UNIVERSAL_TEMPORAL_LAYERS;
+        m_vplTemporalLayers.Header.BufferSz = sizeof(mfxExtTemporalLayers);
+        m_vplTemporalLayers.NumLayers = (mfxU16)temporalLayers;
+        m_vplTemporalLayers.Layers = m_vplTemporalLayerParams;
+        m_vplExtParams[numExtParams++] = &m_vplTemporalLayers.Header;
+    }
+
+    m_vplEncodeParams.ExtParam = m_vplExtParams;
+    m_vplEncodeParams.NumExtParam = numExtParams;
 
     mfxStatus sts = MFXVideoENCODE_Query(m_vplSession, &m_vplEncodeParams, &m_vplEncodeParams);
     switch (sts) {
@@ -209,19 +357,82 @@ void VideoEncoderVPL::InitVplEncode() {
         ERROR_THROW("query unsupported");
     }
 
+    if (m_vplCodingOption3.LowDelayBRC != MFX_CODINGOPTION_ON) {
+        VPL_DEBUG("low delay BRC unsupported");
+    }
+
+    // Query turns off the intra refresh if the GPU can't do it
+    if (intraRefreshFrames > 0 && m_vplCodingOption2.IntRefType != MFX_REFRESH_NO) {
+        m_intraRefreshMode = IntraRefreshMode::Continuous;
+    }
+
     // Initialize ENCODE
     VPL_VERIFY(MFXVideoENCODE_Init(m_vplSession, &m_vplEncodeParams));
 }
 
-mfxFrameSurface1* VideoEncoderVPL::VplImportTexture(ID3D11Texture2D* texture) {
-    m_pD3DRender->GetContext()->CopyResource(m_transferTex.p, texture);
+mfxFrameSurface1* VideoEncoderVPL::GetImportedInput(ID3D11Texture2D* texture) {
+    for (auto& input : m_importedInputs) {
+        if (input.texture.p == texture) {
+            return input.surface;
+        }
+    }
+    for (auto input : m_unimportableInputs) {
+        if (input == texture) {
+            return nullptr;
+        }
+    }
+
+    // Imported in place, the encoder reads the texture itself
+    D3D11_TEXTURE2D_DESC desc;
+    texture->GetDesc(&desc);
+    mfxFrameSurface1* surface = nullptr;
+    if (desc.Format == m_dxColorFormat && desc.Width == UINT(m_renderWidth)
+        && desc.Height == UINT(m_renderHeight)) {
+        mfxSurfaceD3D11Tex2D extSurfD3D11 = {};
+        extSurfD3D11.SurfaceInterface.Header.SurfaceType = MFX_SURFACE_TYPE_D3D11_TEX2D;
+        extSurfD3D11.SurfaceInterface.Header.SurfaceFlags = MFX_SURFACE_FLAG_IMPORT_SHARED;
+        extSurfD3D11.SurfaceInterface.Header.StructSize = sizeof(mfxSurfaceD3D11Tex2D);
+        extSurfD3D11.texture2D = texture;
+        mfxStatus sts = m_vplMemoryInterface->ImportFrameSurface(
+            m_vplMemoryInterface,
+            MFX_SURFACE_COMPONENT_ENCODE,
+            &extSurfD3D11.SurfaceInterface.Header,
+            &surface
+        );
+        if (sts != MFX_ERR_NONE) {
+            VPL_INFO("input texture %p can't be imported (%d), copying it", texture, sts);
+            surface = nullptr;
+        }
+    }
+    if (!surface) {
+        m_unimportableInputs.push_back(texture);
+        return nullptr;
+    }
+
+    VPL_DEBUG("imported input texture %p", texture);
+    m_importedInputs.push_back({ texture, surface });
+    return surface;
+}
+
+void VideoEncoderVPL::ReleaseImportedInputs() {
+    for (auto& input : m_importedInputs) {
+        input.surface->FrameInterface->Release(input.surface);
+    }
+    m_importedInputs.clear();
+    m_unimportableInputs.clear();
+}
+
+mfxFrameSurface1* VideoEncoderVPL::VplImportTexture(
+    ID3D11Texture2D* texture, ID3D11Texture2D* transferTex
+) {
+    m_pD3DRender->GetContext()->CopyResource(transferTex, texture);
 
     mfxSurfaceD3D11Tex2D extSurfD3D11 = {};
     extSurfD3D11.SurfaceInterface.Header.SurfaceType = MFX_SURFACE_TYPE_D3D11_TEX2D;
     extSurfD3D11.SurfaceInterface.Header.SurfaceFlags
         = MFX_SURFACE_FLAG_IMPORT_SHARED | MFX_SURFACE_FLAG_IMPORT_COPY;
     extSurfD3D11.SurfaceInterface.Header.StructSize = sizeof(mfxSurfaceD3D11Tex2D);
-    extSurfD3D11.texture2D = m_transferTex.p;
+    extSurfD3D11.texture2D = transferTex;
 
     mfxFrameSurface1* encSurface = nullptr;
     VPL_VERIFY(m_vplMemoryInterface->ImportFrameSurface(
@@ -253,7 +464,7 @@ void VideoEncoderVPL::ChooseParams() {
         m_codec = ALVR_CODEC_HEVC;
     }
 
-    if (s->m_enableHdr) {
+    if (s->m_convertToYuv) {
         if (s->m_use10bitEncoder) {
             m_dxColorFormat = DXGI_FORMAT_P010;
             m_vplColorFormat = MFX_FOURCC_P010;
@@ -381,6 +592,7 @@ void VideoEncoderVPL::CheckVPLConfig() {
         cfg[3], (mfxU8*)"mfxSurfaceTypesSupported.surftype.surfcomp.SurfaceComponent", cfgVal[3]
     ));
 
+    // The inputs are imported without a copy when possible, see GetImportedInput
     cfgVal[3].Data.U32 = MFX_SURFACE_FLAG_IMPORT_COPY;
     VPL_VERIFY(MFXSetConfigFilterProperty(
         cfg[3], (mfxU8*)"mfxSurfaceTypesSupported.surftype.surfcomp.SurfaceFlags", cfgVal[3]
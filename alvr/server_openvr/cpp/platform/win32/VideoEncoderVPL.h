@@ -31,21 +31,45 @@ public:
         bool insertIDR
     );
 
+    EncoderCapabilities GetCapabilities();
+
 private:
+    // Frame in flight in the encoder, with its own output buffer. The inputs that can't be
+    // imported are copied into its transfer texture, which VPL may still read after
+    // EncodeFrameAsync returns.
+    struct EncodeSlot {
+        // Only created once a frame of the slot is copied
+        CComPtr<ID3D11Texture2D> transferTex;
+        mfxBitstream bitstream;
+        mfxSyncPoint syncp;
+        uint64_t targetTimestampNs;
+        bool insertIDR;
+        // GetSteadyTimeNs when the frame was submitted
+        uint64_t submitNs;
+    };
+
     void CheckVPLConfig();
     void ChooseParams();
-    void InitTransferTex();
+    void InitSlots();
     void InitVpl();
     void InitVplEncode();
-    mfxFrameSurface1* VplImportTexture(ID3D11Texture2D* texture);
+    // The surface of the imported input, null if it can't be imported
+    mfxFrameSurface1* GetImportedInput(ID3D11Texture2D* texture);
+    void ReleaseImportedInputs();
+    mfxFrameSurface1* VplImportTexture(ID3D11Texture2D* texture, ID3D11Texture2D* transferTex);
     void LogImplementationInfo();
 
+    // Output of m_outputThread, which sends the frame of the slot
+    void SyncFrame(size_t slotIndex);
+
     std::shared_ptr<CD3DRender> m_pD3DRender;
     int m_codec;
     int m_renderWidth;
     int m_renderHeight;
     int m_refreshRate;
     int m_bitrateInMBits;
+    // FfiDynamicEncoderParams::max_frame_bytes
+    uint64_t m_maxFrameBytes = 0;
 
     mfxU32 m_vplCodec;
     mfxU32 m_vplCodecProfile;
@@ -55,10 +79,33 @@ private:
     mfxU32 m_vplRateControlMode;
     DXGI_FORMAT m_dxColorFormat;
     mfxVideoParam m_vplEncodeParams = {};
+    mfxExtCodingOption2 m_vplCodingOption2 = {};
+    mfxExtCodingOption3 m_vplCodingOption3 = {};
+    mfxExtHEVCTiles m_vplHevcTiles = {};
+    mfxExtAV1TileParam m_vplAv1Tiles = {};
+    mfxExtTemporalLayers m_vplTemporalLayers = {};
+    mfxTemporalLayer m_vplTemporalLayerParams[3] = {};
+    mfxExtBuffer* m_vplExtParams[4] = {};
+    IntraRefreshMode m_intraRefreshMode = IntraRefreshMode::None;
 
     mfxLoader m_vplLoader = nullptr;
     mfxSession m_vplSession = nullptr;
-    mfxBitstream m_vplBitstream = {};
     mfxMemoryInterface* m_vplMemoryInterface = nullptr;
-    CComPtr<ID3D11Texture2D> m_transferTex;
+
+    // The inputs, which are the textures of the CEncoder frame ring, imported without a copy. The
+    // surfaces are kept so that each texture is imported once.
+    struct ImportedInput {
+        CComPtr<ID3D11Texture2D> texture;
+        mfxFrameSurface1* surface;
+    };
+    std::vector<ImportedInput> m_importedInputs;
+    // Input textures which can't be imported, so that it is not retried every frame
+    std::vector<ID3D11Texture2D*> m_unimportableInputs;
+
+    // Up to AsyncDepth frames are encoded while m_outputThread waits for the oldest one and sends
+    // it. The slots are used in order, so the next one is free when fewer frames are pending.
+    std::vector<EncodeSlot> m_slots;
+    size_t m_nextSlot = 0;
+    // Indices of the pending slots, at most m_slots.size(). The async depth is at most 16.
+    EncoderOutputThread<size_t, 16> m_outputThread;
 };
@@ -93,6 +93,10 @@ void RenderPipeline::Initialize(
     );
 }
 
+void RenderPipeline::AddInputView(ID3D11ShaderResourceView* view) {
+    mInputTextureViews.push_back(view);
+}
+
 void RenderPipeline::Render(ID3D11DeviceContext* otherContext) {
     ID3D11DeviceContext* context = otherContext != nullptr ? otherContext : mImmediateContext.Get();
 
@@ -26,6 +26,9 @@ public:
         bool enableAlphaBlend = false,
         bool overrideAlpha = false
     );
+    // Binds a view after the input textures, for inputs that are not 2D textures. Initialize
+    // clears them.
+    void AddInputView(ID3D11ShaderResourceView* view);
 
     void Render(ID3D11DeviceContext* otherContext = nullptr);
 
@@ -220,11 +220,15 @@ ID3D11Texture2D *CD3DRender::GetSharedTexture( HANDLE hSharedTexture )
 	if ( !hSharedTexture )
 		return NULL;
 
+	if ( m_LastSharedTexture.m_hSharedTexture == hSharedTexture )
+		return m_LastSharedTexture.m_pTexture;
+
 	for ( SharedTextures_t::iterator it = m_SharedTextureCache.begin();
 		it != m_SharedTextureCache.end(); ++it )
 	{
 		if ( it->m_hSharedTexture == hSharedTexture )
 		{
+			m_LastSharedTexture = *it;
 			return it->m_pTexture;
 		}
 	}
@@ -235,6 +239,7 @@ ID3D11Texture2D *CD3DRender::GetSharedTexture( HANDLE hSharedTexture )
 	{
 		SharedTextureEntry_t entry { hSharedTexture, pTexture };
 		m_SharedTextureCache.push_back( entry );
+		m_LastSharedTexture = entry;
 		return pTexture;
 	}
 
@@ -59,5 +59,7 @@ private:
 	};
 	typedef std::vector< SharedTextureEntry_t > SharedTextures_t;
 	SharedTextures_t m_SharedTextureCache;
+	// The compositor presents with the same sync texture every frame
+	SharedTextureEntry_t m_LastSharedTexture = {};
 };
 
@@ -13,6 +13,7 @@
 
 #ifndef _WIN32
 #include <cstring>
+#include <dlfcn.h>
 static inline bool operator==(const GUID &guid1, const GUID &guid2) {
     return !memcmp(&guid1, &guid2, sizeof(GUID));
 }
@@ -468,9 +469,73 @@ void NvEncoder::MapResources(uint32_t bfrIdx)
     }
 }
 
+void NvEncoder::SubmitFrame(NV_ENC_PIC_PARAMS *pPicParams)
+{
+    if (!IsHWEncoderInitialized())
+    {
+        NVENC_THROW_ERROR("Encoder device not found", NV_ENC_ERR_NO_ENCODE_DEVICE);
+    }
+
+    int bfrIdx = m_iToSend % m_nEncoderBuffer;
+
+    MapResources(bfrIdx);
+
+    NVENCSTATUS nvStatus = DoEncode(m_vMappedInputBuffers[bfrIdx], m_vBitstreamOutputBuffer[bfrIdx], pPicParams);
+
+    if (nvStatus == NV_ENC_SUCCESS || nvStatus == NV_ENC_ERR_NEED_MORE_INPUT)
+    {
+        m_iToSend++;
+    }
+    else
+    {
+        NVENC_THROW_ERROR("nvEncEncodePicture API failed", nvStatus);
+    }
+}
+
 void NvEncoder::EncodeFrame(std::vector<std::vector<uint8_t>> &vPacket, NV_ENC_PIC_PARAMS *pPicParams)
 {
     vPacket.clear();
+    SubmitFrame(pPicParams);
+    GetEncodedPacket(m_vBitstreamOutputBuffer, vPacket, true);
+}
+
+void NvEncoder::EncodeFrameRaw(const BitstreamCallback &onBitstream, NV_ENC_PIC_PARAMS *pPicParams)
+{
+    SubmitFrame(pPicParams);
+    LockEncodedPackets(m_vBitstreamOutputBuffer, false, [&](const NV_ENC_LOCK_BITSTREAM &lockBitstreamData)
+    {
+        onBitstream((uint8_t *)lockBitstreamData.bitstreamBufferPtr, lockBitstreamData.bitstreamSizeInBytes);
+    });
+}
+
+NV_ENC_REGISTERED_PTR NvEncoder::RegisterExternalInput(void *pBuffer, NV_ENC_INPUT_RESOURCE_TYPE eResourceType, int pitch)
+{
+    return RegisterResource(pBuffer, eResourceType, m_nMaxEncodeWidth, m_nMaxEncodeHeight, pitch, GetPixelFormat());
+}
+
+void NvEncoder::UnregisterExternalInput(NV_ENC_REGISTERED_PTR registeredResource)
+{
+    NVENC_API_CALL(m_nvenc.nvEncUnregisterResource(m_hEncoder, registeredResource));
+}
+
+void NvEncoder::EncodeRegisteredFrameRaw(NV_ENC_REGISTERED_PTR registeredResource, const BitstreamCallback &onBitstream,
+    NV_ENC_PIC_PARAMS *pPicParams)
+{
+    SubmitFrameRaw(registeredResource, pPicParams);
+    LockEncodedPackets(m_vBitstreamOutputBuffer, false, [&](const NV_ENC_LOCK_BITSTREAM &lockBitstreamData)
+    {
+        onBitstream((uint8_t *)lockBitstreamData.bitstreamBufferPtr, lockBitstreamData.bitstreamSizeInBytes);
+    });
+}
+
+void NvEncoder::SubmitFrameRaw(NV_ENC_REGISTERED_PTR registeredResource, NV_ENC_PIC_PARAMS *pPicParams)
+{
+    if (!registeredResource)
+    {
+        SubmitFrame(pPicParams);
+        return;
+    }
+
     if (!IsHWEncoderInitialized())
     {
         NVENC_THROW_ERROR("Encoder device not found", NV_ENC_ERR_NO_ENCODE_DEVICE);
@@ -478,21 +543,101 @@ void NvEncoder::EncodeFrame(std::vector<std::vector<uint8_t>> &vPacket, NV_ENC_P
 
     int bfrIdx = m_iToSend % m_nEncoderBuffer;
 
-    MapResources(bfrIdx);
+    // Unmapped when the frame is retrieved, like the buffers of GetNextInputFrame()
+    NV_ENC_MAP_INPUT_RESOURCE mapInputResource = { NV_ENC_MAP_INPUT_RESOURCE_VER };
+    mapInputResource.registeredResource = registeredResource;
+    NVENC_API_CALL(m_nvenc.nvEncMapInputResource(m_hEncoder, &mapInputResource));
+    m_vMappedInputBuffers[bfrIdx] = mapInputResource.mappedResource;
 
     NVENCSTATUS nvStatus = DoEncode(m_vMappedInputBuffers[bfrIdx], m_vBitstreamOutputBuffer[bfrIdx], pPicParams);
 
     if (nvStatus == NV_ENC_SUCCESS || nvStatus == NV_ENC_ERR_NEED_MORE_INPUT)
     {
         m_iToSend++;
-        GetEncodedPacket(m_vBitstreamOutputBuffer, vPacket, true);
     }
     else
     {
+        m_nvenc.nvEncUnmapInputResource(m_hEncoder, m_vMappedInputBuffers[bfrIdx]);
+        m_vMappedInputBuffers[bfrIdx] = nullptr;
         NVENC_THROW_ERROR("nvEncEncodePicture API failed", nvStatus);
     }
 }
 
+void NvEncoder::RetrieveFrameRaw(const BitstreamCallback &onBitstream)
+{
+    // Advanced first, so that a failed frame is not waited for again
+    const int bfrIdx = m_iGot++ % m_nEncoderBuffer;
+
+    WaitForCompletionEvent(bfrIdx);
+    NV_ENC_LOCK_BITSTREAM lockBitstreamData = { NV_ENC_LOCK_BITSTREAM_VER };
+    lockBitstreamData.outputBitstream = m_vBitstreamOutputBuffer[bfrIdx];
+    lockBitstreamData.doNotWait = false;
+    NVENC_API_CALL(m_nvenc.nvEncLockBitstream(m_hEncoder, &lockBitstreamData));
+
+    m_lastFrameStats = { lockBitstreamData.frameAvgQP, lockBitstreamData.pictureType };
+    onBitstream((uint8_t *)lockBitstreamData.bitstreamBufferPtr, lockBitstreamData.bitstreamSizeInBytes);
+
+    NVENC_API_CALL(m_nvenc.nvEncUnlockBitstream(m_hEncoder, lockBitstreamData.outputBitstream));
+
+    if (m_vMappedInputBuffers[bfrIdx])
+    {
+        NVENC_API_CALL(m_nvenc.nvEncUnmapInputResource(m_hEncoder, m_vMappedInputBuffers[bfrIdx]));
+        m_vMappedInputBuffers[bfrIdx] = nullptr;
+    }
+}
+
+void NvEncoder::RetrieveFrameSlicesRaw(const SliceCallback &onSlice)
+{
+    const int bfrIdx = m_iGot++ % m_nEncoderBuffer;
+
+    uint32_t nSentSize = 0;
+    bool bFirstSlice = true;
+    while (true)
+    {
+        NV_ENC_LOCK_BITSTREAM lockBitstreamData = { NV_ENC_LOCK_BITSTREAM_VER };
+        lockBitstreamData.outputBitstream = m_vBitstreamOutputBuffer[bfrIdx];
+        lockBitstreamData.doNotWait = true;
+        NVENCSTATUS nvStatus = m_nvenc.nvEncLockBitstream(m_hEncoder, &lockBitstreamData);
+        if (nvStatus == NV_ENC_ERR_LOCK_BUSY || nvStatus == NV_ENC_ERR_ENCODER_BUSY)
+        {
+            WaitForSliceProgress(bfrIdx);
+            continue;
+        }
+        if (nvStatus != NV_ENC_SUCCESS)
+        {
+            NVENC_THROW_ERROR("nvEncLockBitstream API failed", nvStatus);
+        }
+
+        // The status becomes 2 once the whole picture is written
+        bool bLastSlice = lockBitstreamData.hwEncodeStatus == 2;
+        uint32_t nSize = lockBitstreamData.bitstreamSizeInBytes;
+        if (bLastSlice)
+        {
+            m_lastFrameStats = { lockBitstreamData.frameAvgQP, lockBitstreamData.pictureType };
+        }
+        if (nSize > nSentSize || bLastSlice)
+        {
+            onSlice((uint8_t *)lockBitstreamData.bitstreamBufferPtr + nSentSize, nSize - nSentSize, bFirstSlice, bLastSlice);
+            bFirstSlice = false;
+            nSentSize = nSize;
+        }
+
+        NVENC_API_CALL(m_nvenc.nvEncUnlockBitstream(m_hEncoder, lockBitstreamData.outputBitstream));
+
+        if (bLastSlice)
+        {
+            break;
+        }
+        WaitForSliceProgress(bfrIdx);
+    }
+
+    if (m_vMappedInputBuffers[bfrIdx])
+    {
+        NVENC_API_CALL(m_nvenc.nvEncUnmapInputResource(m_hEncoder, m_vMappedInputBuffers[bfrIdx]));
+        m_vMappedInputBuffers[bfrIdx] = nullptr;
+    }
+}
+
 void NvEncoder::RunMotionEstimation(std::vector<uint8_t> &mvData)
 {
     if (!m_hEncoder)
@@ -584,22 +729,15 @@ void NvEncoder::EndEncode(std::vector<std::vector<uint8_t>> &vPacket)
 void NvEncoder::GetEncodedPacket(std::vector<NV_ENC_OUTPUT_PTR> &vOutputBuffer, std::vector<std::vector<uint8_t>> &vPacket, bool bOutputDelay)
 {
     unsigned i = 0;
-    int iEnd = bOutputDelay ? m_iToSend - m_nOutputDelay : m_iToSend;
-    for (; m_iGot < iEnd; m_iGot++)
+    LockEncodedPackets(vOutputBuffer, bOutputDelay, [&](const NV_ENC_LOCK_BITSTREAM &lockBitstreamData)
     {
-        WaitForCompletionEvent(m_iGot % m_nEncoderBuffer);
-        NV_ENC_LOCK_BITSTREAM lockBitstreamData = { NV_ENC_LOCK_BITSTREAM_VER };
-        lockBitstreamData.outputBitstream = vOutputBuffer[m_iGot % m_nEncoderBuffer];
-        lockBitstreamData.doNotWait = false;
-        NVENC_API_CALL(m_nvenc.nvEncLockBitstream(m_hEncoder, &lockBitstreamData));
-  
         uint8_t *pData = (uint8_t *)lockBitstreamData.bitstreamBufferPtr;
         if (vPacket.size() < i + 1)
         {
             vPacket.push_back(std::vector<uint8_t>());
         }
         vPacket[i].clear();
-       
+
         if ((m_initializeParams.encodeGUID == NV_ENC_CODEC_AV1_GUID) && (m_bUseIVFContainer))
         {
             if (m_bWriteIVFFileHeader)
@@ -611,8 +749,24 @@ void NvEncoder::GetEncodedPacket(std::vector<NV_ENC_OUTPUT_PTR> &vOutputBuffer,
             m_IVFUtils.WriteFrameHeader(vPacket[i], lockBitstreamData.bitstreamSizeInBytes, lockBitstreamData.outputTimeStamp);
         }
         vPacket[i].insert(vPacket[i].end(), &pData[0], &pData[lockBitstreamData.bitstreamSizeInBytes]);
-        
+
         i++;
+    });
+}
+
+void NvEncoder::LockEncodedPackets(std::vector<NV_ENC_OUTPUT_PTR> &vOutputBuffer, bool bOutputDelay, const std::function<void(const NV_ENC_LOCK_BITSTREAM &)> &onLocked)
+{
+    int iEnd = bOutputDelay ? m_iToSend - m_nOutputDelay : m_iToSend;
+    for (; m_iGot < iEnd; m_iGot++)
+    {
+        WaitForCompletionEvent(m_iGot % m_nEncoderBuffer);
+        NV_ENC_LOCK_BITSTREAM lockBitstreamData = { NV_ENC_LOCK_BITSTREAM_VER };
+        lockBitstreamData.outputBitstream = vOutputBuffer[m_iGot % m_nEncoderBuffer];
+        lockBitstreamData.doNotWait = false;
+        NVENC_API_CALL(m_nvenc.nvEncLockBitstream(m_hEncoder, &lockBitstreamData));
+
+        m_lastFrameStats = { lockBitstreamData.frameAvgQP, lockBitstreamData.pictureType };
+        onLocked(lockBitstreamData);
 
         NVENC_API_CALL(m_nvenc.nvEncUnlockBitstream(m_hEncoder, lockBitstreamData.outputBitstream));
 
@@ -648,6 +802,11 @@ bool NvEncoder::Reconfigure(const NV_ENC_RECONFIGURE_PARAMS *pReconfigureParams)
     return true;
 }
 
+void NvEncoder::InvalidateRefFrame(uint64_t inputTimeStamp)
+{
+    NVENC_API_CALL(m_nvenc.nvEncInvalidateRefFrames(m_hEncoder, inputTimeStamp));
+}
+
 NV_ENC_REGISTERED_PTR NvEncoder::RegisterResource(void *pBuffer, NV_ENC_INPUT_RESOURCE_TYPE eResourceType,
     int width, int height, int pitch, NV_ENC_BUFFER_FORMAT bufferFormat, NV_ENC_BUFFER_USAGE bufferUsage, 
     NV_ENC_FENCE_POINT_D3D12* pInputFencePoint)
@@ -792,6 +951,20 @@ void NvEncoder::WaitForCompletionEvent(int iEvent)
 #endif
 }
 
+void NvEncoder::WaitForSliceProgress(int iEvent)
+{
+#if defined(_WIN32)
+    if (m_initializeParams.enableEncodeAsync && iEvent < (int)m_vpCompletionEvent.size())
+    {
+        // Signaled once the whole frame is written, the timeout paces the polls of the slices
+        // before that
+        WaitForSingleObject(m_vpCompletionEvent[iEvent], 1);
+        return;
+    }
+#endif
+    std::this_thread::yield();
+}
+
 uint32_t NvEncoder::GetWidthInBytes(const NV_ENC_BUFFER_FORMAT bufferFormat, const uint32_t width)
 {
     switch (bufferFormat) {
@@ -12,6 +12,7 @@
 #pragma once
 
 #include <vector>
+#include <functional>
 #include "alvr_server/nvEncodeAPI.h"
 #include <stdint.h>
 #include <mutex>
@@ -19,6 +20,7 @@
 #include <iostream>
 #include <sstream>
 #include <string.h>
+#include <thread>
 #include "NvCodecUtils.h"
 
 /**
@@ -109,6 +111,13 @@ public:
     */
     bool Reconfigure(const NV_ENC_RECONFIGURE_PARAMS *pReconfigureParams);
 
+    /**
+    *  @brief  This function is used to invalidate a reference frame, identified by the
+    *  NV_ENC_PIC_PARAMS::inputTimeStamp it was encoded with. Frames predicted from it
+    *  are invalidated too, and the encoder falls back on older reference frames.
+    */
+    void InvalidateRefFrame(uint64_t inputTimeStamp);
+
     /**
     *  @brief  This function is used to get the next available input buffer.
     *  Applications must call this function to obtain a pointer to the next
@@ -126,6 +135,84 @@ public:
     */
     virtual void EncodeFrame(std::vector<std::vector<uint8_t>> &vPacket, NV_ENC_PIC_PARAMS *pPicParams = nullptr);
 
+    /**
+    *  @brief  Called with each output bitstream while it is locked.
+    *  The data may be modified in place and must not be used after returning.
+    */
+    typedef std::function<void(uint8_t *pData, uint32_t nSize)> BitstreamCallback;
+
+    /**
+    *  @brief  This function is used to encode a frame without copying the output.
+    *  Same as EncodeFrame(), but the raw bitstream is passed to the callback
+    *  straight from the locked output buffer, without any IVF container. The
+    *  output is not delayed, all the submitted frames are retrieved.
+    */
+    void EncodeFrameRaw(const BitstreamCallback &onBitstream, NV_ENC_PIC_PARAMS *pPicParams = nullptr);
+
+    /**
+    *  @brief  This function is used to register an application owned buffer as encoder input.
+    *  The buffer must have the maximum encode dimensions and the pixel format of the
+    *  encoder. It can then be encoded without a copy with EncodeRegisteredFrameRaw().
+    *  The pitch is only needed for buffers without one of their own, like CUDA device pointers.
+    */
+    NV_ENC_REGISTERED_PTR RegisterExternalInput(void *pBuffer, NV_ENC_INPUT_RESOURCE_TYPE eResourceType, int pitch = 0);
+
+    /**
+    *  @brief  This function is used to unregister a buffer registered with RegisterExternalInput().
+    *  It must be called before the encoder is destroyed.
+    */
+    void UnregisterExternalInput(NV_ENC_REGISTERED_PTR registeredResource);
+
+    /**
+    *  @brief  This function is used to encode a registered application buffer.
+    *  Same as EncodeFrameRaw(), but the buffer is mapped as input instead of the
+    *  buffer returned by GetNextInputFrame().
+    */
+    void EncodeRegisteredFrameRaw(NV_ENC_REGISTERED_PTR registeredResource, const BitstreamCallback &onBitstream,
+        NV_ENC_PIC_PARAMS *pPicParams = nullptr);
+
+    /**
+    *  @brief  This function is used to submit a frame in async mode without waiting for it.
+    *  The input is registeredResource, or the buffer of GetNextInputFrame() if it is null.
+    *  At most GetEncoderBufferCount() frames can be submitted and not yet retrieved.
+    */
+    void SubmitFrameRaw(NV_ENC_REGISTERED_PTR registeredResource, NV_ENC_PIC_PARAMS *pPicParams = nullptr);
+
+    /**
+    *  @brief  This function is used to retrieve the oldest frame submitted with SubmitFrameRaw().
+    *  It waits for the completion event of the frame and passes its locked bitstream to the
+    *  callback. It may be called from another thread than the submission.
+    */
+    void RetrieveFrameRaw(const BitstreamCallback &onBitstream);
+
+    /**
+    *  @brief  Called with the part of a bitstream written since the previous call. lastSlice
+    *  is set once the frame is complete, possibly with no new data.
+    */
+    typedef std::function<void(uint8_t *pData, uint32_t nSize, bool firstSlice, bool lastSlice)> SliceCallback;
+
+    /**
+    *  @brief  This function is used to retrieve the oldest frame submitted with SubmitFrameRaw()
+    *  slice by slice, with enableSubFrameWrite set. The bitstream is polled and each newly
+    *  written part is passed to the callback while the rest is still encoded.
+    */
+    void RetrieveFrameSlicesRaw(const SliceCallback &onSlice);
+
+    /**
+    *  @brief  Statistics of a frame, from its locked bitstream.
+    */
+    struct FrameStats
+    {
+        uint32_t averageQp = 0;
+        NV_ENC_PIC_TYPE pictureType = NV_ENC_PIC_TYPE_UNKNOWN;
+    };
+
+    /**
+    *  @brief  This function returns the statistics of the frame whose bitstream was locked last.
+    *  They are updated before the bitstream or the last slice is passed to the callback.
+    */
+    const FrameStats &GetLastFrameStats() const { return m_lastFrameStats; }
+
     /**
     *  @brief  This function to flush the encoder queue.
     *  The encoder might be queuing frames for B picture encoding or lookahead;
@@ -334,6 +421,12 @@ protected:
     */
     void WaitForCompletionEvent(int iEvent);
 
+    /**
+    *  @brief This function is used between two polls of a frame read back slice by slice. In async
+    *  mode it returns as soon as the frame is complete, otherwise it only yields.
+    */
+    void WaitForSliceProgress(int iEvent);
+
     /**
     *  @brief This function is used to send EOS to HW encoder.
     */
@@ -361,6 +454,17 @@ private:
     */
     void GetEncodedPacket(std::vector<NV_ENC_OUTPUT_PTR> &vOutputBuffer, std::vector<std::vector<uint8_t>> &vPacket, bool bOutputDelay);
 
+    /**
+    *  @brief This is a private function which locks the available output
+    *         bitstreams one by one and passes them to the callback.
+    */
+    void LockEncodedPackets(std::vector<NV_ENC_OUTPUT_PTR> &vOutputBuffer, bool bOutputDelay, const std::function<void(const NV_ENC_LOCK_BITSTREAM &)> &onLocked);
+
+    /**
+    *  @brief This is a private function which submits a frame to the encoder HW.
+    */
+    void SubmitFrame(NV_ENC_PIC_PARAMS *pPicParams);
+
     /**
     *  @brief This is a private function which is used to initialize the bitstream buffers.
     *  This is only used in the encoding mode.
@@ -425,6 +529,7 @@ protected:
 
     int32_t m_iToSend = 0;
     int32_t m_iGot = 0;
+    FrameStats m_lastFrameStats;
     int32_t m_nEncoderBuffer = 0;
     int32_t m_nOutputDelay = 0;
     IVFUtils m_IVFUtils;
@@ -6,12 +6,69 @@ static COMPRESS_AXIS_ALIGNED_CSO: &[u8] =
 static COLOR_CORRECTION_CSO: &[u8] =
     include_bytes!("../cpp/platform/win32/ColorCorrectionPixelShader.cso");
 static RGBTOYUV420_CSO: &[u8] = include_bytes!("../cpp/platform/win32/rgbtoyuv420.cso");
+// Compiled by build.rs, empty if fxc is not available
+static FRAME_RENDER_PS_LINEAR_CSO: &[u8] =
+    include_bytes!(concat!(env!("OUT_DIR"), "/FrameRenderPS_linear.cso"));
+static COLOR_CORRECTION_NO_SHARPENING_CSO: &[u8] = include_bytes!(concat!(
+    env!("OUT_DIR"),
+    "/ColorCorrectionPixelShader_no_sharpening.cso"
+));
+static COLOR_CORRECTION_LUT_CSO: &[u8] = include_bytes!(concat!(
+    env!("OUT_DIR"),
+    "/ColorCorrectionPixelShader_lut.cso"
+));
+static COMPRESS_AXIS_ALIGNED_LUT_CSO: &[u8] = include_bytes!(concat!(
+    env!("OUT_DIR"),
+    "/CompressAxisAlignedPixelShader_lut.cso"
+));
+static FRAME_RENDER_VS_FOVEATED_CSO: &[u8] =
+    include_bytes!(concat!(env!("OUT_DIR"), "/FrameRenderVS_foveated.cso"));
+static FRAME_RENDER_PS_FOVEATED_CSO: &[u8] =
+    include_bytes!(concat!(env!("OUT_DIR"), "/FrameRenderPS_foveated.cso"));
+static FRAME_RENDER_PS_FOVEATED_LINEAR_CSO: &[u8] = include_bytes!(concat!(
+    env!("OUT_DIR"),
+    "/FrameRenderPS_foveated_linear.cso"
+));
+static DEPTH_PLANE_CSO: &[u8] = include_bytes!(concat!(env!("OUT_DIR"), "/DepthPlaneCS.cso"));
 
 static QUAD_SHADER_COMP_SPV: &[u8] = include_bytes!("../cpp/platform/linux/shader/quad.comp.spv");
 static COLOR_SHADER_COMP_SPV: &[u8] = include_bytes!("../cpp/platform/linux/shader/color.comp.spv");
-static FFR_SHADER_COMP_SPV: &[u8] = include_bytes!("../cpp/platform/linux/shader/ffr.comp.spv");
 static RGBTOYUV420_SHADER_COMP_SPV: &[u8] =
     include_bytes!("../cpp/platform/linux/shader/rgbtoyuv420.comp.spv");
+// Compiled by build.rs, empty if glslangValidator is not available
+static COMPOSE_SHADER_COMP_SPV: &[u8] =
+    include_bytes!(concat!(env!("OUT_DIR"), "/compose.comp.spv"));
+static FFR_SHADER_COMP_SPV: &[u8] = include_bytes!(concat!(env!("OUT_DIR"), "/ffr.comp.spv"));
+static DOWNSCALE_SHADER_COMP_SPV: &[u8] =
+    include_bytes!(concat!(env!("OUT_DIR"), "/downscale.comp.spv"));
+static MASK_SHADER_COMP_SPV: &[u8] = include_bytes!(concat!(env!("OUT_DIR"), "/mask.comp.spv"));
+static DENOISE_SHADER_COMP_SPV: &[u8] =
+    include_bytes!(concat!(env!("OUT_DIR"), "/denoise.comp.spv"));
+static REPROJECT_SHADER_COMP_SPV: &[u8] =
+    include_bytes!(concat!(env!("OUT_DIR"), "/reproject.comp.spv"));
+static SCALE_YUV420_SHADER_COMP_SPV: &[u8] =
+    include_bytes!(concat!(env!("OUT_DIR"), "/scale_yuv420.comp.spv"));
+static RGBTONV12_SHADER_COMP_SPV: &[u8] =
+    include_bytes!(concat!(env!("OUT_DIR"), "/rgbtonv12.comp.spv"));
+// For 10 bit outputs, also empty if glslangValidator is not available
+static QUAD_10BIT_SHADER_COMP_SPV: &[u8] =
+    include_bytes!(concat!(env!("OUT_DIR"), "/quad_10bit.comp.spv"));
+static COMPOSE_10BIT_SHADER_COMP_SPV: &[u8] =
+    include_bytes!(concat!(env!("OUT_DIR"), "/compose_10bit.comp.spv"));
+static DOWNSCALE_10BIT_SHADER_COMP_SPV: &[u8] =
+    include_bytes!(concat!(env!("OUT_DIR"), "/downscale_10bit.comp.spv"));
+static RGBTOYUV420_10BIT_SHADER_COMP_SPV: &[u8] =
+    include_bytes!(concat!(env!("OUT_DIR"), "/rgbtoyuv420_10bit.comp.spv"));
+static SCALE_YUV420_10BIT_SHADER_COMP_SPV: &[u8] =
+    include_bytes!(concat!(env!("OUT_DIR"), "/scale_yuv420_10bit.comp.spv"));
+// Writing host allocated planes, also empty if glslangValidator is not available
+static RGBTOYUV420_HOST_SHADER_COMP_SPV: &[u8] =
+    include_bytes!(concat!(env!("OUT_DIR"), "/rgbtoyuv420_host.comp.spv"));
+// With the color math in half precision, also empty if glslangValidator is not available
+static COLOR_FP16_SHADER_COMP_SPV: &[u8] =
+    include_bytes!(concat!(env!("OUT_DIR"), "/color_fp16.comp.spv"));
+static COMPOSE_FP16_SHADER_COMP_SPV: &[u8] =
+    include_bytes!(concat!(env!("OUT_DIR"), "/compose_fp16.comp.spv"));
 
 pub fn initialize_shaders() {
     unsafe {
@@ -27,6 +84,25 @@ pub fn initialize_shaders() {
         crate::COLOR_CORRECTION_CSO_LEN = COLOR_CORRECTION_CSO.len() as _;
         crate::RGBTOYUV420_CSO_PTR = RGBTOYUV420_CSO.as_ptr();
         crate::RGBTOYUV420_CSO_LEN = RGBTOYUV420_CSO.len() as _;
+        crate::FRAME_RENDER_PS_LINEAR_CSO_PTR = FRAME_RENDER_PS_LINEAR_CSO.as_ptr();
+        crate::FRAME_RENDER_PS_LINEAR_CSO_LEN = FRAME_RENDER_PS_LINEAR_CSO.len() as _;
+        crate::COLOR_CORRECTION_NO_SHARPENING_CSO_PTR = COLOR_CORRECTION_NO_SHARPENING_CSO.as_ptr();
+        crate::COLOR_CORRECTION_NO_SHARPENING_CSO_LEN =
+            COLOR_CORRECTION_NO_SHARPENING_CSO.len() as _;
+        crate::COLOR_CORRECTION_LUT_CSO_PTR = COLOR_CORRECTION_LUT_CSO.as_ptr();
+        crate::COLOR_CORRECTION_LUT_CSO_LEN = COLOR_CORRECTION_LUT_CSO.len() as _;
+        crate::COMPRESS_AXIS_ALIGNED_LUT_CSO_PTR = COMPRESS_AXIS_ALIGNED_LUT_CSO.as_ptr();
+        crate::COMPRESS_AXIS_ALIGNED_LUT_CSO_LEN = COMPRESS_AXIS_ALIGNED_LUT_CSO.len() as _;
+        crate::FRAME_RENDER_VS_FOVEATED_CSO_PTR = FRAME_RENDER_VS_FOVEATED_CSO.as_ptr();
+        crate::FRAME_RENDER_VS_FOVEATED_CSO_LEN = FRAME_RENDER_VS_FOVEATED_CSO.len() as _;
+        crate::FRAME_RENDER_PS_FOVEATED_CSO_PTR = FRAME_RENDER_PS_FOVEATED_CSO.as_ptr();
+        crate::FRAME_RENDER_PS_FOVEATED_CSO_LEN = FRAME_RENDER_PS_FOVEATED_CSO.len() as _;
+        crate::FRAME_RENDER_PS_FOVEATED_LINEAR_CSO_PTR =
+            FRAME_RENDER_PS_FOVEATED_LINEAR_CSO.as_ptr();
+        crate::FRAME_RENDER_PS_FOVEATED_LINEAR_CSO_LEN =
+            FRAME_RENDER_PS_FOVEATED_LINEAR_CSO.len() as _;
+        crate::DEPTH_PLANE_CSO_PTR = DEPTH_PLANE_CSO.as_ptr();
+        crate::DEPTH_PLANE_CSO_LEN = DEPTH_PLANE_CSO.len() as _;
         crate::QUAD_SHADER_COMP_SPV_PTR = QUAD_SHADER_COMP_SPV.as_ptr();
         crate::QUAD_SHADER_COMP_SPV_LEN = QUAD_SHADER_COMP_SPV.len() as _;
         crate::COLOR_SHADER_COMP_SPV_PTR = COLOR_SHADER_COMP_SPV.as_ptr();
@@ -35,5 +111,36 @@ pub fn initialize_shaders() {
         crate::FFR_SHADER_COMP_SPV_LEN = FFR_SHADER_COMP_SPV.len() as _;
         crate::RGBTOYUV420_SHADER_COMP_SPV_PTR = RGBTOYUV420_SHADER_COMP_SPV.as_ptr();
         crate::RGBTOYUV420_SHADER_COMP_SPV_LEN = RGBTOYUV420_SHADER_COMP_SPV.len() as _;
+        crate::COMPOSE_SHADER_COMP_SPV_PTR = COMPOSE_SHADER_COMP_SPV.as_ptr();
+        crate::COMPOSE_SHADER_COMP_SPV_LEN = COMPOSE_SHADER_COMP_SPV.len() as _;
+        crate::DOWNSCALE_SHADER_COMP_SPV_PTR = DOWNSCALE_SHADER_COMP_SPV.as_ptr();
+        crate::DOWNSCALE_SHADER_COMP_SPV_LEN = DOWNSCALE_SHADER_COMP_SPV.len() as _;
+        crate::MASK_SHADER_COMP_SPV_PTR = MASK_SHADER_COMP_SPV.as_ptr();
+        crate::MASK_SHADER_COMP_SPV_LEN = MASK_SHADER_COMP_SPV.len() as _;
+        crate::DENOISE_SHADER_COMP_SPV_PTR = DENOISE_SHADER_COMP_SPV.as_ptr();
+        crate::DENOISE_SHADER_COMP_SPV_LEN = DENOISE_SHADER_COMP_SPV.len() as _;
+        crate::REPROJECT_SHADER_COMP_SPV_PTR = REPROJECT_SHADER_COMP_SPV.as_ptr();
+        crate::REPROJECT_SHADER_COMP_SPV_LEN = REPROJECT_SHADER_COMP_SPV.len() as _;
+        crate::SCALE_YUV420_SHADER_COMP_SPV_PTR = SCALE_YUV420_SHADER_COMP_SPV.as_ptr();
+        crate::SCALE_YUV420_SHADER_COMP_SPV_LEN = SCALE_YUV420_SHADER_COMP_SPV.len() as _;
+        crate::RGBTONV12_SHADER_COMP_SPV_PTR = RGBTONV12_SHADER_COMP_SPV.as_ptr();
+        crate::RGBTONV12_SHADER_COMP_SPV_LEN = RGBTONV12_SHADER_COMP_SPV.len() as _;
+        crate::QUAD_10BIT_SHADER_COMP_SPV_PTR = QUAD_10BIT_SHADER_COMP_SPV.as_ptr();
+        crate::QUAD_10BIT_SHADER_COMP_SPV_LEN = QUAD_10BIT_SHADER_COMP_SPV.len() as _;
+        crate::COMPOSE_10BIT_SHADER_COMP_SPV_PTR = COMPOSE_10BIT_SHADER_COMP_SPV.as_ptr();
+        crate::COMPOSE_10BIT_SHADER_COMP_SPV_LEN = COMPOSE_10BIT_SHADER_COMP_SPV.len() as _;
+        crate::DOWNSCALE_10BIT_SHADER_COMP_SPV_PTR = DOWNSCALE_10BIT_SHADER_COMP_SPV.as_ptr();
+        crate::DOWNSCALE_10BIT_SHADER_COMP_SPV_LEN = DOWNSCALE_10BIT_SHADER_COMP_SPV.len() as _;
+        crate::RGBTOYUV420_10BIT_SHADER_COMP_SPV_PTR = RGBTOYUV420_10BIT_SHADER_COMP_SPV.as_ptr();
+        crate::RGBTOYUV420_10BIT_SHADER_COMP_SPV_LEN = RGBTOYUV420_10BIT_SHADER_COMP_SPV.len() as _;
+        crate::SCALE_YUV420_10BIT_SHADER_COMP_SPV_PTR = SCALE_YUV420_10BIT_SHADER_COMP_SPV.as_ptr();
+        crate::SCALE_YUV420_10BIT_SHADER_COMP_SPV_LEN =
+            SCALE_YUV420_10BIT_SHADER_COMP_SPV.len() as _;
+        crate::RGBTOYUV420_HOST_SHADER_COMP_SPV_PTR = RGBTOYUV420_HOST_SHADER_COMP_SPV.as_ptr();
+        crate::RGBTOYUV420_HOST_SHADER_COMP_SPV_LEN = RGBTOYUV420_HOST_SHADER_COMP_SPV.len() as _;
+        crate::COLOR_FP16_SHADER_COMP_SPV_PTR = COLOR_FP16_SHADER_COMP_SPV.as_ptr();
+        crate::COLOR_FP16_SHADER_COMP_SPV_LEN = COLOR_FP16_SHADER_COMP_SPV.len() as _;
+        crate::COMPOSE_FP16_SHADER_COMP_SPV_PTR = COMPOSE_FP16_SHADER_COMP_SPV.as_ptr();
+        crate::COMPOSE_FP16_SHADER_COMP_SPV_LEN = COMPOSE_FP16_SHADER_COMP_SPV.len() as _;
     }
 }
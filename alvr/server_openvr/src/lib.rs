@@ -17,33 +17,46 @@ use bindings::*;
 use alvr_common::{
     BUTTON_INFO, HAND_LEFT_ID, HAND_RIGHT_ID, HAND_TRACKER_LEFT_ID, HAND_TRACKER_RIGHT_ID, HEAD_ID,
     Pose, ViewParams, error,
+    glam::Vec2,
+    info,
     parking_lot::{Mutex, RwLock},
     settings_schema::Switch,
     warn,
 };
 use alvr_filesystem as afs;
-use alvr_packets::{ButtonValue, Haptics};
+use alvr_packets::{ButtonValue, DepthPlaneHeader, Haptics};
 use alvr_server_core::{
-    HandType, ServerCoreContext, ServerCoreEvent, ServerNegotiatedStreamingConfig,
+    EncodedFrameStats, EncodedFrameType, HandType, LockStats, PresentPacingStats,
+    ServerCoreContext, ServerCoreEvent, ServerNegotiatedStreamingConfig,
 };
 use alvr_session::{
-    BodyTrackingSinkConfig, CodecType, ControllersConfig, ControllersEmulationMode,
+    ApplicationProfile, BodyTrackingSinkConfig, CodecType, ControllersConfig,
+    ControllersEmulationMode, EncoderQualityPreset, EncoderQualityPresetNvidia, FoveationShape,
+    NvencMultiPass,
 };
 use std::{
     collections::VecDeque,
-    ffi::{CString, OsStr, c_char, c_void},
-    ptr,
+    ffi::{CStr, CString, OsStr, c_char, c_void},
+    mem, ptr,
     sync::{Once, mpsc},
     thread,
     time::{Duration, Instant},
 };
 
+// The bitrate manager decides when parameters change, this only bounds how late encoders see them
+const ENCODER_PARAMS_PUSH_INTERVAL: Duration = Duration::from_millis(5);
+
 static SERVER_CORE_CONTEXT: RwLock<Option<ServerCoreContext>> = RwLock::new(None);
 static LOCAL_VIEW_PARAMS: RwLock<[ViewParams; 2]> = RwLock::new([ViewParams::DUMMY; 2]);
-static HEAD_POSE_QUEUE: Mutex<VecDeque<(Duration, Pose)>> = Mutex::new(VecDeque::new());
+// Head pose and foveation center shift of each target timestamp
+static HEAD_POSE_QUEUE: Mutex<VecDeque<(Duration, Pose, [Vec2; 2])>> = Mutex::new(VecDeque::new());
+// Slices of the frame currently being received through VideoSendSlice
+static PENDING_VIDEO_FRAME: Mutex<Vec<u8>> = Mutex::new(Vec::new());
 static EVENT_LOOP_HANDLE: Mutex<Option<thread::JoinHandle<()>>> = Mutex::new(None);
 static IDLE_INIT_HANDLE: Mutex<Option<thread::JoinHandle<()>>> = Mutex::new(None);
 static FACTORY_INIT_DATA: Mutex<Option<FactoryInitData>> = Mutex::new(None);
+// Profile of the game whose swapchain connected last, applied on top of the settings
+static APPLICATION_PROFILE: Mutex<Option<ApplicationProfile>> = Mutex::new(None);
 
 struct FactoryInitData {
     filesystem_layout: afs::Layout,
@@ -105,6 +118,10 @@ fn make_settings(negotiated: Option<&ServerNegotiatedStreamingConfig>) -> Settin
         fov_center_shift_y,
         fov_edge_ratio_x,
         fov_edge_ratio_y,
+        fov_radial,
+        fov_follow_gaze,
+        fov_periphery_qp_offset,
+        fov_periphery_target_qp,
     ) = if let Switch::Enabled(config) = &video.foveated_encoding {
         (
             config.center_size_x,
@@ -113,9 +130,19 @@ fn make_settings(negotiated: Option<&ServerNegotiatedStreamingConfig>) -> Settin
             config.center_shift_y,
             config.edge_ratio_x,
             config.edge_ratio_y,
+            match config.shape {
+                FoveationShape::AxisAligned => None,
+                FoveationShape::Radial {
+                    center_radius,
+                    edge_ratio,
+                } => Some((center_radius, edge_ratio)),
+            },
+            config.follow_eye_gaze,
+            config.periphery_qp_offset.as_option().copied().unwrap_or(0),
+            config.periphery_target_qp.as_option().copied().unwrap_or(0),
         )
     } else {
-        (0.0, 0.0, 0.0, 0.0, 0.0, 0.0)
+        (0.0, 0.0, 0.0, 0.0, 0.0, 0.0, None, false, 0, 0)
     };
 
     let (enable_color_correction, brightness, contrast, saturation, gamma, sharpening) =
@@ -132,6 +159,20 @@ fn make_settings(negotiated: Option<&ServerNegotiatedStreamingConfig>) -> Settin
             (false, 0.0, 0.0, 0.0, 0.0, 0.0)
         };
 
+    let (temporal_denoise_strength, temporal_denoise_tolerance) =
+        if let Switch::Enabled(config) = &video.temporal_denoise {
+            (config.strength, config.tolerance)
+        } else {
+            (0.0, 0.0)
+        };
+
+    let (secondary_stream_height, secondary_stream_bitrate_mbps) =
+        if let Switch::Enabled(config) = &settings.extra.capture.secondary_video_stream {
+            (config.height, config.bitrate_mbps)
+        } else {
+            (0, 0)
+        };
+
     // Resolution and refresh rate come from negotiation; fall back to persisted steamvr_hmd_init_config.
     let (render_width, render_height, target_width, target_height, refresh_rate) =
         if let Some(n) = negotiated {
@@ -174,13 +215,23 @@ fn make_settings(negotiated: Option<&ServerNegotiatedStreamingConfig>) -> Settin
         (false, 0, 0, false, 0.0, false)
     };
 
-    Settings {
+    let mut ffi_settings = Settings {
         m_refreshRate: refresh_rate,
         m_renderWidth: render_width,
         m_renderHeight: render_height,
         m_recommendedTargetWidth: target_width as i32,
         m_recommendedTargetHeight: target_height as i32,
+        m_dynamicResolutionMinScale: video
+            .dynamic_game_resolution
+            .as_option()
+            .copied()
+            .unwrap_or(1.0),
         m_nAdapterIndex: video.adapter_index as i32,
+        m_nEncodeAdapterIndex: video
+            .encode_adapter_index
+            .as_option()
+            .map(|index| *index as i32)
+            .unwrap_or(-1),
         m_captureFrameDir: capture_frame_dir,
         m_enableFoveatedEncoding: enable_foveated_encoding,
         m_foveationCenterSizeX: fov_center_size_x,
@@ -189,17 +240,32 @@ fn make_settings(negotiated: Option<&ServerNegotiatedStreamingConfig>) -> Settin
         m_foveationCenterShiftY: fov_center_shift_y,
         m_foveationEdgeRatioX: fov_edge_ratio_x,
         m_foveationEdgeRatioY: fov_edge_ratio_y,
+        m_foveationRadial: fov_radial.is_some(),
+        m_foveationCenterRadius: fov_radial.map(|(radius, _)| radius).unwrap_or(0.0),
+        m_foveationRadialEdgeRatio: fov_radial.map(|(_, ratio)| ratio).unwrap_or(0.0),
+        m_foveationFollowGaze: fov_follow_gaze,
+        m_foveatedQpOffset: fov_periphery_qp_offset,
+        m_foveatedTargetQp: fov_periphery_target_qp,
         m_enableColorCorrection: enable_color_correction,
         m_brightness: brightness,
         m_contrast: contrast,
         m_saturation: saturation,
         m_gamma: gamma,
         m_sharpening: sharpening,
+        m_hiddenAreaMaskSize: video
+            .hidden_area_mask
+            .as_option()
+            .map(|config| config.visible_size)
+            .unwrap_or(0.0),
+        m_highQualityDownscaling: video.high_quality_downscaling,
+        m_temporalDenoiseStrength: temporal_denoise_strength,
+        m_temporalDenoiseTolerance: temporal_denoise_tolerance,
         m_codec: codec,
         m_h264Profile: h264_profile,
         m_use10bitEncoder: use_10bit_encoder,
         m_encodingGamma: encoding_gamma,
         m_enableHdr: enable_hdr,
+        m_convertToYuv: enable_hdr || nvenc.yuv_input,
         m_forceHdrSrgbCorrection: hdr.force_hdr_srgb_correction,
         m_clampHdrExtendedRange: hdr.clamp_hdr_extended_range,
         m_enableAmfPreAnalysis: amf.enable_pre_analysis,
@@ -208,17 +274,69 @@ fn make_settings(negotiated: Option<&ServerNegotiatedStreamingConfig>) -> Settin
         m_useAmfPreproc: amf.use_preproc,
         m_amfPreProcSigma: amf.preproc_sigma,
         m_amfPreProcTor: amf.preproc_tor,
+        m_vplAsyncDepth: video.encoder_config.vpl.async_depth,
         m_encoderQualityPreset: video.encoder_config.quality_preset as u32,
         m_amdBitrateCorruptionFix: video.bitrate.image_corruption_fix,
         m_nvencQualityPreset: nvenc.quality_preset as u32,
         m_rateControlMode: video.encoder_config.rate_control_mode as u32,
         m_fillerData: video.encoder_config.filler_data,
+        m_slicesPerFrame: video.encoder_config.slices_per_frame.max(1),
+        m_tileColumns: video.encoder_config.tile_columns.max(1),
+        m_tileRows: video.encoder_config.tile_rows.max(1),
+        m_temporalLayers: video.encoder_config.temporal_layers.clamp(1, 3),
+        m_skipStaticFrames: video.encoder_config.skip_static_frames,
+        m_sceneChangeDetection: video.encoder_config.scene_change_detection,
+        m_dropLateFrames: video.encoder_config.drop_late_frames,
+        m_enforceServerFramePacing: video.enforce_server_frame_pacing,
+        m_gpuPriority: video.gpu_priority,
+        m_depthPlaneWidth: video.depth_plane_width.as_option().copied().unwrap_or(0),
+        m_threadScheduling: video.thread_scheduling.enabled(),
+        m_mmcssTask: video
+            .thread_scheduling
+            .as_option()
+            .map_or(0, |config| config.mmcss_task as u32),
+        m_powerSaving: video.power_saving,
+        m_reservedCores: video
+            .thread_scheduling
+            .as_option()
+            .and_then(|config| config.reserved_cores.as_option().copied())
+            .unwrap_or(0),
+        m_adaptiveQualityMinScale: video
+            .encoder_config
+            .adaptive_quality
+            .as_option()
+            .map(|config| config.min_resolution_scale)
+            .unwrap_or(0.0),
+        m_adaptiveRefreshRate: video
+            .encoder_config
+            .adaptive_quality
+            .as_option()
+            .is_some_and(|config| config.lower_refresh_rate),
+        m_overlayQpOffset: video
+            .encoder_config
+            .overlay_qp_offset
+            .as_option()
+            .copied()
+            .unwrap_or(0),
+        m_staticBlockQpOffset: video
+            .encoder_config
+            .static_block_qp_offset
+            .as_option()
+            .copied()
+            .unwrap_or(0),
         m_entropyCoding: video.encoder_config.entropy_coding as u32,
         m_forceSwEncoding: video.encoder_config.software.force_software_encoding,
         m_swThreadCount: video.encoder_config.software.thread_count,
+        m_swHevcThreadCount: video.encoder_config.software.hevc_thread_count,
+        m_swHevcSlices: video.encoder_config.software.hevc_slices.max(1),
+        m_swAv1ThreadCount: video.encoder_config.software.av1_thread_count,
+        m_swNumaPlacement: video.encoder_config.software.numa_placement,
+        m_useVulkanVideoEncoder: video.encoder_config.vulkan_video,
+        m_forceEncoderBackend: video.encoder_config.force_backend as u32,
         m_nvencTuningPreset: nvenc.tuning_preset as u32,
         m_nvencMultiPass: nvenc.multi_pass as u32,
         m_nvencAdaptiveQuantizationMode: nvenc.adaptive_quantization_mode as u32,
+        m_nvencSplitEncodeMode: nvenc.split_encode_mode as u32,
         m_nvencLowDelayKeyFrameScale: nvenc.low_delay_key_frame_scale,
         m_nvencRefreshRate: nvenc.refresh_rate,
         m_nvencEnableIntraRefresh: nvenc.enable_intra_refresh,
@@ -233,16 +351,200 @@ fn make_settings(negotiated: Option<&ServerNegotiatedStreamingConfig>) -> Settin
         m_nvencRcMaxBitrate: nvenc.rc_max_bitrate,
         m_nvencRcAverageBitrate: nvenc.rc_average_bitrate,
         m_nvencEnableWeightedPrediction: nvenc.enable_weighted_prediction,
+        m_nvencHeadMotionHints: nvenc.head_motion_hints,
         m_minimumIdrIntervalMs: settings.connection.minimum_idr_interval_ms,
+        // Frames are discarded until the next IDR frame when avoiding glitches
+        m_intraRefreshRecoveryFrames: if settings.connection.avoid_video_glitching {
+            0
+        } else {
+            settings
+                .connection
+                .intra_refresh_recovery_frames
+                .as_option()
+                .copied()
+                .unwrap_or(0)
+        },
+        m_refFrameInvalidation: settings.connection.reference_frame_invalidation
+            && !settings.connection.avoid_video_glitching,
         m_enableViveTrackerProxy: settings.headset.enable_vive_tracker_proxy,
         m_trackingRefOnly: settings.headset.tracking_ref_only,
         m_enableLinuxVulkanAsyncCompute: settings.extra.patches.linux_async_compute,
         m_enableLinuxAsyncReprojection: settings.extra.patches.linux_async_reprojection,
+        m_enableLateLatching: settings.extra.patches.late_latching,
+        m_linuxEncoderOutputImages: settings.extra.patches.linux_encoder_output_images,
+        m_compactGpuMemory: settings.extra.patches.compact_gpu_memory,
+        m_vaapiShaderConversion: settings.extra.patches.linux_vaapi_shader_conversion,
+        m_secondaryStreamHeight: secondary_stream_height,
+        m_secondaryStreamBitrateMbps: secondary_stream_bitrate_mbps,
         m_enableControllers: controllers_enabled,
         m_controllerIsTracker: controller_is_tracker,
         m_enableBodyTrackingFakeVive: body_tracking_vive_enabled,
         m_bodyTrackingHasLegs: body_tracking_has_legs,
         m_useSeparateHandTrackers: use_separate_hand_trackers,
+        m_debugServerImpl: cfg!(debug_assertions)
+            && settings.extra.logging.debug_groups.server_impl,
+    };
+
+    if let Some(profile) = &*APPLICATION_PROFILE.lock() {
+        apply_application_profile(&mut ffi_settings, profile);
+    }
+    if video.power_saving {
+        apply_power_saving(&mut ffi_settings);
+    }
+
+    ffi_settings
+}
+
+// Over the settings and the application profile, the choices that cost the least power
+fn apply_power_saving(settings: &mut Settings) {
+    settings.m_threadScheduling = false;
+    settings.m_skipStaticFrames = true;
+    settings.m_encoderQualityPreset = EncoderQualityPreset::Speed as u32;
+    settings.m_nvencQualityPreset = EncoderQualityPresetNvidia::P1 as u32;
+    settings.m_nvencMultiPass = NvencMultiPass::Disabled as u32;
+    settings.m_enableAmfPreAnalysis = false;
+}
+
+// Only the fields that the encoders and the compose chain read when they are created, the C++ side
+// copies them over while the stream runs, see ApplyApplicationSettings
+fn apply_application_profile(settings: &mut Settings, profile: &ApplicationProfile) {
+    if let Some(preset) = profile.encoder_quality_preset {
+        settings.m_encoderQualityPreset = preset as u32;
+    }
+    if let Some(preset) = profile.nvenc_quality_preset {
+        settings.m_nvencQualityPreset = preset as u32;
+    }
+    if let Some(offset) = profile.foveated_qp_offset {
+        settings.m_foveatedQpOffset = offset;
+    }
+    match &profile.color_correction {
+        Some(Switch::Enabled(config)) => {
+            settings.m_enableColorCorrection = true;
+            settings.m_brightness = config.brightness;
+            settings.m_contrast = config.contrast;
+            settings.m_saturation = config.saturation;
+            settings.m_gamma = config.gamma;
+            settings.m_sharpening = config.sharpening;
+        }
+        Some(Switch::Disabled) => settings.m_enableColorCorrection = false,
+        None => (),
+    }
+}
+
+// The encoders pick up the pushed parameters at the start of their next frame
+fn push_dynamic_encoder_params() {
+    if let Some(context) = &*SERVER_CORE_CONTEXT.read()
+        && let Some(params) = context.get_dynamic_encoder_params()
+    {
+        unsafe {
+            SetDynamicEncoderParams(FfiDynamicEncoderParams {
+                updated: 1,
+                bitrate_bps: params.bitrate_bps as u64,
+                framerate: params.framerate,
+                refresh_rate: params.refresh_rate,
+                resolution_scale: params.resolution_scale,
+                max_frame_bytes: params.max_frame_bytes,
+            })
+        };
+    }
+}
+
+// Turns the timing records of the frames sent since the last call into the intervals of their
+// timelines. Intervals with an end the encoder doesn't report are left out.
+fn report_present_pacing() {
+    let mut stats = FfiPresentPacingStats::default();
+    unsafe { TakePresentPacingStats(&mut stats) };
+
+    if let Some(context) = &*SERVER_CORE_CONTEXT.read() {
+        context.report_present_pacing(&PresentPacingStats {
+            arrivals: stats.arrivals,
+            dropped: stats.dropped,
+            duplicates: stats.duplicates,
+            late: stats.late,
+            interval_buckets: stats.intervalBuckets.to_vec(),
+            interval_bucket_periods: 1.0 / PRESENT_INTERVAL_BUCKETS_PER_PERIOD as f32,
+            compositor_gpu_time_sum: Duration::from_nanos(stats.compositorGpuTimeSumNs),
+            compositor_gpu_times: stats.compositorGpuTimes,
+            compositor_gpu_bound: stats.compositorGpuBound,
+        });
+    }
+}
+
+fn report_idr_stats() {
+    let mut stats = FfiIdrStats::default();
+    unsafe { TakeIdrStats(&mut stats) };
+
+    if let Some(context) = &*SERVER_CORE_CONTEXT.read() {
+        context.report_idr_stats(stats.requested, stats.issued);
+    }
+}
+
+// Empty unless the C++ side is built with the lock-stats feature
+fn report_lock_stats() {
+    let mut stats = [FfiLockStats::default(); 32];
+    let count = unsafe { TakeLockStats(stats.as_mut_ptr(), stats.len() as i32) } as usize;
+    if count == 0 {
+        return;
+    }
+
+    if let Some(context) = &*SERVER_CORE_CONTEXT.read() {
+        let locks = stats[..count]
+            .iter()
+            .map(|lock| {
+                (
+                    unsafe { CStr::from_ptr(lock.name) }.to_str().unwrap_or("?"),
+                    LockStats {
+                        acquisitions: lock.acquisitions,
+                        contended: lock.contended,
+                        wait_buckets: lock.waitBuckets.to_vec(),
+                    },
+                )
+            })
+            .collect::<Vec<_>>();
+        context.report_lock_stats(&locks);
+    }
+}
+
+fn report_frame_timings() {
+    let mut timings = [FfiFrameTiming::default(); 32];
+    loop {
+        let count = unsafe { PopFrameTimings(timings.as_mut_ptr(), timings.len() as i32) } as usize;
+
+        if let Some(context) = &*SERVER_CORE_CONTEXT.read() {
+            for timing in &timings[..count] {
+                let intervals = [
+                    ("Game", timing.poseReceivedNs, timing.presentNs),
+                    ("Compositor queue", timing.presentNs, timing.composeBeginNs),
+                    ("Compositor", timing.composeBeginNs, timing.composeEndNs),
+                    ("Encoder queue", timing.composeEndNs, timing.encodeSubmitNs),
+                    ("Encoder", timing.encodeSubmitNs, timing.encodeCompleteNs),
+                    ("Send", timing.encodeCompleteNs, timing.lastNalSentNs),
+                    (
+                        "Pose to first NAL",
+                        timing.poseReceivedNs,
+                        timing.firstNalSentNs,
+                    ),
+                    (
+                        "Pose to last NAL",
+                        timing.poseReceivedNs,
+                        timing.lastNalSentNs,
+                    ),
+                ];
+
+                let mut latencies = Vec::with_capacity(intervals.len());
+                for (name, begin_ns, end_ns) in intervals {
+                    if begin_ns != 0 && end_ns != 0 {
+                        latencies
+                            .push((name, Duration::from_nanos(end_ns.saturating_sub(begin_ns))));
+                    }
+                }
+                context.report_frame_latencies(&latencies);
+            }
+        }
+
+        if count < timings.len() {
+            break;
+        }
     }
 }
 
@@ -253,8 +555,20 @@ fn spawn_event_loop(events_receiver: mpsc::Receiver<ServerCoreEvent>) {
         }
 
         let mut last_resync = Instant::now();
+        let mut last_encoder_params_push = Instant::now();
         loop {
-            let event = match events_receiver.recv_timeout(Duration::from_millis(5)) {
+            let event = events_receiver.recv_timeout(ENCODER_PARAMS_PUSH_INTERVAL);
+
+            if last_encoder_params_push.elapsed() >= ENCODER_PARAMS_PUSH_INTERVAL {
+                push_dynamic_encoder_params();
+                report_frame_timings();
+                report_present_pacing();
+                report_idr_stats();
+                report_lock_stats();
+                last_encoder_params_push = Instant::now();
+            }
+
+            let event = match event {
                 Ok(event) => event,
                 Err(mpsc::RecvTimeoutError::Timeout) => continue,
                 Err(mpsc::RecvTimeoutError::Disconnected) => break,
@@ -310,13 +624,20 @@ fn spawn_event_loop(events_receiver: mpsc::Receiver<ServerCoreEvent>) {
                         let target_controller_timestamp =
                             target_timestamp.saturating_sub(controllers_pose_time_offset);
 
+                        let foveation_center_shift = context
+                            .get_foveation_center_shift(poll_timestamp, *LOCAL_VIEW_PARAMS.read());
+
                         let ffi_head_motion = if let Some(motion) =
                             context.get_device_motion(*HEAD_ID, poll_timestamp)
                         {
                             let motion = motion.predict(poll_timestamp, target_timestamp);
 
                             let mut head_pose_queue_lock = HEAD_POSE_QUEUE.lock();
-                            head_pose_queue_lock.push_back((poll_timestamp, motion.pose));
+                            head_pose_queue_lock.push_back((
+                                poll_timestamp,
+                                motion.pose,
+                                foveation_center_shift,
+                            ));
                             while head_pose_queue_lock.len() > 360 {
                                 head_pose_queue_lock.pop_front();
                             }
@@ -449,6 +770,12 @@ fn spawn_event_loop(events_receiver: mpsc::Receiver<ServerCoreEvent>) {
                         // we select at runtime which device to use (selected for left and right hand
                         // independently. Selection is done by setting deviceIsConnected.
                         unsafe {
+                            SetFoveationCenter(FfiFoveationCenter {
+                                leftShiftX: foveation_center_shift[0].x,
+                                leftShiftY: foveation_center_shift[0].y,
+                                rightShiftX: foveation_center_shift[1].x,
+                                rightShiftY: foveation_center_shift[1].y,
+                            });
                             SetTracking(
                                 poll_timestamp.as_nanos() as _,
                                 controllers_pose_time_offset.as_secs_f32(),
@@ -463,26 +790,41 @@ fn spawn_event_loop(events_receiver: mpsc::Receiver<ServerCoreEvent>) {
                 }
                 ServerCoreEvent::RawButtons(_) => {}
                 ServerCoreEvent::Buttons(entries) => {
-                    for entry in entries {
-                        let value = match entry.value {
-                            ButtonValue::Binary(value) => FfiButtonValue {
-                                type_: FfiButtonType_BUTTON_TYPE_BINARY,
-                                __bindgen_anon_1: FfiButtonValue__bindgen_ty_1 {
-                                    binary: value.into(),
+                    let ffi_entries = entries
+                        .into_iter()
+                        .map(|entry| FfiButtonEntry {
+                            id: entry.path_id,
+                            value: match entry.value {
+                                ButtonValue::Binary(value) => FfiButtonValue {
+                                    type_: FfiButtonType_BUTTON_TYPE_BINARY,
+                                    __bindgen_anon_1: FfiButtonValue__bindgen_ty_1 {
+                                        binary: value.into(),
+                                    },
+                                },
+                                ButtonValue::Scalar(value) => FfiButtonValue {
+                                    type_: FfiButtonType_BUTTON_TYPE_SCALAR,
+                                    __bindgen_anon_1: FfiButtonValue__bindgen_ty_1 {
+                                        scalar: value,
+                                    },
                                 },
                             },
-
-                            ButtonValue::Scalar(value) => FfiButtonValue {
-                                type_: FfiButtonType_BUTTON_TYPE_SCALAR,
-                                __bindgen_anon_1: FfiButtonValue__bindgen_ty_1 { scalar: value },
-                            },
-                        };
-                        unsafe { SetButton(entry.path_id, value) };
-                    }
+                        })
+                        .collect::<Vec<_>>();
+                    unsafe { SetButtons(ffi_entries.as_ptr(), ffi_entries.len() as i32) };
                 }
                 ServerCoreEvent::RequestIDR => unsafe { RequestIDR() },
+                ServerCoreEvent::RequestRecovery => unsafe { RequestRecovery() },
+                ServerCoreEvent::LostFrames {
+                    last_received_timestamp,
+                } => unsafe { ReportLostFrame(last_received_timestamp.as_nanos() as u64) },
                 ServerCoreEvent::CaptureFrame => unsafe { CaptureFrame() },
+                ServerCoreEvent::LogGpuMemory => unsafe { LogGpuMemoryUsage() },
                 ServerCoreEvent::GameRenderLatencyFeedback(game_latency) => {
+                    if let Some(context) = &*SERVER_CORE_CONTEXT.read() {
+                        let max_pose_age = context.get_max_pose_age_at_encode();
+                        unsafe { SetMaxPoseAge(max_pose_age.as_nanos() as u64) };
+                    }
+
                     if cfg!(target_os = "linux") && game_latency.as_secs_f32() > 0.25 {
                         let now = Instant::now();
                         if now.saturating_duration_since(last_resync).as_secs_f32() > 0.1 {
@@ -550,17 +892,19 @@ pub unsafe extern "C" fn register_buttons(instance_ptr: *mut c_void, device_id:
     }
 }
 
-#[unsafe(export_name = "HapticsSend")]
-extern "C" fn send_haptics(device_id: u64, duration_s: f32, frequency: f32, amplitude: f32) {
-    if let Ok(duration) = Duration::try_from_secs_f32(duration_s)
-        && let Some(context) = &*SERVER_CORE_CONTEXT.read()
-    {
-        context.send_haptics(Haptics {
-            device_id,
-            duration,
-            frequency,
-            amplitude,
-        });
+#[unsafe(export_name = "HapticsSendBatch")]
+extern "C" fn send_haptics_batch(haptics: *const FfiHaptics, count: i32) {
+    if let Some(context) = &*SERVER_CORE_CONTEXT.read() {
+        let batch = unsafe { std::slice::from_raw_parts(haptics, count as usize) };
+
+        context.send_haptics_batch(batch.iter().filter_map(|haptics| {
+            Some(Haptics {
+                device_id: haptics.deviceID,
+                duration: Duration::try_from_secs_f32(haptics.duration_s).ok()?,
+                frequency: haptics.frequency,
+                amplitude: haptics.amplitude,
+            })
+        }));
     }
 }
 
@@ -583,16 +927,41 @@ extern "C" fn set_video_config_nals(buffer_ptr: *const u8, len: i32, codec: i32)
     }
 }
 
-#[unsafe(export_name = "VideoSend")]
-extern "C" fn send_video(timestamp_ns: u64, buffer_ptr: *mut u8, len: i32, is_idr: bool) {
+// Encoder memory received through VideoSendLent, given back to the encoder when dropped
+struct LentVideoBuffer {
+    ptr: *const u8,
+    len: usize,
+    handle: u64,
+}
+
+// The encoder doesn't touch the memory until it is released, from whichever thread
+unsafe impl Send for LentVideoBuffer {}
+
+impl AsRef<[u8]> for LentVideoBuffer {
+    fn as_ref(&self) -> &[u8] {
+        unsafe { std::slice::from_raw_parts(self.ptr, self.len) }
+    }
+}
+
+impl Drop for LentVideoBuffer {
+    fn drop(&mut self) {
+        unsafe { ReleaseVideoBuffer(self.handle) };
+    }
+}
+
+fn send_video_frame(
+    timestamp_ns: u64,
+    is_idr: bool,
+    temporal_layer: u32,
+    buffer: impl AsRef<[u8]> + Send + 'static,
+) {
     if let Some(context) = &*SERVER_CORE_CONTEXT.read() {
         let timestamp = Duration::from_nanos(timestamp_ns);
-        let buffer = unsafe { std::slice::from_raw_parts(buffer_ptr, len as usize) };
 
-        let Some(head_pose) = HEAD_POSE_QUEUE
+        let Some((head_pose, foveation_center_shift)) = HEAD_POSE_QUEUE
             .lock()
             .iter()
-            .find_map(|(ts, pose)| (*ts == timestamp).then_some(*pose))
+            .find_map(|(ts, pose, shift)| (*ts == timestamp).then_some((*pose, *shift)))
         else {
             // We can't submit the frame without its pose
             return;
@@ -611,22 +980,112 @@ extern "C" fn send_video(timestamp_ns: u64, buffer_ptr: *mut u8, len: i32, is_id
             },
         ];
 
-        context.send_video_nal(timestamp, global_view_params, is_idr, buffer.to_vec());
+        context.send_video_nal(
+            timestamp,
+            global_view_params,
+            Some(foveation_center_shift),
+            is_idr,
+            temporal_layer,
+            buffer,
+        );
     }
 }
 
-#[unsafe(export_name = "GetDynamicEncoderParams")]
-extern "C" fn get_dynamic_encoder_params() -> FfiDynamicEncoderParams {
-    if let Some(context) = &*SERVER_CORE_CONTEXT.read()
-        && let Some(params) = context.get_dynamic_encoder_params()
-    {
-        FfiDynamicEncoderParams {
-            updated: 1,
-            bitrate_bps: params.bitrate_bps as u64,
-            framerate: params.framerate,
-        }
-    } else {
-        FfiDynamicEncoderParams::default()
+#[unsafe(export_name = "VideoSend")]
+extern "C" fn send_video(
+    timestamp_ns: u64,
+    buffer_ptr: *mut u8,
+    len: i32,
+    is_idr: bool,
+    temporal_layer: u32,
+) {
+    let buffer = unsafe { std::slice::from_raw_parts(buffer_ptr, len as usize) };
+
+    send_video_frame(timestamp_ns, is_idr, temporal_layer, buffer.to_vec());
+}
+
+#[unsafe(export_name = "VideoSendLent")]
+extern "C" fn send_video_lent(
+    timestamp_ns: u64,
+    buffer_ptr: *const u8,
+    len: i32,
+    is_idr: bool,
+    temporal_layer: u32,
+    handle: u64,
+) {
+    let buffer = LentVideoBuffer {
+        ptr: buffer_ptr,
+        len: len as usize,
+        handle,
+    };
+
+    send_video_frame(timestamp_ns, is_idr, temporal_layer, buffer);
+}
+
+// Receives a frame one slice at a time, so the driver can hand over slices while the rest of the
+// frame is still being encoded. The frame is submitted once its last slice arrives.
+#[unsafe(export_name = "VideoSendSlice")]
+extern "C" fn send_video_slice(
+    timestamp_ns: u64,
+    buffer_ptr: *mut u8,
+    len: i32,
+    is_idr: bool,
+    temporal_layer: u32,
+    first_slice: bool,
+    last_slice: bool,
+) {
+    let buffer = unsafe { std::slice::from_raw_parts(buffer_ptr, len as usize) };
+
+    let mut pending_frame = PENDING_VIDEO_FRAME.lock();
+    if first_slice {
+        pending_frame.clear();
+    }
+    pending_frame.extend_from_slice(buffer);
+
+    if last_slice {
+        let frame = mem::take(&mut *pending_frame);
+        drop(pending_frame);
+
+        send_video_frame(timestamp_ns, is_idr, temporal_layer, frame);
+    }
+}
+
+#[unsafe(export_name = "SecondaryVideoSend")]
+extern "C" fn secondary_video_send(buffer_ptr: *const u8, len: i32, is_idr: bool) {
+    let buffer = unsafe { std::slice::from_raw_parts(buffer_ptr, len as usize) };
+
+    if let Some(context) = &*SERVER_CORE_CONTEXT.read() {
+        context.send_secondary_video(buffer, is_idr);
+    }
+}
+
+#[unsafe(export_name = "DepthPlaneSend")]
+extern "C" fn depth_plane_send(
+    target_timestamp_ns: u64,
+    depth: *const u16,
+    width: i32,
+    height: i32,
+    projections: *const f32,
+) {
+    let depth = unsafe { std::slice::from_raw_parts(depth, (width * height) as usize) };
+    let projections = unsafe { std::slice::from_raw_parts(projections, 32) };
+
+    if let Some(context) = &*SERVER_CORE_CONTEXT.read() {
+        let header = DepthPlaneHeader {
+            timestamp: Duration::from_nanos(target_timestamp_ns),
+            width: width as u32,
+            height: height as u32,
+            projections: [
+                projections[..16].try_into().unwrap(),
+                projections[16..].try_into().unwrap(),
+            ],
+        };
+        let payload = depth
+            .iter()
+            .flat_map(|value| value.to_le_bytes())
+            .collect::<Vec<_>>();
+
+        context.send_depth_plane(header, &payload);
     }
 }
 
@@ -640,6 +1099,50 @@ extern "C" fn report_composed(timestamp_ns: u64, offset_ns: u64) {
     }
 }
 
+#[unsafe(export_name = "ReportComposeStageTimings")]
+extern "C" fn report_compose_stage_timings(timings: *const FfiStageTiming, count: i32) {
+    if let Some(context) = &*SERVER_CORE_CONTEXT.read() {
+        let timings = unsafe { std::slice::from_raw_parts(timings, count as usize) };
+
+        for timing in timings {
+            let name = unsafe { CStr::from_ptr(timing.name) };
+            context.report_compose_stage_timing(
+                &name.to_string_lossy(),
+                Duration::from_nanos(timing.durationNs),
+            );
+        }
+    }
+}
+
+#[unsafe(export_name = "ReportRecoveryFrame")]
+extern "C" fn report_recovery_frame(target_timestamp_ns: u64) {
+    if let Some(context) = &*SERVER_CORE_CONTEXT.read() {
+        context.report_recovery_frame(Duration::from_nanos(target_timestamp_ns));
+    }
+}
+
+#[unsafe(export_name = "ReportEncodedFrameStats")]
+extern "C" fn report_encoded_frame_stats(stats: FfiEncodedFrameStats) {
+    if let Some(context) = &*SERVER_CORE_CONTEXT.read() {
+        let frame_type = match stats.frameType {
+            FfiFrameType_FRAME_TYPE_IDR => EncodedFrameType::Idr,
+            FfiFrameType_FRAME_TYPE_INTRA => EncodedFrameType::Intra,
+            FfiFrameType_FRAME_TYPE_PREDICTED => EncodedFrameType::Predicted,
+            FfiFrameType_FRAME_TYPE_BIDIRECTIONAL => EncodedFrameType::Bidirectional,
+            _ => EncodedFrameType::Unknown,
+        };
+
+        context.report_encoded_frame_stats(EncodedFrameStats {
+            target_timestamp: Duration::from_nanos(stats.targetTimestampNs),
+            size_bytes: stats.sizeBytes as usize,
+            average_qp: (stats.averageQp >= 0.0).then_some(stats.averageQp),
+            frame_type,
+            encode_time: (stats.encodeTimeNs != 0)
+                .then(|| Duration::from_nanos(stats.encodeTimeNs)),
+        });
+    }
+}
+
 #[unsafe(export_name = "ReportPresent")]
 extern "C" fn report_present(timestamp_ns: u64, offset_ns: u64) {
     if let Some(context) = &*SERVER_CORE_CONTEXT.read() {
@@ -650,6 +1153,33 @@ extern "C" fn report_present(timestamp_ns: u64, offset_ns: u64) {
     }
 }
 
+#[unsafe(export_name = "ApplicationSettings")]
+unsafe extern "C" fn application_settings(executable: *const c_char) -> Settings {
+    let executable = unsafe { CStr::from_ptr(executable) }.to_string_lossy();
+    let profile = alvr_server_core::settings()
+        .video
+        .application_profiles
+        .into_iter()
+        .find(|profile| profile.executable.eq_ignore_ascii_case(&executable));
+    if let Some(profile) = &profile {
+        info!("Using the encoder profile of {}", profile.executable);
+    }
+
+    if let Some(context) = &*SERVER_CORE_CONTEXT.read() {
+        context.set_bitrate_bounds(
+            profile
+                .as_ref()
+                .and_then(|profile| profile.min_bitrate_mbps),
+            profile
+                .as_ref()
+                .and_then(|profile| profile.max_bitrate_mbps),
+        );
+    }
+    *APPLICATION_PROFILE.lock() = profile;
+
+    make_settings(None)
+}
+
 #[unsafe(export_name = "WaitForVSync")]
 extern "C" fn wait_for_vsync() {
     // Default 120Hz-ish wait if StatisticsManager isn't up.
@@ -679,6 +1209,43 @@ extern "C" fn wait_for_vsync() {
     }
 }
 
+// 0 if StatisticsManager isn't up
+#[unsafe(export_name = "GetTimeUntilNextVSyncNs")]
+extern "C" fn get_time_until_next_vsync_ns() -> u64 {
+    SERVER_CORE_CONTEXT
+        .read()
+        .as_ref()
+        .and_then(|ctx| ctx.duration_until_next_vsync())
+        .map_or(0, |duration| duration.as_nanos() as u64)
+}
+
+// 0 if StatisticsManager isn't up
+#[unsafe(export_name = "GetVSyncIntervalNs")]
+extern "C" fn get_vsync_interval_ns() -> u64 {
+    SERVER_CORE_CONTEXT
+        .read()
+        .as_ref()
+        .and_then(|ctx| ctx.vsync_interval())
+        .map_or(0, |duration| duration.as_nanos() as u64)
+}
+
+#[unsafe(export_name = "GetRefreshRate")]
+extern "C" fn get_refresh_rate() -> f32 {
+    SERVER_CORE_CONTEXT
+        .read()
+        .as_ref()
+        .map_or(0.0, |ctx| ctx.refresh_rate())
+}
+
+#[unsafe(export_name = "StepRefreshRate")]
+extern "C" fn step_refresh_rate(lower: bool) -> f32 {
+    SERVER_CORE_CONTEXT
+        .read()
+        .as_ref()
+        .and_then(|ctx| ctx.step_refresh_rate(lower))
+        .unwrap_or(0.0)
+}
+
 #[unsafe(export_name = "ShutdownRuntime")]
 pub extern "C" fn shutdown_driver() {
     SERVER_CORE_CONTEXT.write().take();
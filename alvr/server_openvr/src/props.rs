@@ -17,11 +17,12 @@ use alvr_session::{
     ControllersEmulationMode, HeadsetEmulationMode, OpenvrPropKey, OpenvrPropType, OpenvrProperty,
 };
 use std::{
+    cell::RefCell,
     ffi::{CString, c_char, c_void},
     ptr,
 };
 
-pub fn set_openvr_prop(instance_ptr: Option<*mut c_void>, device_id: u64, prop: OpenvrProperty) {
+fn to_ffi_prop(device_id: u64, prop: OpenvrProperty) -> Option<FfiOpenvrProperty> {
     let key = prop.key as u32;
     let ty = alvr_session::openvr_prop_key_to_type(prop.key);
     let value = prop.value;
@@ -97,15 +98,21 @@ pub fn set_openvr_prop(instance_ptr: Option<*mut c_void>, device_id: u64, prop:
             prop.key
         );
 
-        return;
+        return None;
     };
 
     debug!("Setting {device_name} OpenVR prop: {:?}={value}", prop.key);
 
-    let ffi_prop = FfiOpenvrProperty {
+    Some(FfiOpenvrProperty {
         key,
         type_,
         value: ffi_value,
+    })
+}
+
+pub fn set_openvr_prop(instance_ptr: Option<*mut c_void>, device_id: u64, prop: OpenvrProperty) {
+    let Some(ffi_prop) = to_ffi_prop(device_id, prop) else {
+        return;
     };
 
     if let Some(instance_ptr) = instance_ptr {
@@ -199,15 +206,17 @@ pub extern "C" fn set_device_openvr_props(instance_ptr: *mut c_void, device_id:
 
     let settings = alvr_server_core::settings();
 
+    // Collected and applied with a single property write at the end
+    let props = RefCell::new(Vec::new());
+
     let set_prop = |key, value: &str| {
-        set_openvr_prop(
-            Some(instance_ptr),
-            device_id,
-            OpenvrProperty {
-                key,
-                value: value.into(),
-            },
-        );
+        let prop = OpenvrProperty {
+            key,
+            value: value.into(),
+        };
+        if let Some(ffi_prop) = to_ffi_prop(device_id, prop) {
+            props.borrow_mut().push(ffi_prop);
+        }
     };
 
     let set_icons = |base_path: &str| {
@@ -665,4 +674,7 @@ pub extern "C" fn set_device_openvr_props(instance_ptr: *mut c_void, device_id:
             }
         }
     }
+
+    let props = props.into_inner();
+    unsafe { crate::SetOpenvrProperties(instance_ptr, props.as_ptr(), props.len() as i32) };
 }
@@ -14,6 +14,7 @@ use std::{
 
 const DEG_TO_RAD: f32 = PI / 180.0;
 
+// The driver registers its body trackers in this order and pairs them with the motions in one pass
 pub static BODY_TRACKER_IDS: LazyLock<[u64; 8]> = LazyLock::new(|| {
     [
         // Upper body
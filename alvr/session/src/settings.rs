@@ -49,6 +49,22 @@ pub enum EncoderQualityPreset {
     Speed = 2,
 }
 
+#[repr(u32)]
+#[derive(SettingsSchema, Serialize, Deserialize, Clone, Copy, PartialEq)]
+pub enum EncoderBackend {
+    Automatic = 0,
+    #[schema(strings(display_name = "NVENC"))]
+    Nvenc = 1,
+    #[schema(strings(display_name = "AMF"))]
+    Amf = 2,
+    #[schema(strings(display_name = "VPL"))]
+    Vpl = 3,
+    #[schema(strings(display_name = "VAAPI"))]
+    Vaapi = 4,
+    VulkanVideo = 5,
+    Software = 6,
+}
+
 #[repr(u32)]
 #[derive(SettingsSchema, Serialize, Deserialize, Clone, Copy, PartialEq)]
 pub enum EncoderQualityPresetNvidia {
@@ -79,6 +95,18 @@ pub enum NvencMultiPass {
     FullResolution = 2,
 }
 
+// Values of NV_ENC_SPLIT_ENCODE_MODE
+#[repr(u32)]
+#[derive(SettingsSchema, Serialize, Deserialize, Clone, Copy, PartialEq)]
+pub enum NvencSplitEncodeMode {
+    Automatic = 0,
+    #[schema(strings(display_name = "2-way"))]
+    TwoWay = 2,
+    #[schema(strings(display_name = "3-way"))]
+    ThreeWay = 3,
+    Disabled = 15,
+}
+
 #[repr(u32)]
 #[derive(SettingsSchema, Serialize, Deserialize, Clone, Copy, PartialEq)]
 pub enum NvencAdaptiveQuantizationMode {
@@ -129,6 +157,11 @@ Temporal: Helps improve overall encoding quality, very small trade-off in speed.
     ))]
     #[schema(flag = "steamvr-restart")]
     pub adaptive_quantization_mode: NvencAdaptiveQuantizationMode,
+    #[schema(strings(
+        help = "Splits each HEVC or AV1 frame over the NVENC engines of GPUs that have more than one, to encode higher resolutions and refresh rates. Automatic lets the driver decide. Needs a driver with NVENC API 12.1."
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    pub split_encode_mode: NvencSplitEncodeMode,
     #[schema(flag = "steamvr-restart")]
     pub low_delay_key_frame_scale: i64,
     #[schema(flag = "steamvr-restart")]
@@ -157,6 +190,20 @@ Temporal: Helps improve overall encoding quality, very small trade-off in speed.
     pub rc_average_bitrate: i64,
     #[schema(flag = "steamvr-restart")]
     pub enable_weighted_prediction: bool,
+    #[cfg_attr(not(target_os = "windows"), schema(flag = "hidden"))]
+    #[schema(strings(
+        display_name = "Head motion hints",
+        help = "Gives NVENC the motion of the frame caused by the head rotation since the previous frame, as a starting point of its motion search. H.264 only, not used with foveated encoding."
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    pub head_motion_hints: bool,
+    #[cfg_attr(not(target_os = "windows"), schema(flag = "hidden"))]
+    #[schema(strings(
+        display_name = "YUV input",
+        help = "Converts frames to NV12 or P010 with a shader after compositing, so that NVENC doesn't convert them on its own engine. Always done with HDR. The other encoders also get YUV frames then."
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    pub yuv_input: bool,
 }
 
 #[derive(SettingsSchema, Serialize, Deserialize, Clone, PartialEq)]
@@ -190,6 +237,18 @@ Does not work with the "Reduce color banding" option, requires enabling "Use pre
     pub enable_pre_analysis: bool,
 }
 
+#[derive(SettingsSchema, Serialize, Deserialize, Clone, PartialEq)]
+#[schema(collapsible)]
+pub struct VplConfig {
+    #[schema(strings(
+        help = r#"Frames the Intel encoder can work on at the same time. 1 waits for each frame before submitting the next one.
+Higher values keep the GPU busy but each extra frame can add up to one frame of latency when the encoder can't keep up."#
+    ))]
+    #[schema(gui(slider(min = 1, max = 4)))]
+    #[schema(flag = "steamvr-restart")]
+    pub async_depth: u32,
+}
+
 #[derive(SettingsSchema, Serialize, Deserialize, Clone, PartialEq)]
 #[schema(collapsible)]
 pub struct SoftwareEncodingConfig {
@@ -203,6 +262,35 @@ pub struct SoftwareEncodingConfig {
     #[schema(strings(display_name = "Encoder thread count"))]
     #[schema(flag = "steamvr-restart")]
     pub thread_count: u32,
+
+    #[schema(strings(
+        display_name = "HEVC thread count",
+        help = "Threads of x265, which encodes HEVC in software. 0 uses one per core."
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    pub hevc_thread_count: u32,
+
+    #[schema(strings(
+        display_name = "HEVC slices",
+        help = "x265 splits each frame in this many slices. Rows of the frame are already encoded in parallel, more slices cost compression efficiency."
+    ))]
+    #[schema(gui(slider(min = 1, max = 8)))]
+    #[schema(flag = "steamvr-restart")]
+    pub hevc_slices: u32,
+
+    #[schema(strings(
+        display_name = "AV1 thread count",
+        help = "Cores used by SVT-AV1, which encodes AV1 in software, 0 for all. Its frames are split in the tiles of the encoder settings."
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    pub av1_thread_count: u32,
+
+    #[schema(strings(
+        display_name = "NUMA placement",
+        help = "On machines with several NUMA nodes, keeps the software encoder threads and their frames on the node of the last core, on one logical core of each physical core. This replaces the reserved cores for the encoder threads."
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    pub numa_placement: bool,
 }
 
 #[derive(SettingsSchema, Serialize, Deserialize, Clone, PartialEq)]
@@ -233,6 +321,14 @@ pub struct HDRConfig {
 #[derive(SettingsSchema, Serialize, Deserialize, Clone, PartialEq)]
 #[schema(collapsible)]
 pub struct EncoderConfig {
+    #[schema(strings(
+        display_name = "Force backend",
+        help = r#"Automatic tries the backend that last worked on this GPU first, then the others.
+Forcing a backend skips probing, encoding fails if it is not available."#
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    pub force_backend: EncoderBackend,
+
     #[schema(flag = "steamvr-restart")]
     #[schema(strings(
         display_name = "Quality preset",
@@ -273,9 +369,77 @@ CABAC produces better compression but it's significantly slower and may lead to
     #[schema(flag = "steamvr-restart")]
     pub filler_data: bool,
 
+    #[schema(strings(
+        help = r#"Hardware encoders split each frame in this many slices. NVENC on Windows with H.264 or HEVC, and AMF, hand each slice over as soon as it is encoded.
+More slices cost some compression efficiency."#
+    ))]
+    #[schema(gui(slider(min = 1, max = 8)))]
+    #[schema(flag = "steamvr-restart")]
+    pub slices_per_frame: u32,
+
+    #[schema(strings(
+        help = r#"HEVC and AV1 frames are split in this many columns of tiles, which the client can decode in parallel. With 2 each eye is a column of its own.
+NVENC and AMF only split AV1 frames, AMF takes the number of tiles as a hint."#
+    ))]
+    #[schema(gui(slider(min = 1, max = 4)))]
+    #[schema(flag = "steamvr-restart")]
+    pub tile_columns: u32,
+
+    #[schema(gui(slider(min = 1, max = 4)))]
+    #[schema(flag = "steamvr-restart")]
+    pub tile_rows: u32,
+
+    #[schema(strings(
+        help = r#"Frames are predicted in a hierarchy of this many temporal layers instead of each from the previous one. No frame references the top layer, so its frames are dropped when the network can't keep up, without a recovery frame.
+Supported by NVENC with H.264, by AMF, and by VPL. Long term references are not used by AMF with more than 1 layer."#
+    ))]
+    #[schema(gui(slider(min = 1, max = 3)))]
+    #[schema(flag = "steamvr-restart")]
+    pub temporal_layers: u32,
+
+    #[schema(strings(
+        help = "Frames repeating the last encoded one, rendered for the same head pose and with the same content, are not sent. The client keeps showing the last frame while a game is stalled or loading."
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    pub skip_static_frames: bool,
+
+    #[schema(strings(
+        help = "Encodes the first frame after a scene cut, like a menu opening or a teleport, as an IDR frame instead of a large P-frame predicted from unrelated content. The cuts are found on small copies of the frames."
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    pub scene_change_detection: bool,
+
+    #[schema(strings(
+        help = "Frames that would reach the headset after the time they were rendered for, based on the measured encoder, network and decoder latencies, are not encoded. The encoder moves on to the next frame instead."
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    pub drop_late_frames: bool,
+
+    #[schema(strings(
+        help = "Lowers the encoding resolution while composing and encoding the frames takes longer than the frame interval, and raises it back when there is headroom. Only the NVENC and AMF encoders on Windows and VAAPI on Linux can change their resolution."
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    pub adaptive_quality: Switch<AdaptiveQualityConfig>,
+
+    #[schema(strings(
+        display_name = "Overlay QP offset",
+        help = "Lowers the QP of the parts of the frame that overlays cover, like the SteamVR dashboard and desktop windows, so that their text stays readable at low bitrates. Supported by NVENC with H.264 and HEVC and by AMF on Windows."
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    #[schema(gui(slider(min = 1, max = 12)))]
+    pub overlay_qp_offset: Switch<u32>,
+
+    #[schema(strings(
+        display_name = "Unchanged block QP offset",
+        help = "Raises the QP of the parts of the frame that didn't change since the last encoded frame while the head pose repeats, like a menu or the desktop over a stalled game, so that the encoder skips them and spends the bits on what changed. Supported by NVENC with H.264 and HEVC on Windows and Linux and by AMF."
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    #[schema(gui(slider(min = 1, max = 20)))]
+    pub static_block_qp_offset: Switch<u32>,
+
     #[schema(strings(
         display_name = "10-bit encoding",
-        help = "Sets the encoder to use 10 bits per channel instead of 8, if the client has no preference. Does not work on Linux with Nvidia"
+        help = "Sets the encoder to use 10 bits per channel instead of 8, if the client has no preference. With HEVC and AV1 on Linux, frames are also composed at 10 bits"
     ))]
     #[schema(flag = "steamvr-restart")]
     pub use_10bit: Option<bool>,
@@ -300,6 +464,19 @@ CABAC produces better compression but it's significantly slower and may lead to
     #[schema(flag = "steamvr-restart")]
     pub amf: AmfConfig,
 
+    #[cfg_attr(not(target_os = "windows"), schema(flag = "hidden"))]
+    #[schema(strings(display_name = "Intel VPL"))]
+    #[schema(flag = "steamvr-restart")]
+    pub vpl: VplConfig,
+
+    #[cfg_attr(not(target_os = "linux"), schema(flag = "hidden"))]
+    #[schema(strings(
+        display_name = "Vulkan Video encoding",
+        help = "Encode with the Vulkan Video extensions on the compositor device instead of NVENC or VAAPI. Falls back to them if the driver does not support it."
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    pub vulkan_video: bool,
+
     #[schema(strings(display_name = "Software (CPU) encoding"))]
     pub software: SoftwareEncodingConfig,
 }
@@ -420,6 +597,13 @@ pub struct BitrateConfig {
     #[schema(flag = "real-time")]
     pub adapt_to_framerate: Switch<BitrateAdaptiveFramerateConfig>,
 
+    #[schema(strings(
+        help = "Caps the size of each encoded frame, IDR frames included, to what the network delivers within this many frame intervals, so that no single frame causes a burst. The network throughput is measured on the last frames, and frames are not capped before it is. Frames are never capped below the average frame size of the bitrate."
+    ))]
+    #[schema(gui(slider(min = 1.0, max = 10.0, step = 0.5)), suffix = " frames")]
+    #[schema(flag = "real-time")]
+    pub max_frame_size: Switch<f32>,
+
     #[schema(strings(help = "Controls the smoothness during calculations"))]
     pub history_size: usize,
 
@@ -454,6 +638,29 @@ pub struct ClientsideFoveationConfig {
     pub vertical_offset_deg: f32,
 }
 
+#[derive(SettingsSchema, Serialize, Deserialize, Clone, PartialEq)]
+#[schema(gui = "button_group")]
+pub enum FoveationShape {
+    #[schema(strings(
+        help = "Compresses the rows and the columns of the periphery separately, with the center region sizes and edge ratios"
+    ))]
+    AxisAligned,
+    #[schema(strings(
+        help = "Compresses with the distance to the center, like the resolution of the lenses falls off. The corners are compressed more than the edges, which leaves fewer pixels for the same quality along the axes."
+    ))]
+    Radial {
+        #[schema(strings(
+            help = "Radius of the region kept at full resolution, 1 reaching the edges of the view"
+        ))]
+        #[schema(gui(slider(min = 0.1, max = 1.0, step = 0.01)))]
+        center_radius: f32,
+
+        #[schema(strings(help = "Compression at the edges of the view, the corners get more"))]
+        #[schema(gui(slider(min = 1.0, max = 10.0, step = 0.5)))]
+        edge_ratio: f32,
+    },
+}
+
 #[derive(SettingsSchema, Serialize, Deserialize, Clone, PartialEq)]
 #[schema(collapsible)]
 pub struct FoveatedEncodingConfig {
@@ -489,6 +696,37 @@ pub struct FoveatedEncodingConfig {
     #[schema(gui(slider(min = 1.0, max = 10.0, step = 1.0)))]
     #[schema(flag = "steamvr-restart")]
     pub edge_ratio_y: f32,
+
+    #[schema(flag = "steamvr-restart")]
+    pub shape: FoveationShape,
+
+    #[schema(strings(
+        help = "Moves the center region to where the user is looking, on headsets with eye tracking. Requires the combined eye gaze face tracking source. The center region can then be made smaller. The center shift is used when the gaze is not available."
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    pub follow_eye_gaze: bool,
+
+    #[schema(strings(
+        help = "Resamples the periphery to fewer pixels. Can be disabled to only lower its quality with the periphery QP offset, then the client doesn't need to support foveated encoding."
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    pub compress_periphery: bool,
+
+    #[schema(strings(
+        display_name = "Periphery QP offset",
+        help = "Quantizes the periphery more coarsely in the encoder, up to this QP offset at the edges of the eyes. Follows the center region, without resampling artifacts. Supported by NVENC with H.264 and HEVC, by AMF, and by VAAPI with H.264 and HEVC on Linux."
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    #[schema(gui(slider(min = 1, max = 20)))]
+    pub periphery_qp_offset: Switch<u32>,
+
+    #[schema(strings(
+        display_name = "Periphery target QP",
+        help = "Adapts the periphery QP offset to hold the average QP of the center at this value with the current bitrate. The offset goes up to the periphery QP offset when the bitrate doesn't suffice and down to 0 when it leaves bits to spare. Supported by NVENC and AMF with H.264 and HEVC."
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    #[schema(gui(slider(min = 10, max = 51)))]
+    pub periphery_target_qp: Switch<u32>,
 }
 
 #[repr(C)]
@@ -515,6 +753,108 @@ pub struct ColorCorrectionConfig {
     pub sharpening: f32,
 }
 
+#[derive(SettingsSchema, Serialize, Deserialize, Clone)]
+pub struct ApplicationProfile {
+    #[schema(strings(
+        help = "File name of the game executable, like vrchat.exe. Case is ignored."
+    ))]
+    pub executable: String,
+
+    #[schema(strings(display_name = "Quality preset", help = "AMD AMF and VAAPI encoders"))]
+    pub encoder_quality_preset: Option<EncoderQualityPreset>,
+
+    #[schema(strings(display_name = "NVENC quality preset"))]
+    pub nvenc_quality_preset: Option<EncoderQualityPresetNvidia>,
+
+    #[schema(strings(
+        display_name = "Foveated QP offset",
+        help = "QP offset of the periphery. The compressed frame layout of foveated encoding is agreed on with the client when the stream starts and is kept."
+    ))]
+    #[schema(gui(slider(min = 0, max = 20)))]
+    pub foveated_qp_offset: Option<u32>,
+
+    pub color_correction: Option<Switch<ColorCorrectionConfig>>,
+
+    #[schema(strings(display_name = "Minimum bitrate"))]
+    #[schema(gui(slider(min = 1, max = 100, logarithmic)), suffix = "Mbps")]
+    pub min_bitrate_mbps: Option<u64>,
+
+    #[schema(strings(display_name = "Maximum bitrate"))]
+    #[schema(gui(slider(min = 1, max = 1000, logarithmic)), suffix = "Mbps")]
+    pub max_bitrate_mbps: Option<u64>,
+}
+
+#[derive(SettingsSchema, Serialize, Deserialize, Clone, PartialEq)]
+pub struct AdaptiveQualityConfig {
+    #[schema(strings(
+        display_name = "Minimum resolution scale",
+        help = "Lowest fraction of the encoding resolution the frames are scaled down to under load"
+    ))]
+    #[schema(gui(slider(min = 0.5, max = 1.0, step = 0.1)))]
+    #[schema(flag = "steamvr-restart")]
+    pub min_resolution_scale: f32,
+
+    #[schema(strings(
+        display_name = "Lower refresh rate",
+        help = "Once the resolution is at its minimum and the frames still don't fit, switches the stream to the next lower refresh rate the headset supports, and back up when the frames fit the higher rate again. The headset display, SteamVR and the encoders switch together without reconnecting."
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    pub lower_refresh_rate: bool,
+}
+
+#[repr(u32)]
+#[derive(SettingsSchema, Serialize, Deserialize, Clone, Copy, PartialEq)]
+pub enum MmcssTask {
+    #[schema(strings(display_name = "Pro Audio"))]
+    ProAudio = 0,
+    Playback = 1,
+}
+
+#[derive(SettingsSchema, Serialize, Deserialize, Clone, PartialEq)]
+pub struct ThreadSchedulingConfig {
+    #[cfg_attr(not(target_os = "windows"), schema(flag = "hidden"))]
+    #[schema(strings(
+        display_name = "MMCSS task",
+        help = "Multimedia Class Scheduler task the threads are registered with. Pro Audio has the highest priority."
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    pub mmcss_task: MmcssTask,
+    #[schema(strings(
+        help = "Pins the threads to this many logical cores, counted from the last one. Games load the first cores the most."
+    ))]
+    #[schema(gui(slider(min = 1, max = 8)))]
+    #[schema(flag = "steamvr-restart")]
+    pub reserved_cores: Switch<u32>,
+}
+
+#[derive(SettingsSchema, Serialize, Deserialize, Clone, PartialEq)]
+pub struct HiddenAreaMaskConfig {
+    #[schema(strings(
+        display_name = "Visible area size",
+        help = "Size of the visible ellipse of each eye relative to the eye image. At 1 it touches the edges of the image, larger values hide less of the corners."
+    ))]
+    #[schema(gui(slider(min = 1.0, max = 1.4, step = 0.01)))]
+    #[schema(flag = "steamvr-restart")]
+    pub visible_size: f32,
+}
+
+#[derive(SettingsSchema, Serialize, Deserialize, Clone, PartialEq)]
+pub struct TemporalDenoiseConfig {
+    #[schema(strings(
+        help = "Weight of the previous frame in static areas. Higher values remove more noise but leave more trails on fast changes."
+    ))]
+    #[schema(gui(slider(min = 0.1, max = 0.9, step = 0.05)))]
+    #[schema(flag = "steamvr-restart")]
+    pub strength: f32,
+
+    #[schema(strings(
+        help = "Color difference from which a pixel is taken as moving and not filtered. Higher values filter stronger noise but blur more motion."
+    ))]
+    #[schema(gui(slider(min = 0.01, max = 0.2, step = 0.01)))]
+    #[schema(flag = "steamvr-restart")]
+    pub tolerance: f32,
+}
+
 #[repr(u8)]
 #[derive(SettingsSchema, Serialize, Deserialize, Debug, Copy, Clone, PartialEq, Eq, Default)]
 #[schema(gui = "button_group")]
@@ -712,6 +1052,32 @@ If you want to reduce the amount of pixelation on the edges, increase the center
     #[schema(flag = "steamvr-restart")]
     pub color_correction: Switch<ColorCorrectionConfig>,
 
+    #[schema(strings(
+        help = "Windows only. Encoder settings of the games whose executable matches, used from when the game creates its swapchain. The encoder restarts with an IDR frame when they change its settings, the stream keeps running. Color correction changes apply from the next stream. On Linux the profiles are ignored: the encoder only sees vrcompositor, never the game process."
+    ))]
+    #[schema(flag = "real-time")]
+    pub application_profiles: Vec<ApplicationProfile>,
+
+    #[schema(strings(
+        help = "Hides the corners of the eye images that the lenses don't show. Games skip rendering them and the stream fills them with black, so that they cost next to no bits."
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    pub hidden_area_mask: Switch<HiddenAreaMaskConfig>,
+
+    #[cfg_attr(not(target_os = "linux"), schema(flag = "hidden"))]
+    #[schema(strings(
+        help = "Downscales with a Lanczos filter when the game renders at a higher resolution than the stream, which keeps text sharp at a lower encoding resolution. Linux only, foveated encoding does its own resampling."
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    pub high_quality_downscaling: bool,
+
+    #[cfg_attr(not(target_os = "linux"), schema(flag = "hidden"))]
+    #[schema(strings(
+        help = "Blends the static areas of each frame with the previous frames before encoding, which removes the noise and film grain that waste bits. Linux only."
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    pub temporal_denoise: Switch<TemporalDenoiseConfig>,
+
     #[schema(
         strings(
             display_name = "Maximum buffering",
@@ -732,6 +1098,34 @@ If you want to reduce the amount of pixelation on the edges, increase the center
     #[schema(flag = "real-time")]
     pub enforce_server_frame_pacing: bool,
 
+    #[schema(strings(
+        help = "Raises the priority of the vsync, compositing and encoding threads so that a game using all the cores doesn't preempt them. On Windows they are registered with MMCSS. On Linux they get SCHED_RR when SteamVR is allowed to, a lower nice value otherwise."
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    pub thread_scheduling: Switch<ThreadSchedulingConfig>,
+
+    #[schema(strings(
+        help = "For laptops on battery, at a small latency and quality cost. The streaming threads keep their normal priority and the driver events are polled at the scheduler tick on Windows, the frames repeating the last encoded one are not encoded, and the encoders use their fastest presets without pre-analysis or multiple passes. The power drawn from the battery of the streamer and the energy per encoded frame show in the statistics on Linux."
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    pub power_saving: bool,
+
+    #[schema(strings(
+        display_name = "High GPU priority",
+        help = "Schedules the compositing and encoding GPU work ahead of the game's so that it doesn't miss the vsync when the GPU is fully loaded. On Windows the realtime scheduling class of the process requires running SteamVR as administrator. On Linux the compositing queue asks for the high global priority."
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    pub gpu_priority: bool,
+
+    #[cfg_attr(not(target_os = "windows"), schema(flag = "hidden"))]
+    #[schema(strings(
+        display_name = "Send depth plane",
+        help = "Sends a low resolution depth of each frame, taken from the depth buffer that the game submits, so that the client can reproject it with the head translation. Games that don't submit depth send nothing. Windows only."
+    ))]
+    #[schema(gui(slider(min = 16, max = 128, step = 16)), suffix = " px per eye")]
+    #[schema(flag = "steamvr-restart")]
+    pub depth_plane_width: Switch<u32>,
+
     #[schema(flag = "steamvr-restart")]
     pub encoder_config: EncoderConfig,
 
@@ -754,6 +1148,14 @@ If you want to reduce the amount of pixelation on the edges, increase the center
     #[schema(flag = "steamvr-restart")]
     pub emulated_headset_view_resolution: FrameSize,
 
+    #[schema(strings(
+        display_name = "Dynamic game resolution",
+        help = "Lowers the resolution recommended to the game while it misses the vsync, down to this fraction of the emulated headset resolution, and raises it back once the game keeps up. Only games that follow resolution changes while running are affected."
+    ))]
+    #[schema(gui(slider(min = 0.5, max = 0.95, step = 0.05)))]
+    #[schema(flag = "steamvr-restart")]
+    pub dynamic_game_resolution: Switch<f32>,
+
     #[schema(strings(display_name = "Preferred FPS"))]
     #[schema(gui(slider(min = 60.0, max = 120.0)), suffix = "Hz")]
     #[schema(flag = "steamvr-restart")]
@@ -766,6 +1168,13 @@ If you want to reduce the amount of pixelation on the edges, increase the center
     #[schema(flag = "steamvr-restart")]
     pub adapter_index: u32,
 
+    #[cfg_attr(target_os = "macos", schema(flag = "hidden"))]
+    #[schema(strings(
+        help = "Encode on another GPU than the one the game renders on, for example an integrated one. On Windows frames are copied between the GPUs, which needs D3D11 cross adapter sharing. On Linux the index is the one of the Vulkan device, which encodes with VAAPI the composited frames it imports as linear DMA-BUFs. Falls back to the compositor GPU when that is not supported."
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    pub encode_adapter_index: Switch<u32>,
+
     #[schema(strings(display_name = "Client-side foveation"))]
     pub clientside_foveation: Switch<ClientsideFoveationConfig>,
 
@@ -1463,6 +1872,22 @@ This could happen on TCP. A IDR frame is requested in this case."#
     #[schema(gui(slider(min = 5, max = 1000, step = 5)), suffix = "ms")]
     pub minimum_idr_interval_ms: u64,
 
+    #[schema(strings(
+        display_name = "Intra refresh recovery",
+        help = r#"Repair the stream after lost frames by refreshing the picture over this many frames instead of with an IDR frame, which avoids bitrate spikes.
+Encoders that can't do it still use IDR frames. Not used when avoiding video glitches."#
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    #[schema(gui(slider(min = 2, max = 120)), suffix = " frames")]
+    pub intra_refresh_recovery_frames: Switch<u32>,
+
+    #[schema(strings(
+        help = r#"After lost frames, make the encoder predict from the last frame the client received instead of repairing the stream. This costs about a P-frame.
+Falls back on the intra refresh recovery or an IDR frame when the encoder can't do it. Not used when avoiding video glitches."#
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    pub reference_frame_invalidation: bool,
+
     #[schema(strings(display_name = "DSCP (packet prio hints)"))]
     pub dscp: Option<DscpTos>,
 }
@@ -1559,6 +1984,16 @@ pub struct RollingVideoFilesConfig {
     pub duration_s: u64,
 }
 
+#[derive(SettingsSchema, Serialize, Deserialize, Clone)]
+pub struct SecondaryVideoStreamConfig {
+    #[schema(strings(help = "The width follows the aspect ratio of the streamed frames"))]
+    #[schema(gui(slider(min = 360, max = 2160, step = 90)), suffix = "px")]
+    pub height: u32,
+
+    #[schema(gui(slider(min = 1, max = 100, logarithmic)), suffix = "Mbps")]
+    pub bitrate_mbps: u32,
+}
+
 #[derive(SettingsSchema, Serialize, Deserialize, Clone)]
 pub struct CaptureConfig {
     #[schema(strings(display_name = "Start video recording at client connection"))]
@@ -1566,6 +2001,13 @@ pub struct CaptureConfig {
 
     pub rolling_video_files: Switch<RollingVideoFilesConfig>,
 
+    #[schema(strings(
+        help = r#"Linux only. Encodes a smaller H.264 copy of each streamed frame in software and writes it to secondary.<date>.h264 in the log folder, for example for OBS.
+Frames are skipped while the encoder is busy, the headset stream never waits for it."#
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    pub secondary_video_stream: Switch<SecondaryVideoStreamConfig>,
+
     #[schema(flag = "steamvr-restart")]
     pub capture_frame_dir: String,
 }
@@ -1573,15 +2015,60 @@ pub struct CaptureConfig {
 #[derive(SettingsSchema, Serialize, Deserialize, Clone)]
 pub struct Patches {
     #[schema(strings(
-        help = "Async Compute is currently broken in SteamVR, keep disabled. ONLY FOR TESTING."
+        help = r#"Async Compute is currently broken in SteamVR, keep disabled. ONLY FOR TESTING.
+This also moves the ALVR compositor to a dedicated high priority compute queue."#
     ))]
     #[schema(flag = "steamvr-restart")]
     pub linux_async_compute: bool,
     #[schema(strings(
-        help = "Async reprojection only works if you can always hit at least half of your refresh rate.",
+        help = "Async reprojection only works if you can always hit at least half of your refresh rate. Frames the game does not deliver by the next vsync are also reprojected to the latest head pose before encoding.",
     ))]
     #[schema(flag = "steamvr-restart")]
     pub linux_async_reprojection: bool,
+    #[schema(strings(
+        display_name = "Late latching",
+        help = "Rotates each frame to the newest head orientation received from the headset right before composing it, and sends it with that pose. Lowers the rotational latency of frames the game rendered with an older pose. On Linux this uses the reprojection shader."
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    pub late_latching: bool,
+    #[schema(strings(
+        display_name = "Linux encoder output images",
+        help = "Number of composited frames that can be queued for the encoder. With more than one, compositing the next frame overlaps with encoding the current one, at the cost of some VRAM."
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    #[schema(gui(slider(min = 1, max = 3)))]
+    pub linux_encoder_output_images: u32,
+    #[schema(strings(
+        display_name = "Compact GPU memory",
+        help = "Uses as few compositor and encoder buffers as possible, for GPUs that run out of VRAM at high resolutions. Compositing and encoding overlap less, which can lower the framerate."
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    pub compact_gpu_memory: bool,
+    #[schema(strings(
+        display_name = "Linux mailbox present",
+        help = "A new SteamVR compositor frame replaces the queued one if the encoder has not picked it up yet, instead of waiting behind it. Lowers latency when the encoder falls behind, at the cost of dropping compositor frames."
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    pub linux_mailbox_present: bool,
+    #[schema(strings(
+        display_name = "Linux swapchain images",
+        help = "Number of images of the SteamVR compositor swapchain, never less than the compositor asks for. When disabled, the count the compositor asks for is used."
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    #[schema(gui(slider(min = 2, max = 5)))]
+    pub linux_swapchain_images: Switch<u32>,
+    #[schema(strings(
+        display_name = "Linux present sync files",
+        help = "The Vulkan layer hands a sync_file to the encoder with each SteamVR compositor frame, instead of sharing a timeline semaphore per image. Try it if frames stutter or freeze with drivers that handle shared timeline semaphores badly."
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    pub linux_present_sync_files: bool,
+    #[schema(strings(
+        display_name = "Linux VAAPI NV12 shader conversion",
+        help = "With VAAPI on the compositor GPU, a compute shader writes each frame straight into the NV12 surface the encoder reads, instead of converting it with VAAPI video processing. Falls back to video processing if the driver can't import the surfaces, for 10 bit encoding and while the encoding resolution is lowered."
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    pub linux_vaapi_shader_conversion: bool,
 }
 
 #[derive(SettingsSchema, Serialize, Deserialize, Clone)]
@@ -1644,6 +2131,16 @@ pub fn session_settings_default() -> SettingsDefault {
         },
         content: vec![],
     };
+    let default_color_correction = SwitchDefault {
+        enabled: false,
+        content: ColorCorrectionConfigDefault {
+            brightness: 0.,
+            contrast: 0.,
+            saturation: 0.5,
+            gamma: 1.,
+            sharpening: 0.5,
+        },
+    };
     let socket_buffer = SocketBufferSizeDefault {
         Custom: 100000,
         variant: SocketBufferSizeDefaultVariant::Maximum,
@@ -1707,12 +2204,38 @@ pub fn session_settings_default() -> SettingsDefault {
                 },
             },
             adapter_index: 0,
+            encode_adapter_index: SwitchDefault {
+                enabled: false,
+                content: 1,
+            },
             transcoding_view_resolution: view_resolution.clone(),
             emulated_headset_view_resolution: view_resolution,
             preferred_fps: 72.,
             max_buffering_frames: 2.0,
             buffering_history_weight: 0.90,
             enforce_server_frame_pacing: true,
+            thread_scheduling: SwitchDefault {
+                enabled: false,
+                content: ThreadSchedulingConfigDefault {
+                    mmcss_task: MmcssTaskDefault {
+                        variant: MmcssTaskDefaultVariant::ProAudio,
+                    },
+                    reserved_cores: SwitchDefault {
+                        enabled: false,
+                        content: 2,
+                    },
+                },
+            },
+            power_saving: false,
+            gpu_priority: true,
+            depth_plane_width: SwitchDefault {
+                enabled: false,
+                content: 64,
+            },
+            dynamic_game_resolution: SwitchDefault {
+                enabled: false,
+                content: 0.7,
+            },
             bitrate: BitrateConfigDefault {
                 gui_collapsed: false,
                 mode: BitrateModeDefault {
@@ -1756,6 +2279,10 @@ pub fn session_settings_default() -> SettingsDefault {
                         framerate_reset_threshold_multiplier: 2.0,
                     },
                 },
+                max_frame_size: SwitchDefault {
+                    enabled: false,
+                    content: 1.0,
+                },
                 history_size: 256,
                 image_corruption_fix: false,
             },
@@ -1768,6 +2295,28 @@ pub fn session_settings_default() -> SettingsDefault {
                     variant: RateControlModeDefaultVariant::Cbr,
                 },
                 filler_data: false,
+                slices_per_frame: 1,
+                tile_columns: 1,
+                tile_rows: 1,
+                temporal_layers: 1,
+                skip_static_frames: false,
+                scene_change_detection: false,
+                drop_late_frames: false,
+                adaptive_quality: SwitchDefault {
+                    enabled: false,
+                    content: AdaptiveQualityConfigDefault {
+                        min_resolution_scale: 0.7,
+                        lower_refresh_rate: false,
+                    },
+                },
+                overlay_qp_offset: SwitchDefault {
+                    enabled: false,
+                    content: 4,
+                },
+                static_block_qp_offset: SwitchDefault {
+                    enabled: false,
+                    content: 8,
+                },
                 h264_profile: H264ProfileDefault {
                     variant: H264ProfileDefaultVariant::High,
                 },
@@ -1805,6 +2354,9 @@ pub fn session_settings_default() -> SettingsDefault {
                     adaptive_quantization_mode: NvencAdaptiveQuantizationModeDefault {
                         variant: NvencAdaptiveQuantizationModeDefaultVariant::Spatial,
                     },
+                    split_encode_mode: NvencSplitEncodeModeDefault {
+                        variant: NvencSplitEncodeModeDefaultVariant::Automatic,
+                    },
                     low_delay_key_frame_scale: -1,
                     refresh_rate: -1,
                     enable_intra_refresh: false,
@@ -1819,6 +2371,11 @@ pub fn session_settings_default() -> SettingsDefault {
                     rc_max_bitrate: -1,
                     rc_average_bitrate: -1,
                     enable_weighted_prediction: false,
+                    head_motion_hints: false,
+                    yuv_input: false,
+                },
+                force_backend: EncoderBackendDefault {
+                    variant: EncoderBackendDefaultVariant::Automatic,
                 },
                 quality_preset: EncoderQualityPresetDefault {
                     variant: EncoderQualityPresetDefaultVariant::Speed,
@@ -1832,10 +2389,19 @@ pub fn session_settings_default() -> SettingsDefault {
                     preproc_sigma: 4,
                     preproc_tor: 7,
                 },
+                vpl: VplConfigDefault {
+                    gui_collapsed: true,
+                    async_depth: 2,
+                },
+                vulkan_video: false,
                 software: SoftwareEncodingConfigDefault {
                     gui_collapsed: true,
                     force_software_encoding: false,
                     thread_count: 0,
+                    hevc_thread_count: 0,
+                    hevc_slices: 1,
+                    av1_thread_count: 0,
+                    numa_placement: false,
                 },
             },
             mediacodec_extra_options: {
@@ -1875,6 +2441,23 @@ pub fn session_settings_default() -> SettingsDefault {
                     center_shift_y: 0.1,
                     edge_ratio_x: 4.,
                     edge_ratio_y: 5.,
+                    shape: FoveationShapeDefault {
+                        Radial: FoveationShapeRadialDefault {
+                            center_radius: 0.35,
+                            edge_ratio: 6.,
+                        },
+                        variant: FoveationShapeDefaultVariant::AxisAligned,
+                    },
+                    follow_eye_gaze: false,
+                    compress_periphery: true,
+                    periphery_qp_offset: SwitchDefault {
+                        enabled: false,
+                        content: 6,
+                    },
+                    periphery_target_qp: SwitchDefault {
+                        enabled: false,
+                        content: 28,
+                    },
                 },
             },
             clientside_foveation: SwitchDefault {
@@ -1897,14 +2480,52 @@ pub fn session_settings_default() -> SettingsDefault {
                 },
             },
             force_software_decoder: false,
-            color_correction: SwitchDefault {
+            color_correction: default_color_correction.clone(),
+            application_profiles: VectorDefault {
+                gui_collapsed: true,
+                element: ApplicationProfileDefault {
+                    executable: "".into(),
+                    encoder_quality_preset: OptionalDefault {
+                        set: false,
+                        content: EncoderQualityPresetDefault {
+                            variant: EncoderQualityPresetDefaultVariant::Speed,
+                        },
+                    },
+                    nvenc_quality_preset: OptionalDefault {
+                        set: false,
+                        content: EncoderQualityPresetNvidiaDefault {
+                            variant: EncoderQualityPresetNvidiaDefaultVariant::P1,
+                        },
+                    },
+                    foveated_qp_offset: OptionalDefault {
+                        set: false,
+                        content: 6,
+                    },
+                    color_correction: OptionalDefault {
+                        set: false,
+                        content: default_color_correction,
+                    },
+                    min_bitrate_mbps: OptionalDefault {
+                        set: false,
+                        content: 5,
+                    },
+                    max_bitrate_mbps: OptionalDefault {
+                        set: false,
+                        content: 100,
+                    },
+                },
+                content: vec![],
+            },
+            hidden_area_mask: SwitchDefault {
+                enabled: false,
+                content: HiddenAreaMaskConfigDefault { visible_size: 1.1 },
+            },
+            high_quality_downscaling: false,
+            temporal_denoise: SwitchDefault {
                 enabled: false,
-                content: ColorCorrectionConfigDefault {
-                    brightness: 0.,
-                    contrast: 0.,
-                    saturation: 0.5,
-                    gamma: 1.,
-                    sharpening: 0.5,
+                content: TemporalDenoiseConfigDefault {
+                    strength: 0.5,
+                    tolerance: 0.06,
                 },
             },
         },
@@ -2187,6 +2808,11 @@ pub fn session_settings_default() -> SettingsDefault {
             max_queued_server_video_frames: 1024,
             avoid_video_glitching: false,
             minimum_idr_interval_ms: 100,
+            intra_refresh_recovery_frames: SwitchDefault {
+                enabled: false,
+                content: 30,
+            },
+            reference_frame_invalidation: false,
             enable_on_connect_script: false,
             enable_on_disconnect_script: false,
             allow_untrusted_http: false,
@@ -2243,6 +2869,13 @@ pub fn session_settings_default() -> SettingsDefault {
                     enabled: false,
                     content: RollingVideoFilesConfigDefault { duration_s: 5 },
                 },
+                secondary_video_stream: SwitchDefault {
+                    enabled: false,
+                    content: SecondaryVideoStreamConfigDefault {
+                        height: 1080,
+                        bitrate_mbps: 8,
+                    },
+                },
                 capture_frame_dir: if !cfg!(target_os = "linux") {
                     "/tmp".into()
                 } else {
@@ -2252,6 +2885,16 @@ pub fn session_settings_default() -> SettingsDefault {
             patches: PatchesDefault {
                 linux_async_compute: false,
                 linux_async_reprojection: false,
+                late_latching: false,
+                linux_encoder_output_images: 2,
+                compact_gpu_memory: false,
+                linux_mailbox_present: false,
+                linux_swapchain_images: SwitchDefault {
+                    enabled: false,
+                    content: 3,
+                },
+                linux_present_sync_files: false,
+                linux_vaapi_shader_conversion: false,
             },
             velocities_multiplier: 1.0,
             open_setup_wizard: alvr_common::is_stable() || alvr_common::is_nightly(),
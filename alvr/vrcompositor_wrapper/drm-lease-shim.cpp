@@ -63,8 +63,34 @@ static struct wp_drm_lease_v1 {} fake_lease_id;
 static int drm_fd = -1;
 static int drm_connector_id = -1;
 
+static int first_connector(int fd)
+{
+    static drmModeResPtr (*real_drmModeGetResources)(int fd) = nullptr;
+    static void (*real_drmModeFreeResources)(drmModeResPtr ptr) = nullptr;
+    LOAD_FN(drmModeGetResources);
+    LOAD_FN(drmModeFreeResources);
+    auto res = real_drmModeGetResources(fd);
+    int connector_id = res && res->count_connectors ? res->connectors[0] : -1;
+    real_drmModeFreeResources(res);
+    return connector_id;
+}
+
 static void open_drm_fd()
 {
+    // The launcher picks the card of the GPU the compositor renders on, and the connector if the
+    // kernel lists connector IDs
+    const char *device = getenv("ALVR_DRM_DEVICE");
+    if (device) {
+        drm_fd = open(device, O_RDONLY);
+        if (drm_fd != -1) {
+            const char *connector = getenv("ALVR_DRM_CONNECTOR");
+            drm_connector_id = connector ? atoi(connector) : first_connector(drm_fd);
+            LOG("DRM: device=%s, fd=%d, connector_id=%d", device, drm_fd, drm_connector_id);
+            return;
+        }
+        LOG("DRM: failed to open %s, scanning the cards", device);
+    }
+
     static drmModeResPtr (*real_drmModeGetResources)(int fd) = nullptr;
     LOAD_FN(drmModeGetResources);
     for(auto cardCandidate : std::filesystem::directory_iterator("/dev/dri")) {
@@ -1,3 +1,126 @@
+// DRM card as listed in sysfs
+#[cfg(target_os = "linux")]
+struct DrmCard {
+    node: String,
+    // Lowest connector ID of the card, None on kernels that don't list them in sysfs
+    connector_id: Option<u32>,
+    has_connectors: bool,
+    // PCI vendor and device ID in the format of MESA_VK_DEVICE_SELECT, like 10de:2684
+    pci_id: Option<String>,
+    // PCI address, like 0000:01:00.0
+    pci_slot: Option<String>,
+    // The GPU the firmware booted with, which Vulkan picks when nothing else is asked for
+    boot_vga: bool,
+}
+
+// Cards in the order of their numbers. Read from sysfs, so that the compositor doesn't open every
+// card at startup.
+#[cfg(target_os = "linux")]
+fn list_drm_cards() -> Vec<DrmCard> {
+    let Ok(entries) = std::fs::read_dir("/sys/class/drm") else {
+        return vec![];
+    };
+    let entries = entries
+        .filter_map(|entry| entry.ok()?.file_name().into_string().ok())
+        .collect::<Vec<_>>();
+
+    let mut numbers = entries
+        .iter()
+        .filter_map(|name| name.strip_prefix("card")?.parse::<u32>().ok())
+        .collect::<Vec<_>>();
+    numbers.sort_unstable();
+
+    numbers
+        .into_iter()
+        .map(|card| {
+            // Connectors are listed as cardN-<type>-<index>
+            let prefix = format!("card{card}-");
+            let connectors = entries
+                .iter()
+                .filter(|name| name.starts_with(&prefix))
+                .collect::<Vec<_>>();
+            let connector_id = connectors
+                .iter()
+                .filter_map(|name| {
+                    std::fs::read_to_string(format!("/sys/class/drm/{name}/connector_id"))
+                        .ok()?
+                        .trim()
+                        .parse::<u32>()
+                        .ok()
+                })
+                .min();
+
+            let read = |file: &str| {
+                std::fs::read_to_string(format!("/sys/class/drm/card{card}/device/{file}")).ok()
+            };
+            let read_id =
+                |file: &str| Some(read(file)?.trim().trim_start_matches("0x").to_lowercase());
+            let pci_id = read_id("vendor")
+                .zip(read_id("device"))
+                .map(|(vendor, device)| format!("{vendor}:{device}"));
+            let pci_slot = read("uevent").and_then(|uevent| {
+                uevent
+                    .lines()
+                    .find_map(|line| line.strip_prefix("PCI_SLOT_NAME="))
+                    .map(str::to_owned)
+            });
+
+            DrmCard {
+                node: format!("/dev/dri/card{card}"),
+                connector_id,
+                has_connectors: !connectors.is_empty(),
+                pci_id,
+                pci_slot,
+                boot_vga: read("boot_vga").is_some_and(|value| value.trim() == "1"),
+            }
+        })
+        .collect()
+}
+
+// Card of the GPU the compositor renders on, and with it the encoder, which follows the device the
+// capture layer reports. Uses the variables that the Mesa device_select layer and NVIDIA PRIME
+// render offload look at, the way SteamVR is told to be launched on the dGPU.
+#[cfg(target_os = "linux")]
+fn find_render_card(cards: &[DrmCard]) -> Option<&DrmCard> {
+    let by_pci_id = |id: &str| {
+        let id = id.trim_end_matches('!').to_lowercase();
+        cards
+            .iter()
+            .find(|card| card.pci_id.as_deref() == Some(id.as_str()))
+    };
+
+    if let Ok(id) = std::env::var("MESA_VK_DEVICE_SELECT") {
+        return by_pci_id(&id);
+    }
+    if std::env::var("__NV_PRIME_RENDER_OFFLOAD").is_ok_and(|value| value == "1") {
+        return cards.iter().find(|card| {
+            card.pci_id
+                .as_ref()
+                .is_some_and(|id| id.starts_with("10de:"))
+        });
+    }
+    if let Ok(prime) = std::env::var("DRI_PRIME") {
+        let prime = prime.trim_end_matches('!');
+        if let Some(tag) = prime.strip_prefix("pci-") {
+            // pci-0000_01_00_0 is the address 0000:01:00.0
+            let slot = tag.splitn(4, '_').collect::<Vec<_>>();
+            if let [domain, bus, device, function] = slot[..] {
+                let slot = format!("{domain}:{bus}:{device}.{function}");
+                return cards
+                    .iter()
+                    .find(|card| card.pci_slot.as_deref() == Some(slot.as_str()));
+            }
+        } else if prime.contains(':') {
+            return by_pci_id(prime);
+        } else if prime != "0" {
+            // Any other GPU than the default one
+            return cards.iter().find(|card| !card.boot_vga);
+        }
+    }
+
+    cards.iter().find(|card| card.boot_vga)
+}
+
 #[cfg(target_os = "linux")]
 fn main() {
     let argv0 = std::env::args().next().unwrap();
@@ -39,6 +162,24 @@ fn main() {
                     .to_string(),
             );
         }
+
+        // Set by the user to override the card. The Vulkan device choice is left alone.
+        if std::env::var("ALVR_DRM_DEVICE").is_err() {
+            let cards = list_drm_cards();
+            // The GPU of the compositor may have no outputs, then any card with connectors can
+            // serve the lease
+            let card = find_render_card(&cards)
+                .filter(|card| card.has_connectors)
+                .or_else(|| cards.iter().find(|card| card.has_connectors));
+            if let Some(card) = card {
+                unsafe {
+                    std::env::set_var("ALVR_DRM_DEVICE", &card.node);
+                    if let Some(id) = card.connector_id {
+                        std::env::set_var("ALVR_DRM_CONNECTOR", id.to_string());
+                    }
+                }
+            }
+        }
     }
 
     let err = exec::execvp(argv0 + ".real", std::env::args());
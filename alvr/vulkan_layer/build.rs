@@ -48,6 +48,8 @@ fn main() {
     for lib in libunwind.libs {
         println!("cargo:rustc-link-lib={lib}");
     }
+    // dladdr1, part of libc since glibc 2.34
+    println!("cargo:rustc-link-lib=dl");
 
     // fail build if there are undefined symbols in final library
     println!("cargo:rustc-cdylib-link-arg=-Wl,--no-undefined");
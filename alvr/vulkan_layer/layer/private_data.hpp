@@ -69,6 +69,7 @@ namespace layer {
     OPTIONAL(CreateHeadlessSurfaceEXT)                                                             \
     OPTIONAL(GetPhysicalDeviceQueueFamilyProperties)                                               \
     OPTIONAL(CreateDisplayModeKHR)                                                                 \
+    OPTIONAL(GetPhysicalDeviceExternalSemaphoreProperties)                                         \
 
 struct instance_dispatch_table {
     VkResult populate(VkInstance instance, PFN_vkGetInstanceProcAddr get_proc);
@@ -120,7 +121,8 @@ struct instance_dispatch_table {
     OPTIONAL(GetFenceStatus)                                                                       \
     OPTIONAL(GetMemoryFdKHR)                                                                       \
     OPTIONAL(CreateSemaphore)                                                                      \
-    OPTIONAL(GetSemaphoreFdKHR)
+    OPTIONAL(GetSemaphoreFdKHR)                                                                    \
+    OPTIONAL(DestroySemaphore)
 
 struct device_dispatch_table {
     VkResult populate(VkDevice dev, PFN_vkGetDeviceProcAddr get_proc);
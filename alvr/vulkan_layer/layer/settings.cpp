@@ -53,6 +53,36 @@ void Settings::Load()
 		Info("Render Target: %d %d\n", m_renderWidth, m_renderHeight);
 		Info("Refresh Rate: %d\n", m_refreshRate);
 		m_loaded = true;
+
+		// Optional, a session from an older version keeps the defaults
+		try
+		{
+			auto patches = v.get("session_settings").get("extra").get("patches");
+			m_mailboxPresent = patches.get("linux_mailbox_present").get<bool>();
+			auto images = patches.get("linux_swapchain_images");
+			if (images.get("enabled").get<bool>())
+				m_swapchainImages = (uint32_t)images.get("content").get<int64_t>();
+			m_presentSyncFiles = patches.get("linux_present_sync_files").get<bool>();
+		}
+		catch (std::exception &e)
+		{
+			Error("Missing swapchain settings in session config: %hs\n", e.what());
+		}
+		Info("Mailbox present: %d, swapchain images: %u, present sync files: %d\n",
+			m_mailboxPresent, m_swapchainImages, m_presentSyncFiles);
+
+		try
+		{
+			auto scheduling = v.get("session_settings").get("video").get("thread_scheduling");
+			m_threadScheduling = scheduling.get("enabled").get<bool>();
+			auto cores = scheduling.get("content").get("reserved_cores");
+			if (cores.get("enabled").get<bool>())
+				m_reservedCores = (uint32_t)cores.get("content").get<int64_t>();
+		}
+		catch (std::exception &e)
+		{
+			Error("Missing thread scheduling settings in session config: %hs\n", e.what());
+		}
 	}
 	catch (std::exception &e)
 	{
@@ -24,4 +24,13 @@ public:
 	int m_refreshRate;
 	uint32_t m_renderWidth;
 	uint32_t m_renderHeight;
+	// Newer presented images replace the ones the server has not taken yet
+	bool m_mailboxPresent = false;
+	// 0 to use the image count the compositor asks for
+	uint32_t m_swapchainImages = 0;
+	// Send a sync_file with each present instead of relying on the shared timeline semaphores
+	bool m_presentSyncFiles = false;
+	// ApplyThreadScheduling for the vsync and page flip threads, 0 cores if they are not pinned
+	bool m_threadScheduling = false;
+	uint32_t m_reservedCores = 0;
 };
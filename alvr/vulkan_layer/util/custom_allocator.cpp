@@ -65,4 +65,24 @@ const VkAllocationCallbacks *allocator::get_original_callbacks() const {
     return m_callbacks.pfnAllocation == default_allocation ? nullptr : &m_callbacks;
 }
 
+bool arena::init(size_t size) noexcept {
+    assert(m_block == nullptr);
+
+    auto &cb = m_alloc.m_callbacks;
+    m_block = reinterpret_cast<char *>(
+        cb.pfnAllocation(cb.pUserData, size, alignof(std::max_align_t), m_alloc.m_scope));
+    if (m_block == nullptr) {
+        return false;
+    }
+    m_size = size;
+    m_used = 0;
+    return true;
+}
+
+arena::~arena() {
+    if (m_block != nullptr) {
+        m_alloc.m_callbacks.pfnFree(m_alloc.m_callbacks.pUserData, m_block);
+    }
+}
+
 } /* namespace util */
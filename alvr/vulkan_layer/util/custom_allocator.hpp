@@ -23,6 +23,7 @@
  */
 
 #include <cassert>
+#include <cstddef>
 #include <new>
 #include <string>
 #include <vector>
@@ -86,6 +87,61 @@ class allocator {
 /**
  * @brief Implementation of an allocator that can be used with STL containers.
  */
+/**
+ * @brief Bump allocator over a single block, for objects that live as long as the arena.
+ *
+ * The block is allocated once by init(), sized for everything the owner will create. Objects are
+ * not freed one by one: destroy() only runs the destructor, the memory goes back with the block.
+ */
+class arena {
+  public:
+    arena(const allocator &alloc) : m_alloc(alloc) {}
+    ~arena();
+
+    /* copying not implemented */
+    arena &operator=(const arena &) = delete;
+    arena(const arena &) = delete;
+
+    /**
+     * @brief Allocate the block. Can only be called once.
+     * @return @c false if the allocation failed.
+     */
+    bool init(size_t size) noexcept;
+
+    /**
+     * @brief Construct an object in the block.
+     * @return Pointer to the object or @c nullptr if the block is full or construction threw.
+     */
+    template <typename T, typename... arg_types> T *create(arg_types &&...args) noexcept;
+
+    /**
+     * @brief Destroy an object constructed with arena::create(). Its memory is not reused.
+     */
+    template <typename T> void destroy(T *obj) const noexcept { obj->~T(); }
+
+  private:
+    const allocator m_alloc;
+    char *m_block = nullptr;
+    size_t m_size = 0;
+    size_t m_used = 0;
+};
+
+template <typename T, typename... arg_types> T *arena::create(arg_types &&...args) noexcept {
+    size_t offset = (m_used + alignof(T) - 1) & ~(alignof(T) - 1);
+    if (m_block == nullptr || offset + sizeof(T) > m_size) {
+        return nullptr;
+    }
+
+    T *ptr = reinterpret_cast<T *>(m_block + offset);
+    try {
+        new (ptr) T(std::forward<arg_types>(args)...);
+    } catch (...) {
+        return nullptr;
+    }
+    m_used = offset + sizeof(T);
+    return ptr;
+}
+
 template <typename T> class custom_allocator {
   public:
     using value_type = T;
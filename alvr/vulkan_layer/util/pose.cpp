@@ -1,41 +1,78 @@
 #include "pose.hpp"
+#include "alvr_server/PoseMath.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cmath>
+#include <dlfcn.h>
+#include <link.h>
+#include <mutex>
 #include <string.h>
+#include <vector>
 
 #define UNW_LOCAL_ONLY
 #include <libunwind.h>
 
 namespace {
 
-inline HmdMatrix34_t transposeMul33(const HmdMatrix34_t& a) {
-  HmdMatrix34_t result;
-  for (unsigned i = 0; i < 3; i++) {
-    for (unsigned k = 0; k < 3; k++) {
-      result.m[i][k] = a.m[k][i];
-    }
+const char * const render_update_names[] = {"_ZN13CRenderThread11UpdateAsyncEv", "_ZN13CRenderThread6UpdateEv"};
+
+// Walks that find nothing before they get spaced out, up to one in max_walk_interval calls
+const int misses_before_backoff = 64;
+const int max_walk_interval = 256;
+
+struct proc_range
+{
+  unw_word_t start;
+  unw_word_t end;
+  bool render_update;
+};
+
+// Procedures seen on the stack, so that the name of each is only resolved once and the walk
+// compares instruction pointers
+std::vector<proc_range> procs;
+
+void add_exported_render_updates()
+{
+  for (const char * name : render_update_names)
+  {
+    void * addr = dlsym(RTLD_DEFAULT, name);
+    Dl_info info;
+    const ElfW(Sym) * sym = nullptr;
+    if (addr and dladdr1(addr, &info, (void **)&sym, RTLD_DL_SYMENT) and sym and sym->st_size > 0)
+      procs.push_back({(unw_word_t)addr, (unw_word_t)addr + sym->st_size, true});
   }
-  result.m[0][3] = a.m[0][3];
-  result.m[1][3] = a.m[1][3];
-  result.m[2][3] = a.m[2][3];
-  return result;
 }
 
+bool is_render_update(unw_cursor_t & cursor)
+{
+  unw_word_t ip;
+  unw_get_reg(&cursor, UNW_REG_IP, &ip);
+  // Return addresses may be the end of a procedure ending with a call
+  for (const auto & proc : procs)
+  {
+    if (ip >= proc.start and ip <= proc.end)
+      return proc.render_update;
+  }
 
-inline HmdMatrix34_t matMul33(const HmdMatrix34_t& a, const HmdMatrix34_t& b) {
-  HmdMatrix34_t result;
-  for (unsigned i = 0; i < 3; i++) {
-    for (unsigned j = 0; j < 3; j++) {
-      result.m[i][j] = 0.0f;
-      for (unsigned k = 0; k < 3; k++) {
-        result.m[i][j] += a.m[i][k] * b.m[k][j];
-      }
-    }
+  unw_proc_info_t info;
+  if (unw_get_proc_info(&cursor, &info) != 0 or info.start_ip == info.end_ip)
+  {
+    procs.push_back({ip, ip, false});
+    return false;
   }
-  return result;
+  char name[1024];
+  unw_word_t off;
+  bool match = false;
+  if (unw_get_proc_name(&cursor, name, sizeof(name), &off) == 0)
+  {
+    for (const char * render_update : render_update_names)
+      match = match or strcmp(render_update, name) == 0;
+  }
+  procs.push_back({info.start_ip, info.end_ip, match});
+  return match;
 }
 
-
 bool check_pose(const TrackedDevicePose_t & p)
 {
   if (p.bPoseIsValid != 1 or p.bDeviceIsConnected != 1)
@@ -44,7 +81,7 @@ bool check_pose(const TrackedDevicePose_t & p)
   if (p.eTrackingResult != 200)
     return false;
 
-  auto m = matMul33(p.mDeviceToAbsoluteTracking, transposeMul33(p.mDeviceToAbsoluteTracking));
+  auto m = posemath::Mul33(p.mDeviceToAbsoluteTracking, posemath::Transpose33(p.mDeviceToAbsoluteTracking));
   for (int i = 0 ; i < 3; ++i )
   {
     for (int j = 0 ; j < 3 ; ++j)
@@ -66,22 +103,35 @@ bool check_pose(const TrackedDevicePose_t & p)
 // Such a variable is a TrackedDevicePose_t, with both booleans to true,
 // which we compare to 1 to avoid false positives, a tracking result of
 // 200, and a rotation matrix (A*transpose(A)) close to identity.
+// The functions are looked up in the dynamic symbols the first time, and the procedures of the
+// other frames are only resolved by name once. Presents that keep finding nothing walk the stack
+// less and less often.
 const TrackedDevicePose_t & find_pose_in_call_stack()
 {
-  static TrackedDevicePose_t * res;
-  if (res != nullptr)
-    return *res;
+  static std::atomic<TrackedDevicePose_t *> res;
+  if (TrackedDevicePose_t * p = res.load(std::memory_order_acquire))
+    return *p;
   static TrackedDevicePose_t notfound;
+
+  static std::mutex mutex;
+  static std::once_flag exported_once;
+  static int misses;
+  static int calls_to_skip;
+  std::lock_guard<std::mutex> lock(mutex);
+  if (calls_to_skip > 0)
+  {
+    calls_to_skip--;
+    return notfound;
+  }
+  std::call_once(exported_once, add_exported_render_updates);
+
   unw_context_t ctx;
   unw_getcontext(&ctx);
   unw_cursor_t cursor;
   unw_init_local(&cursor, &ctx);
   while (unw_step(&cursor) > 0)
   {
-    char name[1024];
-    unw_word_t off;
-    unw_get_proc_name(&cursor, name, sizeof(name), &off);
-    if ((strcmp("_ZN13CRenderThread11UpdateAsyncEv", name) == 0) || (strcmp("_ZN13CRenderThread6UpdateEv", name) == 0))
+    if (is_render_update(cursor))
     {
       unw_word_t sp, sp_end;
       unw_get_reg(&cursor, UNW_REG_SP, &sp);
@@ -92,12 +142,15 @@ const TrackedDevicePose_t & find_pose_in_call_stack()
         TrackedDevicePose_t * p = (TrackedDevicePose_t *) addr;
         if (check_pose(*p))
         {
-          res = p;
+          res.store(p, std::memory_order_release);
           return *p;
         }
       }
-      return notfound;
+      break;
     }
   }
+
+  if (++misses > misses_before_backoff)
+    calls_to_skip = std::min(max_walk_interval, 1 << std::min(misses - misses_before_backoff, 8)) - 1;
   return notfound;
 }
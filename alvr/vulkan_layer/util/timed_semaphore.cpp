@@ -24,132 +24,99 @@
 
 #include <cassert>
 #include <cerrno>
+#include <cstdint>
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "timed_semaphore.hpp"
 
 namespace util {
 
 VkResult timed_semaphore::init(unsigned count) {
-    int res;
-
-    m_count = count;
-
-    pthread_condattr_t attr;
-    res = pthread_condattr_init(&attr);
-    /* the only failure that can occur is ENOMEM */
-    assert(res == 0 || res == ENOMEM);
-    if (res != 0) {
-        return VK_ERROR_OUT_OF_HOST_MEMORY;
-    }
-
-    res = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
-    /* only programming error can cause _setclock to fail */
-    assert(res == 0);
-
-    res = pthread_cond_init(&m_cond, &attr);
-    /* the only failure that can occur that is not programming error is ENOMEM */
-    assert(res == 0 || res == ENOMEM);
-    if (res != 0) {
-        pthread_condattr_destroy(&attr);
+    m_fd = eventfd(count, EFD_SEMAPHORE | EFD_NONBLOCK | EFD_CLOEXEC);
+    /* the failures that are not programming errors are out of fds or memory */
+    if (m_fd == -1) {
         return VK_ERROR_OUT_OF_HOST_MEMORY;
     }
 
-    res = pthread_condattr_destroy(&attr);
-    /* only programming error can cause _destroy to fail */
-    assert(res == 0);
-
-    res = pthread_mutex_init(&m_mutex, NULL);
-    /* only programming errors can result in failure */
-    assert(res == 0);
-
-    initialized = true;
-
     return VK_SUCCESS;
 }
 
 timed_semaphore::~timed_semaphore() {
-    int res;
-    (void)res; /* unused when NDEBUG */
-
-    if (initialized) {
-        res = pthread_cond_destroy(&m_cond);
-        assert(res == 0); /* only programming error (EBUSY, EINVAL) */
-
-        res = pthread_mutex_destroy(&m_mutex);
-        assert(res == 0); /* only programming error (EBUSY, EINVAL) */
+    if (m_fd != -1) {
+        close(m_fd);
     }
 }
 
 VkResult timed_semaphore::wait(uint64_t timeout) {
-    VkResult retval = VK_SUCCESS;
-    int res;
-
-    assert(initialized);
-
-    res = pthread_mutex_lock(&m_mutex);
-    assert(res == 0); /* only fails with programming error (EINVAL) */
+    assert(m_fd != -1);
+
+    struct timespec end = {};
+    if (timeout != 0 && timeout != UINT64_MAX) {
+        int res = clock_gettime(CLOCK_MONOTONIC, &end);
+        assert(res == 0); /* only fails with programming error (EINVAL, EFAULT, EPERM) */
+        (void)res;        /* unused when NDEBUG */
+
+        end.tv_sec += static_cast<time_t>(timeout / (1000 * 1000 * 1000));
+        end.tv_nsec += static_cast<long>(timeout % (1000 * 1000 * 1000));
+        if (end.tv_nsec >= 1000 * 1000 * 1000) {
+            end.tv_nsec -= 1000 * 1000 * 1000;
+            end.tv_sec++;
+        }
+    }
 
-    if (m_count == 0) {
-        switch (timeout) {
-        case 0:
-            retval = VK_NOT_READY;
-            break;
-        case UINT64_MAX:
-            res = pthread_cond_wait(&m_cond, &m_mutex);
-            assert(res == 0); /* only fails with programming error (EINVAL) */
+    while (true) {
+        /* in semaphore mode a read decrements the value by one */
+        uint64_t value;
+        if (read(m_fd, &value, sizeof(value)) == sizeof(value)) {
+            return VK_SUCCESS;
+        }
+        /* only fails with EAGAIN if the value is 0, other errors are programming errors */
+        assert(errno == EAGAIN || errno == EINTR);
 
-            break;
-        default:
-            struct timespec diff = {/* narrowing casts */
-                                    static_cast<time_t>(timeout / (1000 * 1000 * 1000)),
-                                    static_cast<long>(timeout % (1000 * 1000 * 1000))};
+        if (timeout == 0) {
+            return VK_NOT_READY;
+        }
 
+        /* the remaining time, the clock is read again after spurious wakeups */
+        struct timespec remaining;
+        struct timespec *remaining_ptr = nullptr;
+        if (timeout != UINT64_MAX) {
             struct timespec now;
-            res = clock_gettime(CLOCK_MONOTONIC, &now);
-            assert(res == 0); /* only fails with programming error (EINVAL, EFAULT, EPERM) */
-
-            /* add diff to now, handling overflow */
-            struct timespec end = {now.tv_sec + diff.tv_sec, now.tv_nsec + diff.tv_nsec};
-
-            if (end.tv_nsec >= 1000 * 1000 * 1000) {
-                end.tv_nsec -= 1000 * 1000 * 1000;
-                end.tv_sec++;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            remaining.tv_sec = end.tv_sec - now.tv_sec;
+            remaining.tv_nsec = end.tv_nsec - now.tv_nsec;
+            if (remaining.tv_nsec < 0) {
+                remaining.tv_nsec += 1000 * 1000 * 1000;
+                remaining.tv_sec--;
             }
-
-            res = pthread_cond_timedwait(&m_cond, &m_mutex, &end);
-            /* only fails with programming error, other than timeout */
-            assert(res == 0 || res == ETIMEDOUT);
-            if (res != 0) {
-                retval = VK_TIMEOUT;
+            if (remaining.tv_sec < 0) {
+                return VK_TIMEOUT;
             }
+            remaining_ptr = &remaining;
         }
-    }
-    if (retval == VK_SUCCESS) {
-        assert(m_count > 0);
-        m_count--;
-    }
-    res = pthread_mutex_unlock(&m_mutex);
-    assert(res == 0); /* only fails with programming error (EPERM) */
 
-    return retval;
+        /* another waiter can take the value first, the read above is retried either way */
+        struct pollfd pfd = {m_fd, POLLIN, 0};
+        int res = ppoll(&pfd, 1, remaining_ptr, nullptr);
+        assert(res >= 0 || errno == EINTR); /* only fails with programming error otherwise */
+        if (res == 0) {
+            /* a post may still have raced with the timeout */
+            return read(m_fd, &value, sizeof(value)) == sizeof(value) ? VK_SUCCESS : VK_TIMEOUT;
+        }
+    }
 }
 
 void timed_semaphore::post() {
-    int res;
-    (void)res; /* unused when NDEBUG */
-
-    assert(initialized);
-
-    res = pthread_mutex_lock(&m_mutex);
-    assert(res == 0); /* only fails with programming error (EINVAL) */
-
-    m_count++;
-
-    res = pthread_cond_signal(&m_cond);
-    assert(res == 0); /* only fails with programming error (EINVAL) */
+    assert(m_fd != -1);
 
-    res = pthread_mutex_unlock(&m_mutex);
-    assert(res == 0); /* only fails with programming error (EPERM) */
+    uint64_t one = 1;
+    ssize_t res = write(m_fd, &one, sizeof(one));
+    assert(res == sizeof(one)); /* only fails if the value would overflow */
+    (void)res;                  /* unused when NDEBUG */
 }
 
 } /* namespace util */
@@ -32,33 +32,19 @@
  * as the system time may change, resulting in an incorrect timeout period
  * (potentially by a significant amount).
  *
- * We therefore have to re-engineer semaphores using condition variables.
+ * The semaphore is therefore an eventfd in semaphore mode, waited on with ppoll, which takes a
+ * relative timeout on the monotonic clock. Posting is a single write that wakes the waiting
+ * thread directly, without a mutex handoff, and the fd can be polled together with other fds.
  *
  * This code does not use the C++ standard library to avoid exceptions.
  */
 
 #pragma once
 
-extern "C" {
-#include <pthread.h>
-}
-
 #include <vulkan/vulkan.h>
 
 namespace util {
 
-/**
- * brief semaphore with a safe relative timed wait
- *
- * sem_timedwait takes an absolute time, based on CLOCK_REALTIME. Simply
- * taking the current time and adding on a relative timeout is not correct,
- * as the system time may change, resulting in an incorrect timeout period
- * (potentially by a significant amount).
- *
- * We therefore have to re-engineer semaphores using condition variables.
- *
- * This code does not use the C++ standard library to avoid exceptions.
- */
 class timed_semaphore {
   public:
     /* copying not implemented */
@@ -66,13 +52,13 @@ class timed_semaphore {
     timed_semaphore(const timed_semaphore &) = delete;
 
     ~timed_semaphore();
-    timed_semaphore() : initialized(false){};
+    timed_semaphore() : m_fd(-1){};
 
     /**
      * @brief initializes the semaphore
      *
      * @param count initial value of the semaphore
-     * @retval VK_ERROR_OUT_OF_HOST_MEMORY out of memory condition from pthread calls
+     * @retval VK_ERROR_OUT_OF_HOST_MEMORY the eventfd could not be created
      * @retval VK_SUCCESS on success
      */
     VkResult init(unsigned count);
@@ -94,18 +80,9 @@ class timed_semaphore {
 
   private:
     /**
-     * @brief true if the semaphore has been initialized
-     *
-     * Determines if the destructor should cleanup the mutex and cond.
+     * @brief The eventfd holding the semaphore value, -1 if the semaphore is not initialized
      */
-    bool initialized;
-    /**
-     * @brief semaphore value
-     */
-    unsigned m_count;
-
-    pthread_mutex_t m_mutex;
-    pthread_cond_t m_cond;
+    int m_fd;
 };
 
 } /* namespace util */
@@ -1,13 +1,64 @@
 #include "display.hpp"
 
 #include"layer/settings.h"
+#include "alvr_server/ThreadScheduling.h"
+#include "platform/linux/protocol.h"
+#include "util/logger.h"
 
+#include <algorithm>
+#include <cerrno>
 #include <chrono>
+#include <ctime>
+#include <stdio.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+namespace {
+uint64_t now_ns()
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1'000'000'000ull + ts.tv_nsec;
+}
+}
 
 wsi::display::display()
 {
 }
 
+void wsi::display::set_vsync_source(const present_ring *ring)
+{
+  std::lock_guard<std::mutex> lock(m_source_mutex);
+  m_vsync_source = ring;
+}
+
+void wsi::display::unset_vsync_source(const present_ring *ring)
+{
+  std::lock_guard<std::mutex> lock(m_source_mutex);
+  if (m_vsync_source == ring)
+    m_vsync_source = nullptr;
+}
+
+// First vsync of the driver schedule at least half a period after the last one, so that moving
+// the phase never fires twice for the same frame nor skips one
+uint64_t wsi::display::next_vsync_ns(uint64_t last_vsync_ns, uint64_t fallback_period_ns)
+{
+  uint64_t time = 0;
+  uint64_t period = 0;
+  {
+    std::lock_guard<std::mutex> lock(m_source_mutex);
+    if (m_vsync_source == nullptr or not m_vsync_source->read_vsync(time, period))
+      return last_vsync_ns + fallback_period_ns;
+  }
+
+  uint64_t earliest = last_vsync_ns + period / 2;
+  if (time < earliest)
+    time += (earliest - time + period - 1) / period * period;
+  else
+    time -= (time - earliest) / period * period;
+  return time;
+}
+
 VkFence wsi::display::get_vsync_fence()
 {
   if (not std::atomic_exchange(&m_thread_running, true))
@@ -15,16 +66,37 @@ VkFence wsi::display::get_vsync_fence()
   vsync_fence = reinterpret_cast<VkFence>(this);
   m_vsync_thread = std::thread([this]()
       {
+      if (Settings::Instance().m_threadScheduling and
+          not ApplyThreadScheduling(MmcssTask::ProAudio, Settings::Instance().m_reservedCores)) {
+        Warn("Failed to apply the thread scheduling settings to the vsync thread\n");
+      }
       auto refresh = Settings::Instance().m_refreshRate;
-      auto next_frame = std::chrono::steady_clock::now();
-      auto frame_time = std::chrono::duration_cast<decltype(next_frame)::duration>(std::chrono::duration<double>(1. / refresh));
+      uint64_t frame_time = 1'000'000'000 / std::max(refresh, 1);
+      // An absolute timer on the same clock as the driver schedule, which can be moved each frame
+      int timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+      if (timer == -1) {
+        perror("timerfd_create");
+      }
+      uint64_t vsync = now_ns();
       while (not m_exiting) {
-        std::this_thread::sleep_until(next_frame);
+        vsync = next_vsync_ns(vsync, frame_time);
+        if (timer != -1) {
+          itimerspec spec = {};
+          spec.it_value.tv_sec = vsync / 1'000'000'000;
+          spec.it_value.tv_nsec = vsync % 1'000'000'000;
+          uint64_t expirations;
+          if (timerfd_settime(timer, TFD_TIMER_ABSTIME, &spec, nullptr) == 0) {
+            while (read(timer, &expirations, sizeof(expirations)) == -1 and errno == EINTR) {}
+          }
+        } else {
+          std::this_thread::sleep_for(std::chrono::nanoseconds(vsync - std::min(vsync, now_ns())));
+        }
         m_signaled = true;
         m_cond.notify_all();
         m_vsync_count += 1;
-        next_frame += frame_time;
       }
+      if (timer != -1)
+        close(timer);
       });
   }
   m_signaled = false;
@@ -5,6 +5,8 @@
 #include <thread>
 #include <condition_variable>
 
+struct present_ring;
+
 namespace wsi {
 
 class display {
@@ -18,9 +20,16 @@ class display {
     bool is_signaled() const { return m_signaled; }
     bool wait_for_vsync(uint64_t timeoutNs);
 
+    // Vsyncs follow the schedule the driver writes in the ring, instead of a fixed period
+    void set_vsync_source(const present_ring *ring);
+    // Only if the ring is the current source
+    void unset_vsync_source(const present_ring *ring);
+
     std::atomic<uint64_t> m_vsync_count{0};
 
   private:
+    uint64_t next_vsync_ns(uint64_t last_vsync_ns, uint64_t fallback_period_ns);
+
     std::atomic_bool m_thread_running{false};
     std::atomic_bool m_exiting{false};
     std::thread m_vsync_thread;
@@ -28,6 +37,8 @@ class display {
     std::mutex m_mutex;
     std::condition_variable m_cond;
     std::atomic_bool m_signaled = false;
+    std::mutex m_source_mutex;
+    const present_ring *m_vsync_source = nullptr;
 };
 
 } // namespace wsi
@@ -144,8 +144,8 @@ VkResult surface_properties::get_surface_present_modes(VkPhysicalDevice physical
     UNUSED(surface);
 
     VkResult res = VK_SUCCESS;
-    static const std::array<VkPresentModeKHR, 2> modes = {VK_PRESENT_MODE_FIFO_KHR,
-                                                          VK_PRESENT_MODE_FIFO_RELAXED_KHR};
+    static const std::array<VkPresentModeKHR, 3> modes = {
+        VK_PRESENT_MODE_FIFO_KHR, VK_PRESENT_MODE_FIFO_RELAXED_KHR, VK_PRESENT_MODE_MAILBOX_KHR};
 
     assert(present_mode_count != nullptr);
 
@@ -28,6 +28,7 @@
  * @brief Contains the implementation for a headless swapchain.
  */
 
+#include <algorithm>
 #include <cassert>
 #include <cstdlib>
 #include <errno.h>
@@ -35,6 +36,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <unistd.h>
@@ -43,6 +45,7 @@
 
 #include <util/timed_semaphore.hpp>
 
+#include "layer/settings.h"
 #include "util/logger.h"
 #include "platform/linux/protocol.h"
 #include "swapchain.hpp"
@@ -57,11 +60,29 @@ struct image_data {
 };
 
 swapchain::swapchain(layer::device_private_data &dev_data, const VkAllocationCallbacks *pAllocator)
-    : wsi::swapchain_base(dev_data, pAllocator), m_display(*dev_data.display) {}
+    : wsi::swapchain_base(dev_data, pAllocator), m_image_arena(m_allocator),
+      m_display(*dev_data.display) {}
+
+VkResult swapchain::init_platform(VkDevice device,
+                                  const VkSwapchainCreateInfoKHR *pSwapchainCreateInfo) {
+    /* The images are only created once, so the arena is sized for all of them up front. */
+    size_t size = m_swapchain_images.size() * (sizeof(image_data) + alignof(image_data));
+    if (!m_image_arena.init(size)) {
+        return VK_ERROR_OUT_OF_HOST_MEMORY;
+    }
+    return VK_SUCCESS;
+}
 
 swapchain::~swapchain() {
     /* Call the base's teardown */
     close(m_socket);
+    m_display.unset_vsync_source(m_ring);
+    if (m_ring != nullptr)
+        munmap(m_ring, sizeof(present_ring));
+    if (m_ring_fd != -1)
+        close(m_ring_fd);
+    if (m_doorbell != -1)
+        close(m_doorbell);
     teardown();
 }
 
@@ -113,7 +134,7 @@ VkResult swapchain::create_image(const VkImageCreateInfo &image_create,
     image_data *data = nullptr;
 
     /* Create image_data */
-    data = m_allocator.create<image_data>(1);
+    data = m_image_arena.create<image_data>();
     if (data == nullptr) {
         m_device_data.disp.DestroyImage(m_device, image.image, get_allocation_callbacks());
         return VK_ERROR_OUT_OF_HOST_MEMORY;
@@ -194,30 +215,66 @@ VkResult swapchain::create_image(const VkImageCreateInfo &image_create,
     m_fds.push_back(fd);
     Debug("GetSemaphoreFdKHR returned fd=%d\n", fd);
 
+    if (Settings::Instance().m_presentSyncFiles && supports_sync_files()) {
+        VkExportSemaphoreCreateInfo sync_exp_info = {};
+        sync_exp_info.sType = VK_STRUCTURE_TYPE_EXPORT_SEMAPHORE_CREATE_INFO;
+        sync_exp_info.handleTypes = VK_EXTERNAL_SEMAPHORE_HANDLE_TYPE_SYNC_FD_BIT;
+
+        VkSemaphoreCreateInfo sync_sem_info = {};
+        sync_sem_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+        sync_sem_info.pNext = &sync_exp_info;
+
+        // Without it the image is waited on through its timeline semaphore
+        if (m_device_data.disp.CreateSemaphore(m_device, &sync_sem_info, nullptr,
+                                               &image.sync_semaphore) != VK_SUCCESS) {
+            Error("CreateSemaphore failed for present sync files\n");
+            image.sync_semaphore = VK_NULL_HANDLE;
+        }
+    }
+
     return res;
 }
 
-int swapchain::send_fds() {
+bool swapchain::supports_sync_files() {
+    auto &instance_disp = m_device_data.instance_data.disp;
+    if (instance_disp.GetPhysicalDeviceExternalSemaphoreProperties == nullptr ||
+        m_device_data.disp.GetSemaphoreFdKHR == nullptr ||
+        m_device_data.disp.DestroySemaphore == nullptr) {
+        return false;
+    }
+
+    VkPhysicalDeviceExternalSemaphoreInfo external_info = {};
+    external_info.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTERNAL_SEMAPHORE_INFO;
+    external_info.handleType = VK_EXTERNAL_SEMAPHORE_HANDLE_TYPE_SYNC_FD_BIT;
+
+    VkExternalSemaphoreProperties external_props = {};
+    external_props.sType = VK_STRUCTURE_TYPE_EXTERNAL_SEMAPHORE_PROPERTIES;
+    instance_disp.GetPhysicalDeviceExternalSemaphoreProperties(m_device_data.physical_device,
+                                                               &external_info, &external_props);
+    return external_props.externalSemaphoreFeatures & VK_EXTERNAL_SEMAPHORE_FEATURE_EXPORTABLE_BIT;
+}
+
+int swapchain::send_fds(const int *fds, size_t count) {
     // This function does the arcane magic for sending
     // file descriptors over unix domain sockets
     // Stolen from https://gist.github.com/kokjo/75cec0f466fc34fa2922
     //
-    // There will always be 6 fds (for the 3 images and sempahores created in the swapchain) so we can avoid
-    // dynamic length. Initially, I tried to send the length in the normal data field (msg.msg_iov /
-    // data) but for some reason it was emptied on arrival, no matter what I did.
+    // The receiver knows how many fds to expect (an image and a semaphore for each of the
+    // init_packet num_images, then 2 for the present ring) so we can avoid sending the length.
+    // Initially, I tried to send the length in the normal data field (msg.msg_iov / data) but for
+    // some reason it was emptied on arrival, no matter what I did.
     //
     struct msghdr msg;
     struct iovec iov[1];
     struct cmsghdr *cmsg = NULL;
-    assert(m_fds.size() == 6);
-    int fds[6];
-    char ctrl_buf[CMSG_SPACE(sizeof(fds))];
+    size_t fds_size = count * sizeof(int);
+    size_t ctrl_size = count == 0 ? 0 : CMSG_SPACE(fds_size);
+    if (m_control_buffer.size() < ctrl_size)
+        m_control_buffer.resize(ctrl_size);
+    memset(m_control_buffer.data(), 0, ctrl_size);
     char data[1];
 
-    std::copy(m_fds.begin(), m_fds.end(), fds);
-
     memset(&msg, 0, sizeof(struct msghdr));
-    memset(ctrl_buf, 0, CMSG_SPACE(sizeof(fds)));
 
     iov[0].iov_base = data;
     iov[0].iov_len = sizeof(data);
@@ -226,28 +283,61 @@ int swapchain::send_fds() {
     msg.msg_namelen = 0;
     msg.msg_iov = iov;
     msg.msg_iovlen = 1;
-    msg.msg_controllen = CMSG_SPACE(sizeof(fds));
-    msg.msg_control = ctrl_buf;
+    msg.msg_controllen = ctrl_size;
+    msg.msg_control = ctrl_size == 0 ? NULL : m_control_buffer.data();
+
+    // Only the data byte, for present sync files that failed to export
+    if (count == 0)
+        return sendmsg(m_socket, &msg, 0);
 
     cmsg = CMSG_FIRSTHDR(&msg);
     cmsg->cmsg_level = SOL_SOCKET;
     cmsg->cmsg_type = SCM_RIGHTS;
-    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    cmsg->cmsg_len = CMSG_LEN(fds_size);
 
-    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, fds_size);
 
-    int ret = sendmsg(m_socket, &msg, 0);
+    return sendmsg(m_socket, &msg, 0);
+}
 
-    for (auto fd: m_fds)
-      close(fd);
+bool swapchain::create_ring() {
+    if (m_ring != nullptr)
+        return true;
 
-    return ret;
+    m_ring_fd = memfd_create("alvr-present-ring", MFD_CLOEXEC);
+    if (m_ring_fd == -1) {
+        perror("memfd_create");
+        return false;
+    }
+    if (ftruncate(m_ring_fd, sizeof(present_ring)) == -1) {
+        perror("ftruncate");
+        close(m_ring_fd);
+        m_ring_fd = -1;
+        return false;
+    }
+    void *mem = mmap(nullptr, sizeof(present_ring), PROT_READ | PROT_WRITE, MAP_SHARED, m_ring_fd, 0);
+    if (mem == MAP_FAILED) {
+        perror("mmap");
+        close(m_ring_fd);
+        m_ring_fd = -1;
+        return false;
+    }
+    m_doorbell = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (m_doorbell == -1) {
+        perror("eventfd");
+        munmap(mem, sizeof(present_ring));
+        close(m_ring_fd);
+        m_ring_fd = -1;
+        return false;
+    }
+    // memfd pages are zero filled, which is the initial state of the ring
+    m_ring = new (mem) present_ring;
+    return true;
 }
 
 bool swapchain::try_connect() {
     Debug("swapchain::try_connect\n");
-    m_socketPath = getenv("XDG_RUNTIME_DIR");
-    m_socketPath += "/alvr-ipc";
+    m_socketPath = ipc_socket_path();
 
     int ret;
     if (m_socket == -1) {
@@ -281,7 +371,15 @@ bool swapchain::try_connect() {
       .device_uuid = {},
       .image_create_info = m_create_info,
       .mem_index = m_mem_index,
-      .source_pid = getpid()};
+      .source_pid = getpid(),
+      .protocol_version = create_ring() ? ALVR_IPC_PROTOCOL_VERSION : 1,
+      .flags = 0};
+    // A sync_file for every present, or none
+    m_sync_file_presents = init.protocol_version >= 5 &&
+        std::all_of(m_swapchain_images.begin(), m_swapchain_images.end(),
+                    [](const auto &image) { return image.sync_semaphore != VK_NULL_HANDLE; });
+    if (m_sync_file_presents)
+        init.flags |= ALVR_IPC_FLAG_SYNC_FILE_PRESENTS;
     memcpy(init.device_uuid.data(), props11.deviceUUID, VK_UUID_SIZE);
     ret = write(m_socket, &init, sizeof(init));
     if (ret == -1) {
@@ -289,18 +387,31 @@ bool swapchain::try_connect() {
         exit(1);
     }
 
-    ret = send_fds();
+    ret = send_fds(m_fds.data(), m_fds.size());
     if (ret == -1) {
         perror("sendmsg");
         exit(1);
     }
+    for (auto fd: m_fds)
+      close(fd);
+
+    if (init.protocol_version >= 2) {
+        int ring_fds[] = {m_ring_fd, m_doorbell};
+        ret = send_fds(ring_fds, 2);
+        if (ret == -1) {
+            perror("sendmsg");
+            exit(1);
+        }
+        m_display.set_vsync_source(m_ring);
+    }
     Debug("swapchain sent fds\n");
 
     return true;
 }
 
-void swapchain::submit_image(uint32_t pending_index) {
-    const auto & pose = m_swapchain_images[pending_index].pose.mDeviceToAbsoluteTracking.m;
+void swapchain::submit_image(uint32_t pending_index, int sync_file) {
+    const auto & device_pose = m_swapchain_images[pending_index].pose;
+    const auto & pose = device_pose.mDeviceToAbsoluteTracking.m;
     if (!m_connected) {
         m_connected = try_connect();
     }
@@ -311,11 +422,28 @@ void swapchain::submit_image(uint32_t pending_index) {
         packet.frame = m_display.m_vsync_count;
         packet.semaphore_value = m_swapchain_images[pending_index].semaphore_value;
         memcpy(&packet.pose, pose, sizeof(packet.pose));
-        ret = write(m_socket, &packet, sizeof(packet));
+        packet.pose_tag = pose_tag_from_velocity(device_pose.vVelocity.v);
+        packet.present_ns = m_swapchain_images[pending_index].present_ns;
+        packet.previous_gpu_ns = m_last_gpu_ns;
+        if (m_ring != nullptr) {
+            if (m_sync_file_presents) {
+                // Before the packet, so that the server has it once it reads the packet
+                if (send_fds(&sync_file, sync_file != -1 ? 1 : 0) == -1)
+                    perror("sendmsg");
+            }
+            // Publishing never blocks, the doorbell only wakes up the server if it's waiting
+            m_ring->publish(packet);
+            uint64_t one = 1;
+            ret = write(m_doorbell, &one, sizeof(one));
+        } else {
+            ret = write(m_socket, &packet, sizeof(packet));
+        }
         if (ret == -1) {
             //FIXME: try to reconnect?
         }
     }
+    if (sync_file != -1)
+        close(sync_file);
 }
 
 void swapchain::present_image(uint32_t pending_index) {
@@ -335,6 +463,11 @@ void swapchain::destroy_image(wsi::swapchain_image &image) {
             m_device_data.disp.DestroyImage(m_device, image.image, get_allocation_callbacks());
             image.image = VK_NULL_HANDLE;
         }
+
+        if (image.sync_semaphore != VK_NULL_HANDLE) {
+            m_device_data.disp.DestroySemaphore(m_device, image.sync_semaphore, nullptr);
+            image.sync_semaphore = VK_NULL_HANDLE;
+        }
     }
 
     if (image.data != nullptr) {
@@ -343,7 +476,7 @@ void swapchain::destroy_image(wsi::swapchain_image &image) {
             m_device_data.disp.FreeMemory(m_device, data->memory, nullptr);
             data->memory = VK_NULL_HANDLE;
         }
-        m_allocator.destroy(1, data);
+        m_image_arena.destroy(data);
         image.data = nullptr;
     }
 
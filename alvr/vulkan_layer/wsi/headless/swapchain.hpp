@@ -58,9 +58,7 @@ class swapchain : public wsi::swapchain_base {
     /**
      * @brief Platform specific init
      */
-    VkResult init_platform(VkDevice device, const VkSwapchainCreateInfoKHR *pSwapchainCreateInfo) {
-        return VK_SUCCESS;
-    };
+    VkResult init_platform(VkDevice device, const VkSwapchainCreateInfoKHR *pSwapchainCreateInfo);
 
     /**
      * @brief Creates a new swapchain image.
@@ -75,7 +73,7 @@ class swapchain : public wsi::swapchain_base {
      */
     VkResult create_image(const VkImageCreateInfo &image_create_info, wsi::swapchain_image &image);
 
-    void submit_image(uint32_t pendingIndex);
+    void submit_image(uint32_t pendingIndex, int sync_file);
 
     /**
      * @brief Method to perform a present - just calls unpresent_image on headless
@@ -94,11 +92,23 @@ class swapchain : public wsi::swapchain_base {
 
   private:
     bool try_connect();
-    int send_fds();
+    bool create_ring();
+    bool supports_sync_files();
+    int send_fds(const int *fds, size_t count);
+    /* The image_data of the images */
+    util::arena m_image_arena;
+    /* Control message buffer of send_fds, grown by the init fds so that presents reuse it */
+    std::vector<char> m_control_buffer;
     int m_socket = -1;
     std::string m_socketPath;
     bool m_connected = false;
     std::vector<int> m_fds;
+    /* Shared memory present ring (protocol version 2), and the eventfd rung after each publish */
+    present_ring *m_ring = nullptr;
+    int m_ring_fd = -1;
+    int m_doorbell = -1;
+    /* A sync_file is sent on the socket before each packet published in the ring (version 5) */
+    bool m_sync_file_presents = false;
     VkImageCreateInfo m_create_info;
     size_t m_mem_index;
     display &m_display;
@@ -31,17 +31,23 @@
  * that is not specific to how images are created or presented.
  */
 
+#include <algorithm>
 #include <array>
 #include <cassert>
 #include <cerrno>
 #include <cstdio>
 #include <cstdlib>
+#include <ctime>
 
+#include <poll.h>
 #include <unistd.h>
 #include <vulkan/vulkan.h>
 
+#include "alvr_server/ThreadScheduling.h"
 #include "display.hpp"
+#include "layer/settings.h"
 #include "swapchain_base.hpp"
+#include "util/logger.h"
 
 #if VULKAN_WSI_DEBUG > 0
 #define WSI_PRINT_ERROR(...) fprintf(stderr, ##__VA_ARGS__)
@@ -49,43 +55,78 @@
 #define WSI_PRINT_ERROR(...) (void)0
 #endif
 
+namespace {
+/* On the clock of the driver, which times the presents against its vsyncs */
+uint64_t monotonic_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1'000'000'000ull + ts.tv_nsec;
+}
+} // namespace
+
 namespace wsi {
 
 void swapchain_base::page_flip_thread() {
     auto &sc_images = m_swapchain_images;
     VkResult vk_res = VK_SUCCESS;
-    uint64_t timeout = UINT64_MAX;
-    constexpr uint64_t SEMAPHORE_TIMEOUT = 250000000; /* 250 ms. */
 
-    /* No mutex is needed for the accesses to m_page_flip_thread_run variable as after the variable
-     * is initialized it is only ever changed to false. The while loop will make the thread read the
-     * value repeatedly, and the combination of semaphores and thread joins will force any changes
-     * to the variable to be visible to this thread.
-     */
+    if (Settings::Instance().m_threadScheduling &&
+        !ApplyThreadScheduling(MmcssTask::ProAudio, Settings::Instance().m_reservedCores)) {
+        Warn("Failed to apply the thread scheduling settings to the page flip thread\n");
+    }
+
     while (m_page_flip_thread_run) {
         /* Waiting for the page_flip_semaphore which will be signalled once there is an
-         * image to display.*/
-        if ((vk_res = m_page_flip_semaphore.wait(SEMAPHORE_TIMEOUT)) == VK_TIMEOUT) {
-            /* Image is not ready yet. */
-            continue;
-        }
+         * image to display, or by teardown once m_page_flip_thread_run is cleared. */
+        vk_res = m_page_flip_semaphore.wait(UINT64_MAX);
         assert(vk_res == VK_SUCCESS);
+        if (!m_page_flip_thread_run) {
+            break;
+        }
 
         /* We want to present the oldest queued for present image from our present queue,
          * which we can find at the sc->pending_buffer_pool.head index. */
         uint32_t pending_index = m_pending_buffer_pool.ring[m_pending_buffer_pool.head];
         m_pending_buffer_pool.head = (m_pending_buffer_pool.head + 1) % m_pending_buffer_pool.size;
 
-        submit_image(pending_index);
+        /* In mailbox mode, the newest queued image replaces the older ones, so that the server
+         * never encodes a frame that waited behind another. */
+        while (m_present_mode == VK_PRESENT_MODE_MAILBOX_KHR &&
+               m_page_flip_semaphore.wait(0) == VK_SUCCESS) {
+            if (!m_page_flip_thread_run) {
+                /* The wakeup of teardown, not an image. The outer loop ends after this one. */
+                break;
+            }
+            drop_pending_image(pending_index);
+            pending_index = m_pending_buffer_pool.ring[m_pending_buffer_pool.head];
+            m_pending_buffer_pool.head =
+                (m_pending_buffer_pool.head + 1) % m_pending_buffer_pool.size;
+        }
+
+        /* Exported before the submit, which takes it, so that this thread can sleep on a copy. */
+        int sync_file = export_sync_file(sc_images[pending_index]);
+        int present_sync_file = sync_file != -1 ? dup(sync_file) : -1;
+
+        submit_image(pending_index, sync_file);
 
         /* We wait for the fence of the oldest pending image to be signalled. */
-        vk_res = m_device_data.disp.WaitForFences(
-            m_device, 1, &sc_images[pending_index].present_fence, VK_TRUE, timeout);
+        uint64_t wait_start_ns = monotonic_ns();
+        vk_res = wait_for_present(sc_images[pending_index], present_sync_file);
+        if (present_sync_file != -1) {
+            close(present_sync_file);
+        }
         if (vk_res != VK_SUCCESS) {
             m_is_valid = false;
             m_free_image_semaphore.post();
             continue;
         }
+        /* The fence signals once the compositor's rendering of the image and the signal submission
+         * are done. This thread wakes up right after, which is closer to the GPU completion than
+         * what the server can see, and doesn't need timestamp queries on the compositor's queue.
+         * In FIFO mode the image can be queued while this thread still presents the previous
+         * one, so the time only counts from when the wait started. Sent with the next present. */
+        m_last_gpu_ns =
+            monotonic_ns() - std::max(sc_images[pending_index].present_ns, wait_start_ns);
 
         /* If the descendant has started presenting the queue_present operation has marked the image
          * as FREE so we simply release it and continue. */
@@ -116,6 +157,54 @@ void swapchain_base::page_flip_thread() {
     }
 }
 
+void swapchain_base::drop_pending_image(uint32_t pending_index) {
+    /* Unsignals the binary semaphore for the next present */
+    int sync_file = export_sync_file(m_swapchain_images[pending_index]);
+
+    /* The fence is reset by the next present of the image, it must not be in use anymore. */
+    VkResult vk_res = wait_for_present(m_swapchain_images[pending_index], sync_file);
+    if (vk_res != VK_SUCCESS) {
+        m_is_valid = false;
+    }
+    if (sync_file != -1) {
+        close(sync_file);
+    }
+
+    unpresent_image(pending_index);
+}
+
+VkResult swapchain_base::wait_for_present(swapchain_image &image, int sync_file) {
+    /* The sync_file signals with the submission of the present, so the thread sleeps in the kernel
+     * until the gpu is done instead of in the driver's fence wait, which may spin. The fence is
+     * still waited on, it is signalled last and the wait returns right away. */
+    if (sync_file != -1) {
+        struct pollfd pfd = {sync_file, POLLIN, 0};
+        while (poll(&pfd, 1, -1) == -1 && errno == EINTR) {
+        }
+    }
+
+    return m_device_data.disp.WaitForFences(m_device, 1, &image.present_fence, VK_TRUE,
+                                            UINT64_MAX);
+}
+
+int swapchain_base::export_sync_file(swapchain_image &image) {
+    if (image.sync_semaphore == VK_NULL_HANDLE) {
+        return -1;
+    }
+
+    VkSemaphoreGetFdInfoKHR fd_info = {};
+    fd_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_GET_FD_INFO_KHR;
+    fd_info.semaphore = image.sync_semaphore;
+    fd_info.handleType = VK_EXTERNAL_SEMAPHORE_HANDLE_TYPE_SYNC_FD_BIT;
+
+    int fd = -1;
+    if (m_device_data.disp.GetSemaphoreFdKHR(m_device, &fd_info, &fd) != VK_SUCCESS) {
+        WSI_PRINT_ERROR("GetSemaphoreFdKHR failed for a present sync_file\n");
+        return -1;
+    }
+    return fd;
+}
+
 void swapchain_base::unpresent_image(uint32_t presented_index) {
     m_swapchain_images[presented_index].status = swapchain_image::FREE;
 
@@ -149,8 +238,8 @@ VkResult swapchain_base::init(VkDevice device,
 
     /* Check presentMode has a compatible value with swapchain - everything else should be taken
      * care at image creation.*/
-    static const std::array<VkPresentModeKHR, 2> present_modes = {VK_PRESENT_MODE_FIFO_KHR,
-                                                                  VK_PRESENT_MODE_FIFO_RELAXED_KHR};
+    static const std::array<VkPresentModeKHR, 3> present_modes = {
+        VK_PRESENT_MODE_FIFO_KHR, VK_PRESENT_MODE_FIFO_RELAXED_KHR, VK_PRESENT_MODE_MAILBOX_KHR};
     bool present_mode_found = false;
     for (uint32_t i = 0; i < present_modes.size() && !present_mode_found; i++) {
         if (swapchain_create_info->presentMode == present_modes[i]) {
@@ -162,8 +251,16 @@ VkResult swapchain_base::init(VkDevice device,
         return VK_ERROR_INITIALIZATION_FAILED;
     }
 
+    /* The SteamVR compositor only asks for FIFO, the setting turns it into mailbox. */
+    m_present_mode = Settings::Instance().m_mailboxPresent ? VK_PRESENT_MODE_MAILBOX_KHR
+                                                           : swapchain_create_info->presentMode;
+
+    /* The setting can add images, but never go below what the application asked for. */
+    uint32_t image_count =
+        std::max(swapchain_create_info->minImageCount, Settings::Instance().m_swapchainImages);
+
     /* Init image to invalid values. */
-    if (!m_swapchain_images.try_resize(swapchain_create_info->minImageCount))
+    if (!m_swapchain_images.try_resize(image_count))
         return VK_ERROR_OUT_OF_HOST_MEMORY;
 
     /* Initialize ring buffer. */
@@ -299,8 +396,9 @@ void swapchain_base::teardown() {
 
     /* We are safe to destroy everything. */
     if (m_thread_sem_defined) {
-        /* Tell flip thread to end. */
+        /* Tell flip thread to end, and wake it up to see it. */
         m_page_flip_thread_run = false;
+        m_page_flip_semaphore.post();
 
         if (m_page_flip_thread.joinable()) {
             m_page_flip_thread.join();
@@ -435,10 +533,16 @@ VkResult swapchain_base::queue_present(VkQueue queue, const VkPresentInfoKHR *pr
 
     uint64_t signal_value = ++m_swapchain_images[image_index].semaphore_value;
 
+    /* The value of the binary semaphore is ignored, but the arrays must have the same size. */
+    std::array<VkSemaphore, 2> signal_semaphores = {m_swapchain_images[image_index].semaphore,
+                                                    m_swapchain_images[image_index].sync_semaphore};
+    std::array<uint64_t, 2> signal_values = {signal_value, 0};
+    uint32_t signal_count = signal_semaphores[1] != VK_NULL_HANDLE ? 2 : 1;
+
     VkTimelineSemaphoreSubmitInfo timeline_info = {};
     timeline_info.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
-    timeline_info.signalSemaphoreValueCount = 1;
-    timeline_info.pSignalSemaphoreValues = &signal_value;
+    timeline_info.signalSemaphoreValueCount = signal_count;
+    timeline_info.pSignalSemaphoreValues = signal_values.data();
 
     VkSubmitInfo submit_info = {VK_STRUCTURE_TYPE_SUBMIT_INFO,
                                 &timeline_info,
@@ -447,8 +551,8 @@ VkResult swapchain_base::queue_present(VkQueue queue, const VkPresentInfoKHR *pr
                                 &pipeline_stage_flags,
                                 0,
                                 NULL,
-                                1,
-                                &m_swapchain_images[image_index].semaphore};
+                                signal_count,
+                                signal_semaphores.data()};
 
     assert(m_swapchain_images[image_index].status == swapchain_image::ACQUIRED);
     result =
@@ -462,6 +566,7 @@ VkResult swapchain_base::queue_present(VkQueue queue, const VkPresentInfoKHR *pr
     if (result != VK_SUCCESS) {
         return result;
     }
+    m_swapchain_images[image_index].present_ns = monotonic_ns();
 
     /* If the descendant has started presenting, we should release the image
      * however we do not want to block inside the main thread so we mark it
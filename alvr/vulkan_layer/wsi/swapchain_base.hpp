@@ -30,6 +30,7 @@
 
 #pragma once
 
+#include <atomic>
 #include <pthread.h>
 #include <semaphore.h>
 #include <thread>
@@ -59,8 +60,13 @@ struct swapchain_image {
     VkFence present_fence{VK_NULL_HANDLE};
     VkSemaphore semaphore{VK_NULL_HANDLE};
     uint64_t semaphore_value = 0;
+    /* Binary semaphore, signaled along with semaphore when present sync files are enabled and
+     * exported as a sync_file once per present, which leaves it unsignaled. */
+    VkSemaphore sync_semaphore{VK_NULL_HANDLE};
 
     TrackedDevicePose_t pose;
+    /* CLOCK_MONOTONIC time of the present of the image */
+    uint64_t present_ns = 0;
 };
 
 /**
@@ -144,8 +150,11 @@ class swapchain_base {
 
     /**
      * @brief Whether the page flip thread has to continue running or terminate.
+     *
+     * Only ever changed to false, after which the page_flip_semaphore is posted to wake the
+     * thread up.
      */
-    bool m_page_flip_thread_run;
+    std::atomic<bool> m_page_flip_thread_run;
 
     /**
      * @brief In case we encounter threading or drm errors we need a way to
@@ -187,6 +196,13 @@ class swapchain_base {
      */
     bool m_first_present;
 
+    /**
+     * @brief Time from the present of the last image sent to the server, or from the start of the
+     * wait on it if later, until the GPU was seen done rendering it, 0 while unknown. Only used by
+     * the page flip thread.
+     */
+    uint64_t m_last_gpu_ns = 0;
+
     /**
      * @brief In order to present the images in a FIFO order we implement
      * a ring buffer to hold the images queued for presentation. Since the
@@ -308,8 +324,15 @@ class swapchain_base {
     virtual VkResult create_image(const VkImageCreateInfo &image_create_info,
                                   swapchain_image &image) = 0;
 
-
-    virtual void submit_image(uint32_t pending_index) = 0;
+    /**
+     * @brief Send a pending image to the server.
+     *
+     * @param pending_index Index of the pending image.
+     *
+     * @param sync_file The sync_file of the present, see export_sync_file, or -1. The
+     * implementation takes ownership of it.
+     */
+    virtual void submit_image(uint32_t pending_index, int sync_file) = 0;
 
     /**
      * @brief Method to present and image
@@ -328,6 +351,15 @@ class swapchain_base {
      */
     void unpresent_image(uint32_t presented_index);
 
+    /**
+     * @brief Export the sync_file of the last present of an image.
+     *
+     * Must be called once for each present of an image that has a sync_semaphore.
+     *
+     * @return The sync_file, or -1 if the image has no sync_semaphore or the export failed.
+     */
+    int export_sync_file(swapchain_image &image);
+
     /**
      * @brief Method to release a swapchain image
      *
@@ -355,8 +387,8 @@ class swapchain_base {
     /**
      * @brief A semaphore to be signalled once a free image becomes available.
      *
-     * Uses a custom semaphore implementation that uses a condition variable.
-     * it is slower, but has a safe timedwait implementation.
+     * Uses a custom semaphore implementation backed by an eventfd, which has a safe
+     * timedwait implementation.
      *
      * This is kept private as waiting should be done via wait_for_free_buffer().
      */
@@ -385,9 +417,26 @@ class swapchain_base {
      * logic splits into the above 3 cases and if an image has been
      * presented then the old one is marked as FREE and the free_image
      * semaphore of the swapchain will be posted.
+     *
+     * In mailbox mode, images that were queued before the newest one are
+     * released without being submitted.
      **/
     void page_flip_thread();
 
+    /**
+     * @brief Wait for the gpu to be done with the last present of an image.
+     *
+     * @param sync_file The sync_file of the present to sleep on before the fence wait, or -1.
+     */
+    VkResult wait_for_present(swapchain_image &image, int sync_file);
+
+    /**
+     * @brief Release a pending image that a newer one replaced, once the gpu is done with it.
+     *
+     * @param pending_index Index of the replaced image.
+     */
+    void drop_pending_image(uint32_t pending_index);
+
     uint32_t m_last_acquired_image = 0;
 
     std::vector<VkFence> m_fences;
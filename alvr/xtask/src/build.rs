@@ -136,7 +136,7 @@ pub fn build_streamer(
         };
 
         let profiling_flag = if profiling {
-            vec!["--features", "alvr_server_core/trace-performance"]
+            vec!["--features", "trace-performance"]
         } else {
             vec![]
         };
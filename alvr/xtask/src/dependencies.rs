@@ -224,7 +224,7 @@ pub fn build_ffmpeg_linux(enable_nvenc: bool, deps_path: &Path) {
 
     fs::rename(deps_path.join("FFmpeg-n8.1"), &final_path).unwrap();
 
-    let flags = [
+    let mut flags = vec![
         "--enable-gpl",
         "--enable-version3",
         "--enable-static",
@@ -249,6 +249,27 @@ pub fn build_ffmpeg_linux(enable_nvenc: bool, deps_path: &Path) {
         "--enable-rpath",
         "--fatal-warnings",
     ];
+    // Software encoders of HEVC and AV1, used from the system when installed. H.264 goes through
+    // the x264 built above.
+    if cmd!(sh, "pkg-config --exists x265").quiet().run().is_ok() {
+        flags.extend(["--enable-libx265", "--enable-encoder=libx265"]);
+    }
+    if cmd!(sh, "pkg-config --exists SvtAv1Enc")
+        .quiet()
+        .run()
+        .is_ok()
+    {
+        flags.extend(["--enable-libsvtav1", "--enable-encoder=libsvtav1"]);
+    }
+    // oneVPL encoders of Intel GPUs, an alternative to VAAPI on the same surfaces
+    if cmd!(sh, "pkg-config --exists vpl").quiet().run().is_ok() {
+        flags.extend([
+            "--enable-libvpl",
+            "--enable-encoder=h264_qsv",
+            "--enable-encoder=hevc_qsv",
+            "--enable-encoder=av1_qsv",
+        ]);
+    }
     let install_prefix = format!("--prefix={}", final_path.join("alvr_build").display());
     // The reason for 4x$ in LDSOFLAGS var refer to https://stackoverflow.com/a/71429999
     // all varients of --extra-ldsoflags='-Wl,-rpath,$ORIGIN' do not work! don't waste your time trying!